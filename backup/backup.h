@@ -278,6 +278,8 @@ struct backup_message {
     int chunk_id;
     off_t offset;
     size_t length;
+    off_t seek_offset;
+    size_t seek_pos;
 };
 
 int backup_get_message_id(struct backup *backup, const char *guid);
@@ -392,6 +394,19 @@ int backup_prepare_message_upload(struct backup *backup,
                                   struct sync_msgid_list *msgid_list,
                                   sync_msgid_lookup_func msgid_lookup,
                                   struct dlist **uploadp);
+
+/* batched, in file order, for large restores */
+struct backup_upload_iter;
+struct backup_upload_iter *backup_upload_iter_new(
+                                    struct backup *backup,
+                                    const char *partition,
+                                    struct sync_msgid_list *msgid_list,
+                                    sync_msgid_lookup_func msgid_lookup);
+int backup_upload_iter_next(struct backup_upload_iter *iter,
+                            size_t max_messages, size_t max_bytes,
+                            struct dlist **uploadp);
+void backup_upload_iter_free(struct backup_upload_iter **iterp);
+
 /* miscellaneous */
 int backup_reindex(const char *name,
                    enum backup_open_nonblock nonblock,
@@ -97,6 +97,7 @@ static void usage(void)
             "Options:\n"
             "    -C alt_config       # alternate config file\n"
             "    -F                  # force (run command even if not needed)\n"
+            "    -J jobs             # compact up to jobs backups at once\n"
             "    -S                  # stop on error\n"
             "    -V                  # don't verify checksums (faster read-only ops)\n"
             "    -j                  # output in JSON format\n"
@@ -160,6 +161,7 @@ struct ctlbu_cmd_options {
     int force;
     int noverify;
     int jsonout;
+    int jobs;
     const char *lock_exec_cmd;
     const char *domain;
 };
@@ -179,6 +181,12 @@ enum ctlbu_cmd {
 
 static int ctlbu_skips_fails = 0;
 
+/* child processes running parallel compactions (-J) */
+static int ctlbu_running_jobs = 0;
+static int ctlbu_failed_jobs = 0;
+
+static void compact_wait_jobs(int max_running);
+
 /* same signature as foreach_cb */
 static int cmd_compact_one(void *rock,
                            const char *userid, size_t userid_len,
@@ -350,7 +358,7 @@ int main(int argc, char **argv)
     struct ctlbu_cmd_options options = {0};
     options.wait = BACKUP_OPEN_NONBLOCK;
 
-    while ((opt = getopt(argc, argv, ":AC:DFPSVcfjmpst:x:uvw")) != EOF) {
+    while ((opt = getopt(argc, argv, ":AC:DFJ:PSVcfjmpst:x:uvw")) != EOF) {
         switch (opt) {
         case 'A':
             if (options.mode != CTLBU_MODE_UNSPECIFIED) usage();
@@ -366,6 +374,10 @@ int main(int argc, char **argv)
         case 'F':
             options.force = 1;
             break;
+        case 'J':
+            options.jobs = atoi(optarg);
+            if (options.jobs < 1) usage();
+            break;
         case 'P':
             if (options.mode != CTLBU_MODE_UNSPECIFIED) usage();
             options.mode = CTLBU_MODE_PREFIX;
@@ -438,6 +450,9 @@ int main(int argc, char **argv)
         && cmd != CTLBU_CMD_LOCK)
         usage();
 
+    if (options.jobs && cmd != CTLBU_CMD_COMPACT)
+        usage();
+
     switch (cmd) {
     /* list defaults to all */
     case CTLBU_CMD_LIST:
@@ -576,11 +591,38 @@ int main(int argc, char **argv)
         buf_free(&fname);
     }
 
+    compact_wait_jobs(0);
+
     backup_cleanup_staging_path();
     cyrus_done();
     exit(r || ctlbu_skips_fails ? EC_TEMPFAIL : EC_OK);
 }
 
+/* wait until no more than max_running compaction jobs are running */
+static void compact_wait_jobs(int max_running)
+{
+    while (ctlbu_running_jobs > max_running) {
+        int status;
+        pid_t pid = wait(&status);
+
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            ctlbu_running_jobs = 0;
+            break;
+        }
+
+        ctlbu_running_jobs--;
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EC_OK) {
+            ++ctlbu_skips_fails;
+
+            /* locked backups don't count as errors */
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != EC_TEMPFAIL)
+                ++ctlbu_failed_jobs;
+        }
+    }
+}
+
 static int cmd_compact_one(void *rock,
                            const char *key, size_t key_len,
                            const char *data, size_t data_len)
@@ -590,6 +632,43 @@ static int cmd_compact_one(void *rock,
     char *fname = NULL;
     int r = 0;
 
+    if (options->jobs > 1) {
+        pid_t pid;
+
+        compact_wait_jobs(options->jobs - 1);
+        if (options->stop_on_error && ctlbu_failed_jobs)
+            return IMAP_INTERNAL;
+
+        fflush(stdout);
+        pid = fork();
+
+        if (pid == -1) {
+            perror("fork");
+            return options->stop_on_error ? IMAP_SYS_ERROR : 0;
+        }
+
+        if (pid) {
+            /* parent: get on with the next one */
+            ctlbu_running_jobs++;
+            return 0;
+        }
+
+        /* child: compact this one, then report how it went */
+        if (key_len)
+            userid = xstrndup(key, key_len);
+        if (data_len)
+            fname = xstrndup(data, data_len);
+
+        r = backup_compact(fname, options->wait, options->force,
+                           options->verbose, stdout);
+
+        print_status("compact", userid, fname, options, r);
+        fflush(stdout);
+
+        _exit(r == 0 ? EC_OK :
+              r == IMAP_MAILBOX_LOCKED ? EC_TEMPFAIL : EC_SOFTWARE);
+    }
+
     /* input args might not be 0-terminated, so make a safe copy */
     if (key_len)
         userid = xstrndup(key, key_len);
@@ -45,6 +45,7 @@
 #include <syslog.h>
 
 #include "lib/exitcodes.h"
+#include "lib/libconfig.h"
 #include "lib/sqldb.h"
 #include "lib/xmalloc.h"
 #include "lib/xsha1.h"
@@ -109,6 +110,8 @@ HIDDEN int backup_real_append_start(struct backup *backup,
     if (index_only) backup->append_state->mode |= BACKUP_APPEND_INDEXONLY;
 
     backup->append_state->wrote = 0;
+    backup->append_state->seek_offset = 0;
+    backup->append_state->seek_pos = 0;
     SHA1_Init(&backup->append_state->sha_ctx);
 
     char header[80];
@@ -191,6 +194,25 @@ EXPORTED int backup_append(struct backup *backup,
     const int index_only = backup->append_state->mode & BACKUP_APPEND_INDEXONLY;
     int r;
 
+    /* start messages at a full flush point every so often, so that they
+     * can be read back without inflating the whole chunk up to them */
+    if (!index_only && !strcmp(dlist->name, "MESSAGE")) {
+        size_t interval = config_getint(IMAPOPT_BACKUP_SEEK_INTERVAL);
+
+        if (interval > 0 && backup->append_state->wrote
+                            - backup->append_state->seek_pos >= interval * 1024) {
+            r = gzflush(backup->append_state->gzfile, Z_FULL_FLUSH);
+            if (r != Z_OK) {
+                syslog(LOG_ERR, "IOERROR: %s gzflush %s: %i %i",
+                                __func__, backup->data_fname, r, errno);
+                goto error;
+            }
+
+            backup->append_state->seek_offset = lseek(backup->fd, 0, SEEK_END);
+            backup->append_state->seek_pos = backup->append_state->wrote;
+        }
+    }
+
     /* preload buffer with timestamp preamble */
     buf_printf(&buf, INT64_FMT " APPLY ", (int64_t) ts);
 
@@ -288,6 +310,7 @@ HIDDEN int backup_real_append_end(struct backup *backup, time_t ts)
     }
 
 done:
+    backup_index_end(backup);
     backup->append_state->mode = BACKUP_APPEND_INACTIVE;
     backup->append_state->wrote = 0;
 
@@ -308,6 +331,7 @@ EXPORTED int backup_append_abort(struct backup *backup)
         fatal("backup append not started", EC_SOFTWARE);
 
     sqldb_rollback(backup->db, "backup_append");
+    backup_index_end(backup);
 
     // FIXME
     // can we truncate back to the length we started this append at?
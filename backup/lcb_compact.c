@@ -45,9 +45,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <syslog.h>
+#include <sys/stat.h>
 
 #include "lib/gzuncat.h"
 #include "lib/libconfig.h"
+#include "lib/retry.h"
 
 #include "imap/imap_err.h"
 #include "imap/sync_support.h"
@@ -434,6 +436,127 @@ static int _keep_message_guids_cb(const struct backup_message *message,
     return 0;
 }
 
+static int dlist_nodes(const struct dlist *dl)
+{
+    const struct dlist *di;
+    int n = 1;
+
+    for (di = dl->head; di; di = di->next)
+        n += dlist_nodes(di);
+
+    return n;
+}
+
+static int compact_copy_data(struct backup *original, struct backup *compact,
+                             off_t start, off_t end)
+{
+    char buf[64 * 1024];
+
+    while (start < end) {
+        ssize_t n = pread(original->fd, buf,
+                          MIN((off_t) sizeof(buf), end - start), start);
+        if (n <= 0) {
+            syslog(LOG_ERR, "IOERROR: %s pread %s: %m",
+                            __func__, original->data_fname);
+            return -1;
+        }
+
+        if (retry_write(compact->fd, buf, n) != n) {
+            syslog(LOG_ERR, "IOERROR: %s write %s: %m",
+                            __func__, compact->data_fname);
+            return -1;
+        }
+
+        start += n;
+    }
+
+    return 0;
+}
+
+/* Copy a chunk whose every line is still wanted as-is into the compacted
+ * backup without decompressing and recompressing it: the compressed
+ * member is copied verbatim, and only the index is rebuilt.
+ *
+ * returns:
+ *   0 if the chunk was copied
+ *   1 if something in it has to go, so it needs rewriting
+ *   negative on error
+ */
+static int compact_copy_chunk(struct backup *original,
+                              struct backup *compact,
+                              const struct backup_chunk *chunk,
+                              struct gzuncat *gzuc,
+                              struct sync_msgid_list *keep_message_guids)
+{
+    char file_sha1[2 * SHA1_DIGEST_LENGTH + 1];
+    struct buf cmd = BUF_INITIALIZER;
+    struct protstream *in = NULL;
+    off_t offset, end = -1;
+    time_t ts = chunk->ts_start;
+    int r;
+
+    offset = lseek(compact->fd, 0, SEEK_END);
+    sha1_file(compact->fd, compact->data_fname, SHA1_LIMIT_WHOLE_FILE, file_sha1);
+
+    r = backup_real_append_start(compact, chunk->ts_start, offset, file_sha1,
+                                 1 /* index_only */, BACKUP_APPEND_NOFLUSH);
+    if (r) return -1;
+
+    gzuc_member_start_from(gzuc, chunk->offset);
+    in = prot_readcb(_prot_fill_cb, gzuc);
+
+    while (!r) {
+        struct dlist *dl = NULL;
+        int nodes;
+
+        int c = parse_backup_line(in, &ts, &cmd, &dl);
+
+        if (c == EOF) {
+            const char *error = prot_error(in);
+
+            /* let the rewrite deal with a damaged chunk */
+            if (error && 0 != strcmp(error, PROT_EOF_STRING)) r = 1;
+            break;
+        }
+
+        nodes = dlist_nodes(dl);
+        if (!want_append(original, chunk->id, dl, keep_message_guids)
+            || dlist_nodes(dl) != nodes) {
+            r = 1;
+        }
+        else if (backup_append(compact, dl, &ts, BACKUP_APPEND_NOFLUSH)) {
+            r = 1;
+        }
+
+        dlist_unlink_files(dl);
+        dlist_free(&dl);
+    }
+
+    prot_free(in);
+    buf_free(&cmd);
+
+    /* find where the compressed member ends */
+    if (gzuc_member_end(gzuc, &end) || end < 0) {
+        struct stat sbuf;
+
+        if (fstat(original->fd, &sbuf)) r = -1;
+        else end = sbuf.st_size;
+    }
+
+    /* make sure we'd be indexing exactly the data we copy */
+    if (!r && compact->append_state->wrote != chunk->length)
+        r = 1;
+
+    if (!r) r = compact_copy_data(original, compact, chunk->offset, end);
+
+    if (r) {
+        backup_append_abort(compact);
+        return r;
+    }
+
+    return backup_real_append_end(compact, chunk->ts_end) ? -1 : 0;
+}
+
 /* returns:
  *   0 on success
  *   1 if compact was not needed
@@ -508,6 +631,27 @@ EXPORTED int backup_compact(const char *name,
                                    _keep_message_guids_cb, keep_message_guids);
         if (r) goto error;
 
+        /* a chunk we're neither combining nor splitting might be reusable */
+        if (chunk_start_time == -1
+            && !want_combine(chunk->length, chunk->next)
+            && !want_split(chunk, NULL)) {
+            r = compact_copy_chunk(original, compact, chunk,
+                                   gzuc, keep_message_guids);
+            if (r < 0) goto error;
+
+            if (!r) {
+                if (verbose) {
+                    fprintf(out, "copying chunk %d unchanged\n", chunk->id);
+                }
+
+                sync_msgid_list_free(&keep_message_guids);
+                continue;
+            }
+
+            /* otherwise rewrite it as usual */
+            r = 0;
+        }
+
         gzuc_member_start_from(gzuc, chunk->offset);
 
         in = prot_readcb(_prot_fill_cb, gzuc);
@@ -823,6 +823,8 @@ static int _message_row_cb(sqlite3_stmt *stmt, void *rock)
     message->chunk_id = _column_int(stmt, column++);
     message->offset = _column_int64(stmt, column++);
     message->length = _column_int64(stmt, column++);
+    message->seek_offset = _column_int64(stmt, column++);
+    message->seek_pos = _column_int64(stmt, column++);
 
     message->guid = xzmalloc(sizeof *message->guid);
     if (!message_guid_decode(message->guid, guid_str)) goto error;
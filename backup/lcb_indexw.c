@@ -41,6 +41,8 @@
  *
  */
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
 #include <syslog.h>
 
 #include "lib/xmalloc.h"
@@ -71,6 +73,57 @@ static int _index_sub(struct backup *backup, struct dlist *dl,
 static int _index_sieve(struct backup *backup, struct dlist *dl,
                         time_t ts, off_t dl_offset);
 
+/* message ids assigned or looked up during the current chunk, so that
+ * MAILBOX records don't each need a query to find their message.  the
+ * index changes are only committed at the end of the chunk, so the cache
+ * must not outlive it.
+ */
+#define MESSAGE_ID_CACHE_MAX (64 * 1024)
+
+static void _message_id_cache_add(struct backup *backup,
+                                  const char *guid, int message_id)
+{
+    struct backup_append_state *append_state = backup->append_state;
+
+    if (append_state->n_message_ids >= MESSAGE_ID_CACHE_MAX)
+        backup_index_end(backup);
+
+    if (!append_state->message_ids.size)
+        construct_hash_table(&append_state->message_ids, 4096, 1);
+
+    hash_insert(guid, (void *) (intptr_t) message_id,
+                &append_state->message_ids);
+    append_state->n_message_ids++;
+}
+
+static int _message_id_lookup(struct backup *backup, const char *guid)
+{
+    struct backup_append_state *append_state = backup->append_state;
+    int message_id = 0;
+
+    if (append_state->message_ids.size)
+        message_id = (intptr_t) hash_lookup(guid, &append_state->message_ids);
+
+    if (!message_id) {
+        message_id = backup_get_message_id(backup, guid);
+        if (message_id > 0)
+            _message_id_cache_add(backup, guid, message_id);
+    }
+
+    return message_id;
+}
+
+HIDDEN void backup_index_end(struct backup *backup)
+{
+    struct backup_append_state *append_state = backup->append_state;
+
+    if (!append_state) return;
+
+    free_hash_table(&append_state->message_ids, NULL);
+    memset(&append_state->message_ids, 0, sizeof(append_state->message_ids));
+    append_state->n_message_ids = 0;
+}
+
 HIDDEN int backup_index(struct backup *backup, struct dlist *dlist,
                         time_t ts, off_t start, size_t len)
 {
@@ -206,6 +259,7 @@ static int _index_mailbox(struct backup *backup, struct dlist *dl,
     struct dlist *annotations = NULL;
     struct buf annotations_buf = BUF_INITIALIZER;
     struct dlist *record = NULL;
+    int mailbox_id = 0;
     int r;
 
     if (!dlist_getatom(dl, "UNIQUEID", &uniqueid))
@@ -288,6 +342,10 @@ static int _index_mailbox(struct backup *backup, struct dlist *dl,
             syslog(LOG_DEBUG, "%s: something went wrong: %i insert %s\n",
                               __func__, r, mboxname);
         }
+        else {
+            /* brand new mailbox, so its records will be too */
+            mailbox_id = sqldb_lastid(backup->db);
+        }
     }
     else if (r) {
         syslog(LOG_DEBUG, "%s: something went wrong: %i update %s\n",
@@ -299,9 +357,12 @@ static int _index_mailbox(struct backup *backup, struct dlist *dl,
     if (r) goto error;
 
     if (record->head) {
-        int mailbox_id = backup_get_mailbox_id(backup, uniqueid);
+        const int is_new_mailbox = (mailbox_id != 0);
         struct dlist *ki = NULL;
 
+        if (!is_new_mailbox)
+            mailbox_id = backup_get_mailbox_id(backup, uniqueid);
+
         for (ki = record->head; ki; ki = ki->next) {
             uint32_t uid = 0;
             modseq_t modseq = 0;
@@ -327,7 +388,7 @@ static int _index_mailbox(struct backup *backup, struct dlist *dl,
                 goto error;
 
             /* XXX should this search for guid+size rather than just guid? */
-            message_id = backup_get_message_id(backup, guid);
+            message_id = _message_id_lookup(backup, guid);
             if (message_id == -1) {
                 syslog(LOG_DEBUG, "%s: something went wrong: %i %s %s\n",
                                   __func__, r, mboxname, guid);
@@ -386,10 +447,13 @@ static int _index_mailbox(struct backup *backup, struct dlist *dl,
                 expunged_bval->val.i = expunged;
             }
 
-            r = sqldb_exec(backup->db, backup_index_mailbox_message_update_sql,
-                           record_bval, NULL, NULL);
+            /* don't bother looking for existing records in a new mailbox */
+            if (!is_new_mailbox) {
+                r = sqldb_exec(backup->db, backup_index_mailbox_message_update_sql,
+                               record_bval, NULL, NULL);
+            }
 
-            if (!r && sqldb_changes(backup->db) == 0) {
+            if (!r && (is_new_mailbox || sqldb_changes(backup->db) == 0)) {
                 r = sqldb_exec(backup->db, backup_index_mailbox_message_insert_sql,
                                record_bval, NULL, NULL);
                 if (r) {
@@ -461,29 +525,44 @@ static int _index_message(struct backup *backup, struct dlist *dl,
         if (!dlist_tofile(di, &partition, &guid, &size, NULL))
             continue;
 
+        const char *guid_str = message_guid_encode(guid);
         struct sqldb_bindval bval[] = {
-            { ":guid",      SQLITE_TEXT,    { .s = message_guid_encode(guid) } },
+            { ":guid",      SQLITE_TEXT,    { .s = guid_str  } },
             { ":partition", SQLITE_TEXT,    { .s = partition } },
             { ":chunk_id",  SQLITE_INTEGER, { .i = backup->append_state->chunk_id } },
             { ":offset",    SQLITE_INTEGER, { .i = dl_offset } },
             { ":size",      SQLITE_INTEGER, { .i = size      } },
+            { ":seek_offset", SQLITE_NULL,  { .s = NULL      } },
+            { ":seek_pos",  SQLITE_NULL,    { .s = NULL      } },
             { NULL,         SQLITE_NULL,    { .s = NULL      } },
         };
 
-        r = sqldb_exec(backup->db, backup_index_message_update_sql, bval, NULL,
-                       NULL);
+        /* n.b. index-only appends never have a seek point */
+        if (backup->append_state->seek_offset) {
+            bval[5].type = SQLITE_INTEGER;
+            bval[5].val.i = backup->append_state->seek_offset;
+            bval[6].type = SQLITE_INTEGER;
+            bval[6].val.i = backup->append_state->seek_pos;
+        }
+
+        r = sqldb_exec(backup->db, backup_index_message_insert_sql, bval,
+                       NULL, NULL);
 
         if (!r && sqldb_changes(backup->db) == 0) {
-            r = sqldb_exec(backup->db, backup_index_message_insert_sql, bval,
+            /* already known, so it's been seen again: update its location */
+            r = sqldb_exec(backup->db, backup_index_message_update_sql, bval,
                            NULL, NULL);
             if (r) {
-                syslog(LOG_DEBUG, "%s: something went wrong: %i insert message %s\n",
-                       __func__, r, message_guid_encode(guid));
+                syslog(LOG_DEBUG, "%s: something went wrong: %i update message %s\n",
+                       __func__, r, guid_str);
             }
         }
-        else if (r) {
-            syslog(LOG_DEBUG, "%s: something went wrong: %i update message %s\n",
-                   __func__, r, message_guid_encode(guid));
+        else if (!r) {
+            _message_id_cache_add(backup, guid_str, sqldb_lastid(backup->db));
+        }
+        else {
+            syslog(LOG_DEBUG, "%s: something went wrong: %i insert message %s\n",
+                   __func__, r, guid_str);
         }
     }
 
@@ -41,6 +41,7 @@
  *
  */
 
+#include "lib/hash.h"
 #include "lib/sqldb.h"
 #include "lib/xsha1.h"
 
@@ -64,6 +65,10 @@ struct backup_append_state {
     int chunk_id;
     size_t wrote;
     SHA_CTX sha_ctx;
+    off_t seek_offset;  /* file offset of most recent full flush, or 0 */
+    size_t seek_pos;    /* ...and its uncompressed position in the chunk */
+    hash_table message_ids; /* guid -> message.id, for this chunk only */
+    size_t n_message_ids;
 };
 
 struct backup {
@@ -97,6 +102,7 @@ int backup_real_append_end(struct backup *backup, time_t ts);
 
 HIDDEN int backup_index(struct backup *backup, struct dlist *dlist,
                         time_t ts, off_t start, size_t len);
+HIDDEN void backup_index_end(struct backup *backup);
 
 /* parsing data from backup data stream files */
 int parse_backup_line(struct protstream *in, time_t *ts,
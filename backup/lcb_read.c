@@ -41,7 +41,9 @@
  *
  */
 #include <assert.h>
+#include <fcntl.h>
 #include <syslog.h>
+#include <unistd.h>
 
 #include "lib/gzuncat.h"
 #include "lib/map.h"
@@ -108,16 +110,28 @@ EXPORTED int backup_read_message_data(struct backup *backup,
 
     gzuc = gzuc_new(backup->fd);
 
-    gzuc_member_start_from(gzuc, chunk->offset);
-    r = gzuc_seekto(gzuc, message->offset);
-    if (r) return r;
+    /* if the message was written after a seek point, start inflating from
+     * there, rather than from the start of the chunk */
+    if (message->seek_offset > chunk->offset
+        && (size_t) message->offset >= message->seek_pos)
+        r = gzuc_member_start_at(gzuc, chunk->offset,
+                                 message->seek_offset, message->seek_pos);
+    else
+        r = gzuc_member_start_from(gzuc, chunk->offset);
+    if (!r) r = gzuc_seekto(gzuc, message->offset);
+    if (r) {
+        gzuc_free(&gzuc);
+        backup_chunk_free(&chunk);
+        return r;
+    }
 
     struct protstream *ps = prot_readcb(_prot_fill_cb, gzuc);
     prot_setisclient(ps, 1); /* don't sync literals */
     r = parse_backup_line(ps, NULL, NULL, &dl);
     prot_free(ps);
 
-    gzuc_member_end(gzuc, NULL);
+    /* n.b. no need to gzuc_member_end(), which would inflate the rest of
+     * the chunk just to find where the next one starts */
     gzuc_free(&gzuc);
 
     for (di = dl->head; di; di = di->next) {
@@ -154,33 +168,76 @@ EXPORTED int backup_read_message_data(struct backup *backup,
     return r;
 }
 
+struct upload_item {
+    struct message_guid guid;
+    int chunk_id;
+    off_t chunk_offset;
+    off_t offset;
+    off_t seek_offset;
+    size_t seek_pos;
+};
+
+struct backup_upload_iter {
+    char *data_fname;
+    int fd;
+    char *partition;
+    struct sync_msgid_list *msgid_list;
+    sync_msgid_lookup_func msgid_lookup;
+    struct upload_item *items;
+    size_t n_items;
+    size_t next_item;
+    int chunk_id;               /* chunk currently open for reading, or 0 */
+    struct gzuncat *gzuc;
+    struct protstream *ps;
+};
+
+static int _upload_item_cmp(const void *a, const void *b)
+{
+    const struct upload_item *ia = (const struct upload_item *) a;
+    const struct upload_item *ib = (const struct upload_item *) b;
+
+    if (ia->chunk_id != ib->chunk_id)
+        return ia->chunk_id < ib->chunk_id ? -1 : 1;
+    if (ia->offset != ib->offset)
+        return ia->offset < ib->offset ? -1 : 1;
+    return 0;
+}
+
 /* we can't link against imap/sync_support.c within the backup library,
  * so we need this nasty workaround where the caller provides a
  * pointer to sync_msgid_lookup for us to use.
+ *
+ * looks up the location of every message in msgid_list that still needs
+ * uploading, up front, so that they can then be read in file order.  the
+ * iterator reads through its own file descriptor and never touches the
+ * index again, so once created it can be handed to a forked child.
  */
-EXPORTED int backup_prepare_message_upload(struct backup *backup,
-                                           const char *partition,
-                                           struct sync_msgid_list *msgid_list,
-                                           sync_msgid_lookup_func msgid_lookup,
-                                           struct dlist **uploadp)
+EXPORTED struct backup_upload_iter *backup_upload_iter_new(
+                                        struct backup *backup,
+                                        const char *partition,
+                                        struct sync_msgid_list *msgid_list,
+                                        sync_msgid_lookup_func msgid_lookup)
 {
-    struct dlist *upload = NULL;
+    struct backup_upload_iter *iter = NULL;
     struct sync_msgid *msgid = NULL;
-    struct gzuncat *gzuc = NULL;
-    int r;
-
-    /* nothing to do */
-    if (!uploadp) return 0;
+    size_t alloc = 0;
+    size_t i;
 
-    upload = dlist_newlist(NULL, "MESSAGE");
+    int fd = open(backup->data_fname, O_RDONLY);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: open %s: %m", backup->data_fname);
+        return NULL;
+    }
 
-    gzuc = gzuc_new(backup->fd);
+    iter = xzmalloc(sizeof *iter);
+    iter->data_fname = xstrdup(backup->data_fname);
+    iter->fd = fd;
+    iter->partition = xstrdup(partition);
+    iter->msgid_list = msgid_list;
+    iter->msgid_lookup = msgid_lookup;
 
     for (msgid = msgid_list->head; msgid; msgid = msgid->next) {
         struct backup_message *message = NULL;
-        struct backup_chunk *chunk = NULL;
-        struct dlist *dl = NULL;
-        struct dlist *di, *next;
 
         /* already uploaded */
         if (!msgid->need_upload) continue;
@@ -191,32 +248,149 @@ EXPORTED int backup_prepare_message_upload(struct backup *backup,
                    __func__,
                    message_guid_encode(&msgid->guid),
                    backup->data_fname);
-            goto next_msgid;
+            continue;
+        }
+
+        if (iter->n_items == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            iter->items = xrealloc(iter->items, alloc * sizeof(*iter->items));
+        }
+
+        struct upload_item *item = &iter->items[iter->n_items++];
+        memset(item, 0, sizeof(*item));
+        message_guid_copy(&item->guid, message->guid);
+        item->chunk_id = message->chunk_id;
+        item->offset = message->offset;
+        item->seek_offset = message->seek_offset;
+        item->seek_pos = message->seek_pos;
+
+        backup_message_free(&message);
+    }
+
+    /* read in file order, so each chunk is inflated at most once */
+    qsort(iter->items, iter->n_items, sizeof(*iter->items), _upload_item_cmp);
+
+    struct backup_chunk *chunk = NULL;
+    for (i = 0; i < iter->n_items; i++) {
+        struct upload_item *item = &iter->items[i];
+
+        if (!chunk || chunk->id != item->chunk_id) {
+            if (chunk) backup_chunk_free(&chunk);
+            chunk = backup_get_chunk(backup, item->chunk_id);
+        }
+
+        /* -1 if the chunk is missing, see _upload_iter_seek() */
+        item->chunk_offset = chunk ? chunk->offset : -1;
+    }
+    if (chunk) backup_chunk_free(&chunk);
+
+    return iter;
+}
+
+static void _upload_iter_close_chunk(struct backup_upload_iter *iter)
+{
+    if (iter->ps) prot_free(iter->ps);
+    iter->ps = NULL;
+    if (iter->gzuc) gzuc_free(&iter->gzuc);
+    iter->chunk_id = 0;
+}
+
+/* position the iterator's stream at the start of the item's backup line */
+static int _upload_iter_seek(struct backup_upload_iter *iter,
+                             const struct upload_item *item)
+{
+    int r;
+
+    if (iter->chunk_id == item->chunk_id) {
+        /* uncompressed position of the next unread byte in the chunk */
+        size_t pos = gzuc_member_bytes_read(iter->gzuc) - iter->ps->cnt;
+
+        /* skip forward, unless there's a seek point in between to use */
+        if ((size_t) item->offset >= pos
+            && !(item->seek_offset && item->seek_pos > pos)) {
+            size_t left = item->offset - pos;
+
+            while (left) {
+                char discard[16 * 1024];
+                int n = prot_read(iter->ps, discard,
+                                  MIN(left, sizeof(discard)));
+                if (n <= 0) return IMAP_IOERROR;
+                left -= n;
+            }
+
+            return 0;
         }
+    }
+
+    _upload_iter_close_chunk(iter);
+
+    if (item->chunk_offset < 0) return IMAP_IOERROR;
+
+    iter->gzuc = gzuc_new(iter->fd);
+
+    if (item->seek_offset > item->chunk_offset
+        && (size_t) item->offset >= item->seek_pos)
+        r = gzuc_member_start_at(iter->gzuc, item->chunk_offset,
+                                 item->seek_offset, item->seek_pos);
+    else
+        r = gzuc_member_start_from(iter->gzuc, item->chunk_offset);
+    if (!r) r = gzuc_seekto(iter->gzuc, item->offset);
+    if (r) {
+        gzuc_free(&iter->gzuc);
+        return IMAP_IOERROR;
+    }
 
-        chunk = backup_get_chunk(backup, message->chunk_id);
-        if (!chunk) goto next_msgid;
+    iter->ps = prot_readcb(_prot_fill_cb, iter->gzuc);
+    prot_setisclient(iter->ps, 1); /* don't sync literals */
+    iter->chunk_id = item->chunk_id;
+
+    return 0;
+}
+
+/* fill *uploadp with the next batch of messages to upload, stopping once
+ * it holds at least max_messages messages or max_bytes bytes (zero means
+ * no limit).  when everything has been read, returns an empty list.
+ */
+EXPORTED int backup_upload_iter_next(struct backup_upload_iter *iter,
+                                     size_t max_messages, size_t max_bytes,
+                                     struct dlist **uploadp)
+{
+    struct dlist *upload = NULL;
+    size_t n_messages = 0, n_bytes = 0;
+
+    /* nothing to do */
+    if (!uploadp) return 0;
+
+    upload = dlist_newlist(NULL, "MESSAGE");
+
+    while (iter->next_item < iter->n_items
+           && (!max_messages || n_messages < max_messages)
+           && (!max_bytes || n_bytes < max_bytes)) {
+        const struct upload_item *item = &iter->items[iter->next_item++];
+        struct sync_msgid *msgid = NULL;
+        struct dlist *dl = NULL;
+        struct dlist *di, *next;
+        int r;
+
+        /* already uploaded, maybe picked up from an earlier line */
+        msgid = iter->msgid_lookup(iter->msgid_list, &item->guid);
+        if (!msgid || !msgid->need_upload) continue;
 
         /* read message contents from backup */
-        gzuc_member_start_from(gzuc, chunk->offset);
-        r = gzuc_seekto(gzuc, message->offset);
+        r = _upload_iter_seek(iter, item);
         if (!r) {
-            struct protstream *ps = prot_readcb(_prot_fill_cb, gzuc);
-            int c;
-            prot_setisclient(ps, 1); /* don't sync literals */
-            c = parse_backup_line(ps, NULL, NULL, &dl);
-            prot_free(ps);
-            ps = NULL;
-            if (c == EOF) {
-                syslog(LOG_ERR, "IOERROR: couldn't parse message %s from chunk %d of backup %s",
-                       message_guid_encode(&msgid->guid),
-                       chunk->id,
-                       backup->data_fname);
-                r = IMAP_IOERROR;
-            }
+            int c = parse_backup_line(iter->ps, NULL, NULL, &dl);
+            if (c == EOF) r = IMAP_IOERROR;
+        }
+        if (r) {
+            syslog(LOG_ERR, "IOERROR: couldn't parse message %s from chunk %d of backup %s",
+                   message_guid_encode(&item->guid),
+                   item->chunk_id,
+                   iter->data_fname);
+            /* start afresh for the next one */
+            _upload_iter_close_chunk(iter);
+            goto next_item;
         }
-        gzuc_member_end(gzuc, NULL);
-        if (r) goto next_msgid;
 
         /* A single backup line contains many messages, so process
          * them all while they're already decompressed.
@@ -226,14 +400,15 @@ EXPORTED int backup_prepare_message_upload(struct backup *backup,
         while ((di = next)) {
             struct message_guid *guid = NULL;
             struct sync_msgid *found_msgid = NULL;
+            unsigned long size = 0;
 
             next = di->next;
 
-            if (!dlist_tofile(di, NULL, &guid, NULL, NULL))
+            if (!dlist_tofile(di, NULL, &guid, &size, NULL))
                 continue;
 
-            found_msgid = msgid_lookup(msgid_list, guid);
-            if (!found_msgid)
+            found_msgid = iter->msgid_lookup(iter->msgid_list, guid);
+            if (!found_msgid || !found_msgid->need_upload)
                 continue;
 
             /* found one we want, move to upload list */
@@ -242,25 +417,59 @@ EXPORTED int backup_prepare_message_upload(struct backup *backup,
 
             /* set the destination partition */
             if (di->part) free(di->part);
-            di->part = xstrdup(partition);
+            di->part = xstrdup(iter->partition);
 
             /* flag that we're sending it */
             found_msgid->need_upload = 0;
-            msgid_list->toupload--;
+            iter->msgid_list->toupload--;
+
+            n_messages++;
+            n_bytes += size;
         }
 
-next_msgid:
+next_item:
         if (dl) {
             dlist_unlink_files(dl);
             dlist_free(&dl);
         }
-
-        if (chunk) backup_chunk_free(&chunk);
-        if (message) backup_message_free(&message);
     }
 
-    if (gzuc) gzuc_free(&gzuc);
-
     *uploadp = upload;
     return 0;
 }
+
+EXPORTED void backup_upload_iter_free(struct backup_upload_iter **iterp)
+{
+    struct backup_upload_iter *iter = *iterp;
+    *iterp = NULL;
+
+    if (!iter) return;
+
+    _upload_iter_close_chunk(iter);
+    close(iter->fd);
+    free(iter->items);
+    free(iter->partition);
+    free(iter->data_fname);
+    free(iter);
+}
+
+EXPORTED int backup_prepare_message_upload(struct backup *backup,
+                                           const char *partition,
+                                           struct sync_msgid_list *msgid_list,
+                                           sync_msgid_lookup_func msgid_lookup,
+                                           struct dlist **uploadp)
+{
+    struct backup_upload_iter *iter = NULL;
+    int r;
+
+    /* nothing to do */
+    if (!uploadp) return 0;
+
+    iter = backup_upload_iter_new(backup, partition, msgid_list, msgid_lookup);
+    if (!iter) return IMAP_IOERROR;
+
+    r = backup_upload_iter_next(iter, 0, 0, uploadp);
+
+    backup_upload_iter_free(&iter);
+    return r;
+}
@@ -48,7 +48,7 @@
  */
 #define QUOTE(...) #__VA_ARGS__
 
-const int backup_index_version = 3;
+const int backup_index_version = 5;
 
 const char backup_index_initsql[] = QUOTE(
     CREATE TABLE chunk(
@@ -67,7 +67,9 @@ const char backup_index_initsql[] = QUOTE(
         partition CHAR,
         chunk_id INTEGER REFERENCES chunk(id),
         offset INTEGER,
-        size INTEGER
+        size INTEGER,
+        seek_offset INTEGER,
+        seek_pos INTEGER
     );
     CREATE INDEX IF NOT EXISTS idx_msg_guid ON message(guid);
 
@@ -167,8 +169,9 @@ const char backup_index_upgrade_v3[] = QUOTE(
     CREATE INDEX IF NOT EXISTS idx_seen_unq ON seen(uniqueid);
 );
 
+/* n.b. v3 databases created fresh already have this table */
 const char backup_index_upgrade_v4[] = QUOTE(
-    CREATE TABLE sieve(
+    CREATE TABLE IF NOT EXISTS sieve(
         id INTEGER PRIMARY KEY ASC,
         chunk_id INTEGER NOT NULL REFERENCES chunk(id),
         last_update INTEGER,
@@ -180,10 +183,16 @@ const char backup_index_upgrade_v4[] = QUOTE(
     CREATE INDEX IF NOT EXISTS idx_siv_fn ON sieve(filename);
 );
 
+const char backup_index_upgrade_v5[] = QUOTE(
+    ALTER TABLE message ADD COLUMN seek_offset INTEGER;
+    ALTER TABLE message ADD COLUMN seek_pos INTEGER;
+);
+
 const struct sqldb_upgrade backup_index_upgrade[] = {
     { 2, backup_index_upgrade_v2, NULL },
     { 3, backup_index_upgrade_v3, NULL },
     { 4, backup_index_upgrade_v4, NULL },
+    { 5, backup_index_upgrade_v5, NULL },
     { 0, NULL, NULL } /* leave me last */
 };
 
@@ -445,21 +454,25 @@ const char backup_index_message_update_sql[] = QUOTE(
         partition = :partition,
         chunk_id = :chunk_id,
         offset = :offset,
-        size = :size
+        size = :size,
+        seek_offset = :seek_offset,
+        seek_pos = :seek_pos
     WHERE guid = :guid;
 );
 
+/* n.b. tried before the update, since new messages are the common case */
 const char backup_index_message_insert_sql[] = QUOTE(
-    INSERT INTO message (
-        guid, partition, chunk_id, offset, size
+    INSERT OR IGNORE INTO message (
+        guid, partition, chunk_id, offset, size, seek_offset, seek_pos
     )
     VALUES (
-        :guid, :partition, :chunk_id, :offset, :size
+        :guid, :partition, :chunk_id, :offset, :size, :seek_offset, :seek_pos
     );
 );
 
 #define MESSAGE_SELECT_FIELDS QUOTE(                    \
-    m.id, guid, partition, chunk_id, offset, size       \
+    m.id, guid, partition, chunk_id, offset, size,      \
+    seek_offset, seek_pos                               \
 )
 
 const char backup_index_message_select_all_sql[] =
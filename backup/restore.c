@@ -48,9 +48,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "lib/exitcodes.h"
+#include "lib/ptrarray.h"
 
 #include "imap/global.h"
 #include "imap/imap_err.h"
@@ -86,6 +88,7 @@ static void usage(void)
             "    -U                  # try to preserve uniqueid, uid, modseq, etc\n"
             "    -X                  # don't restore expunged messages\n"
             "    -a                  # try to restore all mailboxes in backup\n"
+            "    -j jobs             # restore over this many parallel connections\n"
             "    -n                  # calculate work required but don't perform restoration\n"
             "    -r                  # recurse into submailboxes\n"
             "    -v                  # verbose (repeat for more verbosity)\n"
@@ -138,6 +141,7 @@ struct restore_options {
     const char *override_partition;
     enum restore_expunged_mode expunged_mode;
     int do_submailboxes;
+    int jobs;
     int keep_uidvalidity;
     int require_compression;
     int trim_deletedprefix;
@@ -146,6 +150,18 @@ struct restore_options {
 
 #define HEX_DIGITS "0123456789abcdefghijklmnopqrstuvwxyz"
 
+/* upload in large-ish blocks, but not so large as to risk timeouts */
+#define RESTORE_BATCH_MESSAGES  (8192)
+#define RESTORE_BATCH_BYTES     (64 * 1024 * 1024)
+
+/* the share of the work done over a single connection */
+struct restore_job {
+    struct backup_mailbox_list mailbox_list;
+    struct sync_reserve_list *reserve_list;
+    ptrarray_t upload_iters; /* one per reserve_list partition */
+    pid_t pid;
+};
+
 static int restore_add_object(const char *object_name,
                               const struct restore_options *options,
                               struct backup *backup,
@@ -171,6 +187,16 @@ static struct backend *restore_connect(const char *servername,
                                        struct buf *tagbuf,
                                        const struct restore_options *options);
 
+static void restore_split_jobs(struct backup_mailbox_list *mailbox_list,
+                               struct restore_job *jobs, int n_jobs);
+static int restore_run_job(struct restore_job *job,
+                           const char *servername,
+                           struct sync_folder_list *reserve_folder_list,
+                           int local_only,
+                           const struct restore_options *options);
+static int restore_wait_jobs(struct restore_job *jobs, int n_jobs);
+static void restore_job_fini(struct restore_job *job);
+
 int main(int argc, char **argv)
 {
     save_argv0(argv[0]);
@@ -187,6 +213,7 @@ int main(int argc, char **argv)
 
     struct restore_options options = {0};
     options.expunged_mode = RESTORE_EXPUNGED_OKAY;
+    options.jobs = 1;
     options.trim_deletedprefix = 1;
 
     struct backup *backup = NULL;
@@ -194,12 +221,11 @@ int main(int argc, char **argv)
     struct backup_mailbox_list *mailbox_list = NULL;
     struct sync_folder_list *reserve_folder_list = NULL;
     struct sync_reserve_list *reserve_list = NULL;
-    struct buf tagbuf = BUF_INITIALIZER;
-    struct backend *backend = NULL;
-    struct dlist *upload = NULL;
-    int opt, r;
+    struct restore_job *jobs = NULL;
+    int n_jobs = 0, jobs_failed = 0;
+    int i, opt, r;
 
-    while ((opt = getopt(argc, argv, ":A:C:DF:LM:P:UXaf:m:nru:vw:xz")) != EOF) {
+    while ((opt = getopt(argc, argv, ":A:C:DF:LM:P:UXaf:j:m:nru:vw:xz")) != EOF) {
         switch (opt) {
         case 'A':
             if (options.keep_uidvalidity) usage();
@@ -245,6 +271,10 @@ int main(int argc, char **argv)
             mode = RESTORE_MODE_FILENAME;
             backup_name = optarg;
             break;
+        case 'j':
+            options.jobs = atoi(optarg);
+            if (options.jobs < 1) usage();
+            break;
         case 'm':
             if (mode != RESTORE_MODE_UNSPECIFIED) usage();
             mode = RESTORE_MODE_MBOXNAME;
@@ -396,8 +426,6 @@ int main(int argc, char **argv)
         free(all_mailboxes);
     }
     else {
-        int i;
-
         for (i = optind; i < argc; i++) {
             r = restore_add_object(argv[i], &options, backup, mailbox_list,
                                    reserve_folder_list, reserve_list);
@@ -412,72 +440,68 @@ int main(int argc, char **argv)
         goto done;
     }
 
-    /* connect to destination */
-    backend = restore_connect(servername, &tagbuf, &options);
-
-    if (!backend) {
-        // FIXME
-        r = -1;
-        goto done;
+    /* share the mailboxes out between the connections */
+    n_jobs = options.jobs;
+    jobs = xzmalloc(n_jobs * sizeof(*jobs));
+    if (n_jobs == 1) {
+        jobs[0].mailbox_list = *mailbox_list;
+        memset(mailbox_list, 0, sizeof(*mailbox_list));
+        jobs[0].reserve_list = reserve_list;
+        reserve_list = NULL;
     }
-
-    /* do the restore */
-    struct sync_reserve *reserve;
-    for (reserve = reserve_list->head; reserve; reserve = reserve->next) {
-        /* send APPLY RESERVE and parse missing lists */
-        r = sync_reserve_partition(reserve->part,
-                                   reserve_folder_list,
-                                   reserve->list,
-                                   backend);
-        if (r) goto done;
-
-        /* send APPLY MESSAGEs */
-        r = backup_prepare_message_upload(backup,
-                                          reserve->part,
-                                          reserve->list,
-                                          &sync_msgid_lookup,
-                                          &upload);
-        if (r) goto done;
-        /* upload in small(ish) blocks to avoid timeouts */
-        while (upload->head) {
-            struct dlist *block = dlist_splice(upload, 1024);
-            sync_send_apply(block, backend->out);
-            r = sync_parse_response("MESSAGE", backend->in, NULL);
-            dlist_unlink_files(block);
-            dlist_free(&block);
-            if (r) goto done;
-        }
+    else {
+        restore_split_jobs(mailbox_list, jobs, n_jobs);
     }
 
-    /* sync_prepare_dlists needs to upload messages per-mailbox, because
-     * it needs the mailbox to find the filename for the message.  but
-     * we have no such limitation, so we can upload messages while
-     * looping over the reserve_list instead, above.
-     *
-     * alternatively, if we do it on a per-mailbox basis then we can limit
-     * the hit on the staging directory to only a mailbox worth of messages
-     * at a time.  but we don't have a logical grouping that would make
-     * this coherent
+    /* find where all the messages are while we still have the index to
+     * ourselves -- once the jobs are running they only read the data file
      */
+    for (i = 0; i < n_jobs; i++) {
+        struct sync_reserve *reserve;
+
+        for (reserve = jobs[i].reserve_list->head; reserve; reserve = reserve->next) {
+            struct backup_upload_iter *iter =
+                backup_upload_iter_new(backup, reserve->part, reserve->list,
+                                       &sync_msgid_lookup);
+            if (!iter) {
+                r = IMAP_IOERROR;
+                goto done;
+            }
+            ptrarray_append(&jobs[i].upload_iters, iter);
+        }
+    }
 
-    /* send RESTORE MAILBOXes */
-    struct backup_mailbox *mailbox;
-    for (mailbox = mailbox_list->head; mailbox; mailbox = mailbox->next) {
-        /* XXX filter the mailbox records based on reserve/missing/upload */
-
-        /* XXX does this sensibly handle mailbox objs with empty values? */
-        struct dlist *dl = backup_mailbox_to_dlist(mailbox);
-        if (!dl) continue;
-
-        if (local_only) {
-            free(dl->name);
-            dl->name = xstrdup("LOCAL_MAILBOX");
+    /* do the restore */
+    if (n_jobs == 1) {
+        r = restore_run_job(&jobs[0], servername, reserve_folder_list,
+                            local_only, &options);
+    }
+    else {
+        /* n.b. we keep the backup open (and locked) until they're done */
+        for (i = 0; i < n_jobs; i++) {
+            jobs[i].pid = fork();
+
+            if (jobs[i].pid == 0) {
+                r = restore_run_job(&jobs[i], servername, reserve_folder_list,
+                                    local_only, &options);
+                if (r)
+                    fprintf(stderr, "%s: job %d: %s\n",
+                            backup_name, i, error_message(r));
+                backup_cleanup_staging_path();
+                _exit(r ? EC_TEMPFAIL : EC_OK);
+            }
+            else if (jobs[i].pid < 0) {
+                syslog(LOG_ERR, "IOERROR: fork: %m");
+                r = IMAP_SYS_ERROR;
+                break;
+            }
         }
 
-        sync_send_restore(dl, backend->out);
-        r = sync_parse_response("MAILBOX", backend->in, NULL);
-        dlist_free(&dl);
-        if (r) goto done;
+        /* n.b. the failed jobs have already reported why */
+        jobs_failed = restore_wait_jobs(jobs, n_jobs);
+        if (jobs_failed)
+            fprintf(stderr, "%s: %d of %d restore jobs failed\n",
+                    backup_name, jobs_failed, n_jobs);
     }
 
 done:
@@ -488,12 +512,10 @@ done:
     if (backup)
         backup_close(&backup);
 
-    if (backend)
-        backend_disconnect(backend);
-
-    if (upload) {
-        dlist_unlink_files(upload);
-        dlist_free(&upload);
+    if (jobs) {
+        for (i = 0; i < n_jobs; i++)
+            restore_job_fini(&jobs[i]);
+        free(jobs);
     }
 
     if (mailbox_list) {
@@ -507,12 +529,10 @@ done:
     if (reserve_list)
         sync_reserve_list_free(&reserve_list);
 
-    buf_free(&tagbuf);
-
     backup_cleanup_staging_path();
     cyrus_done();
 
-    exit(r ? EC_TEMPFAIL : EC_OK);
+    exit(r || jobs_failed ? EC_TEMPFAIL : EC_OK);
 }
 
 static struct backend *restore_connect(const char *servername,
@@ -606,6 +626,203 @@ static struct backend *restore_connect(const char *servername,
     return backend;
 }
 
+/* balance the mailboxes between the jobs by message count.  a message that's
+ * in mailboxes belonging to different jobs will be uploaded by each of them.
+ */
+static void restore_split_jobs(struct backup_mailbox_list *mailbox_list,
+                               struct restore_job *jobs, int n_jobs)
+{
+    struct backup_mailbox *mailbox, *next;
+    size_t *load = xzmalloc(n_jobs * sizeof(*load));
+    int i;
+
+    for (i = 0; i < n_jobs; i++)
+        jobs[i].reserve_list = sync_reserve_list_create(SYNC_MSGID_LIST_HASH_SIZE);
+
+    for (mailbox = mailbox_list->head; mailbox; mailbox = next) {
+        int best = 0;
+
+        next = mailbox->next;
+
+        for (i = 1; i < n_jobs; i++) {
+            if (load[i] < load[best]) best = i;
+        }
+
+        if (mailbox->records) {
+            struct sync_msgid_list *msgid_list = NULL;
+            struct backup_mailbox_message *record = NULL;
+
+            msgid_list = sync_reserve_partlist(jobs[best].reserve_list,
+                                               mailbox->partition);
+            for (record = mailbox->records->head; record; record = record->next) {
+                sync_msgid_insert(msgid_list, &record->guid);
+            }
+
+            load[best] += mailbox->records->count;
+        }
+        load[best]++;
+
+        backup_mailbox_list_add(&jobs[best].mailbox_list, mailbox);
+    }
+
+    memset(mailbox_list, 0, sizeof(*mailbox_list));
+    free(load);
+}
+
+static int restore_upload_messages(struct backup_upload_iter *iter,
+                                   struct backend *backend)
+{
+    struct dlist *upload = NULL, *next = NULL;
+    int r;
+
+    r = backup_upload_iter_next(iter, RESTORE_BATCH_MESSAGES,
+                                RESTORE_BATCH_BYTES, &upload);
+
+    while (!r && upload->head) {
+        int r2;
+
+        sync_send_apply(upload, backend->out);
+
+        /* read the next block out of the backup while the server
+         * is busy with this one */
+        r = backup_upload_iter_next(iter, RESTORE_BATCH_MESSAGES,
+                                    RESTORE_BATCH_BYTES, &next);
+
+        r2 = sync_parse_response("MESSAGE", backend->in, NULL);
+        if (!r) r = r2;
+
+        dlist_unlink_files(upload);
+        dlist_free(&upload);
+        upload = next;
+        next = NULL;
+    }
+
+    if (upload) {
+        dlist_unlink_files(upload);
+        dlist_free(&upload);
+    }
+    if (next) {
+        dlist_unlink_files(next);
+        dlist_free(&next);
+    }
+
+    return r;
+}
+
+static int restore_run_job(struct restore_job *job,
+                           const char *servername,
+                           struct sync_folder_list *reserve_folder_list,
+                           int local_only,
+                           const struct restore_options *options)
+{
+    struct buf tagbuf = BUF_INITIALIZER;
+    struct backend *backend = NULL;
+    struct sync_reserve *reserve;
+    int i, r = 0;
+
+    /* connect to destination */
+    backend = restore_connect(servername, &tagbuf, options);
+
+    if (!backend) {
+        // FIXME
+        r = -1;
+        goto done;
+    }
+
+    for (reserve = job->reserve_list->head, i = 0;
+         reserve;
+         reserve = reserve->next, i++) {
+        /* send APPLY RESERVE and parse missing lists */
+        r = sync_reserve_partition(reserve->part,
+                                   reserve_folder_list,
+                                   reserve->list,
+                                   backend);
+        if (r) goto done;
+
+        /* send APPLY MESSAGEs */
+        r = restore_upload_messages(ptrarray_nth(&job->upload_iters, i),
+                                    backend);
+        if (r) goto done;
+    }
+
+    /* sync_prepare_dlists needs to upload messages per-mailbox, because
+     * it needs the mailbox to find the filename for the message.  but
+     * we have no such limitation, so we can upload messages while
+     * looping over the reserve_list instead, above.
+     *
+     * alternatively, if we do it on a per-mailbox basis then we can limit
+     * the hit on the staging directory to only a mailbox worth of messages
+     * at a time.  but we don't have a logical grouping that would make
+     * this coherent
+     */
+
+    /* send RESTORE MAILBOXes */
+    struct backup_mailbox *mailbox;
+    for (mailbox = job->mailbox_list.head; mailbox; mailbox = mailbox->next) {
+        /* XXX filter the mailbox records based on reserve/missing/upload */
+
+        /* XXX does this sensibly handle mailbox objs with empty values? */
+        struct dlist *dl = backup_mailbox_to_dlist(mailbox);
+        if (!dl) continue;
+
+        if (local_only) {
+            free(dl->name);
+            dl->name = xstrdup("LOCAL_MAILBOX");
+        }
+
+        sync_send_restore(dl, backend->out);
+        r = sync_parse_response("MAILBOX", backend->in, NULL);
+        dlist_free(&dl);
+        if (r) goto done;
+    }
+
+done:
+    if (backend)
+        backend_disconnect(backend);
+
+    buf_free(&tagbuf);
+
+    return r;
+}
+
+/* wait for all the running jobs, returns the number that failed */
+static int restore_wait_jobs(struct restore_job *jobs, int n_jobs)
+{
+    int i, failed = 0;
+
+    for (i = 0; i < n_jobs; i++) {
+        int status;
+        pid_t pid;
+
+        if (jobs[i].pid <= 0) continue;
+
+        do {
+            pid = waitpid(jobs[i].pid, &status, 0);
+        } while (pid == -1 && errno == EINTR);
+
+        if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EC_OK)
+            failed++;
+
+        jobs[i].pid = 0;
+    }
+
+    return failed;
+}
+
+static void restore_job_fini(struct restore_job *job)
+{
+    struct backup_upload_iter *iter;
+
+    while ((iter = ptrarray_pop(&job->upload_iters)))
+        backup_upload_iter_free(&iter);
+    ptrarray_fini(&job->upload_iters);
+
+    backup_mailbox_list_empty(&job->mailbox_list);
+
+    if (job->reserve_list)
+        sync_reserve_list_free(&job->reserve_list);
+}
+
 static void my_mailbox_list_add(struct backup_mailbox_list *mailbox_list,
                                 struct backup_mailbox *mailbox)
 {
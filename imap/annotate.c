@@ -267,6 +267,9 @@ static int annotate_commit(annotate_db_t *d);
 
 static void init_internal();
 
+static void annot_cache_clear(void);
+static void annot_cache_invalidate(const char *key, size_t keylen);
+
 static int annotate_initialized = 0;
 static int annotatemore_dbopen = 0;
 
@@ -682,7 +685,7 @@ error:
     return r;
 }
 
-HIDDEN int annotate_getdb(const char *mboxname, annotate_db_t **dbp)
+EXPORTED int annotate_getdb(const char *mboxname, annotate_db_t **dbp)
 {
     if (!mboxname || !*mboxname) {
         syslog(LOG_ERR, "IOERROR: annotate_getdb called with no mboxname");
@@ -719,7 +722,7 @@ static void annotate_closedb(annotate_db_t *d)
     free(d);
 }
 
-HIDDEN void annotate_putdb(annotate_db_t **dbp)
+EXPORTED void annotate_putdb(annotate_db_t **dbp)
 {
     annotate_db_t *d;
 
@@ -759,6 +762,8 @@ EXPORTED void annotatemore_close(void)
     while (all_dbs_head)
         annotate_closedb(all_dbs_head);
 
+    annot_cache_clear();
+
     annotatemore_dbopen = 0;
 }
 
@@ -783,6 +788,10 @@ static void annotate_abort(annotate_db_t *d)
     }
     d->txn = NULL;
     d->in_txn = 0;
+
+    /* the cache may hold values read inside the txn */
+    if (!d->mboxname)
+        annot_cache_clear();
 }
 
 static int annotate_commit(annotate_db_t *d)
@@ -1815,7 +1824,37 @@ static void annotation_get_fromdb(annotate_state_t *state,
     const char *mboxname = (state->mailbox ? state->mailbox->name : "");
     state->found = 0;
 
-    annotatemore_findall(mboxname, state->uid, entry->name, 0, &rw_cb, state, 0);
+    if (state->which == ANNOTATION_SCOPE_MAILBOX && state->mailbox &&
+        state->mbentry && state->mbentry->foldermodseq &&
+        !strchr(entry->name, '%') && !strchr(entry->name, '*')) {
+        /* look up just the keys rw_cb() accepts, in the order findall
+         * would return them, through the session cache */
+        struct annotate_lookup lookups[3];
+        size_t i, n = 0;
+
+        memset(lookups, 0, sizeof(lookups));
+        lookups[n++].userid = NULL;
+        lookups[n++].userid = "";
+        if (state->userid && *state->userid)
+            lookups[n++].userid = state->userid;
+        for (i = 0; i < n; i++) {
+            lookups[i].mboxname = mboxname;
+            lookups[i].entry = entry->name;
+            lookups[i].modseq = state->mbentry->foldermodseq;
+        }
+
+        annotatemore_lookup_batch(lookups, n);
+        for (i = 0; i < n; i++) {
+            if (buf_len(&lookups[i].value))
+                rw_cb(mboxname, 0, entry->name, lookups[i].userid,
+                      &lookups[i].value, NULL, state);
+        }
+        annotatemore_lookup_batch_fini(lookups, n);
+    }
+    else {
+        annotatemore_findall(mboxname, state->uid, entry->name, 0,
+                             &rw_cb, state, 0);
+    }
 
     if (state->found != state->attribs &&
         (!strchr(entry->name, '%') && !strchr(entry->name, '*'))) {
@@ -2554,6 +2593,366 @@ EXPORTED int annotatemore_msg_lookupmask(const char *mboxname, uint32_t uid, con
     return r;
 }
 
+/**************************  Batched Lookups  *******************************/
+
+/*
+ * Per-session cache of mailbox and server scope annotations.  Each
+ * value is stored with the modseq the caller validated it against
+ * (normally the mailbox's foldermodseq, which moves whenever one of
+ * its annotations is written) and is only returned for that same
+ * modseq.  Writes from this process drop the key immediately.
+ */
+#define ANNOT_CACHE_MAX 8192
+
+struct annot_cache_entry {
+    modseq_t modseq;
+    struct buf value;
+};
+
+static hash_table annot_cache = HASH_TABLE_INITIALIZER;
+static size_t annot_cache_count = 0;
+
+/* keys contain NULs, hash keys can't */
+static const char *annot_cache_key(const char *key, size_t keylen)
+{
+    static struct buf buf = BUF_INITIALIZER;
+    size_t i;
+
+    buf_setmap(&buf, key, keylen);
+    for (i = 0; i < keylen; i++) {
+        if (!buf.s[i]) buf.s[i] = '\x1f';
+    }
+    return buf_cstring(&buf);
+}
+
+static void annot_cache_free_entry(void *data)
+{
+    struct annot_cache_entry *ce = (struct annot_cache_entry *) data;
+
+    buf_free(&ce->value);
+    free(ce);
+}
+
+static void annot_cache_clear(void)
+{
+    free_hash_table(&annot_cache, annot_cache_free_entry);
+    annot_cache_count = 0;
+}
+
+static void annot_cache_invalidate(const char *key, size_t keylen)
+{
+    struct annot_cache_entry *ce;
+
+    if (!annot_cache_count) return;
+
+    ce = hash_del(annot_cache_key(key, keylen), &annot_cache);
+    if (ce) {
+        annot_cache_free_entry(ce);
+        annot_cache_count--;
+    }
+}
+
+static struct annot_cache_entry *annot_cache_find(const char *key,
+                                                  size_t keylen,
+                                                  modseq_t modseq)
+{
+    struct annot_cache_entry *ce;
+
+    if (!modseq || !annot_cache_count) return NULL;
+
+    ce = hash_lookup(annot_cache_key(key, keylen), &annot_cache);
+    if (ce && ce->modseq != modseq)
+        return NULL;
+    return ce;
+}
+
+static void annot_cache_store(const char *key, size_t keylen,
+                              modseq_t modseq, const struct buf *value)
+{
+    const char *ckey = annot_cache_key(key, keylen);
+    struct annot_cache_entry *ce;
+
+    if (!modseq) return;
+
+    /* crude, but a session rarely looks at this many keys */
+    if (annot_cache_count >= ANNOT_CACHE_MAX)
+        annot_cache_clear();
+    if (!annot_cache.size)
+        construct_hash_table(&annot_cache, ANNOT_CACHE_MAX, 0);
+
+    ce = hash_lookup(ckey, &annot_cache);
+    if (!ce) {
+        ce = xzmalloc(sizeof(struct annot_cache_entry));
+        hash_insert(ckey, ce, &annot_cache);
+        annot_cache_count++;
+    }
+    ce->modseq = modseq;
+    buf_copy(&ce->value, value);
+}
+
+struct lookup_item {
+    struct annotate_lookup *lookup;
+    const char *dbname;         /* NULL for the global db */
+    struct buf key;
+    size_t scopelen;
+};
+
+/* Length of the key prefix which keys in the same range scan share:
+ * the uid for message scope, otherwise the user (or top level)
+ * part of the mailbox name */
+static size_t lookup_scopelen(const struct annotate_lookup *l,
+                              const struct buf *key)
+{
+    const char *p;
+
+    if (l->uid)
+        return strlen(key->s) + 1;
+
+    p = strchr(l->mboxname, '!');
+    p = p ? p + 1 : l->mboxname;
+    if (!strncmp(p, "user.", 5)) p += 5;
+    p += strcspn(p, ".");
+
+    return p - l->mboxname;
+}
+
+static int lookup_keycmp(const char *a, size_t alen,
+                         const char *b, size_t blen)
+{
+    int cmp = memcmp(a, b, MIN(alen, blen));
+
+    if (cmp) return cmp;
+    return (alen > blen) - (alen < blen);
+}
+
+static int lookup_item_cmp(const void *a, const void *b)
+{
+    const struct lookup_item *ia = (const struct lookup_item *) a;
+    const struct lookup_item *ib = (const struct lookup_item *) b;
+    int cmp = strcmpsafe(ia->dbname, ib->dbname);
+
+    if (cmp) return cmp;
+    return lookup_keycmp(ia->key.s, ia->key.len, ib->key.s, ib->key.len);
+}
+
+static int lookup_same_scope(const struct lookup_item *first,
+                             const struct lookup_item *item)
+{
+    if (strcmpsafe(first->dbname, item->dbname))
+        return 0;
+    if (item->key.len < first->scopelen)
+        return 0;
+    return !memcmp(first->key.s, item->key.s, first->scopelen);
+}
+
+static void lookup_item_set(struct lookup_item *item,
+                            const char *data, size_t datalen)
+{
+    struct buf value = BUF_INITIALIZER;
+    struct annotate_metadata mdata;
+
+    if (!split_attribs(data, datalen, &value, &mdata) &&
+        !(mdata.flags & ANNOTATE_FLAG_DELETED)) {
+        buf_copy(&item->lookup->value, &value);
+    }
+    buf_free(&value);
+}
+
+struct lookup_rock {
+    struct lookup_item *items;
+    size_t pos;
+    size_t count;
+};
+
+static int lookup_batch_cb(void *rock, const char *key, size_t keylen,
+                           const char *data, size_t datalen)
+{
+    struct lookup_rock *lrock = (struct lookup_rock *) rock;
+
+    /* both sides are sorted, so this is a merge join */
+    while (lrock->pos < lrock->count) {
+        struct lookup_item *item = &lrock->items[lrock->pos];
+        int cmp = lookup_keycmp(item->key.s, item->key.len, key, keylen);
+
+        if (cmp > 0)
+            return 0;
+        if (!cmp)
+            lookup_item_set(item, data, datalen);
+        lrock->pos++;
+    }
+
+    /* nothing left that we want in this range */
+    return CYRUSDB_DONE;
+}
+
+static int lookup_batch_run(struct lookup_item *items, size_t count)
+{
+    const struct lookup_item *last = &items[count-1];
+    annotate_db_t *d = NULL;
+    size_t i, prefixlen = 0;
+    int r;
+
+    r = _annotate_getdb(items->lookup->mboxname, items->lookup->uid, 0, &d);
+    if (r)
+        return (r == CYRUSDB_NOTFOUND ? 0 : r);
+
+    if (count == 1) {
+        const char *data = NULL;
+        size_t datalen = 0;
+
+        do {
+            r = cyrusdb_fetch(d->db, items->key.s, items->key.len,
+                              &data, &datalen, tid(d));
+        } while (r == CYRUSDB_AGAIN);
+
+        if (!r && data)
+            lookup_item_set(items, data, datalen);
+    }
+    else {
+        struct lookup_rock lrock = { items, 0, count };
+
+        while (prefixlen < items->key.len && prefixlen < last->key.len &&
+               items->key.s[prefixlen] == last->key.s[prefixlen])
+            prefixlen++;
+
+        r = cyrusdb_foreach(d->db, items->key.s, prefixlen,
+                            NULL, &lookup_batch_cb, &lrock, tid(d));
+        if (r == CYRUSDB_DONE) r = 0;
+    }
+    if (r == CYRUSDB_NOTFOUND) r = 0;
+
+    for (i = 0; !r && i < count; i++) {
+        struct annotate_lookup *l = items[i].lookup;
+
+        if (!l->uid)
+            annot_cache_store(items[i].key.s, items[i].key.len,
+                              l->modseq, &l->value);
+    }
+
+    annotate_putdb(&d);
+    return r;
+}
+
+EXPORTED int annotatemore_lookup_batch(struct annotate_lookup *lookups,
+                                       size_t n)
+{
+    struct lookup_item *items;
+    size_t i, j, nitems = 0;
+    int r = 0;
+
+    if (!n) return 0;
+
+    init_internal();
+
+    items = xzmalloc(n * sizeof(struct lookup_item));
+
+    for (i = 0; i < n; i++) {
+        struct annotate_lookup *l = &lookups[i];
+        struct annot_cache_entry *ce;
+        struct lookup_item *item;
+        char key[MAX_MAILBOX_PATH+1];
+        size_t keylen;
+
+        buf_reset(&l->value);
+        keylen = make_key(l->mboxname, l->uid, l->entry, l->userid,
+                          key, sizeof(key));
+
+        if (!l->uid && (ce = annot_cache_find(key, keylen, l->modseq))) {
+            buf_copy(&l->value, &ce->value);
+            continue;
+        }
+
+        item = &items[nitems++];
+        item->lookup = l;
+        item->dbname = l->uid ? l->mboxname : NULL;
+        buf_setmap(&item->key, key, keylen);
+        item->scopelen = lookup_scopelen(l, &item->key);
+    }
+
+    qsort(items, nitems, sizeof(struct lookup_item), lookup_item_cmp);
+
+    /* one fetch or range scan per run of keys sharing a scope */
+    for (i = 0; i < nitems; i = j) {
+        for (j = i + 1; j < nitems; j++) {
+            if (!lookup_same_scope(&items[i], &items[j]))
+                break;
+        }
+
+        r = lookup_batch_run(items + i, j - i);
+        if (r) break;
+    }
+
+    for (i = 0; i < nitems; i++)
+        buf_free(&items[i].key);
+    free(items);
+
+    return r;
+}
+
+EXPORTED void annotatemore_lookup_batch_fini(struct annotate_lookup *lookups,
+                                             size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        buf_free(&lookups[i].value);
+}
+
+EXPORTED void annotatemore_prefetch(const ptrarray_t *mbentries,
+                                    const strarray_t *entries,
+                                    const char *userid)
+{
+    struct annotate_lookup *lookups;
+    size_t n = 0;
+    int i, j;
+
+    if (!mbentries->count || !entries->count)
+        return;
+
+    lookups = xzmalloc(3 * mbentries->count * entries->count *
+                       sizeof(struct annotate_lookup));
+
+    for (i = 0; i < mbentries->count; i++) {
+        const mbentry_t *mbentry = ptrarray_nth(mbentries, i);
+
+        /* remote mailboxes are proxied, and without a modseq
+         * there is nothing to validate the cache against */
+        if (mbentry->server || !mbentry->foldermodseq)
+            continue;
+
+        for (j = 0; j < entries->count; j++) {
+            const char *entry = strarray_nth(entries, j);
+
+            if (strchr(entry, '%') || strchr(entry, '*'))
+                continue;
+
+            /* the same keys annotation_get_fromdb() looks at */
+            lookups[n].mboxname = mbentry->name;
+            lookups[n].entry = entry;
+            lookups[n].userid = NULL;
+            lookups[n++].modseq = mbentry->foldermodseq;
+
+            lookups[n].mboxname = mbentry->name;
+            lookups[n].entry = entry;
+            lookups[n].userid = "";
+            lookups[n++].modseq = mbentry->foldermodseq;
+
+            if (userid && *userid) {
+                lookups[n].mboxname = mbentry->name;
+                lookups[n].entry = entry;
+                lookups[n].userid = userid;
+                lookups[n++].modseq = mbentry->foldermodseq;
+            }
+        }
+    }
+
+    /* errors just leave the cache cold */
+    annotatemore_lookup_batch(lookups, n);
+
+    annotatemore_lookup_batch_fini(lookups, n);
+    free(lookups);
+}
+
 static int read_old_value(annotate_db_t *d,
                           const char *key, int keylen,
                           struct buf *valp,
@@ -2646,6 +3045,9 @@ static int write_entry(struct mailbox *mailbox,
 
     keylen = make_key(mboxname, uid, entry, userid, key, sizeof(key));
 
+    if (!uid)
+        annot_cache_invalidate(key, keylen);
+
     if (mailbox) {
         struct annotate_metadata oldmdata;
         r = read_old_value(d, key, keylen, &oldval, &oldmdata);
@@ -2731,6 +3133,8 @@ EXPORTED int annotatemore_rawwrite(const char *mboxname, const char *entry,
 
     keylen = make_key(mboxname, uid, entry, userid, key, sizeof(key));
 
+    annot_cache_invalidate(key, keylen);
+
     if (value->s == NULL) {
         do {
             r = cyrusdb_delete(d->db, key, keylen, tid(d), /*force*/1);
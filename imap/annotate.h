@@ -48,6 +48,7 @@
 #include "imapd.h"
 #include "mailbox.h"
 #include "mboxlist.h"
+#include "ptrarray.h"
 #include "util.h"
 #include "strarray.h"
 
@@ -192,6 +193,28 @@ int annotatemore_msg_lookup(const char *mboxname, uint32_t uid, const char *entr
 int annotatemore_msg_lookupmask(const char *mboxname, uint32_t uid, const char *entry,
                                 const char *userid, struct buf *value);
 
+/* one key for annotatemore_lookup_batch() */
+struct annotate_lookup {
+    const char *mboxname;       /* internal name, "" for server scope */
+    uint32_t uid;               /* 0 for mailbox and server scope */
+    const char *entry;
+    const char *userid;
+    modseq_t modseq;            /* mailbox foldermodseq to validate the
+                                   session cache against, 0 for none */
+    struct buf value;           /* result, empty if not set */
+};
+
+/* lookup many annotations at once, with one range scan per db for
+ * keys which sort close together */
+int annotatemore_lookup_batch(struct annotate_lookup *lookups, size_t n);
+/* free the results of a batch lookup */
+void annotatemore_lookup_batch_fini(struct annotate_lookup *lookups, size_t n);
+/* fill the session cache for 'entries' on each mailbox in 'mbentries',
+ * both shared and private to 'userid' */
+void annotatemore_prefetch(const ptrarray_t *mbentries,
+                           const strarray_t *entries,
+                           const char *userid);
+
 /* store annotations.  Requires an open transaction */
 int annotate_state_store(annotate_state_t *state, struct entryattlist *l);
 
@@ -63,7 +63,9 @@
 #include "msgrecord.h"
 #include "append.h"
 #include "global.h"
+#include "prometheus.h"
 #include "prot.h"
+#include "stagetrace.h"
 #include "sync_log.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -248,15 +250,16 @@ static void append_free(struct appendstate *as)
     mboxevent_freequeue(&as->mboxevents);
     as->event_type = 0;
 
+    /* n.b. only still here if we're aborting */
+    cyrus_copyfile_batch_commit(&as->copy_batch);
+
     if (as->close_mailbox_when_done)
         mailbox_close(&as->mailbox);
 
     as->s = APPEND_DONE;
 }
 
-/* may return non-zero, indicating that the entire append has failed
- and the mailbox is probably in an inconsistent state. */
-EXPORTED int append_commit(struct appendstate *as)
+static int _append_commit(struct appendstate *as)
 {
     int r = 0;
 
@@ -274,6 +277,14 @@ EXPORTED int append_commit(struct appendstate *as)
             append_addseen(as->mailbox, as->userid, as->seen_seq);
     }
 
+    /* the message files must be on disk before the index refers to them */
+    if (cyrus_copyfile_batch_commit(&as->copy_batch)) {
+        syslog(LOG_ERR, "IOERROR: syncing message files for append %s",
+               as->mailbox->name);
+        append_abort(as);
+        return IMAP_IOERROR;
+    }
+
     /* We want to commit here to guarantee mailbox on disk vs
      * duplicate DB consistency */
     r = mailbox_commit(as->mailbox);
@@ -287,10 +298,32 @@ EXPORTED int append_commit(struct appendstate *as)
     /* send the list of MessageCopy or MessageAppend event notifications at once */
     mboxevent_notify(&as->mboxevents);
 
+    if (as->nummsg && as->mailbox->part) {
+        char labels[128];
+
+        snprintf(labels, sizeof(labels), "partition=\"%s\"", as->mailbox->part);
+        prometheus_dynamic_apply_delta("cyrus_partition_appended_messages_total",
+                                       PROM_METRIC_COUNTER, labels,
+                                       as->nummsg);
+    }
+
     append_free(as);
     return 0;
 }
 
+/* may return non-zero, indicating that the entire append has failed
+ and the mailbox is probably in an inconsistent state. */
+EXPORTED int append_commit(struct appendstate *as)
+{
+    int r;
+
+    stagetrace_enter(STAGETRACE_COMMIT);
+    r = _append_commit(as);
+    stagetrace_leave(STAGETRACE_COMMIT);
+
+    return r;
+}
+
 /* may return non-zero, indicating an internal error of some sort. */
 EXPORTED int append_abort(struct appendstate *as)
 {
@@ -847,11 +880,11 @@ out:
  * Note: @user_annots needs to be freed by the caller but
  * may be modified during processing of callout responses.
  */
-EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
-                     struct stagemsg *stage, time_t internaldate,
-                     modseq_t createdmodseq,
-                     const strarray_t *flags, int nolink,
-                     struct entryattlist *user_annots)
+static int _append_fromstage(struct appendstate *as, struct body **body,
+                             struct stagemsg *stage, time_t internaldate,
+                             modseq_t createdmodseq,
+                             const strarray_t *flags, int nolink,
+                             struct entryattlist *user_annots)
 {
     struct mailbox *mailbox = as->mailbox;
     msgrecord_t *msgrec = NULL;
@@ -873,7 +906,7 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
     if (!*body) {
         FILE *file = fopen(stage->parts.data[0], "r");
         if (file) {
-            r = message_parse_file(file, NULL, NULL, body);
+            r = message_parse_file_guid(file, NULL, NULL, body, &stage->guid);
             fclose(file);
         }
         else
@@ -964,19 +997,16 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
     r = msgrecord_get_fname(msgrec, &fname);
     if (r) goto out;
 
-    r = mailbox_copyfile(stagefile, fname, nolink);
+    /* the file is synced (with any others in this append) at commit */
+    if (!as->copy_batch) as->copy_batch = cyrus_copyfile_batch_new();
+    r = mailbox_copyfile_batch(as->copy_batch, stagefile, fname, nolink);
     if (r) goto out;
 
-    FILE *destfile = fopen(fname, "r");
-    if (destfile) {
-        /* this will hopefully ensure that the link() actually happened
-           and makes sure that the file actually hits disk */
-        fsync(fileno(destfile));
-        fclose(destfile);
-    }
-    else {
-        r = IMAP_IOERROR;
-        goto out;
+    if (config_getswitch(IMAPOPT_SINGLEINSTANCE_BLOBS)) {
+        struct index_record record;
+        r = msgrecord_get_index_record(msgrec, &record);
+        if (r) goto out;
+        mailbox_sis_share(mailbox, &record, fname);
     }
 
     if (config_getstring(IMAPOPT_ANNOTATION_CALLOUT)) {
@@ -1097,6 +1127,22 @@ out:
     return r;
 }
 
+EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
+                     struct stagemsg *stage, time_t internaldate,
+                     modseq_t createdmodseq,
+                     const strarray_t *flags, int nolink,
+                     struct entryattlist *user_annots)
+{
+    int r;
+
+    stagetrace_enter(STAGETRACE_APPEND);
+    r = _append_fromstage(as, body, stage, internaldate, createdmodseq,
+                          flags, nolink, user_annots);
+    stagetrace_leave(STAGETRACE_APPEND);
+
+    return r;
+}
+
 EXPORTED int append_removestage(struct stagemsg *stage)
 {
     char *p;
@@ -1142,6 +1188,7 @@ EXPORTED int append_fromstream(struct appendstate *as, struct body **body,
     FILE *destfile;
     int r;
     struct mboxevent *mboxevent = NULL;
+    struct message_guid guid;
 
     assert(size != 0);
 
@@ -1174,10 +1221,10 @@ EXPORTED int append_fromstream(struct appendstate *as, struct body **body,
     /* XXX - also stream to stage directory and check out archive options */
 
     /* Copy and parse message */
-    r = message_copy_strict(messagefile, destfile, size, 0);
+    r = message_copy_strict_guid(messagefile, destfile, size, 0, &guid);
     if (!r) {
         if (!*body || (as->nummsg - 1))
-            r = message_parse_file(destfile, NULL, NULL, body);
+            r = message_parse_file_guid(destfile, NULL, NULL, body, &guid);
         if (!r) r = msgrecord_set_bodystructure(msgrec, *body);
 
         /* messageContent may be included with MessageAppend and MessageNew */
@@ -1350,12 +1397,18 @@ EXPORTED int append_copy(struct mailbox *mailbox, struct appendstate *as,
     int i;
     struct mboxevent *mboxevent = NULL;
     msgrecord_t *dst_msgrec = NULL;
+    annotate_db_t *annot_db = NULL;
 
     if (!msgrecs->count) {
         append_abort(as);
         return 0;
     }
 
+    /* Keep an open reference on the source's per-mailbox annotations
+     * db, so that copying each message's annotations doesn't open and
+     * close it again */
+    annotate_getdb(mailbox->name, &annot_db);
+
     /* prepare a single vnd.cmu.MessageCopy notification for all messages */
     if (as->event_type) {
         mboxevent = mboxevent_enqueue(as->event_type, &as->mboxevents);
@@ -1477,10 +1530,23 @@ EXPORTED int append_copy(struct mailbox *mailbox, struct appendstate *as,
 
         if (!(object_storage_enabled &&
               src_internal_flags & FLAG_INTERNAL_ARCHIVED))   // if object storage do not move file
-           r = mailbox_copyfile(srcfname, destfname, nolink);
+        {
+            /* the new links and copies are synced together at
+             * append_commit(), rather than one at a time */
+            if (!as->copy_batch) as->copy_batch = cyrus_copyfile_batch_new();
+            r = mailbox_copyfile_batch(as->copy_batch, srcfname, destfname,
+                                       nolink);
+        }
 
         if (r) goto out;
 
+        if (config_getswitch(IMAPOPT_SINGLEINSTANCE_BLOBS)) {
+            struct index_record record;
+            r = msgrecord_get_index_record(dst_msgrec, &record);
+            if (r) goto out;
+            mailbox_sis_share(as->mailbox, &record, destfname);
+        }
+
 #if defined ENABLE_OBJECTSTORE
         if (object_storage_enabled &&
             src_internal_flags & FLAG_INTERNAL_ARCHIVED) {
@@ -1524,6 +1590,7 @@ EXPORTED int append_copy(struct mailbox *mailbox, struct appendstate *as,
 out:
     free(srcfname);
     free(destfname);
+    annotate_putdb(&annot_db);
     if (r) {
         append_abort(as);
         return r;
@@ -1599,3 +1666,8 @@ EXPORTED const char *append_stagefname(struct stagemsg *stage)
 {
     return strarray_nth(&stage->parts, 0);
 }
+
+EXPORTED struct message_guid *append_stageguid(struct stagemsg *stage)
+{
+    return &stage->guid;
+}
@@ -82,6 +82,9 @@ struct appendstate {
     /* one event notification to send per appended message */
     enum event_type event_type;
     struct mboxevent *mboxevents;
+
+    /* message files to sync before the commit */
+    struct copyfile_batch *copy_batch;
 };
 
 /* add helper function to determine uid range appended? */
@@ -147,4 +150,8 @@ extern int append_run_annotator(struct appendstate *as,
 
 extern const char *append_stagefname(struct stagemsg *stage);
 
+/* the GUID of the staged message, if known; set it while staging the
+ * message to save append_fromstage() computing it */
+extern struct message_guid *append_stageguid(struct stagemsg *stage);
+
 #endif /* INCLUDED_APPEND_H */
@@ -0,0 +1,389 @@
+/* attachextract.c -- Text extraction from attachments via an external service
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "attachextract.h"
+#include "backend.h"
+#include "charset.h"
+#include "cyrusdb.h"
+#include "global.h"
+#include "mailbox.h"
+#include "mboxname.h"
+#include "message_guid.h"
+#include "prometheus.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/* generated headers are not necessarily in current directory */
+#include "imap/imap_err.h"
+
+#define DB config_getstring(IMAPOPT_SEARCH_ATTACHMENT_CACHE_DB)
+
+/* name lock prefix for the extractor connection slots */
+#define ATTACHEXTRACT_LOCK_PREFIX "$ATTACHEXTRACT$"
+
+/* never keep more extracted text than this for one attachment */
+#define ATTACHEXTRACT_MAXTEXT (4*1024*1024)
+
+/* application subtypes which are signatures, keys or containers
+ * rather than documents */
+static const char * const skip_subtypes[] = {
+    "MS-TNEF",
+    "PGP-ENCRYPTED",
+    "PGP-KEYS",
+    "PGP-SIGNATURE",
+    "PKCS7-MIME",
+    "PKCS7-SIGNATURE",
+    "VND.MS-TNEF",
+    "X-PKCS7-MIME",
+    "X-PKCS7-SIGNATURE",
+    NULL
+};
+
+/* The extractor speaks plain HTTP, so there's nothing to do to log in */
+static int login(struct backend *s __attribute__((unused)),
+                 const char *userid __attribute__((unused)),
+                 sasl_callback_t *cb __attribute__((unused)),
+                 const char **status __attribute__((unused)),
+                 int noauth __attribute__((unused)))
+{
+    return 0;
+}
+
+static int ping(struct backend *s __attribute__((unused)),
+                const char *userid __attribute__((unused)))
+{
+    return 0;
+}
+
+static int logout(struct backend *s __attribute__((unused)))
+{
+    return 0;
+}
+
+static struct protocol_t extractor_protocol =
+{ "http", "HTTP", TYPE_SPEC,
+  { .spec = { &login, &ping, &logout } }
+};
+
+EXPORTED int attachextract_wanted(const char *type, const char *subtype)
+{
+    int i;
+
+    if (!config_getstring(IMAPOPT_SEARCH_ATTACHMENT_EXTRACTOR_URL))
+        return 0;
+
+    if (!type || !subtype || strcasecmp(type, "APPLICATION"))
+        return 0;
+
+    for (i = 0 ; skip_subtypes[i] ; i++) {
+        if (!strcasecmp(subtype, skip_subtypes[i]))
+            return 0;
+    }
+
+    return 1;
+}
+
+/********************* CACHE METHODS ***********************/
+
+static struct db *cache_open(void)
+{
+    struct db *db = NULL;
+    char *fname = xstrdupnull(config_getstring(IMAPOPT_SEARCH_ATTACHMENT_CACHE_DB_PATH));
+    int r;
+
+    if (!fname)
+        fname = strconcat(config_dir, FNAME_ATTACHTEXTDB, (char *)NULL);
+
+    /* Opened for each lookup rather than once per process, so that
+     * forked extraction workers never share a handle */
+    r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &db);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+               cyrusdb_strerror(r));
+        db = NULL;
+    }
+
+    free(fname);
+    return db;
+}
+
+static int cache_lookup(const char *key, struct buf *text)
+{
+    struct db *db = cache_open();
+    const char *data = NULL;
+    size_t datalen = 0;
+    int r;
+
+    if (!db) return IMAP_NOTFOUND;
+
+    r = cyrusdb_fetch(db, key, strlen(key), &data, &datalen, NULL);
+    if (!r) buf_setmap(text, data, datalen);
+
+    cyrusdb_close(db);
+
+    return r ? IMAP_NOTFOUND : 0;
+}
+
+static void cache_store(const char *key, const struct buf *text)
+{
+    struct db *db = cache_open();
+    int r;
+
+    if (!db) return;
+
+    r = cyrusdb_store(db, key, strlen(key),
+                      buf_base(text), buf_len(text), NULL);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: attachextract: storing %s: %s",
+               key, cyrusdb_strerror(r));
+    }
+
+    cyrusdb_close(db);
+}
+
+/********************* EXTRACTOR METHODS ***********************/
+
+/* Take one of the search_attachment_extractor_maxconns slots,
+ * waiting for one if they're all in use.  Returns NULL if there's
+ * no limit, or if locking failed and we go ahead anyway. */
+static struct mboxlock *extractor_slot_acquire(void)
+{
+    int nslots = config_getint(IMAPOPT_SEARCH_ATTACHMENT_EXTRACTOR_MAXCONNS);
+    struct mboxlock *lock = NULL;
+    struct buf name = BUF_INITIALIZER;
+    int start, i;
+
+    if (nslots <= 0) return NULL;
+
+    start = getpid() % nslots;
+    for (i = 0 ; i < nslots ; i++) {
+        buf_reset(&name);
+        buf_printf(&name, ATTACHEXTRACT_LOCK_PREFIX "%d", (start + i) % nslots);
+        if (!mboxname_lock(buf_cstring(&name), &lock, LOCK_NONBLOCKING))
+            goto done;
+    }
+
+    /* all busy, queue up behind whoever has our own slot */
+    buf_reset(&name);
+    buf_printf(&name, ATTACHEXTRACT_LOCK_PREFIX "%d", start);
+    if (mboxname_lock(buf_cstring(&name), &lock, LOCK_EXCLUSIVE))
+        lock = NULL;
+
+done:
+    buf_free(&name);
+    return lock;
+}
+
+/* Split "http[s]://host[:port]/path" into a backend server string
+ * and a request path */
+static int extractor_parse_url(const char *url, struct buf *server,
+                               struct buf *host, struct buf *path)
+{
+    const char *p, *slash;
+    int tls = 0;
+
+    if (!strncasecmp(url, "http://", 7)) p = url + 7;
+    else if (!strncasecmp(url, "https://", 8)) {
+        p = url + 8;
+        tls = 1;
+    }
+    else return IMAP_INVALID_IDENTIFIER;
+
+    slash = strchr(p, '/');
+    if (slash == p) return IMAP_INVALID_IDENTIFIER;
+
+    buf_setmap(host, p, slash ? (size_t)(slash - p) : strlen(p));
+    buf_setcstr(path, slash ? slash : "/");
+    /* the GUID gets appended as the last path segment */
+    if (path->s[path->len-1] != '/') buf_putc(path, '/');
+
+    buf_copy(server, host);
+    if (tls) {
+        if (!strchr(buf_cstring(host), ':')) buf_appendcstr(server, ":https");
+        buf_appendcstr(server, "/tls");
+    }
+
+    return 0;
+}
+
+static int extractor_request(const char *type, const char *subtype,
+                             const char *guid, const struct buf *data,
+                             struct buf *text)
+{
+    const char *url = config_getstring(IMAPOPT_SEARCH_ATTACHMENT_EXTRACTOR_URL);
+    struct buf server = BUF_INITIALIZER;
+    struct buf host = BUF_INITIALIZER;
+    struct buf path = BUF_INITIALIZER;
+    struct backend *be = NULL;
+    struct mboxlock *slot = NULL;
+    char line[1024];
+    unsigned code = 0;
+    size_t clen = 0;
+    int have_clen = 0;
+    int r;
+
+    r = extractor_parse_url(url, &server, &host, &path);
+    if (r) {
+        syslog(LOG_ERR, "attachextract: invalid extractor URL %s", url);
+        goto done;
+    }
+
+    slot = extractor_slot_acquire();
+
+    be = backend_connect(NULL, buf_cstring(&server), &extractor_protocol,
+                         NULL, NULL, NULL, -1);
+    if (!be) {
+        syslog(LOG_ERR, "attachextract: can't connect to %s",
+               buf_cstring(&server));
+        r = IMAP_SERVER_UNAVAILABLE;
+        goto done;
+    }
+    prot_settimeout(be->in,
+                    config_getint(IMAPOPT_SEARCH_ATTACHMENT_EXTRACTOR_TIMEOUT));
+
+    /* HTTP/1.0, so the response is never chunked and ends at EOF */
+    prot_printf(be->out, "PUT %s%s HTTP/1.0\r\n", buf_cstring(&path), guid);
+    prot_printf(be->out, "Host: %s\r\n", buf_cstring(&host));
+    prot_printf(be->out, "User-Agent: Cyrus-IMAP/%s\r\n", CYRUS_VERSION);
+    prot_printf(be->out, "Content-Type: %s/%s\r\n", type, subtype);
+    prot_printf(be->out, "Content-Length: %zu\r\n", buf_len(data));
+    prot_printf(be->out, "Accept: text/plain\r\n\r\n");
+    prot_write(be->out, buf_base(data), buf_len(data));
+    prot_flush(be->out);
+
+    if (!prot_fgets(line, sizeof(line), be->in) ||
+        sscanf(line, "HTTP/%*u.%*u %u", &code) != 1) {
+        syslog(LOG_ERR, "attachextract: bad response from %s for %s",
+               buf_cstring(&server), guid);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    while (prot_fgets(line, sizeof(line), be->in)) {
+        if (line[0] == '\r' || line[0] == '\n') break;
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            clen = strtoul(line + 15, NULL, 10);
+            have_clen = 1;
+        }
+    }
+
+    buf_reset(text);
+    if (code == 200) {
+        size_t want = have_clen ? clen : ATTACHEXTRACT_MAXTEXT;
+        if (want > ATTACHEXTRACT_MAXTEXT) want = ATTACHEXTRACT_MAXTEXT;
+
+        while (buf_len(text) < want) {
+            int n = prot_readbuf(be->in, text, want - buf_len(text));
+            if (n <= 0) break;
+        }
+        if (have_clen && buf_len(text) < want) {
+            syslog(LOG_ERR, "attachextract: short response from %s for %s",
+                   buf_cstring(&server), guid);
+            r = IMAP_IOERROR;
+        }
+    }
+    else if (code >= 500) {
+        /* worth trying again later, so don't cache anything */
+        syslog(LOG_WARNING, "attachextract: %s returned %u for %s",
+               buf_cstring(&server), code, guid);
+        r = IMAP_IOERROR;
+    }
+    /* anything else means the extractor has no text for us */
+
+done:
+    if (be) {
+        backend_disconnect(be);
+        free(be);
+    }
+    if (slot) mboxname_release(&slot);
+    buf_free(&path);
+    buf_free(&host);
+    buf_free(&server);
+    return r;
+}
+
+EXPORTED int attachextract_gettext(const char *type, const char *subtype,
+                                   const struct buf *data, int encoding,
+                                   int cacheonly, struct buf *text)
+{
+    struct buf decbuf = BUF_INITIALIZER;
+    const struct buf *content = data;
+    struct message_guid guid;
+    const char *key;
+    int r;
+
+    if (!config_getstring(IMAPOPT_SEARCH_ATTACHMENT_EXTRACTOR_URL))
+        return IMAP_NOTFOUND;
+
+    if (encoding) {
+        if (charset_decode(&decbuf, buf_base(data), buf_len(data), encoding))
+            return IMAP_NOTFOUND;
+        content = &decbuf;
+    }
+
+    /* the same attachment gets the same GUID wherever it's forwarded */
+    message_guid_generate(&guid, buf_base(content), buf_len(content));
+    key = message_guid_encode(&guid);
+
+    r = cache_lookup(key, text);
+    prometheus_increment(r ? CYRUS_SEARCH_ATTACHMENT_CACHE_TOTAL_RESULT_MISS
+                           : CYRUS_SEARCH_ATTACHMENT_CACHE_TOTAL_RESULT_HIT);
+    if (!r || cacheonly) goto done;
+
+    r = extractor_request(type, subtype, key, content, text);
+    prometheus_increment(r ? CYRUS_SEARCH_ATTACHMENT_EXTRACTOR_TOTAL_RESULT_ERROR
+                           : CYRUS_SEARCH_ATTACHMENT_EXTRACTOR_TOTAL_RESULT_OK);
+    if (!r) cache_store(key, text);
+
+done:
+    buf_free(&decbuf);
+    return r;
+}
@@ -0,0 +1,67 @@
+/* attachextract.h -- Text extraction from attachments via an external service
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ATTACHEXTRACT_H
+#define ATTACHEXTRACT_H
+
+#include "util.h"
+
+/* name of the attachment text cache database */
+#define FNAME_ATTACHTEXTDB "/attachtext.db"
+
+/* Is this MIME type one we'd send to the extractor? */
+extern int attachextract_wanted(const char *type, const char *subtype);
+
+/* Get the plain text of an attachment, decoding 'data' from 'encoding'
+ * first.  The text is looked up in the attachment text cache by the
+ * GUID of the decoded content and, unless 'cacheonly' is set, fetched
+ * from the extractor service on a miss and cached.
+ *
+ * Returns 0 and fills 'text' (which may be empty if the extractor had
+ * nothing for us), IMAP_NOTFOUND if no extractor is configured or the
+ * text isn't cached with 'cacheonly', or another error if the
+ * extractor couldn't be reached. */
+extern int attachextract_gettext(const char *type, const char *subtype,
+                                 const struct buf *data, int encoding,
+                                 int cacheonly, struct buf *text);
+
+#endif /* ATTACHEXTRACT_H */
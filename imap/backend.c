@@ -69,6 +69,7 @@
 #include "global.h"
 #include "iptostring.h"
 #include "nonblock.h"
+#include "ptrarray.h"
 #include "tok.h"
 #include "util.h"
 #include "xmalloc.h"
@@ -505,6 +506,34 @@ static int do_compress(struct backend *s __attribute__((unused)),
 }
 #endif /* HAVE_ZLIB */
 
+#ifdef HAVE_ZSTD
+static int do_compress_zstd(struct backend *s, struct simple_cmd_t *zstd_cmd)
+{
+    char buf[1024];
+
+    /* send compress command */
+    prot_printf(s->out, "%s\r\n", zstd_cmd->cmd);
+    prot_flush(s->out);
+
+    /* check response */
+    if (!prot_fgets(buf, sizeof(buf), s->in) ||
+        strncmp(buf, zstd_cmd->ok, strlen(zstd_cmd->ok)))
+        return -1;
+
+    if (prot_setcompress_zstd(s->in, NULL, 0) ||
+        prot_setcompress_zstd(s->out, NULL, 0))
+        return -1;
+
+    return 0;
+}
+#else
+static int do_compress_zstd(struct backend *s __attribute__((unused)),
+                            struct simple_cmd_t *zstd_cmd __attribute__((unused)))
+{
+    return -1;
+}
+#endif /* HAVE_ZSTD */
+
 #ifdef HAVE_SSL
 EXPORTED int backend_starttls(  struct backend *s,
                                 struct tls_cmd_t *tls_cmd,
@@ -757,6 +786,10 @@ static int backend_authenticate(struct backend *s, const char *userid,
     return r;
 }
 
+static int backend_session_login(struct backend *ret, const char *userid,
+                                 sasl_callback_t *cb, const char **auth_status,
+                                 int noauth);
+
 static int backend_login(struct backend *ret, const char *userid,
                          sasl_callback_t *cb, const char **auth_status,
                          int noauth)
@@ -794,6 +827,18 @@ static int backend_login(struct backend *ret, const char *userid,
         ask_capability(ret, /*dobanner*/0, AUTO_CAPA_NO);
     }
 
+    return backend_session_login(ret, userid, cb, auth_status, noauth);
+}
+
+/* authenticate (unless noauth) and start compression on a connection
+   whose pre-authentication capabilities are already known */
+static int backend_session_login(struct backend *ret, const char *userid,
+                                 sasl_callback_t *cb, const char **auth_status,
+                                 int noauth)
+{
+    int r = 0;
+    struct protocol_t *prot = ret->prot;
+
     /* now need to authenticate to backend server,
        unless we're doing LMTP/CSYNC on a UNIX socket (deliver/sync_client) */
     if (!noauth) {
@@ -868,8 +913,18 @@ static int backend_login(struct backend *ret, const char *userid,
         free(old_mechlist);
     }
 
-    /* start compression if requested and both client/server support it */
+    /* start compression if requested and both client/server support it,
+       preferring zstd */
     if (config_getswitch(IMAPOPT_PROXY_COMPRESS) &&
+        CAPA(ret, CAPA_COMPRESS_ZSTD) &&
+        prot->u.std.zstd_cmd.cmd) {
+        r = do_compress_zstd(ret, &prot->u.std.zstd_cmd);
+        if (r) {
+            syslog(LOG_NOTICE, "couldn't enable zstd compression on backend server: %s", error_message(r));
+            r = 0; /* not a fail-level error */
+        }
+    }
+    else if (config_getswitch(IMAPOPT_PROXY_COMPRESS) &&
         CAPA(ret, CAPA_COMPRESS) &&
         prot->u.std.compress_cmd.cmd) {
         r = do_compress(ret, &prot->u.std.compress_cmd);
@@ -978,6 +1033,162 @@ error:
     return NULL;
 }
 
+/* Connections kept open across client sessions, oldest first
+   (see the proxy_pool_size option) */
+static ptrarray_t backend_pool = PTRARRAY_INITIALIZER;
+
+/* move the connection state of @from into @to, leaving @from disconnected */
+static void backend_move(struct backend *to, struct backend *from)
+{
+    strlcpy(to->hostname, from->hostname, sizeof(to->hostname));
+    memcpy(to->banner, from->banner, sizeof(to->banner));
+    memcpy(&to->addr, &from->addr, sizeof(to->addr));
+    to->sock = from->sock;
+    to->prot = from->prot;
+    to->ext_ssf = from->ext_ssf;
+#ifdef HAVE_SSL
+    to->tlsconn = from->tlsconn;
+    to->tlssess = from->tlssess;
+    from->tlsconn = NULL;
+    from->tlssess = NULL;
+#endif /* HAVE_SSL */
+    to->capability = from->capability;
+    to->num_cap_params = from->num_cap_params;
+    to->cap_params = from->cap_params;
+    to->in = from->in;
+    to->out = from->out;
+
+    from->sock = -1;
+    from->capability = 0;
+    from->num_cap_params = 0;
+    from->cap_params = NULL;
+    from->in = from->out = NULL;
+}
+
+/* take a pooled connection to @server, if there is a live one */
+static struct backend *backend_pool_take(const char *server,
+                                         struct protocol_t *prot)
+{
+    int i;
+
+    /* most recently released first */
+    for (i = ptrarray_size(&backend_pool) - 1; i >= 0; i--) {
+        struct backend *p = ptrarray_nth(&backend_pool, i);
+
+        if (p->prot != prot || strcmp(p->hostname, server)) continue;
+
+        ptrarray_remove(&backend_pool, i);
+
+        /* make sure the server hasn't dropped the connection meanwhile */
+        if (!backend_ping(p, NULL)) return p;
+
+        syslog(LOG_DEBUG, "dropping stale pooled connection to %s", server);
+        backend_disconnect(p);
+        free(p);
+    }
+
+    return NULL;
+}
+
+EXPORTED int backend_release(struct backend *s)
+{
+    struct simple_cmd_t *unauth_cmd;
+    struct backend *p;
+    char buf[2048];
+    int poolsize = config_getint(IMAPOPT_PROXY_POOL_SIZE);
+
+    if (poolsize <= 0 || !s || s->sock == -1) return -1;
+    if (s->prot->type != TYPE_STD) return -1;
+
+    unauth_cmd = &s->prot->u.std.unauth_cmd;
+    if (!unauth_cmd->cmd || !s->saslconn) return -1;
+    if (prot_error(s->in) || prot_error(s->out)) return -1;
+
+    prot_printf(s->out, "%s\r\n", unauth_cmd->cmd);
+    prot_flush(s->out);
+
+    for (;;) {
+        if (!prot_fgets(buf, sizeof(buf), s->in)) {
+            /* connection closed? */
+            return -1;
+        } else if (unauth_cmd->unsol &&
+                   !strncmp(unauth_cmd->unsol, buf,
+                            strlen(unauth_cmd->unsol))) {
+            /* unsolicited response */
+            continue;
+        } else {
+            break;
+        }
+    }
+
+    if (strncmp(unauth_cmd->ok, buf, strlen(unauth_cmd->ok))) {
+        syslog(LOG_NOTICE, "couldn't unauthenticate from %s: %s",
+               s->hostname, buf);
+        return -1;
+    }
+
+    /* the server has dropped its SASL and compression layers (not TLS)
+       right after its response, so do the same */
+    prot_unsetcompress(s->in);
+    prot_unsetcompress(s->out);
+    prot_unsetsasl(s->in);
+    prot_unsetsasl(s->out);
+
+    sasl_dispose(&s->saslconn);
+    s->saslconn = NULL;
+    if (s->sasl_cb) {
+        free_callbacks(s->sasl_cb);
+        s->sasl_cb = NULL;
+    }
+
+    prot_setlog(s->in, PROT_NO_FD);
+    prot_setlog(s->out, PROT_NO_FD);
+    prot_settimeout(s->in, config_getint(IMAPOPT_CLIENT_TIMEOUT));
+
+    /* the response normally carries the pre-authentication capabilities */
+    forget_capabilities(s);
+    if (parse_capability(s, buf)) post_parse_capability(s);
+    else ask_capability(s, /*dobanner*/0, AUTO_CAPA_NO);
+
+    buf_free(&s->last_result);
+
+    p = xzmalloc(sizeof(struct backend));
+    backend_move(p, s);
+
+    if (ptrarray_size(&backend_pool) >= poolsize) {
+        struct backend *old = ptrarray_shift(&backend_pool);
+        backend_disconnect(old);
+        free(old);
+    }
+    ptrarray_append(&backend_pool, p);
+
+    return 0;
+}
+
+EXPORTED void backend_pool_flush(void)
+{
+    struct backend *p;
+
+    while ((p = ptrarray_pop(&backend_pool))) {
+        backend_disconnect(p);
+        free(p);
+    }
+    ptrarray_fini(&backend_pool);
+}
+
+/* drop the pooled connections without a word to their servers, in a
+   forked child whose parent still owns them */
+EXPORTED void backend_pool_detach(void)
+{
+    struct backend *p;
+
+    while ((p = ptrarray_pop(&backend_pool))) {
+        if (p->sock != -1) close(p->sock);
+        free(p);
+    }
+    ptrarray_fini(&backend_pool);
+}
+
 EXPORTED struct backend *backend_connect(struct backend *ret_backend, const char *server,
                                 struct protocol_t *prot, const char *userid,
                                 sasl_callback_t *cb, const char **auth_status,
@@ -993,7 +1204,7 @@ EXPORTED struct backend *backend_connect(struct backend *ret_backend, const char
     int noauth = 0;
     struct addrinfo hints, *res0 = NULL, *res;
     struct sockaddr_un sunsock;
-    struct backend *ret;
+    struct backend *ret, *pooled;
 
     if (!ret_backend) {
         ret = xzmalloc(sizeof(struct backend));
@@ -1003,6 +1214,18 @@ EXPORTED struct backend *backend_connect(struct backend *ret_backend, const char
     else
         ret = ret_backend;
 
+    /* reuse a pooled connection, logging in as the new user */
+    if ((pooled = backend_pool_take(server, prot))) {
+        backend_move(ret, pooled);
+        free(pooled);
+
+        if (!backend_session_login(ret, userid, cb, auth_status, 0))
+            goto connected;
+
+        syslog(LOG_NOTICE, "couldn't reuse pooled connection to %s", server);
+        backend_disconnect(ret);
+    }
+
     if (server[0] == '/') { /* unix socket */
         res0 = &hints;
         memset(res0, 0, sizeof(struct addrinfo));
@@ -1160,6 +1383,7 @@ EXPORTED struct backend *backend_connect(struct backend *ret_backend, const char
 
     if (r) goto error;
 
+connected:
     if (logfd >= 0) {
         prot_setlog(ret->in, logfd);
         prot_setlog(ret->out, logfd);
@@ -110,6 +110,14 @@ int backend_starttls(   struct backend *s,
 
 int backend_ping(struct backend *s, const char *userid);
 void backend_disconnect(struct backend *s);
+
+/* returns the connection of @s to the unauthenticated state and keeps it
+ * for reuse by a later backend_connect() to the same server, leaving @s
+ * disconnected.  Returns non-zero if the connection can't be pooled, in
+ * which case @s is untouched and should be disconnected as usual */
+int backend_release(struct backend *s);
+void backend_pool_flush(void);
+void backend_pool_detach(void);
 char *intersect_mechlists(char *config, char *server);
 char *backend_get_cap_params(const struct backend *, unsigned long capa);
 
@@ -65,6 +65,8 @@ extern int optind;
 extern char *optarg;
 
 static int debugmode = 0;
+static pid_t *workers = NULL;
+static int nworkers = 0;
 
 EXPORTED void fatal(const char *msg, int err)
 {
@@ -80,6 +82,13 @@ EXPORTED void fatal(const char *msg, int err)
 static void shut_down(int ec) __attribute__((noreturn));
 static void shut_down(int ec)
 {
+    int i;
+
+    /* take any worker processes down with us */
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i] > 0) kill(workers[i], SIGTERM);
+    }
+
     cyrus_done();
     exit(ec);
 }
@@ -144,6 +153,36 @@ int main(int argc, char **argv)
     }
     /* child */
 
+    /* start any extra workers, each handling its own share of the users */
+    int nshards = config_getint(IMAPOPT_CALALARMD_WORKERS);
+    int shard = 0;
+    pid_t parent = getpid();
+
+    if (nshards > 1) {
+        int i;
+
+        workers = xzmalloc(nshards * sizeof(pid_t));
+        for (i = 1; i < nshards; i++) {
+            pid = fork();
+            if (pid == -1) {
+                /* a share of the users would never get their alarms */
+                syslog(LOG_ERR, "fork: %m");
+                shut_down(EC_TEMPFAIL);
+            }
+            if (pid == 0) {
+                /* worker: no workers of its own */
+                free(workers);
+                workers = NULL;
+                nworkers = 0;
+                shard = i;
+                break;
+            }
+            workers[nworkers++] = pid;
+        }
+
+        caldav_alarm_set_shard(shard, nshards);
+    }
+
     for (;;) {
         struct timeval start, end;
         double totaltime;
@@ -151,6 +190,9 @@ int main(int argc, char **argv)
 
         signals_poll();
 
+        /* workers exit when the main calalarmd process has gone */
+        if (shard && getppid() != parent) shut_down(0);
+
         gettimeofday(&start, 0);
         caldav_alarm_process(0);
         gettimeofday(&end, 0);
@@ -58,6 +58,7 @@
 #include "mboxevent.h"
 #include "mboxlist.h"
 #include "mboxname.h"
+#include "strhash.h"
 #include "util.h"
 #include "xstrlcat.h"
 #include "xmalloc.h"
@@ -70,8 +71,13 @@ struct caldav_alarm_data {
     char *mboxname;
     uint32_t imap_uid;
     time_t nextcheck;
+    unsigned update : 1;        /* write nextcheck back to the alarm db */
 };
 
+/* which share of the users this process handles (see calalarmd_workers) */
+static unsigned alarm_shard = 0;
+static unsigned alarm_nshards = 1;
+
 void caldav_alarm_fini(struct caldav_alarm_data *alarmdata)
 {
     free(alarmdata->mboxname);
@@ -732,10 +738,20 @@ EXPORTED int caldav_alarm_delete_user(const char *userid)
 static int alarm_read_cb(sqlite3_stmt *stmt, void *rock)
 {
     ptrarray_t *target = (ptrarray_t *)rock;
+    const char *mboxname = (const char *) sqlite3_column_text(stmt, 0);
+
+    if (alarm_nshards > 1) {
+        /* only take alarms of the users in our shard */
+        char *userid = mboxname_to_userid(mboxname);
+        unsigned shard = strhash(userid ? userid : "") % alarm_nshards;
+
+        free(userid);
+        if (shard != alarm_shard) return 0;
+    }
 
     struct caldav_alarm_data *data = xzmalloc(sizeof(struct caldav_alarm_data));
 
-    data->mboxname    = xstrdup((const char *) sqlite3_column_text(stmt, 0));
+    data->mboxname    = xstrdup(mboxname);
     data->imap_uid    = sqlite3_column_int(stmt, 1);
     data->nextcheck   = sqlite3_column_int(stmt, 2);
 
@@ -793,12 +809,20 @@ static int process_peruser_alarms_cb(const char *mailbox, uint32_t uid,
     return 0;
 }
 
-static void process_one_record(struct mailbox *mailbox, uint32_t imap_uid,
+/* The new nextcheck (0 to remove the alarm) is left in 'alarm'
+   for the caller to write back with the rest of the batch */
+static void process_one_record(struct mailbox *mailbox,
+                               struct caldav_alarm_data *alarm,
                                icaltimezone *floatingtz, time_t runtime)
 {
     int rc;
+    uint32_t imap_uid = alarm->imap_uid;
     icalcomponent *ical = NULL;
 
+    /* unless we get as far as processing it, the alarm is removed */
+    alarm->nextcheck = 0;
+    alarm->update = 1;
+
     syslog(LOG_DEBUG, "processing alarms for mailbox %s uid %u",
            mailbox->name, imap_uid);
 
@@ -809,21 +833,18 @@ static void process_one_record(struct mailbox *mailbox, uint32_t imap_uid,
         syslog(LOG_ERR, "not found mailbox %s uid %u",
                mailbox->name, imap_uid);
         /* no record, no worries */
-        caldav_alarm_delete_record(mailbox->name, imap_uid);
         goto done_item;
     }
     if (rc) {
         syslog(LOG_ERR, "error reading mailbox %s uid %u (%s)",
                mailbox->name, imap_uid, error_message(rc));
         /* XXX no index record? item deleted or transient error? */
-        caldav_alarm_delete_record(mailbox->name, imap_uid);
         goto done_item;
     }
     if (record.internal_flags & FLAG_INTERNAL_EXPUNGED) {
         syslog(LOG_ERR, "already expunged mailbox %s uid %u",
                mailbox->name, imap_uid);
         /* no longer exists?  nothing to do */
-        caldav_alarm_delete_record(mailbox->name, imap_uid);
         goto done_item;
     }
 
@@ -832,17 +853,27 @@ static void process_one_record(struct mailbox *mailbox, uint32_t imap_uid,
     if (!ical) {
         syslog(LOG_ERR, "error parsing ical string mailbox %s uid %u",
                mailbox->name, imap_uid);
-        caldav_alarm_delete_record(mailbox->name, imap_uid);
         goto done_item;
     }
 
+    /* slide the occurrence index window of recurring events along */
+    struct caldav_db *caldavdb = caldav_open_mailbox(mailbox);
+    if (caldavdb) {
+        struct caldav_data *cdata = NULL;
+
+        if (!caldav_lookup_imapuid(caldavdb, mailbox->name, imap_uid,
+                                   &cdata, /*tombstones*/0)) {
+            caldav_refresh_occurrences(caldavdb, cdata, ical);
+        }
+        caldav_close(caldavdb);
+    }
+
     /* check for bogus lastalarm data on record
        which actually shouldn't have it */
     if (!has_alarms(ical, mailbox, imap_uid)) {
         syslog(LOG_NOTICE, "removing bogus lastalarm check "
                "for mailbox %s uid %u which has no alarms",
                mailbox->name, imap_uid);
-        caldav_alarm_delete_record(mailbox->name, imap_uid);
         goto done_item;
     }
 
@@ -873,48 +904,133 @@ static void process_one_record(struct mailbox *mailbox, uint32_t imap_uid,
     data.lastrun = runtime;
     write_lastalarm(mailbox, &record, &data);
 
-    update_alarmdb(mailbox->name, record.uid, data.nextcheck);
+    alarm->nextcheck = data.nextcheck;
 
 done_item:
     if (ical) icalcomponent_free(ical);
 }
 
-static void process_records(ptrarray_t *list, time_t runtime)
+struct alarm_batch {
+    int first;          /* index of first alarm in the list */
+    int count;
+    time_t earliest;    /* nextcheck of the most overdue alarm */
+};
+
+static int batch_compare(const void **a, const void **b)
 {
-    struct mailbox *mailbox = NULL;
-    int rc;
+    const struct alarm_batch *ba = *a, *bb = *b;
+
+    if (ba->earliest < bb->earliest) return -1;
+    if (ba->earliest > bb->earliest) return 1;
+    return ba->first - bb->first;
+}
+
+/* write back the new nextcheck of every alarm in the batch
+   in a single alarm db transaction */
+static void flush_batch(ptrarray_t *list, struct alarm_batch *batch)
+{
+    sqldb_t *alarmdb = caldav_alarm_open();
     int i;
+
+    if (!alarmdb) return;
+
+    sqldb_begin(alarmdb, "alarmbatch");
+
+    for (i = batch->first; i < batch->first + batch->count; i++) {
+        struct caldav_alarm_data *data = ptrarray_nth(list, i);
+
+        if (data->update)
+            update_alarmdb(data->mboxname, data->imap_uid, data->nextcheck);
+    }
+
+    sqldb_commit(alarmdb, "alarmbatch");
+
+    caldav_alarm_close(alarmdb);
+}
+
+static void process_batch(ptrarray_t *list, struct alarm_batch *batch,
+                          time_t runtime)
+{
+    struct caldav_alarm_data *data = ptrarray_nth(list, batch->first);
+    struct mailbox *mailbox = NULL;
     icaltimezone *floatingtz = NULL;
+    int i, rc;
+
+    syslog(LOG_DEBUG, "processing %d alarms for mailbox %s",
+           batch->count, data->mboxname);
+
+    rc = mailbox_open_iwl(data->mboxname, &mailbox);
+    if (rc == IMAP_MAILBOX_NONEXISTENT) {
+        /* mailbox was deleted or something, nothing we can do */
+        for (i = batch->first; i < batch->first + batch->count; i++) {
+            data = ptrarray_nth(list, i);
+            data->nextcheck = 0;
+            data->update = 1;
+        }
+    }
+    else if (rc) {
+        /* transient open error, don't delete these alarms */
+        return;
+    }
+    else {
+        floatingtz = get_floatingtz(mailbox->name, "");
+
+        for (i = batch->first; i < batch->first + batch->count; i++) {
+            process_one_record(mailbox, ptrarray_nth(list, i),
+                               floatingtz, runtime);
+        }
+    }
+
+    /* with the mailbox still locked, so nobody else can change these */
+    flush_batch(list, batch);
+
+    if (floatingtz) icaltimezone_free(floatingtz, 1);
+    mailbox_close(&mailbox);
+}
+
+static void process_records(ptrarray_t *list, time_t runtime)
+{
+    ptrarray_t batches = PTRARRAY_INITIALIZER;
+    struct alarm_batch *batch = NULL;
+    const char *mboxname = NULL;
+    int i;
 
     syslog(LOG_DEBUG, "processing records");
 
+    /* the list is in mailbox order: make one batch per mailbox */
     for (i = 0; i < list->count; i++) {
         struct caldav_alarm_data *data = ptrarray_nth(list, i);
 
-        if (mailbox && !strcmp(mailbox->name, data->mboxname)) {
-            /* woot, reuse mailbox */
+        if (!batch || strcmp(mboxname, data->mboxname)) {
+            batch = xzmalloc(sizeof(struct alarm_batch));
+            batch->first = i;
+            batch->earliest = data->nextcheck;
+            ptrarray_append(&batches, batch);
+            mboxname = data->mboxname;
         }
-        else {
-            if (floatingtz) icaltimezone_free(floatingtz, 1);
-            floatingtz = NULL;
-            mailbox_close(&mailbox);
-            rc = mailbox_open_iwl(data->mboxname, &mailbox);
-            if (rc == IMAP_MAILBOX_NONEXISTENT) {
-                /* mailbox was deleted or something, nothing we can do */
-                data->nextcheck = 0;
-                continue;
-            }
-            if (rc) {
-                /* transient open error, don't delete this alarm */
-                continue;
-            }
-            floatingtz = get_floatingtz(mailbox->name, "");
+        else if (data->nextcheck < batch->earliest) {
+            batch->earliest = data->nextcheck;
         }
-        process_one_record(mailbox, data->imap_uid, floatingtz, runtime);
+        batch->count++;
     }
 
-    if (floatingtz) icaltimezone_free(floatingtz, 1);
-    mailbox_close(&mailbox);
+    /* when there are more alarms due than we can send at once,
+       the ones longest overdue go out first */
+    ptrarray_sort(&batches, &batch_compare);
+
+    for (i = 0; i < batches.count; i++) {
+        batch = ptrarray_nth(&batches, i);
+        process_batch(list, batch, runtime);
+        free(batch);
+    }
+
+    ptrarray_fini(&batches);
+}
+
+EXPORTED void caldav_alarm_set_shard(unsigned shard, unsigned nshards)
+{
+    alarm_shard = shard;
+    alarm_nshards = nshards ? nshards : 1;
 }
 
 /* process alarms with triggers before a given time */
@@ -81,6 +81,9 @@ int caldav_alarm_delete_user(const char *userid);
 /* distribute alarms with triggers in the next minute */
 int caldav_alarm_process(time_t runtime);
 
+/* only process the alarms of users hashing to 'shard' of 'nshards' */
+void caldav_alarm_set_shard(unsigned shard, unsigned nshards);
+
 /* upgrade old databases */
 int caldav_alarm_upgrade();
 
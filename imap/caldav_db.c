@@ -370,6 +370,32 @@ EXPORTED int caldav_lookup_resource(struct caldav_db *caldavdb,
     return r;
 }
 
+#define CMD_SELRSRCS CMD_READFIELDS \
+    " WHERE mailbox = :mailbox AND" DAV_RESOURCE_INLIST \
+    " AND alive = 1 ORDER BY imap_uid;"
+
+EXPORTED int caldav_lookup_resources(struct caldav_db *caldavdb,
+                                     const char *mailbox,
+                                     const strarray_t *resources,
+                                     caldav_cb_t *cb, void *rock)
+{
+    struct sqldb_bindval bval[DAV_RESOURCE_BATCH + 2];
+    struct caldav_data cdata;
+    struct read_rock rrock = { caldavdb, &cdata, 0, cb, rock };
+    int i = 0, r = 0;
+
+    bval[0].name = ":mailbox";
+    bval[0].type = SQLITE_TEXT;
+    bval[0].val.s = mailbox;
+
+    while (!r && i < strarray_size(resources)) {
+        i = dav_bind_resources(bval + 1, resources, i);
+        r = sqldb_exec(caldavdb->db, CMD_SELRSRCS, bval, &read_cb, &rrock);
+    }
+
+    return r;
+}
+
 #define CMD_SELIMAPUID CMD_READFIELDS \
     " WHERE mailbox = :mailbox AND imap_uid = :imap_uid;"
 
@@ -447,13 +473,23 @@ EXPORTED int caldav_foreach(struct caldav_db *caldavdb, const char *mailbox,
     }
 }
 
+/* Skip recurring components whose materialized occurrences cover
+   the whole range, but of which none overlaps it */
+#define CMD_SELRANGE_NOOCC \
+    " AND NOT EXISTS ( SELECT 1 FROM ical_occwindow W" \
+    "  WHERE W.objid = ical_objs.rowid" \
+    "  AND W.win_start <= :after AND W.win_end >= :before" \
+    "  AND NOT EXISTS ( SELECT 1 FROM ical_occurrences O" \
+    "   WHERE O.objid = ical_objs.rowid" \
+    "   AND O.dtend > :after AND O.dtstart < :before ) )"
+
 #define CMD_SELRANGE_MBOX CMD_READFIELDS \
     " WHERE dtend > :after AND dtstart < :before " \
-    " AND mailbox = :mailbox AND alive = 1;"
+    " AND mailbox = :mailbox AND alive = 1" CMD_SELRANGE_NOOCC ";"
 
 #define CMD_SELRANGE CMD_READFIELDS \
     " WHERE dtend > :after AND dtstart < :before " \
-    " AND alive = 1;"
+    " AND alive = 1" CMD_SELRANGE_NOOCC ";"
 
 EXPORTED int caldav_foreach_timerange(struct caldav_db *caldavdb,
                                       const char *mailbox,
@@ -648,6 +684,196 @@ static void check_mattach_cb(icalcomponent *comp, void *rock)
     }
 }
 
+/* Give up on indexing components with more occurrences in the window */
+#define OCCURRENCES_MAX  4096
+
+struct occ_rock {
+    strarray_t times;                   /* start/end pairs, as UTC strings */
+    int overflow;
+};
+
+/* Format an occurrence boundary comparably to the dtstart/dtend columns */
+static const char *occ_timestr(icaltimetype t)
+{
+    icaltimezone *utc = icaltimezone_get_utc_timezone();
+
+    return icaltime_as_ical_string(
+        icaltime_from_timet_with_zone(icaltime_to_timet(t, NULL), 0, utc));
+}
+
+static int occ_cb(icalcomponent *comp __attribute__((unused)),
+                  icaltimetype start, icaltimetype end, void *rock)
+{
+    struct occ_rock *orock = (struct occ_rock *) rock;
+
+    if (strarray_size(&orock->times) >= 2 * OCCURRENCES_MAX) {
+        orock->overflow = 1;
+        return 0;
+    }
+
+    strarray_append(&orock->times, occ_timestr(start));
+    strarray_append(&orock->times, occ_timestr(end));
+
+    return 1;
+}
+
+#define CMD_DELETE_OCC "DELETE FROM ical_occurrences WHERE objid = :objid;"
+#define CMD_DELETE_OCCWINDOW "DELETE FROM ical_occwindow WHERE objid = :objid;"
+#define CMD_INSERT_OCC                                                  \
+    "INSERT INTO ical_occurrences ( objid, dtstart, dtend )"            \
+    " VALUES ( :objid, :dtstart, :dtend );"
+#define CMD_INSERT_OCCWINDOW                                            \
+    "INSERT INTO ical_occwindow ( objid, win_start, win_end )"          \
+    " VALUES ( :objid, :win_start, :win_end );"
+
+EXPORTED int caldav_write_occurrences(struct caldav_db *caldavdb,
+                                      struct caldav_data *cdata,
+                                      icalcomponent *ical)
+{
+    int days = config_getint(IMAPOPT_CALDAV_OCCURRENCE_WINDOW);
+    char *win_start = NULL, *win_end = NULL;
+    struct occ_rock orock = { STRARRAY_INITIALIZER, 0 };
+    struct sqldb_bindval bval[] = {
+        { ":objid",     SQLITE_INTEGER, { .i = cdata->dav.rowid } },
+        { ":dtstart",   SQLITE_TEXT,    { .s = NULL             } },
+        { ":dtend",     SQLITE_TEXT,    { .s = NULL             } },
+        { ":win_start", SQLITE_TEXT,    { .s = NULL             } },
+        { ":win_end",   SQLITE_TEXT,    { .s = NULL             } },
+        { NULL,         SQLITE_NULL,    { .s = NULL             } } };
+    int i, r;
+
+    /* clean up existing records if any */
+    r = sqldb_exec(caldavdb->db, CMD_DELETE_OCC, bval, NULL, NULL);
+    if (!r) r = sqldb_exec(caldavdb->db, CMD_DELETE_OCCWINDOW, bval, NULL, NULL);
+    if (r) return r;
+
+    /* Only recurring components need it; for everything else,
+       dtstart and dtend are already exact */
+    if (days <= 0 || !cdata->dav.alive || !cdata->comp_flags.recurring ||
+        !(cdata->comp_type & (CAL_COMP_VEVENT | CAL_COMP_VTODO))) {
+        return 0;
+    }
+
+    icaltimezone *utc = icaltimezone_get_utc_timezone();
+    time_t now = time(NULL);
+    struct icalperiodtype range = icalperiodtype_null_period();
+
+    range.start = icaltime_from_timet_with_zone(now - days * 86400, 0, utc);
+    range.end = icaltime_from_timet_with_zone(now + days * 86400, 0, utc);
+    win_start = xstrdup(icaltime_as_ical_string(range.start));
+    win_end = xstrdup(icaltime_as_ical_string(range.end));
+
+    icalcomponent_myforeach(ical, range, NULL, occ_cb, &orock);
+    if (orock.overflow) {
+        /* Leave it to dtstart/dtend and full expansion */
+        goto done;
+    }
+
+    for (i = 0; i < strarray_size(&orock.times); i += 2) {
+        bval[1].val.s = strarray_nth(&orock.times, i);
+        bval[2].val.s = strarray_nth(&orock.times, i+1);
+        r = sqldb_exec(caldavdb->db, CMD_INSERT_OCC, bval, NULL, NULL);
+        if (r) goto done;
+    }
+
+    bval[3].val.s = win_start;
+    bval[4].val.s = win_end;
+    r = sqldb_exec(caldavdb->db, CMD_INSERT_OCCWINDOW, bval, NULL, NULL);
+
+  done:
+    strarray_fini(&orock.times);
+    free(win_start);
+    free(win_end);
+    return r;
+}
+
+#define CMD_GETOCCWINDOW \
+    "SELECT win_end FROM ical_occwindow WHERE objid = :objid;"
+
+static int occwindow_cb(sqlite3_stmt *stmt, void *rock)
+{
+    struct buf *win_end = (struct buf *) rock;
+
+    buf_setcstr(win_end, (const char *) sqlite3_column_text(stmt, 0));
+
+    return 0;
+}
+
+EXPORTED int caldav_refresh_occurrences(struct caldav_db *caldavdb,
+                                        struct caldav_data *cdata,
+                                        icalcomponent *ical)
+{
+    int days = config_getint(IMAPOPT_CALDAV_OCCURRENCE_WINDOW);
+    struct sqldb_bindval bval[] = {
+        { ":objid", SQLITE_INTEGER, { .i = cdata->dav.rowid } },
+        { NULL,     SQLITE_NULL,    { .s = NULL             } } };
+    struct buf win_end = BUF_INITIALIZER;
+    int r;
+
+    if (days <= 0 || !cdata->comp_flags.recurring) return 0;
+
+    r = sqldb_exec(caldavdb->db, CMD_GETOCCWINDOW, bval,
+                   &occwindow_cb, &win_end);
+
+    if (!r) {
+        /* Slide the window once half of its future has passed */
+        icaltimezone *utc = icaltimezone_get_utc_timezone();
+        icaltimetype due =
+            icaltime_from_timet_with_zone(time(NULL) + days * 43200, 0, utc);
+
+        if (!buf_len(&win_end) ||
+            strcmp(buf_cstring(&win_end), icaltime_as_ical_string(due)) < 0) {
+            r = caldav_write_occurrences(caldavdb, cdata, ical);
+        }
+    }
+
+    buf_free(&win_end);
+    return r;
+}
+
+#define CMD_CHECKOCC \
+    "SELECT EXISTS ( SELECT 1 FROM ical_occurrences" \
+    "  WHERE objid = :objid AND dtend > :after AND dtstart < :before )" \
+    " FROM ical_occwindow" \
+    " WHERE objid = :objid AND win_start <= :after AND win_end >= :before;"
+
+static int checkocc_cb(sqlite3_stmt *stmt, void *rock)
+{
+    int *occurs = (int *) rock;
+
+    *occurs = sqlite3_column_int(stmt, 0);
+
+    return 0;
+}
+
+EXPORTED int caldav_check_occurrences(struct caldav_db *caldavdb,
+                                      struct caldav_data *cdata,
+                                      time_t after, time_t before)
+{
+    struct sqldb_bindval bval[] = {
+        { ":objid",  SQLITE_INTEGER, { .i = cdata->dav.rowid } },
+        { ":after",  SQLITE_TEXT,    { .s = NULL             } },
+        { ":before", SQLITE_TEXT,    { .s = NULL             } },
+        { NULL,      SQLITE_NULL,    { .s = NULL             } } };
+    icaltimezone *utc = icaltimezone_get_utc_timezone();
+    char *safter;
+    int occurs = -1;
+
+    if (!cdata->comp_flags.recurring) return -1;
+
+    safter = xstrdup(icaltime_as_ical_string(
+                         icaltime_from_timet_with_zone(after, 0, utc)));
+    bval[1].val.s = safter;
+    bval[2].val.s =
+        icaltime_as_ical_string(icaltime_from_timet_with_zone(before, 0, utc));
+
+    if (sqldb_exec(caldavdb->db, CMD_CHECKOCC, bval, &checkocc_cb, &occurs))
+        occurs = -1;
+
+    free(safter);
+    return occurs;
+}
+
 EXPORTED int caldav_writeentry(struct caldav_db *caldavdb, struct caldav_data *cdata,
                                icalcomponent *ical)
 {
@@ -731,7 +957,10 @@ EXPORTED int caldav_writeentry(struct caldav_db *caldavdb, struct caldav_data *c
     cdata->comp_flags.recurring = recurring;
     cdata->comp_flags.mattach = mattach;
     
-    return caldav_write(caldavdb, cdata);
+    int r = caldav_write(caldavdb, cdata);
+    if (!r) r = caldav_write_occurrences(caldavdb, cdata, ical);
+
+    return r;
 }
 
 
@@ -125,6 +125,13 @@ int caldav_lookup_resource(struct caldav_db *caldavdb,
                            struct caldav_data **result,
                            int tombstones);
 
+/* process each live entry of 'resources' in 'mailbox' with cb(),
+   batched into a few queries and in IMAP uid order within each */
+int caldav_lookup_resources(struct caldav_db *caldavdb,
+                            const char *mailbox,
+                            const strarray_t *resources,
+                            caldav_cb_t *cb, void *rock);
+
 /* lookup an entry from 'caldavdb' by mailbox and IMAP uid
    (optionally inside a transaction for updates) */
 int caldav_lookup_imapuid(struct caldav_db *caldavdb,
@@ -154,6 +161,23 @@ int caldav_write(struct caldav_db *caldavdb, struct caldav_data *cdata);
 int caldav_writeentry(struct caldav_db *caldavdb, struct caldav_data *cdata,
                       icalcomponent *ical);
 
+/* (re)build the occurrence index of a recurring entry, covering
+ * caldav_occurrence_window days either side of now */
+int caldav_write_occurrences(struct caldav_db *caldavdb,
+                             struct caldav_data *cdata, icalcomponent *ical);
+
+/* rebuild the occurrence index of an entry if its window is
+ * missing or more than half way used up */
+int caldav_refresh_occurrences(struct caldav_db *caldavdb,
+                               struct caldav_data *cdata, icalcomponent *ical);
+
+/* check the occurrence index of an entry for any occurrence
+ * overlapping 'after' to 'before'.  Returns 1 if there is one, 0 if
+ * there is none, or -1 if the index doesn't cover the range. */
+int caldav_check_occurrences(struct caldav_db *caldavdb,
+                             struct caldav_data *cdata,
+                             time_t after, time_t before);
+
 /* delete an entry from 'caldavdb' */
 int caldav_delete(struct caldav_db *caldavdb, unsigned rowid);
 
@@ -293,6 +293,33 @@ EXPORTED int carddav_lookup_resource(struct carddav_db *carddavdb,
 }
 
 
+#define CMD_SELRSRCS CMD_GETFIELDS \
+    " WHERE mailbox = :mailbox AND" DAV_RESOURCE_INLIST \
+    " AND alive = 1 ORDER BY imap_uid;"
+
+EXPORTED int carddav_lookup_resources(struct carddav_db *carddavdb,
+                                      const char *mailbox,
+                                      const strarray_t *resources,
+                                      carddav_cb_t *cb, void *rock)
+{
+    struct sqldb_bindval bval[DAV_RESOURCE_BATCH + 2];
+    struct carddav_data cdata;
+    struct read_rock rrock = { carddavdb, &cdata, 0, cb, rock };
+    int i = 0, r = 0;
+
+    bval[0].name = ":mailbox";
+    bval[0].type = SQLITE_TEXT;
+    bval[0].val.s = mailbox;
+
+    while (!r && i < strarray_size(resources)) {
+        i = dav_bind_resources(bval + 1, resources, i);
+        r = sqldb_exec(carddavdb->db, CMD_SELRSRCS, bval, &read_cb, &rrock);
+    }
+
+    return r;
+}
+
+
 #define CMD_SELIMAPUID CMD_GETFIELDS \
     " WHERE mailbox = :mailbox AND imap_uid = :imap_uid;"
 
@@ -627,6 +654,88 @@ static int carddav_write_groups(struct carddav_db *carddavdb, int rowid, const s
     return 0;
 }
 
+#define CMD_DELETE_SEARCH "DELETE FROM vcard_search WHERE objid = :objid"
+#define CMD_INSERT_SEARCH                                               \
+    "INSERT INTO vcard_search ( objid, lastname, firstname, prefix,"    \
+    "  suffix, company, department, jobtitle )"                         \
+    " VALUES ( :objid, :lastname, :firstname, :prefix,"                 \
+    "  :suffix, :company, :department, :jobtitle );"
+
+/* derive the fields the same way jmap_contact_from_vcard() does */
+static int carddav_write_search(struct carddav_db *carddavdb, int rowid,
+                                struct vparse_card *vcard)
+{
+    const strarray_t *n = vparse_multival(vcard, "n");
+    const strarray_t *org = vparse_multival(vcard, "org");
+    strarray_t empty = STRARRAY_INITIALIZER;
+    struct buf firstname = BUF_INITIALIZER;
+    const char *jobtitle;
+    int r;
+
+    if (!n) n = &empty;
+    if (!org) org = &empty;
+
+    /* firstName has the middle names mashed into it */
+    buf_setcstr(&firstname, strarray_safenth(n, 1));
+    if (*strarray_safenth(n, 2)) {
+        buf_putc(&firstname, ' ');
+        buf_appendcstr(&firstname, strarray_safenth(n, 2));
+    }
+
+    /* jobTitle used to be stored in ORG[2] */
+    jobtitle = vparse_stringval(vcard, "title");
+    if (!jobtitle) jobtitle = strarray_safenth(org, 2);
+
+    struct sqldb_bindval bval[] = {
+        { ":objid",      SQLITE_INTEGER, { .i = rowid                      } },
+        { ":lastname",   SQLITE_TEXT,    { .s = strarray_safenth(n, 0)     } },
+        { ":firstname",  SQLITE_TEXT,    { .s = buf_cstring(&firstname)    } },
+        { ":prefix",     SQLITE_TEXT,    { .s = strarray_safenth(n, 3)     } },
+        { ":suffix",     SQLITE_TEXT,    { .s = strarray_safenth(n, 4)     } },
+        { ":company",    SQLITE_TEXT,    { .s = strarray_safenth(org, 0)   } },
+        { ":department", SQLITE_TEXT,    { .s = strarray_safenth(org, 1)   } },
+        { ":jobtitle",   SQLITE_TEXT,    { .s = jobtitle                   } },
+        { NULL,          SQLITE_NULL,    { .s = NULL                       } } };
+
+    r = sqldb_exec(carddavdb->db, CMD_DELETE_SEARCH, bval, NULL, NULL);
+    if (!r) r = sqldb_exec(carddavdb->db, CMD_INSERT_SEARCH, bval, NULL, NULL);
+
+    buf_free(&firstname);
+    return r;
+}
+
+#define CMD_GETSEARCH                                                   \
+    "SELECT lastname, firstname, prefix, suffix,"                       \
+    "  company, department, jobtitle"                                   \
+    " FROM vcard_search WHERE objid = :objid;"
+
+static int getsearch_cb(sqlite3_stmt *stmt, void *rock)
+{
+    strarray_t *fields = (strarray_t *)rock;
+    int i;
+
+    for (i = 0; i < CARDDAV_SEARCH_NUMFIELDS; i++) {
+        const char *val = (const char *) sqlite3_column_text(stmt, i);
+        strarray_set(fields, i, val ? val : "");
+    }
+    return 0;
+}
+
+EXPORTED int carddav_get_search(struct carddav_db *carddavdb, unsigned rowid,
+                                strarray_t *fields)
+{
+    struct sqldb_bindval bval[] = {
+        { ":objid", SQLITE_INTEGER, { .i = rowid } },
+        { NULL,     SQLITE_NULL,    { .s = NULL  } } };
+    int r;
+
+    strarray_truncate(fields, 0);
+    r = sqldb_exec(carddavdb->db, CMD_GETSEARCH, bval, &getsearch_cb, fields);
+    if (!r && !strarray_size(fields)) r = CYRUSDB_NOTFOUND;
+
+    return r;
+}
+
 #define CMD_INSERT                                                      \
     "INSERT INTO vcard_objs ("                                          \
     "  alive, creationdate, mailbox, resource, imap_uid, modseq,"       \
@@ -873,6 +982,7 @@ EXPORTED int carddav_writecard(struct carddav_db *carddavdb,
     int r = carddav_write(carddavdb, cdata);
     if (!r) r = carddav_write_emails(carddavdb, cdata->dav.rowid, &emails);
     if (!r) r = carddav_write_groups(carddavdb, cdata->dav.rowid, &member_uids);
+    if (!r) r = carddav_write_search(carddavdb, cdata->dav.rowid, vcard);
 
     strarray_fini(&emails);
     strarray_fini(&member_uids);
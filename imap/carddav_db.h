@@ -70,6 +70,19 @@ struct carddav_data {
 
 typedef int carddav_cb_t(void *rock, struct carddav_data *cdata);
 
+/* Contact fields kept for Contact/query, in the order of
+   carddav_get_search() results */
+enum {
+    CARDDAV_SEARCH_LASTNAME = 0,
+    CARDDAV_SEARCH_FIRSTNAME,
+    CARDDAV_SEARCH_PREFIX,
+    CARDDAV_SEARCH_SUFFIX,
+    CARDDAV_SEARCH_COMPANY,
+    CARDDAV_SEARCH_DEPARTMENT,
+    CARDDAV_SEARCH_JOBTITLE,
+    CARDDAV_SEARCH_NUMFIELDS
+};
+
 
 /* prepare for carddav operations in this process */
 int carddav_init(void);
@@ -91,6 +104,13 @@ int carddav_lookup_resource(struct carddav_db *carddavdb,
                            struct carddav_data **result,
                            int tombstones);
 
+/* process each live entry of 'resources' in 'mailbox' with cb(),
+   batched into a few queries and in IMAP uid order within each */
+int carddav_lookup_resources(struct carddav_db *carddavdb,
+                             const char *mailbox,
+                             const strarray_t *resources,
+                             carddav_cb_t *cb, void *rock);
+
 /* lookup an entry from 'carddavdb' by mailbox and IMAP uid
    (optionally inside a transaction for updates) */
 int carddav_lookup_imapuid(struct carddav_db *carddavdb,
@@ -136,6 +156,11 @@ int carddav_get_updates(struct carddav_db *carddavdb,
 int carddav_foreach(struct carddav_db *carddavdb, const char *mailbox,
                     carddav_cb_t *cb, void *rock);
 
+/* fetch the search fields of card 'rowid' into 'fields', indexed by
+   CARDDAV_SEARCH_*.  Returns CYRUSDB_NOTFOUND if none were written */
+int carddav_get_search(struct carddav_db *carddavdb, unsigned rowid,
+                       strarray_t *fields);
+
 /* write an entry to 'carddavdb' */
 int carddav_write(struct carddav_db *carddavdb, struct carddav_data *cdata);
 
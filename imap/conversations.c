@@ -100,6 +100,10 @@
 
 #define DB config_conversations_db
 
+/* G and <msgid> records, in their own database if it's split off */
+#define GUIDDB(state)  ((state)->guiddb ? (state)->guiddb : (state)->db)
+#define GUIDTXN(state) ((state)->guiddb ? &(state)->guidtxn : &(state)->txn)
+
 #define CONVERSATIONS_VERSION 0
 
 struct conversations_open *open_conversations;
@@ -197,6 +201,123 @@ static int _init_counted(struct conversations_state *state,
     return 0;
 }
 
+struct moveguids_rock {
+    struct db *from;
+    struct txn **fromtxn;
+    struct db *to;
+    struct txn **totxn;
+    unsigned long count;
+};
+
+static int moveguids_cb(void *rock,
+                        const char *key, size_t keylen,
+                        const char *data, size_t datalen)
+{
+    struct moveguids_rock *mrock = (struct moveguids_rock *) rock;
+    int r;
+
+    r = cyrusdb_store(mrock->to, key, keylen, data, datalen, mrock->totxn);
+    if (!r) r = cyrusdb_delete(mrock->from, key, keylen, mrock->fromtxn, 1);
+    if (!r) mrock->count++;
+
+    return r;
+}
+
+/* Move any G and <msgid> records into the guid database (split) or
+ * back into the main one, and commit both right away so the move
+ * isn't tangled up with whatever the caller does next. */
+static int conversations_moveguids(struct conversations_state *state,
+                                   int split)
+{
+    struct moveguids_rock rock;
+    int r;
+
+    if (split) {
+        rock.from = state->db;
+        rock.fromtxn = &state->txn;
+        rock.to = state->guiddb;
+        rock.totxn = &state->guidtxn;
+    }
+    else {
+        rock.from = state->guiddb;
+        rock.fromtxn = &state->guidtxn;
+        rock.to = state->db;
+        rock.totxn = &state->txn;
+    }
+    rock.count = 0;
+
+    r = cyrusdb_foreach(rock.from, "G", 1, NULL, moveguids_cb,
+                        &rock, rock.fromtxn);
+    if (!r)
+        r = cyrusdb_foreach(rock.from, "<", 1, NULL, moveguids_cb,
+                            &rock, rock.fromtxn);
+    if (!rock.count)
+        return r;
+
+    /* the copies must be safe before the originals go */
+    if (!r && *rock.totxn)
+        r = cyrusdb_commit(rock.to, *rock.totxn);
+    else if (*rock.totxn)
+        cyrusdb_abort(rock.to, *rock.totxn);
+    *rock.totxn = NULL;
+
+    if (!r && *rock.fromtxn)
+        r = cyrusdb_commit(rock.from, *rock.fromtxn);
+    else if (*rock.fromtxn)
+        cyrusdb_abort(rock.from, *rock.fromtxn);
+    *rock.fromtxn = NULL;
+
+    if (r)
+        syslog(LOG_ERR, "IOERROR: conversations: failed to move guid records "
+                        "for %s: %s", state->path, cyrusdb_strerror(r));
+    else
+        syslog(LOG_NOTICE, "conversations: moved %lu guid records %s %s%s",
+                           rock.count, split ? "into" : "out of",
+                           state->path, CONV_GUIDS_SUFFIX);
+
+    return r;
+}
+
+/* Open the separate G and <msgid> database if conversations_split_guids
+ * is set, or fold an existing one back into the main database if not */
+static int conversations_open_guids(struct conversations_state *state)
+{
+    int split = config_getswitch(IMAPOPT_CONVERSATIONS_SPLIT_GUIDS);
+    char *gfname = strconcat(state->path, CONV_GUIDS_SUFFIX, (char *)NULL);
+    struct stat sbuf;
+    int r = 0;
+
+    if (!split && stat(gfname, &sbuf))
+        goto done;
+
+    r = cyrusdb_open(DB, gfname, CYRUSDB_CREATE | CYRUSDB_CONVERT,
+                     &state->guiddb);
+    if (r || !state->guiddb) {
+        syslog(LOG_ERR, "IOERROR: conversations: failed to open %s: %s",
+                        gfname, cyrusdb_strerror(r));
+        state->guiddb = NULL;
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    r = conversations_moveguids(state, split);
+
+    if (r || !split) {
+        if (state->guidtxn)
+            cyrusdb_abort(state->guiddb, state->guidtxn);
+        state->guidtxn = NULL;
+        cyrusdb_close(state->guiddb);
+        state->guiddb = NULL;
+    }
+
+    if (!r && !split)
+        cyrusdb_unlink(DB, gfname, 0);
+
+done:
+    free(gfname);
+    return r;
+}
+
 int _saxfolder(int type, struct dlistsax_data *d)
 {
     struct conversations_open *open = (struct conversations_open *)d->rock;
@@ -230,6 +351,17 @@ EXPORTED int conversations_open_path(const char *fname, const char *userid, stru
     }
 
     open->s.path = xstrdup(fname);
+
+    r = conversations_open_guids(&open->s);
+    if (r) {
+        if (open->s.txn)
+            cyrusdb_abort(open->s.db, open->s.txn);
+        cyrusdb_close(open->s.db);
+        free(open->s.path);
+        free(open);
+        return r;
+    }
+
     open->next = open_conversations;
     open_conversations = open;
 
@@ -253,7 +385,8 @@ EXPORTED int conversations_open_path(const char *fname, const char *userid, stru
         open->s.annotmboxname = xstrdup(CONVSPLITFOLDER);
 
     /* create the status cache */
-    construct_hash_table(&open->s.folderstatus, open->s.folder_names->count/4+4, 0);
+    construct_hashoa_table(&open->s.folderstatus,
+                           open->s.folder_names->count/4+4);
 
     *statep = &open->s;
 
@@ -340,10 +473,235 @@ static void _conv_remove(struct conversations_state *state)
     fatal("unknown conversation db closed", EC_SOFTWARE);
 }
 
+/*
+ * Write-behind cache of B records.
+ *
+ * A conversations state often stays open across many mailbox commits:
+ * for a whole IMAP command or JMAP request when the caller holds the
+ * user's database.  Without this, a STORE over every message in a big
+ * conversation would write its record into the database once per
+ * message.  Instead the encoded record is kept here, keyed by the B
+ * key, replaced by each change and written once when the state is
+ * committed, or early if the cache grows past
+ * conversations_writebehind_size.  An empty value is a pending delete.
+ * Every read of a B record must go through conv_fetch_b(), and
+ * anything iterating the database must flush first.
+ */
+static void flushcache_key_cb(const char *key,
+                              void *data __attribute__((unused)),
+                              void *rock)
+{
+    strarray_append((strarray_t *) rock, key);
+}
+
+static void free_cachebuf(void *data)
+{
+    buf_free((struct buf *) data);
+    free(data);
+}
+
+/* write the cached records out in key order, so the database sees
+ * one sequential pass rather than a write at every hash position */
+static int conversations_flushcache(struct conversations_state *state)
+{
+    strarray_t keys = STRARRAY_INITIALIZER;
+    int i, r = 0;
+
+    if (!state->convcache.count) goto done;
+
+    hashoa_enumerate(&state->convcache, flushcache_key_cb, &keys);
+    strarray_sort(&keys, cmpstringp_raw);
+
+    for (i = 0; i < strarray_size(&keys); i++) {
+        const char *key = strarray_nth(&keys, i);
+        const struct buf *val = hashoa_lookup(key, &state->convcache);
+
+        if (val->len)
+            r = cyrusdb_store(state->db, key, strlen(key),
+                              val->s, val->len, &state->txn);
+        else
+            r = cyrusdb_delete(state->db, key, strlen(key), &state->txn, 1);
+
+        if (r) {
+            syslog(LOG_ERR, "IOERROR: conversations: failed to write %s to %s: %s",
+                   key, state->path, cyrusdb_strerror(r));
+            break;
+        }
+    }
+
+done:
+    strarray_fini(&keys);
+    free_hashoa_table(&state->convcache, free_cachebuf);
+    state->convcache_size = 0;
+
+    return r;
+}
+
+/* how much may be held in memory before writing out */
+static size_t conversations_cachelimit(struct conversations_state *state)
+{
+    size_t limit = 1024 * (size_t)
+        config_getint(IMAPOPT_CONVERSATIONS_WRITEBEHIND_SIZE);
+
+    if (limit && state->bulk) {
+        size_t bulk = 1024 * (size_t)
+            config_getint(IMAPOPT_CONVERSATIONS_BULK_SIZE);
+        if (bulk > limit) limit = bulk;
+    }
+
+    return limit;
+}
+
+static int conv_fetch_b(struct conversations_state *state,
+                        const char *key, size_t keylen,
+                        const char **datap, size_t *datalenp)
+{
+    const struct buf *val = NULL;
+
+    if (state->convcache.count && key[keylen] == '\0')
+        val = hashoa_lookup(key, &state->convcache);
+
+    if (!val)
+        return cyrusdb_fetch(state->db, key, keylen,
+                             datap, datalenp, &state->txn);
+
+    if (!val->len)
+        return CYRUSDB_NOTFOUND;
+
+    *datap = val->s;
+    *datalenp = val->len;
+    return CYRUSDB_OK;
+}
+
+/* store a B record, or delete it if datalen is zero */
+static int conv_write_b(struct conversations_state *state,
+                        const char *key, size_t keylen,
+                        const char *data, size_t datalen)
+{
+    size_t limit = conversations_cachelimit(state);
+    char ckey[CONVERSATION_ID_STRMAX+2];
+    struct buf *val, *old;
+
+    if (!limit || keylen >= sizeof(ckey)) {
+        /* a key we'd never cache, but make sure it's not shadowed */
+        if (state->convcache.count) {
+            int r = conversations_flushcache(state);
+            if (r) return r;
+        }
+        if (datalen)
+            return cyrusdb_store(state->db, key, keylen,
+                                 data, datalen, &state->txn);
+        return cyrusdb_delete(state->db, key, keylen, &state->txn, 1);
+    }
+
+    memcpy(ckey, key, keylen);
+    ckey[keylen] = '\0';
+
+    val = hashoa_lookup(ckey, &state->convcache);
+    if (val) {
+        state->convcache_size -= val->len;
+        buf_setmap(val, data, datalen);
+    }
+    else {
+        val = xzmalloc(sizeof(struct buf));
+        buf_setmap(val, data, datalen);
+        old = hashoa_insert(ckey, val, &state->convcache);
+        assert(old == val);
+        state->convcache_size += keylen;
+    }
+    state->convcache_size += datalen;
+
+    if (state->convcache_size > limit)
+        return conversations_flushcache(state);
+
+    return 0;
+}
+
+/*
+ * While rebuilding, G records are all new (conversations_zero_counts
+ * has just wiped them) and arrive in mailbox order, which is random
+ * order for the database.  So they're gathered here and stored sorted
+ * by key once enough have built up or the state is committed.  A
+ * delete, or anything reading G records, writes the batch out first.
+ */
+struct guid_pending {
+    size_t keylen;
+    size_t vallen;
+    char data[];        /* key, then value */
+};
+
+static int guid_pending_cmp(const void **a, const void **b)
+{
+    const struct guid_pending *pa = (const struct guid_pending *) *a;
+    const struct guid_pending *pb = (const struct guid_pending *) *b;
+
+    return bsearch_ncompare_raw(pa->data, pa->keylen, pb->data, pb->keylen);
+}
+
+static void conversations_dropguids(struct conversations_state *state)
+{
+    struct guid_pending *item;
+
+    while ((item = ptrarray_pop(&state->guidbatch)))
+        free(item);
+    ptrarray_fini(&state->guidbatch);
+    state->guidbatch_size = 0;
+}
+
+static int conversations_flushguids(struct conversations_state *state)
+{
+    int i, r = 0;
+
+    if (!state->guidbatch.count) return 0;
+
+    ptrarray_sort(&state->guidbatch, guid_pending_cmp);
+
+    for (i = 0; i < state->guidbatch.count; i++) {
+        struct guid_pending *item = ptrarray_nth(&state->guidbatch, i);
+
+        r = cyrusdb_store(GUIDDB(state), item->data, item->keylen,
+                          item->data + item->keylen, item->vallen,
+                          GUIDTXN(state));
+        if (r) {
+            syslog(LOG_ERR, "IOERROR: conversations: failed to write %.*s to %s: %s",
+                   (int) item->keylen, item->data, state->path,
+                   cyrusdb_strerror(r));
+            break;
+        }
+    }
+
+    conversations_dropguids(state);
+
+    return r;
+}
+
+static int conversations_batchguid(struct conversations_state *state,
+                                   const struct buf *key,
+                                   const struct buf *val)
+{
+    struct guid_pending *item =
+        xmalloc(sizeof(struct guid_pending) + key->len + val->len);
+
+    item->keylen = key->len;
+    item->vallen = val->len;
+    memcpy(item->data, key->s, key->len);
+    memcpy(item->data + key->len, val->s, val->len);
+    ptrarray_append(&state->guidbatch, item);
+    state->guidbatch_size += sizeof(struct guid_pending) + key->len + val->len;
+
+    if (state->guidbatch_size > conversations_cachelimit(state))
+        return conversations_flushguids(state);
+
+    return 0;
+}
+
 static void conversations_abortcache(struct conversations_state *state)
 {
     /* still gotta clean up */
-    free_hash_table(&state->folderstatus, free);
+    free_hashoa_table(&state->folderstatus, free);
+    free_hashoa_table(&state->convcache, free_cachebuf);
+    state->convcache_size = 0;
+    conversations_dropguids(state);
 }
 
 static void commitstatus_cb(const char *key, void *data, void *rock)
@@ -358,10 +716,16 @@ static void commitstatus_cb(const char *key, void *data, void *rock)
     sync_log_mailbox(key+1); /* skip the leading F */
 }
 
-static void conversations_commitcache(struct conversations_state *state)
+static int conversations_commitcache(struct conversations_state *state)
 {
-    hash_enumerate(&state->folderstatus, commitstatus_cb, state);
-    free_hash_table(&state->folderstatus, free);
+    int r = conversations_flushcache(state);
+    int r2 = conversations_flushguids(state);
+    if (!r) r = r2;
+
+    hashoa_enumerate(&state->folderstatus, commitstatus_cb, state);
+    free_hashoa_table(&state->folderstatus, free);
+
+    return r;
 }
 
 EXPORTED int conversations_abort(struct conversations_state **statep)
@@ -375,6 +739,12 @@ EXPORTED int conversations_abort(struct conversations_state **statep)
     /* clean up hashes */
     conversations_abortcache(state);
 
+    if (state->guiddb) {
+        if (state->guidtxn)
+            cyrusdb_abort(state->guiddb, state->guidtxn);
+        cyrusdb_close(state->guiddb);
+    }
+
     if (state->db) {
         if (state->txn)
             cyrusdb_abort(state->db, state->txn);
@@ -396,12 +766,26 @@ EXPORTED int conversations_commit(struct conversations_state **statep)
     *statep = NULL;
 
     /* commit cache, writes to to DB */
-    conversations_commitcache(state);
+    r = conversations_commitcache(state);
+
+    if (state->guiddb) {
+        if (state->guidtxn) {
+            if (r)
+                cyrusdb_abort(state->guiddb, state->guidtxn);
+            else
+                r = cyrusdb_commit(state->guiddb, state->guidtxn);
+        }
+        cyrusdb_close(state->guiddb);
+    }
 
     /* finally it's safe to commit the DB itself */
     if (state->db) {
-        if (state->txn)
-            r = cyrusdb_commit(state->db, state->txn);
+        if (state->txn) {
+            if (r)
+                cyrusdb_abort(state->db, state->txn);
+            else
+                r = cyrusdb_commit(state->db, state->txn);
+        }
         cyrusdb_close(state->db);
     }
 
@@ -468,10 +852,10 @@ static int _conversations_set_key(struct conversations_state *state,
     }
     buf_printf(&buf, " %lu", stamp);
 
-    r = cyrusdb_store(state->db,
+    r = cyrusdb_store(GUIDDB(state),
                       key, keylen,
                       buf.s, buf.len,
-                      &state->txn);
+                      GUIDTXN(state));
 
     buf_free(&buf);
     if (r)
@@ -593,10 +977,10 @@ EXPORTED int conversations_get_msgid(struct conversations_state *state,
     if (r)
         return r;
 
-    r = cyrusdb_fetch(state->db,
+    r = cyrusdb_fetch(GUIDDB(state),
                       msgid, keylen,
                       &data, &datalen,
-                      &state->txn);
+                      GUIDTXN(state));
 
     if (r == CYRUSDB_NOTFOUND)
         return 0; /* not an error, but nothing more to do */
@@ -773,10 +1157,10 @@ EXPORTED int conversation_setstatus(struct conversations_state *state,
     char *key = strconcat("F", mboxname, (char *)NULL);
     conv_status_t *cachestatus = NULL;
 
-    cachestatus = hash_lookup(key, &state->folderstatus);
+    cachestatus = hashoa_lookup(key, &state->folderstatus);
     if (!cachestatus) {
         cachestatus = xzmalloc(sizeof(conv_status_t));
-        hash_insert(key, cachestatus, &state->folderstatus);
+        hashoa_insert(key, cachestatus, &state->folderstatus);
     }
 
     /* either way it's in the hash, update the value */
@@ -856,20 +1240,289 @@ static void conv_to_buf(conversation_t *conv, struct buf *buf, int flagcount)
     dlist_free(&dl);
 }
 
+/*
+ * Binary B records.  The first byte is 0x80 | version, which can't be
+ * mistaken for the leading digit of a text record, so both kinds can
+ * live in the same database and text records are converted as they
+ * are next saved.  The counters come first at fixed offsets:
+ *
+ *   u8 version, u64 modseq, u64 createdmodseq,
+ *   u32 num_records, u32 exists, u32 unseen, u32 size,
+ *   u8 nflags, nflags * u32 counts
+ *
+ * followed by the lists, each preceded by its length as a varint:
+ *
+ *   folders: varint number, u64 modseq, u32 num_records, u32 exists,
+ *            u32 unseen
+ *   senders: str name, str route, str mailbox, str domain,
+ *            u32 lastseen, u32 exists
+ *   str subject (not a list)
+ *   threads: guid, u32 exists, u32 internaldate
+ *
+ * A str is a varint of its length plus one (zero for NIL) and then the
+ * bytes.  Integers are in network byte order.
+ */
+#define CONV_BINARY_VERSION 1
+#define CONV_BINARY_HEADERLEN (1 + 8 + 8 + 4 * 4)
+
+static void conv_putvarint(struct buf *buf, uint64_t v)
+{
+    while (v >= 0x80) {
+        buf_putc(buf, (v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    buf_putc(buf, v);
+}
+
+static void conv_putstr(struct buf *buf, const char *s)
+{
+    if (!s) {
+        buf_putc(buf, 0);
+        return;
+    }
+    size_t len = strlen(s);
+    conv_putvarint(buf, len + 1);
+    buf_appendmap(buf, s, len);
+}
+
+static int conv_getvarint(const char **pp, const char *end, uint64_t *vp)
+{
+    const char *p = *pp;
+    uint64_t v = 0;
+    int shift;
+
+    for (shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char c = *p++;
+        v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *pp = p;
+            *vp = v;
+            return 0;
+        }
+    }
+
+    return IMAP_MAILBOX_BADFORMAT;
+}
+
+/* returns a copy in *sp, or NULL for NIL */
+static int conv_getstr(const char **pp, const char *end, char **sp)
+{
+    uint64_t len;
+
+    if (conv_getvarint(pp, end, &len)) return IMAP_MAILBOX_BADFORMAT;
+    if (!len) {
+        *sp = NULL;
+        return 0;
+    }
+    if (--len > (uint64_t) (end - *pp)) return IMAP_MAILBOX_BADFORMAT;
+
+    *sp = xstrndup(*pp, len);
+    *pp += len;
+
+    return 0;
+}
+
+static void conv_to_binary(conversation_t *conv, struct buf *buf, int flagcount)
+{
+    const conv_folder_t *folder;
+    const conv_sender_t *sender;
+    const conv_thread_t *thread;
+    char guid[MESSAGE_GUID_SIZE];
+    int i, n;
+
+    buf_putc(buf, 0x80 | CONV_BINARY_VERSION);
+    buf_appendbit64(buf, conv->modseq);
+    buf_appendbit64(buf, conv->createdmodseq);
+    buf_appendbit32(buf, conv->num_records);
+    buf_appendbit32(buf, conv->exists);
+    buf_appendbit32(buf, conv->unseen);
+    buf_appendbit32(buf, conv->size);
+
+    if (flagcount > (int) VECTOR_SIZE(conv->counts))
+        flagcount = VECTOR_SIZE(conv->counts);
+    buf_putc(buf, flagcount);
+    for (i = 0; i < flagcount; i++)
+        buf_appendbit32(buf, conv->counts[i]);
+
+    for (n = 0, folder = conv->folders; folder; folder = folder->next)
+        if (folder->num_records) n++;
+    conv_putvarint(buf, n);
+    for (folder = conv->folders; folder; folder = folder->next) {
+        if (!folder->num_records)
+            continue;
+        conv_putvarint(buf, folder->number);
+        buf_appendbit64(buf, folder->modseq);
+        buf_appendbit32(buf, folder->num_records);
+        buf_appendbit32(buf, folder->exists);
+        buf_appendbit32(buf, folder->unseen);
+    }
+
+    /* don't ever store more than 100 senders (well, 99, as the text
+     * records do) */
+    for (n = 0, sender = conv->senders; sender; sender = sender->next)
+        if (sender->exists && n < 99) n++;
+    conv_putvarint(buf, n);
+    for (i = 0, sender = conv->senders; sender && i < n; sender = sender->next) {
+        if (!sender->exists)
+            continue;
+        conv_putstr(buf, sender->name);
+        conv_putstr(buf, sender->route);
+        conv_putstr(buf, sender->mailbox);
+        conv_putstr(buf, sender->domain);
+        buf_appendbit32(buf, sender->lastseen);
+        buf_appendbit32(buf, sender->exists);
+        i++;
+    }
+
+    conv_putstr(buf, conv->subject);
+
+    for (n = 0, thread = conv->thread; thread; thread = thread->next)
+        if (thread->exists) n++;
+    conv_putvarint(buf, n);
+    for (thread = conv->thread; thread; thread = thread->next) {
+        if (!thread->exists)
+            continue;
+        message_guid_export(&thread->guid, guid);
+        buf_appendmap(buf, guid, MESSAGE_GUID_SIZE);
+        buf_appendbit32(buf, thread->exists);
+        buf_appendbit32(buf, thread->internaldate);
+    }
+}
+
+static int conv_parse_binary(const char *data, size_t datalen,
+                             conversation_t *conv, int flags)
+{
+    const char *p = data + 1;
+    const char *end = data + datalen;
+    conv_thread_t **nextthread = &conv->thread;
+    uint64_t count, i, num;
+    int nflags;
+    int r = IMAP_MAILBOX_BADFORMAT;
+
+#define NEED(n) do { if ((size_t) (end - p) < (size_t) (n)) goto done; } while (0)
+#define GET32(v) do { NEED(4); v = ntohl(*((bit32 *) p)); p += 4; } while (0)
+#define GET64(v) do { NEED(8); v = ntohll(*((bit64 *) p)); p += 8; } while (0)
+
+    if (datalen < CONV_BINARY_HEADERLEN + 1 ||
+        (unsigned char) data[0] != (0x80 | CONV_BINARY_VERSION))
+        return IMAP_MAILBOX_BADFORMAT;
+
+    GET64(conv->modseq);
+    GET64(conv->createdmodseq);
+    GET32(conv->num_records);
+    GET32(conv->exists);
+    GET32(conv->unseen);
+    conv->prev_unseen = conv->unseen;
+    GET32(conv->size);
+
+    NEED(1);
+    nflags = (unsigned char) *p++;
+    for (i = 0; i < (uint64_t) nflags; i++) {
+        uint32_t v;
+        GET32(v);
+        if (i < VECTOR_SIZE(conv->counts)) conv->counts[i] = v;
+    }
+
+    if (conv_getvarint(&p, end, &count)) goto done;
+    for (i = 0; i < count; i++) {
+        conv_folder_t *folder;
+        modseq_t modseq;
+        uint32_t num_records, exists, unseen;
+
+        if (conv_getvarint(&p, end, &num)) goto done;
+        GET64(modseq);
+        GET32(num_records);
+        GET32(exists);
+        GET32(unseen);
+        if (!(flags & CONV_WITHFOLDERS)) continue;
+
+        folder = conversation_get_folder(conv, num, 1);
+        folder->modseq = modseq;
+        folder->num_records = num_records;
+        folder->exists = folder->prev_exists = exists;
+        folder->unseen = unseen;
+    }
+
+    if (conv_getvarint(&p, end, &count)) goto done;
+    for (i = 0; i < count; i++) {
+        char *name = NULL, *route = NULL, *mailbox = NULL, *domain = NULL;
+        uint32_t lastseen = 0, exists = 0;
+        int bad = conv_getstr(&p, end, &name) ||
+                  conv_getstr(&p, end, &route) ||
+                  conv_getstr(&p, end, &mailbox) ||
+                  conv_getstr(&p, end, &domain) ||
+                  (size_t) (end - p) < 8;
+
+        if (!bad) {
+            GET32(lastseen);
+            GET32(exists);
+            if (flags & CONV_WITHSENDERS)
+                conversation_update_sender(conv, name, route, mailbox, domain,
+                                           lastseen, exists);
+        }
+        free(name);
+        free(route);
+        free(mailbox);
+        free(domain);
+        if (bad) goto done;
+    }
+
+    {
+        char *subject = NULL;
+        if (conv_getstr(&p, end, &subject)) goto done;
+        if (flags & CONV_WITHSUBJECT) conv->subject = subject;
+        else free(subject);
+    }
+
+    if (conv_getvarint(&p, end, &count)) goto done;
+    for (i = 0; i < count; i++) {
+        conv_thread_t *thread;
+
+        NEED(MESSAGE_GUID_SIZE + 8);
+        if (!(flags & CONV_WITHTHREAD)) {
+            p += MESSAGE_GUID_SIZE + 8;
+            continue;
+        }
+
+        thread = xzmalloc(sizeof(conv_thread_t));
+        message_guid_import(&thread->guid, p);
+        p += MESSAGE_GUID_SIZE;
+        GET32(thread->exists);
+        GET32(thread->internaldate);
+        *nextthread = thread;
+        nextthread = &thread->next;
+    }
+
+    r = 0;
+
+ done:
+#undef NEED
+#undef GET32
+#undef GET64
+    return r;
+}
+
 EXPORTED int conversation_store(struct conversations_state *state,
                        const char *key, int keylen,
                        conversation_t *conv)
 {
     struct buf buf = BUF_INITIALIZER;
+    int flagcount = state->counted_flags ? state->counted_flags->count : 0;
 
-    conv_to_buf(conv, &buf, state->counted_flags ? state->counted_flags->count : 0);
+    if (config_getswitch(IMAPOPT_CONVERSATIONS_BINARY_RECORDS))
+        conv_to_binary(conv, &buf, flagcount);
+    else
+        conv_to_buf(conv, &buf, flagcount);
 
     if (_sanity_check_counts(conv)) {
+        struct buf text = BUF_INITIALIZER;
+        conv_to_buf(conv, &text, flagcount);
         syslog(LOG_ERR, "IOERROR: conversations_audit on store: %s %.*s %.*s",
-               state->path, keylen, key, (int)buf.len, buf.s);
+               state->path, keylen, key, (int)text.len, text.s);
+        buf_free(&text);
     }
 
-    int r = cyrusdb_store(state->db, key, keylen, buf.s, buf.len, &state->txn);
+    int r = conv_write_b(state, key, keylen, buf.s, buf.len);
 
     buf_free(&buf);
 
@@ -934,7 +1587,7 @@ static int _conversation_save(struct conversations_state *state,
     }
     else {
         /* last existing record removed - clean up the 'B' record */
-        r = cyrusdb_delete(state->db, key, keylen, &state->txn, 1);
+        r = conv_write_b(state, key, keylen, NULL, 0);
     }
 
 
@@ -1031,7 +1684,7 @@ EXPORTED int conversation_getstatus(struct conversations_state *state,
     int r = 0;
     conv_status_t *cachestatus = NULL;
 
-    cachestatus = hash_lookup(key, &state->folderstatus);
+    cachestatus = hashoa_lookup(key, &state->folderstatus);
     if (cachestatus) {
         *status = *cachestatus;
         goto done;
@@ -1356,6 +2009,15 @@ EXPORTED int conversation_parse(const char *data, size_t datalen,
     bit64 version;
     int r;
 
+    if (datalen && (data[0] & 0x80)) {
+        r = conv_parse_binary(data, datalen, conv, flags);
+        if (r) return r;
+
+        conv->flags = flags;
+
+        return 0;
+    }
+
     r = parsenum(data, &rest, datalen, &version);
     if (r) return IMAP_MAILBOX_BADFORMAT;
 
@@ -1388,10 +2050,7 @@ EXPORTED int conversation_load_advanced(struct conversations_state *state,
     int r;
 
     snprintf(bkey, sizeof(bkey), "B" CONV_FMT, cid);
-    r = cyrusdb_fetch(state->db,
-                  bkey, strlen(bkey),
-                  &data, &datalen,
-                  &state->txn);
+    r = conv_fetch_b(state, bkey, strlen(bkey), &data, &datalen);
 
     if (r == CYRUSDB_NOTFOUND) {
         return IMAP_MAILBOX_NONEXISTENT;
@@ -1440,6 +2099,14 @@ static int _conversation_load_modseq(const char *data, int datalen,
     bit64 version = ~0ULL;
     int r;
 
+    /* binary records keep it at a fixed offset */
+    if (datalen >= CONV_BINARY_HEADERLEN && (*p & 0x80)) {
+        if ((unsigned char) *p != (0x80 | CONV_BINARY_VERSION))
+            return IMAP_MAILBOX_BADFORMAT;
+        *modseqp = ntohll(*((bit64 *) (p + 1)));
+        return 0;
+    }
+
     r = parsenum(p, &p, (end-p), &version);
     if (r || version != CONVERSATIONS_VERSION)
         return IMAP_MAILBOX_BADFORMAT;
@@ -1465,10 +2132,7 @@ EXPORTED int conversation_get_modseq(struct conversations_state *state,
     int r;
 
     snprintf(bkey, sizeof(bkey), "B" CONV_FMT, cid);
-    r = cyrusdb_fetch(state->db,
-                  bkey, strlen(bkey),
-                  &data, &datalen,
-                  &state->txn);
+    r = conv_fetch_b(state, bkey, strlen(bkey), &data, &datalen);
 
     if (r == CYRUSDB_NOTFOUND) {
         *modseqp = 0;
@@ -1777,7 +2441,7 @@ EXPORTED int conversations_guid_exists(struct conversations_state *state,
     int match = 0;
 
     char *key = strconcat("G", guidrep, (char *)NULL);
-    cyrusdb_foreach(state->db, key, strlen(key), NULL, _match1, &match, NULL);
+    cyrusdb_foreach(GUIDDB(state), key, strlen(key), NULL, _match1, &match, NULL);
     free(key);
 
     return match;
@@ -1921,8 +2585,11 @@ EXPORTED int conversations_guid_foreach(struct conversations_state *state,
     rock.cb = cb;
     rock.cbrock = cbrock;
 
+    int r = conversations_flushguids(state);
+    if (r) return r;
+
     char *key = strconcat("G", guidrep, (char *)NULL);
-    int r = cyrusdb_foreach(state->db, key, strlen(key), NULL, _guid_cb, &rock, NULL);
+    r = cyrusdb_foreach(GUIDDB(state), key, strlen(key), NULL, _guid_cb, &rock, NULL);
     free(key);
 
     return r;
@@ -1961,9 +2628,13 @@ static int conversations_guid_setitem(struct conversations_state *state,
     buf_appendcstr(&key, guidrep);
     size_t datalen = 0;
     const char *data;
+    int r = 0;
+
+    // a rebuild has wiped all the old records, nothing to upgrade
+    if (state->bulk) goto write;
 
     // check if we have to upgrade anything?
-    int r = cyrusdb_fetch(state->db, buf_base(&key), buf_len(&key), &data, &datalen, &state->txn);
+    r = cyrusdb_fetch(GUIDDB(state), buf_base(&key), buf_len(&key), &data, &datalen, GUIDTXN(state));
     if (!r && datalen) {
         int i;
         buf_putc(&key, ':');
@@ -1973,7 +2644,7 @@ static int conversations_guid_setitem(struct conversations_state *state,
         for (i = 0; i < strarray_size(old); i++) {
             buf_truncate(&key, 42); // trim back to the colon
             buf_appendcstr(&key, strarray_nth(old, i));
-            r = cyrusdb_store(state->db, buf_base(&key), buf_len(&key), "", 0, &state->txn);
+            r = cyrusdb_store(GUIDDB(state), buf_base(&key), buf_len(&key), "", 0, GUIDTXN(state));
             if (r) break;
         }
         strarray_free(old);
@@ -1982,10 +2653,11 @@ static int conversations_guid_setitem(struct conversations_state *state,
         buf_truncate(&key, 41); // trim back to original key
 
         /* remove the original key */
-        r = cyrusdb_delete(state->db, buf_base(&key), buf_len(&key), &state->txn, /*force*/0);
+        r = cyrusdb_delete(GUIDDB(state), buf_base(&key), buf_len(&key), GUIDTXN(state), /*force*/0);
         if (r) goto done;
     }
 
+write:
     buf_putc(&key, ':');
     buf_appendcstr(&key, item);
 
@@ -1997,13 +2669,19 @@ static int conversations_guid_setitem(struct conversations_state *state,
         buf_appendbit32(&val, system_flags);
         buf_appendbit32(&val, internal_flags);
         buf_appendbit64(&val, (bit64)internaldate);
-        r = cyrusdb_store(state->db, buf_base(&key), buf_len(&key),
-                                     buf_base(&val), buf_len(&val),
-                                     &state->txn);
+        if (state->bulk)
+            r = conversations_batchguid(state, &key, &val);
+        else
+            r = cyrusdb_store(GUIDDB(state), buf_base(&key), buf_len(&key),
+                                         buf_base(&val), buf_len(&val),
+                                         GUIDTXN(state));
         buf_free(&val);
     }
     else {
-        r = cyrusdb_delete(state->db, buf_base(&key), buf_len(&key), &state->txn, /*force*/1);
+        /* it may still be waiting in the batch */
+        r = conversations_flushguids(state);
+        if (!r)
+            r = cyrusdb_delete(GUIDDB(state), buf_base(&key), buf_len(&key), GUIDTXN(state), /*force*/1);
     }
 
 done:
@@ -2106,6 +2784,37 @@ static int conversations_set_guid(struct conversations_state *state,
     return r;
 }
 
+/*
+ * Is this the top-level Trash folder of its user?  Updates come one
+ * record at a time and a bulk expunge or move sends thousands in a row
+ * for the same mailbox, so remember the answer for the last name.
+ * Returns -1 for an unparseable name.
+ */
+static int conversations_is_trash(const char *mboxname)
+{
+    static char *lastname = NULL;
+    static int lastresult = 0;
+    mbname_t *mbname;
+    const strarray_t *boxes;
+
+    if (lastname && !strcmp(lastname, mboxname))
+        return lastresult;
+
+    mbname = mbname_from_intname(mboxname);
+    if (!mbname)
+        return -1;
+
+    boxes = mbname_boxes(mbname);
+    lastresult = (strarray_size(boxes) == 1 &&
+                  !strcmpsafe(strarray_nth(boxes, 0), "Trash"));
+    mbname_free(&mbname);
+
+    free(lastname);
+    lastname = xstrdup(mboxname);
+
+    return lastresult;
+}
+
 EXPORTED int conversations_update_record(struct conversations_state *cstate,
                                          struct mailbox *mailbox,
                                          const struct index_record *old,
@@ -2177,15 +2886,12 @@ EXPORTED int conversations_update_record(struct conversations_state *cstate,
 
     /* IRIS-2534: check if it's the trash folder - XXX - should be separate
      * conversation root or similar more useful method in future */
-    mbname_t *mbname = mbname_from_intname(mailbox->name);
-    if (!mbname)
+    is_trash = conversations_is_trash(mailbox->name);
+    if (is_trash < 0) {
+        free(delta_counts);
+        conversation_free(conv);
         return IMAP_MAILBOX_BADNAME;
-
-    const strarray_t *boxes = mbname_boxes(mbname);
-    if (strarray_size(boxes) == 1 && !strcmpsafe(strarray_nth(boxes, 0), "Trash"))
-        is_trash = 1;
-
-    mbname_free(&mbname);
+    }
 
     /* calculate the changes */
     if (old) {
@@ -2244,27 +2950,28 @@ EXPORTED int conversations_update_record(struct conversations_state *cstate,
 
     /* XXX - combine this with the earlier cache parsing */
     if (!mailbox_cacherecord(mailbox, record)) {
-        char *env = NULL;
-        char *envtokens[NUMENVTOKENS];
+        char *from = NULL;
+        const char *val;
+        size_t len;
         struct address addr = { NULL, NULL, NULL, NULL, NULL, NULL, 0 };
 
-        /* Need to find the sender */
+        /* Need to find the sender; only copy that field */
 
         /* +1 -> skip the leading paren */
-        env = xstrndup(cacheitem_base(record, CACHE_ENVELOPE) + 1,
-                       cacheitem_size(record, CACHE_ENVELOPE) - 1);
-
-        parse_cached_envelope(env, envtokens, VECTOR_SIZE(envtokens));
-
-        if (envtokens[ENV_FROM])
-            message_parse_env_address(envtokens[ENV_FROM], &addr);
+        if (cacheitem_size(record, CACHE_ENVELOPE) > 2 &&
+            message_cached_envelope_token(cacheitem_base(record, CACHE_ENVELOPE) + 1,
+                                          cacheitem_size(record, CACHE_ENVELOPE) - 1,
+                                          ENV_FROM, &val, &len)) {
+            from = xstrndup(val, len);
+            message_parse_env_address(from, &addr);
+        }
 
         /* XXX - internaldate vs gmtime? */
         conversation_update_sender(conv,
                                    addr.name, addr.route,
                                    addr.mailbox, addr.domain,
                                    record->gmtime, delta_exists);
-        free(env);
+        free(from);
     }
 
 
@@ -2416,9 +3123,9 @@ static int prunecb(void *rock,
 
     prock->ndeleted++;
 
-    r = cyrusdb_delete(prock->state->db,
+    r = cyrusdb_delete(GUIDDB(prock->state),
                        key, keylen,
-                       &prock->state->txn,
+                       GUIDTXN(prock->state),
                        /*force*/1);
 
 done:
@@ -2432,7 +3139,7 @@ EXPORTED int conversations_prune(struct conversations_state *state,
 {
     struct prune_rock rock = { state, thresh, 0, 0 };
 
-    cyrusdb_foreach(state->db, "<", 1, NULL, prunecb, &rock, &state->txn);
+    cyrusdb_foreach(GUIDDB(state), "<", 1, NULL, prunecb, &rock, GUIDTXN(state));
 
     if (nseenp)
         *nseenp = rock.nseen;
@@ -2597,7 +3304,7 @@ static int zero_g_cb(void *rock,
                      size_t vallen __attribute__((unused)))
 {
     struct conversations_state *state = (struct conversations_state *)rock;
-    int r = cyrusdb_delete(state->db, key, keylen, &state->txn, /*force*/1);
+    int r = cyrusdb_delete(GUIDDB(state), key, keylen, GUIDTXN(state), /*force*/1);
     return r;
 }
 
@@ -2605,6 +3312,9 @@ EXPORTED int conversations_zero_counts(struct conversations_state *state)
 {
     int r = 0;
 
+    r = conversations_flushcache(state);
+    if (r) return r;
+
     /* wipe B counts */
     r = cyrusdb_foreach(state->db, "B", 1, NULL, zero_b_cb,
                         state, &state->txn);
@@ -2616,8 +3326,12 @@ EXPORTED int conversations_zero_counts(struct conversations_state *state)
     if (r) return r;
 
     /* wipe G keys (there's no modseq kept, so we can just wipe them) */
-    r = cyrusdb_foreach(state->db, "G", 1, NULL, zero_g_cb,
-                        state, &state->txn);
+    r = cyrusdb_foreach(GUIDDB(state), "G", 1, NULL, zero_g_cb,
+                        state, GUIDTXN(state));
+    if (r) return r;
+
+    /* write out the zeroed B records */
+    r = conversations_flushcache(state);
     if (r) return r;
 
     /* re-init the counted flags */
@@ -2627,6 +3341,16 @@ EXPORTED int conversations_zero_counts(struct conversations_state *state)
     return r;
 }
 
+/*
+ * Switch to bulk writes for a state which is being rebuilt from
+ * scratch, after conversations_zero_counts().  Lasts until the state
+ * is committed or aborted.
+ */
+EXPORTED void conversations_set_bulk(struct conversations_state *state)
+{
+    state->bulk = 1;
+}
+
 static int cleanup_b_cb(void *rock,
                         const char *key,
                         size_t keylen,
@@ -2652,24 +3376,76 @@ done:
 
 EXPORTED int conversations_cleanup_zero(struct conversations_state *state)
 {
+    int r = conversations_flushcache(state);
+    if (r) return r;
+
     /* check B counts */
     return cyrusdb_foreach(state->db, "B", 1, NULL, cleanup_b_cb,
                            state, &state->txn);
 }
 
+static int dump_cb(void *rock,
+                   const char *key, size_t keylen,
+                   const char *data, size_t datalen)
+{
+    FILE *fp = (FILE *) rock;
+    struct buf buf = BUF_INITIALIZER;
+
+    /* binary B records are dumped as text, so they can be undumped */
+    if (keylen && key[0] == 'B' && datalen && (data[0] & 0x80)) {
+        conversation_t conv = CONVERSATION_INIT;
+        if (!conv_parse_binary(data, datalen, &conv, CONV_WITHALL)) {
+            conv_to_buf(&conv, &buf, ((unsigned char) data[CONV_BINARY_HEADERLEN]));
+            data = buf_base(&buf);
+            datalen = buf_len(&buf);
+        }
+        conversation_fini(&conv);
+    }
+
+    fprintf(fp, "%.*s\t%.*s\n", (int)keylen, key, (int)datalen, data);
+    buf_free(&buf);
+
+    return 0;
+}
+
 EXPORTED void conversations_dump(struct conversations_state *state, FILE *fp)
 {
-    cyrusdb_dumpfile(state->db, "", 0, fp, &state->txn);
+    conversations_flushcache(state);
+    conversations_flushguids(state);
+    cyrusdb_foreach(state->db, "", 0, NULL, dump_cb, fp, &state->txn);
+    if (state->guiddb)
+        cyrusdb_foreach(state->guiddb, "", 0, NULL, dump_cb, fp,
+                        &state->guidtxn);
 }
 
 EXPORTED int conversations_truncate(struct conversations_state *state)
 {
+    /* pending writes would only resurrect what we're wiping */
+    free_hashoa_table(&state->convcache, free_cachebuf);
+    state->convcache_size = 0;
+    conversations_dropguids(state);
+
+    if (state->guiddb) {
+        int r = cyrusdb_truncate(state->guiddb, &state->guidtxn);
+        if (r) return r;
+    }
+
     return cyrusdb_truncate(state->db, &state->txn);
 }
 
 EXPORTED int conversations_undump(struct conversations_state *state, FILE *fp)
 {
-    return cyrusdb_undumpfile(state->db, fp, &state->txn);
+    int r = conversations_flushcache(state);
+    if (r) return r;
+
+    r = cyrusdb_undumpfile(state->db, fp, &state->txn);
+    if (r) return r;
+
+    /* the dump has everything in one database */
+    if (state->guiddb)
+        r = conversations_moveguids(state, /*split*/1);
+
+    return r;
 }
 
 
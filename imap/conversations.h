@@ -52,7 +52,9 @@
 #include "arrayu64.h"
 #include "hash.h"
 #include "hashu64.h"
+#include "hashoa.h"
 #include "message_guid.h"
+#include "ptrarray.h"
 #include "strarray.h"
 #include "util.h"
 
@@ -72,14 +74,24 @@ struct mailbox;
 #define CONV_WITHALL CONV_WITHFOLDERS|CONV_WITHSENDERS|\
                      CONV_WITHSUBJECT|CONV_WITHTHREAD
 
+/* appended to the conversations db path for the split off guid db */
+#define CONV_GUIDS_SUFFIX ".guids"
+
 struct conversations_state {
     struct db *db;
     struct txn *txn;
     char *annotmboxname;
     strarray_t *counted_flags;
     strarray_t *folder_names;
-    hash_table folderstatus;
+    hashoa_table folderstatus;
+    struct db *guiddb;              /* G and <msgid> records, if split */
+    struct txn *guidtxn;
+    hashoa_table convcache;         /* write-behind B records */
+    size_t convcache_size;
     char *path;
+    int bulk;                       /* rebuilding from scratch */
+    ptrarray_t guidbatch;           /* pending G records, if bulk */
+    size_t guidbatch_size;
 };
 
 struct conversations_open {
@@ -288,6 +300,7 @@ extern int conversation_id_decode(conversation_id_t *cid, const char *text);
 
 
 extern int conversations_zero_counts(struct conversations_state *state);
+extern void conversations_set_bulk(struct conversations_state *state);
 extern int conversations_cleanup_zero(struct conversations_state *state);
 
 extern int conversations_rename_folder(struct conversations_state *state,
@@ -49,6 +49,7 @@
 #include <syslog.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 
 /* cyrus includes */
 #include "assert.h"
@@ -62,6 +63,7 @@
 #include "message.h"
 #include "sysexits.h"
 #include "util.h"
+#include "workerpool.h"
 #include "xmalloc.h"
 
 /* generated headers are not necessarily in current directory */
@@ -78,6 +80,7 @@ int mode = UNKNOWN;
 static const char *audit_temp_directory;
 
 int recalc_silent = 1;
+static int nworkers = 0;
 
 static int do_dump(const char *fname, const char *userid)
 {
@@ -304,6 +307,8 @@ static int do_recalc(const char *userid)
     r = conversations_zero_counts(state);
     if (r) goto err;
 
+    conversations_set_bulk(state);
+
     r = mboxlist_usermboxtree(userid, NULL, recalc_counts_cb, NULL, 0);
     if (r) goto err;
 
@@ -673,6 +678,8 @@ static int do_audit(const char *userid)
         goto out;
     }
 
+    conversations_set_bulk(state_temp);
+
     /*
      * Set the conversations db suffix during the recalc pass, so that
      * calls to conversations_open_mbox() from the mailbox code get
@@ -742,6 +749,12 @@ out:
     conversations_set_suffix(NULL);
     conversations_set_directory(NULL);
     cyrusdb_unlink(config_conversations_db, filename_temp, 0);
+    if (filename_temp) {
+        char *guids_temp = strconcat(filename_temp, CONV_GUIDS_SUFFIX,
+                                     (char *)NULL);
+        cyrusdb_unlink(config_conversations_db, guids_temp, 0);
+        free(guids_temp);
+    }
     free(filename_temp);
     free(filename_real);
     return r;
@@ -749,6 +762,8 @@ out:
 
 static int usage(const char *name)
     __attribute__((noreturn));
+static int collect_user(const char *userid, void *rock);
+static int do_parallel(const strarray_t *userids);
 
 static int do_user(const char *userid, void *rock __attribute__((unused)))
 {
@@ -817,7 +832,7 @@ int main(int argc, char **argv)
     int r = 0;
     int recursive = 0;
 
-    while ((c = getopt(argc, argv, "durzSAbvRFC:T:")) != EOF) {
+    while ((c = getopt(argc, argv, "durzSAbvRFC:T:j:")) != EOF) {
         switch (c) {
         case 'd':
             if (mode != UNKNOWN)
@@ -881,6 +896,12 @@ int main(int argc, char **argv)
             recalc_silent = 0;
             break;
 
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 1)
+                usage(argv[0]);
+            break;
+
         default:
             usage(argv[0]);
             break;
@@ -890,6 +911,10 @@ int main(int argc, char **argv)
     if (mode == UNKNOWN)
         usage(argv[0]);
 
+    /* the workers can't share stdin and stdout */
+    if (nworkers && (!recursive || mode == DUMP || mode == UNDUMP))
+        usage(argv[0]);
+
     if (optind == argc-1)
         userid = argv[optind];
     else if (recursive)
@@ -899,7 +924,16 @@ int main(int argc, char **argv)
 
     cyrus_init(alt_config, "ctl_conversationsdb", 0, 0);
 
-    if (recursive) {
+    if (recursive && nworkers) {
+        strarray_t userids = STRARRAY_INITIALIZER;
+        mboxlist_alluser(collect_user, &userids);
+        if (do_parallel(&userids)) {
+            fprintf(stderr, "some ctl_conversationsdb workers failed\n");
+            r = EC_SOFTWARE;
+        }
+        strarray_fini(&userids);
+    }
+    else if (recursive) {
         mboxlist_alluser(do_user, NULL);
     }
     else
@@ -927,10 +961,41 @@ static int usage(const char *name)
     fprintf(stderr, "    -T dir         store temporary data for audit in dir\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "    -r             recursive mode: username is a prefix\n");
+    fprintf(stderr, "    -j workers     with -r, process users in this many parallel processes\n");
 
     exit(EC_USAGE);
 }
 
+static int collect_user(const char *userid, void *rock)
+{
+    strarray_append((strarray_t *) rock, userid);
+    return 0;
+}
+
+static int parallel_job(unsigned idx, void *rock)
+{
+    return do_user(strarray_nth((const strarray_t *) rock, idx), NULL);
+}
+
+static void parallel_done(void *rock __attribute__((unused)))
+{
+    cyrus_done();
+}
+
+/* hand the users out to a pool of worker processes.  Each user's
+ * conversations database is locked by the worker processing it, so
+ * the workers never contend with each other.  Returns non-zero if any
+ * worker failed. */
+static int do_parallel(const strarray_t *userids)
+{
+    if (!userids->count) return 0;
+
+    mboxlist_close();
+
+    return workerpool_run(nworkers, userids->count,
+                          parallel_job, parallel_done, (void *) userids);
+}
+
 void fatal(const char* s, int code)
 {
     fprintf(stderr, "ctl_conversationsdb: %s\n", s);
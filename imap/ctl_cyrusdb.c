@@ -50,6 +50,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 #include <syslog.h>
 #include <errno.h>
 
@@ -81,6 +82,7 @@
 #include "statuscache.h"
 #include "tls.h"
 #include "util.h"
+#include "workerpool.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
 
@@ -121,7 +123,7 @@ static int compdb(const void *v1, const void *v2)
 static void usage(void)
 {
     fprintf(stderr, "ctl_cyrusdb [-C <altconfig>] -c\n");
-    fprintf(stderr, "ctl_cyrusdb [-C <altconfig>] -r [-x]\n");
+    fprintf(stderr, "ctl_cyrusdb [-C <altconfig>] -r [-x] [-j <workers>]\n");
     exit(-1);
 }
 
@@ -274,6 +276,117 @@ static void check_convert(struct cyrusdb *db, const char *fname)
         syslog(LOG_NOTICE, "conversion failed %s", fname);
 }
 
+/*
+ * Per-user databases (conversations, seen state and so on) are
+ * otherwise recovered by whoever opens them first after a crash, which
+ * is usually a login in the rush after a restart.  With -j, recovery
+ * finds every database file under the user and domain directories and
+ * has a pool of workers check each one's header, recovering the ones
+ * which need it, before the services start.
+ */
+static void find_userdbs(const char *dirname, strarray_t *files)
+{
+    DIR *dirp;
+    struct dirent *dirent;
+
+    dirp = opendir(dirname);
+    if (!dirp) return;
+
+    while ((dirent = readdir(dirp)) != NULL) {
+        struct stat sbuf;
+        char *path;
+
+        if (dirent->d_name[0] == '.') continue;
+
+        path = strconcat(dirname,
+                         dirname[strlen(dirname)-1] == '/' ? "" : "/",
+                         dirent->d_name, (char *)NULL);
+        if (lstat(path, &sbuf)) {
+            free(path);
+            continue;
+        }
+
+        if (S_ISDIR(sbuf.st_mode)) {
+            find_userdbs(path, files);
+            free(path);
+        }
+        else if (S_ISREG(sbuf.st_mode))
+            strarray_appendm(files, path);
+        else
+            free(path);
+    }
+
+    closedir(dirp);
+}
+
+#define RECOVER_PROGRESS 10000
+
+static int recover_job(unsigned idx, void *rock)
+{
+    const strarray_t *files = (const strarray_t *) rock;
+    const char *fname = strarray_nth(files, idx);
+    const char *backend = cyrusdb_detect(fname);
+    struct db *db = NULL;
+    int r;
+
+    if ((idx + 1) % RECOVER_PROGRESS == 0) {
+        syslog(LOG_NOTICE, "recovering user databases: checked %u of %d",
+               idx + 1, strarray_size(files));
+    }
+
+    if (!backend || !cyrusdb_needs_recovery(backend, fname))
+        return 0;
+
+    /* opening it runs the recovery */
+    r = cyrusdb_open(backend, fname, 0, &db);
+    if (!r) r = cyrusdb_close(db);
+
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: recovering %s: %s",
+               fname, cyrusdb_strerror(r));
+    }
+    else
+        syslog(LOG_NOTICE, "recovered %s", fname);
+
+    return r;
+}
+
+static void recover_done(void *rock __attribute__((unused)))
+{
+    cyrus_done();
+}
+
+static int recover_userdbs(int nworkers)
+{
+    strarray_t files = STRARRAY_INITIALIZER;
+    char *dirname;
+    int r = 0;
+
+    dirname = strconcat(config_dir, FNAME_USERDIR, (char *)NULL);
+    find_userdbs(dirname, &files);
+    free(dirname);
+
+    dirname = strconcat(config_dir, FNAME_DOMAINDIR, (char *)NULL);
+    find_userdbs(dirname, &files);
+    free(dirname);
+
+    syslog(LOG_NOTICE, "recovering user databases: %d files, %d workers",
+           strarray_size(&files), nworkers);
+
+    if (!files.count) goto done;
+
+    if (workerpool_run(nworkers, files.count, recover_job, recover_done,
+                       &files))
+        r = CYRUSDB_IOERROR;
+
+    syslog(LOG_NOTICE, "recovering user databases: done%s",
+           r ? ", with errors" : "");
+
+done:
+    strarray_fini(&files);
+    return r;
+}
+
 int main(int argc, char *argv[])
 {
     extern char *optarg;
@@ -285,10 +398,11 @@ int main(int argc, char *argv[])
     strarray_t files = STRARRAY_INITIALIZER;
     char *msg = "";
     int i, rotated = 0;
+    int nworkers = 0;
 
     r = r2 = 0;
 
-    while ((opt = getopt(argc, argv, "C:rxc")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:rxcj:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -311,13 +425,18 @@ int main(int argc, char *argv[])
             reserve_flag = 0;
             break;
 
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) usage();
+            break;
+
         default:
             usage();
             break;
         }
     }
 
-    if (op == NONE || (op != RECOVER && !reserve_flag)) {
+    if (op == NONE || (op != RECOVER && (!reserve_flag || nworkers))) {
         usage();
         /* NOTREACHED */
     }
@@ -344,9 +463,14 @@ int main(int argc, char *argv[])
     for (i = 0; dblist[i].name; i++) {
         const char *fname = dbfname(&dblist[i]);
 
-        if (op == RECOVER)
+        if (op == RECOVER) {
             check_convert(&dblist[i], fname);
 
+            /* a crash may have left the filter behind the database */
+            if (!strcmp(dblist[i].name, FNAME_DELIVERDB))
+                duplicate_filter_discard(fname);
+        }
+
         /* if we need to archive this db, add it to the list */
         if (dblist[i].doarchive)
             strarray_add(&files, fname);
@@ -427,6 +551,9 @@ int main(int argc, char *argv[])
 
     strarray_fini(&files);
 
+    if (op == RECOVER && nworkers)
+        r = recover_userdbs(nworkers);
+
     if(op == RECOVER && reserve_flag)
         process_mboxlist();
 
@@ -63,6 +63,8 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <libgen.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
 #include <sasl/sasl.h>
 
@@ -78,6 +80,8 @@
 #include "util.h"
 #include "xmalloc.h"
 #include "strarray.h"
+#include "strhash.h"
+#include "user.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -92,6 +96,11 @@ static int verbose = 0;
 static const char *progname = NULL;
 static struct namespace expire_namespace; /* current namespace */
 
+/* parallel jobs (-j) */
+static int njobs = 1;
+static int job = 0;
+static double rate_limit = 0;   /* mailboxes per second, across all jobs */
+
 /* command line arguments */
 struct arguments {
     int archive_seconds;
@@ -109,6 +118,9 @@ struct arguments {
     const char *altconfig;
     const char *mbox_prefix;
     const char *userid;
+
+    int njobs;
+    double rate_limit;
 };
 
 struct archive_rock {
@@ -142,9 +154,23 @@ struct conversations_rock {
 struct delete_rock {
     time_t delete_mark;
     strarray_t to_delete;
+    unsigned long mailboxes_deleted;
     bool skip_annotate;
 };
 
+/* the counters which jobs report back to the parent */
+struct expire_counts {
+    unsigned long mailboxes_seen;
+    unsigned long messages_seen;
+    unsigned long messages_expired;
+    unsigned long messages_expunged;
+    unsigned long userflags_expunged;
+    unsigned long databases_seen;
+    unsigned long msgids_seen;
+    unsigned long msgids_expired;
+    unsigned long mailboxes_deleted;
+};
+
 /* The global context */
 struct cyr_expire_ctx {
     struct arguments args;
@@ -197,6 +223,8 @@ static void cyr_expire_init(const char *progname, struct cyr_expire_ctx *ctx)
     cyrus_init(ctx->args.altconfig, progname, 0, 0);
     global_sasl_init(1, 0, NULL);
 
+    mailbox_set_unlink_maxrate(config_getint(IMAPOPT_EXPIRE_UNLINK_MAXRATE));
+
     ctx->erock.do_userflags = ctx->args.do_userflags;
     /* TODO: Ideally all the functions should just use the skip_annotate from
      *       args. But that would require a change in the callback signatures.
@@ -227,7 +255,9 @@ static void usage(void)
     fprintf(stderr, "-a                       skip annotation lookup\n");
     fprintf(stderr, "-c                       do not expire conversations\n");
     fprintf(stderr, "-h                       print this help and exit\n");
+    fprintf(stderr, "-j <jobs>                process users in <jobs> parallel processes\n");
     fprintf(stderr, "-p <mailbox-prefix>      specify prefix for mailboxes\n");
+    fprintf(stderr, "-r <rate>                process at most <rate> mailboxes per second\n");
     fprintf(stderr, "-t                       remove user flags which are not used\n");
     fprintf(stderr, "-u <user-id>             specify user id for mailbox lookup\n");
     fprintf(stderr, "-v                       enable verbose output\n");
@@ -369,6 +399,55 @@ static unsigned userflag_cb(struct mailbox *mailbox __attribute__((unused)),
     return 0;   /* always keep the message */
 }
 
+/*
+ * With -j, every job walks the whole mailbox list, and handles just
+ * the mailboxes of the users which hash to it.  So each user's
+ * mailboxes are all handled by one job, in the usual order.
+ */
+static int in_this_job(const char *mboxname)
+{
+    char *userid;
+    unsigned hash;
+
+    if (njobs <= 1) return 1;
+
+    userid = mboxname_to_userid(mboxname);
+    hash = strhash(userid ? userid : "");
+    free(userid);
+
+    return (int) (hash % njobs) == job;
+}
+
+/*
+ * Called for each mailbox a job handles: reports progress and keeps
+ * this job to its share of the -r rate.
+ */
+static void mailbox_done(const char *phase)
+{
+    static struct timeval start;
+    static unsigned long count = 0;
+    struct timeval now;
+    double elapsed, wanted;
+
+    if (!count) gettimeofday(&start, NULL);
+    count++;
+
+    if (count % 10000 == 0) {
+        if (njobs > 1)
+            verbosep("%s: job %d: %lu mailboxes", phase, job, count);
+        else
+            verbosep("%s: %lu mailboxes", phase, count);
+    }
+
+    if (rate_limit <= 0) return;
+
+    gettimeofday(&now, NULL);
+    elapsed = timesub(&start, &now);
+    wanted = count / (rate_limit / njobs);
+    if (wanted > elapsed)
+        usleep((wanted - elapsed) * 1000000);
+}
+
 static int archive(const mbentry_t *mbentry, void *rock)
 {
     struct archive_rock *arock = (struct archive_rock *) rock;
@@ -378,6 +457,11 @@ static int archive(const mbentry_t *mbentry, void *rock)
     if (sigquit)
         return 1;
 
+    if (!in_this_job(mbentry->name))
+        return 0;
+
+    mailbox_done("archive");
+
     if (mbentry->mbtype & MBTYPE_DELETED)
         goto done;
 
@@ -451,6 +535,11 @@ static int expire(const mbentry_t *mbentry, void *rock)
         return 1;
     }
 
+    if (!in_this_job(mbentry->name))
+        return 0;
+
+    mailbox_done("expire");
+
     /* Skip remote mailboxes */
     if (mbentry->mbtype & MBTYPE_REMOTE)
         goto done;
@@ -542,6 +631,11 @@ static int delete(const mbentry_t *mbentry, void *rock)
     if (sigquit)
         return 1;
 
+    if (!in_this_job(mbentry->name))
+        return 0;
+
+    mailbox_done("delete");
+
     if (mbentry->mbtype & MBTYPE_DELETED)
         goto done;
 
@@ -583,6 +677,11 @@ static int expire_conversations(const mbentry_t *mbentry, void *rock)
     if (sigquit)
         return 1;
 
+    if (!in_this_job(mbentry->name))
+        return 0;
+
+    mailbox_done("conversations");
+
     if (mbentry->mbtype & MBTYPE_DELETED)
         goto done;
 
@@ -623,6 +722,170 @@ static void sighandler(int sig __attribute((unused)))
     return;
 }
 
+static void get_counts(const struct cyr_expire_ctx *ctx,
+                       struct expire_counts *counts)
+{
+    counts->mailboxes_seen = ctx->erock.mailboxes_seen;
+    counts->messages_seen = ctx->erock.messages_seen;
+    counts->messages_expired = ctx->erock.messages_expired;
+    counts->messages_expunged = ctx->erock.messages_expunged;
+    counts->userflags_expunged = ctx->erock.userflags_expunged;
+    counts->databases_seen = ctx->crock.databases_seen;
+    counts->msgids_seen = ctx->crock.msgids_seen;
+    counts->msgids_expired = ctx->crock.msgids_expired;
+    counts->mailboxes_deleted = ctx->drock.mailboxes_deleted;
+}
+
+static void add_counts(struct cyr_expire_ctx *ctx,
+                       const struct expire_counts *counts)
+{
+    ctx->erock.mailboxes_seen += counts->mailboxes_seen;
+    ctx->erock.messages_seen += counts->messages_seen;
+    ctx->erock.messages_expired += counts->messages_expired;
+    ctx->erock.messages_expunged += counts->messages_expunged;
+    ctx->erock.userflags_expunged += counts->userflags_expunged;
+    ctx->crock.databases_seen += counts->databases_seen;
+    ctx->crock.msgids_seen += counts->msgids_seen;
+    ctx->crock.msgids_expired += counts->msgids_expired;
+    ctx->drock.mailboxes_deleted += counts->mailboxes_deleted;
+}
+
+static void write_expire_mark(const char *name, void *data, void *rock)
+{
+    fprintf((FILE *) rock, "%ld %s\n", (long) *((time_t *) data), name);
+}
+
+/* Run one phase over every mailbox, then 'finish' if given */
+static void foreach_mailbox_serial(struct cyr_expire_ctx *ctx,
+                                   mboxlist_cb *proc, void *rock,
+                                   int userflags, int allflags,
+                                   void (*finish)(struct cyr_expire_ctx *))
+{
+    if (ctx->args.userid)
+        mboxlist_usermboxtree(ctx->args.userid, NULL, proc, rock, userflags);
+    else
+        mboxlist_allmbox(ctx->args.mbox_prefix, proc, rock, allflags);
+
+    if (finish && !sigquit) finish(ctx);
+}
+
+static void run_job(struct cyr_expire_ctx *ctx, FILE *out,
+                    mboxlist_cb *proc, void *rock, int allflags,
+                    void (*finish)(struct cyr_expire_ctx *))
+{
+    struct expire_counts before, after;
+    unsigned long *b = (unsigned long *) &before;
+    unsigned long *a = (unsigned long *) &after;
+    size_t i;
+
+    /* only report the expire marks this job finds */
+    free_hash_table(&ctx->erock.table, free);
+    construct_hash_table(&ctx->erock.table, 10000, 1);
+
+    get_counts(ctx, &before);
+    foreach_mailbox_serial(ctx, proc, rock, 0, allflags, finish);
+    get_counts(ctx, &after);
+
+    for (i = 0; i < sizeof(after) / sizeof(unsigned long); i++)
+        a[i] -= b[i];
+
+    fwrite(&after, sizeof(after), 1, out);
+    hash_enumerate(&ctx->erock.table, write_expire_mark, out);
+    fflush(out);
+}
+
+static void read_job(struct cyr_expire_ctx *ctx, FILE *in)
+{
+    struct expire_counts counts;
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t len;
+
+    rewind(in);
+    if (fread(&counts, sizeof(counts), 1, in) != 1) {
+        syslog(LOG_ERR, "cyr_expire: job did not report its results");
+        return;
+    }
+    add_counts(ctx, &counts);
+
+    while ((len = getline(&line, &linesize, in)) > 0) {
+        char *name;
+        time_t mark;
+
+        if (line[len-1] == '\n') line[len-1] = '\0';
+        mark = strtol(line, &name, 10);
+        if (*name++ != ' ') continue;
+        if (!hash_lookup(name, &ctx->erock.table))
+            hash_insert(name, xmemdup(&mark, sizeof(mark)), &ctx->erock.table);
+    }
+
+    free(line);
+}
+
+/*
+ * Run one phase over every mailbox, split across -j jobs by user.
+ * Returns once every job has finished, so the phases still happen
+ * one after the other.
+ */
+static void foreach_mailbox(struct cyr_expire_ctx *ctx, const char *phase,
+                            mboxlist_cb *proc, void *rock,
+                            int userflags, int allflags,
+                            void (*finish)(struct cyr_expire_ctx *))
+{
+    FILE **results;
+    pid_t *pids;
+    int i, done = 0;
+
+    if (njobs <= 1 || ctx->args.userid) {
+        foreach_mailbox_serial(ctx, proc, rock, userflags, allflags, finish);
+        return;
+    }
+
+    results = xzmalloc(njobs * sizeof(FILE *));
+    pids = xzmalloc(njobs * sizeof(pid_t));
+
+    for (i = 0; i < njobs; i++) {
+        results[i] = tmpfile();
+        if (!results[i]) fatal("unable to create job results file", EC_IOERR);
+
+        pids[i] = fork();
+        if (pids[i] < 0) fatal("unable to fork job", EC_OSERR);
+
+        if (!pids[i]) {
+            job = i;
+            run_job(ctx, results[i], proc, rock, allflags, finish);
+            cyrus_done();
+            _exit(sigquit ? EC_TEMPFAIL : 0);
+        }
+    }
+
+    while (done < njobs) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (i = 0; i < njobs; i++) {
+            if (pids[i] != pid) continue;
+
+            if (!WIFEXITED(status) || WEXITSTATUS(status))
+                syslog(LOG_WARNING, "%s: job %d exited with status %d",
+                       phase, i, status);
+            read_job(ctx, results[i]);
+            done++;
+            verbosep("%s: %d of %d jobs finished", phase, done, njobs);
+        }
+    }
+
+    for (i = 0; i < njobs; i++)
+        fclose(results[i]);
+    free(results);
+    free(pids);
+}
+
 static int do_archive(struct cyr_expire_ctx *ctx)
 {
     if (ctx->args.archive_seconds >= 0) {
@@ -630,11 +893,8 @@ static int do_archive(struct cyr_expire_ctx *ctx)
                ctx->args.archive_seconds);
         ctx->arock.archive_mark = time(0) - ctx->args.archive_seconds;
 
-        if (ctx->args.userid)
-            mboxlist_usermboxtree(ctx->args.userid, NULL, archive,
-                                  &ctx->arock, MBOXTREE_DELETED);
-        else
-            mboxlist_allmbox(ctx->args.mbox_prefix, archive, &ctx->arock, 0);
+        foreach_mailbox(ctx, "archive", archive, &ctx->arock,
+                        MBOXTREE_DELETED, 0, NULL);
     }
 
     return 0;
@@ -660,12 +920,9 @@ static int do_expunge(struct cyr_expire_ctx *ctx)
                            ((double)ctx->args.expunge_seconds/SECS_IN_A_DAY));
         }
 
-        if (ctx->args.userid)
-            mboxlist_usermboxtree(ctx->args.userid, NULL, expire,
-                                  &ctx->erock, MBOXTREE_DELETED|MBOXTREE_TOMBSTONES);
-        else
-            mboxlist_allmbox(ctx->args.mbox_prefix, expire, &ctx->erock,
-                             MBOXTREE_TOMBSTONES);
+        foreach_mailbox(ctx, "expire", expire, &ctx->erock,
+                        MBOXTREE_DELETED|MBOXTREE_TOMBSTONES,
+                        MBOXTREE_TOMBSTONES, NULL);
 
         syslog(LOG_NOTICE, "Expired %lu and expunged %lu out of %lu "
                             "messages from %lu mailboxes",
@@ -703,12 +960,8 @@ static int do_cid_expire(struct cyr_expire_ctx *ctx)
         verbosep("Removing conversation entries older than %0.2f days\n",
                        (double)(cid_expire_seconds/SECS_IN_A_DAY));
 
-        if (ctx->args.userid)
-            mboxlist_usermboxtree(ctx->args.userid, NULL, expire_conversations,
-                                  &ctx->crock, MBOXTREE_DELETED);
-        else
-            mboxlist_allmbox(ctx->args.mbox_prefix, expire_conversations,
-                             &ctx->crock, 0);
+        foreach_mailbox(ctx, "conversations", expire_conversations,
+                        &ctx->crock, MBOXTREE_DELETED, 0, NULL);
 
         syslog(LOG_NOTICE, "Expired %lu entries of %lu entries seen "
                             "in %lu conversation databases",
@@ -725,46 +978,66 @@ static int do_cid_expire(struct cyr_expire_ctx *ctx)
     return 0;
 }
 
-static int do_delete(struct cyr_expire_ctx *ctx)
+/* remove the mailboxes found by delete() */
+static void delete_found(struct cyr_expire_ctx *ctx)
 {
-    int ret = 0;
+    int i;
 
+    for (i = 0 ; i < ctx->drock.to_delete.count ; i++) {
+        char *name = ctx->drock.to_delete.data[i];
+
+        if (sigquit)
+            return;         /* return from here, will quit in main. */
+
+        verbosep("Removing: %s\n", name);
+
+        mboxlist_deletemailbox(name, 1, NULL, NULL, NULL, 0, 0, 0, 0);
+        /* XXX: Ignoring the return from mboxlist_deletemailbox() ??? */
+        ctx->drock.mailboxes_deleted++;
+    }
+}
+
+static int do_delete(struct cyr_expire_ctx *ctx)
+{
     if ((ctx->args.delete_seconds >= 0) &&
         mboxlist_delayed_delete_isenabled() &&
         config_getstring(IMAPOPT_DELETEDPREFIX)) {
-        int count = 0;
-        int i;
 
         verbosep("Removing deleted mailboxes older than %0.2f days\n",
                  ((double)ctx->args.delete_seconds/SECS_IN_A_DAY));
 
         ctx->drock.delete_mark = time(0) - ctx->args.delete_seconds;
 
-        if (ctx->args.userid)
-            mboxlist_usermboxtree(ctx->args.userid, NULL, delete,
-                                  &ctx->drock, MBOXTREE_DELETED);
-        else
-            mboxlist_allmbox(ctx->args.mbox_prefix, delete, &ctx->drock, 0);
+        foreach_mailbox(ctx, "delete", delete, &ctx->drock,
+                        MBOXTREE_DELETED, 0, delete_found);
 
-        for (i = 0 ; i < ctx->drock.to_delete.count ; i++) {
-            char *name = ctx->drock.to_delete.data[i];
+        if (sigquit)
+            return 0;       /* will quit in main. */
 
-            if (sigquit)
-                return ret;         /* return from here, will quit in main. */
+        verbosep("Removed %lu deleted mailboxes\n",
+                 ctx->drock.mailboxes_deleted);
 
-            verbosep("Removing: %s\n", name);
+        syslog(LOG_NOTICE, "Removed %lu deleted mailboxes",
+               ctx->drock.mailboxes_deleted);
+    }
 
-            ret = mboxlist_deletemailbox(name, 1, NULL, NULL, NULL, 0, 0, 0, 0);
-            /* XXX: Ignoring the return from mboxlist_deletemailbox() ??? */
-            count++;
-        }
+    return 0;
+}
+
+/* remove the files of users deleted with user_delete_lazy */
+static int do_delete_users(struct cyr_expire_ctx *ctx __attribute__((unused)))
+{
+    int r;
 
-        verbosep("Removed %d deleted mailboxes\n", count);
+    verbosep("Removing lazily deleted users\n");
 
-        syslog(LOG_NOTICE, "Removed %d deleted mailboxes", count);
+    r = user_run_lazy_deletes(&sigquit);
+    if (r) {
+        syslog(LOG_ERR, "Removing lazily deleted users: %s",
+               error_message(r));
     }
 
-    return ret;
+    return r;
 }
 
 static int do_duplicate_prune(struct cyr_expire_ctx *ctx)
@@ -788,7 +1061,9 @@ static int parse_args(int argc, char *argv[], struct arguments *args)
     args->do_expunge = true;
     args->do_cid_expire = -1;
 
-    while ((opt = getopt(argc, argv, "C:D:E:X:A:p:u:vaxtch")) != EOF) {
+    args->njobs = 1;
+
+    while ((opt = getopt(argc, argv, "C:D:E:X:A:j:p:r:u:vaxtch")) != EOF) {
         switch (opt) {
         case 'A':
             if (!parse_duration(optarg, &args->archive_seconds)) usage();
@@ -821,10 +1096,20 @@ static int parse_args(int argc, char *argv[], struct arguments *args)
             args->do_cid_expire = 0;
             break;
 
+        case 'j':
+            args->njobs = atoi(optarg);
+            if (args->njobs < 1) usage();
+            break;
+
         case 'p':
             args->mbox_prefix = optarg;
             break;
 
+        case 'r':
+            args->rate_limit = atof(optarg);
+            if (args->rate_limit <= 0) usage();
+            break;
+
         case 't':
             args->do_userflags = true;
             break;
@@ -875,6 +1160,9 @@ int main(int argc, char *argv[])
 
     cyr_expire_init(progname, &ctx);
 
+    njobs = ctx.args.njobs;
+    rate_limit = ctx.args.rate_limit;
+
     /* do_cid_expire defaults to whatever IMAP options are set */
     if (ctx.args.do_cid_expire < 0)
         ctx.args.do_cid_expire = config_getswitch(IMAPOPT_CONVERSATIONS);
@@ -910,6 +1198,11 @@ int main(int argc, char *argv[])
 
     r = do_delete(&ctx);
 
+    if (sigquit)
+        goto finish;
+
+    r = do_delete_users(&ctx);
+
     if (sigquit)
         goto finish;
 
@@ -67,6 +67,8 @@ struct service_item {
     struct service_item *next;
 };
 
+extern int saslcache_invalidate(const char *userid);
+
 static void usage(void)
 {
     fprintf(stderr, "cyr_info [-C <altconfig>] [-M <cyrus.conf>] [-n servicename] command\n");
@@ -81,6 +83,8 @@ static void usage(void)
     fprintf(stderr, "  * conf-default  - listing of all default config values\n");
     fprintf(stderr, "  * conf-lint     - unknown config keys\n");
     fprintf(stderr, "  * proc          - listing of all open processes\n");
+    fprintf(stderr, "  * saslcache-invalidate [user]\n");
+    fprintf(stderr, "                  - forget cached passwords (of user)\n");
     cyrus_done();
     exit(-1);
 }
@@ -388,6 +392,13 @@ int main(int argc, char *argv[])
         do_defconf();
     else if (!strcmp(argv[optind], "conf-lint"))
         do_lint();
+    else if (!strcmp(argv[optind], "saslcache-invalidate")) {
+        if (saslcache_invalidate(argv[optind+1])) {
+            fprintf(stderr, "can't update the SASL password cache\n");
+            cyrus_done();
+            return 1;
+        }
+    }
     else
         usage();
 
@@ -49,7 +49,14 @@
 #include <stdio.h>
 #include <syslog.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 /* cyrus includes */
 #include "global.h"
@@ -61,6 +68,8 @@
 #include "xmalloc.h"
 #include "mboxlist.h"
 #include "prot.h"
+#include "ptrarray.h"
+#include "retry.h"
 #include "util.h"
 #include "times.h"
 #include "xstrlcpy.h"
@@ -109,18 +118,229 @@ struct infected_mbox *public = NULL;
 struct infected_mbox *user = NULL;
 
 int verbose = 0;
+int nworkers = 0;
 
 /* abstract definition of a virus scan engine */
 struct scan_engine {
     const char *name;
     void *state;
     void *(*init)(void);  /* initialize state */
-    int (*scanfile)(void *state,  /* scan fname & return non-zero if infected */
-                    const char *fname, const char **virname);
+    int (*scanfile)(void *state,  /* scan fname & return 1 if infected, */
+                    const char *fname, const char **virname); /* -1 on error */
     void (*destroy)(void *state);  /* destroy state */
+    unsigned (*sigversion)(void *state);  /* signature db version, or 0 */
 };
 
 
+/* clamd implementation: each message is streamed to the daemon with
+ * INSTREAM, a chunk at a time, rather than loading the signatures and
+ * scanning in process */
+#define CLAMD_CHUNK_SIZE (64*1024)
+
+struct clamd_state {
+    const char *sockname;
+    char *chunk;
+    char *virname;
+    unsigned version;
+    struct buf reply;
+};
+
+static int clamd_connect(const char *sockname)
+{
+    int sock = -1;
+
+    if (sockname[0] == '/') {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strlcpy(addr.sun_path, sockname, sizeof(addr.sun_path));
+
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock >= 0 &&
+            connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    else {
+        /* host:port */
+        struct addrinfo hints, *res, *res0;
+        char *host = xstrdup(sockname);
+        char *port = strrchr(host, ':');
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = PF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if (port) {
+            *port++ = '\0';
+            if (!getaddrinfo(host, port, &hints, &res0)) {
+                for (res = res0; res; res = res->ai_next) {
+                    sock = socket(res->ai_family, res->ai_socktype,
+                                  res->ai_protocol);
+                    if (sock < 0) continue;
+                    if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0)
+                        break;
+                    close(sock);
+                    sock = -1;
+                }
+                freeaddrinfo(res0);
+            }
+        }
+        free(host);
+    }
+
+    if (sock < 0)
+        syslog(LOG_ERR, "clamd: connect(%s) failed: %m", sockname);
+
+    return sock;
+}
+
+/* read a NUL-terminated reply, without its trailing newline */
+static int clamd_reply(int sock, struct buf *reply)
+{
+    char tmp[256];
+    ssize_t n;
+
+    buf_reset(reply);
+    while (!buf_len(reply) || !memchr(buf_base(reply), '\0', buf_len(reply))) {
+        n = read(sock, tmp, sizeof(tmp));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buf_appendmap(reply, tmp, n);
+    }
+
+    buf_truncate(reply, strcspn(buf_cstring(reply), "\n"));
+
+    return buf_len(reply) ? 0 : -1;
+}
+
+static int clamd_command(struct clamd_state *st, const char *cmd)
+{
+    int sock = clamd_connect(st->sockname);
+    int r = -1;
+
+    if (sock < 0) return -1;
+
+    /* z-prefixed commands are NUL-terminated, as are their replies */
+    if (retry_write(sock, cmd, strlen(cmd) + 1) == (ssize_t) strlen(cmd) + 1)
+        r = clamd_reply(sock, &st->reply);
+
+    close(sock);
+    return r;
+}
+
+void *clamd_init()
+{
+    struct clamd_state *st = xzmalloc(sizeof(struct clamd_state));
+    const char *p;
+
+    st->sockname = config_getstring(IMAPOPT_VIRUSSCAN_CLAMD_SOCKET);
+    st->chunk = xmalloc(CLAMD_CHUNK_SIZE);
+
+    /* clamd hangs up if a stream exceeds its StreamMaxLength */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (clamd_command(st, "zVERSION")) {
+        fatal("Failed to contact clamd", EC_UNAVAILABLE);
+    }
+
+    /* "ClamAV 0.103.8/26941/Wed Jun 21 07:33:44 2023" */
+    printf("Connected to %s\n", buf_cstring(&st->reply));
+    p = strchr(buf_cstring(&st->reply), '/');
+    if (p) st->version = strtoul(p + 1, NULL, 10);
+
+    return (void *) st;
+}
+
+int clamd_scanfile(void *state, const char *fname,
+                   const char **virname)
+{
+    struct clamd_state *st = (struct clamd_state *) state;
+    static const char cmd[] = "zINSTREAM";
+    const char *reply;
+    uint32_t len;
+    ssize_t n;
+    int fd, sock = -1, r = -1;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+        return -1;
+    }
+
+    sock = clamd_connect(st->sockname);
+    if (sock < 0) goto ioerr;
+
+    if (retry_write(sock, cmd, sizeof(cmd)) != sizeof(cmd)) goto ioerr;
+
+    /* each chunk is preceded by its length, and a zero length ends it */
+    for (;;) {
+        n = read(fd, st->chunk, CLAMD_CHUNK_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) goto ioerr;
+
+        len = htonl(n);
+        if (retry_write(sock, &len, sizeof(len)) != sizeof(len)) goto ioerr;
+        if (!n) break;
+        if (retry_write(sock, st->chunk, n) != n) goto ioerr;
+    }
+
+    if (clamd_reply(sock, &st->reply)) goto ioerr;
+
+    reply = buf_cstring(&st->reply);
+    if (!strncmp(reply, "stream: ", 8)) reply += 8;
+    n = strlen(reply);
+
+    if (!strcmp(reply, "OK")) {
+        r = 0;
+    }
+    else if (n > 6 && !strcmp(reply + n - 6, " FOUND")) {
+        free(st->virname);
+        st->virname = xstrndup(reply, n - 6);
+        *virname = st->virname;
+        r = 1;
+    }
+    else {
+        printf("clamd error: %s\n", reply);
+        syslog(LOG_ERR, "clamd error scanning %s: %s", fname, reply);
+    }
+    goto done;
+
+ioerr:
+    printf("clamd error scanning %s: %s\n", fname, strerror(errno));
+    syslog(LOG_ERR, "clamd error scanning %s: %m", fname);
+
+done:
+    if (sock >= 0) close(sock);
+    close(fd);
+
+    return r;
+}
+
+void clamd_destroy(void *state)
+{
+    struct clamd_state *st = (struct clamd_state *) state;
+
+    buf_free(&st->reply);
+    free(st->virname);
+    free(st->chunk);
+    free(st);
+}
+
+unsigned clamd_sigversion(void *state)
+{
+    struct clamd_state *st = (struct clamd_state *) state;
+
+    return st->version;
+}
+
+struct scan_engine clamd_engine =
+{ "clamd", NULL, &clamd_init, &clamd_scanfile, &clamd_destroy,
+  &clamd_sigversion };
+
+
 #ifdef HAVE_CLAMAV
 /* ClamAV implementation */
 #include <clamav.h>
@@ -206,7 +426,7 @@ int clamav_scanfile(void *state, const char *fname,
     default:
         printf("cl_scanfile error: %s\n", cl_strerror(r));
         syslog(LOG_ERR, "cl_scanfile error: %s\n", cl_strerror(r));
-        break;
+        return -1;
     }
 
     return 0;
@@ -223,21 +443,114 @@ void clamav_destroy(void *state)
     free(st);
 }
 
+unsigned clamav_sigversion(void *state)
+{
+    struct clamav_state *st = (struct clamav_state *) state;
+
+    return (unsigned) cl_engine_get_num(st->av_engine,
+                                        CL_ENGINE_DB_VERSION, NULL);
+}
+
 struct scan_engine engine =
-{ "ClamAV", NULL, &clamav_init, &clamav_scanfile, &clamav_destroy };
+{ "ClamAV", NULL, &clamav_init, &clamav_scanfile, &clamav_destroy,
+  &clamav_sigversion };
 
 #elif defined(HAVE_SOME_UNKNOWN_VIRUS_SCANNER)
 /* XXX  Add other implementations here */
 
 #else
 /* NO configured virus scanner */
-struct scan_engine engine = { "<None Configured>", NULL, NULL, NULL, NULL };
+struct scan_engine engine = { "<None Configured>", NULL, NULL, NULL, NULL, NULL };
 #endif
 
 
+/* scan results by message GUID, so that identical copies of a message
+ * are only scanned once with each version of the signatures */
+#define FNAME_VIRUSSCANDB "/virusscan.db"
+
+static struct db *scancache = NULL;
+static unsigned sigversion = 0;
+static struct buf scancache_value = BUF_INITIALIZER;
+
+static void scancache_open(void)
+{
+    const char *fname = config_getstring(IMAPOPT_VIRUSSCAN_CACHE_DB_PATH);
+    char *tofree = NULL;
+    int r;
+
+    if (!fname)
+        fname = tofree = strconcat(config_dir, FNAME_VIRUSSCANDB, (char *)NULL);
+
+    r = cyrusdb_open(config_getstring(IMAPOPT_VIRUSSCAN_CACHE_DB),
+                     fname, CYRUSDB_CREATE, &scancache);
+    if (r) {
+        printf("not using scan cache %s: %s\n", fname, cyrusdb_strerror(r));
+        syslog(LOG_ERR, "DBERROR: opening %s: %s", fname, cyrusdb_strerror(r));
+        scancache = NULL;
+    }
+
+    free(tofree);
+}
+
+static void scancache_close(void)
+{
+    if (scancache) cyrusdb_close(scancache);
+    scancache = NULL;
+    buf_free(&scancache_value);
+}
+
+/* 1 if infected, 0 if clean, -1 if not yet scanned with these signatures */
+static int scancache_lookup(const struct message_guid *guid,
+                            const char **virname)
+{
+    const char *key, *data, *val;
+    size_t datalen;
+    char *p;
+
+    if (!scancache || message_guid_isnull(guid)) return -1;
+
+    key = message_guid_encode(guid);
+    if (cyrusdb_fetch(scancache, key, strlen(key), &data, &datalen, NULL))
+        return -1;
+
+    /* "<sigversion>" or "<sigversion> <virname>" */
+    buf_setmap(&scancache_value, data, datalen);
+    val = buf_cstring(&scancache_value);
+    if (strtoul(val, &p, 10) != sigversion) return -1;
+    if (*p++ != ' ') return 0;
+
+    *virname = p;
+    return 1;
+}
+
+static void scancache_store(const struct message_guid *guid,
+                            const char *virname)
+{
+    struct buf val = BUF_INITIALIZER;
+    const char *key;
+    int r;
+
+    if (!scancache || message_guid_isnull(guid)) return;
+
+    key = message_guid_encode(guid);
+    buf_printf(&val, "%u", sigversion);
+    if (virname) buf_printf(&val, " %s", virname);
+
+    r = cyrusdb_store(scancache, key, strlen(key),
+                      buf_base(&val), buf_len(&val), NULL);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: storing scan result for %s: %s",
+               key, cyrusdb_strerror(r));
+    }
+
+    buf_free(&val);
+}
+
+
 /* forward declarations */
 int usage(char *name);
 int scan_me(struct findall_data *, void *);
+static void scan_parallel(struct scan_rock *srock, strarray_t *patterns);
 unsigned virus_check(struct mailbox *mailbox,
                      const struct index_record *record,
                      void *rock);
@@ -248,9 +561,11 @@ int main (int argc, char *argv[]) {
     int option;         /* getopt() returns an int */
     char *alt_config = NULL;
     char *search_str = NULL;
+    strarray_t *patterns = NULL;
+    int use_cache = 0;
     struct scan_rock srock;
 
-    while ((option = getopt(argc, argv, "C:s:rnv")) != EOF) {
+    while ((option = getopt(argc, argv, "C:s:rnvgj:")) != EOF) {
         switch (option) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -272,6 +587,15 @@ int main (int argc, char *argv[]) {
             verbose ++;
             break;
 
+        case 'g':
+            use_cache = 1;
+            break;
+
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) usage(argv[0]);
+            break;
+
         case 'h':
         default: usage(argv[0]);
         }
@@ -309,23 +633,42 @@ int main (int argc, char *argv[]) {
         }
     }
     else {
+        if (config_getstring(IMAPOPT_VIRUSSCAN_CLAMD_SOCKET))
+            engine = clamd_engine;
+
         printf("Using %s virus scanner\n", engine.name);
 
         if (engine.init) engine.state = engine.init();
+
+        if (use_cache && engine.sigversion)
+            sigversion = engine.sigversion(engine.state);
+        if (use_cache && !sigversion)
+            printf("Signature version unknown, not using the scan cache\n");
     }
 
-    if (optind == argc) { /* do the whole partition */
-        mboxlist_findall(NULL, "*", 1, 0, 0, scan_me, &srock);
-    } else {
-        strarray_t *array = strarray_new();
+    if (optind < argc) {
+        patterns = strarray_new();
         for (; optind < argc; optind++) {
-            strarray_append(array, argv[optind]);
+            strarray_append(patterns, argv[optind]);
         }
-        mboxlist_findallmulti(NULL, array, 1, 0, 0, scan_me, &srock);
-        strarray_free(array);
     }
 
-    if (email_notification) append_notifications();
+    if (nworkers) {
+        scan_parallel(&srock, patterns);
+    }
+    else {
+        if (sigversion) scancache_open();
+
+        if (!patterns) { /* do the whole partition */
+            mboxlist_findall(NULL, "*", 1, 0, 0, scan_me, &srock);
+        } else {
+            mboxlist_findallmulti(NULL, patterns, 1, 0, 0, scan_me, &srock);
+        }
+
+        if (email_notification) append_notifications();
+        scancache_close();
+    }
+    strarray_free(patterns);
 
     printf("\n%d mailboxes scanned, %d infected messages %s\n",
            srock.mailboxes_scanned,
@@ -343,7 +686,7 @@ int main (int argc, char *argv[]) {
 int usage(char *name)
 {
     printf("usage: %s [-C <alt_config>] [-s <imap-search-string>] [ -r [-n] ] [-v]\n"
-           "\t[mboxpattern1 ... [mboxpatternN]]\n", name);
+           "\t[-g] [-j <workers>] [mboxpattern1 ... [mboxpatternN]]\n", name);
     printf("\tif no mboxpattern is given %s works on all mailboxes\n", name);
     printf("\t -s imap-search-string  Rather than scanning for viruses,\n"
            "\t    messages matching the search criteria will be treated as infected.\n"
@@ -351,6 +694,8 @@ int usage(char *name)
     printf("\t -r remove infected messages\n");
     printf("\t -n notify mailbox owner of deleted messages via email\n");
     printf("\t -v verbose output\n");
+    printf("\t -g skip messages already scanned with the current signatures\n");
+    printf("\t -j scan users in this many parallel processes\n");
     exit(0);
 }
 
@@ -363,15 +708,13 @@ static void print_header(void)
            "--------------------------------------------------\n");
 }
 
-int scan_me(struct findall_data *data, void *rock)
+static int scan_mailbox(const mbname_t *mbname, struct scan_rock *srock)
 {
-    if (!data || !data->mbname) return 0;
     struct mailbox *mailbox = NULL;
     int r;
     struct infected_mbox *i_mbox = NULL;
-    const char *name = mbname_intname(data->mbname);
-    const char *userid = mbname_userid(data->mbname);
-    struct scan_rock *srock = (struct scan_rock *) rock;
+    const char *name = mbname_intname(mbname);
+    const char *userid = mbname_userid(mbname);
 
     /* reset infected count when user changes, without choking
      * on shared mailboxes, which don't have a user. */
@@ -441,6 +784,152 @@ int scan_me(struct findall_data *data, void *rock)
     return 0;
 }
 
+int scan_me(struct findall_data *data, void *rock)
+{
+    if (!data || !data->mbname) return 0;
+
+    return scan_mailbox(data->mbname, (struct scan_rock *) rock);
+}
+
+/*
+ * Parallel scanning.  The mailboxes are split into groups, one for
+ * each user's mailboxes and one for each shared mailbox, and the
+ * groups are handed out to a pool of worker processes.  Each worker
+ * sends the notifications for the users it scanned, and reports its
+ * counts back to the parent when the groups run out.
+ */
+struct scan_groups {
+    ptrarray_t groups;  /* of strarray_t of mailbox names */
+    char *userid;
+};
+
+struct scan_totals {
+    int mailboxes_scanned;
+    int total_infected;
+};
+
+static int group_me(struct findall_data *data, void *rock)
+{
+    struct scan_groups *sgroups = (struct scan_groups *) rock;
+    strarray_t *group;
+    const char *userid;
+
+    if (!data || !data->mbname) return 0;
+
+    userid = mbname_userid(data->mbname);
+    group = ptrarray_tail(&sgroups->groups);
+
+    if (!group || !userid || strcmpsafe(userid, sgroups->userid)) {
+        group = strarray_new();
+        ptrarray_append(&sgroups->groups, group);
+        free(sgroups->userid);
+        sgroups->userid = xstrdupnull(userid);
+    }
+
+    strarray_append(group, mbname_intname(data->mbname));
+
+    return 0;
+}
+
+static void scan_worker(int jobfd, int resultfd,
+                        struct scan_groups *sgroups, struct scan_rock *srock)
+{
+    struct scan_totals totals;
+    uint32_t idx;
+    int i;
+
+    /* keep each line of the report whole */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (sigversion) scancache_open();
+
+    while (retry_read(jobfd, &idx, sizeof(idx)) == sizeof(idx)) {
+        strarray_t *group = ptrarray_nth(&sgroups->groups, idx);
+
+        for (i = 0; i < strarray_size(group); i++) {
+            mbname_t *mbname = mbname_from_intname(strarray_nth(group, i));
+            scan_mailbox(mbname, srock);
+            mbname_free(&mbname);
+        }
+    }
+    close(jobfd);
+
+    if (email_notification) append_notifications();
+    scancache_close();
+
+    totals.mailboxes_scanned = srock->mailboxes_scanned;
+    totals.total_infected = srock->total_infected;
+    retry_write(resultfd, &totals, sizeof(totals));
+    close(resultfd);
+
+    mboxlist_close();
+    cyrus_done();
+    exit(0);
+}
+
+static void scan_parallel(struct scan_rock *srock, strarray_t *patterns)
+{
+    struct scan_groups sgroups = { PTRARRAY_INITIALIZER, NULL };
+    struct scan_totals totals;
+    int jobfds[2], resultfds[2];
+    pid_t *pids;
+    uint32_t idx;
+    int i;
+
+    if (!patterns)
+        mboxlist_findall(NULL, "*", 1, 0, 0, group_me, &sgroups);
+    else
+        mboxlist_findallmulti(NULL, patterns, 1, 0, 0, group_me, &sgroups);
+    free(sgroups.userid);
+
+    if (pipe(jobfds) || pipe(resultfds))
+        fatal("could not create worker pipe", EC_OSERR);
+
+    /* don't share the mailboxes.db handle or buffered output with the
+     * workers */
+    mboxlist_close();
+    fflush(stdout);
+
+    pids = xzmalloc(nworkers * sizeof(pid_t));
+    for (i = 0; i < nworkers; i++) {
+        pids[i] = fork();
+        if (pids[i] == -1)
+            fatal("could not fork scan worker", EC_OSERR);
+        if (!pids[i]) {
+            close(jobfds[1]);
+            close(resultfds[0]);
+            scan_worker(jobfds[0], resultfds[1], &sgroups, srock);
+            /* never returns */
+        }
+    }
+    close(jobfds[0]);
+    close(resultfds[1]);
+
+    for (idx = 0; idx < (uint32_t) ptrarray_size(&sgroups.groups); idx++) {
+        if (retry_write(jobfds[1], &idx, sizeof(idx)) != sizeof(idx))
+            fatal("could not write to scan workers", EC_OSERR);
+    }
+    close(jobfds[1]);
+
+    while (retry_read(resultfds[0], &totals, sizeof(totals)) == sizeof(totals)) {
+        srock->mailboxes_scanned += totals.mailboxes_scanned;
+        srock->total_infected += totals.total_infected;
+    }
+    close(resultfds[0]);
+
+    for (i = 0; i < nworkers; i++) {
+        int status = 0;
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            printf("scan worker %d failed\n", (int) pids[i]);
+    }
+    free(pids);
+
+    for (i = 0; i < ptrarray_size(&sgroups.groups); i++)
+        strarray_free(ptrarray_nth(&sgroups.groups, i));
+    ptrarray_fini(&sgroups.groups);
+}
+
 void create_digest(struct infected_mbox *i_mbox, struct mailbox *mailbox,
                    const struct index_record *record, const char *virname)
 {
@@ -477,10 +966,15 @@ unsigned virus_check(struct mailbox *mailbox,
                                   srock->searchargs->root, srock->msgno++);
     }
     else if (engine.scanfile) {
-        const char *fname = mailbox_record_fname(mailbox, record);
-
-        /* run the virus scanner against this message */
-        r = engine.scanfile(engine.state, fname, &virname);
+        r = scancache_lookup(&record->guid, &virname);
+        if (r < 0) {
+            const char *fname = mailbox_record_fname(mailbox, record);
+
+            /* run the virus scanner against this message */
+            r = engine.scanfile(engine.state, fname, &virname);
+            if (r < 0) r = 0;  /* failed, try again next time */
+            else scancache_store(&record->guid, r ? virname : NULL);
+        }
     }
 
     if (r) {
@@ -54,14 +54,34 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include "arrayu64.h"
 #include "assert.h"
 #include "caldav_alarm.h"
 #include "cyrusdb.h"
 #include "dav_db.h"
 #include "global.h"
+#include "mboxname.h"
+#include "prometheus.h"
 #include "util.h"
 #include "xmalloc.h"
 
+/* generated headers are not necessarily in current directory */
+#include "imap/imap_err.h"
+
+/* Index the *_get_updates() queries, so that they only visit
+   the changed rows of a collection, in modseq order */
+#define CMD_CREATE_CAL_MODSEQ_IDX                                       \
+    "CREATE INDEX IF NOT EXISTS idx_ical_modseq"                        \
+    " ON ical_objs ( mailbox, modseq );"
+
+#define CMD_CREATE_CARD_MODSEQ_IDX                                      \
+    "CREATE INDEX IF NOT EXISTS idx_vcard_modseq"                       \
+    " ON vcard_objs ( mailbox, modseq );"
+
+#define CMD_CREATE_OBJS_MODSEQ_IDX                                      \
+    "CREATE INDEX IF NOT EXISTS idx_dav_modseq"                         \
+    " ON dav_objs ( mailbox, modseq );"
+
 #define CMD_CREATE_CAL                                                  \
     "CREATE TABLE IF NOT EXISTS ical_objs ("                            \
     " rowid INTEGER PRIMARY KEY,"                                       \
@@ -84,7 +104,25 @@
     " sched_tag TEXT,"                                                  \
     " alive INTEGER,"                                                   \
     " UNIQUE( mailbox, resource ) );"                                   \
-    "CREATE INDEX IF NOT EXISTS idx_ical_uid ON ical_objs ( ical_uid );"
+    "CREATE INDEX IF NOT EXISTS idx_ical_uid ON ical_objs ( ical_uid );" \
+    CMD_CREATE_CAL_MODSEQ_IDX
+
+/* Materialized occurrences of recurring components, for a rolling
+   window around the time they were written (see caldav_db.c) */
+#define CMD_CREATE_OCC                                                  \
+    "CREATE TABLE IF NOT EXISTS ical_occurrences ("                     \
+    " rowid INTEGER PRIMARY KEY,"                                       \
+    " objid INTEGER,"                                                   \
+    " dtstart TEXT NOT NULL,"                                           \
+    " dtend TEXT NOT NULL,"                                             \
+    " FOREIGN KEY (objid) REFERENCES ical_objs (rowid) ON DELETE CASCADE );" \
+    "CREATE INDEX IF NOT EXISTS idx_ical_occ"                           \
+    " ON ical_occurrences ( objid, dtstart );"                          \
+    "CREATE TABLE IF NOT EXISTS ical_occwindow ("                       \
+    " objid INTEGER PRIMARY KEY,"                                       \
+    " win_start TEXT NOT NULL,"                                         \
+    " win_end TEXT NOT NULL,"                                           \
+    " FOREIGN KEY (objid) REFERENCES ical_objs (rowid) ON DELETE CASCADE );"
 
 #define CMD_CREATE_CARD                                                 \
     "CREATE TABLE IF NOT EXISTS vcard_objs ("                           \
@@ -108,7 +146,8 @@
     " alive INTEGER,"                                                   \
     " UNIQUE( mailbox, resource ) );"                                   \
     "CREATE INDEX IF NOT EXISTS idx_vcard_fn ON vcard_objs ( fullname );" \
-    "CREATE INDEX IF NOT EXISTS idx_vcard_uid ON vcard_objs ( vcard_uid );"
+    "CREATE INDEX IF NOT EXISTS idx_vcard_uid ON vcard_objs ( vcard_uid );" \
+    CMD_CREATE_CARD_MODSEQ_IDX
 
 #define CMD_CREATE_EM                                                   \
     "CREATE TABLE IF NOT EXISTS vcard_emails ("                         \
@@ -129,6 +168,20 @@
     " otheruser TEXT NOT NULL DEFAULT \"\","                            \
     " FOREIGN KEY (objid) REFERENCES vcard_objs (rowid) ON DELETE CASCADE );"
 
+/* The Contact/query filter fields of each card, as Contact/get reports
+   them, so that cards can be rejected without parsing the vCard */
+#define CMD_CREATE_SEARCH                                               \
+    "CREATE TABLE IF NOT EXISTS vcard_search ("                         \
+    " objid INTEGER PRIMARY KEY,"                                       \
+    " lastname TEXT,"                                                   \
+    " firstname TEXT,"                                                  \
+    " prefix TEXT,"                                                     \
+    " suffix TEXT,"                                                     \
+    " company TEXT,"                                                    \
+    " department TEXT,"                                                 \
+    " jobtitle TEXT,"                                                   \
+    " FOREIGN KEY (objid) REFERENCES vcard_objs (rowid) ON DELETE CASCADE );"
+
 #define CMD_CREATE_OBJS                                                 \
     "CREATE TABLE IF NOT EXISTS dav_objs ("                             \
     " rowid INTEGER PRIMARY KEY,"                                       \
@@ -149,11 +202,12 @@
     " ref_count INTEGER,"                                               \
     " alive INTEGER,"                                                   \
     " UNIQUE( mailbox, resource ) );"                                   \
-    "CREATE INDEX IF NOT EXISTS idx_res_uid ON dav_objs ( res_uid );"
+    "CREATE INDEX IF NOT EXISTS idx_res_uid ON dav_objs ( res_uid );"   \
+    CMD_CREATE_OBJS_MODSEQ_IDX
 
 
 #define CMD_CREATE CMD_CREATE_CAL CMD_CREATE_CARD CMD_CREATE_EM CMD_CREATE_GR \
-                   CMD_CREATE_OBJS
+                   CMD_CREATE_OBJS CMD_CREATE_OCC CMD_CREATE_SEARCH
 
 /* leaves these unused columns around, but that's life.  A dav_reconstruct
  * will fix them */
@@ -187,6 +241,17 @@
     "ALTER TABLE dav_objs ADD COLUMN createdmodseq INTEGER;"    \
     "UPDATE dav_objs SET createdmodseq = 1;"
 
+#define CMD_DBUPGRADEv8                                         \
+    CMD_CREATE_CAL_MODSEQ_IDX                                   \
+    CMD_CREATE_CARD_MODSEQ_IDX                                  \
+    CMD_CREATE_OBJS_MODSEQ_IDX
+
+#define CMD_DBUPGRADEv9 CMD_CREATE_OCC
+
+/* cards written before this have no vcard_search row, and are matched
+ * by parsing them until a dav_reconstruct fills it in */
+#define CMD_DBUPGRADEv10 CMD_CREATE_SEARCH
+
 
 struct sqldb_upgrade davdb_upgrade[] = {
   { 2, CMD_DBUPGRADEv2, NULL },
@@ -195,21 +260,56 @@ struct sqldb_upgrade davdb_upgrade[] = {
   { 5, CMD_DBUPGRADEv5, NULL },
   { 6, CMD_DBUPGRADEv6, NULL },
   { 7, CMD_DBUPGRADEv7, NULL },
+  { 8, CMD_DBUPGRADEv8, NULL },
+  { 9, CMD_DBUPGRADEv9, NULL },
+  { 10, CMD_DBUPGRADEv10, NULL },
   { 0, NULL, NULL }
 };
 
-#define DB_VERSION 7
+#define DB_VERSION 10
 
 static int in_reconstruct = 0;
 
+static void _sqldb_open_cb(int pooled)
+{
+    prometheus_increment(pooled ? CYRUS_SQLDB_OPEN_TOTAL_SOURCE_POOL
+                                : CYRUS_SQLDB_OPEN_TOTAL_SOURCE_FILE);
+}
+
+static void _sqldb_exec_cb(int cached, double seconds)
+{
+    prometheus_increment(cached ? CYRUS_SQLDB_EXEC_TOTAL_STMT_CACHED
+                                : CYRUS_SQLDB_EXEC_TOTAL_STMT_PREPARED);
+    prometheus_apply_delta(CYRUS_SQLDB_EXEC_SECONDS_TOTAL, seconds);
+}
+
+static sqldb_t *_dav_open(const char *fname)
+{
+    static int configured = 0;
+
+    if (!configured) {
+        struct sqldb_options opts = {
+            config_getint(IMAPOPT_SQLDB_POOL_SIZE),
+            config_getswitch(IMAPOPT_SQLDB_WAL),
+            &_sqldb_open_cb,
+            &_sqldb_exec_cb
+        };
+
+        sqldb_setoptions(&opts);
+        configured = 1;
+    }
+
+    return sqldb_open(fname, CMD_CREATE, DB_VERSION, davdb_upgrade,
+                      config_getint(IMAPOPT_DAV_LOCK_TIMEOUT) * 1000);
+}
+
 EXPORTED sqldb_t *dav_open_userid(const char *userid)
 {
     sqldb_t *db = NULL;
     struct buf fname = BUF_INITIALIZER;
     dav_getpath_byuserid(&fname, userid);
     if (in_reconstruct) buf_printf(&fname, ".NEW");
-    db = sqldb_open(buf_cstring(&fname), CMD_CREATE, DB_VERSION, davdb_upgrade,
-                    config_getint(IMAPOPT_DAV_LOCK_TIMEOUT) * 1000);
+    db = _dav_open(buf_cstring(&fname));
     buf_free(&fname);
     return db;
 }
@@ -220,17 +320,159 @@ EXPORTED sqldb_t *dav_open_mailbox(struct mailbox *mailbox)
     struct buf fname = BUF_INITIALIZER;
     dav_getpath(&fname, mailbox);
     if (in_reconstruct) buf_printf(&fname, ".NEW");
-    db = sqldb_open(buf_cstring(&fname), CMD_CREATE, DB_VERSION, davdb_upgrade,
-                    config_getint(IMAPOPT_DAV_LOCK_TIMEOUT) * 1000);
+    db = _dav_open(buf_cstring(&fname));
     buf_free(&fname);
     return db;
 }
 
+EXPORTED int dav_bind_resources(struct sqldb_bindval *bval,
+                                const strarray_t *resources, int start)
+{
+    static const char * const names[DAV_RESOURCE_BATCH] = {
+        ":r0",  ":r1",  ":r2",  ":r3",  ":r4",  ":r5",  ":r6",  ":r7",
+        ":r8",  ":r9",  ":r10", ":r11", ":r12", ":r13", ":r14", ":r15",
+        ":r16", ":r17", ":r18", ":r19", ":r20", ":r21", ":r22", ":r23",
+        ":r24", ":r25", ":r26", ":r27", ":r28", ":r29", ":r30", ":r31"
+    };
+    int n;
+
+    for (n = 0; n < DAV_RESOURCE_BATCH &&
+             start < strarray_size(resources); n++, start++) {
+        bval[n].name = names[n];
+        bval[n].type = SQLITE_TEXT;
+        bval[n].val.s = strarray_nth(resources, start);
+    }
+    bval[n].name = NULL;
+    bval[n].type = SQLITE_NULL;
+    bval[n].val.s = NULL;
+
+    return start;
+}
+
+struct dav_reconstruct_rock {
+    int incremental;
+    strarray_t mboxnames;       /* collections seen, if incremental */
+};
+
+static const char *dav_objs_table(int mbtype)
+{
+    /* same order as mailbox_update_dav() */
+    if (mbtype & MBTYPE_ADDRESSBOOK) return "vcard_objs";
+    if (mbtype & MBTYPE_CALENDAR) return "ical_objs";
+    if (mbtype & MBTYPE_COLLECTION) return "dav_objs";
+    return NULL;
+}
+
+struct dav_prune_rock {
+    struct mailbox *mailbox;
+    arrayu64_t stale;
+};
+
+static int _dav_prune_cb(sqlite3_stmt *stmt, void *rock)
+{
+    struct dav_prune_rock *prock = (struct dav_prune_rock *) rock;
+    uint32_t uid = sqlite3_column_int(stmt, 1);
+    struct index_record record;
+
+    if (mailbox_find_index_record(prock->mailbox, uid, &record) ||
+        (record.internal_flags & FLAG_INTERNAL_UNLINKED)) {
+        arrayu64_append(&prock->stale, sqlite3_column_int64(stmt, 0));
+    }
+
+    return 0;
+}
+
+/*
+ * An incremental reconstruct starts from a copy of the old DB, so
+ * remove the rows for resources which no longer exist in 'mailbox'.
+ */
+static int _dav_prune_mailbox(struct mailbox *mailbox)
+{
+    const char *table = dav_objs_table(mailbox->mbtype);
+    struct dav_prune_rock prock = { mailbox, ARRAYU64_INITIALIZER };
+    struct buf cmd = BUF_INITIALIZER;
+    sqldb_t *db;
+    int i, r;
+
+    if (!table) return 0;
+
+    db = dav_open_mailbox(mailbox);
+    if (!db) return IMAP_IOERROR;
+
+    struct sqldb_bindval bval[] = {
+        { ":mailbox", SQLITE_TEXT, { .s = mailbox->name } },
+        { NULL,       SQLITE_NULL, { .s = NULL          } } };
+
+    buf_printf(&cmd, "SELECT rowid, imap_uid FROM %s WHERE mailbox = :mailbox;",
+               table);
+    r = sqldb_exec(db, buf_cstring(&cmd), bval, _dav_prune_cb, &prock);
+
+    buf_reset(&cmd);
+    buf_printf(&cmd, "DELETE FROM %s WHERE rowid = :rowid;", table);
+    for (i = 0; !r && i < arrayu64_size(&prock.stale); i++) {
+        struct sqldb_bindval rbval[] = {
+            { ":rowid", SQLITE_INTEGER, { .i = arrayu64_nth(&prock.stale, i) } },
+            { NULL,     SQLITE_NULL,    { .s = NULL                         } } };
+        r = sqldb_exec(db, buf_cstring(&cmd), rbval, NULL, NULL);
+    }
+
+    arrayu64_fini(&prock.stale);
+    buf_free(&cmd);
+    sqldb_close(&db);
+
+    return r;
+}
+
+static int _dav_mboxname_cb(sqlite3_stmt *stmt, void *rock)
+{
+    strarray_add((strarray_t *) rock, (const char *) sqlite3_column_text(stmt, 0));
+    return 0;
+}
+
+/*
+ * ... and the rows of collections which no longer exist at all.
+ */
+static int _dav_prune_user(sqldb_t *db, const strarray_t *seen)
+{
+    static const char * const tables[] = {
+        "ical_objs", "vcard_objs", "dav_objs", NULL
+    };
+    struct buf cmd = BUF_INITIALIZER;
+    int i, j, r = 0;
+
+    for (i = 0; !r && tables[i]; i++) {
+        strarray_t mboxnames = STRARRAY_INITIALIZER;
+
+        buf_reset(&cmd);
+        buf_printf(&cmd, "SELECT DISTINCT mailbox FROM %s;", tables[i]);
+        r = sqldb_exec(db, buf_cstring(&cmd), NULL, _dav_mboxname_cb, &mboxnames);
+
+        buf_reset(&cmd);
+        buf_printf(&cmd, "DELETE FROM %s WHERE mailbox = :mailbox;", tables[i]);
+        for (j = 0; !r && j < strarray_size(&mboxnames); j++) {
+            const char *mboxname = strarray_nth(&mboxnames, j);
+            if (strarray_find(seen, mboxname, 0) >= 0) continue;
+
+            struct sqldb_bindval bval[] = {
+                { ":mailbox", SQLITE_TEXT, { .s = mboxname } },
+                { NULL,       SQLITE_NULL, { .s = NULL     } } };
+            r = sqldb_exec(db, buf_cstring(&cmd), bval, NULL, NULL);
+        }
+
+        strarray_fini(&mboxnames);
+    }
+
+    buf_free(&cmd);
+
+    return r;
+}
+
 /*
  * mboxlist_usermboxtree() callback function to create DAV DB entries for a mailbox
  */
-static int _dav_reconstruct_mb(const mbentry_t *mbentry, void *rock __attribute__((unused)))
+static int _dav_reconstruct_mb(const mbentry_t *mbentry, void *rock)
 {
+    struct dav_reconstruct_rock *rrock = (struct dav_reconstruct_rock *) rock;
     int r = 0;
 
     signals_poll();
@@ -242,13 +484,35 @@ static int _dav_reconstruct_mb(const mbentry_t *mbentry, void *rock __attribute_
         r = mailbox_open_iwl(mbentry->name, &mailbox);
         // needs to be writable to remove bogus lastalarm data
         if (!r) r = mailbox_add_dav(mailbox);
+        if (!r && rrock->incremental &&
+            !mboxname_isdeletedmailbox(mailbox->name, NULL)) {
+            strarray_add(&rrock->mboxnames, mailbox->name);
+            r = _dav_prune_mailbox(mailbox);
+        }
         mailbox_close(&mailbox);
     }
+#else
+    (void) rrock;
 #endif
 
     return r;
 }
 
+/* seed the new DB with a copy of the current one */
+static int _dav_copy_user(const char *userid, const char *newfname)
+{
+    sqldb_t *db = dav_open_userid(userid);
+    int r;
+
+    if (!db) return IMAP_IOERROR;
+
+    unlink(newfname);
+    r = sqldb_copy(db, newfname);
+    sqldb_close(&db);
+
+    return r ? IMAP_IOERROR : 0;
+}
+
 static void run_audit_tool(const char *tool, const char *srcdb, const char *dstdb)
 {
     pid_t pid = fork();
@@ -265,9 +529,14 @@ static void run_audit_tool(const char *tool, const char *srcdb, const char *dstd
     while (waitpid(pid, &status, 0) < 0);
 }
 
-EXPORTED int dav_reconstruct_user(const char *userid, const char *audit_tool)
+EXPORTED int dav_reconstruct_user(const char *userid, const char *audit_tool,
+                                  int incremental)
 {
-    syslog(LOG_NOTICE, "dav_reconstruct_user: %s", userid);
+    struct dav_reconstruct_rock rrock = { incremental, STRARRAY_INITIALIZER };
+    int r;
+
+    syslog(LOG_NOTICE, "dav_reconstruct_user: %s%s", userid,
+           incremental ? " (incremental)" : "");
 
     struct buf fname = BUF_INITIALIZER;
     dav_getpath_byuserid(&fname, userid);
@@ -282,17 +551,29 @@ EXPORTED int dav_reconstruct_user(const char *userid, const char *audit_tool)
      * blocking database over the entire server */
     caldav_alarm_delete_user(userid);
 
+    if (incremental && _dav_copy_user(userid, buf_cstring(&newfname))) {
+        syslog(LOG_WARNING, "dav_reconstruct_user: %s can't copy %s,"
+               " reconstructing from scratch", userid, buf_cstring(&fname));
+        unlink(buf_cstring(&newfname));
+        rrock.incremental = 0;
+    }
+
     in_reconstruct = 1;
 
     sqldb_t *userdb = dav_open_userid(userid);
     sqldb_begin(userdb, "reconstruct");
-    int r = mboxlist_usermboxtree(userid, NULL, _dav_reconstruct_mb, NULL, 0);
+    r = mboxlist_usermboxtree(userid, NULL, _dav_reconstruct_mb, &rrock, 0);
+    if (!r && rrock.incremental)
+        r = _dav_prune_user(userdb, &rrock.mboxnames);
     if (r)
         sqldb_rollback(userdb, "reconstruct");
     else
         sqldb_commit(userdb, "reconstruct");
     sqldb_close(&userdb);
 
+    /* make sure nothing is left open on the file we're about to move */
+    sqldb_pool_flush();
+
     in_reconstruct = 0;
 
     /* this actually works before close according to the internets */
@@ -314,6 +595,7 @@ EXPORTED int dav_reconstruct_user(const char *userid, const char *audit_tool)
         }
     }
 
+    strarray_fini(&rrock.mboxnames);
     buf_free(&newfname);
     buf_free(&fname);
 
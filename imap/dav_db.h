@@ -47,6 +47,7 @@
 #include "sqldb.h"
 #include "dav_util.h"
 #include "mailbox.h"
+#include "strarray.h"
 #include "util.h"
 
 struct dav_data {
@@ -71,6 +72,24 @@ sqldb_t *dav_open_mailbox(struct mailbox *mailbox);
 /* delete database corresponding to mailbox */
 int dav_delete(struct mailbox *mailbox);
 
-int dav_reconstruct_user(const char *userid, const char *audit_tool);
+/* Batched lookups by resource name use one cached statement with a
+ * fixed-size IN-list; unused slots are left bound to NULL */
+#define DAV_RESOURCE_BATCH 32
+#define DAV_RESOURCE_INLIST \
+    " resource IN (:r0, :r1, :r2, :r3, :r4, :r5, :r6, :r7,"             \
+    " :r8, :r9, :r10, :r11, :r12, :r13, :r14, :r15,"                    \
+    " :r16, :r17, :r18, :r19, :r20, :r21, :r22, :r23,"                  \
+    " :r24, :r25, :r26, :r27, :r28, :r29, :r30, :r31)"
+
+/* bind up to DAV_RESOURCE_BATCH names from 'resources', starting at
+ * 'start', into 'bval' (which needs DAV_RESOURCE_BATCH+1 entries) and
+ * terminate it.  Returns the index of the first name not bound */
+int dav_bind_resources(struct sqldb_bindval *bval,
+                       const strarray_t *resources, int start);
+
+/* rebuild the DAV DB of 'userid'.  If 'incremental', start from a copy
+ * of the existing DB and only reparse resources which have changed */
+int dav_reconstruct_user(const char *userid, const char *audit_tool,
+                         int incremental);
 
 #endif /* DAV_DB_H */
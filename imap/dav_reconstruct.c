@@ -51,6 +51,7 @@
 #include <string.h>
 #include <syslog.h>
 #include <time.h>
+#include <sys/types.h>
 
 #include <libical/ical.h>
 
@@ -64,6 +65,7 @@
 #include "mboxname.h"
 #include "mboxlist.h"
 #include "util.h"
+#include "workerpool.h"
 #include "xmalloc.h"
 #include "xstrlcat.h"
 #include "zoneinfo_db.h"
@@ -85,12 +87,55 @@ void usage(void);
 void shut_down(int code);
 
 static int code = 0;
+static int incremental = 0;
+static int nworkers = 0;
 
 static int do_user(const char *userid, void *rock)
 {
     printf("Reconstructing DAV DB for %s...\n", userid);
 
-    return dav_reconstruct_user(userid, (const char *)rock);
+    return dav_reconstruct_user(userid, (const char *)rock, incremental);
+}
+
+static int collect_user(const char *userid, void *rock)
+{
+    strarray_append((strarray_t *) rock, userid);
+    return 0;
+}
+
+struct parallel_rock {
+    const strarray_t *userids;
+    const char *audit_tool;
+};
+
+static int parallel_job(unsigned idx, void *rock)
+{
+    struct parallel_rock *prock = (struct parallel_rock *) rock;
+
+    return do_user(strarray_nth(prock->userids, idx),
+                   (void *) prock->audit_tool);
+}
+
+static void parallel_done(void *rock __attribute__((unused)))
+{
+    mboxlist_close();
+    mboxlist_done();
+    sqldb_done();
+}
+
+/* reconstruct the users in a pool of worker processes.  Each user's
+ * DAV DB is a file of its own, so the workers don't contend for it.
+ * Returns non-zero if any worker failed. */
+static int do_parallel(const strarray_t *userids, const char *audit_tool)
+{
+    struct parallel_rock prock = { userids, audit_tool };
+
+    if (!userids->count) return 0;
+
+    mboxlist_close();
+
+    return workerpool_run(nworkers, userids->count,
+                          parallel_job, parallel_done, &prock);
 }
 
 int main(int argc, char **argv)
@@ -100,7 +145,7 @@ int main(int argc, char **argv)
     int allusers = 0;
     const char *audit_tool = NULL;
 
-    while ((opt = getopt(argc, argv, "C:A:a")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:A:aij:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -114,6 +159,15 @@ int main(int argc, char **argv)
             audit_tool = optarg;
             break;
 
+        case 'i':
+            incremental = 1;
+            break;
+
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) usage();
+            break;
+
         default:
             usage();
         }
@@ -134,7 +188,16 @@ int main(int argc, char **argv)
     /* Initialize libical */
     ical_support_init();
 
-    if (allusers) {
+    if (allusers && nworkers) {
+        strarray_t userids = STRARRAY_INITIALIZER;
+        mboxlist_alluser(collect_user, &userids);
+        if (do_parallel(&userids, audit_tool)) {
+            fprintf(stderr, "some dav_reconstruct workers failed\n");
+            code = EC_SOFTWARE;
+        }
+        strarray_fini(&userids);
+    }
+    else if (allusers) {
         mboxlist_alluser(do_user, (void *)audit_tool);
     }
     else if (optind == argc) {
@@ -153,7 +216,8 @@ int main(int argc, char **argv)
 void usage(void)
 {
     fprintf(stderr,
-            "usage: dav_reconstruct [-C <alt_config>] userid\n");
+            "usage: dav_reconstruct [-C <alt_config>] [-A <audit_tool>] [-i]"
+            " [-a [-j <workers>] | userid...]\n");
     exit(EC_USAGE);
 }
 
@@ -168,12 +168,18 @@ EXPORTED const char *dlist_reserve_path(const char *part, int isarchive, int isb
     return buf;
 }
 
+/* Uploaded files are not fsynced one at a time as they are read; their
+ * writeback is started and the syncs are collected and waited for once
+ * the whole top level dlist has been parsed */
+static struct copyfile_batch *reserve_batch;
+
 static int reservefile(struct protstream *in, const char *part,
                        struct message_guid *guid, unsigned long size,
                        int isbackup, const char **fname)
 {
     FILE *file;
     char buf[8192+1];
+    int fd;
     int r = 0;
 
     /* XXX - write to a temporary file then move in to place! */
@@ -219,14 +225,22 @@ static int reservefile(struct protstream *in, const char *part,
         goto error;
     }
 
-    if (fsync(fileno(file)) < 0) {
-        syslog(LOG_ERR, "IOERROR: fsyncing file '%s': %m", *fname);
+    fd = dup(fileno(file));
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: dup file '%s': %m", *fname);
         r = IMAP_IOERROR;
         goto error;
     }
 
     fclose(file);
 
+    if (!reserve_batch) reserve_batch = cyrus_copyfile_batch_new();
+    if (cyrus_copyfile_batch_adopt(reserve_batch, fd, *fname)) {
+        /* the batch has already cleaned up */
+        *fname = NULL;
+        return IMAP_IOERROR;
+    }
+
     return 0;
 
 error:
@@ -655,6 +669,284 @@ EXPORTED void dlist_print(const struct dlist *dl, int printkeys,
     }
 }
 
+/*
+ * Compact binary encoding.  A list value may be sent as
+ *
+ *    %B{len}\r\n<len bytes>
+ *
+ * where the bytes hold one value: a type byte followed by
+ *
+ *    NIL:               nothing
+ *    ATOM, FLAG, BUF:   varint length, then the bytes
+ *    NUM, DATE, HEX:    varint value
+ *    GUID:              the raw MESSAGE_GUID_SIZE bytes
+ *    KVLIST:            varint count, then per child a varint key
+ *                       length, the key bytes and the child value
+ *    ATOMLIST:          varint count, then each child value
+ *
+ * Varints are little-endian base 128.  Files and keyed atom lists
+ * have no binary form, so lists containing them are printed as text
+ * with their other children encoded separately.
+ */
+
+#define DLIST_BINARY_MAXDEPTH 64
+
+enum {
+    DLB_NIL      = 'N',
+    DLB_ATOM     = 'A',
+    DLB_FLAG     = 'F',
+    DLB_NUM      = 'U',
+    DLB_DATE     = 'D',
+    DLB_HEX      = 'H',
+    DLB_BUF      = 'M',
+    DLB_GUID     = 'G',
+    DLB_KVLIST   = 'K',
+    DLB_ATOMLIST = 'L'
+};
+
+static int dlist_binary_ok(const struct dlist *dl)
+{
+    const struct dlist *di;
+
+    switch (dl->type) {
+    case DL_FILE:
+        return 0;
+    case DL_ATOMLIST:
+        if (dl->nval) return 0; /* keyed atom list */
+        /* fall through */
+    case DL_KVLIST:
+        for (di = dl->head; di; di = di->next)
+            if (!dlist_binary_ok(di)) return 0;
+        break;
+    }
+
+    return 1;
+}
+
+static void binary_putvarint(struct buf *buf, bit64 val)
+{
+    while (val >= 0x80) {
+        buf_putc(buf, (val & 0x7f) | 0x80);
+        val >>= 7;
+    }
+    buf_putc(buf, val);
+}
+
+static void binary_putbytes(struct buf *buf, const char *base, size_t len)
+{
+    binary_putvarint(buf, len);
+    buf_appendmap(buf, base, len);
+}
+
+static void binary_encode(const struct dlist *dl, struct buf *buf)
+{
+    const struct dlist *di;
+    size_t n = 0;
+
+    switch (dl->type) {
+    case DL_ATOM:
+        buf_putc(buf, DLB_ATOM);
+        binary_putbytes(buf, dl->sval, dl->nval);
+        break;
+    case DL_FLAG:
+        buf_putc(buf, DLB_FLAG);
+        binary_putbytes(buf, dl->sval, dl->nval);
+        break;
+    case DL_BUF:
+        buf_putc(buf, DLB_BUF);
+        binary_putbytes(buf, dl->sval, dl->nval);
+        break;
+    case DL_NUM:
+        buf_putc(buf, DLB_NUM);
+        binary_putvarint(buf, dl->nval);
+        break;
+    case DL_DATE:
+        buf_putc(buf, DLB_DATE);
+        binary_putvarint(buf, dl->nval);
+        break;
+    case DL_HEX:
+        buf_putc(buf, DLB_HEX);
+        binary_putvarint(buf, dl->nval);
+        break;
+    case DL_GUID: {
+        char guid[MESSAGE_GUID_SIZE];
+        message_guid_export(dl->gval, guid);
+        buf_putc(buf, DLB_GUID);
+        buf_appendmap(buf, guid, MESSAGE_GUID_SIZE);
+        break;
+    }
+    case DL_KVLIST:
+    case DL_ATOMLIST:
+        for (di = dl->head; di; di = di->next) n++;
+        buf_putc(buf, dl->type == DL_KVLIST ? DLB_KVLIST : DLB_ATOMLIST);
+        binary_putvarint(buf, n);
+        for (di = dl->head; di; di = di->next) {
+            if (dl->type == DL_KVLIST)
+                binary_putbytes(buf, di->name, di->name ? strlen(di->name) : 0);
+            binary_encode(di, buf);
+        }
+        break;
+    default:
+        buf_putc(buf, DLB_NIL);
+        break;
+    }
+}
+
+EXPORTED void dlist_print_binary(const struct dlist *dl, int printkeys,
+                                 struct protstream *out)
+{
+    static struct buf enc = BUF_INITIALIZER;
+    struct dlist *di;
+
+    if (dl->type != DL_KVLIST && dl->type != DL_ATOMLIST) {
+        /* scalars are no smaller in binary, print them as text */
+        dlist_print(dl, printkeys, out);
+        return;
+    }
+
+    if (printkeys) {
+        prot_printastring(out, dl->name);
+        prot_putc(' ', out);
+    }
+
+    if (!dlist_binary_ok(dl)) {
+        /* text framing, with the children encoded where possible */
+        if (dl->type == DL_KVLIST) prot_putc('%', out);
+        prot_putc('(', out);
+        for (di = dl->head; di; di = di->next) {
+            dlist_print_binary(di, dl->type == DL_KVLIST ? 1 : dl->nval, out);
+            if (di->next) prot_putc(' ', out);
+        }
+        prot_putc(')', out);
+        return;
+    }
+
+    buf_reset(&enc);
+    binary_encode(dl, &enc);
+    prot_printf(out, "%%B");
+    prot_printliteral(out, buf_base(&enc), buf_len(&enc));
+}
+
+static int binary_getvarint(const char **pp, const char *end, bit64 *valp)
+{
+    const unsigned char *p = (const unsigned char *) *pp;
+    bit64 val = 0;
+    int shift;
+
+    for (shift = 0; shift < 64; shift += 7) {
+        if ((const char *) p >= end) return 0;
+        val |= (bit64) (*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *pp = (const char *) p;
+            *valp = val;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int binary_getbytes(const char **pp, const char *end,
+                           const char **basep, size_t *lenp)
+{
+    bit64 len;
+
+    if (!binary_getvarint(pp, end, &len)) return 0;
+    if (len > (bit64) (end - *pp)) return 0;
+
+    *basep = *pp;
+    *lenp = len;
+    *pp += len;
+
+    return 1;
+}
+
+/* decode one value from the buffer in place, returns NULL on bad data */
+static struct dlist *binary_decode(const char **pp, const char *end,
+                                   const char *key, size_t keylen, int depth)
+{
+    struct dlist *dl = dlist_child(NULL, NULL);
+    const char *base;
+    size_t len;
+    bit64 n;
+    char type;
+
+    dl->name = xstrndup(key ? key : "", keylen);
+
+    if (*pp >= end || depth > DLIST_BINARY_MAXDEPTH) goto fail;
+    type = *(*pp)++;
+
+    switch (type) {
+    case DLB_NIL:
+        break;
+
+    case DLB_ATOM:
+    case DLB_FLAG:
+    case DLB_BUF:
+        if (!binary_getbytes(pp, end, &base, &len)) goto fail;
+        if (type != DLB_BUF && memchr(base, '\0', len)) goto fail;
+        dlist_makemap(dl, base, len);
+        if (type == DLB_ATOM) dl->type = DL_ATOM;
+        else if (type == DLB_FLAG) dl->type = DL_FLAG;
+        break;
+
+    case DLB_NUM:
+    case DLB_DATE:
+    case DLB_HEX:
+        if (!binary_getvarint(pp, end, &n)) goto fail;
+        dl->type = type == DLB_NUM ? DL_NUM : type == DLB_DATE ? DL_DATE : DL_HEX;
+        dl->nval = n;
+        break;
+
+    case DLB_GUID:
+        if (end - *pp < MESSAGE_GUID_SIZE) goto fail;
+        dl->type = DL_GUID;
+        dl->gval = xzmalloc(sizeof(struct message_guid));
+        message_guid_import(dl->gval, *pp);
+        *pp += MESSAGE_GUID_SIZE;
+        break;
+
+    case DLB_KVLIST:
+    case DLB_ATOMLIST:
+        dl->type = type == DLB_KVLIST ? DL_KVLIST : DL_ATOMLIST;
+        if (!binary_getvarint(pp, end, &n)) goto fail;
+        /* every child needs at least one byte */
+        if (n > (bit64) (end - *pp)) goto fail;
+        while (n--) {
+            struct dlist *di;
+            base = "";
+            len = 0;
+            if (type == DLB_KVLIST && !binary_getbytes(pp, end, &base, &len))
+                goto fail;
+            di = binary_decode(pp, end, base, len, depth + 1);
+            if (!di) goto fail;
+            dlist_stitch(dl, di);
+        }
+        break;
+
+    default:
+        goto fail;
+    }
+
+    return dl;
+
+fail:
+    dlist_free(&dl);
+    return NULL;
+}
+
+static struct dlist *dlist_decode_binary(const char *name,
+                                         const char *base, size_t len)
+{
+    const char *p = base, *end = base + len;
+    struct dlist *dl = binary_decode(&p, end, name, name ? strlen(name) : 0, 0);
+
+    /* must consume exactly the whole literal */
+    if (dl && p != end) dlist_free(&dl);
+
+    return dl;
+}
+
 EXPORTED void dlist_printbuf(const struct dlist *dl, int printkeys, struct buf *outbuf)
 {
     struct protstream *outstream;
@@ -1034,8 +1326,8 @@ static char next_nonspace(struct protstream *in, char c)
     return c;
 }
 
-EXPORTED int dlist_parse(struct dlist **dlp, int parsekey, int isbackup,
-                          struct protstream *in)
+static int parse_dlist(struct dlist **dlp, int parsekey, int isbackup,
+                       struct protstream *in)
 {
     struct dlist *dl = NULL;
     static struct buf kbuf;
@@ -1062,7 +1354,7 @@ EXPORTED int dlist_parse(struct dlist **dlp, int parsekey, int isbackup,
         while (c != ')') {
             struct dlist *di = NULL;
             prot_ungetc(c, in);
-            c = dlist_parse(&di, 0, isbackup, in);
+            c = parse_dlist(&di, 0, isbackup, in);
             if (di) dlist_stitch(dl, di);
             c = next_nonspace(in, c);
             if (c == EOF) goto fail;
@@ -1078,7 +1370,7 @@ EXPORTED int dlist_parse(struct dlist **dlp, int parsekey, int isbackup,
             while (c != ')') {
                 struct dlist *di = NULL;
                 prot_ungetc(c, in);
-                c = dlist_parse(&di, 1, isbackup, in);
+                c = parse_dlist(&di, 1, isbackup, in);
                 if (di) dlist_stitch(dl, di);
                 c = next_nonspace(in, c);
                 if (c == EOF) goto fail;
@@ -1103,6 +1395,17 @@ EXPORTED int dlist_parse(struct dlist **dlp, int parsekey, int isbackup,
             dl = dlist_setfile(NULL, kbuf.s, pbuf.s, &tmp_guid, size, fname);
             /* file literal */
         }
+        else if (c == 'B') {
+            /* compact binary list, always a literal */
+            c = prot_getc(in);
+            if (c != '{') goto fail;
+            prot_ungetc(c, in);
+            c = getbastring(in, NULL, &vbuf);
+            dl = dlist_decode_binary(kbuf.s, vbuf.s, vbuf.len);
+            if (!dl) goto fail;
+            /* put back the terminator for the common read below */
+            if (c != EOF) prot_ungetc(c, in);
+        }
         else {
             /* unknown percent type */
             goto fail;
@@ -1135,6 +1438,20 @@ fail:
     return EOF;
 }
 
+EXPORTED int dlist_parse(struct dlist **dlp, int parsekey, int isbackup,
+                          struct protstream *in)
+{
+    int c = parse_dlist(dlp, parsekey, isbackup, in);
+
+    /* make sure any uploaded files are on disk before they are used */
+    if (reserve_batch && cyrus_copyfile_batch_commit(&reserve_batch)) {
+        dlist_free(dlp);
+        return EOF;
+    }
+
+    return c;
+}
+
 EXPORTED int dlist_parse_asatomlist(struct dlist **dlp, int parsekey,
                             struct protstream *in)
 {
@@ -219,6 +219,10 @@ void dlist_print(const struct dlist *dl, int printkeys,
                  struct protstream *out);
 void dlist_printbuf(const struct dlist *dl, int printkeys,
                     struct buf *outbuf);
+/* like dlist_print, but send lists in the compact binary encoding
+ * where possible.  Only for peers which advertised support for it */
+void dlist_print_binary(const struct dlist *dl, int printkeys,
+                        struct protstream *out);
 int dlist_parse(struct dlist **dlp, int parsekeys, int isbackup,
                  struct protstream *in);
 int dlist_parse_asatomlist(struct dlist **dlp, int parsekey,
@@ -46,6 +46,7 @@
 #include <string.h>
 #include <syslog.h>
 #include <ctype.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -67,12 +68,18 @@
 # endif
 #endif
 
+#ifdef HAVE_SHARED_MMAP
+#include <sys/mman.h>
+#endif
+
 #include "assert.h"
 #include "xmalloc.h"
 #include "global.h"
 #include "exitcodes.h"
+#include "retry.h"
 #include "util.h"
 #include "cyrusdb.h"
+#include "bloom.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -86,6 +93,295 @@
 static struct db *dupdb = NULL;
 static int duplicate_dbopen = 0;
 
+#define FNAME_FILTER_SUFFIX ".bloom"
+
+#ifdef HAVE_SHARED_MMAP
+/*
+ * A bloom filter of every key in the database, kept in a file next to
+ * it and mapped shared by all processes.  Bits are only ever set while
+ * holding the database write lock, and before the record they describe
+ * is committed, so a miss in the filter is a reliable miss in the db.
+ *
+ * When the filter is rebuilt (because it filled up, or after pruning)
+ * the replacement is renamed into place and the old file is flagged as
+ * retired, so that processes still mapping it know to reopen.
+ */
+#define FILTER_MAGIC "cyrus dupfilter\n"
+#define FILTER_MAGIC_SIZE 16
+#define FILTER_VERSION 1
+#define FILTER_ERROR 0.01
+#define FILTER_MINENTRIES 100000
+
+struct filter_header {
+    char magic[FILTER_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t entries;   /* capacity the bloom was sized for */
+    uint32_t count;     /* keys added so far */
+    uint32_t retired;   /* replaced by a newer file */
+};
+
+static struct {
+    char *fname;
+    ino_t ino;
+    char *base;
+    size_t size;
+    struct bloom bloom;
+} filter;
+
+#define FILTER_HEADER(f) ((struct filter_header *)(f).base)
+
+static void filter_close(void)
+{
+    if (filter.base) munmap(filter.base, filter.size);
+    filter.base = NULL;
+    filter.size = 0;
+    filter.ino = 0;
+    memset(&filter.bloom, 0, sizeof(struct bloom));
+}
+
+static int filter_open(void)
+{
+    struct filter_header *hdr;
+    struct stat sbuf;
+    struct bloom params;
+    char *base;
+    int fd;
+
+    filter_close();
+
+    fd = open(filter.fname, O_RDWR, 0);
+    if (fd < 0) return IMAP_IOERROR;
+
+    if (fstat(fd, &sbuf) < 0 ||
+        sbuf.st_size < (off_t) sizeof(struct filter_header)) {
+        close(fd);
+        return IMAP_IOERROR;
+    }
+
+    base = mmap(NULL, sbuf.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mmap %s: %m", filter.fname);
+        return IMAP_IOERROR;
+    }
+
+    /* bloom_init is deterministic, so it gives us the layout of the bits */
+    hdr = (struct filter_header *) base;
+    if (memcmp(hdr->magic, FILTER_MAGIC, FILTER_MAGIC_SIZE) ||
+        hdr->version != FILTER_VERSION ||
+        bloom_init(&params, hdr->entries, FILTER_ERROR)) {
+        munmap(base, sbuf.st_size);
+        return IMAP_MAILBOX_BADFORMAT;
+    }
+    bloom_free(&params);
+
+    if ((size_t) sbuf.st_size != sizeof(struct filter_header) + params.bytes) {
+        munmap(base, sbuf.st_size);
+        return IMAP_MAILBOX_BADFORMAT;
+    }
+
+    params.bf = (unsigned char *) base + sizeof(struct filter_header);
+    params.ready = 1;
+
+    filter.bloom = params;
+    filter.base = base;
+    filter.size = sbuf.st_size;
+    filter.ino = sbuf.st_ino;
+
+    return 0;
+}
+
+/* make sure we map the file currently in place; returns 1 if we do */
+static int filter_current(void)
+{
+    struct stat sbuf;
+
+    if (!filter.fname) return 0;
+
+    if (stat(filter.fname, &sbuf) < 0) {
+        filter_close();
+        return 0;
+    }
+
+    if (filter.base && sbuf.st_ino == filter.ino &&
+        !FILTER_HEADER(filter)->retired)
+        return 1;
+
+    return !filter_open();
+}
+
+static int filter_count_cb(void *rock,
+                           const char *key __attribute__((unused)),
+                           size_t keylen __attribute__((unused)),
+                           const char *data __attribute__((unused)),
+                           size_t datalen __attribute__((unused)))
+{
+    unsigned *count = (unsigned *) rock;
+
+    (*count)++;
+
+    return 0;
+}
+
+static int filter_add_cb(void *rock,
+                         const char *key, size_t keylen,
+                         const char *data __attribute__((unused)),
+                         size_t datalen __attribute__((unused)))
+{
+    struct bloom *bloom = (struct bloom *) rock;
+
+    bloom_add(bloom, key, keylen);
+
+    return 0;
+}
+
+/* (re)build the filter from the database, holding its write lock in *tid.
+ * the new filter has room for at least minentries keys */
+static int filter_build(struct txn **tid, unsigned minentries)
+{
+    struct filter_header hdr;
+    struct bloom bloom;
+    char *newfname = NULL;
+    unsigned count = 0;
+    int fd = -1;
+    int r;
+
+    r = cyrusdb_foreach(dupdb, "", 0, NULL, filter_count_cb, &count, tid);
+    if (r) goto done;
+
+    if (minentries < 2 * count) minentries = 2 * count;
+    if (minentries < FILTER_MINENTRIES) minentries = FILTER_MINENTRIES;
+
+    if (bloom_init(&bloom, minentries, FILTER_ERROR)) {
+        r = IMAP_NOSPACE;
+        goto done;
+    }
+
+    r = cyrusdb_foreach(dupdb, "", 0, NULL, filter_add_cb, &bloom, tid);
+    if (r) goto freebloom;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, FILTER_MAGIC, FILTER_MAGIC_SIZE);
+    hdr.version = FILTER_VERSION;
+    hdr.entries = minentries;
+    hdr.count = count;
+
+    newfname = strconcat(filter.fname, ".NEW", (char *)NULL);
+    fd = open(newfname, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0 ||
+        retry_write(fd, (char *) &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        retry_write(fd, (char *) bloom.bf, bloom.bytes) != bloom.bytes) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", newfname);
+        r = IMAP_IOERROR;
+        goto freebloom;
+    }
+
+    /* anyone still using the old filter must move on to the new one */
+    if (filter_current()) FILTER_HEADER(filter)->retired = 1;
+
+    if (rename(newfname, filter.fname) < 0) {
+        syslog(LOG_ERR, "IOERROR: renaming %s: %m", newfname);
+        r = IMAP_IOERROR;
+        goto freebloom;
+    }
+
+    r = filter_open();
+
+freebloom:
+    bloom_free(&bloom);
+    if (fd >= 0) close(fd);
+    if (r && newfname) unlink(newfname);
+done:
+    free(newfname);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: building duplicate filter %s: %s",
+               filter.fname, error_message(r));
+        /* nobody may trust a filter we failed to keep up to date */
+        filter_close();
+        unlink(filter.fname);
+    }
+
+    return r;
+}
+
+static void filter_init(const char *dbfname)
+{
+    struct txn *tid = NULL;
+
+    if (!config_getswitch(IMAPOPT_DUPLICATE_BLOOM)) return;
+
+    filter.fname = strconcat(dbfname, FNAME_FILTER_SUFFIX, (char *)NULL);
+    if (filter_current()) return;
+
+    filter_build(&tid, 0);
+    if (tid) cyrusdb_commit(dupdb, tid);
+}
+
+/* returns 1 if the key is definitely not in the database */
+static int filter_misses(const struct buf *key)
+{
+    /* a retired header tells us to reopen; otherwise the map is current */
+    if (!filter.base || FILTER_HEADER(filter)->retired) {
+        if (!filter_current()) return 0;
+    }
+
+    return !bloom_check(&filter.bloom, key->s, key->len);
+}
+
+/* called holding the database write lock, before the key is committed */
+static void filter_add(struct txn **tid, const struct buf *key)
+{
+    struct filter_header *hdr;
+
+    if (!filter_current() && filter_build(tid, 0)) return;
+
+    bloom_add(&filter.bloom, key->s, key->len);
+
+    hdr = FILTER_HEADER(filter);
+    if (++hdr->count >= hdr->entries)
+        filter_build(tid, 2 * hdr->entries);
+}
+
+static void filter_rebuild(void)
+{
+    struct txn *tid = NULL;
+
+    filter_build(&tid, 0);
+    if (tid) cyrusdb_commit(dupdb, tid);
+}
+
+static void filter_done(void)
+{
+    filter_close();
+    free(filter.fname);
+    filter.fname = NULL;
+}
+
+#define filter_enabled() (filter.fname != NULL)
+
+#else /* !HAVE_SHARED_MMAP */
+
+#define filter_init(dbfname) do { } while (0)
+#define filter_enabled() (0)
+#define filter_misses(key) (0)
+#define filter_add(tid, key) do { } while (0)
+#define filter_rebuild() do { } while (0)
+#define filter_done() do { } while (0)
+
+#endif /* HAVE_SHARED_MMAP */
+
+/* remove the filter belonging to the database fname, e.g. after a crash
+ * may have left it behind the database */
+EXPORTED void duplicate_filter_discard(const char *fname)
+{
+    char *filterfname = strconcat(fname, FNAME_FILTER_SUFFIX, (char *)NULL);
+
+    if (unlink(filterfname) < 0 && errno != ENOENT)
+        syslog(LOG_ERR, "IOERROR: unlinking %s: %m", filterfname);
+
+    free(filterfname);
+}
+
 /* must be called after cyrus_init */
 EXPORTED int duplicate_init(const char *fname)
 {
@@ -109,6 +405,8 @@ EXPORTED int duplicate_init(const char *fname)
     }
     duplicate_dbopen = 1;
 
+    filter_init(fname);
+
 out:
     free(tofree);
 
@@ -173,6 +471,8 @@ EXPORTED time_t duplicate_check(const duplicate_key_t *dkey)
     r = make_key(&key, dkey);
     if (r) return 0;
 
+    if (filter_misses(&key)) goto done;
+
     do {
         r = cyrusdb_fetch(dupdb, key.s, key.len,
                       &data, &len, NULL);
@@ -198,6 +498,7 @@ EXPORTED time_t duplicate_check(const duplicate_key_t *dkey)
            dkey->id, dkey->to, dkey->date, mark);
 #endif
 
+done:
     buf_free(&key);
     return mark;
 }
@@ -226,10 +527,28 @@ EXPORTED void duplicate_mark(const duplicate_key_t *dkey, time_t mark, unsigned
     memcpy(data, &mark, sizeof(mark));
     memcpy(data + sizeof(mark), &uid, sizeof(uid));
 
-    do {
-        r = cyrusdb_store(dupdb, key.s, key.len,
-                      data, sizeof(mark)+sizeof(uid), NULL);
-    } while (r == CYRUSDB_AGAIN);
+    if (filter_enabled()) {
+        struct txn *tid = NULL;
+
+        /* the filter must learn the key before anyone can read it */
+        do {
+            r = cyrusdb_store(dupdb, key.s, key.len,
+                              data, sizeof(mark)+sizeof(uid), &tid);
+        } while (r == CYRUSDB_AGAIN);
+
+        if (!r) filter_add(&tid, &key);
+
+        if (tid) {
+            if (r) cyrusdb_abort(dupdb, tid);
+            else cyrusdb_commit(dupdb, tid);
+        }
+    }
+    else {
+        do {
+            r = cyrusdb_store(dupdb, key.s, key.len,
+                              data, sizeof(mark)+sizeof(uid), NULL);
+        } while (r == CYRUSDB_AGAIN);
+    }
 
 #if DEBUG
     syslog(LOG_DEBUG, "duplicate_mark: %-40s %-20s %-40s %ld %lu",
@@ -355,6 +674,9 @@ EXPORTED int duplicate_prune(int seconds, struct hash_table *expire_table)
     syslog(LOG_NOTICE, "duplicate_prune: purged %d out of %d entries",
            prock.deletions, prock.count);
 
+    /* the pruned keys are still in the filter, start afresh */
+    if (filter_enabled() && prock.deletions) filter_rebuild();
+
     return 0;
 }
 
@@ -426,6 +748,7 @@ EXPORTED int duplicate_done(void)
     int r = 0;
 
     if (duplicate_dbopen) {
+        filter_done();
         r = cyrusdb_close(dupdb);
         if (r) {
             syslog(LOG_ERR, "DBERROR: error closing deliverdb: %s",
@@ -56,6 +56,7 @@ typedef struct duplicate_key {
 #define DUPLICATE_INITIALIZER { NULL, NULL, NULL }
 
 int duplicate_init(const char *fname);
+void duplicate_filter_discard(const char *fname);
 
 time_t duplicate_check(const duplicate_key_t *dkey);
 void duplicate_log(const duplicate_key_t *dkey, const char *action);
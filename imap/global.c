@@ -51,6 +51,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #ifdef HAVE_SSL
 #include <openssl/rand.h>
@@ -72,6 +73,8 @@
 #include "libcyr_cfg.h"
 #include "mboxlist.h"
 #include "mutex.h"
+#include "prometheus.h"
+#include "quota.h"
 #include "prot.h" /* for PROT_BUFSIZE */
 #include "strarray.h"
 #include "userdeny.h"
@@ -179,6 +182,88 @@ static void cyrus_modules_done()
     }
 }
 
+/* lock timing, gathered per lock class and written to prometheus
+ * at most once a second, since locks are taken far more often than
+ * we could afford to write each one out */
+static const struct {
+    const char *suffix;
+    const char *class;
+} lockstats_classes[] = {
+    { "/cyrus.index",       "mailbox_index" },
+    { ".conversations",     "conversations" },
+    { FNAME_MBOXLIST,       "mailboxes_db" },
+    { "/annotations.db",    "annotations" },
+    { "/cyrus.annotations", "annotations" },
+    { FNAME_QUOTADB,        "quota" },
+    { ".seen",              "seen" },
+    { ".lock",              "namelock" },
+    { NULL,                 "other" }
+};
+
+#define LOCKSTATS_NCLASSES \
+    (sizeof(lockstats_classes) / sizeof(lockstats_classes[0]))
+
+static struct prom_histogram lockstats_wait[LOCKSTATS_NCLASSES];
+static struct prom_histogram lockstats_hold[LOCKSTATS_NCLASSES];
+static time_t lockstats_flushed = 0;
+static int lockstats_busy = 0;
+
+static void lockstats_flush(void)
+{
+    size_t i;
+
+    lockstats_busy = 1;
+    for (i = 0; i < LOCKSTATS_NCLASSES; i++) {
+        prometheus_histogram_flush(&lockstats_wait[i]);
+        prometheus_histogram_flush(&lockstats_hold[i]);
+    }
+    lockstats_busy = 0;
+
+    lockstats_flushed = time(NULL);
+}
+
+static void lockstats_cb(const char *filename,
+                         int exclusive __attribute__((unused)),
+                         double waited, double held)
+{
+    const char *statsdir = prometheus_stats_dir();
+    size_t i, len;
+
+    /* the stats files are locked too, and we must not recurse */
+    if (lockstats_busy || !filename) return;
+    if (!strncmp(filename, statsdir, strlen(statsdir))) return;
+
+    len = strlen(filename);
+    for (i = 0; lockstats_classes[i].suffix; i++) {
+        size_t slen = strlen(lockstats_classes[i].suffix);
+        if (len >= slen &&
+            !strcmp(filename + len - slen, lockstats_classes[i].suffix))
+            break;
+    }
+
+    prometheus_histogram_add(&lockstats_wait[i], waited);
+    prometheus_histogram_add(&lockstats_hold[i], held);
+
+    if (time(NULL) != lockstats_flushed) lockstats_flush();
+}
+
+static void lockstats_init(void)
+{
+    size_t i;
+
+    for (i = 0; i < LOCKSTATS_NCLASSES; i++) {
+        const char *class = lockstats_classes[i].class;
+
+        prometheus_histogram_init(&lockstats_wait[i],
+            prometheus_lookup_label(CYRUS_LOCK_WAIT_SECONDS, class));
+        prometheus_histogram_init(&lockstats_hold[i],
+            prometheus_lookup_label(CYRUS_LOCK_HOLD_SECONDS, class));
+    }
+
+    lockstats_flushed = time(NULL);
+    lock_set_stats_cb(&lockstats_cb);
+}
+
 /* Called before a cyrus application starts (but after command line parameters
  * are read) */
 EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flags, int config_need_data)
@@ -370,6 +455,8 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
                                   config_getswitch(IMAPOPT_SQL_USESSL));
         libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
                                   config_getswitch(IMAPOPT_SKIPLIST_ALWAYS_CHECKPOINT));
+        libcyrus_config_setint(CYRUSOPT_TWOSKIP_GROUP_COMMIT,
+                               config_getint(IMAPOPT_TWOSKIP_GROUP_COMMIT));
 
         /* Not until all configuration parameters are set! */
         libcyrus_init();
@@ -381,6 +468,9 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
         debug_locks_longer_than = atof(locktime);
     }
 
+    if (config_getswitch(IMAPOPT_PROMETHEUS_ENABLED))
+        lockstats_init();
+
     return 0;
 }
 
@@ -760,6 +850,9 @@ EXPORTED int mysasl_proxy_policy(sasl_conn_t *conn,
 /* call before a cyrus application exits */
 EXPORTED void cyrus_done(void)
 {
+    lock_set_stats_cb(NULL);
+    lockstats_flush();
+
     cyrus_modules_done();
     if (cyrus_init_run != RUNNING)
         return;
@@ -769,6 +862,26 @@ EXPORTED void cyrus_done(void)
         libcyrus_done();
 }
 
+EXPORTED void cyrus_prepare_fork(void)
+{
+    /* workers write to the template's stats, which outlive them */
+    prometheus_preinit();
+    lockstats_flush();
+}
+
+EXPORTED void cyrus_recycle_exit(void)
+{
+    lock_set_stats_cb(NULL);
+    lockstats_flush();
+    _exit(0);
+}
+
+EXPORTED void cyrus_observe_startup(int forked, double seconds)
+{
+    prometheus_observe_label(CYRUS_SERVICE_STARTUP_SECONDS,
+                             forked ? "fork" : "exec", seconds);
+}
+
 /*
  * Returns 1 if we have a shutdown file, with the first line in buf.
  * Otherwise returns 0, and the contents of buf is undefined.
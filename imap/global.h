@@ -85,6 +85,17 @@ extern void cyrus_modules_add(void (*done)(void*), void *rock);
 /* Shutdown a cyrus process */
 extern void cyrus_done(void);
 
+/* For service processes forked from a pre-initialised template
+ * (service_preinit_fork): cyrus_prepare_fork() is called in the template
+ * before the first fork; cyrus_recycle_exit() ends a worker which has
+ * served its share of clients, leaving everything it inherited to the
+ * template, without running the module cleanups */
+extern void cyrus_prepare_fork(void);
+extern void cyrus_recycle_exit(void) __attribute__((noreturn));
+
+/* report how long a service process took to become ready */
+extern void cyrus_observe_startup(int forked, double seconds);
+
 /* sasl configuration */
 extern int mysasl_config(void *context,
                          const char *plugin_name,
@@ -87,6 +87,47 @@ struct namespace_t namespace_applepush = {
     }
 };
 
+/*
+ * Devices re-register on every poll, but a registration stays valid at
+ * the push service for APS_EXPIRY seconds.  Each process remembers the
+ * registrations it passed on recently and answers repeats within
+ * APS_REFRESH itself, without the mailbox lookup or another event.
+ */
+#define APS_EXPIRY      86400
+#define APS_REFRESH     3600
+#define APS_RECENT_MAX  1024
+
+static hash_table aps_recent = HASH_TABLE_INITIALIZER;
+
+static void aps_recent_key(struct buf *buf, const char *token, const char *key)
+{
+    buf_setcstr(buf, httpd_userid ? httpd_userid : "");
+    buf_putc(buf, '\n');
+    buf_appendcstr(buf, token);
+    buf_putc(buf, '\n');
+    buf_appendcstr(buf, key);
+}
+
+static int aps_is_recent(const char *rkey)
+{
+    time_t when;
+
+    if (!aps_recent.size) return 0;
+
+    when = (time_t) (intptr_t) hash_lookup(rkey, &aps_recent);
+    return when && time(NULL) - when < APS_REFRESH;
+}
+
+static void aps_set_recent(const char *rkey)
+{
+    if (aps_recent.size && hash_numrecords(&aps_recent) >= APS_RECENT_MAX)
+        free_hash_table(&aps_recent, NULL);
+    if (!aps_recent.size)
+        construct_hash_table(&aps_recent, APS_RECENT_MAX, 0);
+
+    hash_insert(rkey, (void *) (intptr_t) time(NULL), &aps_recent);
+}
+
 static void applepush_init(struct buf *serverinfo __attribute__((unused)))
 {
     namespace_applepush.enabled = apns_enabled &&
@@ -104,6 +145,7 @@ static int meth_get_applepush(struct transaction_t *txn,
     strarray_t *keyparts = NULL;
     char *mboxname = NULL;
     struct mboxlist_entry *mbentry = NULL;
+    struct buf rkey = BUF_INITIALIZER;
     int mbtype = 0;
 
     /* unpack query params */
@@ -115,6 +157,13 @@ static int meth_get_applepush(struct transaction_t *txn,
     if (!vals) goto done;
     key = vals->s;
 
+    /* already registered this recently? */
+    aps_recent_key(&rkey, token, key);
+    if (aps_is_recent(buf_cstring(&rkey))) {
+        rc = HTTP_OK;
+        goto done;
+    }
+
     /* decompose key to userid + mailbox uniqueid */
     keyparts = strarray_split(key, "/", 0);
     if (strarray_size(keyparts) != 2)
@@ -167,16 +216,19 @@ static int meth_get_applepush(struct transaction_t *txn,
     struct mboxevent *mboxevent = mboxevent_new(EVENT_APPLEPUSHSERVICE_DAV);
     mboxevent_set_applepushservice_dav(mboxevent, aps_topic, token, httpd_userid,
                                        mailbox_userid, mailbox_uniqueid, mbtype,
-                                       86400); // XXX interval from config
+                                       APS_EXPIRY);
     mboxevent_notify(&mboxevent);
     mboxevent_free(&mboxevent);
 
+    aps_set_recent(buf_cstring(&rkey));
+
     rc = HTTP_OK;
 
 done:
     mboxlist_entry_free(&mbentry);
     if (mboxname) free(mboxname);
     if (keyparts) strarray_free(keyparts);
+    buf_free(&rkey);
 
     return rc;
 }
@@ -352,7 +352,8 @@ static const struct prop_entry caldav_props[] = {
       PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE,
       propfind_creationdate, NULL, NULL },
     { "displayname", NS_DAV,
-      PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE | PROP_PERUSER,
+      PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE | PROP_PERUSER
+      | PROP_NOMAILBOX,
       propfind_collectionname, proppatch_todb, NULL },
     { "getcontentlanguage", NS_DAV,
       PROP_ALLPROP | PROP_RESOURCE,
@@ -373,7 +374,8 @@ static const struct prop_entry caldav_props[] = {
       PROP_ALLPROP | PROP_RESOURCE,
       propfind_lockdisc, NULL, NULL },
     { "resourcetype", NS_DAV,
-      PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE | PROP_PRESCREEN,
+      PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE | PROP_PRESCREEN
+      | PROP_NOMAILBOX,
       propfind_restype, proppatch_restype, "calendar" },
     { "supportedlock", NS_DAV,
       PROP_ALLPROP | PROP_RESOURCE,
@@ -411,7 +413,7 @@ static const struct prop_entry caldav_props[] = {
 
     /* WebDAV Quota (RFC 4331) properties */
     { "quota-available-bytes", NS_DAV,
-      PROP_COLLECTION,
+      PROP_COLLECTION | PROP_NOMAILBOX,
       propfind_quota, NULL, NULL },
     { "quota-used-bytes", NS_DAV,
       PROP_COLLECTION,
@@ -429,7 +431,7 @@ static const struct prop_entry caldav_props[] = {
 
     /* WebDAV Sync (RFC 6578) properties */
     { "sync-token", NS_DAV,
-      PROP_COLLECTION,
+      PROP_COLLECTION | PROP_NOMAILBOX,
       propfind_sync_token, NULL, SYNC_TOKEN_URL_SCHEME },
 
     /* WebDAV Sharing (draft-pot-webdav-resource-sharing) properties */
@@ -530,7 +532,7 @@ static const struct prop_entry caldav_props[] = {
 
     /* Apple Calendar Server properties */
     { "getctag", NS_CS,
-      PROP_ALLPROP | PROP_COLLECTION,
+      PROP_ALLPROP | PROP_COLLECTION | PROP_NOMAILBOX,
       propfind_sync_token, NULL, "" },
 
     /* Apple Mobile Me properties */
@@ -566,7 +568,8 @@ static struct meth_params caldav_params = {
       (db_foreach_proc_t) &caldav_foreach,
       (db_updates_proc_t) &caldav_get_updates,
       (db_write_proc_t) &caldav_write,
-      (db_delete_proc_t) &caldav_delete },
+      (db_delete_proc_t) &caldav_delete,
+      (db_lookup_many_proc_t) &caldav_lookup_resources },
     &caldav_acl,
     { CALDAV_UID_CONFLICT, &caldav_copy },
     &caldav_delete_cal,
@@ -4897,6 +4900,20 @@ static int apply_comp_timerange(struct comp_filter *compfilter,
                 return 1;
             }
 
+            if (fctx->davdb) {
+                /* Try the occurrence index before expanding */
+                icaltimezone *utc = icaltimezone_get_utc_timezone();
+                int occurs =
+                    caldav_check_occurrences(fctx->davdb, cdata,
+                        icaltime_as_timet_with_zone(range->start, utc),
+                        icaltime_as_timet_with_zone(range->end, utc));
+
+                if (!occurs) return 0;
+                if (occurs > 0 && !(compfilter->prop || compfilter->comp)) {
+                    return 1;
+                }
+            }
+
             /* Load message containing the resource and parse iCal data */
             if (!comp) {
                 if (!fctx->msg_buf.len) {
@@ -7046,6 +7063,17 @@ static int busytime_by_resource(void *rock, void *data)
         /* Component starts later than range */
         return 0;
     }
+    if (cdata->comp_flags.recurring && fctx->davdb) {
+        /* Skip expansion if the occurrence index knows there is no
+           occurrence within range */
+        icaltimezone *utc = icaltimezone_get_utc_timezone();
+
+        if (!caldav_check_occurrences(fctx->davdb, cdata,
+                    icaltime_as_timet_with_zone(fbfilter->start, utc),
+                    icaltime_as_timet_with_zone(fbfilter->end, utc))) {
+            return 0;
+        }
+    }
 
     if (cdata->comp_flags.recurring ||
         cdata->comp_type == CAL_COMP_VAVAILABILITY) {
@@ -54,6 +54,7 @@
 #include <libxml/HTMLparser.h>
 #include <libxml/tree.h>
 
+#include "cyrusdb.h"
 #include "httpd.h"
 #include "http_caldav_sched.h"
 #include "http_dav.h"
@@ -781,6 +782,128 @@ static void sched_param_cleanup(void *data)
 }
 
 
+#define FNAME_FBCACHEDB "/caldav_fbcache.db"
+
+static struct db *fbcachedb = NULL;
+static int fbcache_initted = 0;
+
+static void fbcache_done(void *rock __attribute__((unused)))
+{
+    if (fbcachedb) {
+        int r = cyrusdb_close(fbcachedb);
+        if (r) {
+            syslog(LOG_ERR, "DBERROR: error closing freebusy cache: %s",
+                   cyrusdb_strerror(r));
+        }
+        fbcachedb = NULL;
+    }
+}
+
+/* Open the shared free-busy cache (if enabled) on first use */
+static struct db *fbcache_open(void)
+{
+    if (fbcache_initted) return fbcachedb;
+    fbcache_initted = 1;
+
+    if (!config_getswitch(IMAPOPT_CALDAV_FREEBUSY_CACHE)) return NULL;
+
+    char *fname =
+        xstrdupnull(config_getstring(IMAPOPT_CALDAV_FREEBUSY_CACHE_DB_PATH));
+    if (!fname) fname = strconcat(config_dir, FNAME_FBCACHEDB, (char *)NULL);
+
+    int r = cyrusdb_open(config_getstring(IMAPOPT_CALDAV_FREEBUSY_CACHE_DB),
+                         fname, CYRUSDB_CREATE, &fbcachedb);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+               cyrusdb_strerror(r));
+        syslog(LOG_ERR, "freebusy cache in degraded mode");
+        fbcachedb = NULL;
+    }
+    else cyrus_modules_add(fbcache_done, NULL);
+
+    free(fname);
+
+    return fbcachedb;
+}
+
+/* Everything that affects the computed busytime goes into the key */
+static void fbcache_buildkey(struct buf *key, const char *userid,
+                             struct freebusy_filter *calfilter,
+                             const char *uid, const char *organizer,
+                             const char *attendee)
+{
+    buf_reset(key);
+    buf_printf(key, "%s%%%%%s%%%%%s%%%%%s%%%%%s%%%%%s%%%%%s",
+               userid, httpd_userid ? httpd_userid : "",
+               icaltime_as_ical_string(calfilter->start),
+               icaltime_as_ical_string(calfilter->end),
+               uid ? uid : "", organizer ? organizer : "",
+               attendee ? attendee : "");
+}
+
+/* Fetch a cached busytime result, if it is still current */
+static icalcomponent *fbcache_fetch(struct buf *key, struct buf *data,
+                                    struct mboxname_counters *counters)
+{
+    const char *val = NULL;
+    size_t vallen = 0;
+    modseq_t modseq, foldersmodseq;
+    icalcomponent *ical, *fbcomp;
+    char *p;
+    int r;
+
+    r = cyrusdb_fetch(fbcachedb, buf_base(key), buf_len(key),
+                      &val, &vallen, NULL);
+    if (r || !vallen) return NULL;
+
+    /* "<caldavmodseq> <caldavfoldersmodseq> <icaldata>" */
+    buf_setmap(data, val, vallen);
+    p = (char *) buf_cstring(data);
+    modseq = strtoull(p, &p, 10);
+    if (*p++ != ' ') return NULL;
+    foldersmodseq = strtoull(p, &p, 10);
+    if (*p++ != ' ') return NULL;
+
+    /* Any change to the user's calendars invalidates the entry */
+    if (modseq != counters->caldavmodseq ||
+        foldersmodseq != counters->caldavfoldersmodseq) return NULL;
+
+    ical = icalparser_parse_string(p);
+    if (!ical) return NULL;
+
+    fbcomp = icalcomponent_get_first_component(ical,
+                                               ICAL_VFREEBUSY_COMPONENT);
+    if (!fbcomp) {
+        icalcomponent_free(ical);
+        return NULL;
+    }
+
+    icalcomponent_set_dtstamp(fbcomp,
+                              icaltime_from_timet_with_zone(time(0), 0,
+                                                            utc_zone));
+
+    return ical;
+}
+
+static void fbcache_store(struct buf *key, struct buf *data,
+                          struct mboxname_counters *counters,
+                          icalcomponent *ical)
+{
+    int r;
+
+    buf_reset(data);
+    buf_printf(data, MODSEQ_FMT " " MODSEQ_FMT " %s",
+               counters->caldavmodseq, counters->caldavfoldersmodseq,
+               icalcomponent_as_ical_string(ical));
+
+    r = cyrusdb_store(fbcachedb, buf_base(key), buf_len(key),
+                      buf_base(data), buf_len(data), NULL);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: error updating freebusy cache for %s: %s",
+               buf_cstring(key), cyrusdb_strerror(r));
+    }
+}
+
 /* Perform a Busy Time query based on given VFREEBUSY component */
 /* NOTE: This function is destructive of 'ical' */
 int sched_busytime_query(struct transaction_t *txn,
@@ -799,6 +922,7 @@ int sched_busytime_query(struct transaction_t *txn,
     struct freebusy_filter calfilter;
     struct hash_table remote_table;
     struct caldav_sched_param *remote = NULL;
+    struct buf fbkey = BUF_INITIALIZER, fbdata = BUF_INITIALIZER;
 
     if (!calendarprefix) {
         calendarprefix = config_getstring(IMAPOPT_CALENDARPREFIX);
@@ -935,12 +1059,29 @@ int sched_busytime_query(struct transaction_t *txn,
                 /* Start query at attendee's calendar-home-set */
                 char *mboxname = caldav_mboxname(userid, NULL);
 
-                fctx.davdb = NULL;
-                fctx.req_tgt->collection = NULL;
-                calfilter.freebusy.len = 0;
-                busy = busytime_query_local(txn, &fctx, mboxname,
-                                            ICAL_METHOD_REPLY, uid,
-                                            organizer, attendee);
+                /* Counters are read before the query so that a
+                   concurrent change leaves a stale entry behind */
+                struct mboxname_counters counters;
+                int cacheable = fbcache_open() &&
+                    !mboxname_read_counters(mboxname, &counters);
+
+                if (cacheable) {
+                    fbcache_buildkey(&fbkey, userid, &calfilter,
+                                     uid, organizer, attendee);
+                    busy = fbcache_fetch(&fbkey, &fbdata, &counters);
+                }
+
+                if (!busy) {
+                    fctx.davdb = NULL;
+                    fctx.req_tgt->collection = NULL;
+                    calfilter.freebusy.len = 0;
+                    busy = busytime_query_local(txn, &fctx, mboxname,
+                                                ICAL_METHOD_REPLY, uid,
+                                                organizer, attendee);
+
+                    if (busy && cacheable)
+                        fbcache_store(&fbkey, &fbdata, &counters, busy);
+                }
                 free(mboxname);
             }
             free(inboxname);
@@ -1002,6 +1143,8 @@ int sched_busytime_query(struct transaction_t *txn,
     if (org_authstate) auth_freestate(org_authstate);
     if (calfilter.freebusy.fb) free(calfilter.freebusy.fb);
     if (root) xmlFreeDoc(root->doc);
+    buf_free(&fbkey);
+    buf_free(&fbdata);
 
     return ret;
 }
@@ -176,7 +176,8 @@ static const struct prop_entry carddav_props[] = {
       PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE,
       propfind_creationdate, NULL, NULL },
     { "displayname", NS_DAV,
-      PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE | PROP_PERUSER,
+      PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE | PROP_PERUSER
+      | PROP_NOMAILBOX,
       propfind_collectionname, proppatch_todb, NULL },
     { "getcontentlanguage", NS_DAV,
       PROP_ALLPROP | PROP_RESOURCE,
@@ -197,7 +198,8 @@ static const struct prop_entry carddav_props[] = {
       PROP_ALLPROP | PROP_RESOURCE,
       propfind_lockdisc, NULL, NULL },
     { "resourcetype", NS_DAV,
-      PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE | PROP_PRESCREEN,
+      PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE | PROP_PRESCREEN
+      | PROP_NOMAILBOX,
       propfind_restype, proppatch_restype, "addressbook" },
     { "supportedlock", NS_DAV,
       PROP_ALLPROP | PROP_RESOURCE,
@@ -236,7 +238,7 @@ static const struct prop_entry carddav_props[] = {
 
     /* WebDAV Quota (RFC 4331) properties */
     { "quota-available-bytes", NS_DAV,
-      PROP_COLLECTION,
+      PROP_COLLECTION | PROP_NOMAILBOX,
       propfind_quota, NULL, NULL },
     { "quota-used-bytes", NS_DAV,
       PROP_COLLECTION,
@@ -254,7 +256,7 @@ static const struct prop_entry carddav_props[] = {
 
     /* WebDAV Sync (RFC 6578) properties */
     { "sync-token", NS_DAV,
-      PROP_COLLECTION,
+      PROP_COLLECTION | PROP_NOMAILBOX,
       propfind_sync_token, NULL, SYNC_TOKEN_URL_SCHEME },
 
     /* WebDAV Sharing (draft-pot-webdav-resource-sharing) properties */
@@ -287,7 +289,7 @@ static const struct prop_entry carddav_props[] = {
 
     /* Apple Calendar Server properties */
     { "getctag", NS_CS,
-      PROP_ALLPROP | PROP_COLLECTION,
+      PROP_ALLPROP | PROP_COLLECTION | PROP_NOMAILBOX,
       propfind_sync_token, NULL, "" },
 
     /* Apple Push Notifications Service properties */
@@ -322,7 +324,8 @@ static struct meth_params carddav_params = {
       (db_foreach_proc_t) &carddav_foreach,
       (db_updates_proc_t) &carddav_get_updates,
       (db_write_proc_t) &carddav_write,
-      (db_delete_proc_t) &carddav_delete },
+      (db_delete_proc_t) &carddav_delete,
+      (db_lookup_many_proc_t) &carddav_lookup_resources },
     NULL,                                       /* No ACL extensions */
     { CARDDAV_UID_CONFLICT, &carddav_copy },
     NULL,                                       /* No special DELETE handling */
@@ -752,6 +755,18 @@ static int export_addressbook(struct transaction_t *txn)
         const struct index_record *record = msg_record(msg);
         struct vparse_card *vcard;
 
+        if (mime == carddav_mime_types) {
+            /* Storage format - stream the resource as stored */
+            struct buf msg_buf = BUF_INITIALIZER;
+
+            if (mailbox_map_record(mailbox, record, &msg_buf)) continue;
+
+            write_body(0, txn, buf_base(&msg_buf) + record->header_size,
+                       record->size - record->header_size);
+            buf_free(&msg_buf);
+            continue;
+        }
+
         /* Map and parse existing vCard resource */
         vcard = record_to_vcard(mailbox, record);
 
@@ -1268,13 +1283,22 @@ static int propfind_addrdata(const xmlChar *name, xmlNsPtr ns,
         if (strarray_size(partial)) {
             /* Limit returned properties */
             struct vparse_card *vcard = fctx->obj;
+            static struct buf partbuf = BUF_INITIALIZER;
 
-            if (!vcard) vcard = fctx->obj = vcard_parse_string(data, 1);
-            prune_properties(vcard->objects, partial);
+            buf_reset(&partbuf);
+            if (!vcard &&
+                !vparse_filter_props(data, datalen, partial, &partbuf)) {
+                /* Plain card - copied the properties without parsing */
+                buf_copy(&fctx->msg_buf, &partbuf);
+            }
+            else {
+                if (!vcard) vcard = fctx->obj = vcard_parse_string(data, 1);
+                prune_properties(vcard->objects, partial);
 
-            /* Create vCard data from new vcard component */
-            buf_reset(&fctx->msg_buf);
-            vparse_tobuf(vcard, &fctx->msg_buf);
+                /* Create vCard data from new vcard component */
+                buf_reset(&fctx->msg_buf);
+                vparse_tobuf(vcard, &fctx->msg_buf);
+            }
             data = buf_cstring(&fctx->msg_buf);
             datalen = buf_len(&fctx->msg_buf);
         }
@@ -73,6 +73,7 @@
 #include "http_proxy.h"
 #include "index.h"
 #include "proxy.h"
+#include "statuscache.h"
 #include "times.h"
 #include "syslog.h"
 #include "strhash.h"
@@ -2686,6 +2687,13 @@ EXPORTED int propfind_quota(const xmlChar *name, xmlNsPtr ns,
         /* Use the quotaroot as specified in mailbox header */
         qr = fctx->mailbox->quotaroot;
     }
+    else if (fctx->status && fctx->mbentry) {
+        /* Find the quotaroot governing this (unopened) collection */
+        if (quota_findroot(foundroot, sizeof(foundroot),
+                           fctx->mbentry->name)) {
+            qr = foundroot;
+        }
+    }
     else if (fctx->req_tgt->mbentry) {
         /* Find the quotaroot governing this hierarchy */
         if (quota_findroot(foundroot, sizeof(foundroot),
@@ -2815,12 +2823,20 @@ int propfind_sync_token(const xmlChar *name, xmlNsPtr ns,
     const char *prefix = (const char *) rock;
 
     if (!fctx->req_tgt->collection || /* until we support sync on cal-home */
-        !fctx->mailbox || fctx->record) return HTTP_NOT_FOUND;
+        !(fctx->mailbox || fctx->status) || fctx->record) return HTTP_NOT_FOUND;
 
     /* not defined on the top-level collection either (aka #calendars) */
     if (!fctx->req_tgt->collection) return HTTP_NOT_FOUND;
 
-    dav_get_synctoken(fctx->mailbox, &fctx->buf, prefix);
+    if (fctx->mailbox) {
+        dav_get_synctoken(fctx->mailbox, &fctx->buf, prefix);
+    }
+    else {
+        /* Same token, from the status cache */
+        buf_reset(&fctx->buf);
+        buf_printf(&fctx->buf, "%s%u-" MODSEQ_FMT, prefix,
+                   fctx->status->uidvalidity, fctx->status->highestmodseq);
+    }
 
     xml_add_prop(HTTP_OK, fctx->ns[NS_DAV], &propstat[PROPSTAT_OK],
                  name, ns, BAD_CAST buf_cstring(&fctx->buf), 0);
@@ -3363,7 +3379,8 @@ static int preload_proplist(xmlNodePtr proplist, struct propfind_ctx *fctx)
             else {
                 /* No match, treat as a dead property.
                    Need to look at both collections and resources */
-                nentry->flags = PROP_COLLECTION | PROP_RESOURCE;
+                nentry->flags =
+                    PROP_COLLECTION | PROP_RESOURCE | PROP_NOMAILBOX;
                 nentry->get = propfind_fromdb;
                 nentry->prop = NULL;
                 nentry->rock = NULL;
@@ -5601,10 +5618,20 @@ static int propfind_by_resources(struct propfind_ctx *fctx)
         r = fctx->proc_by_resource(fctx, ddata);
     }
     else {
+        annotate_db_t *annotdb = NULL;
+
+        /* Dead properties on resources are per-message annotations.
+           Hold the mailbox's annotation db open across the whole walk
+           rather than reopening it for every resource */
+        if (fctx->mode == PROPFIND_PROP)
+            annotate_getdb(fctx->mailbox->name, &annotdb);
+
         /* Add responses for all contained resources */
         fctx->foreach_resource(fctx->davdb, fctx->mailbox->name,
                                fctx->proc_by_resource, fctx);
 
+        annotate_putdb(&annotdb);
+
         /* Started with NULL resource, end with NULL resource */
         fctx->req_tgt->resource = NULL;
         fctx->req_tgt->reslen = 0;
@@ -5660,12 +5687,32 @@ static size_t make_collection_url(struct buf *buf, const char  *urlprefix, int h
 }
 
 
+/* Can the requested properties of a collection be answered from its
+   mbentry and the status cache alone?  Polling clients mostly ask for
+   just getctag/sync-token, and opening every collection's mailbox for
+   those dominates the cost of the PROPFIND */
+static int propfind_collection_cacheable(struct propfind_ctx *fctx)
+{
+    struct propfind_entry_list *e;
+
+    if (fctx->mode != PROPFIND_PROP || fctx->depth > 1 || fctx->filter_crit)
+        return 0;
+
+    for (e = fctx->elist; e; e = e->next) {
+        if (e->get && (e->flags & PROP_COLLECTION) &&
+            !(e->flags & PROP_NOMAILBOX)) return 0;
+    }
+
+    return 1;
+}
+
 /* mboxlist_findall() callback to find props on a collection */
 int propfind_by_collection(const mbentry_t *mbentry, void *rock)
 {
     struct propfind_ctx *fctx = (struct propfind_ctx *) rock;
     const char *mboxname = mbentry->name;
     struct buf writebuf = BUF_INITIALIZER;
+    struct statusdata sdata = STATUSDATA_INIT;
     struct mailbox *mailbox = NULL;
     char *p;
     size_t len;
@@ -5712,8 +5759,15 @@ int propfind_by_collection(const mbentry_t *mbentry, void *rock)
         goto done;
 
 
+    if (propfind_collection_cacheable(fctx) &&
+        !status_lookup_mbentry(mbentry, httpd_userid,
+                               STATUS_UIDVALIDITY | STATUS_HIGHESTMODSEQ,
+                               &sdata)) {
+        /* No need to open the mailbox */
+        fctx->status = &sdata;
+    }
     /* Open mailbox for reading */
-    if ((r = mailbox_open_irl(mboxname, &mailbox))) {
+    else if ((r = mailbox_open_irl(mboxname, &mailbox))) {
         syslog(LOG_INFO, "mailbox_open_irl(%s) failed: %s",
                mboxname, error_message(r));
     }
@@ -5768,6 +5822,7 @@ int propfind_by_collection(const mbentry_t *mbentry, void *rock)
 
   done:
     buf_free(&writebuf);
+    fctx->status = NULL;
     if (mailbox) mailbox_close(&mailbox);
 
     return 0;
@@ -7397,13 +7452,150 @@ int meth_put(struct transaction_t *txn, void *params)
 }
 
 
+/* One parsed href of a multiget REPORT */
+struct multiget_href {
+    struct request_target_t tgt;
+    unsigned seq;                       /* position in the request */
+    int found;                          /* response has been added */
+};
+
+struct multiget_rock {
+    struct propfind_ctx *fctx;
+    struct hash_table hrefs;            /* resource name -> multiget_href */
+};
+
+static int multiget_cmp(const void **a, const void **b)
+{
+    const struct multiget_href *ha = (const struct multiget_href *) *a;
+    const struct multiget_href *hb = (const struct multiget_href *) *b;
+    int r = strcmp(ha->tgt.mbentry->name, hb->tgt.mbentry->name);
+
+    if (!r) r = (ha->seq > hb->seq) - (ha->seq < hb->seq);
+    return r;
+}
+
+/* lookup_resources() callback: add response for a requested resource */
+static int multiget_by_resource(void *rock, void *data)
+{
+    struct multiget_rock *mrock = (struct multiget_rock *) rock;
+    struct propfind_ctx *fctx = mrock->fctx;
+    struct dav_data *ddata = (struct dav_data *) data;
+    struct multiget_href *href = hash_lookup(ddata->resource, &mrock->hrefs);
+
+    if (!href || href->found) return 0;
+
+    href->found = 1;
+    fctx->req_tgt = &href->tgt;
+    fctx->mbentry = href->tgt.mbentry;
+    ddata->resource = href->tgt.resource;
+
+    fctx->proc_by_resource(fctx, ddata);
+
+    return 0;
+}
+
+/* Add responses for the hrefs in 'hrefs[first..last)', all of which
+   are in the same mailbox */
+static void multiget_by_mailbox(struct meth_params *rparams,
+                                struct propfind_ctx *fctx,
+                                ptrarray_t *hrefs, int first, int last)
+{
+    struct multiget_href *href = ptrarray_nth(hrefs, first);
+    const char *mboxname = href->tgt.mbentry->name;
+    struct mailbox *mailbox = NULL;
+    int i, r;
+
+    fctx->req_tgt = &href->tgt;
+    fctx->mbentry = href->tgt.mbentry;
+
+    /* Open mailbox for reading */
+    r = mailbox_open_irl(mboxname, &mailbox);
+    if (r && r != IMAP_MAILBOX_NONEXISTENT) {
+        syslog(LOG_ERR, "http_mailbox_open(%s) failed: %s",
+               mboxname, error_message(r));
+        for (i = first; i < last; i++) {
+            href = ptrarray_nth(hrefs, i);
+            fctx->req_tgt = &href->tgt;
+            xml_add_response(fctx, HTTP_SERVER_ERROR,
+                             0, error_message(r), NULL);
+        }
+        return;
+    }
+
+    fctx->mailbox = mailbox;
+
+    if (mailbox) {
+        /* Open the DAV DB corresponding to the mailbox */
+        fctx->davdb = rparams->davdb.open_db(mailbox);
+
+        if (fctx->davdb && rparams->davdb.lookup_resources &&
+            last - first > 1) {
+            /* Resolve the whole group with a few DAV DB queries,
+               and add responses in IMAP uid order */
+            struct multiget_rock mrock = { fctx, HASH_TABLE_INITIALIZER };
+            strarray_t resources = STRARRAY_INITIALIZER;
+
+            construct_hash_table(&mrock.hrefs, last - first, 0);
+            for (i = first; i < last; i++) {
+                href = ptrarray_nth(hrefs, i);
+                if (!href->tgt.resource ||
+                    hash_lookup(href->tgt.resource, &mrock.hrefs)) continue;
+
+                hash_insert(href->tgt.resource, href, &mrock.hrefs);
+                strarray_append(&resources, href->tgt.resource);
+            }
+
+            rparams->davdb.lookup_resources(fctx->davdb, mboxname, &resources,
+                                            &multiget_by_resource, &mrock);
+
+            strarray_fini(&resources);
+            free_hash_table(&mrock.hrefs, NULL);
+        }
+    }
+
+    /* Anything not found above (missing, lock-null, duplicate or no
+       batched lookup) takes the single resource path */
+    for (i = first; i < last; i++) {
+        struct dav_data *ddata;
+
+        href = ptrarray_nth(hrefs, i);
+        if (href->found) continue;
+
+        fctx->req_tgt = &href->tgt;
+        fctx->mbentry = href->tgt.mbentry;
+
+        if (!mailbox || !href->tgt.resource) {
+            /* Add response for missing target */
+            xml_add_response(fctx, HTTP_NOT_FOUND, 0, NULL, NULL);
+            continue;
+        }
+
+        /* Find message UID for the resource */
+        rparams->davdb.lookup_resource(fctx->davdb, mboxname,
+                                       href->tgt.resource, (void **) &ddata, 0);
+        ddata->resource = href->tgt.resource;
+        /* XXX  Check errors */
+
+        fctx->proc_by_resource(fctx, ddata);
+    }
+
+    if (fctx->davdb) {
+        rparams->davdb.close_db(fctx->davdb);
+        fctx->davdb = NULL;
+    }
+    fctx->mailbox = NULL;
+    mailbox_close(&mailbox);
+}
+
 /* CALDAV:calendar-multiget/CARDDAV:addressbook-multiget REPORT */
 int report_multiget(struct transaction_t *txn, struct meth_params *rparams,
                     xmlNodePtr inroot, struct propfind_ctx *fctx)
 {
-    int r, ret = 0;
-    struct mailbox *mailbox = NULL;
+    int r, ret = 0, first, last;
+    ptrarray_t hrefs = PTRARRAY_INITIALIZER;
+    struct multiget_href *href;
     xmlNodePtr node;
+    unsigned seq = 0;
 
     /* Setup for chunked response */
     txn->flags.te |= TE_CHUNKED;
@@ -7411,84 +7603,66 @@ int report_multiget(struct transaction_t *txn, struct meth_params *rparams,
     /* Begin XML response */
     xml_response(HTTP_MULTI_STATUS, txn, fctx->root->doc);
 
-    /* Get props for each href */
+    /* Parse all of the hrefs first, answering the bad ones right away */
     for (node = inroot->children; node; node = node->next) {
         if ((node->type == XML_ELEMENT_NODE) &&
             !xmlStrcmp(node->name, BAD_CAST "href")) {
-            xmlChar *href = xmlNodeListGetString(inroot->doc, node->children, 1);
+            xmlChar *hrefstr = xmlNodeListGetString(inroot->doc,
+                                                    node->children, 1);
             xmlURIPtr uri;
-            struct request_target_t tgt;
-            struct dav_data *ddata;
             const char *resultstr = NULL;
 
-            memset(&tgt, 0, sizeof(struct request_target_t));
+            href = xzmalloc(sizeof(struct multiget_href));
+            href->seq = seq++;
 
             /* Parse the URI */
-            uri = parse_uri(METH_REPORT, (const char *) href,
+            uri = parse_uri(METH_REPORT, (const char *) hrefstr,
                             1 /* path required */, &resultstr);
-            xmlFree(href);
+            xmlFree(hrefstr);
             if (!uri) {
                 r = HTTP_FORBIDDEN;
             }
             else {
                 /* Parse the path */
-                tgt.namespace = txn->req_tgt.namespace;
+                href->tgt.namespace = txn->req_tgt.namespace;
 
-                r = rparams->parse_path(uri->path, &tgt, &resultstr);
+                r = rparams->parse_path(uri->path, &href->tgt, &resultstr);
                 xmlFreeURI(uri);
             }
+            if (!r && !href->tgt.mbentry) r = HTTP_NOT_FOUND;
             if (r) {
+                fctx->req_tgt = &href->tgt;
+                fctx->mbentry = href->tgt.mbentry;
                 if (r == HTTP_MOVED)
                     xml_add_response(fctx, HTTP_MOVED, 0, NULL, resultstr);
                 else
                     xml_add_response(fctx, r, 0, resultstr, NULL);
-                goto next;
-            }
-
-            fctx->req_tgt = &tgt;
-            fctx->mbentry = tgt.mbentry;
-
-            /* Check if we already have this mailbox open */
-            if (!mailbox || strcmp(mailbox->name, tgt.mbentry->name)) {
-                if (mailbox) mailbox_close(&mailbox);
-
-                /* Open mailbox for reading */
-                r = mailbox_open_irl(tgt.mbentry->name, &mailbox);
-                if (r && r != IMAP_MAILBOX_NONEXISTENT) {
-                    syslog(LOG_ERR, "http_mailbox_open(%s) failed: %s",
-                           tgt.mbentry->name, error_message(r));
-                    xml_add_response(fctx, HTTP_SERVER_ERROR,
-                                     0, error_message(r), NULL);
-                    goto next;
-                }
 
-                fctx->mailbox = mailbox;
-            }
-
-            if (!fctx->mailbox || !tgt.resource) {
-                /* Add response for missing target */
-                xml_add_response(fctx, HTTP_NOT_FOUND, 0, NULL, NULL);
-                goto next;
+                /* XXX - split this into a req_tgt cleanup */
+                free(href->tgt.userid);
+                mboxlist_entry_free(&href->tgt.mbentry);
+                free(href);
+                continue;
             }
 
-            /* Open the DAV DB corresponding to the mailbox */
-            fctx->davdb = rparams->davdb.open_db(fctx->mailbox);
-
-            /* Find message UID for the resource */
-            rparams->davdb.lookup_resource(fctx->davdb, tgt.mbentry->name,
-                                           tgt.resource, (void **) &ddata, 0);
-            ddata->resource = tgt.resource;
-            /* XXX  Check errors */
+            ptrarray_append(&hrefs, href);
+        }
+    }
 
-            fctx->proc_by_resource(fctx, ddata);
+    /* Group the hrefs by mailbox, keeping request order within each */
+    ptrarray_sort(&hrefs, &multiget_cmp);
 
-            rparams->davdb.close_db(fctx->davdb);
+    /* Get props for each group of hrefs */
+    for (first = 0; first < ptrarray_size(&hrefs); first = last) {
+        const char *mboxname =
+            ((struct multiget_href *) ptrarray_nth(&hrefs, first))->tgt.mbentry->name;
 
-        next:
-            /* XXX - split this into a req_tgt cleanup */
-            free(tgt.userid);
-            mboxlist_entry_free(&tgt.mbentry);
+        for (last = first + 1; last < ptrarray_size(&hrefs); last++) {
+            href = ptrarray_nth(&hrefs, last);
+            if (strcmp(href->tgt.mbentry->name, mboxname)) break;
         }
+
+        multiget_by_mailbox(rparams, fctx, &hrefs, first, last);
     }
 
     /* End XML response */
@@ -7498,7 +7672,15 @@ int report_multiget(struct transaction_t *txn, struct meth_params *rparams,
     /* End of output */
     write_body(0, txn, NULL, 0);
 
-    mailbox_close(&mailbox);
+    fctx->req_tgt = &txn->req_tgt;
+    fctx->mbentry = NULL;
+    while ((href = ptrarray_pop(&hrefs))) {
+        /* XXX - split this into a req_tgt cleanup */
+        free(href->tgt.userid);
+        mboxlist_entry_free(&href->tgt.mbentry);
+        free(href);
+    }
+    ptrarray_fini(&hrefs);
 
     return ret;
 }
@@ -7679,8 +7861,13 @@ int report_sync_col(struct transaction_t *txn, struct meth_params *rparams,
         goto done;
     }
 
+    /* Truncate huge backlogs ourselves; the client picks up the rest
+       using the sync-token of the truncated response */
+    int maxresults = config_getint(IMAPOPT_DAV_SYNC_MAXRESULTS);
+    if (maxresults > 0 && limit > (uint32_t) maxresults) limit = maxresults;
+
     if (!syncmodseq) {
-        /* Initial sync - set basemodseq in case client limits results */
+        /* Initial sync - set basemodseq in case results get limited */
         basemodseq = highestmodseq;
     }
 
@@ -310,6 +310,12 @@ typedef int (*db_imapuid_proc_t)(void *davdb, const char *mailbox,
 typedef int (*db_foreach_proc_t)(void *davdb, const char *mailbox,
                                  int (*cb)(void *rock, void *data), void *rock);
 
+/* Function to process those of 'resources' which exist in 'mailbox' */
+typedef int (*db_lookup_many_proc_t)(void *davdb, const char *mailbox,
+                                     const strarray_t *resources,
+                                     int (*cb)(void *rock, void *data),
+                                     void *rock);
+
 /* Function to process 'limit' DAV resources
    updated since 'oldmodseq' in 'mailbox' with 'cb' */
 typedef int (*db_updates_proc_t)(void *davdb, modseq_t oldmodseq,
@@ -340,6 +346,8 @@ struct propfind_ctx {
     const mbentry_t *mbentry;           /* mbentry corresponding to collection */
     struct mailbox *mailbox;            /* mailbox corresponding to collection */
     struct quota quota;                 /* quota info for collection */
+    const struct statusdata *status;    /* cached status of collection,
+                                           if mailbox is not open */
     struct index_record *record;        /* cyrus.index record for resource */
     void *data;                         /* DAV record for resource */
     get_validators_t get_validators;    /* fetch resource validators */
@@ -425,7 +433,9 @@ enum {
     PROP_RESOURCE =     (1<<2),         /* Returned for resource */
     PROP_PERUSER =      (1<<3),         /* Per-user property */
     PROP_PRESCREEN =    (1<<4),         /* Prescreen property using callback */
-    PROP_CLEANUP =      (1<<5)          /* Cleanup property using callback */
+    PROP_CLEANUP =      (1<<5),         /* Cleanup property using callback */
+    PROP_NOMAILBOX =    (1<<6)          /* Collection value is available
+                                           without opening the mailbox */
 };
 
 
@@ -458,6 +468,8 @@ struct davdb_params {
      * we need to go via mailbox.c for replication support */
     db_write_proc_t write_resourceLOCKONLY;     /* write a specific resource */
     db_delete_proc_t delete_resourceLOCKONLY;   /* delete a specific resource */
+    db_lookup_many_proc_t lookup_resources;     /* lookup a set of resources
+                                                   (optional, for multiget) */
 };
 
 /*
@@ -46,7 +46,9 @@
 #include "exitcodes.h"
 #include "httpd.h"
 #include "md5.h"
+#include "mboxevent.h"
 #include "prometheus.h"
+#include "quota.h"
 #include "util.h"
 
 int (*alpn_select_cb)(SSL *ssl,
@@ -81,6 +83,11 @@ struct http2_stream {
     int32_t id;                         /* Stream ID */
     size_t num_resp_hdrs;               /* Number of response headers */
     nghttp2_nv resp_hdrs[HTTP2_MAX_HEADERS]; /* Array of response headers */
+    struct buf body;                    /* Response body waiting to be sent */
+    size_t body_sent;                   /* Bytes of 'body' already sent */
+    unsigned body_submitted : 1;        /* Data provider is attached */
+    unsigned body_deferred  : 1;        /* Data provider ran dry */
+    unsigned body_eof       : 1;        /* Last chunk has been queued */
 };
 
 static nghttp2_session_callbacks *http2_callbacks = NULL;
@@ -163,6 +170,9 @@ static ssize_t recv_cb(nghttp2_session *session __attribute__((unused)),
     return n;
 }
 
+/* Feed DATA frames from the body queued on the stream.  nghttp2 calls us
+   whenever flow control and its priority scheduler let this stream send,
+   so a large response never holds up the other streams on the session. */
 static ssize_t data_source_read_cb(nghttp2_session *sess __attribute__((unused)),
                                    int32_t stream_id,
                                    uint8_t *buf, size_t length,
@@ -170,16 +180,29 @@ static ssize_t data_source_read_cb(nghttp2_session *sess __attribute__((unused))
                                    nghttp2_data_source *source,
                                    void *user_data __attribute__((unused)))
 {
-    struct protstream *s = source->ptr;
-    size_t n = prot_read(s, (char *) buf, length);
+    struct http2_stream *strm = source->ptr;
+    size_t n = buf_len(&strm->body) - strm->body_sent;
+
+    if (n > length) n = length;
 
     syslog(LOG_DEBUG,
            "http2_data_source_read_cb(id=%d, len=%zu): n=%zu, eof=%d",
-           stream_id, length, n, !s->cnt);
+           stream_id, length, n, strm->body_eof);
 
-    if (!s->cnt) {
-        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
-        prot_free(s);  /* Done with the protstream */
+    if (!n && !strm->body_eof) {
+        /* Wait for more data - http2_data_chunk() resumes us */
+        strm->body_deferred = 1;
+        return NGHTTP2_ERR_DEFERRED;
+    }
+
+    memcpy(buf, buf_base(&strm->body) + strm->body_sent, n);
+    strm->body_sent += n;
+
+    if (strm->body_sent == buf_len(&strm->body)) {
+        buf_reset(&strm->body);
+        strm->body_sent = 0;
+
+        if (strm->body_eof) *data_flags |= NGHTTP2_DATA_FLAG_EOF;
     }
 
     return n;
@@ -368,11 +391,19 @@ static int frame_recv_cb(nghttp2_session *session,
         if (!ret) {
             const struct method_t *meth_t =
                 &txn->req_tgt.namespace->methods[txn->meth];
+            struct timeval start, end;
 
+            gettimeofday(&start, NULL);
             ret = (*meth_t->proc)(txn, meth_t->params);
+            gettimeofday(&end, NULL);
 
             prometheus_increment(prometheus_lookup_label(http_methods[txn->meth].metric,
                                                          txn->req_tgt.namespace->name));
+            prometheus_observe(http_methods[txn->meth].seconds,
+                               timesub(&start, &end));
+
+            quota_flush_deferred(/*all*/0);
+            mboxevent_flush();
         }
 
         if (ret == HTTP_UNAUTHORIZED) {
@@ -519,8 +550,11 @@ static int nghttp2_extended_connect = 0;
 HIDDEN int http2_start_session(struct transaction_t *txn,
                                struct http_connection *conn)
 {
+    int32_t window = config_getint(IMAPOPT_HTTPWINDOWSIZE) * 1024;
     nghttp2_settings_entry iv[] = {
         { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 100 },
+        { NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE,
+          window > 0 ? window : NGHTTP2_INITIAL_WINDOW_SIZE },
         { NGHTTP2_SETTINGS_ENABLE_CONNECT_PROTOCOL, 1 }  /* MUST be last */
     };
     size_t niv = (sizeof(iv) / sizeof(iv[0])) - !ws_enabled();
@@ -604,6 +638,16 @@ HIDDEN int http2_start_session(struct transaction_t *txn,
         return HTTP_SERVER_ERROR;
     }
 
+    if (window > NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE) {
+        /* Open up the connection window to match */
+        r = nghttp2_submit_window_update(ctx->session, NGHTTP2_FLAG_NONE, 0,
+                                  window - NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE);
+        if (r) {
+            syslog(LOG_ERR, "nghttp2_submit_window_update: %s",
+                   nghttp2_strerror(r));
+        }
+    }
+
     return 0;
 }
 
@@ -812,43 +856,61 @@ HIDDEN int http2_data_chunk(struct transaction_t *txn,
     struct http2_context *ctx = (struct http2_context *) txn->conn->http2_ctx;
     struct http2_stream *strm = (struct http2_stream *) txn->http2_strm;
     uint8_t flags = NGHTTP2_FLAG_END_STREAM;
-    nghttp2_data_provider prd;
-    int r;
+    int r = 0;
 
     syslog(LOG_DEBUG, "http2_data_chunk(datalen=%u, last=%d)",
            datalen, last_chunk);
 
-    /* NOTE: The protstream that we use as the data source MUST remain
-       available until the data source read callback has retrieved all data.
-       Also note that we need to make a copy of the data because data frames
+    /* NOTE: We need to make a copy of the data because data frames
        may not be sent prior to the original pointer becoming invalid.
+       The queue lives as long as the stream, which is as long as
+       nghttp2 may call the data source read callback.
     */
-    struct protstream *s = prot_readmap(xmemdup(data, datalen), datalen);
-    s->buf = s->ptr;
-    s->buf_size = datalen;
-
-    prd.source.ptr = s;
-    prd.read_callback = data_source_read_cb;
+    buf_appendmap(&strm->body, data, datalen);
+    if (last_chunk) strm->body_eof = 1;
 
     if (txn->flags.te) {
-        if (!last_chunk) {
+        if (txn->flags.trailer) {
+            /* The trailer ends the stream */
             flags = NGHTTP2_FLAG_NONE;
+        }
+        if (!last_chunk) {
             if (datalen && (txn->flags.trailer & TRAILER_CMD5)) {
                 MD5Update(md5ctx, data, datalen);
             }
         }
-        else if (txn->flags.trailer) {
-            flags = NGHTTP2_FLAG_NONE;
-            if (txn->flags.trailer & TRAILER_CMD5) MD5Final(md5, md5ctx);
+        else if (txn->flags.trailer & TRAILER_CMD5) MD5Final(md5, md5ctx);
+    }
+
+    if (!strm->body_submitted) {
+        /* One data provider per stream, fed from the queue */
+        nghttp2_data_provider prd;
+
+        prd.source.ptr = strm;
+        prd.read_callback = data_source_read_cb;
+
+        syslog(LOG_DEBUG, "nghttp2_submit_data(id=%d, datalen=%d, flags=%#x)",
+               strm->id, datalen, flags);
+
+        r = nghttp2_submit_data(ctx->session, flags, strm->id, &prd);
+        if (r) {
+            syslog(LOG_ERR, "nghttp2_submit_data: %s", nghttp2_strerror(r));
         }
+        else strm->body_submitted = 1;
     }
+    else if (strm->body_deferred) {
+        syslog(LOG_DEBUG, "nghttp2_session_resume_data(id=%d, datalen=%d)",
+               strm->id, datalen);
 
-    syslog(LOG_DEBUG, "nghttp2_submit_data(id=%d, datalen=%d, flags=%#x)",
-           strm->id, datalen, flags);
+        strm->body_deferred = 0;
+        r = nghttp2_session_resume_data(ctx->session, strm->id);
+        if (r) {
+            syslog(LOG_ERR, "nghttp2_session_resume_data: %s",
+                   nghttp2_strerror(r));
+        }
+    }
 
-    r = nghttp2_submit_data(ctx->session, flags, strm->id, &prd);
     if (r) {
-        syslog(LOG_ERR, "nghttp2_submit_data: %s", nghttp2_strerror(r));
         return HTTP_SERVER_ERROR;
     }
     else {
@@ -884,6 +946,7 @@ HIDDEN void http2_end_stream(void *http2_strm)
     for (i = 0; i < HTTP2_MAX_HEADERS; i++) {
         free(strm->resp_hdrs[i].value);
     }
+    buf_free(&strm->body);
     free(strm);
 }
 
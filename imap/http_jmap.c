@@ -79,6 +79,7 @@ static time_t compile_time;
 static void jmap_init(struct buf *serverinfo);
 static int  jmap_need_auth(struct transaction_t *txn);
 static int  jmap_auth(const char *userid);
+static void jmap_reset(void);
 static void jmap_shutdown(void);
 
 /* HTTP method handlers */
@@ -112,7 +113,7 @@ struct namespace_t namespace_jmap = {
     jmap_need_auth, /*authschemes*/0,
     /*mbtype*/0, 
     (ALLOW_READ | ALLOW_POST),
-    &jmap_init, &jmap_auth, NULL, &jmap_shutdown, NULL, /*bearer*/NULL,
+    &jmap_init, &jmap_auth, &jmap_reset, &jmap_shutdown, NULL, /*bearer*/NULL,
     {
         { NULL,                 NULL },                 /* ACL          */
         { NULL,                 NULL },                 /* BIND         */
@@ -144,7 +145,7 @@ struct namespace_t namespace_jmap = {
  */
 
 static jmap_settings_t my_jmap_settings = {
-    HASH_TABLE_INITIALIZER, STRARRAY_INITIALIZER, NULL, { 0 }
+    HASHOA_TABLE_INITIALIZER, STRARRAY_INITIALIZER, NULL, { 0 }
 };
 
 jmap_method_t jmap_core_methods[] = {
@@ -184,11 +185,11 @@ static void jmap_core_init()
     strarray_push(&my_jmap_settings.can_use, JMAP_URN_CORE);
     strarray_push(&my_jmap_settings.can_use, JMAP_QUOTA_EXTENSION);
  
-    construct_hash_table(&my_jmap_settings.methods, 128, 0);
+    construct_hashoa_table(&my_jmap_settings.methods, 128);
 
     jmap_method_t *mp;
     for (mp = jmap_core_methods; mp->name; mp++) {
-        hash_insert(mp->name, mp, &my_jmap_settings.methods);
+        hashoa_insert(mp->name, mp, &my_jmap_settings.methods);
     }
 }
 
@@ -240,8 +241,17 @@ static void jmap_init(struct buf *serverinfo __attribute__((unused)))
     jmap_calendar_init(&my_jmap_settings);
 }
 
-static int jmap_auth(const char *userid __attribute__((unused)))
+static int jmap_auth(const char *userid)
 {
+    static char *last_userid = NULL;
+
+    /* Don't carry mailboxes over from a previously authenticated user */
+    if (!last_userid || strcmpsafe(userid, last_userid)) {
+        jmap_mboxcache_reset();
+        free(last_userid);
+        last_userid = xstrdupnull(userid);
+    }
+
     /* Set namespace */
     mboxname_init_namespace(&jmap_namespace,
                             httpd_userisadmin || httpd_userisproxyadmin);
@@ -254,9 +264,16 @@ static int jmap_need_auth(struct transaction_t *txn __attribute__((unused)))
     return HTTP_UNAUTHORIZED;
 }
 
+static void jmap_reset(void)
+{
+    /* Don't keep mailboxes open for the next user */
+    jmap_mboxcache_reset();
+}
+
 static void jmap_shutdown(void)
 {
-    free_hash_table(&my_jmap_settings.methods, NULL);
+    jmap_mboxcache_reset();
+    free_hashoa_table(&my_jmap_settings.methods, NULL);
     strarray_fini(&my_jmap_settings.can_use);
     if (my_jmap_settings.capabilities)
         json_decref(my_jmap_settings.capabilities);
@@ -357,21 +374,52 @@ static int jmap_get(struct transaction_t *txn,
     return jmap_download(txn);
 }
 
-static int json_response(int code, struct transaction_t *txn, json_t *root)
+/* Size of the serialized JSON buffered before it is sent as a chunk */
+#define JSON_STREAM_CHUNK  (64 * 1024)
+
+struct json_stream_rock {
+    long code;
+    struct transaction_t *txn;
+    struct buf buf;
+    int streaming;
+};
+
+static void json_stream_flush(struct json_stream_rock *jrock)
 {
-    size_t flags = JSON_PRESERVE_ORDER;
-    char *buf;
+    if (!jrock->streaming) {
+        /* First chunk - send the response header */
+        jrock->txn->flags.te |= TE_CHUNKED;
+        write_body(jrock->code, jrock->txn,
+                   buf_base(&jrock->buf), buf_len(&jrock->buf));
+        jrock->streaming = 1;
+    }
+    else if (buf_len(&jrock->buf)) {
+        write_body(0, jrock->txn, buf_base(&jrock->buf), buf_len(&jrock->buf));
+    }
+    buf_reset(&jrock->buf);
+}
 
-    /* Dump JSON object into a text buffer */
-    flags |= (config_httpprettytelemetry ? JSON_INDENT(2) : JSON_COMPACT);
-    buf = json_dumps(root, flags);
-    json_decref(root);
+static int json_stream_cb(const char *buffer, size_t size, void *rock)
+{
+    struct json_stream_rock *jrock = (struct json_stream_rock *) rock;
 
-    if (!buf) {
-        txn->error.desc = "Error dumping JSON object";
-        return HTTP_SERVER_ERROR;
+    buf_appendmap(&jrock->buf, buffer, size);
+
+    /* HEAD responses are never streamed, so that we can report the length */
+    if (buf_len(&jrock->buf) >= JSON_STREAM_CHUNK &&
+        jrock->txn->meth != METH_HEAD) {
+        json_stream_flush(jrock);
     }
 
+    return 0;
+}
+
+static int json_response(int code, struct transaction_t *txn, json_t *root)
+{
+    size_t flags = JSON_PRESERVE_ORDER;
+    struct json_stream_rock jrock = { code, txn, BUF_INITIALIZER, 0 };
+    int r;
+
     /* Output the JSON object */
     switch (code) {
     case HTTP_OK:
@@ -383,8 +431,34 @@ static int json_response(int code, struct transaction_t *txn, json_t *root)
         break;
     }
 
-    write_body(code, txn, buf, strlen(buf));
-    free(buf);
+    /* Dump JSON object straight to the response body, in chunks once it
+     * grows beyond JSON_STREAM_CHUNK, rather than into one text buffer */
+    flags |= (config_httpprettytelemetry ? JSON_INDENT(2) : JSON_COMPACT);
+    r = json_dump_callback(root, json_stream_cb, &jrock, flags);
+    json_decref(root);
+
+    if (!jrock.streaming) {
+        if (r) {
+            buf_free(&jrock.buf);
+            txn->error.desc = "Error dumping JSON object";
+            return HTTP_SERVER_ERROR;
+        }
+
+        /* Small response - send it in one piece with a Content-Length */
+        write_body(code, txn, buf_base(&jrock.buf), buf_len(&jrock.buf));
+    }
+    else {
+        /* The response header is already gone, all we can do is
+         * cut the body short */
+        if (r) {
+            syslog(LOG_ERR, "IOERROR: error dumping JSON response");
+            buf_reset(&jrock.buf);
+        }
+
+        json_stream_flush(&jrock);
+        write_body(0, txn, NULL, 0);
+    }
+    buf_free(&jrock.buf);
 
     return 0;
 }
@@ -564,6 +638,36 @@ static int jmap_download(struct transaction_t *txn)
     }
     if (!accept_mime) accept_mime = xstrdup("application/octet-stream");
 
+    /* Blobs are immutable, so their id makes a strong validator
+     * and we can serve byte ranges of them.  The ETag must outlive
+     * this function, for when a 304 response is sent by our caller */
+    static char etag[42];
+    time_t lastmod = 0;
+    strlcpy(etag, blobid, sizeof(etag));
+    msgrecord_get_internaldate(mr, &lastmod);
+    txn->flags.ranges = 1;
+
+    int precond = check_precond(txn, etag, lastmod);
+    switch (precond) {
+    case HTTP_OK:
+    case HTTP_PARTIAL:
+    case HTTP_NOT_MODIFIED:
+        /* Fill in ETag, Last-Modified, and Expires */
+        txn->resp_body.etag = etag;
+        txn->resp_body.lastmod = lastmod;
+        txn->resp_body.maxage = 31536000;  /* 1 year */
+        txn->flags.cc |= CC_MAXAGE | CC_PRIVATE;
+
+        if (precond != HTTP_NOT_MODIFIED) break;
+
+        GCC_FALLTHROUGH
+
+    default:
+        /* We failed a precondition - don't perform the request */
+        res = precond;
+        goto done;
+    }
+
     // default with no part is the whole message
     const char *base = msg_buf.s;
     size_t len = msg_buf.len;
@@ -574,15 +678,21 @@ static int jmap_download(struct transaction_t *txn)
         base += part->content_offset;
         len = part->content_size;
 
-        // binary decode if needed
+        // binary decode if needed; unencoded parts are sent
+        // straight from the mapped message
         int encoding = part->charset_enc & 0xff;
         base = charset_decode_mimebody(base, len, encoding, &decbuf, &len);
+        if (!base) {
+            res = HTTP_SERVER_ERROR;
+            txn->error.desc = "Unknown MIME encoding";
+            goto done;
+        }
     }
 
     txn->resp_body.len = len;
     txn->resp_body.dispo.fname = name;
 
-    write_body(HTTP_OK, txn, base, len);
+    write_body(precond, txn, base, len);
 
  done:
     free(accept_mime);
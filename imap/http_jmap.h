@@ -47,6 +47,7 @@
 #include "auth.h"
 #include "conversations.h"
 #include "hash.h"
+#include "hashoa.h"
 #include "httpd.h"
 #include "json_support.h"
 #include "mailbox.h"
@@ -81,7 +82,7 @@ enum {
 };
 
 typedef struct {
-    hash_table methods;
+    hashoa_table methods;
     strarray_t can_use;
     json_t *capabilities;
     long limits[JMAP_NUM_LIMITS];
@@ -130,6 +131,7 @@ typedef struct jmap_req {
 
 extern int jmap_initreq(jmap_req_t *req);
 extern void jmap_finireq(jmap_req_t *req);
+extern void jmap_mboxcache_reset(void);
 
 extern int jmap_hascapa(jmap_req_t *req, const char *capa);
 
@@ -55,6 +55,7 @@
 #include "httpd.h"
 #include "http_proxy.h"
 #include "iptostring.h"
+#include "mbcache.h"
 #include "mupdate-client.h"
 #include "prot.h"
 #include "proxy.h"
@@ -523,7 +524,8 @@ EXPORTED int http_mlookup(const char *name, mbentry_t **mbentryp, void *tid)
     mbentry_t *mbentry = NULL;
     int r;
 
-    r = mboxlist_lookup(name, &mbentry, tid);
+    if (tid) r = mboxlist_lookup(name, &mbentry, tid);
+    else r = mbcache_lookup(name, &mbentry);
     if (r == IMAP_MAILBOX_NONEXISTENT && config_mupdate_server) {
         kick_mupdate();
         r = mboxlist_lookup(name, &mbentry, tid);
@@ -748,6 +750,12 @@ static unsigned pipe_chunk(struct protstream *pin, struct transaction_t *txn,
     char buf[PROT_BUFSIZE];
     unsigned n = 0;
 
+    if (len != UINT_MAX && txn->flags.ver != VER_2 &&
+        !txn->flags.te && !txn->resp_body.enc) {
+        /* Identity body - let the kernel relay it if it can */
+        return prot_splice(pin, httpd_out, len) ? 0 : len;
+    }
+
     /* Read 'len' octets */
     for (; len; len -= n) {
         n = prot_read(pin, buf, MIN(len, PROT_BUFSIZE));
@@ -178,10 +178,20 @@ struct tz_shape_t {
     int valid;
     SHPHandle shp;
     DBFHandle dbf;
+    SHPTree *tree;      /* quadtree of shape bounding boxes */
 };
 
-static struct tz_shape_t tz_world = { 0, NULL, NULL };
-static struct tz_shape_t tz_aq    = { 0, NULL, NULL };
+static struct tz_shape_t tz_world = { 0, NULL, NULL, NULL };
+static struct tz_shape_t tz_aq    = { 0, NULL, NULL, NULL };
+
+/* Index the bounding boxes of all shapes so that lookups only need to
+   test the shapes whose boxes could contain (or be near) the point */
+static void index_shape_file(struct tz_shape_t *shape, const char *fname)
+{
+    shape->tree = SHPCreateTree(shape->shp, 2, 0, NULL, NULL);
+    if (shape->tree) SHPTreeTrimExtraNodes(shape->tree);
+    else syslog(LOG_NOTICE, "Failed to index %s, using linear scan", fname);
+}
 
 static void open_shape_file(struct buf *serverinfo)
 {
@@ -221,6 +231,8 @@ static void open_shape_file(struct buf *serverinfo)
         return;
     }
 
+    index_shape_file(&tz_world, buf);
+
     geo_enabled = tz_world.valid = 1;
 
     /* Open the tz_antarctica shape files (optional) */
@@ -253,11 +265,15 @@ static void open_shape_file(struct buf *serverinfo)
         return;
     }
 
+    index_shape_file(&tz_aq, buf);
+
     tz_aq.valid = 1;
 }
 
 static void close_shape_file()
 {
+    if (tz_world.tree) SHPDestroyTree(tz_world.tree);
+    if (tz_aq.tree) SHPDestroyTree(tz_aq.tree);
     if (tz_world.dbf) DBFClose(tz_world.dbf);
     if (tz_world.shp) SHPClose(tz_world.shp);
     if (tz_aq.dbf) DBFClose(tz_aq.dbf);
@@ -376,6 +392,49 @@ static int pt_near_poly(int nvert, double *vx, double *vy,
     return 0;
 }
 
+static int shapeid_cmp(const void *a, const void *b)
+{
+    return *((const int *) a) - *((const int *) b);
+}
+
+/* Find the ids of the shapes whose bounding boxes are within 'range'
+   (radians) of the point, in shapefile order.
+   Returns NULL (and all shapes) if the shapes aren't indexed. */
+static int *shape_candidates(struct tz_shape_t *shape,
+                             double latitude, double longitude,
+                             double range, int *count)
+{
+    double minbound[4] = { -180.0, -90.0, 0.0, 0.0 };
+    double maxbound[4] = {  180.0,  90.0, 0.0, 0.0 };
+    double dlat = range / M_PI_180;
+    int *ids;
+
+    if (!shape->tree) {
+        *count = shape->shp->nRecords;
+        return NULL;
+    }
+
+    if (latitude - dlat > -90.0) minbound[1] = latitude - dlat;
+    if (latitude + dlat <  90.0) maxbound[1] = latitude + dlat;
+
+    /* Widest longitude span of a circle of 'range' around the point */
+    if (sin(range) < cos(deg2rad(latitude))) {
+        double dlon = asin(sin(range) / cos(deg2rad(latitude))) / M_PI_180;
+
+        /* Don't bother splitting boxes that cross the antimeridian */
+        if (longitude - dlon >= -180.0 && longitude + dlon <= 180.0) {
+            minbound[0] = longitude - dlon;
+            maxbound[0] = longitude + dlon;
+        }
+    }
+
+    ids = SHPTreeFindLikelyShapes(shape->tree, minbound, maxbound, count);
+    if (!ids) *count = 0;
+    else qsort(ids, *count, sizeof(int), &shapeid_cmp);
+
+    return ids;
+}
+
 static strarray_t *tzid_from_geo(struct transaction_t *txn,
                                  double latitude, double longitude,
                                  double uncertainty)
@@ -383,7 +442,7 @@ static strarray_t *tzid_from_geo(struct transaction_t *txn,
     strarray_t *tzids = strarray_new();
     const char *tzid;
     struct vector p, a;
-    int i, npoly;
+    int i, n, npoly, *ids;
     double minbound[4], maxbound[4];
 
     /* using unit vectors */
@@ -403,7 +462,13 @@ static strarray_t *tzid_from_geo(struct transaction_t *txn,
             dist = 10000 / M_EARTH_RADIUS;
         }
 
-        for (i = 0; i < tz_aq.shp->nRecords; i++) {
+        int ncand;
+
+        ids = shape_candidates(&tz_aq, latitude, longitude, dist, &ncand);
+
+        for (n = 0; n < ncand; n++) {
+            i = ids ? ids[n] : n;
+
             SHPObject *base = SHPReadObject(tz_aq.shp, i);
             struct vector b;
 
@@ -419,6 +484,8 @@ static strarray_t *tzid_from_geo(struct transaction_t *txn,
 
             keepalive_response(txn);
         }
+
+        free(ids);
     }
 
     /* Check if point is within or near bounding box of tz_world */
@@ -432,8 +499,14 @@ static strarray_t *tzid_from_geo(struct transaction_t *txn,
     if (pt_in_poly(5, WbbX, WbbY, longitude, latitude) ||
         (uncertainty && pt_near_poly(5, WbbX, WbbY, &p, uncertainty))) {
         /* Check if point is within or near a time zone boundary */
+        int ncand;
+
+        ids = shape_candidates(&tz_world, latitude, longitude,
+                               uncertainty, &ncand);
+
+        for (n = 0; n < ncand; n++) {
+            i = ids ? ids[n] : n;
 
-        for (i = 0; i < npoly; i++) {
             SHPObject *poly = SHPReadObject(tz_world.shp, i);
             double bbX[5] = { poly->dfXMin, poly->dfXMin,
                               poly->dfXMax, poly->dfXMax, poly->dfXMin };
@@ -468,6 +541,8 @@ static strarray_t *tzid_from_geo(struct transaction_t *txn,
 
             keepalive_response(txn);
         }
+
+        free(ids);
     }
 
     if (!strarray_size(tzids)) {
@@ -636,6 +711,67 @@ static void read_leap_seconds()
 }
 
 
+/* Per-process cache of rendered zone data, keyed by tzid, action,
+   format and truncation range, and validated against the dtstamp of
+   the zoneinfo record it was rendered from */
+#define TZCACHE_MAX_ENTRIES 256
+
+struct tzcache_entry {
+    time_t dtstamp;
+    struct buf data;
+};
+
+static hash_table tzcache = HASH_TABLE_INITIALIZER;
+static int tzcache_count = 0;
+
+static void tzcache_entry_free(void *data)
+{
+    struct tzcache_entry *entry = (struct tzcache_entry *) data;
+
+    buf_free(&entry->data);
+    free(entry);
+}
+
+static const struct buf *tzcache_lookup(const char *key, time_t dtstamp)
+{
+    struct tzcache_entry *entry;
+
+    if (!tzcache.size) return NULL;
+
+    entry = hash_lookup(key, &tzcache);
+    if (!entry || entry->dtstamp != dtstamp) return NULL;
+
+    return &entry->data;
+}
+
+static void tzcache_store(const char *key, time_t dtstamp,
+                          const char *data, size_t datalen)
+{
+    struct tzcache_entry *entry;
+
+    if (!tzcache.size) {
+        construct_hash_table(&tzcache, TZCACHE_MAX_ENTRIES, 0);
+    }
+
+    entry = hash_lookup(key, &tzcache);
+    if (!entry) {
+        if (tzcache_count >= TZCACHE_MAX_ENTRIES) {
+            /* Full - start over rather than track usage */
+            free_hash_table(&tzcache, tzcache_entry_free);
+            construct_hash_table(&tzcache, TZCACHE_MAX_ENTRIES, 0);
+            tzcache_count = 0;
+        }
+
+        entry = xzmalloc(sizeof(struct tzcache_entry));
+        hash_insert(key, entry, &tzcache);
+        tzcache_count++;
+    }
+
+    entry->dtstamp = dtstamp;
+    buf_setmap(&entry->data, data, datalen);
+}
+
+
 static void tzdist_init(struct buf *serverinfo __attribute__((unused)))
 {
     struct buf buf = BUF_INITIALIZER;
@@ -684,6 +820,9 @@ static void tzdist_shutdown(void)
 
     close_shape_file();
 
+    free_hash_table(&tzcache, tzcache_entry_free);
+    tzcache_count = 0;
+
     if (!leap_seconds) return;
 
     while ((leap = ptrarray_pop(leap_seconds))) free(leap);
@@ -1768,7 +1907,9 @@ static int action_get(struct transaction_t *txn)
     unsigned long datalen = 0;
     struct resp_body_t *resp_body = &txn->resp_body;
     struct mime_type_t *mime = NULL;
-    const char **hdr;
+    const char **hdr, *proto, *host;
+    static struct buf cachekey = BUF_INITIALIZER;
+    const struct buf *cached;
 
     /* Check/find requested MIME type:
        1st entry in gparams->mime_types array MUST be default MIME type */
@@ -1807,9 +1948,19 @@ static int action_get(struct transaction_t *txn)
                 : HTTP_SERVER_ERROR);
     }
 
-    /* Generate ETag & Last-Modified from info record */
+    /* Everything that goes into the representation (TZURL included) */
+    http_proto_host(txn->req_hdrs, &proto, &host);
+    buf_reset(&cachekey);
+    buf_printf(&cachekey, "get\t%s\t%s\t%s://%s", tzid, mime->content_type,
+               proto, host);
+    if (!icaltime_is_null_time(start) || !icaltime_is_null_time(end))
+        buf_printf(&cachekey, "?%s", URI_QUERY(txn->req_uri));
+
+    /* Generate ETag & Last-Modified from info record,
+       strong per representation of the zone */
     assert(!buf_len(&txn->buf));
-    buf_printf(&txn->buf, "%u-%ld", strhash(tzid), zi.dtstamp);
+    buf_printf(&txn->buf, "%u-%ld-%u", strhash(tzid), zi.dtstamp,
+               strhash(buf_cstring(&cachekey)));
     lastmod = zi.dtstamp;
     freestrlist(zi.data);
 
@@ -1842,106 +1993,117 @@ static int action_get(struct transaction_t *txn)
 
     if (txn->meth != METH_HEAD) {
         static struct buf pathbuf = BUF_INITIALIZER;
-        const char *p, *path, *proto, *host, *msg_base = NULL;
+        const char *p, *path, *msg_base = NULL;
         size_t msg_size = 0;
         icalcomponent *ical, *vtz;
         icalproperty *prop;
         struct buf *buf = NULL;
         int fd;
 
-        /* Open, mmap, and parse the file */
-        buf_reset(&pathbuf);
-        buf_printf(&pathbuf, "%s%s/%s.ics",
-                   config_dir, FNAME_ZONEINFODIR, tzid);
-        path = buf_cstring(&pathbuf);
-        if ((fd = open(path, O_RDONLY)) == -1) return HTTP_SERVER_ERROR;
+        if ((cached = tzcache_lookup(buf_cstring(&cachekey), lastmod))) {
+            datalen = buf_len(cached);
+            data = xmemdup(buf_base(cached), datalen);
+        }
+        else {
+            /* Open, mmap, and parse the file */
+            buf_reset(&pathbuf);
+            buf_printf(&pathbuf, "%s%s/%s.ics",
+                       config_dir, FNAME_ZONEINFODIR, tzid);
+            path = buf_cstring(&pathbuf);
+            if ((fd = open(path, O_RDONLY)) == -1) return HTTP_SERVER_ERROR;
+
+            map_refresh(fd, 1, &msg_base, &msg_size,
+                        MAP_UNKNOWN_LEN, path, NULL);
+            if (!msg_base) return HTTP_SERVER_ERROR;
+
+            ical = icalparser_parse_string(msg_base);
+            map_free(&msg_base, &msg_size);
+            close(fd);
+
+            vtz = icalcomponent_get_first_component(ical,
+                                                    ICAL_VTIMEZONE_COMPONENT);
+            prop = icalcomponent_get_first_property(vtz, ICAL_TZID_PROPERTY);
 
-        map_refresh(fd, 1, &msg_base, &msg_size, MAP_UNKNOWN_LEN, path, NULL);
-        if (!msg_base) return HTTP_SERVER_ERROR;
+            if ((zi.type == ZI_LINK) &&
+                !icalcomponent_get_first_property(vtz,
+                                                  ICAL_TZIDALIASOF_PROPERTY)) {
+                /* Add TZID-ALIAS-OF */
+                const char *aliasof = icalproperty_get_tzid(prop);
+                icalproperty *atzid = icalproperty_new_tzidaliasof(aliasof);
 
-        ical = icalparser_parse_string(msg_base);
-        map_free(&msg_base, &msg_size);
-        close(fd);
+                icalcomponent_add_property(vtz, atzid);
 
-        vtz = icalcomponent_get_first_component(ical, ICAL_VTIMEZONE_COMPONENT);
-        prop = icalcomponent_get_first_property(vtz, ICAL_TZID_PROPERTY);
+                /* Substitute TZID alias */
+                icalproperty_set_tzid(prop, tzid);
+            }
 
-        if ((zi.type == ZI_LINK) &&
-            !icalcomponent_get_first_property(vtz, ICAL_TZIDALIASOF_PROPERTY)) {
-            /* Add TZID-ALIAS-OF */
-            const char *aliasof = icalproperty_get_tzid(prop);
-            icalproperty *atzid = icalproperty_new_tzidaliasof(aliasof);
+            /* Start constructing TZURL */
+            buf_reset(&pathbuf);
+            buf_printf(&pathbuf, "%s://%s%s/zones/",
+                       proto, host, namespace_tzdist.prefix);
+
+            /* Escape '/' and ' ' in tzid */
+            for (p = tzid; *p; p++) {
+                switch (*p) {
+                case '/':
+                case ' ':
+                    buf_printf(&pathbuf, "%%%02X", *p);
+                    break;
 
-            icalcomponent_add_property(vtz, atzid);
+                default:
+                    buf_putc(&pathbuf, *p);
+                    break;
+                }
+            }
 
-            /* Substitute TZID alias */
-            icalproperty_set_tzid(prop, tzid);
-        }
+            if (!icaltime_is_null_time(start) || !icaltime_is_null_time(end)) {
 
-        /* Start constructing TZURL */
-        buf_reset(&pathbuf);
-        http_proto_host(txn->req_hdrs, &proto, &host);
-        buf_printf(&pathbuf, "%s://%s%s/zones/",
-                   proto, host, namespace_tzdist.prefix);
-
-        /* Escape '/' and ' ' in tzid */
-        for (p = tzid; *p; p++) {
-            switch (*p) {
-            case '/':
-            case ' ':
-                buf_printf(&pathbuf, "%%%02X", *p);
-                break;
+                if (!icaltime_is_null_time(end)) {
+                    /* Add TZUNTIL to VTIMEZONE */
+                    icalproperty *tzuntil = icalproperty_new_tzuntil(end);
+                    icalcomponent_add_property(vtz, tzuntil);
+                }
 
-            default:
-                buf_putc(&pathbuf, *p);
-                break;
-            }
-        }
+                /* Add truncation parameter(s) to TZURL */
+                buf_printf(&pathbuf, "?%s", URI_QUERY(txn->req_uri));
 
-        if (!icaltime_is_null_time(start) || !icaltime_is_null_time(end)) {
+                if (!strncmp(mime->content_type, "application/tzif", 16)) {
+                    /* Truncate and convert the VTIMEZONE */
+                    bit32 leapcnt = 0;
 
-            if (!icaltime_is_null_time(end)) {
-                /* Add TZUNTIL to VTIMEZONE */
-                icalproperty *tzuntil = icalproperty_new_tzuntil(end);
-                icalcomponent_add_property(vtz, tzuntil);
+                    if (!strcmp(mime->content_type + 16, "-leap"))
+                        leapcnt = leap_seconds->count - 2;
+
+                    buf =_icaltimezone_as_tzif(ical, leapcnt, &start, &end);
+                }
+                else {
+                    /* Truncate the VTIMEZONE */
+                    truncate_vtimezone(vtz, &start, &end,
+                                       NULL, NULL, NULL, NULL, NULL);
+                }
             }
 
-            /* Add truncation parameter(s) to TZURL */
-            buf_printf(&pathbuf, "?%s", URI_QUERY(txn->req_uri));
+            /* Set TZURL property */
+            prop = icalproperty_new_tzurl(buf_cstring(&pathbuf));
+            icalcomponent_add_property(vtz, prop);
 
-            if (!strncmp(mime->content_type, "application/tzif", 16)) {
-                /* Truncate and convert the VTIMEZONE */
-                bit32 leapcnt = 0;
+            /* Convert to requested MIME type */
+            if (!buf) buf = mime->from_object(ical);
+            datalen = buf_len(buf);
+            data = buf_release(buf);
+            buf_destroy(buf);
 
-                if (!strcmp(mime->content_type + 16, "-leap"))
-                    leapcnt = leap_seconds->count - 2;
+            icalcomponent_free(ical);
 
-                buf =_icaltimezone_as_tzif(ical, leapcnt, &start, &end);
-            }
-            else {
-                /* Truncate the VTIMEZONE */
-                truncate_vtimezone(vtz, &start, &end, NULL, NULL, NULL, NULL, NULL);
-            }
+            tzcache_store(buf_cstring(&cachekey), lastmod, data, datalen);
         }
 
-        /* Set TZURL property */
-        prop = icalproperty_new_tzurl(buf_cstring(&pathbuf));
-        icalcomponent_add_property(vtz, prop);
-
-        /* Convert to requested MIME type */
-        if (!buf) buf = mime->from_object(ical);
-        datalen = buf_len(buf);
-        data = buf_release(buf);
-        buf_destroy(buf);
-
         /* Set Content-Disposition filename */
         buf_setcstr(&pathbuf, tzid);
         if (mime->file_ext) buf_printf(&pathbuf, ".%s", mime->file_ext);
         resp_body->dispo.fname = buf_cstring(&pathbuf);
 
         txn->flags.vary |= VARY_ACCEPT;
-
-        icalcomponent_free(ical);
     }
 
     write_body(precond, txn, data, datalen);
@@ -1973,6 +2135,9 @@ static int action_expand(struct transaction_t *txn)
     icaltimetype start, end;
     struct resp_body_t *resp_body = &txn->resp_body;
     json_t *root = NULL;
+    static struct buf cachekey = BUF_INITIALIZER;
+    const struct buf *cached = NULL;
+    char *json = NULL;
 
     /* Sanity check the parameters */
     param = hash_lookup("start", &txn->req_qparams);
@@ -2018,9 +2183,16 @@ static int action_expand(struct transaction_t *txn)
                 : HTTP_SERVER_ERROR);
     }
 
-    /* Generate ETag & Last-Modified from info record */
+    buf_reset(&cachekey);
+    buf_printf(&cachekey, "expand\t%s\t%s\t%s%s", tzid,
+               icaltime_as_ical_string(start), icaltime_as_ical_string(end),
+               zdump ? "\tzdump" : "");
+
+    /* Generate ETag & Last-Modified from info record,
+       strong per expansion range */
     assert(!buf_len(&txn->buf));
-    buf_printf(&txn->buf, "%u-%ld", strhash(tzid), zi.dtstamp);
+    buf_printf(&txn->buf, "%u-%ld-%u", strhash(tzid), zi.dtstamp,
+               strhash(buf_cstring(&cachekey)));
     lastmod = zi.dtstamp;
     freestrlist(zi.data);
 
@@ -2050,7 +2222,12 @@ static int action_expand(struct transaction_t *txn)
     }
 
 
-    if (txn->meth != METH_HEAD) {
+    if (txn->meth != METH_HEAD && !zdump) {
+        /* Use previously generated JSON, if still current */
+        cached = tzcache_lookup(buf_cstring(&cachekey), lastmod);
+    }
+
+    if (txn->meth != METH_HEAD && !cached) {
         static struct buf pathbuf = BUF_INITIALIZER;
         const char *path, *msg_base = NULL;
         size_t msg_size = 0;
@@ -2171,8 +2348,19 @@ static int action_expand(struct transaction_t *txn)
         return 0;
     }
     else {
+        int from_cache = (cached != NULL);
+
+        if (from_cache) json = xstrndup(buf_base(cached), buf_len(cached));
+
         /* Output the JSON object */
-        return json_response(precond, txn, root, NULL);
+        r = json_response(precond, txn, root, &json);
+
+        if (!r && json && !from_cache && txn->meth != METH_HEAD) {
+            tzcache_store(buf_cstring(&cachekey), lastmod, json, strlen(json));
+        }
+        free(json);
+
+        return r;
     }
 }
 
@@ -133,7 +133,8 @@ static const struct prop_entry webdav_props[] = {
       PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE,
       propfind_creationdate, NULL, NULL },
     { "displayname", NS_DAV,
-      PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE | PROP_PERUSER,
+      PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE | PROP_PERUSER
+      | PROP_NOMAILBOX,
       propfind_collectionname, proppatch_todb, NULL },
     { "getcontentlanguage", NS_DAV,
       PROP_ALLPROP | PROP_RESOURCE,
@@ -154,7 +155,7 @@ static const struct prop_entry webdav_props[] = {
       PROP_ALLPROP | PROP_RESOURCE,
       propfind_lockdisc, NULL, NULL },
     { "resourcetype", NS_DAV,
-      PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE,
+      PROP_ALLPROP | PROP_COLLECTION | PROP_RESOURCE | PROP_NOMAILBOX,
       propfind_restype, proppatch_restype, "addressbook" },
     { "supportedlock", NS_DAV,
       PROP_ALLPROP | PROP_RESOURCE,
@@ -193,7 +194,7 @@ static const struct prop_entry webdav_props[] = {
 
     /* WebDAV Quota (RFC 4331) properties */
     { "quota-available-bytes", NS_DAV,
-      PROP_COLLECTION,
+      PROP_COLLECTION | PROP_NOMAILBOX,
       propfind_quota, NULL, NULL },
     { "quota-used-bytes", NS_DAV,
       PROP_COLLECTION,
@@ -211,12 +212,12 @@ static const struct prop_entry webdav_props[] = {
 
     /* WebDAV Sync (RFC 6578) properties */
     { "sync-token", NS_DAV,
-      PROP_COLLECTION,
+      PROP_COLLECTION | PROP_NOMAILBOX,
       propfind_sync_token, NULL, SYNC_TOKEN_URL_SCHEME },
 
     /* Apple Calendar Server properties */
     { "getctag", NS_CS,
-      PROP_ALLPROP | PROP_COLLECTION,
+      PROP_ALLPROP | PROP_COLLECTION | PROP_NOMAILBOX,
       propfind_sync_token, NULL, "" },
 
     { NULL, 0, 0, NULL, NULL, NULL }
@@ -216,35 +216,43 @@ static ssize_t recv_cb(wslay_event_context_ptr ev,
     return n;
 }
 
+/* Trailing 4 bytes stripped from each compressed message (RFC 7692) */
+static const char pmce_trailer[4] = { 0x00, 0x00, (char) 0xff, (char) 0xff };
+
 static int zlib_decompress(struct transaction_t *txn,
                            const char *buf, unsigned len)
 {
     struct ws_context *ctx = (struct ws_context *) txn->ws_ctx;
     z_stream *zstrm = ctx->pmce.deflate.zstrm;
-
-    zstrm->next_in = (Bytef *) buf;
-    zstrm->avail_in = len;
+    int i;
 
     buf_reset(&txn->zbuf);
 
-    do {
-        int zr;
+    /* Inflate the message and then the trailer, rather than copying
+       the whole message just to append 4 bytes to it */
+    for (i = 0; i < 2; i++) {
+        zstrm->next_in = (Bytef *) (i ? pmce_trailer : buf);
+        zstrm->avail_in = i ? sizeof(pmce_trailer) : len;
 
-        buf_ensure(&txn->zbuf, 4096);
+        do {
+            int zr;
 
-        zstrm->next_out = (Bytef *) txn->zbuf.s + txn->zbuf.len;
-        zstrm->avail_out = txn->zbuf.alloc - txn->zbuf.len;
+            buf_ensure(&txn->zbuf, 4096);
 
-        zr = inflate(zstrm, Z_SYNC_FLUSH);
-        if (!(zr == Z_OK || zr == Z_STREAM_END || zr == Z_BUF_ERROR)) {
-            /* something went wrong */
-            syslog(LOG_ERR, "zlib deflate error: %d %s", zr, zstrm->msg);
-            return -1;
-        }
+            zstrm->next_out = (Bytef *) txn->zbuf.s + txn->zbuf.len;
+            zstrm->avail_out = txn->zbuf.alloc - txn->zbuf.len;
 
-        txn->zbuf.len = txn->zbuf.alloc - zstrm->avail_out;
+            zr = inflate(zstrm, Z_SYNC_FLUSH);
+            if (!(zr == Z_OK || zr == Z_STREAM_END || zr == Z_BUF_ERROR)) {
+                /* something went wrong */
+                syslog(LOG_ERR, "zlib deflate error: %d %s", zr, zstrm->msg);
+                return -1;
+            }
+
+            txn->zbuf.len = txn->zbuf.alloc - zstrm->avail_out;
 
-    } while (!zstrm->avail_out);
+        } while (!zstrm->avail_out);
+    }
 
     return 0;
 }
@@ -259,6 +267,7 @@ static void on_msg_recv_cb(wslay_event_context_ptr ev,
     struct transaction_t *txn = (struct transaction_t *) user_data;
     struct ws_context *ctx = (struct ws_context *) txn->ws_ctx;
     struct buf inbuf = BUF_INITIALIZER, outbuf = BUF_INITIALIZER;
+    struct buf *req = &inbuf, *resp = &outbuf;
     struct wslay_event_msg msgarg = { arg->opcode, NULL, 0 };
     uint8_t rsv = WSLAY_RSV_NONE;
     double cmdtime, nettime;
@@ -270,9 +279,6 @@ static void on_msg_recv_cb(wslay_event_context_ptr ev,
 
     /* Decompress request, if necessary */
     if (wslay_get_rsv1(arg->rsv)) {
-        /* Add trailing 4 bytes */
-        buf_appendmap(&inbuf, "\x00\x00\xff\xff", 4);
-
         r = zlib_decompress(txn, buf_base(&inbuf), buf_len(&inbuf));
         if (r) {
             syslog(LOG_ERR, "on_msg_recv_cb(): zlib_decompress() failed");
@@ -282,7 +288,9 @@ static void on_msg_recv_cb(wslay_event_context_ptr ev,
             goto err;
         }
 
-        buf_move(&inbuf, &txn->zbuf);
+        /* Use the decompressed request in place, so that txn->zbuf
+           keeps its allocation from one message to the next */
+        req = &txn->zbuf;
     }
 
     /* Log the uncompressed client request */
@@ -298,14 +306,14 @@ static void on_msg_recv_cb(wslay_event_context_ptr ev,
     switch (arg->opcode) {
     case WSLAY_CONNECTION_CLOSE:
         buf_printf(&ctx->log, "; status=%d; msg='%s'", arg->status_code,
-                   buf_len(&inbuf) ? buf_cstring(&inbuf)+2 : "");
+                   buf_len(req) ? buf_cstring(req)+2 : "");
         txn->flags.conn = CONN_CLOSE;
         break;
 
     case WSLAY_TEXT_FRAME:
     case WSLAY_BINARY_FRAME:
         /* Process the request */
-        r = ctx->data_cb(&inbuf, &outbuf, &ctx->log, &ctx->cb_rock);
+        r = ctx->data_cb(req, &outbuf, &ctx->log, &ctx->cb_rock);
         if (r) {
 
             err_code = (r == HTTP_SERVER_ERROR ?
@@ -329,15 +337,16 @@ static void on_msg_recv_cb(wslay_event_context_ptr ev,
             }
 
             /* Trim the trailing 4 bytes */
-            buf_truncate(&txn->zbuf, buf_len(&txn->zbuf) - 4);
-            buf_move(&outbuf, &txn->zbuf);
+            buf_truncate(&txn->zbuf,
+                         buf_len(&txn->zbuf) - sizeof(pmce_trailer));
+            resp = &txn->zbuf;
 
             rsv |= WSLAY_RSV1_BIT;
         }
 
         /* Queue the server response */
-        msgarg.msg = (const uint8_t *) buf_base(&outbuf);
-        msgarg.msg_length = buf_len(&outbuf);
+        msgarg.msg = (const uint8_t *) buf_base(resp);
+        msgarg.msg_length = buf_len(resp);
         wslay_event_queue_msg_ex(ev, &msgarg, rsv);
 
         /* Log the server response */
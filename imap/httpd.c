@@ -85,9 +85,14 @@
 #include "xstrlcpy.h"
 #include "xstrlcat.h"
 #include "telemetry.h"
+#include "logring.h"
 #include "backend.h"
 #include "prometheus.h"
 #include "proxy.h"
+#include "quota.h"
+#include "retry.h"
+#include "mbcache.h"
+#include "mboxevent.h"
 #include "userdeny.h"
 #include "message.h"
 #include "idle.h"
@@ -284,6 +289,208 @@ static void brotli_done(void *brotli __attribute__((unused))) {}
 #endif /* HAVE_BROTLI */
 
 
+/*
+ * Cache of compressed static responses, so that identical content
+ * (docroot files, time zone data, etc) is only compressed once per
+ * process rather than on every request.  Only complete bodies with an
+ * ETag which are the same for every user are cached, keyed by the
+ * request-target, Content-Type, ETag and Content-Encoding.  The cache
+ * is kept in memory up to httpcompresscache_size, least recently used
+ * first out, and optionally written to httpcompresscache_dir, where
+ * other httpd processes can find it.
+ */
+struct compcache_entry {
+    char *key;
+    struct buf data;
+    struct compcache_entry *prev, *next;    /* most recently used first */
+};
+
+static struct {
+    int init;
+    size_t maxsize;
+    size_t size;
+    const char *dir;
+    hash_table table;
+    struct compcache_entry *head, *tail;
+} compcache;
+
+static void compcache_init(void)
+{
+    compcache.init = 1;
+    compcache.maxsize =
+        (size_t) config_getint(IMAPOPT_HTTPCOMPRESSCACHE_SIZE) * 1024;
+    compcache.dir = config_getstring(IMAPOPT_HTTPCOMPRESSCACHE_DIR);
+
+    if (compcache.maxsize)
+        construct_hash_table(&compcache.table, 128, 0);
+}
+
+/* Build the cache key for this response, or return 0 if it can't be
+ * shared */
+static int compcache_key(struct transaction_t *txn, struct buf *key)
+{
+    if (!compcache.init) compcache_init();
+    if (!compcache.maxsize && !compcache.dir) return 0;
+
+    if (!txn->resp_body.enc || txn->flags.te || !txn->resp_body.etag)
+        return 0;
+    if (txn->flags.cc & (CC_PRIVATE | CC_NOSTORE)) return 0;
+    if (!(txn->flags.cc & CC_PUBLIC) && !httpd_userisanonymous) return 0;
+
+    buf_printf(key, "%u\t%s\t%s\t%s\t%s", txn->resp_body.enc,
+               txn->resp_body.type ? txn->resp_body.type : "",
+               txn->resp_body.lang ? txn->resp_body.lang : "",
+               txn->resp_body.etag, txn->req_line.uri);
+
+    return 1;
+}
+
+static char *compcache_fname(const char *key)
+{
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    char hex[2*MD5_DIGEST_LENGTH+1];
+    MD5_CTX ctx;
+
+    MD5Init(&ctx);
+    MD5Update(&ctx, key, strlen(key));
+    MD5Final(md5, &ctx);
+    bin_to_hex(md5, MD5_DIGEST_LENGTH, hex, BH_LOWER);
+
+    return strconcat(compcache.dir, "/", hex, (char *)NULL);
+}
+
+static void compcache_unlink(struct compcache_entry *e)
+{
+    if (e->prev) e->prev->next = e->next;
+    else compcache.head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else compcache.tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void compcache_insert(const char *key, const char *data, size_t len)
+{
+    struct compcache_entry *e;
+
+    if (len > compcache.maxsize) return;
+
+    e = xzmalloc(sizeof(struct compcache_entry));
+    e->key = xstrdup(key);
+    buf_setmap(&e->data, data, len);
+
+    e = hash_insert(key, e, &compcache.table);
+    e->next = compcache.head;
+    if (e->next) e->next->prev = e;
+    else compcache.tail = e;
+    compcache.head = e;
+    compcache.size += len;
+
+    while (compcache.size > compcache.maxsize) {
+        struct compcache_entry *old = compcache.tail;
+
+        compcache_unlink(old);
+        hash_del(old->key, &compcache.table);
+        compcache.size -= buf_len(&old->data);
+        buf_free(&old->data);
+        free(old->key);
+        free(old);
+    }
+}
+
+/* Copy a cached compressed body for 'key' into 'out' */
+static int compcache_fetch(const char *key, struct buf *out)
+{
+    struct compcache_entry *e = NULL;
+
+    if (compcache.maxsize)
+        e = hash_lookup(key, &compcache.table);
+
+    if (e) {
+        if (e != compcache.head) {
+            compcache_unlink(e);
+            e->next = compcache.head;
+            e->next->prev = e;
+            compcache.head = e;
+        }
+        buf_copy(out, &e->data);
+        return 1;
+    }
+
+    if (compcache.dir) {
+        /* the file holds the key, a newline, then the body */
+        char *fname = compcache_fname(key);
+        size_t keylen = strlen(key);
+        struct stat sbuf;
+        int found = 0;
+        int fd;
+
+        fd = open(fname, O_RDONLY, 0);
+        free(fname);
+        if (fd == -1) return 0;
+
+        if (!fstat(fd, &sbuf) && (size_t) sbuf.st_size > keylen) {
+            buf_reset(out);
+            buf_ensure(out, sbuf.st_size);
+            if (retry_read(fd, out->s, sbuf.st_size) == sbuf.st_size &&
+                !memcmp(out->s, key, keylen) && out->s[keylen] == '\n') {
+                out->len = sbuf.st_size;
+                buf_remove(out, 0, keylen + 1);
+                found = 1;
+            }
+        }
+        close(fd);
+
+        if (found && compcache.maxsize)
+            compcache_insert(key, buf_base(out), buf_len(out));
+
+        return found;
+    }
+
+    return 0;
+}
+
+static void compcache_store(const char *key, const char *data, size_t len)
+{
+    if (compcache.maxsize && !hash_lookup(key, &compcache.table))
+        compcache_insert(key, data, len);
+
+    if (compcache.dir) {
+        char *fname = compcache_fname(key);
+        /* each process writes its own copy, so it needs its own name */
+        char *tmpname = strconcat(fname, ".XXXXXX", (char *)NULL);
+        struct iovec iov[3];
+        int fd, r = -1;
+
+        cyrus_mkdir(fname, 0755);
+        fd = mkstemp(tmpname);
+        if (fd != -1) {
+            iov[0].iov_base = (char *) key;
+            iov[0].iov_len = strlen(key);
+            iov[1].iov_base = (char *) "\n";
+            iov[1].iov_len = 1;
+            iov[2].iov_base = (char *) data;
+            iov[2].iov_len = len;
+
+            if (retry_writev(fd, iov, 3) ==
+                (ssize_t) (iov[0].iov_len + 1 + len))
+                r = 0;
+            if (close(fd)) r = -1;
+        }
+
+        /* put it in place whole, or not at all */
+        if (!r) r = rename(tmpname, fname);
+        if (r) {
+            syslog(LOG_ERR, "IOERROR: writing compressed response %s: %m",
+                   fname);
+            if (fd != -1) unlink(tmpname);
+        }
+
+        free(tmpname);
+        free(fname);
+    }
+}
+
+
 static const char tls_message[] =
     HTML_DOCTYPE
     "<html>\n<head>\n<title>TLS Required</title>\n</head>\n" \
@@ -400,28 +607,28 @@ static struct sasl_callback mysasl_cb[] = {
 
 /* Array of HTTP methods known by our server. */
 const struct known_meth_t http_methods[] = {
-    { "ACL",            0,              CYRUS_HTTP_ACL_TOTAL },
-    { "BIND",           0,              CYRUS_HTTP_BIND_TOTAL },
-    { "CONNECT",        METH_NOBODY,    CYRUS_HTTP_CONNECT_TOTAL },
-    { "COPY",           METH_NOBODY,    CYRUS_HTTP_COPY_TOTAL },
-    { "DELETE",         METH_NOBODY,    CYRUS_HTTP_DELETE_TOTAL },
-    { "GET",            METH_NOBODY,    CYRUS_HTTP_GET_TOTAL },
-    { "HEAD",           METH_NOBODY,    CYRUS_HTTP_HEAD_TOTAL },
-    { "LOCK",           0,              CYRUS_HTTP_LOCK_TOTAL },
-    { "MKCALENDAR",     0,              CYRUS_HTTP_MKCALENDAR_TOTAL },
-    { "MKCOL",          0,              CYRUS_HTTP_MKCOL_TOTAL },
-    { "MOVE",           METH_NOBODY,    CYRUS_HTTP_MOVE_TOTAL },
-    { "OPTIONS",        METH_NOBODY,    CYRUS_HTTP_OPTIONS_TOTAL },
-    { "PATCH",          0,              CYRUS_HTTP_PATCH_TOTAL },
-    { "POST",           0,              CYRUS_HTTP_POST_TOTAL },
-    { "PROPFIND",       0,              CYRUS_HTTP_PROPFIND_TOTAL },
-    { "PROPPATCH",      0,              CYRUS_HTTP_PROPPATCH_TOTAL },
-    { "PUT",            0,              CYRUS_HTTP_PUT_TOTAL },
-    { "REPORT",         0,              CYRUS_HTTP_REPORT_TOTAL },
-    { "TRACE",          METH_NOBODY,    CYRUS_HTTP_TRACE_TOTAL },
-    { "UNBIND",         0,              CYRUS_HTTP_UNBIND_TOTAL },
-    { "UNLOCK",         METH_NOBODY,    CYRUS_HTTP_UNLOCK_TOTAL },
-    { NULL,             0,              0 }
+    { "ACL",            0,              CYRUS_HTTP_ACL_TOTAL,         CYRUS_HTTP_REQUEST_SECONDS_METHOD_ACL },
+    { "BIND",           0,              CYRUS_HTTP_BIND_TOTAL,        CYRUS_HTTP_REQUEST_SECONDS_METHOD_BIND },
+    { "CONNECT",        METH_NOBODY,    CYRUS_HTTP_CONNECT_TOTAL,     CYRUS_HTTP_REQUEST_SECONDS_METHOD_CONNECT },
+    { "COPY",           METH_NOBODY,    CYRUS_HTTP_COPY_TOTAL,        CYRUS_HTTP_REQUEST_SECONDS_METHOD_COPY },
+    { "DELETE",         METH_NOBODY,    CYRUS_HTTP_DELETE_TOTAL,      CYRUS_HTTP_REQUEST_SECONDS_METHOD_DELETE },
+    { "GET",            METH_NOBODY,    CYRUS_HTTP_GET_TOTAL,         CYRUS_HTTP_REQUEST_SECONDS_METHOD_GET },
+    { "HEAD",           METH_NOBODY,    CYRUS_HTTP_HEAD_TOTAL,        CYRUS_HTTP_REQUEST_SECONDS_METHOD_HEAD },
+    { "LOCK",           0,              CYRUS_HTTP_LOCK_TOTAL,        CYRUS_HTTP_REQUEST_SECONDS_METHOD_LOCK },
+    { "MKCALENDAR",     0,              CYRUS_HTTP_MKCALENDAR_TOTAL,  CYRUS_HTTP_REQUEST_SECONDS_METHOD_MKCALENDAR },
+    { "MKCOL",          0,              CYRUS_HTTP_MKCOL_TOTAL,       CYRUS_HTTP_REQUEST_SECONDS_METHOD_MKCOL },
+    { "MOVE",           METH_NOBODY,    CYRUS_HTTP_MOVE_TOTAL,        CYRUS_HTTP_REQUEST_SECONDS_METHOD_MOVE },
+    { "OPTIONS",        METH_NOBODY,    CYRUS_HTTP_OPTIONS_TOTAL,     CYRUS_HTTP_REQUEST_SECONDS_METHOD_OPTIONS },
+    { "PATCH",          0,              CYRUS_HTTP_PATCH_TOTAL,       CYRUS_HTTP_REQUEST_SECONDS_METHOD_PATCH },
+    { "POST",           0,              CYRUS_HTTP_POST_TOTAL,        CYRUS_HTTP_REQUEST_SECONDS_METHOD_POST },
+    { "PROPFIND",       0,              CYRUS_HTTP_PROPFIND_TOTAL,    CYRUS_HTTP_REQUEST_SECONDS_METHOD_PROPFIND },
+    { "PROPPATCH",      0,              CYRUS_HTTP_PROPPATCH_TOTAL,   CYRUS_HTTP_REQUEST_SECONDS_METHOD_PROPPATCH },
+    { "PUT",            0,              CYRUS_HTTP_PUT_TOTAL,         CYRUS_HTTP_REQUEST_SECONDS_METHOD_PUT },
+    { "REPORT",         0,              CYRUS_HTTP_REPORT_TOTAL,      CYRUS_HTTP_REQUEST_SECONDS_METHOD_REPORT },
+    { "TRACE",          METH_NOBODY,    CYRUS_HTTP_TRACE_TOTAL,       CYRUS_HTTP_REQUEST_SECONDS_METHOD_TRACE },
+    { "UNBIND",         0,              CYRUS_HTTP_UNBIND_TOTAL,      CYRUS_HTTP_REQUEST_SECONDS_METHOD_UNBIND },
+    { "UNLOCK",         METH_NOBODY,    CYRUS_HTTP_UNLOCK_TOTAL,      CYRUS_HTTP_REQUEST_SECONDS_METHOD_UNLOCK },
+    { NULL,             0,              0,                            0 }
 };
 
 /* WebSocket handler */
@@ -559,7 +766,7 @@ static void httpd_reset(struct http_connection *conn)
 
     conn->clienthost = "[local]";
     if (httpd_logfd != -1) {
-        close(httpd_logfd);
+        telemetry_close(httpd_logfd);
         httpd_logfd = -1;
     }
     if (httpd_authid != NULL) {
@@ -918,6 +1125,7 @@ void shut_down(int code)
         i++;
     }
     if (backend_cached) free(backend_cached);
+    mbcache_done();
 
     annotatemore_close();
 
@@ -1644,11 +1852,19 @@ static int http1_input(struct transaction_t *txn)
     if (!ret) {
         const struct method_t *meth_t =
             &txn->req_tgt.namespace->methods[txn->meth];
-        
+        struct timeval start, end;
+
+        gettimeofday(&start, NULL);
         ret = (*meth_t->proc)(txn, meth_t->params);
+        gettimeofday(&end, NULL);
 
         prometheus_increment(prometheus_lookup_label(http_methods[txn->meth].metric,
                                                      txn->req_tgt.namespace->name));
+        prometheus_observe(http_methods[txn->meth].seconds,
+                           timesub(&start, &end));
+
+        quota_flush_deferred(/*all*/0);
+        mboxevent_flush();
     }
 
     if (ret == HTTP_UNAUTHORIZED) {
@@ -3011,18 +3227,33 @@ EXPORTED void write_body(long code, struct transaction_t *txn,
     /* Compress data */
     if (txn->resp_body.enc || txn->flags.te & ~TE_CHUNKED) {
         unsigned flags = 0;
+        struct buf key = BUF_INITIALIZER;
+        int cached = 0;
 
         if (code) flags |= COMPRESS_START;
         if (last_chunk) flags |= COMPRESS_END;
 
-        if ((txn->resp_body.enc == CE_BR) &&
-            brotli_compress(txn, flags, buf, len) < 0) {
-            fatal("Brotli: Error while compressing data", EC_SOFTWARE);
+        /* static content may already have been compressed */
+        if (code && last_chunk && compcache_key(txn, &key))
+            cached = compcache_fetch(buf_cstring(&key), &txn->zbuf);
+
+        if (cached) {
+            syslog(LOG_DEBUG, "write_body: cached compressed body (%zu)",
+                   buf_len(&txn->zbuf));
+        }
+        else if (txn->resp_body.enc == CE_BR) {
+            if (brotli_compress(txn, flags, buf, len) < 0)
+                fatal("Brotli: Error while compressing data", EC_SOFTWARE);
         }
         else if (zlib_compress(txn, flags, buf, len) < 0) {
             fatal("zlib: Error while compressing data", EC_SOFTWARE);
         }
 
+        /* HEAD requests may not have the data to compress */
+        if (!cached && buf_len(&key) && buf && txn->meth == METH_GET)
+            compcache_store(buf_cstring(&key), txn->zbuf.s, txn->zbuf.len);
+        buf_free(&key);
+
         buf = txn->zbuf.s;
         outlen = txn->zbuf.len;
     }
@@ -3216,8 +3447,13 @@ EXPORTED void xml_partial_response(struct transaction_t *txn,
         eol = "";
     }
 
-    /* Start with clean buffer */
-    if (!*buf) *buf = xmlBufferCreate();
+    /* Start with clean buffer, sized for a flush's worth of responses.
+       Grow it geometrically; the default exact allocation reallocs on
+       nearly every append */
+    if (!*buf) {
+        *buf = xmlBufferCreateSize(2 * PROT_BUFSIZE);
+        xmlBufferSetAllocationScheme(*buf, XML_BUFFER_ALLOC_DOUBLEIT);
+    }
 
     if (node) {
         /* Add leading indent to buffer */
@@ -3493,13 +3729,16 @@ static int auth_success(struct transaction_t *txn, const char *userid)
 
     if (httpd_logfd != -1) {
         /* Rewind log to current request and truncate it */
-        off_t end = lseek(httpd_logfd, 0, SEEK_END);
+        off_t end;
+
+        logring_sync(httpd_logfd);
+        end = lseek(httpd_logfd, 0, SEEK_END);
 
         if (ftruncate(httpd_logfd, end - buf_len(&txn->buf)))
             syslog(LOG_ERR, "IOERROR: failed to truncate http log");
 
         /* Close existing telemetry log */
-        close(httpd_logfd);
+        telemetry_close(httpd_logfd);
     }
 
     prot_setlog(httpd_in, PROT_NO_FD);
@@ -3510,7 +3749,8 @@ static int auth_success(struct transaction_t *txn, const char *userid)
 
     if (httpd_logfd != -1) {
         /* Log credential-redacted request */
-        if (write(httpd_logfd, buf_cstring(&txn->buf), buf_len(&txn->buf)) < 0)
+        if (logring_write(httpd_logfd,
+                          buf_cstring(&txn->buf), buf_len(&txn->buf)) < 0)
             syslog(LOG_ERR, "IOERROR: failed to write to http log");
     }
 
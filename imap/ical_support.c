@@ -49,8 +49,10 @@
 
 #include "caldav_db.h"
 #include "global.h"
+#include "hash.h"
 #include "ical_support.h"
 #include "message.h"
+#include "prometheus.h"
 #include "strhash.h"
 #include "util.h"
 
@@ -501,31 +503,168 @@ EXPORTED struct buf *my_icalcomponent_as_ical_string(icalcomponent* comp)
     return ret;
 }
 
+/* Per-process LRU of parsed resources, keyed by mailbox uniqueid and
+   uid.  The message GUID is kept to detect a reused key, and the size
+   accounted is that of the iCalendar source text. */
+struct icalcache_entry {
+    char *key;
+    struct message_guid guid;
+    icalcomponent *ical;
+    char *schedule_userid;
+    size_t size;
+    struct icalcache_entry *prev, *next;    /* prev is more recent */
+};
+
+static struct {
+    hash_table table;
+    struct icalcache_entry *head, *tail;
+    size_t size;
+} icalcache = { HASH_TABLE_INITIALIZER, NULL, NULL, 0 };
+
+#define ICALCACHE_BUCKETS 1024
+
+static void icalcache_unlink(struct icalcache_entry *entry)
+{
+    if (entry->prev) entry->prev->next = entry->next;
+    else icalcache.head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else icalcache.tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void icalcache_push(struct icalcache_entry *entry)
+{
+    entry->next = icalcache.head;
+    if (icalcache.head) icalcache.head->prev = entry;
+    else icalcache.tail = entry;
+    icalcache.head = entry;
+}
+
+static void icalcache_drop(struct icalcache_entry *entry)
+{
+    icalcache_unlink(entry);
+    hash_del(entry->key, &icalcache.table);
+    icalcache.size -= entry->size;
+
+    icalcomponent_free(entry->ical);
+    free(entry->schedule_userid);
+    free(entry->key);
+    free(entry);
+}
+
+static struct icalcache_entry *icalcache_lookup(const char *key,
+                                                const struct message_guid *guid)
+{
+    struct icalcache_entry *entry;
+
+    if (!icalcache.table.size) return NULL;
+
+    entry = hash_lookup(key, &icalcache.table);
+    if (entry && !message_guid_equal(&entry->guid, guid)) {
+        /* uid reused in a recreated mailbox, or similar */
+        icalcache_drop(entry);
+        entry = NULL;
+    }
+
+    if (entry) {
+        /* move to the front */
+        icalcache_unlink(entry);
+        icalcache_push(entry);
+    }
+
+    return entry;
+}
+
+static void icalcache_store(const char *key, const struct message_guid *guid,
+                            icalcomponent *ical, const char *schedule_userid,
+                            size_t size)
+{
+    size_t max = (size_t) config_getint(IMAPOPT_ICAL_CACHE_SIZE) * 1024;
+    struct icalcache_entry *entry;
+
+    if (size > max) return;
+
+    if (!icalcache.table.size) {
+        construct_hash_table(&icalcache.table, ICALCACHE_BUCKETS, 0);
+    }
+
+    while (icalcache.tail && icalcache.size + size > max) {
+        icalcache_drop(icalcache.tail);
+    }
+
+    entry = xzmalloc(sizeof(struct icalcache_entry));
+    entry->key = xstrdup(key);
+    message_guid_copy(&entry->guid, guid);
+    entry->ical = icalcomponent_new_clone(ical);
+    entry->schedule_userid = xstrdupnull(schedule_userid);
+    entry->size = size;
+
+    hash_insert(key, entry, &icalcache.table);
+    icalcache_push(entry);
+    icalcache.size += size;
+}
+
 EXPORTED icalcomponent *record_to_ical(struct mailbox *mailbox,
                               const struct index_record *record,
                               char **schedule_userid)
 {
     icalcomponent *ical = NULL;
+    struct icalcache_entry *entry = NULL;
+    struct buf key = BUF_INITIALIZER;
+    int usecache = config_getint(IMAPOPT_ICAL_CACHE_SIZE) > 0 &&
+        mailbox->uniqueid;
+
+    if (usecache) {
+        buf_printf(&key, "%s/%u", mailbox->uniqueid, record->uid);
+        entry = icalcache_lookup(buf_cstring(&key), &record->guid);
+
+        if (entry) {
+            prometheus_increment(CYRUS_ICAL_CACHE_TOTAL_RESULT_HIT);
+
+            /* callers modify what they get back */
+            ical = icalcomponent_new_clone(entry->ical);
+            if (schedule_userid && entry->schedule_userid) {
+                *schedule_userid = xstrdup(entry->schedule_userid);
+            }
+            buf_free(&key);
+            return ical;
+        }
+
+        prometheus_increment(CYRUS_ICAL_CACHE_TOTAL_RESULT_MISS);
+    }
+
     message_t *m = message_new_from_record(mailbox, record);
     struct buf buf = BUF_INITIALIZER;
+    char *sched_addr = NULL;
+    size_t size = 0;
 
     /* Load message containing the resource and parse iCal data */
     if (!message_get_field(m, "rawbody", MESSAGE_RAW, &buf)) {
         ical = icalparser_parse_string(buf_cstring(&buf));
+        size = buf_len(&buf);
     }
 
     /* extract the schedule user header */
-    if (schedule_userid) {
+    if (schedule_userid || (usecache && ical)) {
         buf_reset(&buf);
         if (!message_get_field(m, "x-schedule-user-address",
                                MESSAGE_DECODED|MESSAGE_TRIM, &buf)) {
             if (buf.len) {
                 buf_replace_all(&buf, "mailto:", "");
-                *schedule_userid = buf_release(&buf);
+                sched_addr = buf_release(&buf);
             }
         }
     }
 
+    if (usecache && ical) {
+        icalcache_store(buf_cstring(&key), &record->guid,
+                        ical, sched_addr, size);
+    }
+
+    if (schedule_userid && sched_addr) *schedule_userid = sched_addr;
+    else free(sched_addr);
+
+    buf_free(&key);
     buf_free(&buf);
     message_unref(&m);
     return ical;
@@ -53,6 +53,9 @@
 #include <signal.h>
 #include <string.h>
 #include <errno.h>
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
 
 #include "assert.h"
 #include "idle.h"
@@ -68,6 +71,14 @@ static struct sockaddr_un idle_remote;
 /* true if we've successfully told the idled
  * that we want to be notified of changes */
 static int idle_started;
+static char idle_mboxname[MAX_MAILBOX_BUFFER];
+
+/* state of handing the client connection to idled */
+static enum {
+    OFFLOAD_NONE = 0,
+    OFFLOAD_PENDING,    /* fd sent, idled hasn't acknowledged it yet */
+    OFFLOAD_ACTIVE      /* idled watches the fd for us */
+} idle_offload;
 
 /* Send the message 'which' about the mailbox 'mboxname' to the idled.
  * Returns 0 on success or an IMAP error code on failure */
@@ -173,13 +184,48 @@ EXPORTED void idle_start(const char *mboxname)
         return;
     }
 
+    xstrncpy(idle_mboxname, mboxname, sizeof(idle_mboxname));
     idle_started = 1;
 }
 
+/* Hand a copy of the client connection to idled, which will tell us
+ * when there is input on it.  Until idled acknowledges it, we keep
+ * watching the connection ourselves. */
+static void idle_offload_start(int otherfd)
+{
+    idle_message_t msg;
+    int r;
+
+    msg.which = IDLE_MSG_OFFLOAD;
+    xstrncpy(msg.mboxname, idle_mboxname, sizeof(msg.mboxname));
+
+    r = idle_send_fd(&idle_remote, &msg, otherfd);
+    if (r) {
+        syslog(LOG_ERR, "IDLE: error sending message "
+                        "OFFLOAD to idled for mailbox %s: %s.",
+                        idle_mboxname, error_message(r));
+        return;
+    }
+
+    idle_offload = OFFLOAD_PENDING;
+}
+
+/* Is there input on @fd right now? */
+static int idle_input_pending(int fd)
+{
+    fd_set rfds;
+    struct timeval timeout = { 0, 0 };
+
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+
+    return (select(fd+1, &rfds, NULL, NULL, &timeout) > 0);
+}
+
 EXPORTED int idle_wait(int otherfd)
 {
     fd_set rfds;
-    int maxfd = -1;
+    int maxfd;
     int s = -1;
     struct timeval timeout;
     int r;
@@ -188,32 +234,38 @@ EXPORTED int idle_wait(int otherfd)
 
     if (!idle_enabled()) return 0;
 
-    /* If idled was not contacted, we still listen on the socket,
-     * because we might get ALERTs, but we won't get mailbox
-     * notifications.  The poll timeout controls how quickly
-     * we will notice new mail arriving. */
-
-    FD_ZERO(&rfds);
-    s = idle_get_sock();
-    if (s >= 0) {
-        FD_SET(s, &rfds);
-        maxfd = MAX(maxfd, s);
+    if (idle_started && otherfd >= 0 && idle_offload == OFFLOAD_NONE &&
+        config_getswitch(IMAPOPT_IMAPIDLEOFFLOAD)) {
+        idle_offload_start(otherfd);
     }
-    if (otherfd >= 0) {
-        FD_SET(otherfd, &rfds);
-        maxfd = MAX(maxfd, otherfd);
-    }
-
-    /* Note: it's technically valid for there to be no fds to listen
-     * to, in the case where @otherfd is passed as -1 and we failed
-     * to talk to idled.  It shouldn't happen though as we're always
-     * called with a valid otherfd.  */
 
     /* maximum possible timeout before we double-check anyway */
     timeout.tv_sec = idle_timeout;
     timeout.tv_usec = 0;
 
     do {
+        /* If idled was not contacted, we still listen on the socket,
+         * because we might get ALERTs, but we won't get mailbox
+         * notifications.  The poll timeout controls how quickly
+         * we will notice new mail arriving. */
+
+        FD_ZERO(&rfds);
+        maxfd = -1;
+        s = idle_get_sock();
+        if (s >= 0) {
+            FD_SET(s, &rfds);
+            maxfd = MAX(maxfd, s);
+        }
+        if (otherfd >= 0 && idle_offload != OFFLOAD_ACTIVE) {
+            FD_SET(otherfd, &rfds);
+            maxfd = MAX(maxfd, otherfd);
+        }
+
+        /* Note: it's technically valid for there to be no fds to listen
+         * to, in the case where @otherfd is passed as -1 and we failed
+         * to talk to idled.  It shouldn't happen though as we're always
+         * called with a valid otherfd.  */
+
         r = signals_select(maxfd+1, &rfds, NULL, NULL, &timeout);
 
         if (r < 0) {
@@ -224,6 +276,10 @@ EXPORTED int idle_wait(int otherfd)
         if (r == 0) {
             /* timeout */
             flags |= IDLE_MAILBOX|IDLE_ALERT;
+
+            /* don't depend on idled to notice input, it may have gone */
+            if (idle_offload == OFFLOAD_ACTIVE && idle_input_pending(otherfd))
+                flags |= IDLE_INPUT;
         }
         if (r > 0 && s >= 0 && FD_ISSET(s, &rfds)) {
             struct sockaddr_un from;
@@ -237,6 +293,19 @@ EXPORTED int idle_wait(int otherfd)
                 case IDLE_MSG_ALERT:
                     flags |= IDLE_ALERT;
                     break;
+                case IDLE_MSG_OFFLOAD:
+                    if (idle_offload == OFFLOAD_PENDING) {
+                        idle_offload = OFFLOAD_ACTIVE;
+#ifdef HAVE_MALLOC_TRIM
+                        /* we may be idle for a long time */
+                        malloc_trim(0);
+#endif
+                    }
+                    break;
+                case IDLE_MSG_INPUT:
+                    if (idle_offload == OFFLOAD_ACTIVE)
+                        flags |= IDLE_INPUT;
+                    break;
                 }
             }
         }
@@ -263,6 +332,7 @@ EXPORTED void idle_stop(const char *mboxname)
     }
 
     idle_started = 0;
+    idle_offload = OFFLOAD_NONE;
 }
 
 EXPORTED void idle_done(void)
@@ -47,6 +47,7 @@
 #include <sys/types.h>
 #include <syslog.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <stdlib.h>
 #include <errno.h>
 #ifdef HAVE_UNISTD_H
@@ -54,6 +55,9 @@
 #endif
 #include <signal.h>
 #include <fcntl.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "idlemsg.h"
 #include "global.h"
@@ -61,6 +65,7 @@
 #include "xmalloc.h"
 #include "hash.h"
 #include "exitcodes.h"
+#include "xstrlcpy.h"
 
 extern int optind;
 extern char *optarg;
@@ -72,10 +77,59 @@ static time_t idle_timeout;
 struct ientry {
     struct sockaddr_un remote;
     time_t itime;
+    int fd;                     /* offloaded client connection, or -1 */
     struct ientry *next;
 };
 static struct hash_table itable;
 
+/* notifications for a mailbox are forwarded at most once per window */
+static int notify_window;   /* milliseconds */
+struct nstate {
+    struct timeval sent;    /* when we last forwarded a notification */
+    int pending;            /* changes since then wait for the window */
+};
+static struct hash_table ntable;
+static int npending;
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epollfd = -1;
+
+/* watch an offloaded client connection for input */
+static int watch_input(struct ientry *t, int fd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = t;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        syslog(LOG_ERR, "IDLE: epoll_ctl(ADD): %m");
+        return -1;
+    }
+
+    t->fd = fd;
+    return 0;
+}
+#else
+static int watch_input(struct ientry *t __attribute__((unused)),
+                       int fd __attribute__((unused)))
+{
+    /* can't watch large numbers of connections, let imapd do it */
+    return -1;
+}
+#endif
+
+static void unwatch_input(struct ientry *t)
+{
+    if (t->fd < 0) return;
+
+#ifdef HAVE_SYS_EPOLL_H
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, t->fd, NULL);
+#endif
+    close(t->fd);
+    t->fd = -1;
+}
+
 EXPORTED void fatal(const char *msg, int err)
 {
     if (debugmode) fprintf(stderr, "dying with %s %d\n",msg,err);
@@ -121,17 +175,71 @@ static void remove_ientry(const char *mboxname,
 
             p->next = t->next; /* remove node */
         }
+        unwatch_input(t);
         free(t);
     }
 }
 
 
 
-static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
+/* send a notification to all clients idling on mboxname */
+static void send_notify(const char *mboxname)
+{
+    struct ientry *t, *n;
+    idle_message_t msg;
+    int r;
+
+    msg.which = IDLE_MSG_NOTIFY;
+    strlcpy(msg.mboxname, mboxname, sizeof(msg.mboxname));
+
+    t = (struct ientry *) hash_lookup(mboxname, &itable);
+    for ( ; t ; t = n) {
+        n = t->next;
+        if ((t->itime + idle_timeout) < time(NULL)) {
+            /* This process has been idling for longer than the timeout
+             * period, so it probably died.  Remove it from the list.
+             */
+            if (verbose || debugmode)
+                syslog(LOG_DEBUG, "    TIMEOUT %s\n", idle_id_from_addr(&t->remote));
+
+            remove_ientry(mboxname, &t->remote);
+        }
+        else { /* signal process to update */
+            if (verbose || debugmode)
+                syslog(LOG_DEBUG, "    fwd NOTIFY %s\n", idle_id_from_addr(&t->remote));
+
+            /* forward the notification onto our clients */
+            r = idle_send(&t->remote, &msg);
+            if (r) {
+                /* ENOENT can happen as result of a race between delivering
+                 * messages and shutting down imapd.  It indicates that the
+                 * imapd's socket was unlinked, which means that imapd went
+                 * through it's graceful shutdown path, so don't syslog. */
+                if (r != ENOENT)
+                    syslog(LOG_ERR, "IDLE: error sending message "
+                                    "NOTIFY to imapd %s for mailbox %s: %s, "
+                                    "forgetting.",
+                                    idle_id_from_addr(&t->remote),
+                                    mboxname, error_message(r));
+                if (verbose || debugmode)
+                    syslog(LOG_DEBUG, "    forgetting %s\n", idle_id_from_addr(&t->remote));
+                remove_ientry(mboxname, &t->remote);
+            }
+        }
+    }
+}
+
+static void process_message(struct sockaddr_un *remote, idle_message_t *msg,
+                            int fd)
 {
     struct ientry *t, *n;
     int r;
 
+    if (fd >= 0 && msg->which != IDLE_MSG_OFFLOAD) {
+        close(fd);
+        fd = -1;
+    }
+
     switch (msg->which) {
     case IDLE_MSG_INIT:
         if (verbose || debugmode)
@@ -143,6 +251,7 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
         n = (struct ientry *) xzmalloc(sizeof(struct ientry));
         n->remote = *remote;
         n->itime = time(NULL);
+        n->fd = -1;
         n->next = t;
         hash_insert(msg->mboxname, n, &itable);
         break;
@@ -151,42 +260,29 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
         if (verbose || debugmode)
             syslog(LOG_DEBUG, "IDLE_MSG_NOTIFY '%s'\n", msg->mboxname);
 
-        /* send a message to all clients idling on mboxname */
-        t = (struct ientry *) hash_lookup(msg->mboxname, &itable);
-        for ( ; t ; t = n) {
-            n = t->next;
-            if ((t->itime + idle_timeout) < time(NULL)) {
-                /* This process has been idling for longer than the timeout
-                 * period, so it probably died.  Remove it from the list.
-                 */
-                if (verbose || debugmode)
-                    syslog(LOG_DEBUG, "    TIMEOUT %s\n", idle_id_from_addr(&t->remote));
+        /* nobody to tell? */
+        if (!hash_lookup(msg->mboxname, &itable)) break;
 
-                remove_ientry(msg->mboxname, &t->remote);
+        if (notify_window > 0) {
+            struct nstate *ns = hash_lookup(msg->mboxname, &ntable);
+            struct timeval now;
+
+            gettimeofday(&now, NULL);
+            if (!ns) {
+                ns = xzmalloc(sizeof(struct nstate));
+                hash_insert(msg->mboxname, ns, &ntable);
             }
-            else { /* signal process to update */
-                if (verbose || debugmode)
-                    syslog(LOG_DEBUG, "    fwd NOTIFY %s\n", idle_id_from_addr(&t->remote));
-
-                /* forward the received msg onto our clients */
-                r = idle_send(&t->remote, msg);
-                if (r) {
-                    /* ENOENT can happen as result of a race between delivering
-                     * messages and shutting down imapd.  It indicates that the
-                     * imapd's socket was unlinked, which means that imapd went
-                     * through it's graceful shutdown path, so don't syslog. */
-                    if (r != ENOENT)
-                        syslog(LOG_ERR, "IDLE: error sending message "
-                                        "NOTIFY to imapd %s for mailbox %s: %s, "
-                                        "forgetting.",
-                                        idle_id_from_addr(&t->remote),
-                                        msg->mboxname, error_message(r));
-                    if (verbose || debugmode)
-                        syslog(LOG_DEBUG, "    forgetting %s\n", idle_id_from_addr(&t->remote));
-                    remove_ientry(msg->mboxname, &t->remote);
-                }
+            else if (timesub(&ns->sent, &now) * 1000 < notify_window) {
+                /* told them recently, tell them again when the window
+                 * closes, however many more changes arrive until then */
+                if (!ns->pending) npending++;
+                ns->pending = 1;
+                break;
             }
+            ns->sent = now;
         }
+
+        send_notify(msg->mboxname);
         break;
 
     case IDLE_MSG_DONE:
@@ -198,6 +294,27 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
         remove_ientry(msg->mboxname, remote);
         break;
 
+    case IDLE_MSG_OFFLOAD:
+        if (verbose || debugmode)
+            syslog(LOG_DEBUG, "imapd[%s]: IDLE_MSG_OFFLOAD '%s'\n",
+                   idle_id_from_addr(remote), msg->mboxname);
+
+        if (fd < 0) break;
+
+        /* find the client's ientry, it owns the descriptor from now on */
+        t = (struct ientry *) hash_lookup(msg->mboxname, &itable);
+        while (t && memcmp(&t->remote, remote, sizeof(*remote)))
+            t = t->next;
+        if (!t || t->fd >= 0 || watch_input(t, fd)) {
+            close(fd);
+            break;
+        }
+
+        /* acknowledge, so imapd stops watching the connection itself */
+        r = idle_send(remote, msg);
+        if (r) remove_ientry(msg->mboxname, remote);
+        break;
+
     case IDLE_MSG_NOOP:
         break;
 
@@ -208,6 +325,80 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
 }
 
 
+/* flush coalesced notifications whose window has closed, and forget
+ * mailboxes which have been quiet for a whole window */
+static void flush_notify(const char *mboxname, void *data, void *rock)
+{
+    struct nstate *ns = (struct nstate *) data;
+    strarray_t *expired = (strarray_t *) rock;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    if (timesub(&ns->sent, &now) * 1000 < notify_window) return;
+
+    if (ns->pending) {
+        ns->pending = 0;
+        npending--;
+        ns->sent = now;
+        send_notify(mboxname);
+    }
+    else {
+        strarray_append(expired, mboxname);
+    }
+}
+
+static void flush_pending(void)
+{
+    static struct timeval last;
+    strarray_t expired = STRARRAY_INITIALIZER;
+    struct timeval now;
+    int i;
+
+    if (notify_window <= 0) return;
+
+    /* sweep at most once per window (or second) */
+    gettimeofday(&now, NULL);
+    if (timesub(&last, &now) * 1000 < MIN(notify_window, 1000)) return;
+    last = now;
+
+    hash_enumerate(&ntable, flush_notify, &expired);
+
+    for (i = 0; i < strarray_size(&expired); i++)
+        free(hash_del(strarray_nth(&expired, i), &ntable));
+    strarray_fini(&expired);
+}
+
+/* poll timeout in milliseconds */
+static int next_timeout(void)
+{
+    return (npending && notify_window < 1000) ? notify_window : 1000;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* an offloaded client connection became readable (or was closed) */
+static void process_input(struct ientry *t)
+{
+    idle_message_t msg;
+    int r;
+
+    if (verbose || debugmode)
+        syslog(LOG_DEBUG, "    INPUT %s\n", idle_id_from_addr(&t->remote));
+
+    /* hand the connection back: imapd still has its own descriptor */
+    unwatch_input(t);
+
+    msg.which = IDLE_MSG_INPUT;
+    strncpy(msg.mboxname, ".", sizeof(msg.mboxname));
+
+    r = idle_send(&t->remote, &msg);
+    if (r && r != ENOENT) {
+        syslog(LOG_ERR, "IDLE: error sending message "
+                        "INPUT to imapd %s: %s",
+                        idle_id_from_addr(&t->remote), error_message(r));
+    }
+}
+#endif
+
 static void send_alert(const char *key,
                        void *data,
                        void *rock __attribute__((unused)))
@@ -263,9 +454,13 @@ int main(int argc, char **argv)
     int nmbox = 0;
     int s;
     struct sockaddr_un local;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev, events[64];
+#else
     fd_set read_set, rset;
     int nfds;
     struct timeval timeout;
+#endif
     pid_t pid;
     char *alt_config = NULL;
 
@@ -294,6 +489,8 @@ int main(int argc, char **argv)
     if (idle_timeout < 30) idle_timeout = 30;
     idle_timeout *= 60;
 
+    notify_window = config_getint(IMAPOPT_IDLENOTIFYWINDOW);
+
     /* count the number of mailboxes */
     mboxlist_allmbox("", &mbox_count_cb, &nmbox, /*flags*/0);
 
@@ -302,6 +499,7 @@ int main(int argc, char **argv)
 
     /* create idle table -- +1 to avoid a zero value */
     construct_hash_table(&itable, nmbox + 1, 1);
+    construct_hash_table(&ntable, 1024, 0);
 
     if (!idle_make_server_address(&local) ||
         !idle_init_sock(&local)) {
@@ -327,10 +525,22 @@ int main(int argc, char **argv)
     /* child */
 
 
+#ifdef HAVE_SYS_EPOLL_H
+    /* our socket plus any offloaded client connections */
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0) fatal("epoll_create1 failed", EC_TEMPFAIL);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, s, &ev) < 0)
+        fatal("epoll_ctl failed", EC_TEMPFAIL);
+#else
     /* get ready for select() */
     FD_ZERO(&read_set);
     FD_SET(s, &read_set);
     nfds = s + 1;
+#endif
 
     for (;;) {
         int n;
@@ -351,9 +561,39 @@ int main(int argc, char **argv)
             shut_down(1);
         }
 
-        /* timeout for select is 1 second */
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
+#ifdef HAVE_SYS_EPOLL_H
+        /* timeout for epoll is 1 second */
+        n = epoll_wait(epollfd, events, 64, next_timeout());
+        if (n < 0 && errno == EINTR) continue;
+        if (n == -1) {
+            /* uh oh */
+            syslog(LOG_ERR, "epoll_wait(): %m");
+            close(s);
+            fatal("epoll error",-1);
+        }
+
+        /* client input first: processing a message may free ientries */
+        int i, have_msg = 0;
+        for (i = 0; i < n; i++) {
+            struct ientry *t = events[i].data.ptr;
+
+            if (!t) have_msg = 1;
+            else if (t->fd >= 0) process_input(t);
+        }
+
+        /* read and process a message */
+        if (have_msg) {
+            struct sockaddr_un from;
+            idle_message_t msg;
+            int fd;
+
+            if (idle_recv_fd(&from, &msg, &fd))
+                process_message(&from, &msg, fd);
+        }
+#else
+        /* timeout for select is 1 second, or less if notifications wait */
+        timeout.tv_sec = next_timeout() / 1000;
+        timeout.tv_usec = (next_timeout() % 1000) * 1000;
 
         /* check for the next input */
         rset = read_set;
@@ -371,11 +611,15 @@ int main(int argc, char **argv)
         if (FD_ISSET(s, &rset)) {
             struct sockaddr_un from;
             idle_message_t msg;
+            int fd;
 
-            if (idle_recv(&from, &msg))
-                process_message(&from, &msg);
+            if (idle_recv_fd(&from, &msg, &fd))
+                process_message(&from, &msg, fd);
         }
+#endif
 
+        /* send coalesced notifications that are due */
+        flush_pending();
     }
 
     /* NOTREACHED */
@@ -184,31 +184,109 @@ EXPORTED int idle_send(const struct sockaddr_un *remote,
     return 0;
 }
 
-EXPORTED int idle_recv(struct sockaddr_un *remote, idle_message_t *msg)
+EXPORTED int idle_send_fd(const struct sockaddr_un *remote,
+                          const idle_message_t *msg, int fd)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    union {
+        struct cmsghdr cm;
+        char control[CMSG_SPACE(sizeof(int))];
+    } cmsgu;
+    struct cmsghdr *cmsg;
+    int flags = 0;
+
+#ifdef MSG_DONTWAIT
+    flags |= MSG_DONTWAIT;
+#endif
+
+    if (idle_sock < 0)
+        return IMAP_SERVER_UNAVAILABLE;
+
+    iov.iov_base = (void *) msg;
+    iov.iov_len = IDLE_MESSAGE_BASE_SIZE+strlen(msg->mboxname)+1;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = (void *) remote;
+    mh.msg_namelen = sizeof(*remote);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cmsgu.control;
+    mh.msg_controllen = sizeof(cmsgu.control);
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(idle_sock, &mh, flags) == -1)
+        return errno;
+
+    return 0;
+}
+
+EXPORTED int idle_recv_fd(struct sockaddr_un *remote, idle_message_t *msg,
+                          int *fdp)
 {
-    socklen_t remote_len = sizeof(*remote);
+    struct msghdr mh;
+    struct iovec iov;
+    union {
+        struct cmsghdr cm;
+        char control[CMSG_SPACE(sizeof(int))];
+    } cmsgu;
+    struct cmsghdr *cmsg;
+    int fd = -1;
     int n;
 
+    if (fdp) *fdp = -1;
+
     if (idle_sock < 0)
         return 0;
 
-    memset(remote, 0, remote_len);
+    memset(remote, 0, sizeof(*remote));
     memset(msg, 0, sizeof(idle_message_t));
 
-    n = recvfrom(idle_sock, (void *) msg, sizeof(idle_message_t), 0,
-                 (struct sockaddr *) remote, &remote_len);
+    iov.iov_base = (void *) msg;
+    iov.iov_len = sizeof(idle_message_t);
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = remote;
+    mh.msg_namelen = sizeof(*remote);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cmsgu.control;
+    mh.msg_controllen = sizeof(cmsgu.control);
+
+    n = recvmsg(idle_sock, &mh, 0);
 
     if (n < 0) {
-        syslog(LOG_ERR, "IDLE: recvfrom failed: %m");
+        syslog(LOG_ERR, "IDLE: recvmsg failed: %m");
         return 0;
     }
 
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
     if (n <= IDLE_MESSAGE_BASE_SIZE ||
         msg->mboxname[n - 1 - IDLE_MESSAGE_BASE_SIZE] != '\0') {
         syslog(LOG_ERR, "IDLE: invalid message received: size=%d", n);
+        if (fd >= 0) close(fd);
         return 0;
     }
 
+    /* don't leak descriptors that nobody asked for */
+    if (fdp) *fdp = fd;
+    else if (fd >= 0) close(fd);
+
     return 1;
 }
 
+EXPORTED int idle_recv(struct sockaddr_un *remote, idle_message_t *msg)
+{
+    return idle_recv_fd(remote, msg, NULL);
+}
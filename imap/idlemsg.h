@@ -68,7 +68,10 @@ enum {
     IDLE_MSG_DONE,
     IDLE_MSG_NOTIFY,
     IDLE_MSG_NOOP,
-    IDLE_MSG_ALERT
+    IDLE_MSG_ALERT,
+    IDLE_MSG_OFFLOAD,   /* imapd->idled: watch the attached client fd;
+                           idled->imapd: the fd is being watched */
+    IDLE_MSG_INPUT      /* idled->imapd: input is pending on the client fd */
 };
 
 int idle_make_server_address(struct sockaddr_un *);
@@ -80,6 +83,10 @@ int idle_get_sock(void);
 int idle_send(const struct sockaddr_un *remote,
               const idle_message_t *msg);
 int idle_recv(struct sockaddr_un *remote, idle_message_t *msg);
+/* as above, passing a file descriptor along with the message */
+int idle_send_fd(const struct sockaddr_un *remote,
+                 const idle_message_t *msg, int fd);
+int idle_recv_fd(struct sockaddr_un *remote, idle_message_t *msg, int *fdp);
 
 
 #endif
@@ -92,6 +92,7 @@ struct protocol_t imap_protocol =
         { { "AUTH", CAPA_AUTH },
           { "STARTTLS", CAPA_STARTTLS },
           { "COMPRESS=DEFLATE", CAPA_COMPRESS },
+          { "COMPRESS=ZSTD", CAPA_COMPRESS_ZSTD },
           { "IDLE", CAPA_IDLE },
           { "MUPDATE", CAPA_MUPDATE },
           { "MULTIAPPEND", CAPA_MULTIAPPEND },
@@ -106,7 +107,9 @@ struct protocol_t imap_protocol =
         NULL, AUTO_CAPA_AUTH_OK },
       { "Z01 COMPRESS DEFLATE", "* ", "Z01 OK" },
       { "N01 NOOP", "* ", "N01 OK" },
-      { "Q01 LOGOUT", "* ", "Q01 " } } }
+      { "Q01 LOGOUT", "* ", "Q01 " },
+      { "Z01 COMPRESS ZSTD", "* ", "Z01 OK" },
+      { "U01 UNAUTHENTICATE", "* ", "U01 OK" } } }
 };
 
 void proxy_gentag(char *tag, size_t len)
@@ -261,6 +264,15 @@ static int pipe_response(struct backend *s, const char *tag, int include_last,
 
             /* copy the literal over */
             if (islit) {
+                if (litlen > 0 && (!last || include_last)) {
+                    if (prot_splice(s->in, imapd_out, litlen) == EOF) {
+                        /* EOF or other error */
+                        return -1;
+                    }
+                    litlen = 0;
+                }
+
+                /* otherwise just swallow it */
                 while (litlen > 0) {
                     int j = (litlen > (int) sizeof(buf) ?
                              (int) sizeof(buf) : litlen);
@@ -270,7 +282,6 @@ static int pipe_response(struct backend *s, const char *tag, int include_last,
                         /* EOF or other error */
                         return -1;
                     }
-                    if (!last || include_last) prot_write(imapd_out, buf, j);
                     litlen -= j;
                 }
 
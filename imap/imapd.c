@@ -61,6 +61,9 @@
 #include <time.h>
 #include <stdbool.h>
 #include <errno.h>
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
 
 #include <sasl/sasl.h>
 
@@ -98,7 +101,9 @@
 #include "mboxkey.h"
 #include "mboxlist.h"
 #include "mboxname.h"
+#include "mbcache.h"
 #include "mbdump.h"
+#include "mpool.h"
 #include "mupdate-client.h"
 #include "partlist.h"
 #include "proc.h"
@@ -213,6 +218,7 @@ struct appendstage {
     time_t internaldate;
     int binary;
     struct entryattlist *annotations;
+    struct body *body;
 };
 static ptrarray_t stages = PTRARRAY_INITIALIZER;
 
@@ -266,6 +272,7 @@ struct list_rock {
     uint32_t last_attributes;
     int last_category;
     hash_table server_table;    /* for proxying */
+    ptrarray_t pending;         /* list_entries waiting for STATUS */
 };
 
 /* Information about one mailbox name that LIST returns */
@@ -430,7 +437,7 @@ static void cmd_genurlauth(char *tag);
 static void cmd_resetkey(char *tag, char *mailbox, char *mechanism);
 #endif
 
-#ifdef HAVE_ZLIB
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
 static void cmd_compress(char *tag, char *alg);
 #endif
 
@@ -504,6 +511,12 @@ extern int saslserver(sasl_conn_t *conn, const char *mech,
                       const char *continuation, const char *empty_resp,
                       struct protstream *pin, struct protstream *pout,
                       int *sasl_result, char **success_data);
+extern int saslcache_checkpass(sasl_conn_t *conn, void *context,
+                               const char *user,
+                               const char *pass, unsigned passlen,
+                               struct propctx *propctx);
+extern void saslcache_reset(void);
+extern void saslcache_commit(sasl_conn_t *conn);
 
 /* Enable the resetting of a sasl_conn_t */
 static int reset_saslconn(sasl_conn_t **conn);
@@ -637,6 +650,7 @@ static const struct sasl_callback mysasl_cb[] = {
     { SASL_CB_PROXY_POLICY, (mysasl_cb_ft *) &imapd_proxy_policy, (void*) &imapd_proxyctx },
     { SASL_CB_CANON_USER, (mysasl_cb_ft *) &imapd_canon_user, (void*) &disable_referrals },
     { SASL_CB_LOG, (mysasl_cb_ft *) &imapd_sasl_log, NULL },
+    { SASL_CB_SERVER_USERDB_CHECKPASS, (mysasl_cb_ft *) &saslcache_checkpass, NULL },
     { SASL_CB_LIST_END, NULL, NULL }
 };
 
@@ -673,7 +687,7 @@ static int mlookup(const char *tag, const char *ext_name,
     int r;
     mbentry_t *mbentry = NULL;
 
-    r = mboxlist_lookup(name, &mbentry, NULL);
+    r = mbcache_lookup(name, &mbentry);
     if ((r == IMAP_MAILBOX_NONEXISTENT || (!r && (mbentry->mbtype & MBTYPE_RESERVE))) &&
         config_mupdate_server) {
         /* It is not currently active, make sure we have the most recent
@@ -779,7 +793,7 @@ static void imapd_reset(void)
 
     imapd_clienthost = "[local]";
     if (imapd_logfd != -1) {
-        close(imapd_logfd);
+        telemetry_close(imapd_logfd);
         imapd_logfd = -1;
     }
     if (imapd_userid != NULL) {
@@ -1068,6 +1082,8 @@ void shut_down(int code)
         i++;
     }
     if (backend_cached) free(backend_cached);
+    backend_pool_flush();
+    mbcache_done();
     if (mupdate_h) mupdate_disconnect(&mupdate_h);
 
     if (idling)
@@ -1152,6 +1168,10 @@ EXPORTED void fatal(const char *s, int code)
             append_removestage(curstage->stage);
             strarray_fini(&curstage->flags);
             freeentryatts(curstage->annotations);
+            if (curstage->body) {
+                message_free_body(curstage->body);
+                free(curstage->body);
+            }
             free(curstage);
         }
         ptrarray_fini(&stages);
@@ -1183,6 +1203,28 @@ static void imapd_check(struct backend *be, int usinguid)
     }
 }
 
+/* waitevent which hibernates a session left waiting between commands */
+static struct prot_waitevent *hibernate_event = NULL;
+
+static struct prot_waitevent *imapd_hibernate(struct protstream *s,
+                                              struct prot_waitevent *ev,
+                                              void *rock __attribute__((unused)))
+{
+    /* nothing is open between commands, and everything below is
+     * reopened on demand by the next command that wants it */
+    annotatemore_close();
+    mbcache_done();
+
+#ifdef HAVE_MALLOC_TRIM
+    malloc_trim(0);
+#endif
+
+    prot_removewaitevent(s, ev);
+    hibernate_event = NULL;
+
+    return NULL;
+}
+
 /*
  * Top-level command loop parsing
  */
@@ -1195,9 +1237,15 @@ static void cmdloop(void)
     const char *err;
     const char * commandmintimer;
     double commandmintimerd = 0.0;
+    struct timeval cmdstart;
     struct sync_reserve_list *reserve_list =
         sync_reserve_list_create(SYNC_MESSAGE_LIST_HASH_SIZE);
     struct applepushserviceargs applepushserviceargs;
+    /* per-command arena for parsed search criteria */
+    struct mpool *cmdpool = new_mpool(0);
+    int hibernate_timeout = config_getint(IMAPOPT_IMAPHIBERNATETIMEOUT);
+
+    search_expr_use_pool(cmdpool);
 
     prot_printf(imapd_out, "* OK [CAPABILITY ");
     capa_response(CAPA_PREAUTH);
@@ -1226,6 +1274,9 @@ static void cmdloop(void)
         /* Release any held index */
         index_release(imapd_index);
 
+        /* and anything the last command allocated from its arena */
+        mpool_reset(cmdpool);
+
         /* ensure we didn't leak anything! */
         assert(!open_mailboxes_exist());
 
@@ -1248,6 +1299,15 @@ static void cmdloop(void)
 
         signals_poll();
 
+        /* hibernate if the client keeps us waiting for the next command */
+        if (hibernate_timeout > 0) {
+            time_t mark = time(NULL) + hibernate_timeout;
+
+            if (hibernate_event) hibernate_event->mark = mark;
+            else hibernate_event = prot_addwaitevent(imapd_in, mark,
+                                                     imapd_hibernate, NULL);
+        }
+
         if (!proxy_check_input(protin, imapd_in, imapd_out,
                                backend_current ? backend_current->in : NULL,
                                NULL, 0)) {
@@ -1257,6 +1317,12 @@ static void cmdloop(void)
 
         /* Parse tag */
         c = getword(imapd_in, &tag);
+
+        /* a command is starting, so it must not fire under it */
+        if (hibernate_event) {
+            prot_removewaitevent(imapd_in, hibernate_event);
+            hibernate_event = NULL;
+        }
         if (c == EOF) {
             if ((err = prot_error(imapd_in))!=NULL
                 && strcmp(err, PROT_EOF_STRING)) {
@@ -1305,6 +1371,7 @@ static void cmdloop(void)
 
         /* Start command timer */
         cmdtime_starttimer();
+        gettimeofday(&cmdstart, NULL);
 
         /* note that about half the commands (the common ones that don't
            hit the mailboxes file) now close the mailboxes file just in
@@ -1362,7 +1429,7 @@ static void cmdloop(void)
                 snmp_increment(CAPABILITY_COUNT, 1);
             }
             else if (!imapd_userid) goto nologin;
-#ifdef HAVE_ZLIB
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
             else if (!strcmp(cmd.s, "Compress")) {
                 if (c != ' ') goto missingargs;
                 c = getword(imapd_in, &arg1);
@@ -1375,7 +1442,7 @@ static void cmdloop(void)
                 prometheus_increment(CYRUS_IMAP_COMPRESS_TOTAL);
                 snmp_increment(COMPRESS_COUNT, 1);
             }
-#endif /* HAVE_ZLIB */
+#endif /* HAVE_ZLIB || HAVE_ZSTD */
             else if (!strcmp(cmd.s, "Check")) {
                 if (!imapd_index && !backend_current) goto nomailbox;
                 if (c == '\r') c = prot_getc(imapd_in);
@@ -2202,7 +2269,7 @@ static void cmdloop(void)
                 }
             }
             else if (!strcmp(cmd.s, "Unauthenticate")) {
-                if (!imapd_userisadmin) goto badcmd;
+                if (!imapd_userisadmin && !imapd_userisproxyadmin) goto badcmd;
 
                 if (c == '\r') c = prot_getc(imapd_in);
                 if (c != '\n') goto extraargs;
@@ -2497,6 +2564,20 @@ static void cmdloop(void)
                     cmdtime, nettime, cmdtime + nettime);
             }
         }
+
+        /* IDLE lasts as long as the client wants, so don't count it */
+        if (strcmp("idle", cmdname)) {
+            struct timeval cmdend;
+
+            gettimeofday(&cmdend, NULL);
+            prometheus_observe_label(CYRUS_IMAP_COMMAND_SECONDS, cmdname,
+                                     timesub(&cmdstart, &cmdend));
+        }
+
+        /* don't sit on quota usage changes while waiting for the client */
+        quota_flush_deferred(/*all*/0);
+        /* nor on event notifications */
+        mboxevent_flush();
         continue;
 
     nologin:
@@ -2549,6 +2630,8 @@ static void cmdloop(void)
 
 done:
     cmd_syncrestart(NULL, &reserve_list, 0);
+    search_expr_use_pool(NULL);
+    free_mpool(cmdpool);
 }
 
 #ifdef USE_AUTOCREATE
@@ -2703,6 +2786,9 @@ static void cmd_login(char *tag, char *user)
 
     passwd = passwdbuf.s;
 
+    /* don't let an earlier attempt's password be cached for this one */
+    saslcache_reset();
+
     if (is_userid_anonymous(canon_user)) {
         if (config_getswitch(IMAPOPT_ALLOWANONYMOUSLOGIN)) {
             passwd = beautify_string(passwd);
@@ -2736,6 +2822,7 @@ static void cmd_login(char *tag, char *user)
                                  strlen(canon_user),
                                  passwd,
                                  strlen(passwd))) != SASL_OK) {
+        saslcache_reset();
         syslog(LOG_NOTICE, "badlogin: %s plaintext %s %s",
                imapd_clienthost, canon_user, sasl_errdetail(imapd_saslconn));
 
@@ -2761,6 +2848,8 @@ static void cmd_login(char *tag, char *user)
         return;
     }
     else {
+        saslcache_commit(imapd_saslconn);
+
         r = sasl_getprop(imapd_saslconn, SASL_USERNAME, &val);
 
         if(r != SASL_OK) {
@@ -3032,7 +3121,7 @@ static void cmd_unauthenticate(char *tag)
     prot_flush(imapd_out);
 
     /* Reset connection state (other than TLS) */
-#ifdef HAVE_ZLIB
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
     if (imapd_compress_done) {
         /* disable (de)compression on the prot layer */
         prot_unsetcompress(imapd_in);
@@ -3500,7 +3589,7 @@ static void capa_response(int flags)
 
     if (!(flags & CAPA_POSTAUTH)) return;
 
-    if (imapd_authstate && imapd_userisadmin) {
+    if (imapd_authstate && (imapd_userisadmin || imapd_userisproxyadmin)) {
         prot_printf(imapd_out, " UNAUTHENTICATE");
     }
 
@@ -3512,6 +3601,11 @@ static void capa_response(int flags)
         prot_printf(imapd_out, " COMPRESS=DEFLATE");
     }
 #endif // HAVE_ZLIB
+#ifdef HAVE_ZSTD
+    if (!imapd_compress_done && !imapd_tls_comp) {
+        prot_printf(imapd_out, " COMPRESS=ZSTD");
+    }
+#endif // HAVE_ZSTD
 
     for (i = 0 ; i < QUOTA_NUMRESOURCES ; i++)
         prot_printf(imapd_out, " X-QUOTA=%s", quota_names[i]);
@@ -4037,7 +4131,12 @@ static void cmd_append(char *tag, char *name, const char *cur_name)
             if (r) goto done;
 
             /* Copy message to stage */
-            r = message_copy_strict(imapd_in, curstage->f, size, curstage->binary);
+            /* binary messages are rewritten when parsed, so their
+             * GUID is only known after that */
+            r = message_copy_strict_guid(imapd_in, curstage->f, size,
+                                         curstage->binary,
+                                         curstage->binary ? NULL :
+                                         append_stageguid(curstage->stage));
         }
         qdiffs[QUOTA_STORAGE] += size;
         /* If this is a non-BINARY message, close the stage file.
@@ -4070,6 +4169,26 @@ static void cmd_append(char *tag, char *name, const char *cur_name)
         }
     }
 
+    /* Parse the stage(s) before taking the mailbox lock, so that a
+     * large MULTIAPPEND doesn't hold it for all the parsing */
+    for (i = 0; !r && i < stages.count; i++) {
+        curstage = stages.data[i];
+        if (curstage->binary) {
+            r = message_parse_binary_file(curstage->f, &curstage->body);
+            fclose(curstage->f);
+            curstage->f = NULL;
+        }
+        else {
+            FILE *f = fopen(append_stagefname(curstage->stage), "r");
+            if (f) {
+                r = message_parse_file_guid(f, NULL, NULL, &curstage->body,
+                                            append_stageguid(curstage->stage));
+                fclose(f);
+            }
+            else r = IMAP_IOERROR;
+        }
+    }
+
     /* Append from the stage(s) */
     if (!r) {
         qdiffs[QUOTA_MESSAGE] = stages.count;
@@ -4080,32 +4199,17 @@ static void cmd_append(char *tag, char *name, const char *cur_name)
                          EVENT_MESSAGE_APPEND);
     }
     if (!r) {
-        struct body *body;
-
         doappenduid = (appendstate.myrights & ACL_READ);
         uidvalidity = append_uidvalidity(&appendstate);
 
+        /* n.b. the message files are only synced, all together,
+         * by append_commit() */
         for (i = 0; !r && i < stages.count ; i++) {
             curstage = stages.data[i];
-            body = NULL;
-            if (curstage->binary) {
-                r = message_parse_binary_file(curstage->f, &body);
-                fclose(curstage->f);
-                curstage->f = NULL;
-            }
-            if (!r) {
-                r = append_fromstage(&appendstate, &body, curstage->stage,
-                                     curstage->internaldate, /*createdmodseq*/0,
-                                     &curstage->flags, 0,
-                                     curstage->annotations);
-            }
-            if (body) {
-                /* Note: either the calls to message_parse_binary_file()
-                 * or append_fromstage() above, may create a body.  */
-                message_free_body(body);
-                free(body);
-                body = NULL;
-            }
+            r = append_fromstage(&appendstate, &curstage->body, curstage->stage,
+                                 curstage->internaldate, /*createdmodseq*/0,
+                                 &curstage->flags, 0,
+                                 curstage->annotations);
         }
 
         if (!r) {
@@ -4154,6 +4258,10 @@ cleanup:
         append_removestage(curstage->stage);
         strarray_fini(&curstage->flags);
         freeentryatts(curstage->annotations);
+        if (curstage->body) {
+            message_free_body(curstage->body);
+            free(curstage->body);
+        }
         free(curstage);
     }
     free(intname);
@@ -7164,6 +7272,7 @@ static void cmd_delete(char *tag, char *name, int localonly, int force)
     int r;
     mbentry_t *mbentry = NULL;
     struct mboxevent *mboxevent = NULL;
+    int lazy = 0;
 
     char *intname = mboxname_from_external(name, &imapd_namespace, imapd_userid);
     r = mlookup(NULL, NULL, intname, &mbentry);
@@ -7217,8 +7326,23 @@ static void cmd_delete(char *tag, char *name, int localonly, int force)
 
     mboxevent = mboxevent_new(EVENT_MAILBOX_DELETE);
 
+    /* a whole user, with the files removed later by cyr_expire? */
+    if (!r && !localonly && config_getswitch(IMAPOPT_USER_DELETE_LAZY) &&
+        !config_mupdate_server &&
+        (imapd_userisadmin || imapd_userisproxyadmin) &&
+        mboxname_isusermailbox(intname, 1)) {
+        char *userid = mboxname_to_userid(intname);
+        if (userid && strcmpsafe(userid, imapd_userid)) {
+            r = user_deletedata_lazy(userid, 1);
+            if (!r) mboxevent_set_access(mboxevent, NULL, NULL,
+                                         imapd_userid, intname, 1);
+            lazy = 1;
+        }
+        free(userid);
+    }
+
     /* local mailbox */
-    if (!r) {
+    if (!r && !lazy) {
         if (localonly || !mboxlist_delayed_delete_isenabled()) {
             r = mboxlist_deletemailbox(intname,
                                        imapd_userisadmin || imapd_userisproxyadmin,
@@ -7245,7 +7369,7 @@ static void cmd_delete(char *tag, char *name, int localonly, int force)
 
     /* was it a top-level user mailbox? */
     /* localonly deletes are only per-mailbox */
-    if (!r && !localonly && mboxname_isusermailbox(intname, 1)) {
+    if (!r && !lazy && !localonly && mboxname_isusermailbox(intname, 1)) {
         char *userid = mboxname_to_userid(intname);
         if (userid) {
             r = mboxlist_usermboxtree(userid, NULL, delmbox, NULL, 0);
@@ -7731,7 +7855,10 @@ submboxes:
 
     /* take care of deleting old ACLs, subscriptions, seen state and quotas */
     if (!r && rename_user) {
-        user_deletedata(olduser, 1);
+        if (config_getswitch(IMAPOPT_USER_DELETE_LAZY))
+            user_deletedata_lazy(olduser, 1);
+        else
+            user_deletedata(olduser, 1);
         /* allow the replica to get the correct new quotaroot
          * and acls copied across */
         sync_log_user(newuser);
@@ -9904,43 +10031,86 @@ static int apply_mailbox_pattern(annotate_state_t *state,
     return r;
 }
 
-static int apply_mailbox_array(annotate_state_t *state,
-                               const strarray_t *mboxes,
-                               int (*proc)(annotate_state_t *, void *),
-                               void *rock)
+/*
+ * Like apply_mailbox_pattern(), but for either a pattern or a list of
+ * mailbox names, and finding all the mailboxes first so that their
+ * annotations can be prefetched in one pass over the annotations db.
+ * Mailboxes found before any error are still applied, so the untagged
+ * output matches the one-by-one case.
+ */
+
+static int collect_cb(struct findall_data *data, void *rock)
 {
-    int i;
-    mbentry_t *mbentry = NULL;
-    char *intname = NULL;
-    int r = 0;
+    if (!data) return 0;
+    ptrarray_t *mbentries = (ptrarray_t *)rock;
+    mbentry_t *mbentry;
 
-    for (i = 0 ; i < mboxes->count ; i++) {
-        intname = mboxname_from_external(strarray_nth(mboxes, i), &imapd_namespace, imapd_userid);
+    /* Suppress any output of a partial match */
+    if (!data->mbname)
+        return 0;
 
-        r = mboxlist_lookup(intname, &mbentry, NULL);
-        if (r)
-            break;
+    mbentry = mboxlist_entry_copy(data->mbentry);
+    free(mbentry->ext_name);
+    mbentry->ext_name = xstrdup(mbname_extname(data->mbname, &imapd_namespace,
+                                               imapd_userid));
+    ptrarray_append(mbentries, mbentry);
 
-        r = annotate_state_set_mailbox_mbe(state, mbentry);
-        if (r)
-            break;
+    return 0;
+}
 
-        r = proc(state, rock);
-        if (r)
-            break;
+static int apply_mailbox_prefetch(annotate_state_t *state,
+                                  const char *pattern,
+                                  const strarray_t *mboxes,
+                                  const strarray_t *entries,
+                                  int (*proc)(annotate_state_t *, void *),
+                                  void *rock)
+{
+    ptrarray_t mbentries = PTRARRAY_INITIALIZER;
+    mbentry_t *mbentry;
+    int i, r = 0, r2;
+
+    if (pattern) {
+        r = mboxlist_findall(&imapd_namespace,
+                             pattern,
+                             imapd_userisadmin || imapd_userisproxyadmin,
+                             imapd_userid,
+                             imapd_authstate,
+                             collect_cb, &mbentries);
+        if (!r && !mbentries.count)
+            r = IMAP_MAILBOX_NONEXISTENT;
+    }
+    else {
+        for (i = 0 ; i < mboxes->count ; i++) {
+            char *intname = mboxname_from_external(strarray_nth(mboxes, i),
+                                                   &imapd_namespace, imapd_userid);
+            mbentry = NULL;
+            r = mboxlist_lookup(intname, &mbentry, NULL);
+            free(intname);
+            if (r)
+                break;
+            ptrarray_append(&mbentries, mbentry);
+        }
+    }
 
-        mboxlist_entry_free(&mbentry);
-        free(intname);
-        intname = NULL;
+    annotatemore_prefetch(&mbentries, entries, imapd_userid);
+
+    for (i = 0 ; i < mbentries.count ; i++) {
+        r2 = annotate_state_set_mailbox_mbe(state, ptrarray_nth(&mbentries, i));
+        if (!r2)
+            r2 = proc(state, rock);
+        if (r2) {
+            r = r2;
+            break;
+        }
     }
 
-    mboxlist_entry_free(&mbentry);
-    free(intname);
+    while ((mbentry = ptrarray_pop(&mbentries)))
+        mboxlist_entry_free(&mbentry);
+    ptrarray_fini(&mbentries);
 
     return r;
 }
 
-
 /*
  * Perform a GETANNOTATION command
  *
@@ -10299,10 +10469,9 @@ static void cmd_getmetadata(const char *tag)
         arock.attribs = &newa;
         arock.callback = getmetadata_response;
         arock.cbrock = &opts;
-        if (mbox_is_pattern)
-            r = apply_mailbox_pattern(astate, mboxes->data[0], annot_fetch_cb, &arock);
-        else
-            r = apply_mailbox_array(astate, mboxes, annot_fetch_cb, &arock);
+        r = apply_mailbox_prefetch(astate,
+                                   mbox_is_pattern ? mboxes->data[0] : NULL,
+                                   mboxes, &newe, annot_fetch_cb, &arock);
     }
     /* we didn't write anything */
     annotate_state_abort(&astate);
@@ -10588,6 +10757,8 @@ syntax_error:
                 warmup_flags |= WARMUP_ANNOTATIONS;
             else if (!strcasecmp(arg.s, "search"))
                 warmup_flags |= WARMUP_SEARCH;
+            else if (!strcasecmp(arg.s, "cache"))
+                warmup_flags |= WARMUP_CACHE;
             else if (!strcasecmp(arg.s, "uids")) {
                 if (c != ' ') goto syntax_error;
                 c = getword(imapd_in, &arg);
@@ -11359,6 +11530,137 @@ static int xfer_addusermbox(const mbentry_t *mbentry, void *rock)
     return 0;
 }
 
+struct xfer_bulkmbox {
+    const char *name;
+    quota_t size;
+};
+
+static int xfer_bulkmbox_cmp(const void *a, const void *b)
+{
+    const struct xfer_bulkmbox *ma = a, *mb = b;
+
+    if (ma->size != mb->size) return ma->size < mb->size ? 1 : -1;
+    return strcmp(ma->name, mb->name);
+}
+
+static void xfer_bulkworker(struct xfer_header *xfer,
+                            struct sync_name_list *mboxes)
+{
+    unsigned flags = SYNC_FLAG_LOGGING | SYNC_FLAG_LOCALONLY;
+    struct buf tagbuf = BUF_INITIALIZER;
+    struct backend *be;
+    int r = IMAP_SERVER_UNAVAILABLE;
+
+    /* the parent still talks over xfer->be and any pooled connections */
+    backend_pool_detach();
+
+    be = backend_connect(NULL, xfer->toserver, &imap_protocol, "",
+                         NULL, NULL, -1);
+    if (be && (be->capability & CAPA_REPLICATION)) {
+        be->in->userdata = be->out->userdata = &tagbuf;
+        r = sync_do_mailboxes_batched(mboxes, xfer->topart, be,
+                                      config_getint(IMAPOPT_SYNC_BATCHSIZE),
+                                      flags);
+    }
+
+    if (r) {
+        syslog(LOG_ERR, "XFER: bulk copy to %s failed: %s",
+               xfer->toserver, error_message(r));
+    }
+
+    if (be) {
+        backend_disconnect(be);
+        free(be);
+    }
+    buf_free(&tagbuf);
+
+    _exit(r ? EC_TEMPFAIL : 0);
+}
+
+/* Copy the bulk of a user's mailboxes ahead of the regular syncs, in
+ * parallel.  The mailboxes are shared out between 'nworkers' forked
+ * workers, largest first to whichever has the least to copy so far,
+ * and each worker copies its share over its own connection to the
+ * destination in steps of sync_batchsize messages.  Every step is
+ * committed on the destination, so an XFER which fails and is retried
+ * picks up where the copy stopped.  This pass is only an optimisation:
+ * a worker which fails is logged, and the syncs which follow copy
+ * whatever it left behind. */
+static void xfer_bulksync(struct xfer_header *xfer, int nworkers)
+{
+    struct xfer_bulkmbox *mboxes = NULL;
+    struct sync_name_list **shares;
+    quota_t *sizes;
+    pid_t *pids;
+    struct xfer_item *item;
+    size_t i, n = 0;
+    int w;
+
+    for (item = xfer->items; item; item = item->next) n++;
+    if (!n) return;
+    if ((size_t) nworkers > n) nworkers = n;
+
+    syslog(LOG_INFO, "XFER: bulk copy of user %s, %d workers",
+           xfer->userid, nworkers);
+
+    mboxes = xmalloc(n * sizeof(struct xfer_bulkmbox));
+    for (i = 0, item = xfer->items; item; i++, item = item->next) {
+        struct mailbox *mailbox = NULL;
+
+        mboxes[i].name = item->mbentry->name;
+        mboxes[i].size = 0;
+        if (!mailbox_open_irl(item->mbentry->name, &mailbox)) {
+            mboxes[i].size = mailbox->i.quota_mailbox_used;
+            mailbox_close(&mailbox);
+        }
+    }
+    qsort(mboxes, n, sizeof(struct xfer_bulkmbox), xfer_bulkmbox_cmp);
+
+    shares = xmalloc(nworkers * sizeof(struct sync_name_list *));
+    sizes = xzmalloc(nworkers * sizeof(quota_t));
+    pids = xzmalloc(nworkers * sizeof(pid_t));
+    for (w = 0; w < nworkers; w++)
+        shares[w] = sync_name_list_create();
+
+    for (i = 0; i < n; i++) {
+        int least = 0;
+
+        for (w = 1; w < nworkers; w++) {
+            if (sizes[w] < sizes[least]) least = w;
+        }
+        sync_name_list_add(shares[least], mboxes[i].name);
+        sizes[least] += mboxes[i].size;
+    }
+
+    for (w = 0; w < nworkers; w++) {
+        pids[w] = fork();
+        if (pids[w] < 0) {
+            syslog(LOG_ERR, "XFER: fork failed: %m");
+            break;
+        }
+        if (!pids[w]) xfer_bulkworker(xfer, shares[w]);
+    }
+
+    for (w = 0; w < nworkers; w++) {
+        int status;
+
+        if (pids[w] <= 0) continue;
+        while (waitpid(pids[w], &status, 0) < 0 && errno == EINTR);
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            syslog(LOG_NOTICE, "XFER: bulk copy worker %d of user %s"
+                   " didn't finish, leaving the rest to sync",
+                   w, xfer->userid);
+        }
+    }
+
+    for (w = 0; w < nworkers; w++)
+        sync_name_list_free(&shares[w]);
+    free(shares);
+    free(sizes);
+    free(pids);
+    free(mboxes);
+}
+
 static int xfer_initialsync(struct xfer_header *xfer)
 {
     unsigned flags = SYNC_FLAG_LOGGING | SYNC_FLAG_LOCALONLY;
@@ -11366,6 +11668,9 @@ static int xfer_initialsync(struct xfer_header *xfer)
 
     if (xfer->userid) {
         struct xfer_item *item, *next;
+        int nworkers = config_getint(IMAPOPT_XFER_WORKERS);
+
+        if (nworkers > 0) xfer_bulksync(xfer, nworkers);
 
         syslog(LOG_INFO, "XFER: initial sync of user %s", xfer->userid);
 
@@ -12928,6 +13233,57 @@ static void _addsubs(struct list_rock *rock)
     }
 }
 
+/* how many LIST-STATUS responses to gather before reading them ahead */
+#define LIST_STATUS_BATCH 64
+
+static void list_flush_pending(struct list_rock *rock)
+{
+    ptrarray_t mbentries = PTRARRAY_INITIALIZER;
+    int i;
+
+    if (!rock->pending.count) return;
+
+    for (i = 0; i < rock->pending.count; i++) {
+        struct list_entry *entry = ptrarray_nth(&rock->pending, i);
+        if (entry->mbentry) ptrarray_append(&mbentries, entry->mbentry);
+    }
+    status_prefetch_mbentries(&mbentries, imapd_userid,
+                              rock->listargs->statusitems);
+    ptrarray_fini(&mbentries);
+
+    /* the responses still go out in LIST order */
+    for (i = 0; i < rock->pending.count; i++) {
+        struct list_entry *entry = ptrarray_nth(&rock->pending, i);
+        list_response(entry->extname, entry->mbentry,
+                      entry->attributes, rock->listargs);
+        free(entry->extname);
+        mboxlist_entry_free(&entry->mbentry);
+        free(entry);
+    }
+    ptrarray_truncate(&rock->pending, 0);
+}
+
+/* output the last mailbox seen, or queue it up if it wants STATUS */
+static void list_output_last(struct list_rock *rock)
+{
+    if (!(rock->listargs->ret & LIST_RET_STATUS)) {
+        list_response(rock->last_name, rock->last_mbentry,
+                      rock->last_attributes, rock->listargs);
+        return;
+    }
+
+    struct list_entry *entry = xzmalloc(sizeof(struct list_entry));
+    entry->extname = rock->last_name;
+    entry->mbentry = rock->last_mbentry;
+    entry->attributes = rock->last_attributes;
+    rock->last_name = NULL;
+    rock->last_mbentry = NULL;
+
+    ptrarray_append(&rock->pending, entry);
+    if (rock->pending.count >= LIST_STATUS_BATCH)
+        list_flush_pending(rock);
+}
+
 static int perform_output(const char *extname, const mbentry_t *mbentry, struct list_rock *rock)
 {
     /* skip non-responsive mailboxes early, so they don't break sub folder detection */
@@ -12964,6 +13320,9 @@ static int perform_output(const char *extname, const mbentry_t *mbentry, struct
             if (s) {
                 char mytag[128];
 
+                /* keep local responses ahead of the proxied ones */
+                list_flush_pending(rock);
+
                 proxy_gentag(mytag, sizeof(mytag));
 
                 if (listargs->scan) {
@@ -13002,14 +13361,16 @@ static int perform_output(const char *extname, const mbentry_t *mbentry, struct
         if (!(rock->listargs->sel & LIST_SEL_SUBSCRIBED) ||
             (rock->last_attributes &
              (MBOX_ATTRIBUTE_SUBSCRIBED | MBOX_ATTRIBUTE_CHILDINFO_SUBSCRIBED))) {
-            list_response(rock->last_name, rock->last_mbentry,
-                          rock->last_attributes, rock->listargs);
+            list_output_last(rock);
         }
         free(rock->last_name);
         rock->last_name = NULL;
         mboxlist_entry_free(&rock->last_mbentry);
     }
 
+    /* end of the listing */
+    if (!extname) list_flush_pending(rock);
+
     if (extname) {
         rock->last_name = xstrdup(extname);
         if (mbentry) rock->last_mbentry = mboxlist_entry_copy(mbentry);
@@ -13257,6 +13618,8 @@ static void list_data_remotesubscriptions(struct listargs *listargs)
                           imapd_userisadmin, imapd_userid,
                           imapd_authstate, list_cb, &rock);
 
+    list_flush_pending(&rock);
+    ptrarray_fini(&rock.pending);
     strarray_free(rock.subs);
     free_hash_table(&rock.server_table, NULL);
     if (rock.last_name) free(rock.last_name);
@@ -13372,6 +13735,20 @@ static void list_data_recursivematch(struct listargs *listargs)
 
         /* print */
         for (i = 0; i < entries; i++) {
+            if ((rock.listargs->ret & LIST_RET_STATUS) &&
+                !(i % LIST_STATUS_BATCH)) {
+                ptrarray_t mbentries = PTRARRAY_INITIALIZER;
+                int j;
+
+                for (j = i; j < entries && j < i + LIST_STATUS_BATCH; j++) {
+                    if (rock.array[j].extname && rock.array[j].mbentry)
+                        ptrarray_append(&mbentries, rock.array[j].mbentry);
+                }
+                status_prefetch_mbentries(&mbentries, imapd_userid,
+                                          rock.listargs->statusitems);
+                ptrarray_fini(&mbentries);
+            }
+
             if (!rock.array[i].extname) continue;
             list_response(rock.array[i].extname,
                           rock.array[i].mbentry,
@@ -13434,6 +13811,8 @@ static void list_data(struct listargs *listargs)
                 free_hash_table(&rock.server_table, NULL);
         }
 
+        list_flush_pending(&rock);
+        ptrarray_fini(&rock.pending);
         if (rock.last_name) free(rock.last_name);
     }
 }
@@ -14132,12 +14511,12 @@ static void cmd_resetkey(char *tag, char *name,
 }
 #endif /* HAVE_SSL */
 
-#ifdef HAVE_ZLIB
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
 static void cmd_compress(char *tag, char *alg)
 {
     if (imapd_compress_done) {
         prot_printf(imapd_out,
-                    "%s BAD [COMPRESSIONACTIVE] DEFLATE active via COMPRESS\r\n",
+                    "%s BAD [COMPRESSIONACTIVE] already active via COMPRESS\r\n",
                     tag);
     }
 #if defined(HAVE_SSL) && (OPENSSL_VERSION_NUMBER >= 0x0090800fL)
@@ -14147,16 +14526,28 @@ static void cmd_compress(char *tag, char *alg)
                     tag, SSL_COMP_get_name(imapd_tls_comp));
     }
 #endif // defined(HAVE_SSL) && (OPENSSL_VERSION_NUMBER >= 0x0090800fL)
-    else if (strcasecmp(alg, "DEFLATE")) {
-        prot_printf(imapd_out,
-                    "%s NO Unknown COMPRESS algorithm: %s\r\n", tag, alg);
-    }
-    else if (ZLIB_VERSION[0] != zlibVersion()[0]) {
+#ifdef HAVE_ZSTD
+    else if (!strcasecmp(alg, "ZSTD")) {
         prot_printf(imapd_out,
-                    "%s NO Error initializing %s (incompatible zlib version)\r\n",
-                    tag, alg);
+                    "%s OK %s active\r\n", tag, alg);
+
+        /* enable (de)compression for the prot layer */
+        if (prot_setcompress_zstd(imapd_in, NULL, 0) ||
+            prot_setcompress_zstd(imapd_out, NULL, 0))
+            fatal("Failed to start zstd compression", EC_SOFTWARE);
+
+        imapd_compress_done = 1;
     }
-    else {
+#endif // HAVE_ZSTD
+#ifdef HAVE_ZLIB
+    else if (!strcasecmp(alg, "DEFLATE")) {
+        if (ZLIB_VERSION[0] != zlibVersion()[0]) {
+            prot_printf(imapd_out,
+                        "%s NO Error initializing %s (incompatible zlib version)\r\n",
+                        tag, alg);
+            return;
+        }
+
         prot_printf(imapd_out,
                     "%s OK %s active\r\n", tag, alg);
 
@@ -14166,8 +14557,13 @@ static void cmd_compress(char *tag, char *alg)
 
         imapd_compress_done = 1;
     }
+#endif // HAVE_ZLIB
+    else {
+        prot_printf(imapd_out,
+                    "%s NO Unknown COMPRESS algorithm: %s\r\n", tag, alg);
+    }
 }
-#endif /* HAVE_ZLIB */
+#endif /* HAVE_ZLIB || HAVE_ZSTD */
 
 static void cmd_enable(char *tag)
 {
@@ -57,28 +57,59 @@
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
 
+static inline int is_word_end(int c)
+{
+    return (c == EOF || isspace(c) || c == '(' || c == ')' || c == '\"');
+}
+
 /*
- * Parse a word
- * (token not containing whitespace, parens, or double quotes)
+ * Append the rest of a word to buf and return the terminating character.
+ * Runs of bytes already sitting in the input buffer are appended as
+ * one slice rather than a character at a time; only a buffer boundary
+ * falls back to prot_getc() to refill.
  */
-EXPORTED int getword(struct protstream *in, struct buf *buf)
+static int getword_append(struct protstream *in, struct buf *buf,
+                          size_t maxword)
 {
+    const char *base;
+    size_t n, i;
     int c;
 
-    buf_reset(buf);
     for (;;) {
-        c = prot_getc(in);
-        if (c == EOF || isspace(c) || c == '(' || c == ')' || c == '\"') {
-            buf_cstring(buf); /* appends a '\0' */
-            return c;
+        base = prot_buffered(in, &n);
+        for (i = 0; i < n && !is_word_end((unsigned char) base[i]); i++);
+        if (i) {
+            buf_appendmap(buf, base, i);
+            prot_skip(in, i);
+            if (maxword && buf_len(buf) > maxword) {
+                fatal("word too long", EC_IOERR);
+            }
         }
+
+        c = prot_getc(in);
+        if (is_word_end(c)) return c;
+
         buf_putc(buf, c);
-        if (config_maxword && buf_len(buf) > config_maxword) {
+        if (maxword && buf_len(buf) > maxword) {
             fatal("word too long", EC_IOERR);
         }
     }
 }
 
+/*
+ * Parse a word
+ * (token not containing whitespace, parens, or double quotes)
+ */
+EXPORTED int getword(struct protstream *in, struct buf *buf)
+{
+    int c;
+
+    buf_reset(buf);
+    c = getword_append(in, buf, config_maxword);
+    buf_cstring(buf); /* appends a '\0' */
+    return c;
+}
+
 /*
  * Parse an xstring
  * (astring, nstring or string based on type)
@@ -118,6 +149,23 @@ EXPORTED int getxstring(struct protstream *pin, struct protstream *pout,
          * other than double-quote, CR, and LF.
          */
         for (;;) {
+            const char *base;
+            size_t n, i;
+
+            /* copy plain runs straight out of the input buffer */
+            base = prot_buffered(pin, &n);
+            for (i = 0; i < n; i++) {
+                if (base[i] == '\\' || base[i] == '\"' ||
+                    base[i] == '\r' || base[i] == '\n') break;
+            }
+            if (i) {
+                buf_appendmap(buf, base, i);
+                prot_skip(pin, i);
+                if (config_maxquoted && buf_len(buf) > config_maxquoted) {
+                    fatal("quoted value too long", EC_IOERR);
+                }
+            }
+
             c = prot_getc(pin);
             if (c == '\\') {
                 c = prot_getc(pin);
@@ -173,13 +221,14 @@ EXPORTED int getxstring(struct protstream *pin, struct protstream *pout,
             prot_printf(pout, "+ go ahead\r\n");
             prot_flush(pout);
         }
-        for (i = 0; i < len; i++) {
-            c = prot_getc(pin);
-            if (c == EOF) {
+        buf_ensure(buf, len);
+        for (i = 0; i < len; ) {
+            int n = prot_readbuf(pin, buf, len - i);
+            if (!n) {
                 buf_cstring(buf);
                 return EOF;
             }
-            buf_putc(buf, c);
+            i += n;
         }
         buf_cstring(buf);
         /* n.b. we've consumed an exact number of bytes according to the literal, do
@@ -194,20 +243,16 @@ EXPORTED int getxstring(struct protstream *pin, struct protstream *pout,
              * Atom -- server is liberal in accepting specials other
              * than whitespace, parens, or double quotes
              */
-            for (;;) {
-                if (c == EOF || isspace(c) || c == '(' ||
-                          c == ')' || c == '\"') {
-                    /* gotta handle NIL here too */
-                    if ((flags & GXS_NIL) && buf->len == 3 && !memcmp(buf->s, "NIL", 3))
-                        buf_free(buf);
-                    else
-                        buf_cstring(buf);
-                    return c;
-                }
+            if (!is_word_end(c)) {
                 buf_putc(buf, c);
-                c = prot_getc(pin);
+                c = getword_append(pin, buf, 0);
             }
-            /* never gets here */
+            /* gotta handle NIL here too */
+            if ((flags & GXS_NIL) && buf->len == 3 && !memcmp(buf->s, "NIL", 3))
+                buf_free(buf);
+            else
+                buf_cstring(buf);
+            return c;
         }
         else if ((flags & GXS_NIL)) {
             /*
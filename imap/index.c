@@ -62,6 +62,7 @@
 #include "annotate.h"
 #include "append.h"
 #include "assert.h"
+#include "attachextract.h"
 #include "charset.h"
 #include "conversations.h"
 #include "dlist.h"
@@ -86,6 +87,7 @@
 #include "util.h"
 #include "xstats.h"
 #include "ptrarray.h"
+#include "retry.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
 
@@ -99,6 +101,8 @@ EXPORTED unsigned client_capa;
 
 /* Forward declarations */
 static void index_refresh_locked(struct index_state *state);
+static void index_columns_free(struct index_columns **colsp);
+static void index_threadcache_free(struct index_threadcache **tcp);
 static void index_tellexists(struct index_state *state);
 static int index_lock(struct index_state *state);
 static void index_unlock(struct index_state *state);
@@ -142,6 +146,9 @@ static void index_fetchflags(struct index_state *state, uint32_t msgno);
 
 static int index_copysetup(struct index_state *state, uint32_t msgno,
                            struct copyargs *copyargs);
+static int index_storeflag_isnoop(struct index_state *state, uint32_t msgno,
+                                  const struct index_record *record,
+                                  const struct storeargs *storeargs);
 static int index_storeflag(struct index_state *state,
                            struct index_modified_flags *modified_flags,
                            uint32_t msgno, msgrecord_t *msgrec,
@@ -151,6 +158,9 @@ static int index_store_annotation(struct index_state *state, uint32_t msgno,
                            int *dirty);
 static int index_fetchreply(struct index_state *state, uint32_t msgno,
                             const struct fetchargs *fetchargs);
+static int fetch_is_fast(const struct fetchargs *fetchargs);
+static void index_fetchreply_fast(struct index_state *state, uint32_t msgno,
+                                  const struct fetchargs *fetchargs);
 static void index_printflags(struct index_state *state, uint32_t msgno,
                              int usinguid, int printmodseq);
 static char *get_localpart_addr(const char *header);
@@ -163,6 +173,16 @@ static void index_get_ids(MsgData *msgdata,
 static int index_sort_compare(MsgData *md1, MsgData *md2,
                               const struct sortcrit *call_data);
 
+struct msgdata_heap {
+    MsgData **data;
+    unsigned int n;
+    int (*cmp)(const void *, const void *);
+};
+static void index_msgdata_heapify(struct msgdata_heap *heap,
+                                  MsgData **msgdata, unsigned int n,
+                                  const struct sortcrit *sortcrit);
+static MsgData *index_msgdata_heappop(struct msgdata_heap *heap);
+
 static void *index_thread_getnext(Thread *thread);
 static void index_thread_setnext(Thread *thread, Thread *next);
 static int index_thread_compare(Thread *t1, Thread *t2,
@@ -257,6 +277,11 @@ static int index_rewrite_record(struct index_state *state,
     for (i = 0; i < MAX_USER_FLAGS/32; i++)
         im->user_flags[i] = record->user_flags[i];
 
+    if (state->columns) {
+        state->columns->modseq[msgno-1] = record->modseq;
+        state->columns->system_flags[msgno-1] = record->system_flags;
+    }
+
     return 0;
 }
 
@@ -283,6 +308,8 @@ EXPORTED void index_close(struct index_state **stateptr)
 
     index_release(state);
 
+    index_columns_free(&state->columns);
+    index_threadcache_free(&state->threadcache);
     xfree(state->map);
     xfree(state->mboxname);
     xfree(state->userid);
@@ -337,6 +364,9 @@ EXPORTED int index_open_mailbox(struct mailbox *mailbox, struct index_init *init
         }
     }
 
+    if (config_getswitch(IMAPOPT_SEARCH_COLUMNAR))
+        state->columns = xzmalloc(sizeof(struct index_columns));
+
     /* initialise the index_state */
     index_refresh_locked(state);
 
@@ -388,6 +418,8 @@ EXPORTED int index_expunge(struct index_state *state, char *sequence,
     int numexpunged = 0;
     struct mboxevent *mboxevent = NULL;
     modseq_t oldmodseq;
+    int batchsize = config_getint(IMAPOPT_EXPUNGE_BATCHSIZE);
+    int inbatch = 0;
 
     r = index_lock(state);
     if (r) return r;
@@ -440,6 +472,20 @@ EXPORTED int index_expunge(struct index_state *state, char *sequence,
             im->told_modseq = im->modseq;
 
         mboxevent_extract_record(mboxevent, state->mailbox, &record);
+
+        /* let everyone else in between batches of a big expunge.
+         * msgnos stay stable across the refresh, since expunges
+         * aren't reported until index_tellchanges() */
+        if (batchsize > 0 && ++inbatch >= batchsize) {
+            inbatch = 0;
+            index_unlock(state);
+            r = index_lock(state);
+            if (r) {
+                seqset_free(seq);
+                mboxevent_free(&mboxevent);
+                return r;
+            }
+        }
     }
 
     seqset_free(seq);
@@ -585,7 +631,7 @@ static struct seqset *_readseen(struct index_state *state, unsigned *recentuid)
         int r;
 
         r = seen_open(userid, SEEN_CREATE, &seendb);
-        if (!r) r = seen_read(seendb, mailbox->uniqueid, &sd);
+        if (!r) r = seen_read_seqset(seendb, mailbox->uniqueid, &sd, &seenlist);
         seen_close(&seendb);
 
         /* handle no seen DB gracefully */
@@ -598,7 +644,6 @@ static struct seqset *_readseen(struct index_state *state, unsigned *recentuid)
         }
         else {
             *recentuid = sd.lastuid;
-            seenlist = seqset_parse(sd.seenuids, NULL, *recentuid);
             seen_freedata(&sd);
         }
     }
@@ -609,6 +654,263 @@ static struct seqset *_readseen(struct index_state *state, unsigned *recentuid)
     return seenlist;
 }
 
+static void index_columns_free(struct index_columns **colsp)
+{
+    struct index_columns *cols = *colsp;
+
+    if (!cols) return;
+
+    free(cols->uid);
+    free(cols->modseq);
+    free(cols->system_flags);
+    free(cols->internaldate);
+    free(cols->size);
+    free(cols);
+
+    *colsp = NULL;
+}
+
+static void index_columns_ensure(struct index_columns *cols, unsigned n)
+{
+    if (n <= cols->alloc) return;
+
+    cols->uid = xrealloc(cols->uid, n * sizeof(*cols->uid));
+    cols->modseq = xrealloc(cols->modseq, n * sizeof(*cols->modseq));
+    cols->system_flags = xrealloc(cols->system_flags,
+                                  n * sizeof(*cols->system_flags));
+    cols->internaldate = xrealloc(cols->internaldate,
+                                  n * sizeof(*cols->internaldate));
+    cols->size = xrealloc(cols->size, n * sizeof(*cols->size));
+    cols->alloc = n;
+}
+
+/*
+ * Shared index snapshots.
+ *
+ * When index_snapshot_dir is set, the first session to open a large
+ * mailbox writes the records it walked (already read and CRC-checked)
+ * into <index_snapshot_dir>/<uniqueid>, and later openers of the same
+ * mailbox state map that file instead of walking cyrus.index again.
+ * On tmpfs those pages are shared by every imapd with the folder open.
+ *
+ * A snapshot is only used if it matches the mailbox's uidvalidity,
+ * generation, highestmodseq and record count exactly, which we can
+ * check under the index lock; any change to the mailbox also removes
+ * it, from mailbox_unlock_index() alongside the update notification.
+ */
+#define SNAPSHOT_MAGIC   0x43494e53  /* "CINS" */
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t uidvalidity;
+    uint32_t generation;
+    modseq_t highestmodseq;
+    uint32_t num_records;
+    uint32_t count;
+};
+
+struct snapshot_entry {
+    uint32_t uid;
+    uint32_t recno;
+    uint32_t system_flags;
+    uint32_t internal_flags;
+    uint32_t user_flags[MAX_USER_FLAGS/32];
+    modseq_t modseq;
+    uint64_t cache_offset;
+    int64_t internaldate;
+    uint32_t size;
+    uint32_t pad;
+};
+
+struct index_snapshot {
+    const char *base;
+    size_t len;
+    const struct snapshot_entry *entries;
+    uint32_t count;
+};
+
+static const char *index_snapshot_fname(const char *uniqueid)
+{
+    static struct buf fname = BUF_INITIALIZER;
+    const char *dir = config_getstring(IMAPOPT_INDEX_SNAPSHOT_DIR);
+
+    if (!dir || !uniqueid) return NULL;
+
+    buf_reset(&fname);
+    buf_printf(&fname, "%s/%s", dir, uniqueid);
+    return buf_cstring(&fname);
+}
+
+static int index_snapshot_wanted(struct mailbox *mailbox)
+{
+    if (!config_getstring(IMAPOPT_INDEX_SNAPSHOT_DIR)) return 0;
+
+    return mailbox->i.num_records >=
+        (uint32_t) config_getint(IMAPOPT_INDEX_SNAPSHOT_MINRECORDS);
+}
+
+static int index_snapshot_matches(const struct snapshot_header *hdr,
+                                  struct mailbox *mailbox)
+{
+    return hdr->magic == SNAPSHOT_MAGIC
+        && hdr->version == SNAPSHOT_VERSION
+        && hdr->uidvalidity == mailbox->i.uidvalidity
+        && hdr->generation == mailbox->i.generation_no
+        && hdr->highestmodseq == mailbox->i.highestmodseq
+        && hdr->num_records == mailbox->i.num_records;
+}
+
+/* map a snapshot of the mailbox's current state, if there is one */
+static struct index_snapshot *index_snapshot_open(struct mailbox *mailbox)
+{
+    const char *fname = index_snapshot_fname(mailbox->uniqueid);
+    struct index_snapshot *snap;
+    const struct snapshot_header *hdr;
+    struct stat sbuf;
+    int fd;
+
+    if (!fname) return NULL;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) return NULL;
+
+    if (fstat(fd, &sbuf) == -1 ||
+        (size_t) sbuf.st_size < sizeof(struct snapshot_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    snap = xzmalloc(sizeof(struct index_snapshot));
+    map_refresh(fd, 1, &snap->base, &snap->len, sbuf.st_size, fname, NULL);
+    close(fd);
+
+    hdr = (const struct snapshot_header *) snap->base;
+    if (!index_snapshot_matches(hdr, mailbox) ||
+        snap->len != sizeof(struct snapshot_header) +
+                     hdr->count * sizeof(struct snapshot_entry)) {
+        map_free(&snap->base, &snap->len);
+        free(snap);
+        return NULL;
+    }
+
+    snap->entries = (const struct snapshot_entry *)
+        (snap->base + sizeof(struct snapshot_header));
+    snap->count = hdr->count;
+
+    return snap;
+}
+
+static void index_snapshot_close(struct index_snapshot **snapp)
+{
+    struct index_snapshot *snap = *snapp;
+
+    if (!snap) return;
+
+    map_free(&snap->base, &snap->len);
+    free(snap);
+    *snapp = NULL;
+}
+
+static void index_snapshot_add(struct buf *buf,
+                               const struct index_record *record)
+{
+    struct snapshot_entry e;
+    int i;
+
+    memset(&e, 0, sizeof(e));
+    e.uid = record->uid;
+    e.recno = record->recno;
+    e.system_flags = record->system_flags;
+    e.internal_flags = record->internal_flags;
+    for (i = 0; i < MAX_USER_FLAGS/32; i++)
+        e.user_flags[i] = record->user_flags[i];
+    e.modseq = record->modseq;
+    e.cache_offset = record->cache_offset;
+    e.internaldate = record->internaldate;
+    e.size = record->size;
+
+    buf_appendmap(buf, (const char *) &e, sizeof(e));
+}
+
+static void index_snapshot_get(const struct index_snapshot *snap, uint32_t n,
+                               struct index_record *record)
+{
+    const struct snapshot_entry *e = &snap->entries[n];
+    int i;
+
+    memset(record, 0, sizeof(struct index_record));
+    record->uid = e->uid;
+    record->recno = e->recno;
+    record->system_flags = e->system_flags;
+    record->internal_flags = e->internal_flags;
+    for (i = 0; i < MAX_USER_FLAGS/32; i++)
+        record->user_flags[i] = e->user_flags[i];
+    record->modseq = e->modseq;
+    record->cache_offset = e->cache_offset;
+    record->internaldate = e->internaldate;
+    record->size = e->size;
+}
+
+/* write out the records collected in 'buf' (after room for the header)
+ * for others to share; failure just means nobody gets a snapshot */
+static void index_snapshot_write(struct mailbox *mailbox, struct buf *buf)
+{
+    const char *fname = index_snapshot_fname(mailbox->uniqueid);
+    struct snapshot_header *hdr;
+    struct buf tmpname = BUF_INITIALIZER;
+    int fd;
+
+    if (!fname) return;
+
+    hdr = (struct snapshot_header *) buf->s;
+    memset(hdr, 0, sizeof(struct snapshot_header));
+    hdr->magic = SNAPSHOT_MAGIC;
+    hdr->version = SNAPSHOT_VERSION;
+    hdr->uidvalidity = mailbox->i.uidvalidity;
+    hdr->generation = mailbox->i.generation_no;
+    hdr->highestmodseq = mailbox->i.highestmodseq;
+    hdr->num_records = mailbox->i.num_records;
+    hdr->count = (buf->len - sizeof(struct snapshot_header)) /
+                 sizeof(struct snapshot_entry);
+
+    buf_printf(&tmpname, "%s.%d", fname, (int) getpid());
+
+    fd = open(buf_cstring(&tmpname), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd == -1 && errno == ENOENT) {
+        if (!cyrus_mkdir(buf_cstring(&tmpname), 0755))
+            fd = open(buf_cstring(&tmpname), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    }
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: creating index snapshot %s: %m",
+               buf_cstring(&tmpname));
+        buf_free(&tmpname);
+        return;
+    }
+
+    if (retry_write(fd, buf->s, buf->len) != (ssize_t) buf->len ||
+        rename(buf_cstring(&tmpname), fname) == -1) {
+        syslog(LOG_ERR, "IOERROR: writing index snapshot %s: %m", fname);
+        unlink(buf_cstring(&tmpname));
+    }
+
+    close(fd);
+    buf_free(&tmpname);
+}
+
+/*
+ * Forget the shared snapshot of the mailbox with 'uniqueid'; called
+ * whenever the mailbox changes
+ */
+EXPORTED void index_snapshot_invalidate(const char *uniqueid)
+{
+    const char *fname = index_snapshot_fname(uniqueid);
+
+    if (fname && unlink(fname) == -1 && errno != ENOENT)
+        syslog(LOG_ERR, "IOERROR: removing index snapshot %s: %m", fname);
+}
+
 static void index_refresh_locked(struct index_state *state)
 {
     struct mailbox *mailbox = state->mailbox;
@@ -623,6 +925,11 @@ static void index_refresh_locked(struct index_state *state)
     struct index_map *im;
     uint32_t need_records;
     struct seqset *seenlist;
+    struct index_snapshot *snap = NULL;
+    struct index_record snaprecord;
+    struct buf snapbuf = BUF_INITIALIZER;
+    uint32_t snapno = 0;
+    int building = 0;
     int i;
 
     /* need to start by having enough space for the entire index state
@@ -650,13 +957,39 @@ static void index_refresh_locked(struct index_state *state)
         state->map = xrealloc(state->map,
                               state->mapsize * sizeof(struct index_map));
     }
+    if (state->columns)
+        index_columns_ensure(state->columns, state->mapsize);
 
     seenlist = _readseen(state, &recentuid);
 
+    /* on first open of a large mailbox, share the walk with others */
+    if (!state->last_uid && index_snapshot_wanted(mailbox)) {
+        snap = index_snapshot_open(mailbox);
+        if (!snap) {
+            building = 1;
+            buf_ensure(&snapbuf, sizeof(struct snapshot_header) +
+                       mailbox->i.num_records * sizeof(struct snapshot_entry));
+            buf_truncate(&snapbuf, sizeof(struct snapshot_header));
+        }
+    }
+
     /* walk through all records */
-    struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, ITER_SKIP_UNLINKED);
-    while ((msg = mailbox_iter_step(iter))) {
-        const struct index_record *record = msg_record(msg);
+    struct mailbox_iter *iter = snap ? NULL :
+        mailbox_iter_init(mailbox, 0, ITER_SKIP_UNLINKED);
+    for (;;) {
+        const struct index_record *record;
+
+        if (snap) {
+            if (snapno >= snap->count) break;
+            index_snapshot_get(snap, snapno++, &snaprecord);
+            record = &snaprecord;
+        }
+        else {
+            if (!(msg = mailbox_iter_step(iter))) break;
+            record = msg_record(msg);
+            if (building) index_snapshot_add(&snapbuf, record);
+        }
+
         im = &state->map[msgno-1];
         while (msgno <= state->exists && im->uid < record->uid) {
             /* NOTE: this same logic is repeated below for messages
@@ -679,6 +1012,8 @@ static void index_refresh_locked(struct index_state *state)
              * find the file */
             im->internal_flags |= FLAG_INTERNAL_EXPUNGED |
                 FLAG_INTERNAL_UNLINKED;
+            if (state->columns)
+                state->columns->modseq[msgno-1] = im->modseq;
             im = &state->map[msgno++];
 
             /* this one is expunged */
@@ -710,6 +1045,15 @@ static void index_refresh_locked(struct index_state *state)
         for (i = 0; i < MAX_USER_FLAGS/32; i++)
             im->user_flags[i] = record->user_flags[i];
 
+        if (state->columns) {
+            struct index_columns *cols = state->columns;
+            cols->uid[msgno-1] = record->uid;
+            cols->modseq[msgno-1] = record->modseq;
+            cols->system_flags[msgno-1] = record->system_flags;
+            cols->internaldate[msgno-1] = record->internaldate;
+            cols->size[msgno-1] = record->size;
+        }
+
         /* for expunged records, just track the modseq */
         if (im->internal_flags & FLAG_INTERNAL_EXPUNGED) {
             num_expunged++;
@@ -762,7 +1106,13 @@ static void index_refresh_locked(struct index_state *state)
             fatal(buf, EC_IOERR);
         }
     }
-    mailbox_iter_done(&iter);
+    if (iter) mailbox_iter_done(&iter);
+    index_snapshot_close(&snap);
+
+    if (building) {
+        index_snapshot_write(mailbox, &snapbuf);
+        buf_free(&snapbuf);
+    }
 
     /* may be trailing records which need to be considered for
      * delayed_modseq purposes, and to get the count right for
@@ -778,6 +1128,8 @@ static void index_refresh_locked(struct index_state *state)
             delayed_modseq = im->modseq - 1;
         im->recno = 0;
         im->internal_flags |= FLAG_INTERNAL_EXPUNGED | FLAG_INTERNAL_UNLINKED;
+        if (state->columns)
+            state->columns->modseq[msgno-1] = im->modseq;
         im = &state->map[msgno++];
         num_expunged++;
     }
@@ -1067,6 +1419,61 @@ static int _fetch_setseen(struct index_state *state,
     return 0;
 }
 
+/* Does the FETCH need the message file of every message it returns? */
+static int fetch_needs_message(const struct fetchargs *fetchargs)
+{
+    return (fetchargs->fetchitems &
+            (FETCH_HEADER|FETCH_TEXT|FETCH_SHA1|FETCH_RFC822)) ||
+           fetchargs->binsections || fetchargs->sizesections ||
+           fetchargs->bodysections;
+}
+
+/*
+ * Start the kernel reading the message files of the messages from
+ * *@nextp to @last which are in @seq, along with the span of the cache
+ * file holding their records.  *@nextp is left at the first message
+ * not yet read ahead.
+ */
+static void fetch_readahead(struct index_state *state,
+                            struct seqset *seq, int usinguid,
+                            uint32_t *nextp, uint32_t last)
+{
+    struct mailbox *mailbox = state->mailbox;
+    struct index_record record;
+    struct index_map *im;
+    uint32_t msgno;
+    uint32_t cache_first = 0, cache_last = 0;
+    const char *fname;
+
+    for (msgno = *nextp; msgno <= last; msgno++) {
+        im = &state->map[msgno-1];
+        if (seq && !seqset_ismember(seq, usinguid ? im->uid : msgno))
+            continue;
+
+        if (index_reload_record(state, msgno, &record))
+            continue;
+
+        fname = mailbox_record_fname(mailbox, &record);
+        if (fname)
+            warmup_file(fname, 0, record.size);
+
+        if (record.cache_offset &&
+            !(record.internal_flags & FLAG_INTERNAL_ARCHIVED)) {
+            if (!cache_first || record.cache_offset < cache_first)
+                cache_first = record.cache_offset;
+            if (record.cache_offset > cache_last)
+                cache_last = record.cache_offset;
+        }
+    }
+    *nextp = msgno;
+
+    /* cache records are small; the last one surely fits in a page */
+    if (cache_last) {
+        fname = mailbox_meta_fname(mailbox, META_CACHE);
+        warmup_file(fname, cache_first, cache_last - cache_first + 4096);
+    }
+}
+
 /* seq can be NULL - means "ALL" */
 EXPORTED void index_fetchresponses(struct index_state *state,
                           struct seqset *seq,
@@ -1075,8 +1482,10 @@ EXPORTED void index_fetchresponses(struct index_state *state,
                           int *fetchedsomething)
 {
     uint32_t msgno, start, end;
+    uint32_t readahead = 0, ahead;
     struct index_map *im;
     int fetched = 0;
+    int fast = fetch_is_fast(fetchargs);
     annotate_db_t *annot_db = NULL;
 
     /* Keep an open reference on the per-mailbox db to avoid
@@ -1122,6 +1531,11 @@ EXPORTED void index_fetchresponses(struct index_state *state,
     if (start < 1) start = 1;
     if (end > state->exists) end = state->exists;
 
+    if (fetch_needs_message(fetchargs) &&
+        config_getint(IMAPOPT_FETCH_READAHEAD) > 0)
+        readahead = config_getint(IMAPOPT_FETCH_READAHEAD);
+    ahead = start;
+
     for (msgno = start; msgno <= end; msgno++) {
         im = &state->map[msgno-1];
         if (seq && !seqset_ismember(seq, usinguid ? im->uid : msgno)) {
@@ -1130,7 +1544,17 @@ EXPORTED void index_fetchresponses(struct index_state *state,
             continue;
         }
 
-        if (index_fetchreply(state, msgno, fetchargs))
+        /* top the window up in batches once half of it has been sent */
+        if (readahead && ahead <= end && ahead <= msgno + readahead / 2) {
+            uint32_t last = msgno + readahead;
+            fetch_readahead(state, seq, usinguid, &ahead,
+                            last < end ? last : end);
+        }
+
+        if (fast) {
+            index_fetchreply_fast(state, msgno, fetchargs);
+        }
+        else if (index_fetchreply(state, msgno, fetchargs))
             break;
         fetched = 1;
     }
@@ -1291,6 +1715,11 @@ EXPORTED int index_store(struct index_state *state, char *sequence,
         r = index_reload_record(state, msgno, &record);
         if (r) goto out;
 
+        /* most of a bulk flag change is often already in place, and
+         * there's no point wrapping up a record which won't change */
+        if (index_storeflag_isnoop(state, msgno, &record, storeargs))
+            continue;
+
         msgrecord_t *msgrec = msgrecord_from_index_record(state->mailbox, &record);
 
         switch (storeargs->operation) {
@@ -1515,6 +1944,11 @@ EXPORTED int index_warmup(struct mboxlist_entry *mbentry,
         r = warmup_file(fname, 0, 0);
         if (r) goto out;
     }
+    if (warmup_flags & WARMUP_CACHE) {
+        fname = mboxname_metapath(mbentry->partition, mbentry->name, mbentry->uniqueid, META_CACHE, 0);
+        r = warmup_file(fname, 0, 0);
+        if (r) goto out;
+    }
     if (warmup_flags & WARMUP_CONVERSATIONS) {
         if (config_getswitch(IMAPOPT_CONVERSATIONS)) {
             fname = tofree1 = conversations_getmboxpath(mbentry->name);
@@ -2075,6 +2509,8 @@ EXPORTED int index_convsort(struct index_state *state,
                             const struct windowargs *windowargs)
 {
     MsgData **msgdata = NULL;
+    struct msgdata_heap heap;
+    int topk;
     unsigned int mi;
     modseq_t xconvmodseq = 0;
     int i;
@@ -2085,6 +2521,8 @@ EXPORTED int index_convsort(struct index_state *state,
     uint32_t first_pos = 0;
     unsigned int ninwindow = 0;
     ptrarray_t results = PTRARRAY_INITIALIZER;
+    bitvector_t hits = BV_INITIALIZER;
+    int colres;
     int total = 0;
     int r = 0;
     struct conversations_state *cstate = NULL;
@@ -2109,6 +2547,8 @@ EXPORTED int index_convsort(struct index_state *state,
     }
 
     search_expr_internalise(state, searchargs->root);
+    index_search_plan(state, searchargs->root, /*verbose*/0);
+    colres = index_search_evaluate_columns(state, searchargs->root, &hits);
 
     /* this works both with and without conversations */
     total = search_predict_total(state, cstate, searchargs,
@@ -2131,12 +2571,19 @@ EXPORTED int index_convsort(struct index_state *state,
         goto out;
     }
 
-    /* Sort the messages based on the given criteria */
-    index_msgdata_sort(msgdata, state->exists, sortcrit);
+    /* When the loop below can stop as soon as the window is full, only
+     * the messages up to there need to come out in order, so pop them
+     * off a heap instead of sorting the lot.  Counting an unpredictable
+     * total needs every message anyway, and a full sort is cheaper. */
+    topk = windowargs->limit && total != UNPREDICTABLE;
+    if (topk)
+        index_msgdata_heapify(&heap, msgdata, state->exists, sortcrit);
+    else
+        index_msgdata_sort(msgdata, state->exists, sortcrit);
 
     /* One pass through the message list */
     for (mi = 0 ; mi < state->exists ; mi++) {
-        MsgData *msg = msgdata[mi];
+        MsgData *msg = topk ? index_msgdata_heappop(&heap) : msgdata[mi];
         struct index_map *im = &state->map[msg->msgno-1];
 
         /* can happen if we didn't "tellchanges" yet */
@@ -2144,7 +2591,10 @@ EXPORTED int index_convsort(struct index_state *state,
             continue;
 
         /* run the search program against all messages */
-        if (!index_search_evaluate(state, searchargs->root, msg->msgno))
+        if (colres != INDEX_COLUMNS_NONE && !bv_isset(&hits, msg->msgno))
+            continue;
+        if (colres != INDEX_COLUMNS_EXACT &&
+            !index_search_evaluate(state, searchargs->root, msg->msgno))
             continue;
 
         /* figure out whether this message is an exemplar */
@@ -2235,6 +2685,7 @@ out:
     index_msgdata_free(msgdata, state->exists);
     ptrarray_fini(&results);
     free_hashu64_table(&seen_cids, NULL);
+    bv_free(&hits);
 
     return r;
 }
@@ -2289,6 +2740,12 @@ EXPORTED int index_convmultisort(struct index_state *state,
     query->need_ids = 1;
     query->need_expunge = 1;
     query->sortcrit = sortcrit;
+    /* without conversations or an anchor the window is a fixed
+     * slice of the sorted list, so only keep enough to fill it */
+    if (!windowargs->conversations && !windowargs->anchor && windowargs->limit) {
+        query->max_results = windowargs->limit +
+            (windowargs->position ? windowargs->position - 1 : 0);
+    }
 
     r = search_query_run(query);
     if (r) return r;
@@ -2306,7 +2763,7 @@ EXPORTED int index_convmultisort(struct index_state *state,
         construct_hashu64_table(&seen_cids, query->merged_msgdata.count/4+4, 0);
     /* no need */
     else
-        total = query->merged_msgdata.count;
+        total = query->merged_total;
 
     /* Another pass through the merged message list */
     for (mi = 0 ; mi < query->merged_msgdata.count ; mi++) {
@@ -2543,7 +3000,7 @@ EXPORTED int index_snippets(struct index_state *state,
             if (r) continue;
 
             msg = message_new_from_record(mailbox, &record);
-            index_getsearchtext(msg, rx, /*snippet*/1);
+            search_getsnippettext(msg, rx);
             message_unref(&msg);
         }
 
@@ -2616,6 +3073,7 @@ EXPORTED int index_convupdates(struct index_state *state,
     }
 
     search_expr_internalise(state, searchargs->root);
+    index_search_plan(state, searchargs->root, /*verbose*/0);
 
     total = search_predict_total(state, cstate, searchargs,
                                 windowargs->conversations,
@@ -2629,6 +3087,40 @@ EXPORTED int index_convupdates(struct index_state *state,
     construct_hashu64_table(&seen_cids, state->exists/4+4, 0);
     construct_hashu64_table(&old_seen_cids, state->exists/4+4, 0);
 
+    /* The folder's conversation status modseq is at least that of every
+     * conversation in it.  If neither it nor the folder itself have
+     * moved since the client's state, and there are no new messages,
+     * then no exemplar can have been added, removed or changed, whatever
+     * the search and sort.  Only the total is left to find, and that
+     * needs neither sort keys nor sorting. */
+    if (state->mailbox->i.last_uid < windowargs->uidnext &&
+        state->mailbox->i.highestmodseq <= windowargs->modseq &&
+        xconvmodseq <= windowargs->modseq) {
+        if (total == UNPREDICTABLE) {
+            struct index_record record;
+            uint32_t msgno;
+
+            total = 0;
+            for (msgno = 1; msgno <= state->exists; msgno++) {
+                struct index_map *im = &state->map[msgno-1];
+
+                if (im->internal_flags & FLAG_INTERNAL_EXPUNGED)
+                    continue;
+                if (!index_search_evaluate(state, searchargs->root, msgno))
+                    continue;
+                if (windowargs->conversations) {
+                    if (index_reload_record(state, msgno, &record))
+                        continue;
+                    if (hashu64_lookup(record.cid, &seen_cids))
+                        continue;
+                    hashu64_insert(record.cid, (void *)1, &seen_cids);
+                }
+                total++;
+            }
+        }
+        goto out;
+    }
+
     /* Create/load the msgdata array
      * initial list - load data for ALL messages always */
     msgdata = index_msgdata_load(state, NULL, state->exists, sortcrit, 0, NULL);
@@ -3102,7 +3594,8 @@ EXPORTED uint32_t index_finduid(struct index_state *state, uint32_t uid)
 
     while (low <= high) {
         mid = (high - low)/2 + low;
-        miduid = index_getuid(state, mid);
+        miduid = state->columns ? state->columns->uid[mid-1]
+                                : index_getuid(state, mid);
         if (miduid == uid)
             return mid;
         else if (miduid > uid)
@@ -3199,7 +3692,13 @@ void index_fetchmsg(struct index_state *state, const struct buf *msg,
     /* Non-text literal -- tell the protstream about it */
     if (domain != DOMAIN_7BIT) prot_data_boundary(state->out);
 
-    prot_write(state->out, msg->s + offset, n);
+    if (state->fetch_msgbase && msg->s == state->fetch_msgbase &&
+        n >= (unsigned) config_getint(IMAPOPT_FETCH_SENDFILE_MINSIZE)) {
+        /* 'msg' is the message file, mapped - skip the copy */
+        prot_sendfile(state->out, state->fetch_msgfd, offset, n);
+    }
+    else
+        prot_write(state->out, msg->s + offset, n);
     while (n++ < size) {
         /* File too short, resynch client.
          *
@@ -3697,8 +4196,17 @@ static void index_tellexpunge(struct index_state *state)
         }
 
         /* copy back if necessary (after first expunge) */
-        if (msgno < oldmsgno)
+        if (msgno < oldmsgno) {
             state->map[msgno-1] = *im;
+            if (state->columns) {
+                struct index_columns *cols = state->columns;
+                cols->uid[msgno-1] = cols->uid[oldmsgno-1];
+                cols->modseq[msgno-1] = cols->modseq[oldmsgno-1];
+                cols->system_flags[msgno-1] = cols->system_flags[oldmsgno-1];
+                cols->internaldate[msgno-1] = cols->internaldate[oldmsgno-1];
+                cols->size[msgno-1] = cols->size[oldmsgno-1];
+            }
+        }
 
         msgno++;
     }
@@ -3933,6 +4441,90 @@ static int index_fetchmailboxids(struct index_state *state,
                                       &rock);
 }
 
+/* the system flags in the order they are reported */
+static const struct {
+    const char *name;
+    bit32 flag;
+} fetch_sysflags[] = {
+    { "\\Answered", FLAG_ANSWERED },
+    { "\\Flagged",  FLAG_FLAGGED },
+    { "\\Draft",    FLAG_DRAFT },
+    { "\\Deleted",  FLAG_DELETED },
+};
+
+#define SYSFLAG_RECENT  (1<<4)
+#define SYSFLAG_SEEN    (1<<5)
+
+/*
+ * The space-separated system flag names for each combination of the
+ * bits above, built once per process, so a flags response only has to
+ * look up one string and then append the user flags.
+ */
+static const char *fetch_sysflags_str(unsigned bits)
+{
+    static char *table[64];
+    unsigned i;
+
+    if (!table[bits]) {
+        struct buf buf = BUF_INITIALIZER;
+
+        if (bits & SYSFLAG_RECENT) buf_appendcstr(&buf, " \\Recent");
+        for (i = 0; i < VECTOR_SIZE(fetch_sysflags); i++) {
+            if (bits & (1<<i)) {
+                buf_putc(&buf, ' ');
+                buf_appendcstr(&buf, fetch_sysflags[i].name);
+            }
+        }
+        if (bits & SYSFLAG_SEEN) buf_appendcstr(&buf, " \\Seen");
+        table[bits] = buf_release(&buf);
+        if (!table[bits]) table[bits] = xstrdup("");
+    }
+
+    return table[bits];
+}
+
+/*
+ * Append the parenthesised flag list of a message to 'out', using
+ * only the index map.
+ */
+static void index_appendflags(struct index_state *state,
+                              struct index_map *im, struct buf *out)
+{
+    unsigned bits = 0, i;
+    unsigned flag;
+    bit32 flagmask = 0;
+    size_t start = buf_len(out);
+
+    for (i = 0; i < VECTOR_SIZE(fetch_sysflags); i++) {
+        if (im->system_flags & fetch_sysflags[i].flag) bits |= (1<<i);
+    }
+    if (im->isrecent) bits |= SYSFLAG_RECENT;
+    if (im->isseen) bits |= SYSFLAG_SEEN;
+
+    buf_appendcstr(out, fetch_sysflags_str(bits));
+    for (flag = 0; flag < VECTOR_SIZE(state->flagname); flag++) {
+        if ((flag & 31) == 0) {
+            flagmask = im->user_flags[flag/32];
+            /* skip a whole empty word at once */
+            if (!flagmask) {
+                flag += 31;
+                continue;
+            }
+        }
+        if (state->flagname[flag] && (flagmask & (1<<(flag & 31)))) {
+            buf_putc(out, ' ');
+            buf_appendcstr(out, state->flagname[flag]);
+        }
+    }
+
+    /* the list was built with a leading separator; turn it into the paren */
+    if (buf_len(out) > start)
+        out->s[start] = '(';
+    else
+        buf_putc(out, '(');
+    buf_putc(out, ')');
+}
+
 /*
  * Helper function to send * FETCH (FLAGS data.
  * Does not send the terminating close paren or CRLF.
@@ -3941,49 +4533,73 @@ static int index_fetchmailboxids(struct index_state *state,
 static void index_fetchflags(struct index_state *state,
                              uint32_t msgno)
 {
-    int sepchar = '(';
-    unsigned flag;
-    bit32 flagmask = 0;
+    static struct buf buf = BUF_INITIALIZER;
     struct index_map *im = &state->map[msgno-1];
 
-    prot_printf(state->out, "* %u FETCH (FLAGS ", msgno);
+    buf_reset(&buf);
+    buf_printf(&buf, "* %u FETCH (FLAGS ", msgno);
+    index_appendflags(state, im, &buf);
+    prot_putbuf(state->out, &buf);
+    im->told_modseq = im->modseq;
+}
 
-    if (im->isrecent) {
-        prot_printf(state->out, "%c\\Recent", sepchar);
-        sepchar = ' ';
-    }
-    if (im->system_flags & FLAG_ANSWERED) {
-        prot_printf(state->out, "%c\\Answered", sepchar);
-        sepchar = ' ';
-    }
-    if (im->system_flags & FLAG_FLAGGED) {
-        prot_printf(state->out, "%c\\Flagged", sepchar);
-        sepchar = ' ';
-    }
-    if (im->system_flags & FLAG_DRAFT) {
-        prot_printf(state->out, "%c\\Draft", sepchar);
+/*
+ * Fast path for FETCH requests of nothing but FLAGS, UID and MODSEQ,
+ * which is what CONDSTORE clients resyncing with CHANGEDSINCE send.
+ * Everything needed is in the index map, so neither the index record
+ * nor cyrus.cache is read, and each response is assembled in a single
+ * buffer.  The output is the same as index_fetchreply() would produce.
+ */
+#define FETCH_FAST_ITEMS (FETCH_FLAGS|FETCH_UID|FETCH_MODSEQ)
+
+static int fetch_is_fast(const struct fetchargs *fetchargs)
+{
+    return (fetchargs->fetchitems &&
+            !(fetchargs->fetchitems & ~FETCH_FAST_ITEMS) &&
+            !fetchargs->cidhash &&
+            !fetchargs->binsections && !fetchargs->sizesections &&
+            !fetchargs->bodysections && !fetchargs->fsections &&
+            !fetchargs->headers.count && !fetchargs->headers_not.count);
+}
+
+static void index_fetchreply_fast(struct index_state *state, uint32_t msgno,
+                                  const struct fetchargs *fetchargs)
+{
+    static struct buf buf = BUF_INITIALIZER;
+    struct index_map *im = &state->map[msgno-1];
+    int fetchitems = fetchargs->fetchitems;
+    int ischanged;
+    int sepchar = '(';
+
+    /* Check the modseq against changedsince */
+    if (fetchargs->changedsince && im->modseq <= fetchargs->changedsince)
+        return;
+
+    /* skip missing records entirely */
+    if (!im->recno)
+        return;
+
+    ischanged = im->told_modseq < im->modseq;
+
+    buf_reset(&buf);
+    buf_printf(&buf, "* %u FETCH ", msgno);
+    if (fetchitems & FETCH_FLAGS || ischanged) {
+        buf_appendcstr(&buf, "(FLAGS ");
+        index_appendflags(state, im, &buf);
+        im->told_modseq = im->modseq;
         sepchar = ' ';
     }
-    if (im->system_flags & FLAG_DELETED) {
-        prot_printf(state->out, "%c\\Deleted", sepchar);
+    if (fetchitems & FETCH_UID || (ischanged && (client_capa & CAPA_QRESYNC))) {
+        buf_printf(&buf, "%cUID %u", sepchar, im->uid);
         sepchar = ' ';
     }
-    if (im->isseen) {
-        prot_printf(state->out, "%c\\Seen", sepchar);
+    if (fetchitems & FETCH_MODSEQ || (ischanged && (client_capa & CAPA_CONDSTORE))) {
+        buf_printf(&buf, "%cMODSEQ (" MODSEQ_FMT ")", sepchar, im->modseq);
         sepchar = ' ';
     }
-    for (flag = 0; flag < VECTOR_SIZE(state->flagname); flag++) {
-        if ((flag & 31) == 0) {
-            flagmask = im->user_flags[flag/32];
-        }
-        if (state->flagname[flag] && (flagmask & (1<<(flag & 31)))) {
-            prot_printf(state->out, "%c%s", sepchar, state->flagname[flag]);
-            sepchar = ' ';
-        }
-    }
-    if (sepchar == '(') (void)prot_putc('(', state->out);
-    (void)prot_putc(')', state->out);
-    im->told_modseq = im->modseq;
+    buf_appendcstr(&buf, ")\r\n");
+
+    prot_putbuf(state->out, &buf);
 }
 
 static void index_printflags(struct index_state *state,
@@ -4066,16 +4682,25 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     }
 
     /* Open the message file if we're going to need it */
-    if ((fetchitems & (FETCH_HEADER|FETCH_TEXT|FETCH_SHA1|FETCH_RFC822)) ||
-        fetchargs->cache_atleast > record.cache_version ||
-        fetchargs->binsections || fetchargs->sizesections ||
-        fetchargs->bodysections) {
+    if (fetch_needs_message(fetchargs) ||
+        fetchargs->cache_atleast > record.cache_version) {
         if (mailbox_map_record(mailbox, &record, &buf)) {
             prot_printf(state->out, "* OK ");
             prot_printf(state->out, error_message(IMAP_NO_MSGGONE), msgno);
             prot_printf(state->out, "\r\n");
             return 0;
         }
+
+        /* big literals can go straight from the file to the socket */
+        if (config_getint(IMAPOPT_FETCH_SENDFILE_MINSIZE) > 0 &&
+            buf.len >= (size_t) config_getint(IMAPOPT_FETCH_SENDFILE_MINSIZE) &&
+            prot_can_sendfile(state->out)) {
+            int fd = open(mailbox_record_fname(mailbox, &record), O_RDONLY, 0);
+            if (fd != -1) {
+                state->fetch_msgfd = fd;
+                state->fetch_msgbase = buf.s;
+            }
+        }
     }
     int ischanged = im->told_modseq < record.modseq;
 
@@ -4158,7 +4783,9 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     }
     if ((fetchitems & FETCH_CID) &&
         config_getswitch(IMAPOPT_CONVERSATIONS)) {
-        struct buf buf = BUF_INITIALIZER;
+        char cidbuf[32];
+        struct buf buf;
+        buf_init_array(&buf, cidbuf);
         if (!record.cid)
             buf_appendcstr(&buf, "NIL");
         else
@@ -4206,7 +4833,9 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     if ((fetchitems & FETCH_BASECID) &&
         config_getswitch(IMAPOPT_CONVERSATIONS)) {
         mailbox_read_basecid(mailbox, &record);
-        struct buf buf = BUF_INITIALIZER;
+        char cidbuf[32];
+        struct buf buf;
+        buf_init_array(&buf, cidbuf);
         if (!record.basecid)
             buf_appendcstr(&buf, "NIL");
         else
@@ -4411,6 +5040,10 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
         /* finsh the response if we have one */
         prot_printf(state->out, ")\r\n");
     }
+    if (state->fetch_msgbase) {
+        close(state->fetch_msgfd);
+        state->fetch_msgbase = NULL;
+    }
     buf_free(&buf);
     if (body) {
         message_free_body(body);
@@ -4654,10 +5287,51 @@ EXPORTED int index_urlfetch(struct index_state *state, uint32_t msgno,
 /*
  * Helper function to perform a STORE command for flags.
  */
-static int index_storeflag(struct index_state *state,
-                           struct index_modified_flags *modified_flags,
-                           uint32_t msgno, msgrecord_t *msgrec,
-                           struct storeargs *storeargs)
+/*
+ * Would an add or remove of flags leave this message as it is?
+ * Only answers for those two operations; a replace goes through
+ * index_storeflag() regardless because of the ACL special cases.
+ */
+static int index_storeflag_isnoop(struct index_state *state, uint32_t msgno,
+                                  const struct index_record *record,
+                                  const struct storeargs *storeargs)
+{
+    struct index_map *im = &state->map[msgno-1];
+    uint32_t want = storeargs->system_flags & FLAGS_SYSTEM;
+    unsigned i;
+
+    switch (storeargs->operation) {
+    case STORE_ADD_FLAGS:
+        if (storeargs->seen && (state->myrights & ACL_SETSEEN) && !im->isseen)
+            return 0;
+        if (~record->system_flags & want)
+            return 0;
+        for (i = 0; i < (MAX_USER_FLAGS/32); i++) {
+            if (~record->user_flags[i] & storeargs->user_flags[i])
+                return 0;
+        }
+        return 1;
+
+    case STORE_REMOVE_FLAGS:
+        if (storeargs->seen && (state->myrights & ACL_SETSEEN) && im->isseen)
+            return 0;
+        if (record->system_flags & want)
+            return 0;
+        for (i = 0; i < (MAX_USER_FLAGS/32); i++) {
+            if (record->user_flags[i] & storeargs->user_flags[i])
+                return 0;
+        }
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+static int index_storeflag(struct index_state *state,
+                           struct index_modified_flags *modified_flags,
+                           uint32_t msgno, msgrecord_t *msgrec,
+                           struct storeargs *storeargs)
 {
     uint32_t old, new, keep;
     unsigned i;
@@ -4911,11 +5585,242 @@ EXPORTED int index_search_evaluate(struct index_state *state,
     return match;
 }
 
+static int columns_cmp_matches(enum search_op op, int cmp)
+{
+    switch (op) {
+    case SEOP_LT: return cmp < 0;
+    case SEOP_LE: return cmp <= 0;
+    case SEOP_GT: return cmp > 0;
+    case SEOP_GE: return cmp >= 0;
+    default:      return cmp == 0;
+    }
+}
+
+#define COLUMNS_SCAN(state, hits, test) do { \
+    uint32_t _msgno; \
+    for (_msgno = 1; _msgno <= (state)->exists; _msgno++) { \
+        uint32_t i = _msgno - 1; \
+        if (test) bv_set((hits), _msgno); \
+    } \
+} while (0)
+
+#define COLUMNS_CMP(a, b)   ((a) < (b) ? -1 : (a) > (b))
+
+static int index_columns_leaf(struct index_state *state,
+                              const search_expr_t *e,
+                              bitvector_t *hits)
+{
+    const struct index_columns *cols = state->columns;
+    const struct index_map *map = state->map;
+    const union search_value *v = &e->value;
+    enum search_op op = e->op;
+    const char *name = e->attr->name;
+    int ordinal = (op == SEOP_LT || op == SEOP_LE ||
+                   op == SEOP_GT || op == SEOP_GE);
+
+    if (op != SEOP_MATCH && op != SEOP_FUZZYMATCH && !ordinal)
+        return -1;
+
+    if (!strcmp(name, "systemflags")) {
+        if (ordinal) return -1;
+        COLUMNS_SCAN(state, hits, cols->system_flags[i] & v->u);
+    }
+    else if (!strcmp(name, "indexflags")) {
+        if (ordinal) return -1;
+        COLUMNS_SCAN(state, hits,
+                     ((v->u & MESSAGE_SEEN) && map[i].isseen) ||
+                     ((v->u & MESSAGE_RECENT) && map[i].isrecent));
+    }
+    else if (!strcmp(name, "keyword")) {
+        int num = (int)(unsigned long)e->internalised;
+        if (ordinal) return -1;
+        /* not a valid flag for this mailbox */
+        if (!num) return 0;
+        num--;
+        COLUMNS_SCAN(state, hits,
+                     map[i].user_flags[num/32] & (1U<<(num % 32)));
+    }
+    else if (!strcmp(name, "uid")) {
+        struct seqset *seq = e->internalised;
+        if (ordinal || !seq) return -1;
+        COLUMNS_SCAN(state, hits, seqset_ismember(seq, cols->uid[i]));
+    }
+    else if (!strcmp(name, "msgno")) {
+        struct seqset *seq = e->internalised;
+        if (ordinal || !seq) return -1;
+        COLUMNS_SCAN(state, hits, seqset_ismember(seq, i+1));
+    }
+    else if (!strcmp(name, "modseq")) {
+        COLUMNS_SCAN(state, hits,
+                     columns_cmp_matches(op, COLUMNS_CMP(cols->modseq[i], v->u)));
+    }
+    else if (!strcmp(name, "size")) {
+        COLUMNS_SCAN(state, hits,
+                     columns_cmp_matches(op, COLUMNS_CMP(cols->size[i], v->u)));
+    }
+    else if (!strcmp(name, "internaldate")) {
+        COLUMNS_SCAN(state, hits,
+                     columns_cmp_matches(op, COLUMNS_CMP(cols->internaldate[i], v->t)));
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void columns_setall(struct index_state *state, bitvector_t *hits)
+{
+    /* msgnos start at 1, bit 0 is never a message */
+    bv_setsize(hits, state->exists+1);
+    bv_setall(hits);
+    bv_clear(hits, 0);
+}
+
+/*
+ * Evaluate @e into @hits, combining the bitmaps of subexpressions
+ * with whole-word (and where the compiler allows, SIMD) operations.
+ * Nodes which the snapshot can't answer evaluate to "every message"
+ * and make the result a superset, which the caller narrows down by
+ * running the scalar evaluator over just the surviving messages.
+ */
+static int index_columns_eval(struct index_state *state,
+                              const search_expr_t *e,
+                              bitvector_t *hits)
+{
+    bitvector_t tmp = BV_INITIALIZER;
+    const search_expr_t *child;
+    int res = INDEX_COLUMNS_EXACT;
+    int r;
+
+    bv_setsize(hits, state->exists+1);
+    bv_clearall(hits);
+
+    switch (e->op) {
+    case SEOP_TRUE:
+        columns_setall(state, hits);
+        break;
+
+    case SEOP_FALSE:
+        break;
+
+    case SEOP_AND:
+        columns_setall(state, hits);
+        for (child = e->children ; child ; child = child->next) {
+            r = index_columns_eval(state, child, &tmp);
+            if (r == INDEX_COLUMNS_SUPERSET)
+                res = INDEX_COLUMNS_SUPERSET;
+            bv_andeq(hits, &tmp);
+        }
+        break;
+
+    case SEOP_OR:
+        for (child = e->children ; child ; child = child->next) {
+            r = index_columns_eval(state, child, &tmp);
+            if (r == INDEX_COLUMNS_SUPERSET)
+                res = INDEX_COLUMNS_SUPERSET;
+            bv_oreq(hits, &tmp);
+        }
+        break;
+
+    case SEOP_NOT:
+        assert(e->children);
+        r = index_columns_eval(state, e->children, hits);
+        if (r == INDEX_COLUMNS_EXACT) {
+            bv_invert(hits);
+            bv_clear(hits, 0);
+        }
+        else {
+            /* the complement of a superset tells us nothing */
+            columns_setall(state, hits);
+            res = INDEX_COLUMNS_SUPERSET;
+        }
+        break;
+
+    default:
+        if (!e->attr || index_columns_leaf(state, e, hits)) {
+            columns_setall(state, hits);
+            res = INDEX_COLUMNS_SUPERSET;
+        }
+        break;
+    }
+
+    bv_free(&tmp);
+    return res;
+}
+
+/*
+ * Evaluate the search expression @e against every message in the
+ * columnar snapshot at once, setting bit msgno in @hits for each
+ * matching message.  Returns
+ *
+ *  INDEX_COLUMNS_EXACT       @hits is exactly the set of matches
+ *  INDEX_COLUMNS_SUPERSET    @e has nodes the snapshot can't answer;
+ *                            only messages in @hits can match, and
+ *                            each must still be checked with
+ *                            index_search_evaluate()
+ *  INDEX_COLUMNS_NONE        the snapshot is disabled, or no use
+ *
+ * @e must already have been internalised against @state.
+ */
+EXPORTED int index_search_evaluate_columns(struct index_state *state,
+                                           const search_expr_t *e,
+                                           bitvector_t *hits)
+{
+    int r;
+
+    if (!state->columns || !e) return INDEX_COLUMNS_NONE;
+
+    r = index_columns_eval(state, e, hits);
+    if (r == INDEX_COLUMNS_EXACT) xstats_inc(SEARCH_EVALUATE_COLUMNS);
+
+    return r;
+}
+
+/*
+ * Order the evaluation of @e, which must already have been
+ * internalised against @state, by the estimated cost and selectivity
+ * of each criterion in this folder.  When @verbose, log the plan.
+ */
+EXPORTED void index_search_plan(struct index_state *state,
+                                search_expr_t *e, int verbose)
+{
+    struct search_plan_stats stats;
+    struct index_record record;
+    struct buf explain = BUF_INITIALIZER;
+
+    if (!e || !state->exists) return;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.exists = state->exists;
+    stats.last_uid = state->last_uid;
+    stats.unseen = state->numunseen;
+    stats.recent = state->numrecent;
+    stats.answered = state->mailbox->i.answered;
+    stats.flagged = state->mailbox->i.flagged;
+    stats.deleted = state->mailbox->i.deleted;
+
+    /* records are in UID order, which is near enough arrival order */
+    if (!index_reload_record(state, 1, &record))
+        stats.first_internaldate = record.internaldate;
+    if (!index_reload_record(state, state->exists, &record))
+        stats.last_internaldate = record.internaldate;
+
+    search_expr_plan(e, &stats, verbose ? &explain : NULL);
+
+    if (verbose) {
+        syslog(LOG_INFO, "Folder %s: search plan: %s",
+               state->mboxname, buf_cstring(&explain));
+        buf_free(&explain);
+    }
+}
+
 struct getsearchtext_rock
 {
     search_text_receiver_t *receiver;
     int indexed_headers;
     int charset_flags;
+    int snippet;
 };
 
 static void stuff_part(search_text_receiver_t *receiver,
@@ -5125,6 +6030,23 @@ static int getsearchtext_cb(int isbody, charset_t charset, int encoding,
             str->receiver->end_part(str->receiver, SEARCH_PART_BODY);
         }
     }
+    else if (attachextract_wanted(type, subtype)) {
+        /* PDF, office documents and the like: get their text from the
+         * extractor service, or just its cache when building snippets */
+        struct buf attachtext = BUF_INITIALIZER;
+
+        if (!attachextract_gettext(type, subtype, data, encoding,
+                                   /*cacheonly*/str->snippet, &attachtext) &&
+            buf_len(&attachtext)) {
+            charset_t utf8 = charset_lookupname("utf-8");
+            str->receiver->begin_part(str->receiver, SEARCH_PART_BODY);
+            charset_extract(extract_cb, str, &attachtext, utf8, 0, "plain",
+                            str->charset_flags);
+            str->receiver->end_part(str->receiver, SEARCH_PART_BODY);
+            charset_free(&utf8);
+        }
+        buf_free(&attachtext);
+    }
 
     return 0;
 }
@@ -5164,6 +6086,7 @@ EXPORTED int index_getsearchtext(message_t *msg,
     str.receiver = receiver;
     str.indexed_headers = 0;
     str.charset_flags = charset_flags;
+    str.snippet = snippet;
 
     if (snippet) {
         str.charset_flags |= CHARSET_SNIPPET;
@@ -5281,6 +6204,85 @@ static int index_copysetup(struct index_state *state, uint32_t msgno,
     return 0;
 }
 
+/*
+ * Precomputed sort keys, as stored in cyrus.sortkeys by
+ * mailbox_append_index_record().  The value is a version byte
+ * followed by NUL-terminated fields in sortkeys_field order;
+ * absent addresses are stored as empty strings.
+ */
+#define SORTKEYS_VERSION '1'
+
+enum sortkeys_field {
+    SORTKEYS_XSUBJ = 0,
+    SORTKEYS_REFWD,
+    SORTKEYS_FROM,
+    SORTKEYS_TO,
+    SORTKEYS_CC,
+    SORTKEYS_DISPLAYFROM,
+    SORTKEYS_DISPLAYTO,
+    SORTKEYS_NUMFIELDS
+};
+
+static void sortkeys_appendm(struct buf *value, char *s)
+{
+    if (s) buf_appendcstr(value, s);
+    buf_putc(value, '\0');
+    free(s);
+}
+
+EXPORTED int index_sortkeys_build(struct mailbox *mailbox,
+                                  const struct index_record *record,
+                                  struct buf *value)
+{
+    int is_refwd = 0;
+    char *xsubj;
+
+    if (mailbox_cacherecord(mailbox, record))
+        return IMAP_IOERROR;
+
+    xsubj = index_extract_subject(cacheitem_base(record, CACHE_SUBJECT),
+                                  cacheitem_size(record, CACHE_SUBJECT),
+                                  &is_refwd);
+
+    buf_reset(value);
+    buf_putc(value, SORTKEYS_VERSION);
+    sortkeys_appendm(value, xsubj);
+    buf_putc(value, is_refwd ? '1' : '0');
+    buf_putc(value, '\0');
+    sortkeys_appendm(value, get_localpart_addr(cacheitem_base(record, CACHE_FROM)));
+    sortkeys_appendm(value, get_localpart_addr(cacheitem_base(record, CACHE_TO)));
+    sortkeys_appendm(value, get_localpart_addr(cacheitem_base(record, CACHE_CC)));
+    sortkeys_appendm(value, get_displayname(cacheitem_base(record, CACHE_FROM)));
+    sortkeys_appendm(value, get_displayname(cacheitem_base(record, CACHE_TO)));
+
+    return 0;
+}
+
+/* split a stored value into its fields; returns 0 on success */
+static int sortkeys_parse(const char *val, size_t len,
+                          const char *fields[SORTKEYS_NUMFIELDS])
+{
+    const char *p = val, *end = val + len;
+    int i;
+
+    if (!len || *p++ != SORTKEYS_VERSION)
+        return IMAP_MAILBOX_BADFORMAT;
+
+    for (i = 0; i < SORTKEYS_NUMFIELDS; i++) {
+        const char *nul = memchr(p, '\0', end - p);
+        if (!nul) return IMAP_MAILBOX_BADFORMAT;
+        fields[i] = p;
+        p = nul + 1;
+    }
+
+    return 0;
+}
+
+static char *sortkeys_dup(const char *s)
+{
+    return *s ? xstrdup(s) : NULL;
+}
+
 /*
  * Creates a list, and optionally also an array of pointers to, of msgdata.
  *
@@ -5302,9 +6304,13 @@ MsgData **index_msgdata_load(struct index_state *state,
     struct index_record record;
     struct conversations_state *cstate = NULL;
     conversation_t conv = CONVERSATION_INIT;
+    const char *keys[SORTKEYS_NUMFIELDS];
+    int use_sortkeys, did_keys, r;
 
     if (!n) return NULL;
 
+    use_sortkeys = mailbox_sortkeys_enabled(mailbox);
+
     /* create an array of MsgData */
     ptrs = (MsgData **) xzmalloc(n * sizeof(MsgData *) + n * sizeof(MsgData));
     md = (MsgData *)(ptrs + n);
@@ -5334,12 +6340,61 @@ MsgData **index_msgdata_load(struct index_state *state,
         /* useful for convupdates */
         cur->modseq = record.modseq;
 
-        did_cache = did_env = did_conv = 0;
+        did_cache = did_env = did_conv = did_keys = 0;
         tmpenv = NULL;
 
         for (j = 0; sortcrit[j].key; j++) {
             label = sortcrit[j].key;
 
+            if ((label == SORT_CC ||
+                 label == SORT_FROM || label == SORT_SUBJECT ||
+                 label == SORT_TO ||
+                 label == SORT_DISPLAYFROM || label == SORT_DISPLAYTO) &&
+                use_sortkeys && !did_keys) {
+                const char *val;
+                size_t vallen;
+
+                /* a missing or stale entry just means reading the cache */
+                did_keys = -1;
+                r = mailbox_lookup_sortkeys(mailbox, record.uid, &val, &vallen);
+                if (r == IMAP_IOERROR)
+                    use_sortkeys = 0; /* no cyrus.sortkeys at all */
+                else if (!r && !sortkeys_parse(val, vallen, keys))
+                    did_keys = 1;
+            }
+
+            if (did_keys > 0) {
+                int done = 1;
+
+                switch (label) {
+                case SORT_CC:
+                    cur->cc = sortkeys_dup(keys[SORTKEYS_CC]);
+                    break;
+                case SORT_FROM:
+                    cur->from = sortkeys_dup(keys[SORTKEYS_FROM]);
+                    break;
+                case SORT_SUBJECT:
+                    cur->xsubj = xstrdup(keys[SORTKEYS_XSUBJ]);
+                    cur->xsubj_hash = strhash(cur->xsubj);
+                    cur->is_refwd = (keys[SORTKEYS_REFWD][0] == '1');
+                    break;
+                case SORT_TO:
+                    cur->to = sortkeys_dup(keys[SORTKEYS_TO]);
+                    break;
+                case SORT_DISPLAYFROM:
+                    cur->displayfrom = sortkeys_dup(keys[SORTKEYS_DISPLAYFROM]);
+                    break;
+                case SORT_DISPLAYTO:
+                    cur->displayto = sortkeys_dup(keys[SORTKEYS_DISPLAYTO]);
+                    break;
+                default:
+                    done = 0;
+                    break;
+                }
+
+                if (done) continue;
+            }
+
             if ((label == SORT_CC ||
                  label == SORT_FROM || label == SORT_SUBJECT ||
                  label == SORT_TO || label == LOAD_IDS ||
@@ -5412,11 +6467,11 @@ MsgData **index_msgdata_load(struct index_state *state,
             case SORT_ANNOTATION: {
                 struct buf value = BUF_INITIALIZER;
 
-                annotatemore_msg_lookup(state->mboxname,
-                                        record.uid,
-                                        sortcrit[j].args.annot.entry,
-                                        sortcrit[j].args.annot.userid,
-                                        &value);
+                mailbox_annotation_lookup_record(mailbox,
+                                                 &record,
+                                                 sortcrit[j].args.annot.entry,
+                                                 sortcrit[j].args.annot.userid,
+                                                 &value);
 
                 /* buf_release() never returns NULL, so if the lookup
                  * fails for any reason we just get an empty string here */
@@ -5481,18 +6536,14 @@ MsgData **index_msgdata_load(struct index_state *state,
 
 static char *get_localpart_addr(const char *header)
 {
-    struct address *addr = NULL;
-    char *ret = NULL;
+    static struct buf copy = BUF_INITIALIZER;
+    struct address addr;
 
-    parseaddr_list(header, &addr);
-    if (!addr) return NULL;
+    /* only the first address is wanted: parse a scratch copy in place */
+    buf_setcstr(&copy, header);
+    if (!parseaddr_list_inplace(copy.s, &addr, 1)) return NULL;
 
-    if (addr->mailbox)
-        ret = xstrdup(addr->mailbox);
-
-    parseaddr_free(addr);
-
-    return ret;
+    return xstrdupnull(addr.mailbox);
 }
 
 /*
@@ -5500,12 +6551,14 @@ static char *get_localpart_addr(const char *header)
  */
 static char *get_displayname(const char *header)
 {
-    struct address *addr = NULL;
+    static struct buf copy = BUF_INITIALIZER;
+    struct address addrbuf, *addr = &addrbuf;
     char *ret = NULL;
     char *p;
 
-    parseaddr_list(header, &addr);
-    if (!addr) return NULL;
+    /* only the first address is wanted: parse a scratch copy in place */
+    buf_setcstr(&copy, header);
+    if (!parseaddr_list_inplace(copy.s, addr, 1)) return NULL;
 
     if (addr->name && addr->name[0]) {
         /* pure RFC5255 compatible "searchform" conversion */
@@ -5524,8 +6577,6 @@ static char *get_displayname(const char *header)
             *p = toupper(*p);
     }
 
-    parseaddr_free(addr);
-
     return ret;
 }
 
@@ -6028,33 +7079,117 @@ static int index_sort_compare_reverse_flagged(const void *v1, const void *v2)
     return message_guid_cmp(&md1->guid, &md2->guid);
 }
 
+/* Pick the qsort() comparison function for sortcrit */
+static int (*index_msgdata_sortfn(const struct sortcrit *sortcrit))
+    (const void *, const void *)
+{
+    if (sortcrit_is_uid(sortcrit))
+        return index_sort_compare_uid;
+    if (sortcrit_is_reverse_uid(sortcrit))
+        return index_sort_compare_reverse_uid;
+    if (sortcrit_is_modseq(sortcrit))
+        return index_sort_compare_modseq;
+    if (sortcrit_is_arrival(sortcrit))
+        return index_sort_compare_arrival;
+    if (sortcrit_is_reverse_arrival(sortcrit))
+        return index_sort_compare_reverse_arrival;
+    if (sortcrit_is_reverse_flagged(sortcrit))
+        return index_sort_compare_reverse_flagged;
+
+    char *tmp = sortcrit_as_string(sortcrit);
+    syslog(LOG_DEBUG, "GENERICSORT: %s", tmp);
+    free(tmp);
+    the_sortcrit = (struct sortcrit *)sortcrit;
+    return index_sort_compare_generic_qsort;
+}
+
 void index_msgdata_sort(MsgData **msgdata, int n, const struct sortcrit *sortcrit)
 {
-    if (sortcrit_is_uid(sortcrit)) {
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_uid);
-    }
-    else if (sortcrit_is_reverse_uid(sortcrit)) {
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_reverse_uid);
-    }
-    else if (sortcrit_is_modseq(sortcrit)) {
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_modseq);
-    }
-    else if (sortcrit_is_arrival(sortcrit)) {
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_arrival);
-    }
-    else if (sortcrit_is_reverse_arrival(sortcrit)) {
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_reverse_arrival);
-    }
-    else if (sortcrit_is_reverse_flagged(sortcrit)) {
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_reverse_flagged);
-    }
-    else {
-        char *tmp = sortcrit_as_string(sortcrit);
-        syslog(LOG_DEBUG, "GENERICSORT: %s", tmp);
-        free(tmp);
-        the_sortcrit = (struct sortcrit *)sortcrit;
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_generic_qsort);
+    qsort(msgdata, n, sizeof(MsgData *), index_msgdata_sortfn(sortcrit));
+}
+
+static void msgdata_heap_siftdown(struct msgdata_heap *heap, unsigned int i)
+{
+    MsgData *md = heap->data[i];
+
+    for (;;) {
+        unsigned int child = 2*i + 1;
+
+        if (child >= heap->n) break;
+        if (child + 1 < heap->n &&
+            heap->cmp(&heap->data[child+1], &heap->data[child]) < 0)
+            child++;
+        if (heap->cmp(&heap->data[child], &md) >= 0) break;
+
+        heap->data[i] = heap->data[child];
+        i = child;
     }
+
+    heap->data[i] = md;
+}
+
+/*
+ * Sort msgdata lazily: arrange it as a heap in O(n), after which each
+ * index_msgdata_heappop() returns the next message in the order
+ * index_msgdata_sort() would have given, in O(log n).  Cheaper than a
+ * full sort when only the first few messages are wanted.
+ */
+static void index_msgdata_heapify(struct msgdata_heap *heap,
+                                  MsgData **msgdata, unsigned int n,
+                                  const struct sortcrit *sortcrit)
+{
+    unsigned int i;
+
+    heap->data = msgdata;
+    heap->n = n;
+    heap->cmp = index_msgdata_sortfn(sortcrit);
+
+    for (i = n / 2; i-- > 0; )
+        msgdata_heap_siftdown(heap, i);
+}
+
+static MsgData *index_msgdata_heappop(struct msgdata_heap *heap)
+{
+    MsgData *md;
+
+    if (!heap->n) return NULL;
+
+    /* popped messages collect at the end of the array, so it stays
+     * fit for index_msgdata_free() */
+    md = heap->data[0];
+    heap->data[0] = heap->data[--heap->n];
+    heap->data[heap->n] = md;
+    if (heap->n) msgdata_heap_siftdown(heap, 0);
+
+    return md;
+}
+
+/*
+ * Compare two MsgData in the order given by sortcrit, like
+ * index_msgdata_sort() would.
+ */
+int index_msgdata_compare(MsgData *md1, MsgData *md2,
+                          const struct sortcrit *sortcrit)
+{
+    return index_sort_compare(md1, md2, sortcrit);
+}
+
+/*
+ * Free the data held by a single MsgData, but not the MsgData itself
+ */
+void index_msgdata_fini(MsgData *md)
+{
+    xfree(md->cc);
+    xfree(md->from);
+    xfree(md->to);
+    xfree(md->displayfrom);
+    xfree(md->displayto);
+    xfree(md->xsubj);
+    xfree(md->msgid);
+    xfree(md->listid);
+    xfree(md->contenttype);
+    strarray_fini(&md->ref);
+    strarray_fini(&md->annot);
 }
 
 /*
@@ -6071,17 +7206,7 @@ void index_msgdata_free(MsgData **msgdata, unsigned int n)
 
         if (!md) continue;
 
-        xfree(md->cc);
-        xfree(md->from);
-        xfree(md->to);
-        xfree(md->displayfrom);
-        xfree(md->displayto);
-        xfree(md->xsubj);
-        xfree(md->msgid);
-        xfree(md->listid);
-        xfree(md->contenttype);
-        strarray_fini(&md->ref);
-        strarray_fini(&md->annot);
+        index_msgdata_fini(md);
     }
     free(msgdata);
 }
@@ -6799,6 +7924,205 @@ static void index_thread_search(struct index_state *state,
     }
 }
 
+/*
+ * Per-session cache for the REFERENCES algorithms.
+ *
+ * Webmail clients tend to re-issue the same THREAD command on every
+ * refresh.  The expensive part is loading and parsing the envelope and
+ * References of every message, which never changes for a given UID, so
+ * we keep the loaded MsgData around (keyed by UID) and only load the
+ * messages appended since the last command.  We also keep the last
+ * forest, and if the threaded message set (MSN and UID) is unchanged
+ * we just print it again.
+ */
+struct threadcache_block {
+    MsgData **msgdata;
+    unsigned n;
+};
+
+struct threadcache_entry {
+    uint32_t uid;
+    MsgData *md;
+};
+
+struct index_threadcache {
+    const struct sortcrit *loadcrit;    /* what the MsgData was loaded with */
+    uint32_t uidvalidity;
+
+    /* loaded MsgData, sorted by uid, pointing into blocks */
+    struct threadcache_entry *entries;
+    unsigned nentries;
+    struct threadcache_block *blocks;
+    unsigned nblocks;
+
+    /* the last forest, and the messages it was built from */
+    const struct sortcrit *sortcrit;
+    uint32_t *msgnos;
+    uint32_t *uids;
+    unsigned nmsg;
+    struct rootset rootset;
+    MsgData **thrdata;
+};
+
+static void threadcache_free_forest(struct index_threadcache *tc)
+{
+    free(tc->rootset.root);
+    index_msgdata_free(tc->thrdata, tc->rootset.nroot);
+    free(tc->msgnos);
+    free(tc->uids);
+    tc->rootset.root = NULL;
+    tc->rootset.nroot = 0;
+    tc->thrdata = NULL;
+    tc->msgnos = tc->uids = NULL;
+    tc->nmsg = 0;
+    tc->sortcrit = NULL;
+}
+
+static void threadcache_reset(struct index_threadcache *tc)
+{
+    unsigned i;
+
+    threadcache_free_forest(tc);
+
+    for (i = 0; i < tc->nblocks; i++)
+        index_msgdata_free(tc->blocks[i].msgdata, tc->blocks[i].n);
+    free(tc->blocks);
+    free(tc->entries);
+    tc->blocks = NULL;
+    tc->nblocks = 0;
+    tc->entries = NULL;
+    tc->nentries = 0;
+}
+
+static void index_threadcache_free(struct index_threadcache **tcp)
+{
+    struct index_threadcache *tc = *tcp;
+
+    if (!tc) return;
+
+    threadcache_reset(tc);
+    free(tc);
+
+    *tcp = NULL;
+}
+
+static int threadcache_entry_cmp(const void *a, const void *b)
+{
+    const struct threadcache_entry *ea = a, *eb = b;
+
+    if (ea->uid < eb->uid) return -1;
+    if (ea->uid > eb->uid) return 1;
+    return 0;
+}
+
+static MsgData *threadcache_lookup(struct index_threadcache *tc, uint32_t uid)
+{
+    struct threadcache_entry key = { uid, NULL }, *e;
+
+    if (!tc->nentries) return NULL;
+
+    e = bsearch(&key, tc->entries, tc->nentries,
+                sizeof(struct threadcache_entry), threadcache_entry_cmp);
+
+    return e ? e->md : NULL;
+}
+
+/*
+ * Return (and take ownership of) the MsgData array for msgno_list,
+ * loading only the messages which the cache doesn't already have.
+ */
+static MsgData **threadcache_msgdata(struct index_state *state,
+                                     struct index_threadcache *tc,
+                                     unsigned *msgno_list, unsigned nmsg,
+                                     const struct sortcrit loadcrit[])
+{
+    MsgData **msgdata = xmalloc(nmsg * sizeof(MsgData *));
+    unsigned *missing = NULL, *missing_pos = NULL;
+    unsigned nmissing = 0, mi;
+
+    /* a different algorithm loaded different fields; too many dead
+     * messages (expunged, or no longer matching) costs memory */
+    if (tc->loadcrit != loadcrit ||
+        tc->uidvalidity != state->mailbox->i.uidvalidity ||
+        tc->nentries + nmsg > 2 * state->exists + 1024) {
+        threadcache_reset(tc);
+        tc->loadcrit = loadcrit;
+        tc->uidvalidity = state->mailbox->i.uidvalidity;
+    }
+
+    for (mi = 0; mi < nmsg; mi++) {
+        msgdata[mi] = threadcache_lookup(tc, index_getuid(state, msgno_list[mi]));
+        if (!msgdata[mi]) {
+            if (!missing) {
+                missing = xmalloc(nmsg * sizeof(unsigned));
+                missing_pos = xmalloc(nmsg * sizeof(unsigned));
+            }
+            missing_pos[nmissing] = mi;
+            missing[nmissing++] = msgno_list[mi];
+        }
+    }
+
+    if (nmissing) {
+        struct threadcache_block *block;
+        unsigned i;
+
+        tc->blocks = xrealloc(tc->blocks, (tc->nblocks + 1) *
+                              sizeof(struct threadcache_block));
+        block = &tc->blocks[tc->nblocks++];
+        block->msgdata = index_msgdata_load(state, missing, nmissing,
+                                            loadcrit, 0, NULL);
+        block->n = nmissing;
+
+        tc->entries = xrealloc(tc->entries, (tc->nentries + nmissing) *
+                               sizeof(struct threadcache_entry));
+        for (i = 0; i < nmissing; i++) {
+            MsgData *md = block->msgdata[i];
+
+            msgdata[missing_pos[i]] = md;
+
+            /* a record we failed to read has no uid; retry it next time */
+            if (!md->uid) continue;
+
+            tc->entries[tc->nentries].uid = md->uid;
+            tc->entries[tc->nentries].md = md;
+            tc->nentries++;
+        }
+        qsort(tc->entries, tc->nentries, sizeof(struct threadcache_entry),
+              threadcache_entry_cmp);
+    }
+
+    /* MSNs move around as messages are expunged */
+    for (mi = 0; mi < nmsg; mi++)
+        msgdata[mi]->msgno = msgno_list[mi];
+
+    free(missing);
+    free(missing_pos);
+    return msgdata;
+}
+
+/* is the cached forest for exactly these messages? */
+static int threadcache_forest_matches(struct index_state *state,
+                                      struct index_threadcache *tc,
+                                      unsigned *msgno_list, unsigned nmsg,
+                                      const struct sortcrit loadcrit[],
+                                      const struct sortcrit sortcrit[])
+{
+    unsigned mi;
+
+    if (!tc->rootset.root || tc->loadcrit != loadcrit ||
+        tc->sortcrit != sortcrit || tc->nmsg != nmsg ||
+        tc->uidvalidity != state->mailbox->i.uidvalidity)
+        return 0;
+
+    for (mi = 0; mi < nmsg; mi++) {
+        if (tc->msgnos[mi] != msgno_list[mi] ||
+            tc->uids[mi] != index_getuid(state, msgno_list[mi]))
+            return 0;
+    }
+
+    return 1;
+}
+
 /*
  * Guts of the REFERENCES algorithms.  Behavior is tweaked with loadcrit[],
  * threadproc(), searchproc() and sortcrit[].
@@ -6816,9 +8140,27 @@ static void _index_thread_ref(struct index_state *state, unsigned *msgno_list,
     Thread *newnode;
     struct hash_table id_table;
     struct rootset rootset;
+    struct index_threadcache *tc = NULL;
 
-    /* Create/load the msgdata array */
-    msgdata = index_msgdata_load(state, msgno_list, nmsg, loadcrit, 0, NULL);
+    if (config_getswitch(IMAPOPT_THREAD_CACHE) && !searchproc) {
+        if (!state->threadcache)
+            state->threadcache = xzmalloc(sizeof(struct index_threadcache));
+        tc = state->threadcache;
+
+        if (threadcache_forest_matches(state, tc, msgno_list, nmsg,
+                                       loadcrit, sortcrit)) {
+            xstats_inc(THREAD_CACHE_HIT);
+            index_thread_print(state, tc->rootset.root, usinguid);
+            return;
+        }
+
+        threadcache_free_forest(tc);
+        msgdata = threadcache_msgdata(state, tc, msgno_list, nmsg, loadcrit);
+    }
+    else {
+        /* Create/load the msgdata array */
+        msgdata = index_msgdata_load(state, msgno_list, nmsg, loadcrit, 0, NULL);
+    }
 
     /* calculate the sum of the number of references for all messages */
     for (mi = 0, tref = 0 ; mi < nmsg ; mi++)
@@ -6878,6 +8220,22 @@ static void _index_thread_ref(struct index_state *state, unsigned *msgno_list,
     /* Output the threaded messages */
     index_thread_print(state, rootset.root, usinguid);
 
+    if (tc) {
+        /* keep the forest; the cache owns the per-message MsgData */
+        tc->rootset = rootset;
+        tc->thrdata = thrdata;
+        tc->sortcrit = sortcrit;
+        tc->nmsg = nmsg;
+        tc->msgnos = xmalloc(nmsg * sizeof(uint32_t));
+        tc->uids = xmalloc(nmsg * sizeof(uint32_t));
+        for (mi = 0; mi < nmsg; mi++) {
+            tc->msgnos[mi] = msgno_list[mi];
+            tc->uids[mi] = index_getuid(state, msgno_list[mi]);
+        }
+        free(msgdata);
+        return;
+    }
+
     /* free the thread array */
     free(rootset.root);
 
@@ -6956,12 +8314,19 @@ static MsgData **refs_thread_proc(struct rootset *rootset,
     /* Find most recent internaldate in each thread */
     cur = rootset->root->child;
     while (cur) {
-        /* If the message is a dummy, assign it MsgData for sorting */
+        /* Give every root its own MsgData for sorting, so that we don't
+         * scribble over the message's real dates (which the thread
+         * cache may reuse) */
         if (!cur->msgdata) {
-            cur->msgdata = ptrs[i] = &md[i];
-            i++;
-            cur->msgdata->internaldate = cur->child->msgdata->internaldate;
+            md[i].internaldate = cur->child->msgdata->internaldate;
         }
+        else {
+            md[i].uid = cur->msgdata->uid;
+            md[i].msgno = cur->msgdata->msgno;
+            md[i].internaldate = cur->msgdata->internaldate;
+        }
+        cur->msgdata = ptrs[i] = &md[i];
+        i++;
         cur->msgdata->sentdate = 0; /* force date sort to use internaldate */
 
         find_most_recent(cur, cur->msgdata);
@@ -7037,8 +8402,13 @@ static void massage_header(char *hdr)
     hdr[n] = '\0';
 }
 
-EXPORTED extern struct nntp_overview *index_overview(struct index_state *state,
-                                                     uint32_t msgno)
+static unsigned long record_getlines(struct mailbox *mailbox,
+                                     struct index_record *record);
+
+/* fill in an overview from the cache; the result is only valid until
+ * the next call */
+static struct nntp_overview *overview_from_record(struct mailbox *mailbox,
+                                                  struct index_record *record)
 {
     static struct nntp_overview over;
     static char *env = NULL, *from = NULL, *hdr = NULL;
@@ -7047,43 +8417,38 @@ EXPORTED extern struct nntp_overview *index_overview(struct index_state *state,
     char *envtokens[NUMENVTOKENS];
     struct address addr = { NULL, NULL, NULL, NULL, NULL, NULL, 0 };
     strarray_t refhdr = STRARRAY_INITIALIZER;
-    struct mailbox *mailbox = state->mailbox;
-    struct index_record record;
 
     /* flush any previous data */
     memset(&over, 0, sizeof(struct nntp_overview));
 
-    if (index_reload_record(state, msgno, &record))
-        return NULL;
-
-    if (mailbox_cacherecord(mailbox, &record))
+    if (mailbox_cacherecord(mailbox, record))
         return NULL; /* upper layers can cope! */
 
     /* make a working copy of envelope; strip outer ()'s */
     /* -2 -> don't include the size of the outer parens */
     /* +1 -> leave space for NUL */
-    size = cacheitem_size(&record, CACHE_ENVELOPE) - 2 + 1;
+    size = cacheitem_size(record, CACHE_ENVELOPE) - 2 + 1;
     if (envsize < size) {
         envsize = size;
         env = xrealloc(env, envsize);
     }
     /* +1 -> skip the leading paren */
-    strlcpy(env, cacheitem_base(&record, CACHE_ENVELOPE) + 1, size);
+    strlcpy(env, cacheitem_base(record, CACHE_ENVELOPE) + 1, size);
 
     /* make a working copy of headers */
-    size = cacheitem_size(&record, CACHE_HEADERS);
+    size = cacheitem_size(record, CACHE_HEADERS);
     if (hdrsize < size+2) {
         hdrsize = size+100;
         hdr = xrealloc(hdr, hdrsize);
     }
-    memcpy(hdr, cacheitem_base(&record, CACHE_HEADERS), size);
+    memcpy(hdr, cacheitem_base(record, CACHE_HEADERS), size);
     hdr[size] = '\0';
 
     parse_cached_envelope(env, envtokens, VECTOR_SIZE(envtokens));
 
-    over.uid = record.uid;
-    over.bytes = record.size;
-    over.lines = index_getlines(state, msgno);
+    over.uid = record->uid;
+    over.bytes = record->size;
+    over.lines = record_getlines(mailbox, record);
     over.date = envtokens[ENV_DATE];
     over.msgid = envtokens[ENV_MSGID];
 
@@ -7125,6 +8490,157 @@ EXPORTED extern struct nntp_overview *index_overview(struct index_state *state,
     return &over;
 }
 
+/*
+ * Overview as stored in cyrus.overview by mailbox_update_overview():
+ * a version byte, then NUL-terminated subject, from, date, msgid,
+ * references, bytes and lines.
+ */
+#define OVERVIEW_VERSION '1'
+
+EXPORTED int index_overview_build(struct mailbox *mailbox,
+                                  const struct index_record *record,
+                                  struct buf *value)
+{
+    struct index_record copy = *record;
+    struct nntp_overview *over = overview_from_record(mailbox, &copy);
+
+    if (!over) return IMAP_IOERROR;
+
+    buf_reset(value);
+    buf_putc(value, OVERVIEW_VERSION);
+    buf_appendcstr(value, over->subj ? over->subj : "");
+    buf_putc(value, '\0');
+    buf_appendcstr(value, over->from ? over->from : "");
+    buf_putc(value, '\0');
+    buf_appendcstr(value, over->date ? over->date : "");
+    buf_putc(value, '\0');
+    buf_appendcstr(value, over->msgid ? over->msgid : "");
+    buf_putc(value, '\0');
+    buf_appendcstr(value, over->ref ? over->ref : "");
+    buf_putc(value, '\0');
+    buf_printf(value, "%lu", over->bytes);
+    buf_putc(value, '\0');
+    buf_printf(value, "%lu", over->lines);
+    buf_putc(value, '\0');
+
+    return 0;
+}
+
+/* split a stored overview into 'over', pointing into 'copy' */
+static int overview_parse(uint32_t uid, const char *val, size_t len,
+                          struct buf *copy, struct nntp_overview *over)
+{
+    char *fields[7];
+    char *p, *end;
+    int i;
+
+    if (!len || *val != OVERVIEW_VERSION) return -1;
+
+    buf_setmap(copy, val + 1, len - 1);
+    p = (char *) buf_cstring(copy);
+    end = p + buf_len(copy);
+
+    for (i = 0; i < 7; i++) {
+        if (p >= end) return -1;
+        fields[i] = p;
+        p += strlen(p) + 1;
+    }
+
+    memset(over, 0, sizeof(struct nntp_overview));
+    over->uid = uid;
+    if (*fields[0]) over->subj = fields[0];
+    if (*fields[1]) over->from = fields[1];
+    if (*fields[2]) over->date = fields[2];
+    if (*fields[3]) over->msgid = fields[3];
+    if (*fields[4]) over->ref = fields[4];
+    over->bytes = strtoul(fields[5], NULL, 10);
+    over->lines = strtoul(fields[6], NULL, 10);
+
+    return 0;
+}
+
+EXPORTED extern struct nntp_overview *index_overview(struct index_state *state,
+                                                     uint32_t msgno)
+{
+    struct index_record record;
+
+    if (index_reload_record(state, msgno, &record))
+        return NULL;
+
+    return overview_from_record(state->mailbox, &record);
+}
+
+struct overview_range_rock {
+    struct index_state *state;
+    uint32_t msgno;
+    uint32_t last_msgno;
+    index_overview_cb_t *proc;
+    void *rock;
+    struct buf copy;
+};
+
+/* send anything before 'uid' which isn't in the database the slow way */
+static void overview_catchup(struct overview_range_rock *orock, uint32_t uid)
+{
+    struct nntp_overview *over;
+
+    while (orock->msgno <= orock->last_msgno &&
+           index_getuid(orock->state, orock->msgno) < uid) {
+        if ((over = index_overview(orock->state, orock->msgno)))
+            orock->proc(over, orock->rock);
+        orock->msgno++;
+    }
+}
+
+static int overview_range_cb(uint32_t uid, const char *val, size_t len,
+                             void *rock)
+{
+    struct overview_range_rock *orock = rock;
+    struct nntp_overview over, *slow;
+
+    overview_catchup(orock, uid);
+
+    if (orock->msgno > orock->last_msgno)
+        return CYRUSDB_DONE;
+
+    /* not in our view of the mailbox */
+    if (index_getuid(orock->state, orock->msgno) != uid)
+        return 0;
+
+    if (!overview_parse(uid, val, len, &orock->copy, &over))
+        orock->proc(&over, orock->rock);
+    else if ((slow = index_overview(orock->state, orock->msgno)))
+        orock->proc(slow, orock->rock);
+    orock->msgno++;
+
+    return 0;
+}
+
+/*
+ * Call 'proc' with the overview of each message from 'msgno' to
+ * 'last_msgno', from cyrus.overview where it's there and from the
+ * cache where it isn't.
+ */
+EXPORTED void index_overview_range(struct index_state *state,
+                                   uint32_t msgno, uint32_t last_msgno,
+                                   index_overview_cb_t *proc, void *rock)
+{
+    struct overview_range_rock orock =
+        { state, msgno, last_msgno, proc, rock, BUF_INITIALIZER };
+
+    if (msgno > last_msgno) return;
+
+    if (mailbox_overview_enabled(state->mailbox)) {
+        mailbox_foreach_overview(state->mailbox,
+                                 index_getuid(state, msgno),
+                                 index_getuid(state, last_msgno),
+                                 overview_range_cb, &orock);
+    }
+
+    overview_catchup(&orock, UINT32_MAX);
+    buf_free(&orock.copy);
+}
+
 EXPORTED extern char *index_getheader(struct index_state *state,
                                       uint32_t msgno, char *hdr)
 {
@@ -7177,20 +8693,16 @@ EXPORTED extern unsigned long index_getsize(struct index_state *state,
     return record.size;
 }
 
-EXPORTED extern unsigned long index_getlines(struct index_state *state,
-                                             uint32_t msgno)
+static unsigned long record_getlines(struct mailbox *mailbox,
+                                     struct index_record *record)
 {
-    struct index_record record;
     struct body *body = NULL;
     unsigned long lines = 0;
 
-    if (index_reload_record(state, msgno, &record))
-        return 0;
-
-    if (mailbox_cacherecord(state->mailbox, &record))
+    if (mailbox_cacherecord(mailbox, record))
         return 0;
 
-    message_read_bodystructure(&record, &body);
+    message_read_bodystructure(record, &body);
     if (!body) return 0;
 
     lines = body->content_lines;
@@ -7201,6 +8713,17 @@ EXPORTED extern unsigned long index_getlines(struct index_state *state,
     return lines;
 }
 
+EXPORTED extern unsigned long index_getlines(struct index_state *state,
+                                             uint32_t msgno)
+{
+    struct index_record record;
+
+    if (index_reload_record(state, msgno, &record))
+        return 0;
+
+    return record_getlines(state->mailbox, &record);
+}
+
 EXPORTED const char *index_mboxname(const struct index_state *state)
 {
     if (!state) return NULL;
@@ -56,6 +56,7 @@
 #include <netinet/in.h>
 
 #include "annotate.h" /* for strlist functionality */
+#include "bitvector.h"
 #include "search_engines.h"
 #include "message_guid.h"
 #include "sequence.h"
@@ -106,6 +107,20 @@ struct index_map {
     unsigned int isrecent:1;
 };
 
+/* Structure-of-arrays snapshot of the per-message fields which the
+ * search and sequence code scan for every message.  Indexed by
+ * msgno-1 like the map, rebuilt on refresh and kept in step with
+ * the map, so that flag, date and size filters become linear scans
+ * over contiguous arrays instead of walks over the full map */
+struct index_columns {
+    unsigned alloc;
+    uint32_t *uid;
+    modseq_t *modseq;
+    uint32_t *system_flags;
+    time_t *internaldate;
+    uint32_t *size;
+};
+
 struct index_state {
     struct mailbox *mailbox;
     unsigned num_records;
@@ -119,6 +134,10 @@ struct index_state {
     modseq_t delayed_modseq;
     struct index_map *map;
     unsigned mapsize;
+    struct index_columns *columns; /* NULL unless search_columnar */
+    struct index_threadcache *threadcache; /* NULL unless thread_cache */
+    const char *fetch_msgbase;  /* message mapped by index_fetchreply() ... */
+    int fetch_msgfd;            /* ... and its open file, for prot_sendfile() */
     int internalseen;
     int skipped_expunge;
     int seen_dirty;
@@ -220,7 +239,9 @@ enum index_warmup_flags
     WARMUP_CONVERSATIONS    = (1<<1),
     WARMUP_ANNOTATIONS      = (1<<2),
     WARMUP_SEARCH           = (1<<3),
-    WARMUP_ALL              = (~WARMUP_SEARCH)
+    WARMUP_CACHE            = (1<<4),
+    /* search and cache files can be large, ask for them explicitly */
+    WARMUP_ALL              = (~(WARMUP_SEARCH|WARMUP_CACHE))
 };
 
 /* non-locking, non-updating - just do a fetch on the state
@@ -303,6 +324,10 @@ extern char *index_get_msgid(struct index_state *state, uint32_t msgno);
 extern struct message *index_get_message(struct index_state *state, uint32_t msgno);
 extern struct nntp_overview *index_overview(struct index_state *state,
                                             uint32_t msgno);
+typedef void index_overview_cb_t(struct nntp_overview *over, void *rock);
+extern void index_overview_range(struct index_state *state,
+                                 uint32_t msgno, uint32_t last_msgno,
+                                 index_overview_cb_t *proc, void *rock);
 extern char *index_getheader(struct index_state *state, uint32_t msgno,
                              char *hdr);
 extern unsigned long index_getsize(struct index_state *state, uint32_t msgno);
@@ -322,10 +347,31 @@ char *sortcrit_as_string(const struct sortcrit *sortcrit);
 void freesortcrit(struct sortcrit *s);
 void index_msgdata_sort(MsgData **msgdata, int n, const struct sortcrit *sortcrit);
 void index_msgdata_free(MsgData **, unsigned int);
+void index_msgdata_fini(MsgData *md);
+int index_msgdata_compare(MsgData *md1, MsgData *md2,
+                          const struct sortcrit *sortcrit);
 MsgData **index_msgdata_load(struct index_state *state, unsigned *msgno_list, int n,
                              const struct sortcrit *sortcrit,
                              unsigned int anchor, int *found_anchor);
+extern int index_sortkeys_build(struct mailbox *mailbox,
+                                const struct index_record *record,
+                                struct buf *value);
+extern int index_overview_build(struct mailbox *mailbox,
+                                const struct index_record *record,
+                                struct buf *value);
+extern void index_snapshot_invalidate(const char *uniqueid);
 extern int index_search_evaluate(struct index_state *state, const search_expr_t *e, uint32_t msgno);
+/* results of index_search_evaluate_columns() */
+enum {
+    INDEX_COLUMNS_NONE = -1,
+    INDEX_COLUMNS_EXACT = 0,
+    INDEX_COLUMNS_SUPERSET = 1
+};
+extern int index_search_evaluate_columns(struct index_state *state,
+                                         const search_expr_t *e,
+                                         bitvector_t *hits);
+extern void index_search_plan(struct index_state *state,
+                              search_expr_t *e, int verbose);
 
 extern int index_expunge(struct index_state *state, char *uidsequence,
                          int need_deleted);
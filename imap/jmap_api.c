@@ -56,6 +56,7 @@
 #include "http_jmap.h"
 #include "mboxname.h"
 #include "msgrecord.h"
+#include "prometheus.h"
 #include "proxy.h"
 #include "times.h"
 #include "syslog.h"
@@ -508,10 +509,97 @@ struct _mboxcache_rec {
     int rw;
 };
 
+/* Mailboxes kept open between requests, least recently used first.
+ * Each holds one reference on the open mailbox, with the index unlocked,
+ * so that mailbox_open_irl/iwl() on the same name only has to relock
+ * the index, which also rereads its header if it changed meanwhile. */
+static ptrarray_t jmap_mboxcache = PTRARRAY_INITIALIZER;
+
+static int mboxcache_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < jmap_mboxcache.count; i++) {
+        struct mailbox *mbox = ptrarray_nth(&jmap_mboxcache, i);
+        if (!strcmp(name, mbox->name)) return i;
+    }
+
+    return -1;
+}
+
+static int mboxcache_drop(const char *name)
+{
+    int i = mboxcache_find(name);
+    struct mailbox *mbox;
+
+    if (i < 0) return 0;
+
+    mbox = ptrarray_remove(&jmap_mboxcache, i);
+    mailbox_close(&mbox);
+
+    return 1;
+}
+
+/* Release the last request reference on mbox, keeping it open
+ * for the next request if we can */
+static void mboxcache_release(struct mailbox *mbox)
+{
+    int max = config_getint(IMAPOPT_JMAP_MAILBOX_CACHE_SIZE);
+    int i = mboxcache_find(mbox->name);
+
+    if (i >= 0) {
+        /* Already cached - drop the request reference and
+         * move the cached one to the back of the queue */
+        struct mailbox *cached = ptrarray_remove(&jmap_mboxcache, i);
+        mailbox_close(&mbox);
+        mbox = cached;
+    }
+    else if (max <= 0) {
+        mailbox_close(&mbox);
+        return;
+    }
+    else {
+        mailbox_unlock_index(mbox, NULL);
+    }
+
+    if (mbox->i.options & MAILBOX_CLEANUP_MASK) {
+        /* Let the final close do its cleanup now */
+        mailbox_close(&mbox);
+        return;
+    }
+
+    ptrarray_append(&jmap_mboxcache, mbox);
+
+    while (jmap_mboxcache.count > max) {
+        mbox = ptrarray_shift(&jmap_mboxcache);
+        mailbox_close(&mbox);
+    }
+}
+
+HIDDEN void jmap_mboxcache_reset(void)
+{
+    struct mailbox *mbox;
+
+    while ((mbox = ptrarray_pop(&jmap_mboxcache))) {
+        mailbox_close(&mbox);
+    }
+    ptrarray_fini(&jmap_mboxcache);
+}
+
 HIDDEN void jmap_finireq(jmap_req_t *req)
 {
     int i;
 
+    /* Close cached mailboxes that were deleted or expunged during
+     * this request, so that their cleanup isn't held up */
+    for (i = jmap_mboxcache.count - 1; i >= 0; i--) {
+        struct mailbox *mbox = ptrarray_nth(&jmap_mboxcache, i);
+        if (mbox->i.options & MAILBOX_CLEANUP_MASK) {
+            ptrarray_remove(&jmap_mboxcache, i);
+            mailbox_close(&mbox);
+        }
+    }
+
     for (i = 0; i < req->mboxes->count; i++) {
         struct _mboxcache_rec *rec = ptrarray_nth(req->mboxes, i);
         syslog(LOG_ERR, "jmap: force-closing mailbox %s (refcount=%d)",
@@ -526,12 +614,44 @@ HIDDEN void jmap_finireq(jmap_req_t *req)
     req->mboxes = NULL;
 }
 
-static jmap_method_t *find_methodproc(const char *name, hash_table *jmap_methods)
+static jmap_method_t *find_methodproc(const char *name,
+                                      const hashoa_table *jmap_methods)
 {
-    return hash_lookup(name, jmap_methods);
+    return hashoa_lookup(name, jmap_methods);
+}
+
+/* Methods which by definition don't change any objects.  A run of
+ * these for the same account shares one conversations transaction. */
+static int is_readonly_method(const char *name)
+{
+    static const char * const suffixes[] = {
+        "/get", "/changes", "/query", "/queryChanges", "/parse", NULL
+    };
+    const char *method = strrchr(name, '/');
+    int i;
+
+    if (!method) return 0;
+    for (i = 0; suffixes[i]; i++) {
+        if (!strcmp(method, suffixes[i])) return 1;
+    }
+    return 0;
 }
 
 /* Perform an API request */
+/* "Email/get" is counted as email_get, unknown methods as other */
+static void jmap_observe_method(const char *mname, double secs)
+{
+    char label[64];
+    size_t i;
+
+    for (i = 0; mname[i] && i < sizeof(label) - 1; i++) {
+        label[i] = mname[i] == '/' ? '_' : TOLOWER(mname[i]);
+    }
+    label[i] = '\0';
+
+    prometheus_observe_label(CYRUS_JMAP_METHOD_SECONDS, label, secs);
+}
+
 HIDDEN int jmap_api(struct transaction_t *txn, json_t **res,
                     jmap_settings_t *settings)
 {
@@ -547,6 +667,9 @@ HIDDEN int jmap_api(struct transaction_t *txn, json_t **res,
     ptrarray_t method_calls = PTRARRAY_INITIALIZER;
     ptrarray_t processed_methods = PTRARRAY_INITIALIZER;
     strarray_t capabilities = STRARRAY_INITIALIZER;
+    /* conversations state held open across consecutive read-only calls */
+    struct conversations_state *run_cstate = NULL;
+    char *run_accountid = NULL;
 
     ret = parse_json_body(txn, &jreq);
     if (ret) return json_error_response(txn, ret, res);
@@ -679,14 +802,26 @@ HIDDEN int jmap_api(struct transaction_t *txn, json_t **res,
             continue;
         }
 
-        struct conversations_state *cstate = NULL;
-        r = conversations_open_user(accountid, &cstate);
-        if (r) {
-            txn->error.desc = error_message(r);
-            ret = HTTP_SERVER_ERROR;
-            json_decref(args);
-            goto done;
+        /* Anything that may write, or works on another account, gets
+         * its own transaction, so that its failure can't undo others */
+        int readonly = is_readonly_method(mname);
+        if (run_cstate && (!readonly || strcmp(run_accountid, accountid))) {
+            conversations_commit(&run_cstate);
+            free(run_accountid);
+            run_accountid = NULL;
+        }
+
+        struct conversations_state *cstate = run_cstate;
+        if (!cstate) {
+            r = conversations_open_user(accountid, &cstate);
+            if (r) {
+                txn->error.desc = error_message(r);
+                ret = HTTP_SERVER_ERROR;
+                json_decref(args);
+                goto done;
+            }
         }
+        run_cstate = NULL;
 
         /* Initialize request context */
         struct jmap_req req;
@@ -726,7 +861,11 @@ HIDDEN int jmap_api(struct transaction_t *txn, json_t **res,
         }
 
         /* Call the message processor. */
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
         r = mp->proc(&req);
+        gettimeofday(&end, NULL);
+        jmap_observe_method(mname, timesub(&start, &end));
 
         /* Finalize request context */
         jmap_finireq(&req);
@@ -738,7 +877,11 @@ HIDDEN int jmap_api(struct transaction_t *txn, json_t **res,
             json_decref(args);
             goto done;
         }
-        conversations_commit(&req.cstate);
+        if (readonly) {
+            run_cstate = req.cstate;
+            if (!run_accountid) run_accountid = xstrdup(accountid);
+        }
+        else conversations_commit(&req.cstate);
 
         json_decref(args);
     }
@@ -763,6 +906,9 @@ HIDDEN int jmap_api(struct transaction_t *txn, json_t **res,
     buf_free(&state);
 
   done:
+    /* whatever the read-only calls did is already in the response */
+    conversations_commit(&run_cstate);
+    free(run_accountid);
     {
         /* Clean up call stack */
         json_t *jval;
@@ -859,6 +1005,10 @@ HIDDEN int jmap_openmbox(jmap_req_t *req, const char *name,
     if (req->force_openmbox_rw)
         rw = 1;
     r = rw ? mailbox_open_iwl(name, mboxp) : mailbox_open_irl(name, mboxp);
+    if (r == IMAP_MAILBOX_NONEXISTENT && mboxcache_drop(name)) {
+        /* The cached mailbox went away underneath us - try afresh */
+        r = rw ? mailbox_open_iwl(name, mboxp) : mailbox_open_irl(name, mboxp);
+    }
     if (r) {
         syslog(LOG_ERR, "jmap_openmbox(%s): %s", name, error_message(r));
         return r;
@@ -899,7 +1049,7 @@ HIDDEN void jmap_closembox(jmap_req_t *req, struct mailbox **mboxp)
         if (rec->mbox == *mboxp) {
             if (!(--rec->refcount)) {
                 ptrarray_remove(req->mboxes, i);
-                mailbox_close(&rec->mbox);
+                mboxcache_release(rec->mbox);
                 free(rec);
             }
             *mboxp = NULL;
@@ -924,28 +1074,91 @@ struct findblob_data {
     struct mailbox *mbox;
     msgrecord_t *mr;
     char *part_id;
+    uint32_t uid;
 };
 
-static int findblob_cb(const conv_guidrec_t *rec, void *rock)
+/* Where recently found blobs live, keyed by "accountid/blobid".
+ * Blobs are immutable, so a location only goes stale when its
+ * message is expunged, which findblob_open() checks for. */
+#define BLOBCACHE_MAX_ENTRIES  1024
+
+struct blobloc {
+    char *mboxname;
+    uint32_t uid;
+    char *part_id;
+};
+
+static hash_table jmap_blobcache = HASH_TABLE_INITIALIZER;
+static int jmap_blobcache_count = 0;
+
+static void blobloc_free(void *data)
+{
+    struct blobloc *loc = (struct blobloc *) data;
+
+    free(loc->mboxname);
+    free(loc->part_id);
+    free(loc);
+}
+
+static void blobcache_key(struct buf *key, const char *accountid,
+                          const char *blobid)
+{
+    buf_setcstr(key, accountid);
+    buf_putc(key, '/');
+    buf_appendcstr(key, blobid);
+}
+
+static void blobcache_store(const char *key, const char *mboxname,
+                            uint32_t uid, const char *part_id)
+{
+    struct blobloc *loc;
+
+    if (!jmap_blobcache.size) {
+        construct_hash_table(&jmap_blobcache, BLOBCACHE_MAX_ENTRIES, 0);
+    }
+    else if (jmap_blobcache_count >= BLOBCACHE_MAX_ENTRIES) {
+        /* Full - just start over */
+        free_hash_table(&jmap_blobcache, blobloc_free);
+        construct_hash_table(&jmap_blobcache, BLOBCACHE_MAX_ENTRIES, 0);
+        jmap_blobcache_count = 0;
+    }
+
+    loc = xzmalloc(sizeof(struct blobloc));
+    loc->mboxname = xstrdup(mboxname);
+    loc->uid = uid;
+    loc->part_id = xstrdupnull(part_id);
+
+    loc = hash_insert(key, loc, &jmap_blobcache);
+    if (loc) blobloc_free(loc);
+    else jmap_blobcache_count++;
+}
+
+static void blobcache_drop(const char *key)
+{
+    struct blobloc *loc;
+
+    if (!jmap_blobcache.size) return;
+
+    loc = hash_del(key, &jmap_blobcache);
+    if (loc) {
+        blobloc_free(loc);
+        jmap_blobcache_count--;
+    }
+}
+
+/* Open the message at mboxname:uid for a blob, if allowed */
+static int findblob_open(struct findblob_data *d, const char *mboxname,
+                         uint32_t uid, const char *part_id)
 {
-    struct findblob_data *d = (struct findblob_data*) rock;
     jmap_req_t *req = d->req;
     int r = 0;
 
-    /* Ignore blobs that don't belong to the current accountId */
-    mbname_t *mbname = mbname_from_intname(rec->mboxname);
-    int is_accountid_mbox =
-        (mbname && !strcmp(mbname_userid(mbname), d->from_accountid));
-    mbname_free(&mbname);
-    if (!is_accountid_mbox)
-        return 0;
-
     /* Check ACL */
     if (d->is_shared_account) {
         mbentry_t *mbentry = NULL;
-        r = mboxlist_lookup(rec->mboxname, &mbentry, NULL);
+        r = mboxlist_lookup(mboxname, &mbentry, NULL);
         if (r) {
-            syslog(LOG_ERR, "jmap_findblob: no mbentry for %s", rec->mboxname);
+            syslog(LOG_ERR, "jmap_findblob: no mbentry for %s", mboxname);
             return r;
         }
         int rights = jmap_myrights(req, mbentry);
@@ -955,20 +1168,65 @@ static int findblob_cb(const conv_guidrec_t *rec, void *rock)
         }
     }
 
-    r = jmap_openmbox(req, rec->mboxname, &d->mbox, 0);
+    r = jmap_openmbox(req, mboxname, &d->mbox, 0);
     if (r) return r;
 
-    r = msgrecord_find(d->mbox, rec->uid, &d->mr);
+    r = msgrecord_find(d->mbox, uid, &d->mr);
     if (r) {
         jmap_closembox(req, &d->mbox);
         d->mr = NULL;
         return r;
     }
 
-    d->part_id = rec->part ? xstrdup(rec->part) : NULL;
+    d->uid = uid;
+    d->part_id = part_id ? xstrdup(part_id) : NULL;
     return IMAP_OK_COMPLETED;
 }
 
+static int findblob_cb(const conv_guidrec_t *rec, void *rock)
+{
+    struct findblob_data *d = (struct findblob_data*) rock;
+
+    /* Ignore blobs that don't belong to the current accountId */
+    mbname_t *mbname = mbname_from_intname(rec->mboxname);
+    int is_accountid_mbox =
+        (mbname && !strcmp(mbname_userid(mbname), d->from_accountid));
+    mbname_free(&mbname);
+    if (!is_accountid_mbox)
+        return 0;
+
+    return findblob_open(d, rec->mboxname, rec->uid, rec->part);
+}
+
+/* Try the cached location of a blob */
+static int findblob_cached(struct findblob_data *d, const char *key)
+{
+    struct blobloc *loc;
+    uint32_t internal_flags = 0;
+    int r;
+
+    if (!jmap_blobcache.size) return 0;
+
+    loc = hash_lookup(key, &jmap_blobcache);
+    if (!loc) return 0;
+
+    r = findblob_open(d, loc->mboxname, loc->uid, loc->part_id);
+    if (r == IMAP_OK_COMPLETED) {
+        r = msgrecord_get_internalflags(d->mr, &internal_flags);
+        if (!r && !(internal_flags & FLAG_INTERNAL_EXPUNGED))
+            return IMAP_OK_COMPLETED;
+
+        msgrecord_unref(&d->mr);
+        jmap_closembox(d->req, &d->mbox);
+        free(d->part_id);
+        d->part_id = NULL;
+    }
+
+    /* Stale or no longer accessible - look it up again */
+    blobcache_drop(key);
+    return 0;
+}
+
 HIDDEN int jmap_findblob(jmap_req_t *req, const char *from_accountid,
                          const char *blobid,
                          struct mailbox **mbox, msgrecord_t **mr,
@@ -987,10 +1245,13 @@ HIDDEN int jmap_findblob(jmap_req_t *req, const char *from_accountid,
         /* mr */
         NULL,
         /* part_id */
-        NULL
+        NULL,
+        /* uid */
+        0
     };
     struct body *mybody = NULL;
     const struct body *mypart = NULL;
+    struct buf key = BUF_INITIALIZER;
     int i, r;
     struct conversations_state *mycstate = NULL;
 
@@ -1005,10 +1266,16 @@ HIDDEN int jmap_findblob(jmap_req_t *req, const char *from_accountid,
     if (blobid[0] != 'G')
         return IMAP_NOTFOUND;
 
-    r = conversations_guid_foreach(mycstate, blobid+1, findblob_cb, &data);
+    blobcache_key(&key, data.from_accountid, blobid);
+    r = findblob_cached(&data, buf_cstring(&key));
     if (r != IMAP_OK_COMPLETED) {
-        if (!r) r = IMAP_NOTFOUND;
-        goto done;
+        r = conversations_guid_foreach(mycstate, blobid+1, findblob_cb, &data);
+        if (r != IMAP_OK_COMPLETED) {
+            if (!r) r = IMAP_NOTFOUND;
+            goto done;
+        }
+        blobcache_store(buf_cstring(&key), data.mbox->name,
+                        data.uid, data.part_id);
     }
 
     r = msgrecord_extract_bodystructure(data.mr, &mybody);
@@ -1061,6 +1328,7 @@ done:
         if (mybody) message_free_body(mybody);
     }
     if (data.part_id) free(data.part_id);
+    buf_free(&key);
     return r;
 }
 
@@ -100,7 +100,7 @@ HIDDEN void jmap_calendar_init(jmap_settings_t *settings)
 {
     jmap_method_t *mp;
     for (mp = jmap_calendar_methods; mp->name; mp++) {
-        hash_insert(mp->name, mp, &settings->methods);
+        hashoa_insert(mp->name, mp, &settings->methods);
     }
 
     strarray_push(&settings->can_use, JMAP_URN_CALENDARS);
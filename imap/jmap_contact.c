@@ -98,7 +98,7 @@ HIDDEN void jmap_contact_init(jmap_settings_t *settings)
 {
     jmap_method_t *mp;
     for (mp = jmap_contact_methods; mp->name; mp++) {
-        hash_insert(mp->name, mp, &settings->methods);
+        hashoa_insert(mp->name, mp, &settings->methods);
     }
 
     strarray_push(&settings->can_use, JMAP_URN_CONTACTS);
@@ -286,6 +286,33 @@ static int jmap_filter_match(jmap_filter *f,
     }
 }
 
+/* Like jmap_filter_match, but with match only able to rule a condition
+ * out: returns zero only if f can't match.  NOT can never be decided. */
+static int jmap_filter_prematch(jmap_filter *f,
+                                jmap_filtermatch_cb *match, void *rock)
+{
+    int i;
+
+    switch (f->op) {
+    case JMAP_FILTER_OP_NONE:
+        return match(ptrarray_head(&f->conditions), rock);
+    case JMAP_FILTER_OP_AND:
+        for (i = 0; i < ptrarray_size(&f->conditions); i++) {
+            if (!jmap_filter_prematch(ptrarray_nth(&f->conditions, i), match, rock))
+                return 0;
+        }
+        return 1;
+    case JMAP_FILTER_OP_OR:
+        for (i = 0; i < ptrarray_size(&f->conditions); i++) {
+            if (jmap_filter_prematch(ptrarray_nth(&f->conditions, i), match, rock))
+                return 1;
+        }
+        return 0;
+    default:
+        return 1;
+    }
+}
+
 static void jmap_filter_free(jmap_filter *f, jmap_filterfree_cb *freecond)
 {
     void *cond;
@@ -1825,6 +1852,75 @@ static int contact_filter_match(void *vf, void *rock)
     return 1;
 }
 
+typedef struct contact_prefilter_rock {
+    struct carddav_db *carddavdb;
+    struct carddav_data *cdata;
+    const struct index_record *record;
+    strarray_t search;
+    int have_search;    /* 0: not looked up yet, 1: found, -1: none */
+} contact_prefilter_rock;
+
+static int contact_prefilter_field(contact_prefilter_rock *rock,
+                                   int field, const char *text)
+{
+    if (!rock->have_search) {
+        rock->have_search = carddav_get_search(rock->carddavdb,
+                                               rock->cdata->dav.rowid,
+                                               &rock->search) ? -1 : 1;
+    }
+    if (rock->have_search < 0) return 1;
+
+    return _match_text(strarray_nth(&rock->search, field), text);
+}
+
+/* Return zero if the contact in rock can't match filter, judging only
+ * by its index record and the search fields in carddav_db, so that
+ * most contacts never need their vCard parsed.  Conditions on anything
+ * else are left to contact_filter_match. */
+static int contact_filter_prematch(void *vf, void *rock)
+{
+    contact_filter *f = (contact_filter *) vf;
+    contact_prefilter_rock *pfrock = (contact_prefilter_rock*) rock;
+
+    /* isFlagged */
+    if (JNOTNULL(f->isFlagged)) {
+        int flagged = pfrock->record->system_flags & FLAG_FLAGGED;
+        if (json_is_true(f->isFlagged) != !!flagged) {
+            return 0;
+        }
+    }
+    if (f->prefix && !contact_prefilter_field(pfrock,
+                CARDDAV_SEARCH_PREFIX, f->prefix)) {
+        return 0;
+    }
+    if (f->firstName && !contact_prefilter_field(pfrock,
+                CARDDAV_SEARCH_FIRSTNAME, f->firstName)) {
+        return 0;
+    }
+    if (f->lastName && !contact_prefilter_field(pfrock,
+                CARDDAV_SEARCH_LASTNAME, f->lastName)) {
+        return 0;
+    }
+    if (f->suffix && !contact_prefilter_field(pfrock,
+                CARDDAV_SEARCH_SUFFIX, f->suffix)) {
+        return 0;
+    }
+    if (f->company && !contact_prefilter_field(pfrock,
+                CARDDAV_SEARCH_COMPANY, f->company)) {
+        return 0;
+    }
+    if (f->department && !contact_prefilter_field(pfrock,
+                CARDDAV_SEARCH_DEPARTMENT, f->department)) {
+        return 0;
+    }
+    if (f->jobTitle && !contact_prefilter_field(pfrock,
+                CARDDAV_SEARCH_JOBTITLE, f->jobTitle)) {
+        return 0;
+    }
+
+    return 1;
+}
+
 /* Free the memory allocated by this contact filter. */
 static void contact_filter_free(void *vf)
 {
@@ -2023,6 +2119,17 @@ static int getcontactquery_cb(void *rock, struct carddav_data *cdata) {
     r = mailbox_find_index_record(crock->mailbox, cdata->dav.imap_uid, &record);
     if (r) goto done;
 
+    /* Rule out what we can without parsing the vCard. */
+    if (crock->filter) {
+        contact_prefilter_rock pfrock = {
+            crock->carddavdb, cdata, &record, STRARRAY_INITIALIZER, 0
+        };
+        int m = jmap_filter_prematch(crock->filter,
+                                     &contact_filter_prematch, &pfrock);
+        strarray_fini(&pfrock.search);
+        if (!m) goto done;
+    }
+
     /* Load contact from record. */
     struct vparse_card *vcard = record_to_vcard(crock->mailbox, &record);
     if (!vcard || !vcard->objects) {
@@ -138,7 +138,7 @@ HIDDEN void jmap_mail_init(jmap_settings_t *settings)
 {
     jmap_method_t *mp;
     for (mp = jmap_mail_methods; mp->name; mp++) {
-        hash_insert(mp->name, mp, &settings->methods);
+        hashoa_insert(mp->name, mp, &settings->methods);
     }
 
     strarray_push(&settings->can_use, JMAP_URN_MAIL);
@@ -2235,6 +2235,24 @@ static int _email_query_writecache(struct db *cache_db,
             buf_putc(&buf, '\0');
         }
     }
+    /* Keep the result this one replaces, so that Email/queryChanges
+     * from its state can be answered by comparing the two */
+    const char *olddata = NULL;
+    size_t olddatalen = 0;
+    if (!cyrusdb_fetch(cache_db, cache_key, strlen(cache_key),
+                       &olddata, &olddatalen, NULL) && olddatalen >= 12 &&
+        ntohll(*((bit64*)(olddata + 4))) != current_modseq) {
+        /* copy it out of the db's map before writing to it */
+        struct buf prev = BUF_INITIALIZER;
+        char *prev_key = strconcat(cache_key, "/prev", NULL);
+        buf_setmap(&prev, olddata, olddatalen);
+        r = cyrusdb_store(cache_db, prev_key, strlen(prev_key),
+                          buf_base(&prev), buf_len(&prev), NULL);
+        buf_free(&prev);
+        free(prev_key);
+        if (r) goto done;
+    }
+
     /* Store cache record */
     r = cyrusdb_store(cache_db, cache_key, strlen(cache_key),
             buf_base(&buf), buf_len(&buf), NULL);
@@ -2271,8 +2289,8 @@ static int _email_query_readcache(struct db *cache_db,
     }
     modseq_t cached_modseq = ntohll(((bit64*)(p))[0]); p += 8;
     if (cached_modseq != current_modseq) {
-        r = CYRUSDB_EXISTS;
-        goto done;
+        /* out of date, but still needed for queryChanges */
+        return CYRUSDB_NOTFOUND;
     }
 
     /* Read email ids */
@@ -2385,6 +2403,15 @@ static void _email_query(jmap_req_t *req, struct jmap_query *query,
         if (*is_cachedptr) goto done;
     }
 
+    /* Without a cache to fill, an anchor to find, threads to collapse
+     * or a total to count, only the start of the sorted list matters */
+    int want_window = !cache_db && !query->anchor && query->limit &&
+                      !collapse_threads && !query->calculate_total;
+
+run:
+    if (want_window)
+        search->query->max_results = query->position + query->limit;
+
     /* Run search */
     const ptrarray_t *msgdata = NULL;
     int r = _emailsearch_run(search, &msgdata);
@@ -2477,6 +2504,26 @@ static void _email_query(jmap_req_t *req, struct jmap_query *query,
     hashset_free(&seen_threads);
     hashset_free(&seen_emails);
 
+    if (want_window && search->query->merged_total > (unsigned) msgdata->count) {
+        if (json_array_size(query->ids) < query->limit) {
+            /* duplicates or hidden messages used up some of the
+             * window, so go again and keep everything this time */
+            json_array_clear(query->ids);
+            query->total = 0;
+            want_window = 0;
+            _emailsearch_free(search);
+            search = _emailsearch_new(req, query->filter, query->sort, 0, 0);
+            if (!search) {
+                *err = jmap_server_error(IMAP_INTERNAL);
+                goto done;
+            }
+            goto run;
+        }
+        /* we didn't look at everything, so this can only be
+         * an upper bound */
+        query->total = search->query->merged_total;
+    }
+
     if (!query->anchor) {
         query->result_position = query->position;
     }
@@ -2920,6 +2967,217 @@ done:
     _emailsearch_free(search);
 }
 
+/* Fill ids with every email matching the search, in order, the same
+ * way _email_query does before it applies the window */
+static void _email_query_allids(const ptrarray_t *msgdata,
+                                int collapse_threads,
+                                strarray_t *ids)
+{
+    struct hashset *seen_emails = hashset_new(12);
+    struct hashset *seen_threads = hashset_new(8);
+    char email_id[26];
+    int i;
+
+    for (i = 0 ; i < msgdata->count; i++) {
+        MsgData *md = ptrarray_nth(msgdata, i);
+
+        /* Skip expunged or hidden messages */
+        if (md->system_flags & FLAG_DELETED ||
+            md->internal_flags & FLAG_INTERNAL_EXPUNGED)
+            continue;
+
+        if (!hashset_add(seen_emails, &md->guid.value))
+            continue;
+        if (collapse_threads && !hashset_add(seen_threads, &md->cid))
+            continue;
+
+        _email_id_set_guid(&md->guid, email_id);
+        strarray_append(ids, email_id);
+    }
+
+    hashset_free(&seen_threads);
+    hashset_free(&seen_emails);
+}
+
+/* Report the changes between two complete query results.  Emails
+ * which are in both and keep their relative order (the longest
+ * increasing run of old positions) are left alone; everything else in
+ * the old result is removed and everything else in the new one added.
+ * Returns the number of changes. */
+static size_t _email_querychanges_diff(struct jmap_querychanges *query,
+                                       const struct cached_emailquery *old,
+                                       const strarray_t *new)
+{
+    size_t nnew = strarray_size(new);
+    size_t *oldpos = xzmalloc((nnew + 1) * sizeof(size_t));
+    size_t *tails = xmalloc((nnew + 1) * sizeof(size_t));
+    size_t *prev = xmalloc((nnew + 1) * sizeof(size_t));
+    char *keep_old = xzmalloc(old->ids_count + 1);
+    char *keep_new = xzmalloc(nnew + 1);
+    hash_table oldids = HASH_TABLE_INITIALIZER;
+    size_t i, len = 0, nchanges = 0;
+
+    construct_hash_table(&oldids, old->ids_count + 1, 0);
+    for (i = 0; i < old->ids_count; i++) {
+        const char *email_id = old->ids + i * (old->id_size + 1);
+        hash_insert(email_id, (void *) (i + 1), &oldids);
+    }
+
+    /* patience sort over the old positions of the new result */
+    for (i = 0; i < nnew; i++) {
+        size_t pos = (size_t) hash_lookup(strarray_nth(new, i), &oldids);
+        size_t lo = 0, hi = len;
+
+        oldpos[i] = pos;
+        if (!pos) continue;
+
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (oldpos[tails[mid]] < pos) lo = mid + 1;
+            else hi = mid;
+        }
+        prev[i] = lo ? tails[lo-1] : (size_t) -1;
+        tails[lo] = i;
+        if (lo == len) len++;
+    }
+    if (len) {
+        for (i = tails[len-1]; i != (size_t) -1; i = prev[i]) {
+            keep_new[i] = 1;
+            keep_old[oldpos[i]-1] = 1;
+        }
+    }
+
+    for (i = 0; i < old->ids_count; i++) {
+        if (keep_old[i]) continue;
+        _email_querychanges_destroyed(query, old->ids + i * (old->id_size + 1));
+        nchanges++;
+    }
+    for (i = 0; i < nnew; i++) {
+        if (keep_new[i]) continue;
+        json_array_append_new(query->added,
+                json_pack("{s:s,s:i}", "id", strarray_nth(new, i), "index", (int) i));
+        nchanges++;
+    }
+    query->total = nnew;
+
+    free_hash_table(&oldids, NULL);
+    free(keep_new);
+    free(keep_old);
+    free(prev);
+    free(tails);
+    free(oldpos);
+    return nchanges;
+}
+
+/* Answer Email/queryChanges from the query cache, if it still has the
+ * result the client saw at since_querystate.  The current result comes
+ * from the cache too if nothing changed since it was stored, else the
+ * search runs once (without expunged records) and is cached for next
+ * time.  Returns 0 if the caller needs to calculate the changes the
+ * long way. */
+static int _email_querychanges_cached(jmap_req_t *req,
+                                      struct jmap_querychanges *query,
+                                      int collapse_threads,
+                                      json_t **err)
+{
+    struct cached_emailquery old = _CACHED_EMAILQUERY_INITIALIZER;
+    struct cached_emailquery cur = _CACHED_EMAILQUERY_INITIALIZER;
+    strarray_t ids = STRARRAY_INITIALIZER;
+    struct emailsearch *search = NULL;
+    struct db *cache_db = NULL;
+    char *cache_fname = NULL;
+    char *cache_key = NULL;
+    char *prev_key = NULL;
+    modseq_t since_modseq, current_modseq = 0;
+    uint32_t since_uid;
+    int handled = 0;
+    int r;
+
+    /* changes past upToId are skipped, which the diff doesn't know */
+    if (query->up_to_id) return 0;
+
+    if (!_email_read_querystate(query->since_querystate, &since_modseq, &since_uid))
+        return 0;
+
+    cache_fname = emailsearch_getcachepath();
+    if (!cache_fname) return 0;
+
+    r = cyrusdb_open(EMAILSEARCH_DB, cache_fname, CYRUSDB_CREATE, &cache_db);
+    if (r) {
+        syslog(LOG_WARNING, "jmap: can't open email search cache %s: %s",
+                cache_fname, cyrusdb_strerror(r));
+        goto done;
+    }
+
+    search = _emailsearch_new(req, query->filter, query->sort, 0, 0);
+    if (!search || search->is_mutable > 1) goto done;
+
+    cache_key = strconcat(req->accountid,
+            "/", collapse_threads ?  "collapsed" : "uncollapsed",
+            "/", search->hash, NULL
+    );
+    prev_key = strconcat(cache_key, "/prev", NULL);
+
+    /* the result the client has */
+    current_modseq = jmap_highestmodseq(req, MBTYPE_EMAIL);
+    r = _email_query_readcache(cache_db, cache_key, since_modseq, &old);
+    if (r == CYRUSDB_NOTFOUND)
+        r = _email_query_readcache(cache_db, prev_key, since_modseq, &old);
+    if (r) goto done;
+
+    /* and the result it should have now */
+    if (current_modseq == since_modseq) {
+        query->total = old.ids_count;
+        handled = 1;
+        goto done;
+    }
+    r = _email_query_readcache(cache_db, cache_key, current_modseq, &cur);
+    if (!r) {
+        size_t i;
+        for (i = 0; i < cur.ids_count; i++)
+            strarray_append(&ids, cur.ids + i * (cur.id_size + 1));
+    }
+    else if (r == CYRUSDB_NOTFOUND) {
+        const ptrarray_t *msgdata = NULL;
+        r = _emailsearch_run(search, &msgdata);
+        if (r) {
+            /* let the long way report it */
+            goto done;
+        }
+        _email_query_allids(msgdata, collapse_threads, &ids);
+        r = _email_query_writecache(cache_db, cache_key, current_modseq, &ids);
+        if (r) {
+            syslog(LOG_ERR, "jmap: can't cache email search (%s): %s",
+                    cache_key, cyrusdb_strerror(r));
+        }
+    }
+    else goto done;
+
+    size_t num_changes = _email_querychanges_diff(query, &old, &ids);
+    if (query->max_changes && num_changes > query->max_changes)
+        *err = json_pack("{s:s}", "type", "tooManyChanges");
+    handled = 1;
+
+done:
+    if (handled && !*err)
+        query->new_querystate = _email_make_querystate(current_modseq, 0);
+    if (search) _emailsearch_free(search);
+    if (cache_db) {
+        r = cyrusdb_close(cache_db);
+        if (r) {
+            syslog(LOG_ERR, "jmap: can't close email search cache %s: %s",
+                    cache_fname, cyrusdb_strerror(r));
+        }
+    }
+    _cached_emailquery_fini(&cur);
+    _cached_emailquery_fini(&old);
+    strarray_fini(&ids);
+    free(prev_key);
+    free(cache_key);
+    free(cache_fname);
+    return handled;
+}
+
 static int jmap_email_querychanges(jmap_req_t *req)
 {
     struct jmap_parser parser = JMAP_PARSER_INITIALIZER;
@@ -2946,7 +3204,9 @@ static int jmap_email_querychanges(jmap_req_t *req)
     }
 
     /* Query changes */
-    if (collapse_threads)
+    if (_email_querychanges_cached(req, &query, collapse_threads, &err))
+        ; /* answered from the query cache */
+    else if (collapse_threads)
         _email_querychanges_collapsed(req, &query, &err);
     else
         _email_querychanges_uncollapsed(req, &query, &err);
@@ -3312,7 +3572,7 @@ static int _snippet_get(jmap_req_t *req, json_t *filter, json_t *messageids,
         json_object_set_new(snippet, "emailId", json_string(msgid));
         json_object_set_new(snippet, "subject", json_null());
         json_object_set_new(snippet, "preview", json_null());
-        index_getsearchtext(msg, rx, /*snippet*/1);
+        search_getsnippettext(msg, rx);
         json_array_append_new(*snippets, json_deep_copy(snippet));
         json_object_clear(snippet);
         msgrecord_unref(&mr);
@@ -4397,8 +4657,10 @@ static int _email_get_meta(jmap_req_t *req,
 
     if (_wantprop(props, "spamScore")) {
         int r = 0;
-        struct buf buf = BUF_INITIALIZER;
+        char scorebuf[64];
+        struct buf buf;
         json_t *jval = json_null();
+        buf_init_array(&buf, scorebuf);
         if (!msg->_m) r = msgrecord_get_message(msg->mr, &msg->_m);
         if (!r) r = message_get_field(msg->_m, "x-spam-score", MESSAGE_RAW, &buf);
         if (!r && buf_len(&buf)) jval = json_real(atof(buf_cstring(&buf)));
@@ -5275,11 +5537,140 @@ static int _warmup_mboxcache_cb(const conv_guidrec_t *rec, void* vrock)
     return r;
 }
 
-static void jmap_email_get_full(jmap_req_t *req, struct jmap_get *get, struct email_getargs *args)
+/*
+ * Email properties which the conversations guid records carry, so
+ * can be reported without opening any mailbox.
+ */
+static const char *email_lite_props[] = {
+    "id", "threadId", "receivedAt", NULL
+};
+
+static void _email_islite_cb(const char *key,
+                             void *data __attribute__((unused)),
+                             void *rock)
+{
+    int *islite = rock;
+    int i;
+
+    for (i = 0; email_lite_props[i]; i++) {
+        if (!strcmp(key, email_lite_props[i])) return;
+    }
+    *islite = 0;
+}
+
+static int _email_islite(struct email_getargs *args)
+{
+    int islite = 1;
+
+    if (!args->props || args->props == &_email_get_default_props)
+        return 0;
+
+    hash_enumerate(args->props, _email_islite_cb, &islite);
+    return islite;
+}
+
+struct _email_lite_rock {
+    jmap_req_t *req;
+    conversation_id_t cid;
+    time_t internaldate;
+    int found;
+};
+
+static int _email_lite_cb(const conv_guidrec_t *rec, void *vrock)
 {
+    struct _email_lite_rock *rock = vrock;
+
+    if (rec->part) return 0;
+
+    /* old records don't carry flags; let the caller read the index */
+    if (rec->version < 1) return IMAP_AGAIN;
+
+    if (!jmap_hasrights_byname(rock->req, rec->mboxname, ACL_READ))
+        return 0;
+
+    if (rec->system_flags & FLAG_DELETED ||
+        rec->internal_flags & FLAG_INTERNAL_EXPUNGED)
+        return 0;
+
+    rock->cid = rec->cid;
+    rock->internaldate = rec->internaldate;
+    rock->found = 1;
+    return IMAP_OK_COMPLETED;
+}
+
+/* Report the lightweight properties from the conversations db.
+ * Any ids which can't be served that way are moved to 'fallback'. */
+static void jmap_email_get_lite(jmap_req_t *req, struct jmap_get *get,
+                                struct email_getargs *args,
+                                json_t *fallback)
+{
+    hash_table *props = args->props;
     size_t i;
     json_t *val;
 
+    json_array_foreach(get->ids, i, val) {
+        const char *id = json_string_value(val);
+        struct _email_lite_rock rock = { req, 0, 0, 0 };
+        int r = IMAP_NOTFOUND;
+
+        if (id[0] == 'M' && strlen(id) == 25) {
+            r = conversations_guid_foreach(req->cstate, _guid_from_id(id),
+                                           _email_lite_cb, &rock);
+            if (r == IMAP_OK_COMPLETED) r = 0;
+        }
+
+        if (r == IMAP_AGAIN) {
+            json_array_append(fallback, val);
+            continue;
+        }
+        if (r || !rock.found) {
+            json_array_append_new(get->not_found, json_string(id));
+            if (r && r != IMAP_NOTFOUND) {
+                syslog(LOG_ERR, "jmap: Email/get(%s): %s", id, error_message(r));
+            }
+            continue;
+        }
+
+        json_t *msg = json_pack("{s:s}", "id", id);
+        if (_wantprop(props, "threadId")) {
+            char thread_id[18];
+            _thread_id_set_cid(rock.cid, thread_id);
+            json_object_set_new(msg, "threadId", json_string(thread_id));
+        }
+        if (_wantprop(props, "receivedAt")) {
+            char datestr[RFC3339_DATETIME_MAX];
+            time_to_rfc3339(rock.internaldate, datestr, RFC3339_DATETIME_MAX);
+            json_object_set_new(msg, "receivedAt", json_string(datestr));
+        }
+        json_array_append_new(get->list, msg);
+    }
+}
+
+struct _email_getitem {
+    const char *id;
+    char *mboxname;
+    uint32_t uid;
+    json_t *msg;
+    int r;
+};
+
+static int _email_getitem_cmp(const void *va, const void *vb)
+{
+    const struct _email_getitem *a = *(const struct _email_getitem **) va;
+    const struct _email_getitem *b = *(const struct _email_getitem **) vb;
+    int cmp = strcmpsafe(a->mboxname, b->mboxname);
+
+    if (cmp) return cmp;
+    return a->uid < b->uid ? -1 : a->uid > b->uid;
+}
+
+static void jmap_email_get_full(jmap_req_t *req, struct jmap_get *get, struct email_getargs *args)
+{
+    size_t i, nitems = json_array_size(get->ids);
+    struct _email_getitem *items, **sorted;
+    struct mailbox *mbox = NULL;
+    json_t *val;
+
     /* Warm up the mailbox cache by opening all mailboxes */
     struct _warmup_mboxcache_cb_rock rock = { req, PTRARRAY_INITIALIZER };
     json_array_foreach(get->ids, i, val) {
@@ -5296,42 +5687,60 @@ static void jmap_email_get_full(jmap_req_t *req, struct jmap_get *get, struct em
         }
     }
 
-    /* Process emails one after the other */
+    /* Resolve all emails first, then read them grouped by mailbox and
+     * in uid order, so index records and cache are read front to back */
+    items = xzmalloc(nitems * sizeof(struct _email_getitem));
+    sorted = xmalloc(nitems * sizeof(struct _email_getitem *));
     json_array_foreach(get->ids, i, val) {
-        const char *id = json_string_value(val);
-        char *mboxname = NULL;
+        items[i].id = json_string_value(val);
+        items[i].r = jmap_email_find(req, items[i].id,
+                                     &items[i].mboxname, &items[i].uid);
+        sorted[i] = &items[i];
+    }
+    qsort(sorted, nitems, sizeof(struct _email_getitem *), _email_getitem_cmp);
+
+    for (i = 0; i < nitems; i++) {
+        struct _email_getitem *item = sorted[i];
         msgrecord_t *mr = NULL;
-        json_t *msg = NULL;
-        struct mailbox *mbox = NULL;
 
-        uint32_t uid;
-        int r = jmap_email_find(req, id, &mboxname, &uid);
-        if (!r) {
-            r = jmap_openmbox(req, mboxname, &mbox, 0);
-            if (!r) {
-                r = msgrecord_find(mbox, uid, &mr);
-                if (!r) {
-                    r = _email_from_record(req, args, mr, &msg);
-                }
-                jmap_closembox(req, &mbox);
-            }
+        if (item->r) continue;
+
+        if (mbox && strcmp(mbox->name, item->mboxname)) {
+            jmap_closembox(req, &mbox);
         }
-        if (!r && msg) {
-            json_array_append_new(get->list, msg);
+        if (!mbox) {
+            item->r = jmap_openmbox(req, item->mboxname, &mbox, 0);
+            if (item->r) continue;
+        }
+
+        item->r = msgrecord_find(mbox, item->uid, &mr);
+        if (!item->r) {
+            item->r = _email_from_record(req, args, mr, &item->msg);
+        }
+        msgrecord_unref(&mr);
+    }
+    if (mbox) jmap_closembox(req, &mbox);
+
+    /* Report in request order */
+    for (i = 0; i < nitems; i++) {
+        struct _email_getitem *item = &items[i];
+
+        if (!item->r && item->msg) {
+            json_array_append_new(get->list, item->msg);
         }
         else {
-            json_array_append_new(get->not_found, json_string(id));
+            json_array_append_new(get->not_found, json_string(item->id));
+            json_decref(item->msg);
         }
-        if (r) {
-            syslog(LOG_ERR, "jmap: Email/get(%s): %s", id, error_message(r));
+        if (item->r) {
+            syslog(LOG_ERR, "jmap: Email/get(%s): %s", item->id, error_message(item->r));
         }
-
-        free(mboxname);
-        msgrecord_unref(&mr);
+        free(item->mboxname);
     }
+    free(sorted);
+    free(items);
 
     /* Close cached mailboxes */
-    struct mailbox *mbox = NULL;
     while ((mbox = ptrarray_pop(&rock.mboxes))) {
         jmap_closembox(req, &mbox);
     }
@@ -5436,6 +5845,18 @@ static int jmap_email_get(jmap_req_t *req)
 
     if (_isthreadsonly(req->args))
         jmap_email_get_threadsonly(req, &get);
+    else if (_email_islite(&args)) {
+        json_t *ids = get.ids;
+        json_t *fallback = json_array();
+
+        jmap_email_get_lite(req, &get, &args, fallback);
+        if (json_array_size(fallback)) {
+            get.ids = fallback;
+            jmap_email_get_full(req, &get, &args);
+            get.ids = ids;
+        }
+        json_decref(fallback);
+    }
     else
         jmap_email_get_full(req, &get, &args);
 
@@ -7894,6 +8315,15 @@ static int _email_setflags(json_t *keywords, int patch_keywords,
         }
     }
 
+    /* Nothing to write if the keywords are already as requested.
+     * Marking a large selection read often hits many such emails, and
+     * each rewrite costs a modseq bump and a conversations update. */
+    if (new_system_flags == old_system_flags &&
+        !memcmp(new_user_flags, old_user_flags, sizeof(old_user_flags))) {
+        memset(modflags, 0, sizeof(struct modified_flags));
+        goto done;
+    }
+
     /* Write flags to record */
     r = msgrecord_set_systemflags(mrw, new_system_flags);
     if (r) goto done;
@@ -82,7 +82,7 @@ HIDDEN void jmap_emailsubmission_init(jmap_settings_t *settings)
 {
     jmap_method_t *mp;
     for (mp = jmap_emailsubmission_methods; mp->name; mp++) {
-        hash_insert(mp->name, mp, &settings->methods);
+        hashoa_insert(mp->name, mp, &settings->methods);
     }
 
     strarray_push(&settings->can_use, JMAP_URN_SUBMISSION);
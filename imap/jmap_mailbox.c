@@ -90,7 +90,7 @@ HIDDEN void jmap_mailbox_init(jmap_settings_t *settings)
 {
     jmap_method_t *mp;
     for (mp = jmap_mailbox_methods; mp->name; mp++) {
-        hash_insert(mp->name, mp, &settings->methods);
+        hashoa_insert(mp->name, mp, &settings->methods);
     }
 }
 
@@ -292,6 +292,115 @@ static char *_mbox_find_specialuse(jmap_req_t *req, const char *use)
     return rock.mboxname;
 }
 
+/*
+ * While Mailbox/get reports on every mailbox of an account, the
+ * annotations it reads for each one and the parent mailbox entries are
+ * fetched up front: one range scan of the annotations db instead of
+ * several point lookups per mailbox, and parents resolved from the
+ * list the tree walk already produced.  Lookups for anything not in
+ * the prefetch fall through to the databases.
+ */
+static struct {
+    int active;
+    const char *userid;
+    hash_table annots;      /* "mboxname\tentry" -> struct buf */
+    hash_table byname;      /* mboxname -> mbentry_t, not owned */
+} mbox_prefetch;
+
+static const char *mbox_prefetch_entries[] = {
+    "/specialuse",
+    IMAP_ANNOT_NS "x-role",
+    IMAP_ANNOT_NS "displayname",
+    IMAP_ANNOT_NS "sortOrder",
+    NULL
+};
+
+static void _mbox_prefetch_freebuf(void *data)
+{
+    buf_destroy((struct buf *) data);
+}
+
+static void _mbox_prefetch(jmap_req_t *req, const ptrarray_t *mbentries)
+{
+    struct annotate_lookup *lookups;
+    struct buf key = BUF_INITIALIZER;
+    size_t nentries, n = 0, i;
+    int j, r;
+
+    for (nentries = 0; mbox_prefetch_entries[nentries]; nentries++);
+
+    construct_hash_table(&mbox_prefetch.byname, mbentries->count + 1, 0);
+    for (j = 0; j < mbentries->count; j++) {
+        mbentry_t *mbentry = ptrarray_nth(mbentries, j);
+        hash_insert(mbentry->name, mbentry, &mbox_prefetch.byname);
+    }
+
+    lookups = xzmalloc(mbentries->count * nentries *
+                       sizeof(struct annotate_lookup));
+    for (j = 0; j < mbentries->count; j++) {
+        mbentry_t *mbentry = ptrarray_nth(mbentries, j);
+
+        for (i = 0; i < nentries; i++) {
+            lookups[n].mboxname = mbentry->name;
+            lookups[n].entry = mbox_prefetch_entries[i];
+            lookups[n++].userid = req->accountid;
+        }
+    }
+
+    r = annotatemore_lookup_batch(lookups, n);
+
+    construct_hash_table(&mbox_prefetch.annots, n + 1, 0);
+    for (i = 0; !r && i < n; i++) {
+        struct buf *val = buf_new();
+
+        buf_copy(val, &lookups[i].value);
+        buf_setcstr(&key, lookups[i].mboxname);
+        buf_putc(&key, '\t');
+        buf_appendcstr(&key, lookups[i].entry);
+        hash_insert(buf_cstring(&key), val, &mbox_prefetch.annots);
+    }
+
+    annotatemore_lookup_batch_fini(lookups, n);
+    free(lookups);
+    buf_free(&key);
+
+    /* on error, the annotations table just stays empty */
+    mbox_prefetch.userid = req->accountid;
+    mbox_prefetch.active = 1;
+}
+
+static void _mbox_prefetch_fini(void)
+{
+    if (!mbox_prefetch.active) return;
+
+    free_hash_table(&mbox_prefetch.annots, _mbox_prefetch_freebuf);
+    free_hash_table(&mbox_prefetch.byname, NULL);
+    mbox_prefetch.userid = NULL;
+    mbox_prefetch.active = 0;
+}
+
+static int _mbox_annotlookup(const char *mboxname, const char *entry,
+                             const char *userid, struct buf *value)
+{
+    if (mbox_prefetch.active && !strcmpsafe(userid, mbox_prefetch.userid)) {
+        struct buf key = BUF_INITIALIZER;
+        struct buf *val;
+
+        buf_setcstr(&key, mboxname);
+        buf_putc(&key, '\t');
+        buf_appendcstr(&key, entry);
+        val = hash_lookup(buf_cstring(&key), &mbox_prefetch.annots);
+        buf_free(&key);
+
+        if (val) {
+            buf_copy(value, val);
+            return 0;
+        }
+    }
+
+    return annotatemore_lookup(mboxname, entry, userid, value);
+}
+
 static char *_mbox_get_role(jmap_req_t *req, const mbname_t *mbname)
 {
     struct buf buf = BUF_INITIALIZER;
@@ -305,8 +414,8 @@ static char *_mbox_get_role(jmap_req_t *req, const mbname_t *mbname)
     /* XXX How to determine the templates role? */
 
     /* Does this mailbox have an IMAP special use role? */
-    annotatemore_lookup(mbname_intname(mbname), "/specialuse",
-                        req->accountid, &buf);
+    _mbox_annotlookup(mbname_intname(mbname), "/specialuse",
+                      req->accountid, &buf);
     if (buf.len) {
         strarray_t *uses = strarray_split(buf_cstring(&buf), " ", STRARRAY_TRIM);
         if (uses->count) {
@@ -339,8 +448,8 @@ static char *_mbox_get_role(jmap_req_t *req, const mbname_t *mbname)
     /* Otherwise, does it have the x-role annotation set? */
     if (!role) {
         buf_reset(&buf);
-        annotatemore_lookup(mbname_intname(mbname),
-                            IMAP_ANNOT_NS "x-role", req->accountid, &buf);
+        _mbox_annotlookup(mbname_intname(mbname),
+                          IMAP_ANNOT_NS "x-role", req->accountid, &buf);
         if (buf.len) {
             role = buf_cstring(&buf);
         }
@@ -357,7 +466,7 @@ static char *_mbox_get_name(const char *account_id, const mbname_t *mbname)
 {
 	struct buf attrib = BUF_INITIALIZER;
 
-	int r = annotatemore_lookup(mbname_intname(mbname),
+	int r = _mbox_annotlookup(mbname_intname(mbname),
 			IMAP_ANNOT_NS "displayname",
 			account_id, &attrib);
 	if (!r && attrib.len) {
@@ -397,8 +506,8 @@ static int _mbox_get_sortorder(jmap_req_t *req, const mbname_t *mbname)
     char *role = NULL;
 
     /* Ignore lookup errors here. */
-    annotatemore_lookup(mbname_intname(mbname),
-                        IMAP_ANNOT_NS "sortOrder", req->accountid, &attrib);
+    _mbox_annotlookup(mbname_intname(mbname),
+                      IMAP_ANNOT_NS "sortOrder", req->accountid, &attrib);
     if (attrib.len) {
         uint64_t t = str2uint64(buf_cstring(&attrib));
         if (t < INT_MAX) {
@@ -427,7 +536,15 @@ static int _findparent(const char *mboxname, mbentry_t **mbentryp)
             !strcmp(strarray_nth(mbname_boxes(mbname), 0), "INBOX")) {
             free(mbname_pop_boxes(mbname));
         }
-        r = mboxlist_lookup_allow_all(mbname_intname(mbname), &mbentry, NULL);
+        const mbentry_t *known = mbox_prefetch.active ?
+            hash_lookup(mbname_intname(mbname), &mbox_prefetch.byname) : NULL;
+        if (known) {
+            mbentry = mboxlist_entry_copy(known);
+            r = 0;
+        }
+        else {
+            r = mboxlist_lookup_allow_all(mbname_intname(mbname), &mbentry, NULL);
+        }
         if (!r) {
             /* Ignore "reserved" entries, like they aren't there */
             if (mbentry->mbtype & MBTYPE_RESERVE) {
@@ -692,6 +809,12 @@ static int jmap_mailbox_get_cb(const mbentry_t *mbentry, void *_rock)
     return 0;
 }
 
+static int _mbox_collect_cb(const mbentry_t *mbentry, void *rock)
+{
+    ptrarray_append((ptrarray_t *) rock, mboxlist_entry_copy(mbentry));
+    return 0;
+}
+
 static void jmap_mailbox_get_notfound(const char *id, void *data __attribute__((unused)), void *rock)
 {
     json_array_append_new((json_t*) rock, json_string(id));
@@ -772,8 +895,28 @@ static int jmap_mailbox_get(jmap_req_t *req)
      * but will degrade if clients just fetch a small subset of
      * all mailbox ids. XXX Optimise this codepath if the ids[] array
      * length is small */
-    mboxlist_usermboxtree(req->accountid, req->authstate,
-                          jmap_mailbox_get_cb, &rock, MBOXTREE_INTERMEDIATES);
+    if (rock.want) {
+        mboxlist_usermboxtree(req->accountid, req->authstate,
+                              jmap_mailbox_get_cb, &rock, MBOXTREE_INTERMEDIATES);
+    }
+    else {
+        ptrarray_t mbentries = PTRARRAY_INITIALIZER;
+        mbentry_t *mbentry;
+        int i;
+
+        mboxlist_usermboxtree(req->accountid, req->authstate,
+                              _mbox_collect_cb, &mbentries, MBOXTREE_INTERMEDIATES);
+        _mbox_prefetch(req, &mbentries);
+        for (i = 0; i < mbentries.count; i++) {
+            if (jmap_mailbox_get_cb(ptrarray_nth(&mbentries, i), &rock))
+                break;
+        }
+        _mbox_prefetch_fini();
+
+        while ((mbentry = ptrarray_pop(&mbentries)))
+            mboxlist_entry_free(&mbentry);
+        ptrarray_fini(&mbentries);
+    }
 
     /* Report if any requested mailbox has not been found */
     if (rock.want) {
@@ -3198,6 +3341,17 @@ static int _mbox_changes(jmap_req_t *req,
     int r, i;
 
 
+    /* every mail and mail folder change in the account moves the mail
+     * modseq counter on, so if it hasn't passed since_modseq there is
+     * nothing to find and no need to look at each mailbox's status */
+    if (changes->since_modseq >= jmap_highestmodseq(req, 0)) {
+        changes->has_more_changes = 0;
+        changes->new_modseq = jmap_highestmodseq(req, 0);
+        *only_counts_changed = 0;
+        r = 0;
+        goto done;
+    }
+
     /* Search for updates */
     r = mboxlist_usermboxtree(req->accountid, req->authstate,
                               _mbox_changes_cb, &data,
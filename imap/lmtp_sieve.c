@@ -71,6 +71,7 @@
 #include "times.h"
 #include "sieve/sieve_interface.h"
 #include "smtpclient.h"
+#include "stagetrace.h"
 #include "strhash.h"
 #include "tok.h"
 #include "util.h"
@@ -128,6 +129,18 @@ static int getheader(void *v, const char *phead, const char ***body)
     }
 }
 
+/* same, MIME-decoded.  The decoded values are kept with the message's
+ * header cache, so they're shared by every recipient's script. */
+static int getheader_decoded(void *v, const char *phead, const char ***body)
+{
+    message_data_t *m = ((deliver_data_t *) v)->m;
+
+    if (phead==NULL) return SIEVE_FAIL;
+    *body = spool_getheader_decoded(m->hdrcache, phead);
+
+    return *body ? SIEVE_OK : SIEVE_FAIL;
+}
+
 /* adds the header "head" with body "body" to msg */
 static int addheader(void *sc, void *mc,
                      const char *head, const char *body, int index)
@@ -1084,6 +1097,8 @@ static deliver_data_t *setup_special_delivery(deliver_data_t *mydata)
 
         /* XXX  do we look for updated Date and Message-ID? */
         md.size = ftell(md.f);
+        /* the rewritten file has its own GUID, computed on parse */
+        message_guid_set_null(&md.guid);
         md.data = prot_new(fileno(md.f), 0);
 
         mydata = &dd;
@@ -1608,6 +1623,7 @@ sieve_interp_t *setup_sieve(struct sieve_interp_ctx *ctx)
     sieve_register_specialuseexists(interp, &getspecialuseexists);
     sieve_register_metadata(interp, &getmetadata);
     sieve_register_header(interp, &getheader);
+    sieve_register_header_decoded(interp, &getheader_decoded);
     sieve_register_addheader(interp, &addheader);
     sieve_register_deleteheader(interp, &deleteheader);
     sieve_register_fname(interp, &getfname);
@@ -1747,8 +1763,11 @@ int run_sieve(const mbname_t *mbname, sieve_interp_t *interp, deliver_data_t *ms
         sdata.authstate = msgdata->authstate;
     }
 
+    /* any message filed by the script is traced as a nested append */
+    stagetrace_enter(STAGETRACE_SIEVE);
     r = sieve_execute_bytecode(bc, interp,
                                (void *) &sdata, (void *) msgdata);
+    stagetrace_leave(STAGETRACE_SIEVE);
 
     if ((r == SIEVE_OK) && (msgdata->m->id)) {
         const char *sdb = make_sieve_db(mbname_recipient(mbname, sdata.ns));
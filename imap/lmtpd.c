@@ -74,6 +74,7 @@
 #ifdef WITH_DAV
 #include "carddav_db.h"
 #endif
+#include "conversations.h"
 #include "duplicate.h"
 #include "exitcodes.h"
 #include "global.h"
@@ -89,6 +90,8 @@
 #include "prometheus.h"
 #include "prot.h"
 #include "proxy.h"
+#include "quota.h"
+#include "stagetrace.h"
 #include "telemetry.h"
 #include "times.h"
 #include "tls.h"
@@ -292,6 +295,9 @@ int service_main(int argc, char **argv,
 
     lmtpmode(&mylmtp, deliver_in, deliver_out, 0);
 
+    /* give back quota reservations before waiting for another client */
+    quota_flush_deferred(/*all*/1);
+
     prometheus_decrement(CYRUS_LMTP_ACTIVE_CONNECTIONS);
     snmp_increment(ACTIVE_CONNECTIONS, -1);
 
@@ -301,7 +307,7 @@ int service_main(int argc, char **argv,
     deliver_in = deliver_out = NULL;
 
     if (deliver_logfd != -1) {
-        close(deliver_logfd);
+        telemetry_close(deliver_logfd);
         deliver_logfd = -1;
     }
 
@@ -441,12 +447,14 @@ static int mlookup(const char *name, mbentry_t **mbentryptr)
     mbentry_t *mbentry = NULL;
 
     /* do a local lookup and kick the slave if necessary */
+    stagetrace_enter(STAGETRACE_MLOOKUP);
     r = mboxlist_lookup(name, &mbentry, NULL);
     if (r == IMAP_MAILBOX_NONEXISTENT && config_mupdate_server) {
         kick_mupdate();
         mboxlist_entry_free(&mbentry);
         r = mboxlist_lookup(name, &mbentry, NULL);
     }
+    stagetrace_leave(STAGETRACE_MLOOKUP);
     if (r) return r;
     if (mbentry->mbtype & MBTYPE_MOVING) {
         r = IMAP_MAILBOX_MOVED;
@@ -577,7 +585,8 @@ int deliver_mailbox(FILE *f,
     if (!r && !content->body) {
         /* parse the message body if we haven't already,
            and keep the file mmap'ed */
-        r = message_parse_file(f, &content->base, &content->len, &content->body);
+        r = message_parse_file_guid(f, &content->base, &content->len,
+                                    &content->body, &content->guid);
         /* If the body contains received_date, we should always use that. */
         if (content->body->received_date)
             time_from_rfc5322(content->body->received_date, &internaldate,
@@ -774,12 +783,35 @@ EXPORTED int deliver_local(deliver_data_t *mydata, const strarray_t *flags,
     return ret;
 }
 
+struct local_rcpt {
+    int rcpt;
+    const char *userid;
+    mbentry_t *mbentry;
+};
+
+static int local_rcpt_cmp(const void *a, const void *b)
+{
+    const struct local_rcpt *ra = (const struct local_rcpt *) a;
+    const struct local_rcpt *rb = (const struct local_rcpt *) b;
+    int cmp;
+
+    cmp = strcmpsafe(ra->mbentry->partition, rb->mbentry->partition);
+    if (!cmp) cmp = strcmpsafe(ra->userid, rb->userid);
+    /* otherwise keep the order they were given in */
+    if (!cmp) cmp = ra->rcpt - rb->rcpt;
+
+    return cmp;
+}
+
 int deliver(message_data_t *msgdata, char *authuser,
             const struct auth_state *authstate, const struct namespace *ns)
 {
-    int n, nrcpts;
+    int i, n, nrcpts, nlocal = 0;
     struct dest *dlist = NULL;
     enum rcpt_status *status;
+    struct local_rcpt *local;
+    struct conversations_state *cstate = NULL;
+    const char *cstate_userid = NULL;
     struct message_content content = { NULL, 0, NULL };
     char *notifyheader;
     deliver_data_t mydata;
@@ -796,13 +828,16 @@ int deliver(message_data_t *msgdata, char *authuser,
     /* create 'mydata', our per-delivery data */
     mydata.m = msgdata;
     mydata.content = &content;
+    /* the GUID was computed while the message was spooled */
+    message_guid_copy(&content.guid, &msgdata->guid);
     mydata.stage = stage;
     mydata.notifyheader = notifyheader;
     mydata.ns = ns;
     mydata.authuser = authuser;
     mydata.authstate = authstate;
 
-    /* loop through each recipient, attempting delivery for each */
+    /* look up each recipient, queueing the remote ones for proxying */
+    local = xzmalloc(sizeof(struct local_rcpt) * nrcpts);
     for (n = 0; n < nrcpts; n++) {
         const mbname_t *mbname = msg_getrcpt(msgdata, n);
         char *mboxname = mbname_userid(mbname) ?
@@ -812,47 +847,88 @@ int deliver(message_data_t *msgdata, char *authuser,
         mbentry_t *mbentry = NULL;
         int r = mlookup(mboxname, &mbentry);
         free(mboxname);
-        if (r) goto setstatus;
-
-        if (mbentry->server) {
+        if (r) {
+            msg_setrcpt_status(msgdata, n, r, NULL);
+        }
+        else if (mbentry->server) {
             /* remote mailbox */
             const char *recip = mbname_recipient(mbname, &lmtpd_namespace);
             proxy_adddest(&dlist, recip, n, mbentry->server, authuser);
             status[n] = nosieve;
         }
         else {
-            /* local mailbox */
-            mydata.cur_rcpt = n;
+            local[nlocal].rcpt = n;
+            local[nlocal].userid = mbname_userid(mbname);
+            local[nlocal].mbentry = mbentry;
+            mbentry = NULL;
+            nlocal++;
+        }
+
+        mboxlist_entry_free(&mbentry);
+    }
+
+    /* deliver to the local recipients grouped by partition and user, so
+     * that the staged message is linked into each partition in turn and
+     * a user's conversations db is locked once for all their recipients */
+    qsort(local, nlocal, sizeof(struct local_rcpt), &local_rcpt_cmp);
+
+    for (i = 0; i < nlocal; i++) {
+        const mbname_t *mbname = msg_getrcpt(msgdata, local[i].rcpt);
+        const char *userid = local[i].userid;
+        int r;
+
+        n = local[i].rcpt;
+
+        if (cstate && strcmpsafe(userid, cstate_userid))
+            conversations_commit(&cstate);
+
+        if (!cstate && userid && config_getswitch(IMAPOPT_CONVERSATIONS) &&
+            i + 1 < nlocal && !strcmpsafe(local[i+1].userid, userid)) {
+            r = conversations_open_user(userid, &cstate);
+            if (r) {
+                syslog(LOG_WARNING, "error opening conversations for %s: %s",
+                                    userid, error_message(r));
+                cstate = NULL;
+            }
+            cstate_userid = userid;
+        }
+
+        /* local mailbox */
+        mydata.cur_rcpt = n;
 #ifdef USE_SIEVE
-            struct sieve_interp_ctx ctx = { mbname_userid(mbname), NULL };
-            sieve_interp_t *interp = setup_sieve(&ctx);
+        struct sieve_interp_ctx ctx = { mbname_userid(mbname), NULL };
+        sieve_interp_t *interp = setup_sieve(&ctx);
 
-            sieve_srs_init();
-            r = run_sieve(mbname, interp, &mydata);
+        sieve_srs_init();
+        r = run_sieve(mbname, interp, &mydata);
 #ifdef WITH_DAV
-            if (ctx.carddavdb) carddav_close(ctx.carddavdb);
+        if (ctx.carddavdb) carddav_close(ctx.carddavdb);
 #endif
-            sieve_srs_free();
-            sieve_interp_free(&interp);
-            /* if there was no sieve script, or an error during execution,
-               r is non-zero and we'll do normal delivery */
+        sieve_srs_free();
+        sieve_interp_free(&interp);
+        /* if there was no sieve script, or an error during execution,
+           r is non-zero and we'll do normal delivery */
 #else
-            r = 1;      /* normal delivery */
+        r = 1;      /* normal delivery */
 #endif
 
-            if (r) {
-                r = deliver_local(&mydata, NULL, mbname);
-            }
+        if (r) {
+            r = deliver_local(&mydata, NULL, mbname);
         }
 
-        telemetry_rusage(mbname_userid(mbname));
-
-        setstatus:
+        telemetry_rusage(userid);
 
         msg_setrcpt_status(msgdata, n, r, NULL);
 
-        mboxlist_entry_free(&mbentry);
+        mboxlist_entry_free(&local[i].mbentry);
+    }
+
+    if (cstate) {
+        stagetrace_enter(STAGETRACE_CONVERSATIONS);
+        conversations_commit(&cstate);
+        stagetrace_leave(STAGETRACE_CONVERSATIONS);
     }
+    free(local);
 
     if (dlist) {
         struct dest *d;
@@ -919,6 +995,9 @@ int deliver(message_data_t *msgdata, char *authuser,
     stage = NULL;
     if (notifyheader) free(notifyheader);
 
+    /* send the events for this message's deliveries together */
+    mboxevent_flush();
+
     return 0;
 }
 
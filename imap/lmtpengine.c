@@ -54,6 +54,7 @@
 #include <syslog.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <limits.h>
 #include <sys/wait.h>
 #include <netdb.h>
@@ -73,6 +74,7 @@
 #include "global.h"
 #include "exitcodes.h"
 #include "prometheus.h"
+#include "stagetrace.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
 #include "version.h"
@@ -571,6 +573,32 @@ static void clean822space(char *buf)
     }
 }
 
+/*
+ * feed the first 'len' bytes of spool file 'f' (the headers) into 'guidctx'.
+ * They were only just written, so this is a page cache read of a few KB.
+ */
+static int hash_spooled_headers(FILE *f, long len, struct message_guid_ctx *guidctx)
+{
+    char buf[4096];
+    off_t off = 0;
+    ssize_t n;
+
+    if (fflush(f)) return IMAP_IOERROR;
+
+    while (off < len) {
+        n = pread(fileno(f), buf,
+                  len - off < (off_t) sizeof(buf) ? len - off : sizeof(buf), off);
+        if (n <= 0) {
+            syslog(LOG_ERR, "IOERROR: reading spooled headers: %m");
+            return IMAP_IOERROR;
+        }
+        message_guid_update(guidctx, buf, n);
+        off += n;
+    }
+
+    return 0;
+}
+
 /*
  * file in the message structure 'm' from 'pin', assuming a dot-stuffed
  * stream a la lmtp.
@@ -595,6 +623,7 @@ static int savemsg(struct clientdata *cd,
     };
     char *addbody, *fold[5], *p;
     int addlen, nfold, i;
+    struct message_guid_ctx guidctx;
 
     /* Copy to spool file */
     f = func->spoolfile(m);
@@ -742,7 +771,14 @@ static int savemsg(struct clientdata *cd,
     /* get offset of message body */
     m->body_offset = ftell(f);
 
-    r |= spool_copy_msg(cd->pin, f);
+    /* the headers we just wrote are still hot; hash them now, then
+     * hash the body as it streams in, so nobody has to read the whole
+     * file back just to compute its GUID */
+    message_guid_set_null(&m->guid);
+    message_guid_init(&guidctx);
+    if (!r) r = hash_spooled_headers(f, m->body_offset, &guidctx);
+
+    r |= spool_copy_msg_guid(cd->pin, f, r ? NULL : &guidctx);
     if (r) {
         fclose(f);
         if (func->removespool) {
@@ -786,6 +822,8 @@ static int savemsg(struct clientdata *cd,
     m->f = f;
     m->data = prot_new(fileno(f), 0);
 
+    message_guid_final(&guidctx, &m->guid);
+
     return 0;
 }
 
@@ -832,9 +870,12 @@ static int process_recipient(char *addr,
                 mbname_set_domain(mbname, NULL);
         }
 
-        if ((r = verify_user(mbname,
+        stagetrace_enter(STAGETRACE_VERIFY);
+        r = verify_user(mbname,
                         (quota_t) (ignorequota ? -1 : msg->size),
-                        ignorequota ? -1 : 1, msg->authstate))) {
+                        ignorequota ? -1 : 1, msg->authstate);
+        stagetrace_leave(STAGETRACE_VERIFY);
+        if (r) {
             mbname_free(&mbname);
         }
     }
@@ -843,9 +884,12 @@ static int process_recipient(char *addr,
         const char *catchall = config_getstring(IMAPOPT_LMTP_CATCHALL_MAILBOX);
         if (catchall) {
             mbname = mbname_from_userid(catchall);
-            if ((r = verify_user(mbname,
+            stagetrace_enter(STAGETRACE_VERIFY);
+            r = verify_user(mbname,
                             ignorequota ? -1 : msg->size,
-                            ignorequota ? -1 : 1, msg->authstate))) {
+                            ignorequota ? -1 : 1, msg->authstate);
+            stagetrace_leave(STAGETRACE_VERIFY);
+            if (r) {
                 mbname_free(&mbname);
             }
         }
@@ -929,6 +973,8 @@ void lmtpmode(struct lmtp_func *func,
 {
     message_data_t *msg = NULL;
     int max_msgsize;
+    unsigned ntrans = 0;
+    char trace_token[256];
     char buf[4096];
     char *p;
     int r;
@@ -1158,15 +1204,22 @@ void lmtpmode(struct lmtp_func *func,
       case 'd':
       case 'D':
             if (!strcasecmp(buf, "data")) {
+                struct timeval datastart, dataend;
                 int delivered = 0;
                 int j;
 
+                gettimeofday(&datastart, NULL);
+
                 if (!msg->rcpt_num) {
                     prot_printf(pout, "503 5.5.1 No recipients\r\n");
                     continue;
                 }
+                stagetrace_enter(STAGETRACE_DATA);
+
                 /* copy message from input to msg structure */
+                stagetrace_enter(STAGETRACE_PARSE);
                 r = savemsg(&cd, func, msg);
+                stagetrace_leave(STAGETRACE_PARSE);
                 if (r) {
                     goto rset;
                 }
@@ -1201,6 +1254,15 @@ void lmtpmode(struct lmtp_func *func,
                 snmp_increment(mtaTransmittedMessages, delivered);
                 snmp_increment(mtaTransmittedVolume,
                                roundToK(delivered * msg->size));
+
+                gettimeofday(&dataend, NULL);
+                prometheus_observe(CYRUS_LMTP_DATA_SECONDS,
+                                   timesub(&datastart, &dataend));
+
+                stagetrace_leave(STAGETRACE_DATA);
+                stagetrace_end(CYRUS_LMTP_STAGE_SECONDS, msg->id,
+                               config_getint(IMAPOPT_LMTP_TRACE_THRESHOLD)
+                               / 1000.0);
                 goto rset;
             }
             goto syntaxerr;
@@ -1342,6 +1404,11 @@ void lmtpmode(struct lmtp_func *func,
                     continue;
                 }
 
+                /* trace the transaction through to the replies to DATA */
+                snprintf(trace_token, sizeof(trace_token), "%s.%u",
+                         session_id(), ++ntrans);
+                stagetrace_begin(trace_token);
+
                 prot_printf(pout, "250 2.1.0 ok\r\n");
                 continue;
             }
@@ -57,6 +57,8 @@ struct message_data {
     struct protstream *data;    /* message in temp file */
     FILE *f;                    /* FILE * corresponding */
     long body_offset;           /* offset of msg body in file */
+    struct message_guid guid;   /* GUID of the spooled file, computed
+                                   while it was written */
 
     char *id;                   /* message id */
     int size;                   /* size of message */
@@ -89,6 +89,7 @@
 #include "exitcodes.h"
 #include "global.h"
 #include "imparse.h"
+#include "index.h"
 #include "cyr_lock.h"
 #include "mailbox.h"
 #include "mappedfile.h"
@@ -96,12 +97,15 @@
 #include "map.h"
 #include "mboxevent.h"
 #include "mboxlist.h"
+#include "msgid_db.h"
 #include "parseaddr.h"
 #include "proc.h"
+#include "prometheus.h"
 #include "retry.h"
 #include "seen.h"
 #include "util.h"
 #include "sequence.h"
+#include "stagetrace.h"
 #include "statuscache.h"
 #include "strarray.h"
 #include "sync_log.h"
@@ -122,6 +126,7 @@
 
 static mailbox_wait_cb_t *mailbox_wait_cb = NULL;
 static void *mailbox_wait_cb_rock = NULL;
+static int mailbox_unlink_maxrate = 0;
 
 struct mailboxlist {
     struct mailboxlist *next;
@@ -144,6 +149,11 @@ struct mailbox_repack {
     char *userid;
     int newindex_fd;
     ptrarray_t caches;
+    /* online repack: file cleanups to do once nobody else can see them */
+    ptrarray_t cleanups;
+    int defer_cleanup;
+    int keep_needs_repack;
+    struct unlink_batch *unlinks;
 };
 
 static struct MsgFlagMap msgflagmap[] = {
@@ -166,13 +176,29 @@ static struct MsgFlagMap msgflagmap[] = {
                            (10 + 1))
 
 static int mailbox_index_unlink(struct mailbox *mailbox);
-static int mailbox_index_repack(struct mailbox *mailbox, int version);
+static int mailbox_index_repack(struct mailbox *mailbox, int version,
+                                int packed);
+static int mailbox_index_repack_online(struct mailboxlist *listitem);
+static void sis_release(struct mailbox *mailbox,
+                        const struct message_guid *guid, int archive);
 static void mailbox_repack_abort(struct mailbox_repack **repackptr);
 static int mailbox_lock_index_internal(struct mailbox *mailbox,
                                        int locktype);
 static void cleanup_stale_expunged(struct mailbox *mailbox);
 static bit32 mailbox_index_record_to_buf(struct index_record *record, int version,
                                          unsigned char *buf);
+static int mailbox_commit_sortkeys(struct mailbox *mailbox);
+static void mailbox_abort_sortkeys(struct mailbox *mailbox);
+static void mailbox_close_sortkeys(struct mailbox *mailbox);
+static int mailbox_commit_overview(struct mailbox *mailbox);
+static void mailbox_abort_overview(struct mailbox *mailbox);
+static void mailbox_close_overview(struct mailbox *mailbox);
+static void mailbox_annotcols_changed(struct mailbox *mailbox, uint32_t uid,
+                                      const char *entry, const char *userid,
+                                      const struct buf *newval);
+static void mailbox_commit_annotcols(struct mailbox *mailbox);
+static void mailbox_abort_annotcols(struct mailbox *mailbox);
+static void mailbox_close_annotcols(struct mailbox *mailbox);
 
 #ifdef WITH_DAV
 static int mailbox_commit_dav(struct mailbox *mailbox);
@@ -510,9 +536,8 @@ EXPORTED char *mailbox_cache_get_env(struct mailbox *mailbox,
                                      const struct index_record *record,
                                      int token)
 {
-    char *env;
-    char *envtokens[NUMENVTOKENS];
-    char *field;
+    const char *field;
+    size_t len;
 
     if (mailbox_cacherecord(mailbox, record))
         return NULL;
@@ -520,22 +545,16 @@ EXPORTED char *mailbox_cache_get_env(struct mailbox *mailbox,
     if (cacheitem_size(record, CACHE_ENVELOPE) <= 2)
         return NULL;
 
-    /* get field out of the envelope
-     *
-     * get a working copy; strip outer ()'s
+    /* get field straight out of the envelope
      * +1 -> skip the leading paren
      * -2 -> don't include the size of the outer parens
      */
-    env = xstrndup(cacheitem_base(record, CACHE_ENVELOPE) + 1,
-                   cacheitem_size(record, CACHE_ENVELOPE) - 2);
-    parse_cached_envelope(env, envtokens, VECTOR_SIZE(envtokens));
-
-    field = xstrdupnull(envtokens[token]);
-
-    /* free stuff */
-    free(env);
+    if (!message_cached_envelope_token(cacheitem_base(record, CACHE_ENVELOPE) + 1,
+                                       cacheitem_size(record, CACHE_ENVELOPE) - 2,
+                                       token, &field, &len))
+        return NULL;
 
-    return field;
+    return xstrndup(field, len);
 }
 
 EXPORTED int mailbox_index_islocked(struct mailbox *mailbox, int write)
@@ -848,6 +867,9 @@ EXPORTED int mailbox_map_record(struct mailbox *mailbox, const struct index_reco
 
 #if defined ENABLE_OBJECTSTORE
     if (config_getswitch(IMAPOPT_OBJECT_STORAGE_ENABLED)){
+        if (config_getstring(IMAPOPT_OBJECT_STORAGE_CACHE_DIR))
+            return objectstore_cache_map(mailbox, record, buf);
+
         r = objectstore_get(mailbox, record, fname);
         if (r) return r;
         r = _map_local_record(mailbox, fname, buf);
@@ -874,6 +896,9 @@ static void mailbox_release_resources(struct mailbox *mailbox)
     mailbox->index_locktype = 0; /* lock was released by closing fd */
     if (mailbox->index_base)
         map_free(&mailbox->index_base, &mailbox->index_len);
+    free(mailbox->packed_block);
+    mailbox->packed_block = NULL;
+    mailbox->packed_blockno = 0;
 
     /* release caches */
     for (i = 0; i < mailbox->caches.count; i++) {
@@ -1081,37 +1106,63 @@ EXPORTED modseq_t mailbox_modseq_dirty(struct mailbox *mailbox)
     return mailbox->i.highestmodseq;
 }
 
-EXPORTED int mailbox_setversion(struct mailbox *mailbox, int version)
+/*
+ * Repack 'mailbox' to index 'version', packed or not, with the
+ * mailbox to ourselves for the duration.
+ */
+static int mailbox_reformat(struct mailbox *mailbox, int version, int packed)
 {
-    int r = 0;
+    struct mailboxlist *listitem = find_listitem(mailbox->name);
+    int r;
+    assert(listitem);
+
+    /* release any existing locks */
+    mailbox_unlock_index(mailbox, NULL);
+
+    r = mailbox_mboxlock_reopen(listitem, LOCK_NONBLOCKING);
+    /* we need to re-open the index because we dropped the mboxname lock,
+     * so the file may have changed */
+    if (!r) r = mailbox_open_index(mailbox);
+    /* lock_internal so DELETED doesn't cause it to appear to be
+     * NONEXISTENT */
+    if (!r) r = mailbox_lock_index_internal(mailbox, LOCK_EXCLUSIVE);
+    if (!r) r = mailbox_index_repack(mailbox, version, packed);
+
+    /* and let's just update the counts too */
+    mailbox_unlock_index(mailbox, NULL);
+    if (!r) r = mailbox_mboxlock_reopen(listitem, LOCK_EXCLUSIVE);
+    if (!r) r = mailbox_open_index(mailbox);
+    if (!r) r = mailbox_lock_index_internal(mailbox, LOCK_EXCLUSIVE);
+    /* the repack recounted everything except the sync CRCs and
+     * annotation quota, and those were kept up to date all along if
+     * they've ever been verified, so only new indexes need this */
+    if (!r && !mailbox->i.synccrcs_verified)
+        r = mailbox_index_recalc(mailbox);
 
-    if (version && mailbox->i.minor_version != version) {
-        /* need to re-set the version! */
-        struct mailboxlist *listitem = find_listitem(mailbox->name);
-        int r;
-        assert(listitem);
+    return r;
+}
 
-        /* release any existing locks */
-        mailbox_unlock_index(mailbox, NULL);
+/* a packed index is always unpacked too, whatever its version */
+EXPORTED int mailbox_setversion(struct mailbox *mailbox, int version)
+{
+    if (version && (mailbox->i.minor_version != version ||
+                    (mailbox->i.options & OPT_MAILBOX_PACKED)))
+        return mailbox_reformat(mailbox, version, /*packed*/0);
 
-        r = mailbox_mboxlock_reopen(listitem, LOCK_NONBLOCKING);
-        /* we need to re-open the index because we dropped the mboxname lock,
-         * so the file may have changed */
-        if (!r) r = mailbox_open_index(mailbox);
-        /* lock_internal so DELETED doesn't cause it to appear to be
-         * NONEXISTENT */
-        if (!r) r = mailbox_lock_index_internal(mailbox, LOCK_EXCLUSIVE);
-        if (!r) r = mailbox_index_repack(mailbox, version);
+    return 0;
+}
 
-        /* and let's just update the counts too */
-        mailbox_unlock_index(mailbox, NULL);
-        if (!r) r = mailbox_mboxlock_reopen(listitem, LOCK_EXCLUSIVE);
-        if (!r) r = mailbox_open_index(mailbox);
-        if (!r) r = mailbox_lock_index_internal(mailbox, LOCK_EXCLUSIVE);
-        if (!r) r = mailbox_index_recalc(mailbox);
-    }
+/*
+ * Pack the index records of a mailbox which isn't expected to change
+ * any more, such as an archive.  This also brings the index up to the
+ * current version.  The first change to any record unpacks it again.
+ */
+EXPORTED int mailbox_setpacked(struct mailbox *mailbox)
+{
+    if (mailbox->i.options & OPT_MAILBOX_PACKED)
+        return 0;
 
-    return r;
+    return mailbox_reformat(mailbox, MAILBOX_MINOR_VERSION, /*packed*/1);
 }
 
 /*
@@ -1147,9 +1198,19 @@ EXPORTED void mailbox_close(struct mailbox **mailboxptr)
         mailbox_unlock_index(mailbox, NULL);
     }
 
+    /* big mailboxes are repacked without locking everyone else out
+     * while it happens, see mailbox_index_repack_online() */
+    if (!in_shutdown && mailbox->index_fd != -1 &&
+        (mailbox->i.options & MAILBOX_CLEANUP_MASK) == OPT_MAILBOX_NEEDS_REPACK &&
+        config_getint(IMAPOPT_REPACK_ONLINE_MINRECORDS) > 0 &&
+        mailbox->i.num_records >=
+            (unsigned) config_getint(IMAPOPT_REPACK_ONLINE_MINRECORDS)) {
+        mailbox_index_repack_online(listitem);
+    }
+
     /* do we need to try and clean up? (not if doing a shutdown,
      * speed is probably more important!) */
-    if (!in_shutdown && (mailbox->i.options & MAILBOX_CLEANUP_MASK)) {
+    else if (!in_shutdown && (mailbox->i.options & MAILBOX_CLEANUP_MASK)) {
         int r = mailbox_mboxlock_reopen(listitem, LOCK_NONBLOCKING);
         /* we need to re-open the index because we dropped the mboxname lock,
          * so the file may have changed */
@@ -1162,7 +1223,7 @@ EXPORTED void mailbox_close(struct mailbox **mailboxptr)
             if (mailbox->i.options & OPT_MAILBOX_DELETED)
                 mailbox_delete_cleanup(mailbox, mailbox->part, mailbox->name, mailbox->uniqueid);
             else if (mailbox->i.options & OPT_MAILBOX_NEEDS_REPACK)
-                mailbox_index_repack(mailbox, mailbox->i.minor_version);
+                mailbox_index_repack(mailbox, mailbox->i.minor_version, 0);
             else if (mailbox->i.options & OPT_MAILBOX_NEEDS_UNLINK)
                 mailbox_index_unlink(mailbox);
             /* or we missed out - someone else beat us to it */
@@ -1176,6 +1237,9 @@ EXPORTED void mailbox_close(struct mailbox **mailboxptr)
     }
 
     mailbox_release_resources(mailbox);
+    mailbox_close_sortkeys(mailbox);
+    mailbox_close_overview(mailbox);
+    mailbox_close_annotcols(mailbox);
 
     free(mailbox->name);
     free(mailbox->part);
@@ -1555,6 +1619,7 @@ static int mailbox_buf_to_index_header(const char *buf, size_t len,
     case 14:
     case 15:
     case 16:
+    case 17:
         headerlen = 160;
         break;
     default:
@@ -1576,6 +1641,11 @@ static int mailbox_buf_to_index_header(const char *buf, size_t len,
     i->flagged = ntohl(*((bit32 *)(buf+OFFSET_FLAGGED)));
     i->options = ntohl(*((bit32 *)(buf+OFFSET_MAILBOX_OPTIONS)));
     i->leaked_cache_records = ntohl(*((bit32 *)(buf+OFFSET_LEAKED_CACHE)));
+
+    /* packed records came with version 17 */
+    if ((i->options & OPT_MAILBOX_PACKED) && i->minor_version < 17)
+        return IMAP_MAILBOX_BADFORMAT;
+
     if (i->minor_version < 8) goto done;
 
     i->highestmodseq = align_ntohll(buf+OFFSET_HIGHESTMODSEQ);
@@ -1606,6 +1676,7 @@ static int mailbox_buf_to_index_header(const char *buf, size_t len,
     if (i->minor_version < 16) goto crc;
 
     i->createdmodseq = align_ntohll(buf+OFFSET_MAILBOX_CREATEDMODSEQ);
+    i->synccrcs_verified = align_ntohll(buf+OFFSET_SYNCCRCS_VERIFIED);
 
 crc:
     /* CRC is always the last 4 bytes */
@@ -1628,6 +1699,193 @@ done:
     return 0;
 }
 
+/*
+ * Packed index records.
+ *
+ * The records of a mailbox which doesn't change any more can be stored
+ * packed (see mailbox_setpacked) to take less disk and page cache.  The
+ * header is as usual but with OPT_MAILBOX_PACKED set, and then follow,
+ * in network byte order:
+ *
+ *   bit32 length of the packed records, including this
+ *   bit32 number of records
+ *   bit32 offset of each block from the start of the packed records,
+ *         and one more for the end of the last block
+ *   the blocks of PACKED_BLOCK_RECORDS records each
+ *
+ * A block is the CRC32 of its contents followed by each record as the
+ * difference from the one before (the first from all zeroes), a word at
+ * a time: a bitmap of which words changed, then by how much as zigzag
+ * varints.  A uid, date or modseq a little higher than the last takes a
+ * byte or two and unchanged flags take nothing.  The record CRC is not
+ * stored, it's computed again when the block is unpacked.
+ *
+ * Readers unpack one block at a time, into mailbox->packed_block.
+ * The first change to any record unpacks the whole index in place, see
+ * mailbox_index_unpack().
+ */
+#define PACKED_BLOCK_RECORDS 64
+#define PACKED_PREFIX_SIZE 8
+
+static void packed_putvarint(struct buf *buf, uint32_t v)
+{
+    while (v >= 0x80) {
+        buf_putc(buf, (v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    buf_putc(buf, v);
+}
+
+static int packed_getvarint(const unsigned char **pp, const unsigned char *end,
+                            uint32_t *vp)
+{
+    const unsigned char *p = *pp;
+    uint32_t v = 0;
+    int shift;
+
+    for (shift = 0; p < end && shift < 35; shift += 7) {
+        v |= (uint32_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *pp = p;
+            *vp = v;
+            return 0;
+        }
+    }
+
+    return IMAP_MAILBOX_BADFORMAT;
+}
+
+/* append 'count' plain records from 'recs' to 'buf' as a packed block */
+static void mailbox_pack_block(const unsigned char *recs, uint32_t count,
+                               size_t record_size, struct buf *buf)
+{
+    size_t nwords = record_size / 4 - 1; /* not the CRC */
+    size_t maplen = (nwords + 7) / 8;
+    uint32_t prev[INDEX_RECORD_SIZE/4] = { 0 };
+    uint32_t delta[INDEX_RECORD_SIZE/4];
+    unsigned char map[(INDEX_RECORD_SIZE/4 + 7) / 8];
+    uint32_t n;
+    size_t w;
+
+    for (n = 0; n < count; n++) {
+        const unsigned char *rec = recs + n * record_size;
+
+        memset(map, 0, maplen);
+        for (w = 0; w < nwords; w++) {
+            uint32_t word = ntohl(*((bit32 *)(rec + 4*w)));
+            delta[w] = word - prev[w];
+            prev[w] = word;
+            if (delta[w]) map[w/8] |= 1 << (w%8);
+        }
+
+        buf_appendmap(buf, (const char *) map, maplen);
+        for (w = 0; w < nwords; w++) {
+            int32_t d = (int32_t) delta[w];
+            if (d) packed_putvarint(buf, ((uint32_t) d << 1) ^ (uint32_t)(d >> 31));
+        }
+    }
+}
+
+/* unpack a block of 'count' records from 'p' to 'end' into 'recs' */
+static int mailbox_unpack_block(const unsigned char *p, const unsigned char *end,
+                                uint32_t count, size_t record_size,
+                                unsigned char *recs)
+{
+    size_t nwords = record_size / 4 - 1;
+    size_t maplen = (nwords + 7) / 8;
+    uint32_t prev[INDEX_RECORD_SIZE/4] = { 0 };
+    uint32_t n;
+    size_t w;
+
+    for (n = 0; n < count; n++) {
+        unsigned char *rec = recs + n * record_size;
+        const unsigned char *map = p;
+
+        if ((size_t)(end - p) < maplen)
+            return IMAP_MAILBOX_BADFORMAT;
+        p += maplen;
+
+        for (w = 0; w < nwords; w++) {
+            if (map[w/8] & (1 << (w%8))) {
+                uint32_t z;
+                if (packed_getvarint(&p, end, &z))
+                    return IMAP_MAILBOX_BADFORMAT;
+                prev[w] += (z >> 1) ^ -(z & 1);
+            }
+            *((bit32 *)(rec + 4*w)) = htonl(prev[w]);
+        }
+        *((bit32 *)(rec + record_size - 4)) =
+            htonl(crc32_map((const char *) rec, record_size - 4));
+    }
+
+    return p == end ? 0 : IMAP_MAILBOX_BADFORMAT;
+}
+
+/*
+ * Find record 'recno' of a packed index, unpacking its block unless
+ * that's the one we have already.
+ */
+static int mailbox_packed_record(struct mailbox *mailbox, uint32_t recno,
+                                 const char **bufp)
+{
+    const unsigned char *base;
+    size_t record_size = mailbox->i.record_size;
+    size_t avail = 0;
+    uint32_t block = (recno - 1) / PACKED_BLOCK_RECORDS;
+    uint32_t len, nrecords, nblocks, start, end, count;
+    bit32 crc;
+
+    if (mailbox->packed_blockno == block + 1)
+        goto found;
+
+    base = (const unsigned char *) mailbox->index_base + mailbox->i.start_offset;
+    if (mailbox->index_len > mailbox->i.start_offset)
+        avail = mailbox->index_len - mailbox->i.start_offset;
+    if (avail < PACKED_PREFIX_SIZE || record_size > INDEX_RECORD_SIZE)
+        goto badformat;
+
+    len = ntohl(*((bit32 *)base));
+    nrecords = ntohl(*((bit32 *)(base+4)));
+    nblocks = (nrecords + PACKED_BLOCK_RECORDS - 1) / PACKED_BLOCK_RECORDS;
+    if (len > avail || recno > nrecords ||
+        PACKED_PREFIX_SIZE + ((size_t) nblocks + 1) * 4 > len)
+        goto badformat;
+
+    start = ntohl(*((bit32 *)(base + PACKED_PREFIX_SIZE + 4*block)));
+    end = ntohl(*((bit32 *)(base + PACKED_PREFIX_SIZE + 4*(block+1))));
+    if (start > end || end - start < 4 || end > len)
+        goto badformat;
+
+    /* blocks aren't aligned */
+    memcpy(&crc, base + start, 4);
+    if (ntohl(crc) != crc32_map((const char *) base + start + 4, end - start - 4)) {
+        syslog(LOG_ERR, "IOERROR: packed index block %u for %s checksum mismatch",
+               block, mailbox->name);
+        return IMAP_MAILBOX_CHECKSUM;
+    }
+
+    count = nrecords - block * PACKED_BLOCK_RECORDS;
+    if (count > PACKED_BLOCK_RECORDS) count = PACKED_BLOCK_RECORDS;
+
+    if (!mailbox->packed_block)
+        mailbox->packed_block = xmalloc(PACKED_BLOCK_RECORDS * INDEX_RECORD_SIZE);
+    mailbox->packed_blockno = 0;
+    if (mailbox_unpack_block(base + start + 4, base + end, count, record_size,
+                             mailbox->packed_block))
+        goto badformat;
+    mailbox->packed_blockno = block + 1;
+
+found:
+    *bufp = (const char *) mailbox->packed_block +
+            ((recno - 1) % PACKED_BLOCK_RECORDS) * record_size;
+    return 0;
+
+badformat:
+    syslog(LOG_ERR, "IOERROR: packed index record %u for %s is corrupt",
+           recno, mailbox->name);
+    return IMAP_MAILBOX_BADFORMAT;
+}
+
 static int mailbox_refresh_index_map(struct mailbox *mailbox)
 {
     size_t need_size;
@@ -1637,6 +1895,9 @@ static int mailbox_refresh_index_map(struct mailbox *mailbox)
      * (i.e. new records appended since last read) */
     need_size = mailbox->i.start_offset +
                 mailbox->i.num_records * mailbox->i.record_size;
+    /* packed records are never appended to, just check there's a length */
+    if (mailbox->i.options & OPT_MAILBOX_PACKED)
+        need_size = mailbox->i.start_offset + PACKED_PREFIX_SIZE;
     if (mailbox->index_size < need_size) {
         if (fstat(mailbox->index_fd, &sbuf) == -1)
             return IMAP_IOERROR;
@@ -1684,6 +1945,9 @@ static int mailbox_read_index_header(struct mailbox *mailbox)
                                     &mailbox->i);
     if (r) return r;
 
+    /* the file may have been unpacked, or packed afresh, since */
+    mailbox->packed_blockno = 0;
+
     r = mailbox_refresh_index_map(mailbox);
     if (r) return r;
 
@@ -1853,30 +2117,38 @@ static int _store_change(struct mailbox *mailbox, struct index_record *record, i
     return 0;
 }
 
-static int _commit_one(struct mailbox *mailbox, struct index_change *change)
-{
-    indexbuffer_t ibuf;
-    unsigned char *buf = ibuf.buf;
-    size_t offset;
-    struct index_record *record = &change->record;
-    uint32_t recno = record->recno;
-
-    mailbox_index_record_to_buf(&change->record, mailbox->i.minor_version, buf);
+/* largest run of adjacent index records written with a single pwrite */
+#define COMMIT_BATCH_RECORDS 256
 
-    offset = mailbox->i.start_offset + ((recno-1) * mailbox->i.record_size);
+static int _commit_write(struct mailbox *mailbox, const unsigned char *buf,
+                         uint32_t recno, uint32_t count)
+{
+    size_t len = (size_t) count * mailbox->i.record_size;
+    off_t offset = mailbox->i.start_offset +
+                   ((off_t)(recno-1) * mailbox->i.record_size);
+    const unsigned char *p = buf;
+    ssize_t n;
 
     /* any failure here is a disaster! */
-    if (lseek(mailbox->index_fd, offset, SEEK_SET) == -1) {
-        syslog(LOG_ERR, "IOERROR: seeking index record %u for %s: %m",
-               recno, mailbox->name);
-        return IMAP_IOERROR;
+    while (len) {
+        n = pwrite(mailbox->index_fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            syslog(LOG_ERR, "IOERROR: writing index records %u-%u for %s: %m",
+                   recno, recno + count - 1, mailbox->name);
+            return IMAP_IOERROR;
+        }
+        p += n;
+        len -= n;
+        offset += n;
     }
 
-    if (retry_write(mailbox->index_fd, buf, mailbox->i.record_size) != mailbox->i.record_size) {
-        syslog(LOG_ERR, "IOERROR: writing index record %u for %s: %m",
-               recno, mailbox->name);
-        return IMAP_IOERROR;
-    }
+    return 0;
+}
+
+static void _commit_log(struct mailbox *mailbox, struct index_change *change)
+{
+    struct index_record *record = &change->record;
 
     /* audit logging */
     if (config_auditlog) {
@@ -1907,8 +2179,6 @@ static int _commit_one(struct mailbox *mailbox, struct index_change *change)
                    record->modseq, flagstr,
                    message_guid_encode(&record->guid));
     }
-
-    return 0;
 }
 
 static void _cleanup_changes(struct mailbox *mailbox)
@@ -1939,7 +2209,8 @@ static int change_compar(const void *a, const void *b)
 
 static int _commit_changes(struct mailbox *mailbox)
 {
-    uint32_t i;
+    unsigned char *buf;
+    uint32_t i, j, count;
     int r;
 
     if (!mailbox->index_change_count) return 0;
@@ -1951,10 +2222,31 @@ static int _commit_changes(struct mailbox *mailbox)
     qsort(mailbox->index_changes, mailbox->index_change_count,
           sizeof(struct index_change), change_compar);
 
-    for (i = 0; i < mailbox->index_change_count; i++) {
-        r = _commit_one(mailbox, &mailbox->index_changes[i]);
-        if (r) return r; /* DAMN, we're screwed */
+    /* changes are sorted by recno, so runs of adjacent records (a flag
+     * change over a whole range, say) go out in one write each */
+    buf = xmalloc((size_t) COMMIT_BATCH_RECORDS * mailbox->i.record_size +
+                  sizeof(indexbuffer_t));
+    for (i = 0; i < mailbox->index_change_count; i += count) {
+        uint32_t first = mailbox->index_changes[i].record.recno;
+
+        for (count = 0; i + count < mailbox->index_change_count &&
+                        count < COMMIT_BATCH_RECORDS; count++) {
+            struct index_change *change = &mailbox->index_changes[i + count];
+            if (change->record.recno != first + count) break;
+            mailbox_index_record_to_buf(&change->record, mailbox->i.minor_version,
+                                        buf + count * mailbox->i.record_size);
+        }
+
+        r = _commit_write(mailbox, buf, first, count);
+        if (r) {
+            free(buf);
+            return r; /* DAMN, we're screwed */
+        }
+
+        for (j = 0; j < count; j++)
+            _commit_log(mailbox, &mailbox->index_changes[i + j]);
     }
+    free(buf);
 
     _cleanup_changes(mailbox);
 
@@ -1967,11 +2259,18 @@ static int _commit_changes(struct mailbox *mailbox)
     return 0;
 }
 
-EXPORTED int mailbox_reload_index_record_dirty(struct mailbox *mailbox,
-                                               struct index_record *record)
+/*
+ * Find the on-disk form of record 'recno', packed or not
+ */
+static int mailbox_index_record_buf(struct mailbox *mailbox, uint32_t recno,
+                                    const char **bufp)
 {
-    unsigned recno = record->recno;
-    unsigned offset = mailbox->i.start_offset + (recno-1) * mailbox->i.record_size;
+    unsigned offset;
+
+    if (mailbox->i.options & OPT_MAILBOX_PACKED)
+        return mailbox_packed_record(mailbox, recno, bufp);
+
+    offset = mailbox->i.start_offset + (recno-1) * mailbox->i.record_size;
 
     if (offset + mailbox->i.record_size > mailbox->index_size) {
         syslog(LOG_ERR,
@@ -1980,7 +2279,120 @@ EXPORTED int mailbox_reload_index_record_dirty(struct mailbox *mailbox,
         return IMAP_IOERROR;
     }
 
-    const char *buf = mailbox->index_base + offset;
+    *bufp = mailbox->index_base + offset;
+    return 0;
+}
+
+/*
+ * Turn a packed index back into plain records.  Needs the index locked
+ * exclusively, and must come before any change to it.
+ *
+ * Like a repack, the plain index is written to a new file and renamed
+ * into place, so that a crash leaves either the old index or the new
+ * one whole.  Unlike a repack we may only hold the mailbox shared, so
+ * the cache files and generation number are left alone, and the new
+ * file is locked before it is renamed: other sessions waiting on the
+ * old one notice it has been replaced in mailbox_lock_index_internal(),
+ * and wait on the new one in turn.  It isn't index.NEW, which an online
+ * repack may be filling in meanwhile.
+ */
+static int mailbox_index_unpack(struct mailbox *mailbox)
+{
+    indexbuffer_t ibuf;
+    unsigned char *hbuf = ibuf.buf;
+    size_t start_offset = mailbox->i.start_offset;
+    size_t record_size = mailbox->i.record_size;
+    char *fname = xstrdup(mailbox_meta_fname(mailbox, META_INDEX));
+    char *tmpname = strconcat(fname, ".UNPACK", (char *)NULL);
+    uint32_t num_records, recno;
+    unsigned char *records;
+    const char *buf;
+    struct stat sbuf;
+    bit32 options;
+    int fd = -1;
+    int r = 0;
+
+    assert(mailbox_index_islocked(mailbox, 1));
+
+    syslog(LOG_INFO, "Unpacking index of mailbox %s", mailbox->name);
+
+    /* what's on disk, whatever this session did to the header so far */
+    num_records = ntohl(*((bit32 *)(mailbox->index_base+OFFSET_NUM_RECORDS)));
+    records = xmalloc((size_t) num_records * record_size + 1);
+    for (recno = 1; recno <= num_records; recno++) {
+        r = mailbox_packed_record(mailbox, recno, &buf);
+        if (r) goto done;
+        memcpy(records + (recno-1) * record_size, buf, record_size);
+    }
+
+    memcpy(hbuf, mailbox->index_base, start_offset);
+    options = ntohl(*((bit32 *)(hbuf+OFFSET_MAILBOX_OPTIONS)));
+    *((bit32 *)(hbuf+OFFSET_MAILBOX_OPTIONS)) = htonl(options & ~OPT_MAILBOX_PACKED);
+    /* CRC is always the last 4 bytes */
+    *((bit32 *)(hbuf+start_offset-4)) =
+        htonl(crc32_map((const char *) hbuf, start_offset-4));
+
+    r = IMAP_IOERROR;
+
+    fd = open(tmpname, O_RDWR|O_TRUNC|O_CREAT, 0666);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: failed to create %s: %m", tmpname);
+        goto done;
+    }
+
+    /* nobody else knows about it yet, so this doesn't wait */
+    if (lock_blocking(fd, tmpname)) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", tmpname);
+        goto done;
+    }
+
+    if (retry_write(fd, hbuf, start_offset) < 0 ||
+        retry_write(fd, records, (size_t) num_records * record_size) < 0 ||
+        fsync(fd) || fstat(fd, &sbuf)) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", tmpname);
+        goto done;
+    }
+
+    if (rename(tmpname, fname)) {
+        syslog(LOG_ERR, "IOERROR: renaming %s: %m", tmpname);
+        goto done;
+    }
+
+    /* carry on with the new file, still locked; closing the old one
+     * releases anyone waiting on it */
+    map_free(&mailbox->index_base, &mailbox->index_len);
+    xclose(mailbox->index_fd);
+    mailbox->index_fd = fd;
+    fd = -1;
+    mailbox->index_ino = sbuf.st_ino;
+    mailbox->index_mtime = sbuf.st_mtime;
+    mailbox->index_size = sbuf.st_size;
+
+    mailbox->i.options &= ~OPT_MAILBOX_PACKED;
+    mailbox->packed_blockno = 0;
+    r = mailbox_refresh_index_map(mailbox);
+
+done:
+    if (fd != -1) {
+        close(fd);
+        unlink(tmpname);
+    }
+    free(records);
+    free(tmpname);
+    free(fname);
+    return r;
+}
+
+EXPORTED int mailbox_reload_index_record_dirty(struct mailbox *mailbox,
+                                               struct index_record *record)
+{
+    unsigned recno = record->recno;
+    const char *buf;
+    int r;
+
+    r = mailbox_index_record_buf(mailbox, recno, &buf);
+    if (r) return r;
+
     mailbox_buf_to_index_record(buf, mailbox->i.minor_version, record, 1);
     record->recno = recno;
 
@@ -1996,7 +2408,6 @@ static int mailbox_read_index_record(struct mailbox *mailbox,
                                      struct index_record *record)
 {
     const char *buf;
-    unsigned offset;
     int r;
     struct index_change *change = _find_change(mailbox, recno);
 
@@ -2005,16 +2416,8 @@ static int mailbox_read_index_record(struct mailbox *mailbox,
         return 0;
     }
 
-    offset = mailbox->i.start_offset + (recno-1) * mailbox->i.record_size;
-
-    if (offset + mailbox->i.record_size > mailbox->index_size) {
-        syslog(LOG_ERR,
-               "IOERROR: index record %u for %s past end of file",
-               recno, mailbox->name);
-        return IMAP_IOERROR;
-    }
-
-    buf = mailbox->index_base + offset;
+    r = mailbox_index_record_buf(mailbox, recno, &buf);
+    if (r) return r;
 
     r = mailbox_buf_to_index_record(buf, mailbox->i.minor_version, record, 0);
 
@@ -2029,7 +2432,7 @@ EXPORTED int mailbox_read_basecid(struct mailbox *mailbox, const struct index_re
 
     if (record->internal_flags & FLAG_INTERNAL_SPLITCONVERSATION) {
         struct buf annotval = BUF_INITIALIZER;
-        annotatemore_msg_lookup(mailbox->name, record->uid, IMAP_ANNOT_NS "basethrid", "", &annotval);
+        mailbox_annotation_lookup_record(mailbox, record, IMAP_ANNOT_NS "basethrid", "", &annotval);
         if (annotval.len == 16) {
             const char *p = buf_cstring(&annotval);
             /* we have a new canonical CID */
@@ -2198,16 +2601,33 @@ static int mailbox_lock_index_internal(struct mailbox *mailbox, int locktype)
             mailbox->is_readonly = 0;
             r = mailbox_open_index(mailbox);
         }
-        if (!r) r = lock_blocking(mailbox->index_fd, index_fname);
-    }
-    else if (locktype == LOCK_SHARED) {
-        r = lock_shared(mailbox->index_fd, index_fname);
     }
-    else {
+    else if (locktype != LOCK_SHARED) {
         /* this function does not support nonblocking locks */
         fatal("invalid locktype for index", EC_SOFTWARE);
     }
 
+    while (!r) {
+        if (locktype == LOCK_EXCLUSIVE)
+            r = lock_blocking(mailbox->index_fd, index_fname);
+        else
+            r = lock_shared(mailbox->index_fd, index_fname);
+        if (r) break;
+
+        /* a packed index (or one we haven't read yet, which could be)
+         * may have been unpacked into a new file while we waited, see
+         * mailbox_index_unpack() */
+        if (mailbox->i.minor_version &&
+            !(mailbox->i.options & OPT_MAILBOX_PACKED))
+            break;
+        if (stat(index_fname, &sbuf) == -1 ||
+            sbuf.st_ino == mailbox->index_ino)
+            break;
+
+        lock_unlock(mailbox->index_fd, index_fname);
+        r = mailbox_open_index(mailbox);
+    }
+
     /* double check that the index exists and has at least enough
      * data to check the version number */
     if (!r) {
@@ -2307,6 +2727,7 @@ EXPORTED int mailbox_lock_index(struct mailbox *mailbox, int locktype)
 EXPORTED void mailbox_unlock_index(struct mailbox *mailbox, struct statusdata *sdata)
 {
     struct statusdata mysdata = STATUSDATA_INIT;
+    char *owner = NULL;
     struct timeval endtime;
     double timediff;
     int r;
@@ -2326,12 +2747,25 @@ EXPORTED void mailbox_unlock_index(struct mailbox *mailbox, struct statusdata *s
     }
 
     if (mailbox->has_changed) {
+        index_snapshot_invalidate(mailbox->uniqueid);
         if (updatenotifier) updatenotifier(mailbox->name);
         sync_log_mailbox(mailbox->name);
 
         if (!sdata) {
             status_fill_mailbox(mailbox, &mysdata);
             sdata = &mysdata;
+
+            /* keep the owner's seen counts current too, so LIST-STATUS
+             * doesn't have to open the mailbox after every change */
+            if (config_getswitch(IMAPOPT_STATUSCACHE))
+                owner = mboxname_to_userid(mailbox->name);
+            if (owner && mailbox->i.minor_version > 13 &&
+                mailbox_internal_seen(mailbox, owner)) {
+                status_fill_seen(owner, sdata,
+                                 mailbox_count_recent(mailbox,
+                                                      mailbox->i.recentuid),
+                                 mailbox->i.unseen);
+            }
         }
 
         mailbox->has_changed = 0;
@@ -2340,6 +2774,7 @@ EXPORTED void mailbox_unlock_index(struct mailbox *mailbox, struct statusdata *s
     // we always write if given new statusdata, or if we changed the mailbox
     if (sdata)
         statuscache_invalidate(mailbox->name, sdata);
+    free(owner);
 
     if (mailbox->index_locktype) {
         if (lock_unlock(mailbox->index_fd, index_fname))
@@ -2425,7 +2860,7 @@ static int mailbox_commit_header(struct mailbox *mailbox)
         r = retry_writev(fd, iov, niov);
     }
 
-    if (r == -1 || fsync(fd)) {
+    if (r == -1 || stagetrace_fsync(fd)) {
         syslog(LOG_ERR, "IOERROR: writing %s: %m", newfname);
         close(fd);
         unlink(newfname);
@@ -2528,6 +2963,7 @@ static bit32 mailbox_index_header_to_buf(struct index_header *i, unsigned char *
 
     if (i->minor_version > 15) {
         align_htonll(buf+OFFSET_MAILBOX_CREATEDMODSEQ, i->createdmodseq);
+        align_htonll(buf+OFFSET_SYNCCRCS_VERIFIED, i->synccrcs_verified);
     }
 
     /* Update checksum */
@@ -2589,7 +3025,11 @@ EXPORTED int mailbox_abort(struct mailbox *mailbox)
     r = mailbox_abort_cache(mailbox);
     if (r) return r;
 
+    mailbox_abort_sortkeys(mailbox);
+    mailbox_abort_overview(mailbox);
+
     annotate_state_abort(&mailbox->annot_state);
+    mailbox_abort_annotcols(mailbox);
 
     if (!mailbox->i.dirty)
         return 0;
@@ -2633,12 +3073,20 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
     r = mailbox_commit_cache(mailbox);
     if (r) return r;
 
+    r = mailbox_commit_sortkeys(mailbox);
+    if (r) return r;
+
+    r = mailbox_commit_overview(mailbox);
+    if (r) return r;
+
     r = mailbox_commit_quota(mailbox);
     if (r) return r;
 
     r = annotate_state_commit(&mailbox->annot_state);
     if (r) return r;
 
+    mailbox_commit_annotcols(mailbox);
+
     r = mailbox_commit_header(mailbox);
     if (r) return r;
 
@@ -2662,7 +3110,7 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
 
     lseek(mailbox->index_fd, 0, SEEK_SET);
     n = retry_write(mailbox->index_fd, buf, mailbox->i.start_offset);
-    if (n < 0 || fsync(mailbox->index_fd)) {
+    if (n < 0 || stagetrace_fsync(mailbox->index_fd)) {
         syslog(LOG_ERR, "IOERROR: writing index header for %s: %m",
                mailbox->name);
         return IMAP_IOERROR;
@@ -2941,6 +3389,7 @@ EXPORTED void mailbox_annot_changed(struct mailbox *mailbox,
         int r = mailbox_find_index_record(mailbox, uid, &record);
         if (r || record.internal_flags & FLAG_INTERNAL_EXPUNGED)
             return;
+        mailbox_annotcols_changed(mailbox, uid, entry, userid, newval);
         if (oldval->len)
             mailbox->i.synccrcs.annot ^= crc_annot(uid, entry, userid, oldval);
         if (newval->len)
@@ -3011,8 +3460,16 @@ static void mailbox_annot_update_counts(struct mailbox *mailbox,
 }
 
 /*
- * Calculate a sync CRC for the entire @mailbox using CRC algorithm
- * version @vers, optionally forcing recalculation
+ * Calculate a sync CRC for the entire @mailbox, optionally forcing
+ * recalculation.
+ *
+ * The stored CRCs are XOR sums which every record and annotation change
+ * keeps up to date, so once they have been verified against the records
+ * they stay right and there's nothing to gain by recalculating them
+ * again for every sync mismatch.  A full recalculation only happens for
+ * mailboxes which have never been verified, including those last written
+ * by a version which stored zero in that field.  mailbox_index_recalc(),
+ * which reconstruct and sync retries use, always recalculates.
  */
 EXPORTED struct synccrcs mailbox_synccrcs(struct mailbox *mailbox, int force)
 {
@@ -3020,7 +3477,7 @@ EXPORTED struct synccrcs mailbox_synccrcs(struct mailbox *mailbox, int force)
     const message_t *msg;
     struct synccrcs crcs = { 0, 0 };
 
-    if (!force)
+    if (!force || mailbox->i.synccrcs_verified)
         return mailbox->i.synccrcs;
 
     /* hold annotations DB open - failure to load is an error */
@@ -3046,7 +3503,13 @@ EXPORTED struct synccrcs mailbox_synccrcs(struct mailbox *mailbox, int force)
 
     /* possibly upgrade the stored value */
     if (mailbox_index_islocked(mailbox, /*write*/1)) {
+        if (mailbox->i.synccrcs.basic != crcs.basic ||
+            mailbox->i.synccrcs.annot != crcs.annot) {
+            syslog(LOG_NOTICE, "%s: sync CRCs were wrong, recalculated",
+                   mailbox->name);
+        }
         mailbox->i.synccrcs = crcs;
+        mailbox->i.synccrcs_verified = mailbox->i.highestmodseq;
         mailbox_index_dirty(mailbox);
     }
 
@@ -3106,6 +3569,8 @@ EXPORTED int mailbox_index_recalc(struct mailbox *mailbox)
     }
     mailbox_iter_done(&iter);
 
+    mailbox->i.synccrcs_verified = mailbox->i.highestmodseq;
+
 out:
     return r;
 }
@@ -3158,6 +3623,11 @@ static int mailbox_update_carddav(struct mailbox *mailbox,
         r = carddav_delete(carddavdb, cdata->dav.rowid);
     }
     else if (cdata->dav.imap_uid == new->uid) {
+        /* unchanged, e.g. an incremental dav_reconstruct */
+        if (cdata->dav.modseq == new->modseq &&
+            cdata->dav.alive == !(new->internal_flags & FLAG_INTERNAL_EXPUNGED))
+            goto done;
+
         /* just a flag change on an existing record */
         cdata->dav.modseq = new->modseq;
         cdata->dav.alive = (new->internal_flags & FLAG_INTERNAL_EXPUNGED) ? 0 : 1;
@@ -3266,6 +3736,11 @@ static int mailbox_update_caldav(struct mailbox *mailbox,
             caldav_alarm_touch_record(mailbox, new);
         }
 
+        /* unchanged, e.g. an incremental dav_reconstruct */
+        if (cdata->dav.modseq == new->modseq &&
+            cdata->dav.alive == !(new->internal_flags & FLAG_INTERNAL_EXPUNGED))
+            goto done;
+
         /* just a flags update to an existing record */
         cdata->dav.modseq = new->modseq;
         cdata->dav.alive = (new->internal_flags & FLAG_INTERNAL_EXPUNGED) ? 0 : 1;
@@ -3363,6 +3838,11 @@ static int mailbox_update_webdav(struct mailbox *mailbox,
         r = webdav_delete(webdavdb, wdata->dav.rowid);
     }
     else if (wdata->dav.imap_uid == new->uid) {
+        /* unchanged, e.g. an incremental dav_reconstruct */
+        if (wdata->dav.modseq == new->modseq &&
+            wdata->dav.alive == !(new->internal_flags & FLAG_INTERNAL_EXPUNGED))
+            goto done;
+
         /* just a flags update to an existing record */
         wdata->dav.modseq = new->modseq;
         wdata->dav.alive = (new->internal_flags & FLAG_INTERNAL_EXPUNGED) ? 0 : 1;
@@ -3498,6 +3978,7 @@ static int mailbox_update_conversations(struct mailbox *mailbox,
                                         struct index_record *new)
 {
     struct conversations_state *cstate = mailbox_get_cstate(mailbox);
+    int r;
 
     if (!cstate)
         return 0;
@@ -3509,7 +3990,11 @@ static int mailbox_update_conversations(struct mailbox *mailbox,
     if (!old && !new)
         return 0;
 
-    return conversations_update_record(cstate, mailbox, old, new, /*allowrenumber*/1);
+    stagetrace_enter(STAGETRACE_CONVERSATIONS);
+    r = conversations_update_record(cstate, mailbox, old, new, /*allowrenumber*/1);
+    stagetrace_leave(STAGETRACE_CONVERSATIONS);
+
+    return r;
 }
 
 
@@ -3552,34 +4037,777 @@ EXPORTED int mailbox_update_xconvmodseq(struct mailbox *mailbox, modseq_t newmod
     return r;
 }
 
-/* NOTE: maybe make this able to return error codes if we have
- * support for transactional mailbox updates later.  For now,
- * we expect callers to have already done all sanity checking */
-static int mailbox_update_indexes(struct mailbox *mailbox,
-                                  const struct index_record *old,
-                                  struct index_record *new)
+/*
+ * Precomputed sort keys.
+ *
+ * If mailbox_sortkeys is enabled we keep a per-mailbox cyrusdb keyed
+ * by UID, holding the keys that SORT would otherwise have to parse out
+ * of cyrus.cache for every message on every command.  The value format
+ * belongs to index.c (index_sortkeys_build); we just store it.  A
+ * missing entry is never an error - the reader falls back to the cache.
+ */
+EXPORTED int mailbox_sortkeys_enabled(struct mailbox *mailbox)
 {
-    int r = 0;
-#ifdef WITH_DAV
-    r = mailbox_update_dav(mailbox, old, new);
-    if (r) return r;
-#endif
+    if (!config_getswitch(IMAPOPT_MAILBOX_SORTKEYS))
+        return 0;
 
-    r = mailbox_update_conversations(mailbox, old, new);
-    if (r) return r;
+    /* only email mailboxes are ever sorted */
+    return !(mailbox->mbtype & MBTYPES_NONIMAP);
+}
 
-    /* NOTE - we do these last, once the counts are updated */
+static int mailbox_open_sortkeys(struct mailbox *mailbox, int create)
+{
+    const char *fname;
+    int r;
 
-    if (old)
-        mailbox_index_update_counts(mailbox, old, 0);
-    if (new)
-        mailbox_index_update_counts(mailbox, new, 1);
+    if (mailbox->sortkeys_db) return 0;
 
-    return 0;
-}
+    fname = mailbox_meta_fname(mailbox, META_SORTKEYS);
+    if (!fname) return IMAP_MAILBOX_BADNAME;
 
-EXPORTED int mailbox_reload_index_record(struct mailbox *mailbox,
-                                         struct index_record *record)
+    r = cyrusdb_open(config_getstring(IMAPOPT_SORTKEYS_DB), fname,
+                     create ? CYRUSDB_CREATE : 0, &mailbox->sortkeys_db);
+    if (r) {
+        if (create)
+            syslog(LOG_ERR, "DBERROR: opening %s: %s",
+                   fname, cyrusdb_strerror(r));
+        mailbox->sortkeys_db = NULL;
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
+static void mailbox_close_sortkeys(struct mailbox *mailbox)
+{
+    if (!mailbox->sortkeys_db) return;
+
+    if (mailbox->sortkeys_txn) {
+        cyrusdb_abort(mailbox->sortkeys_db, mailbox->sortkeys_txn);
+        mailbox->sortkeys_txn = NULL;
+    }
+    cyrusdb_close(mailbox->sortkeys_db);
+    mailbox->sortkeys_db = NULL;
+}
+
+static int mailbox_commit_sortkeys(struct mailbox *mailbox)
+{
+    int r;
+
+    if (!mailbox->sortkeys_txn) return 0;
+
+    r = cyrusdb_commit(mailbox->sortkeys_db, mailbox->sortkeys_txn);
+    mailbox->sortkeys_txn = NULL;
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: committing sortkeys for %s: %s",
+               mailbox->name, cyrusdb_strerror(r));
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
+static void mailbox_abort_sortkeys(struct mailbox *mailbox)
+{
+    if (!mailbox->sortkeys_txn) return;
+
+    cyrusdb_abort(mailbox->sortkeys_db, mailbox->sortkeys_txn);
+    mailbox->sortkeys_txn = NULL;
+}
+
+EXPORTED int mailbox_lookup_sortkeys(struct mailbox *mailbox, uint32_t uid,
+                                     const char **valp, size_t *lenp)
+{
+    char key[16];
+    int r;
+
+    r = mailbox_open_sortkeys(mailbox, /*create*/0);
+    if (r) return r;
+
+    snprintf(key, sizeof(key), "%u", uid);
+    r = cyrusdb_fetch(mailbox->sortkeys_db, key, strlen(key), valp, lenp,
+                      mailbox->sortkeys_txn ? &mailbox->sortkeys_txn : NULL);
+
+    return r ? IMAP_NOTFOUND : 0;
+}
+
+static int mailbox_update_sortkeys(struct mailbox *mailbox,
+                                   const struct index_record *old,
+                                   struct index_record *new)
+{
+    struct buf value = BUF_INITIALIZER;
+    char key[16];
+    int r = 0;
+
+    if (!mailbox_sortkeys_enabled(mailbox))
+        return 0;
+
+    /* the keys only depend on the (immutable) cache record, so the
+     * only interesting transitions are append and expunge */
+    if (!old) {
+        if (new->internal_flags & (FLAG_INTERNAL_EXPUNGED|FLAG_INTERNAL_UNLINKED))
+            return 0;
+        /* a broken cache just means no keys - SORT will cope */
+        if (index_sortkeys_build(mailbox, new, &value))
+            return 0;
+    }
+    else if ((new->internal_flags & FLAG_INTERNAL_EXPUNGED) &&
+             !(old->internal_flags & FLAG_INTERNAL_EXPUNGED)) {
+        /* fall through to delete */
+    }
+    else {
+        return 0;
+    }
+
+    r = mailbox_open_sortkeys(mailbox, /*create*/1);
+    if (r) goto done;
+
+    snprintf(key, sizeof(key), "%u", new->uid);
+    if (buf_len(&value))
+        r = cyrusdb_store(mailbox->sortkeys_db, key, strlen(key),
+                          buf_base(&value), buf_len(&value),
+                          &mailbox->sortkeys_txn);
+    else
+        r = cyrusdb_delete(mailbox->sortkeys_db, key, strlen(key),
+                           &mailbox->sortkeys_txn, /*force*/1);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: updating sortkeys for %s %u: %s",
+               mailbox->name, new->uid, cyrusdb_strerror(r));
+        r = IMAP_IOERROR;
+    }
+
+done:
+    buf_free(&value);
+    return r;
+}
+
+/*
+ * NNTP overview.
+ *
+ * If mailbox_overview is enabled we keep a per-mailbox cyrusdb of the
+ * fields OVER and HDR return for each article, keyed by the UID as
+ * fixed width decimal so that a range of articles is a range of keys.
+ * As with the sort keys, the value format belongs to index.c
+ * (index_overview_build) and a missing entry just means the reader
+ * falls back to the cache.
+ */
+#define OVERVIEW_KEYLEN 10
+
+EXPORTED int mailbox_overview_enabled(struct mailbox *mailbox)
+{
+    if (!config_getswitch(IMAPOPT_MAILBOX_OVERVIEW))
+        return 0;
+
+    return !(mailbox->mbtype & MBTYPES_NONIMAP);
+}
+
+static int mailbox_open_overview(struct mailbox *mailbox, int create)
+{
+    const char *fname;
+    int r;
+
+    if (mailbox->overview_db) return 0;
+
+    fname = mailbox_meta_fname(mailbox, META_OVERVIEW);
+    if (!fname) return IMAP_MAILBOX_BADNAME;
+
+    r = cyrusdb_open(config_getstring(IMAPOPT_OVERVIEW_DB), fname,
+                     create ? CYRUSDB_CREATE : 0, &mailbox->overview_db);
+    if (r) {
+        if (create)
+            syslog(LOG_ERR, "DBERROR: opening %s: %s",
+                   fname, cyrusdb_strerror(r));
+        mailbox->overview_db = NULL;
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
+static void mailbox_close_overview(struct mailbox *mailbox)
+{
+    if (!mailbox->overview_db) return;
+
+    if (mailbox->overview_txn) {
+        cyrusdb_abort(mailbox->overview_db, mailbox->overview_txn);
+        mailbox->overview_txn = NULL;
+    }
+    cyrusdb_close(mailbox->overview_db);
+    mailbox->overview_db = NULL;
+}
+
+static int mailbox_commit_overview(struct mailbox *mailbox)
+{
+    int r;
+
+    if (!mailbox->overview_txn) return 0;
+
+    r = cyrusdb_commit(mailbox->overview_db, mailbox->overview_txn);
+    mailbox->overview_txn = NULL;
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: committing overview for %s: %s",
+               mailbox->name, cyrusdb_strerror(r));
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
+static void mailbox_abort_overview(struct mailbox *mailbox)
+{
+    if (!mailbox->overview_txn) return;
+
+    cyrusdb_abort(mailbox->overview_db, mailbox->overview_txn);
+    mailbox->overview_txn = NULL;
+}
+
+struct overview_rock {
+    uint32_t fromuid;
+    uint32_t touid;
+    mailbox_overview_cb_t *proc;
+    void *rock;
+};
+
+static int overview_uid(const char *key, size_t keylen, uint32_t *uidp)
+{
+    const char *p;
+
+    if (keylen != OVERVIEW_KEYLEN) return -1;
+    if (parseuint32(key, &p, uidp) || p != key + keylen) return -1;
+
+    return 0;
+}
+
+static int overview_good(void *rock, const char *key, size_t keylen,
+                         const char *val __attribute__((unused)),
+                         size_t vallen __attribute__((unused)))
+{
+    struct overview_rock *orock = rock;
+    uint32_t uid;
+
+    if (overview_uid(key, keylen, &uid)) return 0;
+
+    return uid >= orock->fromuid;
+}
+
+static int overview_cb(void *rock, const char *key, size_t keylen,
+                       const char *val, size_t vallen)
+{
+    struct overview_rock *orock = rock;
+    uint32_t uid;
+
+    if (overview_uid(key, keylen, &uid)) return 0;
+
+    /* keys are in order, so we're done */
+    if (uid > orock->touid) return CYRUSDB_DONE;
+
+    return orock->proc(uid, val, vallen, orock->rock);
+}
+
+/*
+ * Call 'proc' for each stored overview from 'fromuid' to 'touid'
+ * inclusive, in UID order.  Returns IMAP_NOTFOUND if the mailbox has
+ * no overview database at all.
+ */
+EXPORTED int mailbox_foreach_overview(struct mailbox *mailbox,
+                                      uint32_t fromuid, uint32_t touid,
+                                      mailbox_overview_cb_t *proc, void *rock)
+{
+    struct overview_rock orock = { fromuid, touid, proc, rock };
+    char fromkey[OVERVIEW_KEYLEN+1], tokey[OVERVIEW_KEYLEN+1];
+    size_t prefixlen = 0;
+    int r;
+
+    r = mailbox_open_overview(mailbox, /*create*/0);
+    if (r) return IMAP_NOTFOUND;
+
+    /* scan from the longest prefix shared by both ends of the range */
+    snprintf(fromkey, sizeof(fromkey), "%0*u", OVERVIEW_KEYLEN, fromuid);
+    snprintf(tokey, sizeof(tokey), "%0*u", OVERVIEW_KEYLEN, touid);
+    while (prefixlen < OVERVIEW_KEYLEN && fromkey[prefixlen] == tokey[prefixlen])
+        prefixlen++;
+
+    r = cyrusdb_foreach(mailbox->overview_db, fromkey, prefixlen,
+                        overview_good, overview_cb, &orock,
+                        mailbox->overview_txn ? &mailbox->overview_txn : NULL);
+    if (r == CYRUSDB_DONE) r = 0;
+
+    return r;
+}
+
+static int mailbox_update_overview(struct mailbox *mailbox,
+                                   const struct index_record *old,
+                                   struct index_record *new)
+{
+    struct buf value = BUF_INITIALIZER;
+    char key[OVERVIEW_KEYLEN+1];
+    int r = 0;
+
+    if (!mailbox_overview_enabled(mailbox))
+        return 0;
+
+    /* like the sort keys, this only depends on the cache record */
+    if (!old) {
+        if (new->internal_flags & (FLAG_INTERNAL_EXPUNGED|FLAG_INTERNAL_UNLINKED))
+            return 0;
+        if (index_overview_build(mailbox, new, &value))
+            return 0;
+    }
+    else if ((new->internal_flags & FLAG_INTERNAL_EXPUNGED) &&
+             !(old->internal_flags & FLAG_INTERNAL_EXPUNGED)) {
+        /* fall through to delete */
+    }
+    else {
+        return 0;
+    }
+
+    r = mailbox_open_overview(mailbox, /*create*/1);
+    if (r) goto done;
+
+    snprintf(key, sizeof(key), "%0*u", OVERVIEW_KEYLEN, new->uid);
+    if (buf_len(&value))
+        r = cyrusdb_store(mailbox->overview_db, key, OVERVIEW_KEYLEN,
+                          buf_base(&value), buf_len(&value),
+                          &mailbox->overview_txn);
+    else
+        r = cyrusdb_delete(mailbox->overview_db, key, OVERVIEW_KEYLEN,
+                           &mailbox->overview_txn, /*force*/1);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: updating overview for %s %u: %s",
+               mailbox->name, new->uid, cyrusdb_strerror(r));
+        r = IMAP_IOERROR;
+    }
+
+done:
+    buf_free(&value);
+    return r;
+}
+
+static int mailbox_update_msgid(struct mailbox *mailbox,
+                                const struct index_record *old,
+                                struct index_record *new)
+{
+    const char *newsprefix = config_getstring(IMAPOPT_NEWSPREFIX);
+    char *c_env, *envtokens[NUMENVTOKENS];
+
+    if (!msgid_db_enabled())
+        return 0;
+
+    /* only shared mailboxes under the news prefix are ever served by nntpd */
+    if ((mailbox->mbtype & MBTYPES_NONIMAP) ||
+        mboxname_isusermailbox(mailbox->name, 0) ||
+        (newsprefix && strncmp(mailbox->name, newsprefix, strlen(newsprefix))))
+        return 0;
+
+    if (!old) {
+        if (new->internal_flags & (FLAG_INTERNAL_EXPUNGED|FLAG_INTERNAL_UNLINKED))
+            return 0;
+    }
+    else if (!(new->internal_flags & FLAG_INTERNAL_EXPUNGED) ||
+             (old->internal_flags & FLAG_INTERNAL_EXPUNGED)) {
+        return 0;
+    }
+
+    if (mailbox_cacherecord(mailbox, new) ||
+        cacheitem_size(new, CACHE_ENVELOPE) <= 2)
+        return 0;
+
+    c_env = xstrndup(cacheitem_base(new, CACHE_ENVELOPE) + 1,
+                     cacheitem_size(new, CACHE_ENVELOPE) - 2);
+    parse_cached_envelope(c_env, envtokens, NUMENVTOKENS);
+
+    if (envtokens[ENV_MSGID]) {
+        /* the index is advisory, so never fail the append over it */
+        if (!old)
+            msgid_db_add(envtokens[ENV_MSGID], mailbox->name, new->uid);
+        else
+            msgid_db_remove(envtokens[ENV_MSGID], mailbox->name);
+    }
+
+    free(c_env);
+    return 0;
+}
+
+/*
+ * Packed per-message annotations.
+ *
+ * If annotation_columns is set, the shared values of those entries are
+ * also kept in cyrus.annotcols: a header, then one fixed-size row per
+ * index record, holding one fixed-size slot per column.  It is a cache
+ * of the per-mailbox annotations db, never the only copy.  Each row
+ * carries the uid it was filled for and each slot the modseq of the
+ * record at the time, and every message annotation write also bumps
+ * the record's modseq - so a slot which doesn't match the current
+ * record is just a miss, whatever happened to the file in between.
+ *
+ * Slots are written through from mailbox_annot_changed() when the
+ * mailbox commits, and filled lazily on a miss by anyone holding the
+ * index lock (writers of the annotations db hold it exclusively).
+ */
+#define ANNOTCOLS_MAGIC "\241acols1\n"
+#define ANNOTCOLS_HEADER_SIZE 16    /* magic, config crc, row size */
+#define ANNOTCOLS_ROW_HEADER 8      /* uid, pad */
+#define ANNOTCOLS_SLOT_HEADER 16    /* modseq, crc, state, pad, length */
+
+enum {
+    ANNOTCOL_UNKNOWN = 0,
+    ANNOTCOL_VALUE,
+    ANNOTCOL_NONE,
+    ANNOTCOL_TOOBIG
+};
+
+struct annotcols_change {
+    uint32_t uid;
+    int col;
+    struct buf value;
+};
+
+static int annotcols_loaded = 0;
+static strarray_t *annotcols_entries = NULL;
+static size_t annotcols_slotsize = 0;
+static size_t annotcols_rowsize = 0;
+static uint32_t annotcols_crc = 0;
+
+static void annotcols_init(void)
+{
+    struct buf buf = BUF_INITIALIZER;
+    int i;
+
+    if (annotcols_loaded) return;
+    annotcols_loaded = 1;
+
+    annotcols_entries = strarray_split(config_getstring(IMAPOPT_ANNOTATION_COLUMNS),
+                                       NULL, STRARRAY_TRIM);
+    if (!annotcols_entries->count) return;
+
+    /* the length of a value is stored in 16 bits */
+    annotcols_slotsize = config_getint(IMAPOPT_ANNOTATION_COLUMN_SIZE);
+    if (annotcols_slotsize < 8) annotcols_slotsize = 8;
+    if (annotcols_slotsize > UINT16_MAX) annotcols_slotsize = UINT16_MAX;
+    annotcols_slotsize = (annotcols_slotsize + 7) & ~(size_t)7;
+
+    annotcols_rowsize = ANNOTCOLS_ROW_HEADER + annotcols_entries->count *
+                        (ANNOTCOLS_SLOT_HEADER + annotcols_slotsize);
+
+    /* a change of columns or slot size invalidates the whole file */
+    for (i = 0; i < annotcols_entries->count; i++)
+        buf_printf(&buf, "%s\n", strarray_nth(annotcols_entries, i));
+    buf_printf(&buf, "%u", (unsigned) annotcols_slotsize);
+    annotcols_crc = crc32_buf(&buf);
+    buf_free(&buf);
+}
+
+static int annotcols_column(const char *entry, const char *userid)
+{
+    annotcols_init();
+
+    /* only the shared value is packed */
+    if (!annotcols_entries->count || !userid || *userid)
+        return -1;
+
+    return strarray_find(annotcols_entries, entry, 0);
+}
+
+static int mailbox_open_annotcols(struct mailbox *mailbox)
+{
+    const char *fname;
+    const char *base;
+    char header[ANNOTCOLS_HEADER_SIZE];
+    int writable = !mailbox->is_readonly && mailbox_index_islocked(mailbox, 1);
+    int r;
+
+    if (mailbox->annotcols && !mailbox->annotcols_bad)
+        return 0;
+
+    /* missing or stale: only a writer may start the file over */
+    if (mailbox->annotcols_bad && !writable)
+        return IMAP_NOTFOUND;
+
+    /* opened before the index was reopened read-write? */
+    if (mailbox->annotcols && !mappedfile_iswritable(mailbox->annotcols))
+        mappedfile_close(&mailbox->annotcols);
+
+    if (!mailbox->annotcols) {
+        fname = mailbox_meta_fname(mailbox, META_ANNOTCOLS);
+        if (!fname) return IMAP_MAILBOX_BADNAME;
+
+        r = mappedfile_open(&mailbox->annotcols, fname,
+                            writable ? MAPPEDFILE_CREATE|MAPPEDFILE_RW : 0);
+        if (r) {
+            mailbox->annotcols = NULL;
+            mailbox->annotcols_bad = 1;
+            return IMAP_NOTFOUND;
+        }
+    }
+
+    base = mappedfile_base(mailbox->annotcols);
+    if (mappedfile_size(mailbox->annotcols) >= ANNOTCOLS_HEADER_SIZE &&
+        !memcmp(base, ANNOTCOLS_MAGIC, 8) &&
+        ntohl(*((bit32 *)(base+8))) == annotcols_crc &&
+        ntohl(*((bit32 *)(base+12))) == annotcols_rowsize) {
+        mailbox->annotcols_bad = 0;
+        return 0;
+    }
+
+    mailbox->annotcols_bad = 1;
+    if (!writable)
+        return IMAP_NOTFOUND;
+
+    /* new file, or the columns changed: start over */
+    memcpy(header, ANNOTCOLS_MAGIC, 8);
+    *((bit32 *)(header+8)) = htonl(annotcols_crc);
+    *((bit32 *)(header+12)) = htonl(annotcols_rowsize);
+
+    r = mappedfile_truncate(mailbox->annotcols, 0);
+    if (!r && mappedfile_pwrite(mailbox->annotcols, header,
+                                sizeof(header), 0) < 0)
+        r = IMAP_IOERROR;
+    mappedfile_defer_commit(mailbox->annotcols);
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: resetting %s",
+               mappedfile_fname(mailbox->annotcols));
+        return IMAP_IOERROR;
+    }
+
+    mailbox->annotcols_bad = 0;
+    return 0;
+}
+
+static void mailbox_abort_annotcols(struct mailbox *mailbox)
+{
+    struct annotcols_change *change;
+
+    while ((change = ptrarray_pop(&mailbox->annotcols_changes))) {
+        buf_free(&change->value);
+        free(change);
+    }
+}
+
+static void mailbox_close_annotcols(struct mailbox *mailbox)
+{
+    mailbox_abort_annotcols(mailbox);
+    ptrarray_fini(&mailbox->annotcols_changes);
+
+    if (mailbox->annotcols) {
+        /* it's a cache: no need to wait for the disk on the way out */
+        mappedfile_defer_commit(mailbox->annotcols);
+        mappedfile_close(&mailbox->annotcols);
+    }
+    mailbox->annotcols_bad = 0;
+}
+
+static size_t annotcols_rowoffset(const struct index_record *record)
+{
+    return ANNOTCOLS_HEADER_SIZE + (record->recno - 1) * annotcols_rowsize;
+}
+
+static size_t annotcols_offset(const struct index_record *record, int col)
+{
+    return annotcols_rowoffset(record) + ANNOTCOLS_ROW_HEADER +
+           col * (ANNOTCOLS_SLOT_HEADER + annotcols_slotsize);
+}
+
+static int mailbox_write_annotcol(struct mailbox *mailbox,
+                                  const struct index_record *record,
+                                  int col, const struct buf *value)
+{
+    struct buf slot = BUF_INITIALIZER;
+    bit32 uid = htonl(record->uid);
+    char *p;
+    int state;
+    int r;
+
+    if (!record->recno || mailbox->is_readonly)
+        return 0;
+
+    r = mailbox_open_annotcols(mailbox);
+    if (r) return r;
+
+    if (!buf_len(value))
+        state = ANNOTCOL_NONE;
+    else if (buf_len(value) > annotcols_slotsize)
+        state = ANNOTCOL_TOOBIG;
+    else
+        state = ANNOTCOL_VALUE;
+
+    /* the crc covers the slot header (with a zero crc) and value */
+    buf_truncate(&slot, ANNOTCOLS_SLOT_HEADER);
+    p = slot.s;
+    memset(p, 0, ANNOTCOLS_SLOT_HEADER);
+    align_htonll(p, record->modseq);
+    p[12] = state;
+    *((uint16_t *)(p+14)) = htons(state == ANNOTCOL_VALUE ? buf_len(value) : 0);
+    if (state == ANNOTCOL_VALUE)
+        buf_appendmap(&slot, buf_base(value), buf_len(value));
+    *((bit32 *)(slot.s+8)) = htonl(crc32_buf(&slot));
+
+    /* (re)stamp the row with its uid, then the slot itself */
+    if (mappedfile_pwrite(mailbox->annotcols, &uid, sizeof(uid),
+                          annotcols_rowoffset(record)) < 0 ||
+        mappedfile_pwritebuf(mailbox->annotcols, &slot,
+                             annotcols_offset(record, col)) < 0) {
+        syslog(LOG_ERR, "IOERROR: writing %s",
+               mappedfile_fname(mailbox->annotcols));
+        r = IMAP_IOERROR;
+    }
+    mappedfile_defer_commit(mailbox->annotcols);
+
+    buf_free(&slot);
+    return r;
+}
+
+/* Returns 0 with the value (empty if there isn't one) if the packed
+ * slot answers for 'record', IMAP_NOTFOUND if the db must be asked */
+static int mailbox_read_annotcol(struct mailbox *mailbox,
+                                 const struct index_record *record,
+                                 int col, struct buf *value)
+{
+    const char *base;
+    const char *slot;
+    size_t len;
+    bit32 crc;
+    char header[ANNOTCOLS_SLOT_HEADER];
+    struct iovec iov[2];
+
+    if (!record->recno || mailbox_open_annotcols(mailbox))
+        return IMAP_NOTFOUND;
+
+    if (annotcols_rowoffset(record) + annotcols_rowsize >
+        mappedfile_size(mailbox->annotcols))
+        return IMAP_NOTFOUND;
+
+    base = mappedfile_base(mailbox->annotcols);
+    if (ntohl(*((bit32 *)(base + annotcols_rowoffset(record)))) != record->uid)
+        return IMAP_NOTFOUND;
+
+    slot = base + annotcols_offset(record, col);
+    if (align_ntohll(slot) != record->modseq)
+        return IMAP_NOTFOUND;
+
+    len = ntohs(*((uint16_t *)(slot+14)));
+    if (len > annotcols_slotsize)
+        return IMAP_NOTFOUND;
+
+    /* a torn write from a concurrent filler just looks like a miss */
+    memcpy(header, slot, ANNOTCOLS_SLOT_HEADER);
+    crc = ntohl(*((bit32 *)(header+8)));
+    memset(header+8, 0, 4);
+    iov[0].iov_base = header;
+    iov[0].iov_len = ANNOTCOLS_SLOT_HEADER;
+    iov[1].iov_base = (void *)(slot + ANNOTCOLS_SLOT_HEADER);
+    iov[1].iov_len = len;
+    if (crc != crc32_iovec(iov, 2))
+        return IMAP_NOTFOUND;
+
+    switch (slot[12]) {
+    case ANNOTCOL_VALUE:
+        buf_setmap(value, slot + ANNOTCOLS_SLOT_HEADER, len);
+        return 0;
+    case ANNOTCOL_NONE:
+        buf_reset(value);
+        return 0;
+    default:
+        return IMAP_NOTFOUND;
+    }
+}
+
+static void mailbox_annotcols_changed(struct mailbox *mailbox, uint32_t uid,
+                                      const char *entry, const char *userid,
+                                      const struct buf *newval)
+{
+    struct annotcols_change *change;
+    int col = annotcols_column(entry, userid);
+
+    if (col < 0) return;
+
+    /* the record's new modseq is only known at commit */
+    change = xzmalloc(sizeof(struct annotcols_change));
+    change->uid = uid;
+    change->col = col;
+    buf_copy(&change->value, newval);
+    ptrarray_append(&mailbox->annotcols_changes, change);
+}
+
+static void mailbox_commit_annotcols(struct mailbox *mailbox)
+{
+    struct annotcols_change *change;
+    struct index_record record;
+    int i;
+
+    /* failures just leave misses behind, which is always safe */
+    for (i = 0; i < mailbox->annotcols_changes.count; i++) {
+        change = ptrarray_nth(&mailbox->annotcols_changes, i);
+        if (!mailbox_find_index_record(mailbox, change->uid, &record))
+            mailbox_write_annotcol(mailbox, &record, change->col, &change->value);
+    }
+
+    mailbox_abort_annotcols(mailbox);
+}
+
+EXPORTED int mailbox_annotation_lookup_record(struct mailbox *mailbox,
+                                              const struct index_record *record,
+                                              const char *entry,
+                                              const char *userid,
+                                              struct buf *value)
+{
+    int col = annotcols_column(entry, userid);
+    int r;
+
+    if (col < 0)
+        return annotatemore_msg_lookup(mailbox->name, record->uid,
+                                       entry, userid, value);
+
+    if (!mailbox_read_annotcol(mailbox, record, col, value))
+        return 0;
+
+    buf_reset(value);
+    r = annotatemore_msg_lookup(mailbox->name, record->uid, entry, userid, value);
+    if (r) return r;
+
+    /* nobody can be changing annotations while we hold the index lock */
+    if (mailbox_index_islocked(mailbox, 0))
+        mailbox_write_annotcol(mailbox, record, col, value);
+
+    return 0;
+}
+
+/* NOTE: maybe make this able to return error codes if we have
+ * support for transactional mailbox updates later.  For now,
+ * we expect callers to have already done all sanity checking */
+static int mailbox_update_indexes(struct mailbox *mailbox,
+                                  const struct index_record *old,
+                                  struct index_record *new)
+{
+    int r = 0;
+#ifdef WITH_DAV
+    r = mailbox_update_dav(mailbox, old, new);
+    if (r) return r;
+#endif
+
+    r = mailbox_update_conversations(mailbox, old, new);
+    if (r) return r;
+
+    r = mailbox_update_sortkeys(mailbox, old, new);
+    if (r) return r;
+
+    r = mailbox_update_overview(mailbox, old, new);
+    if (r) return r;
+
+    r = mailbox_update_msgid(mailbox, old, new);
+    if (r) return r;
+
+    /* NOTE - we do these last, once the counts are updated */
+
+    if (old)
+        mailbox_index_update_counts(mailbox, old, 0);
+    if (new)
+        mailbox_index_update_counts(mailbox, new, 1);
+
+    return 0;
+}
+
+EXPORTED int mailbox_reload_index_record(struct mailbox *mailbox,
+                                         struct index_record *record)
 {
     if (record->recno)
         return mailbox_read_index_record(mailbox, record->recno, record);
@@ -3606,6 +4834,11 @@ EXPORTED int mailbox_rewrite_index_record(struct mailbox *mailbox,
     assert(record->recno > 0 &&
            record->recno <= mailbox->i.num_records);
 
+    if (mailbox->i.options & OPT_MAILBOX_PACKED) {
+        r = mailbox_index_unpack(mailbox);
+        if (r) return r;
+    }
+
     r = mailbox_read_index_record(mailbox, record->recno, &oldrecord);
     if (r) {
         syslog(LOG_ERR, "IOERROR: re-reading: %s %u",
@@ -3726,6 +4959,11 @@ EXPORTED int mailbox_append_index_record(struct mailbox *mailbox,
 
     assert(mailbox_index_islocked(mailbox, 1));
 
+    if (mailbox->i.options & OPT_MAILBOX_PACKED) {
+        r = mailbox_index_unpack(mailbox);
+        if (r) return r;
+    }
+
     /* Append MUST be a higher UID than any we've yet seen */
     assert(record->uid > mailbox->i.last_uid)
 
@@ -3814,8 +5052,80 @@ EXPORTED int mailbox_append_index_record(struct mailbox *mailbox,
     return 0;
 }
 
+struct record_unlink {
+    struct index_record record;
+    int archive;
+    const char *audit;      /* auditlog action, NULL for none */
+};
+
+static void record_unlinked(const char *fname __attribute__((unused)),
+                            int err, void *rock, void *itemrock)
+{
+    struct mailbox *mailbox = (struct mailbox *) rock;
+    struct record_unlink *ru = (struct record_unlink *) itemrock;
+
+    if (!err) {
+        if (ru->audit && config_auditlog) {
+            char flagstr[FLAGMAPSTR_MAXLEN];
+            flags_to_str(&ru->record, flagstr);
+            syslog(LOG_NOTICE, "auditlog: %s sessionid=<%s> "
+                   "mailbox=<%s> uniqueid=<%s> uid=<%u> sysflags=<%s>",
+                   ru->audit, session_id(), mailbox->name, mailbox->uniqueid,
+                   ru->record.uid, flagstr);
+        }
+        sis_release(mailbox, &ru->record.guid, ru->archive);
+    }
+
+    free(ru);
+}
+
+/* unlink a message file now, or through 'batch' if there is one */
+static void record_unlink(struct mailbox *mailbox, struct unlink_batch *batch,
+                          const struct index_record *record,
+                          const char *fname, int archive, const char *audit)
+{
+    struct record_unlink *ru = xmalloc(sizeof(struct record_unlink));
+
+    ru->record = *record;
+    ru->archive = archive;
+    ru->audit = audit;
+
+    if (batch)
+        cyrus_unlink_batch_add(batch, fname, 0, ru);
+    else
+        record_unlinked(fname, unlink(fname) ? errno : 0, mailbox, ru);
+}
+
+/* never rate limited: these run under the exclusive index lock, and
+ * must be done before the index stops listing the records */
+static struct unlink_batch *mailbox_unlink_batch(struct mailbox *mailbox)
+{
+    return cyrus_unlink_batch_new(record_unlinked, mailbox, 0);
+}
+
+/* unlink whatever is still queued, and account for the lot */
+static void mailbox_unlink_done(struct unlink_batch **batchp, const char *name)
+{
+    unsigned long unlinked, failed;
+    double seconds;
+
+    if (!*batchp) return;
+
+    cyrus_unlink_batch_flush(*batchp);
+    cyrus_unlink_batch_stats(*batchp, &unlinked, &failed, &seconds);
+    cyrus_unlink_batch_free(batchp);
+
+    prometheus_apply_delta(CYRUS_MAILBOX_UNLINKED_FILES_TOTAL, unlinked);
+    prometheus_apply_delta(CYRUS_MAILBOX_UNLINK_SECONDS_TOTAL, seconds);
+
+    if (unlinked || failed)
+        syslog(LOG_INFO, "Unlinked %lu files (%lu failed) for %s in %.3fs",
+               unlinked, failed, name, seconds);
+}
+
 static void mailbox_record_cleanup(struct mailbox *mailbox,
-                                   struct index_record *record)
+                                   struct index_record *record,
+                                   struct unlink_batch *batch)
 {
     const char *spoolfname = mailbox_spool_fname(mailbox, record->uid);
     const char *archivefname = mailbox_archive_fname(mailbox, record->uid);
@@ -3839,30 +5149,10 @@ static void mailbox_record_cleanup(struct mailbox *mailbox,
 
     else if (record->internal_flags & FLAG_INTERNAL_UNLINKED) {
         /* try to delete both */
+        record_unlink(mailbox, batch, record, spoolfname, 0, "unlink");
 
-        if (unlink(spoolfname) == 0) {
-            if (config_auditlog) {
-                char flagstr[FLAGMAPSTR_MAXLEN];
-                flags_to_str(record, flagstr);
-                syslog(LOG_NOTICE, "auditlog: unlink sessionid=<%s> "
-                       "mailbox=<%s> uniqueid=<%s> uid=<%u> sysflags=<%s>",
-                       session_id(), mailbox->name, mailbox->uniqueid,
-                       record->uid, flagstr);
-            }
-        }
-
-        if (strcmp(spoolfname, archivefname)) {
-            if (unlink(archivefname) == 0) {
-                if (config_auditlog) {
-                    char flagstr[FLAGMAPSTR_MAXLEN];
-                    flags_to_str(record, flagstr);
-                    syslog(LOG_NOTICE, "auditlog: unlinkarchive sessionid=<%s> "
-                           "mailbox=<%s> uniqueid=<%s> uid=<%u> sysflags=<%s>",
-                           session_id(), mailbox->name, mailbox->uniqueid,
-                           record->uid, flagstr);
-                }
-            }
-        }
+        if (strcmp(spoolfname, archivefname))
+            record_unlink(mailbox, batch, record, archivefname, 1, "unlinkarchive");
 
         r = mailbox_get_annotate_state(mailbox, record->uid, NULL);
         if (r) {
@@ -3883,11 +5173,11 @@ static void mailbox_record_cleanup(struct mailbox *mailbox,
         if (record->internal_flags & FLAG_INTERNAL_ARCHIVED) {
             /* XXX - stat to make sure the other file exists first? - we mostly
             *  trust that we didn't do stupid things everywhere else, so maybe not */
-            unlink(spoolfname);
+            record_unlink(mailbox, batch, record, spoolfname, 0, NULL);
         }
 
         else {
-            unlink(archivefname);
+            record_unlink(mailbox, batch, record, archivefname, 1, NULL);
         }
     }
 
@@ -3906,6 +5196,7 @@ static int mailbox_index_unlink(struct mailbox *mailbox)
      *    to be removed.
      */
     const message_t *msg;
+    struct unlink_batch *batch = mailbox_unlink_batch(mailbox);
     struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, 0);
     while ((msg = mailbox_iter_step(iter))) {
         const struct index_record *record = msg_record(msg);
@@ -3914,7 +5205,7 @@ static int mailbox_index_unlink(struct mailbox *mailbox)
         if ((record->internal_flags & FLAG_INTERNAL_NEEDS_CLEANUP) ||
             record->internal_flags & FLAG_INTERNAL_UNLINKED) {
             struct index_record copyrecord = *record;
-            mailbox_record_cleanup(mailbox, &copyrecord);
+            mailbox_record_cleanup(mailbox, &copyrecord, batch);
             copyrecord.internal_flags &= ~FLAG_INTERNAL_NEEDS_CLEANUP;
             copyrecord.silent = 1;
             /* XXX - error handling */
@@ -3922,6 +5213,7 @@ static int mailbox_index_unlink(struct mailbox *mailbox)
         }
     }
     mailbox_iter_done(&iter);
+    mailbox_unlink_done(&batch, mailbox->name);
 
     /* need to clear the flag, even if nothing needed unlinking! */
     mailbox_index_dirty(mailbox);
@@ -3996,6 +5288,8 @@ static int mailbox_repack_setup(struct mailbox *mailbox, int version,
         repack->i.record_size = 104;
         break;
     case 16:
+        /* version 17 just added packed records */
+    case 17:
         repack->i.start_offset = 160;
         repack->i.record_size = 112;
         break;
@@ -4039,6 +5333,7 @@ static int mailbox_repack_setup(struct mailbox *mailbox, int version,
     }
 
     /* zero out some values */
+    repack->i.options &= ~OPT_MAILBOX_PACKED;
     repack->i.num_records = 0;
     repack->i.quota_mailbox_used = 0;
     repack->i.num_records = 0;
@@ -4070,8 +5365,13 @@ static int mailbox_repack_setup(struct mailbox *mailbox, int version,
     return IMAP_IOERROR;
 }
 
+/*
+ * Write 'record' to the new index, appending it unless 'newrecno' is
+ * set, in which case it replaces the record already written there.
+ */
 static int mailbox_repack_add(struct mailbox_repack *repack,
-                              struct index_record *record)
+                              struct index_record *record,
+                              uint32_t newrecno)
 {
     struct mappedfile *cachefile;
     indexbuffer_t ibuf;
@@ -4079,6 +5379,24 @@ static int mailbox_repack_add(struct mailbox_repack *repack,
     int r;
     int n;
 
+    if (newrecno) {
+        /* take the old copy out of the counts; its cache record is
+         * left behind in the new cache file */
+        struct index_record oldrecord;
+        off_t offset = repack->i.start_offset +
+                       (off_t) (newrecno-1) * repack->i.record_size;
+
+        n = pread(repack->newindex_fd, buf, repack->i.record_size, offset);
+        if (n != (int) repack->i.record_size)
+            return IMAP_IOERROR;
+        r = mailbox_buf_to_index_record((const char *) buf,
+                                        repack->i.minor_version,
+                                        &oldrecord, 0);
+        if (r) return r;
+        header_update_counts(&repack->i, &oldrecord, 0);
+        repack->i.leaked_cache_records++;
+    }
+
     cachefile = repack_cachefile(repack, record);
 
     /* write out the new cache record - need to clear the cache_offset
@@ -4092,6 +5410,15 @@ static int mailbox_repack_add(struct mailbox_repack *repack,
 
     /* write the index record out */
     mailbox_index_record_to_buf(record, repack->i.minor_version, buf);
+    if (newrecno) {
+        n = pwrite(repack->newindex_fd, buf, repack->i.record_size,
+                   repack->i.start_offset +
+                   (off_t) (newrecno-1) * repack->i.record_size);
+        if (n != (int) repack->i.record_size)
+            return IMAP_IOERROR;
+        return 0;
+    }
+
     n = retry_write(repack->newindex_fd, buf, repack->i.record_size);
     if (n == -1)
         return IMAP_IOERROR;
@@ -4104,6 +5431,7 @@ static int mailbox_repack_add(struct mailbox_repack *repack,
 static void mailbox_repack_abort(struct mailbox_repack **repackptr)
 {
     struct mailbox_repack *repack = *repackptr;
+    struct index_record *record;
     int i;
 
     if (!repack) return; /* safe against double-free */
@@ -4126,11 +5454,82 @@ static void mailbox_repack_abort(struct mailbox_repack **repackptr)
     }
     ptrarray_fini(&repack->caches);
 
+    while ((record = ptrarray_pop(&repack->cleanups)))
+        free(record);
+    ptrarray_fini(&repack->cleanups);
+
+    /* the records were marked unlinked already, the files can go */
+    mailbox_unlink_done(&repack->unlinks, repack->mailbox->name);
+
     free(repack->userid);
     free(repack);
     *repackptr = NULL;
 
-    return;
+    return;
+}
+
+/*
+ * Replace the plain records written to the new index by packed ones,
+ * or leave them be if that wouldn't make them any smaller.
+ */
+static int repack_pack_records(struct mailbox_repack *repack)
+{
+    size_t record_size = repack->i.record_size;
+    uint32_t num_records = repack->i.num_records;
+    uint32_t nblocks = (num_records + PACKED_BLOCK_RECORDS - 1) / PACKED_BLOCK_RECORDS;
+    unsigned char *recs = xmalloc(PACKED_BLOCK_RECORDS * record_size);
+    struct buf packed = BUF_INITIALIZER;
+    uint32_t block, count;
+    size_t start;
+    bit32 crc;
+    int r = IMAP_IOERROR;
+
+    assert(repack->i.minor_version == MAILBOX_MINOR_VERSION);
+
+    buf_truncate(&packed, PACKED_PREFIX_SIZE + ((size_t) nblocks + 1) * 4);
+
+    for (block = 0; block < nblocks; block++) {
+        count = num_records - block * PACKED_BLOCK_RECORDS;
+        if (count > PACKED_BLOCK_RECORDS) count = PACKED_BLOCK_RECORDS;
+
+        if (pread(repack->newindex_fd, recs, count * record_size,
+                  repack->i.start_offset +
+                  (off_t) block * PACKED_BLOCK_RECORDS * record_size)
+            != (ssize_t) (count * record_size))
+            goto done;
+
+        start = buf_len(&packed);
+        *((bit32 *)(packed.s + PACKED_PREFIX_SIZE + 4*block)) = htonl(start);
+        buf_appendmap(&packed, "\0\0\0\0", 4);
+        mailbox_pack_block(recs, count, record_size, &packed);
+        crc = htonl(crc32_map(packed.s + start + 4, buf_len(&packed) - start - 4));
+        memcpy(packed.s + start, &crc, 4);
+    }
+    *((bit32 *)(packed.s + PACKED_PREFIX_SIZE + 4*nblocks)) = htonl(buf_len(&packed));
+    *((bit32 *)(packed.s)) = htonl(buf_len(&packed));
+    *((bit32 *)(packed.s + 4)) = htonl(num_records);
+
+    if (buf_len(&packed) >= (size_t) num_records * record_size ||
+        buf_len(&packed) > UINT32_MAX) {
+        syslog(LOG_NOTICE, "Not packing index of %s, it wouldn't be smaller",
+               repack->mailbox->name);
+        repack->i.options &= ~OPT_MAILBOX_PACKED;
+        r = 0;
+        goto done;
+    }
+
+    if (pwrite(repack->newindex_fd, packed.s, buf_len(&packed),
+               repack->i.start_offset) != (ssize_t) buf_len(&packed))
+        goto done;
+    if (ftruncate(repack->newindex_fd, repack->i.start_offset + buf_len(&packed)))
+        goto done;
+
+    r = 0;
+
+done:
+    free(recs);
+    buf_free(&packed);
+    return r;
 }
 
 HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
@@ -4144,6 +5543,9 @@ HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
 
     assert(repack);
 
+    /* any files the repack dropped are gone before the index says so */
+    mailbox_unlink_done(&repack->unlinks, repack->mailbox->name);
+
     repack->i.last_repack_time = time(0);
 
     assert(repack->i.synccrcs.basic == repack->mailbox->i.synccrcs.basic);
@@ -4167,6 +5569,10 @@ HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
         seen_freedata(&sd);
     }
 
+    /* all the records are there now, so they can be packed */
+    if ((repack->i.options & OPT_MAILBOX_PACKED) && repack_pack_records(repack))
+        goto fail;
+
     /* rewrite the header with updated details */
     mailbox_index_header_to_buf(&repack->i, buf);
 
@@ -4220,6 +5626,9 @@ HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
 
     strarray_fini(&cachefiles);
 
+    assert(!repack->cleanups.count);
+    ptrarray_fini(&repack->cleanups);
+
     seqset_free(repack->seqset);
     free(repack->userid);
     free(repack);
@@ -4232,8 +5641,102 @@ HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
     return r;
 }
 
+/*
+ * Copy one record into the repack.  'newrecno' is zero to append it,
+ * or the position of an earlier copy of it to replace.  Sets *newrecnop
+ * to where it was written, or zero if it was dropped.
+ */
+static int repack_record(struct mailbox_repack *repack,
+                         const struct index_record *record,
+                         uint32_t newrecno, uint32_t *newrecnop)
+{
+    struct mailbox *mailbox = repack->mailbox;
+    struct index_record copyrecord = *record;
+    int needs_cache_upgrade = 0;
+    int r;
+
+    if (newrecnop) *newrecnop = 0;
+
+    /* version changes? */
+    if (mailbox->i.minor_version < 12 && repack->i.minor_version >= 12) {
+        if (seqset_ismember(repack->seqset, copyrecord.uid))
+            copyrecord.system_flags |= FLAG_SEEN;
+        else
+            copyrecord.system_flags &= ~FLAG_SEEN;
+
+        needs_cache_upgrade = 1;
+
+    }
+    if (mailbox->i.minor_version >= 12 && repack->i.minor_version < 12) {
+        if (repack->seqset)
+            seqset_add(repack->seqset, copyrecord.uid, copyrecord.system_flags & FLAG_SEEN ? 1 : 0);
+        copyrecord.system_flags &= ~FLAG_SEEN;
+    }
+
+    /* force cache upgrade across version 15 repack */
+    if (repack->i.minor_version >= 15 && record->cache_version < 9)
+        needs_cache_upgrade = 1;
+
+    /* better handle the cleanup just in case it's unlinked too */
+    /* still gotta check for FLAG_INTERNAL_UNLINKED, because it may have been
+     * created by old code.  Woot */
+    if (copyrecord.internal_flags & (FLAG_INTERNAL_NEEDS_CLEANUP | FLAG_INTERNAL_UNLINKED)) {
+        /* other sessions may still be reading these files during an
+         * online repack, so only remove them at the swap */
+        if (repack->defer_cleanup)
+            ptrarray_append(&repack->cleanups,
+                            xmemdup(&copyrecord, sizeof(copyrecord)));
+        else {
+            if (!repack->unlinks)
+                repack->unlinks = mailbox_unlink_batch(mailbox);
+            mailbox_record_cleanup(mailbox, &copyrecord, repack->unlinks);
+        }
+        copyrecord.internal_flags &= ~FLAG_INTERNAL_NEEDS_CLEANUP;
+        /* no need to rewrite - it's already being written to the new file */
+    }
+
+    /* we aren't keeping unlinked files, that's kind of the point */
+    if (copyrecord.internal_flags & FLAG_INTERNAL_UNLINKED) {
+        /* track the modseq for QRESYNC purposes */
+        if (copyrecord.modseq > repack->i.deletedmodseq)
+            repack->i.deletedmodseq = copyrecord.modseq;
+
+        if (!newrecno) return 0;
+
+        /* it's already in the new index, so it has to stay for now */
+        repack->keep_needs_repack = 1;
+    }
+
+    if (needs_cache_upgrade) {
+        const char *fname = mailbox_record_fname(mailbox, &copyrecord);
+
+        if (message_parse(fname, &copyrecord)) {
+            /* failed to parse, don't try to write out record */
+            copyrecord.crec.len = 0;
+            /* and the record is expunged too! */
+            copyrecord.internal_flags |= FLAG_INTERNAL_EXPUNGED | FLAG_INTERNAL_UNLINKED;
+            syslog(LOG_ERR, "IOERROR: FATAL - failed to parse file for %s %u, expunging",
+                   repack->mailbox->name, copyrecord.uid);
+        }
+    }
+
+    if (!copyrecord.createdmodseq)
+        copyrecord.createdmodseq = 1;
+
+    /* read in the old cache record */
+    r = mailbox_cacherecord(mailbox, &copyrecord);
+    if (r) return r;
+
+    r = mailbox_repack_add(repack, &copyrecord, newrecno);
+    if (r) return r;
+
+    if (newrecnop) *newrecnop = newrecno ? newrecno : repack->i.num_records;
+    return 0;
+}
+
 /* need a mailbox exclusive lock, we're rewriting files */
-static int mailbox_index_repack(struct mailbox *mailbox, int version)
+static int mailbox_index_repack(struct mailbox *mailbox, int version,
+                                int packed)
 {
     struct mailbox_repack *repack = NULL;
     const message_t *msg;
@@ -4244,81 +5747,172 @@ static int mailbox_index_repack(struct mailbox *mailbox, int version)
 
     r = mailbox_repack_setup(mailbox, version, &repack);
     if (r) goto done;
+    if (packed && version >= 17) repack->i.options |= OPT_MAILBOX_PACKED;
 
     iter = mailbox_iter_init(mailbox, 0, 0);
     while ((msg = mailbox_iter_step(iter))) {
-        const struct index_record *record = msg_record(msg);
-        struct index_record copyrecord = *record;
-        int needs_cache_upgrade = 0;
+        r = repack_record(repack, msg_record(msg), 0, NULL);
+        if (r) goto done;
+    }
 
-        /* version changes? */
-        if (mailbox->i.minor_version < 12 && repack->i.minor_version >= 12) {
-            if (seqset_ismember(repack->seqset, copyrecord.uid))
-                copyrecord.system_flags |= FLAG_SEEN;
-            else
-                copyrecord.system_flags &= ~FLAG_SEEN;
+    /* we unlinked any "needs unlink" in the process */
+    repack->i.options &= ~(OPT_MAILBOX_NEEDS_REPACK|OPT_MAILBOX_NEEDS_UNLINK);
 
-            needs_cache_upgrade = 1;
+done:
+    mailbox_iter_done(&iter);
+    if (r) mailbox_repack_abort(&repack);
+    else r = mailbox_repack_commit(&repack);
+    return r;
+}
 
-        }
-        if (mailbox->i.minor_version >= 12 && repack->i.minor_version < 12) {
-            if (repack->seqset)
-                seqset_add(repack->seqset, copyrecord.uid, copyrecord.system_flags & FLAG_SEEN ? 1 : 0);
-            copyrecord.system_flags &= ~FLAG_SEEN;
-        }
+/* how many records to copy per shared lock during an online repack */
+#define REPACK_ONLINE_BATCH 1024
 
-        /* force cache upgrade across version 15 repack */
-        if (repack->i.minor_version >= 15 && record->cache_version < 9)
-            needs_cache_upgrade = 1;
+/*
+ * Bring the repack's header up to date with the mailbox's, keeping
+ * the fields which describe the new files.
+ */
+static void repack_refresh_header(struct mailbox_repack *repack)
+{
+    struct index_header i = repack->mailbox->i; /* struct copy */
+
+    i.generation_no = repack->i.generation_no;
+    i.minor_version = repack->i.minor_version;
+    i.start_offset = repack->i.start_offset;
+    i.record_size = repack->i.record_size;
+    i.options = (i.options & ~OPT_MAILBOX_PACKED) |
+                (repack->i.options & OPT_MAILBOX_PACKED);
+    i.num_records = repack->i.num_records;
+    i.answered = repack->i.answered;
+    i.deleted = repack->i.deleted;
+    i.flagged = repack->i.flagged;
+    i.unseen = repack->i.unseen;
+    i.exists = repack->i.exists;
+    i.quota_mailbox_used = repack->i.quota_mailbox_used;
+    i.first_expunged = repack->i.first_expunged;
+    i.leaked_cache_records = repack->i.leaked_cache_records;
+    if (repack->i.deletedmodseq > i.deletedmodseq)
+        i.deletedmodseq = repack->i.deletedmodseq;
+
+    repack->i = i;
+}
 
-        /* better handle the cleanup just in case it's unlinked too */
-        /* still gotta check for FLAG_INTERNAL_UNLINKED, because it may have been
-         * created by old code.  Woot */
-        if (copyrecord.internal_flags & (FLAG_INTERNAL_NEEDS_CLEANUP | FLAG_INTERNAL_UNLINKED)) {
-            mailbox_record_cleanup(mailbox, &copyrecord);
-            copyrecord.internal_flags &= ~FLAG_INTERNAL_NEEDS_CLEANUP;
-            /* no need to rewrite - it's already being written to the new file */
-        }
+/*
+ * Repack the mailbox while other sessions carry on using it.  The
+ * records are copied in batches under a shared index lock.  Then we
+ * take the exclusive mailbox lock, which is what lets us replace the
+ * files, and catch up with anything which changed in the meantime
+ * (every change bumps the record's modseq) before the swap.
+ *
+ * Called with the mailbox open but the index unlocked.  Returns
+ * IMAP_MAILBOX_LOCKED if somebody else is busy with the mailbox, in
+ * which case nothing has changed.
+ */
+static int mailbox_index_repack_online(struct mailboxlist *listitem)
+{
+    struct mailbox *mailbox = &listitem->m;
+    struct mailbox_repack *repack = NULL;
+    struct mboxlock *repacklock = NULL;
+    struct index_record record;
+    char *lockname = strconcat("$REPACK$", mailbox->name, (char *)NULL);
+    uint32_t *newrecnos = NULL;
+    uint32_t recno, num_records = 0;
+    bit32 generation;
+    modseq_t since;
+    int r;
 
-        /* we aren't keeping unlinked files, that's kind of the point */
-        if (copyrecord.internal_flags & FLAG_INTERNAL_UNLINKED) {
-            /* track the modseq for QRESYNC purposes */
-            if (copyrecord.modseq > repack->i.deletedmodseq)
-                repack->i.deletedmodseq = copyrecord.modseq;
-            continue;
-        }
+    /* only one repacker at a time */
+    r = mboxname_lock(lockname, &repacklock, LOCK_NONBLOCKING);
+    if (r) {
+        r = IMAP_MAILBOX_LOCKED;
+        goto done;
+    }
+
+    r = mailbox_lock_index_internal(mailbox, LOCK_SHARED);
+    if (r) goto done;
+
+    syslog(LOG_INFO, "Repacking mailbox %s online", mailbox->name);
 
-        if (needs_cache_upgrade) {
-            const char *fname = mailbox_record_fname(mailbox, &copyrecord);
+    generation = mailbox->i.generation_no;
+    since = mailbox->i.highestmodseq;
+    num_records = mailbox->i.num_records;
 
-            if (message_parse(fname, &copyrecord)) {
-                /* failed to parse, don't try to write out record */
-                copyrecord.crec.len = 0;
-                /* and the record is expunged too! */
-                copyrecord.internal_flags |= FLAG_INTERNAL_EXPUNGED | FLAG_INTERNAL_UNLINKED;
-                syslog(LOG_ERR, "IOERROR: FATAL - failed to parse file for %s %u, expunging",
-                       repack->mailbox->name, copyrecord.uid);
+    r = mailbox_repack_setup(mailbox, mailbox->i.minor_version, &repack);
+    if (r) goto done;
+    repack->defer_cleanup = 1;
+
+    newrecnos = xzmalloc((num_records + 1) * sizeof(uint32_t));
+
+    for (recno = 1; recno <= num_records; recno++) {
+        if (recno % REPACK_ONLINE_BATCH == 0) {
+            /* give writers a go */
+            mailbox_unlock_index(mailbox, NULL);
+            r = mailbox_lock_index_internal(mailbox, LOCK_SHARED);
+            if (r) goto done;
+            if (mailbox->i.generation_no != generation) {
+                r = IMAP_MAILBOX_LOCKED;
+                goto done;
             }
         }
 
-        if (!copyrecord.createdmodseq)
-            copyrecord.createdmodseq = 1;
+        r = mailbox_read_index_record(mailbox, recno, &record);
+        if (!r) r = repack_record(repack, &record, 0, &newrecnos[recno]);
+        if (r) goto done;
+    }
+
+    mailbox_unlock_index(mailbox, NULL);
+
+    /* now for the swap; nobody else may have the mailbox open */
+    r = mailbox_mboxlock_reopen(listitem, LOCK_NONBLOCKING);
+    if (!r) r = mailbox_open_index(mailbox);
+    if (!r) r = mailbox_lock_index_internal(mailbox, LOCK_EXCLUSIVE);
+    if (r) {
+        r = IMAP_MAILBOX_LOCKED;
+        goto done;
+    }
+    if (mailbox->i.generation_no != generation) {
+        r = IMAP_MAILBOX_LOCKED;
+        goto done;
+    }
 
-        /* read in the old cache record */
-        r = mailbox_cacherecord(mailbox, &copyrecord);
+    /* catch up on records which changed since we copied them... */
+    for (recno = 1; recno <= num_records; recno++) {
+        r = mailbox_read_index_record(mailbox, recno, &record);
         if (r) goto done;
+        if (record.modseq <= since || !newrecnos[recno]) continue;
+        r = repack_record(repack, &record, newrecnos[recno], NULL);
+        if (r) goto done;
+    }
 
-        r = mailbox_repack_add(repack, &copyrecord);
+    /* ... and any which were added */
+    for (; recno <= mailbox->i.num_records; recno++) {
+        r = mailbox_read_index_record(mailbox, recno, &record);
+        if (!r) r = repack_record(repack, &record, 0, NULL);
         if (r) goto done;
     }
 
-    /* we unlinked any "needs unlink" in the process */
-    repack->i.options &= ~(OPT_MAILBOX_NEEDS_REPACK|OPT_MAILBOX_NEEDS_UNLINK);
+    /* nobody else can see the expunged files now */
+    if (repack->cleanups.count && !repack->unlinks)
+        repack->unlinks = mailbox_unlink_batch(mailbox);
+    while (repack->cleanups.count) {
+        struct index_record *cleanup = ptrarray_pop(&repack->cleanups);
+        mailbox_record_cleanup(mailbox, cleanup, repack->unlinks);
+        free(cleanup);
+    }
+
+    repack_refresh_header(repack);
+    repack->i.options &= ~OPT_MAILBOX_NEEDS_UNLINK;
+    if (!repack->keep_needs_repack)
+        repack->i.options &= ~OPT_MAILBOX_NEEDS_REPACK;
+
+    r = mailbox_repack_commit(&repack);
 
 done:
-    mailbox_iter_done(&iter);
-    if (r) mailbox_repack_abort(&repack);
-    else r = mailbox_repack_commit(&repack);
+    if (repack) mailbox_repack_abort(&repack);
+    if (mailbox->index_locktype) mailbox_unlock_index(mailbox, NULL);
+    mboxname_release(&repacklock);
+    free(newrecnos);
+    free(lockname);
     return r;
 }
 
@@ -4397,6 +5991,88 @@ EXPORTED unsigned mailbox_should_archive(struct mailbox *mailbox,
     return 0;
 }
 
+/* how many moved messages to make durable at once */
+#define ARCHIVE_BATCH 64
+
+struct archive_pending {
+    struct index_record record;
+    const char *action;
+};
+
+/*
+ * Hold back to archive_maxrate kilobytes per second.  The budget
+ * covers the whole process, not just one mailbox.
+ */
+static void archive_throttle(size_t bytes)
+{
+    static struct timeval start;
+    static uint64_t moved;
+    int maxrate = config_getint(IMAPOPT_ARCHIVE_MAXRATE);
+    struct timeval now;
+    double elapsed, wanted;
+
+    if (maxrate <= 0) return;
+
+    gettimeofday(&now, NULL);
+    if (!start.tv_sec) start = now;
+    moved += bytes;
+
+    elapsed = timesub(&start, &now);
+    wanted = (double) moved / (maxrate * 1024.0);
+
+    if (wanted > elapsed + 0.001)
+        usleep((useconds_t) ((wanted - elapsed) * 1000000));
+}
+
+/*
+ * Once the batched copies are on disk, point the index records at
+ * them.  If the copies failed the records are left alone, so the
+ * messages will be moved on a later run.
+ */
+static void archive_flush(struct mailbox *mailbox,
+                          struct copyfile_batch **batchp,
+                          struct archive_pending *pending, int npending,
+                          int differentcache, int *dirtycache)
+{
+    int i;
+
+    if (cyrus_copyfile_batch_commit(batchp)) {
+        syslog(LOG_ERR, "IOERROR archive %s failed to sync %d copies",
+               mailbox->name, npending);
+        return;
+    }
+
+    for (i = 0; i < npending; i++) {
+        struct index_record *copyrecord = &pending[i].record;
+
+        /* got a new cache record to write */
+        if (differentcache)
+        {
+            *dirtycache = 1;
+            copyrecord->cache_offset = 0;
+            if (mailbox_append_cache(mailbox, copyrecord))
+                continue;
+        }
+
+        /* rewrite the index record */
+        copyrecord->silent = 1;
+        if (mailbox_rewrite_index_record(mailbox, copyrecord))
+            continue;
+        mailbox->i.options |= OPT_MAILBOX_NEEDS_UNLINK;
+
+        if (config_auditlog) {
+            char flagstr[FLAGMAPSTR_MAXLEN];
+            flags_to_str(copyrecord, flagstr);
+            syslog(LOG_NOTICE, "auditlog: %s sessionid=<%s> mailbox=<%s> "
+                   "uniqueid=<%s> uid=<%u> guid=<%s> cid=<%s> sysflags=<%s>",
+                   pending[i].action, session_id(), mailbox->name,
+                   mailbox->uniqueid, copyrecord->uid,
+                   message_guid_encode(&copyrecord->guid),
+                   conversation_id_encode(copyrecord->cid), flagstr);
+        }
+    }
+}
+
 /*
  * Move messages between spool and archive partition
  * function pointed to by 'decideproc' is called (with 'deciderock') to
@@ -4411,6 +6087,9 @@ EXPORTED void mailbox_archive(struct mailbox *mailbox,
     int dirtycache = 0;
     const message_t *msg;
     struct index_record copyrecord;
+    struct copyfile_batch *batch = NULL;
+    struct archive_pending *pending;
+    int npending = 0;
     const char *srcname;
     const char *destname;
     char *spoolcache = xstrdup(mailbox_meta_fname(mailbox, META_CACHE));
@@ -4426,6 +6105,8 @@ EXPORTED void mailbox_archive(struct mailbox *mailbox,
     assert(mailbox_index_islocked(mailbox, 1));
     if (!decideproc) decideproc = &mailbox_should_archive;
 
+    pending = xmalloc(ARCHIVE_BATCH * sizeof(struct archive_pending));
+
     struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, flags);
 
     while ((msg = mailbox_iter_step(iter))) {
@@ -4448,7 +6129,17 @@ EXPORTED void mailbox_archive(struct mailbox *mailbox,
 #if defined ENABLE_OBJECTSTORE
             if (object_storage_enabled){
                 /* upload on the blob store */
+                int retries = config_getint(IMAPOPT_OBJECT_STORAGE_PUT_RETRIES);
+                int delay = 1;
                 r = objectstore_put(mailbox, &copyrecord, srcname);
+                while (r && retries-- > 0) {
+                    syslog(LOG_WARNING, "archive %s %u objectstorage put failed, "
+                           "retrying in %ds: %s", mailbox->name, copyrecord.uid,
+                           delay, error_message(r));
+                    sleep(delay);
+                    delay *= 2;
+                    r = objectstore_put(mailbox, &copyrecord, srcname);
+                }
                 if (r) {
                     syslog(LOG_ERR, "IOERROR archive %s %u failed to objectstorage put file (%s): %s",
                            mailbox->name, copyrecord.uid, srcname, error_message(r));
@@ -4500,42 +6191,32 @@ EXPORTED void mailbox_archive(struct mailbox *mailbox,
         if (!object_storage_enabled){
             /* got a file to copy! */
             if (strcmp(srcname, destname)) {
-                r = cyrus_copyfile(srcname, destname, COPYFILE_MKDIR);
+                if (!batch) batch = cyrus_copyfile_batch_new();
+                r = cyrus_copyfile_batch(batch, srcname, destname, COPYFILE_MKDIR);
                 if (r) {
                     syslog(LOG_ERR, "IOERROR archive %s %u failed to copyfile (%s => %s): %s",
                            mailbox->name, copyrecord.uid, srcname, destname, error_message(r));
                     continue;
                 }
+                archive_throttle(copyrecord.size);
             }
         }
 
-        /* got a new cache record to write */
-        if (differentcache)
-        {
-            dirtycache = 1;
-            copyrecord.cache_offset = 0;
-            if (mailbox_append_cache(mailbox, &copyrecord))
-                continue;
-        }
-
-        /* rewrite the index record */
-        copyrecord.silent = 1;
-        if (mailbox_rewrite_index_record(mailbox, &copyrecord))
-            continue;
-        mailbox->i.options |= OPT_MAILBOX_NEEDS_UNLINK;
-
-        if (config_auditlog) {
-            char flagstr[FLAGMAPSTR_MAXLEN];
-            flags_to_str(&copyrecord, flagstr);
-            syslog(LOG_NOTICE, "auditlog: %s sessionid=<%s> mailbox=<%s> "
-                   "uniqueid=<%s> uid=<%u> guid=<%s> cid=<%s> sysflags=<%s>",
-                   action, session_id(), mailbox->name, mailbox->uniqueid,
-                   copyrecord.uid, message_guid_encode(&copyrecord.guid),
-                   conversation_id_encode(copyrecord.cid), flagstr);
+        /* the index is only updated once the copies are on disk */
+        pending[npending].record = copyrecord;
+        pending[npending].action = action;
+        if (++npending == ARCHIVE_BATCH) {
+            archive_flush(mailbox, &batch, pending, npending,
+                          differentcache, &dirtycache);
+            npending = 0;
         }
     }
     mailbox_iter_done(&iter);
 
+    archive_flush(mailbox, &batch, pending, npending,
+                  differentcache, &dirtycache);
+    free(pending);
+
     /* if we have stale cache records, we'll need a repack */
     if (dirtycache) {
         mailbox_index_dirty(mailbox);
@@ -4737,6 +6418,31 @@ unsigned mailbox_count_unseen(struct mailbox *mailbox)
     return count;
 }
 
+/*
+ * Return the number of unexpunged messages above 'recentuid'.  Only
+ * the tail of the index is walked, so this is cheap in the usual case.
+ */
+EXPORTED unsigned mailbox_count_recent(struct mailbox *mailbox,
+                                       uint32_t recentuid)
+{
+    const message_t *msg;
+    unsigned count = 0;
+
+    if (recentuid >= mailbox->i.last_uid)
+        return 0;
+
+    struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, ITER_SKIP_EXPUNGED);
+    mailbox_iter_startuid(iter, recentuid+1);
+    while ((msg = mailbox_iter_step(iter))) {
+        const struct index_record *record = msg_record(msg);
+        if (record->uid > recentuid)
+            count++;
+    }
+    mailbox_iter_done(&iter);
+
+    return count;
+}
+
 /* returns a mailbox locked in MAILBOX EXCLUSIVE mode, so you
  * don't need to lock the index file to work with it :) */
 EXPORTED int mailbox_create(const char *name,
@@ -4871,7 +6577,8 @@ EXPORTED int mailbox_create(const char *name,
     mailbox->i.minor_version = MAILBOX_MINOR_VERSION;
     mailbox->i.start_offset = INDEX_HEADER_SIZE;
     mailbox->i.record_size = INDEX_RECORD_SIZE;
-    mailbox->i.options = options;
+    /* no records to be packed yet, whatever the options came from */
+    mailbox->i.options = options & ~OPT_MAILBOX_PACKED;
     mailbox->i.uidvalidity = uidvalidity;
     mailbox->i.createdmodseq = createdmodseq;
     mailbox->i.highestmodseq = highestmodseq;
@@ -4919,9 +6626,9 @@ done:
 }
 
 /*
- * Remove all files in directory
+ * Queue all files in directory for removal
  */
-static void mailbox_delete_files(const char *path)
+static void mailbox_delete_files(const char *path, struct unlink_batch *batch)
 {
     DIR *dirp;
     struct dirent *f;
@@ -4957,7 +6664,7 @@ static void mailbox_delete_files(const char *path)
                 fatal("Path too long", EC_OSFILE);
             }
             strcpy(tail, f->d_name);
-            unlink(buf);
+            cyrus_unlink_batch_add(batch, buf, f->d_ino, NULL);
             *tail = '\0';
         }
         closedir(dirp);
@@ -5207,6 +6914,16 @@ EXPORTED int mailbox_delete(struct mailbox **mailboxptr)
     return mailbox_delete_internal(mailboxptr);
 }
 
+/*
+ * As mailbox_delete(), for a mailbox going away with its whole user.
+ * The user's conversations database is removed along with the user,
+ * so there's no point unwinding it one record at a time.
+ */
+EXPORTED int mailbox_delete_withuser(struct mailbox **mailboxptr)
+{
+    return mailbox_delete_internal(mailboxptr);
+}
+
 struct meta_file {
     unsigned long metaflag;
     int optional;
@@ -5220,6 +6937,9 @@ static struct meta_file meta_files[] = {
     { META_SQUAT,        1, 0 },
     { META_ANNOTATIONS,  1, 1 },
     { META_ARCHIVECACHE, 1, 1 },
+    { META_SORTKEYS,     1, 1 },
+    { META_ANNOTCOLS,    1, 1 },
+    { META_OVERVIEW,     1, 1 },
     { 0, 0, 0 }
 };
 
@@ -5231,6 +6951,7 @@ static struct meta_file meta_files[] = {
 HIDDEN int mailbox_delete_cleanup(struct mailbox *mailbox, const char *part, const char *name, const char *uniqueid)
 {
     strarray_t paths = STRARRAY_INITIALIZER;
+    struct unlink_batch *batch;
     int i;
     mbentry_t *mbentry;
     struct meta_file *mf;
@@ -5265,10 +6986,12 @@ HIDDEN int mailbox_delete_cleanup(struct mailbox *mailbox, const char *part, con
         free(fname);
     }
 
+    batch = cyrus_unlink_batch_new(NULL, NULL, mailbox_unlink_maxrate);
     for (i = 0; i < paths.count; i++) {
         const char *path = strarray_nth(&paths, i);
-        mailbox_delete_files(path);
+        mailbox_delete_files(path, batch);
     }
+    mailbox_unlink_done(&batch, name);
 
     do {
         /* Check if the mailbox has children */
@@ -5321,6 +7044,7 @@ EXPORTED int mailbox_copy_files(struct mailbox *mailbox, const char *newpart,
     char oldbuf[MAX_MAILBOX_PATH], newbuf[MAX_MAILBOX_PATH];
     struct meta_file *mf;
     const message_t *msg;
+    struct copyfile_batch *batch;
     int r = 0;
 
     int object_storage_enabled = 0 ;
@@ -5345,6 +7069,9 @@ EXPORTED int mailbox_copy_files(struct mailbox *mailbox, const char *newpart,
         }
     }
 
+    /* message files are copied as a batch, syncing them all at the end */
+    batch = cyrus_copyfile_batch_new();
+
     struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, ITER_SKIP_UNLINKED);
     while ((msg = mailbox_iter_step(iter))) {
         const struct index_record *record = msg_record(msg);
@@ -5357,8 +7084,11 @@ EXPORTED int mailbox_copy_files(struct mailbox *mailbox, const char *newpart,
             xstrncpy(newbuf, mboxname_datapath(newpart, newname, newuniqueid, record->uid),
                     MAX_MAILBOX_PATH);
 
-        if (!(object_storage_enabled && record->internal_flags & FLAG_INTERNAL_ARCHIVED))    // if object storage do not move file
-           r = mailbox_copyfile(oldbuf, newbuf, 0);
+        if (!(object_storage_enabled && record->internal_flags & FLAG_INTERNAL_ARCHIVED)) {   // if object storage do not move file
+            if (mailbox_wait_cb) mailbox_wait_cb(mailbox_wait_cb_rock);
+            if (cyrus_copyfile_batch(batch, oldbuf, newbuf, COPYFILE_MKDIR))
+                r = IMAP_IOERROR;
+        }
 
         if (r) break;
 
@@ -5375,6 +7105,9 @@ EXPORTED int mailbox_copy_files(struct mailbox *mailbox, const char *newpart,
     }
     mailbox_iter_done(&iter);
 
+    if (cyrus_copyfile_batch_commit(&batch) && !r)
+        r = IMAP_IOERROR;
+
     return r;
 }
 
@@ -5572,6 +7305,139 @@ EXPORTED int mailbox_copyfile(const char *from, const char *to, int nolink)
     return 0;
 }
 
+/*
+ * Single instance blob store.  With singleinstance_blobs enabled, each
+ * message file on a partition is also linked as
+ * <partition>/sis./XX/<guid>, and a new file whose GUID is already
+ * there is swapped for a link to the existing blob.  That way separate
+ * deliveries, appends, copies between partitions and sync uploads of
+ * the same message all end up sharing one file.  The blob's link count
+ * is its reference count: once only the blob's own name is left it is
+ * removed.  "sis." can't clash with a mailbox directory.
+ */
+static const char *sis_fname(const char *part,
+                             const struct message_guid *guid, int archive)
+{
+    static char fname[MAX_MAILBOX_PATH];
+    const char *root = NULL;
+    const char *hex = message_guid_encode(guid);
+
+    if (archive) root = config_archivepartitiondir(part);
+    if (!root) root = config_partitiondir(part);
+    if (!root) return NULL;
+
+    snprintf(fname, sizeof(fname), "%s/sis./%c%c/%s",
+             root, hex[0], hex[1], hex);
+
+    return fname;
+}
+
+/* Share the message file 'fname' for 'record' through the blob store */
+EXPORTED void mailbox_sis_share(struct mailbox *mailbox,
+                                const struct index_record *record,
+                                const char *fname)
+{
+    struct stat fsbuf, bsbuf;
+    const char *blob;
+    char *tmpname = NULL;
+    int tries;
+
+    if (!config_getswitch(IMAPOPT_SINGLEINSTANCE_BLOBS)) return;
+    if (message_guid_isnull(&record->guid)) return;
+#if defined ENABLE_OBJECTSTORE
+    /* the local copy of an archived message is only temporary */
+    if (config_getswitch(IMAPOPT_OBJECT_STORAGE_ENABLED) &&
+        (record->internal_flags & FLAG_INTERNAL_ARCHIVED))
+        return;
+#endif
+
+    blob = sis_fname(mailbox->part, &record->guid,
+                     record->internal_flags & FLAG_INTERNAL_ARCHIVED);
+    if (!blob) return;
+
+    if (stat(fname, &fsbuf) == -1) return;
+
+    for (tries = 0; tries < 2; tries++) {
+        if (stat(blob, &bsbuf) == -1) {
+            /* first one in: this file becomes the blob */
+            if (link(fname, blob) == 0) break;
+            if (errno == ENOENT) {
+                cyrus_mkdir(blob, 0755);
+                if (link(fname, blob) == 0) break;
+            }
+            if (errno != EEXIST) {
+                syslog(LOG_ERR, "IOERROR: linking %s to %s: %m", fname, blob);
+                break;
+            }
+            /* somebody beat us to it, share theirs */
+            continue;
+        }
+
+        if (bsbuf.st_ino == fsbuf.st_ino && bsbuf.st_dev == fsbuf.st_dev)
+            break;  /* already shared */
+
+        if (bsbuf.st_size != fsbuf.st_size) {
+            syslog(LOG_ERR, "IOERROR: sis blob %s has the wrong size "
+                   "(%lld != %lld), not sharing", blob,
+                   (long long) bsbuf.st_size, (long long) fsbuf.st_size);
+            break;
+        }
+
+        /* swap our copy for a link to the blob */
+        tmpname = strconcat(fname, ".sis", (char *)NULL);
+        unlink(tmpname);
+        if (link(blob, tmpname) == -1) {
+            /* removed under us by sis_release, try to become the blob */
+            free(tmpname);
+            tmpname = NULL;
+            continue;
+        }
+        if (rename(tmpname, fname) == -1) {
+            syslog(LOG_ERR, "IOERROR: renaming %s to %s: %m", tmpname, fname);
+            unlink(tmpname);
+        }
+        break;
+    }
+
+    free(tmpname);
+}
+
+/* Drop the blob for 'guid' if nothing else links to it any more */
+static void sis_release(struct mailbox *mailbox,
+                        const struct message_guid *guid, int archive)
+{
+    struct stat sbuf;
+    const char *blob;
+
+    if (!config_getswitch(IMAPOPT_SINGLEINSTANCE_BLOBS)) return;
+    if (message_guid_isnull(guid)) return;
+
+    blob = sis_fname(mailbox->part, guid, archive);
+    if (!blob) return;
+
+    /* a racing mailbox_sis_share() which loses its blob just makes a
+     * new one, so there's no need to lock */
+    if (stat(blob, &sbuf) == 0 && sbuf.st_nlink == 1)
+        unlink(blob);
+}
+
+/* as mailbox_copyfile(), but the copy (linked or not) is only synced
+ * when the batch is committed */
+EXPORTED int mailbox_copyfile_batch(struct copyfile_batch *batch,
+                                    const char *from, const char *to,
+                                    int nolink)
+{
+    int flags = COPYFILE_MKDIR | COPYFILE_SYNCLINK;
+    if (nolink) flags |= COPYFILE_NOLINK;
+
+    if (mailbox_wait_cb) mailbox_wait_cb(mailbox_wait_cb_rock);
+
+    if (cyrus_copyfile_batch(batch, from, to, flags))
+        return IMAP_IOERROR;
+
+    return 0;
+}
+
 /* ---------------------------------------------------------------------- */
 /*                      RECONSTRUCT SUPPORT                               */
 /* ---------------------------------------------------------------------- */
@@ -5773,7 +7639,7 @@ static void cleanup_stale_expunged(struct mailbox *mailbox)
         bufp = expunge_base + eoffset + (erecno-1)*expungerecord_size;
         mailbox_buf_to_index_record(bufp, eversion, &record, 0);
         record.internal_flags |= FLAG_INTERNAL_EXPUNGED | FLAG_INTERNAL_UNLINKED;
-        mailbox_record_cleanup(mailbox, &record);
+        mailbox_record_cleanup(mailbox, &record, NULL);
     }
 
     fname = mailbox_meta_fname(mailbox, META_EXPUNGE);
@@ -6451,6 +8317,11 @@ static int mailbox_wipe_index_record(struct mailbox *mailbox,
     assert(record->recno > 0 &&
            record->recno <= mailbox->i.num_records);
 
+    if (mailbox->i.options & OPT_MAILBOX_PACKED) {
+        n = mailbox_index_unpack(mailbox);
+        if (n) return n;
+    }
+
     record->uid = 0;
     record->internal_flags |= FLAG_INTERNAL_EXPUNGED | FLAG_INTERNAL_UNLINKED;
 
@@ -6805,6 +8676,11 @@ EXPORTED struct mailbox_iter *mailbox_iter_init(struct mailbox *mailbox,
     if (flags & ITER_SKIP_DELETED)
         iter->skipflags |= FLAG_DELETED;
 
+    /* a full body implies the cache too */
+    if (flags & ITER_NEED_BODY)
+        flags |= ITER_NEED_CACHE;
+    iter->needflags = flags & (ITER_NEED_CACHE|ITER_NEED_BODY);
+
     return iter;
 }
 
@@ -6825,6 +8701,15 @@ EXPORTED const message_t *mailbox_iter_step(struct mailbox_iter *iter)
         if ((record->system_flags & iter->skipflags)) continue;
         if ((record->internal_flags & iter->skipflags)) continue;
         if (record->modseq <= iter->changedsince) continue;
+
+        /* errors are logged here and reported again by the getters */
+        if (iter->needflags & ITER_NEED_CACHE)
+            mailbox_cacherecord(iter->mailbox, record);
+        if (iter->needflags & ITER_NEED_BODY) {
+            const char *fname = mailbox_record_fname(iter->mailbox, record);
+            if (fname) warmup_file(fname, 0, 0);
+        }
+
         return iter->msg;
     }
 
@@ -6956,6 +8841,13 @@ EXPORTED int mailbox_annotation_lookup(struct mailbox *mailbox, uint32_t uid,
                                        const char *entry, const char *userid,
                                        struct buf *value)
 {
+    struct index_record record;
+
+    if (annotcols_column(entry, userid) >= 0 &&
+        !mailbox_find_index_record(mailbox, uid, &record))
+        return mailbox_annotation_lookup_record(mailbox, &record,
+                                                entry, userid, value);
+
     return annotatemore_msg_lookup(mailbox->name, uid, entry, userid, value);
 }
 
@@ -7009,3 +8901,10 @@ EXPORTED void mailbox_set_wait_cb(void (*cb)(void *), void *rock)
     mailbox_wait_cb = cb;
     mailbox_wait_cb_rock = rock;
 }
+
+/* limit the removal of deleted mailboxes by this process to 'maxrate'
+ * files per second */
+EXPORTED void mailbox_set_unlink_maxrate(int maxrate)
+{
+    mailbox_unlink_maxrate = maxrate;
+}
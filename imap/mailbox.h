@@ -74,7 +74,7 @@
  * make sure all the mailbox upgrade and downgrade code in mailbox.c is
  * changed to be able to convert both backwards and forwards between the
  * new version and all supported previous versions */
-#define MAILBOX_MINOR_VERSION   16
+#define MAILBOX_MINOR_VERSION   17
 #define MAILBOX_CACHE_MINOR_VERSION 9
 
 #define FNAME_HEADER "/cyrus.header"
@@ -86,6 +86,9 @@
 #define FNAME_DAV "/cyrus.dav"
 #endif
 #define FNAME_ANNOTATIONS "/cyrus.annotations"
+#define FNAME_SORTKEYS "/cyrus.sortkeys"
+#define FNAME_ANNOTCOLS "/cyrus.annotcols"
+#define FNAME_OVERVIEW "/cyrus.overview"
 
 enum meta_filename {
   META_HEADER = 1,
@@ -97,7 +100,10 @@ enum meta_filename {
 #ifdef WITH_DAV
   META_DAV,
 #endif
-  META_ARCHIVECACHE
+  META_ARCHIVECACHE,
+  META_SORTKEYS,
+  META_ANNOTCOLS,
+  META_OVERVIEW
 };
 
 #define MAILBOX_FNAME_LEN 256
@@ -206,6 +212,8 @@ struct index_header {
 
     bit32 header_file_crc;
     struct synccrcs synccrcs;
+    modseq_t synccrcs_verified; /* highestmodseq when synccrcs were last
+                                   checked against every record, or 0 */
 
     uint32_t recentuid;
     time_t recenttime;
@@ -245,6 +253,10 @@ struct mailbox {
     ino_t index_ino;
     size_t index_size;
 
+    /* records of the packed block last read, see OPT_MAILBOX_PACKED */
+    unsigned char *packed_block;
+    uint32_t packed_blockno;    /* 1-based, 0 for none */
+
     /* Information in mailbox list */
     char *name;
     uint32_t mbtype;
@@ -266,6 +278,19 @@ struct mailbox {
     /* conversations */
     struct conversations_state *local_cstate;
 
+    /* precomputed sort keys (cyrus.sortkeys) */
+    struct db *sortkeys_db;
+    struct txn *sortkeys_txn;
+
+    /* NNTP overview (cyrus.overview) */
+    struct db *overview_db;
+    struct txn *overview_txn;
+
+    /* packed per-message annotations (cyrus.annotcols) */
+    struct mappedfile *annotcols;
+    int annotcols_bad;
+    ptrarray_t annotcols_changes;
+
 #ifdef WITH_DAV
     struct caldav_db *local_caldav;
     struct carddav_db *local_carddav;
@@ -292,6 +317,11 @@ struct mailbox {
 #define ITER_SKIP_EXPUNGED (1<<1)
 #define ITER_SKIP_DELETED (1<<2)
 
+/* what each step needs beyond the index record.  With neither, cache
+ * records are only read (and checksummed) if the caller asks for them */
+#define ITER_NEED_CACHE (1<<3)  /* load and verify the cache record */
+#define ITER_NEED_BODY  (1<<4)  /* ...and read ahead the message file */
+
 /* pre-declare message_t to avoid circular dependency problems */
 typedef struct message message_t;
 
@@ -302,6 +332,7 @@ struct mailbox_iter {
     uint32_t recno;
     uint32_t num_records;
     unsigned skipflags;
+    unsigned needflags;
 };
 
 /* Offsets of index/expunge header fields
@@ -347,8 +378,11 @@ struct mailbox_iter {
  * files. We've created the header space now, but will also need code
  * changes, so holding off */
 #define OFFSET_MAILBOX_CREATEDMODSEQ 128 /* MODSEQ at creation time */
-#define OFFSET_SPARE0 136
-#define OFFSET_SPARE1 140
+#define OFFSET_SYNCCRCS_VERIFIED 136 /* HIGHESTMODSEQ when the sync CRCs
+                                        were last fully recalculated,
+                                        0 if they need recalculating.
+                                        Was spare space, so older code
+                                        writes it as 0 */
 #define OFFSET_SPARE2 144
 #define OFFSET_SPARE3 148
 #define OFFSET_SPARE4 152
@@ -413,6 +447,7 @@ typedef enum _MsgInternalFlags {
  * struct annotate_mailbox_flags */
 #define OPT_IMAP_SHAREDSEEN (1<<2)      /* added for shared \Seen flag */
 #define OPT_IMAP_DUPDELIVER (1<<3)      /* added to allow duplicate delivery */
+#define OPT_MAILBOX_PACKED (1<<28)      /* records are packed (v17+), see mailbox.c */
 #define OPT_MAILBOX_NEEDS_UNLINK (1<<29)        /* files to be unlinked */
 #define OPT_MAILBOX_NEEDS_REPACK (1<<30)        /* repacking to do */
 #define OPT_MAILBOX_DELETED (1U<<31)    /* mailbox is deleted an awaiting cleanup */
@@ -424,7 +459,8 @@ typedef enum _MsgInternalFlags {
                               OPT_MAILBOX_NEEDS_REPACK | \
                               OPT_MAILBOX_DELETED)
 #define MAILBOX_OPT_VALID (MAILBOX_OPTIONS_MASK | \
-                           MAILBOX_CLEANUP_MASK)
+                           MAILBOX_CLEANUP_MASK | \
+                           OPT_MAILBOX_PACKED)
 
 /* reconstruct flags */
 #define RECONSTRUCT_QUIET           (1<<1)
@@ -537,6 +573,19 @@ const char *cacheitem_base(const struct index_record *record, int field);
 unsigned cacheitem_size(const struct index_record *record, int field);
 struct buf *cacheitem_buf(const struct index_record *record, int field);
 
+/* precomputed sort key API (cyrus.sortkeys, see index_sortkeys_build) */
+extern int mailbox_sortkeys_enabled(struct mailbox *mailbox);
+extern int mailbox_lookup_sortkeys(struct mailbox *mailbox, uint32_t uid,
+                                   const char **valp, size_t *lenp);
+
+/* NNTP overview API (cyrus.overview, see index_overview_build) */
+typedef int mailbox_overview_cb_t(uint32_t uid, const char *val, size_t len,
+                                  void *rock);
+extern int mailbox_overview_enabled(struct mailbox *mailbox);
+extern int mailbox_foreach_overview(struct mailbox *mailbox,
+                                    uint32_t fromuid, uint32_t touid,
+                                    mailbox_overview_cb_t *proc, void *rock);
+
 /* opening and closing */
 extern int mailbox_open_iwl(const char *name,
                             struct mailbox **mailboxptr);
@@ -547,6 +596,7 @@ extern int mailbox_open_exclusive(const char *name,
                                   struct mailbox **mailboxptr);
 extern void mailbox_close(struct mailbox **mailboxptr);
 extern int mailbox_delete(struct mailbox **mailboxptr);
+extern int mailbox_delete_withuser(struct mailbox **mailboxptr);
 
 struct caldav_db *mailbox_open_caldav(struct mailbox *mailbox);
 struct carddav_db *mailbox_open_carddav(struct mailbox *mailbox);
@@ -592,6 +642,8 @@ extern int mailbox_abort(struct mailbox *mailbox);
 extern int mailbox_internal_seen(const struct mailbox *mailbox, const char *userid);
 
 extern unsigned mailbox_count_unseen(struct mailbox *mailbox);
+extern unsigned mailbox_count_recent(struct mailbox *mailbox,
+                                     uint32_t recentuid);
 
 /* index locking operations */
 extern int mailbox_lock_index(struct mailbox *mailbox, int locktype);
@@ -627,11 +679,18 @@ extern int mailbox_rename_cleanup(struct mailbox **mailboxptr, int isinbox);
 
 
 extern int mailbox_copyfile(const char *from, const char *to, int nolink);
+extern int mailbox_copyfile_batch(struct copyfile_batch *batch,
+                                  const char *from, const char *to,
+                                  int nolink);
+extern void mailbox_sis_share(struct mailbox *mailbox,
+                              const struct index_record *record,
+                              const char *fname);
 
 extern int mailbox_reconstruct(const char *name, int flags);
 extern void mailbox_make_uniqueid(struct mailbox *mailbox);
 
 extern int mailbox_setversion(struct mailbox *mailbox, int version);
+extern int mailbox_setpacked(struct mailbox *mailbox);
 
 extern int mailbox_index_recalc(struct mailbox *mailbox);
 
@@ -662,6 +721,13 @@ extern int mailbox_annotation_writemask(struct mailbox *mailbox, uint32_t uid,
 extern int mailbox_annotation_lookup(struct mailbox *mailbox, uint32_t uid,
                                      const char *entry, const char *userid,
                                      struct buf *value);
+/* same, for a record already in hand: entries listed in
+ * annotation_columns are read from cyrus.annotcols where possible */
+extern int mailbox_annotation_lookup_record(struct mailbox *mailbox,
+                                            const struct index_record *record,
+                                            const char *entry,
+                                            const char *userid,
+                                            struct buf *value);
 
 
 extern int mailbox_annotation_lookupmask(struct mailbox *mailbox, uint32_t uid,
@@ -675,6 +741,9 @@ extern void mailbox_iter_startuid(struct mailbox_iter *iter, uint32_t uid);
 extern const message_t *mailbox_iter_step(struct mailbox_iter *iter);
 extern void mailbox_iter_done(struct mailbox_iter **iterp);
 
+/* Get the sync CRCs.  With 'recalc', recalculate them from every record,
+ * unless they have been verified that way since the last time they
+ * were reset.  The stored value is updated if the index is write locked. */
 struct synccrcs mailbox_synccrcs(struct mailbox *mailbox, int recalc);
 
 extern int mailbox_add_dav(struct mailbox *mailbox);
@@ -692,5 +761,6 @@ extern struct conversations_state *mailbox_get_cstate(struct mailbox *mailbox);
 
 typedef void mailbox_wait_cb_t(void *rock);
 extern void mailbox_set_wait_cb(mailbox_wait_cb_t *cb, void *rock);
+extern void mailbox_set_unlink_maxrate(int maxrate);
 
 #endif /* INCLUDED_MAILBOX_H */
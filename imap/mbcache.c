@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SHARED_MMAP
+#include <sys/mman.h>
+#endif
+
+#include "global.h"
+#include "hash.h"
+#include "mbcache.h"
+#include "strhash.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/*
+ * The generations file holds a global counter and a table of per-bucket
+ * counters, where a mailbox name hashes to one bucket.  The mupdate
+ * slave, the only writer of mailboxes.db on a frontend, bumps the bucket
+ * of every mailbox it changes (and the global counter after a resync).
+ * A cached entry remembers both counters as they were before it was read
+ * from the database, and is only used while they are unchanged.
+ */
+
+#define MBCACHE_MAGIC "CYRMBGEN"
+#define MBCACHE_MAGIC_SIZE 8
+#define MBCACHE_BUCKETS 4096
+#define MBCACHE_RETRY 60    /* seconds between attempts to map the file */
+
+struct mbcache_gens {
+    char magic[MBCACHE_MAGIC_SIZE];
+    uint32_t global;
+    uint32_t bucket[MBCACHE_BUCKETS];
+};
+
+struct mbcache_entry {
+    mbentry_t *mbentry;
+    uint32_t global;
+    uint32_t bucket;
+};
+
+static struct {
+    volatile struct mbcache_gens *gens;
+    int writable;
+    time_t nextmap;
+    int max;
+    hash_table table;
+} mbcache;
+
+static char *mbcache_fname(void)
+{
+    return strconcat(config_dir, FNAME_MBCACHE_GENS, (char *)NULL);
+}
+
+#ifdef HAVE_SHARED_MMAP
+static int mbcache_map(int writable)
+{
+    struct mbcache_gens *gens;
+    struct stat sbuf;
+    char *fname = mbcache_fname();
+    int fd;
+
+    fd = open(fname, writable ? O_RDWR|O_CREAT : O_RDONLY, 0644);
+    if (fd < 0) {
+        if (writable || errno != ENOENT)
+            syslog(LOG_ERR, "IOERROR: open %s: %m", fname);
+        free(fname);
+        return -1;
+    }
+
+    if (fstat(fd, &sbuf) < 0) goto fail;
+
+    if (sbuf.st_size != sizeof(struct mbcache_gens)) {
+        /* only the writer creates (or repairs) the file */
+        if (!writable ||
+            ftruncate(fd, 0) < 0 ||
+            ftruncate(fd, sizeof(struct mbcache_gens)) < 0) goto fail;
+    }
+
+    gens = mmap(NULL, sizeof(struct mbcache_gens),
+                writable ? PROT_READ|PROT_WRITE : PROT_READ,
+                MAP_SHARED, fd, 0);
+    if (gens == MAP_FAILED) goto fail;
+    close(fd);
+
+    if (memcmp(gens->magic, MBCACHE_MAGIC, MBCACHE_MAGIC_SIZE)) {
+        if (!writable) {
+            munmap(gens, sizeof(struct mbcache_gens));
+            free(fname);
+            return -1;
+        }
+        memcpy(gens->magic, MBCACHE_MAGIC, MBCACHE_MAGIC_SIZE);
+    }
+
+    mbcache.gens = gens;
+    mbcache.writable = writable;
+    free(fname);
+    return 0;
+
+ fail:
+    syslog(LOG_ERR, "IOERROR: mapping %s: %m", fname);
+    close(fd);
+    free(fname);
+    return -1;
+}
+#else /* !HAVE_SHARED_MMAP */
+static int mbcache_map(int writable __attribute__((unused)))
+{
+    return -1;
+}
+#endif /* HAVE_SHARED_MMAP */
+
+static void mbcache_free_entry(void *data)
+{
+    struct mbcache_entry *e = data;
+
+    mboxlist_entry_free(&e->mbentry);
+    free(e);
+}
+
+/* are we a frontend whose mailboxes.db only the mupdate slave writes? */
+static int mbcache_enabled(void)
+{
+    if (mbcache.max < 0) return 0;
+
+    if (!mbcache.max) {
+        mbcache.max = config_getint(IMAPOPT_MBOXLIST_CACHE_SIZE);
+        if (mbcache.max <= 0 || !config_mupdate_server ||
+            config_mupdate_config != IMAP_ENUM_MUPDATE_CONFIG_STANDARD ||
+            config_getstring(IMAPOPT_PROXYSERVERS)) {
+            mbcache.max = -1;
+            return 0;
+        }
+        construct_hash_table(&mbcache.table, mbcache.max, 0);
+    }
+
+    if (!mbcache.gens) {
+        time_t now = time(NULL);
+
+        /* the slave may not have created the file yet */
+        if (now < mbcache.nextmap) return 0;
+        if (mbcache_map(/*writable*/0)) {
+            mbcache.nextmap = now + MBCACHE_RETRY;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+EXPORTED int mbcache_lookup(const char *name, mbentry_t **mbentryptr)
+{
+    struct mbcache_entry *e;
+    mbentry_t *mbentry = NULL;
+    uint32_t global, bucket;
+    int r;
+
+    if (!mbcache_enabled())
+        return mboxlist_lookup(name, mbentryptr, NULL);
+
+    /* take the generations before reading the database */
+    global = mbcache.gens->global;
+    bucket = mbcache.gens->bucket[strhash(name) % MBCACHE_BUCKETS];
+
+    e = hash_lookup(name, &mbcache.table);
+    if (e && e->global == global && e->bucket == bucket) {
+        if (mbentryptr) *mbentryptr = mboxlist_entry_copy(e->mbentry);
+        return 0;
+    }
+
+    r = mboxlist_lookup(name, &mbentry, NULL);
+
+    /* misses and reservations make callers kick the slave, so
+       only current entries are worth keeping */
+    if (!r && !(mbentry->mbtype & MBTYPE_RESERVE)) {
+        if (!e) {
+            if (hash_numrecords(&mbcache.table) >= mbcache.max)
+                free_hash_table(&mbcache.table, mbcache_free_entry);
+            if (!mbcache.table.size)
+                construct_hash_table(&mbcache.table, mbcache.max, 0);
+
+            e = xzmalloc(sizeof(struct mbcache_entry));
+            hash_insert(name, e, &mbcache.table);
+        }
+        else mboxlist_entry_free(&e->mbentry);
+
+        e->mbentry = mboxlist_entry_copy(mbentry);
+        e->global = global;
+        e->bucket = bucket;
+    }
+    else if (e) {
+        hash_del(name, &mbcache.table);
+        mbcache_free_entry(e);
+    }
+
+    if (!r && mbentryptr) *mbentryptr = mbentry;
+    else mboxlist_entry_free(&mbentry);
+
+    return r;
+}
+
+EXPORTED void mbcache_invalidate(const char *name)
+{
+    if (!mbcache.writable) {
+#ifdef HAVE_SHARED_MMAP
+        if (mbcache.gens)
+            munmap((void *) mbcache.gens, sizeof(struct mbcache_gens));
+#endif
+        mbcache.gens = NULL;
+        if (mbcache_map(/*writable*/1)) return;
+    }
+
+    if (name) mbcache.gens->bucket[strhash(name) % MBCACHE_BUCKETS]++;
+    else mbcache.gens->global++;
+}
+
+EXPORTED void mbcache_done(void)
+{
+    if (mbcache.max > 0 && mbcache.table.size)
+        free_hash_table(&mbcache.table, mbcache_free_entry);
+
+#ifdef HAVE_SHARED_MMAP
+    if (mbcache.gens)
+        munmap((void *) mbcache.gens, sizeof(struct mbcache_gens));
+#endif
+
+    memset(&mbcache, 0, sizeof(mbcache));
+}
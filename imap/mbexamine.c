@@ -496,7 +496,7 @@ static int do_compare(struct findall_data *data, void *rock __attribute__((unuse
     printf("\n%-56s\t%s\n", " Index Record Info:", "Message File Info:");
 
     msgno = 0;
-    struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, 0);
+    struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, ITER_NEED_CACHE);
     const message_t *msg;
     while ((msg = mailbox_iter_step(iter)) || msgno < count) {
         const struct index_record *record = msg ? msg_record(msg) : NULL;
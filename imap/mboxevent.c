@@ -42,6 +42,8 @@
  */
 #include <config.h>
 #include "imap/mboxevent.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -57,11 +59,13 @@
 #include "caldav_db.h"
 #include "carddav_db.h"
 #endif /* WITH_DAV */
+#include "cyr_lock.h"
 #include "exitcodes.h"
 #include "global.h"
 #include "imapurl.h"
 #include "libconfig.h"
 #include "map.h"
+#include "retry.h"
 #include "times.h"
 #include "xmalloc.h"
 
@@ -70,8 +74,12 @@
 #include "mboxname.h"
 #include "msgrecord.h"
 #include "notify.h"
+#include "prometheus.h"
 #include "global.h"
 
+/* generated headers are not necessarily in current directory */
+#include "imap/imap_err.h"
+
 #define MESSAGE_EVENTS (EVENT_MESSAGE_APPEND|EVENT_MESSAGE_EXPIRE|\
                         EVENT_MESSAGE_EXPUNGE|EVENT_MESSAGE_NEW|\
                         EVENT_MESSAGE_COPY|EVENT_MESSAGE_MOVE)
@@ -103,6 +111,13 @@ static int enable_subfolder = 1;
 static int enabled_events = 0;
 static unsigned long extra_params;
 
+/* formatted notifications waiting for mboxevent_flush() */
+static strarray_t event_queue = STRARRAY_INITIALIZER;
+static int event_queue_size = 0;
+
+/* largest aggregated notification we'll build, in bytes */
+#define EVENT_BATCH_MAXSIZE 16384
+
 static struct mboxevent event_template =
 { 0,
   /* ordered to optimize the parsing of the notification message */
@@ -193,7 +208,8 @@ static int mboxevent_expected_param(enum event_type type, enum event_param param
 static int mboxevent_initialized = 0;
 
 static void done_cb(void *rock __attribute__((unused))) {
-    /* do nothing */
+    mboxevent_flush();
+    strarray_fini(&event_queue);
 }
 
 static void init_internal() {
@@ -252,6 +268,8 @@ EXPORTED int mboxevent_init(void)
     if (groups & IMAP_ENUM_EVENT_GROUPS_APPLEPUSHSERVICE)
         enabled_events |= APPLEPUSHSERVICE_EVENTS;
 
+    event_queue_size = config_getint(IMAPOPT_EVENT_QUEUE_SIZE);
+
     mboxevent_initialized = 1;
 
     return enabled_events;
@@ -621,6 +639,202 @@ static int mboxevent_expected_param(enum event_type type, enum event_param param
     return type & (MESSAGE_EVENTS|FLAGS_EVENTS);
 }
 
+/*
+ * Send events[start..] to the notifier, as few notifications as
+ * possible if the consumer takes batches.  Stops at the first one
+ * which can't be sent without blocking, and returns the index of
+ * that event (so the end of the array if everything was sent).
+ */
+static int send_events(const strarray_t *events, int start)
+{
+    int batch = config_getswitch(IMAPOPT_EVENT_BATCH);
+    struct buf buf = BUF_INITIALIZER;
+    int i = start, n;
+
+    while (i < strarray_size(events)) {
+        const char *message = strarray_nth(events, i);
+
+        n = 1;
+        if (batch) {
+            /* aggregate into one JSON array of events */
+            buf_setcstr(&buf, "[");
+            buf_appendcstr(&buf, message);
+            while (i + n < strarray_size(events)) {
+                const char *next = strarray_nth(events, i + n);
+                if (buf_len(&buf) + strlen(next) + 2 > EVENT_BATCH_MAXSIZE)
+                    break;
+                buf_putc(&buf, ',');
+                buf_appendcstr(&buf, next);
+                n++;
+            }
+            buf_putc(&buf, ']');
+            message = buf_cstring(&buf);
+        }
+
+        if (notify_nonblock(notifier, "EVENT", NULL, NULL, NULL, 0, NULL,
+                            message, NULL) == IMAP_AGAIN)
+            break;
+
+        /* a notification which failed outright is lost, as it always was */
+        i += n;
+    }
+
+    buf_free(&buf);
+    return i;
+}
+
+/*
+ * Append events[start..] to the spool file, for a later flush to send
+ * once the notifier has caught up.  If there is no spool file, or it's
+ * full, fall back to waiting for the notifier.
+ */
+static void spool_events(const strarray_t *events, int start)
+{
+    const char *fname = config_getstring(IMAPOPT_EVENT_SPOOL_FILE);
+    size_t maxsize = (size_t) config_getint(IMAPOPT_EVENT_SPOOL_MAXSIZE) * 1024;
+    struct buf buf = BUF_INITIALIZER;
+    struct stat sbuf;
+    int fd = -1;
+    int i;
+
+    if (!fname) goto block;
+
+    fd = open(fname, O_WRONLY|O_APPEND|O_CREAT, 0600);
+    if (fd < 0 || lock_blocking(fd, fname) || fstat(fd, &sbuf)) {
+        syslog(LOG_ERR, "IOERROR: event spool %s: %m", fname);
+        goto block;
+    }
+
+    for (i = start; i < strarray_size(events); i++) {
+        buf_appendcstr(&buf, strarray_nth(events, i));
+        buf_putc(&buf, '\n');
+    }
+
+    if ((size_t) sbuf.st_size + buf_len(&buf) > maxsize) {
+        syslog(LOG_WARNING, "event spool %s is full, waiting for notifier",
+               fname);
+        goto block;
+    }
+
+    if (retry_write(fd, buf_base(&buf), buf_len(&buf)) < 0) {
+        syslog(LOG_ERR, "IOERROR: writing event spool %s: %m", fname);
+        goto block;
+    }
+
+    prometheus_apply_delta(CYRUS_EVENT_SPOOLED_TOTAL,
+                           strarray_size(events) - start);
+    goto done;
+
+block:
+    for (i = start; i < strarray_size(events); i++) {
+        notify(notifier, "EVENT", NULL, NULL, NULL, 0, NULL,
+               strarray_nth(events, i), NULL);
+    }
+
+done:
+    if (fd >= 0) {
+        lock_unlock(fd, fname);
+        close(fd);
+    }
+    buf_free(&buf);
+}
+
+/*
+ * Try to send everything in the spool file.  Returns nonzero if
+ * anything is left in it (or someone else is sending it right now).
+ */
+static int drain_spool(void)
+{
+    const char *fname = config_getstring(IMAPOPT_EVENT_SPOOL_FILE);
+    strarray_t *events = NULL;
+    struct buf buf = BUF_INITIALIZER;
+    struct stat sbuf;
+    int fd, sent, r = 0;
+
+    if (!fname) return 0;
+
+    fd = open(fname, O_RDWR);
+    if (fd < 0) return 0;   /* nothing spooled */
+
+    /* whoever holds the lock is already sending or adding to it */
+    if (lock_nonblocking(fd, fname)) {
+        close(fd);
+        return 1;
+    }
+
+    if (fstat(fd, &sbuf) || !sbuf.st_size) goto done;
+
+    buf_ensure(&buf, sbuf.st_size);
+    if (retry_read(fd, buf.s, sbuf.st_size) != sbuf.st_size) {
+        syslog(LOG_ERR, "IOERROR: reading event spool %s: %m", fname);
+        r = 1;
+        goto done;
+    }
+    buf.len = sbuf.st_size;
+
+    events = strarray_nsplit(buf_base(&buf), buf_len(&buf), "\n", 0);
+
+    sent = send_events(events, 0);
+
+    /* keep whatever the notifier couldn't take yet */
+    buf_reset(&buf);
+    if (sent < strarray_size(events)) {
+        int i;
+        for (i = sent; i < strarray_size(events); i++) {
+            buf_appendcstr(&buf, strarray_nth(events, i));
+            buf_putc(&buf, '\n');
+        }
+        r = 1;
+    }
+
+    if (ftruncate(fd, 0) ||
+        lseek(fd, 0, SEEK_SET) < 0 ||
+        (buf_len(&buf) && retry_write(fd, buf_base(&buf), buf_len(&buf)) < 0)) {
+        syslog(LOG_ERR, "IOERROR: rewriting event spool %s: %m", fname);
+    }
+
+done:
+    lock_unlock(fd, fname);
+    close(fd);
+    strarray_free(events);
+    buf_free(&buf);
+    return r;
+}
+
+/*
+ * Send any queued event notifications.  Events which the notifier
+ * can't accept without blocking are spooled for the next flush.
+ */
+EXPORTED void mboxevent_flush(void)
+{
+    int sent = 0;
+
+    if (!strarray_size(&event_queue)) return;
+
+    /* don't overtake earlier events still in the spool */
+    if (!drain_spool())
+        sent = send_events(&event_queue, 0);
+
+    if (sent < strarray_size(&event_queue))
+        spool_events(&event_queue, sent);
+
+    strarray_truncate(&event_queue, 0);
+}
+
+static void send_event(char *formatted_message)
+{
+    if (event_queue_size <= 0) {
+        notify(notifier, "EVENT", NULL, NULL, NULL, 0, NULL,
+               formatted_message, NULL);
+        free(formatted_message);
+        return;
+    }
+
+    strarray_appendm(&event_queue, formatted_message);
+    if (strarray_size(&event_queue) >= event_queue_size)
+        mboxevent_flush();
+}
+
 #define TIMESTAMP_MAX 32
 EXPORTED void mboxevent_notify(struct mboxevent **mboxevents)
 {
@@ -628,7 +842,6 @@ EXPORTED void mboxevent_notify(struct mboxevent **mboxevents)
     struct mboxevent *event;
     char stimestamp[TIMESTAMP_MAX+1];
     char *formatted_message;
-    const char *fname = NULL;
 
     /* nothing to notify */
     if (!*mboxevents)
@@ -740,9 +953,7 @@ EXPORTED void mboxevent_notify(struct mboxevent **mboxevents)
 
             /* notification is ready to send */
             formatted_message = json_formatter(type, event->params);
-            notify(notifier, "EVENT", NULL, NULL, NULL, 0, NULL, formatted_message, fname);
-
-            free(formatted_message);
+            send_event(formatted_message);
         }
         while (strarray_size(&event->flagnames) > 0);
     }
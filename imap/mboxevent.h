@@ -250,6 +250,12 @@ struct mboxevent *mboxevent_enqueue(enum event_type type,
  */
 void mboxevent_notify(struct mboxevent **mboxevents);
 
+/*
+ * Send the notifications queued by mboxevent_notify() when
+ * event_queue_size is set.  Call this at the end of each command.
+ */
+void mboxevent_flush(void);
+
 /*
  * Release any allocated resources of this given event
  */
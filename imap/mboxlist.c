@@ -67,6 +67,7 @@
 #include "util.h"
 #include "mailbox.h"
 #include "mboxevent.h"
+#include "nameindex.h"
 #include "exitcodes.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -90,6 +91,11 @@
 cyrus_acl_canonproc_t mboxlist_ensureOwnerRights;
 
 static struct db *mbdb;
+static char *mbdb_fname;
+
+/* in-memory index of mailbox names, rebuilt when the db file changes */
+static struct nameindex *mbindex;
+static struct stat mbindex_sbuf;
 
 static int mboxlist_dbopen = 0;
 static int mboxlist_initialized = 0;
@@ -923,6 +929,13 @@ static int mboxlist_create_namecheck(const char *mboxname,
     r = mboxname_policycheck(mboxname);
     if (r) goto done;
 
+    /* the files of a lazily deleted user may still be on disk */
+    char *owner = mboxname_to_userid(mboxname);
+    if (owner && mboxlist_deleteuser_pending(owner))
+        r = IMAP_MAILBOX_LOCKED;
+    free(owner);
+    if (r) goto done;
+
     /* is this the user's INBOX namespace? */
     if (!isadmin && mboxname_userownsmailbox(userid, mboxname)) {
         /* User has admin rights over their own mailbox namespace */
@@ -1854,6 +1867,221 @@ EXPORTED int mboxlist_deletemailbox(const char *name, int isadmin,
     return r;
 }
 
+/*
+ * Lazy deletion of whole users.  Each queued user has a "$DELUSER$"
+ * key in mailboxes.db holding the mailboxes whose files are still on
+ * disk, deepest first; user_run_lazy_deletes() works through them and
+ * removes the key once the user's other data is gone too.
+ */
+
+#define DELUSER_PREFIX "$DELUSER$"
+
+struct deluser_rock {
+    const char *inbox;
+    size_t inboxlen;
+    ptrarray_t mbentries;
+};
+
+static int deluser_collect_cb(void *rock,
+                              const char *key, size_t keylen,
+                              const char *data, size_t datalen)
+{
+    struct deluser_rock *drock = (struct deluser_rock *) rock;
+    mbentry_t *mbentry = NULL;
+    int r;
+
+    /* the INBOX and its children, but not user.foobar for user.foo */
+    if (keylen > drock->inboxlen && key[drock->inboxlen] != '.')
+        return 0;
+
+    r = mboxlist_parse_entry(&mbentry, key, keylen, data, datalen);
+    if (r) return r;
+
+    if (mbentry->mbtype & (MBTYPE_DELETED | MBTYPE_RESERVE |
+                           MBTYPE_REMOTE | MBTYPE_MOVING)) {
+        mboxlist_entry_free(&mbentry);
+        return 0;
+    }
+
+    ptrarray_append(&drock->mbentries, mbentry);
+    return 0;
+}
+
+static void deluser_key(const char *userid, struct buf *key)
+{
+    buf_setcstr(key, DELUSER_PREFIX);
+    buf_appendcstr(key, userid);
+}
+
+EXPORTED int mboxlist_deleteuser_lazy(const char *userid, int wipe_user)
+{
+    struct deluser_rock drock = { NULL, 0, PTRARRAY_INITIALIZER };
+    struct buf key = BUF_INITIALIZER;
+    struct buf val = BUF_INITIALIZER;
+    struct dlist *dl = NULL, *list;
+    struct txn *tid = NULL;
+    char *inbox = mboxname_user_mbox(userid, NULL);
+    mbentry_t *mbentry;
+    int i, r;
+
+    init_internal();
+
+    drock.inbox = inbox;
+    drock.inboxlen = strlen(inbox);
+
+    r = cyrusdb_foreach(mbdb, inbox, drock.inboxlen, NULL,
+                        deluser_collect_cb, &drock, &tid);
+    if (r) goto done;
+
+    dl = dlist_newkvlist(NULL, "DELUSER");
+    dlist_setnum32(dl, "WIPE", wipe_user);
+    dlist_setdate(dl, "QUEUED", time(NULL));
+    list = dlist_newlist(dl, "MAILBOXES");
+
+    /* children before their parents, so each directory is empty by
+     * the time its own mailbox is cleaned up */
+    for (i = ptrarray_size(&drock.mbentries) - 1; i >= 0; i--) {
+        struct dlist *item;
+
+        mbentry = ptrarray_nth(&drock.mbentries, i);
+        item = dlist_newkvlist(list, NULL);
+        dlist_setatom(item, "NAME", mbentry->name);
+        if (mbentry->uniqueid)
+            dlist_setatom(item, "UNIQUEID", mbentry->uniqueid);
+
+        mbentry->mbtype |= MBTYPE_DELETED;
+        r = mboxlist_update_entry(mbentry->name, mbentry, &tid);
+        if (r) goto done;
+    }
+
+    deluser_key(userid, &key);
+    dlist_printbuf(dl, 0, &val);
+    r = cyrusdb_store(mbdb, key.s, key.len, val.s, val.len, &tid);
+    if (r) goto done;
+
+    r = cyrusdb_commit(mbdb, tid);
+    tid = NULL;
+    if (r) goto done;
+
+    for (i = 0; i < ptrarray_size(&drock.mbentries); i++) {
+        mbentry = ptrarray_nth(&drock.mbentries, i);
+        sync_log_unmailbox(mbentry->name);
+    }
+
+    syslog(LOG_NOTICE, "Queued user %s for deletion (%d mailboxes)",
+           userid, ptrarray_size(&drock.mbentries));
+
+ done:
+    if (tid) cyrusdb_abort(mbdb, tid);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: error queueing %s for deletion: %s",
+               userid, cyrusdb_strerror(r));
+        r = IMAP_IOERROR;
+    }
+    for (i = 0; i < ptrarray_size(&drock.mbentries); i++) {
+        mbentry = ptrarray_nth(&drock.mbentries, i);
+        mboxlist_entry_free(&mbentry);
+    }
+    ptrarray_fini(&drock.mbentries);
+    dlist_free(&dl);
+    buf_free(&key);
+    buf_free(&val);
+    free(inbox);
+
+    return r;
+}
+
+EXPORTED int mboxlist_deleteuser_pending(const char *userid)
+{
+    struct buf key = BUF_INITIALIZER;
+    int r;
+
+    init_internal();
+
+    deluser_key(userid, &key);
+    r = cyrusdb_fetch(mbdb, key.s, key.len, NULL, NULL, NULL);
+    buf_free(&key);
+
+    return !r;
+}
+
+static int deluser_queue_cb(void *rock,
+                            const char *key, size_t keylen,
+                            const char *data __attribute__((unused)),
+                            size_t datalen __attribute__((unused)))
+{
+    strarray_t *userids = (strarray_t *) rock;
+
+    strarray_appendm(userids, xstrndup(key + strlen(DELUSER_PREFIX),
+                                       keylen - strlen(DELUSER_PREFIX)));
+    return 0;
+}
+
+EXPORTED int mboxlist_deleteuser_queue(strarray_t *userids)
+{
+    int r;
+
+    init_internal();
+
+    r = cyrusdb_foreach(mbdb, DELUSER_PREFIX, strlen(DELUSER_PREFIX), NULL,
+                        deluser_queue_cb, userids, NULL);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: error reading deletion queue: %s",
+               cyrusdb_strerror(r));
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
+EXPORTED int mboxlist_deleteuser_get(const char *userid, struct dlist **dlp)
+{
+    struct buf key = BUF_INITIALIZER;
+    const char *data;
+    size_t datalen;
+    int r;
+
+    init_internal();
+
+    deluser_key(userid, &key);
+    r = cyrusdb_fetch(mbdb, key.s, key.len, &data, &datalen, NULL);
+    buf_free(&key);
+
+    if (r == CYRUSDB_NOTFOUND) return IMAP_MAILBOX_NONEXISTENT;
+    if (r) return IMAP_IOERROR;
+
+    r = dlist_parsemap(dlp, 0, 0, data, datalen);
+    return r ? IMAP_MAILBOX_BADFORMAT : 0;
+}
+
+EXPORTED int mboxlist_deleteuser_update(const char *userid, struct dlist *dl)
+{
+    struct buf key = BUF_INITIALIZER;
+    struct buf val = BUF_INITIALIZER;
+    int r;
+
+    init_internal();
+
+    deluser_key(userid, &key);
+    if (dl) {
+        dlist_printbuf(dl, 0, &val);
+        r = cyrusdb_store(mbdb, key.s, key.len, val.s, val.len, NULL);
+    }
+    else {
+        r = cyrusdb_delete(mbdb, key.s, key.len, NULL, /*force*/1);
+    }
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: error updating deletion queue for %s: %s",
+               userid, cyrusdb_strerror(r));
+        r = IMAP_IOERROR;
+    }
+
+    buf_free(&key);
+    buf_free(&val);
+
+    return r;
+}
+
 static int _rename_check_specialuse(const char *oldname, const char *newname)
 {
     mbname_t *old = mbname_from_intname(oldname);
@@ -2721,6 +2949,7 @@ mboxlist_sync_setacls(const char *name, const char *newacl)
 
 struct find_rock {
     ptrarray_t globs;
+    const strarray_t *patterns;
     struct namespace *namespace;
     const char *userid;
     const char *domain;
@@ -2754,7 +2983,7 @@ static int find_p(void *rockp,
     intname[keylen] = 0;
 
     assert(!rock->mbname);
-    rock->mbname = mbname_from_intname(intname);
+    rock->mbname = mbname_intern(intname);
 
     if (!rock->isadmin && !config_getswitch(IMAPOPT_CROSSDOMAINS)) {
         /* don't list mailboxes outside of the default domain */
@@ -3185,8 +3414,183 @@ EXPORTED int mboxlist_usermboxtree(const char *userid,
     return r;
 }
 
+static int nameindex_add_cb(void *rock,
+                            const char *key, size_t keylen,
+                            const char *data __attribute__((unused)),
+                            size_t datalen __attribute__((unused)))
+{
+    struct nameindex *ni = (struct nameindex *) rock;
+
+    /* skip any $RACL or future $ space keys */
+    if (key[0] != '$') nameindex_add(ni, key, keylen);
+
+    return 0;
+}
+
+/* returns the name index, building it if mailboxes.db has changed
+ * since it was last built, or NULL if it isn't available */
+static struct nameindex *mboxlist_nameindex(void)
+{
+    struct stat sbuf;
+    int r;
+
+    if (!mbdb_fname || stat(mbdb_fname, &sbuf)) {
+        nameindex_free(&mbindex);
+        return NULL;
+    }
+
+    if (mbindex &&
+        sbuf.st_ino == mbindex_sbuf.st_ino &&
+        sbuf.st_size == mbindex_sbuf.st_size &&
+        sbuf.st_mtime == mbindex_sbuf.st_mtime) {
+        return mbindex;
+    }
+
+    nameindex_free(&mbindex);
+    mbindex = nameindex_new('.', config_getswitch(IMAPOPT_IMPROVED_MBOXLIST_SORT)
+                                 ? bsearch_ncompare_mbox : bsearch_ncompare_raw);
+
+    r = cyrusdb_foreach(mbdb, "", 0, NULL, nameindex_add_cb, mbindex, NULL);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: indexing mailbox names: %s",
+               cyrusdb_strerror(r));
+        nameindex_free(&mbindex);
+        return NULL;
+    }
+
+    mbindex_sbuf = sbuf;
+
+    return mbindex;
+}
+
+/* Is there any string 'str'+X which matches the IMAP wildcard pattern
+ * 'pat'?  Tracks every position the pattern could be at in parallel,
+ * so that runs of '%' don't backtrack. */
+static int glob_could_extend(const char *pat, const char *str, char sep)
+{
+    size_t plen = strlen(pat);
+    char *cur = xzmalloc(plen + 1);
+    char *next = xzmalloc(plen + 1);
+    char *tmp;
+    size_t i;
+    int alive = 1;
+
+    cur[0] = 1;
+
+    for (; alive && *str; str++) {
+        memset(next, 0, plen + 1);
+        alive = 0;
+
+        for (i = 0; i <= plen; i++) {
+            if (!cur[i]) continue;
+            /* a wildcard can also match nothing */
+            if (pat[i] == '*' || pat[i] == '%') cur[i+1] = 1;
+        }
+
+        for (i = 0; i < plen; i++) {
+            if (!cur[i]) continue;
+            if (pat[i] == '*') {
+                /* matches everything from here on */
+                alive = 2;
+                break;
+            }
+            if ((pat[i] == '%' && *str != sep) || pat[i] == *str) {
+                next[pat[i] == '%' ? i : i+1] = 1;
+                alive = 1;
+            }
+        }
+        if (alive == 2) break;
+
+        tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+
+    free(cur);
+    free(next);
+
+    return alive != 0;
+}
+
+/* Could any mailbox below 'name' match the patterns?  Only says no when
+ * the children's external names are sure to extend this one's, which
+ * rules out a few special cases. */
+static int find_can_descend(struct find_rock *rock, const char *name)
+{
+    const char *dp = config_getstring(IMAPOPT_DELETEDPREFIX);
+    size_t dplen = strlen(dp);
+    const char *p = strchr(name, '!');
+    struct buf buf = BUF_INITIALIZER;
+    const char *extname;
+    int i, r = 1;
+
+    p = p ? p + 1 : name;
+    if (!strncmp(p, dp, dplen) && (!p[dplen] || p[dplen] == '.'))
+        return 1;
+
+    mbname_t *mbname = mbname_from_intname(name);
+
+    /* deleted names carry a suffix, and "user" alone is special */
+    if (mbname_isdeleted(mbname)) goto done;
+    if (!mbname_localpart(mbname) && strarray_size(mbname_boxes(mbname)) == 1 &&
+        !strcmp(strarray_nth(mbname_boxes(mbname), 0), "user"))
+        goto done;
+
+    /* admins see virtual domains appended to the whole name */
+    if (config_virtdomains && rock->namespace->isadmin && mbname_domain(mbname))
+        goto done;
+
+    /* own mailboxes are named relative to INBOX */
+    if (mbname_category(mbname, rock->namespace, rock->userid) != rock->mb_category)
+        goto done;
+
+    extname = mbname_extname(mbname, rock->namespace, rock->userid);
+    if (!extname) goto done;
+
+    buf_setcstr(&buf, extname);
+    buf_putc(&buf, rock->namespace->hier_sep);
+
+    for (r = 0, i = 0; !r && i < strarray_size(rock->patterns); i++)
+        r = glob_could_extend(strarray_nth(rock->patterns, i),
+                              buf_cstring(&buf), rock->namespace->hier_sep);
+
+ done:
+    buf_free(&buf);
+    mbname_free(&mbname);
+    return r;
+}
+
+static int find_index_cb(const char *name, size_t len, int *prunep, void *rock)
+{
+    struct find_rock *frock = (struct find_rock *) rock;
+    int r;
+
+    r = cyrusdb_forone(frock->db, name, len, &find_p, &find_cb, frock, NULL);
+    if (r) return r;
+
+    *prunep = !find_can_descend(frock, name);
+
+    return 0;
+}
+
+/* With no '*' in the patterns, whole subtrees can be ruled out by name */
+static int find_use_nameindex(struct find_rock *rock)
+{
+    int i;
+
+    if (!config_getswitch(IMAPOPT_MBOXLIST_NAME_INDEX)) return 0;
+    if (rock->db != mbdb || !rock->patterns) return 0;
+
+    for (i = 0; i < strarray_size(rock->patterns); i++) {
+        if (strchr(strarray_nth(rock->patterns, i), '*')) return 0;
+    }
+
+    return 1;
+}
+
 static int mboxlist_find_category(struct find_rock *rock, const char *prefix, size_t len)
 {
+    struct nameindex *ni;
     int r = 0;
 
     init_internal();
@@ -3210,6 +3614,9 @@ static int mboxlist_find_category(struct find_rock *rock, const char *prefix, si
         }
         strarray_fini(&matches);
     }
+    else if (find_use_nameindex(rock) && (ni = mboxlist_nameindex())) {
+        r = nameindex_foreach(ni, prefix, len, &find_index_cb, rock);
+    }
     else {
         r = cyrusdb_foreach(rock->db, prefix, len, &find_p, &find_cb, rock, NULL);
     }
@@ -3248,6 +3655,7 @@ static int mboxlist_do_find(struct find_rock *rock, const strarray_t *patterns)
 
     if (patterns->count < 1) return 0; /* nothing to do */
 
+    rock->patterns = patterns;
     for (i = 0; i < patterns->count; i++) {
         glob *g = glob_init(strarray_nth(patterns, i), rock->namespace->hier_sep);
         ptrarray_append(&rock->globs, g);
@@ -3913,6 +4321,9 @@ EXPORTED void mboxlist_open(const char *fname)
     if (config_getswitch(IMAPOPT_IMPROVED_MBOXLIST_SORT)) {
         flags |= CYRUSDB_MBOXSORT;
     }
+    if (config_getswitch(IMAPOPT_MBOXLIST_SPARSE_INDEX)) {
+        flags |= CYRUSDB_SPARSEINDEX;
+    }
 
     ret = cyrusdb_open(DB, fname, flags, &mbdb);
     if (ret != 0) {
@@ -3923,6 +4334,8 @@ EXPORTED void mboxlist_open(const char *fname)
         fatal("can't read mailboxes file", EC_TEMPFAIL);
     }
 
+    free(mbdb_fname);
+    mbdb_fname = xstrdup(fname);
     free(tofree);
 
     mboxlist_dbopen = 1;
@@ -3938,6 +4351,9 @@ EXPORTED void mboxlist_close(void)
             syslog(LOG_ERR, "DBERROR: error closing mailboxes: %s",
                    cyrusdb_strerror(r));
         }
+        nameindex_free(&mbindex);
+        free(mbdb_fname);
+        mbdb_fname = NULL;
         mboxlist_dbopen = 0;
     }
 }
@@ -188,6 +188,18 @@ int mboxlist_deletemailbox(const char *name, int isadmin, const char *userid,
                            int checkacl,
                            int local_only, int force, int keep_intermediaries);
 
+/* Lazy deletion of a whole user: tombstone all of the user's mailboxes
+ * and queue the user for user_run_lazy_deletes(), in one transaction.
+ * The tombstones keep their partition so the files can still be found */
+int mboxlist_deleteuser_lazy(const char *userid, int wipe_user);
+/* is 'userid' queued for lazy deletion? */
+int mboxlist_deleteuser_pending(const char *userid);
+/* the userids currently queued */
+int mboxlist_deleteuser_queue(strarray_t *userids);
+/* read and rewrite the queue entry for 'userid'; a NULL 'dl' removes it */
+int mboxlist_deleteuser_get(const char *userid, struct dlist **dlp);
+int mboxlist_deleteuser_update(const char *userid, struct dlist *dl);
+
 /* rename a tree of mailboxes - renames mailbox plus any children */
 int mboxlist_renametree(const char *oldname, const char *newname,
                         const char *partition, unsigned uidvalidity,
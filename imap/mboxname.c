@@ -56,6 +56,7 @@
 #include "exitcodes.h"
 #include "glob.h"
 #include "global.h"
+#include "hash.h"
 #include "mailbox.h"
 #include "map.h"
 #include "retry.h"
@@ -95,7 +96,12 @@ struct mbname_parts {
     char *userid;
     char *intname;
     char *extname;
+    unsigned extgen;
     char *recipient;
+    char *hashpath;
+
+    /* references, if interned */
+    int refcount;
 };
 
 #define XX 127
@@ -259,17 +265,91 @@ EXPORTED void mboxname_release(struct mboxlock **mboxlockptr)
 
 /******************** mbname stuff **********************/
 
+/* interned mbnames, by internal name.  When the table fills up it is
+ * emptied, and entries still in use are freed by their last user */
+#define MBNAME_INTERN_MAX 16384
+
+static hash_table mbname_interned = HASH_TABLE_INITIALIZER;
+static int mbname_interned_count = 0;
+static int mbname_intern_max = MBNAME_INTERN_MAX;
+
+/* bumped whenever a namespace is (re)initialised, since cached
+ * external names may depend on what it used to say */
+static unsigned mbname_nsgen = 1;
+
 static void _mbdirty(mbname_t *mbname)
 {
+    /* interned mbnames are shared */
+    assert(!mbname->refcount);
+
     free(mbname->userid);
     free(mbname->intname);
     free(mbname->extname);
     free(mbname->recipient);
+    free(mbname->hashpath);
 
     mbname->userid = NULL;
     mbname->intname = NULL;
     mbname->extname = NULL;
     mbname->recipient = NULL;
+    mbname->hashpath = NULL;
+}
+
+static void _mbintern_release(void *data)
+{
+    mbname_t *mbname = (mbname_t *) data;
+
+    mbname_free(&mbname);
+}
+
+static void _mbintern_flush(void)
+{
+    if (!mbname_interned.size) return;
+
+    free_hash_table(&mbname_interned, _mbintern_release);
+    mbname_interned_count = 0;
+}
+
+/*
+ * Return a shared mbname for 'intname', which keeps the names and
+ * paths worked out from it between callers.  Release it with
+ * mbname_free() as usual, but never change it.
+ */
+EXPORTED mbname_t *mbname_intern(const char *intname)
+{
+    mbname_t *mbname;
+
+    if (!intname || !*intname || !mbname_intern_max)
+        return mbname_from_intname(intname);
+
+    if (!mbname_interned.size)
+        construct_hash_table(&mbname_interned, 1024, 0);
+
+    mbname = hash_lookup(intname, &mbname_interned);
+    if (!mbname) {
+        if (mbname_interned_count >= mbname_intern_max) {
+            _mbintern_flush();
+            construct_hash_table(&mbname_interned, 1024, 0);
+        }
+
+        mbname = mbname_from_intname(intname);
+        mbname->refcount = 1; /* the table's */
+        hash_insert(intname, mbname, &mbname_interned);
+        mbname_interned_count++;
+    }
+
+    mbname->refcount++;
+    return mbname;
+}
+
+/*
+ * Limit the number of interned mbnames to 'max'.  0 turns interning
+ * off, for threaded programs.
+ */
+EXPORTED void mbname_intern_setmax(int max)
+{
+    _mbintern_flush();
+    mbname_intern_max = max;
 }
 
 EXPORTED void mbname_downcaseuser(mbname_t *mbname)
@@ -743,6 +823,10 @@ EXPORTED void mbname_free(mbname_t **mbnamep)
 
     *mbnamep = NULL;
 
+    /* still in use elsewhere? */
+    if (mbname->refcount && --mbname->refcount)
+        return;
+
     strarray_free(mbname->boxes);
     free(mbname->localpart);
     free(mbname->domain);
@@ -753,6 +837,7 @@ EXPORTED void mbname_free(mbname_t **mbnamep)
     free(mbname->extname);
     free(mbname->extuserid);
     free(mbname->recipient);
+    free(mbname->hashpath);
 
     /* thing itself */
     free(mbname);
@@ -760,7 +845,7 @@ EXPORTED void mbname_free(mbname_t **mbnamep)
 
 EXPORTED char *mboxname_to_userid(const char *intname)
 {
-    mbname_t *mbname = mbname_from_intname(intname);
+    mbname_t *mbname = mbname_intern(intname);
     char *res = xstrdupnull(mbname_userid(mbname));
     mbname_free(&mbname);
     return res;
@@ -776,7 +861,7 @@ EXPORTED char *mboxname_from_external(const char *extname, const struct namespac
 
 EXPORTED char *mboxname_to_external(const char *intname, const struct namespace *ns, const char *userid)
 {
-    mbname_t *mbname = mbname_from_intname(intname);
+    mbname_t *mbname = mbname_intern(intname);
     char *res = xstrdupnull(mbname_extname(mbname, ns, userid));
     mbname_free(&mbname);
     return res;
@@ -980,20 +1065,20 @@ EXPORTED const char *mbname_extname(const mbname_t *mbname, const struct namespa
     int admindomains = config_virtdomains && ns->isadmin;
 
     /* gotta match up! */
-    if (mbname->extname && ns == mbname->extns && !strcmpsafe(userid, mbname->extuserid))
+    if (mbname->extname && ns == mbname->extns && mbname->extgen == mbname_nsgen &&
+        !strcmpsafe(userid, mbname->extuserid))
         return mbname->extname;
 
     struct buf buf = BUF_INITIALIZER;
 
     /* have to zero out any existing value just in case we drop through */
     mbname_t *backdoor = (mbname_t *)mbname;
-    if (backdoor->extname) {
-        free(backdoor->extname);
-        backdoor->extname = NULL;
-        backdoor->extns = ns;
-        free(backdoor->extuserid);
-        backdoor->extuserid = xstrdupnull(userid);
-    }
+    free(backdoor->extname);
+    backdoor->extname = NULL;
+    backdoor->extns = ns;
+    backdoor->extgen = mbname_nsgen;
+    free(backdoor->extuserid);
+    backdoor->extuserid = xstrdupnull(userid);
 
     mbname_t *userparts = mbname_from_userid(userid);
     strarray_t *boxes = strarray_dup(mbname_boxes(mbname));
@@ -1216,6 +1301,9 @@ EXPORTED int mboxname_init_namespace(struct namespace *namespace, int isadmin)
 
     assert(namespace != NULL);
 
+    /* external names worked out for the old contents are stale */
+    mbname_nsgen++;
+
     namespace->isadmin = isadmin;
 
     namespace->hier_sep =
@@ -1671,53 +1759,59 @@ EXPORTED void mboxname_hash(char *dest, size_t destlen,
                             const char *root,
                             const char *name)
 {
-    mbname_t *mbname = mbname_from_intname(name);
-    struct buf buf = BUF_INITIALIZER;
+    mbname_t *mbname = mbname_intern(name);
+    size_t rootlen = strlen(root);
 
-    buf_setcstr(&buf, root);
+    /* the path below root depends only on the name, so keep it */
+    if (!mbname->hashpath) {
+        struct buf buf = BUF_INITIALIZER;
+        const char *domain = mbname_domain(mbname);
+        strarray_t *boxes = strarray_dup(mbname_boxes(mbname));
 
-    const char *domain = mbname_domain(mbname);
-    strarray_t *boxes = strarray_dup(mbname_boxes(mbname));
+        if (domain) {
+            if (config_hashimapspool) {
+                char c = dir_hash_c(domain, config_fulldirhash);
+                buf_printf(&buf, "%s%c/%s", FNAME_DOMAINDIR, c, domain);
+            }
+            else {
+                buf_printf(&buf, "%s%s", FNAME_DOMAINDIR, domain);
+            }
+        }
 
-    if (domain) {
-        if (config_hashimapspool) {
-            char c = dir_hash_c(domain, config_fulldirhash);
-            buf_printf(&buf, "%s%c/%s", FNAME_DOMAINDIR, c, domain);
+        if (mbname_localpart(mbname)) {
+            strarray_unshift(boxes, mbname_localpart(mbname));
+            strarray_unshift(boxes, "user");
         }
-        else {
-            buf_printf(&buf, "%s%s", FNAME_DOMAINDIR, domain);
+        if (mbname_isdeleted(mbname)) {
+            struct buf dbuf = BUF_INITIALIZER;
+            buf_printf(&dbuf, "%X", (unsigned)mbname_isdeleted(mbname));
+            strarray_unshift(boxes, config_getstring(IMAPOPT_DELETEDPREFIX));
+            strarray_push(boxes, buf_cstring(&dbuf));
+            buf_free(&dbuf);
         }
-    }
 
-    if (mbname_localpart(mbname)) {
-        strarray_unshift(boxes, mbname_localpart(mbname));
-        strarray_unshift(boxes, "user");
-    }
-    if (mbname_isdeleted(mbname)) {
-        struct buf dbuf = BUF_INITIALIZER;
-        buf_printf(&dbuf, "%X", (unsigned)mbname_isdeleted(mbname));
-        strarray_unshift(boxes, config_getstring(IMAPOPT_DELETEDPREFIX));
-        strarray_push(boxes, buf_cstring(&dbuf));
-        buf_free(&dbuf);
-    }
+        if (config_hashimapspool && strarray_size(boxes)) {
+            const char *idx = strarray_size(boxes) > 1 ? strarray_nth(boxes, 1) : strarray_nth(boxes, 0);
+            char c = dir_hash_c(idx, config_fulldirhash);
+            buf_printf(&buf, "/%c", c);
+        }
 
-    if (config_hashimapspool && strarray_size(boxes)) {
-        const char *idx = strarray_size(boxes) > 1 ? strarray_nth(boxes, 1) : strarray_nth(boxes, 0);
-        char c = dir_hash_c(idx, config_fulldirhash);
-        buf_printf(&buf, "/%c", c);
-    }
+        int i;
+        for (i = 0; i < strarray_size(boxes); i++) {
+            buf_putc(&buf, '/');
+            _append_intbuf(&buf, strarray_nth(boxes, i));
+        }
 
-    int i;
-    for (i = 0; i < strarray_size(boxes); i++) {
-        buf_putc(&buf, '/');
-        _append_intbuf(&buf, strarray_nth(boxes, i));
+        mbname->hashpath = buf_release(&buf);
+        if (!mbname->hashpath) mbname->hashpath = xstrdup("");
+        strarray_free(boxes);
     }
 
     /* for now, keep API even though we're doing a buffer inside here */
-    strncpy(dest, buf_cstring(&buf), destlen);
+    strncpy(dest, root, destlen);
+    if (rootlen < destlen)
+        strncpy(dest + rootlen, mbname->hashpath, destlen - rootlen);
 
-    buf_free(&buf);
-    strarray_free(boxes);
     mbname_free(&mbname);
 }
 
@@ -1881,6 +1975,21 @@ EXPORTED char *mboxname_metapath(const char *partition,
         filename = FNAME_CACHE;
         archiveflag = 1;
         break;
+    case META_SORTKEYS:
+        snprintf(confkey, 256, "metadir-index-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_SORTKEYS;
+        filename = FNAME_SORTKEYS;
+        break;
+    case META_ANNOTCOLS:
+        snprintf(confkey, 256, "metadir-index-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_ANNOTCOLS;
+        filename = FNAME_ANNOTCOLS;
+        break;
+    case META_OVERVIEW:
+        snprintf(confkey, 256, "metadir-index-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_OVERVIEW;
+        filename = FNAME_OVERVIEW;
+        break;
     case 0:
         break;
     default:
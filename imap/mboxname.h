@@ -107,6 +107,10 @@ mbname_t *mbname_from_extname(const char *extname, const struct namespace *ns, c
 mbname_t *mbname_from_extsub(const char *extsub, const struct namespace *ns, const char *userid);
 mbname_t *mbname_from_recipient(const char *recip, const struct namespace *ns);
 mbname_t *mbname_dup(const mbname_t *mbname);
+/* a shared mbname which keeps its names and paths between callers:
+ * release it with mbname_free(), but never modify it */
+mbname_t *mbname_intern(const char *intname);
+void mbname_intern_setmax(int max);
 
 void mbname_downcaseuser(mbname_t *mbname);
 void mbname_set_localpart(mbname_t *mbname, const char *localpart);
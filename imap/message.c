@@ -79,6 +79,7 @@
 #include "global.h"
 #include "retry.h"
 #include "rfc822tok.h"
+#include "stagetrace.h"
 #include "times.h"
 
 /* generated headers are not necessarily in current directory */
@@ -174,6 +175,18 @@ static char *message_ucase(char *s)
  */
 EXPORTED int message_copy_strict(struct protstream *from, FILE *to,
                                  unsigned size, int allow_null)
+{
+    return message_copy_strict_guid(from, to, size, allow_null, NULL);
+}
+
+/*
+ * As message_copy_strict(), but if 'guid' is given, it is set to the
+ * GUID of the copied message, hashed as it is written so that the
+ * message doesn't have to be read back again to compute it.
+ */
+EXPORTED int message_copy_strict_guid(struct protstream *from, FILE *to,
+                                      unsigned size, int allow_null,
+                                      struct message_guid *guid)
 {
     char buf[4096+1];
     unsigned char *p, *endp;
@@ -184,6 +197,12 @@ EXPORTED int message_copy_strict(struct protstream *from, FILE *to,
     int munge8bit = config_getswitch(IMAPOPT_MUNGE8BIT);
     int inheader = 1, blankline = 1;
     struct buf tmp = BUF_INITIALIZER;
+    struct message_guid_ctx guidctx;
+
+    if (guid) {
+        message_guid_set_null(guid);
+        message_guid_init(&guidctx);
+    }
 
     while (size) {
         n = prot_read(from, buf, size > 4096 ? 4096 : size);
@@ -240,13 +259,17 @@ EXPORTED int message_copy_strict(struct protstream *from, FILE *to,
             fwrite(buf, 1, n, to);
         else
             buf_appendmap(&tmp, buf, n);
+
+        if (guid) message_guid_update(&guidctx, buf, n);
     }
 
     if (r) goto done;
 
+    if (guid) message_guid_final(&guidctx, guid);
+
     if (to) {
         fflush(to);
-        if (ferror(to) || fsync(fileno(to))) {
+        if (ferror(to) || stagetrace_fsync(fileno(to))) {
             syslog(LOG_ERR, "IOERROR: writing message: %m");
             r = IMAP_IOERROR;
             goto done;
@@ -351,9 +374,22 @@ EXPORTED int message_parse(const char *fname, struct index_record *record)
  * If msg_base/msg_len are non-NULL, the file will remain memory-mapped
  * and returned to the caller.  The caller MUST unmap the file.
  */
+static int message_parse_mapped_guid(const char *msg_base,
+                                     unsigned long msg_len,
+                                     struct body *body,
+                                     const struct message_guid *guid);
+
 EXPORTED int message_parse_file(FILE *infile,
                        const char **msg_base, size_t *msg_len,
                        struct body **body)
+{
+    return message_parse_file_guid(infile, msg_base, msg_len, body, NULL);
+}
+
+EXPORTED int message_parse_file_guid(FILE *infile,
+                                     const char **msg_base, size_t *msg_len,
+                                     struct body **body,
+                                     const struct message_guid *guid)
 {
     int fd = fileno(infile);
     struct stat sbuf;
@@ -380,7 +416,7 @@ EXPORTED int message_parse_file(FILE *infile,
         return IMAP_IOERROR; /* zero length file? */
 
     if (!*body) *body = (struct body *) xzmalloc(sizeof(struct body));
-    r = message_parse_mapped(*msg_base, *msg_len, *body);
+    r = message_parse_mapped_guid(*msg_base, *msg_len, *body, guid);
 
     if (unmap) map_free(msg_base, msg_len);
 
@@ -437,7 +473,7 @@ EXPORTED int message_parse_binary_file(FILE *infile, struct body **body)
 
     free((char*) msg.base);
 
-    if (n != msg.len || fsync(fd)) {
+    if (n != msg.len || stagetrace_fsync(fd)) {
         syslog(LOG_ERR, "IOERROR: rewriting binary file in spool: %m");
         return IMAP_IOERROR;
     }
@@ -450,6 +486,14 @@ EXPORTED int message_parse_binary_file(FILE *infile, struct body **body)
  */
 EXPORTED int message_parse_mapped(const char *msg_base, unsigned long msg_len,
                          struct body *body)
+{
+    return message_parse_mapped_guid(msg_base, msg_len, body, NULL);
+}
+
+static int message_parse_mapped_guid(const char *msg_base,
+                                     unsigned long msg_len,
+                                     struct body *body,
+                                     const struct message_guid *guid)
 {
     struct msg msg;
 
@@ -463,7 +507,10 @@ EXPORTED int message_parse_mapped(const char *msg_base, unsigned long msg_len,
 
     body->filesize = msg_len;
 
-    message_guid_generate(&body->guid, msg_base, msg_len);
+    if (guid && !message_guid_isnull(guid))
+        message_guid_copy(&body->guid, guid);
+    else
+        message_guid_generate(&body->guid, msg_base, msg_len);
 
     if (body->filesize != body->header_size + body->content_size) {
         syslog(LOG_NOTICE, "IOERROR: size mismatch on parse %s (%d, %d)",
@@ -660,16 +707,25 @@ message_header_lookup(const char *buf, const char **valp)
 }
 
 
+static void content_guid_update(const char *s, size_t len, void *rock)
+{
+    message_guid_update((struct message_guid_ctx *) rock, s, len);
+}
+
 static void body_add_content_guid(const char *base, struct body *body)
 {
     int encoding = ENCODING_NONE;
-    char *decbuf = NULL;
+    struct message_guid_ctx ctx;
     charset_t cs = NULL;
     size_t len = body->content_size;
     message_parse_charset(body, &encoding, &cs);
-    base = charset_decode_mimebody(base, len, encoding, &decbuf, &len);
-    if (base) {
-        message_guid_generate(&body->content_guid, base, len);
+
+    /* hash the decoded content as it is decoded, rather than decoding
+     * a possibly huge attachment into memory first */
+    message_guid_init(&ctx);
+    if (!charset_decode_mimebody_chunks(base, len, encoding,
+                                        content_guid_update, &ctx, &len)) {
+        message_guid_final(&ctx, &body->content_guid);
         body->decoded_content_size = len;
     }
     else {
@@ -677,7 +733,6 @@ static void body_add_content_guid(const char *base, struct body *body)
         body->decoded_content_size = 0;
     }
     charset_free(&cs);
-    free(decbuf);
 }
 
 
@@ -2689,6 +2744,90 @@ HIDDEN void parse_cached_envelope(char *env, char *tokens[], int tokens_size)
     }
 }
 
+/*
+ * Find token number @token of a cached envelope (the @len bytes at @env
+ * inside the outer parentheses) without copying or modifying it, using
+ * the same rules as parse_cached_envelope().  Returns 1 and points
+ * *@valp and *@vallenp at the token if it exists and isn't NIL.
+ */
+HIDDEN int message_cached_envelope_token(const char *env, size_t len,
+                                         int token, const char **valp,
+                                         size_t *vallenp)
+{
+    const char *c = env, *end = env + len;
+    const char *list = NULL;
+    int i = 0, ncom = 0;
+    size_t litlen;
+
+    while (c < end && *c) {
+        switch (*c) {
+        case ' ':                       /* end of token */
+            c++;
+            break;
+        case 'N':                       /* "NIL" */
+        case 'n':
+            if (!ncom && i++ == token) return 0;
+            c += 3;                     /* skip "NIL" */
+            break;
+        case '"':                       /* quoted string */
+            *valp = ++c;                /* skip open quote */
+            while (c < end && *c && *c != '"') {
+                if (*c == '\\') c++;    /* skip quoted-specials */
+                if (c < end && *c) c++;
+            }
+            if (!ncom && i++ == token) {
+                *vallenp = c - *valp;
+                return 1;
+            }
+            if (c < end && *c) c++;     /* skip close quote */
+            break;
+        case '{':                       /* literal */
+            c++;                        /* skip open brace */
+            litlen = 0;
+            while (c < end && cyrus_isdigit((int) *c)) {
+                litlen = litlen*10 + *c - '0';
+                c++;
+            }
+            c += 3;                     /* skip close brace & CRLF */
+            if (c > end) return 0;
+            if (litlen > (size_t) (end - c)) litlen = end - c;
+            if (!ncom && i++ == token) {
+                *valp = c;
+                *vallenp = litlen;
+                return 1;
+            }
+            c += litlen;                /* skip literal */
+            break;
+        case '(':                       /* start of address */
+            c++;                        /* skip open paren */
+            if (!ncom && i++ == token) list = c;
+            ncom++;
+            break;
+        case ')':                       /* end of address */
+            c++;                        /* skip close paren */
+            if (ncom && !--ncom && list) {
+                *valp = list;
+                *vallenp = c - 1 - list;
+                return 1;
+            }
+            break;
+        default:
+            /* yikes! unparsed junk, just skip it */
+            c++;
+            break;
+        }
+    }
+
+    /* an unterminated list runs to the end */
+    if (list) {
+        *valp = list;
+        *vallenp = c - list;
+        return 1;
+    }
+
+    return 0;
+}
+
 EXPORTED char *parse_nstring(char **str)
 {
     char *cp = *str, *val;
@@ -3655,6 +3794,9 @@ EXPORTED message_t *message_new_from_data(const char *base, size_t len)
 EXPORTED void message_set_from_mailbox(struct mailbox *mailbox, unsigned int recno, message_t *m)
 {
     assert(m->refcount == 1);
+    /* release whatever the previous message mapped or parsed */
+    message_yield(m, M_ALL);
+    free(m->filename);
     memset(m, 0, sizeof(message_t));
     m->mailbox = mailbox;
     m->record.recno = recno;
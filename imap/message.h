@@ -146,6 +146,10 @@ extern void param_free(struct param **paramp);
 
 extern int message_copy_strict P((struct protstream *from, FILE *to,
                                   unsigned size, int allow_null));
+/* as message_copy_strict, also computing the GUID of what was written */
+extern int message_copy_strict_guid P((struct protstream *from, FILE *to,
+                                       unsigned size, int allow_null,
+                                       struct message_guid *guid));
 
 extern int message_parse(const char *fname, struct index_record *record);
 
@@ -153,6 +157,7 @@ struct message_content {
     const char *base;  /* memory mapped file */
     size_t len;
     struct body *body; /* parsed body structure */
+    struct message_guid guid; /* GUID of the file if already known */
 };
 
 /* MUST keep this struct sync'd with sieve_bodypart in sieve_interface.h */
@@ -163,6 +168,9 @@ struct bodypart {
 
 
 extern void parse_cached_envelope P((char *env, char *tokens[], int tokens_size));
+extern int message_cached_envelope_token(const char *env, size_t len,
+                                         int token, const char **valp,
+                                         size_t *vallenp);
 
 extern int message_parse_mapped P((const char *msg_base, unsigned long msg_len,
                                    struct body *body));
@@ -170,6 +178,12 @@ extern int message_parse_binary_file P((FILE *infile, struct body **body));
 extern int message_parse_file P((FILE *infile,
                                  const char **msg_base, size_t *msg_len,
                                  struct body **body));
+/* as message_parse_file, with the GUID of the file already known
+ * (e.g. from message_copy_strict_guid); a NULL guid is computed */
+extern int message_parse_file_guid P((FILE *infile,
+                                      const char **msg_base, size_t *msg_len,
+                                      struct body **body,
+                                      const struct message_guid *guid));
 extern void message_parse_string(const char *hdr, char **hdrp);
 extern void message_pruneheader(char *buf, const strarray_t *headers,
                                 const strarray_t *headers_not);
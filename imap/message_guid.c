@@ -89,6 +89,30 @@ EXPORTED void message_guid_generate(struct message_guid *guid,
     xsha1((const unsigned char *) msg_base, msg_len, guid->value);
 }
 
+/* message_guid_init() / _update() / _final() ****************************
+ *
+ * Generate GUID from message passed in pieces, e.g. while copying it
+ *
+ ************************************************************************/
+
+EXPORTED void message_guid_init(struct message_guid_ctx *ctx)
+{
+    SHA1_Init(&ctx->sha1);
+}
+
+EXPORTED void message_guid_update(struct message_guid_ctx *ctx,
+                                  const char *base, unsigned long len)
+{
+    SHA1_Update(&ctx->sha1, (const unsigned char *) base, len);
+}
+
+EXPORTED void message_guid_final(struct message_guid_ctx *ctx,
+                                 struct message_guid *guid)
+{
+    guid->status = GUID_NONNULL;
+    SHA1_Final(guid->value, &ctx->sha1);
+}
+
 /* message_guid_copy() ***************************************************
  *
  * Copy GUID
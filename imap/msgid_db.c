@@ -0,0 +1,234 @@
+/* msgid_db.c -- index of news articles by Message-ID
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "cyrusdb.h"
+#include "global.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/* generated headers are not necessarily in current directory */
+#include "imap/imap_err.h"
+
+#include "msgid_db.h"
+
+/*
+ * Keys are "<msgid>\0<mboxname>", values the uid as a decimal string,
+ * so all the copies of an article sort together and a lookup is one
+ * prefix scan.  Writes are autocommitted: the index is advisory and
+ * a lost record only means falling back to the deliver db.
+ */
+
+#define DB (config_getstring(IMAPOPT_NEWSMSGID_DB))
+
+static struct db *msgiddb = NULL;
+static int msgid_initialized = 0;
+
+static void done_cb(void *rock __attribute__((unused)))
+{
+    msgid_db_close();
+}
+
+EXPORTED int msgid_db_enabled(void)
+{
+    return config_getswitch(IMAPOPT_NEWSMSGID_INDEX);
+}
+
+static int msgid_db_open(void)
+{
+    char *fname = NULL;
+    int r;
+
+    if (msgiddb) return 0;
+
+    if (!msgid_initialized) {
+        cyrus_modules_add(done_cb, NULL);
+        msgid_initialized = 1;
+    }
+
+    if (config_getstring(IMAPOPT_NEWSMSGID_DB_PATH))
+        fname = xstrdup(config_getstring(IMAPOPT_NEWSMSGID_DB_PATH));
+    else
+        fname = strconcat(config_dir, FNAME_MSGIDDB, (char *)NULL);
+
+    r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &msgiddb);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+               cyrusdb_strerror(r));
+        msgiddb = NULL;
+        r = IMAP_IOERROR;
+    }
+
+    free(fname);
+    return r;
+}
+
+EXPORTED void msgid_db_close(void)
+{
+    int r;
+
+    if (!msgiddb) return;
+
+    r = cyrusdb_close(msgiddb);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: error closing msgid db: %s",
+               cyrusdb_strerror(r));
+    }
+    msgiddb = NULL;
+}
+
+static void make_key(struct buf *key, const char *msgid, const char *mboxname)
+{
+    buf_setcstr(key, msgid);
+    buf_putc(key, '\0');
+    if (mboxname) buf_appendcstr(key, mboxname);
+}
+
+EXPORTED int msgid_db_add(const char *msgid, const char *mboxname,
+                          uint32_t uid)
+{
+    struct buf key = BUF_INITIALIZER;
+    char data[11];
+    int r;
+
+    if (!msgid || !*msgid) return 0;
+
+    r = msgid_db_open();
+    if (r) return r;
+
+    make_key(&key, msgid, mboxname);
+    snprintf(data, sizeof(data), "%u", uid);
+
+    r = cyrusdb_store(msgiddb, key.s, key.len, data, strlen(data), NULL);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: msgid_db_add %s %s: %s",
+               msgid, mboxname, cyrusdb_strerror(r));
+        r = IMAP_IOERROR;
+    }
+
+    buf_free(&key);
+    return r;
+}
+
+EXPORTED int msgid_db_remove(const char *msgid, const char *mboxname)
+{
+    struct buf key = BUF_INITIALIZER;
+    int r;
+
+    if (!msgid || !*msgid) return 0;
+
+    r = msgid_db_open();
+    if (r) return r;
+
+    make_key(&key, msgid, mboxname);
+
+    r = cyrusdb_delete(msgiddb, key.s, key.len, NULL, /*force*/1);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: msgid_db_remove %s %s: %s",
+               msgid, mboxname, cyrusdb_strerror(r));
+        r = IMAP_IOERROR;
+    }
+
+    buf_free(&key);
+    return r;
+}
+
+struct findrock {
+    size_t prefixlen;
+    msgid_db_find_proc_t *proc;
+    void *rock;
+    int found;
+};
+
+static int find_cb(void *rock, const char *key, size_t keylen,
+                   const char *data, size_t datalen)
+{
+    struct findrock *frock = (struct findrock *) rock;
+    char *mboxname;
+    char uidbuf[11];
+    uint32_t uid;
+    int r;
+
+    if (keylen <= frock->prefixlen || datalen >= sizeof(uidbuf))
+        return 0;   /* ignore broken records */
+
+    memcpy(uidbuf, data, datalen);
+    uidbuf[datalen] = '\0';
+    if (parseuint32(uidbuf, NULL, &uid) || !uid) return 0;
+
+    mboxname = xstrndup(key + frock->prefixlen, keylen - frock->prefixlen);
+    frock->found++;
+    r = frock->proc(mboxname, uid, frock->rock);
+    free(mboxname);
+
+    return r;
+}
+
+EXPORTED int msgid_db_find(const char *msgid,
+                           msgid_db_find_proc_t *proc, void *rock)
+{
+    struct buf prefix = BUF_INITIALIZER;
+    struct findrock frock = { 0, proc, rock, 0 };
+    int r;
+
+    if (!msgid_db_enabled() || !msgid || !*msgid) return IMAP_NOTFOUND;
+
+    r = msgid_db_open();
+    if (r) return IMAP_NOTFOUND;
+
+    make_key(&prefix, msgid, NULL);
+    frock.prefixlen = prefix.len;
+
+    r = cyrusdb_foreach(msgiddb, prefix.s, prefix.len, NULL,
+                        find_cb, &frock, NULL);
+    buf_free(&prefix);
+
+    if (r == CYRUSDB_DONE) r = 0;
+    if (!r && !frock.found) r = IMAP_NOTFOUND;
+
+    return r;
+}
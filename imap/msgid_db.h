@@ -0,0 +1,71 @@
+/* msgid_db.h -- index of news articles by Message-ID
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MSGID_DB_H
+#define MSGID_DB_H
+
+#include <stdint.h>
+
+/* name of the Message-ID index */
+#define FNAME_MSGIDDB "/msgid.db"
+
+/* callback for each article carrying a Message-ID.  return CYRUSDB_DONE
+ * to stop early. */
+typedef int msgid_db_find_proc_t(const char *mboxname, uint32_t uid,
+                                 void *rock);
+
+/* is the index in use? */
+int msgid_db_enabled(void);
+
+/* record/forget that 'mboxname' holds 'msgid' as 'uid' */
+int msgid_db_add(const char *msgid, const char *mboxname, uint32_t uid);
+int msgid_db_remove(const char *msgid, const char *mboxname);
+
+/* call 'proc' for every mailbox which holds an article with 'msgid'.
+ * returns IMAP_NOTFOUND if the index is disabled or unavailable, so
+ * callers can fall back to the duplicate delivery database */
+int msgid_db_find(const char *msgid, msgid_db_find_proc_t *proc, void *rock);
+
+/* close the database */
+void msgid_db_close(void);
+
+#endif /* MSGID_DB_H */
@@ -460,10 +460,10 @@ EXPORTED int msgrecord_get_fname(msgrecord_t *mr, const char **fname)
 EXPORTED int msgrecord_annot_lookup(msgrecord_t *mr, const char *entry,
                                     const char *userid, struct buf *value)
 {
-    int r = msgrecord_need(mr, M_MAILBOX|M_UID|M_ANNOTATIONS);
+    int r = msgrecord_need(mr, M_MAILBOX|M_RECORD|M_ANNOTATIONS);
     if (r) return r;
 
-    return annotatemore_msg_lookup(mr->mbox->name, mr->record.uid, entry, userid, value);
+    return mailbox_annotation_lookup_record(mr->mbox, &mr->record, entry, userid, value);
 }
 
 
@@ -82,6 +82,7 @@ static struct protocol_t mupdate_protocol =
         { { "AUTH", CAPA_AUTH },
           { "STARTTLS", CAPA_STARTTLS },
           { "COMPRESS=DEFLATE", CAPA_COMPRESS },
+          { "INCREMENTAL-UPDATE", CAPA_INCREMENTAL_UPDATE },
           { NULL, 0 } } },
       { "S01 STARTTLS", "S01 OK", "S01 NO", 1 },
       { "A01 AUTHENTICATE", USHRT_MAX, 1, "A01 OK", "A01 NO", "", "*", NULL, 0 },
@@ -717,6 +718,42 @@ EXPORTED int mupdate_scarf(mupdate_handle *handle,
                 break;
             }
             goto badcmd;
+        case 'P':
+            if (!strncmp(handle->cmd.s, "POSITION", 8)) {
+                bit64 epoch, seq;
+
+                /* Epoch */
+                ch = getword(handle->conn->in, &(handle->arg1));
+                if (ch != ' ') {
+                    r = MUPDATE_PROTOCOL_ERROR;
+                    goto done;
+                }
+
+                /* Sequence */
+                ch = getword(handle->conn->in, &(handle->arg2));
+                if (ch != ' ') {
+                    r = MUPDATE_PROTOCOL_ERROR;
+                    goto done;
+                }
+
+                /* FULL or INCREMENTAL */
+                ch = getword(handle->conn->in, &(handle->arg3));
+                CHECKNEWLINE(handle, ch);
+
+                if (parsenum(handle->arg1.s, NULL, 0, &epoch) ||
+                    parsenum(handle->arg2.s, NULL, 0, &seq)) {
+                    r = MUPDATE_PROTOCOL_ERROR;
+                    goto done;
+                }
+
+                /* everything before this has been sent */
+                handle->pos_epoch = epoch;
+                handle->pos_seq = seq;
+                handle->pos_incremental =
+                    !strcasecmp(handle->arg3.s, "INCREMENTAL");
+                break;
+            }
+            goto badcmd;
         case 'R':
             if (!strncmp(handle->cmd.s, "RESERVE", 7)) {
                 /* Mailbox Name */
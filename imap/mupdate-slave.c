@@ -69,6 +69,53 @@
 #include "mupdate.h"
 #include "exitcodes.h"
 
+/* Load the position in the master's change log that our copy of the
+ * mailbox list reflects, or zeros if we don't know it */
+static void read_position(mupdate_handle *handle)
+{
+    char *fname = strconcat(config_dir, FNAME_MUPDATE_POSITION, (char *)NULL);
+    unsigned long long epoch = 0, seq = 0;
+    FILE *f;
+
+    handle->pos_epoch = handle->pos_seq = 0;
+
+    f = fopen(fname, "r");
+    if (f) {
+        if (fscanf(f, "%llu %llu", &epoch, &seq) == 2) {
+            handle->pos_epoch = epoch;
+            handle->pos_seq = seq;
+        }
+        fclose(f);
+    }
+
+    free(fname);
+}
+
+static void write_position(mupdate_handle *handle)
+{
+    char *fname = strconcat(config_dir, FNAME_MUPDATE_POSITION, (char *)NULL);
+    char *newfname = strconcat(fname, ".NEW", (char *)NULL);
+    FILE *f;
+
+    f = fopen(newfname, "w");
+    if (!f) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+        goto done;
+    }
+
+    fprintf(f, "%llu %llu\n", (unsigned long long) handle->pos_epoch,
+            (unsigned long long) handle->pos_seq);
+
+    if (fclose(f) == EOF || rename(newfname, fname) < 0) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", fname);
+        unlink(newfname);
+    }
+
+ done:
+    free(newfname);
+    free(fname);
+}
+
 /* Returns file descriptor of kick socket (or does not return) */
 static int open_kick_socket(void)
 {
@@ -164,6 +211,7 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
     fd_set rset, read_set;
     int highest_fd, kicksock;
     int waiting_for_noop = 0;
+    uint64_t saved_seq;
     int kick_fds[KICK_FDS_LEN];
     int num_kick_fds = 0;
     struct mbent_queue remote_boxes;
@@ -175,7 +223,9 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
 
     pool = new_mpool(131072); /* Arbitrary, but large (128k) */
 
-    /* first get the list of remote mailboxes from the mupdate master */
+    /* first get the list of remote mailboxes from the mupdate master,
+       or just what changed since we last heard from it */
+    read_position(handle);
     r = mupdate_synchronize_remote(handle, &remote_boxes, pool);
     if (r) {
         free_mpool(pool);
@@ -187,10 +237,17 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
     mupdate_unready();
 
     /* Now, resync the database by comparing the remote mbox with our local*/
-    r = mupdate_synchronize(&remote_boxes, pool);
+    if (handle->pos_incremental)
+        r = mupdate_synchronize_incremental(&remote_boxes);
+    else
+        r = mupdate_synchronize(&remote_boxes, pool);
     free_mpool(pool);
     if (r) return;
 
+    /* we are now as up to date as the position we were sent */
+    write_position(handle);
+    saved_seq = handle->pos_seq;
+
     mupdate_signal_db_synced();
 
     /* Okay, we're all set to go */
@@ -230,6 +287,12 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
                     break;
                 }
 
+                if (handle->pos_seq != saved_seq) {
+                    /* the changes up to the new position are applied */
+                    write_position(handle);
+                    saved_seq = handle->pos_seq;
+                }
+
                 /* If we were waiting on a noop, we no longer are.
                  * If we have been kicked, tell them we're done now */
                 if (waiting_for_noop) {
@@ -78,6 +78,7 @@
 #include "exitcodes.h"
 #include "global.h"
 #include "mailbox.h"
+#include "mbcache.h"
 #include "mboxlist.h"
 #include "mpool.h"
 #include "nonblock.h"
@@ -112,6 +113,7 @@ enum {
 struct pending {
     struct pending *next;
 
+    uint64_t seq;   /* position in the change log */
     char mailbox[MAX_MAILBOX_BUFFER];
 };
 
@@ -141,6 +143,7 @@ struct conn {
     /* UPDATE command handling */
     const char *streaming; /* tag */
     strarray_t *streaming_hosts; /* partial updates */
+    int want_position;     /* UPDATESINCE: report our change log position */
 
     /* pending changes to send, in reverse order */
     pthread_mutex_t m;
@@ -198,6 +201,16 @@ static int conn_pipe[2];
 static pthread_mutex_t mailboxes_mutex = PTHREAD_MUTEX_INITIALIZER;
 static struct conn *updatelist = NULL;
 
+/* ---- recent changes, for UPDATESINCE (protected by mailboxes_mutex) */
+static struct {
+    uint64_t epoch;     /* identifies this log; new after every reset */
+    uint64_t seq;       /* position of the latest change */
+    size_t size;        /* capacity of the ring, 0 if disabled */
+    size_t count;
+    size_t head;        /* slot of the oldest change */
+    char **mailbox;
+} changelog;
+
 /* --- prototypes --- */
 static void conn_free(struct conn *C);
 static mupdate_docmd_result_t docmd(struct conn *c);
@@ -212,6 +225,8 @@ static void cmd_find(struct conn *C, const char *tag, const char *mailbox,
 static void cmd_list(struct conn *C, const char *tag, const char *host_prefix);
 static void cmd_startupdate(struct conn *C, const char *tag,
                      strarray_t *partial);
+static void cmd_startupdate_since(struct conn *C, const char *tag,
+                                  uint64_t epoch, uint64_t seq);
 static void cmd_starttls(struct conn *C, const char *tag);
 #ifdef HAVE_ZLIB
 static void cmd_compress(struct conn *C, const char *tag, const char *alg);
@@ -487,6 +502,10 @@ int service_init(int argc, char **argv,
 
     if (geteuid() == 0) fatal("must run as the Cyrus user", EC_USAGE);
 
+    /* interned mailbox names are shared between callers, and our
+     * threads don't all hold the mailboxes lock */
+    mbname_intern_setmax(0);
+
     /* Do minor configuration checking */
     workers_to_start = config_getint(IMAPOPT_MUPDATE_WORKERS_START);
 
@@ -912,6 +931,22 @@ static mupdate_docmd_result_t docmd(struct conn *c)
 
             cmd_startupdate(c, c->tag.s, arg);
         }
+        else if (!strcmp(c->cmd.s, "Updatesince")) {
+            bit64 epoch, seq;
+
+            if (ch != ' ') goto missingargs;
+            ch = getword(c->pin, &(c->arg1));
+            if (ch != ' ') goto missingargs;
+            ch = getword(c->pin, &(c->arg2));
+            CHECKNEWLINE(c, ch);
+            if (c->streaming) goto notwhenstreaming;
+
+            if (parsenum(c->arg1.s, NULL, 0, &epoch) ||
+                parsenum(c->arg2.s, NULL, 0, &seq))
+                goto badargs;
+
+            cmd_startupdate_since(c, c->tag.s, epoch, seq);
+        }
         else goto badcmd;
         break;
 
@@ -1064,6 +1099,10 @@ static void dobanner(struct conn *c)
 
     prot_printf(c->pout, "* PARTIAL-UPDATE\r\n");
 
+    if (changelog.size) {
+        prot_printf(c->pout, "* INCREMENTAL-UPDATE\r\n");
+    }
+
     prot_printf(c->pout,
                 "* OK MUPDATE \"%s\" \"Cyrus IMAP\" \"%s\" \"%s\"\r\n",
                 config_servername,
@@ -1375,10 +1414,60 @@ static void *thread_main(void *rock __attribute__((unused)))
     return NULL;
 }
 
+/* forget all recorded changes; slaves that were following the old log
+   will be sent the whole list.  database must be locked */
+static void changelog_reset(void)
+{
+    struct timeval now;
+    size_t i;
+
+    for (i = 0; i < changelog.count; i++) {
+        free(changelog.mailbox[(changelog.head + i) % changelog.size]);
+    }
+    changelog.count = changelog.head = 0;
+
+    gettimeofday(&now, NULL);
+    changelog.epoch = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static void changelog_init(void)
+{
+    int size = config_getint(IMAPOPT_MUPDATE_CHANGELOG_SIZE);
+
+    if (size > 0) {
+        changelog.size = size;
+        changelog.mailbox = xzmalloc(size * sizeof(char *));
+    }
+    changelog_reset();
+}
+
+/* record a change, returning its position.  database must be locked */
+static uint64_t changelog_append(const char *mailbox)
+{
+    size_t slot;
+
+    changelog.seq++;
+    if (!changelog.size) return changelog.seq;
+
+    if (changelog.count == changelog.size) {
+        /* full: drop the oldest change */
+        free(changelog.mailbox[changelog.head]);
+        changelog.head = (changelog.head + 1) % changelog.size;
+        changelog.count--;
+    }
+
+    slot = (changelog.head + changelog.count) % changelog.size;
+    changelog.mailbox[slot] = xstrdup(mailbox);
+    changelog.count++;
+
+    return changelog.seq;
+}
+
 /* read from disk database must be unlocked. */
 static void database_init(void)
 {
     pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
+    changelog_init();
     pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
 }
 
@@ -1422,6 +1511,9 @@ static void database_log(const struct mbent *mb, struct txn **mytid)
         abort();
     }
 
+    /* let frontend processes know their copy is out of date */
+    if (!mytid) mbcache_invalidate(mb->mailbox);
+
     mboxlist_entry_free(&mbentry);
 }
 
@@ -1555,11 +1647,13 @@ static void log_update(const char *mailbox,
                 const char *thislocation)
 {
     struct conn *upc;
+    uint64_t seq = changelog_append(mailbox);
 
     for (upc = updatelist; upc != NULL; upc = upc->updatelist_next) {
         /* for each connection, add to pending list */
         struct pending *p = (struct pending *) xmalloc(sizeof(struct pending));
         p->next = NULL;
+        p->seq = seq;
         strlcpy(p->mailbox, mailbox, sizeof(p->mailbox));
 
         /* this might need to be inside the mutex, but I doubt it */
@@ -1924,11 +2018,79 @@ static void cmd_startupdate(struct conn *C, const char *tag,
                               sendupdates_evt, C);
 }
 
+static void cmd_startupdate_since(struct conn *C, const char *tag,
+                                  uint64_t epoch, uint64_t seq)
+{
+    strarray_t changed = STRARRAY_INITIALIZER;
+    hash_table seen = HASH_TABLE_INITIALIZER;
+    uint64_t oldest;
+    int i, full;
+
+    prot_NONBLOCK(C->pout);
+
+    pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
+
+    C->updatelist_next = updatelist;
+    updatelist = C;
+    C->streaming = xstrdup(tag);
+    C->want_position = 1;
+
+    /* can we tell exactly what changed since then? */
+    oldest = changelog.seq - changelog.count;
+    full = (epoch != changelog.epoch || seq < oldest || seq > changelog.seq);
+
+    if (full) {
+        /* dump initial list */
+        mboxlist_allmbox("", sendupdate, (void*)C, /*flags*/0);
+    }
+    else if (seq < changelog.seq) {
+        size_t n;
+
+        construct_hash_table(&seen, changelog.seq - seq, 0);
+        for (n = seq - oldest; n < changelog.count; n++) {
+            const char *mailbox =
+                changelog.mailbox[(changelog.head + n) % changelog.size];
+
+            if (hash_lookup(mailbox, &seen)) continue;
+            hash_insert(mailbox, (void *) 1, &seen);
+            strarray_append(&changed, mailbox);
+        }
+        free_hash_table(&seen, NULL);
+    }
+    epoch = changelog.epoch;
+    seq = changelog.seq;
+
+    pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
+
+    /* send the current state of each changed mailbox, or its deletion */
+    for (i = 0; i < strarray_size(&changed); i++) {
+        cmd_find(C, tag, strarray_nth(&changed, i), 0, 1);
+    }
+
+    syslog(LOG_NOTICE, "%s: %s update, %d mailboxes changed, position %llu",
+           C->clienthost, full ? "full" : "incremental",
+           strarray_size(&changed), (unsigned long long) seq);
+    strarray_fini(&changed);
+
+    prot_printf(C->pout, "%s POSITION %llu %llu %s\r\n",
+                tag, (unsigned long long) epoch,
+                (unsigned long long) seq, full ? "FULL" : "INCREMENTAL");
+    prot_printf(C->pout, "%s OK \"streaming starts\"\r\n", tag);
+
+    prot_BLOCK(C->pout);
+    prot_flush(C->pout);
+
+    /* schedule our first update */
+    C->ev = prot_addwaitevent(C->pin, time(NULL) + update_wait,
+                              sendupdates_evt, C);
+}
+
 /* send out any pending updates.
    if 'flushnow' is set, flush the output buffer */
 static void sendupdates(struct conn *C, int flushnow)
 {
     struct pending *p, *q;
+    uint64_t seq = 0;
 
     pthread_mutex_lock(&C->m);
 
@@ -1947,9 +2109,23 @@ static void sendupdates(struct conn *C, int flushnow)
          * notifications */
         cmd_find(C, C->streaming, q->mailbox, 0, 1);
 
+        seq = q->seq;
         free(q);
     }
 
+    if (seq && C->want_position) {
+        uint64_t epoch;
+
+        pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
+        epoch = changelog.epoch;
+        pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
+
+        /* everything up to here has been sent */
+        prot_printf(C->pout, "%s POSITION %llu %llu INCREMENTAL\r\n",
+                    C->streaming, (unsigned long long) epoch,
+                    (unsigned long long) seq);
+    }
+
     /* reschedule event for 'update_wait' seconds */
     C->ev->mark = time(NULL) + update_wait;
 
@@ -2230,8 +2406,8 @@ struct sync_rock
     struct mbent_queue *boxes;
 };
 
-/* Read a series of MAILBOX and RESERVE commands and tack them onto a
- * queue */
+/* Read a series of MAILBOX and RESERVE (and, for an incremental update,
+ * DELETE) commands and tack them onto a queue */
 static int cmd_resync(struct mupdate_mailboxdata *mdata,
                const char *rock, void *context)
 {
@@ -2249,7 +2425,8 @@ static int cmd_resync(struct mupdate_mailboxdata *mdata,
     }
 
     newm->mailbox = mpool_strdup(r->pool, mdata->mailbox);
-    newm->location = mpool_strdup(r->pool, mdata->location);
+    newm->location = mpool_strdup(r->pool,
+                                  mdata->location ? mdata->location : "");
 
     if (mdata->acl) {
         strcpy(newm->acl, mdata->acl);
@@ -2261,6 +2438,8 @@ static int cmd_resync(struct mupdate_mailboxdata *mdata,
         newm->t = SET_ACTIVE;
     } else if (!strncmp(rock, "RESERVE", 7)) {
         newm->t = SET_RESERVE;
+    } else if (!strncmp(rock, "DELETE", 6)) {
+        newm->t = SET_DELETE;
     } else {
         syslog(LOG_NOTICE,
                "bad mupdate command in cmd_resync: %s", rock);
@@ -2306,7 +2485,17 @@ int mupdate_synchronize_remote(mupdate_handle *handle,
     rock.pool = pool;
 
     /* ask mupdate master for updates and set nonblocking */
-    prot_printf(handle->conn->out, "U01 UPDATE\r\n");
+    handle->pos_incremental = 0;
+    if (CAPA(handle->conn, CAPA_INCREMENTAL_UPDATE)) {
+        /* just the changes since we were last in sync, if it can tell */
+        prot_printf(handle->conn->out, "U01 UPDATESINCE %llu %llu\r\n",
+                    (unsigned long long) handle->pos_epoch,
+                    (unsigned long long) handle->pos_seq);
+    }
+    else {
+        handle->pos_epoch = handle->pos_seq = 0;
+        prot_printf(handle->conn->out, "U01 UPDATE\r\n");
+    }
 
     syslog(LOG_NOTICE,
            "scarfing mailbox list from master mupdate server");
@@ -2351,6 +2540,10 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
     syslog(LOG_NOTICE,
            "synchronizing mailbox list with master mupdate server");
 
+    /* these changes don't go through the change log, so anyone
+       following it from us will need the whole list again */
+    changelog_reset();
+
     local_boxes.head = NULL;
     local_boxes.tail = &(local_boxes.head);
 
@@ -2482,6 +2675,7 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
     }
 
     if (tid) mboxlist_commit(tid);
+    mbcache_invalidate(NULL);
 
     /* All up to date! */
     if ( err ) {
@@ -2495,6 +2689,35 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
     return ret;
 }
 
+int mupdate_synchronize_incremental(struct mbent_queue *remote_boxes)
+{
+    struct mupdate_mailboxdata mdata;
+    struct mbent *r;
+    int n = 0;
+
+    /* apply each change the same way as one streamed to us */
+    for (r = remote_boxes->head; r; r = r->next) {
+        const char *cmd = r->t == SET_ACTIVE ? "MAILBOX" :
+                          r->t == SET_RESERVE ? "RESERVE" : "DELETE";
+
+        memset(&mdata, 0, sizeof(mdata));
+        mdata.mailbox = r->mailbox;
+        mdata.location = r->location;
+        mdata.acl = r->acl;
+
+        if (cmd_change(&mdata, cmd, NULL)) {
+            syslog(LOG_ERR, "incremental update of %s failed", r->mailbox);
+            return 1;
+        }
+        n++;
+    }
+
+    syslog(LOG_NOTICE,
+           "mailbox list synchronization complete (%d changes)", n);
+
+    return 0;
+}
+
 void mupdate_signal_db_synced(void)
 {
     pthread_mutex_lock(&synced_mutex);
@@ -77,8 +77,19 @@ struct mupdate_handle_s {
     struct mupdate_mailboxdata mailboxdata_buf;
 
     int saslcompleted;
+
+    /* our position in the master's change log (see POSITION) */
+    uint64_t pos_epoch;
+    uint64_t pos_seq;
+    int pos_incremental;    /* the last UPDATESINCE sent only changes */
 };
 
+/* the master can send only the changes since a POSITION */
+#define CAPA_INCREMENTAL_UPDATE (1 << 3)
+
+/* where the slave records its POSITION */
+#define FNAME_MUPDATE_POSITION "/mupdate.position"
+
 enum settype {
     SET_ACTIVE,
     SET_RESERVE,
@@ -114,6 +125,8 @@ int mupdate_synchronize_remote(mupdate_handle *handle,
                                struct mpool *pool);
 /* Given an mbent_queue, will synchronize the local database to it */
 int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool);
+/* Given an mbent_queue of changes only, will apply them */
+int mupdate_synchronize_incremental(struct mbent_queue *remote_boxes);
 
 /* Signal that we are ready to accept connections */
 void mupdate_ready(void);
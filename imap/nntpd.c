@@ -85,9 +85,11 @@
 #include "hash.h"
 #include "idle.h"
 #include "index.h"
+#include "logring.h"
 #include "mailbox.h"
 #include "map.h"
 #include "mboxlist.h"
+#include "msgid_db.h"
 #include "mkgmtime.h"
 #include "mupdate-client.h"
 #include "partlist.h"
@@ -386,7 +388,7 @@ static void nntp_reset(void)
 
     nntp_clienthost = "[local]";
     if (nntp_logfd != -1) {
-        close(nntp_logfd);
+        telemetry_close(nntp_logfd);
         nntp_logfd = -1;
     }
     if (nntp_userid != NULL) {
@@ -1502,11 +1504,32 @@ static int find_cb(const duplicate_key_t *dkey,
     return CYRUSDB_DONE;
 }
 
+/*
+ * msgid_db_find() callback function to fetch a message by msgid
+ */
+static int msgid_find_cb(const char *mboxname, uint32_t uid, void *rock)
+{
+    struct findrock *frock = (struct findrock *) rock;
+    static struct buf found = BUF_INITIALIZER;
+
+    /* skip mailboxes that we don't serve as newsgroups */
+    if (!is_newsgroup(mboxname)) return 0;
+
+    /* mboxname only lives as long as the callback */
+    buf_setcstr(&found, mboxname);
+    frock->mailbox = buf_cstring(&found);
+    frock->uid = uid;
+
+    return CYRUSDB_DONE;
+}
+
 static int my_find_msgid(char *msgid, char **mailbox, uint32_t *uid)
 {
     struct findrock frock = { NULL, 0 };
 
-    duplicate_find(msgid, find_cb, &frock);
+    /* articles which predate the index are only in the deliver db */
+    if (msgid_db_find(msgid, msgid_find_cb, &frock) || !frock.mailbox)
+        duplicate_find(msgid, find_cb, &frock);
 
     if (!frock.mailbox) return 0;
 
@@ -1842,6 +1865,21 @@ static int xref_cb(const duplicate_key_t *dkey,
     return 0;
 }
 
+/*
+ * msgid_db_find() callback function to build Xref content
+ */
+static int msgid_xref_cb(const char *mboxname, uint32_t uid, void *rock)
+{
+    struct buf *buf = (struct buf *)rock;
+
+    /* skip mailboxes that we don't serve as newsgroups */
+    if (is_newsgroup(mboxname)) {
+        buf_printf(buf, " %s:%u", mboxname + strlen(newsprefix), uid);
+    }
+
+    return 0;
+}
+
 /*
  * Build an Xref header.  We have to do this on the fly because there is
  * no way to store it in the article at delivery time.
@@ -1851,7 +1889,8 @@ static void build_xref(const char *msgid, struct buf *buf, int body_only)
     if (!body_only)
         buf_appendcstr(buf, "Xref: ");
     buf_appendcstr(buf, config_servername);
-    duplicate_find(msgid, xref_cb, buf);
+    if (msgid_db_find(msgid, msgid_xref_cb, buf))
+        duplicate_find(msgid, xref_cb, buf);
 }
 
 static void cmd_article(int part, char *msgid, unsigned long uid)
@@ -1982,10 +2021,11 @@ static void cmd_authinfo_pass(char *pass)
 
     /* Conceal password in telemetry log */
     if (nntp_logfd != -1 && pass) {
+        logring_sync(nntp_logfd);
         r = ftruncate(nntp_logfd,
                   lseek(nntp_logfd, -2, SEEK_CUR) - strlen(pass));
         if (!r)
-            r = write(nntp_logfd, "...\r\n", 5);
+            r = logring_write(nntp_logfd, "...\r\n", 5);
         if (r < 0)
             syslog(LOG_ERR, "IOERROR: cannot conceal password in telemetry log: %m");
     }
@@ -2046,7 +2086,7 @@ static void cmd_authinfo_pass(char *pass)
         nntp_authstate = auth_newstate(nntp_userid);
 
         /* Close IP-based telemetry log and create new log based on userid */
-        if (nntp_logfd != -1) close(nntp_logfd);
+        if (nntp_logfd != -1) telemetry_close(nntp_logfd);
         nntp_logfd = telemetry_log(nntp_userid, nntp_in, nntp_out, 0);
     }
 }
@@ -2070,9 +2110,10 @@ static void cmd_authinfo_sasl(char *cmd, char *mech, char *resp)
 
     /* Conceal initial response in telemetry log */
     if (nntp_logfd != -1 && resp) {
+        logring_sync(nntp_logfd);
         r = ftruncate(nntp_logfd,
                   lseek(nntp_logfd, -2, SEEK_CUR) - strlen(resp));
-        r = write(nntp_logfd, "...\r\n", 5);
+        r = logring_write(nntp_logfd, "...\r\n", 5);
         r = 0;
     }
 
@@ -2251,7 +2292,7 @@ static void cmd_authinfo_sasl(char *cmd, char *mech, char *resp)
     prot_setsasl(nntp_out, nntp_saslconn);
 
     /* Close IP-based telemetry log and create new log based on userid */
-    if (nntp_logfd != -1) close(nntp_logfd);
+    if (nntp_logfd != -1) telemetry_close(nntp_logfd);
     nntp_logfd = telemetry_log(nntp_userid, nntp_in, nntp_out, 0);
 
     if (ssf) {
@@ -2265,6 +2306,56 @@ static void cmd_authinfo_sasl(char *cmd, char *mech, char *resp)
     }
 }
 
+struct hdr_rock {
+    const char *cmd;
+    const char *hdr;
+    const char *pat;
+    int by_msgid;
+    int found;
+};
+
+/* header fields which can be answered from the overview */
+static int hdr_in_overview(const char *hdr)
+{
+    return (!strcmp(hdr, "subject") || !strcmp(hdr, "date") ||
+            !strcmp(hdr, "message-id") || !strcmp(hdr, "references") ||
+            !strcmp(hdr, ":bytes") || !strcmp(hdr, ":lines"));
+}
+
+static void hdr_print(struct nntp_overview *over, void *rock)
+{
+    struct hdr_rock *hrock = rock;
+    unsigned long uid = hrock->by_msgid ? 0 : over->uid;
+    const char *val = NULL;
+
+    if (!hrock->found++)
+        prot_printf(nntp_out, "%u Headers follow:\r\n",
+                    hrock->cmd[0] == 'X' ? 221 : 225);
+
+    if (!strcmp(hrock->hdr, ":bytes")) {
+        struct buf xref = BUF_INITIALIZER;
+
+        build_xref(over->msgid, &xref, 0);
+        prot_printf(nntp_out, "%lu %lu\r\n", uid,
+                    over->bytes + xref.len + 2); /* +2 for \r\n */
+        buf_free(&xref);
+        return;
+    }
+    if (!strcmp(hrock->hdr, ":lines")) {
+        prot_printf(nntp_out, "%lu %lu\r\n", uid, over->lines);
+        return;
+    }
+
+    if (!strcmp(hrock->hdr, "subject")) val = over->subj;
+    else if (!strcmp(hrock->hdr, "date")) val = over->date;
+    else if (!strcmp(hrock->hdr, "message-id")) val = over->msgid;
+    else if (!strcmp(hrock->hdr, "references")) val = over->ref;
+    if (!val) val = "";
+
+    if (!hrock->pat || wildmat(val, hrock->pat))
+        prot_printf(nntp_out, "%lu %s\r\n", uid, val);
+}
+
 static void cmd_hdr(char *cmd, char *hdr, char *pat, char *msgid,
                     unsigned long uid, unsigned long last)
 {
@@ -2278,6 +2369,16 @@ static void cmd_hdr(char *cmd, char *hdr, char *pat, char *msgid,
     if (!msgno || index_getuid(group_state, msgno) != uid) msgno++;
     last_msgno = index_finduid(group_state, last);
 
+    if (mailbox_overview_enabled(group_state->mailbox) &&
+        hdr_in_overview(hdr)) {
+        struct hdr_rock hrock = { cmd, hdr, pat, by_msgid, 0 };
+
+        index_overview_range(group_state, msgno, last_msgno,
+                             hdr_print, &hrock);
+        found = hrock.found;
+        msgno = last_msgno + 1;
+    }
+
     for (; msgno <= last_msgno; msgno++) {
         char *body;
 
@@ -2796,39 +2897,45 @@ static void cmd_newnews(char *wild, time_t tstamp)
     free_wildmats(nrock.wild);
 }
 
+struct over_rock {
+    char *msgid;
+    int found;
+};
+
+static void over_print(struct nntp_overview *over, void *rock)
+{
+    struct over_rock *orock = rock;
+    struct buf xref = BUF_INITIALIZER;
+
+    if (!orock->found++)
+        prot_printf(nntp_out, "224 Overview information follows:\r\n");
+
+    build_xref(over->msgid, &xref, 0);
+
+    prot_printf(nntp_out, "%lu\t%s\t%s\t%s\t%s\t%s\t%lu\t%lu\t%s\r\n",
+                orock->msgid ? 0 : over->uid,
+                over->subj ? over->subj : "",
+                over->from ? over->from : "",
+                over->date ? over->date : "",
+                over->msgid ? over->msgid : "",
+                over->ref ? over->ref : "",
+                over->bytes + xref.len + 2, /* +2 for \r\n */
+                over->lines, buf_cstring(&xref));
+    buf_free(&xref);
+}
+
 static void cmd_over(char *msgid, unsigned long uid, unsigned long last)
 {
     uint32_t msgno, last_msgno;
-    struct nntp_overview *over;
-    int found = 0;
+    struct over_rock orock = { msgid, 0 };
 
     msgno = index_finduid(group_state, uid);
     if (!msgno || index_getuid(group_state, msgno) != uid) msgno++;
     last_msgno = index_finduid(group_state, last);
 
-    for (; msgno <= last_msgno; msgno++) {
-        if (!found++)
-            prot_printf(nntp_out, "224 Overview information follows:\r\n");
-
-        if ((over = index_overview(group_state, msgno))) {
-            struct buf xref = BUF_INITIALIZER;
+    index_overview_range(group_state, msgno, last_msgno, over_print, &orock);
 
-            build_xref(over->msgid, &xref, 0);
-
-            prot_printf(nntp_out, "%lu\t%s\t%s\t%s\t%s\t%s\t%lu\t%lu\t%s\r\n",
-                        msgid ? 0 : over->uid,
-                        over->subj ? over->subj : "",
-                        over->from ? over->from : "",
-                        over->date ? over->date : "",
-                        over->msgid ? over->msgid : "",
-                        over->ref ? over->ref : "",
-                        over->bytes + xref.len + 2, /* +2 for \r\n */
-                        over->lines, buf_cstring(&xref));
-            buf_free(&xref);
-        }
-    }
-
-    if (found)
+    if (orock.found)
         prot_printf(nntp_out, ".\r\n");
     else
         prot_printf(nntp_out, "423 No such article(s) in this newsgroup\r\n");
@@ -44,6 +44,7 @@
 #include <config.h>
 #endif
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
@@ -224,11 +225,12 @@ done:
     return r;
 }
 
-EXPORTED void notify(const char *method,
-            const char *class, const char *priority,
-            const char *user, const char *mailbox,
-            int nopt, const char **options,
-            const char *message, const char *fname)
+static int notify_send(const char *method,
+                       const char *class, const char *priority,
+                       const char *user, const char *mailbox,
+                       int nopt, const char **options,
+                       const char *message, const char *fname,
+                       int nonblock)
 {
     const char *notify_sock = config_getstring(IMAPOPT_NOTIFYSOCKET);
     int soc = -1;
@@ -240,15 +242,17 @@ EXPORTED void notify(const char *method,
     socklen_t optlen;
 
     if (!strncmp(notify_sock, "dlist:", 6)) {
+        /* the dlist protocol waits for a reply, so is always blocking */
         notify_dlist(notify_sock+6, method, class, priority,
                             user, mailbox, nopt, options,
                             message, fname);
-        return;
+        return 0;
     }
 
     soc = socket(AF_UNIX, SOCK_DGRAM, 0);
     if (soc == -1) {
         syslog(LOG_ERR, "unable to create notify socket(): %m");
+        r = IMAP_IOERROR;
         goto out;
     }
 
@@ -268,6 +272,7 @@ EXPORTED void notify(const char *method,
     r = getsockopt(soc, SOL_SOCKET, SO_SNDBUF, &bufsiz, &optlen);
     if (r == -1) {
         syslog(LOG_ERR, "unable to getsockopt(SO_SNDBUF) on notify socket: %m");
+        r = IMAP_IOERROR;
         goto out;
     }
 
@@ -300,21 +305,56 @@ EXPORTED void notify(const char *method,
     if (r) {
         syslog(LOG_ERR, "notify datagram too large, %s, %s",
                user, mailbox);
+        r = IMAP_IOERROR;
         goto out;
     }
 
-    r = sendto(soc, buf, buflen, 0,
+    r = sendto(soc, buf, buflen, nonblock ? MSG_DONTWAIT : 0,
                (struct sockaddr *)&sun_data, sizeof(sun_data));
 
     if (r < 0) {
+        if (nonblock && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                         errno == ENOBUFS)) {
+            r = IMAP_AGAIN;
+            goto out;
+        }
         syslog(LOG_ERR, "unable to sendto() notify socket: %m");
+        r = IMAP_IOERROR;
         goto out;
     }
     if (r < buflen) {
         syslog(LOG_ERR, "short write to notify socket");
+        r = IMAP_IOERROR;
         goto out;
     }
+    r = 0;
 
 out:
     xclose(soc);
+    return r;
+}
+
+EXPORTED void notify(const char *method,
+            const char *class, const char *priority,
+            const char *user, const char *mailbox,
+            int nopt, const char **options,
+            const char *message, const char *fname)
+{
+    notify_send(method, class, priority, user, mailbox,
+                nopt, options, message, fname, /*nonblock*/0);
+}
+
+/*
+ * Like notify(), but don't wait if the notify socket is full.
+ * Returns IMAP_AGAIN if the notification would have blocked, and
+ * IMAP_IOERROR if it could not be sent at all.
+ */
+EXPORTED int notify_nonblock(const char *method,
+                             const char *class, const char *priority,
+                             const char *user, const char *mailbox,
+                             int nopt, const char **options,
+                             const char *message, const char *fname)
+{
+    return notify_send(method, class, priority, user, mailbox,
+                       nopt, options, message, fname, /*nonblock*/1);
 }
@@ -51,6 +51,12 @@ void notify(const char *method,
             int nopt, const char **options,
             const char *message, const char *fname);
 
+int notify_nonblock(const char *method,
+                    const char *class, const char *priority,
+                    const char *user, const char *mailbox,
+                    int nopt, const char **options,
+                    const char *message, const char *fname);
+
 int notify_at(time_t when, const char *method,
             const char *class, const char *priority,
             const char *user, const char *mboxname,
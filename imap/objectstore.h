@@ -56,4 +56,8 @@ int objectstore_delete (struct mailbox *mailbox,
 int objectstore_is_filename_in_container (struct mailbox *mailbox,
         const struct index_record *record, int *isthere);
 
+/* local cache of fetched objects, see objectstore_cache.c */
+int objectstore_cache_map (struct mailbox *mailbox,
+        const struct index_record *record, struct buf *buf);
+
 #endif /*OBJECT_STORE*/
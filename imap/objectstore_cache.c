@@ -0,0 +1,264 @@
+/* objectstore_cache.c -- local cache of objects fetched from the object store
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "mailbox.h"
+#include "mboxname.h"
+#include "libconfig.h"
+#include "xmalloc.h"
+#include "util.h"
+#include "objectstore.h"
+#include "imap/imap_err.h"
+#include "imap/prometheus.h"
+
+/*
+ * Archived messages are fetched from the object store into
+ * object_storage_cache_dir, one file per message GUID, and read from
+ * there until they're evicted.  Objects are content addressed, so the
+ * same file serves every mailbox which holds the message.  The files'
+ * mtimes are bumped on use and the least recently used ones are
+ * removed when the cache grows past object_storage_cache_maxsize.
+ */
+
+/* don't bother bumping the mtime more often than this */
+#define CACHE_TOUCH_INTERVAL 60
+
+/* how much to evict down to, as a fraction of the maximum size */
+#define CACHE_EVICT_TARGET 0.9
+
+/* bytes this process has added since it last checked the size */
+static uint64_t cache_added = 0;
+
+struct cache_entry {
+    char *path;
+    time_t mtime;
+    off_t size;
+};
+
+static const char *cache_fname(const struct index_record *record)
+{
+    static struct buf fname = BUF_INITIALIZER;
+    const char *guid = message_guid_encode(&record->guid);
+
+    buf_reset(&fname);
+    buf_printf(&fname, "%s/%c%c/%s",
+               config_getstring(IMAPOPT_OBJECT_STORAGE_CACHE_DIR),
+               guid[0], guid[1], guid);
+
+    return buf_cstring(&fname);
+}
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+    const struct cache_entry *ea = a, *eb = b;
+
+    if (ea->mtime < eb->mtime) return -1;
+    if (ea->mtime > eb->mtime) return 1;
+    return 0;
+}
+
+static void cache_evict(void)
+{
+    const char *dir = config_getstring(IMAPOPT_OBJECT_STORAGE_CACHE_DIR);
+    uint64_t maxsize =
+        (uint64_t) config_getint(IMAPOPT_OBJECT_STORAGE_CACHE_MAXSIZE) << 20;
+    struct mboxlock *lock = NULL;
+    struct cache_entry *entries = NULL;
+    size_t nentries = 0, alloc = 0, i;
+    uint64_t total = 0;
+    struct buf path = BUF_INITIALIZER;
+    DIR *top, *sub;
+    struct dirent *tde, *sde;
+    struct stat sbuf;
+
+    /* somebody else is already on it */
+    if (mboxname_lock("$OBJCACHE$", &lock, LOCK_NONBLOCKING))
+        return;
+
+    cache_added = 0;
+
+    top = opendir(dir);
+    if (!top) goto done;
+
+    while ((tde = readdir(top))) {
+        if (tde->d_name[0] == '.') continue;
+
+        buf_reset(&path);
+        buf_printf(&path, "%s/%s", dir, tde->d_name);
+        sub = opendir(buf_cstring(&path));
+        if (!sub) continue;
+
+        while ((sde = readdir(sub))) {
+            if (sde->d_name[0] == '.') continue;
+
+            buf_reset(&path);
+            buf_printf(&path, "%s/%s/%s", dir, tde->d_name, sde->d_name);
+            if (stat(buf_cstring(&path), &sbuf) == -1) continue;
+
+            if (nentries == alloc) {
+                alloc = alloc ? alloc * 2 : 1024;
+                entries = xrealloc(entries, alloc * sizeof(*entries));
+            }
+            entries[nentries].path = buf_release(&path);
+            entries[nentries].mtime = sbuf.st_mtime;
+            entries[nentries].size = sbuf.st_size;
+            total += sbuf.st_size;
+            nentries++;
+        }
+        closedir(sub);
+    }
+    closedir(top);
+
+    if (total > maxsize) {
+        uint64_t target = maxsize * CACHE_EVICT_TARGET;
+
+        qsort(entries, nentries, sizeof(*entries), cache_entry_cmp);
+
+        for (i = 0; i < nentries && total > target; i++) {
+            if (unlink(entries[i].path) == 0) {
+                total -= entries[i].size;
+                prometheus_increment(CYRUS_OBJECTSTORE_CACHE_EVICTED_TOTAL);
+            }
+        }
+    }
+
+    for (i = 0; i < nentries; i++)
+        free(entries[i].path);
+    free(entries);
+
+done:
+    buf_free(&path);
+    mboxname_release(&lock);
+}
+
+static int cache_map_file(const char *fname, const char *mboxname,
+                          struct buf *buf)
+{
+    struct stat sbuf;
+    int fd;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) return errno;
+
+    if (fstat(fd, &sbuf) == -1 || !sbuf.st_size) {
+        close(fd);
+        return IMAP_IOERROR;
+    }
+
+    if (sbuf.st_mtime + CACHE_TOUCH_INTERVAL < time(NULL))
+        futimens(fd, NULL);
+
+    buf_init_mmap(buf, /*onceonly*/1, fd, fname, sbuf.st_size, mboxname);
+    close(fd);
+
+    return 0;
+}
+
+/*
+ * Map the archived message for 'record' into 'buf', fetching it from
+ * the object store if it isn't in the local cache.
+ */
+EXPORTED int objectstore_cache_map(struct mailbox *mailbox,
+                                   const struct index_record *record,
+                                   struct buf *buf)
+{
+    const char *fname = cache_fname(record);
+    char *tmpname = NULL;
+    char pid[32];
+    uint64_t maxsize;
+    int r;
+
+    r = cache_map_file(fname, mailbox->name, buf);
+    if (!r) {
+        prometheus_increment(CYRUS_OBJECTSTORE_CACHE_TOTAL_RESULT_HIT);
+        return 0;
+    }
+
+    prometheus_increment(CYRUS_OBJECTSTORE_CACHE_TOTAL_RESULT_MISS);
+
+    /* fetch to a private name, so nobody maps a half written file */
+    snprintf(pid, sizeof(pid), "%d", (int) getpid());
+    tmpname = strconcat(fname, ".", pid, ".tmp", (char *)NULL);
+
+    if (cyrus_mkdir(tmpname, 0755) == -1) {
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    r = objectstore_get(mailbox, record, tmpname);
+    if (r) goto done;
+
+    r = cache_map_file(tmpname, mailbox->name, buf);
+    if (r) {
+        unlink(tmpname);
+        goto done;
+    }
+
+    if (rename(tmpname, fname) == -1) {
+        syslog(LOG_ERR, "IOERROR: renaming %s to %s: %m", tmpname, fname);
+        unlink(tmpname);
+        goto done;  /* still got it mapped */
+    }
+
+    cache_added += buf_len(buf);
+    maxsize = (uint64_t) config_getint(IMAPOPT_OBJECT_STORAGE_CACHE_MAXSIZE) << 20;
+    if (cache_added > maxsize / 16)
+        cache_evict();
+
+done:
+    free(tmpname);
+    return r;
+}
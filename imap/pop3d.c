@@ -52,6 +52,8 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <syslog.h>
 #include <netdb.h>
 #include <sys/socket.h>
@@ -84,9 +86,12 @@
 #include "telemetry.h"
 #include "backend.h"
 #include "proc.h"
+#include "retry.h"
+#include "prometheus.h"
 #include "proxy.h"
 #include "seen.h"
 #include "userdeny.h"
+#include "user.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -145,6 +150,11 @@ static struct msg {
     int seen:1;
 } *popd_map = NULL;
 
+/* LIST and UIDL responses, rendered on first use.  Both are thrown
+ * away whenever DELE or RSET changes which messages are listed. */
+static struct buf popd_list = BUF_INITIALIZER;
+static struct buf popd_uidl = BUF_INITIALIZER;
+
 static struct io_count *io_count_start;
 static struct io_count *io_count_stop;
 
@@ -200,7 +210,9 @@ static int openinbox(void);
 static void cmdloop(void);
 static void kpop(void);
 static unsigned parse_msgno(char **ptr);
-static void uidl_msg(uint32_t msgno);
+static void uidl_msg(uint32_t msgno, struct buf *out);
+static int load_listing(const char *key);
+static void save_listing(const char *key);
 static int msg_exists_or_err(uint32_t msgno);
 static int update_seen(void);
 static void usage(void);
@@ -211,6 +223,12 @@ extern int saslserver(sasl_conn_t *conn, const char *mech,
                       const char *continuation, const char *empty_chal,
                       struct protstream *pin, struct protstream *pout,
                       int *sasl_result, char **success_data);
+extern int saslcache_checkpass(sasl_conn_t *conn, void *context,
+                               const char *user,
+                               const char *pass, unsigned passlen,
+                               struct propctx *propctx);
+extern void saslcache_reset(void);
+extern void saslcache_commit(sasl_conn_t *conn);
 
 /* Enable the resetting of a sasl_conn_t */
 static int reset_saslconn(sasl_conn_t **conn);
@@ -319,6 +337,7 @@ static struct sasl_callback mysasl_cb[] = {
     { SASL_CB_GETOPT, (mysasl_cb_ft *) &mysasl_config, NULL },
     { SASL_CB_PROXY_POLICY, (mysasl_cb_ft *) &popd_proxy_policy, (void*) &popd_proxyctx },
     { SASL_CB_CANON_USER, (mysasl_cb_ft *) &popd_canon_user, NULL },
+    { SASL_CB_SERVER_USERDB_CHECKPASS, (mysasl_cb_ft *) &saslcache_checkpass, NULL },
     { SASL_CB_LIST_END, NULL, NULL }
 };
 
@@ -376,7 +395,7 @@ static void popd_reset(void)
 
     popd_clienthost = "[local]";
     if (popd_logfd != -1) {
-        close(popd_logfd);
+        telemetry_close(popd_logfd);
         popd_logfd = -1;
     }
     if (popd_userid != NULL) {
@@ -400,6 +419,8 @@ static void popd_reset(void)
     saslprops_reset(&saslprops);
 
     popd_exists = 0;
+    buf_free(&popd_list);
+    buf_free(&popd_uidl);
 }
 
 /*
@@ -611,6 +632,8 @@ void shut_down(int code)
     if (popd_map) {
         free(popd_map);
     }
+    buf_free(&popd_list);
+    buf_free(&popd_uidl);
 
     /* close backend connection */
     if (backend) {
@@ -849,6 +872,7 @@ static void cmdloop(void)
     char *p;
     char *arg;
     uint32_t msgno = 0;
+    struct timeval cmdstart, cmdend;
 
     for (;;) {
         signals_poll();
@@ -933,6 +957,8 @@ static void cmdloop(void)
         /* register process */
         proc_register(config_ident, popd_clienthost, popd_userid, popd_mailbox ? popd_mailbox->name : NULL, inputbuf);
 
+        gettimeofday(&cmdstart, NULL);
+
         if (!strcmp(inputbuf, "quit")) {
             if (!arg) {
                 int pollpadding =config_getint(IMAPOPT_POPPOLLPADDING);
@@ -1040,13 +1066,16 @@ done:
                 }
             }
             else {
-                prot_printf(popd_out, "+OK scan listing follows\r\n");
-                for (msgno = 1; msgno <= popd_exists; msgno++) {
-                    if (!popd_map[msgno-1].deleted)
-                        prot_printf(popd_out, "%u %u\r\n",
-                        msgno, popd_map[msgno-1].size);
+                if (!buf_len(&popd_list)) {
+                    buf_appendcstr(&popd_list, "+OK scan listing follows\r\n");
+                    for (msgno = 1; msgno <= popd_exists; msgno++) {
+                        if (!popd_map[msgno-1].deleted)
+                            buf_printf(&popd_list, "%u %u\r\n",
+                                       msgno, popd_map[msgno-1].size);
+                    }
+                    buf_appendcstr(&popd_list, ".\r\n");
                 }
-                prot_printf(popd_out, ".\r\n");
+                prot_putbuf(popd_out, &popd_list);
             }
         }
         else if (!strcmp(inputbuf, "retr")) {
@@ -1070,6 +1099,8 @@ done:
                 msgno = parse_msgno(&arg);
                 if (msgno) {
                     popd_map[msgno-1].deleted = 1;
+                    buf_reset(&popd_list);
+                    buf_reset(&popd_uidl);
                     prot_printf(popd_out, "+OK message deleted\r\n");
                     count_dele++;
                 }
@@ -1088,6 +1119,8 @@ done:
                 for (msgno = 1; msgno <= popd_exists; msgno++) {
                     popd_map[msgno-1].deleted = 0;
                     popd_map[msgno-1].seen = 0;
+                    buf_reset(&popd_list);
+                    buf_reset(&popd_uidl);
                 }
                 prot_printf(popd_out, "+OK\r\n");
             }
@@ -1131,22 +1164,32 @@ done:
             if (arg) {
                 msgno = parse_msgno(&arg);
                 if (msgno) {
-                    prot_printf(popd_out, "+OK ");
-                    uidl_msg(msgno);
+                    struct buf line = BUF_INITIALIZER;
+                    buf_appendcstr(&line, "+OK ");
+                    uidl_msg(msgno, &line);
+                    prot_putbuf(popd_out, &line);
+                    buf_free(&line);
                 }
             }
             else {
-                prot_printf(popd_out, "+OK unique-id listing follows\r\n");
-                for (msgno = 1; msgno <= popd_exists; msgno++) {
-                    if (!popd_map[msgno-1].deleted)
-                        uidl_msg(msgno);
+                if (!buf_len(&popd_uidl)) {
+                    buf_appendcstr(&popd_uidl, "+OK unique-id listing follows\r\n");
+                    for (msgno = 1; msgno <= popd_exists; msgno++) {
+                        if (!popd_map[msgno-1].deleted)
+                            uidl_msg(msgno, &popd_uidl);
+                    }
+                    buf_appendcstr(&popd_uidl, ".\r\n");
                 }
-                prot_printf(popd_out, ".\r\n");
+                prot_putbuf(popd_out, &popd_uidl);
             }
         }
         else {
             prot_printf(popd_out, "-ERR Unrecognized command\r\n");
         }
+
+        gettimeofday(&cmdend, NULL);
+        prometheus_observe_label(CYRUS_POP3_COMMAND_SECONDS, inputbuf,
+                                 timesub(&cmdstart, &cmdend));
     }
 }
 
@@ -1189,16 +1232,16 @@ int msg_exists_or_err(uint32_t msgno)
     return 1;
 }
 
-void uidl_msg(uint32_t msgno)
+void uidl_msg(uint32_t msgno, struct buf *out)
 {
     if (popd_mailbox->i.options & OPT_POP3_NEW_UIDL) {
         switch (config_getenum(IMAPOPT_UIDL_FORMAT)) {
         case IMAP_ENUM_UIDL_FORMAT_UIDONLY:
-            prot_printf(popd_out, "%u %u\r\n", msgno,
+            buf_printf(out, "%u %u\r\n", msgno,
                         popd_map[msgno-1].uid);
             break;
         case IMAP_ENUM_UIDL_FORMAT_CYRUS:
-            prot_printf(popd_out, "%u %u.%u\r\n", msgno,
+            buf_printf(out, "%u %u.%u\r\n", msgno,
                         popd_mailbox->i.uidvalidity,
                         popd_map[msgno-1].uid);
             break;
@@ -1207,11 +1250,11 @@ void uidl_msg(uint32_t msgno)
             snprintf(uidl, 100, "%08x%08x",
                      popd_map[msgno-1].uid,
                      popd_mailbox->i.uidvalidity);
-            prot_printf(popd_out, "%u %s\r\n", msgno, uidl);
+            buf_printf(out, "%u %s\r\n", msgno, uidl);
             }
             break;
         case IMAP_ENUM_UIDL_FORMAT_COURIER:
-            prot_printf(popd_out, "%u %u-%u\r\n", msgno,
+            buf_printf(out, "%u %u-%u\r\n", msgno,
                         popd_mailbox->i.uidvalidity,
                         popd_map[msgno-1].uid);
             break;
@@ -1220,7 +1263,7 @@ void uidl_msg(uint32_t msgno)
         }
     }
     else {
-        prot_printf(popd_out, "%u %u\r\n", msgno,
+        buf_printf(out, "%u %u\r\n", msgno,
                     popd_map[msgno-1].uid);
     }
 }
@@ -1450,6 +1493,9 @@ static void cmd_pass(char *pass)
     }
 #endif
 
+    /* don't let an earlier attempt's password be cached for this one */
+    saslcache_reset();
+
     if (!strcmp(popd_userid, "anonymous")) {
         if (config_getswitch(IMAPOPT_ALLOWANONYMOUSLOGIN)) {
             pass = beautify_string(pass);
@@ -1469,6 +1515,7 @@ static void cmd_pass(char *pass)
                             strlen(popd_userid),
                             pass,
                             strlen(pass))!=SASL_OK) {
+        saslcache_reset();
         syslog(LOG_NOTICE, "badlogin: %s plaintext %s %s",
                popd_clienthost, popd_userid, sasl_errdetail(popd_saslconn));
         failedloginpause = config_getint(IMAPOPT_FAILEDLOGINPAUSE);
@@ -1487,6 +1534,8 @@ static void cmd_pass(char *pass)
         int sasl_result, plaintextloginpause;
         const void *val;
 
+        saslcache_commit(popd_saslconn);
+
         free(popd_userid);
         popd_userid = 0;
 
@@ -1749,6 +1798,7 @@ int openinbox(void)
     struct statusdata sdata = STATUSDATA_INIT;
     struct proc_limits limits;
     struct mboxevent *mboxevent;
+    struct buf listingkey = BUF_INITIALIZER;
 
     /* send a Login event notification */
     if ((mboxevent = mboxevent_new(EVENT_LOGIN))) {
@@ -1886,6 +1936,21 @@ int openinbox(void)
         config_popuseimapflags = config_getswitch(IMAPOPT_POPUSEIMAPFLAGS);
         exists = 0;
 
+        /* anything which changes the maildrop listing changes one of these */
+        buf_reset(&listingkey);
+        buf_printf(&listingkey, "%s %u %u " MODSEQ_FMT " %ld %d",
+                   popd_mailbox->uniqueid, popd_mailbox->i.uidvalidity,
+                   popd_mailbox->i.generation_no,
+                   popd_mailbox->i.highestmodseq,
+                   (long) popd_mailbox->i.pop3_show_after,
+                   config_popuseimapflags);
+
+        if (config_getswitch(IMAPOPT_POPLISTINGCACHE) &&
+            load_listing(buf_cstring(&listingkey))) {
+            mailbox_unlock_index(popd_mailbox, NULL);
+            goto listed;
+        }
+
         unsigned iterflags = ITER_SKIP_EXPUNGED;
         if (config_popuseimapflags) iterflags |= ITER_SKIP_DELETED;
 
@@ -1917,7 +1982,11 @@ int openinbox(void)
 
         /* finished our initial read */
         mailbox_unlock_index(popd_mailbox, NULL);
+
+        if (config_getswitch(IMAPOPT_POPLISTINGCACHE))
+            save_listing(buf_cstring(&listingkey));
     }
+  listed:
 
     limits.procname = "pop3d";
     limits.clienthost = popd_clienthost;
@@ -1945,6 +2014,7 @@ int openinbox(void)
 
     mboxlist_entry_free(&mbentry);
     mbname_free(&mbname);
+    buf_free(&listingkey);
 
     if (statusline)
         prot_printf(popd_out, "+OK%s", statusline);
@@ -1958,6 +2028,7 @@ int openinbox(void)
   fail:
     mboxlist_entry_free(&mbentry);
     mbname_free(&mbname);
+    buf_free(&listingkey);
     free(popd_userid);
     popd_userid = 0;
     if (popd_subfolder) {
@@ -1969,16 +2040,116 @@ int openinbox(void)
     return 1;
 }
 
+/*
+ * The maildrop listing is saved per user, so that pollers which log in
+ * over and over to an unchanged maildrop don't have to walk the whole
+ * index each time.  The file starts with a line describing the state
+ * of the mailbox it was built from, followed by uid, recno and size
+ * for each message in network byte order.
+ */
+#define LISTING_VERSION "pop3listing1 "
+
+static char *listing_fname(void)
+{
+    return user_hash_meta(popd_userid, "pop3");
+}
+
+/* returns 1 if popd_map was filled from a listing saved for 'key' */
+static int load_listing(const char *key)
+{
+    char *fname = listing_fname();
+    struct buf data = BUF_INITIALIZER;
+    struct stat sbuf;
+    const char *base, *nl;
+    size_t len, keylen = strlen(LISTING_VERSION) + strlen(key);
+    uint32_t i, count;
+    int fd, found = 0;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) goto done;
+    if (fstat(fd, &sbuf) == -1 || !sbuf.st_size) {
+        close(fd);
+        goto done;
+    }
+    buf_init_mmap(&data, /*onceonly*/1, fd, fname, sbuf.st_size, NULL);
+    close(fd);
+
+    base = buf_base(&data);
+    len = buf_len(&data);
+
+    if (len <= keylen || base[keylen] != '\n' ||
+        strncmp(base, LISTING_VERSION, strlen(LISTING_VERSION)) ||
+        strncmp(base + strlen(LISTING_VERSION), key, strlen(key)))
+        goto done;
+
+    base += keylen + 1;
+    len -= keylen + 1;
+    nl = memchr(base, '\n', len);
+    if (!nl || parseuint32(base, NULL, &count)) goto done;
+    len -= nl + 1 - base;
+    base = nl + 1;
+
+    if (count > popd_mailbox->i.exists || len != count * 12) goto done;
+
+    for (i = 0; i < count; i++) {
+        popd_map[i].uid = ntohl(*((bit32 *)(base + i*12)));
+        popd_map[i].recno = ntohl(*((bit32 *)(base + i*12 + 4)));
+        popd_map[i].size = ntohl(*((bit32 *)(base + i*12 + 8)));
+        popd_map[i].deleted = 0;
+        popd_map[i].seen = 0;
+    }
+    popd_exists = count;
+    found = 1;
+
+ done:
+    buf_free(&data);
+    free(fname);
+    return found;
+}
+
+static void save_listing(const char *key)
+{
+    char *fname = listing_fname();
+    char *tmpname = strconcat(fname, ".NEW", (char *)NULL);
+    struct buf data = BUF_INITIALIZER;
+    uint32_t i;
+    int fd;
+
+    buf_printf(&data, "%s%s\n%u\n", LISTING_VERSION, key, popd_exists);
+    for (i = 0; i < popd_exists; i++) {
+        bit32 item[3];
+        item[0] = htonl(popd_map[i].uid);
+        item[1] = htonl(popd_map[i].recno);
+        item[2] = htonl(popd_map[i].size);
+        buf_appendmap(&data, (const char *) item, sizeof(item));
+    }
+
+    /* it's only a cache, so no need to fsync */
+    fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd == -1 && errno == ENOENT && !cyrus_mkdir(tmpname, 0755))
+        fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd == -1) goto done;
+
+    if (retry_write(fd, buf_base(&data), buf_len(&data)) == -1 ||
+        rename(tmpname, fname) == -1) {
+        syslog(LOG_WARNING, "failed to write pop3 listing %s: %m", fname);
+        unlink(tmpname);
+    }
+    close(fd);
+
+ done:
+    buf_free(&data);
+    free(tmpname);
+    free(fname);
+}
+
 static int blat(int msgno, int lines)
 {
-    FILE *msgfile;
-    char buf[4096];
-    const char *fname;
+    struct buf msg = BUF_INITIALIZER;
+    const char *base, *end, *p, *span;
     int thisline = -2;
     struct index_record record;
 
-    /* XXX - map file */
-
     memset(&record, 0, sizeof(struct index_record));
     record.recno = popd_map[msgno-1].recno;
     if (mailbox_reload_index_record(popd_mailbox, &record)) {
@@ -1986,35 +2157,42 @@ static int blat(int msgno, int lines)
         return IMAP_IOERROR;
     }
 
-    fname = mailbox_record_fname(popd_mailbox, &record);
-    msgfile = fopen(fname, "r");
-    if (!msgfile) {
+    if (mailbox_map_record(popd_mailbox, &record, &msg)) {
         prot_printf(popd_out, "-ERR [SYS/PERM] Could not read message file\r\n");
         return IMAP_IOERROR;
     }
     prot_printf(popd_out, "+OK Message follows\r\n");
-    while (lines != thisline) {
-        if (!fgets(buf, sizeof(buf), msgfile)) break;
+
+    /* write out runs of lines in one go, breaking them only where
+     * a line starts with a dot which needs stuffing */
+    base = buf_base(&msg);
+    end = base + buf_len(&msg);
+    p = span = base;
+    while (p < end && lines != thisline) {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *next = eol ? eol + 1 : end;
 
         if (thisline < 0) {
-            if (buf[0] == '\r' && buf[1] == '\n') thisline = 0;
+            if (p[0] == '\r' && p + 1 < end && p[1] == '\n') thisline = 0;
         }
         else thisline++;
 
-        if (buf[0] == '.')
+        if (*p == '.') {
+            if (p > span) prot_write(popd_out, span, p - span);
             (void)prot_putc('.', popd_out);
-        do {
-            prot_printf(popd_out, "%s", buf);
+            span = p;
         }
-        while (buf[strlen(buf)-1] != '\n' && fgets(buf, sizeof(buf), msgfile));
+        p = next;
     }
-    fclose(msgfile);
+    if (p > span) prot_write(popd_out, span, p - span);
 
     /* Protect against messages not ending in CRLF */
-    if (buf[strlen(buf)-1] != '\n') prot_printf(popd_out, "\r\n");
+    if (p > base && p[-1] != '\n') prot_printf(popd_out, "\r\n");
 
     prot_printf(popd_out, ".\r\n");
 
+    buf_free(&msg);
+
     /* Reset inactivity timer in case we spend a long time
        pushing data to the client over a slow link. */
     prot_resettimeout(popd_in);
@@ -1,7 +1,7 @@
 # Prometheus metric definitions file
 #
 # metric <type> <name> <description>
-#   * type is one of "counter" or "gauge"
+#   * type is one of "counter", "gauge" or "histogram"
 #   * name must be [a-z0-9_] only
 #   * description is free text until EOL but don't be silly
 #
@@ -12,6 +12,12 @@
 #
 # Each metric may have zero or one labels applied to it
 #
+# buckets <metric> <bounds...>
+#   * metric is the name of an already defined histogram
+#   * bounds are the upper bounds of its finite buckets, in increasing order
+#   * a histogram must have buckets, and a labelled histogram has a full set
+#     of buckets for each label value, so keep both lists short
+#
 # '#' begins a comment
 #
 # There is not currently a line-continuation character supported by the parser,
@@ -68,6 +74,20 @@ metric counter cyrus_imap_unauthenticate_total          The total number of IMAP
 metric counter cyrus_imap_unsubscribe_total             The total number of IMAP UNSUBSCRIBEs
 metric counter cyrus_imap_unselect_total                The total number of IMAP UNSELECTs
 metric counter cyrus_imap_xbackup_total                 The total number of IMAP XBACKUPs
+metric histogram cyrus_imap_command_seconds             The time taken by IMAP commands, in seconds
+    label cyrus_imap_command_seconds command append copy create delete examine expunge fetch getmetadata list lsub move search select setmetadata sort status store thread other
+    buckets cyrus_imap_command_seconds 0.005 0.025 0.1 0.25 1 2.5 10
+
+metric counter cyrus_squatter_indexed_mailboxes_total   The total number of mailboxes indexed by squatter
+metric counter cyrus_squatter_indexed_users_total       The total number of user batches indexed by rolling squatter workers
+metric counter cyrus_squatter_requeued_mailboxes_total  The number of mailboxes requeued by the rolling squatter
+metric gauge   cyrus_squatter_queued_users              The number of user batches queued to rolling squatter workers
+metric counter cyrus_squatter_compacted_users_total     The total number of users compacted by the squatter compaction scheduler
+metric gauge   cyrus_squatter_compacting_users          The number of users being compacted by the squatter compaction scheduler
+
+metric counter cyrus_search_xapian_commits_total        The total number of Xapian index commits
+metric counter cyrus_search_xapian_committed_documents_total The total number of documents committed to Xapian indexes
+metric counter cyrus_search_xapian_commit_seconds_total The total time spent committing Xapian indexes, in seconds
 
 metric counter cyrus_lmtp_connections_total             The total number of LMTP connections
 metric gauge   cyrus_lmtp_active_connections            The number of active LMTP connections
@@ -89,6 +109,15 @@ metric counter cyrus_lmtp_sieve_keep_total              The number of sieve KEEP
 metric counter cyrus_lmtp_sieve_notify_total            The number of sieve NOTIFYs
 metric counter cyrus_lmtp_sieve_autorespond_total       The number of sieve AUTORESPONDs considered
 metric counter cyrus_lmtp_sieve_autorespond_sent_total  The number of sieve AUTORESPONDs sent
+metric histogram cyrus_lmtp_data_seconds                The time taken to receive and deliver a message after DATA, in seconds
+    buckets cyrus_lmtp_data_seconds 0.005 0.025 0.1 0.25 1 2.5 10
+metric histogram cyrus_lmtp_stage_seconds               The time taken by each stage of delivering a message, in seconds
+    label cyrus_lmtp_stage_seconds stage verify mlookup parse sieve append conversations fsync commit other
+    buckets cyrus_lmtp_stage_seconds 0.001 0.005 0.025 0.1 0.5 2.5
+
+metric histogram cyrus_pop3_command_seconds             The time taken by POP3 commands, in seconds
+    label cyrus_pop3_command_seconds command auth dele list pass retr stat top uidl other
+    buckets cyrus_pop3_command_seconds 0.005 0.025 0.1 0.25 1 2.5 10
 
 metric counter cyrus_http_connections_total       The total number of HTTP connections
 metric gauge   cyrus_http_active_connections      The number of active HTTP connections
@@ -137,3 +166,43 @@ metric counter cyrus_http_unbind_total            The total number of HTTP UNBIN
     label cyrus_http_unbind_total namespace default admin applepush calendar freebusy addressbook principal notify dblookup ischedule domainkeys jmap prometheus rss tzdist drive
 metric counter cyrus_http_unlock_total            The total number of HTTP UNLOCKs
     label cyrus_http_unlock_total namespace default admin applepush calendar freebusy addressbook principal notify dblookup ischedule domainkeys jmap prometheus rss tzdist drive
+metric histogram cyrus_http_request_seconds       The time taken by HTTP requests, in seconds
+    label cyrus_http_request_seconds method acl bind connect copy delete get head lock mkcalendar mkcol move options patch post propfind proppatch put report trace unbind unlock
+    buckets cyrus_http_request_seconds 0.005 0.025 0.1 0.25 1 2.5 10
+metric histogram cyrus_jmap_method_seconds        The time taken by JMAP method calls, in seconds
+    label cyrus_jmap_method_seconds method calendarevent_get calendarevent_query calendarevent_set contact_get contact_set email_changes email_get email_import email_query email_querychanges email_set emailsubmission_set identity_get mailbox_changes mailbox_get mailbox_query mailbox_set searchsnippet_get thread_changes thread_get other
+    buckets cyrus_jmap_method_seconds 0.005 0.025 0.1 0.25 1 2.5 10
+metric counter cyrus_ical_cache_total             The total number of parsed iCalendar cache lookups
+    label cyrus_ical_cache_total result hit miss
+metric counter cyrus_sqldb_open_total                     The total number of SQLite database opens
+    label cyrus_sqldb_open_total source pool file
+metric counter cyrus_sqldb_exec_total                     The total number of SQLite statements executed
+    label cyrus_sqldb_exec_total stmt cached prepared
+metric counter cyrus_sqldb_exec_seconds_total             The total time spent executing SQLite statements
+metric counter cyrus_ptloader_requests_total              The total number of ptloader requests
+    label cyrus_ptloader_requests_total result hit stale negative miss
+metric counter cyrus_ptloader_lookup_seconds_total        The total time spent in ptloader module lookups, in seconds
+metric counter cyrus_ptloader_lookup_latency_total        The number of ptloader module lookups by duration
+    label cyrus_ptloader_lookup_latency_total bucket lt_10ms lt_100ms lt_1s lt_10s ge_10s
+metric histogram cyrus_lock_wait_seconds                  The time spent waiting for file locks, in seconds
+    label cyrus_lock_wait_seconds class annotations conversations mailbox_index mailboxes_db namelock quota seen other
+    buckets cyrus_lock_wait_seconds 0.0001 0.001 0.01 0.1 1 10
+metric histogram cyrus_lock_hold_seconds                  The time file locks were held for, in seconds
+    label cyrus_lock_hold_seconds class annotations conversations mailbox_index mailboxes_db namelock quota seen other
+    buckets cyrus_lock_hold_seconds 0.0001 0.001 0.01 0.1 1 10
+metric histogram cyrus_service_startup_seconds            The time from a service process starting to being ready to accept a connection, in seconds
+    label cyrus_service_startup_seconds mode exec fork
+    buckets cyrus_service_startup_seconds 0.0001 0.001 0.01 0.1 1 10
+metric histogram cyrus_tls_handshake_seconds              The time taken by server TLS handshakes, in seconds
+    label cyrus_tls_handshake_seconds result success failure
+    buckets cyrus_tls_handshake_seconds 0.001 0.005 0.025 0.1 0.5 2.5
+metric counter cyrus_search_attachment_cache_total        The total number of attachment text cache lookups
+    label cyrus_search_attachment_cache_total result hit miss
+metric counter cyrus_search_attachment_extractor_total    The total number of attachment text extractor requests
+    label cyrus_search_attachment_extractor_total result ok error
+metric counter cyrus_event_spooled_total                  The total number of event notifications spooled because the notifier was busy
+metric counter cyrus_objectstore_cache_total              The total number of local object cache lookups
+    label cyrus_objectstore_cache_total result hit miss
+metric counter cyrus_objectstore_cache_evicted_total      The total number of objects evicted from the local object cache
+metric counter cyrus_mailbox_unlinked_files_total         The total number of message files removed by mailbox cleanups
+metric counter cyrus_mailbox_unlink_seconds_total         The total time spent removing message files in mailbox cleanups, in seconds
@@ -43,9 +43,13 @@
 #include <config.h>
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <string.h>
 #include <syslog.h>
 #include <time.h>
@@ -57,6 +61,7 @@
 #include "lib/libconfig.h"
 #include "lib/map.h"
 #include "lib/ptrarray.h"
+#include "lib/strhash.h"
 #include "lib/util.h"
 
 #include "imap/global.h"
@@ -65,6 +70,8 @@
 
 struct prometheus_handle {
     struct mappedfile *mf;
+    struct prom_registry *reg;  /* shared registry, instead of mf */
+    uint32_t service;           /* our entry in reg->services */
 };
 
 static struct prometheus_handle *promhandle = NULL;
@@ -101,6 +108,158 @@ EXPORTED const char *prometheus_stats_dir(void)
     return buf_cstring(&statsdir);
 }
 
+static int registry_valid(const struct prom_registry *reg)
+{
+    return reg->magic == PROM_REGISTRY_MAGIC
+        && reg->version == PROM_REGISTRY_VERSION
+        && reg->nmetrics == PROM_NUM_METRICS
+        && reg->nslots == PROM_REGISTRY_SLOTS;
+}
+
+/* map the shared registry, creating it if need be, and find or claim
+ * the entry for our service */
+static int registry_open(struct prometheus_handle *handle)
+{
+    char *fname = strconcat(prometheus_stats_dir(), FNAME_PROM_REGISTRY, NULL);
+    struct prom_registry *reg = MAP_FAILED;
+    struct stat sbuf;
+    int fd = -1, i, r = IMAP_IOERROR;
+
+    if (cyrus_mkdir(fname, 0755)) goto done;
+
+    fd = open(fname, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: open %s: %m", fname);
+        goto done;
+    }
+
+    /* creation and service claims are rare, so they're simply locked */
+    if (lock_blocking(fd, fname)) {
+        syslog(LOG_ERR, "IOERROR: lock %s: %m", fname);
+        goto done;
+    }
+
+    if (fstat(fd, &sbuf) == -1) {
+        syslog(LOG_ERR, "IOERROR: fstat %s: %m", fname);
+        goto done;
+    }
+
+    if (sbuf.st_size == 0 && ftruncate(fd, PROM_REGISTRY_SIZE) == -1) {
+        syslog(LOG_ERR, "IOERROR: ftruncate %s: %m", fname);
+        goto done;
+    }
+    else if (sbuf.st_size != 0 && (size_t) sbuf.st_size != PROM_REGISTRY_SIZE) {
+        syslog(LOG_ERR, "prometheus registry %s has the wrong size,"
+                        " restart promstatsd to recreate it", fname);
+        goto done;
+    }
+
+    reg = mmap(NULL, PROM_REGISTRY_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (reg == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mmap %s: %m", fname);
+        goto done;
+    }
+
+    if (sbuf.st_size == 0) {
+        reg->nmetrics = PROM_NUM_METRICS;
+        reg->nslots = PROM_REGISTRY_SLOTS;
+        reg->version = PROM_REGISTRY_VERSION;
+        reg->magic = PROM_REGISTRY_MAGIC;
+    }
+    else if (!registry_valid(reg)) {
+        syslog(LOG_ERR, "prometheus registry %s is from a different version,"
+                        " restart promstatsd to recreate it", fname);
+        goto done;
+    }
+
+    for (i = 0; i < PROM_REGISTRY_MAX_SERVICES; i++) {
+        struct prom_registry_service *s = &reg->services[i];
+
+        if (s->state == PROM_REGISTRY_READY) {
+            if (!strncmp(s->ident, config_ident, sizeof(s->ident) - 1))
+                break;
+            continue;
+        }
+
+        xstrncpy(s->ident, config_ident, sizeof(s->ident));
+        __atomic_store_n(&s->state, PROM_REGISTRY_READY, __ATOMIC_RELEASE);
+        break;
+    }
+    if (i == PROM_REGISTRY_MAX_SERVICES) {
+        syslog(LOG_ERR, "prometheus registry %s has no room for service %s",
+                        fname, config_ident);
+        goto done;
+    }
+
+    handle->reg = reg;
+    handle->service = i;
+    r = 0;
+
+done:
+    if (r && reg != MAP_FAILED) munmap(reg, PROM_REGISTRY_SIZE);
+    if (fd != -1) {
+        lock_unlock(fd, fname);
+        close(fd);
+    }
+    free(fname);
+    return r;
+}
+
+EXPORTED const struct prom_registry *prometheus_registry_map(void)
+{
+    char *fname = strconcat(prometheus_stats_dir(), FNAME_PROM_REGISTRY, NULL);
+    struct prom_registry *reg = NULL;
+    struct stat sbuf;
+    int fd;
+
+    fd = open(fname, O_RDONLY, 0);
+    free(fname);
+    if (fd == -1) return NULL;
+
+    if (fstat(fd, &sbuf) == 0 && (size_t) sbuf.st_size == PROM_REGISTRY_SIZE) {
+        reg = mmap(NULL, PROM_REGISTRY_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        if (reg == MAP_FAILED) reg = NULL;
+    }
+    close(fd);
+
+    if (reg && !registry_valid(reg)) {
+        munmap(reg, PROM_REGISTRY_SIZE);
+        reg = NULL;
+    }
+
+    return reg;
+}
+
+EXPORTED void prometheus_registry_unmap(const struct prom_registry *reg)
+{
+    if (reg) munmap((void *) reg, PROM_REGISTRY_SIZE);
+}
+
+static unsigned registry_slot(void)
+{
+#ifdef HAVE_SCHED_GETCPU
+    int cpu = sched_getcpu();
+
+    if (cpu >= 0) return cpu % PROM_REGISTRY_SLOTS;
+#endif
+    return getpid() % PROM_REGISTRY_SLOTS;
+}
+
+/* lock-free, other processes may be adding to the same slot */
+static void registry_add(struct prom_metric *metric, double delta, int64_t now)
+{
+    double old, new;
+
+    __atomic_load(&metric->value, &old, __ATOMIC_RELAXED);
+    do {
+        new = old + delta;
+    } while (!__atomic_compare_exchange(&metric->value, &old, &new, /*weak*/1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    __atomic_store_n(&metric->last_updated, now, __ATOMIC_RELAXED);
+}
+
 static void prometheus_init(void)
 {
     char fname[PATH_MAX];
@@ -113,6 +272,20 @@ static void prometheus_init(void)
     prometheus_enabled = config_getswitch(IMAPOPT_PROMETHEUS_ENABLED);
     if (!prometheus_enabled) return;
 
+    if (config_getswitch(IMAPOPT_PROMETHEUS_SHARED_REGISTRY)) {
+        handle = xzmalloc(sizeof(*handle));
+        if (!registry_open(handle)) {
+            promhandle = handle;
+            cyrus_modules_add(&prometheus_done, NULL);
+            return;
+        }
+        /* fall back to a stats file of our own */
+        syslog(LOG_WARNING, "prometheus registry unavailable,"
+                            " using a per-process stats file");
+        free(handle);
+        handle = NULL;
+    }
+
     r = snprintf(stats.ident, sizeof(stats.ident), "%s", config_ident);
     if (r < 0 || (size_t) r >= sizeof(stats.ident))
         syslog(LOG_WARNING, "service name '%s' is longer than " SIZE_T_FMT
@@ -177,6 +350,14 @@ static void prometheus_done(void *rock __attribute__((unused)))
 
     if (!promhandle) return; /* make double-call safe */
 
+    if (promhandle->reg) {
+        /* nothing to hand over, the registry outlives us */
+        munmap(promhandle->reg, PROM_REGISTRY_SIZE);
+        free(promhandle);
+        promhandle = NULL;
+        return;
+    }
+
     /* hold a lock on .doneprocs.lock - this keeps promstatsd from double
      * counting while we're juggling files */
     doneprocs_lock_fname = strconcat(prometheus_stats_dir(), ".",
@@ -268,6 +449,11 @@ done:
     free(doneprocs_lock_fname);
 }
 
+EXPORTED void prometheus_preinit(void)
+{
+    if (prometheus_enabled && !promhandle) prometheus_init();
+}
+
 /* use the prometheus_increment() and prometheus_decrement() wrapper macros
  * for readability if that's all you're doing.
  */
@@ -286,6 +472,18 @@ EXPORTED void prometheus_apply_delta(enum prom_metric_id metric_id,
 
     assert(metric_id >= 0 && metric_id < PROM_NUM_METRICS);
 
+    if (delta < 0) {
+        /* counters must not be decremented */
+        assert(prom_metric_descs[metric_id].type != PROM_METRIC_COUNTER);
+    }
+
+    if (promhandle->reg) {
+        registry_add(prom_registry_metric(promhandle->reg, promhandle->service,
+                                          registry_slot(), metric_id),
+                     delta, now_ms());
+        return;
+    }
+
     r = mappedfile_writelock(promhandle->mf);
     if (r) {
         syslog(LOG_ERR, "IOERROR: mappedfile_writelock unable to obtain lock on %s",
@@ -295,10 +493,6 @@ EXPORTED void prometheus_apply_delta(enum prom_metric_id metric_id,
 
     offset = offsetof(struct prom_stats, metrics) + metric_id * sizeof(metric);
     memcpy(&metric, mappedfile_base(promhandle->mf) + offset, sizeof(metric));
-    if (delta < 0) {
-        /* counters must not be decremented */
-        assert(prom_metric_descs[metric_id].type != PROM_METRIC_COUNTER);
-    }
     metric.value = metric.value + delta;
     metric.last_updated = now_ms();
 
@@ -315,6 +509,215 @@ EXPORTED void prometheus_apply_delta(enum prom_metric_id metric_id,
     mappedfile_unlock(promhandle->mf);
 }
 
+EXPORTED void prometheus_histogram_init(struct prom_histogram *h,
+                                       enum prom_metric_id series)
+{
+    memset(h, 0, sizeof(*h));
+    h->series = series;
+    h->nbuckets = prom_metric_descs[series].nbuckets;
+
+    assert(h->nbuckets > 0 && h->nbuckets <= PROM_HISTOGRAM_MAXBUCKETS);
+    assert(series >= 0 && series + h->nbuckets + 3 <= PROM_NUM_METRICS);
+}
+
+EXPORTED void prometheus_histogram_add(struct prom_histogram *h, double value)
+{
+    const struct prom_metric_desc *desc = &prom_metric_descs[h->series];
+    int i;
+
+    for (i = 0; i < h->nbuckets; i++) {
+        if (value <= desc[i].le) h->buckets[i]++;
+    }
+    h->sum += value;
+    h->count++;
+}
+
+/* add the observations gathered in 'h' to its series, under a single
+ * lock, and start it again from empty.  Observations are frequent, so
+ * the write is left for the next commit by prometheus_apply_delta() or
+ * the page cache to make durable */
+EXPORTED void prometheus_histogram_flush(struct prom_histogram *h)
+{
+    struct prom_metric metrics[PROM_HISTOGRAM_MAXBUCKETS + 3];
+    int nbuckets = h->nbuckets;
+    int nslots = nbuckets + 3;
+    int64_t now;
+    size_t offset;
+    int i, r;
+
+    if (!h->count) return;
+
+    if (!prometheus_enabled) goto done;
+
+    if (!promhandle) prometheus_init();
+
+    if (!prometheus_enabled) goto done;
+
+    if (promhandle->reg) {
+        unsigned slot = registry_slot();
+        struct prom_metric *m = prom_registry_metric(promhandle->reg,
+                                                     promhandle->service,
+                                                     slot, h->series);
+
+        now = now_ms();
+        for (i = 0; i < nbuckets; i++) {
+            if (h->buckets[i]) registry_add(&m[i], h->buckets[i], now);
+        }
+        registry_add(&m[nbuckets], h->count, now);
+        registry_add(&m[nbuckets + 1], h->sum, now);
+        registry_add(&m[nbuckets + 2], h->count, now);
+
+        /* a series is reported whole or not at all */
+        for (i = 0; i < nbuckets; i++) {
+            __atomic_store_n(&m[i].last_updated, now, __ATOMIC_RELAXED);
+        }
+        goto done;
+    }
+
+    r = mappedfile_writelock(promhandle->mf);
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: mappedfile_writelock unable to obtain lock on %s",
+                        mappedfile_fname(promhandle->mf));
+        goto done;
+    }
+
+    offset = offsetof(struct prom_stats, metrics) + h->series * sizeof(metrics[0]);
+    memcpy(metrics, mappedfile_base(promhandle->mf) + offset,
+           nslots * sizeof(metrics[0]));
+
+    /* the last bucket is +Inf */
+    for (i = 0; i < nbuckets; i++) {
+        metrics[i].value += h->buckets[i];
+    }
+    metrics[nbuckets].value += h->count;
+    metrics[nbuckets + 1].value += h->sum;
+    metrics[nbuckets + 2].value += h->count;
+
+    /* a series is reported whole or not at all */
+    now = now_ms();
+    for (i = 0; i < nslots; i++) {
+        metrics[i].last_updated = now;
+    }
+
+    r = mappedfile_pwrite(promhandle->mf, metrics,
+                          nslots * sizeof(metrics[0]), offset);
+    if (r != (int) (nslots * sizeof(metrics[0]))) {
+        syslog(LOG_ERR, "IOERROR: mappedfile_pwrite: expected to write "
+                        SIZE_T_FMT " bytes, actually wrote %d",
+                        nslots * sizeof(metrics[0]), r);
+    }
+    else {
+        mappedfile_defer_commit(promhandle->mf);
+    }
+
+    mappedfile_unlock(promhandle->mf);
+
+done:
+    memset(h->buckets, 0, sizeof(h->buckets));
+    h->sum = 0;
+    h->count = 0;
+}
+
+/* record one observation of 'value' in the histogram series starting at
+ * 'series' */
+EXPORTED void prometheus_observe(enum prom_metric_id series, double value)
+{
+    struct prom_histogram h;
+
+    if (!prometheus_enabled) return;
+
+    prometheus_histogram_init(&h, series);
+    prometheus_histogram_add(&h, value);
+    prometheus_histogram_flush(&h);
+}
+
+/* record 'value' in the series of the labelled histogram 'metric' for
+ * 'label', or for "other" if 'label' isn't one of its values */
+EXPORTED void prometheus_observe_label(enum prom_labelled_metric metric,
+                                       const char *label, double value)
+{
+    int series;
+
+    if (!prometheus_enabled) return;
+
+    series = prometheus_find_label(metric, label);
+    if (series < 0) series = prometheus_lookup_label(metric, "other");
+
+    prometheus_observe(series, value);
+}
+
+EXPORTED void prometheus_dynamic_apply_delta(const char *name,
+                                             enum prom_metric_type type,
+                                             const char *labels,
+                                             double delta)
+{
+    struct prom_registry *reg;
+    struct buf key = BUF_INITIALIZER;
+    unsigned i, n;
+
+    if (!prometheus_enabled) return;
+
+    if (!promhandle) prometheus_init();
+
+    if (!prometheus_enabled || !promhandle || !promhandle->reg) return;
+
+    if (!labels) labels = "";
+
+    assert(type == PROM_METRIC_COUNTER || type == PROM_METRIC_GAUGE);
+    assert(delta >= 0 || type != PROM_METRIC_COUNTER);
+
+    if (strlen(name) >= sizeof(reg->dynamic[0].name)
+        || strlen(labels) >= sizeof(reg->dynamic[0].labels)) {
+        syslog(LOG_WARNING, "prometheus metric %s{%s} too long, not recorded",
+                            name, labels);
+        return;
+    }
+
+    reg = promhandle->reg;
+
+    buf_printf(&key, "%u:%s{%s}", promhandle->service, name, labels);
+    i = strhash(buf_cstring(&key)) % PROM_REGISTRY_MAX_DYNAMIC;
+    buf_free(&key);
+
+    for (n = 0; n < PROM_REGISTRY_MAX_DYNAMIC;
+         n++, i = (i + 1) % PROM_REGISTRY_MAX_DYNAMIC) {
+        struct prom_registry_dynamic *d = &reg->dynamic[i];
+        uint32_t state = __atomic_load_n(&d->state, __ATOMIC_ACQUIRE);
+        int spins;
+
+        if (state == PROM_REGISTRY_FREE) {
+            if (__atomic_compare_exchange_n(&d->state, &state,
+                                            PROM_REGISTRY_CLAIMING, 0,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_ACQUIRE)) {
+                d->type = type;
+                d->service = promhandle->service;
+                strcpy(d->name, name);
+                strcpy(d->labels, labels);
+                __atomic_store_n(&d->state, PROM_REGISTRY_READY,
+                                 __ATOMIC_RELEASE);
+                state = PROM_REGISTRY_READY;
+            }
+        }
+
+        /* someone else is filling this one in, it may well be ours */
+        for (spins = 0; state == PROM_REGISTRY_CLAIMING && spins < 1000; spins++) {
+            sched_yield();
+            state = __atomic_load_n(&d->state, __ATOMIC_ACQUIRE);
+        }
+        if (state != PROM_REGISTRY_READY) continue;
+
+        if (d->service == promhandle->service
+            && !strcmp(d->name, name) && !strcmp(d->labels, labels)) {
+            registry_add(&d->slots[registry_slot()], delta, now_ms());
+            return;
+        }
+    }
+
+    syslog(LOG_WARNING, "prometheus registry full, %s{%s} not recorded",
+                        name, labels);
+}
+
 EXPORTED int prometheus_text_report(struct buf *buf, const char **mimetype)
 {
     char *report_fname = NULL;
@@ -364,8 +767,10 @@ EXPORTED int prometheus_text_report(struct buf *buf, const char **mimetype)
     return 0;
 }
 
-EXPORTED enum prom_metric_id prometheus_lookup_label(enum prom_labelled_metric metric,
-                                                     const char *value)
+/* like prometheus_lookup_label(), but returns -1 for unknown values,
+ * for labels which come from the client */
+EXPORTED int prometheus_find_label(enum prom_labelled_metric metric,
+                                   const char *value)
 {
     size_t i;
 
@@ -381,5 +786,16 @@ EXPORTED enum prom_metric_id prometheus_lookup_label(enum prom_labelled_metric m
             break;
     }
 
-    fatal("invalid metric value -- compile time bug", EC_SOFTWARE);
+    return -1;
+}
+
+EXPORTED enum prom_metric_id prometheus_lookup_label(enum prom_labelled_metric metric,
+                                                     const char *value)
+{
+    int id = prometheus_find_label(metric, value);
+
+    if (id < 0)
+        fatal("invalid metric value -- compile time bug", EC_SOFTWARE);
+
+    return id;
 }
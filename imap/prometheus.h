@@ -56,6 +56,65 @@
 #define FNAME_PROM_MASTER_REPORT "master.txt"
 #define FNAME_PROM_DONEPROCS "doneprocs"
 #define FNAME_PROM_STATS_DIR "/stats"
+#define FNAME_PROM_REGISTRY "registry"
+
+/* The shared registry (prometheus_shared_registry) is a single file in
+ * the stats dir mapped by every service.  Each fixed metric has a counter
+ * for every (service, slot) pair; a process adds to the slot of the CPU
+ * it's running on with an atomic compare-and-swap, and promstatsd sums
+ * the slots.  Dynamic metrics are claimed at runtime, keyed on service,
+ * name and labels, from an open-addressed table with their own slots. */
+#define PROM_REGISTRY_MAGIC         (0x70726f6d)    /* "prom" */
+#define PROM_REGISTRY_VERSION       (1)
+#define PROM_REGISTRY_SLOTS         (16)
+#define PROM_REGISTRY_MAX_SERVICES  (32)
+#define PROM_REGISTRY_MAX_DYNAMIC   (1024)
+
+enum {
+    PROM_REGISTRY_FREE = 0,
+    PROM_REGISTRY_CLAIMING,
+    PROM_REGISTRY_READY
+};
+
+struct prom_registry_service {
+    uint32_t state;
+    char ident[60];
+};
+
+struct prom_registry_dynamic {
+    uint32_t state;
+    uint32_t type;              /* enum prom_metric_type */
+    uint32_t service;
+    uint32_t pad;
+    char name[64];
+    char labels[176];           /* e.g. partition="default" */
+    struct prom_metric slots[PROM_REGISTRY_SLOTS];
+};
+
+struct prom_registry {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nmetrics;          /* PROM_NUM_METRICS of whoever created it */
+    uint32_t nslots;
+    uint32_t pad[12];
+    struct prom_registry_service services[PROM_REGISTRY_MAX_SERVICES];
+    struct prom_registry_dynamic dynamic[PROM_REGISTRY_MAX_DYNAMIC];
+    struct prom_metric metrics[]; /* [service][slot][PROM_NUM_METRICS] */
+};
+
+#define PROM_REGISTRY_SIZE                                              \
+    (sizeof(struct prom_registry) +                                     \
+     (size_t) PROM_REGISTRY_MAX_SERVICES * PROM_REGISTRY_SLOTS *        \
+     PROM_NUM_METRICS * sizeof(struct prom_metric))
+
+#define prom_registry_metric(reg, service, slot, metric_id)             \
+    (&(reg)->metrics[((size_t) (service) * PROM_REGISTRY_SLOTS + (slot)) \
+                     * PROM_NUM_METRICS + (metric_id)])
+
+/* map the registry read-only, for collation.  NULL if there isn't one,
+ * or it was made by a build with different metrics */
+extern const struct prom_registry *prometheus_registry_map(void);
+extern void prometheus_registry_unmap(const struct prom_registry *reg);
 
 extern const char *prometheus_stats_dir(void);
 
@@ -68,9 +127,46 @@ extern const char *prometheus_stats_dir(void);
 extern void prometheus_apply_delta(enum prom_metric_id metric_id,
                                    double delta);
 
+extern void prometheus_observe(enum prom_metric_id series, double value);
+
+/* observations gathered in memory, for callers who observe too often
+ * to afford a write each time.  Buckets are cumulative, like the
+ * exported ones */
+#define PROM_HISTOGRAM_MAXBUCKETS (16)
+struct prom_histogram {
+    enum prom_metric_id series;
+    int nbuckets;
+    double buckets[PROM_HISTOGRAM_MAXBUCKETS];
+    double sum;
+    double count;
+};
+
+extern void prometheus_histogram_init(struct prom_histogram *h,
+                                      enum prom_metric_id series);
+extern void prometheus_histogram_add(struct prom_histogram *h, double value);
+extern void prometheus_histogram_flush(struct prom_histogram *h);
+
+extern void prometheus_observe_label(enum prom_labelled_metric metric,
+                                     const char *label, double value);
+
+/* add 'delta' to the metric called 'name' with 'labels' (formatted as
+ * Prometheus label pairs, or NULL), creating it on first use.  Only
+ * recorded when prometheus_shared_registry is enabled */
+extern void prometheus_dynamic_apply_delta(const char *name,
+                                           enum prom_metric_type type,
+                                           const char *labels,
+                                           double delta);
+
+/* set up this process's stats now, so that processes forked from it
+ * share them rather than each making their own */
+extern void prometheus_preinit(void);
+
 extern int prometheus_text_report(struct buf *buf, const char **mimetype);
 
 extern enum prom_metric_id prometheus_lookup_label(enum prom_labelled_metric metric,
                                                    const char *value);
 
+extern int prometheus_find_label(enum prom_labelled_metric metric,
+                                 const char *value);
+
 #endif
@@ -207,6 +207,120 @@ static int accum_stats(const struct prom_stats *stats, void *rock)
     return 0;
 }
 
+/* sum each service's slots in the shared registry into 'all_stats' */
+static void accum_registry(const struct prom_registry *reg, hash_table *all_stats)
+{
+    struct prom_stats *stats = xmalloc(sizeof *stats);
+    int s, slot, i;
+
+    for (s = 0; s < PROM_REGISTRY_MAX_SERVICES; s++) {
+        const struct prom_registry_service *service = &reg->services[s];
+
+        if (__atomic_load_n(&service->state, __ATOMIC_ACQUIRE) != PROM_REGISTRY_READY)
+            break;
+
+        memset(stats, 0, sizeof(*stats));
+        xstrncpy(stats->ident, service->ident, sizeof(service->ident));
+
+        for (slot = 0; slot < PROM_REGISTRY_SLOTS; slot++) {
+            const struct prom_metric *m = prom_registry_metric(reg, s, slot, 0);
+
+            for (i = 0; i < PROM_NUM_METRICS; i++) {
+                double value;
+                int64_t last_updated;
+
+                __atomic_load(&m[i].value, &value, __ATOMIC_RELAXED);
+                last_updated = __atomic_load_n(&m[i].last_updated, __ATOMIC_RELAXED);
+
+                stats->metrics[i].value += value;
+                stats->metrics[i].last_updated = MAX(stats->metrics[i].last_updated,
+                                                     last_updated);
+            }
+        }
+
+        accum_stats(stats, all_stats);
+    }
+
+    free(stats);
+}
+
+static const struct prom_registry *sort_registry;
+
+static int dynamic_cmp(const void *a, const void *b)
+{
+    const struct prom_registry_dynamic *da = *(const struct prom_registry_dynamic **) a;
+    const struct prom_registry_dynamic *db = *(const struct prom_registry_dynamic **) b;
+    int r;
+
+    r = strcmp(da->name, db->name);
+    if (!r) r = strcmp(sort_registry->services[da->service].ident,
+                       sort_registry->services[db->service].ident);
+    if (!r) r = strcmp(da->labels, db->labels);
+
+    return r;
+}
+
+/* report the registry's dynamic metrics, grouped by name */
+static void format_dynamic(const struct prom_registry *reg, struct buf *buf)
+{
+    const struct prom_registry_dynamic **all;
+    const char *lastname = "";
+    int i, j, n = 0, slot;
+
+    all = xmalloc(PROM_REGISTRY_MAX_DYNAMIC * sizeof(*all));
+
+    for (i = 0; i < PROM_REGISTRY_MAX_DYNAMIC; i++) {
+        const struct prom_registry_dynamic *d = &reg->dynamic[i];
+
+        if (__atomic_load_n(&d->state, __ATOMIC_ACQUIRE) != PROM_REGISTRY_READY)
+            continue;
+        if (d->service >= PROM_REGISTRY_MAX_SERVICES) continue;
+        if (d->type != PROM_METRIC_COUNTER && d->type != PROM_METRIC_GAUGE)
+            continue;
+
+        all[n++] = d;
+    }
+
+    sort_registry = reg;
+    qsort(all, n, sizeof(*all), dynamic_cmp);
+
+    for (i = 0; i < n; i = j) {
+        const struct prom_registry_dynamic *d = all[i];
+        double value = 0;
+        int64_t last_updated = 0;
+
+        /* sum any duplicates along with their slots */
+        for (j = i; j < n && !dynamic_cmp(&all[i], &all[j]); j++) {
+            for (slot = 0; slot < PROM_REGISTRY_SLOTS; slot++) {
+                double v;
+                int64_t t;
+
+                __atomic_load(&all[j]->slots[slot].value, &v, __ATOMIC_RELAXED);
+                t = __atomic_load_n(&all[j]->slots[slot].last_updated,
+                                    __ATOMIC_RELAXED);
+                value += v;
+                last_updated = MAX(last_updated, t);
+            }
+        }
+
+        if (!last_updated) continue;
+
+        if (strcmp(d->name, lastname)) {
+            buf_printf(buf, "# TYPE %s %s\n", d->name,
+                            prom_metric_type_names[d->type]);
+            lastname = d->name;
+        }
+
+        buf_printf(buf, "%s{service=\"%s\"%s%s} %.*f %" PRId64 "\n",
+                        d->name, reg->services[d->service].ident,
+                        d->labels[0] ? "," : "", d->labels,
+                        value == (double) (int64_t) value ? 0 : 6, value,
+                        last_updated);
+    }
+
+    free(all);
+}
+
 struct format_metric_rock {
     struct buf *buf;
     enum prom_metric_id metric;
@@ -217,6 +331,7 @@ static void format_metric(const char *key __attribute__((unused)),
 {
     struct prom_stats *stats = (struct prom_stats *) data;
     struct format_metric_rock *fmrock = (struct format_metric_rock *) rock;
+    double value;
 
     /* don't report service/metric combinations that have never been seen */
     if (!stats->metrics[fmrock->metric].last_updated)
@@ -226,14 +341,16 @@ static void format_metric(const char *key __attribute__((unused)),
     buf_printf(fmrock->buf, "{service=\"%s\"", stats->ident);
     if (prom_metric_descs[fmrock->metric].label)
         buf_printf(fmrock->buf, ",%s", prom_metric_descs[fmrock->metric].label);
-    buf_printf(fmrock->buf, "} %0.f %" PRId64 "\n",
-                            stats->metrics[fmrock->metric].value,
+    value = stats->metrics[fmrock->metric].value;
+    buf_printf(fmrock->buf, "} %.*f %" PRId64 "\n",
+                            value == (double) (int64_t) value ? 0 : 6, value,
                             stats->metrics[fmrock->metric].last_updated);
 }
 
 static void do_collate_report(struct buf *buf)
 {
     hash_table all_stats = HASH_TABLE_INITIALIZER;
+    const struct prom_registry *reg;
     char *doneprocs_lock_fname;
     int doneprocs_lock_fd;
     int i;
@@ -267,6 +384,11 @@ static void do_collate_report(struct buf *buf)
     /* slurp up and accumulate current stats */
     promdir_foreach(&accum_stats, PROMDIR_FOREACH_PIDS, &all_stats);
 
+    /* and whatever is in the shared registry, however many processes
+     * are writing to it */
+    reg = prometheus_registry_map();
+    if (reg) accum_registry(reg, &all_stats);
+
     syslog(LOG_DEBUG, "updating prometheus report for %d services",
                       hash_numrecords(&all_stats));
 
@@ -278,12 +400,17 @@ static void do_collate_report(struct buf *buf)
 
     /* format it into buf */
     for (i = 0; i < PROM_NUM_METRICS; i++) {
+        /* a histogram's samples are named differently from the metric */
+        const char *family = prom_metric_descs[i].family ?
+                             prom_metric_descs[i].family :
+                             prom_metric_descs[i].name;
+
         if (prom_metric_descs[i].help) {
-            buf_printf(buf, "# HELP %s %s\n", prom_metric_descs[i].name,
+            buf_printf(buf, "# HELP %s %s\n", family,
                             prom_metric_descs[i].help);
         }
         if (prom_metric_descs[i].type != PROM_METRIC_CONTINUED) {
-            buf_printf(buf, "# TYPE %s %s\n", prom_metric_descs[i].name,
+            buf_printf(buf, "# TYPE %s %s\n", family,
                             prom_metric_type_names[prom_metric_descs[i].type]);
         }
 
@@ -291,6 +418,11 @@ static void do_collate_report(struct buf *buf)
         hash_enumerate(&all_stats, &format_metric, &fmrock);
     }
 
+    if (reg) {
+        format_dynamic(reg, buf);
+        prometheus_registry_unmap(reg);
+    }
+
     /* clean up the copy */
     free_hash_table(&all_stats, free);
 }
@@ -54,18 +54,21 @@ enum {
 struct stdprot_t;
 struct backend;
 
-#define MAX_CAPA 11
+#define MAX_CAPA 12
 
 enum {
     /* generic capabilities */
     CAPA_AUTH           = (1 << 0),
     CAPA_STARTTLS       = (1 << 1),
-    CAPA_COMPRESS       = (1 << 2)
+    CAPA_COMPRESS       = (1 << 2),
 
     /*
       protocol specific capabilities MUST be in the range
       (1 << 3) .. (1 << MAX_CAPA)
     */
+
+    /* generic capabilities added later live above that range */
+    CAPA_COMPRESS_ZSTD  = (1 << 20)
 };
 
 struct banner_t {
@@ -119,6 +122,9 @@ struct stdprot_t {
     struct simple_cmd_t compress_cmd;
     struct simple_cmd_t ping_cmd;
     struct simple_cmd_t logout_cmd;
+    struct simple_cmd_t zstd_cmd;   /* [OPTIONAL] COMPRESS with zstd */
+    struct simple_cmd_t unauth_cmd; /* [OPTIONAL] return to the
+                                       unauthenticated state */
 };
 
 struct protocol_t {
@@ -103,8 +103,8 @@ EXPORTED void proxy_downserver(struct backend *s)
         return;
     }
 
-    /* need to logout of server */
-    backend_disconnect(s);
+    /* need to logout of server, unless it can be reused later */
+    if (backend_release(s)) backend_disconnect(s);
 
     /* clear any references to this backend */
     if (s->inbox && (s == *(s->inbox))) *(s->inbox) = NULL;
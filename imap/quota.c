@@ -83,6 +83,7 @@
 #include "quota.h"
 #include "convert_code.h"
 #include "util.h"
+#include "workerpool.h"
 #include <jansson.h>
 
 /* generated headers are not necessarily in current directory */
@@ -98,6 +99,7 @@ struct quotaentry {
     char *name;
     int refcount;
     int deleted;
+    quota_t scanuseds[QUOTA_NUMRESOURCES];  /* for a dry run */
 };
 
 /* forward declarations */
@@ -118,6 +120,8 @@ static int quota_num = 0, quota_alloc = 0;
 static int quota_todo = 0;
 
 static int test_sync_mode = 0;
+static int dryrun = 0;
+static int nworkers = 0;
 
 static json_t *jsonout;
 
@@ -131,7 +135,7 @@ int main(int argc,char **argv)
     int do_report = 1;
     char *alt_config = NULL, *domain = NULL;
 
-    while ((opt = getopt(argc, argv, "C:d:fqJZu")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:d:fnqJZuj:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -149,6 +153,16 @@ int main(int argc,char **argv)
             fflag = 1;
             break;
 
+        case 'n':
+            fflag = 1;
+            dryrun = 1;
+            break;
+
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) usage();
+            break;
+
         case 'u':
             isuser = 1;
             break;
@@ -222,7 +236,7 @@ int main(int argc,char **argv)
 static void usage(void)
 {
     fprintf(stderr,
-            "usage: quota [-C <alt_config>] [-d <domain>] [-f] [-q] [-u] [mailbox-spec]...\n");
+            "usage: quota [-C <alt_config>] [-d <domain>] [-f | -n] [-j <workers>] [-q] [-u] [mailbox-spec]...\n");
     exit(EC_USAGE);
 }
 
@@ -322,6 +336,12 @@ static int fixquota_addroot(struct quota *q,
 
     quotaroots[quota_num].name = xstrdup(q->root);
 
+    /* a dry run adds up usage in memory instead */
+    if (dryrun) {
+        quota_num++;
+        return 0;
+    }
+
     /* get a locked read */
     quota_init(&localq, quotaroots[quota_num].name);
     r = quota_read(&localq, &tid, 1);
@@ -472,7 +492,10 @@ static int fixquota_dombox(const mbentry_t *mbentry, void *rock)
         goto done;
     }
 
-    r = mailbox_open_iwl(mbentry->name, &mailbox);
+    if (dryrun)
+        r = mailbox_open_irl(mbentry->name, &mailbox);
+    else
+        r = mailbox_open_iwl(mbentry->name, &mailbox);
     if (r) {
         errmsg("failed opening header for mailbox '%s'", mbentry->name, r);
         goto done;
@@ -502,13 +525,21 @@ static int fixquota_dombox(const mbentry_t *mbentry, void *rock)
             if (r) goto done;
         }
 
+        /* the usage comes from the index header, not the records */
+        mailbox_get_usage(mailbox, useds);
+
+        if (dryrun) {
+            for (res = 0; res < QUOTA_NUMRESOURCES; res++)
+                quotaroots[thisquota].scanuseds[res] += useds[res];
+            goto done;
+        }
+
         /* read the current data */
         quota_init(&localq, root);
         r = quota_read(&localq, &txn, 1);
         if (r) goto done;
 
         /* add the usage for this mailbox */
-        mailbox_get_usage(mailbox, useds);
         for (res = 0; res < QUOTA_NUMRESOURCES; res++)
             localq.scanuseds[res] += useds[res];
 
@@ -539,9 +570,11 @@ int fixquota_fixroot(struct mailbox *mailbox,
 {
     int r;
 
-    fprintf(stderr, "%s: quota root %s --> %s\n", mailbox->name,
+    fprintf(stderr, "%s: quota root %s --> %s%s\n", mailbox->name,
            mailbox->quotaroot ? mailbox->quotaroot : "(none)",
-           root ? root : "(none)");
+           root ? root : "(none)", dryrun ? " (not changed)" : "");
+
+    if (dryrun) return 0;
 
     r = mailbox_set_quotaroot(mailbox, root);
     if (r) errmsg("failed writing header for mailbox '%s'", mailbox->name, r);
@@ -549,6 +582,42 @@ int fixquota_fixroot(struct mailbox *mailbox,
     return r;
 }
 
+/*
+ * Pass 3 for a dry run: report what fixing would have changed
+ */
+static int fixquota_report(int thisquota)
+{
+    const char *root = quotaroots[thisquota].name;
+    struct quota localq;
+    int res, r;
+
+    if (!quotaroots[thisquota].refcount) {
+        fprintf(stderr, "%s: would be removed\n", root);
+        return 0;
+    }
+
+    quota_init(&localq, root);
+    r = quota_read(&localq, NULL, 0);
+    if (r) {
+        errmsg("failed reading quotaroot '%s'", root, r);
+        goto done;
+    }
+
+    for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+        if (quotaroots[thisquota].scanuseds[res] != localq.useds[res]) {
+            fprintf(stderr, "%s: %s usage is " QUOTA_T_FMT ", would be " QUOTA_T_FMT "\n",
+                root,
+                quota_names[res],
+                localq.useds[res],
+                quotaroots[thisquota].scanuseds[res]);
+        }
+    }
+
+done:
+    quota_free(&localq);
+    return r;
+}
+
 /*
  * Pass 3: finish fixing up a quota root
  */
@@ -560,6 +629,8 @@ int fixquota_finish(int thisquota)
     const char *root = quotaroots[thisquota].name;
     struct quota localq;
 
+    if (dryrun) return fixquota_report(thisquota);
+
     if (!quotaroots[thisquota].refcount) {
         quotaroots[thisquota].deleted = 1;
         fprintf(stderr, "%s: removed\n", root);
@@ -657,6 +728,125 @@ int fixquota_dopass(char *domain, char **roots, int nroots,
     return r;
 }
 
+/*
+ * Parallel fixing.  The quota roots are split into groups, each an
+ * outermost root and the roots nested inside it, and the groups are
+ * handed out to a pool of worker processes.  A group's mailboxes all
+ * sort together under its outermost root, and belong to no other
+ * group, so each worker runs the usual pass over just that range.
+ * Meanwhile the parent passes over the mailboxes outside every root.
+ */
+static int *quota_groups;   /* index of each group's first root */
+static int quota_ngroups;
+static int stray_group;
+
+/* mailboxes not under the current group's root belong to someone else */
+static int fixquota_dogroupbox(const mbentry_t *mbentry, void *rock)
+{
+    const char *root = (const char *) rock;
+
+    if (!mboxname_is_prefix(mbentry->name, root)) return 0;
+
+    return fixquota_dombox(mbentry, NULL);
+}
+
+static int fixquota_dogroup(int group)
+{
+    int start = quota_groups[group];
+    int end = quota_groups[group+1];
+    const char *root = quotaroots[start].name;
+    int r;
+
+    /* only consider this group's roots */
+    quota_todo = start;
+    quota_num = end;
+
+    r = mboxlist_allmbox(root, fixquota_dogroupbox, (void *) root, /*flags*/0);
+    if (r) errmsg("processing mbox list for '%s'", root, r);
+
+    while (!r && quota_todo < quota_num) {
+        r = fixquota_finish(quota_todo);
+        quota_todo++;
+    }
+
+    return r;
+}
+
+static int fixquota_job(unsigned idx, void *rock __attribute__((unused)))
+{
+    return fixquota_dogroup(idx);
+}
+
+static void fixquota_workerdone(void *rock __attribute__((unused)))
+{
+    mboxlist_close();
+    cyrus_done();
+}
+
+/* pass over the mailboxes which aren't inside any of the groups */
+static int fixquota_dostray(const mbentry_t *mbentry, void *rock)
+{
+    while (stray_group < quota_ngroups) {
+        const char *root = quotaroots[quota_groups[stray_group]].name;
+
+        if (compar(mbentry->name, root) < 0)
+            break;
+
+        /* a worker has this one */
+        if (mboxname_is_prefix(mbentry->name, root))
+            return 0;
+
+        stray_group++;
+    }
+
+    return fixquota_dombox(mbentry, rock);
+}
+
+static int fixquotas_parallel(char *domain, char **roots, int nroots,
+                              int isuser)
+{
+    int allroots = quota_num;
+    struct workerpool *pool;
+    int i, r, wr;
+
+    quota_groups = xmalloc((quota_num + 1) * sizeof(int));
+    quota_ngroups = 0;
+    for (i = 0; i < quota_num; ) {
+        int outer = i;
+        quota_groups[quota_ngroups++] = outer;
+        for (i++; i < quota_num &&
+                 mboxname_is_prefix(quotaroots[i].name, quotaroots[outer].name); i++);
+    }
+    quota_groups[quota_ngroups] = quota_num;
+
+    mboxlist_close();
+
+    pool = workerpool_start(nworkers, quota_ngroups, fixquota_job,
+                            fixquota_workerdone, NULL);
+
+    /* no roots left for the parent: strays can only lose theirs */
+    quota_todo = quota_num;
+    stray_group = 0;
+    r = fixquota_dopass(domain, roots, nroots, fixquota_dostray, isuser);
+
+    wr = workerpool_wait(pool);
+    if (!r && wr) r = IMAP_IOERROR;
+    free(quota_groups);
+    quota_groups = NULL;
+
+    /* the workers removed any unused roots in their own copy of the list */
+    for (i = 0; i < allroots; i++) {
+        struct quota localq;
+
+        quota_init(&localq, quotaroots[i].name);
+        if (quota_read(&localq, NULL, 0) == IMAP_QUOTAROOT_NONEXISTENT)
+            quotaroots[i].deleted = 1;
+        quota_free(&localq);
+    }
+
+    return r;
+}
+
 /*
  * Fix all the quota roots
  */
@@ -664,6 +854,9 @@ int fixquotas(char *domain, char **roots, int nroots, int isuser)
 {
     int r;
 
+    if (nworkers && quota_num)
+        return fixquotas_parallel(domain, roots, nroots, isuser);
+
     r = fixquota_dopass(domain, roots, nroots, fixquota_dombox, isuser);
 
     while (!r && quota_todo < quota_num) {
@@ -120,6 +120,10 @@ extern int quota_update_useds(const char *quotaroot,
 extern int quota_check_useds(const char *quotaroot,
                              const quota_t diff[QUOTA_NUMRESOURCES]);
 
+/* write out any usage changes this process has held back, see
+ * quota_reserve_percent.  With 'all', give back reservations too */
+extern void quota_flush_deferred(int all);
+
 extern int quota_deleteroot(const char *quotaroot, int silent);
 
 extern int quota_findroot(char *ret, size_t retlen, const char *name);
@@ -49,11 +49,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 
 #include "cyrusdb.h"
 #include "dlist.h"
 #include "exitcodes.h"
 #include "global.h"
+#include "hash.h"
 #include "mailbox.h"
 #include "mboxname.h"
 #include "mboxevent.h"
@@ -79,6 +81,31 @@ static void init_internal();
 static int quota_initialized = 0;
 static int quota_dbopen = 0;
 
+/* Usage changes held back by this process, by quotaroot.  Each
+ * process may reserve some of a root's remaining room by adding it to
+ * the stored usage ahead of time, and then use it up without writing
+ * the record again.  Since the stored usage is never less than what
+ * is really used, other processes can never go over the limit.
+ * Reductions, and growth in unlimited resources, are held back until
+ * the next write or flush.  See quota_update_useds() */
+struct quota_deferred {
+    char *mboxname;     /* mailbox the pending changes were made in */
+    quota_t pending[QUOTA_NUMRESOURCES];  /* not yet written */
+    quota_t reserved[QUOTA_NUMRESOURCES]; /* written, but not yet used */
+    int limits[QUOTA_NUMRESOURCES];       /* as of the last write */
+    time_t since;                         /* time of the last write */
+};
+
+static hash_table quota_deferred = HASH_TABLE_INITIALIZER;
+
+static void quota_deferred_free(void *data)
+{
+    struct quota_deferred *qd = (struct quota_deferred *) data;
+
+    free(qd->mboxname);
+    free(qd);
+}
+
 /* keywords used when storing fields in the new quota db format */
 static const char * const quota_db_names[QUOTA_NUMRESOURCES] = {
     "S",        /* QUOTA_STORAGE */
@@ -264,6 +291,17 @@ EXPORTED int quota_read(struct quota *quota, struct txn **tid, int wrlock)
                    quota->root, data);
             return r;
         }
+        if (!wrlock && quota_deferred.size) {
+            /* show our own changes as they really are */
+            struct quota_deferred *qd =
+                hash_lookup(quota->root, &quota_deferred);
+            int res;
+
+            for (res = 0; qd && res < QUOTA_NUMRESOURCES; res++) {
+                quota->useds[res] += qd->pending[res] - qd->reserved[res];
+                if (quota->useds[res] < 0) quota->useds[res] = 0;
+            }
+        }
         break;
 
     case CYRUSDB_AGAIN:
@@ -478,19 +516,25 @@ EXPORTED int quota_write(struct quota *quota, int silent, struct txn **tid)
     return r;
 }
 
-EXPORTED int quota_update_useds(const char *quotaroot,
-                       const quota_t diff[QUOTA_NUMRESOURCES],
-                       const char *mboxname)
+/*
+ * Write the change 'diff' to 'quotaroot', made in 'mboxname', along
+ * with any changes this process has held back for it.  If 'reserve' is
+ * set, reserve some of the remaining room for later changes.
+ */
+static int quota_write_useds(const char *quotaroot,
+                             const quota_t diff[QUOTA_NUMRESOURCES],
+                             const char *mboxname, int reserve)
 {
     struct quota q;
     struct txn *tid = NULL;
     int r = 0;
     struct mboxevent *mboxevents = NULL;
+    struct quota_deferred *qd = NULL;
+    quota_t newreserved[QUOTA_NUMRESOURCES] = QUOTA_DIFFS_INITIALIZER;
+    int percent = config_getint(IMAPOPT_QUOTA_RESERVE_PERCENT);
 
-    init_internal();
-
-    if (!quotaroot || !*quotaroot)
-        return IMAP_QUOTAROOT_NONEXISTENT;
+    if (quota_deferred.size)
+        qd = hash_lookup(quotaroot, &quota_deferred);
 
     quota_init(&q, quotaroot);
 
@@ -498,32 +542,83 @@ EXPORTED int quota_update_useds(const char *quotaroot,
 
     if (!r) {
         int res;
-        int cmp = 1;
+        int cmp = 1, qdcmp = 1;
         if (q.scanmbox) {
-            cmp = cyrusdb_compar(qdb, mboxname, strlen(mboxname),
-                                 q.scanmbox, strlen(q.scanmbox));
+            if (mboxname)
+                cmp = cyrusdb_compar(qdb, mboxname, strlen(mboxname),
+                                     q.scanmbox, strlen(q.scanmbox));
+            if (qd && qd->mboxname)
+                qdcmp = cyrusdb_compar(qdb, qd->mboxname, strlen(qd->mboxname),
+                                       q.scanmbox, strlen(q.scanmbox));
+            /* don't hold anything back while quota is being fixed */
+            reserve = 0;
         }
         for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
-            int was_over = quota_is_overquota(&q, res, NULL);
+            int was_over;
+
+            /* give back what we reserved before */
+            if (qd) quota_use(&q, res, -qd->reserved[res]);
+
+            was_over = quota_is_overquota(&q, res, NULL);
             quota_use(&q, res, diff[res]);
             if (cmp <= 0)
                 q.scanuseds[res] += diff[res];
+            if (qd) {
+                quota_use(&q, res, qd->pending[res]);
+                if (qdcmp <= 0)
+                    q.scanuseds[res] += qd->pending[res];
+            }
 
             if (was_over && !quota_is_overquota(&q, res, NULL)) {
                 struct mboxevent *mboxevent =
                     mboxevent_enqueue(EVENT_QUOTA_WITHIN, &mboxevents);
                 mboxevent_extract_quota(mboxevent, &q, res);
             }
+
+            /* only reserve while there's at least as much room again
+             * left over, so that near the limit every change is written
+             * through and checked exactly */
+            if (reserve && q.limits[res] >= 0) {
+                quota_t lim = (quota_t)q.limits[res] * quota_units[res];
+                quota_t want = lim * percent / 100;
+
+                if (want > 0 && lim - q.useds[res] >= 2 * want) {
+                    newreserved[res] = want;
+                    q.useds[res] += want;
+                }
+            }
         }
         r = quota_write(&q, 0/*force*/, &tid);
     }
 
     if (r) {
         quota_abort(&tid);
+        if (qd && r == IMAP_QUOTAROOT_NONEXISTENT) {
+            /* the root is gone, and what we held back with it */
+            hash_del(quotaroot, &quota_deferred);
+            quota_deferred_free(qd);
+        }
         goto out;
     }
     quota_commit(&tid);
 
+    if (qd || reserve) {
+        int res;
+
+        if (!qd) {
+            qd = xzmalloc(sizeof(struct quota_deferred));
+            hash_insert(quotaroot, qd, &quota_deferred);
+        }
+        free(qd->mboxname);
+        qd->mboxname = NULL;
+        for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+            qd->pending[res] = 0;
+            qd->reserved[res] = newreserved[res];
+            qd->limits[res] = q.limits[res];
+        }
+        qd->since = time(NULL);
+    }
+
     mboxevent_notify(&mboxevents);
 
 out:
@@ -540,6 +635,113 @@ out:
     return r;
 }
 
+/*
+ * Try to account for 'diff' without writing the record: growth must
+ * fit in what we've reserved, or be unlimited.  Returns 1 if it did.
+ */
+static int quota_defer_useds(const char *quotaroot,
+                             const quota_t diff[QUOTA_NUMRESOURCES],
+                             const char *mboxname)
+{
+    struct quota_deferred *qd = hash_lookup(quotaroot, &quota_deferred);
+    int pending = 0;
+    int res;
+
+    /* nothing is known about the root until we've written it once */
+    if (!qd) return 0;
+
+    if (time(NULL) - qd->since >= config_getint(IMAPOPT_QUOTA_RESERVE_MAXAGE))
+        return 0;
+
+    for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+        if (diff[res] > 0 && qd->limits[res] >= 0) {
+            if (diff[res] > qd->reserved[res]) return 0;
+        }
+        else if (diff[res]) {
+            pending = 1;
+        }
+    }
+
+    /* pending changes are kept per mailbox, for quota -f's sake */
+    if (pending && qd->mboxname && strcmpsafe(qd->mboxname, mboxname))
+        return 0;
+
+    for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+        if (diff[res] > 0 && qd->limits[res] >= 0)
+            qd->reserved[res] -= diff[res];
+        else
+            qd->pending[res] += diff[res];
+    }
+    if (pending && !qd->mboxname)
+        qd->mboxname = xstrdupnull(mboxname);
+
+    return 1;
+}
+
+EXPORTED int quota_update_useds(const char *quotaroot,
+                       const quota_t diff[QUOTA_NUMRESOURCES],
+                       const char *mboxname)
+{
+    int reserve = config_getint(IMAPOPT_QUOTA_RESERVE_PERCENT) > 0;
+
+    init_internal();
+
+    if (!quotaroot || !*quotaroot)
+        return IMAP_QUOTAROOT_NONEXISTENT;
+
+    if (reserve && quota_defer_useds(quotaroot, diff, mboxname))
+        return 0;
+
+    return quota_write_useds(quotaroot, diff, mboxname, reserve);
+}
+
+struct quota_flush_rock {
+    int all;
+    time_t now;
+    strarray_t roots;
+};
+
+static void quota_flush_cb(const char *root, void *data, void *rock)
+{
+    struct quota_deferred *qd = (struct quota_deferred *) data;
+    struct quota_flush_rock *frock = (struct quota_flush_rock *) rock;
+    int res;
+
+    for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+        if (qd->pending[res] ||
+            (qd->reserved[res] &&
+             (frock->all ||
+              frock->now - qd->since >= config_getint(IMAPOPT_QUOTA_RESERVE_MAXAGE)))) {
+            strarray_append(&frock->roots, root);
+            return;
+        }
+    }
+}
+
+/*
+ * Write out the usage changes this process has held back.  Unless
+ * 'all' is set, reservations are kept until they are too old.
+ */
+EXPORTED void quota_flush_deferred(int all)
+{
+    static const quota_t nodiff[QUOTA_NUMRESOURCES] = QUOTA_DIFFS_INITIALIZER;
+    struct quota_flush_rock frock = { all, time(NULL), STRARRAY_INITIALIZER };
+    int i;
+
+    if (!quota_deferred.size) return;
+
+    hash_enumerate(&quota_deferred, quota_flush_cb, &frock);
+
+    for (i = 0; i < strarray_size(&frock.roots); i++) {
+        const char *root = strarray_nth(&frock.roots, i);
+        int reserve = !all && config_getint(IMAPOPT_QUOTA_RESERVE_PERCENT) > 0;
+
+        quota_write_useds(root, nodiff, NULL, reserve);
+    }
+
+    strarray_fini(&frock.roots);
+}
+
 EXPORTED int quota_check_useds(const char *quotaroot,
                       const quota_t diff[QUOTA_NUMRESOURCES])
 {
@@ -648,6 +850,10 @@ EXPORTED int quota_findroot(char *ret, size_t retlen, const char *name)
 
 static void done_cb(void*rock __attribute__((unused)))
 {
+    if (quota_deferred.size) {
+        if (quota_dbopen) quota_flush_deferred(/*all*/1);
+        free_hash_table(&quota_deferred, quota_deferred_free);
+    }
     if (quota_dbopen) {
         quotadb_close();
     }
@@ -670,6 +876,8 @@ EXPORTED void quotadb_init(int myflags)
     if (myflags & QUOTADB_SYNC) {
         cyrusdb_sync(QDB);
     }
+    if (!quota_deferred.size)
+        construct_hash_table(&quota_deferred, 64, 0);
     cyrus_modules_add(done_cb, NULL);
 }
 
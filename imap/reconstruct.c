@@ -97,6 +97,7 @@
 #include "quota.h"
 #include "seen.h"
 #include "util.h"
+#include "workerpool.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -112,6 +113,8 @@ static struct namespace recon_namespace;
 struct reconstruct_rock {
     strarray_t *discovered;
     hash_table visited;
+    strarray_t *collected;      /* -j: names found, not yet rebuilt */
+    hash_table rebuilt;         /* -j: names rebuilt by the workers */
 };
 
 /* Program name */
@@ -119,6 +122,7 @@ static const char *progname = NULL;
 
 /* forward declarations */
 static void do_mboxlist(void);
+static int do_parallel(struct reconstruct_rock *rrock);
 static int do_reconstruct_p(const mbentry_t *mbentry, void *rock);
 static int do_reconstruct(struct findall_data *data, void *rock);
 static void usage(void);
@@ -127,7 +131,9 @@ extern cyrus_acl_canonproc_t mboxlist_ensureOwnerRights;
 
 static int reconstruct_flags = RECONSTRUCT_MAKE_CHANGES | RECONSTRUCT_DO_STAT;
 static int setversion = 0;
+static int setpacked = 0;
 static int updateuniqueids = 0;
+static int nworkers = 0;
 
 int main(int argc, char **argv)
 {
@@ -137,16 +143,18 @@ int main(int argc, char **argv)
     int mflag = 0;
     int fflag = 0;
     int xflag = 0;
+    int status = 0;
     struct buf buf = BUF_INITIALIZER;
     char *alt_config = NULL;
     char *start_part = NULL;
-    struct reconstruct_rock rrock = { NULL, HASH_TABLE_INITIALIZER };
+    struct reconstruct_rock rrock = { NULL, HASH_TABLE_INITIALIZER,
+                                      NULL, HASH_TABLE_INITIALIZER };
 
     progname = basename(argv[0]);
 
     construct_hash_table(&unqid_table, 2047, 1);
 
-    while ((opt = getopt(argc, argv, "C:kp:rmfsxgGqRUMIoOnV:u")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:kp:rmfsxgGqRUMIoOnV:Puj:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -231,6 +239,15 @@ int main(int argc, char **argv)
                 setversion = atoi(optarg);
             break;
 
+        case 'P':
+            setpacked = 1;
+            break;
+
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) usage();
+            break;
+
         default:
             usage();
         }
@@ -307,6 +324,13 @@ int main(int argc, char **argv)
     if (fflag) rrock.discovered = strarray_new();
     construct_hash_table(&rrock.visited, 2047, 1); /* XXX magic numbers */
 
+    /* with -j, first just gather the names so that the workers can
+     * rebuild them, then go over them again serially below */
+    if (nworkers > 1 && !setversion && !setpacked) {
+        rrock.collected = strarray_new();
+        construct_hash_table(&rrock.rebuilt, 2047, 1);
+    }
+
     /* Normal Operation */
     if (optind == argc) {
         if (rflag || dousers) {
@@ -352,6 +376,11 @@ int main(int argc, char **argv)
         }
     }
 
+    if (rrock.collected && do_parallel(&rrock)) {
+        fprintf(stderr, "some reconstruct workers failed\n");
+        status = EC_SOFTWARE;
+    }
+
     /* examine our list to see if we discovered anything */
     while (rrock.discovered && rrock.discovered->count) {
         char *name = strarray_shift(rrock.discovered);
@@ -375,6 +404,7 @@ int main(int argc, char **argv)
 
     if (rrock.discovered) strarray_free(rrock.discovered);
     free_hash_table(&rrock.visited, NULL);
+    free_hash_table(&rrock.rebuilt, NULL);
 
     free_hash_table(&unqid_table, free);
 
@@ -384,7 +414,7 @@ int main(int argc, char **argv)
 
     cyrus_done();
 
-    return 0;
+    return status;
 }
 
 static void usage(void)
@@ -409,7 +439,9 @@ static void usage(void)
     fprintf(stderr, "-O                 delete odd files(unlike -o)\n");
     fprintf(stderr, "-M                 prefer mailboxes.db over cyrus.header\n");
     fprintf(stderr, "-V <version>       Change the cyrus.index minor version to the version specified\n");
+    fprintf(stderr, "-P                 pack the cyrus.index records of mailboxes which no longer change\n");
     fprintf(stderr, "-u                 give usernames instead of mailbox prefixes\n");
+    fprintf(stderr, "-j <workers>       rebuild mailboxes in this many parallel processes\n");
 
     fprintf(stderr, "\n");
 
@@ -453,7 +485,15 @@ static int do_reconstruct(struct findall_data *data, void *rock)
     /* don't repeat */
     if (hash_lookup(name, &rrock->visited)) return 0;
 
-    if (!setversion) {
+    if (rrock->collected) {
+        if (!hash_lookup(name, &rrock->rebuilt)) {
+            strarray_append(rrock->collected, name);
+            hash_insert(name, rrock, &rrock->rebuilt);
+        }
+        return 0;
+    }
+
+    if (!setversion && !setpacked && !hash_lookup(name, &rrock->rebuilt)) {
         r = mailbox_reconstruct(name, reconstruct_flags);
         if (r) {
             com_err(name, r, "%s",
@@ -507,6 +547,15 @@ static int do_reconstruct(struct findall_data *data, void *rock)
             printf("Repacked %s to version %d\n", extname, setversion);
         }
     }
+    if (setpacked) {
+        int r = mailbox_setpacked(mailbox);
+        if (r) {
+            printf("FAILED TO PACK %s: %s\n", extname, error_message(r));
+        }
+        else if (mailbox->i.options & OPT_MAILBOX_PACKED) {
+            printf("Packed %s\n", extname);
+        }
+    }
     mailbox_close(&mailbox);
     free(extname);
 
@@ -570,6 +619,64 @@ static int do_reconstruct(struct findall_data *data, void *rock)
     return 0;
 }
 
+/*
+ * Parallel mode (-j N).
+ *
+ * The expensive part of reconstructing, mailbox_reconstruct(), reads
+ * and parses every message file, and each mailbox can be done on its
+ * own.  Worker processes pull the indexes of the collected names off a
+ * shared pipe, so a worker that lands a huge mailbox doesn't hold up
+ * the others.  Everything which looks across mailboxes (uniqueid
+ * clashes, discovering new mailboxes, the output) then happens in the
+ * usual serial pass, which skips the rebuild itself.
+ */
+static int parallel_job(unsigned idx, void *rock)
+{
+    const char *name = strarray_nth((const strarray_t *) rock, idx);
+    int r;
+
+    r = mailbox_reconstruct(name, reconstruct_flags);
+    if (r) {
+        com_err(name, r, "%s",
+                (r == IMAP_IOERROR) ? error_message(errno) : "Failed to reconstruct mailbox");
+    }
+
+    return r;
+}
+
+static void parallel_done(void *rock __attribute__((unused)))
+{
+    partlist_local_done();
+    cyrus_done();
+}
+
+/* returns non-zero if any worker failed */
+static int do_parallel(struct reconstruct_rock *rrock)
+{
+    strarray_t *names = rrock->collected;
+    int i, r = 0;
+
+    /* the workers rebuild, the serial pass below only checks */
+    rrock->collected = NULL;
+
+    if (names->count) {
+        /* the workers open their own mailboxes.db */
+        mboxlist_close();
+
+        r = workerpool_run(nworkers, names->count,
+                           parallel_job, parallel_done, names);
+    }
+
+    for (i = 0; i < names->count; i++) {
+        mboxlist_findone(&recon_namespace, strarray_nth(names, i), 1, 0, 0,
+                         do_reconstruct, rrock);
+    }
+
+    strarray_free(names);
+
+    return r;
+}
+
 /*
  * Reconstruct the mailboxes list.
  */
@@ -42,18 +42,38 @@
 
 #include <config.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sasl/sasl.h>
 #include <sasl/saslutil.h>
+#ifdef HAVE_SSL
+#include <openssl/evp.h>
+#endif
 
+#include "cyr_lock.h"
+#include "global.h"
 #include "prot.h"
+#include "util.h"
 #include "xmalloc.h"
+#include "xsha1.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
 
 #define BASE64_BUF_SIZE 21848   /* per RFC 2222bis: ((16K / 3) + 1) * 4  */
 
+#define FNAME_SASLCACHE "/saslcache"
+
+extern void saslcache_reset(void);
+extern void saslcache_commit(sasl_conn_t *conn);
+
 /* NOTE: success_data will need to be free()d by the caller */
 EXPORTED int saslserver(sasl_conn_t *conn, const char *mech,
                const char *init_resp, const char *resp_prefix,
@@ -70,6 +90,9 @@ EXPORTED int saslserver(sasl_conn_t *conn, const char *mech,
 
     if (success_data) *success_data = NULL;
 
+    /* nothing from an earlier attempt may be cached on this one's behalf */
+    saslcache_reset();
+
     /* initial response */
     if (init_resp) {
         clientin = base64;
@@ -108,6 +131,7 @@ EXPORTED int saslserver(sasl_conn_t *conn, const char *mech,
         /* get response from the client */
         if (!prot_fgets(base64, BASE64_BUF_SIZE, pin) ||
             strncasecmp(base64, resp_prefix, strlen(resp_prefix))) {
+            saslcache_reset();
             if (sasl_result) *sasl_result = SASL_FAIL;
             return IMAP_SASL_PROTERR;
         }
@@ -122,6 +146,7 @@ EXPORTED int saslserver(sasl_conn_t *conn, const char *mech,
 
         /* check if client cancelled */
         if (p[0] == '*') {
+            saslcache_reset();
             if(sasl_result) *sasl_result = SASL_BADPROT;
             return IMAP_SASL_CANCEL;
         }
@@ -137,6 +162,10 @@ EXPORTED int saslserver(sasl_conn_t *conn, const char *mech,
                              &serverout, &serveroutlen);
     }
 
+    /* remember a password the backend just verified */
+    if (r == SASL_OK) saslcache_commit(conn);
+    else saslcache_reset();
+
     /* success data */
     if (r == SASL_OK && serverout && success_data) {
         r = sasl_encode64(serverout, serveroutlen,
@@ -148,3 +177,322 @@ EXPORTED int saslserver(sasl_conn_t *conn, const char *mech,
     if (sasl_result) *sasl_result = r;
     return (r == SASL_OK ? 0 : IMAP_SASL_FAIL);
 }
+
+/*
+ * Password verification cache.
+ *
+ * Clients which reconnect every minute or so (POP pollers, phones) make
+ * us send the same PLAIN/LOGIN password to saslauthd (and on to LDAP or
+ * whatever is behind it) over and over.  With sasl_auth_cache_ttl set,
+ * passwords which the backend accepted are remembered for that long in
+ * a small table shared by all processes through a mapped file, and
+ * checked there first through the SASL_CB_SERVER_USERDB_CHECKPASS
+ * callback.  Passwords are never stored: each slot holds a hash of the
+ * userid and a PBKDF2 verifier of userid and password, salted with a
+ * random secret kept in the file, so that a copy of the file is no
+ * cheaper to attack than the backend's own hashes would be.  Without
+ * OpenSSL there is no KDF to hand and the cache stays disabled.
+ *
+ * A password is only cached for the login which offered it: the pending
+ * verifier is dropped at the start of every attempt and whenever one
+ * fails, and is only committed if the user it was computed for is the
+ * one SASL then authenticated.  A user has at most one slot, so the first
+ * successful login with a new password replaces the old one; use
+ * saslcache_invalidate() (cyr_info saslcache-invalidate) to drop a user
+ * straight away after a password change.
+ */
+
+#define SASLCACHE_MAGIC     "CyrSASLc"
+#define SASLCACHE_VERSION   2
+#define SASLCACHE_SLOTS     8192
+#define SASLCACHE_ROUNDS    10000
+
+struct saslcache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nslots;
+    unsigned char secret[SHA1_DIGEST_LENGTH];
+};
+
+struct saslcache_slot {
+    uint32_t expires;
+    unsigned char user[SHA1_DIGEST_LENGTH];
+    unsigned char verifier[SHA1_DIGEST_LENGTH];
+};
+
+#define SASLCACHE_SIZE (sizeof(struct saslcache_header) + \
+                        SASLCACHE_SLOTS * sizeof(struct saslcache_slot))
+
+static struct {
+    int fd;
+    char *fname;
+    char *base;
+    /* a password we couldn't vouch for, to remember if the backend does */
+    sasl_conn_t *pending_conn;
+    char *pending_user;
+    struct saslcache_slot pending;
+} saslcache = { -1, NULL, NULL, NULL, NULL, { 0, {0}, {0} } };
+
+static int saslcache_ttl(void)
+{
+#ifdef HAVE_SSL
+    return config_getint(IMAPOPT_SASL_AUTH_CACHE_TTL);
+#else
+    return 0;
+#endif
+}
+
+/* forget any password waiting to be committed */
+EXPORTED void saslcache_reset(void)
+{
+    saslcache.pending_conn = NULL;
+    xzfree(saslcache.pending_user);
+    memset(&saslcache.pending, 0, sizeof(saslcache.pending));
+}
+
+/* map the cache file, creating or resetting it if need be */
+static int saslcache_open(void)
+{
+    struct saslcache_header *hdr;
+    struct stat sbuf;
+    int fd;
+
+    if (saslcache.base) return 0;
+
+    if (!saslcache.fname)
+        saslcache.fname = strconcat(config_dir, FNAME_SASLCACHE, (char *) NULL);
+
+    fd = open(saslcache.fname, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: opening %s: %m", saslcache.fname);
+        return -1;
+    }
+
+    if (lock_blocking(fd, saslcache.fname) || fstat(fd, &sbuf)) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", saslcache.fname);
+        close(fd);
+        return -1;
+    }
+
+    if (sbuf.st_size == SASLCACHE_SIZE) {
+        struct saslcache_header old;
+
+        /* a cache left by an older version is thrown away */
+        if (pread(fd, &old, sizeof(old), 0) != sizeof(old) ||
+            memcmp(old.magic, SASLCACHE_MAGIC, sizeof(old.magic)) ||
+            old.version != SASLCACHE_VERSION) {
+            sbuf.st_size = 0;
+        }
+    }
+
+    if (sbuf.st_size != SASLCACHE_SIZE) {
+        struct saslcache_header new;
+        int rfd;
+
+        /* start afresh, with a new secret */
+        memset(&new, 0, sizeof(new));
+        memcpy(new.magic, SASLCACHE_MAGIC, sizeof(new.magic));
+        new.version = SASLCACHE_VERSION;
+        new.nslots = SASLCACHE_SLOTS;
+
+        rfd = open("/dev/urandom", O_RDONLY);
+        if (rfd < 0 || read(rfd, new.secret, sizeof(new.secret)) !=
+                                                  sizeof(new.secret)) {
+            syslog(LOG_ERR, "saslcache: can't read /dev/urandom: %m");
+            if (rfd >= 0) close(rfd);
+            lock_unlock(fd, saslcache.fname);
+            close(fd);
+            return -1;
+        }
+        close(rfd);
+
+        if (ftruncate(fd, 0) || ftruncate(fd, SASLCACHE_SIZE) ||
+            pwrite(fd, &new, sizeof(new), 0) != sizeof(new)) {
+            syslog(LOG_ERR, "IOERROR: initialising %s: %m", saslcache.fname);
+            lock_unlock(fd, saslcache.fname);
+            close(fd);
+            return -1;
+        }
+    }
+
+    saslcache.base = mmap(NULL, SASLCACHE_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+    lock_unlock(fd, saslcache.fname);
+
+    if (saslcache.base == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mapping %s: %m", saslcache.fname);
+        saslcache.base = NULL;
+        close(fd);
+        return -1;
+    }
+
+    hdr = (struct saslcache_header *) saslcache.base;
+    if (memcmp(hdr->magic, SASLCACHE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != SASLCACHE_VERSION || hdr->nslots != SASLCACHE_SLOTS) {
+        syslog(LOG_ERR, "saslcache: %s is not a cache file, remove it",
+               saslcache.fname);
+        munmap(saslcache.base, SASLCACHE_SIZE);
+        saslcache.base = NULL;
+        close(fd);
+        return -1;
+    }
+
+    saslcache.fd = fd;
+    return 0;
+}
+
+static struct saslcache_slot *saslcache_slot(const unsigned char *user)
+{
+    uint32_t n;
+
+    memcpy(&n, user, sizeof(n));
+    return (struct saslcache_slot *)
+        (saslcache.base + sizeof(struct saslcache_header)) +
+        (n % SASLCACHE_SLOTS);
+}
+
+/* fill in the user and verifier hashes for a userid and password */
+static void saslcache_hash(const char *user, const char *pass,
+                           unsigned passlen, struct saslcache_slot *slot)
+{
+    struct saslcache_header *hdr = (struct saslcache_header *) saslcache.base;
+    struct buf salt = BUF_INITIALIZER;
+
+    xsha1((const unsigned char *) user, strlen(user), slot->user);
+
+    buf_appendmap(&salt, (const char *) hdr->secret, sizeof(hdr->secret));
+    buf_appendmap(&salt, user, strlen(user) + 1);
+
+#ifdef HAVE_SSL
+    if (!PKCS5_PBKDF2_HMAC_SHA1(pass, passlen,
+                                (const unsigned char *) buf_base(&salt),
+                                buf_len(&salt), SASLCACHE_ROUNDS,
+                                SHA1_DIGEST_LENGTH, slot->verifier))
+#endif
+    {
+        /* never matches a slot, since commit refuses it too */
+        memset(slot->verifier, 0, SHA1_DIGEST_LENGTH);
+    }
+
+    buf_free(&salt);
+}
+
+static int saslcache_isnull(const unsigned char *v)
+{
+    unsigned char any = 0;
+    size_t i;
+
+    for (i = 0; i < SHA1_DIGEST_LENGTH; i++)
+        any |= v[i];
+
+    return any == 0;
+}
+
+static int saslcache_equal(const unsigned char *a, const unsigned char *b)
+{
+    unsigned char diff = 0;
+    size_t i;
+
+    for (i = 0; i < SHA1_DIGEST_LENGTH; i++)
+        diff |= a[i] ^ b[i];
+
+    return diff == 0;
+}
+
+/* SASL_CB_SERVER_USERDB_CHECKPASS: SASL_OK if we recently saw the
+ * backend accept this password, otherwise SASL_NOUSER so that SASL goes
+ * on to its configured pwcheck_method */
+EXPORTED int saslcache_checkpass(sasl_conn_t *conn,
+                                 void *context __attribute__((unused)),
+                                 const char *user,
+                                 const char *pass, unsigned passlen,
+                                 struct propctx *propctx __attribute__((unused)))
+{
+    struct saslcache_slot want, *slot;
+    int hit = 0;
+
+    saslcache_reset();
+
+    if (saslcache_ttl() <= 0 || !user || !*user || !pass || !passlen)
+        return SASL_NOUSER;
+    if (saslcache_open()) return SASL_NOUSER;
+
+    saslcache_hash(user, pass, passlen, &want);
+    if (saslcache_isnull(want.verifier)) return SASL_NOUSER;
+    slot = saslcache_slot(want.user);
+
+    if (!lock_shared(saslcache.fd, saslcache.fname)) {
+        hit = slot->expires > (uint32_t) time(NULL) &&
+              saslcache_equal(slot->user, want.user) &&
+              saslcache_equal(slot->verifier, want.verifier);
+        lock_unlock(saslcache.fd, saslcache.fname);
+    }
+
+    if (hit) {
+        syslog(LOG_DEBUG, "saslcache: hit for %s", user);
+        return SASL_OK;
+    }
+
+    /* remember it in case the backend accepts it */
+    saslcache.pending = want;
+    saslcache.pending_user = xstrdup(user);
+    saslcache.pending_conn = conn;
+
+    return SASL_NOUSER;
+}
+
+/* the authentication on 'conn' succeeded: if that was thanks to the
+ * backend checking the password offered for the very user SASL has
+ * now authenticated, cache the result.  Either way, nothing is left
+ * pending afterwards. */
+EXPORTED void saslcache_commit(sasl_conn_t *conn)
+{
+    struct saslcache_slot *slot;
+    const void *authuser = NULL;
+
+    if (!conn || saslcache.pending_conn != conn || !saslcache.base ||
+        !saslcache.pending_user) {
+        saslcache_reset();
+        return;
+    }
+
+    if (sasl_getprop(conn, SASL_AUTHUSER, &authuser) != SASL_OK ||
+        !authuser || strcmp((const char *) authuser, saslcache.pending_user)) {
+        saslcache_reset();
+        return;
+    }
+
+    if (!lock_blocking(saslcache.fd, saslcache.fname)) {
+        slot = saslcache_slot(saslcache.pending.user);
+        memcpy(slot->user, saslcache.pending.user, SHA1_DIGEST_LENGTH);
+        memcpy(slot->verifier, saslcache.pending.verifier, SHA1_DIGEST_LENGTH);
+        slot->expires = time(NULL) + saslcache_ttl();
+
+        lock_unlock(saslcache.fd, saslcache.fname);
+    }
+
+    saslcache_reset();
+}
+
+/* forget the cached password of 'userid', or of everybody if NULL */
+EXPORTED int saslcache_invalidate(const char *userid)
+{
+    struct saslcache_slot want, *slot;
+
+    if (saslcache_open()) return IMAP_IOERROR;
+    if (lock_blocking(saslcache.fd, saslcache.fname)) return IMAP_IOERROR;
+
+    if (userid) {
+        xsha1((const unsigned char *) userid, strlen(userid), want.user);
+        slot = saslcache_slot(want.user);
+        if (saslcache_equal(slot->user, want.user))
+            memset(slot, 0, sizeof(*slot));
+    }
+    else {
+        memset(saslcache.base + sizeof(struct saslcache_header), 0,
+               SASLCACHE_SLOTS * sizeof(struct saslcache_slot));
+    }
+
+    lock_unlock(saslcache.fd, saslcache.fname);
+    return 0;
+}
@@ -43,6 +43,9 @@
 #include <config.h>
 
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <syslog.h>
 #include <string.h>
@@ -50,11 +53,16 @@
 #include <unistd.h>
 #endif
 
+#include "cyrusdb.h"
 #include "index.h"
 #include "message.h"
 #include "global.h"
+#include "user.h"
+#include "exitcodes.h"
+#include "retry.h"
 #include "search_engines.h"
 #include "ptrarray.h"
+#include "xmalloc.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -81,6 +89,7 @@ static const struct search_engine default_search_engine = {
     NULL,
     NULL,
     NULL,
+    NULL,
 };
 
 static const struct search_engine *engine(void)
@@ -143,6 +152,390 @@ static int search_batch_size(void)
             config_getint(IMAPOPT_SEARCH_BATCHSIZE) : INT_MAX);
 }
 
+/*
+ * Parallel text extraction.
+ *
+ * Pulling the text out of a message (MIME parsing, charset conversion,
+ * HTML stripping, iCalendar) is usually far more expensive than adding
+ * it to the index, and only needs the message file.  With
+ * search_extract_workers set, flush_batch() forks that many workers
+ * which each extract every Nth message of the batch into a recording
+ * receiver and stream the recording back over a pipe.  The parent
+ * stays the only writer to the index, replaying the recordings into
+ * the real receiver in the original message order while the workers
+ * carry on with the next messages.
+ *
+ * Each recording is a frame: an int result code, a size_t length, and
+ * then that many bytes of
+ *     'B' part                        begin_part
+ *     'T' len (4 bytes, BE), bytes    append_text
+ *     'E' part                        end_part
+ * where part is a single byte.  The same recordings are kept in the
+ * snippet text store below, so the format doesn't depend on the host.
+ */
+typedef struct {
+    search_text_receiver_t super;
+    struct buf rec;
+    size_t maxpart;     /* keep at most this much text per part, 0 for all */
+    size_t partlen;
+} recording_receiver_t;
+
+static int rec_begin_message(search_text_receiver_t *rx,
+                             message_t *msg __attribute__((unused)))
+{
+    recording_receiver_t *rr = (recording_receiver_t *)rx;
+    buf_reset(&rr->rec);
+    return 0;
+}
+
+static void rec_begin_part(search_text_receiver_t *rx, int part)
+{
+    recording_receiver_t *rr = (recording_receiver_t *)rx;
+    buf_putc(&rr->rec, 'B');
+    buf_putc(&rr->rec, (char) part);
+    rr->partlen = 0;
+}
+
+static void rec_append_text(search_text_receiver_t *rx, const struct buf *text)
+{
+    recording_receiver_t *rr = (recording_receiver_t *)rx;
+    size_t len = buf_len(text);
+    uint32_t netlen;
+
+    if (rr->maxpart) {
+        if (rr->partlen >= rr->maxpart) return;
+        if (len > rr->maxpart - rr->partlen) len = rr->maxpart - rr->partlen;
+        rr->partlen += len;
+    }
+
+    netlen = htonl((uint32_t) len);
+    buf_putc(&rr->rec, 'T');
+    buf_appendmap(&rr->rec, (const char *)&netlen, sizeof(netlen));
+    buf_appendmap(&rr->rec, buf_base(text), len);
+}
+
+static void rec_end_part(search_text_receiver_t *rx, int part)
+{
+    recording_receiver_t *rr = (recording_receiver_t *)rx;
+    buf_putc(&rr->rec, 'E');
+    buf_putc(&rr->rec, (char) part);
+}
+
+static int rec_end_message(search_text_receiver_t *rx __attribute__((unused)))
+{
+    return 0;
+}
+
+static void recording_receiver_init(recording_receiver_t *rr, size_t maxpart)
+{
+    memset(rr, 0, sizeof(*rr));
+    rr->super.begin_message = rec_begin_message;
+    rr->super.begin_part = rec_begin_part;
+    rr->super.append_text = rec_append_text;
+    rr->super.end_part = rec_end_part;
+    rr->super.end_message = rec_end_message;
+    rr->maxpart = maxpart;
+}
+
+static void extract_worker(ptrarray_t *batch, int first, int step, int fd)
+{
+    recording_receiver_t rr;
+    int i;
+
+    recording_receiver_init(&rr, 0);
+
+    for (i = first ; i < batch->count ; i += step) {
+        message_t *msg = ptrarray_nth(batch, i);
+        int r;
+        size_t len;
+
+        buf_reset(&rr.rec);
+        r = index_getsearchtext(msg, &rr.super, 0);
+        len = buf_len(&rr.rec);
+
+        if (retry_write(fd, &r, sizeof(r)) != sizeof(r) ||
+            retry_write(fd, &len, sizeof(len)) != sizeof(len) ||
+            (len && retry_write(fd, buf_base(&rr.rec), len) != (ssize_t) len))
+            _exit(EC_IOERR);
+    }
+
+    /* don't run any exit handlers: they belong to the parent */
+    _exit(0);
+}
+
+static int replay_recording(search_text_receiver_t *rx, message_t *msg,
+                            const struct buf *rec)
+{
+    const char *p = buf_base(rec);
+    const char *end = p + buf_len(rec);
+    struct buf text = BUF_INITIALIZER;
+    uint32_t len;
+    int r;
+
+    r = rx->begin_message(rx, msg);
+    if (r) return r;
+
+    while (p < end) {
+        char op = *p++;
+
+        switch (op) {
+        case 'B':
+        case 'E':
+            if (p == end) goto bad;
+            if (op == 'B')
+                rx->begin_part(rx, (unsigned char) *p);
+            else
+                rx->end_part(rx, (unsigned char) *p);
+            p++;
+            break;
+        case 'T':
+            if ((size_t)(end - p) < sizeof(len)) goto bad;
+            memcpy(&len, p, sizeof(len));
+            len = ntohl(len);
+            p += sizeof(len);
+            if ((size_t)(end - p) < len) goto bad;
+            buf_init_ro(&text, p, len);
+            rx->append_text(rx, &text);
+            p += len;
+            break;
+        default:
+            goto bad;
+        }
+    }
+
+    return rx->end_message(rx);
+
+bad:
+    syslog(LOG_ERR, "IOERROR: search: corrupt text extraction record");
+    return IMAP_IOERROR;
+}
+
+static int extract_batch_parallel(search_text_receiver_t *rx,
+                                  ptrarray_t *batch, int nworkers)
+{
+    pid_t *pids = xzmalloc(nworkers * sizeof(pid_t));
+    int *fds = xmalloc(nworkers * sizeof(int));
+    struct buf rec = BUF_INITIALIZER;
+    int i, w;
+    int r = 0;
+
+    for (w = 0 ; w < nworkers ; w++) {
+        int p[2];
+
+        fds[w] = -1;
+        if (pipe(p) < 0) {
+            syslog(LOG_ERR, "IOERROR: search: pipe: %m");
+            r = IMAP_IOERROR;
+            break;
+        }
+
+        pids[w] = fork();
+        if (pids[w] < 0) {
+            syslog(LOG_ERR, "IOERROR: search: fork: %m");
+            close(p[0]);
+            close(p[1]);
+            pids[w] = 0;
+            r = IMAP_IOERROR;
+            break;
+        }
+        if (!pids[w]) {
+            int j;
+            /* only keep our own write end */
+            for (j = 0 ; j < w ; j++) close(fds[j]);
+            close(p[0]);
+            extract_worker(batch, w, nworkers, p[1]);
+            /* never returns */
+        }
+
+        close(p[1]);
+        fds[w] = p[0];
+    }
+
+    /* replay in the original order: message i comes from worker i%n */
+    for (i = 0 ; !r && i < batch->count ; i++) {
+        message_t *msg = ptrarray_nth(batch, i);
+        int fd = fds[i % nworkers];
+        int mr;
+        size_t len;
+
+        if (retry_read(fd, &mr, sizeof(mr)) != sizeof(mr) ||
+            retry_read(fd, &len, sizeof(len)) != sizeof(len)) {
+            syslog(LOG_ERR, "IOERROR: search: text extraction worker failed");
+            r = IMAP_IOERROR;
+            break;
+        }
+
+        buf_reset(&rec);
+        buf_ensure(&rec, len);
+        if (len && retry_read(fd, rec.s, len) != (ssize_t) len) {
+            syslog(LOG_ERR, "IOERROR: search: text extraction worker failed");
+            r = IMAP_IOERROR;
+            break;
+        }
+        buf_truncate(&rec, len);
+
+        r = mr ? mr : replay_recording(rx, msg, &rec);
+    }
+
+    /* closing the pipes stops any workers we've given up on */
+    for (w = 0 ; w < nworkers ; w++) {
+        if (fds[w] >= 0) close(fds[w]);
+    }
+    for (w = 0 ; w < nworkers ; w++) {
+        if (pids[w] > 0) {
+            while (waitpid(pids[w], NULL, 0) < 0 && errno == EINTR);
+        }
+    }
+
+    buf_free(&rec);
+    free(fds);
+    free(pids);
+
+    return r;
+}
+
+/*
+ * Snippet text store.
+ *
+ * Generating snippets used to mean extracting each hit's text from
+ * scratch, which costs a full MIME parse and decode per message however
+ * little of it ends up in the snippet.  With search_snippet_store_size
+ * set, indexing also records each message's snippet-mode text, at most
+ * that many bytes per part, in a per-user database keyed by message
+ * GUID.  Snippet generation then just replays the recording.
+ */
+#define SNIPPETDB ("twoskip")
+#define SNIPPETDB_SUFFIX "snippets"
+/* the first byte of each record says how the rest is encoded */
+#define SNIPPETDB_PLAIN   'S'
+#define SNIPPETDB_DEFLATE 'Z'
+
+static struct db *snippetdb_open(struct mailbox *mailbox, int create)
+{
+    char *userid = mboxname_to_userid(mailbox->name);
+    struct db *db = NULL;
+    char *fname;
+    int r;
+
+    /* only kept for users' mailboxes */
+    if (!userid) return NULL;
+
+    fname = user_hash_meta(userid, SNIPPETDB_SUFFIX);
+    r = cyrusdb_open(SNIPPETDB, fname, create ? CYRUSDB_CREATE : 0, &db);
+    if (r) {
+        if (r != CYRUSDB_NOTFOUND)
+            syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+                   cyrusdb_strerror(r));
+        db = NULL;
+    }
+
+    free(fname);
+    free(userid);
+    return db;
+}
+
+static void snippetdb_store_batch(struct mailbox *mailbox, ptrarray_t *batch)
+{
+    int maxpart = config_getint(IMAPOPT_SEARCH_SNIPPET_STORE_SIZE);
+    recording_receiver_t rr;
+    struct db *db;
+    struct txn *tid = NULL;
+    int i;
+    int r = 0;
+
+    if (maxpart <= 0) return;
+    if (!(db = snippetdb_open(mailbox, /*create*/1))) return;
+
+    recording_receiver_init(&rr, maxpart);
+
+    for (i = 0 ; !r && i < batch->count ; i++) {
+        message_t *msg = ptrarray_nth(batch, i);
+        const struct message_guid *guid = NULL;
+        const char *key;
+
+        if (message_get_guid(msg, &guid)) continue;
+        key = message_guid_encode(guid);
+
+        /* already stored for a copy of this message elsewhere? */
+        r = cyrusdb_fetch(db, key, strlen(key), NULL, NULL, &tid);
+        if (r != CYRUSDB_NOTFOUND) continue;
+        r = 0;
+
+        buf_reset(&rr.rec);
+        if (index_getsearchtext(msg, &rr.super, /*snippet*/1)) continue;
+
+#ifdef HAVE_ZLIB
+        if (buf_deflate(&rr.rec, 1, DEFLATE_RAW)) continue;
+        buf_insertmap(&rr.rec, 0, (const char []){ SNIPPETDB_DEFLATE }, 1);
+#else
+        buf_insertmap(&rr.rec, 0, (const char []){ SNIPPETDB_PLAIN }, 1);
+#endif
+
+        r = cyrusdb_store(db, key, strlen(key),
+                          buf_base(&rr.rec), buf_len(&rr.rec), &tid);
+    }
+
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: storing snippet text for %s: %s",
+               mailbox->name, cyrusdb_strerror(r));
+        if (tid) cyrusdb_abort(db, tid);
+    }
+    else if (tid) {
+        cyrusdb_commit(db, tid);
+    }
+
+    cyrusdb_close(db);
+    buf_free(&rr.rec);
+}
+
+EXPORTED int search_getsnippettext(message_t *msg,
+                                   search_text_receiver_t *receiver)
+{
+    const struct message_guid *guid = NULL;
+    struct mailbox *mailbox = NULL;
+    struct buf rec = BUF_INITIALIZER;
+    struct db *db = NULL;
+    const char *data = NULL;
+    size_t datalen = 0;
+    const char *key;
+    char encoding = 0;
+    int r;
+
+    if (config_getint(IMAPOPT_SEARCH_SNIPPET_STORE_SIZE) <= 0 ||
+        message_get_mailbox(msg, &mailbox) ||
+        message_get_guid(msg, &guid) ||
+        !(db = snippetdb_open(mailbox, /*create*/0)))
+        goto parse;
+
+    key = message_guid_encode(guid);
+    r = cyrusdb_fetch(db, key, strlen(key), &data, &datalen, NULL);
+    if (!r && datalen) {
+        encoding = data[0];
+        buf_setmap(&rec, data + 1, datalen - 1);
+    }
+    cyrusdb_close(db);
+
+    switch (encoding) {
+    case SNIPPETDB_PLAIN:
+        break;
+#ifdef HAVE_ZLIB
+    case SNIPPETDB_DEFLATE:
+        if (buf_inflate(&rec, DEFLATE_RAW)) goto parse;
+        break;
+#endif
+    default:
+        goto parse;
+    }
+
+    r = replay_recording(receiver, msg, &rec);
+    buf_free(&rec);
+    return r;
+
+parse:
+    buf_free(&rec);
+    return index_getsearchtext(msg, receiver, /*snippet*/1);
+}
+
 /*
  * Flush a batch of messages to the search engine's indexer code.  We
  * drop the index lock during the presumably CPU and IO heavy parts of
@@ -154,6 +547,7 @@ static int flush_batch(search_text_receiver_t *rx,
                        struct mailbox *mailbox,
                        ptrarray_t *batch)
 {
+    int nworkers;
     int i;
     int r = 0;
 
@@ -172,9 +566,23 @@ static int flush_batch(search_text_receiver_t *rx,
                             so we'll fail later anyway */
     }
 
+    nworkers = config_getint(IMAPOPT_SEARCH_EXTRACT_WORKERS);
+    if (nworkers > batch->count) nworkers = batch->count;
+
+    if (nworkers > 1) {
+        r = extract_batch_parallel(rx, batch, nworkers);
+    }
+    else {
+        for (i = 0 ; i < batch->count ; i++) {
+            message_t *msg = ptrarray_nth(batch, i);
+            if (!r) r = index_getsearchtext(msg, rx, 0);
+        }
+    }
+
+    if (!r) snippetdb_store_batch(mailbox, batch);
+
     for (i = 0 ; i < batch->count ; i++) {
         message_t *msg = ptrarray_nth(batch, i);
-        if (!r) r = index_getsearchtext(msg, rx, 0);
         message_unref(&msg);
     }
     ptrarray_truncate(batch, 0);
@@ -294,6 +702,15 @@ EXPORTED int search_compact(const char *userid,
     return (se->compact ? se->compact(userid, tempdir, srctiers, desttier, flags) : 0);
 }
 
+EXPORTED int search_tier_stats(const char *userid,
+                               const strarray_t *srctiers,
+                               struct search_tier_stats *stats)
+{
+    const struct search_engine *se = engine();
+    memset(stats, 0, sizeof(*stats));
+    return (se->tier_stats ? se->tier_stats(userid, srctiers, stats) : 0);
+}
+
 EXPORTED int search_deluser(const char *userid)
 {
     const struct search_engine *se = engine();
@@ -112,6 +112,13 @@ struct search_text_receiver {
     int (*audit_mailbox)(search_text_receiver_t *, bitvector_t *unindexed);
 };
 
+/* what a compaction of some tiers of a user's index would read */
+struct search_tier_stats {
+    unsigned ndbs;              /* number of databases */
+    unsigned long long bytes;   /* total size on disk */
+    unsigned long long docs;    /* total documents */
+};
+
 #define SEARCH_FLAG_CAN_BATCH   (1<<0)
 struct search_engine {
     const char *name;
@@ -147,6 +154,8 @@ struct search_engine {
                    int flags);
     int (*deluser)(const char *userid);
     int (*check_config)(char **errstr);
+    int (*tier_stats)(const char *userid, const strarray_t *srctiers,
+                      struct search_tier_stats *stats);
 };
 
 /*
@@ -175,6 +184,9 @@ search_text_receiver_t *search_begin_snippets(void *internalised,
                                               search_snippet_cb_t proc,
                                               void *rock);
 int search_end_snippets(search_text_receiver_t *rx);
+/* Feed the snippet text of 'msg' to a snippets receiver, from the
+ * snippet text store if it has it or else by extracting it afresh */
+int search_getsnippettext(message_t *msg, search_text_receiver_t *receiver);
 /* Returns a new string which describes the internalised query, and must
  * be free()d by the caller.  Only useful for whitebox testing.  */
 char *search_describe_internalised(void *internalised);
@@ -184,6 +196,8 @@ int search_compact(const char *userid, const char *tempdir,
                    const strarray_t *srctiers, const char *desttier, int verbose);
 int search_deluser(const char *userid);
 int search_check_config(char **errstr);
+int search_tier_stats(const char *userid, const strarray_t *srctiers,
+                      struct search_tier_stats *stats);
 
 
 /* for debugging */
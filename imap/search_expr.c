@@ -46,6 +46,7 @@
 #include <stdlib.h>
 #include <syslog.h>
 #include <string.h>
+#include <math.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -57,9 +58,11 @@
 #include "charset.h"
 #include "annotate.h"
 #include "global.h"
+#include "hashoa.h"
 #include "lsort.h"
 #include "xstrlcpy.h"
 #include "xmalloc.h"
+#include "mpool.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -71,6 +74,7 @@ static search_expr_t **the_rootp;
 static search_expr_t *the_focus;
 #endif
 static unsigned nnodes = 0;
+static struct mpool *exprpool = NULL;
 
 static void split(search_expr_t *e,
                   void (*cb)(const char *, search_expr_t *, search_expr_t *, void *),
@@ -160,9 +164,29 @@ static search_expr_t *interpolate(search_expr_t **prevp, enum search_op op)
  * operation.  If 'parent' is not NULL, the new node is attached as the
  * last child of 'parent'.  Returns a new node, never returns NULL.
  */
+/*
+ * Allocate new nodes from @pool rather than the heap, until called
+ * again with NULL.  The caller owns the pool and must not reset it
+ * while any tree built from it is still in use.  search_expr_free()
+ * still releases the values of pooled nodes, just not the nodes.
+ */
+EXPORTED void search_expr_use_pool(struct mpool *pool)
+{
+    exprpool = pool;
+}
+
 EXPORTED search_expr_t *search_expr_new(search_expr_t *parent, enum search_op op)
 {
-    search_expr_t *e = xzmalloc(sizeof(search_expr_t));
+    search_expr_t *e;
+
+    if (exprpool) {
+        e = mpool_malloc(exprpool, sizeof(search_expr_t));
+        memset(e, 0, sizeof(search_expr_t));
+        e->pooled = 1;
+    }
+    else {
+        e = xzmalloc(sizeof(search_expr_t));
+    }
     e->op = op;
     if (parent) append(parent, e);
     nnodes++;
@@ -198,7 +222,7 @@ EXPORTED void search_expr_free(search_expr_t *e)
         if (e->attr->internalise) e->attr->internalise(NULL, NULL, &e->internalised);
         if (e->attr->free) e->attr->free(&e->value);
     }
-    free(e);
+    if (!e->pooled) free(e);
 }
 
 /*
@@ -2204,7 +2228,7 @@ static int search_text_match(message_t *m, const union search_value *v,
 
 /* ====================================================================== */
 
-static hash_table attrs_by_name = HASH_TABLE_INITIALIZER;
+static hashoa_table attrs_by_name = HASHOA_TABLE_INITIALIZER;
 
 enum search_cost {
     SEARCH_COST_NONE = 0,
@@ -2702,9 +2726,9 @@ EXPORTED void search_attr_init(void)
         }
     };
 
-    construct_hash_table(&attrs_by_name, VECTOR_SIZE(attrs), 0);
+    construct_hashoa_table(&attrs_by_name, VECTOR_SIZE(attrs));
     for (i = 0 ; i < VECTOR_SIZE(attrs) ; i++)
-        hash_insert(attrs[i].name, (void *)&attrs[i], &attrs_by_name);
+        hashoa_insert(attrs[i].name, (void *)&attrs[i], &attrs_by_name);
 
     search_attr_initialized = 1;
 }
@@ -2723,7 +2747,7 @@ EXPORTED const search_attr_t *search_attr_find(const char *name)
 
     strlcpy(tmp, name, sizeof(tmp));
     lcase(tmp);
-    return hash_lookup(tmp, &attrs_by_name);
+    return hashoa_lookup(tmp, &attrs_by_name);
 }
 
 /*
@@ -2765,7 +2789,7 @@ EXPORTED const search_attr_t *search_attr_find_field(const char *field)
         return search_attr_find(field);
 
     key = lcase(strconcat("header:", field, (char *)NULL));
-    attr = (search_attr_t *)hash_lookup(key, &attrs_by_name);
+    attr = (search_attr_t *)hashoa_lookup(key, &attrs_by_name);
 
     if (!attr) {
         attr = (search_attr_t *)xzmalloc(sizeof(search_attr_t));
@@ -2776,7 +2800,7 @@ EXPORTED const search_attr_t *search_attr_find_field(const char *field)
         attr->part = (config_getswitch(IMAPOPT_SEARCH_INDEX_HEADERS)
                         ? SEARCH_PART_HEADERS : -1);
         attr->data1 = strchr(key, ':')+1;
-        hash_insert(attr->name, (void *)attr, &attrs_by_name);
+        hashoa_insert(attr->name, (void *)attr, &attrs_by_name);
         key = NULL;     /* attr takes this over */
     }
 
@@ -2794,3 +2818,283 @@ EXPORTED int search_attr_is_fuzzable(const search_attr_t *attr)
             (attr->flags & SEA_FUZZABLE));
 }
 
+
+/* ====================================================================== */
+
+/*
+ * Cost-based ordering of the evaluation of an expression.
+ *
+ * search_expr_evaluate() short-circuits AND and OR nodes in child
+ * order, so the order of the children decides how many messages each
+ * criterion gets run against.  The normalised order is fixed by
+ * static attribute cost, which knows that a header match is dearer
+ * than a flag test but not that "UNSEEN" in a folder with three unseen
+ * messages throws away nearly everything for almost nothing.
+ *
+ * search_expr_plan() estimates, for each node, the fraction of
+ * messages it will match (its selectivity) from the folder's
+ * statistics, and the cost per message of evaluating it.  It then
+ * orders the children of each AND so that the cheapest per message
+ * rejected run first, and the children of each OR so that the
+ * cheapest per message accepted run first; expensive cache and body
+ * scans only see the messages which survive.  Both orders give the
+ * same result, so this must be done after search_expr_normalise()
+ * has built any cache keys from the tree.
+ */
+
+/* relative cost per message of each search_cost class */
+static const double plan_cost_weights[] = {
+    /* SEARCH_COST_NONE */      0.1,
+    /* SEARCH_COST_INDEX */     1.0,
+    /* SEARCH_COST_CONV */      5.0,
+    /* SEARCH_COST_ANNOT */     10.0,
+    /* SEARCH_COST_CACHE */     20.0,
+    /* SEARCH_COST_BODY */      200.0
+};
+
+/* guesses for criteria with no usable statistics */
+#define PLAN_SEL_MATCH      0.1
+#define PLAN_SEL_ORDINAL    0.5
+
+struct plan_node {
+    search_expr_t *e;
+    double sel;
+    double cost;
+    double rank;
+    int pos;
+};
+
+static double plan_fraction(double n, double total)
+{
+    if (total <= 0) return PLAN_SEL_MATCH;
+    if (n <= 0) return 0.0;
+    if (n >= total) return 1.0;
+    return n / total;
+}
+
+static double plan_systemflags(const struct search_plan_stats *stats,
+                               uint64_t flags)
+{
+    switch (flags) {
+    case FLAG_ANSWERED:
+        return plan_fraction(stats->answered, stats->exists);
+    case FLAG_FLAGGED:
+        return plan_fraction(stats->flagged, stats->exists);
+    case FLAG_DELETED:
+        return plan_fraction(stats->deleted, stats->exists);
+    case FLAG_SEEN:
+        return plan_fraction(stats->exists - stats->unseen, stats->exists);
+    default:
+        return PLAN_SEL_MATCH;
+    }
+}
+
+static double plan_seqset(const struct seqset *seq, unsigned maxval)
+{
+    double n = 0;
+    size_t i;
+
+    if (!seq) return PLAN_SEL_MATCH;
+
+    for (i = 0 ; i < seq->len ; i++) {
+        unsigned high = seq->set[i].high;
+        if (maxval && high > maxval) high = maxval;
+        if (high >= seq->set[i].low)
+            n += high - seq->set[i].low + 1;
+    }
+
+    return plan_fraction(n, maxval);
+}
+
+static double plan_date(const struct search_plan_stats *stats,
+                        enum search_op op, time_t t)
+{
+    double first = stats->first_internaldate;
+    double last = stats->last_internaldate;
+    double below;
+
+    if (!first || last <= first) return PLAN_SEL_ORDINAL;
+
+    /* assume arrivals spread evenly between the oldest and newest */
+    if (t <= first) below = 0.0;
+    else if (t >= last) below = 1.0;
+    else below = (t - first) / (last - first);
+
+    return (op == SEOP_LT || op == SEOP_LE) ? below : 1.0 - below;
+}
+
+static double plan_leaf(const search_expr_t *e,
+                        const struct search_plan_stats *stats)
+{
+    const char *name = e->attr->name;
+
+    switch (e->op) {
+    case SEOP_MATCH:
+        if (!strcmp(name, "systemflags"))
+            return plan_systemflags(stats, e->value.u);
+        if (!strcmp(name, "indexflags")) {
+            if (e->value.u == MESSAGE_SEEN)
+                return plan_fraction(stats->exists - stats->unseen,
+                                     stats->exists);
+            if (e->value.u == MESSAGE_RECENT)
+                return plan_fraction(stats->recent, stats->exists);
+        }
+        if (!strcmp(name, "msgno"))
+            return plan_seqset(e->internalised, stats->exists);
+        if (!strcmp(name, "uid"))
+            return plan_seqset(e->internalised, stats->last_uid);
+        return PLAN_SEL_MATCH;
+
+    case SEOP_LT:
+    case SEOP_LE:
+    case SEOP_GT:
+    case SEOP_GE:
+        if (!strcmp(name, "internaldate") || !strcmp(name, "savedate"))
+            return plan_date(stats, e->op, e->value.t);
+        return PLAN_SEL_ORDINAL;
+
+    default:
+        return PLAN_SEL_MATCH;
+    }
+}
+
+static int plan_node_cmp(const void *a, const void *b)
+{
+    const struct plan_node *pa = a;
+    const struct plan_node *pb = b;
+
+    if (pa->rank < pb->rank) return -1;
+    if (pa->rank > pb->rank) return 1;
+    return pa->pos - pb->pos;
+}
+
+static void plan(search_expr_t *e, const struct search_plan_stats *stats,
+                 double *selp, double *costp)
+{
+    search_expr_t *child;
+    struct plan_node *nodes;
+    double sel, cost, reach;
+    int n, i;
+
+    switch (e->op) {
+    case SEOP_TRUE:
+        *selp = 1.0;
+        *costp = 0.0;
+        return;
+
+    case SEOP_FALSE:
+        *selp = 0.0;
+        *costp = 0.0;
+        return;
+
+    case SEOP_NOT:
+        assert(e->children);
+        plan(e->children, stats, &sel, costp);
+        *selp = 1.0 - sel;
+        return;
+
+    case SEOP_AND:
+    case SEOP_OR:
+        break;
+
+    default:
+        if (!e->attr) {
+            *selp = 1.0;
+            *costp = 0.0;
+            return;
+        }
+        *selp = plan_leaf(e, stats);
+        *costp = plan_cost_weights[e->attr->cost];
+        if (e->op == SEOP_FUZZYMATCH)
+            *costp = plan_cost_weights[SEARCH_COST_BODY];
+        return;
+    }
+
+    for (n = 0, child = e->children ; child ; child = child->next)
+        n++;
+    if (!n) {
+        *selp = (e->op == SEOP_AND) ? 1.0 : 0.0;
+        *costp = 0.0;
+        return;
+    }
+
+    nodes = xmalloc(n * sizeof(*nodes));
+    for (i = 0, child = e->children ; child ; child = child->next, i++) {
+        struct plan_node *pn = &nodes[i];
+        pn->e = child;
+        pn->pos = i;
+        plan(child, stats, &pn->sel, &pn->cost);
+
+        /* cost paid per message this child decides the node for */
+        double decides = (e->op == SEOP_AND) ? 1.0 - pn->sel : pn->sel;
+        pn->rank = decides > 0 ? pn->cost / decides : HUGE_VAL;
+    }
+
+    qsort(nodes, n, sizeof(*nodes), plan_node_cmp);
+
+    /* relink the children in plan order, and work out what the
+     * whole node costs given that each child only sees the messages
+     * which got past the ones before it */
+    e->children = NULL;
+    reach = 1.0;
+    cost = 0.0;
+    for (i = n - 1 ; i >= 0 ; i--) {
+        nodes[i].e->next = e->children;
+        e->children = nodes[i].e;
+    }
+    for (i = 0 ; i < n ; i++) {
+        cost += reach * nodes[i].cost;
+        reach *= (e->op == SEOP_AND) ? nodes[i].sel : 1.0 - nodes[i].sel;
+    }
+    free(nodes);
+
+    *selp = (e->op == SEOP_AND) ? reach : 1.0 - reach;
+    *costp = cost;
+}
+
+static void plan_explain(const search_expr_t *e,
+                         const struct search_plan_stats *stats,
+                         struct buf *buf)
+{
+    search_expr_t *child;
+    double sel, cost;
+
+    /* the tree is already in plan order, so this only re-estimates */
+    plan((search_expr_t *)e, stats, &sel, &cost);
+
+    buf_putc(buf, '(');
+    buf_appendcstr(buf, op_as_string(e->op));
+    if (e->attr) {
+        buf_putc(buf, ' ');
+        buf_appendcstr(buf, e->attr->name);
+        buf_putc(buf, ' ');
+        if (e->attr->serialise)
+            e->attr->serialise(buf, &e->value);
+    }
+    buf_printf(buf, " {sel=%.3g cost=%.3g}", sel, cost);
+    for (child = e->children ; child ; child = child->next) {
+        buf_putc(buf, ' ');
+        plan_explain(child, stats, buf);
+    }
+    buf_putc(buf, ')');
+}
+
+/*
+ * Reorder the children of every AND and OR node in 'e' so that the
+ * evaluation is cheapest for a folder with statistics 'stats'.  'e'
+ * must already have been internalised against that folder.  If
+ * 'explain' is not NULL, a description of the chosen plan with the
+ * estimated selectivity and cost of each node is appended to it.
+ */
+EXPORTED void search_expr_plan(search_expr_t *e,
+                               const struct search_plan_stats *stats,
+                               struct buf *explain)
+{
+    double sel, cost;
+
+    if (!e) return;
+
+    plan(e, stats, &sel, &cost);
+
+    if (explain) plan_explain(e, stats, explain);
+}
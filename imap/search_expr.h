@@ -113,6 +113,7 @@ struct search_expr {
     union search_value value;
     void *internalised;
     int match_guid;
+    int pooled;         /* allocated by search_expr_use_pool's pool */
 };
 
 /* flags for search_expr_get_countability */
@@ -125,6 +126,21 @@ enum {
     SEC_UNCOUNTED =         (1<<30),
 };
 
+/* per-folder statistics for search_expr_plan() */
+struct search_plan_stats {
+    uint32_t exists;
+    uint32_t last_uid;
+    uint32_t unseen;
+    uint32_t recent;
+    uint32_t answered;
+    uint32_t flagged;
+    uint32_t deleted;
+    time_t first_internaldate;
+    time_t last_internaldate;
+};
+
+struct mpool;
+extern void search_expr_use_pool(struct mpool *pool);
 extern search_expr_t *search_expr_new(search_expr_t *parent,
                                       enum search_op);
 extern void search_expr_append(search_expr_t *parent, search_expr_t *child);
@@ -139,6 +155,9 @@ extern int search_expr_normalise(search_expr_t **);
 extern void search_expr_internalise(struct index_state *, search_expr_t *);
 extern int search_expr_always_same(const search_expr_t *);
 extern int search_expr_evaluate(message_t *m, const search_expr_t *);
+extern void search_expr_plan(search_expr_t *,
+                             const struct search_plan_stats *,
+                             struct buf *explain);
 extern int search_expr_uses_attr(const search_expr_t *, const char *);
 extern int search_expr_is_mutable(const search_expr_t *);
 extern unsigned int search_expr_get_countability(const search_expr_t *);
@@ -114,6 +114,15 @@ EXPORTED void search_query_free(search_query_t *query)
     search_expr_free(query->global_sub.expr);
     ptrarray_fini(&query->folders_by_id);
     free_hash_table(&query->folders_by_name, folder_free);
+
+    /* with max_results, the kept MsgData are our own copies */
+    if (query->max_results) {
+        for (i = 0 ; i < query->merged_msgdata.count ; i++) {
+            MsgData *md = ptrarray_nth(&query->merged_msgdata, i);
+            index_msgdata_fini(md);
+            free(md);
+        }
+    }
     ptrarray_fini(&query->merged_msgdata);
 
     /* free pending MsgData arrays */
@@ -416,6 +425,83 @@ static void query_assign_folder_ids(search_query_t *query)
 
 /* ====================================================================== */
 
+/*
+ * With max_results, merged_msgdata is a heap of the best results so
+ * far, with the one which sorts last at the top so it can be replaced
+ * when something better comes along.
+ */
+static int query_heap_cmp(search_query_t *query, int a, int b)
+{
+    return index_msgdata_compare(query->merged_msgdata.data[a],
+                                 query->merged_msgdata.data[b],
+                                 query->sortcrit);
+}
+
+static void query_heap_swap(search_query_t *query, int a, int b)
+{
+    void *tmp = query->merged_msgdata.data[a];
+    query->merged_msgdata.data[a] = query->merged_msgdata.data[b];
+    query->merged_msgdata.data[b] = tmp;
+}
+
+static void query_heap_up(search_query_t *query, int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (query_heap_cmp(query, i, parent) <= 0) break;
+        query_heap_swap(query, i, parent);
+        i = parent;
+    }
+}
+
+static void query_heap_down(search_query_t *query, int i)
+{
+    int n = query->merged_msgdata.count;
+
+    for (;;) {
+        int worst = i;
+        int child = 2 * i + 1;
+        if (child < n && query_heap_cmp(query, child, worst) > 0)
+            worst = child;
+        child++;
+        if (child < n && query_heap_cmp(query, child, worst) > 0)
+            worst = child;
+        if (worst == i) break;
+        query_heap_swap(query, i, worst);
+        i = worst;
+    }
+}
+
+/*
+ * Offer a freshly loaded MsgData to the heap.  Either its contents
+ * are moved into the heap, or they are freed; in both cases the
+ * caller only has to free the MsgData itself.
+ */
+static void query_keep_best(search_query_t *query, MsgData *md)
+{
+    ptrarray_t *heap = &query->merged_msgdata;
+    MsgData *kept;
+
+    if ((unsigned) heap->count < query->max_results) {
+        kept = xmalloc(sizeof(*kept));
+        *kept = *md;
+        ptrarray_append(heap, kept);
+        query_heap_up(query, heap->count - 1);
+        return;
+    }
+
+    kept = ptrarray_nth(heap, 0);
+    if (index_msgdata_compare(md, kept, query->sortcrit) >= 0) {
+        /* sorts after everything we already have */
+        index_msgdata_fini(md);
+        return;
+    }
+
+    index_msgdata_fini(kept);
+    *kept = *md;
+    query_heap_down(query, 0);
+}
+
 static void query_load_msgdata(search_query_t *query,
                                search_folder_t *folder,
                                struct index_state *state,
@@ -426,6 +512,17 @@ static void query_load_msgdata(search_query_t *query,
     struct search_saved_msgdata *saved;
 
     msgdata = index_msgdata_load(state, msgno_list, nmsgs, query->sortcrit, 0, NULL);
+    query->merged_total += nmsgs;
+
+    if (query->max_results) {
+        for (i = 0 ; i < nmsgs ; i++) {
+            msgdata[i]->folder = folder;
+            query_keep_best(query, msgdata[i]);
+        }
+        /* just the array: the contents were kept or freed above */
+        free(msgdata);
+        return;
+    }
 
     /* add the new messages to the global list */
     for (i = 0 ; i < nmsgs ; i++) {
@@ -463,6 +560,8 @@ static void subquery_post_indexed(const char *key, void *data, void *rock)
     unsigned msgno;
     unsigned nmsgs = 0;
     unsigned *msgno_list = NULL;
+    bitvector_t hits = BV_INITIALIZER;
+    int colres;
     int r = 0;
 
     if (query->error) return;
@@ -494,6 +593,8 @@ static void subquery_post_indexed(const char *key, void *data, void *rock)
     if (!state->exists) goto out;
 
     search_expr_internalise(state, sub->expr);
+    index_search_plan(state, sub->expr, query->verbose);
+    colres = index_search_evaluate_columns(state, sub->expr, &hits);
 
     if (query->sortcrit)
         msgno_list = (unsigned *) xmalloc(state->exists * sizeof(unsigned));
@@ -520,7 +621,10 @@ static void subquery_post_indexed(const char *key, void *data, void *rock)
             continue;
 
         /* run the search program */
-        if (!index_search_evaluate(state, sub->expr, msgno))
+        if (colres != INDEX_COLUMNS_NONE && !bv_isset(&hits, msgno))
+            continue;
+        if (colres != INDEX_COLUMNS_EXACT &&
+            !index_search_evaluate(state, sub->expr, msgno))
             continue;
 
         /* we have a new UID that needs to be merged in */
@@ -545,6 +649,7 @@ static void subquery_post_indexed(const char *key, void *data, void *rock)
 out:
     query_end_index(query, &state);
     free(msgno_list);
+    bv_free(&hits);
     if (r) query->error = r;
 }
 
@@ -674,6 +779,8 @@ static int subquery_run_one_folder(search_query_t *query,
     search_folder_t *folder = NULL;
     unsigned nmsgs = 0;
     unsigned *msgno_list = NULL;
+    bitvector_t hits = BV_INITIALIZER;
+    int colres;
     int r = 0;
 
     if (query->verbose) {
@@ -717,6 +824,8 @@ static int subquery_run_one_folder(search_query_t *query,
     if (!state->exists) goto out;
 
     search_expr_internalise(state, e);
+    index_search_plan(state, e, query->verbose);
+    colres = index_search_evaluate_columns(state, e, &hits);
 
     if (query->sortcrit)
         msgno_list = (unsigned *) xmalloc(state->exists * sizeof(unsigned));
@@ -735,7 +844,10 @@ static int subquery_run_one_folder(search_query_t *query,
             continue;
 
         /* run the search program */
-        if (!index_search_evaluate(state, e, msgno))
+        if (colres != INDEX_COLUMNS_NONE && !bv_isset(&hits, msgno))
+            continue;
+        if (colres != INDEX_COLUMNS_EXACT &&
+            !index_search_evaluate(state, e, msgno))
             continue;
 
         if (!folder) {
@@ -769,6 +881,7 @@ static int subquery_run_one_folder(search_query_t *query,
 out:
     if (state) query_end_index(query, &state);
     free(msgno_list);
+    bv_free(&hits);
     return r;
 }
 
@@ -821,10 +934,48 @@ static int subquery_run_global(search_query_t *query, const char *mboxname)
     return r;
 }
 
-static int subquery_run_global_cb(const mbentry_t *mbentry, void *rock)
+static int subquery_collect_global_cb(const mbentry_t *mbentry, void *rock)
 {
-    search_query_t *query = rock;
-    return subquery_run_global(query, mbentry->name);
+    ptrarray_t *mbentries = rock;
+    ptrarray_append(mbentries, mboxlist_entry_copy(mbentry));
+    return 0;
+}
+
+/* Apply the global scan expression to all of the user's folders, in
+ * mailboxes.db order.  Scanning is strictly one folder at a time, but
+ * the kernel is asked to read in the next few folders' files meanwhile
+ * so that a search over cold folders doesn't wait on each one in turn. */
+static int subquery_run_global_all(search_query_t *query, const char *userid)
+{
+    ptrarray_t mbentries = PTRARRAY_INITIALIZER;
+    int ahead = config_getint(IMAPOPT_SEARCH_FOLDER_READAHEAD);
+    unsigned int warmup_flags = WARMUP_INDEX;
+    int i, warmed = 0;
+    int r;
+
+    /* the post-search sort reads the cache records of the matches */
+    if (query->sortcrit) warmup_flags |= WARMUP_CACHE;
+
+    r = mboxlist_usermboxtree(userid, NULL, subquery_collect_global_cb,
+                              &mbentries, /*flags*/0);
+
+    for (i = 0 ; !r && i < mbentries.count ; i++) {
+        mbentry_t *mbentry = ptrarray_nth(&mbentries, i);
+
+        /* warmup failures are logged and otherwise harmless */
+        for ( ; ahead > 0 && warmed <= i + ahead && warmed < mbentries.count ; warmed++)
+            index_warmup(ptrarray_nth(&mbentries, warmed), warmup_flags, NULL);
+
+        r = subquery_run_global(query, mbentry->name);
+    }
+
+    for (i = 0 ; i < mbentries.count ; i++) {
+        mbentry_t *mbentry = ptrarray_nth(&mbentries, i);
+        mboxlist_entry_free(&mbentry);
+    }
+    ptrarray_fini(&mbentries);
+
+    return r;
 }
 
 static search_subquery_t *subquery_new(void)
@@ -906,8 +1057,7 @@ EXPORTED int search_query_run(search_query_t *query)
          * Walk over every folder, applying the scan expression. */
         if (query->multiple) {
             char *userid = mboxname_to_userid(index_mboxname(query->state));
-            r = mboxlist_usermboxtree(userid, NULL, subquery_run_global_cb,
-                                      query, /*flags*/0);
+            r = subquery_run_global_all(query, userid);
             free(userid);
         }
         else {
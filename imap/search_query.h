@@ -108,6 +108,13 @@ struct search_query {
     uint32_t want_mbtype;
     int verbose;
     int ignore_timer;
+    /*
+     * If non-zero and sorting is requested, keep only the first
+     * max_results messages in sort order in merged_msgdata, rather
+     * than loading all of them and sorting at the end.  Useful when
+     * the caller only wants a window at the start of the results.
+     */
+    unsigned max_results;
 
     /*
      * A query comprises multiple sub-queries logically ORed together.
@@ -159,6 +166,11 @@ struct search_query {
      * folder, guid.
      */
     ptrarray_t merged_msgdata;
+    /*
+     * Number of results found when sorting, which may be more than
+     * merged_msgdata holds if max_results is set.
+     */
+    unsigned merged_total;
 };
 
 extern search_query_t *search_query_new(struct index_state *state,
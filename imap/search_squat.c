@@ -77,12 +77,18 @@ struct opstack {
                      * that bit 0 is not meaningful) */
 };
 
+/* An open index file: the base cyrus.squat or one of its deltas */
+typedef struct {
+    SquatSearchIndex *index;
+    int fd;
+} SquatIndexFile;
+
 typedef struct {
     search_builder_t super;
     struct mailbox *mailbox;
     int verbose;
-    SquatSearchIndex *index;
-    int fd;
+    SquatIndexFile *files;
+    int nfiles;
     const char *part_types;
     int found_validity;
     int depth;
@@ -92,6 +98,50 @@ typedef struct {
 
 static const char *squat_strerror(int err);
 
+/* Delta N of a mailbox's index lives next to cyrus.squat as
+ * cyrus.squat.N, numbered from 1 without gaps */
+static char *delta_fname(struct mailbox *mailbox, int n, int isnew)
+{
+    struct buf buf = BUF_INITIALIZER;
+
+    buf_printf(&buf, "%s.%d%s", mailbox_meta_fname(mailbox, META_SQUAT),
+               n, isnew ? ".NEW" : "");
+    return buf_release(&buf);
+}
+
+static int count_deltas(struct mailbox *mailbox)
+{
+    struct stat sb;
+    int n;
+
+    for (n = 0 ; ; n++) {
+        char *fname = delta_fname(mailbox, n+1, 0);
+        int r = stat(fname, &sb);
+        free(fname);
+        if (r < 0) break;
+    }
+
+    return n;
+}
+
+static int open_index_file(const char *fname, SquatIndexFile *file)
+{
+    file->index = NULL;
+    if ((file->fd = open(fname, O_RDONLY)) < 0) {
+        if (errno != ENOENT)
+            syslog(LOG_ERR, "SQUAT failed to open index file %s: %m", fname);
+        return IMAP_IOERROR;   /* probably not found */
+    }
+    if ((file->index = squat_search_open(file->fd)) == NULL) {
+        syslog(LOG_ERR, "SQUAT failed to open index %s: %s",
+               fname, squat_strerror(squat_get_last_error()));
+        close(file->fd);
+        file->fd = -1;
+        return IMAP_IOERROR;
+    }
+    return 0;
+}
+
 static const char * const doctypes_by_part[SEARCH_NUM_PARTS] = {
     "mh",
     "f",
@@ -295,6 +345,7 @@ static void match(search_builder_t *bx, int part, const char *str)
     SquatBuilderData *bb = (SquatBuilderData *)bx;
     struct opstack *parent = opstack_top(bb);
     struct opstack *top;
+    int i;
     int r;
 
 #if DEBUG
@@ -310,15 +361,19 @@ static void match(search_builder_t *bx, int part, const char *str)
     top = opstack_push(bb, /*doesn't matter*/0);
     bb->part_types = doctypes_by_part[part];
 
-    r = squat_search_execute(bb->index, str, strlen(str),
-                             fill_with_hits, bb);
-    if (r != SQUAT_OK) {
-        if (squat_get_last_error() == SQUAT_ERR_SEARCH_STRING_TOO_SHORT)
-            goto out; /* The rest of the search is still viable */
-        syslog(LOG_ERR, "SQUAT string list search failed on string %s "
-                          "with part types %s: %s",
-                          str, bb->part_types, squat_strerror(r));
-        goto out;
+    /* a message's documents are all in exactly one of the files,
+     * so the hits are just the union over the base and deltas */
+    for (i = 0 ; i < bb->nfiles ; i++) {
+        r = squat_search_execute(bb->files[i].index, str, strlen(str),
+                                 fill_with_hits, bb);
+        if (r != SQUAT_OK) {
+            if (squat_get_last_error() == SQUAT_ERR_SEARCH_STRING_TOO_SHORT)
+                goto out; /* The rest of the search is still viable */
+            syslog(LOG_ERR, "SQUAT string list search failed on string %s "
+                              "with part types %s: %s",
+                              str, bb->part_types, squat_strerror(r));
+            goto out;
+        }
     }
     top->valid = 1;
 
@@ -342,9 +397,8 @@ static int run(search_builder_t *bx, search_hit_cb_t proc, void *rock);
 static search_builder_t *begin_search(struct mailbox *mailbox, int opts)
 {
     SquatBuilderData *bb;
-    SquatSearchIndex* index;
-    const char *fname;
-    int fd;
+    SquatIndexFile base;
+    int n;
 
     if ((opts & SEARCH_MULTIPLE)) {
         syslog(LOG_ERR, "Squat does not support multiple-folder searches, sorry");
@@ -352,19 +406,8 @@ static search_builder_t *begin_search(struct mailbox *mailbox, int opts)
         return NULL;
     }
 
-    fname = mailbox_meta_fname(mailbox, META_SQUAT);
-    if ((fd = open(fname, O_RDONLY)) < 0) {
-        if (errno != ENOENT)
-            syslog(LOG_ERR, "SQUAT failed to open index file %s: %s",
-                   fname, squat_strerror(squat_get_last_error()));
+    if (open_index_file(mailbox_meta_fname(mailbox, META_SQUAT), &base))
         return NULL;   /* probably not found. Just bail */
-    }
-    if ((index = squat_search_open(fd)) == NULL) {
-        syslog(LOG_ERR, "SQUAT failed to open index %s: %s",
-               fname, squat_strerror(squat_get_last_error()));
-        close(fd);
-        return NULL;
-    }
 
     bb = xzmalloc(sizeof(SquatBuilderData));
     bb->super.begin_boolean = begin_boolean;
@@ -375,8 +418,22 @@ static search_builder_t *begin_search(struct mailbox *mailbox, int opts)
 
     bb->mailbox = mailbox;
     bb->verbose = (opts & _SEARCH_VERBOSE_MASK);
-    bb->index = index;
-    bb->fd = fd;
+    bb->files = xmalloc(sizeof(SquatIndexFile));
+    bb->files[0] = base;
+    bb->nfiles = 1;
+
+    /* and any deltas written since the base was last rebuilt.  If one
+     * has gone away under us, its messages are just seen as unindexed */
+    for (n = 1 ; ; n++) {
+        SquatIndexFile delta;
+        char *fname = delta_fname(mailbox, n, 0);
+        int r = open_index_file(fname, &delta);
+        free(fname);
+        if (r) break;
+
+        bb->files = xrealloc(bb->files, (n+1) * sizeof(SquatIndexFile));
+        bb->files[bb->nfiles++] = delta;
+    }
 
     /* Push a boolean node on the stack -- this will be used
      * at the end of the search to OR in any unindexed messages */
@@ -388,25 +445,29 @@ static search_builder_t *begin_search(struct mailbox *mailbox, int opts)
 static int add_unindexed(SquatBuilderData *bb)
 {
     struct opstack *top = opstack_top(bb);
+    int i;
     int r = 0;
 
     top = opstack_push(bb, /*doesn't matter*/0);
     bv_setall(&top->msg_vector);
     bv_clear(&top->msg_vector, 0);  /* UID 0 is not valid */
     bb->part_types = "tfcbsmh";
-    bb->found_validity = 0;
 
-    r = squat_search_list_docs(bb->index, drop_indexed_docs, bb);
-    if (r != SQUAT_OK) {
-        syslog(LOG_ERR, "SQUAT failed to get list of indexed documents: %s",
-               squat_strerror(r));
-        r = IMAP_IOERROR;
-        goto out;
-    }
-    if (!bb->found_validity) {
-        syslog(LOG_ERR, "SQUAT didn't find validity record");
-        r = IMAP_IOERROR;
-        goto out;
+    for (i = 0 ; i < bb->nfiles ; i++) {
+        bb->found_validity = 0;
+
+        r = squat_search_list_docs(bb->files[i].index, drop_indexed_docs, bb);
+        if (r != SQUAT_OK) {
+            syslog(LOG_ERR, "SQUAT failed to get list of indexed documents: %s",
+                   squat_strerror(r));
+            r = IMAP_IOERROR;
+            goto out;
+        }
+        if (!bb->found_validity) {
+            syslog(LOG_ERR, "SQUAT didn't find validity record");
+            r = IMAP_IOERROR;
+            goto out;
+        }
     }
     top->valid = 1;
     r = 0;
@@ -456,11 +517,15 @@ out:
 static void end_search(search_builder_t *bx)
 {
     SquatBuilderData *bb = (SquatBuilderData *)bx;
+    int i;
 
     while (bb->depth) opstack_pop(bb);
     free(bb->stack);
-    if (bb->index) squat_search_close(bb->index);
-    if (bb->fd >= 0) close(bb->fd);
+    for (i = 0 ; i < bb->nfiles ; i++) {
+        squat_search_close(bb->files[i].index);
+        close(bb->files[i].fd);
+    }
+    free(bb->files);
     free(bx);
 }
 
@@ -483,11 +548,23 @@ static void end_search(search_builder_t *bx)
   the UIDs have been renumbered since we created the index (in which
   case the index is useless and is ignored).
 
-  Updating creates new indexes for one or more mailboxes. (We do not
-  support true incremental updates to an index yet.) The index is created
-  in "cyrus.squat.tmp" and then, if creation was successful, it is
-  atomically renamed to "cyrus.squat". This guarantees that we don't
+  Updating creates new indexes for one or more mailboxes. The index is
+  created in "cyrus.squat.NEW" and then, if creation was successful, it
+  is atomically renamed to "cyrus.squat". This guarantees that we don't
   interfere with anyone who has the old index open.
+
+  Rewriting the whole trie makes that cost O(mailbox size) even when
+  only a few messages arrived, so an incremental update instead writes
+  just the new messages into a delta index "cyrus.squat.N", which has
+  the same format as the base (validity record included) and is created
+  and renamed into place the same way.  Deltas are numbered from 1 with
+  no gaps.  Searches run against the base and every delta and take the
+  union of the hits; each message's documents are in exactly one file.
+  Once search_squat_maxdeltas deltas have built up, the next update
+  merges them by rebuilding the base from the old base plus every
+  message not in it, and then removes the deltas.  A delta that is
+  missing or removed under a reader only makes its messages look
+  unindexed, which is always safe.
 */
 
 /* These stats are gathered 1) per mailbox and 2) for the whole operation. */
@@ -509,6 +586,8 @@ typedef struct {
     int fd;
     SquatSearchIndex *old_index;
     int old_fd;
+    int delta;          /* number of the delta being written, 0 for base */
+    int ndeltas;        /* deltas to remove once the base is replaced */
     struct mailbox *mailbox;
     int valid;
     uint32_t uidvalidity;
@@ -752,24 +831,106 @@ static int doc_check(void *closure, const SquatListDoc *doc)
     return (0);
 }
 
+static int list_doc_check(void *closure, const SquatListDoc *doc)
+{
+    doc_check(closure, doc);
+    return SQUAT_CALLBACK_CONTINUE;
+}
+
+/* Record in d->indexed which UIDs are in the index file 'fname',
+ * checking its validity record.  Returns 0 if the file is usable. */
+static int scan_indexed(SquatReceiverData *d, struct mailbox *mailbox,
+                        const char *fname)
+{
+    SquatIndexFile file;
+    int s;
+
+    if (open_index_file(fname, &file))
+        return IMAP_IOERROR;
+
+    d->valid = 1;
+    d->uidvalidity = 0L;
+    s = squat_search_list_docs(file.index, list_doc_check, d);
+    squat_search_close(file.index);
+    close(file.fd);
+
+    if (s != SQUAT_OK || !d->valid ||
+        d->uidvalidity != mailbox->i.uidvalidity) {
+        syslog(LOG_ERR, "squat: unusable index %s for mailbox %s",
+               fname, mailbox->name);
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
+/* write an empty document at the beginning to record the validity nonce */
+static int write_validity(SquatReceiverData *d, SquatIndex *index,
+                          struct mailbox *mailbox)
+{
+    int s;
+
+    snprintf(d->doc_name, sizeof(d->doc_name),
+             "validity.%u", mailbox->i.uidvalidity);
+    s = squat_index_open_document(index, d->doc_name);
+    if (s != SQUAT_OK) {
+        syslog(LOG_ERR, "squat: cannot write uidvalidity nonce: %s",
+               squat_strerror(s));
+        return IMAP_IOERROR;
+    }
+    s = squat_index_close_document(index);
+    if (s != SQUAT_OK) {
+        syslog(LOG_ERR, "squat: cannot close document for "
+                        "uidvalidity nonce: %s",
+                        squat_strerror(s));
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
 static int begin_mailbox(search_text_receiver_t *rx,
                          struct mailbox *mailbox,
                          int incremental)
 {
     SquatReceiverData *d = (SquatReceiverData *)rx;
     SquatOptions options;
-    const char *filename;
+    char *filename = NULL;
     const char *old_filename;
     int fd = -1;
     int old_fd = -1;
     SquatIndex *index = NULL;
     SquatSearchIndex *old_index = NULL;
+    int maxdeltas = config_getint(IMAPOPT_SEARCH_SQUAT_MAXDELTAS);
+    int ndeltas = count_deltas(mailbox);
+    int delta = 0;
+    int n;
     int r = 0;      /* IMAP error code */
-    int s = 0;      /* SQUAT error code */
 
     bv_clearall(&d->indexed);
 
-    filename = mailbox_meta_newfname(mailbox, META_SQUAT);
+    old_filename = mailbox_meta_fname(mailbox, META_SQUAT);
+
+    if (incremental && ndeltas < maxdeltas) {
+        /* Cheap path: put just the messages which are in neither the
+         * base nor any delta into a new delta */
+        delta = ndeltas + 1;
+        if (scan_indexed(d, mailbox, old_filename))
+            delta = 0;
+        for (n = 1 ; delta && n <= ndeltas ; n++) {
+            char *fname = delta_fname(mailbox, n, 0);
+            if (scan_indexed(d, mailbox, fname))
+                delta = 0;
+            free(fname);
+        }
+        if (!delta) bv_clearall(&d->indexed);
+    }
+
+    if (delta)
+        filename = delta_fname(mailbox, delta, 1);
+    else
+        filename = xstrdup(mailbox_meta_newfname(mailbox, META_SQUAT));
+
     if ((fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0666)) < 0) {
         syslog(LOG_ERR, "squat: unable to create temporary index file %s: %m",
                filename);
@@ -789,8 +950,12 @@ static int begin_mailbox(search_text_receiver_t *rx,
         goto out;
     }
 
+    if (delta) {
+        r = write_validity(d, index, mailbox);
+        goto out;
+    }
+
     /* Open existing index if it exists */
-    old_filename = mailbox_meta_fname(mailbox, META_SQUAT);
     if (incremental) {
         old_fd = open(old_filename, O_RDONLY);
         /* Silently ignore errors opening the old fd or index
@@ -806,6 +971,8 @@ static int begin_mailbox(search_text_receiver_t *rx,
     if (incremental) {
         /* Copy existing document names verbatim. They end up with the same
          * doc_IDs as in the old index, which makes trie copying much simpler.
+         * Messages which are only in the deltas get indexed again, which
+         * merges them into the new base.
          */
         d->valid = 1;
         d->uidvalidity = 0L;
@@ -832,26 +999,7 @@ static int begin_mailbox(search_text_receiver_t *rx,
 
     if (!incremental) {
         bv_clearall(&d->indexed);
-
-        /* write an empty document at the beginning to record the validity
-           nonce */
-        snprintf(d->doc_name, sizeof(d->doc_name),
-                 "validity.%u", mailbox->i.uidvalidity);
-        s = squat_index_open_document(index, d->doc_name);
-        if (s != SQUAT_OK) {
-            syslog(LOG_ERR, "squat: cannot write uidvalidity nonce: %s",
-                   squat_strerror(s));
-            r = IMAP_IOERROR;
-            goto out;
-        }
-        s = squat_index_close_document(index);
-        if (s != SQUAT_OK) {
-            syslog(LOG_ERR, "squat: cannot close document for "
-                            "uidvalidity nonce: %s",
-                            squat_strerror(s));
-            r = IMAP_IOERROR;
-            goto out;
-        }
+        r = write_validity(d, index, mailbox);
     }
 
 out:
@@ -877,9 +1025,13 @@ out:
         d->old_index = old_index;
         d->old_fd = old_fd;
 
+        d->delta = delta;
+        d->ndeltas = delta ? 0 : ndeltas;
+
         d->mailbox = mailbox;
         start_stats(&d->mailbox_stats);
     }
+    free(filename);
     return r;
 }
 
@@ -940,8 +1092,34 @@ static int end_mailbox(search_text_receiver_t *rx,
 
     /* OK, we successfully created the index under the temporary file name.
        Let's rename it to make it the real index. */
-    r = mailbox_meta_rename(d->mailbox, META_SQUAT);
-    if (r) goto out;
+    if (d->delta) {
+        char *newfname = delta_fname(d->mailbox, d->delta, 1);
+        char *fname = delta_fname(d->mailbox, d->delta, 0);
+
+        if (!d->mailbox_stats.indexed_messages) {
+            /* nothing new, don't leave an empty delta behind */
+            unlink(newfname);
+        }
+        else if (rename(newfname, fname) < 0) {
+            syslog(LOG_ERR, "IOERROR: renaming %s: %m", newfname);
+            r = IMAP_IOERROR;
+        }
+        free(newfname);
+        free(fname);
+        if (r) goto out;
+    }
+    else {
+        r = mailbox_meta_rename(d->mailbox, META_SQUAT);
+        if (r) goto out;
+
+        /* the new base has everything the deltas had */
+        while (d->ndeltas) {
+            char *fname = delta_fname(d->mailbox, d->ndeltas--, 0);
+            if (unlink(fname) < 0 && errno != ENOENT)
+                syslog(LOG_ERR, "IOERROR: unlinking %s: %m", fname);
+            free(fname);
+        }
+    }
 
     if (d->verbose) {
         stop_stats(&d->mailbox_stats);
@@ -1016,5 +1194,6 @@ const struct search_engine squat_search_engine = {
     /* compact */NULL,
     /* deluser */NULL,
     /* check_config */NULL,
+    /* tier_stats */NULL,
 };
 
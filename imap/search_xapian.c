@@ -72,6 +72,7 @@
 #include "cyr_lock.h"
 #include "xapian_wrap.h"
 #include "command.h"
+#include "prometheus.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -1419,6 +1420,21 @@ struct xapian_update_receiver
     strarray_t *activetiers;
     hash_table cached_seqs;
     int mode;
+
+    /* open transaction, possibly spanning several mailboxes of one user */
+    char *txn_userid;
+    char *txn_part;
+    size_t uncommitted_bytes;
+    struct timeval txn_start;
+    ptrarray_t pending;         /* struct pending_indexed */
+};
+
+/* indexed ranges of mailboxes whose documents are in the open transaction
+ * but not yet committed; written out after the commit */
+struct pending_indexed {
+    char *mboxname;
+    uint32_t uidvalidity;
+    struct seqset *indexed;
 };
 
 /* receiver used for extracting snippets after a search */
@@ -1549,31 +1565,95 @@ out:
     return r;
 }
 
-static int flush(search_text_receiver_t *rx)
+/*
+ * Should the open transaction be committed now?  Documents from several
+ * mailboxes of the same user are grouped into one Xapian commit, bounded
+ * by document count, size and age - each commit is fsync-heavy, and
+ * users with thousands of small folders would otherwise pay for one per
+ * folder.
+ */
+static int commit_due(xapian_update_receiver_t *tr)
+{
+    int maxdocs = config_getint(IMAPOPT_SEARCH_COMMIT_MAXDOCS);
+    int maxsize = config_getint(IMAPOPT_SEARCH_COMMIT_MAXSIZE);
+    int maxtime = config_getint(IMAPOPT_SEARCH_COMMIT_MAXTIME);
+    struct timeval now;
+
+    if (!tr->uncommitted) return 0;
+
+    if (maxdocs <= 0 || tr->uncommitted >= (unsigned) maxdocs)
+        return 1;
+
+    if (maxsize > 0 && tr->uncommitted_bytes >= (size_t) maxsize * 1024)
+        return 1;
+
+    if (maxtime > 0) {
+        gettimeofday(&now, NULL);
+        if (timesub(&tr->txn_start, &now) >= maxtime)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void free_pending(xapian_update_receiver_t *tr)
+{
+    int i;
+
+    for (i = 0; i < tr->pending.count; i++) {
+        struct pending_indexed *pi = ptrarray_nth(&tr->pending, i);
+        free(pi->mboxname);
+        seqset_free(pi->indexed);
+        free(pi);
+    }
+    ptrarray_truncate(&tr->pending, 0);
+}
+
+/* commit the open transaction and record what it indexed */
+static int commit_txn(xapian_update_receiver_t *tr)
 {
-    xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
     int r = 0;
+    int i;
     struct timeval start, end;
 
     if (tr->uncommitted) {
+        double secs;
+
         assert(tr->dbw);
 
         gettimeofday(&start, NULL);
         r = xapian_dbw_commit_txn(tr->dbw);
         if (r) goto out;
         gettimeofday(&end, NULL);
+        secs = timesub(&start, &end);
+
+        syslog(LOG_INFO, "Xapian committed %u updates (%llu bytes, "
+                         "%d mailboxes) in %.6f sec",
+                    tr->uncommitted, (unsigned long long) tr->uncommitted_bytes,
+                    tr->pending.count + (tr->super.mailbox ? 1 : 0), secs);
 
-        syslog(LOG_INFO, "Xapian committed %u updates in %.6f sec",
-                    tr->uncommitted, timesub(&start, &end));
+        prometheus_increment(CYRUS_SEARCH_XAPIAN_COMMITS_TOTAL);
+        prometheus_apply_delta(CYRUS_SEARCH_XAPIAN_COMMITTED_DOCUMENTS_TOTAL,
+                               tr->uncommitted);
+        prometheus_apply_delta(CYRUS_SEARCH_XAPIAN_COMMIT_SECONDS_TOTAL, secs);
 
         tr->uncommitted = 0;
+        tr->uncommitted_bytes = 0;
         tr->commits++;
     }
 
     /* We write out the indexed list for the mailbox only after successfully
      * updating the index, to avoid a future instance not realising that
      * there are unindexed messages should we fail to index */
-    if (tr->indexed) {
+    for (i = 0; i < tr->pending.count; i++) {
+        struct pending_indexed *pi = ptrarray_nth(&tr->pending, i);
+        r = write_indexed(strarray_nth(tr->activedirs, 0),
+                          pi->mboxname, pi->uidvalidity,
+                          pi->indexed, tr->super.verbose);
+        if (r) goto out;
+    }
+
+    if (tr->indexed && tr->super.mailbox) {
         r = write_indexed(strarray_nth(tr->activedirs, 0),
                           tr->super.mailbox->name, tr->super.mailbox->i.uidvalidity,
                           tr->indexed, tr->super.verbose);
@@ -1581,9 +1661,58 @@ static int flush(search_text_receiver_t *rx)
     }
 
 out:
+    free_pending(tr);
     return r;
 }
 
+/* close the database and drop the locks held for the transaction */
+static void release_txn(xapian_update_receiver_t *tr)
+{
+    if (tr->dbw) {
+        xapian_dbw_close(tr->dbw);
+        tr->dbw = NULL;
+    }
+
+    /* don't unlock until DB is committed */
+    if (tr->activefile) {
+        mappedfile_unlock(tr->activefile);
+        mappedfile_close(&tr->activefile);
+        tr->activefile = NULL;
+    }
+
+    /* Release xapian db named lock */
+    if (tr->xapiandb_namelock) {
+        mboxname_release(&tr->xapiandb_namelock);
+        tr->xapiandb_namelock = NULL;
+    }
+
+    if (tr->activedirs) {
+        strarray_free(tr->activedirs);
+        tr->activedirs = NULL;
+    }
+    if (tr->activetiers) {
+        strarray_free(tr->activetiers);
+        tr->activetiers = NULL;
+    }
+
+    free_pending(tr);
+    tr->uncommitted = 0;
+    tr->uncommitted_bytes = 0;
+    xzfree(tr->txn_userid);
+    xzfree(tr->txn_part);
+}
+
+static int flush(search_text_receiver_t *rx)
+{
+    xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
+
+    /* keep filling the transaction until the commit policy says stop */
+    if (tr->uncommitted && !commit_due(tr))
+        return 0;
+
+    return commit_txn(tr);
+}
+
 static int audit_mailbox(search_text_receiver_t *rx, bitvector_t *unindexed)
 {
     xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
@@ -1743,11 +1872,13 @@ static int end_message_update(search_text_receiver_t *rx)
         seg = (struct segment *)ptrarray_nth(&tr->super.segs, i);
         r = xapian_dbw_doc_part(tr->dbw, &seg->text, seg->part);
         if (r) goto out;
+        tr->uncommitted_bytes += seg->text.len;
     }
 
     if (!tr->uncommitted) {
         r = xapian_dbw_begin_txn(tr->dbw);
         if (r) goto out;
+        gettimeofday(&tr->txn_start, NULL);
     }
     r = xapian_dbw_end_doc(tr->dbw);
     if (r) goto out;
@@ -1770,6 +1901,7 @@ static int begin_mailbox_update(search_text_receiver_t *rx,
     int r = IMAP_IOERROR;
     char *namelock_fname = NULL;
     char *userid = NULL;
+    int mode;
 
     /* not an indexable mailbox, fine - return a code to avoid
      * trying to index each message as well */
@@ -1782,6 +1914,24 @@ static int begin_mailbox_update(search_text_receiver_t *rx,
     userid = mboxname_to_userid(mailbox->name);
     if (!userid) goto out;
 
+    mode = (flags & (SEARCH_UPDATE_XAPINDEXED|SEARCH_UPDATE_AUDIT)) ?
+        XAPIAN_DBW_XAPINDEXED : XAPIAN_DBW_CONVINDEXED;
+
+    /* still holding a transaction open from a previous mailbox? */
+    if (tr->txn_userid) {
+        if (!strcmp(tr->txn_userid, userid) &&
+            !strcmpsafe(tr->txn_part, mailbox->part) && tr->mode == mode) {
+            /* same user's index: keep adding to it */
+            r = 0;
+            goto mailbox;
+        }
+
+        r = commit_txn(tr);
+        release_txn(tr);
+        if (r) goto out;
+        r = IMAP_IOERROR;
+    }
+
     /* Get a shared namelock */
     namelock_fname = xapiandb_namelock_fname_from_userid(userid);
 
@@ -1819,8 +1969,7 @@ static int begin_mailbox_update(search_text_receiver_t *rx,
         goto out;
     }
 
-    tr->mode = (flags & (SEARCH_UPDATE_XAPINDEXED|SEARCH_UPDATE_AUDIT)) ?
-        XAPIAN_DBW_XAPINDEXED : XAPIAN_DBW_CONVINDEXED;
+    tr->mode = mode;
 
     /* doesn't matter if the first one doesn't exist yet, we'll create it. Only stat the others if we're going
      * to be opening them */
@@ -1840,6 +1989,10 @@ static int begin_mailbox_update(search_text_receiver_t *rx,
         if (r) goto out;
     }
 
+    tr->txn_userid = xstrdup(userid);
+    tr->txn_part = xstrdupnull(mailbox->part);
+
+mailbox:
     /* read the indexed data from every directory so know what still needs indexing */
     tr->oldindexed = seqset_init(0, SEQ_MERGE);
 
@@ -1977,13 +2130,26 @@ static int is_indexed(search_text_receiver_t *rx, message_t *msg)
 }
 
 static int end_mailbox_update(search_text_receiver_t *rx,
-                              struct mailbox *mailbox
-                            __attribute__((unused)))
+                              struct mailbox *mailbox)
 {
     xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
     int r = 0;
 
-    r = flush(rx);
+    if (tr->txn_userid && tr->uncommitted && !commit_due(tr)) {
+        /* leave the transaction open for the user's next mailbox;
+         * remember what to write to cyrus.indexed.db once committed */
+        if (tr->indexed) {
+            struct pending_indexed *pi = xzmalloc(sizeof(struct pending_indexed));
+            pi->mboxname = xstrdup(mailbox->name);
+            pi->uidvalidity = mailbox->i.uidvalidity;
+            pi->indexed = tr->indexed;
+            ptrarray_append(&tr->pending, pi);
+            tr->indexed = NULL;
+        }
+    }
+    else {
+        r = commit_txn(tr);
+    }
 
     /* flush before cleaning up, since indexed data is written by flush */
     if (tr->indexed) {
@@ -1997,32 +2163,8 @@ static int end_mailbox_update(search_text_receiver_t *rx,
 
     tr->super.mailbox = NULL;
 
-    if (tr->dbw) {
-        xapian_dbw_close(tr->dbw);
-        tr->dbw = NULL;
-    }
-
-    /* don't unlock until DB is committed */
-    if (tr->activefile) {
-        mappedfile_unlock(tr->activefile);
-        mappedfile_close(&tr->activefile);
-        tr->activefile = NULL;
-    }
-
-    /* Release xapian db named lock */
-    if (tr->xapiandb_namelock) {
-        mboxname_release(&tr->xapiandb_namelock);
-        tr->xapiandb_namelock = NULL;
-    }
-
-    if (tr->activedirs) {
-        strarray_free(tr->activedirs);
-        tr->activedirs = NULL;
-    }
-    if (tr->activetiers) {
-        strarray_free(tr->activetiers);
-        tr->activetiers = NULL;
-    }
+    if (r || !tr->uncommitted)
+        release_txn(tr);
 
     return r;
 }
@@ -2063,11 +2205,18 @@ static void free_receiver(xapian_receiver_t *tr)
 static int end_update(search_text_receiver_t *rx)
 {
     xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
+    int r;
+
+    /* commit anything still batched up from the last mailboxes */
+    r = commit_txn(tr);
+    release_txn(tr);
+    ptrarray_fini(&tr->pending);
+
     free_hash_table(&tr->cached_seqs, (void(*)(void*))seqset_free);
 
     free_receiver(&tr->super);
 
-    return 0;
+    return r;
 }
 
 static int begin_mailbox_snippets(search_text_receiver_t *rx,
@@ -2310,6 +2459,101 @@ out:
     return 0;
 }
 
+static int tier_stats(const char *userid, const strarray_t *srctiers,
+                      struct search_tier_stats *stats)
+{
+    char *mboxname = mboxname_user_mbox(userid, NULL);
+    struct mboxlist_entry *mbentry = NULL;
+    char *fname = NULL;
+    DIR *dirh = NULL;
+    struct dirent *de;
+    struct stat sb;
+    strarray_t *active = NULL;
+    strarray_t *tochange = NULL;
+    strarray_t *dirs = NULL;
+    struct mappedfile *activefile = NULL;
+    struct mboxlock *xapiandb_namelock = NULL;
+    char *namelock_fname = NULL;
+    int r;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    r = mboxlist_lookup(mboxname, &mbentry, NULL);
+    if (r == IMAP_MAILBOX_NONEXISTENT) {
+        /* no user, no worries */
+        r = 0;
+        goto out;
+    }
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: failed to lookup %s", mboxname);
+        goto out;
+    }
+
+    /* Get a shared namelock */
+    namelock_fname = xapiandb_namelock_fname_from_userid(userid);
+
+    r = mboxname_lock(namelock_fname, &xapiandb_namelock, LOCK_SHARED);
+    if (r) {
+        syslog(LOG_ERR, "Could not acquire shared namelock on %s\n",
+               namelock_fname);
+        goto out;
+    }
+
+    /* Get a readlock on the activefile */
+    active = activefile_open(mboxname, mbentry->partition, &activefile, AF_LOCK_READ);
+    if (!active) goto out;
+
+    /* only the databases a compaction of these tiers would read */
+    tochange = activefile_filter(active, srctiers, mbentry->partition);
+    dirs = activefile_resolve(mboxname, mbentry->partition, tochange,
+                              /*dostat*/1, NULL/*resultitems*/);
+    if (!dirs || !dirs->count) goto out;
+
+    stats->ndbs = dirs->count;
+
+    for (i = 0; i < dirs->count; i++) {
+        const char *basedir = strarray_nth(dirs, i);
+
+        dirh = opendir(basedir);
+        if (!dirh) continue;
+
+        while ((de = readdir(dirh))) {
+            if (de->d_name[0] == '.') continue;
+            free(fname);
+            fname = strconcat(basedir, "/", de->d_name, (char *)NULL);
+            if (!stat(fname, &sb) && S_ISREG(sb.st_mode))
+                stats->bytes += sb.st_size;
+        }
+
+        closedir(dirh);
+        dirh = NULL;
+    }
+
+    r = xapian_db_doccount((const char **)dirs->data, &stats->docs);
+
+out:
+    if (activefile) {
+        mappedfile_unlock(activefile);
+        mappedfile_close(&activefile);
+    }
+
+    if (xapiandb_namelock) {
+        mboxname_release(&xapiandb_namelock);
+        xapiandb_namelock = NULL;
+    }
+
+    strarray_free(active);
+    strarray_free(tochange);
+    strarray_free(dirs);
+    free(fname);
+    free(namelock_fname);
+    mboxlist_entry_free(&mbentry);
+    free(mboxname);
+
+    return r;
+}
+
 struct mbfilter {
     const char *userid;
     struct bloom bloom;
@@ -2430,7 +2674,8 @@ static int create_filter(const strarray_t *srcpaths, const strarray_t *destpaths
             goto done;
         }
 
-        r = cyrusdb_foreach(cstate->db, "G", 1, NULL, bloomadd_cb, &filter->bloom, NULL);
+        r = cyrusdb_foreach(cstate->guiddb ? cstate->guiddb : cstate->db,
+                            "G", 1, NULL, bloomadd_cb, &filter->bloom, NULL);
     }
 
 done:
@@ -3113,5 +3358,6 @@ const struct search_engine xapian_search_engine = {
     compact_dbs,
     delete_user,  /* XXX: fixme */
     check_config,
+    tier_stats,
 };
 
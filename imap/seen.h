@@ -44,6 +44,7 @@
 #define SEEN_H
 
 struct seen;
+struct seqset;
 
 #define SEEN_CREATE 0x01
 #define SEEN_SILENT 0x02
@@ -73,6 +74,11 @@ int seen_foreach(struct seen *db, seenproc_t *func, void *rock);
 int seen_read(struct seen *seendb, const char *uniqueid,
               struct seendata *data);
 
+/* same, but return the seen uids as a seqset in '*seqp' rather than
+   as a string in data->seenuids, which is left NULL */
+int seen_read_seqset(struct seen *seendb, const char *uniqueid,
+                     struct seendata *data, struct seqset **seqp);
+
 /* read an entry from 'seendb' and leave that record (or some superset
    of it) locked for update */
 int seen_lockread(struct seen *seendb, const char *uniqueid,
@@ -65,6 +65,7 @@
 #include "seen.h"
 #include "sync_log.h"
 #include "imparse.h"
+#include "sequence.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -74,9 +75,22 @@
 
 enum {
     SEEN_VERSION = 1,
+    SEEN_VERSION_COMPACT = 2,   /* seenuids stored with seqset_encode() */
+    SEEN_VERSION_DELTA = 3,     /* changes against a separate base set */
     SEEN_DEBUG = 0
 };
 
+/* The base set of a SEEN_VERSION_DELTA record is stored, encoded, under
+ * the mailbox uniqueid with this suffix, so it sorts straight after the
+ * record itself.  The record holds the UIDs added to and removed from
+ * the base since it was written, so a small change to a large set only
+ * rewrites the small record.  Sets which encode to less than
+ * SEEN_DELTA_MIN bytes aren't worth splitting, and the base is rewritten
+ * once the changes reach 1/SEEN_DELTA_RATIO of its size. */
+#define SEEN_BASE_SUFFIX ".base"
+#define SEEN_DELTA_MIN 512
+#define SEEN_DELTA_RATIO 4
+
 struct seen {
     char *user;                 /* what user is this for? */
     struct db *db;
@@ -156,6 +170,9 @@ EXPORTED int seen_open(const char *user,
 struct seendata_rock {
     seenproc_t *f;
     void *rock;
+    struct buf key;     /* a delta record waiting for its base */
+    struct buf data;
+    int pending;
 };
 
 EXPORTED void seen_freedata(struct seendata *sd)
@@ -163,7 +180,51 @@ EXPORTED void seen_freedata(struct seendata *sd)
     free (sd->seenuids);
 }
 
-static void parse_data(const char *data, int datalen, struct seendata *sd)
+static int is_basekey(const char *key, size_t keylen)
+{
+    size_t len = strlen(SEEN_BASE_SUFFIX);
+
+    return (keylen > len &&
+            !memcmp(key + keylen - len, SEEN_BASE_SUFFIX, len));
+}
+
+/* "<addlen> <additions><removals>", both encoded, against the base */
+static struct seqset *decode_delta(const char *p, const char *dend,
+                                   const char *base, size_t baselen,
+                                   unsigned maxval)
+{
+    struct seqset *seq, *add, *del, *res = NULL;
+    unsigned long addlen;
+    char *q;
+
+    addlen = strtoul(p, &q, 10);
+    if (q >= dend || *q != ' ' || addlen > (size_t) (dend - q - 1))
+        return NULL;
+    q++;
+
+    seq = base ? seqset_decode(base, baselen, maxval)
+               : seqset_init(maxval, SEQ_SPARSE);
+    add = seqset_decode(q, addlen, maxval);
+    del = seqset_decode(q + addlen, dend - q - addlen, maxval);
+
+    if (seq && add && del) {
+        res = seqset_difference(seq, del);
+        seqset_join(res, add);
+    }
+
+    seqset_free(seq);
+    seqset_free(add);
+    seqset_free(del);
+
+    return res;
+}
+
+/* Parse a record into 'sd'.  If 'seqp' is given, the compact forms are
+ * decoded straight into a seqset there, and sd->seenuids is left NULL.
+ * A delta record needs its base set, if it could be found. */
+static void parse_data(const char *data, int datalen,
+                       const char *base, size_t baselen,
+                       struct seendata *sd, struct seqset **seqp)
 {
     /* remember that 'data' may not be null terminated ! */
     const char *dend = data + datalen;
@@ -174,11 +235,37 @@ static void parse_data(const char *data, int datalen, struct seendata *sd)
     memset(sd, 0, sizeof(struct seendata));
 
     version = strtol(data, &p, 10); data = p;
-    assert(version == SEEN_VERSION);
+    assert(version == SEEN_VERSION || version == SEEN_VERSION_COMPACT ||
+           version == SEEN_VERSION_DELTA);
 
     sd->lastread = strtol(data, &p, 10); data = p;
     sd->lastuid = strtoll(data, &p, 10); data = p;
     sd->lastchange = strtol(data, &p, 10); data = p;
+
+    if (version == SEEN_VERSION_COMPACT || version == SEEN_VERSION_DELTA) {
+        /* exactly one space, then the binary form */
+        struct seqset *seq;
+
+        if (p < dend) p++;
+        if (version == SEEN_VERSION_DELTA)
+            seq = decode_delta(p, dend, base, baselen, sd->lastuid);
+        else
+            seq = seqset_decode(p, dend - p, sd->lastuid);
+
+        if (seqp) {
+            /* garbage reads as an empty set */
+            *seqp = seq ? seq : seqset_init(sd->lastuid, SEQ_SPARSE);
+            return;
+        }
+
+        if (seq) sd->seenuids = seqset_cstring(seq);
+        /* an empty set comes back as NULL; so does garbage, which
+         * seen_readit would nuke anyway */
+        if (!sd->seenuids) sd->seenuids = xstrdup("");
+        seqset_free(seq);
+        return;
+    }
+
     while (p < dend && Uisspace(*p)) { p++; } data = p;
     uidlen = dend - data;
     sd->seenuids = xmalloc(uidlen + 1);
@@ -186,41 +273,94 @@ static void parse_data(const char *data, int datalen, struct seendata *sd)
     sd->seenuids[uidlen] = '\0';
 }
 
+static int foreach_emit(struct seendata_rock *sr,
+                        const char *base, size_t baselen)
+{
+    struct seendata sd = SEENDATA_INITIALIZER;
+    int r;
+
+    sr->pending = 0;
+
+    parse_data(buf_cstring(&sr->data), buf_len(&sr->data),
+               base, baselen, &sd, NULL);
+
+    r = (sr->f)(buf_cstring(&sr->key), &sd, sr->rock);
+
+    seen_freedata(&sd);
+
+    return r;
+}
+
 static int foreach_proc(void *rock,
                  const char *key,
                  size_t keylen,
                  const char *data,
                  size_t datalen)
 {
-    struct seendata sd = SEENDATA_INITIALIZER;
     struct seendata_rock *sr = (struct seendata_rock *)rock;
-    char *name = xstrndup(key, keylen);
-    int r;
+    int r = 0;
+
+    if (is_basekey(key, keylen)) {
+        /* the base for the delta record before it, if any */
+        if (sr->pending &&
+            keylen == buf_len(&sr->key) + strlen(SEEN_BASE_SUFFIX) &&
+            !memcmp(key, buf_base(&sr->key), buf_len(&sr->key)))
+            return foreach_emit(sr, data, datalen);
+        return 0;
+    }
 
-    parse_data(data, datalen, &sd);
+    if (sr->pending) {
+        r = foreach_emit(sr, NULL, 0);
+        if (r) return r;
+    }
 
-    r = (sr->f)(name, &sd, sr->rock);
+    buf_setmap(&sr->key, key, keylen);
+    buf_setmap(&sr->data, data, datalen);
 
-    seen_freedata(&sd);
-    free(name);
+    /* a delta record waits for its base, which follows it */
+    if (atoi(buf_cstring(&sr->data)) == SEEN_VERSION_DELTA) {
+        sr->pending = 1;
+        return 0;
+    }
 
-    return r;
+    return foreach_emit(sr, NULL, 0);
 }
 
-EXPORTED int seen_foreach(struct seen *seendb, seenproc_t *f, void *rock)
+static int seen_foreach_db(struct db *db, seenproc_t *f, void *rock)
 {
     struct seendata_rock sdrock;
+    int r;
+
+    memset(&sdrock, 0, sizeof(struct seendata_rock));
     sdrock.f = f;
     sdrock.rock = rock;
-    return cyrusdb_foreach(seendb->db, "", 0, NULL, foreach_proc, &sdrock, NULL);
+
+    r = cyrusdb_foreach(db, "", 0, NULL, foreach_proc, &sdrock, NULL);
+    if (!r && sdrock.pending) {
+        /* no base was found for the last record */
+        r = foreach_emit(&sdrock, NULL, 0);
+    }
+
+    buf_free(&sdrock.key);
+    buf_free(&sdrock.data);
+
+    return r;
+}
+
+EXPORTED int seen_foreach(struct seen *seendb, seenproc_t *f, void *rock)
+{
+    return seen_foreach_db(seendb->db, f, rock);
 }
 
 static int seen_readit(struct seen *seendb, const char *uniqueid,
-                       struct seendata *sd, int rw)
+                       struct seendata *sd, struct seqset **seqp, int rw)
 {
     int r;
     const char *data;
     size_t datalen;
+    const char *base = NULL;
+    size_t baselen = 0;
+    struct buf record = BUF_INITIALIZER;
 
     assert(seendb && uniqueid);
     if (rw || seendb->tid) {
@@ -240,7 +380,8 @@ static int seen_readit(struct seen *seendb, const char *uniqueid,
         break;
     case CYRUSDB_NOTFOUND:
         memset(sd, 0, sizeof(struct seendata));
-        sd->seenuids = xstrdup("");
+        if (seqp) *seqp = seqset_init(0, SEQ_SPARSE);
+        else sd->seenuids = xstrdup("");
         return 0;
         break;
     default:
@@ -250,14 +391,57 @@ static int seen_readit(struct seen *seendb, const char *uniqueid,
         break;
     }
 
-    parse_data(data, datalen, sd);
-    if (sd->seenuids[0] && !imparse_issequence(sd->seenuids)) {
+    /* keep a copy, fetching the base may move the data */
+    buf_setmap(&record, data, datalen);
+
+    if (atoi(buf_cstring(&record)) == SEEN_VERSION_DELTA) {
+        char *basekey = strconcat(uniqueid, SEEN_BASE_SUFFIX, (char *)NULL);
+
+        if (rw || seendb->tid) {
+            r = cyrusdb_fetchlock(seendb->db, basekey, strlen(basekey),
+                                  &base, &baselen, &seendb->tid);
+        } else {
+            r = cyrusdb_fetch(seendb->db, basekey, strlen(basekey),
+                              &base, &baselen, NULL);
+        }
+        free(basekey);
+
+        switch (r) {
+        case 0:
+            break;
+        case CYRUSDB_AGAIN:
+            buf_free(&record);
+            return IMAP_AGAIN;
+        case CYRUSDB_NOTFOUND:
+            syslog(LOG_ERR, "DBERROR: missing seen base for %s %s",
+                   seendb->user, uniqueid);
+            base = NULL;
+            break;
+        default:
+            syslog(LOG_ERR, "DBERROR: error fetching txn %s",
+                   cyrusdb_strerror(r));
+            buf_free(&record);
+            return IMAP_IOERROR;
+        }
+    }
+
+    parse_data(buf_cstring(&record), buf_len(&record), base, baselen, sd, seqp);
+    buf_free(&record);
+
+    if (sd->seenuids && sd->seenuids[0] && !imparse_issequence(sd->seenuids)) {
         syslog(LOG_ERR, "DBERROR: invalid sequence <%s> for %s %s - nuking",
                sd->seenuids, seendb->user, uniqueid);
         free(sd->seenuids);
         sd->seenuids = xstrdup("");
     }
 
+    if (seqp && sd->seenuids) {
+        /* an old text record */
+        *seqp = seqset_parse(sd->seenuids, NULL, sd->lastuid);
+        free(sd->seenuids);
+        sd->seenuids = NULL;
+    }
+
     return 0;
 }
 
@@ -268,7 +452,18 @@ EXPORTED int seen_read(struct seen *seendb, const char *uniqueid, struct seendat
                seendb->user, uniqueid);
     }
 
-    return seen_readit(seendb, uniqueid, sd, 0);
+    return seen_readit(seendb, uniqueid, sd, NULL, 0);
+}
+
+EXPORTED int seen_read_seqset(struct seen *seendb, const char *uniqueid,
+                              struct seendata *sd, struct seqset **seqp)
+{
+    if (SEEN_DEBUG) {
+        syslog(LOG_DEBUG, "seen_db: seen_read_seqset %s (%s)",
+               seendb->user, uniqueid);
+    }
+
+    return seen_readit(seendb, uniqueid, sd, seqp, 0);
 }
 
 EXPORTED int seen_lockread(struct seen *seendb, const char *uniqueid, struct seendata *sd)
@@ -278,16 +473,98 @@ EXPORTED int seen_lockread(struct seen *seendb, const char *uniqueid, struct see
                seendb->user, uniqueid);
     }
 
-    return seen_readit(seendb, uniqueid, sd, 1);
+    return seen_readit(seendb, uniqueid, sd, NULL, 1);
 }
 
-EXPORTED int seen_write(struct seen *seendb, const char *uniqueid, struct seendata *sd)
+/* Build the record for 'seq' into 'data': as changes against the
+ * stored base if they're small enough, otherwise writing a new base
+ * first, or dropping it if the set is too small to need one */
+static int seen_build_delta(struct seen *seendb, const char *uniqueid,
+                            const struct seendata *sd,
+                            const struct seqset *seq, struct buf *data)
 {
-    int sz = strlen(sd->seenuids) + 50;
-    char *data = xmalloc(sz);
-    int datalen;
+    struct buf full = BUF_INITIALIZER;
+    struct buf add = BUF_INITIALIZER;
+    struct buf del = BUF_INITIALIZER;
+    char *basekey = strconcat(uniqueid, SEEN_BASE_SUFFIX, (char *)NULL);
+    const char *base = NULL;
+    size_t baselen = 0;
+    int delta = 0;
     int r;
 
+    seqset_encode(seq, &full);
+
+    r = cyrusdb_fetchlock(seendb->db, basekey, strlen(basekey),
+                          &base, &baselen, &seendb->tid);
+    if (r == CYRUSDB_NOTFOUND) {
+        base = NULL;
+        r = 0;
+    }
+    if (r) goto done;
+
+    if (base) {
+        struct seqset *baseseq = seqset_decode(base, baselen, 0);
+
+        if (baseseq) {
+            struct seqset *diff = seqset_difference(seq, baseseq);
+            seqset_encode(diff, &add);
+            seqset_free(diff);
+
+            diff = seqset_difference(baseseq, seq);
+            seqset_encode(diff, &del);
+            seqset_free(diff);
+
+            seqset_free(baseseq);
+        }
+        else base = NULL;
+    }
+
+    if (base && (add.len + del.len) * SEEN_DELTA_RATIO < baselen) {
+        /* just the changes */
+        delta = 1;
+    }
+    else if (full.len >= SEEN_DELTA_MIN) {
+        /* (re)write the base */
+        r = cyrusdb_store(seendb->db, basekey, strlen(basekey),
+                          full.s, full.len, &seendb->tid);
+        if (r) goto done;
+        buf_reset(&add);
+        buf_reset(&del);
+        delta = 1;
+    }
+    else if (baselen) {
+        /* shrunk too small to need one */
+        r = cyrusdb_delete(seendb->db, basekey, strlen(basekey),
+                           &seendb->tid, 1);
+        if (r) goto done;
+    }
+
+    if (delta) {
+        buf_printf(data, "%d %lu %u %lu %zu ", SEEN_VERSION_DELTA,
+                   sd->lastread, sd->lastuid, sd->lastchange, add.len);
+        buf_append(data, &add);
+        buf_append(data, &del);
+    }
+    else {
+        buf_printf(data, "%d %lu %u %lu ", SEEN_VERSION_COMPACT,
+                   sd->lastread, sd->lastuid, sd->lastchange);
+        buf_append(data, &full);
+    }
+
+done:
+    buf_free(&full);
+    buf_free(&add);
+    buf_free(&del);
+    free(basekey);
+
+    return r;
+}
+
+EXPORTED int seen_write(struct seen *seendb, const char *uniqueid, struct seendata *sd)
+{
+    struct buf data = BUF_INITIALIZER;
+    int r = 0;
+
     assert(seendb && uniqueid);
 
     if (SEEN_DEBUG) {
@@ -295,13 +572,28 @@ EXPORTED int seen_write(struct seen *seendb, const char *uniqueid, struct seenda
                seendb->user, uniqueid);
     }
 
-    snprintf(data, sz, "%d %lu %u %lu %s", SEEN_VERSION,
-            sd->lastread, sd->lastuid,
-            sd->lastchange, sd->seenuids);
-    datalen = strlen(data);
+    if (config_getswitch(IMAPOPT_SEENSTATE_COMPACT) &&
+        (!sd->seenuids[0] || imparse_issequence(sd->seenuids))) {
+        struct seqset *seq = seqset_parse(sd->seenuids, NULL, 0);
 
-    r = cyrusdb_store(seendb->db, uniqueid, strlen(uniqueid),
-                  data, datalen, &seendb->tid);
+        if (config_getswitch(IMAPOPT_SEENSTATE_DELTA)) {
+            r = seen_build_delta(seendb, uniqueid, sd, seq, &data);
+        }
+        else {
+            buf_printf(&data, "%d %lu %u %lu ", SEEN_VERSION_COMPACT,
+                       sd->lastread, sd->lastuid, sd->lastchange);
+            seqset_encode(seq, &data);
+        }
+        seqset_free(seq);
+    }
+    else {
+        buf_printf(&data, "%d %lu %u %lu %s", SEEN_VERSION,
+                   sd->lastread, sd->lastuid,
+                   sd->lastchange, sd->seenuids);
+    }
+
+    if (!r) r = cyrusdb_store(seendb->db, uniqueid, strlen(uniqueid),
+                              data.s, data.len, &seendb->tid);
     switch (r) {
     case CYRUSDB_OK:
         break;
@@ -315,7 +607,7 @@ EXPORTED int seen_write(struct seen *seendb, const char *uniqueid, struct seenda
         break;
     }
 
-    free(data);
+    buf_free(&data);
 
     sync_log_seen(seendb->user, uniqueid);
 
@@ -388,6 +680,12 @@ EXPORTED int seen_delete_mailbox(const char *userid, struct mailbox *mailbox)
     r = seen_open(userid, SEEN_SILENT, &seendb);
     if (!r) r = cyrusdb_delete(seendb->db, uniqueid, strlen(uniqueid),
                            &seendb->tid, 1);
+    if (!r) {
+        char *basekey = strconcat(uniqueid, SEEN_BASE_SUFFIX, (char *)NULL);
+        r = cyrusdb_delete(seendb->db, basekey, strlen(basekey),
+                           &seendb->tid, 1);
+        free(basekey);
+    }
     seen_close(&seendb);
 
     return r;
@@ -496,32 +794,28 @@ EXPORTED int seen_compare(struct seendata *a, struct seendata *b)
 /* Look up the unique id in the new file, if it is there, compare the
  * last change times, and ensure that the database uses the newer of
  * the two */
-static int seen_merge_cb(void *rockp,
-                         const char *key, size_t keylen,
-                         const char *newdata, size_t newlen)
+static int seen_merge_cb(const char *uniqueid, struct seendata *newsd,
+                         void *rockp)
 {
     int r = 0;
     struct seen *seendb = (struct seen *)rockp;
-    struct seendata oldsd, newsd;
-    char *uniqueid = xstrndup(key, keylen);
+    struct seendata oldsd = SEENDATA_INITIALIZER;
     int dirty = 0;
 
-    parse_data(newdata, newlen, &newsd);
-
     if (seen_lockread(seendb, uniqueid, &oldsd)) {
         dirty = 1; /* no record */
     }
     else {
-        if (newsd.lastuid > oldsd.lastuid) dirty = 1;
-        if (newsd.lastread > oldsd.lastread) dirty = 1;
+        if (newsd->lastuid > oldsd.lastuid) dirty = 1;
+        if (newsd->lastread > oldsd.lastread) dirty = 1;
     }
 
     if (dirty) {
         /* write back data from new entry */
-        r = seen_write(seendb, uniqueid, &newsd);
+        r = seen_write(seendb, uniqueid, newsd);
     }
 
-    free(uniqueid);
+    seen_freedata(&oldsd);
 
     return r;
 }
@@ -540,7 +834,7 @@ HIDDEN int seen_merge(struct seen *seendb, const char *newfile)
      * to do, so abort without an error */
     if (r == CYRUSDB_NOTFOUND) return 0;
 
-    if (!r) r = cyrusdb_foreach(newdb, "", 0, NULL, seen_merge_cb, seendb, NULL);
+    if (!r) r = seen_foreach_db(newdb, seen_merge_cb, seendb);
 
     if (newdb) cyrusdb_close(newdb);
 
@@ -170,9 +170,9 @@ static int comp_rangesort(const void *v1, const void *v2)
     struct seq_range *r1 = (struct seq_range *) v1;
     struct seq_range *r2 = (struct seq_range *) v2;
 
-    int ret = r1->low - r2->low;
-    if (ret) return ret;
-    return r1->high - r2->high;
+    if (r1->low != r2->low) return r1->low < r2->low ? -1 : 1;
+    if (r1->high != r2->high) return r1->high < r2->high ? -1 : 1;
+    return 0;
 }
 
 static void seqset_simplify(struct seqset *seq)
@@ -393,23 +393,240 @@ EXPORTED unsigned seqset_getnext(struct seqset *seq)
     return 0;
 }
 
+static void seqset_grow(struct seqset *seq, size_t need)
+{
+    if (need <= seq->alloc) return;
+    seq->alloc = need + SETGROWSIZE;
+    seq->set = xrealloc(seq->set, seq->alloc * sizeof(struct seq_range));
+}
+
+/* append a range to the end of the ranges being built in `out',
+ * coalescing it with the previous one if they touch.  Ranges must
+ * be appended in order of their low value */
+static void append_range(struct seq_range *out, size_t *lenp,
+                         const struct seq_range *r)
+{
+    size_t len = *lenp;
+
+    if (len && (out[len-1].high == UINT_MAX ||
+                out[len-1].high + 1 >= r->low)) {
+        if (r->high > out[len-1].high)
+            out[len-1].high = r->high;
+        return;
+    }
+
+    out[len] = *r;
+    *lenp = len + 1;
+}
+
 /*
  * Merge the numbers in seqset `b' into seqset `a'.
+ *
+ * Both sets are already sorted, so this is a linear merge of the
+ * two range lists rather than an append and re-sort.
  */
-/* NOTE - not sort safe! */
 EXPORTED void seqset_join(struct seqset *a, const struct seqset *b)
 {
-    if (a->len + b->len > a->alloc) {
-        a->alloc = a->len + b->len;
-        a->set =
-            xrealloc(a->set, a->alloc * sizeof(struct seq_range));
+    struct seq_range *out;
+    size_t i = 0, j = 0, len = 0;
+    size_t total;
+
+    if (!b || !b->len) return;
+
+    if (!a->len) {
+        seqset_grow(a, b->len);
+        memcpy(a->set, b->set, b->len * sizeof(struct seq_range));
+        a->len = b->len;
+        return;
+    }
+
+    /* fast path: b lies entirely after a */
+    if (a->set[a->len-1].high != UINT_MAX &&
+        a->set[a->len-1].high + 1 < b->set[0].low) {
+        seqset_grow(a, a->len + b->len);
+        memcpy(a->set + a->len, b->set, b->len * sizeof(struct seq_range));
+        a->len += b->len;
+        return;
+    }
+
+    total = a->len + b->len;
+    out = xmalloc(total * sizeof(struct seq_range));
+    while (i < a->len || j < b->len) {
+        if (j >= b->len || (i < a->len && a->set[i].low <= b->set[j].low))
+            append_range(out, &len, &a->set[i++]);
+        else
+            append_range(out, &len, &b->set[j++]);
+    }
+
+    free(a->set);
+    a->set = out;
+    a->len = len;
+    a->alloc = total;
+    a->current = 0;
+}
+
+/*
+ * Return a new seqset containing only the numbers which are
+ * members of both `a' and `b'.
+ */
+EXPORTED struct seqset *seqset_intersect(const struct seqset *a,
+                                         const struct seqset *b)
+{
+    struct seqset *res = seqset_init(a ? a->maxval : 0, SEQ_SPARSE);
+    size_t i = 0, j = 0;
+
+    if (!a || !b) return res;
+
+    while (i < a->len && j < b->len) {
+        unsigned low = a->set[i].low > b->set[j].low ?
+                       a->set[i].low : b->set[j].low;
+        unsigned high = a->set[i].high < b->set[j].high ?
+                        a->set[i].high : b->set[j].high;
+
+        if (low <= high) {
+            seqset_grow(res, res->len + 1);
+            res->set[res->len].low = low;
+            res->set[res->len].high = high;
+            res->len++;
+        }
+
+        /* step past whichever range finishes first */
+        if (a->set[i].high < b->set[j].high) i++;
+        else j++;
+    }
+
+    return res;
+}
+
+/*
+ * Return a new seqset with the members of `a' which aren't in `b'.
+ * Both are walked once, in order.
+ */
+EXPORTED struct seqset *seqset_difference(const struct seqset *a,
+                                          const struct seqset *b)
+{
+    struct seqset *res = seqset_init(a ? a->maxval : 0, SEQ_SPARSE);
+    size_t i, j = 0;
+
+    if (!a) return res;
+
+    for (i = 0; i < a->len; i++) {
+        unsigned low = a->set[i].low;
+        unsigned high = a->set[i].high;
+        int covered = 0;
+
+        /* skip past b's ranges which end before this one */
+        while (b && j < b->len && b->set[j].high < low) j++;
+
+        /* cut out each of b's ranges which overlap this one */
+        while (b && j < b->len && b->set[j].low <= high) {
+            if (b->set[j].low > low) {
+                seqset_grow(res, res->len + 1);
+                res->set[res->len].low = low;
+                res->set[res->len].high = b->set[j].low - 1;
+                res->len++;
+            }
+            if (b->set[j].high >= high) {
+                /* it may cover the next range of a too */
+                covered = 1;
+                break;
+            }
+            low = b->set[j].high + 1;
+            j++;
+        }
+
+        if (!covered) {
+            seqset_grow(res, res->len + 1);
+            res->set[res->len].low = low;
+            res->set[res->len].high = high;
+            res->len++;
+        }
+    }
+
+    return res;
+}
+
+static void put_varint(struct buf *buf, unsigned val)
+{
+    while (val >= 0x80) {
+        buf_putc(buf, (val & 0x7f) | 0x80);
+        val >>= 7;
+    }
+    buf_putc(buf, val);
+}
+
+static int get_varint(const char **ptr, const char *end, unsigned *valp)
+{
+    const unsigned char *p = (const unsigned char *)*ptr;
+    unsigned val = 0;
+    int shift = 0;
+
+    while ((const char *)p < end && shift < 35) {
+        val |= (unsigned)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *ptr = (const char *)p;
+            *valp = val;
+            return 0;
+        }
+        shift += 7;
+    }
+
+    return -1;
+}
+
+/*
+ * Append a compact binary form of `seq' to `buf'.  Each range is
+ * stored as two varints: the gap since the end of the previous range
+ * and the length of the range.  Long runs of consecutive numbers
+ * therefore cost a couple of bytes no matter how large the numbers
+ * are.  This is for storage only; use seqset_cstring() for anything
+ * which goes on the wire.
+ */
+EXPORTED void seqset_encode(const struct seqset *seq, struct buf *buf)
+{
+    unsigned next = 0;
+    size_t i;
+
+    if (!seq) return;
+
+    for (i = 0; i < seq->len; i++) {
+        put_varint(buf, seq->set[i].low - next);
+        put_varint(buf, seq->set[i].high - seq->set[i].low);
+        next = seq->set[i].high + 1;
+    }
+}
+
+/*
+ * Decode the output of seqset_encode() into a new seqset.
+ * Returns NULL if the data is corrupt.
+ */
+EXPORTED struct seqset *seqset_decode(const char *data, size_t len,
+                                      unsigned maxval)
+{
+    struct seqset *seq = seqset_init(maxval, SEQ_SPARSE);
+    const char *end = data + len;
+    unsigned next = 0;
+
+    while (data < end) {
+        unsigned gap, span;
+
+        if (get_varint(&data, end, &gap) ||
+            get_varint(&data, end, &span) ||
+            (seq->len && next == 0) ||       /* previous range ended at '*' */
+            gap > UINT_MAX - next ||
+            span > UINT_MAX - (next + gap)) {
+            seqset_free(seq);
+            return NULL;
+        }
+
+        seqset_grow(seq, seq->len + 1);
+        seq->set[seq->len].low = next + gap;
+        seq->set[seq->len].high = next + gap + span;
+        next = seq->set[seq->len].high + 1;
+        seq->len++;
     }
-    /* call them char * so the maths works out right */
-    memcpy((char *)a->set + a->len * sizeof(struct seq_range),
-           (char *)b->set, b->len * sizeof(struct seq_range));
-    a->len += b->len;
 
-    seqset_simplify(a);
+    return seq;
 }
 
 static void format_num(struct buf *buf, unsigned i)
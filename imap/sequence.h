@@ -46,6 +46,8 @@
 #ifndef SEQUENCE_H
 #define SEQUENCE_H
 
+#include "util.h"
+
 struct seq_range {
     unsigned low;
     unsigned high;
@@ -74,6 +76,10 @@ extern struct seqset *seqset_parse(const char *sequence,
                                    struct seqset *set,
                                    unsigned maxval);
 extern void seqset_join(struct seqset *a, const struct seqset *b);
+extern struct seqset *seqset_intersect(const struct seqset *a,
+                                      const struct seqset *b);
+extern struct seqset *seqset_difference(const struct seqset *a,
+                                       const struct seqset *b);
 extern int seqset_ismember(struct seqset *set, unsigned num);
 extern unsigned seqset_getnext(struct seqset *set);
 extern unsigned seqset_first(const struct seqset *set);
@@ -83,4 +89,9 @@ extern char *seqset_cstring(const struct seqset *set);
 extern void seqset_free(struct seqset *set);
 extern struct seqset *seqset_dup(const struct seqset *);
 
+/* compact binary form, for storage */
+extern void seqset_encode(const struct seqset *set, struct buf *buf);
+extern struct seqset *seqset_decode(const char *data, size_t len,
+                                    unsigned maxval);
+
 #endif /* SEQUENCE_H */
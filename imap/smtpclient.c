@@ -88,6 +88,8 @@ struct smtpclient {
     char *by;
     unsigned long msgsize;
     smtp_resp_t resp;
+    int reusable; /* may be kept open for the next smtpclient_open */
+    int broken;   /* the connection failed and can't be reused */
 };
 
 enum {
@@ -96,9 +98,14 @@ enum {
     SMTPCLIENT_CAPA_SIZE      = (1 << 5),
     SMTPCLIENT_CAPA_STATUS    = (1 << 6),
     SMTPCLIENT_CAPA_FUTURE    = (1 << 7),
-    SMTPCLIENT_CAPA_PRIORITY  = (1 << 8)
+    SMTPCLIENT_CAPA_PRIORITY  = (1 << 8),
+    SMTPCLIENT_CAPA_PIPELINING = (1 << 9),
+    SMTPCLIENT_CAPA_CHUNKING  = (1 << 10)
 };
 
+/* Size of the BDAT chunks written when the server supports CHUNKING */
+#define SMTPCLIENT_BDAT_CHUNK (64 * 1024)
+
 static struct protocol_t smtp_protocol =
 { "smtp", "smtp", TYPE_STD,
   { { { 0, "220 " },
@@ -112,6 +119,8 @@ static struct protocol_t smtp_protocol =
           { "ENHANCEDSTATUSCODES", SMTPCLIENT_CAPA_STATUS },
           { "FUTURERELEASE", SMTPCLIENT_CAPA_FUTURE },
           { "MT-PRIORITY", SMTPCLIENT_CAPA_PRIORITY },
+          { "PIPELINING", SMTPCLIENT_CAPA_PIPELINING },
+          { "CHUNKING", SMTPCLIENT_CAPA_CHUNKING },
           { NULL, 0 } } },
       { "STARTTLS", "220", "454", 0 },
       { "AUTH", 512, 0, "235", "5", "334 ", "*", NULL, 0 },
@@ -130,16 +139,61 @@ static int smtpclient_new(smtpclient_t **smp,
 typedef int smtp_readcb_t(smtpclient_t *sm, void *rock);
 
 static int smtpclient_read(smtpclient_t *sm, smtp_readcb_t *cb, void *rock);
+static int expect_code_cb(smtpclient_t *sm, void *rock);
 
 static int smtpclient_writebuf(smtpclient_t *sm, struct buf *buf, int flush);
 static int smtpclient_ehlo(smtpclient_t *sm);
 static int smtpclient_quit(smtpclient_t *sm);
-static int smtpclient_from(smtpclient_t *sm, smtp_addr_t *addr);
-static int smtpclient_rcpt_to(smtpclient_t *sm, ptrarray_t *rcpt);
+static int smtpclient_from(smtpclient_t *sm, smtp_addr_t *addr, int pipelined);
+static int smtpclient_rcpt_to(smtpclient_t *sm, ptrarray_t *rcpt, int pipelined);
 static int smtpclient_data(smtpclient_t *sm, struct protstream *data);
 
 static int smtpclient_sendmail_freectx(struct backend* backend);
 
+/* An idle connection to smtp_host, kept open for the next message
+ * (see the smtp_idle_timeout option) */
+static struct {
+    smtpclient_t *sm;
+    time_t since;
+} smtp_idle;
+
+static void smtpclient_free(smtpclient_t *sm);
+
+static void smtpclient_idle_done(void *rock __attribute__((unused)))
+{
+    if (smtp_idle.sm) smtpclient_free(smtp_idle.sm);
+    smtp_idle.sm = NULL;
+}
+
+/* Take over the idle connection, if it is still fresh and the server
+ * still answers.  RSET also ends any transaction left half done. */
+static int smtpclient_reuse(smtpclient_t **smp)
+{
+    smtpclient_t *sm = smtp_idle.sm;
+    int r = 0;
+
+    if (!sm) return IMAP_NOTFOUND;
+    smtp_idle.sm = NULL;
+
+    if (time(NULL) - smtp_idle.since >= config_getint(IMAPOPT_SMTP_IDLE_TIMEOUT)) {
+        r = IMAP_NOTFOUND;
+    }
+    else {
+        buf_setcstr(&sm->buf, "RSET\r\n");
+        r = smtpclient_writebuf(sm, &sm->buf, 1);
+        buf_reset(&sm->buf);
+        if (!r) r = smtpclient_read(sm, expect_code_cb, "2");
+    }
+
+    if (r) {
+        smtpclient_free(sm);
+        return r;
+    }
+
+    *smp = sm;
+    return 0;
+}
+
 EXPORTED int smtpclient_open(smtpclient_t **smp)
 {
     int r = 0;
@@ -149,7 +203,9 @@ EXPORTED int smtpclient_open(smtpclient_t **smp)
         r = smtpclient_open_sendmail(smp);
     }
     else if (!strcmp(backend, "host")) {
-        r = smtpclient_open_host(config_getstring(IMAPOPT_SMTP_HOST), smp);
+        r = smtpclient_reuse(smp);
+        if (r) r = smtpclient_open_host(config_getstring(IMAPOPT_SMTP_HOST), smp);
+        if (!r) (*smp)->reusable = 1;
     }
     else {
         syslog(LOG_ERR, "smtpclient_open: unknown backend: %s", backend);
@@ -164,20 +220,48 @@ EXPORTED int smtpclient_close(smtpclient_t **smp)
         return 0;
     }
 
-    int r = 0;
     smtpclient_t *sm = *smp;
+    *smp = NULL;
+
+    /* Keep a healthy connection to smtp_host for the next message */
+    if (sm->reusable && !sm->broken && !smtp_idle.sm &&
+        config_getint(IMAPOPT_SMTP_IDLE_TIMEOUT) > 0) {
+        static int registered = 0;
+
+        if (!registered) {
+            cyrus_modules_add(smtpclient_idle_done, NULL);
+            registered = 1;
+        }
+
+        /* Forget the settings of this message */
+        smtpclient_set_auth(sm, NULL);
+        smtpclient_set_notify(sm, NULL);
+        smtpclient_set_ret(sm, NULL);
+        smtpclient_set_by(sm, NULL);
+        smtpclient_set_size(sm, 0);
 
+        smtp_idle.sm = sm;
+        smtp_idle.since = time(NULL);
+        return 0;
+    }
+
+    smtpclient_free(sm);
+    return 0;
+}
+
+static void smtpclient_free(smtpclient_t *sm)
+{
     /* Close backend */
     backend_disconnect(sm->backend);
     if (sm->free_context) {
-        r = sm->free_context(sm->backend);
+        sm->free_context(sm->backend);
     }
     free(sm->backend);
     sm->backend = NULL;
 
     /* Close log */
     if (sm->logfd != -1) {
-        close(sm->logfd);
+        telemetry_close(sm->logfd);
     }
     sm->logfd = -1;
 
@@ -195,8 +279,6 @@ EXPORTED int smtpclient_close(smtpclient_t **smp)
     buf_free(&sm->resp.text);
 
     free(sm);
-    *smp = NULL;
-    return r;
 }
 
 /* Match the response code to an expected return code defined in rock.
@@ -264,25 +346,28 @@ static int expect_code_cb(smtpclient_t *sm, void *rock)
 static int smtpclient_read(smtpclient_t *sm, smtp_readcb_t *cb, void *rock)
 {
     char buf[513]; /* Maximum length of reply line, see RFC 5321, 4.5.3.1.5. */
-    int r = IMAP_IOERROR;
+    int r = 0;
 
     do {
         /* Read next reply line. */
         if (!prot_fgets(buf, 513, sm->backend->in)) {
-            r = IMAP_IOERROR;
-            return r;
+            sm->broken = 1;
+            return IMAP_IOERROR;
         }
         buf[512] = '\0';
 
         /* Parse reply line. */
         if (!isdigit(buf[0]) || !isdigit(buf[1]) || !isdigit(buf[2])) {
+            sm->broken = 1;
             return IMAP_PROTOCOL_ERROR;
         }
         if (buf[3] != '-' && !isspace(buf[3])) {
+            sm->broken = 1;
             return IMAP_PROTOCOL_ERROR;
         }
         char *p = memchr(buf + 4, '\n', 508);
         if (p == NULL) {
+            sm->broken = 1;
             return IMAP_PROTOCOL_ERROR;
         }
         if (*(p-1) == '\r') {
@@ -290,12 +375,15 @@ static int smtpclient_read(smtpclient_t *sm, smtp_readcb_t *cb, void *rock)
         }
         *p = '\0';
 
-        /* Call callback. */
-        memcpy(sm->resp.code, buf, 3);
-        buf_setcstr(&sm->resp.text, buf + 4);
+        /* Call callback.  After it failed, just read the rest of the
+         * reply, so the next reply (pipelined or not) starts in sync. */
         sm->resp.is_last = isspace(buf[3]);
-        r = cb(sm, rock);
-    } while (!r && !sm->resp.is_last);
+        if (!r) {
+            memcpy(sm->resp.code, buf, 3);
+            buf_setcstr(&sm->resp.text, buf + 4);
+            r = cb(sm, rock);
+        }
+    } while (!sm->resp.is_last);
 
     return r;
 }
@@ -326,9 +414,11 @@ static int ehlo_cb(smtpclient_t *sm, void *rock __attribute__((unused)))
 static int smtpclient_writebuf(smtpclient_t *sm, struct buf *buf, int flush)
 {
     if (prot_putbuf(sm->backend->out, buf)) {
+        sm->broken = 1;
         return IMAP_IOERROR;
     }
     if (flush && prot_flush(sm->backend->out)) {
+        sm->broken = 1;
         return IMAP_IOERROR;
     }
     return 0;
@@ -370,10 +460,13 @@ done:
     return r;
 }
 
+/* Write cmd for addr.  Unless pipelined, also flush it and read the
+ * reply; pipelined replies are read by smtpclient_read_envelope. */
 static int write_addr(smtpclient_t *sm,
                       const char *cmd,
                       const smtp_addr_t *addr,
-                      const ptrarray_t *extra_params)
+                      const ptrarray_t *extra_params,
+                      int pipelined)
 {
     int i, r = 0;
 
@@ -401,8 +494,8 @@ static int write_addr(smtpclient_t *sm,
     }
     buf_appendcstr(&sm->buf, "\r\n");
 
-    r = smtpclient_writebuf(sm, &sm->buf, 1);
-    if (r) goto done;
+    r = smtpclient_writebuf(sm, &sm->buf, !pipelined);
+    if (r || pipelined) goto done;
 
     r = smtpclient_read(sm, expect_code_cb, "2");
     if (r) goto done;
@@ -444,7 +537,7 @@ static void smtp_params_fini(ptrarray_t *params)
 }
 
 /* Write a MAIL FROM command for address addr. */
-static int smtpclient_from(smtpclient_t *sm, smtp_addr_t *addr)
+static int smtpclient_from(smtpclient_t *sm, smtp_addr_t *addr, int pipelined)
 {
     ptrarray_t extra_params = PTRARRAY_INITIALIZER;
     if (sm->authid && CAPA(sm->backend, CAPA_AUTH)) {
@@ -461,13 +554,13 @@ static int smtpclient_from(smtpclient_t *sm, smtp_addr_t *addr)
         snprintf(szbuf, sizeof(szbuf), "%lu", sm->msgsize);
         smtp_params_set_extra(&addr->params, &extra_params, "SIZE", szbuf);
     }
-    int r = write_addr(sm, "MAIL FROM", addr, &extra_params);
+    int r = write_addr(sm, "MAIL FROM", addr, &extra_params, pipelined);
     smtp_params_fini(&extra_params);
     return r;
 }
 
 /* Write a RCPT TO command for all addresses in rcpt. */
-static int smtpclient_rcpt_to(smtpclient_t *sm, ptrarray_t *rcpts)
+static int smtpclient_rcpt_to(smtpclient_t *sm, ptrarray_t *rcpts, int pipelined)
 {
     int i, r = 0;
 
@@ -477,8 +570,36 @@ static int smtpclient_rcpt_to(smtpclient_t *sm, ptrarray_t *rcpts)
         if (sm->notify && CAPA(sm->backend, SMTPCLIENT_CAPA_DSN)) {
             smtp_params_set_extra(&addr->params, &extra_params, "NOTIFY", sm->notify);
         }
-        int r1 = write_addr(sm, "RCPT TO", addr, &extra_params);
+        int r1 = write_addr(sm, "RCPT TO", addr, &extra_params, pipelined);
         smtp_params_fini(&extra_params);
+        if (pipelined && r1) return r1;
+        else if (!r1 && !pipelined) addr->completed = 1;
+        else if (!r) r = r1;
+    }
+
+    return r;
+}
+
+/* Send the pipelined MAIL FROM and RCPT TO commands of env and read
+ * their replies, in order (RFC 2920). */
+static int smtpclient_read_envelope(smtpclient_t *sm, smtp_envelope_t *env)
+{
+    int i, r;
+
+    if (prot_flush(sm->backend->out)) {
+        sm->broken = 1;
+        return IMAP_IOERROR;
+    }
+
+    /* MAIL FROM */
+    r = smtpclient_read(sm, expect_code_cb, "2");
+    if (r == IMAP_IOERROR) return r;
+
+    /* RCPT TO, which the server rejects if MAIL FROM failed */
+    for (i = 0; i < env->rcpts.count; i++) {
+        smtp_addr_t *addr = ptrarray_nth(&env->rcpts, i);
+        int r1 = smtpclient_read(sm, expect_code_cb, "2");
+        if (r1 == IMAP_IOERROR) return r1;
         if (!r1) addr->completed = 1;
         else if (!r) r = r1;
     }
@@ -486,12 +607,62 @@ static int smtpclient_rcpt_to(smtpclient_t *sm, ptrarray_t *rcpts)
     return r;
 }
 
+static void bdat_fill(struct protstream *data, struct buf *chunk)
+{
+    int n;
+
+    buf_reset(chunk);
+    buf_ensure(chunk, SMTPCLIENT_BDAT_CHUNK);
+    while (buf_len(chunk) < SMTPCLIENT_BDAT_CHUNK &&
+           (n = prot_read(data, chunk->s + chunk->len,
+                          SMTPCLIENT_BDAT_CHUNK - chunk->len)) > 0) {
+        chunk->len += n;
+    }
+}
+
+/* Write data in BDAT chunks (RFC 3030), which needs no dot-escaping.
+ * Reading one chunk ahead lets the last one carry LAST. */
+static int smtpclient_bdat(smtpclient_t *sm, struct protstream *data)
+{
+    struct buf cur = BUF_INITIALIZER;
+    struct buf next = BUF_INITIALIZER;
+    int last, r = 0;
+
+    bdat_fill(data, &cur);
+    do {
+        struct buf tmp;
+
+        bdat_fill(data, &next);
+        last = !buf_len(&next);
+
+        buf_reset(&sm->buf);
+        buf_printf(&sm->buf, "BDAT %zu%s\r\n", buf_len(&cur),
+                   last ? " LAST" : "");
+        buf_append(&sm->buf, &cur);
+        r = smtpclient_writebuf(sm, &sm->buf, 1);
+        buf_reset(&sm->buf);
+        if (!r) r = smtpclient_read(sm, expect_code_cb, "2");
+
+        tmp = cur;
+        cur = next;
+        next = tmp;
+    } while (!r && !last);
+
+    buf_free(&cur);
+    buf_free(&next);
+    return r;
+}
+
 /* Write a DATA command using data as input. Data is dot-escaped
  * before it is written to the SMTP backend. */
 static int smtpclient_data(smtpclient_t *sm, struct protstream *data)
 {
     int r = 0;
 
+    if (CAPA(sm->backend, SMTPCLIENT_CAPA_CHUNKING)) {
+        return smtpclient_bdat(sm, data);
+    }
+
     /* Write DATA */
     buf_setcstr(&sm->buf, "DATA\r\n");
     r = smtpclient_writebuf(sm, &sm->buf, 1);
@@ -586,12 +757,20 @@ EXPORTED int smtpclient_sendprot(smtpclient_t *sm, smtp_envelope_t *env, struct
     r = validate_envelope(env);
     if (r) goto done;
 
-    r = smtpclient_from(sm, &env->from);
+    /* With PIPELINING, the whole envelope goes out in one write */
+    int pipelined = CAPA(sm->backend, SMTPCLIENT_CAPA_PIPELINING);
+
+    r = smtpclient_from(sm, &env->from, pipelined);
     if (r) goto done;
 
-    r = smtpclient_rcpt_to(sm, &env->rcpts);
+    r = smtpclient_rcpt_to(sm, &env->rcpts, pipelined);
     if (r) goto done;
 
+    if (pipelined) {
+        r = smtpclient_read_envelope(sm, env);
+        if (r) goto done;
+    }
+
     r = smtpclient_data(sm, data);
     if (r) goto done;
 
@@ -714,7 +893,7 @@ EXPORTED int smtpclient_open_host(const char *addr, smtpclient_t **smp)
     if (sasl_cb) free_callbacks(sasl_cb);
     if (!bk) {
         syslog(LOG_ERR, "smptclient_open: can't connect to host: %s", host);
-        if (logfd != -1) close(logfd);
+        telemetry_close(logfd);
         r = IMAP_INTERNAL;
         goto done;
     }
@@ -836,7 +1015,7 @@ EXPORTED int smtpclient_open_sendmail(smtpclient_t **smp)
     if (!bk) {
         syslog(LOG_ERR, "smptclient_open: can't open sendmail backend");
         r = IMAP_INTERNAL;
-        if (logfd != -1) close(logfd);
+        telemetry_close(logfd);
         goto done;
     }
     bk->context = ctx;
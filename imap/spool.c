@@ -49,6 +49,7 @@
 #include <string.h>
 
 #include "assert.h"
+#include "charset.h"
 #include "spool.h"
 #include "util.h"
 #include "xmalloc.h"
@@ -70,7 +71,9 @@ struct hdrcache_t {
     hash_table cache;       /* hash table of headers for quick retrieval     */
     struct header_t *head;  /* head of double-linked list of ordered headers */
     struct header_t *tail;  /* tail of double-linked list of ordered headers */
-    ptrarray_t getheader_cache;  /* header bodies returned by spool_getheader()   */
+    hash_table lookups;     /* header bodies returned by spool_getheader()   */
+    hash_table decoded;     /* ... and by spool_getheader_decoded()          */
+    ptrarray_t getheader_cache;  /* superseded results, freed with the cache */
 };
 
 hdrcache_t spool_new_hdrcache(void)
@@ -79,12 +82,27 @@ hdrcache_t spool_new_hdrcache(void)
 
     if (!construct_hash_table(&cache->cache, 4000, 0)) {
         free(cache);
-        cache = NULL;
+        return NULL;
     }
+    construct_hash_table(&cache->lookups, 64, 0);
+    construct_hash_table(&cache->decoded, 64, 0);
 
     return cache;
 }
 
+/* the headers called 'lname' have changed, so results handed out for
+ * them are out of date.  Callers may still hold them, so keep them
+ * until the cache is freed. */
+static void __spool_forget_lookups(const char *lname, hdrcache_t cache)
+{
+    strarray_t *array;
+
+    if ((array = hash_del(lname, &cache->lookups)))
+        ptrarray_append(&cache->getheader_cache, array);
+    if ((array = hash_del(lname, &cache->decoded)))
+        ptrarray_append(&cache->getheader_cache, array);
+}
+
 /* take a list of headers, pull the first one out and return it in
    name and contents.
 
@@ -275,7 +293,7 @@ static int parseheader(struct protstream *fin, FILE *fout,
 }
 
 static struct header_t *__spool_cache_header(char *name, char *body,
-                                             hash_table *table)
+                                             hdrcache_t cache)
 {
     ptrarray_t *contents;
     struct header_t *hdr = xzmalloc(sizeof(struct header_t));
@@ -285,11 +303,12 @@ static struct header_t *__spool_cache_header(char *name, char *body,
 
     /* add header to hash table */
     name = lcase(xstrdup(name));
-    contents = (ptrarray_t *) hash_lookup(name, table);
+    contents = (ptrarray_t *) hash_lookup(name, &cache->cache);
 
-    if (!contents) contents = hash_insert(name, ptrarray_new(), table);
+    if (!contents) contents = hash_insert(name, ptrarray_new(), &cache->cache);
     ptrarray_append(contents, hdr);
 
+    __spool_forget_lookups(name, cache);
     free(name);
 
     return hdr;
@@ -297,7 +316,7 @@ static struct header_t *__spool_cache_header(char *name, char *body,
 
 EXPORTED void spool_prepend_header(char *name, char *body, hdrcache_t cache)
 {
-    struct header_t *hdr = __spool_cache_header(name, body, &cache->cache);
+    struct header_t *hdr = __spool_cache_header(name, body, cache);
 
     /* link header at head of list */
     hdr->next = cache->head;
@@ -310,7 +329,7 @@ EXPORTED void spool_prepend_header(char *name, char *body, hdrcache_t cache)
 
 EXPORTED void spool_append_header(char *name, char *body, hdrcache_t cache)
 {
-    struct header_t *hdr = __spool_cache_header(name, body, &cache->cache);
+    struct header_t *hdr = __spool_cache_header(name, body, cache);
 
     /* link header at tail of list */
     hdr->prev = cache->tail;
@@ -336,6 +355,8 @@ static void __spool_remove_header(char *name, int first, int last,
     if (contents) {
         int idx;
 
+        __spool_forget_lookups(name, cache);
+
         /* normalize indices */
         if (first < 0) first += ptrarray_size(contents);
         if (last < 0) {
@@ -402,38 +423,61 @@ EXPORTED int spool_fill_hdrcache(struct protstream *fin, FILE *fout,
     return r;
 }
 
-EXPORTED const char **spool_getheader(hdrcache_t cache, const char *phead)
+static const char **__spool_getheader(hdrcache_t cache, const char *phead,
+                                      int decode)
 {
-    char *head;
+    hash_table *results = decode ? &cache->decoded : &cache->lookups;
+    strarray_t *array = NULL;
     ptrarray_t *contents;
+    char *head;
 
     assert(cache && phead);
 
     head = xstrdup(phead);
     lcase(head);
 
+    /* asked before, and not changed since? */
+    array = hash_lookup(head, results);
+    if (array) goto done;
+
     /* check the cache */
     contents = (ptrarray_t *) hash_lookup(head, &cache->cache);
 
-    free(head);
-
     if (contents && ptrarray_size(contents)) {
-        strarray_t *array = strarray_new();
         /* build read-only array of header bodies */
-
         int i;
+
+        array = strarray_new();
         for (i = 0; i < ptrarray_size(contents); i++) {
             struct header_t *hdr = ptrarray_nth(contents, i);
-            strarray_append(array, hdr->body);
-        }
 
-        /* cache the response so we clean it up later */
-        ptrarray_append(&cache->getheader_cache, array);
+            if (decode)
+                strarray_appendm(array,
+                                 charset_parse_mimeheader(hdr->body, 0));
+            else
+                strarray_append(array, hdr->body);
+        }
 
-        return (const char **) array->data;
+        /* keep the response for the next caller, and to clean up later */
+        hash_insert(head, array, results);
     }
 
-    return NULL;
+done:
+    free(head);
+    return array ? (const char **) array->data : NULL;
+}
+
+EXPORTED const char **spool_getheader(hdrcache_t cache, const char *phead)
+{
+    return __spool_getheader(cache, phead, 0);
+}
+
+/* As spool_getheader(), but with each body MIME-decoded to UTF-8.
+ * The decoding is done once per header, however often it's asked for. */
+EXPORTED const char **spool_getheader_decoded(hdrcache_t cache,
+                                              const char *phead)
+{
+    return __spool_getheader(cache, phead, 1);
 }
 
 static void __spool_free_hdrcache(ptrarray_t *pa)
@@ -457,6 +501,8 @@ EXPORTED void spool_free_hdrcache(hdrcache_t cache)
     if (!cache) return;
 
     free_hash_table(&cache->cache, (void (*)(void *)) __spool_free_hdrcache);
+    free_hash_table(&cache->lookups, (void (*)(void *)) strarray_free);
+    free_hash_table(&cache->decoded, (void (*)(void *)) strarray_free);
 
     for (i = 0; i < cache->getheader_cache.count; i++) {
         strarray_t *item = ptrarray_nth(&cache->getheader_cache, i);
@@ -487,6 +533,12 @@ EXPORTED void spool_enum_hdrcache(hdrcache_t cache,
    . bare \r are removed
 */
 EXPORTED int spool_copy_msg(struct protstream *fin, FILE *fout)
+{
+    return spool_copy_msg_guid(fin, fout, NULL);
+}
+
+EXPORTED int spool_copy_msg_guid(struct protstream *fin, FILE *fout,
+                                 struct message_guid_ctx *guidctx)
 {
     char buf[8192], *p;
     int r = 0;
@@ -537,10 +589,13 @@ EXPORTED int spool_copy_msg(struct protstream *fin, FILE *fout)
                 goto dot;
             }
             /* Remove the dot-stuffing */
-            if (fout) fputs(buf+1, fout);
+            p = buf+1;
         } else {
-            if (fout) fputs(buf, fout);
+            p = buf;
         }
+
+        if (fout) fputs(p, fout);
+        if (guidctx && !r) message_guid_update(guidctx, p, strlen(p));
     }
 
     /* wow, serious error---got a premature EOF. */
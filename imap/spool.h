@@ -45,6 +45,7 @@
 
 #include <stdio.h>
 #include "prot.h"
+#include "message_guid.h"
 
 typedef struct hdrcache_t *hdrcache_t;
 
@@ -60,10 +61,15 @@ void spool_remove_header_instance(char *name, int n, hdrcache_t cache);
 int spool_fill_hdrcache(struct protstream *fin, FILE *fout, hdrcache_t cache,
                         const char **skipheaders);
 const char **spool_getheader(hdrcache_t cache, const char *phead);
+const char **spool_getheader_decoded(hdrcache_t cache, const char *phead);
 void spool_free_hdrcache(hdrcache_t cache);
 void spool_enum_hdrcache(hdrcache_t cache,
                          void (*proc)(const char *, const char *, void *),
                          void *rock);
 int spool_copy_msg(struct protstream *fin, FILE *fout);
+/* as spool_copy_msg, also feeding every byte written to fout into 'guidctx'
+ * so the caller can finish the GUID without reading the file back */
+int spool_copy_msg_guid(struct protstream *fin, FILE *fout,
+                        struct message_guid_ctx *guidctx);
 
 #endif
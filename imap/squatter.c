@@ -57,6 +57,10 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/poll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <syslog.h>
@@ -69,6 +73,9 @@
 #include "mboxlist.h"
 #include "global.h"
 #include "exitcodes.h"
+#include "hashoa.h"
+#include "prometheus.h"
+#include "retry.h"
 #include "search_engines.h"
 #include "sync_log.h"
 #include "mailbox.h"
@@ -82,6 +89,7 @@
 #include "mboxname.h"
 #include "index.h"
 #include "message.h"
+#include "strhash.h"
 #include "util.h"
 
 /* generated headers are not necessarily in current directory */
@@ -102,6 +110,8 @@ static int xapindexed_mode = 0;
 static int recursive_flag = 0;
 static int annotation_flag = 0;
 static int sleepmicroseconds = 0;
+static int nworkers = 0;
+static const char *rolling_channel = NULL;
 static const char *temp_root_dir = NULL;
 static search_text_receiver_t *rx = NULL;
 
@@ -122,6 +132,7 @@ static int usage(const char *name)
             "  -I file     index mbox/uids in file\n"
             "  -R          start rolling indexer\n"
             "  -z tier     compact to tier\n"
+            "  -c          with -t and -z, run the compaction scheduler\n"
             "\n"
             "Index mode options:\n"
             "  -i          index incrementally\n"
@@ -137,6 +148,7 @@ static int usage(const char *name)
             "Rolling indexer options:\n"
             "  -n channel  listen to channel\n"
             "  -d          don't background process\n"
+            "  -j workers  index users in parallel with workers processes\n"
             "\n"
             "Compact mode options:\n"
             "  -t tier...  compact from tiers\n"
@@ -145,6 +157,8 @@ static int usage(const char *name)
             "  -X          reindex during compaction\n"
             "  -o          copy db rather compacting\n"
             "  -U          only compact if re-indexing\n"
+            "  -j jobs     with -c, compact this many users in parallel\n"
+            "  -d          with -c, don't background process\n"
             "\n"
             "General options:\n"
             "  -v          be verbose\n"
@@ -310,6 +324,9 @@ again:
 
     mailbox_close(&mailbox);
 
+    if (!r || r == IMAP_AGAIN)
+        prometheus_increment(CYRUS_SQUATTER_INDEXED_MAILBOXES_TOTAL);
+
     /* in non-blocking (rolling) mode, only do one batch per mailbox at
      * a time for fairness [IRIS-2471].  The squatter will re-insert the
      * mailbox in the queue */
@@ -512,6 +529,215 @@ static int do_compact(const strarray_t *mboxnames, const strarray_t *srctiers,
     return r;
 }
 
+/* ====================================================================== */
+
+/*
+ * Compaction scheduler (-c with -t/-z).
+ *
+ * Every search_compact_interval seconds, look at each user's source
+ * tiers and compact the users whose databases have grown too many,
+ * too big or too full, most fragmented first.  Up to -j users are
+ * compacted at once, each in its own process running at idle IO
+ * priority, and new compactions are only started while the bytes
+ * they will read stay within search_compact_iobudget per second.
+ */
+struct compact_job {
+    char *userid;
+    struct search_tier_stats stats;
+};
+
+static int compact_job_cmp(const void **a, const void **b)
+{
+    const struct compact_job *ja = *a;
+    const struct compact_job *jb = *b;
+
+    if (ja->stats.ndbs != jb->stats.ndbs)
+        return ja->stats.ndbs < jb->stats.ndbs ? 1 : -1;
+    if (ja->stats.bytes != jb->stats.bytes)
+        return ja->stats.bytes < jb->stats.bytes ? 1 : -1;
+    return strcmp(ja->userid, jb->userid);
+}
+
+static void compact_jobs_free(ptrarray_t **jobsp)
+{
+    ptrarray_t *jobs = *jobsp;
+    int i;
+
+    if (!jobs) return;
+
+    for (i = 0; i < jobs->count; i++) {
+        struct compact_job *job = ptrarray_nth(jobs, i);
+        free(job->userid);
+        free(job);
+    }
+    ptrarray_free(jobs);
+    *jobsp = NULL;
+}
+
+struct compact_scan_rock {
+    const strarray_t *srctiers;
+    ptrarray_t *jobs;
+};
+
+static int compact_scan_user(const mbentry_t *mbentry, void *rock)
+{
+    struct compact_scan_rock *crock = rock;
+    struct search_tier_stats stats;
+    int maxdbs = config_getint(IMAPOPT_SEARCH_COMPACT_MAXDBS);
+    unsigned long long maxsize = config_getint(IMAPOPT_SEARCH_COMPACT_MAXSIZE);
+    unsigned long long maxdocs = config_getint(IMAPOPT_SEARCH_COMPACT_MAXDOCS);
+    char *userid;
+
+    if (!mboxname_isusermailbox(mbentry->name, /*isinbox*/1))
+        return 0;
+
+    userid = mboxname_to_userid(mbentry->name);
+    if (!userid) return 0;
+
+    if (search_tier_stats(userid, crock->srctiers, &stats) || !stats.ndbs)
+        goto skip;
+
+    if ((maxdbs > 0 && stats.ndbs >= (unsigned) maxdbs) ||
+        (maxsize && stats.bytes >= maxsize * 1024 * 1024) ||
+        (maxdocs && stats.docs >= maxdocs)) {
+        struct compact_job *job = xzmalloc(sizeof(*job));
+        job->userid = userid;
+        job->stats = stats;
+        ptrarray_append(crock->jobs, job);
+        return 0;
+    }
+
+skip:
+    free(userid);
+    return 0;
+}
+
+static void compact_lower_priority(void)
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    /* from linux/ioprio.h, which glibc doesn't provide */
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_WHO_PROCESS  1
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+        syslog(LOG_NOTICE, "compact: can't set idle IO priority: %m");
+#endif
+    if (setpriority(PRIO_PROCESS, 0, 19) < 0)
+        syslog(LOG_NOTICE, "compact: can't lower CPU priority: %m");
+}
+
+/* Wait for one compaction process to finish; returns 0 if none left */
+static int compact_reap(int block)
+{
+    int status;
+    pid_t pid = waitpid(-1, &status, block ? 0 : WNOHANG);
+
+    if (pid <= 0) return 0;
+
+    prometheus_apply_delta(CYRUS_SQUATTER_COMPACTING_USERS, -1);
+    if (WIFEXITED(status) && !WEXITSTATUS(status))
+        prometheus_increment(CYRUS_SQUATTER_COMPACTED_USERS_TOTAL);
+    else
+        syslog(LOG_ERR, "compact: process %d failed with status %d",
+               (int) pid, status);
+
+    return 1;
+}
+
+static void do_compact_daemon(const strarray_t *srctiers,
+                              const char *desttier, int flags)
+{
+    int maxjobs = nworkers > 0 ? nworkers : 1;
+    int running = 0;
+
+    for (;;) {
+        struct compact_scan_rock crock = { srctiers, ptrarray_new() };
+        double budget = config_getint(IMAPOPT_SEARCH_COMPACT_IOBUDGET)
+                      * 1024.0 * 1024.0;
+        double credit = 0;
+        time_t scan_start = time(NULL);
+        struct timeval last, now;
+        int i;
+
+        mboxlist_allmbox(NULL, compact_scan_user, &crock, /*flags*/0);
+        ptrarray_sort(crock.jobs, compact_job_cmp);
+
+        if (verbose)
+            syslog(LOG_INFO, "compact: %d users due", crock.jobs->count);
+
+        gettimeofday(&last, NULL);
+        for (i = 0; i < crock.jobs->count; i++) {
+            struct compact_job *job = ptrarray_nth(crock.jobs, i);
+            pid_t pid;
+
+            /* wait for a free slot, and for the budget to allow the
+             * bytes this job will read */
+            for (;;) {
+                while (running && compact_reap(0))
+                    running--;
+
+                if (signals_poll() == SIGHUP || shutdown_file(NULL, 0))
+                    goto shutdown;
+
+                gettimeofday(&now, NULL);
+                credit += budget * timesub(&last, &now);
+                last = now;
+                if (budget && credit > budget) credit = budget;
+
+                if (running < maxjobs &&
+                    (!budget || credit >= 0))
+                    break;
+
+                usleep(100000);    /* 1/10th second */
+            }
+
+            if (verbose)
+                syslog(LOG_INFO, "compact: user %s: %u dbs, %llu bytes, %llu docs",
+                       job->userid, job->stats.ndbs,
+                       job->stats.bytes, job->stats.docs);
+
+            pid = fork();
+            if (pid == -1) {
+                syslog(LOG_ERR, "compact: fork failed: %m");
+                break;
+            }
+            if (!pid) {
+                int r;
+                compact_lower_priority();
+                r = compact_mbox(job->userid, srctiers, desttier, flags);
+                if (r)
+                    syslog(LOG_ERR, "compact: user %s: %s",
+                           job->userid, error_message(r));
+                _exit(r ? EC_TEMPFAIL : 0);
+            }
+
+            running++;
+            credit -= job->stats.bytes;
+            prometheus_apply_delta(CYRUS_SQUATTER_COMPACTING_USERS, 1);
+        }
+
+        compact_jobs_free(&crock.jobs);
+
+        /* sleep out the rest of the interval, collecting finished jobs */
+        while (time(NULL) < scan_start + config_getint(IMAPOPT_SEARCH_COMPACT_INTERVAL)) {
+            while (running && compact_reap(0))
+                running--;
+            if (signals_poll() == SIGHUP || shutdown_file(NULL, 0))
+                goto shutdown;
+            sleep(1);
+        }
+        continue;
+
+shutdown:
+        syslog(LOG_DEBUG, "compact: shutting down, waiting for %d jobs", running);
+        compact_jobs_free(&crock.jobs);
+        while (running && compact_reap(1))
+            running--;
+        shut_down(0);
+    }
+}
+
 static int do_search(const char *query, int single, const strarray_t *mboxnames)
 {
     struct mailbox *mailbox = NULL;
@@ -627,26 +853,296 @@ out:
     return r;
 }
 
+/* index one batch of mailboxes from the sync log, requeueing any
+ * which are locked or have more left to do */
+static void rolling_index_batch(const char *channel, const strarray_t *mboxnames)
+{
+    int i, r;
+
+    rx = search_begin_update(verbose);
+    if (NULL == rx) {
+        /* XXX if xapian, probably don't have conversations enabled? */
+        fatal("could not construct search text receiver", EC_CONFIG);
+    }
+    for (i = 0; i < strarray_size(mboxnames); i++) {
+        const char *mboxname = strarray_nth(mboxnames, i);
+        if (!should_index(mboxname)) continue;
+        if (verbose > 1)
+            syslog(LOG_INFO, "do_rolling: indexing %s", mboxname);
+        r = index_one(mboxname, /*blocking*/0);
+        if (r == IMAP_AGAIN || r == IMAP_MAILBOX_LOCKED) {
+            /* XXX: alternative, just append to strarray_t *mboxnames ... */
+            sync_log_channel_append(channel, mboxname);
+            prometheus_increment(CYRUS_SQUATTER_REQUEUED_MAILBOXES_TOTAL);
+        }
+        if (sleepmicroseconds)
+            usleep(sleepmicroseconds);
+    }
+    search_end_update(rx);
+    rx = NULL;
+}
+
+/* ====================================================================== */
+
+/*
+ * Parallel rolling mode (-R -j N).
+ *
+ * The supervisor reads the sync log and hands each user's mailboxes to
+ * a worker process as one batch.  Users are sharded by a hash of the
+ * userid, so any given user's search index is only ever written by one
+ * worker and workers never contend for each other's Xapian locks.
+ *
+ * Batches are sent as mailbox names, one per line, ending with an empty
+ * line.  The worker writes back a single byte for each batch it has
+ * finished.  No worker is allowed more than ROLLING_WORKER_QUEUE batches
+ * in flight: when the chosen worker is full the supervisor waits for it,
+ * and meanwhile new work just accumulates in the sync log.
+ */
+#define ROLLING_WORKER_QUEUE 4
+
+struct rolling_worker {
+    pid_t pid;
+    int batch_fd;
+    int done_fd;
+    unsigned inflight;
+};
+
+static struct rolling_worker *workers = NULL;
+
+static void rolling_worker_main(const char *channel, int batch_fd, int done_fd)
+{
+    strarray_t batch = STRARRAY_INITIALIZER;
+    char line[MAX_MAILBOX_BUFFER];
+    FILE *in = fdopen(batch_fd, "r");
+
+    if (!in) fatal("could not fdopen worker pipe", EC_OSERR);
+
+    while (fgets(line, sizeof(line), in)) {
+        size_t len = strlen(line);
+
+        if (len && line[len-1] == '\n') line[--len] = '\0';
+        if (len) {
+            strarray_append(&batch, line);
+            continue;
+        }
+
+        /* end of batch */
+        rolling_index_batch(channel, &batch);
+        strarray_truncate(&batch, 0);
+        prometheus_increment(CYRUS_SQUATTER_INDEXED_USERS_TOTAL);
+
+        if (retry_write(done_fd, "", 1) != 1)
+            break;
+    }
+
+    /* supervisor has gone away (or told us to stop) */
+    fclose(in);
+    strarray_fini(&batch);
+    shut_down(0);
+}
+
+static void rolling_start_workers(const char *channel)
+{
+    int i, j;
+
+    workers = xzmalloc(nworkers * sizeof(struct rolling_worker));
+
+    for (i = 0; i < nworkers; i++) {
+        int batchpipe[2], donepipe[2];
+        pid_t pid;
+
+        if (pipe(batchpipe) || pipe(donepipe))
+            fatal("could not create worker pipes", EC_OSERR);
+
+        pid = fork();
+        if (pid == -1)
+            fatal("could not fork rolling worker", EC_OSERR);
+
+        if (!pid) {
+            /* child: only keep our own ends */
+            for (j = 0; j < i; j++) {
+                close(workers[j].batch_fd);
+                close(workers[j].done_fd);
+            }
+            free(workers);
+            workers = NULL;
+            close(batchpipe[1]);
+            close(donepipe[0]);
+            rolling_worker_main(channel, batchpipe[0], donepipe[1]);
+            /* never returns */
+        }
+
+        close(batchpipe[0]);
+        close(donepipe[1]);
+        workers[i].pid = pid;
+        workers[i].batch_fd = batchpipe[1];
+        workers[i].done_fd = donepipe[0];
+        workers[i].inflight = 0;
+
+        syslog(LOG_INFO, "started rolling worker %d as pid %d", i, (int) pid);
+    }
+}
+
+static void rolling_stop_workers(void)
+{
+    int i;
+
+    if (!workers) return;
+
+    /* EOF on its batch pipe tells each worker to finish up */
+    for (i = 0; i < nworkers; i++)
+        close(workers[i].batch_fd);
+    for (i = 0; i < nworkers; i++) {
+        waitpid(workers[i].pid, NULL, 0);
+        close(workers[i].done_fd);
+    }
+
+    free(workers);
+    workers = NULL;
+}
+
+/* Collect finished batches.  If 'full' is a worker index, block until
+ * that worker has room in its queue; otherwise just poll. */
+static void rolling_reap_workers(int full)
+{
+    struct pollfd *pfds = xmalloc(nworkers * sizeof(struct pollfd));
+    int i;
+
+    for (;;) {
+        int timeout = (full >= 0 && workers[full].inflight >= ROLLING_WORKER_QUEUE)
+                      ? 1000 : 0;
+        int n;
+
+        for (i = 0; i < nworkers; i++) {
+            pfds[i].fd = workers[i].done_fd;
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+
+        n = poll(pfds, nworkers, timeout);
+        if (n < 0 && errno != EINTR)
+            fatal("poll on rolling workers failed", EC_OSERR);
+
+        for (i = 0; n > 0 && i < nworkers; i++) {
+            char buf[ROLLING_WORKER_QUEUE * 2];
+            ssize_t done;
+
+            if (!pfds[i].revents) continue;
+
+            done = read(workers[i].done_fd, buf, sizeof(buf));
+            if (done <= 0) {
+                syslog(LOG_ERR, "rolling worker %d (pid %d) exited, shutting down",
+                       i, (int) workers[i].pid);
+                free(pfds);
+                rolling_stop_workers();
+                shut_down(EC_TEMPFAIL);
+            }
+
+            workers[i].inflight -= done;
+            prometheus_apply_delta(CYRUS_SQUATTER_QUEUED_USERS, -done);
+        }
+
+        signals_poll();
+
+        if (!timeout || workers[full].inflight < ROLLING_WORKER_QUEUE)
+            break;
+    }
+
+    free(pfds);
+}
+
+static void rolling_dispatch(const strarray_t *mboxnames)
+{
+    hashoa_table users = HASHOA_TABLE_INITIALIZER;
+    strarray_t userids = STRARRAY_INITIALIZER;
+    struct buf batch = BUF_INITIALIZER;
+    int i;
+
+    construct_hashoa_table(&users, strarray_size(mboxnames) + 1);
+
+    /* group by user, keeping the sync log order within each user */
+    for (i = 0; i < strarray_size(mboxnames); i++) {
+        const char *mboxname = strarray_nth(mboxnames, i);
+        char *userid = mboxname_to_userid(mboxname);
+        const char *key = userid ? userid : "";
+        strarray_t *sa = hashoa_lookup(key, &users);
+
+        if (!sa) {
+            sa = strarray_new();
+            hashoa_insert(key, sa, &users);
+            strarray_append(&userids, key);
+        }
+        strarray_add(sa, mboxname);
+        free(userid);
+    }
+
+    for (i = 0; i < strarray_size(&userids); i++) {
+        const char *userid = strarray_nth(&userids, i);
+        strarray_t *sa = hashoa_lookup(userid, &users);
+        int w = strhash(userid) % nworkers;
+        int j;
+
+        if (workers[w].inflight >= ROLLING_WORKER_QUEUE)
+            rolling_reap_workers(w);
+
+        buf_reset(&batch);
+        for (j = 0; j < strarray_size(sa); j++) {
+            buf_appendcstr(&batch, strarray_nth(sa, j));
+            buf_putc(&batch, '\n');
+        }
+        buf_putc(&batch, '\n');
+
+        if (retry_write(workers[w].batch_fd, buf_base(&batch),
+                        buf_len(&batch)) != (ssize_t) buf_len(&batch)) {
+            syslog(LOG_ERR, "IOERROR: writing to rolling worker %d: %m", w);
+            /* put it back for next time */
+            for (j = 0; j < strarray_size(sa); j++)
+                sync_log_channel_append(rolling_channel, strarray_nth(sa, j));
+            continue;
+        }
+
+        workers[w].inflight++;
+        prometheus_increment(CYRUS_SQUATTER_QUEUED_USERS);
+        if (verbose > 1)
+            syslog(LOG_INFO, "do_rolling: user %s (%d mailboxes) to worker %d",
+                   userid, strarray_size(sa), w);
+    }
+
+    buf_free(&batch);
+    strarray_fini(&userids);
+    free_hashoa_table(&users, (void (*)(void *)) strarray_free);
+}
+
 static void do_rolling(const char *channel)
 {
     strarray_t *mboxnames = NULL;
     sync_log_reader_t *slr;
-    int i;
     int r;
 
     slr = sync_log_reader_create_with_channel(channel);
 
+    if (nworkers) {
+        rolling_channel = channel;
+        rolling_start_workers(channel);
+    }
+
     for (;;) {
         int sig = signals_poll();
 
         if (sig == SIGHUP && getenv("CYRUS_ISDAEMON")) {
             syslog(LOG_DEBUG, "received SIGHUP, shutting down gracefully\n");
             sync_log_reader_end(slr);
+            rolling_stop_workers();
             shut_down(0);
         }
 
-        if (shutdown_file(NULL, 0))
+        if (shutdown_file(NULL, 0)) {
+            rolling_stop_workers();
             shut_down(EC_TEMPFAIL);
+        }
+
+        if (nworkers)
+            rolling_reap_workers(-1);
 
         r = sync_log_reader_begin(slr);
         if (r) { /* including IMAP_AGAIN */
@@ -658,26 +1154,10 @@ static void do_rolling(const char *channel)
 
         if (mboxnames->count) {
             /* have some due items in the queue, try to index them */
-            rx = search_begin_update(verbose);
-            if (NULL == rx) {
-                /* XXX if xapian, probably don't have conversations enabled? */
-                fatal("could not construct search text receiver", EC_CONFIG);
-            }
-            for (i = 0; i < strarray_size(mboxnames); i++) {
-                const char *mboxname = strarray_nth(mboxnames, i);
-                if (!should_index(mboxname)) continue;
-                if (verbose > 1)
-                    syslog(LOG_INFO, "do_rolling: indexing %s", mboxname);
-                r = index_one(mboxname, /*blocking*/0);
-                if (r == IMAP_AGAIN || r == IMAP_MAILBOX_LOCKED) {
-                    /* XXX: alternative, just append to strarray_t *mboxnames ... */
-                    sync_log_channel_append(channel, mboxname);
-                }
-                if (sleepmicroseconds)
-                    usleep(sleepmicroseconds);
-            }
-            search_end_update(rx);
-            rx = NULL;
+            if (nworkers)
+                rolling_dispatch(mboxnames);
+            else
+                rolling_index_batch(channel, mboxnames);
         }
 
         strarray_free(mboxnames);
@@ -780,6 +1260,7 @@ int main(int argc, char **argv)
     int multi_folder = 0;
     int user_mode = 0;
     int compact_flags = 0;
+    int compact_daemon = 0;
     strarray_t *srctiers = NULL;
     const char *desttier = NULL;
     char *errstr = NULL;
@@ -788,7 +1269,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:I:N:RUXZT:S:Fde:f:mn:riavAz:t:ouh")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:I:N:RUXZT:S:Fcde:f:j:mn:riavAz:t:ouh")) != EOF) {
         switch (opt) {
         case 'A':
             if (mode != UNKNOWN) usage(argv[0]);
@@ -833,6 +1314,12 @@ int main(int argc, char **argv)
             temp_root_dir = optarg;
             break;
 
+        case 'c':               /* compaction scheduler (with -t, -z) */
+            if (mode != UNKNOWN && mode != COMPACT) usage(argv[0]);
+            compact_daemon = 1;
+            mode = COMPACT;
+            break;
+
         case 'd':               /* foreground (with -R) */
             background = 0;
             break;
@@ -844,6 +1331,11 @@ int main(int argc, char **argv)
             mode = SEARCH;
             break;
 
+        case 'j':               /* parallel workers (with -R) */
+            nworkers = atoi(optarg);
+            if (nworkers < 0) usage(argv[0]);
+            break;
+
         case 'f': /* alternate synclogfile used in SYNCLOG mode */
             synclogfile = optarg;
             mode = SYNCLOG;
@@ -935,7 +1427,7 @@ int main(int argc, char **argv)
             fatal(error_message(r), EC_CONFIG);
     }
 
-    if (mode == ROLLING || mode == SYNCLOG) {
+    if (mode == ROLLING || mode == SYNCLOG || compact_daemon) {
         signals_set_shutdown(&shut_down);
         signals_add_handlers(0);
     }
@@ -966,6 +1458,12 @@ int main(int argc, char **argv)
         r = do_synclogfile(synclogfile);
         break;
     case COMPACT:
+        if (compact_daemon) {
+            if (background && !getenv("CYRUS_ISDAEMON"))
+                become_daemon();
+            do_compact_daemon(srctiers, desttier, compact_flags);
+            /* never returns */
+        }
         if (recursive_flag && optind == argc) usage(argv[0]);
         expand_mboxnames(&mboxnames, argc-optind, (const char **)argv+optind, user_mode);
         r = do_compact(&mboxnames, srctiers, desttier, compact_flags);
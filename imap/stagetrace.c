@@ -0,0 +1,237 @@
+/* stagetrace.c -- span timings of the stages of a message delivery
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "xmalloc.h"
+
+#include "imap/prometheus.h"
+#include "imap/stagetrace.h"
+
+/* spans beyond these limits are still timed, but aren't logged */
+#define STAGETRACE_MAXSPANS (64)
+#define STAGETRACE_MAXDEPTH (8)
+
+static const char * const stage_names[STAGETRACE_NUMSTAGES] = {
+    "data", "verify", "mlookup", "parse", "sieve",
+    "append", "conversations", "fsync", "commit"
+};
+
+struct span {
+    enum stagetrace_stage stage;
+    double start;               /* seconds since the trace began */
+    double end;
+};
+
+static struct {
+    int active;
+    char *token;
+    struct timespec begin;
+    double last;                /* time of the last enter or leave */
+    double excl[STAGETRACE_NUMSTAGES];
+    unsigned entered[STAGETRACE_NUMSTAGES];
+    /* the open spans, innermost last */
+    int depth;
+    unsigned overflow;
+    enum stagetrace_stage open[STAGETRACE_MAXDEPTH];
+    int openspan[STAGETRACE_MAXDEPTH];  /* index in spans, or -1 */
+    struct span spans[STAGETRACE_MAXSPANS];
+    int nspans;
+    unsigned dropped;
+} trace;
+
+static double trace_elapsed(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - trace.begin.tv_sec) +
+           (now.tv_nsec - trace.begin.tv_nsec) / 1e9;
+}
+
+/* charge the time since the last transition to the innermost open span.
+ * time with no span open (e.g. waiting for the client) isn't charged */
+static double trace_charge(void)
+{
+    double now = trace_elapsed();
+
+    if (trace.depth)
+        trace.excl[trace.open[trace.depth-1]] += now - trace.last;
+    trace.last = now;
+
+    return now;
+}
+
+EXPORTED void stagetrace_begin(const char *token)
+{
+    free(trace.token);
+    memset(&trace, 0, sizeof(trace));
+
+    trace.active = 1;
+    trace.token = xstrdup(token);
+    clock_gettime(CLOCK_MONOTONIC, &trace.begin);
+}
+
+EXPORTED void stagetrace_enter(enum stagetrace_stage stage)
+{
+    double now;
+    int i = -1;
+
+    if (!trace.active) return;
+
+    if (trace.depth == STAGETRACE_MAXDEPTH) {
+        trace.overflow++;
+        return;
+    }
+
+    now = trace_charge();
+
+    if (trace.nspans < STAGETRACE_MAXSPANS) {
+        i = trace.nspans++;
+        trace.spans[i].stage = stage;
+        trace.spans[i].start = now;
+        trace.spans[i].end = now;
+    }
+    else trace.dropped++;
+
+    trace.open[trace.depth] = stage;
+    trace.openspan[trace.depth] = i;
+    trace.depth++;
+    trace.entered[stage]++;
+}
+
+EXPORTED void stagetrace_leave(enum stagetrace_stage stage)
+{
+    double now;
+    int i;
+
+    if (!trace.active) return;
+
+    if (trace.overflow) {
+        trace.overflow--;
+        return;
+    }
+
+    if (!trace.depth || trace.open[trace.depth-1] != stage) {
+        syslog(LOG_DEBUG, "stagetrace: %s: leaving %s, which isn't open",
+               trace.token, stage_names[stage]);
+        return;
+    }
+
+    now = trace_charge();
+
+    trace.depth--;
+    i = trace.openspan[trace.depth];
+    if (i >= 0) trace.spans[i].end = now;
+}
+
+EXPORTED int stagetrace_fsync(int fd)
+{
+    int r;
+
+    stagetrace_enter(STAGETRACE_FSYNC);
+    r = fsync(fd);
+    stagetrace_leave(STAGETRACE_FSYNC);
+
+    return r;
+}
+
+static void trace_log(const char *msgid, double total)
+{
+    struct buf buf = BUF_INITIALIZER;
+    int i;
+
+    buf_printf(&buf, "stagetrace: token=<%s> msgid=%s total=%.3fms",
+               trace.token, msgid ? msgid : "<>", total * 1e3);
+
+    /* each span as stage@start+duration, in milliseconds */
+    for (i = 0; i < trace.nspans; i++) {
+        const struct span *span = &trace.spans[i];
+
+        buf_printf(&buf, " %s@%.3f+%.3f", stage_names[span->stage],
+                   span->start * 1e3, (span->end - span->start) * 1e3);
+    }
+    if (trace.dropped)
+        buf_printf(&buf, " dropped=%u", trace.dropped);
+
+    /* and the time spent in each stage, less its nested stages */
+    buf_appendcstr(&buf, " self:");
+    for (i = 0; i < STAGETRACE_NUMSTAGES; i++) {
+        if (trace.entered[i])
+            buf_printf(&buf, " %s=%.3f", stage_names[i], trace.excl[i] * 1e3);
+    }
+
+    syslog(LOG_NOTICE, "%s", buf_cstring(&buf));
+    buf_free(&buf);
+}
+
+EXPORTED void stagetrace_end(enum prom_labelled_metric metric,
+                             const char *msgid, double logmin)
+{
+    double total;
+    int i;
+
+    if (!trace.active) return;
+
+    /* close anything left open, e.g. after an error */
+    trace.overflow = 0;
+    while (trace.depth)
+        stagetrace_leave(trace.open[trace.depth-1]);
+    total = trace_elapsed();
+
+    for (i = 0; i < STAGETRACE_NUMSTAGES; i++) {
+        if (trace.entered[i])
+            prometheus_observe_label(metric, stage_names[i], trace.excl[i]);
+    }
+
+    if (logmin > 0 && total >= logmin)
+        trace_log(msgid, total);
+
+    free(trace.token);
+    memset(&trace, 0, sizeof(trace));
+}
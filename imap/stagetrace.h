@@ -0,0 +1,84 @@
+/* stagetrace.h -- span timings of the stages of a message delivery
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef STAGETRACE_H
+#define STAGETRACE_H
+
+#include "imap/promdata.h"
+
+/*
+ * A trace follows one message through delivery.  Code which does
+ * work on its behalf brackets that work with stagetrace_enter() and
+ * stagetrace_leave(); spans may nest, and the time in a nested span
+ * is not counted against the span around it.  With no trace running
+ * (e.g. in imapd) entering and leaving a stage does nothing.
+ */
+enum stagetrace_stage {
+    STAGETRACE_DATA = 0,        /* DATA to final reply, not in another stage */
+    STAGETRACE_VERIFY,          /* verify_user() at RCPT */
+    STAGETRACE_MLOOKUP,
+    STAGETRACE_PARSE,           /* spooling and parsing the message */
+    STAGETRACE_SIEVE,
+    STAGETRACE_APPEND,
+    STAGETRACE_CONVERSATIONS,
+    STAGETRACE_FSYNC,
+    STAGETRACE_COMMIT,
+    STAGETRACE_NUMSTAGES
+};
+
+/* start a trace identified by 'token', discarding any unfinished one */
+extern void stagetrace_begin(const char *token);
+
+extern void stagetrace_enter(enum stagetrace_stage stage);
+extern void stagetrace_leave(enum stagetrace_stage stage);
+
+/* fsync(2), traced as the fsync stage */
+extern int stagetrace_fsync(int fd);
+
+/* finish the trace: observe the time spent in each stage that was
+ * entered in the labelled histogram 'metric', and log the spans if
+ * the trace took at least 'logmin' seconds (never if 'logmin' is 0).
+ * 'msgid' is only used for the log line and may be NULL */
+extern void stagetrace_end(enum prom_labelled_metric metric,
+                           const char *msgid, double logmin);
+
+#endif /* STAGETRACE_H */
@@ -66,6 +66,11 @@ extern int status_lookup_mbentry(const mbentry_t *mbentry, const char *userid,
 extern int status_lookup_mailbox(struct mailbox *mailbox, const char *userid,
                                  unsigned statusitems, struct statusdata *sdata);
 
+/* read ahead the mailboxes which a batch of lookups will need to open */
+extern void status_prefetch_mbentries(const ptrarray_t *mbentries,
+                                      const char *userid,
+                                      unsigned statusitems);
+
 /* invalidate (delete) statuscache entry for the mailbox,
    optionally writing the data for one user in the same transaction */
 extern int statuscache_invalidate(const char *mboxname,
@@ -438,6 +438,14 @@ static int status_load_mailbox(struct mailbox *mailbox, const char *userid,
 
         if (internalseen) {
             recentuid = mailbox->i.recentuid;
+
+            /* the index header already counts the internal unseen */
+            if (mailbox->i.minor_version > 13) {
+                status_fill_seen(userid, sdata,
+                                 mailbox_count_recent(mailbox, recentuid),
+                                 mailbox->i.unseen);
+                goto done;
+            }
         } else {
             struct seen *seendb = NULL;
             struct seendata sd = SEENDATA_INITIALIZER;
@@ -473,6 +481,7 @@ static int status_load_mailbox(struct mailbox *mailbox, const char *userid,
         status_fill_seen(userid, sdata, numrecent, numunseen);
     }
 
+done:
     statuscache_invalidate(mailbox->name, sdata);
 
     return 0;
@@ -553,6 +562,70 @@ EXPORTED int status_lookup_mbname(const mbname_t *mbname, const char *userid,
     return status_lookup_mboxname(mbname_intname(mbname), userid, statusitems, sdata);
 }
 
+struct status_prefetch {
+    const char *partition;
+    char *fname;
+};
+
+static int status_prefetch_cmp(const void *a, const void *b)
+{
+    const struct status_prefetch *pa = a, *pb = b;
+    int r = strcmpsafe(pa->partition, pb->partition);
+    if (!r) r = strcmp(pa->fname, pb->fname);
+    return r;
+}
+
+/*
+ * Read ahead the index files of every mailbox in 'mbentries' that the
+ * statuscache can't answer for, so that the status_lookup_mbentry()
+ * calls which follow find them in memory.  The files are visited in
+ * partition and path order, and the kernel services the reads for the
+ * whole batch at once rather than one mailbox open at a time.
+ */
+EXPORTED void status_prefetch_mbentries(const ptrarray_t *mbentries,
+                                        const char *userid,
+                                        unsigned statusitems)
+{
+    struct status_prefetch *files;
+    int i, n = 0;
+
+    statusitems &= ~STATUS_CONVITEMS;
+    if (!(statusitems & (STATUS_INDEXITEMS|STATUS_SEENITEMS)))
+        return;
+
+    files = xzmalloc(mbentries->count * sizeof(struct status_prefetch));
+
+    for (i = 0; i < mbentries->count; i++) {
+        const mbentry_t *mbentry = ptrarray_nth(mbentries, i);
+        struct statusdata sdata = STATUSDATA_INIT;
+
+        if (mbentry->mbtype & (MBTYPE_REMOTE|MBTYPE_INTERMEDIATE)) continue;
+
+        status_fill_mbentry(mbentry, &sdata);
+        if ((sdata.statusitems & statusitems) == statusitems) continue;
+
+        if (config_getswitch(IMAPOPT_STATUSCACHE) &&
+            !statuscache_lookup(mbentry->name, userid, statusitems, &sdata))
+            continue;
+
+        const char *fname = mbentry_metapath(mbentry, META_INDEX, 0);
+        if (!fname) continue;
+
+        files[n].partition = mbentry->partition;
+        files[n].fname = xstrdup(fname);
+        n++;
+    }
+
+    qsort(files, n, sizeof(struct status_prefetch), status_prefetch_cmp);
+
+    for (i = 0; i < n; i++) {
+        warmup_file(files[i].fname, 0, 0);
+        free(files[i].fname);
+    }
+
+    free(files);
+}
+
 /*
  * Performs a STATUS command on an open mailbox
  */
@@ -48,6 +48,7 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -83,6 +84,8 @@
 #include "xstrlcat.h"
 #include "signals.h"
 #include "cyrusdb.h"
+#include "retry.h"
+#include "strhash.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -109,6 +112,7 @@ static int connect_once    = 0;
 static int background      = 0;
 static int do_compress     = 0;
 static int no_copyback     = 0;
+static int nshards         = 0;
 
 static char *prev_userid;
 
@@ -125,7 +129,7 @@ static void shut_down(int code)
 static int usage(const char *name)
 {
     fprintf(stderr,
-            "usage: %s -S <servername> [-C <alt_config>] [-r] [-v] mailbox...\n", name);
+            "usage: %s -S <servername> [-C <alt_config>] [-r [-j N]] [-v] mailbox...\n", name);
 
     exit(EC_USAGE);
 }
@@ -578,6 +582,237 @@ static int do_sync_filename(const char *filename)
 }
 
 
+/* ====================================================================== */
+
+/* Sharded rolling replication: the parent reads the sync log and splits
+ * it by user into one file per worker, and each worker replays its file
+ * over its own connection to the replica.  All of a user's events land
+ * on the same worker in their original order, and the parent only
+ * removes the log file once every worker has succeeded with its part. */
+
+struct sync_shard {
+    pid_t pid;
+    int cmdfd;          /* parent -> worker: shard file names */
+    int resfd;          /* worker -> parent: one result per file */
+    char *fname;
+    unsigned count;
+};
+
+static struct sync_shard *shards = NULL;
+static int shards_pingok = 0;
+
+static void replica_connect(const char *channel);
+static void replica_disconnect(void);
+
+static void shard_worker(const char *channel, int cmdfd, int resfd)
+{
+    char fname[MAX_MAILBOX_PATH+1];
+    FILE *in;
+
+    replica_connect(channel);
+
+    in = fdopen(cmdfd, "r");
+    if (!in) fatal("fdopen failed", EC_OSERR);
+
+    while (fgets(fname, sizeof(fname), in)) {
+        sync_log_reader_t *slr;
+        int reply[2] = { 0, 0 };
+        size_t len = strlen(fname);
+        int fd;
+
+        if (len && fname[len-1] == '\n') fname[--len] = '\0';
+
+        fd = open(fname, O_RDONLY, 0);
+        if (fd < 0) {
+            syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+            reply[0] = IMAP_IOERROR;
+        }
+        else {
+            slr = sync_log_reader_create_with_fd(fd);
+            reply[0] = sync_log_reader_begin(slr);
+            if (!reply[0]) reply[0] = do_sync(slr, &channel);
+            sync_log_reader_end(slr);
+            sync_log_reader_free(slr);
+            close(fd);
+        }
+
+        if (reply[0]) reply[1] = !backend_ping(sync_backend, NULL);
+
+        if (retry_write(resfd, reply, sizeof(reply)) < 0)
+            break;
+    }
+
+    fclose(in);
+    replica_disconnect();
+    _exit(0);
+}
+
+static void shards_start(const char *channel)
+{
+    int i, j;
+
+    shards = xzmalloc(nshards * sizeof(struct sync_shard));
+
+    for (i = 0; i < nshards; i++) {
+        int cmdpipe[2], respipe[2];
+
+        if (pipe(cmdpipe) < 0 || pipe(respipe) < 0)
+            fatal("pipe failed", EC_OSERR);
+
+        shards[i].pid = fork();
+        if (shards[i].pid < 0)
+            fatal("fork failed", EC_OSERR);
+
+        if (!shards[i].pid) {
+            /* child: drop every other worker's pipes */
+            for (j = 0; j < i; j++) {
+                close(shards[j].cmdfd);
+                close(shards[j].resfd);
+            }
+            close(cmdpipe[1]);
+            close(respipe[0]);
+            shard_worker(channel, cmdpipe[0], respipe[1]);
+        }
+
+        close(cmdpipe[0]);
+        close(respipe[1]);
+        shards[i].cmdfd = cmdpipe[1];
+        shards[i].resfd = respipe[0];
+    }
+}
+
+static void shards_stop(void)
+{
+    int i;
+
+    if (!shards) return;
+
+    /* closing the command pipe tells the worker to finish up */
+    for (i = 0; i < nshards; i++)
+        close(shards[i].cmdfd);
+
+    for (i = 0; i < nshards; i++) {
+        int status;
+        while (waitpid(shards[i].pid, &status, 0) < 0 && errno == EINTR);
+        close(shards[i].resfd);
+        free(shards[i].fname);
+    }
+
+    free(shards);
+    shards = NULL;
+}
+
+static int shard_for_item(const char *args[3])
+{
+    char *userid = NULL;
+    int shard = 0;
+
+    if (!strcmp(args[0], "USER") || !strcmp(args[0], "UNUSER") ||
+        !strcmp(args[0], "META") || !strcmp(args[0], "SIEVE") ||
+        !strcmp(args[0], "SEEN") || !strcmp(args[0], "SUB") ||
+        !strcmp(args[0], "UNSUB"))
+        userid = xstrdupnull(args[1]);
+    else
+        userid = mboxname_to_userid(args[1]);
+
+    /* shared mailboxes and server annotations all go to the first */
+    if (userid) shard = strhash(userid) % nshards;
+
+    free(userid);
+    return shard;
+}
+
+static int do_sync_sharded(sync_log_reader_t *slr)
+{
+    struct protstream **outs = xzmalloc(nshards * sizeof(struct protstream *));
+    const char *args[3];
+    int i, r = 0;
+
+    shards_pingok = 1;
+
+    for (i = 0; i < nshards; i++) {
+        struct buf buf = BUF_INITIALIZER;
+        int fd;
+
+        buf_printf(&buf, "%s.%d", sync_log_reader_get_file_name(slr), i);
+        free(shards[i].fname);
+        shards[i].fname = buf_release(&buf);
+        shards[i].count = 0;
+
+        fd = open(shards[i].fname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+        if (fd < 0) {
+            syslog(LOG_ERR, "IOERROR: creating %s: %m", shards[i].fname);
+            r = IMAP_IOERROR;
+            goto done;
+        }
+        outs[i] = prot_new(fd, /*write*/1);
+        prot_setisclient(outs[i], 1);
+    }
+
+    while (sync_log_reader_getitem(slr, args) != EOF) {
+        struct sync_shard *shard = &shards[shard_for_item(args)];
+        struct protstream *out = outs[shard - shards];
+
+        prot_printf(out, "%s ", args[0]);
+        prot_printastring(out, args[1]);
+        if (args[2]) {
+            prot_putc(' ', out);
+            prot_printastring(out, args[2]);
+        }
+        prot_putc('\n', out);
+        shard->count++;
+    }
+
+    for (i = 0; i < nshards; i++) {
+        int fd = outs[i]->fd;
+        if (prot_flush(outs[i]) == EOF) r = IMAP_IOERROR;
+        prot_free(outs[i]);
+        outs[i] = NULL;
+        close(fd);
+    }
+    if (r) goto done;
+
+    /* hand the files out, then wait until every worker is done */
+    for (i = 0; i < nshards; i++) {
+        if (!shards[i].count) continue;
+        if (retry_write(shards[i].cmdfd, shards[i].fname,
+                        strlen(shards[i].fname)) < 0 ||
+            retry_write(shards[i].cmdfd, "\n", 1) < 0) {
+            syslog(LOG_ERR, "IOERROR: sync worker %d went away", i);
+            shards[i].count = 0;
+            r = IMAP_IOERROR;
+        }
+    }
+
+    for (i = 0; i < nshards; i++) {
+        int reply[2];
+
+        if (!shards[i].count) continue;
+        if (retry_read(shards[i].resfd, reply, sizeof(reply)) != sizeof(reply)) {
+            syslog(LOG_ERR, "IOERROR: sync worker %d went away", i);
+            reply[0] = IMAP_IOERROR;
+            reply[1] = 1;
+        }
+        if (reply[0]) {
+            if (!r) r = reply[0];
+            if (!reply[1]) shards_pingok = 0;
+        }
+    }
+
+done:
+    for (i = 0; i < nshards; i++) {
+        if (outs[i]) {
+            int fd = outs[i]->fd;
+            prot_free(outs[i]);
+            close(fd);
+        }
+        if (shards[i].fname) unlink(shards[i].fname);
+    }
+    free(outs);
+
+    return r;
+}
+
 /* ====================================================================== */
 
 enum {
@@ -636,7 +871,8 @@ static int do_daemon_work(const char *channel, const char *sync_shutdown_file,
         }
 
         /* Process the work log */
-        if ((r=do_sync(slr, &channel))) {
+        r = shards ? do_sync_sharded(slr) : do_sync(slr, &channel);
+        if (r) {
             syslog(LOG_ERR,
                    "Processing sync log file %s failed: %s",
                    sync_log_reader_get_file_name(slr), error_message(r));
@@ -653,7 +889,8 @@ static int do_daemon_work(const char *channel, const char *sync_shutdown_file,
     }
     sync_log_reader_free(slr);
 
-    if (*restartp == RESTART_NORMAL) {
+    /* sharded workers are simply restarted along with their connections */
+    if (*restartp == RESTART_NORMAL && !shards) {
         r = do_restart();
         if (r) {
             syslog(LOG_ERR, "sync_client RESTART failed: %s",
@@ -674,6 +911,7 @@ static void replica_connect(const char *channel)
     int timeout;
     const char *port, *auth_status = NULL;
     int try_imap;
+    int compressed = 0;
 
     cb = mysasl_callbacks(NULL,
                           sync_get_config(channel, "sync_authname"),
@@ -735,9 +973,42 @@ static void replica_connect(const char *channel)
         tcp_enable_keepalive(sync_backend->sock);
     }
 
+#ifdef HAVE_ZSTD
+    /* Prefer zstd, optionally with a shared dictionary */
+    if (CAPA(sync_backend, CAPA_COMPRESS_ZSTD) &&
+        sync_backend->prot->u.std.zstd_cmd.cmd) {
+        struct buf dict = BUF_INITIALIZER;
+
+        if (sync_zstd_dictionary(&dict)) {
+            syslog(LOG_NOTICE, "Can't load zstd dictionary, not using zstd");
+        }
+        else {
+            prot_printf(sync_backend->out, "%s\r\n",
+                        sync_backend->prot->u.std.zstd_cmd.cmd);
+            prot_flush(sync_backend->out);
+
+            if (sync_parse_response("COMPRESS", sync_backend->in, NULL)) {
+                syslog(LOG_NOTICE, "Failed to enable zstd compression");
+            }
+            else {
+                const char *base = buf_len(&dict) ? buf_base(&dict) : NULL;
+
+                if (prot_setcompress_zstd(sync_backend->in, base, buf_len(&dict)) ||
+                    prot_setcompress_zstd(sync_backend->out, base, buf_len(&dict)))
+                    fatal("Failed to start zstd compression, aborting", EC_SOFTWARE);
+                compressed = 1;
+            }
+        }
+        buf_free(&dict);
+    }
+#endif
+
 #ifdef HAVE_ZLIB
     /* Does the backend support compression? */
-    if (CAPA(sync_backend, CAPA_COMPRESS)) {
+    if (compressed) {
+        /* already done */
+    }
+    else if (CAPA(sync_backend, CAPA_COMPRESS)) {
         prot_printf(sync_backend->out, "%s\r\n",
                     sync_backend->prot->u.std.compress_cmd.cmd);
         prot_flush(sync_backend->out);
@@ -749,11 +1020,17 @@ static void replica_connect(const char *channel)
         else {
             prot_setcompress(sync_backend->in);
             prot_setcompress(sync_backend->out);
+            compressed = 1;
         }
     }
-    else if (do_compress) fatal("Backend does not support compression, aborting", EC_SOFTWARE);
 #endif
 
+    if (!compressed && do_compress)
+        fatal("Backend does not support compression, aborting", EC_SOFTWARE);
+
+    /* replicas which can parse it get the compact dlist encoding */
+    sync_set_binary_dlist(CAPA(sync_backend, CAPA_DLIST_BINARY));
+
     /* links to sockets */
     sync_in = sync_backend->in;
     sync_out = sync_backend->out;
@@ -787,7 +1064,8 @@ static void do_daemon(const char *channel, const char *sync_shutdown_file,
     signal(SIGPIPE, SIG_IGN); /* don't fail on server disconnects */
 
     while (restart) {
-        replica_connect(channel);
+        if (nshards > 1) shards_start(channel);
+        else replica_connect(channel);
         r = do_daemon_work(channel, sync_shutdown_file,
                            timeout, min_delta, &restart);
         if (r) {
@@ -795,9 +1073,11 @@ static void do_daemon(const char *channel, const char *sync_shutdown_file,
              * If we are, we had some type of error, so we exit.
              * Otherwise, try reconnecting.
              */
-            if (!backend_ping(sync_backend, NULL)) restart = 1;
+            if (shards ? shards_pingok : !backend_ping(sync_backend, NULL))
+                restart = 1;
         }
-        replica_disconnect();
+        if (shards) shards_stop();
+        else replica_disconnect();
     }
 }
 
@@ -896,7 +1176,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:vlLS:F:f:w:t:d:n:rRumsozOAp:")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:vlLS:F:f:w:t:d:n:j:rRumsozOAp:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -935,6 +1215,11 @@ int main(int argc, char **argv)
             channel = optarg;
             break;
 
+        case 'j':
+            nshards = atoi(optarg);
+            if (nshards < 1) usage("sync_client");
+            break;
+
         case 'w':
             wait = atoi(optarg);
             break;
@@ -471,7 +471,10 @@ EXPORTED int sync_log_reader_begin(sync_log_reader_t *slr)
         if (r) return r;
     }
 
-    if (stat(slr->work_file, &sbuf) == 0) {
+    if (!slr->work_file) {
+        /* reading from a file descriptor, nothing to rename */
+    }
+    else if (stat(slr->work_file, &sbuf) == 0) {
         /* Existing work log file - process this first */
         syslog(LOG_NOTICE,
                "Reprocessing sync log file %s", slr->work_file);
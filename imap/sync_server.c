@@ -202,7 +202,7 @@ static void sync_reset(void)
 
     sync_clienthost = "[local]";
     if (sync_logfd != -1) {
-        close(sync_logfd);
+        telemetry_close(sync_logfd);
         sync_logfd = -1;
     }
     if (sync_userid != NULL) {
@@ -289,6 +289,13 @@ static void dobanner(void)
             prot_printf(sync_out, "* COMPRESS DEFLATE\r\n");
         }
 #endif
+#ifdef HAVE_ZSTD
+        if (!sync_compress_done && !sync_starttls_done) {
+            prot_printf(sync_out, "* COMPRESS ZSTD\r\n");
+        }
+#endif
+
+        prot_printf(sync_out, "* DLIST BINARY\r\n");
     }
 
     prot_printf(sync_out,
@@ -839,27 +846,51 @@ static void cmd_starttls(void)
 }
 #endif /* HAVE_SSL */
 
-#ifdef HAVE_ZLIB
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
 static void cmd_compress(char *alg)
 {
     if (sync_compress_done) {
         prot_printf(sync_out, "NO Compression already active: %s\r\n", alg);
         return;
     }
-    if (strcasecmp(alg, "DEFLATE")) {
-        prot_printf(sync_out, "NO Unknown compression algorithm: %s\r\n", alg);
+#ifdef HAVE_ZSTD
+    if (!strcasecmp(alg, "ZSTD")) {
+        struct buf dict = BUF_INITIALIZER;
+        const char *base;
+
+        if (sync_zstd_dictionary(&dict)) {
+            prot_printf(sync_out, "NO Error initializing %s "
+                        "(dictionary unavailable)\r\n", alg);
+            return;
+        }
+        base = buf_len(&dict) ? buf_base(&dict) : NULL;
+
+        prot_printf(sync_out, "OK %s active\r\n", alg);
+        prot_flush(sync_out);
+        if (prot_setcompress_zstd(sync_in, base, buf_len(&dict)) ||
+            prot_setcompress_zstd(sync_out, base, buf_len(&dict)))
+            fatal("Failed to start zstd compression", EC_SOFTWARE);
+        buf_free(&dict);
+        sync_compress_done = 1;
         return;
     }
-    if (ZLIB_VERSION[0] != zlibVersion()[0]) {
-        prot_printf(sync_out, "NO Error initializing %s "
-                    "(incompatible zlib version)\r\n", alg);
+#endif
+#ifdef HAVE_ZLIB
+    if (!strcasecmp(alg, "DEFLATE")) {
+        if (ZLIB_VERSION[0] != zlibVersion()[0]) {
+            prot_printf(sync_out, "NO Error initializing %s "
+                        "(incompatible zlib version)\r\n", alg);
+            return;
+        }
+        prot_printf(sync_out, "OK %s active\r\n", alg);
+        prot_flush(sync_out);
+        prot_setcompress(sync_in);
+        prot_setcompress(sync_out);
+        sync_compress_done = 1;
         return;
     }
-    prot_printf(sync_out, "OK %s active\r\n", alg);
-    prot_flush(sync_out);
-    prot_setcompress(sync_in);
-    prot_setcompress(sync_out);
-    sync_compress_done = 1;
+#endif
+    prot_printf(sync_out, "NO Unknown compression algorithm: %s\r\n", alg);
 }
 #else
 static void cmd_compress(char *alg __attribute__((unused)))
@@ -133,12 +133,15 @@ struct protocol_t csync_protocol =
         { { "SASL", CAPA_AUTH },
           { "STARTTLS", CAPA_STARTTLS },
           { "COMPRESS=DEFLATE", CAPA_COMPRESS },
+          { "COMPRESS=ZSTD", CAPA_COMPRESS_ZSTD },
+          { "DLIST=BINARY", CAPA_DLIST_BINARY },
           { NULL, 0 } } },
       { "STARTTLS", "OK", "NO", 1 },
       { "AUTHENTICATE", USHRT_MAX, 0, "OK", "NO", "+ ", "*", NULL, 0 },
       { "COMPRESS DEFLATE", NULL, "OK" },
       { "NOOP", NULL, "OK" },
-      { "EXIT", NULL, "OK" } } }
+      { "EXIT", NULL, "OK" },
+      { "COMPRESS ZSTD", NULL, "OK" } } }
 };
 
 /* parse_success api is undocumented but my current understanding
@@ -283,6 +286,38 @@ EXPORTED int sync_get_switchconfig(const char *channel, const char *val)
     return response;
 }
 
+/*
+ * Map the configured sync_zstd_dictionary into @dict.  Leaves @dict
+ * empty if none is configured.  Caller must buf_free() it, the
+ * compressor takes its own copy.
+ */
+EXPORTED int sync_zstd_dictionary(struct buf *dict)
+{
+    const char *fname = config_getstring(IMAPOPT_SYNC_ZSTD_DICTIONARY);
+    struct stat sbuf;
+    int fd;
+
+    buf_reset(dict);
+    if (!fname) return 0;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: open %s: %m", fname);
+        return IMAP_IOERROR;
+    }
+
+    if (fstat(fd, &sbuf) == -1 || !sbuf.st_size) {
+        syslog(LOG_ERR, "IOERROR: unusable zstd dictionary %s", fname);
+        close(fd);
+        return IMAP_IOERROR;
+    }
+
+    buf_init_mmap(dict, /*onceonly*/1, fd, fname, sbuf.st_size, NULL);
+    close(fd);
+
+    return 0;
+}
+
 /* Parse routines */
 
 char *sync_encode_options(int options)
@@ -1826,6 +1861,21 @@ static const char *sync_gentag(struct buf *tag)
     return buf_cstring(tag);
 }
 
+static int sync_binary_dlist = 0;
+
+EXPORTED void sync_set_binary_dlist(int enable)
+{
+    sync_binary_dlist = enable;
+}
+
+static void sync_print_dlist(struct dlist *kl, struct protstream *out)
+{
+    if (sync_binary_dlist)
+        dlist_print_binary(kl, 1, out);
+    else
+        dlist_print(kl, 1, out);
+}
+
 /* these are one-shot commands for get and apply, so flush the stream
  * after sending */
 void sync_send_apply(struct dlist *kl, struct protstream *out)
@@ -1835,7 +1885,7 @@ void sync_send_apply(struct dlist *kl, struct protstream *out)
         prot_printf(out, "%s SYNC", sync_gentag((struct buf *) out->userdata));
     }
     prot_printf(out, "APPLY ");
-    dlist_print(kl, 1, out);
+    sync_print_dlist(kl, out);
     prot_printf(out, "\r\n");
     prot_flush(out);
 }
@@ -1847,7 +1897,7 @@ void sync_send_lookup(struct dlist *kl, struct protstream *out)
         prot_printf(out, "%s SYNC", sync_gentag((struct buf *) out->userdata));
     }
     prot_printf(out, "GET ");
-    dlist_print(kl, 1, out);
+    sync_print_dlist(kl, out);
     prot_printf(out, "\r\n");
     prot_flush(out);
 }
@@ -1869,7 +1919,7 @@ void sync_send_restore(struct dlist *kl, struct protstream *out)
         prot_printf(out, "%s SYNC", sync_gentag((struct buf *) out->userdata));
     }
     prot_printf(out, "RESTORE ");
-    dlist_print(kl, 1, out);
+    sync_print_dlist(kl, out);
     prot_printf(out, "\r\n");
     prot_flush(out);
 }
@@ -2208,6 +2258,7 @@ int sync_append_copyfile(struct mailbox *mailbox,
                item->fname, destname);
         return r;
     }
+    mailbox_sis_share(mailbox, record, destname);
 
  just_write:
     r = mailbox_append_index_record(mailbox, record);
@@ -2262,13 +2313,57 @@ done:
 
 /* =======================  server-side sync  =========================== */
 
+/* Reserve the message file of @record for @item, after checking that
+ * the file on disk really has the expected GUID.  Returns 1 if reserved */
+static int reserve_record(const char *part, struct mailbox *mailbox,
+                          const struct index_record *record,
+                          struct sync_msgid *item,
+                          struct sync_msgid_list *part_list)
+{
+    const char *mailbox_msg_path, *stage_msg_path;
+    int r;
+
+    /* Attempt to reserve this message */
+    mailbox_msg_path = mailbox_record_fname(mailbox, record);
+    stage_msg_path = dlist_reserve_path(part, record->internal_flags & FLAG_INTERNAL_ARCHIVED,
+                                        0, &record->guid);
+
+    /* check that the sha1 of the file on disk is correct */
+    struct index_record record2;
+    memset(&record2, 0, sizeof(struct index_record));
+    r = message_parse(mailbox_msg_path, &record2);
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: Unable to parse %s",
+               mailbox_msg_path);
+        return 0;
+    }
+    if (!message_guid_equal(&record->guid, &record2.guid)) {
+        syslog(LOG_ERR, "IOERROR: GUID mismatch on parse for %s",
+               mailbox_msg_path);
+        return 0;
+    }
+
+    if (mailbox_copyfile(mailbox_msg_path, stage_msg_path, 0) != 0) {
+        syslog(LOG_ERR, "IOERROR: Unable to link %s -> %s: %m",
+               mailbox_msg_path, stage_msg_path);
+        return 0;
+    }
+
+    item->size = record->size;
+    item->fname = xstrdup(stage_msg_path); /* track the correct location */
+    item->is_archive = (record->internal_flags & FLAG_INTERNAL_ARCHIVED) ? 1 : 0;
+    item->need_upload = 0;
+    part_list->toupload--;
+
+    return 1;
+}
+
 static void reserve_folder(const char *part, const char *mboxname,
                     struct sync_msgid_list *part_list)
 {
     struct mailbox *mailbox = NULL;
     int r;
     struct sync_msgid *item;
-    const char *mailbox_msg_path, *stage_msg_path;
     int num_reserved;
 
 redo:
@@ -2293,37 +2388,8 @@ redo:
         if (!item->need_upload)
             continue;
 
-        /* Attempt to reserve this message */
-        mailbox_msg_path = mailbox_record_fname(mailbox, record);
-        stage_msg_path = dlist_reserve_path(part, record->internal_flags & FLAG_INTERNAL_ARCHIVED,
-                                            0, &record->guid);
-
-        /* check that the sha1 of the file on disk is correct */
-        struct index_record record2;
-        memset(&record2, 0, sizeof(struct index_record));
-        r = message_parse(mailbox_msg_path, &record2);
-        if (r) {
-            syslog(LOG_ERR, "IOERROR: Unable to parse %s",
-                   mailbox_msg_path);
+        if (!reserve_record(part, mailbox, record, item, part_list))
             continue;
-        }
-        if (!message_guid_equal(&record->guid, &record2.guid)) {
-            syslog(LOG_ERR, "IOERROR: GUID mismatch on parse for %s",
-                   mailbox_msg_path);
-            continue;
-        }
-
-        if (mailbox_copyfile(mailbox_msg_path, stage_msg_path, 0) != 0) {
-            syslog(LOG_ERR, "IOERROR: Unable to link %s -> %s: %m",
-                   mailbox_msg_path, stage_msg_path);
-            continue;
-        }
-
-        item->size = record->size;
-        item->fname = xstrdup(stage_msg_path); /* track the correct location */
-        item->is_archive = (record->internal_flags & FLAG_INTERNAL_ARCHIVED) ? 1 : 0;
-        item->need_upload = 0;
-        part_list->toupload--;
         num_reserved++;
 
         /* already found everything, drop out */
@@ -2342,6 +2408,111 @@ redo:
     mailbox_close(&mailbox);
 }
 
+struct reserve_index_rock {
+    const char *part;
+    struct sync_msgid_list *part_list;
+    hash_table uids;            /* mboxname => arrayu64_t of UIDs */
+};
+
+static int reserve_index_cb(const conv_guidrec_t *rec, void *rock)
+{
+    struct reserve_index_rock *rrock = (struct reserve_index_rock *) rock;
+    arrayu64_t *uids;
+
+    /* only whole messages, and only copies which still exist */
+    if (rec->part) return 0;
+    if (rec->version > 0 && (rec->internal_flags & FLAG_INTERNAL_EXPUNGED))
+        return 0;
+
+    uids = hash_lookup(rec->mboxname, &rrock->uids);
+    if (!uids) {
+        uids = arrayu64_new();
+        hash_insert(rec->mboxname, uids, &rrock->uids);
+    }
+    arrayu64_append(uids, rec->uid);
+
+    /* one copy is enough */
+    return CYRUSDB_DONE;
+}
+
+static void reserve_index_folder(const char *mboxname, void *data, void *rock)
+{
+    struct reserve_index_rock *rrock = (struct reserve_index_rock *) rock;
+    arrayu64_t *uids = (arrayu64_t *) data;
+    struct mailbox *mailbox = NULL;
+    struct sync_msgid *item;
+    int i, r;
+
+    if (!rrock->part_list->toupload) return;
+
+    r = mailbox_open_irl(mboxname, &mailbox);
+    if (!r) r = sync_mailbox_version_check(&mailbox);
+    if (r) return;
+
+    for (i = 0; i < arrayu64_size(uids); i++) {
+        struct index_record record;
+
+        r = mailbox_find_index_record(mailbox, arrayu64_nth(uids, i), &record);
+        if (r || (record.internal_flags & FLAG_INTERNAL_UNLINKED))
+            continue;
+
+        /* the index may be stale, so trust only the mailbox record */
+        item = sync_msgid_lookup(rrock->part_list, &record.guid);
+        if (!item || !item->need_upload)
+            continue;
+
+        reserve_record(rrock->part, mailbox, &record, item, rrock->part_list);
+        if (!rrock->part_list->toupload) break;
+    }
+
+    mailbox_close(&mailbox);
+}
+
+/* Use the owner's conversations GUID records to find copies of the
+ * wanted messages directly, rather than reading every candidate
+ * folder's index.  Anything not found here is left for reserve_folder */
+static void reserve_from_index(const char *part, const char *mboxname,
+                               struct sync_msgid_list *part_list)
+{
+    struct reserve_index_rock rrock;
+    struct conversations_state *cstate = NULL;
+    struct sync_msgid *item;
+    struct stat sbuf;
+    char *userid = NULL;
+    char *path = NULL;
+
+    if (!config_getswitch(IMAPOPT_CONVERSATIONS)) return;
+
+    userid = mboxname_to_userid(mboxname);
+    if (!userid) goto done;
+
+    /* don't create a conversations database just to look in it */
+    path = conversations_getuserpath(userid);
+    if (!path || stat(path, &sbuf)) goto done;
+
+    if (conversations_open_path(path, userid, &cstate)) goto done;
+
+    rrock.part = part;
+    rrock.part_list = part_list;
+    construct_hash_table(&rrock.uids, 64, 0);
+
+    for (item = part_list->head; item; item = item->next) {
+        if (!item->need_upload) continue;
+        conversations_guid_foreach(cstate, message_guid_encode(&item->guid),
+                                   reserve_index_cb, &rrock);
+    }
+
+    /* release the conversations lock before opening any mailboxes */
+    conversations_abort(&cstate);
+
+    hash_enumerate(&rrock.uids, reserve_index_folder, &rrock);
+    free_hash_table(&rrock.uids, (void (*)(void *)) arrayu64_free);
+
+done:
+    free(path);
+    free(userid);
+}
+
 int sync_apply_reserve(struct dlist *kl,
                        struct sync_reserve_list *reserve_list,
                        struct sync_state *sstate)
@@ -2374,6 +2545,10 @@ int sync_apply_reserve(struct dlist *kl,
         sync_name_list_add(folder_names, i->sval);
     }
 
+    /* try a direct lookup first, then fall back to scanning folders */
+    if (folder_names->head)
+        reserve_from_index(partition, folder_names->head->name, part_list);
+
     for (folder = folder_names->head; folder; folder = folder->next) {
         if (!part_list->toupload) break;
         if (mboxlist_lookup(folder->name, &mbentry, 0))
@@ -5397,12 +5572,100 @@ static int is_unchanged(struct mailbox *mailbox, struct sync_folder *remote)
 #define SYNC_FLAG_ISREPEAT      (1<<15)
 #define SYNC_FLAG_FULLANNOTS    (1<<16)
 
+/* A mailbox update whose APPLY has been sent but whose response has
+ * not been read yet.  The replica answers in order, so responses are
+ * matched up by position, and by tag on the IMAP flavour. */
+struct sync_pending {
+    struct sync_folder *local;
+    struct sync_folder *remote;
+    char *tag;
+    int r;
+};
+
+struct sync_pipeline {
+    struct backend *sync_be;
+    struct sync_pending *items;
+    int depth;
+    int count;          /* sent */
+    int nread;          /* of which responses have been read */
+};
+
+static struct sync_pipeline *sync_pipeline_new(struct backend *sync_be,
+                                               int depth)
+{
+    struct sync_pipeline *pl = xzmalloc(sizeof(struct sync_pipeline));
+    pl->sync_be = sync_be;
+    pl->depth = depth;
+    pl->items = xzmalloc(depth * sizeof(struct sync_pending));
+    return pl;
+}
+
+static void sync_pipeline_push(struct sync_pipeline *pl,
+                               struct sync_folder *local,
+                               struct sync_folder *remote)
+{
+    struct sync_pending *item = &pl->items[pl->count++];
+    struct buf *tagbuf = pl->sync_be->out->userdata;
+
+    assert(pl->count <= pl->depth);
+    item->local = local;
+    item->remote = remote;
+    item->tag = tagbuf ? xstrdup(buf_cstring(tagbuf)) : NULL;
+    item->r = 0;
+}
+
+/* read every outstanding response, so the stream is free for the
+ * next synchronous command */
+static void sync_pipeline_read(struct sync_pipeline *pl)
+{
+    struct protstream *in = pl->sync_be->in;
+    struct buf *tagbuf = in->userdata;
+    struct buf saved = BUF_INITIALIZER;
+    int broken = 0;
+
+    if (pl->nread == pl->count) return;
+
+    if (tagbuf) buf_copy(&saved, tagbuf);
+
+    for (; pl->nread < pl->count; pl->nread++) {
+        struct sync_pending *item = &pl->items[pl->nread];
+
+        /* after a protocol error we can't tell which response is which */
+        if (broken) {
+            item->r = IMAP_PROTOCOL_ERROR;
+            continue;
+        }
+
+        if (tagbuf) buf_setcstr(tagbuf, item->tag);
+        item->r = sync_parse_response("MAILBOX", in, NULL);
+        if (item->r == IMAP_PROTOCOL_ERROR) broken = 1;
+    }
+
+    if (tagbuf) buf_copy(tagbuf, &saved);
+    buf_free(&saved);
+}
+
+static void sync_pipeline_free(struct sync_pipeline **plp)
+{
+    struct sync_pipeline *pl = *plp;
+    int i;
+
+    if (!pl) return;
+
+    for (i = 0; i < pl->count; i++)
+        free(pl->items[i].tag);
+    free(pl->items);
+    free(pl);
+    *plp = NULL;
+}
+
 static int update_mailbox_once(struct sync_folder *local,
                                struct sync_folder *remote,
                                const char *topart,
                                struct sync_reserve_list *reserve_list,
                                struct backend *sync_be,
-                               unsigned flags)
+                               unsigned flags,
+                               struct sync_pipeline *pl)
 {
     struct sync_msgid_list *part_list;
     struct mailbox *mailbox = NULL;
@@ -5489,6 +5752,9 @@ static int update_mailbox_once(struct sync_folder *local,
     if (flags & SYNC_FLAG_LOGGING)
         syslog(LOG_INFO, "%s %s", cmd, local->name);
 
+    /* the uploads need their responses straight away */
+    if (pl && kupload->head) sync_pipeline_read(pl);
+
     /* upload in small(ish) blocks to avoid timeouts */
     while (kupload->head) {
         struct dlist *kul1 = dlist_splice(kupload, 1024);
@@ -5503,7 +5769,8 @@ static int update_mailbox_once(struct sync_folder *local,
 
     /* update the mailbox */
     sync_send_apply(kl, sync_be->out);
-    r = sync_parse_response("MAILBOX", sync_be->in, NULL);
+    if (pl) sync_pipeline_push(pl, local, remote);
+    else r = sync_parse_response("MAILBOX", sync_be->in, NULL);
 
 done:
     if (mailbox && !local->mailbox) mailbox_close(&mailbox);
@@ -5513,16 +5780,13 @@ done:
     return r;
 }
 
-int sync_update_mailbox(struct sync_folder *local,
-                        struct sync_folder *remote,
-                        const char *topart,
-                        struct sync_reserve_list *reserve_list,
-                        struct backend *sync_be,
-                        unsigned flags)
+static int update_mailbox_retry(struct sync_folder *local,
+                                struct sync_folder *remote,
+                                const char *topart,
+                                struct sync_reserve_list *reserve_list,
+                                struct backend *sync_be,
+                                unsigned flags, int r)
 {
-    int r = update_mailbox_once(local, remote, topart,
-                                reserve_list, sync_be, flags);
-
     /* never retry - other end should always sync cleanly */
     if (flags & SYNC_FLAG_NO_COPYBACK) return r;
 
@@ -5532,7 +5796,7 @@ int sync_update_mailbox(struct sync_folder *local,
         local->ispartial = 0; /* don't batch the re-update, means sync to 2.4 will still work after fullsync */
         r = mailbox_full_update(local, reserve_list, sync_be, flags);
         if (!r) r = update_mailbox_once(local, remote, topart,
-                                        reserve_list, sync_be, flags);
+                                        reserve_list, sync_be, flags, NULL);
     }
     else if (r == IMAP_SYNC_CHECKSUM) {
         syslog(LOG_ERR, "CRC failure on sync for %s, trying full update",
@@ -5540,9 +5804,60 @@ int sync_update_mailbox(struct sync_folder *local,
         r = mailbox_full_update(local, reserve_list, sync_be, flags);
         if (!r) r = update_mailbox_once(local, remote, topart,
                                         reserve_list, sync_be,
-                                        flags|SYNC_FLAG_FULLANNOTS);
+                                        flags|SYNC_FLAG_FULLANNOTS, NULL);
+    }
+
+    return r;
+}
+
+int sync_update_mailbox(struct sync_folder *local,
+                        struct sync_folder *remote,
+                        const char *topart,
+                        struct sync_reserve_list *reserve_list,
+                        struct backend *sync_be,
+                        unsigned flags)
+{
+    int r = update_mailbox_once(local, remote, topart,
+                                reserve_list, sync_be, flags, NULL);
+
+    return update_mailbox_retry(local, remote, topart,
+                                reserve_list, sync_be, flags, r);
+}
+
+/* collect the responses to every pipelined update, retrying any that
+ * need it one at a time */
+static int sync_pipeline_finish(struct sync_pipeline *pl,
+                                const char *topart,
+                                struct sync_reserve_list *reserve_list,
+                                const char **channelp,
+                                unsigned flags)
+{
+    int i, r = 0;
+
+    sync_pipeline_read(pl);
+
+    for (i = 0; i < pl->count; i++) {
+        struct sync_pending *item = &pl->items[i];
+
+        if (!r) {
+            r = update_mailbox_retry(item->local, item->remote, topart,
+                                     reserve_list, pl->sync_be, flags,
+                                     item->r);
+            if (r) {
+                syslog(LOG_ERR, "do_folders(): update failed: %s '%s'",
+                       item->local->name, error_message(r));
+            }
+            else if (channelp && item->local->ispartial) {
+                sync_log_channel_mailbox(*channelp, item->local->name);
+            }
+        }
+
+        free(item->tag);
+        item->tag = NULL;
     }
 
+    pl->count = pl->nread = 0;
+
     return r;
 }
 
@@ -5740,10 +6055,14 @@ bail:
 
 /* ====================================================================== */
 
+/* with a non-zero 'batchsize', mailboxes with more new messages than
+ * that are only brought part of the way up to date; '*partialp' is set
+ * if any were */
 static int do_folders(struct sync_name_list *mboxname_list, const char *topart,
                       struct sync_folder_list *replica_folders,
                       struct backend *sync_be,
                       const char **channelp,
+                      uint32_t batchsize, int *partialp,
                       unsigned flags)
 {
     int r = 0;
@@ -5752,8 +6071,9 @@ static int do_folders(struct sync_name_list *mboxname_list, const char *topart,
     struct sync_reserve_list *reserve_list;
     struct sync_folder *mfolder, *rfolder;
     const char *part;
-    uint32_t batchsize = 0;
     struct sync_name *mbox;
+    struct sync_pipeline *pl = NULL;
+    int depth;
 
     /* Look for intermediate mailboxes */
     for (mbox = mboxname_list->head; !r && mbox; mbox = mbox->next) {
@@ -5786,11 +6106,6 @@ static int do_folders(struct sync_name_list *mboxname_list, const char *topart,
         goto bail;
     }
 
-
-    if (channelp) {
-        batchsize = config_getint(IMAPOPT_SYNC_BATCHSIZE);
-    }
-
     master_folders = sync_folder_list_create();
     rename_folders = sync_rename_list_create();
     reserve_list = sync_reserve_list_create(SYNC_MSGID_LIST_HASH_SIZE);
@@ -5878,14 +6193,42 @@ static int do_folders(struct sync_name_list *mboxname_list, const char *topart,
         }
     }
 
+    depth = config_getint(IMAPOPT_SYNC_PIPELINE);
+    if (depth > 0) pl = sync_pipeline_new(sync_be, depth);
+
     for (mfolder = master_folders->head; mfolder; mfolder = mfolder->next) {
         if (mfolder->mark) continue;
         /* NOTE: rfolder->name may now be wrong, but we're guaranteed that
          * it was successfully renamed above, so just use mfolder->name for
          * all commands */
         rfolder = sync_folder_lookup(replica_folders, mfolder->uniqueid);
-        r = sync_update_mailbox(mfolder, rfolder, topart, reserve_list,
-                                sync_be, flags);
+        if (pl) {
+            r = update_mailbox_once(mfolder, rfolder, topart, reserve_list,
+                                    sync_be, flags, pl);
+            if (!r) {
+                /* sent - check the responses once the window is full */
+                if (pl->count >= pl->depth)
+                    r = sync_pipeline_finish(pl, topart, reserve_list,
+                                             channelp, flags);
+                if (r) goto bail;
+                continue;
+            }
+
+            /* failed before sending: settle what is outstanding, then
+             * retry this one the usual way */
+            int r2 = sync_pipeline_finish(pl, topart, reserve_list,
+                                          channelp, flags);
+            if (r2) {
+                r = r2;
+                goto bail;
+            }
+            r = update_mailbox_retry(mfolder, rfolder, topart, reserve_list,
+                                     sync_be, flags, r);
+        }
+        else {
+            r = sync_update_mailbox(mfolder, rfolder, topart, reserve_list,
+                                    sync_be, flags);
+        }
         if (r) {
             syslog(LOG_ERR, "do_folders(): update failed: %s '%s'",
                    mfolder->name, error_message(r));
@@ -5896,16 +6239,31 @@ static int do_folders(struct sync_name_list *mboxname_list, const char *topart,
         }
     }
 
+    if (pl) r = sync_pipeline_finish(pl, topart, reserve_list, channelp, flags);
+
+    /* a retried update is never partial, so this is what was sent */
+    if (!r && partialp) {
+        for (mfolder = master_folders->head; mfolder; mfolder = mfolder->next) {
+            if (!mfolder->mark && mfolder->ispartial) *partialp = 1;
+        }
+    }
+
  bail:
+    if (pl) {
+        /* don't leave responses behind for whoever talks next */
+        sync_pipeline_read(pl);
+        sync_pipeline_free(&pl);
+    }
     sync_folder_list_free(&master_folders);
     sync_rename_list_free(&rename_folders);
     sync_reserve_list_free(&reserve_list);
     return r;
 }
 
-int sync_do_mailboxes(struct sync_name_list *mboxname_list, const char *topart,
-                      struct backend *sync_be, const char **channelp, unsigned flags)
-
+static int do_mailboxes(struct sync_name_list *mboxname_list,
+                        const char *topart, struct backend *sync_be,
+                        const char **channelp, uint32_t batchsize,
+                        int *partialp, unsigned flags)
 {
     struct sync_name *mbox;
     struct sync_folder_list *replica_folders = sync_folder_list_create();
@@ -5943,8 +6301,8 @@ int sync_do_mailboxes(struct sync_name_list *mboxname_list, const char *topart,
      * UNMAILBOX anyway */
     if (!r) {
         flags &= ~SYNC_FLAG_DELETE_REMOTE;
-        r = do_folders(mboxname_list, topart,
-                       replica_folders, sync_be, channelp, flags);
+        r = do_folders(mboxname_list, topart, replica_folders, sync_be,
+                       channelp, batchsize, partialp, flags);
     }
 
     sync_folder_list_free(&replica_folders);
@@ -5952,6 +6310,33 @@ int sync_do_mailboxes(struct sync_name_list *mboxname_list, const char *topart,
     return r;
 }
 
+int sync_do_mailboxes(struct sync_name_list *mboxname_list, const char *topart,
+                      struct backend *sync_be, const char **channelp, unsigned flags)
+
+{
+    /* with a channel, the rest of a partial update is logged for later */
+    uint32_t batchsize = channelp ? config_getint(IMAPOPT_SYNC_BATCHSIZE) : 0;
+
+    return do_mailboxes(mboxname_list, topart, sync_be, channelp,
+                        batchsize, NULL, flags);
+}
+
+int sync_do_mailboxes_batched(struct sync_name_list *mboxname_list,
+                              const char *topart, struct backend *sync_be,
+                              uint32_t batchsize, unsigned flags)
+{
+    int partial;
+    int r;
+
+    do {
+        partial = 0;
+        r = do_mailboxes(mboxname_list, topart, sync_be, /*channelp*/NULL,
+                         batchsize, &partial, flags);
+    } while (!r && partial);
+
+    return r;
+}
+
 /* ====================================================================== */
 
 struct mboxinfo {
@@ -6046,8 +6431,10 @@ static int do_user_main(const char *user, const char *topart,
      * anything not mentioned here on the replica - at least until we get
      * real tombstones */
     flags |= SYNC_FLAG_DELETE_REMOTE;
-    if (!r) r = do_folders(info.mboxlist, topart,
-                           replica_folders, sync_be, channelp, flags);
+    if (!r) r = do_folders(info.mboxlist, topart, replica_folders, sync_be,
+                           channelp,
+                           channelp ? config_getint(IMAPOPT_SYNC_BATCHSIZE) : 0,
+                           /*partialp*/NULL, flags);
     if (!r) r = sync_do_user_quota(info.quotalist, replica_quota,
                                    sync_be, flags);
 
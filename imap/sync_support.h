@@ -55,6 +55,14 @@
 extern struct protocol_t imap_csync_protocol;
 extern struct protocol_t csync_protocol;
 
+enum {
+    /* csync capabilities, clear of the IMAP ones */
+    CAPA_DLIST_BINARY   = (1 << 11)
+};
+
+/* send dlists to the peer in the compact binary encoding */
+void sync_set_binary_dlist(int enable);
+
 #define SYNC_MSGID_LIST_HASH_SIZE        (65536)
 #define SYNC_MESSAGE_LIST_HASH_SIZE      (65536)
 #define SYNC_MESSAGE_LIST_MAX_OPEN_FILES (64)
@@ -62,6 +70,7 @@ extern struct protocol_t csync_protocol;
 const char *sync_get_config(const char *channel, const char *val);
 int sync_get_intconfig(const char *channel, const char *val);
 int sync_get_switchconfig(const char *channel, const char *val);
+int sync_zstd_dictionary(struct buf *dict);
 
 /* ====================================================================== */
 
@@ -489,6 +498,12 @@ int sync_do_annotation(char *mboxname, struct backend *sync_be, unsigned flags);
 int sync_do_mailboxes(struct sync_name_list *mboxname_list,
                       const char *topart, struct backend *sync_be,
                       const char **channelp, unsigned flags);
+/* the same, but bring the mailboxes up to date in steps of at most
+ * 'batchsize' messages each, every one committed on the replica before
+ * the next is sent, so an interrupted copy resumes from the last step */
+int sync_do_mailboxes_batched(struct sync_name_list *mboxname_list,
+                              const char *topart, struct backend *sync_be,
+                              uint32_t batchsize, unsigned flags);
 int sync_do_user(const char *userid, const char *topart,
                  struct backend *sync_be, const char **channelp, unsigned flags);
 int sync_do_meta(const char *userid, struct backend *sync_be, unsigned flags);
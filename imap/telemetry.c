@@ -55,6 +55,7 @@
 
 #include "prot.h"
 #include "global.h"
+#include "logring.h"
 
 /* create telemetry log; return fd of log */
 EXPORTED int telemetry_log(const char *userid, struct protstream *pin,
@@ -99,6 +100,14 @@ EXPORTED int telemetry_log(const char *userid, struct protstream *pin,
         if (r < 0)
             syslog(LOG_ERR, "IOERROR: unable to write to telemetry log %s: %m", buf);
 
+        /* mupdate's threads can't share the ring */
+        if (!usetimestamp) {
+            int ringsize = config_getint(IMAPOPT_TELEMETRY_RING_SIZE);
+
+            if (ringsize > 0 && !logring_init((size_t) ringsize * 1024))
+                logring_register(fd);
+        }
+
         if (pin) prot_setlog(pin, fd);
         if (pout) prot_setlog(pout, fd);
     }
@@ -106,6 +115,15 @@ EXPORTED int telemetry_log(const char *userid, struct protstream *pin,
     return fd;
 }
 
+/* close a log created by telemetry_log() */
+EXPORTED void telemetry_close(int fd)
+{
+    if (fd == -1) return;
+
+    logring_release(fd);
+    close(fd);
+}
+
 EXPORTED void telemetry_rusage(char *userid)
 {
     static struct rusage        previous;
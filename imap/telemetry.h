@@ -45,6 +45,7 @@
 
 int telemetry_log(const char *userid, struct protstream *pin,
                   struct protstream *pout, int usetimestamp);
+void telemetry_close(int fd);
 void telemetry_rusage(const char *userid);
 
 #endif
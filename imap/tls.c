@@ -103,6 +103,9 @@
 /* System library. */
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -113,13 +116,23 @@
 #include <openssl/lhash.h>
 #include <openssl/bn.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
 #include <openssl/pem.h>
+#include <openssl/rand.h>
 #include <openssl/x509.h>
 #include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+#ifndef OPENSSL_NO_ENGINE
+#include <openssl/engine.h>
+#endif
 
 /* Application-specific. */
 #include "assert.h"
 #include "nonblock.h"
+#include "prometheus.h"
+#include "retry.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "tls.h"
@@ -668,6 +681,162 @@ static SSL_SESSION *get_session_cb(SSL *ssl __attribute__((unused)),
     return sess;
 }
 
+/*
+ * RFC 5077 session tickets, encrypted with keys read from the file
+ * named by tls_session_ticket_keys, so that any process on any server
+ * sharing that file can resume a session without a database lookup.
+ *
+ * The file holds one or more 80-byte keys: a 16-byte key name, a
+ * 32-byte HMAC-SHA256 secret and a 32-byte AES-256 secret.  New tickets
+ * are issued with the first key; tickets made with any of the others
+ * are still accepted (and renewed), which allows keys to be rotated by
+ * prepending a new one and later dropping the oldest.
+ */
+struct ticket_key {
+    unsigned char name[16];
+    unsigned char hmac_secret[32];
+    unsigned char aes_secret[32];
+};
+
+#define TICKET_KEYS_RECHECK 60 /* seconds between checks for a new file */
+
+static struct ticket_key *ticket_keys = NULL;
+static int ticket_nkeys = 0;
+static time_t ticket_keys_mtime = 0;
+static time_t ticket_keys_checked = 0;
+
+static void ticket_keys_free(void)
+{
+    if (ticket_keys) {
+        OPENSSL_cleanse(ticket_keys, ticket_nkeys * sizeof(struct ticket_key));
+        free(ticket_keys);
+    }
+    ticket_keys = NULL;
+    ticket_nkeys = 0;
+    ticket_keys_mtime = 0;
+}
+
+/* (Re)read the ticket key file if it has changed; returns the key count */
+static int ticket_keys_load(void)
+{
+    const char *fname = config_getstring(IMAPOPT_TLS_SESSION_TICKET_KEYS);
+    struct ticket_key *keys;
+    time_t now = time(NULL);
+    struct stat sbuf;
+    int fd;
+
+    if (ticket_keys && now - ticket_keys_checked < TICKET_KEYS_RECHECK)
+        return ticket_nkeys;
+    ticket_keys_checked = now;
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1 || fstat(fd, &sbuf) == -1) {
+        syslog(LOG_ERR, "IOERROR: reading TLS ticket keys %s: %m", fname);
+        goto done;
+    }
+
+    if (ticket_keys && sbuf.st_mtime == ticket_keys_mtime) goto done;
+
+    if (!sbuf.st_size || sbuf.st_size % sizeof(struct ticket_key)) {
+        syslog(LOG_ERR, "TLS ticket keys %s: size must be a multiple of "
+               SIZE_T_FMT " bytes", fname, sizeof(struct ticket_key));
+        goto done;
+    }
+
+    keys = xmalloc(sbuf.st_size);
+    if (retry_read(fd, keys, sbuf.st_size) != sbuf.st_size) {
+        syslog(LOG_ERR, "IOERROR: reading TLS ticket keys %s: %m", fname);
+        OPENSSL_cleanse(keys, sbuf.st_size);
+        free(keys);
+        goto done;
+    }
+
+    ticket_keys_free();
+    ticket_keys = keys;
+    ticket_nkeys = sbuf.st_size / sizeof(struct ticket_key);
+    ticket_keys_mtime = sbuf.st_mtime;
+
+    syslog(LOG_DEBUG, "loaded %d TLS ticket key(s) from %s",
+           ticket_nkeys, fname);
+
+ done:
+    if (fd != -1) close(fd);
+    return ticket_nkeys;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ticket_hmac_ctx;
+
+static int ticket_hmac_init(EVP_MAC_CTX *hctx, struct ticket_key *key)
+{
+    OSSL_PARAM params[3];
+
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                                  key->hmac_secret,
+                                                  sizeof(key->hmac_secret));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 "sha256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+typedef HMAC_CTX ticket_hmac_ctx;
+
+static int ticket_hmac_init(HMAC_CTX *hctx, struct ticket_key *key)
+{
+    return HMAC_Init_ex(hctx, key->hmac_secret, sizeof(key->hmac_secret),
+                        EVP_sha256(), NULL);
+}
+#endif
+
+/*
+ * Called by OpenSSL to set up the cipher and HMAC contexts for
+ * encrypting (enc = 1) or decrypting (enc = 0) a session ticket.
+ */
+static int ticket_key_cb(SSL *ssl __attribute__((unused)),
+                         unsigned char *key_name, unsigned char *iv,
+                         EVP_CIPHER_CTX *ctx, ticket_hmac_ctx *hctx, int enc)
+{
+    const EVP_CIPHER *cipher = EVP_aes_256_cbc();
+    struct ticket_key *key = NULL;
+    int i, n = ticket_keys_load();
+
+    if (enc) {
+        /* no keys: don't issue a ticket */
+        if (!n) return 0;
+
+        key = &ticket_keys[0];
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(cipher)) <= 0) return -1;
+        memcpy(key_name, key->name, sizeof(key->name));
+
+        if (!EVP_EncryptInit_ex(ctx, cipher, NULL, key->aes_secret, iv) ||
+            !ticket_hmac_init(hctx, key)) {
+            return -1;
+        }
+
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!memcmp(key_name, ticket_keys[i].name, sizeof(key->name))) {
+            key = &ticket_keys[i];
+            break;
+        }
+    }
+
+    /* unknown (or retired) key: fall back to a full handshake */
+    if (!key) return 0;
+
+    if (!ticket_hmac_init(hctx, key) ||
+        !EVP_DecryptInit_ex(ctx, cipher, NULL, key->aes_secret, iv)) {
+        return -1;
+    }
+
+    /* reissue tickets made with an older key */
+    return i ? 2 : 1;
+}
+
 /*
  * Seed the random number generator.
  */
@@ -692,6 +861,50 @@ static int tls_rand_init(void)
 
 /* must be called after cyrus_init */
 // I am the server
+/* Have OpenSSL use a crypto engine (e.g. a hardware accelerator) for
+ * the expensive parts of handshakes, if one is configured.  Failure
+ * isn't fatal: we carry on in software. */
+static void tls_load_engine(void)
+{
+    const char *id = config_getstring(IMAPOPT_TLS_ENGINE);
+
+    if (!id) return;
+
+#ifndef OPENSSL_NO_ENGINE
+    static ENGINE *engine = NULL;
+
+    if (engine) return;
+
+    ENGINE_load_builtin_engines();
+    engine = ENGINE_by_id(id);
+    if (!engine) {
+        syslog(LOG_ERR, "TLS server engine: cannot load OpenSSL engine '%s'",
+               id);
+        return;
+    }
+
+    if (!ENGINE_init(engine)) {
+        syslog(LOG_ERR,
+               "TLS server engine: cannot initialise OpenSSL engine '%s'", id);
+        ENGINE_free(engine);
+        engine = NULL;
+        return;
+    }
+
+    if (!ENGINE_set_default(engine, ENGINE_METHOD_ALL)) {
+        syslog(LOG_WARNING,
+               "TLS server engine: OpenSSL engine '%s' not made the default",
+               id);
+    }
+
+    syslog(LOG_INFO, "TLS server engine: using OpenSSL engine '%s'", id);
+#else
+    syslog(LOG_WARNING,
+           "TLS server engine: tls_engine '%s' ignored, "
+           "OpenSSL has no engine support", id);
+#endif
+}
+
 EXPORTED int     tls_init_serverengine(const char *ident,
                               int verifydepth,
                               int askcert,
@@ -734,6 +947,8 @@ EXPORTED int     tls_init_serverengine(const char *ident,
         return -1;
     }
 
+    tls_load_engine();
+
 #if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
     s_ctx = SSL_CTX_new(TLS_server_method());
 #else
@@ -778,9 +993,19 @@ EXPORTED int     tls_init_serverengine(const char *ident,
     if (server_cipher_order)
         off |= SSL_OP_CIPHER_SERVER_PREFERENCE;
 
+#ifdef SSL_OP_ENABLE_KTLS
+    if (config_getswitch(IMAPOPT_TLS_KTLS))
+        off |= SSL_OP_ENABLE_KTLS;
+#endif
+
     SSL_CTX_set_options(s_ctx, off);
     SSL_CTX_set_info_callback(s_ctx, apps_ssl_info_callback);
 
+#ifdef SSL_MODE_ASYNC
+    if (config_getswitch(IMAPOPT_TLS_ASYNC))
+        SSL_CTX_set_mode(s_ctx, SSL_CTX_get_mode(s_ctx) | SSL_MODE_ASYNC);
+#endif
+
     cipher_list = config_getstring(IMAPOPT_TLS_CIPHERS);
     if (!SSL_CTX_set_cipher_list(s_ctx, cipher_list)) {
         syslog(
@@ -999,9 +1224,7 @@ EXPORTED int     tls_init_serverengine(const char *ident,
 
     /* A timeout of zero disables session caching */
     if (timeout) {
-        const char *fname = NULL;
-        char *tofree = NULL;
-        int r;
+        int cache = config_getenum(IMAPOPT_TLS_SESSION_CACHE);
 
         /* Set the context for session reuse -- use the service ident */
         SSL_CTX_set_session_id_context(s_ctx, (void*) ident, strlen(ident));
@@ -1009,28 +1232,52 @@ EXPORTED int     tls_init_serverengine(const char *ident,
         /* Set the timeout for the internal/external cache (in seconds) */
         SSL_CTX_set_timeout(s_ctx, timeout*60);
 
-        /* Set the callback functions for the external session cache */
-        SSL_CTX_sess_set_new_cb(s_ctx, new_session_cb);
-        SSL_CTX_sess_set_remove_cb(s_ctx, remove_session_cb);
-        SSL_CTX_sess_set_get_cb(s_ctx, get_session_cb);
+        if (config_getstring(IMAPOPT_TLS_SESSION_TICKET_KEYS)) {
+            /* Tickets any of our servers can decrypt */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            SSL_CTX_set_tlsext_ticket_key_evp_cb(s_ctx, ticket_key_cb);
+#else
+            SSL_CTX_set_tlsext_ticket_key_cb(s_ctx, ticket_key_cb);
+#endif
+            if (!ticket_keys_load()) {
+                syslog(LOG_WARNING,
+                       "no usable TLS ticket keys; not issuing tickets");
+            }
+        }
+        else if (cache == IMAP_ENUM_TLS_SESSION_CACHE_TICKETS) {
+            syslog(LOG_WARNING, "tls_session_cache is \"tickets\" but"
+                   " tls_session_ticket_keys is not set; tickets will"
+                   " only resume in this process");
+        }
 
-        fname = config_getstring(IMAPOPT_TLS_SESSIONS_DB_PATH);
+        if (cache != IMAP_ENUM_TLS_SESSION_CACHE_TICKETS) {
+            const char *fname = NULL;
+            char *tofree = NULL;
+            int r;
 
-        /* create the name of the db file */
-        if (!fname) {
-            tofree = strconcat(config_dir, FNAME_TLSSESSIONS, (char *)NULL);
-            fname = tofree;
-        }
+            /* Set the callback functions for the external session cache */
+            SSL_CTX_sess_set_new_cb(s_ctx, new_session_cb);
+            SSL_CTX_sess_set_remove_cb(s_ctx, remove_session_cb);
+            SSL_CTX_sess_set_get_cb(s_ctx, get_session_cb);
 
-        r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &sessdb);
-        if (r != 0) {
-            syslog(LOG_ERR, "DBERROR: opening %s: %s",
-                   fname, cyrusdb_strerror(ret));
-        }
-        else
-            sess_dbopen = 1;
+            fname = config_getstring(IMAPOPT_TLS_SESSIONS_DB_PATH);
+
+            /* create the name of the db file */
+            if (!fname) {
+                tofree = strconcat(config_dir, FNAME_TLSSESSIONS, (char *)NULL);
+                fname = tofree;
+            }
 
-        free(tofree);
+            r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &sessdb);
+            if (r != 0) {
+                syslog(LOG_ERR, "DBERROR: opening %s: %s",
+                       fname, cyrusdb_strerror(ret));
+            }
+            else
+                sess_dbopen = 1;
+
+            free(tofree);
+        }
     }
 
     tls_serverengine = 1;
@@ -1076,6 +1323,39 @@ static long bio_dump_cb(BIO * bio, int cmd, const char *argp, int argi,
   * filled in if the client authenticated. 'ret' is the SSL connection
   * on success.
   */
+#ifdef SSL_MODE_ASYNC
+/* Wait for the crypto engine to finish an operation SSL_accept()
+ * handed it.  Returns as select() does. */
+static int tls_wait_async(SSL *conn, int timeout)
+{
+    OSSL_ASYNC_FD fds[8];
+    size_t numfds = 0, i;
+    fd_set rfds;
+    struct timeval tv;
+    int maxfd = -1;
+
+    if (!SSL_get_all_async_fds(conn, NULL, &numfds) ||
+        numfds == 0 || numfds > sizeof(fds) / sizeof(fds[0]) ||
+        !SSL_get_all_async_fds(conn, fds, &numfds)) {
+        /* no fd to wait on (e.g. no async job was free): just retry */
+        tv.tv_sec = 0;
+        tv.tv_usec = 1000;
+        select(0, NULL, NULL, NULL, &tv);
+        return 1;
+    }
+
+    FD_ZERO(&rfds);
+    for (i = 0; i < numfds; i++) {
+        FD_SET(fds[i], &rfds);
+        if (fds[i] > maxfd) maxfd = fds[i];
+    }
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+
+    return select(maxfd+1, &rfds, NULL, NULL, &tv);
+}
+#endif /* SSL_MODE_ASYNC */
+
 EXPORTED int tls_start_servertls(int readfd, int writefd, int timeout,
                                  struct saslprops_t *saslprops, SSL **ret)
 {
@@ -1091,6 +1371,9 @@ EXPORTED int tls_start_servertls(int readfd, int writefd, int timeout,
     int tls_cipher_usebits = 0;
     int tls_cipher_algbits = 0;
     SSL *tls_conn;
+    struct timeval hs_start, hs_end;
+    double hs_secs;
+    int want_async = 0;
     int r = 0;
 
     assert(tls_serverengine);
@@ -1098,6 +1381,8 @@ EXPORTED int tls_start_servertls(int readfd, int writefd, int timeout,
     if (var_imapd_tls_loglevel >= 1)
         syslog(LOG_DEBUG, "setting up TLS connection");
 
+    gettimeofday(&hs_start, NULL);
+
     saslprops_reset(saslprops);
 
     tls_conn = (SSL *) SSL_new(s_ctx);
@@ -1139,12 +1424,21 @@ EXPORTED int tls_start_servertls(int readfd, int writefd, int timeout,
         struct timeval tv;
         int err;
 
-        FD_ZERO(&rfds);
-        FD_SET(readfd, &rfds);
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
+#ifdef SSL_MODE_ASYNC
+        if (want_async) {
+            want_async = 0;
+            sts = tls_wait_async(tls_conn, timeout);
+        }
+        else
+#endif
+        {
+            FD_ZERO(&rfds);
+            FD_SET(readfd, &rfds);
+            tv.tv_sec = timeout;
+            tv.tv_usec = 0;
 
-        sts = select(readfd+1, &rfds, NULL, NULL, &tv);
+            sts = select(readfd+1, &rfds, NULL, NULL, &tv);
+        }
         if (sts <= 0) {
             if (sts == 0) {
                 syslog(LOG_DEBUG, "SSL_accept() timed out -> fail");
@@ -1153,7 +1447,7 @@ EXPORTED int tls_start_servertls(int readfd, int writefd, int timeout,
                        "tls_start_servertls() failed in select() -> fail: %m");
             }
             r = -1;
-            goto done;
+            goto handshake_failed;
         }
 
         sts = SSL_accept(tls_conn);
@@ -1169,6 +1463,13 @@ EXPORTED int tls_start_servertls(int readfd, int writefd, int timeout,
         case SSL_ERROR_WANT_WRITE:
             syslog(LOG_DEBUG, "SSL_accept() incomplete -> wait");
             continue;
+#ifdef SSL_MODE_ASYNC
+        case SSL_ERROR_WANT_ASYNC:
+        case SSL_ERROR_WANT_ASYNC_JOB:
+            syslog(LOG_DEBUG, "SSL_accept() waiting for crypto engine -> wait");
+            want_async = 1;
+            continue;
+#endif
         case SSL_ERROR_SYSCALL:
             if (sts == 0) {
                 syslog(LOG_DEBUG, "EOF in SSL_accept() -> fail");
@@ -1201,11 +1502,15 @@ EXPORTED int tls_start_servertls(int readfd, int writefd, int timeout,
             break;
         }
         r = -1;
-        goto done;
+        goto handshake_failed;
 
         /* Should never get here */
     }
 
+    gettimeofday(&hs_end, NULL);
+    hs_secs = timesub(&hs_start, &hs_end);
+    prometheus_observe_label(CYRUS_TLS_HANDSHAKE_SECONDS, "success", hs_secs);
+
     /* Only loglevel==4 dumps everything */
     if (var_imapd_tls_loglevel < 4)
         do_dump = 0;
@@ -1298,8 +1603,22 @@ EXPORTED int tls_start_servertls(int readfd, int writefd, int timeout,
                    alpn_len, (const char *) alpn);
     }
 
+#ifdef SSL_OP_ENABLE_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(tls_conn))) {
+        buf_appendcstr(&log, "; kernel TLS");
+    }
+#endif
+
+    buf_printf(&log, "; handshake = %.3fs", hs_secs);
+
     syslog(LOG_NOTICE, "%s", buf_cstring(&log));
     buf_free(&log);
+    goto done;
+
+ handshake_failed:
+    gettimeofday(&hs_end, NULL);
+    prometheus_observe_label(CYRUS_TLS_HANDSHAKE_SECONDS, "failure",
+                             timesub(&hs_start, &hs_end));
 
  done:
     nonblock(readfd, 0);
@@ -1361,6 +1680,8 @@ EXPORTED int tls_shutdown_serverengine(void)
 #if (OPENSSL_VERSION_NUMBER >= 0x0090800fL)
         if (dh_params) DH_free(dh_params);
 #endif
+
+        ticket_keys_free();
     }
 
     return 0;
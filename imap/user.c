@@ -51,6 +51,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <syslog.h>
+#include <sys/time.h>
 
 #if HAVE_DIRENT_H
 # include <dirent.h>
@@ -69,6 +70,7 @@
 # endif
 #endif
 
+#include "dlist.h"
 #include "global.h"
 #include "mailbox.h"
 #include "mboxkey.h"
@@ -213,9 +215,12 @@ EXPORTED int user_deletedata(const char *userid, int wipe_user)
 
     /* NOTE: even if conversations aren't enabled, we want to clean up */
 
-    /* delete conversations file */
+    /* delete conversations file, and its guid file if split */
     fname = conversations_getuserpath(userid);
     (void) unlink(fname);
+    char *gfname = strconcat(fname, CONV_GUIDS_SUFFIX, (char *)NULL);
+    (void) unlink(gfname);
+    free(gfname);
     free(fname);
 
     /* XXX: one could make an argument for keeping the counters
@@ -224,6 +229,16 @@ EXPORTED int user_deletedata(const char *userid, int wipe_user)
     (void) unlink(fname);
     free(fname);
 
+    /* delete the saved pop3 listing */
+    fname = user_hash_meta(userid, "pop3");
+    (void) unlink(fname);
+    free(fname);
+
+    /* delete the snippet text store */
+    fname = user_hash_meta(userid, "snippets");
+    (void) unlink(fname);
+    free(fname);
+
     /* delete dav database (even if DAV is turned off, this is fine) */
     fname = user_hash_meta(userid, "dav");
     (void) unlink(fname);
@@ -242,6 +257,174 @@ EXPORTED int user_deletedata(const char *userid, int wipe_user)
     return 0;
 }
 
+EXPORTED int user_deletedata_lazy(const char *userid, int wipe_user)
+{
+    int r = mboxlist_deleteuser_lazy(userid, wipe_user);
+    if (r) return r;
+
+    /* nobody gets to carry on using the tombstoned mailboxes */
+    proc_killuser(userid);
+
+    return 0;
+}
+
+/*
+ * Hold back to user_delete_maxrate kilobytes of removed message files
+ * per second.
+ */
+static void lazydelete_throttle(size_t bytes)
+{
+    static struct timeval start;
+    static uint64_t removed;
+    int maxrate = config_getint(IMAPOPT_USER_DELETE_MAXRATE);
+    struct timeval now;
+    double elapsed, wanted;
+
+    if (maxrate <= 0) return;
+
+    gettimeofday(&now, NULL);
+    if (!start.tv_sec) start = now;
+    removed += bytes;
+
+    elapsed = timesub(&start, &now);
+    wanted = (double) removed / (maxrate * 1024.0);
+
+    if (wanted > elapsed + 0.001)
+        usleep((useconds_t) ((wanted - elapsed) * 1000000));
+}
+
+static int lazydelete_mailbox(const char *name, const char *uniqueid)
+{
+    struct mailbox *mailbox = NULL;
+    mbentry_t *mbentry = NULL;
+    int r;
+
+    /* the tombstone still has the partition, so this finds the files */
+    r = mailbox_open_iwl(name, &mailbox);
+    if (r == IMAP_MAILBOX_NONEXISTENT) r = 0;  /* no files, e.g. intermediate */
+    if (r) return r;
+
+    if (mailbox && (!(mailbox->mbtype & MBTYPE_DELETED) ||
+                    strcmpsafe(mailbox->uniqueid, uniqueid))) {
+        /* can't happen while the user is queued, but never remove
+         * the files of a live mailbox */
+        syslog(LOG_ERR, "lazy delete: %s is not the queued mailbox, skipping",
+               name);
+        mailbox_close(&mailbox);
+        return 0;
+    }
+
+    if (mailbox) {
+        struct mailbox_iter *iter;
+        const message_t *msg;
+
+        /* the message files first, at a pace other users won't notice */
+        iter = mailbox_iter_init(mailbox, 0, ITER_SKIP_UNLINKED);
+        while ((msg = mailbox_iter_step(iter))) {
+            const struct index_record *record = msg_record(msg);
+            const char *fname = mailbox_record_fname(mailbox, record);
+
+            if (unlink(fname) && errno != ENOENT)
+                syslog(LOG_ERR, "IOERROR: unlinking %s: %m", fname);
+            lazydelete_throttle(record->size);
+        }
+        mailbox_iter_done(&iter);
+
+        /* then the rest, as the mailbox is closed */
+        r = mailbox_delete_withuser(&mailbox);
+        if (r) {
+            mailbox_close(&mailbox);
+            return r;
+        }
+    }
+
+    /* leave an ordinary tombstone behind */
+    r = mboxlist_lookup_allow_all(name, &mbentry, NULL);
+    if (r == IMAP_MAILBOX_NONEXISTENT) return 0;
+    if (!r && (mbentry->mbtype & MBTYPE_DELETED) &&
+        !strcmpsafe(mbentry->uniqueid, uniqueid)) {
+        mbentry_t *tombstone = mboxlist_entry_create();
+
+        tombstone->name = xstrdup(name);
+        tombstone->mbtype = MBTYPE_DELETED;
+        tombstone->uniqueid = xstrdupnull(mbentry->uniqueid);
+        tombstone->uidvalidity = mbentry->uidvalidity;
+        tombstone->createdmodseq = mbentry->createdmodseq;
+        tombstone->foldermodseq = mbentry->foldermodseq;
+        r = mboxlist_update(tombstone, /*localonly*/1);
+        mboxlist_entry_free(&tombstone);
+    }
+    mboxlist_entry_free(&mbentry);
+
+    return r;
+}
+
+static int lazydelete_user(const char *userid,
+                           const volatile sig_atomic_t *stop)
+{
+    struct dlist *dl = NULL;
+    struct dlist *list = NULL;
+    struct dlist *item;
+    uint32_t wipe_user = 0;
+    int r;
+
+    r = mboxlist_deleteuser_get(userid, &dl);
+    if (r == IMAP_MAILBOX_NONEXISTENT) return 0;
+    if (r) goto done;
+
+    dlist_getnum32(dl, "WIPE", &wipe_user);
+    dlist_getlist(dl, "MAILBOXES", &list);
+
+    while (list && (item = list->head)) {
+        const char *name = NULL;
+        const char *uniqueid = NULL;
+
+        if (stop && *stop) goto done;
+
+        dlist_getatom(item, "NAME", &name);
+        dlist_getatom(item, "UNIQUEID", &uniqueid);
+        if (name) {
+            r = lazydelete_mailbox(name, uniqueid);
+            if (r) goto done;
+        }
+
+        /* remember how far we got */
+        dlist_unstitch(list, item);
+        dlist_free(&item);
+        r = mboxlist_deleteuser_update(userid, dl);
+        if (r) goto done;
+    }
+
+    r = user_deletedata(userid, wipe_user);
+    if (!r) r = mboxlist_deleteuser_update(userid, NULL);
+    if (!r) syslog(LOG_NOTICE, "Finished deleting user %s", userid);
+
+ done:
+    if (r) {
+        syslog(LOG_ERR, "lazy delete of user %s: %s",
+               userid, error_message(r));
+    }
+    dlist_free(&dl);
+    return r;
+}
+
+EXPORTED int user_run_lazy_deletes(const volatile sig_atomic_t *stop)
+{
+    strarray_t userids = STRARRAY_INITIALIZER;
+    int i, r;
+
+    r = mboxlist_deleteuser_queue(&userids);
+
+    /* one broken entry doesn't hold up the rest of the queue */
+    for (i = 0; !r && i < strarray_size(&userids); i++) {
+        if (stop && *stop) break;
+        lazydelete_user(strarray_nth(&userids, i), stop);
+    }
+
+    strarray_fini(&userids);
+    return r;
+}
+
 struct rename_rock {
     const char *olduser;
     const char *newuser;
@@ -43,6 +43,8 @@
 #ifndef INCLUDED_USER_H
 #define INCLUDED_USER_H
 
+#include <signal.h>
+
 #include "auth.h"
 
 /* path to user's sieve directory */
@@ -55,6 +57,18 @@ const char *user_sieve_path(const char *user);
  */
 int user_deletedata(const char *userid, int wipe_user);
 
+/* As user_deletedata(), but also for all of the user's mailboxes, and
+ * in the background: the mailboxes are tombstoned and the user queued
+ * straight away, and user_run_lazy_deletes() removes the files later.
+ */
+int user_deletedata_lazy(const char *userid, int wipe_user);
+
+/* Work through the queue of lazily deleted users, until it is empty or
+ * '*stop' is set.  Progress is kept in the queue, so a later run carries
+ * on where this one stopped.
+ */
+int user_run_lazy_deletes(const volatile sig_atomic_t *stop);
+
 /* Rename/copy user meta-data (seen state, subscriptions, sieve scripts)
  * from 'olduser' to 'newuser'.
  */
@@ -6,6 +6,7 @@
 #include <syslog.h>
 
 #include <fstream>
+#include <list>
 #include <sstream>
 
 extern "C" {
@@ -542,6 +543,7 @@ int xapian_dbw_is_indexed(xapian_dbw_t *dbw, const char *cyrusid)
 struct xapian_db
 {
     std::string *paths;
+    std::string *revisions;
     Xapian::Database *database;
     Xapian::Stem *stemmer;
     Xapian::QueryParser *parser;
@@ -557,6 +559,7 @@ int xapian_db_open(const char **paths, xapian_db_t **dbp)
 
     try {
         db->paths = new std::string();
+        db->revisions = new std::string();
         db->database = new Xapian::Database();
         while (*paths) {
             thispath = *paths++;
@@ -579,6 +582,8 @@ int xapian_db_open(const char **paths, xapian_db_t **dbp)
             db->database->add_database(database);
             db->paths->append(thispath);
             db->paths->append(" ");
+            db->revisions->append(std::to_string(database.get_revision()));
+            db->revisions->append(" ");
             thispath = "(unknown)";
         }
         db->stemmer = new Xapian::Stem("en");
@@ -612,6 +617,7 @@ void xapian_db_close(xapian_db_t *db)
         delete db->parser;
         delete db->stopper;
         delete db->paths;
+        delete db->revisions;
         delete db->stem_versions;
         free(db);
     }
@@ -623,6 +629,28 @@ void xapian_db_close(xapian_db_t *db)
 }
 
 
+int xapian_db_doccount(const char **paths, unsigned long long *countp)
+{
+    const char *thispath = "(unknown)";
+
+    *countp = 0;
+
+    try {
+        while (*paths) {
+            thispath = *paths++;
+            Xapian::Database database = Xapian::Database(thispath);
+            *countp += database.get_doccount();
+        }
+    }
+    catch (const Xapian::Error &err) {
+        syslog(LOG_ERR, "IOERROR: Xapian: caught exception db_doccount: %s: %s",
+                    thispath, err.get_description().c_str());
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
 static xapian_query_t *
 xapian_query_new_match_internal(const xapian_db_t *db, int stem_version,
                                 int num_part, const char *str)
@@ -808,6 +836,54 @@ int bincmp20(const void *a, const void *b)
     return memcmp(a, b, 20);
 }
 
+/*
+ * Cache of recent query results, so that paging through the same
+ * search or repeating it doesn't run it against every tier again.
+ * The key names the databases and the revision each was opened at,
+ * so any change to any of them misses; entries are never stale, just
+ * dropped when least recently used.
+ */
+#define XAPIAN_CACHE_MAXHITS    (1<<17)     /* 2.5MB of guids */
+
+static std::list<std::pair<std::string, std::string> > query_cache;
+
+static std::string query_cache_key(const xapian_db_t *db,
+                                   const Xapian::Query *query)
+{
+    return *db->paths + "\n" + *db->revisions + "\n" + query->get_description();
+}
+
+static int query_cache_lookup(const std::string &key, void **datap, size_t *np)
+{
+    std::list<std::pair<std::string, std::string> >::iterator it;
+
+    for (it = query_cache.begin() ; it != query_cache.end() ; ++it) {
+        if (it->first != key) continue;
+
+        /* most recently used goes to the front */
+        query_cache.splice(query_cache.begin(), query_cache, it);
+
+        *np = it->second.length() / 20;
+        *datap = xmalloc(it->second.length() + 1);
+        memcpy(*datap, it->second.data(), it->second.length());
+        return 1;
+    }
+
+    return 0;
+}
+
+static void query_cache_insert(const std::string &key, const void *data, size_t n)
+{
+    int max = config_getint(IMAPOPT_SEARCH_QUERY_CACHE);
+
+    if (max <= 0 || n > XAPIAN_CACHE_MAXHITS) return;
+
+    query_cache.push_front(std::make_pair(key,
+                           std::string((const char *)data, n * 20)));
+    while (query_cache.size() > (size_t) max)
+        query_cache.pop_back();
+}
+
 int xapian_query_run(const xapian_db_t *db, const xapian_query_t *qq,
                      int (*cb)(void *data, size_t n, void *rock), void *rock)
 {
@@ -816,6 +892,10 @@ int xapian_query_run(const xapian_db_t *db, const xapian_query_t *qq,
     size_t n = 0;
 
     try {
+        std::string key = query_cache_key(db, query);
+        if (query_cache_lookup(key, &data, &n))
+            return cb(data, n, rock);
+
         Xapian::Enquire enquire(*db->database);
         enquire.set_query(*query);
         Xapian::MSet matches = enquire.get_mset(0, db->database->get_doccount());
@@ -838,6 +918,8 @@ int xapian_query_run(const xapian_db_t *db, const xapian_query_t *qq,
             hex_to_bin(cstr+3, 40, (uint8_t *)data + (20*n));
             n++;
         }
+        if (n) qsort(data, n, 20, bincmp20);
+        query_cache_insert(key, data, n);
     }
     catch (const Xapian::Error &err) {
         syslog(LOG_ERR, "IOERROR: Xapian: caught exception query_run: %s: %s",
@@ -846,8 +928,6 @@ int xapian_query_run(const xapian_db_t *db, const xapian_query_t *qq,
         return IMAP_IOERROR;
     }
 
-    if (n) qsort(data, n, 20, bincmp20);
-
     return cb(data, n, rock);
 }
 
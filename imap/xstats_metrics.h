@@ -46,6 +46,8 @@ X(CONV_NEW),
 X(MSGDATA_LOAD),
 X(MESSAGE_MAP),
 X(SEARCH_EVALUATE),
+X(SEARCH_EVALUATE_COLUMNS),
+X(THREAD_CACHE_HIT),
 X(SEARCH_HEADER),
 X(SEARCH_CACHE_HEADER),
 X(SEARCH_BODY),
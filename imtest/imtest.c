@@ -62,12 +62,14 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <ctype.h>
 
 #include <sasl/sasl.h>
 #include <sasl/saslutil.h>
 
+#include "bsearch.h"
 #include "hash.h"
 #include "imparse.h"
 #include "iptostring.h"
@@ -1975,6 +1977,282 @@ static void send_recv_test(void)
     printf("took %ld seconds\n", end - start);
 }
 
+/**************
+ *
+ * Scripted load generation (IMAP only)
+ *
+ * Each of the load sessions is a child process which connects and
+ * authenticates just like the interactive client, then replays the
+ * script.  Every command is timed until its tagged response and the
+ * samples are passed back to the parent over a pipe, which reports
+ * throughput and per-command latency percentiles once all the
+ * sessions have finished.
+ *
+ * Script lines are sent as-is with a generated tag, except:
+ *   # ...                  comment
+ *   IDLE [secs]            IDLE for secs (default 1), then DONE
+ *   APPEND mbox size       APPEND a generated message of size bytes
+ *
+ *************/
+
+struct load_sample {
+    char cmd[24];
+    uint32_t usec;
+    uint32_t ok;
+};
+
+struct load_stat {
+    unsigned long count;
+    unsigned long fails;
+    unsigned long alloc;
+    uint32_t *usec;
+};
+
+static strarray_t load_script = STRARRAY_INITIALIZER;
+static int load_fd = -1;
+static uint64_t load_login_start;
+
+static uint64_t load_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void load_readscript(const char *fname)
+{
+    char line[8192];
+    FILE *f;
+
+    if (!(f = fopen(fname, "r")))
+        imtest_fatal("could not open load script %s", fname);
+
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line;
+        size_t len;
+
+        while (*p == ' ' || *p == '\t') p++;
+        len = strcspn(p, "\r\n");
+        p[len] = '\0';
+        if (!*p || *p == '#') continue;
+
+        strarray_append(&load_script, p);
+    }
+    fclose(f);
+
+    if (!strarray_size(&load_script))
+        imtest_fatal("load script %s has no commands", fname);
+}
+
+static void load_record(const char *line, uint64_t start, int ok)
+{
+    struct load_sample s;
+    const char *p;
+    size_t n = 0;
+    int words = 0;
+
+    memset(&s, 0, sizeof(s));
+
+    /* key on the command name, plus the subcommand for UID */
+    for (p = line; *p && n < sizeof(s.cmd) - 1; p++) {
+        if (*p == ' ' && (words++ || strcmp(s.cmd, "UID"))) break;
+        s.cmd[n++] = toupper((unsigned char) *p);
+    }
+    s.usec = load_now() - start;
+    s.ok = ok;
+
+    if (retry_write(load_fd, &s, sizeof(s)) != sizeof(s))
+        imtest_fatal("lost the load sample pipe");
+}
+
+/* send one script line tagged with 'tag' (which includes the trailing
+ * space) and wait for its completion; returns nonzero on OK */
+static int load_command(const char *tag, const char *line, uint64_t *start)
+{
+    static const char body[] = "0123456789abcdefghijklmnopqrstuvwxyz\r\n";
+    char mbox[1024];
+    const char *resp;
+    int size;
+
+    if (!strncasecmp(line, "IDLE", 4) && (!line[4] || line[4] == ' ')) {
+        int secs = line[4] ? atoi(line + 5) : 1;
+        uint64_t idle;
+
+        prot_printf(pout, "%sIDLE\r\n", tag);
+        prot_flush(pout);
+        resp = waitfor("+", (char *) tag, verbose);
+        if (*resp == '+') {
+            /* don't count the time spent idling */
+            idle = load_now();
+            sleep(secs > 0 ? secs : 1);
+            *start += load_now() - idle;
+
+            prot_printf(pout, "DONE\r\n");
+            prot_flush(pout);
+            resp = waitfor((char *) tag, NULL, verbose);
+        }
+    }
+    else if (!strncasecmp(line, "APPEND ", 7) &&
+             sscanf(line + 7, "%1023s %d", mbox, &size) == 2) {
+        int len = strlen(HEADERS);
+
+        if (size < len) size = len;
+        prot_printf(pout, "%sAPPEND %s {%d}\r\n", tag, mbox, size);
+        prot_flush(pout);
+        resp = waitfor("+", (char *) tag, verbose);
+        if (*resp == '+') {
+            prot_write(pout, HEADERS, len);
+            for (; len < size; len += sizeof(body) - 1) {
+                prot_write(pout, body, size - len < (int) sizeof(body) - 1 ?
+                           size - len : (int) sizeof(body) - 1);
+            }
+            prot_printf(pout, "\r\n");
+            prot_flush(pout);
+            resp = waitfor((char *) tag, NULL, verbose);
+        }
+    }
+    else {
+        prot_printf(pout, "%s%s\r\n", tag, line);
+        prot_flush(pout);
+        resp = waitfor((char *) tag, NULL, verbose);
+    }
+
+    return !strncmp(resp, tag, strlen(tag)) &&
+        !strncasecmp(resp + strlen(tag), "OK", 2);
+}
+
+static void load_session(int repeat)
+{
+    char tag[32];
+    unsigned n = 0;
+    int i, r;
+
+    /* connect and authentication together count as LOGIN */
+    load_record("LOGIN", load_login_start, 1);
+
+    for (r = 0; r < repeat; r++) {
+        for (i = 0; i < strarray_size(&load_script); i++) {
+            const char *line = strarray_nth(&load_script, i);
+            uint64_t start = load_now();
+            int ok;
+
+            snprintf(tag, sizeof(tag), "L%u ", ++n);
+            ok = load_command(tag, line, &start);
+            load_record(line, start, ok);
+        }
+    }
+}
+
+static int load_cmp_usec(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double load_pct(const struct load_stat *st, int pct)
+{
+    return st->usec[(st->count - 1) * pct / 100] / 1000.0;
+}
+
+static void load_stat_free(void *data)
+{
+    struct load_stat *st = data;
+
+    free(st->usec);
+    free(st);
+}
+
+static void load_report(int fd, int nsessions, uint64_t start)
+{
+    hash_table stats = HASH_TABLE_INITIALIZER;
+    strarray_t cmds = STRARRAY_INITIALIZER;
+    struct load_sample s;
+    struct load_stat *st;
+    unsigned long total = 0;
+    int i, status, failed = 0;
+    double elapsed;
+
+    construct_hash_table(&stats, 64, 0);
+
+    while (retry_read(fd, &s, sizeof(s)) == sizeof(s)) {
+        s.cmd[sizeof(s.cmd) - 1] = '\0';
+        if (!(st = hash_lookup(s.cmd, &stats))) {
+            st = xzmalloc(sizeof(struct load_stat));
+            hash_insert(s.cmd, st, &stats);
+            strarray_append(&cmds, s.cmd);
+        }
+        if (st->count == st->alloc) {
+            st->alloc = st->alloc ? 2 * st->alloc : 64;
+            st->usec = xrealloc(st->usec, st->alloc * sizeof(uint32_t));
+        }
+        st->usec[st->count++] = s.usec;
+        if (!s.ok) st->fails++;
+        if (strcmp(s.cmd, "LOGIN")) total++;
+    }
+    close(fd);
+
+    elapsed = (load_now() - start) / 1e6;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) failed++;
+    }
+
+    printf("%d sessions (%d failed), %lu commands in %.3f seconds: "
+           "%.1f commands/sec\n\n", nsessions, failed, total, elapsed,
+           elapsed > 0 ? total / elapsed : 0.0);
+    printf("%-16s %8s %6s %9s %9s %9s %9s\n", "command", "count", "fail",
+           "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+    strarray_sort(&cmds, cmpstringp_raw);
+    for (i = 0; i < strarray_size(&cmds); i++) {
+        st = hash_lookup(strarray_nth(&cmds, i), &stats);
+        qsort(st->usec, st->count, sizeof(uint32_t), load_cmp_usec);
+        printf("%-16s %8lu %6lu %9.3f %9.3f %9.3f %9.3f\n",
+               strarray_nth(&cmds, i), st->count, st->fails,
+               load_pct(st, 50), load_pct(st, 90), load_pct(st, 99),
+               load_pct(st, 100));
+    }
+
+    strarray_fini(&cmds);
+    free_hash_table(&stats, load_stat_free);
+}
+
+/* start the load sessions.  Returns only in the children; the parent
+ * collects their samples, prints the report and exits. */
+static void load_fork(int nsessions)
+{
+    int fds[2], i;
+    uint64_t start;
+
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    start = load_now();
+    for (i = 0; i < nsessions; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        if (!pid) {
+            close(fds[0]);
+            load_fd = fds[1];
+            load_login_start = load_now();
+            if (!verbose && !freopen("/dev/null", "w", stdout))
+                imtest_fatal("could not redirect stdout");
+            return;
+        }
+    }
+
+    close(fds[1]);
+    load_report(fds[0], i, start);
+    exit(0);
+}
+
 /*********************************** POP3 ************************************/
 
 static void *pop3_parse_banner(char *str)
@@ -2684,7 +2962,10 @@ static void usage(char *prog, char *prot)
     printf("Usage: %s [options] hostname\n", prog);
     printf("  -p port  : port to use (default=standard port for protocol)\n");
     if (!strcasecmp(prot, "imap"))
-        printf("  -z       : timing test\n");
+        printf("  -z       : timing test\n"
+               "  -L file  : load test, replaying the commands in file\n"
+               "  -N #     : number of concurrent load sessions (default=1)\n"
+               "  -R #     : number of times each session replays the script\n");
     printf("  -k #     : minimum protection layer required\n");
     printf("  -l #     : max protection layer (0=none; 1=integrity; etc)\n");
     printf("  -u user  : authorization name to use\n");
@@ -2852,6 +3133,8 @@ int main(int argc, char **argv)
     char *tls_keyfile WITH_SSL_ONLY = "";
     char *port = "", *prot = "";
     int run_stress_test=0;
+    char *loadscript = NULL;
+    int load_sessions = 1, load_repeat = 1;
     int dotls WITH_SSL_ONLY = 0, dossl = 0, docompress WITH_ZLIB_ONLY = 0;
     unsigned long capabilities = 0;
     char str[1024];
@@ -2875,7 +3158,7 @@ int main(int argc, char **argv)
     prog = strrchr(argv[0], '/') ? strrchr(argv[0], '/')+1 : argv[0];
 
     /* look at all the extra args */
-    while ((c = getopt(argc, argv, "P:qscizvk:l:p:u:a:m:f:r:t:n:I:x:X:w:o:?h")) != EOF)
+    while ((c = getopt(argc, argv, "P:qscizvk:l:p:u:a:m:f:r:t:n:I:x:X:w:o:L:N:R:?h")) != EOF)
         switch (c) {
         case 'P':
             prot = optarg;
@@ -2903,6 +3186,19 @@ int main(int argc, char **argv)
         case 'z':
             run_stress_test=1;
             break;
+        case 'L':
+            loadscript = optarg;
+            break;
+        case 'N':
+            load_sessions = atoi(optarg);
+            if (load_sessions <= 0)
+                imtest_fatal("number of load sessions must be > 0\n");
+            break;
+        case 'R':
+            load_repeat = atoi(optarg);
+            if (load_repeat <= 0)
+                imtest_fatal("number of script repeats must be > 0\n");
+            break;
         case 'v':
             verbose=1;
             break;
@@ -3026,6 +3322,16 @@ int main(int argc, char **argv)
     if (run_stress_test && strcmp(protocol->protocol, "imap"))
         imtest_fatal("stress test can only be run for IMAP\n");
 
+    if (loadscript) {
+        if (strcmp(protocol->protocol, "imap"))
+            imtest_fatal("load test can only be run for IMAP\n");
+        if (run_stress_test || filename || output_socket)
+            imtest_fatal("load test cannot be combined with -z, -f or -x\n");
+        if (!cmdline_password)
+            imtest_fatal("load test needs the password given with -w\n");
+        load_readscript(loadscript);
+    }
+
     if (errflg) {
         usage(prog, protocol->protocol);
     }
@@ -3063,6 +3369,8 @@ int main(int argc, char **argv)
         imtest_fatal("SASL initialization");
     }
 
+    if (loadscript) load_fork(load_sessions);
+
     conn = NULL;
     do {
         unsigned flags = 0;
@@ -3271,7 +3579,11 @@ int main(int argc, char **argv)
     }
 #endif /* HAVE_ZLIB */
 
-    if (run_stress_test == 1) {
+    if (load_fd >= 0) {
+        load_session(load_repeat);
+        logout(&protocol->logout_cmd, 1);
+        close(load_fd);
+    } else if (run_stress_test == 1) {
         send_recv_test();
     } else {
         /* else run in interactive mode or
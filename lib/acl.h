@@ -115,6 +115,12 @@ extern char *cyrus_acl_masktostr(int acl, char *str);
  */
 extern int cyrus_acl_myrights(const struct auth_state *auth_state, const char *acl);
 
+/*  cyrus_acl_flushcache(auth_state)
+ * Forget the rights cached by cyrus_acl_myrights() for 'auth_state', or
+ * for any state if NULL.  Must be called before 'auth_state' is freed.
+ */
+extern void cyrus_acl_flushcache(const struct auth_state *auth_state);
+
 /*  cyrus_acl_set(acl, identifier, mode, access, canonproc, canonrock) Modify the
  * ACL pointed to by 'acl' to modify the rights granted to
  * 'identifier' as specified by 'mode' and the set specified in the
@@ -55,14 +55,58 @@
 
 #include "acl.h"
 #include "auth.h"
+#include "hashoa.h"
 #include "xmalloc.h"
 #include "strarray.h"
 #include "libconfig.h"
 
+/*
+ * Rights by ACL string, for the auth_state we were last asked about.
+ * Listing many folders evaluates the same few ACLs over and over, and
+ * each evaluation checks group membership for every identifier, so a
+ * session only pays for each distinct ACL once.  Rights are stored
+ * shifted with the low bit set, so that no rights isn't NULL.
+ */
+#define ACLCACHE_MAX 4096
+
+static const struct auth_state *aclcache_state;
+static hashoa_table aclcache = HASHOA_TABLE_INITIALIZER;
+
+EXPORTED void cyrus_acl_flushcache(const struct auth_state *auth_state)
+{
+    if (!auth_state || auth_state == aclcache_state) {
+        free_hashoa_table(&aclcache, NULL);
+        aclcache_state = NULL;
+    }
+}
+
+static int acl_myrights(const struct auth_state *auth_state, const char *origacl);
+
 /*
  * Calculate the set of rights the user in 'auth_state' has in the ACL 'acl'.
  */
 EXPORTED int cyrus_acl_myrights(const struct auth_state *auth_state, const char *origacl)
+{
+    const char *key = origacl ? origacl : "";
+    void *cached;
+    int rights;
+
+    if (auth_state != aclcache_state || hashoa_numrecords(&aclcache) >= ACLCACHE_MAX) {
+        free_hashoa_table(&aclcache, NULL);
+        aclcache_state = auth_state;
+    }
+
+    cached = hashoa_lookup(key, &aclcache);
+    if (cached) return (int) ((uintptr_t) cached >> 1);
+
+    rights = acl_myrights(auth_state, origacl);
+    hashoa_insert(key, (void *) (((uintptr_t) (unsigned) rights << 1) | 1),
+                  &aclcache);
+
+    return rights;
+}
+
+static int acl_myrights(const struct auth_state *auth_state, const char *origacl)
 {
     char *acl = xstrdupsafe(origacl);
     char *thisid, *rights, *nextid;
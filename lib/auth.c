@@ -43,6 +43,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "acl.h"
 #include "auth.h"
 #include "exitcodes.h"
 #include "libcyr_cfg.h"
@@ -108,7 +109,11 @@ EXPORTED void auth_freestate(struct auth_state *auth_state)
 {
     struct auth_mech *auth = auth_fromname();
 
-    if (auth_state) auth->freestate(auth_state);
+    if (auth_state) {
+        /* the pointer may be reused for someone else */
+        cyrus_acl_flushcache(auth_state);
+        auth->freestate(auth_state);
+    }
 }
 
 EXPORTED strarray_t *auth_groups(const struct auth_state *auth_state)
@@ -43,8 +43,14 @@
 #include <config.h>
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "xmalloc.h"
 #include "bitvector.h"
@@ -53,6 +59,9 @@
 #ifndef MAX
 #define MAX(a,b)    ((a)>(b)?(a):(b))
 #endif
+#ifndef MIN
+#define MIN(a,b)    ((a)<(b)?(a):(b))
+#endif
 
 #define BITS_PER_UNIT   8
 #define vidx(x)         ((x) >> 3)
@@ -108,10 +117,20 @@ EXPORTED void bv_clearall(bitvector_t *bv)
         memset(bv->bits, 0, vlen(bv->length));
 }
 
+/* Clear the unused bits past the end of the last partial byte, so
+ * that whole-byte operations like bv_count() don't see them */
+static void bv_cleartail(bitvector_t *bv)
+{
+    if (!visaligned(bv->length))
+        bv->bits[vidx(bv->length)] &= ~vtailmask(bv->length);
+}
+
 EXPORTED void bv_setall(bitvector_t *bv)
 {
-    if (bv->length)
+    if (bv->length) {
         memset(bv->bits, 0xff, vlen(bv->length));
+        bv_cleartail(bv);
+    }
 }
 
 EXPORTED int bv_isset(const bitvector_t *bv, unsigned int i)
@@ -137,35 +156,113 @@ EXPORTED void bv_clear(bitvector_t *bv, unsigned int i)
     }
 }
 
+enum bv_op {
+    BV_AND,
+    BV_OR,
+    BV_ANDNOT
+};
+
+/* Apply @op bytewise from @src into @dst for @n bytes, a vector
+ * register or a machine word at a time where we can.  These loops
+ * are the inner loop of flag searches over large mailboxes. */
+static void bv_wordop(unsigned char *dst, const unsigned char *src,
+                      size_t n, enum bv_op op)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for ( ; i + sizeof(__m256i) <= n ; i += sizeof(__m256i)) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(src + i));
+        switch (op) {
+        case BV_AND:    x = _mm256_and_si256(x, y); break;
+        case BV_OR:     x = _mm256_or_si256(x, y); break;
+        case BV_ANDNOT: x = _mm256_andnot_si256(y, x); break;
+        }
+        _mm256_storeu_si256((__m256i *)(dst + i), x);
+    }
+#elif defined(__ARM_NEON)
+    for ( ; i + sizeof(uint8x16_t) <= n ; i += sizeof(uint8x16_t)) {
+        uint8x16_t x = vld1q_u8(dst + i);
+        uint8x16_t y = vld1q_u8(src + i);
+        switch (op) {
+        case BV_AND:    x = vandq_u8(x, y); break;
+        case BV_OR:     x = vorrq_u8(x, y); break;
+        case BV_ANDNOT: x = vbicq_u8(x, y); break;
+        }
+        vst1q_u8(dst + i, x);
+    }
+#endif
+
+    for ( ; i + sizeof(uint64_t) <= n ; i += sizeof(uint64_t)) {
+        uint64_t x, y;
+        memcpy(&x, dst + i, sizeof(x));
+        memcpy(&y, src + i, sizeof(y));
+        switch (op) {
+        case BV_AND:    x &= y; break;
+        case BV_OR:     x |= y; break;
+        case BV_ANDNOT: x &= ~y; break;
+        }
+        memcpy(dst + i, &x, sizeof(x));
+    }
+
+    for ( ; i < n ; i++) {
+        switch (op) {
+        case BV_AND:    dst[i] &= src[i]; break;
+        case BV_OR:     dst[i] |= src[i]; break;
+        case BV_ANDNOT: dst[i] &= ~src[i]; break;
+        }
+    }
+}
+
 EXPORTED void bv_andeq(bitvector_t *a, const bitvector_t *b)
 {
     unsigned int n;
-    unsigned int i;
 
     bv_ensure(a, b->length);
     if (!a->length)
         return;
-    n = vlen(b->length+1);
-    for (i = 0 ; i <= n ; i++)
-        a->bits[i] &= b->bits[i];
-    n = vlen(a->length);
-    for ( ; i <= n ; i++)
-        a->bits[i] = 0;
+    n = MIN(vlen(a->length), vlen(b->length));
+    bv_wordop(a->bits, b->bits, n, BV_AND);
+    /* anything past the end of b is cleared */
+    if (vlen(a->length) > n)
+        memset(a->bits + n, 0, vlen(a->length) - n);
     a->length = MAX(a->length, b->length);
 }
 
 EXPORTED void bv_oreq(bitvector_t *a, const bitvector_t *b)
 {
-    unsigned int n;
-    unsigned int i;
-
     bv_ensure(a, b->length);
-    n = vlen(b->length+1);
-    for (i = 0 ; i <= n ; i++)
-        a->bits[i] |= b->bits[i];
+    bv_wordop(a->bits, b->bits, vlen(b->length), BV_OR);
     a->length = MAX(a->length, b->length);
 }
 
+/* a &= ~b; bits of a past the end of b are unchanged */
+EXPORTED void bv_andnoteq(bitvector_t *a, const bitvector_t *b)
+{
+    unsigned int n = MIN(vlen(a->length), vlen(b->length));
+
+    if (n) bv_wordop(a->bits, b->bits, n, BV_ANDNOT);
+}
+
+/* Flip every bit below the current length */
+EXPORTED void bv_invert(bitvector_t *bv)
+{
+    unsigned int n = vlen(bv->length);
+    unsigned int i = 0;
+
+    for ( ; i + sizeof(uint64_t) <= n ; i += sizeof(uint64_t)) {
+        uint64_t x;
+        memcpy(&x, bv->bits + i, sizeof(x));
+        x = ~x;
+        memcpy(bv->bits + i, &x, sizeof(x));
+    }
+    for ( ; i < n ; i++)
+        bv->bits[i] = ~bv->bits[i];
+
+    if (n) bv_cleartail(bv);
+}
+
 /*
  * Returns the bit position of the next set bit which is after or equal
  * to position 'start'.  Passing start = 0 returns the first set bit.
@@ -71,6 +71,8 @@ extern void bv_set(bitvector_t *, unsigned int);
 extern void bv_clear(bitvector_t *, unsigned int);
 extern void bv_andeq(bitvector_t *a, const bitvector_t *b);
 extern void bv_oreq(bitvector_t *a, const bitvector_t *b);
+extern void bv_andnoteq(bitvector_t *a, const bitvector_t *b);
+extern void bv_invert(bitvector_t *);
 extern int bv_next_set(const bitvector_t *, int start);
 extern int bv_prev_set(const bitvector_t *, int start);
 extern int bv_first_set(const bitvector_t *);
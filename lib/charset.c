@@ -109,19 +109,19 @@ struct canon_state {
 };
 
 struct comp_pat_s {
-    int max_start;
     size_t patlen;
 };
 
 struct search_state {
-    ssize_t *starts;
-    int max_start;
+    struct buf buf;             /* decoded octets not yet matched */
     int havematch;
-    unsigned char *substr;
+    const char *substr;
     size_t patlen;
-    size_t offset;
 };
 
+/* decoded octets gathered before search_scan() looks at them */
+#define SEARCH_BLOCK 4096
+
 enum html_state {
     HDATA,
     HTAGOPEN,
@@ -179,6 +179,7 @@ struct charset_converter {
     int num_bits;
 
     /* ICU converter backend state */
+    char *icuname;    /* name conv was opened by, for icu_cache */
     short flush;      /* set if conv should be flushed */
     char *buf;        /* Target and source cache */
     size_t buf_size;
@@ -346,10 +347,11 @@ static void convert_catn(struct convert_rock *rock, const char *s, size_t len)
     convert_flush(rock);
 }
 
-/* convertproc_t conversion functions */
-static void qp_flushline(struct convert_rock *rock, int endline)
+/* decode the QP line buffered in s into dst, which must have room
+ * for s->len + 2 bytes; returns the number of bytes written */
+static size_t qp_decodeline(struct qp_state *s, int endline, char *dst)
 {
-    struct qp_state *s = (struct qp_state *)rock->state;
+    char *p = dst;
     int i;
 
     /* strip trailing whitespace: RFC2405 transport-padding */
@@ -368,31 +370,45 @@ static void qp_flushline(struct convert_rock *rock, int endline)
                 int val1 = HEXCHAR(s->buf[i+1]);
                 int val2 = HEXCHAR(s->buf[i+2]);
                 if (val1 != XX && val2 != XX) {
-                    convert_putc(rock->next, (val1<<4) + val2);
+                    *p++ = (val1<<4) + val2;
                     i += 2;
                     break;
                 }
             }
             /* otherwise too close to the end or invalid, just eject
              * a literal '=' and keep going */
-            convert_putc(rock->next, '=');
+            *p++ = '=';
             break;
         case '_':
             /* underscores are space in headers */
-            convert_putc(rock->next, s->isheader ? ' ' : '_');
+            *p++ = s->isheader ? ' ' : '_';
             break;
         default:
-            convert_putc(rock->next, s->buf[i]);
+            *p++ = s->buf[i];
             break;
         }
     }
 
     if (endline) {
-        convert_putc(rock->next, '\r');
-        convert_putc(rock->next, '\n');
+        *p++ = '\r';
+        *p++ = '\n';
     }
 
     s->len = 0;
+
+    return p - dst;
+}
+
+/* convertproc_t conversion functions */
+static void qp_flushline(struct convert_rock *rock, int endline)
+{
+    struct qp_state *s = (struct qp_state *)rock->state;
+    char out[sizeof(s->buf) + 2];
+    size_t i, n;
+
+    n = qp_decodeline(s, endline, out);
+    for (i = 0; i < n; i++)
+        convert_putc(rock->next, (unsigned char) out[i]);
 }
 
 static void qp_flush(struct convert_rock *rock)
@@ -453,6 +469,136 @@ static void b64_2byte(struct convert_rock *rock, uint32_t c)
     }
 }
 
+/*
+ * Bulk decoders, for when the decoded bytes go straight into memory
+ * rather than on down a convert_rock chain.  They produce exactly the
+ * same output as qp2byte and b64_2byte, and keep their state in the
+ * same structures so input can be fed in pieces, but avoid making
+ * several indirect calls for every byte.
+ */
+
+/* decode len bytes of QP from src into dst, which must have room for
+ * 2 * len + 2 bytes; if final, flush any partial line */
+static size_t qp_decode_bulk(struct qp_state *s, const char *src, size_t len,
+                             int final, char *dst)
+{
+    const unsigned char *p = (const unsigned char *) src;
+    const unsigned char *end = p + len;
+    char *out = dst;
+
+    while (p < end) {
+        switch (*p) {
+        case '\r':
+            break;
+        case '\n':
+            out += qp_decodeline(s, 1, out);
+            break;
+        default:
+            s->buf[s->len++] = *p;
+            /* really overlength line? just flush now */
+            if (s->len > 998)
+                out += qp_decodeline(s, 0, out);
+            break;
+        }
+        p++;
+    }
+
+    if (final) out += qp_decodeline(s, 0, out);
+
+    return out - dst;
+}
+
+/* decode len bytes of base64 from src into dst, which must have room
+ * for len / 4 * 3 + 3 bytes */
+static size_t b64_decode_bulk(struct b64_state *s, const char *src, size_t len,
+                              char *dst)
+{
+    const unsigned char *p = (const unsigned char *) src;
+    const unsigned char *end = p + len;
+    unsigned char *out = (unsigned char *) dst;
+
+    while (p < end) {
+        int b;
+
+        /* whole quantum, no whitespace or padding: the common case */
+        if (!s->bytesleft && end - p >= 4) {
+            int b0 = CHAR64(p[0]), b1 = CHAR64(p[1]);
+            int b2 = CHAR64(p[2]), b3 = CHAR64(p[3]);
+
+            /* valid values are <= 63, XX has 0x40 set */
+            if (!((b0 | b1 | b2 | b3) & 0x40)) {
+                *out++ = ((b0 << 2) | (b1 >> 4)) & 0xff;
+                *out++ = ((b1 << 4) | (b2 >> 2)) & 0xff;
+                *out++ = ((b2 << 6) | b3) & 0xff;
+                p += 4;
+                continue;
+            }
+        }
+
+        b = CHAR64(*p++);
+
+        /* could just be whitespace, ignore it */
+        if (b == XX) continue;
+
+        switch (s->bytesleft) {
+        case 0:
+            s->codepoint = b;
+            s->bytesleft = 3;
+            break;
+        case 3:
+            *out++ = ((s->codepoint << 2) | (b >> 4)) & 0xff;
+            s->codepoint = b;
+            s->bytesleft = 2;
+            break;
+        case 2:
+            *out++ = ((s->codepoint << 4) | (b >> 2)) & 0xff;
+            s->codepoint = b;
+            s->bytesleft = 1;
+            break;
+        case 1:
+            *out++ = ((s->codepoint << 6) | b) & 0xff;
+            s->codepoint = 0;
+            s->bytesleft = 0;
+        }
+    }
+
+    return out - (unsigned char *) dst;
+}
+
+/* append the decoding of src to dst; returns -1 for an unknown encoding */
+static int decode_bulk(struct buf *dst, const char *src, size_t len,
+                       int encoding)
+{
+    size_t n;
+
+    switch (encoding) {
+    case ENCODING_NONE:
+        buf_appendmap(dst, src, len);
+        return 0;
+
+    case ENCODING_QP: {
+        struct qp_state s = { 0, 0, { 0 } };
+        buf_ensure(dst, 2 * len + 2);
+        n = qp_decode_bulk(&s, src, len, 1, dst->s + dst->len);
+        break;
+    }
+
+    case ENCODING_BASE64: {
+        struct b64_state s = { 0, 0 };
+        buf_ensure(dst, len / 4 * 3 + 3);
+        n = b64_decode_bulk(&s, src, len, dst->s + dst->len);
+        break;
+    }
+
+    default:
+        return -1;
+    }
+
+    buf_truncate(dst, dst->len + n);
+
+    return 0;
+}
+
 /*
  * This filter unfolds folded RFC2822 header field lines, i.e. it strips
  * a CRLF pair only if the first character after the CRLF is LWS, and
@@ -628,51 +774,42 @@ static void uni2html(struct convert_rock *rock, uint32_t c)
     convert_putc(rock->next, c);
 }
 
+/* Match the search pattern against the octets gathered so far, keeping
+ * back just enough of them to catch a match that straddles the next
+ * block */
+static void search_scan(struct search_state *s)
+{
+    size_t keep;
+
+    if (!s->patlen) s->havematch = 1;
+    if (s->havematch || s->buf.len < s->patlen)
+        return;
+
+    if (memmem(s->buf.s, s->buf.len, s->substr, s->patlen)) {
+        s->havematch = 1;
+        buf_reset(&s->buf);
+        return;
+    }
+
+    keep = s->patlen - 1;
+    memmove(s->buf.s, s->buf.s + s->buf.len - keep, keep);
+    buf_truncate(&s->buf, keep);
+}
+
 static void byte2search(struct convert_rock *rock, uint32_t c)
 {
     struct search_state *s = (struct search_state *)rock->state;
-    int i, cur;
-    unsigned char b = (unsigned char)c;
+
+    if (s->havematch) return;
 
     if (c == U_REPLACEMENT) {
         c = 0xff; /* searchable by invalid character! */
     }
 
-    /* check our "in_progress" matches to see if they're still valid */
-    for (i = 0, cur = 0; i < s->max_start; i++) {
-        /* no more active offsets */
-        if (s->starts[i] == -1)
-            break;
-
-        /* if we've passed one that's not ongoing, copy back */
-        if (cur < i)
-            s->starts[cur] = s->starts[i];
+    buf_putc(&s->buf, c & 0xff);
 
-        /* check that the substring is still matching */
-        if (b == s->substr[s->offset - s->starts[i]]) {
-            if (s->offset - s->starts[i] == s->patlen - 1) {
-                /* we're there! */
-                s->havematch = 1;
-            }
-            else {
-                /* keep this one, it's ongoing */
-                cur++;
-            }
-        }
-    }
-    /* starting a new one! */
-    if (b == s->substr[0]) {
-        /* have to treat this one specially! */
-        if (s->patlen == 1)
-            s->havematch = 1;
-        else
-            s->starts[cur++] = s->offset;
-    }
-    /* empty out any others that aren't being kept */
-    while (cur < i) s->starts[cur++] = -1;
-
-    /* increment the offset counter */
-    s->offset++;
+    if (s->buf.len >= SEARCH_BLOCK + s->patlen)
+        search_scan(s);
 }
 
 /* Given an octet, append it to a buffer */
@@ -956,6 +1093,115 @@ static void table2uni(struct convert_rock *rock, uint32_t c)
     s->curtable = s->initialtable + map->next;
 }
 
+/*
+ * Handle a leading run of plain ASCII octets in src for a pipeline of
+ * the form charset -> searchform -> utf-8 -> buffer or search, appending
+ * their search form straight to the target buffer instead of pushing
+ * every octet through each converter in turn.  Returns the number of octets
+ * consumed, which is zero if the pipeline has some other shape or the
+ * first octet needs the general path; the caller feeds that octet to
+ * convert_putc() and tries again.
+ */
+static size_t searchform_ascii(struct convert_rock *input,
+                               const char *src, size_t len)
+{
+    struct convert_rock *canon = input->next;
+    struct convert_rock *sink;
+    struct charset_converter *cs = (struct charset_converter *)input->state;
+    const unsigned char *p = (const unsigned char *)src;
+    struct canon_state *s;
+    struct charmap *map;
+    struct buf *out;
+    unsigned char table16, table8;
+    int istable;
+    size_t i;
+
+    if (!canon || canon->f != uni2searchform ||
+        !canon->next || canon->next->f != uni2utf8 || !canon->next->next)
+        return 0;
+
+    sink = canon->next->next;
+    if (sink->f == byte2buffer)
+        out = (struct buf *)sink->state;
+    else if (sink->f == byte2search)
+        /* the caller runs search_havematch() after each block */
+        out = &((struct search_state *)sink->state)->buf;
+    else
+        return 0;
+
+    if (input->f == utf8_2uni) {
+        /* a pending multi-octet sequence must see this octet */
+        if (cs->bytesleft) return 0;
+        istable = 0;
+    }
+    else if (input->f == table2uni) {
+        /* shift states belong to the general path */
+        if (cs->curtable != cs->initialtable) return 0;
+        istable = 1;
+    }
+    else return 0;
+
+    s = (struct canon_state *)canon->state;
+
+    /* the translation block for U+0000..U+00FF, as in uni2searchform */
+    table16 = chartables_translation_block16[0];
+    table8 = table16 == 255 ? 255 : chartables_translation_block8[table16][0];
+    if (table8 == 255) return 0;
+
+    buf_ensure(out, len);
+
+    for (i = 0; i < len; i++) {
+        int code = p[i];
+
+        if (code >= 0x80) break;
+
+        if (istable) {
+            map = (struct charmap *)&cs->curtable[0][code];
+            if (!map->c || map->c != (unsigned)code || map->next) break;
+        }
+
+        code = chartables_translation[table8][code];
+
+        /* case - zero length output */
+        if (code == 0) continue;
+
+        /* anything but a single ASCII character goes the long way */
+        if (code < 0 || code >= 0x80) break;
+
+        if (code == ' ' || code == '\r' || code == '\n') {
+            if (s->flags & CHARSET_SKIPSPACE)
+                continue;
+            if (s->flags & CHARSET_MERGESPACE) {
+                if (s->seenspace)
+                    continue;
+                s->seenspace = 1;
+                code = ' ';
+            }
+        }
+        else
+            s->seenspace = 0;
+
+        out->s[out->len++] = code;
+    }
+
+    return i;
+}
+
+/* Feed len octets of src into the pipeline, without flushing it */
+static void searchform_catn(struct convert_rock *input,
+                            const char *src, size_t len)
+{
+    while (len) {
+        size_t n = searchform_ascii(input, src, len);
+        if (!n) {
+            convert_putc(input, (unsigned char)*src);
+            n = 1;
+        }
+        src += n;
+        len -= n;
+    }
+}
+
 /*
  * The HTML5 standard mandates that certain Unicode code points
  * cannot be generated using &#nnn; numerical character references,
@@ -1509,6 +1755,109 @@ restart:
     }
 }
 
+/*
+ * Can striphtml_catn() stand in for charset -> striphtml on src?  It
+ * can when the charset is UTF-8 and every multi-octet sequence in src
+ * is complete, so that the decoder is never part way through one at
+ * an ASCII octet, and skipping a run of text can't change its state.
+ */
+static int striphtml_blockable(charset_t charset, const char *src, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)src;
+    const unsigned char *end = p + len;
+
+    if (charset->conv || charset->num < 0 ||
+        !strstr(chartables_charset_table[charset->num].name, "utf-8"))
+        return 0;
+
+    while (p < end) {
+        unsigned char c = *p++;
+        int n;
+
+        if (c < 0x80) continue;
+
+        if (c >= 0xc2 && c <= 0xdf) n = 1;
+        else if (c >= 0xe0 && c <= 0xef) n = 2;
+        else if (c >= 0xf0 && c <= 0xf4) n = 3;
+        else return 0;
+
+        if (end - p < n) return 0;
+        while (n--) {
+            if ((*p++ & 0xc0) != 0x80) return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Strip markup from a block of src which striphtml_blockable() accepted,
+ * with the same output as feeding it through the UTF-8 decoder and then
+ * striphtml2uni() one codepoint at a time.  'text' is the decoder, and
+ * must share the striphtml rock's next converter.  Runs of text go to
+ * the decoder in one call, runs which the state machine would discard
+ * (script and style data, tag parameters, comments) are skipped with
+ * memchr(), and only the markup itself steps through striphtml2uni().
+ * src must not end part way through a multi-octet sequence.
+ */
+static void striphtml_catn(struct convert_rock *strip,
+                           struct convert_rock *text,
+                           const char *src, size_t len)
+{
+    struct striphtml_state *s = (struct striphtml_state *)strip->state;
+    const char *end = src + len;
+    const char *p, *q;
+    uint32_t c;
+    int n;
+
+    while (src < end) {
+        p = src;
+
+        switch (html_top(s)) {
+        case HDATA:
+            p = memchr(src, '<', end - src);
+            if (!p) p = end;
+            q = memchr(src, '&', p - src);
+            if (q) p = q;
+            if (p > src) searchform_catn(text, src, p - src);
+            break;
+
+        case HSCRIPTDATA:
+        case HSTYLEDATA:
+            p = memchr(src, '<', end - src);
+            break;
+
+        case HTAGPARAMS:
+            while (p < end && *p != '>' && *p != '/') p++;
+            break;
+
+        case HBOGUSCOMM:
+            p = memchr(src, '>', end - src);
+            break;
+
+        case HCOMM:
+            p = memchr(src, '-', end - src);
+            break;
+
+        default:
+            break;
+        }
+
+        if (!p) break;
+        src = p;
+        if (src == end) break;
+
+        /* one codepoint through the state machine */
+        c = (unsigned char) *src++;
+        if (c >= 0x80) {
+            n = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+            c &= 0x3f >> n;
+            while (n--) c = (c << 6) + (*src++ & 0x3f);
+        }
+        convert_putc(strip, c);
+    }
+}
+
 static const char *convert_name(struct convert_rock *rock)
 {
     if (rock->f == b64_2byte) return "b64_2byte";
@@ -1542,6 +1891,7 @@ static char *buffer_cstring(struct convert_rock *rock)
 static inline int search_havematch(struct convert_rock *rock)
 {
     struct search_state *s = (struct search_state *)rock->state;
+    search_scan(s);
     return s->havematch;
 }
 
@@ -1657,7 +2007,7 @@ static void search_free(struct convert_rock *rock)
 {
     if (rock && rock->state) {
         struct search_state *s = (struct search_state *)rock->state;
-        if (s->starts) free(s->starts);
+        buf_free(&s->buf);
     }
     basic_free(rock);
 }
@@ -1775,18 +2125,11 @@ static struct convert_rock *search_init(const char *substr, comp_pat *pat) {
     struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
     struct search_state *s = xzmalloc(sizeof(struct search_state));
     struct comp_pat_s *p = (struct comp_pat_s *)pat;
-    int i;
 
     /* copy in tracking vars */
-    s->max_start = p->max_start;
     s->patlen = p->patlen;
-    s->substr = (unsigned char *)substr;
-
-    /* allocate tracking space and initialise to "no match" */
-    s->starts = xmalloc(s->max_start * sizeof(s->starts[0]));
-    for (i = 0; i < s->max_start; i++) {
-        s->starts[i] = -1;
-    }
+    s->substr = substr;
+    buf_ensure(&s->buf, SEARCH_BLOCK + s->patlen);
 
     /* set up the rock */
     rock->f = byte2search;
@@ -1810,6 +2153,8 @@ static struct convert_rock *buffer_init(size_t hint)
     return rock;
 }
 
+#define CHUNK_SIZE (64*1024)
+
 static void buffer_setbuf(struct convert_rock *rock, struct buf *dst)
 {
     if (rock->state) {
@@ -1899,6 +2244,115 @@ done:
     return "unknown";
 }
 
+/*
+ * Case-insensitive indexes of the compiled in alias and charset tables,
+ * built on first use.  The alias index maps every alias and canonical
+ * name to its canonical name, the table index maps a charset name to
+ * one more than its position in chartables_charset_table.  Where a
+ * name appears more than once the first entry wins, as it did when
+ * the tables were searched in order.
+ */
+static struct hash_table charset_alias_index = HASH_TABLE_INITIALIZER;
+static struct hash_table charset_table_index = HASH_TABLE_INITIALIZER;
+
+static const char *charset_index_key(const char *name)
+{
+    static struct buf key = BUF_INITIALIZER;
+
+    buf_setcstr(&key, name);
+    return lcase((char *) buf_cstring(&key));
+}
+
+static void charset_index_init(void)
+{
+    int i;
+
+    if (charset_alias_index.table) return;
+
+    construct_hash_table(&charset_alias_index, 256, 0);
+    for (i = 0; charset_aliases[i].name; i++) {
+        const char *key = charset_index_key(charset_aliases[i].name);
+        if (!hash_lookup(key, &charset_alias_index))
+            hash_insert(key, charset_aliases[i].canon_name,
+                        &charset_alias_index);
+        key = charset_index_key(charset_aliases[i].canon_name);
+        if (!hash_lookup(key, &charset_alias_index))
+            hash_insert(key, charset_aliases[i].canon_name,
+                        &charset_alias_index);
+    }
+
+    construct_hash_table(&charset_table_index, 128, 0);
+    for (i = 0; i < chartables_num_charsets; i++) {
+        const char *key;
+
+        if (!chartables_charset_table[i].name) continue;
+        if (!chartables_charset_table[i].table &&
+            strcmp(chartables_charset_table[i].name, "utf-8")) continue;
+
+        key = charset_index_key(chartables_charset_table[i].name);
+        if (!hash_lookup(key, &charset_table_index))
+            hash_insert(key, (void *)(intptr_t)(i + 1), &charset_table_index);
+    }
+}
+
+/*
+ * ICU converters are costly to open, and a process tends to see the
+ * same few charsets over and over, so charset_free() parks them here
+ * and charset_lookupname() resets and reuses them.
+ */
+#define ICU_CACHE_SIZE 8
+
+static struct icu_cache_entry {
+    char *name;
+    UConverter *conv;
+    char *buf;
+    size_t buf_size;
+} icu_cache[ICU_CACHE_SIZE];
+static unsigned icu_cache_evict;
+
+static int icu_cache_get(struct charset_converter *s, const char *name)
+{
+    struct icu_cache_entry *e;
+
+    for (e = icu_cache; e < icu_cache + ICU_CACHE_SIZE; e++) {
+        if (e->conv && !strcasecmp(e->name, name)) {
+            s->icuname = e->name;
+            s->conv = e->conv;
+            s->buf = e->buf;
+            s->buf_size = e->buf_size;
+            memset(e, 0, sizeof(struct icu_cache_entry));
+            ucnv_reset(s->conv);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void icu_cache_put(struct charset_converter *s)
+{
+    struct icu_cache_entry *e;
+
+    for (e = icu_cache; e < icu_cache + ICU_CACHE_SIZE; e++) {
+        if (!e->conv) break;
+    }
+    if (e == icu_cache + ICU_CACHE_SIZE) {
+        /* full: evict round robin */
+        e = &icu_cache[icu_cache_evict++ % ICU_CACHE_SIZE];
+        ucnv_close(e->conv);
+        free(e->buf);
+        free(e->name);
+    }
+
+    e->name = s->icuname;
+    e->conv = s->conv;
+    e->buf = s->buf;
+    e->buf_size = s->buf_size;
+    s->icuname = NULL;
+    s->conv = NULL;
+    s->buf = NULL;
+}
+
 /*
  * Lookup the character set 'name'.  Returns the character set
  * or CHARSET_UNKNOWN_CHARSET if there is no matching character set.
@@ -1907,6 +2361,7 @@ EXPORTED charset_t charset_lookupname(const char *name)
 {
     int i;
     struct charset_converter *s;
+    const char *canon;
     UErrorCode err;
     UConverter *conv;
 
@@ -1919,35 +2374,36 @@ EXPORTED charset_t charset_lookupname(const char *name)
         return s;
     }
 
+    charset_index_init();
+
     /* translate to canonical name */
-    for (i = 0; charset_aliases[i].name; i++) {
-        if (!strcasecmp(name, charset_aliases[i].name) ||
-            !strcasecmp(name, charset_aliases[i].canon_name)) {
-            name = charset_aliases[i].canon_name;
-            s->name = xstrdup(name);
-            break;
-        }
+    canon = hash_lookup(charset_index_key(name), &charset_alias_index);
+    if (canon) {
+        name = canon;
+        s->name = xstrdup(name);
     }
 
     /* Is it a table based lookup, or UTF-8? */
-    for (i = 0; i < chartables_num_charsets; i++) {
-        if (!strcasecmp(name, chartables_charset_table[i].name)) {
-            if ((chartables_charset_table[i].table) || !strcmp(name, "utf-8")) {
-                s->num = i;
-                return s;
-            }
-        }
+    i = (intptr_t) hash_lookup(charset_index_key(name), &charset_table_index);
+    if (i && (chartables_charset_table[i-1].table || !strcmp(name, "utf-8"))) {
+        s->num = i - 1;
+        return s;
     }
 
     /* Otherwise, let's see if we can fallback to ICU */
+    if (icu_cache_get(s, name))
+        return s;
+
     err = U_ZERO_ERROR;
     conv = ucnv_open(name, &err);
     if (U_SUCCESS(err)) {
         s->conv = conv;
+        s->icuname = xstrdup(name);
         return s;
     }
 
     /* Still here? This means we don't know this charset name */
+    free(s->name);
     free(s);
     return CHARSET_UNKNOWN_CHARSET;
 }
@@ -1956,8 +2412,8 @@ EXPORTED void charset_free(charset_t *charsetp)
 {
     if (charsetp && *charsetp != CHARSET_UNKNOWN_CHARSET) {
         struct charset_converter *s = *charsetp;
-        /* Close the ICU converter */
-        if (s->conv) ucnv_close(s->conv);
+        /* Keep the ICU converter for reuse */
+        if (s->conv) icu_cache_put(s);
         /* Free up memory. */
         if (s->buf) free(s->buf);
         if (s->name) free(s->name);
@@ -2001,7 +2457,8 @@ EXPORTED char *charset_convert(const char *s, charset_t charset, int flags)
     input = convert_init(charset, 1/*to_uni*/, input);
 
     /* do the conversion */
-    convert_cat(input, s);
+    searchform_catn(input, s, strlen(s));
+    convert_flush(input);
 
     /* extract the result */
     res = buffer_cstring(tobuffer);
@@ -2226,8 +2683,6 @@ EXPORTED char *charset_to_utf8(const char *msg_base, size_t len, charset_t chars
 /* Decode bytes from src into buffer dst */
 EXPORTED int charset_decode(struct buf *dst, const char *src, size_t len, int encoding)
 {
-    struct convert_rock *input;
-
     buf_reset(dst);
 
     /* check for trivial decode */
@@ -2236,35 +2691,14 @@ EXPORTED int charset_decode(struct buf *dst, const char *src, size_t len, int en
         return 0;
     }
 
-    /* set up the conversion path */
-    input = buffer_init(len);
-    buffer_setbuf(input, dst);
-
-    /* choose encoding extraction if needed */
-    switch (encoding) {
-    case ENCODING_NONE:
-        break;
-
-    case ENCODING_QP:
-        input = qp_init(0, input);
-        break;
-
-    case ENCODING_BASE64:
-        input = b64_init(input);
-        /* XXX have to have nl-mapping base64 in order to
-         * properly count \n as 2 raw characters
-         */
-        break;
-
-    default:
+    /* XXX have to have nl-mapping base64 in order to
+     * properly count \n as 2 raw characters
+     */
+    if (decode_bulk(dst, src, len, encoding)) {
         /* Don't know encoding--nothing can match */
-        convert_free(input);
         return -1;
     }
 
-    convert_catn(input, src, len);
-    convert_free(input);
-
     return 0;
 }
 
@@ -2598,18 +3032,14 @@ EXPORTED int charset_search_mimeheader(const char *substr, comp_pat *pat,
 }
 
 /* Compile a search pattern for later comparison.  We just count
- * how long the string is, and how many times the first character
- * occurs.  Later optimisation could reduce the max_start by
- * deeper analysis of the possible paths through the string, but
- * this is a good absolute maximum, and it just means a few more
- * bytes get allocated... */
+ * how long the string is; the matching itself is done a block at
+ * a time by memmem(). */
 EXPORTED comp_pat *charset_compilepat(const char *s)
 {
     struct comp_pat_s *pat = xzmalloc(sizeof(struct comp_pat_s));
     const char *p = s;
     /* count occurrences */
     while (*p) {
-        if (*p == *s) pat->max_start++;
         pat->patlen++;
         p++;
     }
@@ -2652,9 +3082,12 @@ EXPORTED int charset_searchstring(const char *substr, comp_pat *pat,
     input = canon_init(flags, input);
     input = convert_init(utf8from, 1/*to_uni*/, input);
 
-    /* feed the handler */
-    while (len-- > 0) {
-        convert_putc(input, (unsigned char)*s++);
+    /* feed the handler a block at a time */
+    while (len > 0) {
+        size_t n = len > SEARCH_BLOCK ? SEARCH_BLOCK : len;
+        searchform_catn(input, s, n);
+        s += n;
+        len -= n;
         if (search_havematch(tosearch)) break; /* shortcut if there's a match */
     }
 
@@ -2681,7 +3114,8 @@ EXPORTED int charset_searchfile(const char *substr, comp_pat *pat,
                        charset_t charset, int encoding, int flags)
 {
     struct convert_rock *input, *tosearch;
-    size_t i;
+    struct buf decoded = BUF_INITIALIZER;
+    size_t i, n;
     int res;
     charset_t utf8;
 
@@ -2699,37 +3133,29 @@ EXPORTED int charset_searchfile(const char *substr, comp_pat *pat,
     input = canon_init(flags, input);
     input = convert_init(charset, 1/*to_uni*/, input);
 
-    /* choose encoding extraction if needed */
-    switch (encoding) {
-    case ENCODING_NONE:
-        break;
-
-    case ENCODING_QP:
-        input = qp_init(0, input);
-        break;
-
-    case ENCODING_BASE64:
-        input = b64_init(input);
-        /* XXX have to have nl-mapping base64 in order to
-         * properly count \n as 2 raw characters
-         */
-        break;
-
-    default:
-        /* Don't know encoding--nothing can match */
-        convert_free(input);
-        charset_free(&utf8);
-        return 0;
+    /* strip the transfer encoding in one go */
+    if (encoding != ENCODING_NONE) {
+        if (decode_bulk(&decoded, msg_base, len, encoding)) {
+            /* Don't know encoding--nothing can match */
+            convert_free(input);
+            charset_free(&utf8);
+            return 0;
+        }
+        msg_base = decoded.s;
+        len = decoded.len;
     }
 
-    /* implement the loop here so we can check on the search each time */
-    for (i = 0; i < len; i++) {
-        convert_putc(input, (unsigned char)msg_base[i]);
+    /* implement the loop here so we can check on the search each block */
+    for (i = 0; i < len; i += n) {
+        n = len - i > SEARCH_BLOCK ? SEARCH_BLOCK : len - i;
+        searchform_catn(input, msg_base + i, n);
         if (search_havematch(tosearch)) break;
     }
+    convert_flush(input);
 
     res = search_havematch(tosearch); /* copy before we free it */
 
+    buf_free(&decoded);
     convert_free(input);
     charset_free(&utf8);
 
@@ -2743,9 +3169,12 @@ EXPORTED int charset_extract(void (*cb)(const struct buf *, void *),
                              charset_t charset, int encoding,
                              const char *subtype, int flags)
 {
-    struct convert_rock *input, *tobuffer;
+    struct convert_rock *input, *tobuffer, *strip = NULL;
+    struct buf decoded = BUF_INITIALIZER;
     struct buf *out;
-    size_t i;
+    const char *src = data->s;
+    size_t len = data->len;
+    size_t i, n;
     charset_t utf8;
     
     if (charset_debug)
@@ -2770,39 +3199,42 @@ EXPORTED int charset_extract(void (*cb)(const struct buf *, void *),
         /* this is text/html data, so we can make ourselves useful by
          * stripping html tags, css and js. */
         if (!(flags & CHARSET_KEEPHTML)) {
-            input = striphtml_init(input);
+            input = strip = striphtml_init(input);
         }
     }
 
     input = convert_init(charset, 1/*to_uni*/, input);
 
-    switch (encoding) {
-    case ENCODING_NONE:
-        break;
-
-    case ENCODING_QP:
-        input = qp_init(0, input);
-        break;
-
-    case ENCODING_BASE64:
-        input = b64_init(input);
-        /* XXX have to have nl-mapping base64 in order to
-         * properly count \n as 2 raw characters
-         */
-        break;
+    /* strip the transfer encoding in one go */
+    if (encoding != ENCODING_NONE) {
+        if (decode_bulk(&decoded, data->s, data->len, encoding)) {
+            /* Don't know encoding--nothing can match */
+            convert_free(input);
+            charset_free(&utf8);
+            return 0;
+        }
+        src = decoded.s;
+        len = decoded.len;
+    }
 
-    default:
-        /* Don't know encoding--nothing can match */
-        convert_free(input);
-        charset_free(&utf8);
-        return 0;
+    if (strip && striphtml_blockable(charset, src, len)) {
+        /* take the stripper out of the pipeline and drive it by block,
+         * with the decoder now feeding the rest of the pipeline */
+        input->next = strip->next;
     }
+    else strip = NULL;
 
     /* point to the buffer for easy block sending */
     out = (struct buf *)tobuffer->state;
 
-    for (i = 0; i < data->len; i++) {
-        convert_putc(input, (unsigned char)data->s[i]);
+    for (i = 0; i < len; i += n) {
+        n = len - i > 4096 ? 4096 : len - i;
+        if (strip) {
+            /* don't split a multi-octet sequence between blocks */
+            while (i + n < len && (src[i + n] & 0xc0) == 0x80) n--;
+            striphtml_catn(strip, input, src + i, n);
+        }
+        else searchform_catn(input, src + i, n);
 
         /* process a block of output every so often */
         if (buf_len(out) > 4096) {
@@ -2816,7 +3248,9 @@ EXPORTED int charset_extract(void (*cb)(const struct buf *, void *),
         cb(out, rock);
     }
 
+    buf_free(&decoded);
     convert_free(input);
+    if (strip) convert_nfree(strip, 1);
     charset_free(&utf8);
 
     return 1;
@@ -2832,10 +3266,59 @@ EXPORTED int charset_extract(void (*cb)(const struct buf *, void *),
  * @decbuf, so @decbuf should not be free()d until the return value has
  * been used.
  */
+EXPORTED int charset_decode_mimebody_chunks(const char *msg_base, size_t len,
+                                            int encoding,
+                                            charset_chunkproc_t *proc,
+                                            void *rock, size_t *outlen)
+{
+    struct qp_state qp = { 0, 0, { 0 } };
+    struct b64_state b64 = { 0, 0 };
+    char *out;
+    size_t n;
+
+    *outlen = 0;
+
+    switch (encoding) {
+    case ENCODING_NONE:
+        if (len) proc(msg_base, len, rock);
+        *outlen = len;
+        return 0;
+
+    case ENCODING_QP:
+    case ENCODING_BASE64:
+        break;
+
+    default:
+        /* Don't know encoding--nothing can match */
+        return -1;
+    }
+
+    out = xmalloc(CHUNK_SIZE + 2);
+
+    while (len) {
+        /* QP can grow a lone LF into CRLF, so take half a chunk */
+        size_t take = len > CHUNK_SIZE / 2 ? CHUNK_SIZE / 2 : len;
+
+        len -= take;
+        if (encoding == ENCODING_QP)
+            n = qp_decode_bulk(&qp, msg_base, take, !len, out);
+        else
+            n = b64_decode_bulk(&b64, msg_base, take, out);
+        msg_base += take;
+
+        if (n) proc(out, n, rock);
+        *outlen += n;
+    }
+
+    free(out);
+
+    return 0;
+}
+
 EXPORTED const char *charset_decode_mimebody(const char *msg_base, size_t len, int encoding,
                                              char **decbuf, size_t *outlen)
 {
-    struct convert_rock *input, *tobuffer;
+    struct buf buf = BUF_INITIALIZER;
 
     *decbuf = NULL;
     *outlen = 0;
@@ -2846,13 +3329,7 @@ EXPORTED const char *charset_decode_mimebody(const char *msg_base, size_t len, i
         return msg_base;
 
     case ENCODING_QP:
-        tobuffer = buffer_init(len);
-        input = qp_init(0, tobuffer);
-        break;
-
     case ENCODING_BASE64:
-        tobuffer = buffer_init(len);
-        input = b64_init(tobuffer);
         break;
 
     default:
@@ -2860,16 +3337,11 @@ EXPORTED const char *charset_decode_mimebody(const char *msg_base, size_t len, i
         return NULL;
     }
 
-    convert_catn(input, msg_base, len);
+    if (len) decode_bulk(&buf, msg_base, len, encoding);
 
     /* extract the string from the buffer */
-    {
-        struct buf *buf = (struct buf *)tobuffer->state;
-        *outlen = buf->len;
-        *decbuf = buf_release(buf);
-    }
-
-    convert_free(input);
+    *outlen = buf.len;
+    *decbuf = buf_release(&buf);
 
     if (!*decbuf) {
         /* didn't get a result - maybe blank input, don't return NULL */
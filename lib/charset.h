@@ -112,6 +112,13 @@ extern int charset_searchfile(const char *substr, comp_pat *pat,
 extern const char *charset_decode_mimebody(const char *msg_base, size_t len,
                                            int encoding, char **retval,
                                            size_t *outlen);
+/* decode a MIME body in bounded memory, passing the decoded data to
+ * proc a piece at a time.  Returns 0, or -1 if the encoding is unknown */
+typedef void charset_chunkproc_t(const char *s, size_t len, void *rock);
+extern int charset_decode_mimebody_chunks(const char *msg_base, size_t len,
+                                          int encoding,
+                                          charset_chunkproc_t *proc,
+                                          void *rock, size_t *outlen);
 extern char *charset_encode_mimebody(const char *msg_base, size_t len,
                                      char *retval, size_t *outlen,
                                      int *outlines, int wrap);
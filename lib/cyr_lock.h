@@ -52,11 +52,24 @@
 #endif
 
 #include <sys/stat.h>
+#include <sys/time.h>
 
 extern const char *lock_method_desc;
 
 extern double debug_locks_longer_than;
 
+/* called as each timed lock is released, with the seconds spent
+ * waiting for it and holding it.  'filename' may be NULL */
+typedef void lock_stats_cb_t(const char *filename, int exclusive,
+                             double waited, double held);
+extern void lock_set_stats_cb(lock_stats_cb_t *cb);
+
+/* for the lock backends */
+extern void lock_stats_begin(struct timeval *start);
+extern void lock_stats_locked(int fd, const char *filename, int exclusive,
+                              const struct timeval *start);
+extern void lock_stats_unlocked(int fd, const char *filename);
+
 extern int lock_reopen_ex(int fd, const char *filename,
                           struct stat *sbuf, const char **failaction,
                           int *changed);
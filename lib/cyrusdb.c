@@ -67,6 +67,7 @@ extern struct cyrusdb_backend cyrusdb_flat;
 extern struct cyrusdb_backend cyrusdb_skiplist;
 extern struct cyrusdb_backend cyrusdb_quotalegacy;
 extern struct cyrusdb_backend cyrusdb_sql;
+extern struct cyrusdb_backend cyrusdb_sstable;
 extern struct cyrusdb_backend cyrusdb_twoskip;
 extern struct cyrusdb_backend cyrusdb_zeroskip;
 
@@ -77,6 +78,7 @@ static struct cyrusdb_backend *_backends[] = {
 #if defined USE_CYRUSDB_SQL
     &cyrusdb_sql,
 #endif
+    &cyrusdb_sstable,
     &cyrusdb_twoskip,
 #if defined HAVE_ZEROSKIP
     &cyrusdb_zeroskip,
@@ -90,6 +92,15 @@ struct db {
     struct cyrusdb_backend *backend;
 };
 
+struct cyrusdb_snapshot {
+    struct db *db;
+};
+
+struct cyrusdb_cursor {
+    struct cyrusdb_snapshot *snap;
+    struct dbengine_cursor *engine;
+};
+
 static struct cyrusdb_backend *cyrusdb_fromname(const char *name)
 {
     int i;
@@ -330,6 +341,82 @@ EXPORTED int cyrusdb_compar(struct db *db,
     return db->backend->compar(db->engine, a, alen, b, blen);
 }
 
+EXPORTED int cyrusdb_snapshot_open(struct db *db,
+                                   struct cyrusdb_snapshot **snapp)
+{
+    int r;
+
+    *snapp = NULL;
+
+    if (!db->backend->snapshot_begin)
+        return CYRUSDB_NOTIMPLEMENTED;
+
+    r = db->backend->snapshot_begin(db->engine);
+    if (r) return r;
+
+    *snapp = xzmalloc(sizeof(struct cyrusdb_snapshot));
+    (*snapp)->db = db;
+
+    return 0;
+}
+
+EXPORTED int cyrusdb_snapshot_close(struct cyrusdb_snapshot **snapp)
+{
+    struct cyrusdb_snapshot *snap = *snapp;
+    int r;
+
+    if (!snap) return 0;
+
+    r = snap->db->backend->snapshot_end(snap->db->engine);
+
+    free(snap);
+    *snapp = NULL;
+
+    return r;
+}
+
+EXPORTED int cyrusdb_cursor_open(struct cyrusdb_snapshot *snap,
+                                 struct cyrusdb_cursor **curp)
+{
+    struct cyrusdb_cursor *cur = xzmalloc(sizeof(struct cyrusdb_cursor));
+
+    cur->snap = snap;
+    cur->engine = snap->db->backend->cursor_new(snap->db->engine);
+    *curp = cur;
+
+    return 0;
+}
+
+EXPORTED void cyrusdb_cursor_close(struct cyrusdb_cursor **curp)
+{
+    struct cyrusdb_cursor *cur = *curp;
+
+    if (!cur) return;
+
+    cur->snap->db->backend->cursor_free(cur->engine);
+
+    free(cur);
+    *curp = NULL;
+}
+
+EXPORTED int cyrusdb_cursor_fetch(struct cyrusdb_cursor *cur,
+                                  const char *key, size_t keylen,
+                                  const char **data, size_t *datalen)
+{
+    return cur->snap->db->backend->cursor_fetch(cur->engine, key, keylen,
+                                                data, datalen);
+}
+
+EXPORTED int cyrusdb_cursor_foreach(struct cyrusdb_cursor *cur,
+                                    const char *prefix, size_t prefixlen,
+                                    foreach_p *p,
+                                    foreach_cb *cb, void *rock)
+{
+    return cur->snap->db->backend->cursor_foreach(cur->engine,
+                                                  prefix, prefixlen,
+                                                  p, cb, rock);
+}
+
 /**********************************************/
 
 EXPORTED void cyrusdb_init(void)
@@ -553,6 +640,9 @@ EXPORTED const char *cyrusdb_detect(const char *fname)
     if (!strncmp(buf, "\241\002\213\015twoskip file\0\0\0\0", 16))
         return "twoskip";
 
+    if (!strncmp(buf, "\241\002\213\015sstable file", 16))
+        return "sstable";
+
     /* unable to detect SQLite databases or flat files explicitly here */
     return NULL;
 }
@@ -576,6 +666,13 @@ EXPORTED cyrusdb_archiver *cyrusdb_getarchiver(const char *backend)
     return db->archive; /* the function used for archiving */
 }
 
+EXPORTED int cyrusdb_needs_recovery(const char *backend, const char *fname)
+{
+    struct cyrusdb_backend *db = cyrusdb_fromname(backend);
+    if (!db->needs_recovery) return 0;
+    return db->needs_recovery(fname);
+}
+
 EXPORTED int cyrusdb_canfetchnext(const char *backend)
 {
     struct cyrusdb_backend *db = cyrusdb_fromname(backend);
@@ -75,7 +75,8 @@ enum cyrusdb_openflags {
     CYRUSDB_CREATE    = 0x01,    /* Create the database if not existant */
     CYRUSDB_MBOXSORT  = 0x02,    /* Use mailbox sort order ('.' sorts 1st) */
     CYRUSDB_CONVERT   = 0x04,    /* Convert to the named format if not already */
-    CYRUSDB_NOCOMPACT = 0x08     /* Don't run any database compaction routines */
+    CYRUSDB_NOCOMPACT = 0x08,    /* Don't run any database compaction routines */
+    CYRUSDB_SPARSEINDEX = 0x10   /* Keep an in-memory index to speed lookups */
 };
 
 typedef int foreach_p(void *rock,
@@ -90,6 +91,7 @@ typedef int cyrusdb_archiver(const strarray_t *fnames,
                              const char *dirname);
 
 struct dbengine;
+struct dbengine_cursor;
 
 struct cyrusdb_backend {
     const char *name;
@@ -221,6 +223,28 @@ struct cyrusdb_backend {
     int (*repack)(struct dbengine *db);
     int (*compar)(struct dbengine *db, const char *s1, int l1,
                   const char *s2, int l2);
+
+    /* read snapshots, optional: see cyrusdb_snapshot_open() below.
+     * snapshot_begin() and snapshot_end() nest.  While any snapshot is
+     * open the view of the database must not change, and the cursor
+     * functions must be safe to call from several threads at once, each
+     * on its own cursor */
+    int (*snapshot_begin)(struct dbengine *db);
+    int (*snapshot_end)(struct dbengine *db);
+    struct dbengine_cursor *(*cursor_new)(struct dbengine *db);
+    void (*cursor_free)(struct dbengine_cursor *cur);
+    int (*cursor_fetch)(struct dbengine_cursor *cur,
+                        const char *key, size_t keylen,
+                        const char **data, size_t *datalen);
+    int (*cursor_foreach)(struct dbengine_cursor *cur,
+                          const char *prefix, size_t prefixlen,
+                          foreach_p *p,
+                          foreach_cb *cb, void *rock);
+
+    /* optional: a quick look at the file, without opening or locking
+     * it.  Returns 1 if opening it would have to run recovery first,
+     * 0 if not */
+    int (*needs_recovery)(const char *fname);
 };
 
 extern int cyrusdb_copyfile(const char *srcname, const char *dstname);
@@ -296,6 +320,38 @@ extern int cyrusdb_compar(struct db *db,
                           const char *a, int alen,
                           const char *b, int blen);
 
+/* Read snapshots for multi-threaded readers.
+ *
+ * cyrusdb_snapshot_open() fixes a read-only view of 'db' (for twoskip:
+ * a shared lock plus the current mapping) which stays valid until
+ * cyrusdb_snapshot_close().  Each cursor opened on a snapshot carries
+ * its own search position, so any number of threads may fetch and
+ * iterate concurrently, each through its own cursor, without further
+ * locking.  Data returned through a cursor stays valid until the
+ * snapshot is closed.
+ *
+ * Opening and closing snapshots, and any other use of 'db', must still
+ * be serialised by the caller.  Writes to 'db' fail with CYRUSDB_LOCKED
+ * while a snapshot is open, and other processes' writers wait for it,
+ * so keep snapshots short-lived.  Backends without support return
+ * CYRUSDB_NOTIMPLEMENTED from cyrusdb_snapshot_open(). */
+struct cyrusdb_snapshot;
+struct cyrusdb_cursor;
+
+extern int cyrusdb_snapshot_open(struct db *db,
+                                 struct cyrusdb_snapshot **snapp);
+extern int cyrusdb_snapshot_close(struct cyrusdb_snapshot **snapp);
+extern int cyrusdb_cursor_open(struct cyrusdb_snapshot *snap,
+                               struct cyrusdb_cursor **curp);
+extern void cyrusdb_cursor_close(struct cyrusdb_cursor **curp);
+extern int cyrusdb_cursor_fetch(struct cyrusdb_cursor *cur,
+                                const char *key, size_t keylen,
+                                const char **data, size_t *datalen);
+extern int cyrusdb_cursor_foreach(struct cyrusdb_cursor *cur,
+                                  const char *prefix, size_t prefixlen,
+                                  foreach_p *p,
+                                  foreach_cb *cb, void *rock);
+
 /* somewhat special case, because they don't take a DB */
 
 extern int cyrusdb_sync(const char *backend);
@@ -303,6 +359,10 @@ extern cyrusdb_archiver *cyrusdb_getarchiver(const char *backend);
 
 extern int cyrusdb_canfetchnext(const char *backend);
 
+/* does the 'backend' file 'fname' need recovery?  Backends which can't
+ * tell say no.  Opening the database does the recovery */
+extern int cyrusdb_needs_recovery(const char *backend, const char *fname);
+
 extern strarray_t *cyrusdb_backends(void);
 
 /* generic implementations */
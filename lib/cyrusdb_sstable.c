@@ -0,0 +1,2194 @@
+/* cyrusdb_sstable.c - sorted, block compressed runs for read-mostly databases
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "assert.h"
+#include "bloom.h"
+#include "bsearch.h"
+#include "byteorder64.h"
+#include "cyrusdb.h"
+#include "crc32.h"
+#include "mappedfile.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/*
+ * sstable disk format.
+ *
+ * GOALS:
+ *  a) small files and a small page cache footprint for databases
+ *     with long, repetitive keys (mailboxes.db, conversations)
+ *  b) fast prefix scans
+ *  c) the same crash safety as twoskip
+ *
+ * ACHIEVED BY:
+ *  a)
+ *   - records are kept in sorted "runs".  Within a run, keys are
+ *     prefix compressed against the previous key, and records are
+ *     grouped into blocks of about BLOCKSIZE bytes which are
+ *     compressed with zlib if that makes them smaller.
+ *  b)
+ *   - each run has a sparse index holding the first key of every
+ *     block, so a lookup or a seek for a prefix binary searches the
+ *     index and then only decompresses the blocks it needs.
+ *   - each run has a bloom filter over its keys, so a fetch only
+ *     looks inside the runs which may hold the key.
+ *  c)
+ *   - runs are written after the current end of the file and
+ *     fsynced before the header is rewritten to point at them, so
+ *     the header always describes a complete set of runs.
+ *   - every block and every index carries a crc32.
+ *
+ * WRITES:
+ *   A transaction is held in memory until commit, when it is written
+ *   out as a new run (deletes become "tombstone" records).  Runs are
+ *   linked newest to oldest, and a newer record hides older records
+ *   with the same key.  After a commit, the newest runs are merged
+ *   into one while the run being absorbed is no more than MERGE_RATIO
+ *   times the size of what's accumulated so far, which keeps the
+ *   number of runs logarithmic in the number of records.  Tombstones
+ *   are dropped when the oldest run takes part in a merge.  Once the
+ *   file is more than twice the size of the live runs, it is rewritten
+ *   as a single run, just like a twoskip checkpoint.
+ *
+ * FORMAT:
+ *
+ * HEADER: 64 bytes
+ *  magic: 16 bytes: "4 bytes same as skiplist" "sstable file"
+ *  version: 4 bytes
+ *  num_runs: 4 bytes
+ *  generation: 8 bytes
+ *  newest_run: 8 bytes (offset of the newest run's footer, or 0)
+ *  current_size: 8 bytes
+ *  live_size: 8 bytes (total size of the runs in the chain)
+ *  flags: 4 bytes
+ *  crc32: 4 bytes
+ *
+ * RUN:
+ *  blocks, then the index, the bloom filter and the footer
+ *
+ * BLOCK:
+ *  stored_len: 4 bytes
+ *  raw_len: 4 bytes
+ *  crc32: 4 bytes (of the stored bytes)
+ *  method: 4 bytes (0 = none, 1 = zlib)
+ *  data: stored_len bytes, which decompress to raw_len bytes of
+ *   records: varint shared, varint unshared, varint vallen+1
+ *            (0 for a tombstone), key suffix, value
+ *   the first record in a block shares nothing.
+ *
+ * INDEX: per block
+ *  offset: 8 bytes
+ *  keylen: 4 bytes
+ *  key: keylen bytes (the first key in the block)
+ *
+ * BLOOM: the bloom filter bits, built with BLOOM_ERROR
+ *
+ * FOOTER: 64 bytes
+ *  magic: 4 bytes "SSTR"
+ *  nblocks: 4 bytes
+ *  start: 8 bytes (offset of the first block)
+ *  index: 8 bytes (offset of the index)
+ *  bloom: 8 bytes (offset of the bloom filter)
+ *  bloom_entries: 4 bytes
+ *  bloom_bytes: 4 bytes
+ *  nrecords: 8 bytes
+ *  prev: 8 bytes (offset of the next older run's footer, or 0)
+ *  index_crc32: 4 bytes (of the index and the bloom filter)
+ *  crc32: 4 bytes (of the footer up to here)
+ */
+
+#define HEADER_MAGIC ("\241\002\213\015sstable file")
+#define HEADER_MAGIC_SIZE (16)
+#define HEADER_SIZE 64
+#undef VERSION /* defined in config.h */
+#define VERSION 1
+
+enum {
+    OFFSET_HEADER = 0,
+    OFFSET_VERSION = 16,
+    OFFSET_NUM_RUNS = 20,
+    OFFSET_GENERATION = 24,
+    OFFSET_NEWEST_RUN = 32,
+    OFFSET_CURRENT_SIZE = 40,
+    OFFSET_LIVE_SIZE = 48,
+    OFFSET_FLAGS = 56,
+    OFFSET_CRC32 = 60
+};
+
+#define RUN_MAGIC 0x53535452 /* "SSTR" */
+#define FOOTER_SIZE 64
+#define BLOCKHEAD_SIZE 16
+
+enum {
+    METHOD_NONE = 0,
+    METHOD_ZLIB = 1
+};
+
+/* aim for blocks of this many bytes before compression */
+#define BLOCKSIZE 4096
+
+/* merge a run into the newer ones while it's no bigger than this
+ * many times their total size */
+#define MERGE_RATIO 2
+
+/* merge everything once there are this many runs, whatever the sizes */
+#define MAXRUNS 16
+
+/* don't rewrite files smaller than this */
+#define MINREWRITE 16834
+
+#define BLOOM_ERROR 0.01
+
+/* release the read lock every this many records in a foreach
+ * that's not matching anything */
+#define FOREACH_LOCK_RELEASE 256
+
+struct txn {
+    int num;
+};
+
+struct db_header {
+    uint32_t version;
+    uint32_t num_runs;
+    uint64_t generation;
+    uint64_t newest_run;
+    uint64_t current_size;
+    uint64_t live_size;
+    uint32_t flags;
+};
+
+/* a run as loaded from the file: all offsets, so they survive the
+ * file being remapped */
+struct run {
+    size_t start;
+    size_t index;
+    size_t footer;
+    size_t prev;
+    uint64_t nrecords;
+    uint32_t nblocks;
+    size_t *blockoff;
+    size_t *firstkey;
+    uint32_t *firstkeylen;
+    struct bloom bloom;
+};
+
+#define RUN_SIZE(run) ((run)->footer + FOOTER_SIZE - (run)->start)
+
+/* a pending write in the current transaction */
+struct mement {
+    char *key;
+    size_t keylen;
+    char *val;
+    size_t vallen;
+    int tomb;
+};
+
+struct memtable {
+    struct mement **ents;
+    int count;
+    int alloc;
+    unsigned modcount;
+};
+
+struct dbengine {
+    /* file data */
+    struct mappedfile *mf;
+
+    struct db_header header;
+
+    /* loaded runs, newest first, and what they were loaded from */
+    struct run *runs;
+    int nruns;
+    unsigned runs_version;
+    uint64_t runs_generation;
+    uint64_t runs_newest;
+
+    /* tracking info */
+    int is_open;
+    int txn_num;
+    struct txn *current_txn;
+    struct memtable mem;
+
+    /* comparator function to use for sorting */
+    int open_flags;
+    int (*compar) (const char *s1, int l1, const char *s2, int l2);
+
+    /* the last block decompressed by a fetch */
+    struct buf block;
+    unsigned block_version;
+    size_t block_offset;
+
+    /* fetchnext results */
+    struct buf keybuf;
+    struct buf valbuf;
+};
+
+struct db_list {
+    struct dbengine *db;
+    struct db_list *next;
+    int refcount;
+};
+
+static struct db_list *open_sstable = NULL;
+
+static int mycommit(struct dbengine *db, struct txn *tid);
+static int myabort(struct dbengine *db, struct txn *tid);
+static int mycheckpoint(struct dbengine *db);
+
+/************** HELPER FUNCTIONS ****************/
+
+#define BASE(db) mappedfile_base((db)->mf)
+#define SIZE(db) mappedfile_size((db)->mf)
+#define FNAME(db) mappedfile_fname((db)->mf)
+
+static uint32_t get32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+static uint64_t get64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return ntohll(v);
+}
+
+static void put32(char *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static void put64(char *p, uint64_t v)
+{
+    v = htonll(v);
+    memcpy(p, &v, 8);
+}
+
+static void buf_appendvarint(struct buf *buf, uint64_t v)
+{
+    while (v >= 0x80) {
+        buf_putc(buf, (char)((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    buf_putc(buf, (char)v);
+}
+
+/* returns the number of bytes used, or 0 if it runs off the end */
+static size_t getvarint(const char *p, size_t len, uint64_t *vp)
+{
+    uint64_t v = 0;
+    size_t i;
+
+    for (i = 0; i < len && i < 10; i++) {
+        v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *vp = v;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+static int range_ok(struct dbengine *db, size_t offset, size_t len)
+{
+    return offset <= db->header.current_size
+        && len <= db->header.current_size - offset
+        && offset + len <= SIZE(db);
+}
+
+/************** HEADER ****************/
+
+static int read_header(struct dbengine *db)
+{
+    const char *base;
+
+    if (SIZE(db) < HEADER_SIZE) {
+        syslog(LOG_ERR, "DBERROR: sstable %s: file not large enough for header",
+               FNAME(db));
+        return CYRUSDB_IOERROR;
+    }
+
+    base = BASE(db);
+
+    if (memcmp(base, HEADER_MAGIC, HEADER_MAGIC_SIZE)) {
+        syslog(LOG_ERR, "DBERROR: sstable %s: invalid magic header",
+               FNAME(db));
+        return CYRUSDB_IOERROR;
+    }
+
+    if (crc32_map(base, OFFSET_CRC32) != get32(base + OFFSET_CRC32)) {
+        syslog(LOG_ERR, "DBERROR: sstable %s: invalid header crc",
+               FNAME(db));
+        return CYRUSDB_IOERROR;
+    }
+
+    db->header.version = get32(base + OFFSET_VERSION);
+    if (db->header.version > VERSION) {
+        syslog(LOG_ERR, "DBERROR: sstable %s: version mismatch: %u",
+               FNAME(db), db->header.version);
+        return CYRUSDB_IOERROR;
+    }
+
+    db->header.num_runs = get32(base + OFFSET_NUM_RUNS);
+    db->header.generation = get64(base + OFFSET_GENERATION);
+    db->header.newest_run = get64(base + OFFSET_NEWEST_RUN);
+    db->header.current_size = get64(base + OFFSET_CURRENT_SIZE);
+    db->header.live_size = get64(base + OFFSET_LIVE_SIZE);
+    db->header.flags = get32(base + OFFSET_FLAGS);
+
+    if (db->header.current_size > SIZE(db)) {
+        syslog(LOG_ERR, "DBERROR: sstable %s: file is shorter than the header says",
+               FNAME(db));
+        return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+static int write_header(struct mappedfile *mf, const struct db_header *header)
+{
+    char buf[HEADER_SIZE];
+
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+    put32(buf + OFFSET_VERSION, header->version);
+    put32(buf + OFFSET_NUM_RUNS, header->num_runs);
+    put64(buf + OFFSET_GENERATION, header->generation);
+    put64(buf + OFFSET_NEWEST_RUN, header->newest_run);
+    put64(buf + OFFSET_CURRENT_SIZE, header->current_size);
+    put64(buf + OFFSET_LIVE_SIZE, header->live_size);
+    put32(buf + OFFSET_FLAGS, header->flags);
+    put32(buf + OFFSET_CRC32, crc32_map(buf, OFFSET_CRC32));
+
+    if (mappedfile_pwrite(mf, buf, HEADER_SIZE, 0) < 0)
+        return CYRUSDB_IOERROR;
+
+    return 0;
+}
+
+/* the runs must be on disk before the header points at them */
+static int commit_header(struct mappedfile *mf, const struct db_header *header)
+{
+    int r = mappedfile_commit(mf);
+    if (!r) r = write_header(mf, header);
+    if (!r) r = mappedfile_commit(mf);
+    return r ? CYRUSDB_IOERROR : 0;
+}
+
+/************** RUNS ****************/
+
+static void free_run(struct run *run)
+{
+    free(run->blockoff);
+    free(run->firstkey);
+    free(run->firstkeylen);
+    bloom_free(&run->bloom);
+    memset(run, 0, sizeof(struct run));
+}
+
+static void free_runs(struct dbengine *db)
+{
+    int i;
+
+    for (i = 0; i < db->nruns; i++)
+        free_run(&db->runs[i]);
+
+    free(db->runs);
+    db->runs = NULL;
+    db->nruns = 0;
+}
+
+static int load_run(struct dbengine *db, size_t footer, struct run *run)
+{
+    const char *base = BASE(db);
+    const char *p;
+    size_t bloomoff, pos;
+    uint32_t bloom_entries, bloom_bytes;
+    uint32_t i;
+
+    memset(run, 0, sizeof(struct run));
+
+    if (footer < HEADER_SIZE || !range_ok(db, footer, FOOTER_SIZE))
+        goto bad;
+
+    p = base + footer;
+    if (get32(p) != RUN_MAGIC) goto bad;
+    if (crc32_map(p, FOOTER_SIZE - 4) != get32(p + FOOTER_SIZE - 4))
+        goto bad;
+
+    run->footer = footer;
+    run->nblocks = get32(p + 4);
+    run->start = get64(p + 8);
+    run->index = get64(p + 16);
+    bloomoff = get64(p + 24);
+    bloom_entries = get32(p + 32);
+    bloom_bytes = get32(p + 36);
+    run->nrecords = get64(p + 40);
+    run->prev = get64(p + 48);
+
+    if (run->start < HEADER_SIZE || run->start > run->index
+        || run->index > bloomoff || bloomoff + bloom_bytes != footer)
+        goto bad;
+
+    if (crc32_map(base + run->index, footer - run->index)
+        != get32(p + FOOTER_SIZE - 8))
+        goto bad;
+
+    /* the sparse index */
+    run->blockoff = xmalloc(sizeof(size_t) * (run->nblocks + 1));
+    run->firstkey = xmalloc(sizeof(size_t) * (run->nblocks + 1));
+    run->firstkeylen = xmalloc(sizeof(uint32_t) * (run->nblocks + 1));
+    pos = run->index;
+    for (i = 0; i < run->nblocks; i++) {
+        if (pos + 12 > bloomoff) goto bad;
+        run->blockoff[i] = get64(base + pos);
+        run->firstkeylen[i] = get32(base + pos + 8);
+        run->firstkey[i] = pos + 12;
+        pos += 12 + run->firstkeylen[i];
+        if (pos > bloomoff) goto bad;
+        if (run->blockoff[i] < run->start || run->blockoff[i] >= run->index)
+            goto bad;
+    }
+    /* the end of the last block */
+    run->blockoff[run->nblocks] = run->index;
+
+    /* and the bloom filter */
+    if (bloom_entries) {
+        if (bloom_init(&run->bloom, bloom_entries, BLOOM_ERROR)
+            || (uint32_t)run->bloom.bytes != bloom_bytes)
+            goto bad;
+        memcpy(run->bloom.bf, base + bloomoff, bloom_bytes);
+    }
+
+    return 0;
+
+ bad:
+    syslog(LOG_ERR, "DBERROR: sstable %s: invalid run at %08llX",
+           FNAME(db), (unsigned long long)footer);
+    free_run(run);
+    return CYRUSDB_IOERROR;
+}
+
+/* make sure the loaded runs match the header */
+static int refresh_runs(struct dbengine *db)
+{
+    struct run *oldruns = NULL;
+    int oldn = 0;
+    size_t footer;
+    int i, r = 0;
+
+    if (db->runs_version
+        && db->runs_generation == db->header.generation
+        && db->runs_newest == db->header.newest_run)
+        return 0;
+
+    /* runs never change once written, so within a generation any we
+     * already have loaded can be kept */
+    if (db->runs_version && db->runs_generation == db->header.generation) {
+        oldruns = db->runs;
+        oldn = db->nruns;
+        db->runs = NULL;
+        db->nruns = 0;
+    }
+    else {
+        free_runs(db);
+    }
+    db->runs_version++;
+    db->runs_generation = db->header.generation;
+    db->runs_newest = db->header.newest_run;
+
+    if (db->header.num_runs)
+        db->runs = xzmalloc(sizeof(struct run) * db->header.num_runs);
+
+    for (footer = db->header.newest_run; footer; ) {
+        if ((uint32_t)db->nruns >= db->header.num_runs) {
+            syslog(LOG_ERR, "DBERROR: sstable %s: more runs than the header says",
+                   FNAME(db));
+            r = CYRUSDB_IOERROR;
+            break;
+        }
+        for (i = 0; i < oldn; i++) {
+            if (oldruns[i].footer == footer) break;
+        }
+        if (i < oldn) {
+            db->runs[db->nruns] = oldruns[i];
+            memset(&oldruns[i], 0, sizeof(struct run));
+        }
+        else {
+            r = load_run(db, footer, &db->runs[db->nruns]);
+            if (r) break;
+        }
+        footer = db->runs[db->nruns].prev;
+        db->nruns++;
+    }
+
+    if (!r && (uint32_t)db->nruns != db->header.num_runs) {
+        syslog(LOG_ERR, "DBERROR: sstable %s: fewer runs than the header says",
+               FNAME(db));
+        r = CYRUSDB_IOERROR;
+    }
+
+    for (i = 0; i < oldn; i++)
+        free_run(&oldruns[i]);
+    free(oldruns);
+
+    if (r) {
+        free_runs(db);
+        /* make sure we try again next time */
+        db->runs_version++;
+        db->runs_generation = 0;
+    }
+
+    return r;
+}
+
+/* read (and decompress) block 'blockno' of 'run' into 'out' */
+static int read_block(struct dbengine *db, struct run *run, uint32_t blockno,
+                      struct buf *out)
+{
+    size_t offset = run->blockoff[blockno];
+    size_t end = run->blockoff[blockno + 1];
+    const char *p;
+    uint32_t stored_len, raw_len, method;
+
+    buf_reset(out);
+
+    if (end < offset + BLOCKHEAD_SIZE || !range_ok(db, offset, end - offset))
+        goto bad;
+
+    p = BASE(db) + offset;
+    stored_len = get32(p);
+    raw_len = get32(p + 4);
+    method = get32(p + 12);
+
+    if (offset + BLOCKHEAD_SIZE + stored_len != end) goto bad;
+    if (crc32_map(p + BLOCKHEAD_SIZE, stored_len) != get32(p + 8)) goto bad;
+
+    switch (method) {
+    case METHOD_NONE:
+        if (stored_len != raw_len) goto bad;
+        buf_appendmap(out, p + BLOCKHEAD_SIZE, stored_len);
+        break;
+
+#ifdef HAVE_ZLIB
+    case METHOD_ZLIB: {
+        uLongf destlen = raw_len;
+        buf_ensure(out, raw_len);
+        if (uncompress((Bytef *)out->s, &destlen,
+                       (const Bytef *)p + BLOCKHEAD_SIZE, stored_len) != Z_OK
+            || destlen != raw_len)
+            goto bad;
+        buf_truncate(out, raw_len);
+        break;
+    }
+#endif
+
+    default:
+        syslog(LOG_ERR, "DBERROR: sstable %s: unsupported block compression %u",
+               FNAME(db), method);
+        return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+
+ bad:
+    syslog(LOG_ERR, "DBERROR: sstable %s: invalid block at %08llX",
+           FNAME(db), (unsigned long long)offset);
+    return CYRUSDB_IOERROR;
+}
+
+/* the last block of 'run' whose first key is <= key, or 0 */
+static uint32_t find_block(struct dbengine *db, struct run *run,
+                           const char *key, size_t keylen)
+{
+    const char *base = BASE(db);
+    uint32_t lo = 0, hi = run->nblocks;
+
+    /* invariant: block lo starts <= key (or lo == 0), block hi starts > key */
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (db->compar(base + run->firstkey[mid], run->firstkeylen[mid],
+                       key, keylen) <= 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* parse the record at *posp in a decompressed block, building the
+ * key in 'key' from the previous one */
+static int parse_record(const struct buf *block, size_t *posp, struct buf *key,
+                        const char **val, size_t *vallen, int *tomb)
+{
+    size_t pos = *posp;
+    uint64_t shared, unshared, vl;
+    size_t n;
+
+    n = getvarint(block->s + pos, block->len - pos, &shared);
+    if (!n) return CYRUSDB_IOERROR;
+    pos += n;
+    n = getvarint(block->s + pos, block->len - pos, &unshared);
+    if (!n) return CYRUSDB_IOERROR;
+    pos += n;
+    n = getvarint(block->s + pos, block->len - pos, &vl);
+    if (!n) return CYRUSDB_IOERROR;
+    pos += n;
+
+    if (shared > key->len) return CYRUSDB_IOERROR;
+    if (unshared > block->len - pos) return CYRUSDB_IOERROR;
+    buf_truncate(key, shared);
+    buf_appendmap(key, block->s + pos, unshared);
+    pos += unshared;
+
+    *tomb = (vl == 0);
+    *vallen = vl ? vl - 1 : 0;
+    if (*vallen > block->len - pos) return CYRUSDB_IOERROR;
+    *val = block->s + pos;
+    pos += *vallen;
+
+    *posp = pos;
+    return 0;
+}
+
+/************** MEMTABLE ****************/
+
+/* index of the first entry >= key (or > key if 'after') */
+static int mem_find(struct dbengine *db, const char *key, size_t keylen,
+                    int after)
+{
+    int lo = 0, hi = db->mem.count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct mement *e = db->mem.ents[mid];
+        int cmp = db->compar(e->key, e->keylen, key, keylen);
+        if (cmp < 0 || (after && cmp == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static struct mement *mem_lookup(struct dbengine *db,
+                                 const char *key, size_t keylen)
+{
+    int i = mem_find(db, key, keylen, 0);
+
+    if (i < db->mem.count) {
+        struct mement *e = db->mem.ents[i];
+        if (!db->compar(e->key, e->keylen, key, keylen))
+            return e;
+    }
+
+    return NULL;
+}
+
+static void mem_put(struct dbengine *db, const char *key, size_t keylen,
+                    const char *val, size_t vallen, int tomb)
+{
+    int i = mem_find(db, key, keylen, 0);
+    struct mement *e;
+
+    if (i < db->mem.count &&
+        !db->compar(db->mem.ents[i]->key, db->mem.ents[i]->keylen,
+                    key, keylen)) {
+        free(db->mem.ents[i]);
+    }
+    else {
+        if (db->mem.count == db->mem.alloc) {
+            db->mem.alloc = db->mem.alloc ? db->mem.alloc * 2 : 64;
+            db->mem.ents = xrealloc(db->mem.ents,
+                                    sizeof(struct mement *) * db->mem.alloc);
+        }
+        memmove(db->mem.ents + i + 1, db->mem.ents + i,
+                sizeof(struct mement *) * (db->mem.count - i));
+        db->mem.count++;
+    }
+
+    /* key and value live in the same allocation as the entry */
+    e = xmalloc(sizeof(struct mement) + keylen + vallen);
+    e->key = (char *)(e + 1);
+    e->keylen = keylen;
+    memcpy(e->key, key, keylen);
+    e->val = e->key + keylen;
+    e->vallen = vallen;
+    if (vallen) memcpy(e->val, val, vallen);
+    e->tomb = tomb;
+
+    db->mem.ents[i] = e;
+    db->mem.modcount++;
+}
+
+static void mem_clear(struct dbengine *db)
+{
+    int i;
+
+    for (i = 0; i < db->mem.count; i++)
+        free(db->mem.ents[i]);
+    db->mem.count = 0;
+    db->mem.modcount++;
+}
+
+/************** ITERATORS ****************/
+
+/* one sorted input to a merge: the memtable or a run */
+struct source {
+    struct run *run;            /* NULL for the memtable */
+    uint32_t blockno;
+    struct buf block;
+    size_t pos;
+
+    int memidx;
+    unsigned modcount;
+
+    int valid;
+    int need_advance;
+    struct buf key;
+    const char *val;
+    size_t vallen;
+    int tomb;
+};
+
+struct merge {
+    struct dbengine *db;
+    int nsrc;
+    struct source *src;
+    unsigned version;
+    int keep_tombs;
+
+    struct buf lastkey;
+    int started;
+
+    /* the current record */
+    const char *val;
+    size_t vallen;
+    int tomb;
+};
+
+static void src_setmem(struct dbengine *db, struct source *s)
+{
+    s->modcount = db->mem.modcount;
+    if (s->memidx < db->mem.count) {
+        struct mement *e = db->mem.ents[s->memidx];
+        buf_setmap(&s->key, e->key, e->keylen);
+        s->val = e->val;
+        s->vallen = e->vallen;
+        s->tomb = e->tomb;
+        s->valid = 1;
+    }
+    else {
+        s->valid = 0;
+    }
+}
+
+static int src_next(struct dbengine *db, struct source *s)
+{
+    int r;
+
+    if (!s->run) {
+        s->memidx++;
+        src_setmem(db, s);
+        return 0;
+    }
+
+    while (s->pos >= s->block.len) {
+        if (++s->blockno >= s->run->nblocks) {
+            s->valid = 0;
+            return 0;
+        }
+        r = read_block(db, s->run, s->blockno, &s->block);
+        if (r) return r;
+        s->pos = 0;
+        buf_reset(&s->key);
+    }
+
+    r = parse_record(&s->block, &s->pos, &s->key, &s->val, &s->vallen, &s->tomb);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: sstable %s: bad record in block at %08llX",
+               FNAME(db), (unsigned long long)s->run->blockoff[s->blockno]);
+        return CYRUSDB_IOERROR;
+    }
+
+    s->valid = 1;
+    return 0;
+}
+
+/* position on the first record >= key (> key if 'after') */
+static int src_seek(struct dbengine *db, struct source *s,
+                    const char *key, size_t keylen, int after)
+{
+    int r;
+
+    s->need_advance = 0;
+
+    if (!s->run) {
+        s->memidx = mem_find(db, key, keylen, after);
+        src_setmem(db, s);
+        return 0;
+    }
+
+    s->valid = 0;
+    if (!s->run->nblocks) return 0;
+
+    s->blockno = keylen ? find_block(db, s->run, key, keylen) : 0;
+    r = read_block(db, s->run, s->blockno, &s->block);
+    if (r) return r;
+    s->pos = 0;
+    buf_reset(&s->key);
+
+    for (;;) {
+        int cmp;
+
+        r = src_next(db, s);
+        if (r || !s->valid) return r;
+        if (!keylen && !after) return 0;
+
+        cmp = db->compar(s->key.s, s->key.len, key, keylen);
+        if (cmp > 0 || (cmp == 0 && !after)) return 0;
+    }
+}
+
+static void merge_free(struct merge *m)
+{
+    int i;
+
+    for (i = 0; i < m->nsrc; i++) {
+        buf_free(&m->src[i].block);
+        buf_free(&m->src[i].key);
+    }
+    free(m->src);
+    m->src = NULL;
+    m->nsrc = 0;
+}
+
+/* merge the memtable (if 'usemem') and runs [first, last) */
+static void merge_init(struct merge *m, struct dbengine *db, int usemem,
+                       int first, int last, int keep_tombs)
+{
+    int i;
+
+    m->db = db;
+    m->version = db->runs_version;
+    m->keep_tombs = keep_tombs;
+    m->nsrc = 0;
+    m->src = xzmalloc(sizeof(struct source) * (last - first + 1));
+
+    if (usemem) m->nsrc++;
+    for (i = first; i < last; i++)
+        m->src[m->nsrc++].run = &db->runs[i];
+}
+
+static int merge_seek(struct merge *m, const char *key, size_t keylen,
+                      int after)
+{
+    int i, r;
+
+    for (i = 0; i < m->nsrc; i++) {
+        r = src_seek(m->db, &m->src[i], key, keylen, after);
+        if (r) return r;
+    }
+
+    /* remember where we are, for re-seeking */
+    buf_setmap(&m->lastkey, key, keylen);
+    m->started = after;
+
+    return 0;
+}
+
+/* the next visible record: returns 1 with the key in m->lastkey,
+ * 0 at the end, or an error */
+static int merge_next(struct merge *m)
+{
+    struct dbengine *db = m->db;
+    int i, r;
+
+    for (;;) {
+        struct source *best = NULL;
+
+        for (i = 0; i < m->nsrc; i++) {
+            struct source *s = &m->src[i];
+
+            if (s->need_advance) {
+                s->need_advance = 0;
+                r = src_next(db, s);
+                if (r) return r;
+            }
+
+            /* the transaction changed under us: find our place again */
+            if (!s->run && s->modcount != db->mem.modcount) {
+                s->memidx = mem_find(db, m->lastkey.s, m->lastkey.len,
+                                     m->started);
+                src_setmem(db, s);
+            }
+        }
+
+        for (i = 0; i < m->nsrc; i++) {
+            struct source *s = &m->src[i];
+            int cmp;
+
+            if (!s->valid) continue;
+            if (!best) {
+                best = s;
+                continue;
+            }
+            /* earlier sources are newer, so they win ties */
+            cmp = db->compar(s->key.s, s->key.len, best->key.s, best->key.len);
+            if (cmp < 0) best = s;
+        }
+
+        if (!best) return 0;
+
+        buf_copy(&m->lastkey, &best->key);
+        m->started = 1;
+        m->val = best->val;
+        m->vallen = best->vallen;
+        m->tomb = best->tomb;
+
+        /* step past this key everywhere; lazily, so that the value
+         * stays put until the next call */
+        for (i = 0; i < m->nsrc; i++) {
+            struct source *s = &m->src[i];
+            if (s->valid &&
+                !db->compar(s->key.s, s->key.len, m->lastkey.s, m->lastkey.len))
+                s->need_advance = 1;
+        }
+
+        if (m->tomb && !m->keep_tombs) continue;
+
+        return 1;
+    }
+}
+
+/************** WRITING RUNS ****************/
+
+struct writer {
+    struct mappedfile *mf;
+    const char *fname;
+    size_t start;
+    size_t end;
+
+    struct buf raw;
+    struct buf out;
+    struct buf index;
+    struct buf lastkey;
+    struct buf firstkey;
+    uint32_t nblocks;
+    uint64_t nrecords;
+    struct bloom bloom;
+};
+
+static void writer_init(struct writer *w, struct mappedfile *mf,
+                        size_t offset, uint64_t expected)
+{
+    memset(w, 0, sizeof(struct writer));
+    w->mf = mf;
+    w->fname = mappedfile_fname(mf);
+    w->start = w->end = offset;
+    if (expected > INT_MAX) expected = INT_MAX;
+    bloom_init(&w->bloom, expected ? expected : 1, BLOOM_ERROR);
+}
+
+static void writer_free(struct writer *w)
+{
+    buf_free(&w->raw);
+    buf_free(&w->out);
+    buf_free(&w->index);
+    buf_free(&w->lastkey);
+    buf_free(&w->firstkey);
+    bloom_free(&w->bloom);
+}
+
+static int writer_write(struct writer *w, const char *base, size_t len)
+{
+    if (mappedfile_pwrite(w->mf, base, len, w->end) < 0) {
+        syslog(LOG_ERR, "IOERROR: sstable %s: failed to write run: %m",
+               w->fname);
+        return CYRUSDB_IOERROR;
+    }
+    w->end += len;
+    return 0;
+}
+
+static int writer_flush_block(struct writer *w)
+{
+    char head[BLOCKHEAD_SIZE];
+    const char *data = w->raw.s;
+    size_t len = w->raw.len;
+    uint32_t method = METHOD_NONE;
+    int r;
+
+    if (!w->raw.len) return 0;
+
+#ifdef HAVE_ZLIB
+    {
+        uLongf destlen = compressBound(w->raw.len);
+        buf_reset(&w->out);
+        buf_ensure(&w->out, destlen);
+        if (compress2((Bytef *)w->out.s, &destlen,
+                      (const Bytef *)w->raw.s, w->raw.len,
+                      Z_DEFAULT_COMPRESSION) == Z_OK
+            && destlen < w->raw.len) {
+            data = w->out.s;
+            len = destlen;
+            method = METHOD_ZLIB;
+        }
+    }
+#endif
+
+    /* index entry first, while we know where the block starts */
+    buf_appendbit64(&w->index, w->end);
+    buf_appendbit32(&w->index, w->firstkey.len);
+    buf_appendmap(&w->index, w->firstkey.s, w->firstkey.len);
+
+    put32(head, len);
+    put32(head + 4, w->raw.len);
+    put32(head + 8, crc32_map(data, len));
+    put32(head + 12, method);
+
+    r = writer_write(w, head, BLOCKHEAD_SIZE);
+    if (!r) r = writer_write(w, data, len);
+    if (r) return r;
+
+    w->nblocks++;
+    buf_reset(&w->raw);
+    return 0;
+}
+
+static int writer_add(struct writer *w, const char *key, size_t keylen,
+                      const char *val, size_t vallen, int tomb)
+{
+    size_t shared = 0;
+
+    if (!w->raw.len) {
+        buf_setmap(&w->firstkey, key, keylen);
+    }
+    else {
+        size_t max = keylen < w->lastkey.len ? keylen : w->lastkey.len;
+        while (shared < max && key[shared] == w->lastkey.s[shared])
+            shared++;
+    }
+
+    buf_appendvarint(&w->raw, shared);
+    buf_appendvarint(&w->raw, keylen - shared);
+    buf_appendvarint(&w->raw, tomb ? 0 : (uint64_t)vallen + 1);
+    buf_appendmap(&w->raw, key + shared, keylen - shared);
+    if (!tomb) buf_appendmap(&w->raw, val, vallen);
+
+    buf_setmap(&w->lastkey, key, keylen);
+    bloom_add(&w->bloom, key, keylen);
+    w->nrecords++;
+
+    if (w->raw.len >= BLOCKSIZE)
+        return writer_flush_block(w);
+
+    return 0;
+}
+
+/* write out the index, bloom filter and footer; the footer's
+ * offset comes back in *footerp */
+static int writer_finish(struct writer *w, size_t prev, size_t *footerp)
+{
+    char footer[FOOTER_SIZE];
+    size_t indexoff, bloomoff;
+    int r;
+
+    r = writer_flush_block(w);
+    if (r) return r;
+
+    /* the index and bloom filter go out together, under one crc */
+    indexoff = w->end;
+    bloomoff = indexoff + w->index.len;
+    buf_appendmap(&w->index, (const char *)w->bloom.bf, w->bloom.bytes);
+
+    memset(footer, 0, sizeof(footer));
+    put32(footer, RUN_MAGIC);
+    put32(footer + 4, w->nblocks);
+    put64(footer + 8, w->start);
+    put64(footer + 16, indexoff);
+    put64(footer + 24, bloomoff);
+    put32(footer + 32, w->bloom.entries);
+    put32(footer + 36, w->bloom.bytes);
+    put64(footer + 40, w->nrecords);
+    put64(footer + 48, prev);
+    put32(footer + FOOTER_SIZE - 8, crc32_buf(&w->index));
+    put32(footer + FOOTER_SIZE - 4, crc32_map(footer, FOOTER_SIZE - 4));
+
+    r = writer_write(w, w->index.s, w->index.len);
+    if (r) return r;
+
+    *footerp = w->end;
+    return writer_write(w, footer, FOOTER_SIZE);
+}
+
+/************ DATABASE STRUCT AND TRANSACTION MANAGEMENT **************/
+
+static int read_lock(struct dbengine *db)
+{
+    int r = mappedfile_readlock(db->mf);
+    if (r) return CYRUSDB_IOERROR;
+
+    if (db->is_open) {
+        r = read_header(db);
+        if (!r) r = refresh_runs(db);
+        if (r) mappedfile_unlock(db->mf);
+    }
+
+    return r;
+}
+
+static int write_lock(struct dbengine *db)
+{
+    int r = mappedfile_writelock(db->mf);
+    if (r) return CYRUSDB_IOERROR;
+
+    if (db->is_open) {
+        r = read_header(db);
+        if (!r) r = refresh_runs(db);
+        if (r) mappedfile_unlock(db->mf);
+    }
+
+    return r;
+}
+
+static int unlock(struct dbengine *db)
+{
+    return mappedfile_unlock(db->mf) ? CYRUSDB_IOERROR : 0;
+}
+
+static int newtxn(struct dbengine *db, struct txn **tidptr)
+{
+    int r;
+
+    assert(!db->current_txn);
+    assert(!*tidptr);
+
+    /* grab a r/w lock */
+    r = write_lock(db);
+    if (r) return r;
+
+    /* create the transaction */
+    db->txn_num++;
+    db->current_txn = xmalloc(sizeof(struct txn));
+    db->current_txn->num = db->txn_num;
+
+    /* pass it back out */
+    *tidptr = db->current_txn;
+
+    return 0;
+}
+
+static void dispose_db(struct dbengine *db)
+{
+    if (!db) return;
+
+    if (db->mf) {
+        if (mappedfile_islocked(db->mf))
+            mappedfile_unlock(db->mf);
+        mappedfile_close(&db->mf);
+    }
+
+    free_runs(db);
+    mem_clear(db);
+    free(db->mem.ents);
+    free(db->current_txn);
+    buf_free(&db->block);
+    buf_free(&db->keybuf);
+    buf_free(&db->valbuf);
+
+    free(db);
+}
+
+static int opendb(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+{
+    struct dbengine *db;
+    int r;
+    int mappedfile_flags = MAPPEDFILE_RW;
+
+    assert(fname);
+    assert(ret);
+
+    db = (struct dbengine *) xzmalloc(sizeof(struct dbengine));
+
+    if (flags & CYRUSDB_CREATE)
+        mappedfile_flags |= MAPPEDFILE_CREATE;
+
+    db->open_flags = flags & ~CYRUSDB_CREATE;
+    db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare_mbox
+                                            : bsearch_ncompare_raw;
+
+    r = mappedfile_open(&db->mf, fname, mappedfile_flags);
+    if (r) {
+        /* convert to CYRUSDB errors*/
+        if (r == -ENOENT) r = CYRUSDB_NOTFOUND;
+        else r = CYRUSDB_IOERROR;
+        goto done;
+    }
+
+    db->is_open = 0;
+
+    /* grab a read lock, only reading the header */
+    r = read_lock(db);
+    if (r) goto done;
+
+    /* if the map size is zero, it's a new file - we need to create an
+     * initial header */
+    if (mappedfile_size(db->mf) == 0) {
+        unlock(db);
+        r = write_lock(db);
+        if (r) goto done;
+
+        /* someone else may have beaten us to it */
+        if (mappedfile_size(db->mf) == 0) {
+            memset(&db->header, 0, sizeof(struct db_header));
+            db->header.version = VERSION;
+            db->header.generation = 1;
+            db->header.current_size = HEADER_SIZE;
+            r = commit_header(db->mf, &db->header);
+            if (r) {
+                syslog(LOG_ERR, "DBERROR: writing header for %s: %m",
+                       fname);
+                goto done;
+            }
+        }
+    }
+
+    db->is_open = 1;
+
+    r = read_header(db);
+    if (!r) r = refresh_runs(db);
+    if (r) goto done;
+
+    /* unlock the DB */
+    unlock(db);
+
+    *ret = db;
+
+    if (mytid) {
+        r = newtxn(db, mytid);
+        if (r) goto done;
+    }
+
+done:
+    if (r) dispose_db(db);
+    return r;
+}
+
+static int myopen(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+{
+    struct db_list *ent;
+    struct dbengine *mydb;
+    int r = 0;
+
+    /* do we already have this DB open? */
+    for (ent = open_sstable; ent; ent = ent->next) {
+        if (strcmp(FNAME(ent->db), fname)) continue;
+        if (ent->db->current_txn)
+            return CYRUSDB_LOCKED;
+        if (mytid) {
+            r = newtxn(ent->db, mytid);
+            if (r) return r;
+        }
+        ent->refcount++;
+        *ret = ent->db;
+        return 0;
+    }
+
+    r = opendb(fname, flags, &mydb, mytid);
+    if (r) return r;
+
+    /* track this database in the open list */
+    ent = (struct db_list *) xzmalloc(sizeof(struct db_list));
+    ent->db = mydb;
+    ent->refcount = 1;
+    ent->next = open_sstable;
+    open_sstable = ent;
+
+    /* return the open DB */
+    *ret = mydb;
+
+    return 0;
+}
+
+static int myclose(struct dbengine *db)
+{
+    struct db_list *ent = open_sstable;
+    struct db_list *prev = NULL;
+
+    assert(db);
+
+    /* remove this DB from the open list */
+    while (ent && ent->db != db) {
+        prev = ent;
+        ent = ent->next;
+    }
+    assert(ent);
+
+    if (--ent->refcount <= 0) {
+        if (prev) prev->next = ent->next;
+        else open_sstable = ent->next;
+        free(ent);
+        if (mappedfile_islocked(db->mf))
+            syslog(LOG_ERR, "sstable: %s closed while still locked", FNAME(db));
+        dispose_db(db);
+    }
+
+    return 0;
+}
+
+/*************** EXTERNAL APIS ***********************/
+
+/* find 'key' in 'run', using the bloom filter and the sparse index */
+static int run_lookup(struct dbengine *db, struct run *run,
+                      const char *key, size_t keylen,
+                      const char **val, size_t *vallen, int *tomb)
+{
+    struct buf curkey = BUF_INITIALIZER;
+    uint32_t blockno;
+    size_t pos = 0;
+    int r = CYRUSDB_NOTFOUND;
+
+    if (!run->nblocks) return CYRUSDB_NOTFOUND;
+    if (run->bloom.ready && !bloom_check(&run->bloom, key, keylen))
+        return CYRUSDB_NOTFOUND;
+
+    blockno = find_block(db, run, key, keylen);
+
+    if (db->block_version != db->runs_version
+        || db->block_offset != run->blockoff[blockno]) {
+        db->block_version = 0;
+        r = read_block(db, run, blockno, &db->block);
+        if (r) return r;
+        db->block_version = db->runs_version;
+        db->block_offset = run->blockoff[blockno];
+    }
+
+    r = CYRUSDB_NOTFOUND;
+    while (pos < db->block.len) {
+        int cmp;
+
+        if (parse_record(&db->block, &pos, &curkey, val, vallen, tomb)) {
+            syslog(LOG_ERR, "DBERROR: sstable %s: bad record in block at %08llX",
+                   FNAME(db), (unsigned long long)run->blockoff[blockno]);
+            db->block_version = 0;
+            r = CYRUSDB_IOERROR;
+            break;
+        }
+
+        cmp = db->compar(curkey.s, curkey.len, key, keylen);
+        if (cmp == 0) {
+            r = 0;
+            break;
+        }
+        if (cmp > 0) break;
+    }
+
+    buf_free(&curkey);
+    return r;
+}
+
+static int lookup(struct dbengine *db, const char *key, size_t keylen,
+                  const char **data, size_t *datalen)
+{
+    struct mement *e;
+    const char *val = NULL;
+    size_t vallen = 0;
+    int tomb = 0;
+    int i, r;
+
+    e = mem_lookup(db, key, keylen);
+    if (e) {
+        if (e->tomb) return CYRUSDB_NOTFOUND;
+        *data = e->val;
+        *datalen = e->vallen;
+        return 0;
+    }
+
+    for (i = 0; i < db->nruns; i++) {
+        r = run_lookup(db, &db->runs[i], key, keylen, &val, &vallen, &tomb);
+        if (r == CYRUSDB_NOTFOUND) continue;
+        if (r) return r;
+        if (tomb) return CYRUSDB_NOTFOUND;
+        /* never hand out NULL for a zero length record */
+        *data = vallen ? val : "";
+        *datalen = vallen;
+        return 0;
+    }
+
+    return CYRUSDB_NOTFOUND;
+}
+
+static int myfetch(struct dbengine *db,
+            const char *key, size_t keylen,
+            const char **foundkey, size_t *foundkeylen,
+            const char **data, size_t *datalen,
+            struct txn **tidptr, int fetchnext)
+{
+    const char *val = NULL;
+    size_t vallen = 0;
+    int r = 0;
+
+    assert(db);
+    if (datalen) assert(data);
+
+    if (data) *data = NULL;
+    if (datalen) *datalen = 0;
+
+    /* Hacky workaround:
+     *
+     * If no transaction was passed, but we're in a transaction,
+     * then just do the read within that transaction.
+     */
+    if (!tidptr && db->current_txn)
+        tidptr = &db->current_txn;
+
+    if (tidptr) {
+        if (!*tidptr) {
+            r = newtxn(db, tidptr);
+            if (r) return r;
+        }
+    } else {
+        /* grab a r lock */
+        r = read_lock(db);
+        if (r) return r;
+    }
+
+    if (fetchnext) {
+        struct merge m;
+
+        memset(&m, 0, sizeof(struct merge));
+        merge_init(&m, db, 1, 0, db->nruns, 0);
+        r = merge_seek(&m, key, keylen, 1);
+        if (!r) r = merge_next(&m);
+        if (r > 0) {
+            buf_copy(&db->keybuf, &m.lastkey);
+            buf_setmap(&db->valbuf, m.val, m.vallen);
+            val = db->valbuf.s ? db->valbuf.s : "";
+            vallen = db->valbuf.len;
+            r = 0;
+        }
+        else if (!r) {
+            r = CYRUSDB_NOTFOUND;
+        }
+        merge_free(&m);
+        buf_free(&m.lastkey);
+
+        if (foundkey) *foundkey = db->keybuf.s;
+        if (foundkeylen) *foundkeylen = db->keybuf.len;
+    }
+    else {
+        r = lookup(db, key, keylen, &val, &vallen);
+    }
+
+    if (!r) {
+        if (data) *data = val;
+        if (datalen) *datalen = vallen;
+    }
+
+    if (!tidptr) {
+        /* release read lock */
+        int r1;
+        if ((r1 = unlock(db)) < 0) {
+            return r1;
+        }
+    }
+
+    return r;
+}
+
+/* foreach allows for subsidiary mailbox operations in 'cb'.
+   if there is a txn, 'cb' must make use of it.
+*/
+static int myforeach(struct dbengine *db,
+                     const char *prefix, size_t prefixlen,
+                     foreach_p *goodp,
+                     foreach_cb *cb, void *rock,
+                     struct txn **tidptr)
+{
+    int r = 0, cb_r = 0;
+    int num_misses = 0;
+    int need_unlock = 0;
+    struct merge m;
+
+    assert(db);
+    assert(cb);
+    if (prefixlen) assert(prefix);
+
+    memset(&m, 0, sizeof(struct merge));
+
+    /* Hacky workaround:
+     *
+     * If no transaction was passed, but we're in a transaction,
+     * then just do the read within that transaction.
+     */
+    if (!tidptr && db->current_txn)
+        tidptr = &db->current_txn;
+    if (tidptr) {
+        if (!*tidptr) {
+            r = newtxn(db, tidptr);
+            if (r) return r;
+        }
+    } else {
+        /* grab a r lock */
+        r = read_lock(db);
+        if (r) return r;
+        need_unlock = 1;
+    }
+
+    merge_init(&m, db, tidptr != NULL, 0, db->nruns, 0);
+    r = merge_seek(&m, prefix, prefixlen, 0);
+    if (r) goto done;
+
+    while ((r = merge_next(&m)) > 0) {
+        r = 0;
+
+        /* does it match prefix? */
+        if (prefixlen) {
+            if (m.lastkey.len < prefixlen) break;
+            if (db->compar(m.lastkey.s, prefixlen, prefix, prefixlen)) break;
+        }
+
+        if (!goodp || goodp(rock, m.lastkey.s, m.lastkey.len,
+                                  m.val, m.vallen)) {
+            if (!tidptr) {
+                /* release read lock; the key and value are our own
+                 * copies, so they survive it */
+                r = unlock(db);
+                if (r) goto done;
+                need_unlock = 0;
+            }
+
+            /* make callback */
+            cb_r = cb(rock, m.lastkey.s, m.lastkey.len,
+                            m.vallen ? m.val : "", m.vallen);
+            if (cb_r) break;
+
+            if (!tidptr) {
+                /* grab a r lock */
+                r = read_lock(db);
+                if (r) goto done;
+                need_unlock = 1;
+
+                num_misses = 0;
+            }
+        }
+        else if (!tidptr) {
+            num_misses++;
+            if (num_misses > FOREACH_LOCK_RELEASE) {
+                /* release read lock */
+                r = unlock(db);
+                if (r) goto done;
+                need_unlock = 0;
+
+                /* grab a r lock */
+                r = read_lock(db);
+                if (r) goto done;
+                need_unlock = 1;
+
+                num_misses = 0;
+            }
+        }
+
+        /* someone else changed the runs: find our place again */
+        if (m.version != db->runs_version) {
+            struct buf lastkey = BUF_INITIALIZER;
+
+            buf_copy(&lastkey, &m.lastkey);
+            merge_free(&m);
+            merge_init(&m, db, tidptr != NULL, 0, db->nruns, 0);
+            r = merge_seek(&m, lastkey.s, lastkey.len, 1);
+            buf_free(&lastkey);
+            if (r) goto done;
+        }
+    }
+
+ done:
+    merge_free(&m);
+    buf_free(&m.lastkey);
+
+    if (need_unlock) {
+        /* release read lock */
+        int r1 = unlock(db);
+        if (r1) return r1;
+    }
+
+    return r ? r : cb_r;
+}
+
+static int mystore(struct dbengine *db,
+            const char *key, size_t keylen,
+            const char *data, size_t datalen,
+            struct txn **tidptr, int force)
+{
+    struct txn *localtid = NULL;
+    const char *oldval = NULL;
+    size_t oldvallen = 0;
+    int r = 0;
+    int r2 = 0;
+
+    assert(db);
+    assert(key && keylen);
+
+    /* not keeping the transaction, just create one local to
+     * this function */
+    if (!tidptr) tidptr = &localtid;
+
+    /* make sure we're write locked and up to date */
+    if (!*tidptr) {
+        r = newtxn(db, tidptr);
+        if (r) return r;
+    }
+
+    if (!force || !data) {
+        r = lookup(db, key, keylen, &oldval, &oldvallen);
+        if (r == CYRUSDB_NOTFOUND) {
+            /* must be a delete - are we forcing? */
+            r = data ? 0 : (force ? 0 : CYRUSDB_NOTFOUND);
+            if (!r && !data) goto done;
+        }
+        else if (!r && data && !force) {
+            r = CYRUSDB_EXISTS;
+        }
+        if (r) goto done;
+    }
+
+    mem_put(db, key, keylen, data, data ? datalen : 0, data == NULL);
+
+ done:
+    if (r) {
+        r2 = myabort(db, *tidptr);
+        *tidptr = NULL;
+    }
+    else if (localtid) {
+        /* commit the store, which releases the write lock */
+        r = mycommit(db, localtid);
+    }
+
+    return r ? r : r2;
+}
+
+/* write the newest 'count' runs out as one new run.  Tombstones are
+ * only kept if there's an older run they might be hiding something in */
+static int merge_runs(struct dbengine *db, int count)
+{
+    struct merge m;
+    struct writer w;
+    uint64_t expected = 0;
+    uint64_t oldsize = 0;
+    size_t prev = db->runs[count-1].prev;
+    size_t footer = 0;
+    int i, r;
+
+    for (i = 0; i < count; i++) {
+        expected += db->runs[i].nrecords;
+        oldsize += RUN_SIZE(&db->runs[i]);
+    }
+
+    memset(&m, 0, sizeof(struct merge));
+    merge_init(&m, db, 0, 0, count, count < db->nruns);
+    writer_init(&w, db->mf, db->header.current_size, expected);
+
+    r = merge_seek(&m, NULL, 0, 0);
+    while (!r && (r = merge_next(&m)) > 0)
+        r = writer_add(&w, m.lastkey.s, m.lastkey.len, m.val, m.vallen, m.tomb);
+    if (!r && w.nrecords) r = writer_finish(&w, prev, &footer);
+
+    merge_free(&m);
+    buf_free(&m.lastkey);
+
+    if (!r) {
+        struct db_header newheader = db->header;
+
+        /* the merged run takes the place of the newest runs; the
+         * space they used is reclaimed by the next checkpoint */
+        newheader.num_runs -= count;
+        newheader.live_size -= oldsize;
+        if (footer) {
+            newheader.num_runs++;
+            newheader.live_size += w.end - w.start;
+            newheader.newest_run = footer;
+        }
+        else {
+            newheader.newest_run = prev;
+        }
+        newheader.current_size = w.end;
+
+        r = commit_header(db->mf, &newheader);
+        if (!r) {
+            db->header = newheader;
+            r = refresh_runs(db);
+        }
+    }
+
+    writer_free(&w);
+
+    return r;
+}
+
+/* merge the newest runs while they're of a similar size */
+static int maybe_merge(struct dbengine *db)
+{
+    uint64_t acc;
+    int k;
+
+    if (db->nruns < 2) return 0;
+
+    acc = RUN_SIZE(&db->runs[0]);
+    for (k = 1; k < db->nruns; k++) {
+        uint64_t size = RUN_SIZE(&db->runs[k]);
+        if (size > acc * MERGE_RATIO) break;
+        acc += size;
+    }
+
+    if (k < 2 && db->nruns > MAXRUNS)
+        k = db->nruns;
+
+    if (k < 2) return 0;
+
+    return merge_runs(db, k);
+}
+
+static int mycommit(struct dbengine *db, struct txn *tid)
+{
+    struct writer w;
+    size_t footer = 0;
+    int r = 0;
+    int i;
+
+    assert(db);
+    assert(tid == db->current_txn);
+
+    /* nothing to write */
+    if (!db->mem.count)
+        goto done;
+
+    writer_init(&w, db->mf, db->header.current_size, db->mem.count);
+    for (i = 0; !r && i < db->mem.count; i++) {
+        struct mement *e = db->mem.ents[i];
+        /* nothing older for a tombstone to hide */
+        if (e->tomb && !db->nruns) continue;
+        r = writer_add(&w, e->key, e->keylen, e->val, e->vallen, e->tomb);
+    }
+    if (!r && w.nrecords)
+        r = writer_finish(&w, db->header.newest_run, &footer);
+
+    if (!r && footer) {
+        struct db_header newheader = db->header;
+
+        newheader.num_runs++;
+        newheader.newest_run = footer;
+        newheader.current_size = w.end;
+        newheader.live_size += w.end - w.start;
+
+        r = commit_header(db->mf, &newheader);
+        if (!r) {
+            db->header = newheader;
+            r = refresh_runs(db);
+        }
+    }
+    writer_free(&w);
+
+    if (!r && !(db->open_flags & CYRUSDB_NOCOMPACT)) {
+        int r2 = maybe_merge(db);
+        if (r2) {
+            syslog(LOG_NOTICE, "sstable: failed to merge runs in %s",
+                   FNAME(db));
+        }
+        else if (db->header.current_size > MINREWRITE
+                 && db->header.current_size > 2 * (db->header.live_size + HEADER_SIZE)) {
+            r2 = mycheckpoint(db);
+            if (r2) {
+                syslog(LOG_NOTICE, "sstable: failed to checkpoint %s: %m",
+                       FNAME(db));
+            }
+        }
+    }
+
+ done:
+    if (r) {
+        int r2;
+
+        /* error during commit; we must abort */
+        r2 = myabort(db, tid);
+        if (r2) {
+            syslog(LOG_ERR, "DBERROR: sstable %s: commit AND abort failed",
+                   FNAME(db));
+        }
+    }
+    else {
+        mem_clear(db);
+        unlock(db);
+
+        free(tid);
+        db->current_txn = NULL;
+    }
+
+    return r;
+}
+
+static int myabort(struct dbengine *db, struct txn *tid)
+{
+    assert(db);
+    assert(tid == db->current_txn);
+
+    /* free the tid */
+    free(tid);
+    db->current_txn = NULL;
+
+    /* nothing was written that the header points at, so just
+     * forget the pending changes */
+    mem_clear(db);
+
+    return unlock(db);
+}
+
+/* rewrite the whole file as a single run, dropping everything
+ * that's been superseded.  Must be called write locked */
+static int mycheckpoint(struct dbengine *db)
+{
+    size_t old_size = db->header.current_size;
+    char newfname[1024];
+    clock_t start = sclock();
+    struct mappedfile *newmf = NULL;
+    struct db_header newheader;
+    struct writer w;
+    struct merge m;
+    uint64_t expected = 0;
+    size_t footer = 0;
+    int i, r;
+
+    /* open fname.NEW */
+    snprintf(newfname, sizeof(newfname), "%s.NEW", FNAME(db));
+    unlink(newfname);
+
+    r = mappedfile_open(&newmf, newfname, MAPPEDFILE_RW | MAPPEDFILE_CREATE);
+    if (r) return CYRUSDB_IOERROR;
+    r = mappedfile_writelock(newmf);
+    if (r) {
+        mappedfile_close(&newmf);
+        return CYRUSDB_IOERROR;
+    }
+
+    for (i = 0; i < db->nruns; i++)
+        expected += db->runs[i].nrecords;
+
+    memset(&m, 0, sizeof(struct merge));
+    merge_init(&m, db, 0, 0, db->nruns, 0);
+    writer_init(&w, newmf, HEADER_SIZE, expected);
+
+    r = merge_seek(&m, NULL, 0, 0);
+    while (!r && (r = merge_next(&m)) > 0)
+        r = writer_add(&w, m.lastkey.s, m.lastkey.len, m.val, m.vallen, 0);
+    if (!r && w.nrecords) r = writer_finish(&w, 0, &footer);
+
+    merge_free(&m);
+    buf_free(&m.lastkey);
+    if (r) goto err;
+
+    memset(&newheader, 0, sizeof(struct db_header));
+    newheader.version = VERSION;
+    newheader.generation = db->header.generation + 1;
+    newheader.num_runs = footer ? 1 : 0;
+    newheader.newest_run = footer;
+    newheader.current_size = w.end;
+    newheader.live_size = footer ? w.end - w.start : 0;
+
+    r = commit_header(newmf, &newheader);
+    if (r) goto err;
+
+    /* move new file to original file name */
+    r = mappedfile_rename(newmf, FNAME(db));
+    if (r) goto err;
+
+    /* OK, we're committed now - swap the files over, still holding
+     * the write lock on the new one */
+    mappedfile_unlock(db->mf);
+    mappedfile_close(&db->mf);
+    db->mf = newmf;
+    db->header = newheader;
+    r = refresh_runs(db);
+    writer_free(&w);
+
+    syslog(LOG_INFO,
+           "sstable: checkpointed %s (%llu record%s, %llu => %llu bytes) in %2.3f seconds",
+           FNAME(db), (unsigned long long)expected, expected == 1 ? "" : "s",
+           (unsigned long long)old_size,
+           (unsigned long long)db->header.current_size,
+           (sclock() - start) / (double) CLOCKS_PER_SEC);
+
+    return r;
+
+ err:
+    writer_free(&w);
+    unlink(newfname);
+    mappedfile_commit(newmf);
+    mappedfile_unlock(newmf);
+    mappedfile_close(&newmf);
+    return CYRUSDB_IOERROR;
+}
+
+static int myrepack(struct dbengine *db)
+{
+    int r;
+
+    if (db->current_txn) return CYRUSDB_LOCKED;
+
+    r = write_lock(db);
+    if (r) return r;
+
+    r = mycheckpoint(db);
+
+    unlock(db);
+
+    return r;
+}
+
+/* dump the database.
+   if detail == 1, dump the runs.
+   if detail == 2, also dump every record in them.
+*/
+static int dump(struct dbengine *db, int detail)
+{
+    int i, r;
+
+    r = read_lock(db);
+    if (r) return r;
+
+    printf("HEADER: v=%lu runs=%lu gen=%llu sz=(%08llX/%08llX)\n",
+           (unsigned long)db->header.version,
+           (unsigned long)db->header.num_runs,
+           (unsigned long long)db->header.generation,
+           (unsigned long long)db->header.current_size,
+           (unsigned long long)db->header.live_size);
+
+    for (i = 0; !r && i < db->nruns; i++) {
+        struct run *run = &db->runs[i];
+        struct merge m;
+
+        printf("RUN %08llX: records=%llu blocks=%lu size=%llu prev=%08llX\n",
+               (unsigned long long)run->footer,
+               (unsigned long long)run->nrecords,
+               (unsigned long)run->nblocks,
+               (unsigned long long)RUN_SIZE(run),
+               (unsigned long long)run->prev);
+
+        if (detail < 2) continue;
+
+        memset(&m, 0, sizeof(struct merge));
+        merge_init(&m, db, 0, i, i + 1, 1);
+        r = merge_seek(&m, NULL, 0, 0);
+        while (!r && (r = merge_next(&m)) > 0) {
+            r = 0;
+            printf(" %s ", m.tomb ? "DELETE" : "RECORD");
+            fwrite(m.lastkey.s, m.lastkey.len, 1, stdout);
+            if (!m.tomb) {
+                printf(" => ");
+                fwrite(m.val, m.vallen, 1, stdout);
+            }
+            printf("\n");
+        }
+        merge_free(&m);
+        buf_free(&m.lastkey);
+    }
+
+    unlock(db);
+
+    return r < 0 ? r : 0;
+}
+
+/* every record in every run reads back, with its checksum, in order */
+static int consistent(struct dbengine *db)
+{
+    struct buf prevkey = BUF_INITIALIZER;
+    int i, r;
+
+    r = read_lock(db);
+    if (r) return r;
+
+    for (i = 0; !r && i < db->nruns; i++) {
+        struct run *run = &db->runs[i];
+        struct source s;
+        uint64_t count = 0;
+
+        memset(&s, 0, sizeof(struct source));
+        s.run = run;
+        r = src_seek(db, &s, NULL, 0, 0);
+        while (!r && s.valid) {
+            if (count && db->compar(prevkey.s, prevkey.len,
+                                    s.key.s, s.key.len) >= 0) {
+                syslog(LOG_ERR, "DBERROR: sstable %s: run at %08llX out of order",
+                       FNAME(db), (unsigned long long)run->footer);
+                r = CYRUSDB_INTERNAL;
+                break;
+            }
+            buf_copy(&prevkey, &s.key);
+            count++;
+            r = src_next(db, &s);
+        }
+
+        if (!r && count != run->nrecords) {
+            syslog(LOG_ERR, "DBERROR: sstable %s: run at %08llX has %llu records, expected %llu",
+                   FNAME(db), (unsigned long long)run->footer,
+                   (unsigned long long)count, (unsigned long long)run->nrecords);
+            r = CYRUSDB_INTERNAL;
+        }
+
+        buf_free(&s.block);
+        buf_free(&s.key);
+    }
+
+    buf_free(&prevkey);
+    unlock(db);
+
+    return r;
+}
+
+static int fetch(struct dbengine *mydb,
+                 const char *key, size_t keylen,
+                 const char **data, size_t *datalen,
+                 struct txn **tidptr)
+{
+    assert(key);
+    assert(keylen);
+    return myfetch(mydb, key, keylen, NULL, NULL,
+                   data, datalen, tidptr, 0);
+}
+
+static int fetchnext(struct dbengine *mydb,
+                 const char *key, size_t keylen,
+                 const char **foundkey, size_t *fklen,
+                 const char **data, size_t *datalen,
+                 struct txn **tidptr)
+{
+    return myfetch(mydb, key, keylen, foundkey, fklen,
+                   data, datalen, tidptr, 1);
+}
+
+static int create(struct dbengine *db,
+                  const char *key, size_t keylen,
+                  const char *data, size_t datalen,
+                  struct txn **tid)
+{
+    if (datalen) assert(data);
+    return mystore(db, key, keylen, data ? data : "", datalen, tid, 0);
+}
+
+static int store(struct dbengine *db,
+                 const char *key, size_t keylen,
+                 const char *data, size_t datalen,
+                 struct txn **tid)
+{
+    if (datalen) assert(data);
+    return mystore(db, key, keylen, data ? data : "", datalen, tid, 1);
+}
+
+static int delete(struct dbengine *db,
+                  const char *key, size_t keylen,
+                  struct txn **tid, int force)
+{
+    return mystore(db, key, keylen, NULL, 0, tid, force);
+}
+
+static int mycompar(struct dbengine *db, const char *a, int alen,
+                    const char *b, int blen)
+{
+    return db->compar(a, alen, b, blen);
+}
+
+HIDDEN struct cyrusdb_backend cyrusdb_sstable =
+{
+    "sstable",                  /* name */
+
+    &cyrusdb_generic_init,
+    &cyrusdb_generic_done,
+    &cyrusdb_generic_sync,
+    &cyrusdb_generic_archive,
+    &cyrusdb_generic_unlink,
+
+    &myopen,
+    &myclose,
+
+    &fetch,
+    &fetch,
+    &fetchnext,
+
+    &myforeach,
+    &create,
+    &store,
+    &delete,
+
+    &mycommit,
+    &myabort,
+
+    &dump,
+    &consistent,
+    &myrepack,
+    &mycompar,
+
+    NULL,                       /* snapshot_begin */
+    NULL,                       /* snapshot_end */
+    NULL,                       /* cursor_new */
+    NULL,                       /* cursor_free */
+    NULL,                       /* cursor_fetch */
+    NULL                        /* cursor_foreach */
+};
@@ -43,10 +43,12 @@
 #include <config.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -59,6 +61,7 @@
 #include "crc32.h"
 #include "libcyr_cfg.h"
 #include "mappedfile.h"
+#include "prot.h"
 #include "util.h"
 #include "xmalloc.h"
 
@@ -276,6 +279,10 @@
 /* should be 0.5 for binary search semantics */
 #define PROB 0.5
 
+/* records at or above this level go in the sparse index, which with
+ * PROB 0.5 is about one key in every 2^(SPARSE_LEVEL-1) */
+#define SPARSE_LEVEL 7
+
 /* release lock in foreach at least every N records */
 #define FOREACH_LOCK_RELEASE 256
 
@@ -338,6 +345,11 @@ struct skiprecord {
  *
  * generation and end can be used to see if anything in
  * the file may have changed and needs re-reading.
+ *
+ * partial: the location was found starting from a sparse index
+ *          record rather than the dummy, so backloc and forwardloc
+ *          are only valid below that record's level.  Fine for
+ *          reading, but writes must relocate first.
  */
 struct skiploc {
     /* requested, may not match actual record */
@@ -354,6 +366,8 @@ struct skiploc {
     /* need a generation so we know if the location is still valid */
     uint64_t generation;
     size_t end;
+
+    int partial;
 };
 
 #define DIRTY (1<<0)
@@ -374,6 +388,23 @@ struct db_header {
     size_t current_size;
 };
 
+/* in-memory copy of the keys of every record at SPARSE_LEVEL or above,
+ * in order, valid for one generation and end of the file */
+struct sparse_entry {
+    size_t offset;                  /* of the record in the file */
+    size_t keypos;                  /* of the key in sparseindex.keys */
+    size_t keylen;
+};
+
+struct sparseindex {
+    uint64_t generation;
+    size_t end;
+    size_t count;
+    size_t alloc;
+    struct sparse_entry *entries;
+    struct buf keys;
+};
+
 struct dbengine {
     /* file data */
     struct mappedfile *mf;
@@ -390,6 +421,22 @@ struct dbengine {
     /* comparator function to use for sorting */
     int open_flags;
     int (*compar) (const char *s1, int l1, const char *s2, int l2);
+
+    /* open read snapshots, which hold the read lock between them */
+    int snapshots;
+
+    /* time (ms) of the oldest commit not yet synced, 0 if none */
+    int64_t unsynced_since;
+
+    /* with CYRUSDB_SPARSEINDEX, built on the first lookup after open
+     * or after the file changes */
+    struct sparseindex sparse;
+};
+
+/* a read cursor over a snapshot: owns nothing but its location */
+struct dbengine_cursor {
+    struct dbengine *db;
+    struct skiploc loc;
 };
 
 struct db_list {
@@ -429,6 +476,7 @@ static int mycommit(struct dbengine *db, struct txn *tid);
 static int myabort(struct dbengine *db, struct txn *tid);
 static int mycheckpoint(struct dbengine *db);
 static int myconsistent(struct dbengine *db, struct txn *tid);
+static int group_commit_flush(int force);
 static int recovery(struct dbengine *db);
 static int recovery1(struct dbengine *db, int *count);
 static int recovery2(struct dbengine *db, int *count);
@@ -842,11 +890,97 @@ static void _setloc(struct dbengine *db, struct skiprecord *record,
         record->nextloc[1] = offset;
 }
 
+static void sparse_free(struct sparseindex *sparse)
+{
+    free(sparse->entries);
+    buf_free(&sparse->keys);
+    memset(sparse, 0, sizeof(struct sparseindex));
+}
+
+/* walk the SPARSE_LEVEL chain from the dummy and copy out every key on
+ * it.  Only touches one record in every 2^(SPARSE_LEVEL-1) or so */
+static int sparse_build(struct dbengine *db)
+{
+    struct sparseindex *sparse = &db->sparse;
+    struct skiprecord record;
+    size_t offset;
+    int r;
+
+    sparse->count = 0;
+    buf_reset(&sparse->keys);
+
+    r = read_onerecord(db, DUMMY_OFFSET, &record);
+    if (r) return r;
+
+    offset = _getloc(db, &record, SPARSE_LEVEL-1);
+    while (offset) {
+        struct sparse_entry *entry;
+
+        r = read_onerecord(db, offset, &record);
+        if (r) return r;
+
+        if (record.type != RECORD || record.level < SPARSE_LEVEL) {
+            syslog(LOG_ERR, "DBERROR: twoskip bad sparse index record for %s at %08llX",
+                   FNAME(db), (LLU)offset);
+            return CYRUSDB_INTERNAL;
+        }
+
+        if (sparse->count == sparse->alloc) {
+            sparse->alloc = sparse->alloc ? sparse->alloc * 2 : 64;
+            sparse->entries = xrealloc(sparse->entries,
+                                       sparse->alloc * sizeof(struct sparse_entry));
+        }
+
+        entry = &sparse->entries[sparse->count++];
+        entry->offset = offset;
+        entry->keypos = sparse->keys.len;
+        entry->keylen = record.keylen;
+        buf_appendmap(&sparse->keys, KEY(db, &record), record.keylen);
+
+        offset = _getloc(db, &record, SPARSE_LEVEL-1);
+    }
+
+    sparse->generation = db->header.generation;
+    sparse->end = db->end;
+
+    return 0;
+}
+
+/* offset of the last sparse index record which sorts before the key
+ * in 'loc', or 0 to start from the dummy */
+static size_t sparse_start(struct dbengine *db, struct skiploc *loc)
+{
+    struct sparseindex *sparse = &db->sparse;
+    size_t lo = 0, hi;
+
+    if (sparse->generation != db->header.generation || sparse->end != db->end) {
+        if (sparse_build(db)) {
+            /* fall back to the full descent until the file changes */
+            sparse_free(sparse);
+            sparse->generation = db->header.generation;
+            sparse->end = db->end;
+            return 0;
+        }
+    }
+
+    /* binary search for the first entry not before the key */
+    hi = sparse->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        struct sparse_entry *entry = &sparse->entries[mid];
+        int cmp = db->compar(sparse->keys.s + entry->keypos, entry->keylen,
+                             loc->keybuf.s, loc->keybuf.len);
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo ? sparse->entries[lo-1].offset : 0;
+}
+
 /* finds a record, either an exact match or the record
  * immediately before */
-static int relocate(struct dbengine *db)
+static int relocate(struct dbengine *db, struct skiploc *loc)
 {
-    struct skiploc *loc = &db->loc;
     struct skiprecord newrecord;
     size_t offset;
     size_t oldoffset = 0;
@@ -858,9 +992,25 @@ static int relocate(struct dbengine *db)
     /* pointer validity */
     loc->generation = db->header.generation;
     loc->end = db->end;
+    loc->partial = 0;
 
-    /* start with the dummy */
-    r = read_onerecord(db, DUMMY_OFFSET, &loc->record);
+    /* reads outside a transaction can start from the sparse index */
+    offset = 0;
+    if (loc->keybuf.len && !db->current_txn
+        && (db->open_flags & CYRUSDB_SPARSEINDEX)) {
+        offset = sparse_start(db, loc);
+    }
+
+    if (offset) {
+        /* start just before the key, and only descend from there */
+        r = read_onerecord(db, offset, &loc->record);
+        if (r) return r;
+        loc->partial = 1;
+    }
+    else {
+        /* start with the dummy */
+        r = read_onerecord(db, DUMMY_OFFSET, &loc->record);
+    }
     loc->is_exactmatch = 0;
 
     /* initialise pointers */
@@ -925,10 +1075,10 @@ static int relocate(struct dbengine *db)
 
 /* helper function to find a location, either by using the existing
  * location if it's close enough, or using the full relocate above */
-static int find_loc(struct dbengine *db, const char *key, size_t keylen)
+static int find_loc_at(struct dbengine *db, struct skiploc *loc,
+                       const char *key, size_t keylen)
 {
     struct skiprecord newrecord;
-    struct skiploc *loc = &db->loc;
     int cmp, i, r;
 
     if (key != loc->keybuf.s)
@@ -936,21 +1086,23 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
     else if (keylen != loc->keybuf.len)
         buf_truncate(&loc->keybuf, keylen);
 
-    /* can we special case advance? */
+    /* can we special case advance?  Not for a write from a location
+     * found through the sparse index, stitch() needs all the levels */
     if (keylen && loc->end == db->end
-               && loc->generation == db->header.generation) {
+               && loc->generation == db->header.generation
+               && !(loc->partial && db->current_txn)) {
         cmp = db->compar(KEY(db, &loc->record), loc->record.keylen,
                          loc->keybuf.s, loc->keybuf.len);
         /* same place, and was exact.  Otherwise we're going back,
          * and the reverse pointers are no longer valid... */
-        if (db->loc.is_exactmatch && cmp == 0) {
+        if (loc->is_exactmatch && cmp == 0) {
             return 0;
         }
 
         /* we're looking after this record */
         if (cmp < 0) {
-            for (i = 0; i < db->loc.record.level; i++)
-                loc->backloc[i] = db->loc.record.offset;
+            for (i = 0; i < loc->record.level; i++)
+                loc->backloc[i] = loc->record.offset;
 
             /* read the next record */
             r = read_skipdelete(db, loc->forwardloc[0], &newrecord);
@@ -958,7 +1110,7 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
 
             /* nothing afterwards? */
             if (!newrecord.offset) {
-                db->loc.is_exactmatch = 0;
+                loc->is_exactmatch = 0;
                 return 0;
             }
 
@@ -968,8 +1120,8 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
 
             /* exact match? */
             if (cmp == 0) {
-                db->loc.is_exactmatch = 1;
-                db->loc.record = newrecord;
+                loc->is_exactmatch = 1;
+                loc->record = newrecord;
 
                 for (i = 0; i < newrecord.level; i++)
                     loc->forwardloc[i] = _getloc(db, &newrecord, i);
@@ -983,27 +1135,31 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
 
             /* or in the gap */
             if (cmp > 0) {
-                db->loc.is_exactmatch = 0;
+                loc->is_exactmatch = 0;
                 return 0;
             }
         }
         /* if we fell out here, it's not a "local" record, just search */
     }
 
-    return relocate(db);
+    return relocate(db, loc);
+}
+
+static int find_loc(struct dbengine *db, const char *key, size_t keylen)
+{
+    return find_loc_at(db, &db->loc, key, keylen);
 }
 
 /* helper function to advance to the "next" record.  Used by foreach,
  * fetchnext, and internal functions */
-static int advance_loc(struct dbengine *db)
+static int advance_loc_at(struct dbengine *db, struct skiploc *loc)
 {
-    struct skiploc *loc = &db->loc;
     uint8_t i;
     int r;
 
     /* has another session made changes?  Need to re-find the location */
     if (loc->end != db->end || loc->generation != db->header.generation) {
-        r = relocate(db);
+        r = relocate(db, loc);
         if (r) return r;
     }
 
@@ -1018,7 +1174,7 @@ static int advance_loc(struct dbengine *db)
     /* reached the end? */
     if (!loc->record.offset) {
         buf_reset(&loc->keybuf);
-        return relocate(db);
+        return relocate(db, loc);
     }
 
     /* update forward pointers */
@@ -1036,6 +1192,11 @@ static int advance_loc(struct dbengine *db)
     return 0;
 }
 
+static int advance_loc(struct dbengine *db)
+{
+    return advance_loc_at(db, &db->loc);
+}
+
 /* helper function to update all the back records efficiently
  * after appending a new record, either create or delete.  The
  * caller must set forwardloc[] correctly for each level it has
@@ -1179,12 +1340,23 @@ static int db_is_clean(struct dbengine *db)
 
 static int unlock(struct dbengine *db)
 {
+    /* an open snapshot keeps the read lock */
+    if (db->snapshots) return 0;
+
     return mappedfile_unlock(db->mf);
 }
 
 static int write_lock(struct dbengine *db)
 {
-    int r = mappedfile_writelock(db->mf);
+    int r;
+
+    if (db->snapshots) {
+        syslog(LOG_ERR, "twoskip: %s: write attempted with %d read snapshots open",
+               FNAME(db), db->snapshots);
+        return CYRUSDB_LOCKED;
+    }
+
+    r = mappedfile_writelock(db->mf);
     if (r) return r;
 
     /* reread header */
@@ -1202,7 +1374,12 @@ static int write_lock(struct dbengine *db)
 
 static int read_lock(struct dbengine *db)
 {
-    int r = mappedfile_readlock(db->mf);
+    int r;
+
+    /* an open snapshot already holds it, and the view is fixed */
+    if (db->snapshots) return 0;
+
+    r = mappedfile_readlock(db->mf);
     if (r) return r;
 
     /* reread header */
@@ -1253,12 +1430,17 @@ static void dispose_db(struct dbengine *db)
     if (!db) return;
 
     if (db->mf) {
+        db->snapshots = 0;
         if (mappedfile_islocked(db->mf))
             unlock(db);
+        if (db->unsynced_since && mappedfile_commit(db->mf))
+            syslog(LOG_ERR, "DBERROR: twoskip %s: failed to sync pending "
+                   "commits on close", FNAME(db));
         mappedfile_close(&db->mf);
     }
 
     buf_free(&db->loc.keybuf);
+    sparse_free(&db->sparse);
 
     free(db);
 }
@@ -1421,6 +1603,8 @@ static int myclose(struct dbengine *db)
     assert(ent);
 
     if (--ent->refcount <= 0) {
+        /* anything else pending goes out with this one */
+        if (db->unsynced_since) group_commit_flush(1);
         if (prev) prev->next = ent->next;
         else open_twoskip = ent->next;
         free(ent);
@@ -1662,6 +1846,90 @@ static int skipwrite(struct dbengine *db,
     return 0;
 }
 
+/* would committing the current transaction leave the file big enough
+ * to be worth repacking? */
+static int checkpoint_due(struct dbengine *db)
+{
+    return !(db->open_flags & CYRUSDB_NOCOMPACT)
+        && db->end > MINREWRITE
+        && db->end > 2 * db->header.repack_size;
+}
+
+/*
+ * Group commit: with twoskip_group_commit set, a commit is written to
+ * the file and becomes visible to other processes straight away, but
+ * the fsync is put off until the oldest unsynced commit in this process
+ * is that many milliseconds old.  Every open database with pending
+ * commits is then synced in the same pass, so a process committing to
+ * several databases per operation pays for one round of syncs per
+ * interval instead of one per commit.
+ *
+ * Commits are only checked against the interval as they happen, so a
+ * process which then sits waiting for a client would never get round to
+ * the sync: every deferral also asks prot to flush the lot as soon as
+ * the process would block for input, and the services do the same
+ * before waiting for their next connection.
+ *
+ * Only databases on the open list are deferred, so that there's always
+ * someone to flush them; a commit which is about to checkpoint syncs
+ * as usual, because the file is replaced straight afterwards.
+ */
+static int group_commit_defer(struct dbengine *db)
+{
+    struct db_list *ent;
+
+    if (libcyrus_config_getint(CYRUSOPT_TWOSKIP_GROUP_COMMIT) <= 0)
+        return 0;
+
+    if (checkpoint_due(db))
+        return 0;
+
+    for (ent = open_twoskip; ent; ent = ent->next) {
+        if (ent->db == db) return 1;
+    }
+
+    return 0;
+}
+
+static void group_commit_idle(void)
+{
+    group_commit_flush(1);
+}
+
+static int group_commit_flush(int force)
+{
+    int64_t latency = libcyrus_config_getint(CYRUSOPT_TWOSKIP_GROUP_COMMIT);
+    int64_t oldest = 0;
+    struct db_list *ent;
+    int r = 0;
+
+    for (ent = open_twoskip; ent; ent = ent->next) {
+        int64_t since = ent->db->unsynced_since;
+        if (since && (!oldest || since < oldest)) oldest = since;
+    }
+
+    if (!oldest) return 0;
+    if (!force && now_ms() - oldest < latency) return 0;
+
+    for (ent = open_twoskip; ent; ent = ent->next) {
+        struct dbengine *db = ent->db;
+        int r2;
+
+        if (!db->unsynced_since) continue;
+
+        r2 = mappedfile_commit(db->mf);
+        if (r2) {
+            syslog(LOG_ERR, "DBERROR: twoskip %s: group commit sync failed",
+                   FNAME(db));
+            r = CYRUSDB_IOERROR;
+            continue;
+        }
+        db->unsynced_since = 0;
+    }
+
+    return r;
+}
+
 static int mycommit(struct dbengine *db, struct txn *tid)
 {
     struct skiprecord newrecord;
@@ -1683,6 +1951,19 @@ static int mycommit(struct dbengine *db, struct txn *tid)
     r = append_record(db, &newrecord, NULL, NULL);
     if (r) goto done;
 
+    if (group_commit_defer(db)) {
+        /* update the header in place, and leave the sync of this and
+         * any other pending commits to the next group flush */
+        db->header.current_size = db->end;
+        db->header.flags &= ~DIRTY;
+        r = write_header(db);
+        if (r) goto done;
+        mappedfile_defer_commit(db->mf);
+        if (!db->unsynced_since) db->unsynced_since = now_ms();
+        prot_setidle(group_commit_idle);
+        goto done;
+    }
+
     /* commit ALL outstanding changes first, before
      * rewriting the header */
     r = mappedfile_commit(db->mf);
@@ -1692,6 +1973,7 @@ static int mycommit(struct dbengine *db, struct txn *tid)
     db->header.current_size = db->end;
     db->header.flags &= ~DIRTY;
     r = commit_header(db);
+    if (!r) db->unsynced_since = 0;
 
  done:
     if (r) {
@@ -1705,9 +1987,7 @@ static int mycommit(struct dbengine *db, struct txn *tid)
         }
     }
     else {
-        if (!(db->open_flags & CYRUSDB_NOCOMPACT)
-            && db->header.current_size > MINREWRITE
-            && db->header.current_size > 2 * db->header.repack_size) {
+        if (checkpoint_due(db)) {
             int r2 = mycheckpoint(db);
             if (r2) {
                 syslog(LOG_NOTICE, "twoskip: failed to checkpoint %s: %m",
@@ -1720,6 +2000,8 @@ static int mycommit(struct dbengine *db, struct txn *tid)
 
         free(tid);
         db->current_txn = NULL;
+
+        group_commit_flush(0);
     }
 
     return r;
@@ -1784,29 +2066,214 @@ static int mystore(struct dbengine *db,
     return r2 ? r2 : r;
 }
 
-/* compress 'db', closing at the end.  Uses foreach to copy into a new
- * database, then rewrites over the old one */
+/*
+ * Bulk loading: records arriving in key order are simply appended, so
+ * there's no need to search for each one.  Every record still waiting
+ * for its forward pointers is on a stack, the oldest (and highest
+ * level) at the bottom.  A new record of level L takes over levels
+ * below L from the records above it, which get their pointers filled
+ * in as they are popped.  Appended records collect in a buffer and go
+ * to the file in large sequential writes; a pending record which has
+ * already been written out gets its header rewritten in place.
+ */
+
+/* write out appended records once this many bytes are buffered */
+#define BULKLOAD_FLUSH (1024*1024)
 
-struct copy_rock {
+struct bulkload {
     struct dbengine *db;
-    struct txn *tid;
+    struct buf out;                          /* not yet written */
+    size_t outstart;                         /* file offset of out */
+    struct skiprecord stack[MAXLEVEL+1];     /* waiting for pointers */
+    int depth;
 };
 
-static int copy_cb(void *rock,
-                   const char *key, size_t keylen,
-                   const char *val, size_t vallen)
+static int bulkload_begin(struct bulkload *bl, struct dbengine *db)
 {
-    struct copy_rock *cr = (struct copy_rock *)rock;
+    int r;
+
+    assert(db->current_txn);
+
+    memset(bl, 0, sizeof(struct bulkload));
+    bl->db = db;
 
-    return mystore(cr->db, key, keylen, val, vallen, &cr->tid, 0);
+    /* dirty the header, as append_record() would */
+    if (!(db->header.flags & DIRTY)) {
+        db->header.flags |= DIRTY;
+        r = commit_header(db);
+        if (r) return r;
+    }
+
+    /* everything starts out pointing nowhere from the dummy */
+    r = read_onerecord(db, DUMMY_OFFSET, &bl->stack[0]);
+    if (r) return r;
+    bl->depth = 1;
+    bl->outstart = db->end;
+
+    return 0;
+}
+
+static int bulkload_flush(struct bulkload *bl)
+{
+    struct dbengine *db = bl->db;
+    ssize_t n;
+
+    if (!bl->out.len) return 0;
+
+    n = mappedfile_pwrite(db->mf, bl->out.s, bl->out.len, bl->outstart);
+    if (n < 0) return CYRUSDB_IOERROR;
+
+    db->end = bl->outstart + bl->out.len;
+    bl->outstart = db->end;
+    buf_reset(&bl->out);
+
+    return 0;
 }
 
+/* write back the header of a record whose pointers have changed */
+static int bulkload_patch(struct bulkload *bl, struct skiprecord *record)
+{
+    size_t len;
+
+    if (record->offset < bl->outstart)
+        return rewrite_record(bl->db, record);
+
+    prepare_record(record, bl->out.s + (record->offset - bl->outstart), &len);
+
+    return 0;
+}
+
+/* append a record, which must sort after everything already loaded */
+static int bulkload_add(struct bulkload *bl,
+                        const char *key, size_t keylen,
+                        const char *val, size_t vallen)
+{
+    struct dbengine *db = bl->db;
+    char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    struct skiprecord record;
+    struct iovec io[3];
+    size_t offset = bl->outstart + bl->out.len;
+    size_t len, padlen;
+    uint8_t level = 0;
+    uint8_t i;
+    int r;
+
+    memset(&record, 0, sizeof(struct skiprecord));
+    record.type = RECORD;
+    record.level = randlvl(1, MAXLEVEL);
+    record.keylen = keylen;
+    record.vallen = vallen;
+
+    /* point the waiting records at this one, up to its level */
+    while (level < record.level) {
+        struct skiprecord *prev = &bl->stack[bl->depth-1];
+        uint8_t top = prev->level < record.level ? prev->level : record.level;
+
+        for (i = level; i < top; i++)
+            _setloc(db, prev, i, offset);
+
+        r = bulkload_patch(bl, prev);
+        if (r) return r;
+
+        /* fully pointed, nothing more to wait for */
+        if (prev->level <= record.level)
+            bl->depth--;
+
+        level = top;
+    }
+
+    /* the tail crc covers key, value and padding */
+    padlen = roundup(keylen + vallen, 8) - (keylen + vallen);
+    io[0].iov_base = (char *)key;
+    io[0].iov_len = keylen;
+    io[1].iov_base = (char *)val;
+    io[1].iov_len = vallen;
+    io[2].iov_base = zeros;
+    io[2].iov_len = padlen;
+    record.crc32_tail = crc32_iovec(io, 3);
+
+    prepare_record(&record, scratchspace.s, &len);
+    buf_appendmap(&bl->out, scratchspace.s, len);
+    buf_appendmap(&bl->out, key, keylen);
+    buf_appendmap(&bl->out, val, vallen);
+    buf_appendmap(&bl->out, zeros, padlen);
+
+    record.offset = offset;
+    record.len = len + keylen + vallen + padlen;
+    bl->stack[bl->depth++] = record;
+
+    db->header.num_records++;
+
+    if (bl->out.len >= BULKLOAD_FLUSH)
+        return bulkload_flush(bl);
+
+    return 0;
+}
+
+static int bulkload_finish(struct bulkload *bl)
+{
+    int r = bulkload_flush(bl);
+
+    buf_free(&bl->out);
+
+    return r;
+}
+
+/* bulk load every live record of 'db' into the empty 'newdb' */
+static int bulkload_copy(struct dbengine *db, struct dbengine *newdb)
+{
+    struct bulkload bl;
+    int r;
+
+    r = bulkload_begin(&bl, newdb);
+    if (r) goto done;
+
+    /* start before the first record */
+    buf_reset(&db->loc.keybuf);
+    r = relocate(db, &db->loc);
+    if (r) goto done;
+
+    while (!(r = advance_loc(db)) && db->loc.is_exactmatch) {
+        r = bulkload_add(&bl, KEY(db, &db->loc.record), db->loc.record.keylen,
+                         VAL(db, &db->loc.record), db->loc.record.vallen);
+        if (r) goto done;
+    }
+
+ done:
+    if (!r) r = bulkload_finish(&bl);
+    else buf_free(&bl.out);
+
+    return r;
+}
+
+/* create an empty fname.NEW to checkpoint into */
+static int checkpoint_newdb(struct dbengine *db, const char *newfname,
+                            struct dbengine **newdbp, struct txn **tidp)
+{
+    unlink(newfname);
+
+    *newdbp = NULL;
+    *tidp = NULL;
+    return opendb(newfname, db->open_flags | CYRUSDB_CREATE, newdbp, tidp);
+}
+
+/* compress 'db', closing at the end.  Bulk loads the live records into
+ * a new database, then renames it over the old one.  The copy is made
+ * under a read lock, so that only writers have to wait for it; if any
+ * did get in before the write lock was taken back, the copy is made
+ * again under the write lock.  Delete records don't name the key they
+ * remove, so the tail of the log can't simply be replayed instead. */
 static int mycheckpoint(struct dbengine *db)
 {
     size_t old_size = db->header.current_size;
     char newfname[1024];
     clock_t start = sclock();
-    struct copy_rock cr;
+    struct {
+        struct dbengine *db;
+        struct txn *tid;
+    } cr;
+    uint64_t generation;
+    size_t end;
     int r = 0;
 
     r = myconsistent(db, db->current_txn);
@@ -1819,16 +2286,45 @@ static int mycheckpoint(struct dbengine *db)
 
     /* open fname.NEW */
     snprintf(newfname, sizeof(newfname), "%s.NEW", FNAME(db));
-    unlink(newfname);
+    r = checkpoint_newdb(db, newfname, &cr.db, &cr.tid);
+    if (r) {
+        unlock(db);
+        return r;
+    }
 
-    cr.db = NULL;
-    cr.tid = NULL;
-    r = opendb(newfname, db->open_flags | CYRUSDB_CREATE, &cr.db, &cr.tid);
-    if (r) return r;
+    /* let readers back in while we copy */
+    unlock(db);
+    r = read_lock(db);
+    if (r) goto err;
+
+    generation = db->header.generation;
+    end = db->end;
+
+    r = bulkload_copy(db, cr.db);
+    if (r) goto err;
 
-    r = myforeach(db, NULL, 0, NULL, copy_cb, &cr, &db->current_txn);
+    unlock(db);
+    r = write_lock(db);
     if (r) goto err;
 
+    if (db->header.generation != generation || db->end != end) {
+        /* somebody wrote in the meantime, start again and hold on */
+        syslog(LOG_INFO, "twoskip: %s changed during checkpoint, "
+               "copying again under the write lock", FNAME(db));
+
+        myabort(cr.db, cr.tid);
+        cr.tid = NULL;
+        dispose_db(cr.db);
+        r = checkpoint_newdb(db, newfname, &cr.db, &cr.tid);
+        if (r) {
+            cr.db = NULL;
+            goto err;
+        }
+
+        r = bulkload_copy(db, cr.db);
+        if (r) goto err;
+    }
+
     r = myconsistent(cr.db, cr.tid);
     if (r) {
         syslog(LOG_ERR, "db %s, inconsistent post-checkpoint, bailing out",
@@ -1854,9 +2350,12 @@ static int mycheckpoint(struct dbengine *db)
     /* OK, we're committed now - clean up */
     unlock(db);
 
-    /* gotta clean it all up */
+    /* gotta clean it all up; the new file already holds any commits
+     * that were waiting for a group sync */
+    if (db->unsynced_since) mappedfile_commit(db->mf);
     mappedfile_close(&db->mf);
     buf_free(&db->loc.keybuf);
+    sparse_free(&db->sparse);
 
     *db = *cr.db;
     free(cr.db); /* leaked? */
@@ -1873,9 +2372,11 @@ static int mycheckpoint(struct dbengine *db)
     return 0;
 
  err:
-    if (cr.tid) myabort(cr.db, cr.tid);
-    unlink(FNAME(cr.db));
-    dispose_db(cr.db);
+    if (cr.db) {
+        if (cr.tid) myabort(cr.db, cr.tid);
+        unlink(FNAME(cr.db));
+        dispose_db(cr.db);
+    }
     unlock(db);
     return CYRUSDB_IOERROR;
 }
@@ -2134,7 +2635,9 @@ static int recovery2(struct dbengine *db, int *count)
     /* OK, we're committed now - clean up */
     unlock(db);
 
-    /* gotta clean it all up */
+    /* gotta clean it all up; the new file already holds any commits
+     * that were waiting for a group sync */
+    if (db->unsynced_since) mappedfile_commit(db->mf);
     mappedfile_close(&db->mf);
     buf_free(&db->loc.keybuf);
 
@@ -2379,13 +2882,167 @@ static int mycompar(struct dbengine *db, const char *a, int alen,
     return db->compar(a, alen, b, blen);
 }
 
+/************** READ SNAPSHOTS ****************/
+
+static int snapshot_begin(struct dbengine *db)
+{
+    int r;
+
+    if (db->current_txn) return CYRUSDB_LOCKED;
+
+    if (!db->snapshots) {
+        r = read_lock(db);
+        if (r) return r;
+    }
+
+    db->snapshots++;
+
+    return 0;
+}
+
+static int snapshot_end(struct dbengine *db)
+{
+    assert(db->snapshots > 0);
+
+    if (--db->snapshots) return 0;
+
+    return unlock(db);
+}
+
+static struct dbengine_cursor *cursor_new(struct dbengine *db)
+{
+    struct dbengine_cursor *cur = xzmalloc(sizeof(struct dbengine_cursor));
+
+    cur->db = db;
+
+    return cur;
+}
+
+static void cursor_free(struct dbengine_cursor *cur)
+{
+    buf_free(&cur->loc.keybuf);
+    free(cur);
+}
+
+/* while a snapshot is open nothing in 'db' but the locations changes,
+ * so the lookups below only ever write to the cursor's own one */
+static int cursor_fetch(struct dbengine_cursor *cur,
+                        const char *key, size_t keylen,
+                        const char **data, size_t *datalen)
+{
+    struct dbengine *db = cur->db;
+    int r;
+
+    assert(db->snapshots);
+
+    r = find_loc_at(db, &cur->loc, key, keylen);
+    if (r) return r;
+
+    if (!cur->loc.is_exactmatch)
+        return CYRUSDB_NOTFOUND;
+
+    if (data) *data = VAL(db, &cur->loc.record);
+    if (datalen) *datalen = cur->loc.record.vallen;
+
+    return 0;
+}
+
+static int cursor_foreach(struct dbengine_cursor *cur,
+                          const char *prefix, size_t prefixlen,
+                          foreach_p *goodp,
+                          foreach_cb *cb, void *rock)
+{
+    struct dbengine *db = cur->db;
+    struct skiploc *loc = &cur->loc;
+    int r, cb_r = 0;
+
+    assert(db->snapshots);
+    assert(cb);
+    if (prefixlen) assert(prefix);
+
+    r = find_loc_at(db, loc, prefix, prefixlen);
+    if (r) return r;
+
+    if (!loc->is_exactmatch) {
+        /* advance to the first match */
+        r = advance_loc_at(db, loc);
+        if (r) return r;
+    }
+
+    while (loc->is_exactmatch) {
+        const char *val = VAL(db, &loc->record);
+        size_t vallen = loc->record.vallen;
+
+        /* does it match prefix? */
+        if (prefixlen) {
+            if (loc->record.keylen < prefixlen) break;
+            if (db->compar(KEY(db, &loc->record), prefixlen, prefix, prefixlen)) break;
+        }
+
+        if (!goodp || goodp(rock, loc->keybuf.s, loc->keybuf.len,
+                                  val, vallen)) {
+            cb_r = cb(rock, loc->keybuf.s, loc->keybuf.len, val, vallen);
+            if (cb_r) break;
+        }
+
+        /* move to the next one */
+        r = advance_loc_at(db, loc);
+        if (r) return r;
+    }
+
+    return cb_r;
+}
+
+/* the same test as db_is_clean(), straight from the file */
+static int needs_recovery(const char *fname)
+{
+    char header[HEADER_SIZE];
+    struct stat sbuf;
+    uint64_t current_size;
+    uint32_t flags;
+    int fd, r = 0;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd < 0) return 0;
+
+    if (fstat(fd, &sbuf) ||
+        pread(fd, header, HEADER_SIZE, 0) != HEADER_SIZE ||
+        memcmp(header, HEADER_MAGIC, HEADER_MAGIC_SIZE)) {
+        /* not for us to judge, opening it will report the problem */
+        goto done;
+    }
+
+    current_size = ntohll(*((uint64_t *)(header + OFFSET_CURRENT_SIZE)));
+    flags = ntohl(*((uint32_t *)(header + OFFSET_FLAGS)));
+
+    if ((flags & DIRTY) || current_size != (uint64_t) sbuf.st_size)
+        r = 1;
+
+done:
+    close(fd);
+    return r;
+}
+
+static int mydone(void)
+{
+    group_commit_flush(1);
+    return cyrusdb_generic_done();
+}
+
+static int mysync(void)
+{
+    int r = group_commit_flush(1);
+    int r2 = cyrusdb_generic_sync();
+    return r ? r : r2;
+}
+
 HIDDEN struct cyrusdb_backend cyrusdb_twoskip =
 {
     "twoskip",                  /* name */
 
     &cyrusdb_generic_init,
-    &cyrusdb_generic_done,
-    &cyrusdb_generic_sync,
+    &mydone,
+    &mysync,
     &cyrusdb_generic_archive,
     &cyrusdb_generic_unlink,
 
@@ -2407,5 +3064,14 @@ HIDDEN struct cyrusdb_backend cyrusdb_twoskip =
     &dump,
     &consistent,
     &mycheckpoint,
-    &mycompar
+    &mycompar,
+
+    &snapshot_begin,
+    &snapshot_end,
+    &cursor_new,
+    &cursor_free,
+    &cursor_fetch,
+    &cursor_foreach,
+
+    &needs_recovery
 };
@@ -77,6 +77,12 @@
  *     current_offset = file offset of the start of the member being read
  *     next_offset = -1
  *     member_eof = 1
+ *
+ * when reading was started from a full flush point within a member (after
+ * gzuc_member_start_at), the stream is raw deflate data rather than gzip,
+ * and seek_offset/seek_pos record where (in the file) and at what
+ * uncompressed position that flush point is, so that backwards seeks
+ * can restart from there rather than from the start of the member.
  */
 
 static const size_t default_in_buf_size = 16 * 1024;
@@ -91,6 +97,9 @@ struct gzuncat {
     unsigned char *in_buf;
     size_t in_buf_size;
     size_t bytes_read;
+    int   raw;
+    off_t seek_offset;
+    size_t seek_pos;
 };
 
 EXPORTED struct gzuncat *gzuc_new(int fd)
@@ -107,6 +116,9 @@ EXPORTED struct gzuncat *gzuc_new(int fd)
     gz->in_buf = NULL;
     gz->in_buf_size = default_in_buf_size;
     gz->bytes_read = 0;
+    gz->raw = 0;
+    gz->seek_offset = -1;
+    gz->seek_pos = 0;
 
     return gz;
 }
@@ -121,7 +133,7 @@ EXPORTED int gzuc_set_bufsize(struct gzuncat *gz, size_t size)
     return 0;
 }
 
-static int _inflate_init(z_stream *strm, unsigned char *in_buf)
+static int _inflate_init(z_stream *strm, unsigned char *in_buf, int raw)
 {
     strm->zalloc = Z_NULL;
     strm->zfree = Z_NULL;
@@ -131,7 +143,8 @@ static int _inflate_init(z_stream *strm, unsigned char *in_buf)
 
     // 15 = support maximum window size
     // 16 = decode gzip format
-    return inflateInit2(strm, 15 + 16);
+    // negative = raw deflate data, no header (resuming at a flush point)
+    return inflateInit2(strm, raw ? -15 : 15 + 16);
 }
 
 EXPORTED int gzuc_member_start_from(struct gzuncat *gz, off_t offset)
@@ -149,7 +162,7 @@ EXPORTED int gzuc_member_start_from(struct gzuncat *gz, off_t offset)
     int r = lseek(gz->fd, offset, SEEK_SET);
     if (r < 0) return Z_ERRNO;
 
-    r = _inflate_init(&gz->strm, gz->in_buf);
+    r = _inflate_init(&gz->strm, gz->in_buf, 0);
     if (r) return r;
 
     // anything else to initialise?
@@ -159,6 +172,46 @@ EXPORTED int gzuc_member_start_from(struct gzuncat *gz, off_t offset)
     gz->member_eof = 0;
     gz->file_eof = 0;
     gz->bytes_read = 0;
+    gz->raw = 0;
+    gz->seek_offset = -1;
+    gz->seek_pos = 0;
+
+    return 0;
+}
+
+/* start reading the member at member_offset, but from the full flush point
+ * at flush_offset, which corresponds to uncompressed position flush_pos
+ * within the member.  deflate discards its history at a full flush, so
+ * the data from there on can be inflated without reading what came before.
+ */
+EXPORTED int gzuc_member_start_at(struct gzuncat *gz, off_t member_offset,
+                                  off_t flush_offset, size_t flush_pos)
+{
+    if (gz->current_offset >= 0 || member_offset < 0
+        || flush_offset <= member_offset) {
+        errno = EINVAL;
+        return Z_ERRNO;
+    }
+
+    if (!gz->in_buf)
+        gz->in_buf = xmalloc(gz->in_buf_size);
+
+    memset(gz->in_buf, 0, gz->in_buf_size);
+
+    int r = lseek(gz->fd, flush_offset, SEEK_SET);
+    if (r < 0) return Z_ERRNO;
+
+    r = _inflate_init(&gz->strm, gz->in_buf, 1);
+    if (r) return r;
+
+    gz->current_offset = member_offset;
+    gz->next_offset = -1;
+    gz->member_eof = 0;
+    gz->file_eof = 0;
+    gz->bytes_read = flush_pos;
+    gz->raw = 1;
+    gz->seek_offset = flush_offset;
+    gz->seek_pos = flush_pos;
 
     return 0;
 }
@@ -186,14 +239,20 @@ EXPORTED int gzuc_member_end(struct gzuncat *gz, off_t *offset)
         if (r < 0) goto done;
     }
 
-    /* we're now at the start of the next member */
+    /* we're now at the start of the next member, unless we were reading
+     * raw deflate data, in which case the gzip trailer is still to come */
     gz->next_offset = lseek(gz->fd, 0, SEEK_CUR);
+    if (gz->raw && gz->next_offset >= 0)
+        gz->next_offset += 8;
 
 done:
     inflateEnd(&gz->strm);
     gz->current_offset = -1;
     gz->member_eof = -1;
     gz->bytes_read = 0;
+    gz->raw = 0;
+    gz->seek_offset = -1;
+    gz->seek_pos = 0;
     if (!r && offset) *offset = gz->next_offset;
     return r;
 }
@@ -329,14 +388,18 @@ EXPORTED int gzuc_seekto(struct gzuncat *gz, size_t pos)
     if (pos == gz->bytes_read) return 0;
 
     if (pos < gz->bytes_read) {
-        int r = lseek(gz->fd, gz->current_offset, SEEK_SET);
+        /* restart from the flush point if we can, else the member start */
+        int raw = (gz->seek_offset >= 0 && pos >= gz->seek_pos);
+        int r = lseek(gz->fd, raw ? gz->seek_offset : gz->current_offset,
+                      SEEK_SET);
         if (r < 0) return r;
 
         inflateEnd(&gz->strm);
-        r = _inflate_init(&gz->strm, gz->in_buf);
+        r = _inflate_init(&gz->strm, gz->in_buf, raw);
         if (r) return r;
 
-        gz->bytes_read = 0;
+        gz->raw = raw;
+        gz->bytes_read = raw ? gz->seek_pos : 0;
     }
 
     return gzuc_skip(gz, pos - gz->bytes_read);
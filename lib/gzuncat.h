@@ -56,6 +56,8 @@ void gzuc_free(struct gzuncat **gzp);
 int gzuc_set_bufsize(struct gzuncat *gz, size_t size);
 int gzuc_member_start_from(struct gzuncat *gz, off_t offset);
 int gzuc_member_start(struct gzuncat *gz);
+int gzuc_member_start_at(struct gzuncat *gz, off_t member_offset,
+                         off_t flush_offset, size_t flush_pos);
 int gzuc_member_end(struct gzuncat *gz, off_t *offset);
 int gzuc_member_eof(struct gzuncat *gz);
 int gzuc_eof(struct gzuncat *gz);
@@ -0,0 +1,340 @@
+/* hashoa.c -- open addressing hash table keyed by strings
+ *
+ * Copyright (c) 2018 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "assert.h"
+#include "hashoa.h"
+#include "mpool.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/*
+** Control bytes.  A full slot holds the low 7 bits of its key's hash,
+** so both kinds of free slot are recognisable by their top bit alone.
+*/
+#define CTRL_EMPTY      ((uint8_t) 0x80)
+#define CTRL_DELETED    ((uint8_t) 0xFE)
+#define CTRL_ISFULL(c)  (!((c) & 0x80))
+
+#define H1(hash)        ((hash) >> 7)
+#define H2(hash)        ((uint8_t) ((hash) & 0x7F))
+
+/* maximum load, counting tombstones, is 7/8 of the slots */
+#define MAXLOAD(nslots) ((nslots) - (nslots) / 8)
+
+static inline uint64_t rotl64(uint64_t v, int r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t v)
+{
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    v *= 0xc4ceb9fe1a85ec53ULL;
+    v ^= v >> 33;
+    return v;
+}
+
+/* strhash() only mixes the low bits; we need all 64 of them */
+static uint64_t hashoa_hash(const char *key, size_t len)
+{
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+    uint64_t v;
+
+    for (; len >= 8; key += 8, len -= 8) {
+        memcpy(&v, key, 8);
+        h = rotl64(h ^ (v * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+    }
+    if (len) {
+        v = 0;
+        memcpy(&v, key, len);
+        h ^= v * 0x87c37b91114253d5ULL;
+    }
+
+    return fmix64(h);
+}
+
+/* bitmask of the slots in the group at 'ctrl' whose control byte is 'c' */
+static inline unsigned group_match(const uint8_t *ctrl, uint8_t c)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) c)));
+#else
+    unsigned mask = 0;
+    int i;
+
+    for (i = 0; i < HASHOA_GROUP; i++)
+        if (ctrl[i] == c) mask |= 1U << i;
+    return mask;
+#endif
+}
+
+/* bitmask of the empty or deleted slots in the group at 'ctrl' */
+static inline unsigned group_match_free(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+#else
+    unsigned mask = 0;
+    int i;
+
+    for (i = 0; i < HASHOA_GROUP; i++)
+        if (!CTRL_ISFULL(ctrl[i])) mask |= 1U << i;
+    return mask;
+#endif
+}
+
+/*
+** Groups are probed in triangular order, which visits every group
+** exactly once when the number of groups is a power of two.
+*/
+#define FOREACH_GROUP(table, hash, g, i)                                \
+    for (i = 0, g = H1(hash) & ((table)->mask / HASHOA_GROUP);          \
+         i <= (table)->mask / HASHOA_GROUP;                             \
+         i++, g = (g + i) & ((table)->mask / HASHOA_GROUP))
+
+static hashoa_slot *find_slot(const hashoa_table *table,
+                              const char *key, uint64_t hash)
+{
+    size_t g, i;
+
+    FOREACH_GROUP(table, hash, g, i) {
+        const uint8_t *ctrl = table->ctrl + g * HASHOA_GROUP;
+        unsigned m = group_match(ctrl, H2(hash));
+
+        while (m) {
+            hashoa_slot *slot = table->slots + g * HASHOA_GROUP
+                                + __builtin_ctz(m);
+            if (slot->hash == hash && !strcmp(slot->key, key))
+                return slot;
+            m &= m - 1;
+        }
+
+        /* an empty slot means the key was never pushed further along */
+        if (group_match(ctrl, CTRL_EMPTY)) break;
+    }
+
+    return NULL;
+}
+
+/* index of the first free slot along the probe sequence for 'hash' */
+static size_t find_free(const hashoa_table *table, uint64_t hash)
+{
+    size_t g, i;
+
+    FOREACH_GROUP(table, hash, g, i) {
+        unsigned m = group_match_free(table->ctrl + g * HASHOA_GROUP);
+        if (m) return g * HASHOA_GROUP + __builtin_ctz(m);
+    }
+
+    /* can't happen: the load limit always leaves free slots */
+    assert(0);
+    return 0;
+}
+
+static void resize(hashoa_table *table, size_t nslots)
+{
+    uint8_t *oldctrl = table->ctrl;
+    hashoa_slot *oldslots = table->slots;
+    size_t oldnslots = table->ctrl ? table->mask + 1 : 0;
+    size_t i;
+
+    table->mask = nslots - 1;
+    table->deleted = 0;
+    table->ctrl = xmalloc(nslots);
+    memset(table->ctrl, CTRL_EMPTY, nslots);
+    table->slots = xmalloc(nslots * sizeof(hashoa_slot));
+
+    for (i = 0; i < oldnslots; i++) {
+        if (CTRL_ISFULL(oldctrl[i])) {
+            size_t j = find_free(table, oldslots[i].hash);
+            table->ctrl[j] = oldctrl[i];
+            table->slots[j] = oldslots[i];
+        }
+    }
+
+    free(oldctrl);
+    free(oldslots);
+}
+
+EXPORTED hashoa_table *construct_hashoa_table(hashoa_table *table,
+                                              size_t size)
+{
+    size_t nslots = HASHOA_GROUP;
+
+    assert(table);
+
+    while (MAXLOAD(nslots) < size) nslots *= 2;
+
+    memset(table, 0, sizeof(hashoa_table));
+    table->pool = new_mpool(size * 32);
+    resize(table, nslots);
+
+    return table;
+}
+
+EXPORTED void *hashoa_insert(const char *key, void *data, hashoa_table *table)
+{
+    size_t len = strlen(key);
+    uint64_t hash = hashoa_hash(key, len);
+    hashoa_slot *slot;
+    size_t i;
+    char *copy;
+
+    if (!table->ctrl) construct_hashoa_table(table, HASHOA_GROUP);
+
+    slot = find_slot(table, key, hash);
+    if (slot) {
+        void *old_data = slot->data;
+        slot->data = data;
+        return old_data;
+    }
+
+    if (table->count + table->deleted + 1 > MAXLOAD(table->mask + 1)) {
+        /* grow if it's mostly live entries, else just sweep tombstones */
+        size_t nslots = table->mask + 1;
+        if (table->count + 1 > MAXLOAD(nslots) / 2) nslots *= 2;
+        resize(table, nslots);
+    }
+
+    i = find_free(table, hash);
+    if (table->ctrl[i] == CTRL_DELETED) table->deleted--;
+
+    copy = mpool_malloc(table->pool, len + 1);
+    memcpy(copy, key, len + 1);
+
+    table->ctrl[i] = H2(hash);
+    table->slots[i].key = copy;
+    table->slots[i].data = data;
+    table->slots[i].hash = hash;
+    table->count++;
+
+    return data;
+}
+
+EXPORTED void *hashoa_lookup(const char *key, const hashoa_table *table)
+{
+    hashoa_slot *slot;
+
+    if (!table->count) return NULL;
+
+    slot = find_slot(table, key, hashoa_hash(key, strlen(key)));
+    return slot ? slot->data : NULL;
+}
+
+EXPORTED void *hashoa_del(const char *key, hashoa_table *table)
+{
+    hashoa_slot *slot;
+    size_t i;
+
+    if (!table->count) return NULL;
+
+    slot = find_slot(table, key, hashoa_hash(key, strlen(key)));
+    if (!slot) return NULL;
+
+    i = slot - table->slots;
+
+    /* if the group still has an empty slot, no probe ever went past it,
+     * so the slot can go straight back to empty */
+    if (group_match(table->ctrl + (i & ~(size_t) (HASHOA_GROUP - 1)),
+                    CTRL_EMPTY)) {
+        table->ctrl[i] = CTRL_EMPTY;
+    }
+    else {
+        table->ctrl[i] = CTRL_DELETED;
+        table->deleted++;
+    }
+    table->count--;
+
+    return slot->data;
+}
+
+EXPORTED void hashoa_enumerate(const hashoa_table *table,
+                               void (*func)(const char *, void *, void *),
+                               void *rock)
+{
+    size_t i;
+
+    if (!table->count) return;
+
+    for (i = 0; i <= table->mask; i++) {
+        if (CTRL_ISFULL(table->ctrl[i]))
+            func(table->slots[i].key, table->slots[i].data, rock);
+    }
+}
+
+EXPORTED int hashoa_numrecords(const hashoa_table *table)
+{
+    return table->count;
+}
+
+EXPORTED void free_hashoa_table(hashoa_table *table, void (*func)(void *))
+{
+    size_t i;
+
+    if (!table) return;
+
+    if (func && table->count) {
+        for (i = 0; i <= table->mask; i++) {
+            if (CTRL_ISFULL(table->ctrl[i]))
+                func(table->slots[i].data);
+        }
+    }
+
+    free(table->ctrl);
+    free(table->slots);
+    if (table->pool) free_mpool(table->pool);
+
+    memset(table, 0, sizeof(hashoa_table));
+}
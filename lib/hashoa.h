@@ -0,0 +1,134 @@
+/* hashoa.h -- open addressing hash table keyed by strings
+ *
+ * Copyright (c) 2018 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_HASHOA_H__
+#define __CYRUS_HASHOA_H__
+
+#include <stddef.h>           /* For size_t */
+#include <stdint.h>           /* For uint8_t, uint64_t */
+
+#include "mpool.h"
+
+/*
+** An open addressing ("Swiss table") alternative to hash_table for
+** the hot paths.  Instead of chasing a bucket list per lookup, the
+** slots live in one flat array with a parallel array of one byte
+** control codes: each full slot stores 7 bits of its key's hash, so a
+** whole group of HASHOA_GROUP slots is filtered with a single vector
+** compare and only the few candidates are strcmp'd.  Keys are copied
+** into a private memory pool, so inserting allocates nothing per
+** entry once the table has grown to size.
+**
+** The interface follows hash_table, argument order included, so
+** callers can switch with little more than a rename.
+*/
+
+#define HASHOA_GROUP 16
+
+#define HASHOA_TABLE_INITIALIZER {0, 0, 0, NULL, NULL, NULL}
+
+typedef struct hashoa_slot {
+    const char *key;
+    void *data;
+    uint64_t hash;
+} hashoa_slot;
+
+typedef struct hashoa_table {
+    size_t mask;            /* number of slots - 1, or 0 if unallocated */
+    size_t count;           /* live entries */
+    size_t deleted;         /* tombstones still occupying slots */
+    uint8_t *ctrl;          /* one control byte per slot */
+    hashoa_slot *slots;
+    struct mpool *pool;     /* copies of the keys */
+} hashoa_table;
+
+/*
+** Sets up the table to hold at least 'size' entries without growing.
+** A table left at HASHOA_TABLE_INITIALIZER is also usable, and will
+** be allocated by the first insert.
+*/
+
+hashoa_table *construct_hashoa_table(hashoa_table *table, size_t size);
+
+/*
+** Inserts a pointer to 'data' in the table, with a copy of 'key' as its
+** key.  Returns 'data', or if there was already an entry for 'key', the
+** data it replaced.
+*/
+
+void *hashoa_insert(const char *key, void *data, hashoa_table *table);
+
+/*
+** Returns a pointer to the data associated with a key, or NULL.
+*/
+
+void *hashoa_lookup(const char *key, const hashoa_table *table);
+
+/*
+** Deletes an entry from the table and returns its data so the caller
+** can dispose of it.  The copy of the key stays in the pool until the
+** table is freed.
+*/
+
+void *hashoa_del(const char *key, hashoa_table *table);
+
+/*
+** Calls 'func' for each entry.  The table must not be modified from
+** inside the callback.
+*/
+
+void hashoa_enumerate(const hashoa_table *table,
+                      void (*func)(const char *, void *, void *),
+                      void *rock);
+
+/* counts the number of entries in the table */
+
+int hashoa_numrecords(const hashoa_table *table);
+
+/*
+** Frees the table, calling 'func' (if non-NULL) on each entry's data.
+** The table is left as HASHOA_TABLE_INITIALIZER and may be reused.
+*/
+
+void free_hashoa_table(hashoa_table *table, void (*func)(void *));
+
+#endif /* __CYRUS_HASHOA_H__ */
@@ -145,6 +145,10 @@ static struct cyrusopt_s cyrus_options[] = {
       CFGVAL(long, 1),
       CYRUS_OPT_SWITCH },
 
+    { CYRUSOPT_TWOSKIP_GROUP_COMMIT,
+      CFGVAL(long, 0),
+      CYRUS_OPT_INT },
+
     { CYRUSOPT_LAST, { NULL }, CYRUS_OPT_NOTOPT }
 };
 
@@ -105,6 +105,8 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* Delay twoskip commit syncs by up to this many ms (0) */
+    CYRUSOPT_TWOSKIP_GROUP_COMMIT,
 
     CYRUSOPT_LAST
 
@@ -49,13 +49,8 @@
 
 #include "cyr_lock.h"
 
-#include <syslog.h>
-#include <time.h>
-
 EXPORTED const char *lock_method_desc = "fcntl";
 
-EXPORTED double debug_locks_longer_than = 0.0;
-
 /*
  * Block until we obtain an exclusive lock on the file descriptor 'fd',
  * opened for reading and writing on the file named 'filename'.  If
@@ -79,9 +74,8 @@ EXPORTED int lock_reopen_ex(int fd, const char *filename,
     struct stat sbuffile, sbufspare;
     int newfd;
     struct timeval starttime;
-    if (debug_locks_longer_than)
-        gettimeofday(&starttime, 0);
 
+    lock_stats_begin(&starttime);
 
     if (!sbuf) sbuf = &sbufspare;
 
@@ -106,14 +100,7 @@ EXPORTED int lock_reopen_ex(int fd, const char *filename,
         }
 
         if (sbuf->st_ino == sbuffile.st_ino) {
-            if (debug_locks_longer_than) {
-                struct timeval endtime;
-                gettimeofday(&endtime, 0);
-                double locktime = (double)(endtime.tv_sec - starttime.tv_sec) +
-                                  (double)(endtime.tv_usec - starttime.tv_usec)/1000000.0;
-                if (locktime > debug_locks_longer_than) /* 10ms */
-                    syslog(LOG_NOTICE, "locktimer: reopen %s (%0.2fs)", filename, locktime);
-            }
+            lock_stats_locked(fd, filename, /*exclusive*/1, &starttime);
             return 0;
         }
 
@@ -147,8 +134,8 @@ EXPORTED int lock_setlock(int fd, int exclusive, int nonblock,
     int type = (exclusive ? F_WRLCK : F_RDLCK);
     int cmd = (nonblock ? F_SETLK : F_SETLKW);
     struct timeval starttime;
-    if (debug_locks_longer_than)
-        gettimeofday(&starttime, 0);
+
+    lock_stats_begin(&starttime);
 
     for (;;) {
         fl.l_type= type;
@@ -157,14 +144,7 @@ EXPORTED int lock_setlock(int fd, int exclusive, int nonblock,
         fl.l_len = 0;
         r = fcntl(fd, cmd, &fl);
         if (r != -1) {
-            if (debug_locks_longer_than) {
-                struct timeval endtime;
-                gettimeofday(&endtime, 0);
-                double locktime = (double)(endtime.tv_sec - starttime.tv_sec) +
-                                  (double)(endtime.tv_usec - starttime.tv_usec)/1000000.0;
-                if (locktime > debug_locks_longer_than)
-                    syslog(LOG_NOTICE, "locktimer: reopen %s (%0.2fs)", filename, locktime);
-            }
+            lock_stats_locked(fd, filename, exclusive, &starttime);
             return 0;
         }
         if (errno == EINTR) continue;
@@ -175,7 +155,7 @@ EXPORTED int lock_setlock(int fd, int exclusive, int nonblock,
 /*
  * Release any lock on 'fd'.  Always returns success.
  */
-EXPORTED int lock_unlock(int fd, const char *filename __attribute__((unused)))
+EXPORTED int lock_unlock(int fd, const char *filename)
 {
     struct flock fl;
     int r;
@@ -187,7 +167,10 @@ EXPORTED int lock_unlock(int fd, const char *filename __attribute__((unused)))
 
     for (;;) {
         r = fcntl(fd, F_SETLKW, &fl);
-        if (r != -1) return 0;
+        if (r != -1) {
+            lock_stats_unlocked(fd, filename);
+            return 0;
+        }
         if (errno == EINTR) continue;
         /* xxx help! */
         return -1;
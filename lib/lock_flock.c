@@ -74,6 +74,9 @@ EXPORTED int lock_reopen_ex(int fd, const char *filename,
     int r;
     struct stat sbuffile, sbufspare;
     int newfd;
+    struct timeval starttime;
+
+    lock_stats_begin(&starttime);
 
     if (!sbuf) sbuf = &sbufspare;
 
@@ -93,7 +96,10 @@ EXPORTED int lock_reopen_ex(int fd, const char *filename,
             return -1;
         }
 
-        if (sbuf->st_ino == sbuffile.st_ino) return 0;
+        if (sbuf->st_ino == sbuffile.st_ino) {
+            lock_stats_locked(fd, filename, /*exclusive*/1, &starttime);
+            return 0;
+        }
 
         if (changed) *changed = 1;
 
@@ -118,15 +124,21 @@ EXPORTED int lock_reopen_ex(int fd, const char *filename,
  * appropriate error code.
  */
 EXPORTED int lock_setlock(int fd, int exclusive, int nonblock,
-                          const char *filename __attribute__((unused)))
+                          const char *filename)
 {
     int r;
     int op = (exclusive ? LOCK_EX : LOCK_SH);
+    struct timeval starttime;
     if (nonblock) op |= LOCK_NB;
 
+    lock_stats_begin(&starttime);
+
     for (;;) {
         r = flock(fd, op);
-        if (r != -1) return 0;
+        if (r != -1) {
+            lock_stats_locked(fd, filename, exclusive, &starttime);
+            return 0;
+        }
         if (errno == EINTR) continue;
         return -1;
     }
@@ -135,13 +147,16 @@ EXPORTED int lock_setlock(int fd, int exclusive, int nonblock,
 /*
  * Release any lock on 'fd'.  Always returns success.
  */
-EXPORTED int lock_unlock(int fd, const char *filename __attribute__((unused)))
+EXPORTED int lock_unlock(int fd, const char *filename)
 {
     int r;
 
     for (;;) {
         r = flock(fd, LOCK_UN);
-        if (r != -1) return 0;
+        if (r != -1) {
+            lock_stats_unlocked(fd, filename);
+            return 0;
+        }
         if (errno == EINTR) continue;
         /* xxx help! */
         return -1;
@@ -0,0 +1,150 @@
+/* lock_stats.c -- timing of file locks, shared by the lock backends
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <string.h>
+
+#include "cyr_lock.h"
+#include "xmalloc.h"
+
+EXPORTED double debug_locks_longer_than = 0.0;
+
+static lock_stats_cb_t *lock_stats_cb = NULL;
+
+/* the locks we are timing, indexed by fd */
+struct lock_timer {
+    struct timeval locked;
+    double waited;
+    int exclusive;
+    int held;
+};
+
+static struct lock_timer *lock_timers = NULL;
+static int lock_timers_alloc = 0;
+
+static double timesub(const struct timeval *start, const struct timeval *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_usec - start->tv_usec)/1000000.0;
+}
+
+/*
+ * Register 'cb' to be called each time a timed lock is released,
+ * with how long we waited for it and how long we held it.  NULL
+ * turns the callback off again.
+ */
+EXPORTED void lock_set_stats_cb(lock_stats_cb_t *cb)
+{
+    lock_stats_cb = cb;
+}
+
+/*
+ * Note the time before trying to take a lock, if anyone is interested.
+ */
+HIDDEN void lock_stats_begin(struct timeval *start)
+{
+    if (debug_locks_longer_than || lock_stats_cb)
+        gettimeofday(start, NULL);
+    else
+        timerclear(start);
+}
+
+/*
+ * We now hold a lock on 'fd', having started to wait for it at 'start'.
+ */
+HIDDEN void lock_stats_locked(int fd, const char *filename, int exclusive,
+                              const struct timeval *start)
+{
+    struct timeval now;
+    struct lock_timer *timer;
+    double waited;
+
+    if (!timerisset(start) || fd < 0) return;
+
+    gettimeofday(&now, NULL);
+    waited = timesub(start, &now);
+
+    if (debug_locks_longer_than && waited > debug_locks_longer_than)
+        syslog(LOG_NOTICE, "locktimer: wait %s (%0.2fs)",
+               filename ? filename : "(unknown)", waited);
+
+    if (fd >= lock_timers_alloc) {
+        int n = fd + 16;
+        lock_timers = xrealloc(lock_timers, n * sizeof(struct lock_timer));
+        memset(lock_timers + lock_timers_alloc, 0,
+               (n - lock_timers_alloc) * sizeof(struct lock_timer));
+        lock_timers_alloc = n;
+    }
+
+    timer = &lock_timers[fd];
+    timer->locked = now;
+    timer->waited = waited;
+    timer->exclusive = exclusive;
+    timer->held = 1;
+}
+
+/*
+ * We have released the lock on 'fd'.
+ */
+HIDDEN void lock_stats_unlocked(int fd, const char *filename)
+{
+    struct timeval now;
+    struct lock_timer *timer;
+    double held;
+
+    if (fd < 0 || fd >= lock_timers_alloc || !lock_timers[fd].held) return;
+
+    timer = &lock_timers[fd];
+    timer->held = 0;
+
+    gettimeofday(&now, NULL);
+    held = timesub(&timer->locked, &now);
+
+    if (debug_locks_longer_than && held > debug_locks_longer_than)
+        syslog(LOG_NOTICE, "locktimer: held %s (%0.2fs)",
+               filename ? filename : "(unknown)", held);
+
+    if (lock_stats_cb)
+        lock_stats_cb(filename, timer->exclusive, timer->waited, held);
+}
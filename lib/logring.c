@@ -0,0 +1,555 @@
+/* logring.c -- asynchronous log file writes through a collector process
+ *
+ * Copyright (c) 1994-2026 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* The serving process appends records to a ring in an anonymous
+ * shared mapping and only ever advances 'head'; the collector, forked
+ * when the ring is set up, writes the records out and only ever
+ * advances 'tail'.  Neither takes a lock.  The descriptors themselves
+ * are passed over a socketpair, which also carries wakeups for a
+ * collector that went to sleep on an empty ring.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "logring.h"
+#include "xmalloc.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define LOGRING_ALIGN(n) (((n) + 7) & ~((size_t) 7))
+#define LOGRING_SYNC_WAIT 5000      /* ms to wait for the collector */
+
+struct logring_shm {
+    uint64_t head;                  /* written by the serving process */
+    uint64_t tail;                  /* written by the collector */
+    uint32_t sleeping;              /* collector is waiting for a wakeup */
+    uint32_t pad;
+    char data[];
+};
+
+/* a record in the ring, followed by 'len' bytes padded to 8.
+ * id 0 skips to the end of the ring; len 0 releases the id */
+struct logring_rec {
+    uint32_t id;
+    uint32_t len;
+};
+
+enum {
+    LOGRING_MSG_WAKE = 1,
+    LOGRING_MSG_REGISTER
+};
+
+struct logring_msg {
+    uint32_t type;
+    uint32_t id;
+};
+
+struct logring_log {
+    int fd;
+    uint32_t id;
+    uint64_t dropped;
+};
+
+static struct {
+    struct logring_shm *shm;
+    size_t size;                    /* of shm->data */
+    pid_t pid;                      /* process which owns the ring */
+    int sock;
+    uint32_t nextid;
+    struct logring_log *logs;
+    int nlogs;
+    int alloc;
+} ring = { NULL, 0, 0, -1, 0, NULL, 0, 0 };
+
+static int logring_active(void)
+{
+    /* a forked child must not write into its parent's ring */
+    return ring.shm && ring.pid == getpid();
+}
+
+static struct logring_log *logring_find(int fd)
+{
+    int i;
+
+    for (i = 0; i < ring.nlogs; i++) {
+        if (ring.logs[i].fd == fd) return &ring.logs[i];
+    }
+
+    return NULL;
+}
+
+static int logring_sendmsg(uint32_t type, uint32_t id, int fd)
+{
+    struct logring_msg msg = { type, id };
+    struct msghdr mh;
+    struct iovec iov;
+    union {
+        struct cmsghdr cm;
+        char control[CMSG_SPACE(sizeof(int))];
+    } cmsgu;
+    struct cmsghdr *cmsg;
+    int flags = MSG_NOSIGNAL;
+
+    iov.iov_base = (void *) &msg;
+    iov.iov_len = sizeof(msg);
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        mh.msg_control = cmsgu.control;
+        mh.msg_controllen = sizeof(cmsgu.control);
+
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    else {
+        /* wakeups are only a hint */
+        flags |= MSG_DONTWAIT;
+    }
+
+    return sendmsg(ring.sock, &mh, flags) == -1 ? -1 : 0;
+}
+
+static void logring_wake(void)
+{
+    if (__atomic_exchange_n(&ring.shm->sleeping, 0, __ATOMIC_SEQ_CST))
+        logring_sendmsg(LOGRING_MSG_WAKE, 0, -1);
+}
+
+/* append one record, or fail without waiting if there's no room */
+static int logring_put(uint32_t id, const void *buf, uint32_t len)
+{
+    struct logring_shm *shm = ring.shm;
+    uint64_t head = shm->head;
+    uint64_t tail = __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE);
+    size_t off = head % ring.size;
+    size_t need = sizeof(struct logring_rec) + LOGRING_ALIGN(len);
+    size_t skip = 0;
+    struct logring_rec *rec;
+
+    /* records are never split across the end of the ring */
+    if (off + need > ring.size) skip = ring.size - off;
+
+    if (head + skip + need - tail > ring.size) return -1;
+
+    if (skip) {
+        rec = (struct logring_rec *) (shm->data + off);
+        rec->id = 0;
+        rec->len = skip - sizeof(struct logring_rec);
+        head += skip;
+        off = 0;
+    }
+
+    rec = (struct logring_rec *) (shm->data + off);
+    rec->id = id;
+    rec->len = len;
+    if (len) memcpy(rec + 1, buf, len);
+
+    __atomic_store_n(&shm->head, head + need, __ATOMIC_SEQ_CST);
+    logring_wake();
+
+    return 0;
+}
+
+/*
+ * Collector process
+ */
+
+struct collector_log {
+    uint32_t id;
+    int fd;
+};
+
+static struct {
+    struct collector_log *logs;
+    int nlogs;
+    int alloc;
+    int eof;
+} collector = { NULL, 0, 0, 0 };
+
+static struct collector_log *collector_find(uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < collector.nlogs; i++) {
+        if (collector.logs[i].id == id) return &collector.logs[i];
+    }
+
+    return NULL;
+}
+
+/* read one message from the serving process, blocking if 'wait' */
+static void collector_recv(int wait)
+{
+    struct logring_msg msg;
+    struct msghdr mh;
+    struct iovec iov;
+    union {
+        struct cmsghdr cm;
+        char control[CMSG_SPACE(sizeof(int))];
+    } cmsgu;
+    struct cmsghdr *cmsg;
+    int fd = -1;
+    ssize_t n;
+
+    iov.iov_base = (void *) &msg;
+    iov.iov_len = sizeof(msg);
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cmsgu.control;
+    mh.msg_controllen = sizeof(cmsgu.control);
+
+    do {
+        n = recvmsg(ring.sock, &mh, wait ? 0 : MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        /* the serving process has gone away */
+        collector.eof = 1;
+        return;
+    }
+    if (n != sizeof(msg)) return;
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if (msg.type == LOGRING_MSG_REGISTER && fd >= 0) {
+        if (collector.nlogs == collector.alloc) {
+            collector.alloc += 8;
+            collector.logs = xrealloc(collector.logs,
+                                      collector.alloc * sizeof(struct collector_log));
+        }
+        collector.logs[collector.nlogs].id = msg.id;
+        collector.logs[collector.nlogs].fd = fd;
+        collector.nlogs++;
+    }
+    else if (fd >= 0) close(fd);
+}
+
+static void collector_write(const struct logring_rec *rec)
+{
+    struct collector_log *log = collector_find(rec->id);
+    const char *ptr = (const char *) (rec + 1);
+    size_t left = rec->len;
+    ssize_t n;
+
+    /* the descriptor is sent before any record which uses it,
+     * but the two travel separately */
+    while (!log && !collector.eof) {
+        collector_recv(/*wait*/1);
+        log = collector_find(rec->id);
+    }
+    if (!log) return;
+
+    if (!rec->len) {
+        /* released */
+        close(log->fd);
+        *log = collector.logs[--collector.nlogs];
+        return;
+    }
+
+    while (left) {
+        n = write(log->fd, ptr, left);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "IOERROR: writing log: %m");
+            break;
+        }
+        ptr += n;
+        left -= n;
+    }
+}
+
+static void collector_run(void) __attribute__((noreturn));
+static void collector_run(void)
+{
+    struct logring_shm *shm = ring.shm;
+    struct pollfd pfd;
+
+    pfd.fd = ring.sock;
+    pfd.events = POLLIN;
+
+    for (;;) {
+        uint64_t tail = shm->tail;
+        uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+
+        while (tail != head) {
+            const struct logring_rec *rec =
+                (const struct logring_rec *) (shm->data + tail % ring.size);
+
+            if (rec->id) collector_write(rec);
+
+            tail += sizeof(struct logring_rec) + LOGRING_ALIGN(rec->len);
+            __atomic_store_n(&shm->tail, tail, __ATOMIC_RELEASE);
+        }
+
+        /* pick up descriptors and wakeups which arrived meanwhile */
+        collector_recv(/*wait*/0);
+
+        __atomic_store_n(&shm->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&shm->head, __ATOMIC_SEQ_CST) != tail) {
+            shm->sleeping = 0;
+            continue;
+        }
+
+        if (collector.eof) break;
+
+        /* the timeout only covers a lost wakeup */
+        if (poll(&pfd, 1, 1000) > 0)
+            collector_recv(/*wait*/0);
+    }
+
+    _exit(0);
+}
+
+static void collector_start(int sock)
+{
+    int fd, nfds = getdtablesize();
+
+    /* don't hold the serving process's connections open */
+    for (fd = 0; fd < nfds; fd++) {
+        if (fd != sock) close(fd);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+
+    ring.sock = sock;
+    collector_run();
+}
+
+/*
+ * Serving process
+ */
+
+EXPORTED int logring_init(size_t size)
+{
+    int sv[2];
+    pid_t pid;
+    void *shm;
+
+    if (logring_active()) return 0;
+
+    if (ring.shm) {
+        /* inherited from our parent; leave it to them */
+        munmap(ring.shm, sizeof(struct logring_shm) + ring.size);
+        if (ring.sock >= 0) close(ring.sock);
+        free(ring.logs);
+        memset(&ring, 0, sizeof(ring));
+        ring.sock = -1;
+    }
+
+    size &= ~((size_t) 7);
+    if (size < 4096) return -1;
+
+#ifdef MAP_ANONYMOUS
+    shm = mmap(NULL, sizeof(struct logring_shm) + size,
+               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+#else
+    shm = MAP_FAILED;
+    errno = ENOSYS;
+#endif
+    if (shm == MAP_FAILED) {
+        syslog(LOG_ERR, "logring: unable to map %lu bytes: %m",
+               (unsigned long) size);
+        return -1;
+    }
+    memset(shm, 0, sizeof(struct logring_shm));
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+        syslog(LOG_ERR, "logring: socketpair failed: %m");
+        munmap(shm, sizeof(struct logring_shm) + size);
+        return -1;
+    }
+
+    ring.shm = shm;
+    ring.size = size;
+
+    /* fork twice, so that nobody needs to reap the collector;
+     * it exits once we do and it has emptied the ring */
+    pid = fork();
+    if (pid == 0) {
+        if (fork() == 0) collector_start(sv[1]);
+        _exit(0);
+    }
+
+    close(sv[1]);
+
+    if (pid == -1) {
+        syslog(LOG_ERR, "logring: fork failed: %m");
+        close(sv[0]);
+        munmap(shm, sizeof(struct logring_shm) + size);
+        ring.shm = NULL;
+        return -1;
+    }
+
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR);
+
+    (void) fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    ring.sock = sv[0];
+    ring.pid = getpid();
+
+    return 0;
+}
+
+EXPORTED int logring_register(int fd)
+{
+    struct logring_log *log;
+
+    if (!logring_active() || fd < 0) return -1;
+    if (logring_find(fd)) return 0;
+
+    if (logring_sendmsg(LOGRING_MSG_REGISTER, ring.nextid + 1, fd)) {
+        syslog(LOG_ERR, "logring: unable to pass log to collector: %m");
+        return -1;
+    }
+
+    if (ring.nlogs == ring.alloc) {
+        ring.alloc += 8;
+        ring.logs = xrealloc(ring.logs, ring.alloc * sizeof(struct logring_log));
+    }
+    log = &ring.logs[ring.nlogs++];
+    log->fd = fd;
+    log->id = ++ring.nextid;
+    log->dropped = 0;
+
+    return 0;
+}
+
+EXPORTED ssize_t logring_write(int fd, const void *buf, size_t len)
+{
+    struct logring_log *log = logring_active() ? logring_find(fd) : NULL;
+    const char *ptr = buf;
+    size_t left = len;
+
+    if (!log) return write(fd, buf, len);
+
+    /* keep each record well short of the size of the ring */
+    while (left) {
+        size_t n = left < ring.size / 4 ? left : ring.size / 4;
+
+        if (logring_put(log->id, ptr, n)) log->dropped += n;
+        ptr += n;
+        left -= n;
+    }
+
+    return len;
+}
+
+EXPORTED int logring_sync(int fd)
+{
+    uint64_t head;
+    int waited;
+
+    if (!logring_active() || !logring_find(fd)) return 0;
+
+    head = ring.shm->head;
+    logring_sendmsg(LOGRING_MSG_WAKE, 0, -1);
+
+    for (waited = 0; waited < LOGRING_SYNC_WAIT; waited++) {
+        if (__atomic_load_n(&ring.shm->tail, __ATOMIC_ACQUIRE) >= head)
+            return 0;
+        poll(NULL, 0, 1);
+    }
+
+    syslog(LOG_WARNING, "logring: timed out waiting for the collector");
+    return -1;
+}
+
+EXPORTED void logring_release(int fd)
+{
+    struct logring_log *log = logring_active() ? logring_find(fd) : NULL;
+
+    if (!log) return;
+
+    /* the collector leaks its copy if this doesn't get through */
+    if (logring_put(log->id, NULL, 0) &&
+        (logring_sync(fd) || logring_put(log->id, NULL, 0))) {
+        syslog(LOG_ERR, "logring: unable to release log");
+    }
+
+    if (log->dropped) {
+        syslog(LOG_WARNING, "logring: dropped %llu bytes of log data",
+               (unsigned long long) log->dropped);
+    }
+
+    *log = ring.logs[--ring.nlogs];
+}
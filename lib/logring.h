@@ -0,0 +1,75 @@
+/* logring.h -- asynchronous log file writes through a collector process
+ *
+ * Copyright (c) 1994-2026 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef INCLUDED_LOGRING_H
+#define INCLUDED_LOGRING_H
+
+#include <sys/types.h>
+
+/* Protocol logs are written by a collector process, fed through a
+ * single-producer ring of shared memory, so that a serving process
+ * never waits on the disk (or on the collector) to log a busy session.
+ * The ring is per process and must only be written by one thread. */
+
+/* Set up a ring of 'size' bytes and fork its collector.  Returns 0 if
+ * the ring is usable; otherwise every log stays synchronous. */
+int logring_init(size_t size);
+
+/* Hand a copy of 'fd' to the collector, so that writes made through
+ * logring_write() on it are queued.  The caller keeps 'fd'. */
+int logring_register(int fd);
+
+/* Queue 'len' bytes for 'fd', or write() them there and then if 'fd'
+ * isn't registered.  If the ring is full, the data is dropped (and
+ * counted), never waited for. */
+ssize_t logring_write(int fd, const void *buf, size_t len);
+
+/* Wait until the collector has written everything queued so far,
+ * e.g. before rewriting the end of the file through 'fd' */
+int logring_sync(int fd);
+
+/* Stop queueing for 'fd'.  The collector closes its copy once everything
+ * queued before has been written; the caller still closes 'fd'. */
+void logring_release(int fd);
+
+#endif /* INCLUDED_LOGRING_H */
@@ -288,7 +288,7 @@ EXPORTED int mappedfile_commit(struct mappedfile *mf)
 {
     assert(mf->fd != -1);
 
-    if (!mf->dirty)
+    if (!mf->dirty && !mf->sync_pending)
         return 0; /* nice, nothing to do */
 
     assert(mf->is_rw);
@@ -308,10 +308,24 @@ EXPORTED int mappedfile_commit(struct mappedfile *mf)
 
     mf->dirty = 0;
     mf->was_resized = 0;
+    mf->sync_pending = 0;
 
     return 0;
 }
 
+/* treat everything written so far as committed, but leave the sync
+ * for a later mappedfile_commit().  The lock may be released meanwhile */
+EXPORTED void mappedfile_defer_commit(struct mappedfile *mf)
+{
+    assert(mf->fd != -1);
+
+    if (!mf->dirty)
+        return;
+
+    mf->sync_pending = 1;
+    mf->dirty = 0;
+}
+
 EXPORTED ssize_t mappedfile_pwrite(struct mappedfile *mf,
                                    const void *base, size_t len,
                                    off_t offset)
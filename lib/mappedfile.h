@@ -62,6 +62,7 @@ struct mappedfile {
     int lock_status;
     int dirty;
     int was_resized;
+    int sync_pending;
     int is_rw;
 
     struct timeval starttime;
@@ -83,6 +84,7 @@ extern int mappedfile_writelock(struct mappedfile *mf);
 extern int mappedfile_unlock(struct mappedfile *mf);
 
 extern int mappedfile_commit(struct mappedfile *mf);
+extern void mappedfile_defer_commit(struct mappedfile *mf);
 extern ssize_t mappedfile_pwrite(struct mappedfile *mf,
                                  const void *base, size_t len,
                                  off_t offset);
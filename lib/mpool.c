@@ -50,6 +50,7 @@
 #include <string.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "mpool.h"
 #include "xmalloc.h"
@@ -58,6 +59,7 @@
 struct mpool
 {
     struct mpool_blob *blob;
+    struct mpool_stats stats;
 };
 
 struct mpool_blob
@@ -84,50 +86,85 @@ static struct mpool_blob *new_mpool_blob(size_t size)
 /* Create a new pool */
 EXPORTED struct mpool *new_mpool(size_t size)
 {
-    struct mpool *ret = xmalloc(sizeof(struct mpool));
+    struct mpool *ret = xzmalloc(sizeof(struct mpool));
 
     ret->blob = new_mpool_blob(size);
+    ret->stats.blobs = 1;
+    ret->stats.capacity = ret->blob->size;
 
     return ret;
 }
 
+static void free_blobs(struct mpool_blob *p)
+{
+    struct mpool_blob *p_next;
+
+    while(p) {
+        p_next = p->next;
+        free(p->base);
+        free(p);
+        p = p_next;
+    }
+}
+
 /* Free a pool */
 EXPORTED void free_mpool(struct mpool *pool)
 {
-    struct mpool_blob *p, *p_next;
-
     if (!pool) return;
     if (!pool->blob) {
         fatal("memory pool without a blob", EC_TEMPFAIL);
         return;
     }
 
-    p = pool->blob;
+    free_blobs(pool->blob);
 
-    while(p) {
-        p_next = p->next;
-        free(p->base);
-        free(p);
-        p = p_next;
+    free(pool);
+}
+
+/*
+ * Forget everything allocated from the pool without giving its memory
+ * back.  If the pool had to grow, its blobs are merged into one of the
+ * combined size, so a pool reset once per unit of work soon settles on
+ * a single blob and stops calling malloc at all.
+ */
+EXPORTED void mpool_reset(struct mpool *pool)
+{
+    if (!pool || !pool->blob) {
+        fatal("mpool_reset called without a valid pool", EC_TEMPFAIL);
     }
 
-    free(pool);
+    if (pool->blob->next) {
+        free_blobs(pool->blob);
+        pool->blob = new_mpool_blob(pool->stats.capacity);
+    }
+    pool->blob->ptr = pool->blob->base;
+
+    pool->stats.blobs = 1;
+    pool->stats.capacity = pool->blob->size;
+    pool->stats.allocs = 0;
+    pool->stats.used = 0;
+    pool->stats.resets++;
+}
+
+EXPORTED void mpool_getstats(const struct mpool *pool,
+                             struct mpool_stats *stats)
+{
+    *stats = pool->stats;
 }
 
 #ifdef ROUNDUP
 #undef ROUNDUP
 #endif
 
-/* round up to the next multiple of 16 bytes if necessary */
-/* 0xFF...FFF0 = ~0 ^ 0xF */
-#define ROUNDUP(num) (((num) + 15) & (~((unsigned long) 0x0) ^ 0xF))
+/* round up to the next multiple of MPOOL_ALIGN bytes if necessary */
+#define ROUNDUP(num) (((num) + (MPOOL_ALIGN-1)) & ~((uintptr_t) (MPOOL_ALIGN-1)))
 
 /* Allocate from a pool */
 EXPORTED void *mpool_malloc(struct mpool *pool, size_t size)
 {
     void *ret = NULL;
     struct mpool_blob *p;
-    size_t remain;
+    unsigned char *start;
 
     if(!pool || !pool->blob) {
         fatal("mpool_malloc called without a valid pool", EC_TEMPFAIL);
@@ -139,28 +176,31 @@ EXPORTED void *mpool_malloc(struct mpool *pool, size_t size)
 
     p = pool->blob;
 
-    /* This is a bit tricky, not only do we have to make sure that the current
-     * pool has enough room, we need to be sure that we haven't rounded p->ptr
-     * outside of the current pool anyway */
-
-    remain = p->size - ((char *)p->ptr - (char *)p->base);
+    /* align the absolute address, not the offset into the blob, so
+     * the result is suitable for any type whatever malloc gave us */
+    start = (unsigned char *) ROUNDUP((uintptr_t) p->ptr);
 
-    if (remain < size ||
-        (char *) p->ptr > (p->size + (char *) p->base)) {
+    if (start > p->base + p->size ||
+        (size_t) (p->base + p->size - start) < size) {
         /* Need a new pool */
         struct mpool_blob *new_pool;
         size_t new_pool_size = 2 * ((size > p->size) ? size : p->size);
 
-        new_pool = new_mpool_blob(new_pool_size);
+        /* leave room to align the start of the new blob */
+        new_pool = new_mpool_blob(new_pool_size + MPOOL_ALIGN);
         new_pool->next = p;
         p = pool->blob = new_pool;
+        pool->stats.blobs++;
+        pool->stats.capacity += p->size;
+
+        start = (unsigned char *) ROUNDUP((uintptr_t) p->ptr);
     }
 
-    ret = p->ptr;
+    ret = start;
+    p->ptr = start + size;
 
-    /* make sure that the next thing we allocate is align on
-       a ROUNDUP boundary */
-    p->ptr = p->base + ROUNDUP(p->ptr - p->base + size);
+    pool->stats.allocs++;
+    pool->stats.used += size;
 
     return ret;
 }
@@ -41,6 +41,7 @@
  */
 
 #ifndef _MPOOL_H_
+#define _MPOOL_H_
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -56,6 +57,17 @@ struct mpool;
 
 #define DEFAULT_MPOOL_SIZE 32768
 
+/* Every allocation is aligned to at least this many bytes */
+#define MPOOL_ALIGN 16
+
+struct mpool_stats {
+    size_t blobs;       /* blobs currently held */
+    size_t capacity;    /* total bytes in those blobs */
+    size_t allocs;      /* allocations since the last reset */
+    size_t used;        /* bytes requested since the last reset */
+    size_t resets;      /* number of times mpool_reset was called */
+};
+
 /* Create a new pool -- pass zero for default */
 /* 'size' is the size of the first blob of memory that will be allocated */
 struct mpool *new_mpool(size_t size);
@@ -63,6 +75,13 @@ struct mpool *new_mpool(size_t size);
 /* Free a pool */
 void free_mpool(struct mpool *pool);
 
+/* Release everything allocated from a pool, but keep its memory
+ * for reuse.  Pointers previously returned by the pool are invalid */
+void mpool_reset(struct mpool *pool);
+
+/* Report on the pool's memory use */
+void mpool_getstats(const struct mpool *pool, struct mpool_stats *stats);
+
 /* Allocate from a pool */
 void *mpool_malloc(struct mpool *pool, size_t size);
 char *mpool_strdup(struct mpool *pool, const char *str);
@@ -0,0 +1,215 @@
+/* nameindex.c -- sorted in-memory index of hierarchical names
+ *
+ * Copyright (c) 2018 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "assert.h"
+#include "nameindex.h"
+#include "xmalloc.h"
+
+EXPORTED struct nameindex *nameindex_new(char sep,
+                                         int (*compar)(const char *, int,
+                                                       const char *, int))
+{
+    struct nameindex *ni = xzmalloc(sizeof(struct nameindex));
+
+    ni->sep = sep;
+    ni->compar = compar;
+
+    return ni;
+}
+
+EXPORTED void nameindex_free(struct nameindex **nip)
+{
+    struct nameindex *ni = *nip;
+
+    if (!ni) return;
+
+    buf_free(&ni->names);
+    free(ni->offsets);
+    free(ni);
+
+    *nip = NULL;
+}
+
+EXPORTED void nameindex_add(struct nameindex *ni, const char *name, size_t len)
+{
+    if (ni->count == ni->alloc) {
+        ni->alloc = ni->alloc ? ni->alloc * 2 : 1024;
+        ni->offsets = xrealloc(ni->offsets, ni->alloc * sizeof(uint32_t));
+    }
+
+    assert(buf_len(&ni->names) + len < UINT32_MAX);
+
+    ni->offsets[ni->count++] = buf_len(&ni->names);
+    buf_appendmap(&ni->names, name, len);
+    buf_putc(&ni->names, '\0');
+}
+
+EXPORTED size_t nameindex_count(const struct nameindex *ni)
+{
+    return ni->count;
+}
+
+EXPORTED const char *nameindex_name(const struct nameindex *ni, size_t i)
+{
+    assert(i < ni->count);
+    return ni->names.s + ni->offsets[i];
+}
+
+static size_t nameindex_namelen(const struct nameindex *ni, size_t i)
+{
+    size_t end = (i + 1 < ni->count) ? ni->offsets[i+1] : buf_len(&ni->names);
+
+    return end - ni->offsets[i] - 1;
+}
+
+EXPORTED size_t nameindex_lowerbound(const struct nameindex *ni,
+                                     const char *prefix, size_t len)
+{
+    size_t lo = 0, hi = ni->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ni->compar(nameindex_name(ni, mid), nameindex_namelen(ni, mid),
+                       prefix, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static int hasprefix(const struct nameindex *ni, size_t i,
+                     const char *prefix, size_t len)
+{
+    return nameindex_namelen(ni, i) >= len &&
+           !memcmp(nameindex_name(ni, i), prefix, len);
+}
+
+EXPORTED void nameindex_prefixrange(const struct nameindex *ni,
+                                    const char *prefix, size_t len,
+                                    size_t *startp, size_t *endp)
+{
+    size_t lo = nameindex_lowerbound(ni, prefix, len);
+    size_t hi = ni->count;
+
+    *startp = lo;
+
+    /* names with the prefix are contiguous, so find where they stop */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (hasprefix(ni, mid, prefix, len))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *endp = lo;
+}
+
+struct skiprange {
+    size_t start;
+    size_t end;
+};
+
+EXPORTED int nameindex_foreach(const struct nameindex *ni,
+                               const char *prefix, size_t len,
+                               nameindex_proc_t *proc, void *rock)
+{
+    struct skiprange *skips = NULL;
+    size_t nskips = 0, allocskips = 0;
+    struct buf child = BUF_INITIALIZER;
+    size_t i, end;
+    int r = 0;
+
+    nameindex_prefixrange(ni, prefix, len, &i, &end);
+
+    while (i < end) {
+        const char *name = nameindex_name(ni, i);
+        size_t namelen = nameindex_namelen(ni, i);
+        int prune = 0;
+
+        r = proc(name, namelen, &prune, rock);
+        if (r) break;
+
+        i++;
+
+        if (prune) {
+            struct skiprange *s;
+
+            if (nskips == allocskips) {
+                allocskips = allocskips ? allocskips * 2 : 16;
+                skips = xrealloc(skips, allocskips * sizeof(struct skiprange));
+            }
+            s = &skips[nskips++];
+
+            buf_setmap(&child, name, namelen);
+            buf_putc(&child, ni->sep);
+            nameindex_prefixrange(ni, buf_base(&child), buf_len(&child),
+                                  &s->start, &s->end);
+            /* an empty subtree */
+            if (s->start == s->end) nskips--;
+        }
+
+        /* Depending on the sort order, names that are not children can
+         * sort between a name and its first child (e.g. "a-b" between
+         * "a" and "a.b"), so the subtrees are skipped when we reach
+         * them.  Any subtree pruned later starts before those pruned
+         * earlier, so they form a stack. */
+        while (nskips && i >= skips[nskips-1].start) {
+            if (i < skips[nskips-1].end) i = skips[nskips-1].end;
+            nskips--;
+        }
+    }
+
+    buf_free(&child);
+    free(skips);
+
+    return r;
+}
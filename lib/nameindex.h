@@ -0,0 +1,102 @@
+/* nameindex.h -- sorted in-memory index of hierarchical names
+ *
+ * Copyright (c) 2018 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_NAMEINDEX_H__
+#define __CYRUS_NAMEINDEX_H__
+
+#include <stddef.h>           /* For size_t */
+#include <stdint.h>           /* For uint32_t */
+
+#include "util.h"
+
+/*
+** A compact, read-only copy of a sorted set of hierarchical names
+** (all of them sharing one string buffer), which can be walked in
+** the original order while skipping whole subtrees.  A name's
+** subtree is every name that starts with it plus the separator.
+**
+** Names must be added in increasing order under 'compar', which must
+** be the comparator of the database they come from; any comparator
+** that orders strings character by character will do.
+*/
+
+struct nameindex {
+    char sep;
+    int (*compar)(const char *, int, const char *, int);
+    struct buf names;       /* every name, each NUL terminated */
+    uint32_t *offsets;      /* start of each name in 'names' */
+    size_t count;
+    size_t alloc;
+};
+
+extern struct nameindex *nameindex_new(char sep,
+                                       int (*compar)(const char *, int,
+                                                     const char *, int));
+extern void nameindex_free(struct nameindex **nip);
+
+extern void nameindex_add(struct nameindex *ni, const char *name, size_t len);
+
+extern size_t nameindex_count(const struct nameindex *ni);
+extern const char *nameindex_name(const struct nameindex *ni, size_t i);
+
+/* index of the first name not less than 'prefix' */
+extern size_t nameindex_lowerbound(const struct nameindex *ni,
+                                   const char *prefix, size_t len);
+
+/* range [*startp, *endp) of all names that start with 'prefix' */
+extern void nameindex_prefixrange(const struct nameindex *ni,
+                                  const char *prefix, size_t len,
+                                  size_t *startp, size_t *endp);
+
+/*
+** Calls 'proc' in order for each name starting with 'prefix'.  If
+** 'proc' sets *prunep, none of that name's descendants are visited.
+** If 'proc' returns non-zero, the walk stops and returns that value.
+*/
+typedef int nameindex_proc_t(const char *name, size_t len,
+                             int *prunep, void *rock);
+
+extern int nameindex_foreach(const struct nameindex *ni,
+                             const char *prefix, size_t len,
+                             nameindex_proc_t *proc, void *rock);
+
+#endif /* __CYRUS_NAMEINDEX_H__ */
@@ -52,31 +52,35 @@
 static const char unknown_user[] = "unknown-user";
 static const char unspecified_domain[] = "unspecified-domain";
 
+/* caller-provided storage for parseaddr_list_inplace() */
+struct parseaddr_slots {
+    struct address *addrs;
+    int max;
+    int count;
+};
+
 static void parseaddr_append(struct address ***addrpp, const char *name,
                              const char *route, const char *mailbox,
-                             const char *domain, char **freemep, int invalid);
+                             const char *domain, char **freemep, int invalid,
+                             struct parseaddr_slots *slots);
+static int parseaddr_simple(char *s, struct address ***addrpp,
+                            char **freemep, struct parseaddr_slots *slots);
 static int parseaddr_phrase (char **inp, char **phrasep, const char *specials);
 static int parseaddr_domain (char **inp, char **domainp, char **commmentp, int *invalid);
 static int parseaddr_route (char **inp, char **routep);
 
 /*
- * Parse an address list in 's', appending address structures to
- * the list pointed to by 'addrp'.
+ * Parse the (writable) address list in 's', appending to 'addrp'.
+ * The first address takes ownership of '*freemep'.
  */
-EXPORTED void parseaddr_list(const char *str, struct address **addrp)
+static void parseaddr_parse(char *s, struct address **addrp, char **freemep,
+                            struct parseaddr_slots *slots)
 {
-    char *s;
     int ingroup = 0;
-    char *freeme;
     int tok = ' ', invalid = 0;
     char *phrase, *route, *mailbox, *domain, *comment;
 
-    /* Skip down to the tail */
-    while (*addrp) {
-        addrp = &(*addrp)->next;
-    }
-
-    s = freeme = xstrdup(str);
+    if (parseaddr_simple(s, &addrp, freemep, slots)) return;
 
     while (tok) {
         tok = parseaddr_phrase(&s, &phrase, ingroup ? ",@<;" : ",@<:");
@@ -85,24 +89,26 @@ EXPORTED void parseaddr_list(const char *str, struct address **addrp)
         case '\0':
         case ';':
             if (*phrase) {
-                parseaddr_append(&addrp, 0, 0, phrase, "", &freeme, invalid);
+                parseaddr_append(&addrp, 0, 0, phrase, "",
+                                 freemep, invalid, slots);
             }
             if (tok == ';') {
-                parseaddr_append(&addrp, 0, 0, 0, 0, &freeme, invalid);
+                parseaddr_append(&addrp, 0, 0, 0, 0, freemep, invalid, slots);
                 ingroup = 0;
             }
             continue;
 
         case ':':
-            parseaddr_append(&addrp, 0, 0, phrase, 0, &freeme, invalid);
+            parseaddr_append(&addrp, 0, 0, phrase, 0, freemep, invalid, slots);
             ingroup++;
             continue;
 
         case '@':
             tok = parseaddr_domain(&s, &domain, &comment, &invalid);
-            parseaddr_append(&addrp, comment, 0, phrase, domain, &freeme, invalid);
+            parseaddr_append(&addrp, comment, 0, phrase, domain,
+                             freemep, invalid, slots);
             if (tok == ';') {
-                parseaddr_append(&addrp, 0, 0, 0, 0, &freeme, invalid);
+                parseaddr_append(&addrp, 0, 0, 0, 0, freemep, invalid, slots);
                 ingroup = 0;
             }
             continue;
@@ -115,33 +121,63 @@ EXPORTED void parseaddr_list(const char *str, struct address **addrp)
                     *--s = '@';
                     tok = parseaddr_route(&s, &route);
                     if (tok != ':') {
-                        parseaddr_append(&addrp, phrase, route, "", "", &freeme, invalid);
+                        parseaddr_append(&addrp, phrase, route, "", "",
+                                         freemep, invalid, slots);
                         while (tok && tok != '>') tok = *s++;
                         continue;
                     }
                     tok = parseaddr_phrase(&s, &mailbox, "@>");
                     if (tok != '@') {
                         parseaddr_append(&addrp, phrase, route, mailbox, "",
-                                         &freeme, invalid);
+                                         freemep, invalid, slots);
                         continue;
                     }
                 }
                 tok = parseaddr_domain(&s, &domain, 0, &invalid);
                 parseaddr_append(&addrp, phrase, route, mailbox, domain,
-                                 &freeme, invalid);
+                                 freemep, invalid, slots);
                 while (tok && tok != '>') tok = *s++;
                 continue; /* effectively auto-inserts a comma */
             }
             else {
-                parseaddr_append(&addrp, phrase, 0, mailbox, "", &freeme, invalid);
+                parseaddr_append(&addrp, phrase, 0, mailbox, "",
+                                 freemep, invalid, slots);
             }
         }
     }
-    if (ingroup) parseaddr_append(&addrp, 0, 0, 0, 0, &freeme, invalid);
+    if (ingroup) parseaddr_append(&addrp, 0, 0, 0, 0, freemep, invalid, slots);
+}
+
+/*
+ * Parse an address list in 's', appending address structures to
+ * the list pointed to by 'addrp'.
+ */
+EXPORTED void parseaddr_list(const char *str, struct address **addrp)
+{
+    char *freeme;
+
+    /* Skip down to the tail */
+    while (*addrp) {
+        addrp = &(*addrp)->next;
+    }
+
+    freeme = xstrdup(str);
+    parseaddr_parse(freeme, addrp, &freeme, NULL);
 
     if (freeme) free(freeme);
 }
 
+EXPORTED int parseaddr_list_inplace(char *s, struct address *addrs, int max)
+{
+    struct parseaddr_slots slots = { addrs, max, 0 };
+    struct address *addrlist = NULL;
+    char *freeme = NULL;
+
+    parseaddr_parse(s, &addrlist, &freeme, &slots);
+
+    return slots.count;
+}
+
 /*
  * Free the address list 'addr'
  */
@@ -162,11 +198,17 @@ EXPORTED void parseaddr_free(struct address *addr)
  */
 static void parseaddr_append(struct address ***addrpp, const char *name,
                              const char *route, const char *mailbox,
-                             const char *domain, char **freemep, int invalid)
+                             const char *domain, char **freemep, int invalid,
+                             struct parseaddr_slots *slots)
 {
     struct address *newaddr;
 
-    newaddr = (struct address *)xmalloc(sizeof(struct address));
+    if (slots) {
+        /* count them all, but only store what fits */
+        if (slots->count++ >= slots->max) return;
+        newaddr = &slots->addrs[slots->count - 1];
+    }
+    else newaddr = (struct address *)xmalloc(sizeof(struct address));
     if (name && *name) {
         newaddr->name = name;
     }
@@ -198,6 +240,76 @@ static void parseaddr_append(struct address ***addrpp, const char *name,
     *addrpp = &newaddr->next;
 }
 
+/* Characters which may appear in a "simple" display-name or local-part;
+ * anything else (quotes, comments, escapes, specials, controls) needs the
+ * full parser */
+#define SIMPLE_SPECIALS "\"()<>@,;:\\[]"
+
+static int simple_namechar(unsigned char c)
+{
+    return c >= ' ' && c != 0x7f && !strchr(SIMPLE_SPECIALS, c);
+}
+
+static int simple_localchar(unsigned char c)
+{
+    return c > ' ' && c != 0x7f && !strchr(SIMPLE_SPECIALS, c);
+}
+
+/*
+ * Fast path for a lone "Name <local@domain>", "<local@domain>" or
+ * "local@domain", which is what nearly every From/To header holds.
+ * Only strings that the general parser would return unchanged are
+ * accepted (single spaces, no quoting, comments, folding or odd domain
+ * dots), so the result is identical.  Splits 's' in place and returns 1,
+ * or returns 0 without touching 's'.
+ */
+static int parseaddr_simple(char *s, struct address ***addrpp,
+                            char **freemep, struct parseaddr_slots *slots)
+{
+    char *name = NULL, *lt, *at, *end, *domain, *p;
+
+    while (*s == ' ') s++;
+
+    lt = strchr(s, '<');
+    if (lt) {
+        for (p = s; p < lt; p++) {
+            if (!simple_namechar(*p) || (p[0] == ' ' && p[1] == ' '))
+                return 0;
+        }
+        p = lt + 1;
+    }
+    else p = s;
+
+    /* local-part */
+    for (at = p; simple_localchar(*at); at++);
+    if (at == p || *at != '@') return 0;
+
+    /* domain */
+    for (domain = end = at + 1;
+         Uisalnum(*end) || *end == '-' ||
+             (*end == '.' && end > domain && end[-1] != '.');
+         end++);
+    if (end == domain || end[-1] == '.') return 0;
+
+    /* nothing but spaces may follow */
+    p = end;
+    if (lt && *p++ != '>') return 0;
+    while (*p == ' ') p++;
+    if (*p) return 0;
+
+    if (lt) {
+        for (name = lt; name > s && name[-1] == ' '; name--);
+        *name = '\0';
+        name = s;
+        s = lt + 1;
+    }
+    *at = '\0';
+    *end = '\0';
+
+    parseaddr_append(addrpp, name, 0, s, at + 1, freemep, 0, slots);
+    return 1;
+}
+
 /* Macro to skip white space and rfc822 comments */
 
 #define SKIPWHITESPACE(s) \
@@ -456,9 +568,21 @@ EXPORTED void address_itr_init(struct address_itr *ai, const char *str,
     memset(ai, 0, sizeof(*ai));
     if (!*str && reverse_path) {
         /* Null reverse-path */
-        ai->addrlist = (struct address *)xzmalloc(sizeof(struct address));
+        ai->addrlist = ai->slots;
+    }
+    else {
+        ai->freeme = xstrdup(str);
+        if (parseaddr_list_inplace(ai->freeme, ai->slots,
+                                   ADDRESS_ITR_SLOTS) <= ADDRESS_ITR_SLOTS) {
+            ai->addrlist = ai->slots;
+        }
+        else {
+            /* too many for the slots */
+            free(ai->freeme);
+            ai->freeme = NULL;
+            parseaddr_list(str, &ai->addrlist);
+        }
     }
-    else parseaddr_list(str, &ai->addrlist);
     ai->anext = ai->addrlist;
 }
 
@@ -474,7 +598,8 @@ EXPORTED const struct address *address_itr_next(struct address_itr *ai)
 
 EXPORTED void address_itr_fini(struct address_itr *ai)
 {
-    parseaddr_free(ai->addrlist);
+    if (ai->addrlist != ai->slots) parseaddr_free(ai->addrlist);
+    free(ai->freeme);
     memset(ai, 0, sizeof(*ai));
 }
 
@@ -54,12 +54,25 @@ struct address {
                                    be invalid. */
 };
 
+#define ADDRESS_ITR_SLOTS 8
+
 struct address_itr {
     struct address *addrlist;
     struct address *anext;
+    /* short lists are parsed in place, without any per-address
+       allocation */
+    struct address slots[ADDRESS_ITR_SLOTS];
+    char *freeme;
 };
 
 extern void parseaddr_list(const char *s, struct address **addrp);
+/* Parse the address list in 's', which is modified in place, into the
+ * caller's array 'addrs' of 'max' entries, linked through ->next as
+ * with parseaddr_list().  Nothing is allocated and the addresses point
+ * into 's', so there is nothing to free.  Returns the number of
+ * addresses in 's', which may be more than 'max', in which case only
+ * the first 'max' were stored. */
+extern int parseaddr_list_inplace(char *s, struct address *addrs, int max);
 extern void parseaddr_free(struct address *addr);
 
 extern char *address_get_all(const struct address *, int canon_domain);
@@ -53,6 +53,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SPLICE
+#include <fcntl.h>
+#endif
+#include <poll.h>
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
@@ -61,6 +68,7 @@
 #include "exitcodes.h"
 #include "imparse.h"
 #include "libcyr_cfg.h"
+#include "logring.h"
 #include "map.h"
 #include "nonblock.h"
 #include "prot.h"
@@ -68,6 +76,16 @@
 #include "util.h"
 #include "xmalloc.h"
 
+/* Kernel TLS (OpenSSL 3): once the kernel owns the send side of the
+ * record layer, SSL_write() is a plain write() and SSL_sendfile() works */
+#if defined(HAVE_SSL) && defined(BIO_get_ktls_send) && !defined(OPENSSL_NO_KTLS)
+#define PROT_KTLS_SEND(ssl) BIO_get_ktls_send(SSL_get_wbio(ssl))
+#define PROT_KTLS_SENDFILE(ssl, fd, off, len) SSL_sendfile(ssl, fd, off, len, 0)
+#else
+#define PROT_KTLS_SEND(ssl) 0
+#define PROT_KTLS_SENDFILE(ssl, fd, off, len) (errno = ENOSYS, -1)
+#endif
+
 /* Transparent protgroup structure */
 struct protgroup
 {
@@ -194,6 +212,11 @@ EXPORTED int prot_free(struct protstream *s)
     }
     if (s->zbuf) free(s->zbuf);
 #endif
+#ifdef HAVE_ZSTD
+    if (s->zstd_cctx) ZSTD_freeCCtx(s->zstd_cctx);
+    if (s->zstd_dctx) ZSTD_freeDCtx(s->zstd_dctx);
+    if (s->zstdbuf) free(s->zstdbuf);
+#endif
 
     free(s);
 
@@ -417,21 +440,6 @@ error:
     return EOF;
 }
 
-EXPORTED void prot_unsetcompress(struct protstream *s)
-{
-    if (s->zstrm) {
-        if (s->write) deflateEnd(s->zstrm);
-        else inflateEnd(s->zstrm);
-
-        free(s->zstrm);
-        s->zstrm = NULL;
-    }
-    if (s->zbuf) {
-        free(s->zbuf);
-        s->zbuf = NULL;
-    }
-}
-
 /* Table of incompressible file type signatures */
 static struct file_sig {
     const char *type;
@@ -467,6 +475,108 @@ static int is_incompressible(const char *p, size_t n)
 
 #endif /* HAVE_ZLIB */
 
+#ifdef HAVE_ZSTD
+
+/*
+ * Turn on zstd (de)compression for this connection.
+ * If dict is non-NULL, both compressor and decompressor are primed
+ * with it, so the peer must load exactly the same dictionary.
+ */
+
+EXPORTED int prot_setcompress_zstd(struct protstream *s,
+                                   const char *dict, size_t dictlen)
+{
+    size_t zr = 0;
+
+    if (s->write) {
+        if (s->ptr != s->buf) {
+            /* flush any pending output */
+            if (prot_flush_internal(s, 0) == EOF)
+                goto error;
+        }
+
+        s->zstd_cctx = ZSTD_createCCtx();
+        if (!s->zstd_cctx) goto error;
+
+        zr = ZSTD_CCtx_setParameter(s->zstd_cctx, ZSTD_c_compressionLevel,
+                                    ZSTD_CLEVEL_DEFAULT);
+        if (!ZSTD_isError(zr) && dict)
+            zr = ZSTD_CCtx_loadDictionary(s->zstd_cctx, dict, dictlen);
+
+        /* enough for a flush of a full protstream buffer in one pass */
+        s->zstdbuf_size = ZSTD_CStreamOutSize();
+    }
+    else {
+        s->zstd_dctx = ZSTD_createDCtx();
+        if (!s->zstd_dctx) goto error;
+
+        if (dict)
+            zr = ZSTD_DCtx_loadDictionary(s->zstd_dctx, dict, dictlen);
+
+        s->zstd_in.src = NULL;
+        s->zstd_in.size = s->zstd_in.pos = 0;
+        s->zstd_drain = 0;
+        s->zstdbuf_size = ZSTD_DStreamOutSize();
+    }
+
+    if (ZSTD_isError(zr)) {
+        syslog(LOG_ERR, "zstd setup error: %s", ZSTD_getErrorName(zr));
+        goto error;
+    }
+
+    s->zstdbuf = (unsigned char *) xmalloc(s->zstdbuf_size);
+    syslog(LOG_DEBUG, "created zstd %scompress buffer of " SIZE_T_FMT " bytes%s",
+           s->write ? "" : "de", s->zstdbuf_size, dict ? " with dictionary" : "");
+
+    return 0;
+
+error:
+    syslog(LOG_NOTICE, "failed to start zstd %scompression",
+           s->write ? "" : "de");
+    if (s->zstd_cctx) ZSTD_freeCCtx(s->zstd_cctx);
+    if (s->zstd_dctx) ZSTD_freeDCtx(s->zstd_dctx);
+    s->zstd_cctx = NULL;
+    s->zstd_dctx = NULL;
+    return EOF;
+}
+
+#endif /* HAVE_ZSTD */
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+EXPORTED void prot_unsetcompress(struct protstream *s)
+{
+#ifdef HAVE_ZLIB
+    if (s->zstrm) {
+        if (s->write) deflateEnd(s->zstrm);
+        else inflateEnd(s->zstrm);
+
+        free(s->zstrm);
+        s->zstrm = NULL;
+    }
+    if (s->zbuf) {
+        free(s->zbuf);
+        s->zbuf = NULL;
+    }
+#endif /* HAVE_ZLIB */
+#ifdef HAVE_ZSTD
+    if (s->zstd_cctx) {
+        ZSTD_freeCCtx(s->zstd_cctx);
+        s->zstd_cctx = NULL;
+    }
+    if (s->zstd_dctx) {
+        ZSTD_freeDCtx(s->zstd_dctx);
+        s->zstd_dctx = NULL;
+    }
+    if (s->zstdbuf) {
+        free(s->zstdbuf);
+        s->zstdbuf = NULL;
+    }
+    s->zstd_in.size = s->zstd_in.pos = 0;
+    s->zstd_drain = 0;
+#endif /* HAVE_ZSTD */
+}
+#endif /* HAVE_ZLIB || HAVE_ZSTD */
+
 /* Tell the protstream that the type of data is about to change.
  * Since we might want to look at the data, we only set a flag and delay
  * any changes to the stream layers until the next prot_write().
@@ -533,6 +643,30 @@ int prot_setreadcallback(struct protstream *s,
     return 0;
 }
 
+static prot_idlefn_t *idle_proc = NULL;
+
+/*
+ * Call 'proc' the next time this process would block waiting for input
+ * on any stream.
+ */
+EXPORTED void prot_setidle(prot_idlefn_t *proc)
+{
+    idle_proc = proc;
+}
+
+/*
+ * Run the pending idle callback now, if there is one.
+ */
+EXPORTED void prot_runidle(void)
+{
+    prot_idlefn_t *proc = idle_proc;
+
+    if (!proc) return;
+
+    idle_proc = NULL;
+    proc();
+}
+
 /*
  * Add an event on stream 's' so that the callback 'proc' taking
  * argument 'rock' will be called at 'mark' (in seconds) while
@@ -678,6 +812,39 @@ EXPORTED int prot_fill(struct protstream *s)
         }
 #endif
 
+#ifdef HAVE_ZSTD
+        /* check if there's anything pending in the zstd stream already */
+        if (s->zstd_dctx &&
+            (s->zstd_in.pos < s->zstd_in.size || s->zstd_drain)) {
+            ZSTD_outBuffer out = { s->zstdbuf, s->zstdbuf_size, 0 };
+            size_t in = s->zstd_in.pos;
+            size_t zr;
+
+            zr = ZSTD_decompressStream(s->zstd_dctx, &out, &s->zstd_in);
+            if (ZSTD_isError(zr)) {
+                syslog(LOG_ERR, "zstd decompress error: %s",
+                       ZSTD_getErrorName(zr));
+                s->error = xstrdup("Error decompressing data");
+                return EOF;
+            }
+
+            /* a full output buffer may leave more data inside the
+             * decoder even once all the input has been consumed */
+            s->zstd_drain = (out.pos == out.size);
+
+            if (out.pos) {
+                s->ptr = s->zstdbuf;
+                s->cnt = out.pos;
+
+                syslog(LOG_DEBUG, "zstd decompressed " SIZE_T_FMT " -> %u bytes",
+                       s->zstd_in.pos - in, s->cnt);
+
+                /* drop straight to logging and returning the first char */
+                break;
+            }
+        }
+#endif /* HAVE_ZSTD */
+
         /* wait until get input */
         haveinput = 0;
 
@@ -690,7 +857,7 @@ EXPORTED int prot_fill(struct protstream *s)
 
         /* if we've promised to call something before blocking or
            flush an output stream, check to see if we're going to block */
-        if (s->readcallback_proc ||
+        if (s->readcallback_proc || idle_proc ||
             (s->flushonread && s->flushonread->ptr != s->flushonread->buf)) {
             timeout.tv_sec = timeout.tv_usec = 0;
             FD_ZERO(&rfds);
@@ -704,6 +871,7 @@ EXPORTED int prot_fill(struct protstream *s)
                     s->readcallback_proc = 0;
                     s->readcallback_rock = 0;
                 }
+                prot_runidle();
                 /* Request a flush of the buffer.  If we are a blocking
                    read stream, force the flush */
                 if (s->flushonread)
@@ -809,6 +977,16 @@ EXPORTED int prot_fill(struct protstream *s)
             s->cnt = 0;
         }
 #endif /* HAVE_ZLIB */
+
+#ifdef HAVE_ZSTD
+        if (s->zstd_dctx) {
+            /* likewise for a zstd stream */
+            s->zstd_in.src = s->ptr;
+            s->zstd_in.size = s->cnt;
+            s->zstd_in.pos = 0;
+            s->cnt = 0;
+        }
+#endif /* HAVE_ZSTD */
     } while (!s->cnt);
 
     if (s->logfd != -1) {
@@ -817,12 +995,12 @@ EXPORTED int prot_fill(struct protstream *s)
 
         time(&newtime);
         snprintf(timebuf, sizeof(timebuf), "<%ld<", newtime);
-        n = write(s->logfd, timebuf, strlen(timebuf));
+        n = logring_write(s->logfd, timebuf, strlen(timebuf));
 
         left = s->cnt;
         ptr = s->ptr;
         do {
-            n = write(s->logfd, ptr, left);
+            n = logring_write(s->logfd, ptr, left);
             if (n == -1 && (errno != EINTR || signals_poll())) {
                 break;
             }
@@ -880,10 +1058,10 @@ static void prot_flush_log(struct protstream *s)
 
         time(&newtime);
         snprintf(timebuf, sizeof(timebuf), ">%ld>", newtime);
-        n = write(s->logfd, timebuf, strlen(timebuf));
+        n = logring_write(s->logfd, timebuf, strlen(timebuf));
 
         do {
-            n = write(s->logfd, ptr, left);
+            n = logring_write(s->logfd, ptr, left);
             if (n == -1 && (errno != EINTR || signals_poll())) {
                 break;
             }
@@ -954,6 +1132,46 @@ static int prot_flush_encode(struct protstream *s,
     }
 #endif /* HAVE_ZLIB */
 
+#ifdef HAVE_ZSTD
+    if (s->zstd_cctx) {
+        /* Compress the data, flushing a complete block for the peer */
+        ZSTD_inBuffer in = { ptr, left, 0 };
+        ZSTD_outBuffer out = { s->zstdbuf, s->zstdbuf_size, 0 };
+        size_t remaining;
+
+        do {
+            if (out.pos == out.size) {
+                syslog(LOG_DEBUG, "growing zstd compress buffer from "
+                       SIZE_T_FMT " to " SIZE_T_FMT " bytes",
+                       s->zstdbuf_size, s->zstdbuf_size + PROT_BUFSIZE);
+
+                s->zstdbuf_size += PROT_BUFSIZE;
+                s->zstdbuf = (unsigned char *)
+                    xrealloc(s->zstdbuf, s->zstdbuf_size);
+                out.dst = s->zstdbuf;
+                out.size = s->zstdbuf_size;
+            }
+
+            remaining = ZSTD_compressStream2(s->zstd_cctx, &out, &in,
+                                             ZSTD_e_flush);
+            if (ZSTD_isError(remaining)) {
+                syslog(LOG_ERR, "zstd compress error: %s",
+                       ZSTD_getErrorName(remaining));
+                s->error = xstrdup("Error compressing data");
+                return EOF;
+            }
+
+            /* non-zero means the flush isn't complete yet */
+        } while (remaining);
+
+        ptr = s->zstdbuf;
+        left = out.pos;
+
+        syslog(LOG_DEBUG, "zstd compressed " SIZE_T_FMT " -> %d bytes",
+               in.size, left);
+    }
+#endif /* HAVE_ZSTD */
+
     if (s->saslssf != 0) {
         /* encode the data */
         int result = sasl_encode(s->conn, (char *) ptr, left,
@@ -1275,6 +1493,272 @@ EXPORTED int prot_write(struct protstream *s, const char *buf, unsigned len)
     return 0;
 }
 
+/*
+ * Can data be handed straight from a file to the socket underneath the
+ * output stream 's', bypassing the output buffer?  Only for plain
+ * connections or kernel TLS: userspace TLS, COMPRESS, SASL security
+ * layers and the telemetry log all need to see the bytes.
+ */
+EXPORTED int prot_can_sendfile(struct protstream *s)
+{
+    if (!s->write || s->writetobuf) return 0;
+    if (s->logfd != PROT_NO_FD) return 0;
+    if (s->saslssf) return 0;
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif
+#ifdef HAVE_ZSTD
+    if (s->zstd_cctx) return 0;
+#endif
+#ifdef HAVE_SSL
+    /* with kernel TLS the record layer lives in the kernel too */
+    if (s->tls_conn) return PROT_KTLS_SEND(s->tls_conn);
+#endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Write to the output stream 's' the 'len' bytes of the file open on
+ * 'fd' starting at 'offset'.  If prot_can_sendfile(), the kernel copies
+ * the data directly to the socket with sendfile(2); otherwise (or if
+ * sendfile isn't supported for this descriptor) the file is read through
+ * the normal buffered path.
+ */
+EXPORTED int prot_sendfile(struct protstream *s, int fd, off_t offset, size_t len)
+{
+    char buf[PROT_BUFSIZE];
+    int tls = 0;
+
+    assert(s->write);
+    if (s->error || s->eof) return EOF;
+    if (len == 0) return 0;
+
+#ifdef HAVE_SSL
+    tls = (s->tls_conn != NULL);
+    if (tls && prot_can_sendfile(s)) {
+        if (prot_flush_internal(s, 1) == EOF) return EOF;
+
+        while (len) {
+            ssize_t n;
+
+            cmdtime_netstart();
+            n = PROT_KTLS_SENDFILE(s->tls_conn, fd, offset, len);
+            cmdtime_netend();
+
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR && !signals_poll()) continue;
+                if (n == 0) break; /* file is shorter than we were told */
+                if (errno == EINVAL || errno == ENOSYS) break; /* fall back */
+                s->error = xstrdup("kTLS sendfile failed");
+                return EOF;
+            }
+
+            offset += n;
+            len -= n;
+            s->bytes_out += n;
+        }
+
+        if (!len) return 0;
+    }
+#endif /* HAVE_SSL */
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    if (!tls && prot_can_sendfile(s)) {
+        /* anything already buffered must go out first; a forced flush
+         * also leaves the descriptor in blocking mode */
+        if (prot_flush_internal(s, 1) == EOF) return EOF;
+
+        while (len) {
+            ssize_t n;
+
+            cmdtime_netstart();
+            n = sendfile(s->fd, fd, &offset, len);
+            cmdtime_netend();
+
+            if (n == -1) {
+                if (errno == EINTR && !signals_poll()) continue;
+                if (errno == EINVAL || errno == ENOSYS) break; /* fall back */
+                s->error = xstrdup(strerror(errno));
+                return EOF;
+            }
+            if (n == 0) break; /* file is shorter than we were told */
+
+            len -= n;
+            s->bytes_out += n;
+        }
+
+        if (!len) return 0;
+    }
+#endif /* HAVE_SENDFILE */
+
+    while (len) {
+        ssize_t n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            s->error = xstrdup(n ? strerror(errno) : "unexpected end of file");
+            return EOF;
+        }
+        if (prot_write(s, buf, n) == EOF) return EOF;
+
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_SPLICE
+/* most we ask splice(2) to move through the pipe at once */
+#define PROT_SPLICE_MAX (64*1024)
+
+/*
+ * Can data be taken straight from the socket underneath the input
+ * stream 's', bypassing the input buffer?  Only for plain blocking
+ * connections, for the same reasons as prot_can_sendfile().
+ */
+static int prot_can_splice_from(struct protstream *s)
+{
+    if (s->write || s->dontblock) return 0;
+    if (s->logfd != PROT_NO_FD || s->big_buffer != PROT_NO_FD) return 0;
+    if (s->fillcallback_proc) return 0;
+    if (s->saslssf) return 0;
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif
+#ifdef HAVE_ZSTD
+    if (s->zstd_dctx) return 0;
+#endif
+#ifdef HAVE_SSL
+    if (s->tls_conn) return 0;
+#endif
+    return 1;
+}
+
+/*
+ * Move up to '*lenp' bytes from the socket of 'in' to the socket of 'out'
+ * through a pipe, decrementing '*lenp' as they go.  Returns EOF on error,
+ * otherwise 0 (with '*lenp' untouched if splice(2) can't be used here).
+ */
+static int prot_splice_sockets(struct protstream *in, struct protstream *out,
+                               size_t *lenp)
+{
+    static int pipefd[2] = { -1, -1 };
+
+    if (pipefd[0] == -1 && pipe(pipefd) < 0) return 0;
+
+    while (*lenp) {
+        size_t want = *lenp < PROT_SPLICE_MAX ? *lenp : PROT_SPLICE_MAX;
+        ssize_t n;
+
+        if (in->read_timeout) {
+            struct pollfd pfd = { in->fd, POLLIN, 0 };
+            int r;
+
+            do {
+                r = poll(&pfd, 1, in->read_timeout * 1000);
+            } while (r == -1 && errno == EINTR && !signals_poll());
+
+            if (r <= 0) {
+                in->error = xstrdup(r ? strerror(errno) : "idle for too long");
+                return EOF;
+            }
+        }
+
+        cmdtime_netstart();
+        n = splice(in->fd, NULL, pipefd[1], NULL, want,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+        cmdtime_netend();
+
+        if (n == -1) {
+            if (errno == EINTR && !signals_poll()) continue;
+            if (errno == EINVAL || errno == ENOSYS) return 0; /* fall back */
+            in->error = xstrdup(strerror(errno));
+            return EOF;
+        }
+        if (n == 0) {
+            in->eof = 1;
+            return EOF;
+        }
+        in->bytes_in += n;
+
+        /* and out of the pipe again */
+        while (n) {
+            ssize_t m;
+
+            cmdtime_netstart();
+            m = splice(pipefd[0], NULL, out->fd, NULL, n,
+                       SPLICE_F_MOVE | ((size_t) n < *lenp ? SPLICE_F_MORE : 0));
+            cmdtime_netend();
+
+            if (m == -1) {
+                if (errno == EINTR && !signals_poll()) continue;
+
+                /* the pipe may still hold data; don't reuse it */
+                out->error = xstrdup(strerror(errno));
+                close(pipefd[0]);
+                close(pipefd[1]);
+                pipefd[0] = pipefd[1] = -1;
+                return EOF;
+            }
+
+            n -= m;
+            *lenp -= m;
+            out->bytes_out += m;
+        }
+    }
+
+    return 0;
+}
+#endif /* HAVE_SPLICE */
+
+/*
+ * Copy 'len' bytes from the input stream 'in' to the output stream 'out'.
+ * If neither stream has a layer that needs to see the bytes (see
+ * prot_can_sendfile), the kernel moves them from one socket to the other
+ * with splice(2); otherwise they are copied through the buffers.
+ */
+EXPORTED int prot_splice(struct protstream *in, struct protstream *out,
+                         size_t len)
+{
+    char buf[PROT_BUFSIZE];
+
+    assert(!in->write);
+    assert(out->write);
+    if (out->error || out->eof) return EOF;
+
+#ifdef HAVE_SPLICE
+    if (len > PROT_BUFSIZE &&
+        prot_can_splice_from(in) && prot_can_sendfile(out)) {
+        /* whatever we have already read goes first */
+        while (len && in->cnt) {
+            int n = prot_read(in, buf, len < sizeof(buf) ? len : sizeof(buf));
+
+            if (prot_write(out, buf, n) == EOF) return EOF;
+            len -= n;
+        }
+
+        /* a forced flush also leaves the descriptor in blocking mode */
+        if (prot_flush_internal(out, 1) == EOF) return EOF;
+
+        if (prot_splice_sockets(in, out, &len) == EOF) return EOF;
+    }
+#endif /* HAVE_SPLICE */
+
+    while (len) {
+        int n = prot_read(in, buf, len < sizeof(buf) ? len : sizeof(buf));
+
+        if (!n) return EOF;
+        if (prot_write(out, buf, n) == EOF) return EOF;
+        len -= n;
+    }
+
+    return 0;
+}
+
 EXPORTED int prot_putbuf(struct protstream *s, struct buf *buf)
 {
     return prot_write(s, buf->s, buf->len);
@@ -1473,6 +1957,9 @@ EXPORTED int prot_readbuf(struct protstream *s, struct buf *buf, unsigned size)
  * select() for protection streams, read only
  * Also supports selecting on an extra file descriptor
  *
+ * Implemented with poll(), so it isn't limited to descriptors below
+ * FD_SETSIZE, and the cost of a call is linear in the group size only.
+ *
  * returns # of protstreams with pending data (including the extra fd)
  *
  * Only works for readable protstreams
@@ -1483,9 +1970,11 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
 {
     struct protstream *s, *timeout_prot = NULL;
     struct protgroup *retval = NULL;
-    int max_fd, found_fds = 0;
+    int found_fds = 0;
     unsigned i;
-    fd_set rfds;
+    static struct pollfd *pfds = NULL;
+    static nfds_t pfds_alloc = 0;
+    nfds_t npfds = 0, extra_pfd = 0;
     int have_readtimeout = 0;
     struct timeval my_timeout;
     struct prot_waitevent *event;
@@ -1499,11 +1988,12 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
     /* Initialize things we might use */
     errno = 0;
     found_fds = 0;
-    FD_ZERO(&rfds);
 
-    /* If extra_read_fd is PROT_NO_FD, then the first protstream
-     * will override it */
-    max_fd = extra_read_fd;
+    /* one slot per stream, plus the extra fd */
+    if (pfds_alloc < readstreams->next_element + 1) {
+        pfds_alloc = readstreams->next_element + 1;
+        pfds = xrealloc(pfds, pfds_alloc * sizeof(struct pollfd));
+    }
 
     for(i = 0; i<readstreams->next_element; i++) {
         int have_thistimeout = 0; /* used to compute the minimal timeout for */
@@ -1538,9 +2028,10 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
                 timeout_prot = s;
         }
 
-        FD_SET(s->fd, &rfds);
-        if(s->fd > max_fd)
-            max_fd = s->fd;
+        pfds[npfds].fd = s->fd;
+        pfds[npfds].events = POLLIN;
+        pfds[npfds].revents = 0;
+        npfds++;
 
         /* Is something currently pending in our protstream's buffer? */
         if(s->cnt > 0) {
@@ -1569,10 +2060,13 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
     if(!retval) {
         time_t sleepfor;
 
-        /* do a select */
+        /* do a poll */
         if(extra_read_fd != PROT_NO_FD) {
-            /* max_fd started with atleast extra_read_fd */
-            FD_SET(extra_read_fd, &rfds);
+            extra_pfd = npfds;
+            pfds[npfds].fd = extra_read_fd;
+            pfds[npfds].events = POLLIN;
+            pfds[npfds].revents = 0;
+            npfds++;
         }
 
         if(read_timeout < now)
@@ -1590,24 +2084,37 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
             timeout->tv_usec = 0;
         }
 
-        if(signals_select(max_fd + 1, &rfds, NULL, NULL, timeout) == -1)
+        if (!timeout || timeout->tv_sec || timeout->tv_usec)
+            prot_runidle();
+
+        if(signals_poll_fds(pfds, npfds, timeout) == -1)
             return -1;
 
+        /* select() would have failed outright on a bad descriptor */
+        for(i = 0; i < npfds; i++) {
+            if(pfds[i].revents & POLLNVAL) {
+                errno = EBADF;
+                return -1;
+            }
+        }
+
         /* Reset now */
         now = time(NULL);
 
-        if(extra_read_fd != PROT_NO_FD && FD_ISSET(extra_read_fd, &rfds)) {
+        if(extra_read_fd != PROT_NO_FD && pfds[extra_pfd].revents) {
             *extra_read_flag = 1;
             found_fds++;
         } else if(extra_read_flag) {
             *extra_read_flag = 0;
         }
 
+        /* streams were added to pfds in group order, skipping holes */
+        npfds = 0;
         for(i = 0; i<readstreams->next_element; i++) {
             s = readstreams->group[i];
             if (!s) continue;
 
-            if(FD_ISSET(s->fd, &rfds)) {
+            if(pfds[npfds++].revents) {
                 found_fds++;
 
                 if(!retval)
@@ -1797,6 +2304,25 @@ EXPORTED size_t prot_lookahead(struct protstream *s,
     return 0;
 }
 
+EXPORTED const char *prot_buffered(struct protstream *s, size_t *lenp)
+{
+    assert(!s->write);
+
+    *lenp = s->cnt;
+    return (const char *) s->ptr;
+}
+
+EXPORTED void prot_skip(struct protstream *s, size_t n)
+{
+    assert(!s->write);
+    assert(n <= s->cnt);
+
+    s->ptr += n;
+    s->cnt -= n;
+    s->can_unget += n;
+    s->bytes_in += n;
+}
+
 EXPORTED inline int prot_ungetc(int c, struct protstream *s)
     __attribute__((always_inline,optimize("-O3")));
 EXPORTED inline int prot_ungetc(int c, struct protstream *s)
@@ -59,6 +59,10 @@
 #include <zlib.h>
 #endif /* HAVE_ZLIB */
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif /* HAVE_ZSTD */
+
 #include "util.h"
 
 #define PROT_BUFSIZE 4096
@@ -104,6 +108,19 @@ struct protstream {
     int zflush;
 #endif /* HAVE_ZLIB */
 
+#ifdef HAVE_ZSTD
+    /* zstd (de)compress context, only one is set per stream */
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+    /* Pending compressed input */
+    ZSTD_inBuffer zstd_in;
+    /* (De)compress buffer */
+    unsigned char *zstdbuf;
+    size_t zstdbuf_size;
+    /* Decompressor may still hold output for input already consumed */
+    int zstd_drain;
+#endif /* HAVE_ZSTD */
+
     /* Big Buffer Information */
     const char *bigbuf_base;  /* Base Pointer */
     size_t bigbuf_siz; /* Overall Size of Buffer */
@@ -190,6 +207,14 @@ extern size_t prot_lookahead(struct protstream *s,
                              size_t len,
                              int *sep);
 
+/* prot_buffered returns the bytes already read from the stream but not
+ * yet consumed, without filling or copying, and their count in *lenp.
+ * The pointer is only valid until the next read from the stream.
+ * prot_skip consumes n (<= *lenp) of those bytes, as if by prot_getc.
+ */
+extern const char *prot_buffered(struct protstream *s, size_t *lenp);
+extern void prot_skip(struct protstream *s, size_t n);
+
 /* The following two macros control the blocking nature of
  * the protstream.
  *
@@ -247,14 +272,30 @@ int prot_setisclient(struct protstream *s, int val);
 #ifdef HAVE_ZLIB
 /* Enable (de)compression for a given protstream */
 int prot_setcompress(struct protstream *s);
+#endif /* HAVE_ZLIB */
+
+#ifdef HAVE_ZSTD
+/* Enable zstd (de)compression for a given protstream, optionally
+ * primed with a shared dictionary (both ends must use the same one) */
+int prot_setcompress_zstd(struct protstream *s,
+                          const char *dict, size_t dictlen);
+#endif /* HAVE_ZSTD */
 
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
 /* Disable (de)compression for a given protstream */
 void prot_unsetcompress(struct protstream *s);
-#endif /* HAVE_ZLIB */
+#endif /* HAVE_ZLIB || HAVE_ZSTD */
 
 /* Tell the protstream that the type of data is about to change. */
 int prot_data_boundary(struct protstream *s);
 
+/* Zero-copy output of a file range (see prot_sendfile in prot.c) */
+extern int prot_can_sendfile(struct protstream *s);
+extern int prot_sendfile(struct protstream *s, int fd, off_t offset, size_t len);
+/* Zero-copy relay of 'len' bytes between two streams (see prot_splice) */
+extern int prot_splice(struct protstream *in, struct protstream *out,
+                       size_t len);
+
 /* Set a timeout for the connection (in seconds) */
 extern int prot_settimeout(struct protstream *s, int timeout);
 
@@ -269,6 +310,13 @@ extern int prot_setflushonread(struct protstream *s,
 
 int prot_setreadcallback(struct protstream *s,
                                 prot_readcallback_t *proc, void *rock);
+
+/* Work put off until the process goes idle: 'proc' is called once, the
+ * next time a read on any stream is about to block (or prot_runidle()
+ * is called), then forgotten.  There is one slot per process. */
+typedef void prot_idlefn_t(void);
+extern void prot_setidle(prot_idlefn_t *proc);
+extern void prot_runidle(void);
 extern struct prot_waitevent *prot_addwaitevent(struct protstream *s,
                                                 time_t mark,
                                                 prot_waiteventcallback_t *proc,
@@ -276,6 +276,69 @@ EXPORTED int signals_select(int nfds, fd_set *rfds, fd_set *wfds,
 #endif
 }
 
+/*
+ * Same as signals_select(), but with the interface of poll(), so that
+ * callers aren't limited to descriptors below FD_SETSIZE.
+ */
+EXPORTED int signals_poll_fds(struct pollfd *fds, nfds_t nfds,
+                              struct timeval *tout)
+{
+#if HAVE_PPOLL
+    struct timespec ts, *tsptr = NULL;
+    sigset_t blocked;
+    sigset_t oldmask;
+    int saved_errno;
+    int r;
+
+    /* temporarily block all the signals we want
+     * to be caught reliably */
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGALRM);
+    sigaddset(&blocked, SIGQUIT);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigprocmask(SIG_BLOCK, &blocked, &oldmask);
+
+    /* Those signals will not arrive now.  Check to see if any
+     * of them arrived before we blocked them */
+    signals_poll_mask(&oldmask);
+
+    if (tout) {
+        ts.tv_sec = tout->tv_sec;
+        ts.tv_nsec = tout->tv_usec * 1000;
+        tsptr = &ts;
+    }
+
+    /* ppoll() allows the restartable signals to arrive */
+    r = ppoll(fds, nfds, tsptr, &oldmask);
+
+    if (r < 0 && (errno == EAGAIN || errno == EINTR))
+        signals_poll_mask(&oldmask);
+
+    /* restore the old signal mask */
+    saved_errno = errno;
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    errno = saved_errno;
+
+    return r;
+#else
+    int timeout = -1;
+    int r;
+
+    if (tout) {
+        /* round up, so a short timeout doesn't become a busy loop */
+        timeout = tout->tv_sec * 1000 + (tout->tv_usec + 999) / 1000;
+    }
+
+    r = poll(fds, nfds, timeout);
+    if (r < 0 && (errno == EAGAIN || errno == EINTR))
+        signals_poll();
+
+    return r;
+#endif
+}
+
 EXPORTED void signals_clear(int sig)
 {
     if (sig >= 0 && sig < _NSIG)
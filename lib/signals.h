@@ -43,6 +43,7 @@
 #ifndef INCLUDED_SIGNALS_H
 #define INCLUDED_SIGNALS_H
 
+#include <poll.h>
 #include <sys/select.h>
 #include <unistd.h>
 
@@ -54,6 +55,7 @@ void signals_set_shutdown(shutdownfn *s);
 int signals_poll(void);
 int signals_select(int nfds, fd_set *rfds, fd_set *wfds,
                    fd_set *efds, struct timeval *tout);
+int signals_poll_fds(struct pollfd *fds, nfds_t nfds, struct timeval *tout);
 void signals_clear(int sig);
 int signals_cancelled();
 
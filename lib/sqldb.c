@@ -51,6 +51,7 @@
 #include <unistd.h>
 #endif
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -63,6 +64,17 @@ static int sqldb_active = 0;
 
 static sqldb_t *open_sqldbs;
 
+/* unused handles, most recently used first */
+static sqldb_t *idle_sqldbs;
+static int idle_count;
+
+static struct sqldb_options sqldb_opts;
+
+EXPORTED void sqldb_setoptions(const struct sqldb_options *opts)
+{
+    sqldb_opts = *opts;
+}
+
 EXPORTED int sqldb_init(void)
 {
     if (!sqldb_active++) {
@@ -76,6 +88,7 @@ EXPORTED int sqldb_init(void)
 EXPORTED int sqldb_done(void)
 {
     if (!--sqldb_active) {
+        sqldb_pool_flush();
         sqlite3_shutdown();
         /* XXX - report the problems? */
         assert(!open_sqldbs);
@@ -92,12 +105,78 @@ static void _debug(void *fname, const char *sql)
 static int _free_open(sqldb_t *open)
 {
     int rc = sqlite3_close(open->db);
+    free_hash_table(&open->stmts, NULL);
     free(open->fname);
     free(open);
     int r = (rc == SQLITE_OK ? 0 : -1);
     return r;
 }
 
+static void _finish_stmt(sqldb_t *open);
+
+static int _close_open(sqldb_t *open)
+{
+    strarray_fini(&open->trans);
+    _finish_stmt(open);
+    return _free_open(open);
+}
+
+/* take an unused handle for fname out of the pool, unless the file
+ * has been removed or replaced (e.g. by dav_reconstruct) since */
+static sqldb_t *_pool_take(const char *fname)
+{
+    sqldb_t *open, **prevp;
+    struct stat sbuf;
+
+    for (prevp = &idle_sqldbs; (open = *prevp); prevp = &open->next) {
+        if (strcmp(open->fname, fname)) continue;
+
+        *prevp = open->next;
+        open->next = NULL;
+        idle_count--;
+
+        if (stat(fname, &sbuf) == -1 ||
+            sbuf.st_dev != open->dev || sbuf.st_ino != open->ino) {
+            _close_open(open);
+            return NULL;
+        }
+
+        return open;
+    }
+
+    return NULL;
+}
+
+static void _pool_put(sqldb_t *open)
+{
+    sqldb_t **prevp;
+    int n;
+
+    open->next = idle_sqldbs;
+    idle_sqldbs = open;
+    idle_count++;
+
+    if (idle_count <= sqldb_opts.poolsize) return;
+
+    /* evict the least recently used handle */
+    for (prevp = &idle_sqldbs, n = 1; n < idle_count; n++)
+        prevp = &(*prevp)->next;
+    open = *prevp;
+    *prevp = NULL;
+    idle_count--;
+    _close_open(open);
+}
+
+EXPORTED void sqldb_pool_flush(void)
+{
+    while (idle_sqldbs) {
+        sqldb_t *open = idle_sqldbs;
+        idle_sqldbs = open->next;
+        _close_open(open);
+    }
+    idle_count = 0;
+}
+
 static int _version_cb(void *rock, int ncol, char **vals, char **names __attribute__((unused)))
 {
     int *vptr = (int *)rock;
@@ -126,8 +205,15 @@ EXPORTED sqldb_t *sqldb_open(const char *fname, const char *initsql,
         }
     }
 
+    open = _pool_take(fname);
+    if (open) {
+        if (sqldb_opts.open_cb) sqldb_opts.open_cb(1);
+        goto link;
+    }
+
     open = xzmalloc(sizeof(sqldb_t));
     open->fname = xstrdup(fname);
+    construct_hash_table(&open->stmts, 32, 0);
 
     rc = stat(open->fname, &sbuf);
     if (rc == -1 && errno == ENOENT) {
@@ -168,6 +254,20 @@ EXPORTED sqldb_t *sqldb_open(const char *fname, const char *initsql,
         return NULL;
     }
 
+    if (sqldb_opts.wal) {
+        /* readers don't block the writer, and commits only need to
+         * sync the log; the mode is persistent in the file */
+        rc = sqlite3_exec(open->db,
+                          "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL;",
+                          NULL, NULL, NULL);
+        if (rc != SQLITE_OK) {
+            syslog(LOG_ERR, "DBERROR: sqldb_open(%s) enable WAL: %s",
+                   open->fname, sqlite3_errmsg(open->db));
+            _free_open(open);
+            return NULL;
+        }
+    }
+
     rc = sqlite3_exec(open->db, "PRAGMA user_version;", _version_cb, &open->version, NULL);
     if (rc != SQLITE_OK) {
         syslog(LOG_ERR, "sqldb_open(%s) get user_version: %s",
@@ -270,6 +370,13 @@ transout:
     }
 
 out:
+    if (!stat(open->fname, &sbuf)) {
+        open->dev = sbuf.st_dev;
+        open->ino = sbuf.st_ino;
+    }
+    if (sqldb_opts.open_cb) sqldb_opts.open_cb(0);
+
+link:
     /* stitch on up */
     open->refcount = 1;
     open->next = open_sqldbs;
@@ -278,15 +385,13 @@ out:
     return open;
 }
 
-static sqlite3_stmt *_prepare_stmt(sqldb_t *open, const char *cmd)
+static sqlite3_stmt *_prepare_stmt(sqldb_t *open, const char *cmd,
+                                   int *cached)
 {
-    int i;
-    sqlite3_stmt *stmt;
-    for (i = 0; i < open->stmts.count; i++) {
-        stmt = ptrarray_nth(&open->stmts, i);
-        if (!strcmp(cmd, sqlite3_sql(stmt)))
-            return stmt;
-    }
+    sqlite3_stmt *stmt = hash_lookup(cmd, &open->stmts);
+    *cached = (stmt != NULL);
+    if (stmt) return stmt;
+
     /* prepare new statement */
     int rc = sqlite3_prepare_v2(open->db, cmd, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
@@ -294,26 +399,30 @@ static sqlite3_stmt *_prepare_stmt(sqldb_t *open, const char *cmd)
                open->fname, cmd, sqlite3_errmsg(open->db));
         return NULL;
     }
-    ptrarray_append(&open->stmts, stmt);
+    hash_insert(cmd, stmt, &open->stmts);
     return stmt;
 }
 
+static void _finalize_cb(const char *cmd __attribute__((unused)),
+                         void *stmt, void *rock __attribute__((unused)))
+{
+    sqlite3_finalize((sqlite3_stmt *) stmt);
+}
+
 static void _finish_stmt(sqldb_t *open)
 {
-    int i;
-    sqlite3_stmt *stmt;
-    for (i = 0; i < open->stmts.count; i++) {
-        stmt = ptrarray_nth(&open->stmts, i);
-        sqlite3_finalize(stmt);
-    }
-    ptrarray_fini(&open->stmts);
+    hash_enumerate(&open->stmts, _finalize_cb, NULL);
 }
 
 EXPORTED int sqldb_exec(sqldb_t *open, const char *cmd, struct sqldb_bindval bval[],
                         int (*cb)(sqlite3_stmt *stmt, void *rock), void *rock)
 {
-    int rc, r = 0;
-    sqlite3_stmt *stmt = _prepare_stmt(open, cmd);
+    int rc, r = 0, cached;
+    struct timeval start, end;
+
+    if (sqldb_opts.exec_cb) gettimeofday(&start, NULL);
+
+    sqlite3_stmt *stmt = _prepare_stmt(open, cmd, &cached);
     if (!stmt) return -1;
 
     /* bind values */
@@ -345,6 +454,11 @@ EXPORTED int sqldb_exec(sqldb_t *open, const char *cmd, struct sqldb_bindval bva
         r = -1;
     }
 
+    if (sqldb_opts.exec_cb) {
+        gettimeofday(&end, NULL);
+        sqldb_opts.exec_cb(cached, timesub(&start, &end));
+    }
+
     return r;
 }
 
@@ -424,6 +538,40 @@ EXPORTED int sqldb_changes(sqldb_t *open)
     return sqlite3_changes(open->db);
 }
 
+EXPORTED int sqldb_copy(sqldb_t *open, const char *fname)
+{
+    sqlite3 *dst = NULL;
+    sqlite3_backup *backup;
+    int rc;
+
+    rc = sqlite3_open_v2(fname, &dst,
+                         SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+    if (rc != SQLITE_OK) {
+        syslog(LOG_ERR, "DBERROR: sqldb_copy(%s) open: %s",
+               fname, dst ? sqlite3_errmsg(dst) : "failed");
+        sqlite3_close(dst);
+        return -1;
+    }
+
+    /* one step copies the lot, so no writer can get in between */
+    backup = sqlite3_backup_init(dst, "main", open->db, "main");
+    if (backup) {
+        rc = sqlite3_backup_step(backup, -1);
+        sqlite3_backup_finish(backup);
+        if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    }
+    else rc = sqlite3_errcode(dst);
+
+    if (rc != SQLITE_OK) {
+        syslog(LOG_ERR, "DBERROR: sqldb_copy(%s) from %s: %s",
+               fname, open->fname, sqlite3_errstr(rc));
+    }
+
+    sqlite3_close(dst);
+
+    return (rc == SQLITE_OK ? 0 : -1);
+}
+
 EXPORTED int sqldb_close(sqldb_t **dbp)
 {
     sqldb_t *open, *prev = NULL;
@@ -445,10 +593,12 @@ EXPORTED int sqldb_close(sqldb_t **dbp)
     assert(open);
     assert(!open->trans.count);
 
-    strarray_fini(&open->trans);
-    _finish_stmt(open);
-
     *dbp = NULL;
 
-    return _free_open(open);
+    if (sqldb_opts.poolsize > 0 && !open->writelock) {
+        _pool_put(open);
+        return 0;
+    }
+
+    return _close_open(open);
 }
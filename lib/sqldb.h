@@ -44,8 +44,9 @@
 #ifndef SQLDB_H
 #define SQLDB_H
 
+#include <sys/types.h>
 #include <sqlite3.h>
-#include "ptrarray.h"
+#include "hash.h"
 #include "strarray.h"
 
 struct sqldb_bindval {
@@ -66,7 +67,9 @@ struct sqldb {
     int refcount;
     int writelock;
     strarray_t trans;
-    ptrarray_t stmts;
+    hash_table stmts;           /* prepared statements, keyed by SQL text */
+    dev_t dev;                  /* identity of the file, to detect */
+    ino_t ino;                  /* replacement while pooled */
     struct sqldb *next;
 };
 
@@ -78,6 +81,20 @@ struct sqldb_upgrade {
     int (*cb)(sqldb_t *db);
 };
 
+struct sqldb_options {
+    /* number of unused handles kept open for reuse, most recently
+       used first (0 = close handles as soon as they are unused) */
+    int poolsize;
+    /* put databases into WAL journal mode when opening them */
+    int wal;
+    /* optional statistics hooks */
+    void (*open_cb)(int pooled);
+    void (*exec_cb)(int cached, double seconds);
+};
+
+/* set per-process options, before any databases are opened */
+void sqldb_setoptions(const struct sqldb_options *opts);
+
 /* prepare for SQL operations in this process */
 int sqldb_init(void);
 
@@ -106,6 +123,12 @@ int sqldb_writeabort(sqldb_t *open);
 int sqldb_lastid(sqldb_t *open);
 int sqldb_changes(sqldb_t *open);
 
+/* write a consistent copy of the database to a new file 'fname' */
+int sqldb_copy(sqldb_t *open, const char *fname);
+
 int sqldb_close(sqldb_t **openp);
 
+/* close all pooled (unused) handles */
+void sqldb_pool_flush(void);
+
 #endif /* SQLDB_H */
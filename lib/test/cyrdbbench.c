@@ -0,0 +1,492 @@
+/* Benchmark of the cyrusdb backends under mail server shaped workloads.
+ *
+ * usage: cyrdbbench [-b backend[,backend...]] [-c procs] [-n ops]
+ *                   [-k keys] [-d dir] mboxlist|convmsgid|duplicate|tracefile
+ *
+ * Each backend gets a fresh database in 'dir' (default "."), preloaded
+ * with 'keys' records, then 'procs' processes share 'ops' operations
+ * between them, all on that one database.  Reported per backend: ops/s
+ * over the wall clock time, p50 and p99 latency of a single operation,
+ * the number of fsync/fdatasync calls, and how much the file grew.
+ *
+ * The built-in workloads:
+ *   mboxlist   mailboxes.db: LIST of one user's folders by prefix scan,
+ *              exact lookups, and the odd create
+ *   convmsgid  conversations.db: message-id lookups, half of them
+ *              misses, skewed towards recent ids, plus new ids
+ *   duplicate  deliver.db: check then mark, mostly new messages
+ *
+ * Anything else is read as a trace with one operation per line:
+ *   get KEY | put KEY VALLEN | del KEY | scan PREFIX | mark KEY VALLEN
+ * and is replayed against an empty database.
+ *
+ * The sql backend needs a server configured and quotalegacy only
+ * stores quota roots, so they are only run when named with -b.  fsync counting works by interposing on the libc
+ * calls and is Linux only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <cyrus/cyrusdb.h>
+#include <cyrus/libcyr_cfg.h>
+#include <cyrus/strarray.h>
+#include <cyrus/xmalloc.h>
+
+void fatal(const char *s, int code)
+{
+    fprintf(stderr, "%d:%s\n", code, s);
+    exit(1);
+}
+
+static long nfsync;
+
+#ifdef __linux__
+int fsync(int fd)
+{
+    nfsync++;
+    return syscall(SYS_fsync, fd);
+}
+
+int fdatasync(int fd)
+{
+    nfsync++;
+    return syscall(SYS_fdatasync, fd);
+}
+#endif
+
+enum { OP_GET, OP_PUT, OP_DEL, OP_SCAN, OP_MARK };
+
+struct op {
+    int type;
+    char *key;
+    size_t vallen;
+};
+
+struct workload {
+    struct op *preload;
+    int npreload;
+    struct op *ops;
+    int nops;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* skewed towards the end of [0, n), as recent items are */
+static int skewed(int n)
+{
+    double u = (double) rand() / RAND_MAX;
+    int i = n - 1 - (int) (n * u * u * u);
+    return i < 0 ? 0 : i;
+}
+
+static void addop(struct op **ops, int *n, int type, const char *key,
+                  size_t vallen)
+{
+    if (!(*n & 1023)) *ops = xrealloc(*ops, (*n + 1024) * sizeof(struct op));
+    (*ops)[*n].type = type;
+    (*ops)[*n].key = xstrdup(key);
+    (*ops)[*n].vallen = vallen;
+    (*n)++;
+}
+
+static void gen_mboxlist(struct workload *w, int nkeys, int nops)
+{
+    int nusers = nkeys / 20 + 1;
+    char key[256];
+    int i;
+
+    for (i = 0; i < nkeys; i++) {
+        int folder = i / nusers;
+        if (folder)
+            snprintf(key, sizeof(key), "user.u%06d.folder%04d", i % nusers, folder);
+        else
+            snprintf(key, sizeof(key), "user.u%06d", i % nusers);
+        addop(&w->preload, &w->npreload, OP_PUT, key, 96);
+    }
+
+    for (i = 0; i < nops; i++) {
+        int u = rand() % nusers;
+        int pct = rand() % 100;
+
+        if (pct < 80) {
+            snprintf(key, sizeof(key), "user.u%06d.", u);
+            addop(&w->ops, &w->nops, OP_SCAN, key, 0);
+        }
+        else if (pct < 95) {
+            snprintf(key, sizeof(key), "user.u%06d.folder%04d", u, rand() % 20);
+            addop(&w->ops, &w->nops, OP_GET, key, 0);
+        }
+        else {
+            snprintf(key, sizeof(key), "user.u%06d.new%08d", u, i);
+            addop(&w->ops, &w->nops, OP_PUT, key, 96);
+        }
+    }
+}
+
+static void gen_convmsgid(struct workload *w, int nkeys, int nops)
+{
+    char key[256];
+    int i;
+
+    for (i = 0; i < nkeys; i++) {
+        snprintf(key, sizeof(key), "<%08x.%d@mail.example.com>",
+                 (unsigned) (i * 2654435761U), i);
+        addop(&w->preload, &w->npreload, OP_PUT, key, 40);
+    }
+
+    for (i = 0; i < nops; i++) {
+        int pct = rand() % 100;
+        int n = skewed(nkeys);
+
+        if (pct < 45) {
+            snprintf(key, sizeof(key), "<%08x.%d@mail.example.com>",
+                     (unsigned) (n * 2654435761U), n);
+            addop(&w->ops, &w->nops, OP_GET, key, 0);
+        }
+        else if (pct < 90) {
+            snprintf(key, sizeof(key), "<%08x.%d@elsewhere.example.net>",
+                     (unsigned) rand(), n);
+            addop(&w->ops, &w->nops, OP_GET, key, 0);
+        }
+        else {
+            snprintf(key, sizeof(key), "<%08x.%d@mail.example.com>",
+                     (unsigned) ((nkeys + i) * 2654435761U), nkeys + i);
+            addop(&w->ops, &w->nops, OP_PUT, key, 40);
+        }
+    }
+}
+
+static void gen_duplicate(struct workload *w, int nkeys, int nops)
+{
+    char key[256];
+    int i;
+
+    for (i = 0; i < nkeys; i++) {
+        /* the real keys are NUL separated, tabs keep these C strings */
+        snprintf(key, sizeof(key), "<%d@mail.example.com>\tuser.u%06d\t",
+                 i, i % 1000);
+        addop(&w->preload, &w->npreload, OP_PUT, key, 16);
+    }
+
+    for (i = 0; i < nops; i++) {
+        /* mostly new messages, some redelivered */
+        int n = rand() % 10 ? nkeys + i : skewed(nkeys);
+
+        snprintf(key, sizeof(key), "<%d@mail.example.com>\tuser.u%06d\t",
+                 n, n % 1000);
+        addop(&w->ops, &w->nops, OP_MARK, key, 16);
+    }
+}
+
+static void read_trace(struct workload *w, const char *fname)
+{
+    FILE *f = fopen(fname, "r");
+    char line[4096];
+
+    if (!f) {
+        perror(fname);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char *op = strtok(line, " \t\r\n");
+        char *key = strtok(NULL, " \t\r\n");
+        char *len = strtok(NULL, " \t\r\n");
+        size_t vallen = len ? strtoul(len, NULL, 10) : 0;
+
+        if (!op || !key) continue;
+
+        if (!strcmp(op, "get")) addop(&w->ops, &w->nops, OP_GET, key, 0);
+        else if (!strcmp(op, "put")) addop(&w->ops, &w->nops, OP_PUT, key, vallen);
+        else if (!strcmp(op, "del")) addop(&w->ops, &w->nops, OP_DEL, key, 0);
+        else if (!strcmp(op, "scan")) addop(&w->ops, &w->nops, OP_SCAN, key, 0);
+        else if (!strcmp(op, "mark")) addop(&w->ops, &w->nops, OP_MARK, key, vallen);
+        else fprintf(stderr, "%s: unknown operation '%s'\n", fname, op);
+    }
+
+    fclose(f);
+}
+
+static int count_cb(void *rock,
+                    const char *key __attribute__((unused)),
+                    size_t keylen __attribute__((unused)),
+                    const char *data __attribute__((unused)),
+                    size_t datalen __attribute__((unused)))
+{
+    (*(long *) rock)++;
+    return 0;
+}
+
+static int run_op(struct db *db, const struct op *op, const char *val)
+{
+    size_t keylen = strlen(op->key);
+    const char *data;
+    size_t datalen;
+    long n = 0;
+    int r;
+
+    switch (op->type) {
+    case OP_GET:
+        r = cyrusdb_fetch(db, op->key, keylen, &data, &datalen, NULL);
+        return r == CYRUSDB_NOTFOUND ? 0 : r;
+
+    case OP_PUT:
+        return cyrusdb_store(db, op->key, keylen, val, op->vallen, NULL);
+
+    case OP_DEL:
+        return cyrusdb_delete(db, op->key, keylen, NULL, 1);
+
+    case OP_SCAN:
+        return cyrusdb_foreach(db, op->key, keylen, NULL, count_cb, &n, NULL);
+
+    case OP_MARK:
+        r = cyrusdb_fetch(db, op->key, keylen, &data, &datalen, NULL);
+        if (r == CYRUSDB_NOTFOUND)
+            r = cyrusdb_store(db, op->key, keylen, val, op->vallen, NULL);
+        return r;
+    }
+
+    return 0;
+}
+
+/* size of the database file, or of every file in it if a directory */
+static off_t dbsize(const char *fname)
+{
+    struct stat sbuf;
+    off_t size = 0;
+    DIR *dir;
+    struct dirent *d;
+
+    if (stat(fname, &sbuf)) return 0;
+    if (!S_ISDIR(sbuf.st_mode)) return sbuf.st_size;
+
+    if (!(dir = opendir(fname))) return 0;
+    while ((d = readdir(dir))) {
+        char path[4096];
+
+        snprintf(path, sizeof(path), "%s/%s", fname, d->d_name);
+        if (!stat(path, &sbuf) && S_ISREG(sbuf.st_mode)) size += sbuf.st_size;
+    }
+    closedir(dir);
+
+    return size;
+}
+
+static int cmp_float(const void *a, const void *b)
+{
+    float x = *(const float *) a, y = *(const float *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* one child: run every procs'th op, send back fsyncs and latencies */
+static void child(const char *backend, const char *fname,
+                  const struct workload *w, int id, int procs, int fd,
+                  const char *val)
+{
+    struct db *db = NULL;
+    float *lat = xmalloc((w->nops / procs + 1) * sizeof(float));
+    long n = 0;
+    int i, r;
+
+    r = cyrusdb_open(backend, fname, 0, &db);
+    if (r) {
+        fprintf(stderr, "%s: open %s: %s\n", backend, fname, cyrusdb_strerror(r));
+        _exit(1);
+    }
+
+    nfsync = 0;
+    for (i = id; i < w->nops; i += procs) {
+        double t = now();
+
+        r = run_op(db, &w->ops[i], val);
+        if (r) {
+            fprintf(stderr, "%s: operation on '%s' failed: %s\n",
+                    backend, w->ops[i].key, cyrusdb_strerror(r));
+        }
+        lat[n++] = (now() - t) * 1e6;
+    }
+
+    cyrusdb_close(db);
+
+    if (write(fd, &nfsync, sizeof(nfsync)) != sizeof(nfsync) ||
+        write(fd, &n, sizeof(n)) != sizeof(n) ||
+        write(fd, lat, n * sizeof(float)) != (ssize_t) (n * sizeof(float))) {
+        _exit(1);
+    }
+
+    _exit(0);
+}
+
+static void bench(const char *backend, const char *dir,
+                  const struct workload *w, int procs, const char *val)
+{
+    char fname[4096];
+    struct db *db = NULL;
+    float *lat = xmalloc((w->nops + 1) * sizeof(float));
+    long fsyncs = 0, n = 0;
+    off_t before;
+    double t;
+    int i, r, fds[2];
+
+    snprintf(fname, sizeof(fname), "%s/bench.%s", dir, backend);
+    cyrusdb_unlink(backend, fname, 0);
+
+    /* preload, untimed */
+    r = cyrusdb_open(backend, fname, CYRUSDB_CREATE, &db);
+    if (r) {
+        fprintf(stderr, "%s: create %s: %s\n", backend, fname, cyrusdb_strerror(r));
+        free(lat);
+        return;
+    }
+    if (w->npreload) {
+        struct txn *tid = NULL;
+
+        for (i = 0; i < w->npreload; i++) {
+            const struct op *op = &w->preload[i];
+            r = cyrusdb_store(db, op->key, strlen(op->key),
+                              val, op->vallen, &tid);
+            if (r) break;
+        }
+        if (!r) r = cyrusdb_commit(db, tid);
+        else if (tid) cyrusdb_abort(db, tid);
+    }
+    cyrusdb_close(db);
+    if (r) {
+        fprintf(stderr, "%s: preload: %s\n", backend, cyrusdb_strerror(r));
+        free(lat);
+        return;
+    }
+
+    before = dbsize(fname);
+
+    if (pipe(fds)) {
+        perror("pipe");
+        exit(1);
+    }
+
+    t = now();
+    for (i = 0; i < procs; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (!pid) {
+            close(fds[0]);
+            child(backend, fname, w, i, procs, fds[1], val);
+        }
+    }
+    close(fds[1]);
+
+    /* collect what each child sends, in whatever order they finish */
+    for (i = 0; i < procs; i++) {
+        long cf, cn;
+
+        if (read(fds[0], &cf, sizeof(cf)) != sizeof(cf) ||
+            read(fds[0], &cn, sizeof(cn)) != sizeof(cn)) break;
+        fsyncs += cf;
+        while (cn > 0) {
+            ssize_t got = read(fds[0], lat + n, cn * sizeof(float));
+            if (got <= 0) break;
+            n += got / sizeof(float);
+            cn -= got / sizeof(float);
+        }
+    }
+    close(fds[0]);
+    while (wait(NULL) > 0);
+    t = now() - t;
+
+    qsort(lat, n, sizeof(float), cmp_float);
+
+    printf("%-9s %10.0f ops/s  p50 %8.1f us  p99 %8.1f us  "
+           "%7ld fsyncs  %+10lld bytes\n",
+           backend, n / t, n ? lat[n / 2] : 0.0,
+           n ? lat[(long) (n * 0.99)] : 0.0, fsyncs,
+           (long long) (dbsize(fname) - before));
+
+    cyrusdb_unlink(backend, fname, 0);
+    free(lat);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = ".";
+    const char *backends = NULL;
+    struct workload w;
+    strarray_t *names;
+    char *val;
+    int procs = 1, nops = 100000, nkeys = 100000;
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, "b:c:n:k:d:")) != -1) {
+        switch (opt) {
+        case 'b': backends = optarg; break;
+        case 'c': procs = atoi(optarg); break;
+        case 'n': nops = atoi(optarg); break;
+        case 'k': nkeys = atoi(optarg); break;
+        case 'd': dir = optarg; break;
+        default: goto usage;
+        }
+    }
+    if (optind != argc - 1 || procs < 1) {
+    usage:
+        fprintf(stderr, "usage: %s [-b backend[,backend...]] [-c procs] "
+                "[-n ops] [-k keys] [-d dir] "
+                "mboxlist|convmsgid|duplicate|tracefile\n", argv[0]);
+        return 1;
+    }
+
+    memset(&w, 0, sizeof(w));
+    srand(1);
+    if (!strcmp(argv[optind], "mboxlist")) gen_mboxlist(&w, nkeys, nops);
+    else if (!strcmp(argv[optind], "convmsgid")) gen_convmsgid(&w, nkeys, nops);
+    else if (!strcmp(argv[optind], "duplicate")) gen_duplicate(&w, nkeys, nops);
+    else read_trace(&w, argv[optind]);
+
+    /* values are never looked at, so they can all share one buffer */
+    val = xzmalloc(65536);
+    for (i = 0; i < w.npreload; i++)
+        if (w.preload[i].vallen > 65536) w.preload[i].vallen = 65536;
+    for (i = 0; i < w.nops; i++)
+        if (w.ops[i].vallen > 65536) w.ops[i].vallen = 65536;
+
+    libcyrus_config_setstring(CYRUSOPT_CONFIG_DIR, dir);
+    libcyrus_init();
+    cyrusdb_init();
+
+    if (backends) {
+        names = strarray_split(backends, ",", STRARRAY_TRIM);
+    }
+    else {
+        names = cyrusdb_backends();
+        strarray_remove_all(names, "quotalegacy");
+        strarray_remove_all(names, "sql");
+    }
+
+    printf("%s: %d keys preloaded, %d ops in %d process%s\n",
+           argv[optind], w.npreload, w.nops, procs, procs == 1 ? "" : "es");
+    for (i = 0; i < strarray_size(names); i++)
+        bench(strarray_nth(names, i), dir, &w, procs, val);
+
+    strarray_free(names);
+    cyrusdb_done();
+    libcyrus_done();
+    free(val);
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+/* Micro-benchmark of tzdist geolocation candidate selection:
+ * linear scan of every polygon's bounding box vs. the shapelib quadtree.
+ *
+ * usage: geobench <tz_world shapefile> [npoints]
+ *
+ * Picks npoints pseudo-random points, finds the polygons containing
+ * each one both ways, and reports lookups per second.  Both methods
+ * must find the same number of matches.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <shapefil.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int pt_in_poly(int nvert, double *vx, double *vy, double px, double py)
+{
+    int i, j, in = 0;
+
+    for (i = 0, j = nvert - 1; i < nvert; j = i++) {
+        if (((vy[i] > py) != (vy[j] > py)) &&
+            (px < (vx[j] - vx[i]) * (py - vy[i]) / (vy[j] - vy[i]) + vx[i])) {
+            in = !in;
+        }
+    }
+
+    return in;
+}
+
+static int test_shape(SHPHandle shp, int i, double x, double y)
+{
+    SHPObject *poly = SHPReadObject(shp, i);
+    int r = 0;
+
+    if (x >= poly->dfXMin && x <= poly->dfXMax &&
+        y >= poly->dfYMin && y <= poly->dfYMax) {
+        r = pt_in_poly(poly->nVertices, poly->padfX, poly->padfY, x, y);
+    }
+
+    SHPDestroyObject(poly);
+
+    return r;
+}
+
+static void report(const char *name, double secs, long n, long found)
+{
+    printf("%-8s %8.3f s %10.1f lookups/s (%ld matches)\n",
+           name, secs, n / secs, found);
+}
+
+int main(int argc, char **argv)
+{
+    int npoints = argc > 2 ? atoi(argv[2]) : 1000;
+    long found_scan = 0, found_tree = 0;
+    double *px, *py, t;
+    SHPHandle shp;
+    SHPTree *tree;
+    int i, n, npoly;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <shapefile> [npoints]\n", argv[0]);
+        return 1;
+    }
+
+    if (!(shp = SHPOpen(argv[1], "rb"))) {
+        fprintf(stderr, "can't open %s\n", argv[1]);
+        return 1;
+    }
+    SHPGetInfo(shp, &npoly, NULL, NULL, NULL);
+
+    px = malloc(npoints * sizeof(double));
+    py = malloc(npoints * sizeof(double));
+    srand(42);
+    for (i = 0; i < npoints; i++) {
+        px[i] = 360.0 * rand() / RAND_MAX - 180.0;
+        py[i] = 180.0 * rand() / RAND_MAX - 90.0;
+    }
+
+    t = now();
+    for (i = 0; i < npoints; i++) {
+        for (n = 0; n < npoly; n++)
+            found_scan += test_shape(shp, n, px[i], py[i]);
+    }
+    report("scan", now() - t, npoints, found_scan);
+
+    t = now();
+    tree = SHPCreateTree(shp, 2, 0, NULL, NULL);
+    SHPTreeTrimExtraNodes(tree);
+    printf("%-8s %8.3f s\n", "index", now() - t);
+
+    t = now();
+    for (i = 0; i < npoints; i++) {
+        double minbound[4] = { px[i], py[i], 0.0, 0.0 };
+        double maxbound[4] = { px[i], py[i], 0.0, 0.0 };
+        int count = 0;
+        int *ids = SHPTreeFindLikelyShapes(tree, minbound, maxbound, &count);
+
+        for (n = 0; n < count; n++)
+            found_tree += test_shape(shp, ids[n], px[i], py[i]);
+        free(ids);
+    }
+    report("quadtree", now() - t, npoints, found_tree);
+
+    SHPDestroyTree(tree);
+    SHPClose(shp);
+    free(px);
+    free(py);
+
+    if (found_scan != found_tree) {
+        fprintf(stderr, "match mismatch\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+/* Micro-benchmark of hash_table against hashoa_table.
+ *
+ * usage: hashbench [nkeys [rounds]]
+ *
+ * Inserts nkeys mailbox-shaped keys, looks every one of them up
+ * 'rounds' times (plus as many misses), then frees the table.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cyrus/hash.h>
+#include <cyrus/hashoa.h>
+
+void fatal(const char *s, int code)
+{
+    fprintf(stderr, "%d:%s\n", code, s);
+    exit(1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, const char *op, double secs, long n)
+{
+    printf("%-8s %-8s %8.3f ms %8.1f ns/op\n",
+           name, op, secs * 1e3, secs * 1e9 / n);
+}
+
+int main(int argc, char **argv)
+{
+    int nkeys = argc > 1 ? atoi(argv[1]) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    char **keys = malloc(2 * nkeys * sizeof(char *));
+    hash_table ht = HASH_TABLE_INITIALIZER;
+    hashoa_table ot = HASHOA_TABLE_INITIALIZER;
+    volatile long found = 0;
+    double t;
+    int i, r;
+
+    /* the second half are never inserted, to measure misses */
+    for (i = 0; i < 2 * nkeys; i++) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "Fuser.u%d.INBOX.folder%d", i % 997, i);
+        keys[i] = strdup(buf);
+    }
+
+    /* size both as a caller would: for the expected number of keys */
+    t = now();
+    construct_hash_table(&ht, nkeys, 0);
+    for (i = 0; i < nkeys; i++) hash_insert(keys[i], keys[i], &ht);
+    report("hash", "insert", now() - t, nkeys);
+
+    t = now();
+    for (r = 0; r < rounds; r++)
+        for (i = 0; i < 2 * nkeys; i++) found += !!hash_lookup(keys[i], &ht);
+    report("hash", "lookup", now() - t, (long) rounds * 2 * nkeys);
+
+    t = now();
+    free_hash_table(&ht, NULL);
+    report("hash", "free", now() - t, nkeys);
+
+    t = now();
+    construct_hashoa_table(&ot, nkeys);
+    for (i = 0; i < nkeys; i++) hashoa_insert(keys[i], keys[i], &ot);
+    report("hashoa", "insert", now() - t, nkeys);
+
+    t = now();
+    for (r = 0; r < rounds; r++)
+        for (i = 0; i < 2 * nkeys; i++) found += !!hashoa_lookup(keys[i], &ot);
+    report("hashoa", "lookup", now() - t, (long) rounds * 2 * nkeys);
+
+    t = now();
+    free_hashoa_table(&ot, NULL);
+    report("hashoa", "free", now() - t, nkeys);
+
+    if (found != (long) 2 * rounds * nkeys) fatal("lookup mismatch", 1);
+
+    for (i = 0; i < 2 * nkeys; i++) free(keys[i]);
+    free(keys);
+
+    return 0;
+}
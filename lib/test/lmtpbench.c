@@ -0,0 +1,524 @@
+/* Benchmark of end to end LMTP delivery against a test instance.
+ *
+ * usage: lmtpbench [-c procs] [-n msgs] [-r rcpts] [-u userfmt]
+ *                  [-U users] [-D dup%] [-S size] [-f device]
+ *                  [-s statsfile] host:port|socket [corpus...]
+ *
+ * 'procs' connections share 'msgs' deliveries between them.  Each
+ * message goes to 'rcpts' recipients picked from 'users' names made
+ * with 'userfmt' (default "user%d"), and 'dup' percent of them are
+ * sent again with the same Message-ID and recipients, for duplicate
+ * suppression to catch.  The messages are the files (or the files in
+ * the directories) given as the corpus, or generated ones of about
+ * 'size' bytes.  Sieve scripts, duplicate suppression, conversations
+ * and quota are whatever the instance has configured for those users.
+ *
+ * Reported: messages/s over the wall clock time, p50 and p99 latency
+ * of a whole transaction, and failed recipients.  With -f, the cache
+ * flushes the named block device completed during the run, per
+ * message (from /proc/diskstats, so Linux only), which is what the
+ * server's fsyncs cost.  With -s, the per-stage delivery timings
+ * (parse, sieve, append, commit) lmtpd records in its prometheus
+ * stats, from the report promstatsd writes: 'statsfile' is
+ * <configdirectory>/stats/report.txt, and lmtpbench waits for it to
+ * be rewritten after the run.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <cyrus/strarray.h>
+#include <cyrus/util.h>
+#include <cyrus/xmalloc.h>
+
+void fatal(const char *s, int code)
+{
+    fprintf(stderr, "%d:%s\n", code, s);
+    exit(1);
+}
+
+static const char *stages[] = {
+    "verify", "mlookup", "parse", "sieve", "append",
+    "conversations", "fsync", "commit", "other"
+};
+#define NSTAGES (int) (sizeof(stages) / sizeof(stages[0]))
+
+struct stagestats {
+    double sum[NSTAGES];
+    double count[NSTAGES];
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* CRLF line endings, dot-stuffed, and any Message-ID header renamed
+ * out of the way of the one we add */
+static void add_message(struct buf *msg, const char *base, size_t len)
+{
+    int bol = 1, inheaders = 1;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (bol) {
+            if (inheaders && (base[i] == '\r' || base[i] == '\n'))
+                inheaders = 0;
+            if (inheaders && !strncasecmp(base + i, "Message-ID:", 11))
+                buf_appendcstr(msg, "X-Original-");
+            if (base[i] == '.')
+                buf_putc(msg, '.');
+        }
+        bol = (base[i] == '\n');
+        if (bol && (!i || base[i-1] != '\r'))
+            buf_putc(msg, '\r');
+        buf_putc(msg, base[i]);
+    }
+    if (!bol) buf_appendcstr(msg, "\r\n");
+}
+
+static void read_corpus(struct buf **corpus, int *n, const char *path)
+{
+    struct buf raw = BUF_INITIALIZER;
+    char chunk[65536];
+    struct stat sbuf;
+    size_t got;
+    FILE *f;
+
+    if (stat(path, &sbuf)) {
+        perror(path);
+        exit(1);
+    }
+
+    if (S_ISDIR(sbuf.st_mode)) {
+        DIR *dir = opendir(path);
+        struct dirent *d;
+
+        while (dir && (d = readdir(dir))) {
+            char fname[4096];
+
+            if (d->d_name[0] == '.') continue;
+            snprintf(fname, sizeof(fname), "%s/%s", path, d->d_name);
+            if (!stat(fname, &sbuf) && S_ISREG(sbuf.st_mode))
+                read_corpus(corpus, n, fname);
+        }
+        if (dir) closedir(dir);
+        return;
+    }
+
+    if (!(f = fopen(path, "r"))) {
+        perror(path);
+        exit(1);
+    }
+    while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        buf_appendmap(&raw, chunk, got);
+    fclose(f);
+
+    *corpus = xrealloc(*corpus, (*n + 1) * sizeof(struct buf));
+    buf_init(&(*corpus)[*n]);
+    add_message(&(*corpus)[*n], buf_base(&raw), buf_len(&raw));
+    (*n)++;
+    buf_free(&raw);
+}
+
+static void gen_corpus(struct buf **corpus, int *n, int size)
+{
+    struct buf raw = BUF_INITIALIZER;
+    int i;
+
+    *corpus = xzmalloc(16 * sizeof(struct buf));
+    for (i = 0; i < 16; i++) {
+        buf_reset(&raw);
+        buf_printf(&raw, "From: Sender %d <sender%d@example.com>\n"
+                         "To: Undisclosed recipients:;\n"
+                         "Date: Mon, 7 Feb 1994 21:52:25 -0800\n"
+                         "Subject: lmtpbench message %d\n"
+                         "MIME-Version: 1.0\n"
+                         "Content-Type: text/plain; charset=us-ascii\n"
+                         "\n", i, i, i);
+        while ((int) buf_len(&raw) < size) {
+            buf_appendcstr(&raw, "The quick brown fox jumps over the "
+                                 "lazy dog, again and again.\n");
+        }
+        add_message(&(*corpus)[i], buf_base(&raw), buf_len(&raw));
+    }
+    *n = 16;
+    buf_free(&raw);
+}
+
+static int connect_to(const char *target)
+{
+    int sock = -1;
+
+    if (strchr(target, '/')) {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, target, sizeof(addr.sun_path) - 1);
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock >= 0 && connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    else {
+        struct addrinfo hints, *res, *ai;
+        char *host = xstrdup(target);
+        char *port = strrchr(host, ':');
+
+        if (port) *port++ = '\0';
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if (!getaddrinfo(host, port ? port : "lmtp", &hints, &res)) {
+            for (ai = res; ai && sock < 0; ai = ai->ai_next) {
+                sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                if (sock >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen)) {
+                    close(sock);
+                    sock = -1;
+                }
+            }
+            /* don't let the tail of a message wait for a delayed ack */
+            if (sock >= 0) {
+                int on = 1;
+                setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            freeaddrinfo(res);
+        }
+        free(host);
+    }
+
+    return sock;
+}
+
+/* read a (possibly multi-line) reply, return its code */
+static int reply(FILE *in)
+{
+    char line[1024];
+
+    do {
+        if (!fgets(line, sizeof(line), in)) return 0;
+    } while (strlen(line) > 3 && line[3] == '-');
+
+    return atoi(line);
+}
+
+static int send_all(int sock, const char *base, size_t len)
+{
+    while (len) {
+        ssize_t n = write(sock, base, len);
+        if (n <= 0) return -1;
+        base += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int cmp_float(const void *a, const void *b)
+{
+    float x = *(const float *) a, y = *(const float *) b;
+    return x < y ? -1 : x > y;
+}
+
+struct options {
+    const char *target;
+    const char *userfmt;
+    int procs, nmsgs, nrcpts, nusers, dup;
+};
+
+/* one child: deliver every procs'th message, send back failures and
+ * latencies */
+static void child(const struct options *o, const struct buf *corpus,
+                  int ncorpus, int id, int fd)
+{
+    float *lat = xmalloc((o->nmsgs / o->procs + 1) * sizeof(float));
+    struct buf cmd = BUF_INITIALIZER;
+    long n = 0, failed = 0;
+    int msgid = 0, first = 0;
+    int i, k, sock;
+    FILE *in;
+
+    if ((sock = connect_to(o->target)) < 0 || !(in = fdopen(sock, "r"))) {
+        fprintf(stderr, "can't connect to %s\n", o->target);
+        _exit(1);
+    }
+
+    buf_setcstr(&cmd, "LHLO lmtpbench\r\n");
+    if (reply(in) != 220 || send_all(sock, cmd.s, cmd.len) ||
+        reply(in) != 250) {
+        fprintf(stderr, "%s did not greet us\n", o->target);
+        _exit(1);
+    }
+
+    srand(id + 1);
+    for (i = id; i < o->nmsgs; i += o->procs) {
+        const struct buf *msg = &corpus[i % ncorpus];
+        int accepted = 0;
+        double t = now();
+
+        /* a duplicate repeats the last Message-ID and recipients */
+        if (!msgid || rand() % 100 >= o->dup) {
+            msgid = i + 1;
+            first = rand() % o->nusers;
+        }
+
+        buf_setcstr(&cmd, "MAIL FROM:<lmtpbench@example.com>\r\n");
+        if (send_all(sock, cmd.s, cmd.len) || reply(in) != 250) break;
+
+        for (k = 0; k < o->nrcpts; k++) {
+            buf_setcstr(&cmd, "RCPT TO:<");
+            buf_printf(&cmd, o->userfmt, (first + k) % o->nusers);
+            buf_appendcstr(&cmd, ">\r\n");
+            if (send_all(sock, cmd.s, cmd.len)) break;
+            if (reply(in) == 250) accepted++;
+            else failed++;
+        }
+        if (k < o->nrcpts) break;
+
+        if (!accepted) {
+            buf_setcstr(&cmd, "RSET\r\n");
+            if (send_all(sock, cmd.s, cmd.len) || reply(in) != 250) break;
+            continue;
+        }
+
+        buf_setcstr(&cmd, "DATA\r\n");
+        if (send_all(sock, cmd.s, cmd.len) || reply(in) != 354) break;
+
+        buf_reset(&cmd);
+        buf_printf(&cmd, "Message-ID: <lmtpbench-%d@example.com>\r\n", msgid);
+        buf_append(&cmd, msg);
+        buf_appendcstr(&cmd, ".\r\n");
+        if (send_all(sock, cmd.s, cmd.len)) break;
+
+        /* LMTP replies once per accepted recipient */
+        for (k = 0; k < accepted; k++) {
+            int code = reply(in);
+            if (!code) break;
+            if (code != 250) failed++;
+        }
+        if (k < accepted) break;
+
+        lat[n++] = (now() - t) * 1e3;
+    }
+
+    buf_setcstr(&cmd, "QUIT\r\n");
+    if (!send_all(sock, cmd.s, cmd.len)) reply(in);
+    fclose(in);
+    buf_free(&cmd);
+
+    if (write(fd, &failed, sizeof(failed)) != sizeof(failed) ||
+        write(fd, &n, sizeof(n)) != sizeof(n) ||
+        write(fd, lat, n * sizeof(float)) != (ssize_t) (n * sizeof(float))) {
+        _exit(1);
+    }
+
+    _exit(0);
+}
+
+/* completed flush requests of a block device, -1 if not known */
+static long long diskflushes(const char *device)
+{
+    char line[1024], name[256];
+    long long flushes = -1;
+    FILE *f;
+
+    if (!device || !(f = fopen("/proc/diskstats", "r"))) return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long v[17];
+        int n = sscanf(line, "%*u %*u %255s %llu %llu %llu %llu %llu %llu %llu "
+                       "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+                       name, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6],
+                       &v[7], &v[8], &v[9], &v[10], &v[11], &v[12], &v[13],
+                       &v[14], &v[15], &v[16]);
+
+        /* flushes are the 16th statistic, since Linux 5.5 */
+        if (n >= 17 && !strcmp(name, device)) flushes = v[15];
+    }
+    fclose(f);
+
+    return flushes;
+}
+
+/* sum the lmtp stage histograms over all the services in the report */
+static int read_stages(const char *fname, struct stagestats *s)
+{
+    static const char prefix[] = "cyrus_lmtp_stage_seconds_";
+    char line[1024];
+    FILE *f;
+
+    memset(s, 0, sizeof(struct stagestats));
+    if (!(f = fopen(fname, "r"))) return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        const char *p = line + sizeof(prefix) - 1;
+        const char *stage, *val;
+        double *which;
+        int i;
+
+        if (strncmp(line, prefix, sizeof(prefix) - 1)) continue;
+
+        if (!strncmp(p, "sum{", 4)) which = s->sum;
+        else if (!strncmp(p, "count{", 6)) which = s->count;
+        else continue;
+
+        if (!(stage = strstr(p, "stage=\"")) || !(val = strchr(p, '}')))
+            continue;
+        stage += 7;
+        for (i = 0; i < NSTAGES; i++) {
+            size_t len = strlen(stages[i]);
+            if (!strncmp(stage, stages[i], len) && stage[len] == '"')
+                which[i] += atof(val + 1);
+        }
+    }
+    fclose(f);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct options o = { NULL, "user%d", 1, 1000, 1, 100, 0 };
+    const char *device = NULL, *statsfile = NULL;
+    struct stagestats before, after;
+    struct buf *corpus = NULL;
+    float *lat;
+    long failed = 0, n = 0;
+    long long flushes;
+    int ncorpus = 0, size = 4096;
+    int i, opt, fds[2];
+    double t;
+
+    while ((opt = getopt(argc, argv, "c:n:r:u:U:D:S:f:s:")) != -1) {
+        switch (opt) {
+        case 'c': o.procs = atoi(optarg); break;
+        case 'n': o.nmsgs = atoi(optarg); break;
+        case 'r': o.nrcpts = atoi(optarg); break;
+        case 'u': o.userfmt = optarg; break;
+        case 'U': o.nusers = atoi(optarg); break;
+        case 'D': o.dup = atoi(optarg); break;
+        case 'S': size = atoi(optarg); break;
+        case 'f': device = optarg; break;
+        case 's': statsfile = optarg; break;
+        default: goto usage;
+        }
+    }
+    if (optind >= argc || o.procs < 1 || o.nrcpts < 1 ||
+        o.nusers < o.nrcpts || !strstr(o.userfmt, "%d")) {
+    usage:
+        fprintf(stderr, "usage: %s [-c procs] [-n msgs] [-r rcpts] "
+                "[-u userfmt] [-U users] [-D dup%%] [-S size] [-f device] "
+                "[-s statsfile] host:port|socket [corpus...]\n", argv[0]);
+        return 1;
+    }
+    o.target = argv[optind++];
+
+    for (; optind < argc; optind++)
+        read_corpus(&corpus, &ncorpus, argv[optind]);
+    if (!ncorpus) gen_corpus(&corpus, &ncorpus, size);
+
+    if (statsfile && read_stages(statsfile, &before)) {
+        perror(statsfile);
+        return 1;
+    }
+    flushes = diskflushes(device);
+    if (device && flushes < 0)
+        fprintf(stderr, "no flush statistics for %s\n", device);
+
+    if (pipe(fds)) {
+        perror("pipe");
+        return 1;
+    }
+
+    t = now();
+    for (i = 0; i < o.procs; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (!pid) {
+            close(fds[0]);
+            child(&o, corpus, ncorpus, i, fds[1]);
+        }
+    }
+    close(fds[1]);
+
+    /* collect what each child sends, in whatever order they finish */
+    lat = xmalloc((o.nmsgs + 1) * sizeof(float));
+    for (i = 0; i < o.procs; i++) {
+        long cf, cn;
+
+        if (read(fds[0], &cf, sizeof(cf)) != sizeof(cf) ||
+            read(fds[0], &cn, sizeof(cn)) != sizeof(cn)) break;
+        failed += cf;
+        while (cn > 0) {
+            ssize_t got = read(fds[0], lat + n, cn * sizeof(float));
+            if (got <= 0) break;
+            n += got / sizeof(float);
+            cn -= got / sizeof(float);
+        }
+    }
+    close(fds[0]);
+    while (wait(NULL) > 0);
+    t = now() - t;
+
+    qsort(lat, n, sizeof(float), cmp_float);
+
+    printf("%ld messages x %d recipients in %d connection%s, %d%% duplicates\n",
+           n, o.nrcpts, o.procs, o.procs == 1 ? "" : "s", o.dup);
+    printf("%10.1f msgs/s  p50 %8.1f ms  p99 %8.1f ms  %ld failed recipients\n",
+           n / t, n ? lat[n / 2] : 0.0, n ? lat[(long) (n * 0.99)] : 0.0,
+           failed);
+
+    if (flushes >= 0) {
+        long long end = diskflushes(device);
+        printf("%10.2f %s flushes/msg\n",
+               n ? (double) (end - flushes) / n : 0.0, device);
+    }
+
+    if (statsfile) {
+        time_t finished = time(NULL);
+        struct stat sbuf;
+        int waited;
+
+        /* promstatsd rewrites the report every prometheus_update_freq */
+        for (waited = 0; waited < 120; waited++) {
+            if (!stat(statsfile, &sbuf) && sbuf.st_mtime > finished) break;
+            sleep(1);
+        }
+        if (read_stages(statsfile, &after)) {
+            perror(statsfile);
+        }
+        else {
+            for (i = 0; i < NSTAGES; i++) {
+                double count = after.count[i] - before.count[i];
+                double sum = after.sum[i] - before.sum[i];
+
+                printf("%13s %10.0f observations  %8.3f ms mean  %8.3f ms/msg\n",
+                       stages[i], count, count ? sum * 1e3 / count : 0.0,
+                       n ? sum * 1e3 / n : 0.0);
+            }
+        }
+    }
+
+    for (i = 0; i < ncorpus; i++) buf_free(&corpus[i]);
+    free(corpus);
+    free(lat);
+
+    return 0;
+}
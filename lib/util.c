@@ -44,7 +44,9 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <limits.h>
 #include <pwd.h>
@@ -53,6 +55,10 @@
 #include <syslog.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #if defined(__linux__) && defined(HAVE_LIBCAP)
 #include <sys/capability.h>
 #include <sys/prctl.h>
@@ -73,7 +79,9 @@
 #include "exitcodes.h"
 #include "libconfig.h"
 #include "map.h"
+#include "mpool.h"
 #include "retry.h"
+#include "strarray.h"
 #include "util.h"
 #include "assert.h"
 #include "xmalloc.h"
@@ -508,7 +516,45 @@ EXPORTED int cyrus_mkdir(const char *pathname, mode_t mode __attribute__((unused
     return 0;
 }
 
-static int _copyfile_helper(const char *from, const char *to, int flags)
+/* Copy the contents of @srcfd to @destfd without passing them through
+ * userspace: share the blocks if the filesystem can (reflink), else let
+ * the kernel do the copy.  Returns 0 if the copy is done, -1 if the
+ * caller needs to fall back to read and write. */
+static int _copyfile_kernel(int srcfd, int destfd, size_t size)
+{
+#ifdef FICLONE
+    if (ioctl(destfd, FICLONE, srcfd) == 0)
+        return 0;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = copy_file_range(srcfd, NULL, destfd, NULL,
+                                    size - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    if (done == size) return 0;
+
+    /* start again from the top with the slow way */
+    if (done && ftruncate(destfd, 0) == -1) return -1;
+    lseek(destfd, 0, SEEK_SET);
+#else
+    (void) srcfd;
+    (void) destfd;
+    (void) size;
+#endif
+
+    return -1;
+}
+
+/* If @fdp is not NULL, the copy is left unsynced and its descriptor is
+ * returned there for the caller to fsync and close */
+static int _copyfile_helper(const char *from, const char *to, int flags,
+                            int *fdp)
 {
     int srcfd = -1;
     int destfd = -1;
@@ -558,17 +604,31 @@ static int _copyfile_helper(const char *from, const char *to, int flags)
         goto done;
     }
 
-    map_refresh(srcfd, 1, &src_base, &src_size, sbuf.st_size, from, 0);
+    if (!_copyfile_kernel(srcfd, destfd, sbuf.st_size)) {
+        n = 0;
+    }
+    else {
+        map_refresh(srcfd, 1, &src_base, &src_size, sbuf.st_size, from, 0);
 
-    n = retry_write(destfd, src_base, src_size);
+        n = retry_write(destfd, src_base, src_size);
+    }
 
-    if (n == -1 || fsync(destfd)) {
+    if (n == -1 || (!fdp && fsync(destfd))) {
         syslog(LOG_ERR, "IOERROR: writing %s: %m", to);
         r = -1;
         unlink(to);  /* remove any rubbish we created */
         goto done;
     }
 
+    if (fdp) {
+#ifdef SYNC_FILE_RANGE_WRITE
+        /* get the writeback going now; the fsync comes later */
+        sync_file_range(destfd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+        *fdp = destfd;
+        destfd = -1;
+    }
+
 done:
     map_free(&src_base, &src_size);
 
@@ -578,7 +638,7 @@ done:
     return r;
 }
 
-EXPORTED int cyrus_copyfile(const char *from, const char *to, int flags)
+static int _copyfile(const char *from, const char *to, int flags, int *fdp)
 {
     int r;
 
@@ -586,12 +646,12 @@ EXPORTED int cyrus_copyfile(const char *from, const char *to, int flags)
     if (!strcmp(from, to))
         return -1;
 
-    r = _copyfile_helper(from, to, flags);
+    r = _copyfile_helper(from, to, flags, fdp);
 
     /* try creating the target directory if requested */
     if (r && (flags & COPYFILE_MKDIR)) {
         r = cyrus_mkdir(to, 0755);
-        if (!r) r = _copyfile_helper(from, to, flags & ~COPYFILE_MKDIR);
+        if (!r) r = _copyfile_helper(from, to, flags & ~COPYFILE_MKDIR, fdp);
     }
 
     if (!r && (flags & COPYFILE_RENAME)) {
@@ -602,6 +662,394 @@ EXPORTED int cyrus_copyfile(const char *from, const char *to, int flags)
     return r;
 }
 
+EXPORTED int cyrus_copyfile(const char *from, const char *to, int flags)
+{
+    return _copyfile(from, to, flags, NULL);
+}
+
+/*
+ * Batched copies.  Files which can't be hard linked are written out
+ * without waiting for each one to reach the disk; their writeback is
+ * started straight away and the fsyncs are collected when the batch
+ * fills up or is committed, so the device sees many writes at once
+ * rather than one write-and-wait per file.  The directories holding
+ * the new files are synced after them, once per directory.
+ */
+
+#define COPYFILE_BATCH_MAX 64
+
+struct copyfile_batch {
+    int nfiles;
+    int fds[COPYFILE_BATCH_MAX];
+    strarray_t names;
+};
+
+static int copyfile_batch_sync(struct copyfile_batch *batch)
+{
+    strarray_t dirs = STRARRAY_INITIALIZER;
+    int i;
+    int r = 0;
+
+    for (i = 0; i < batch->nfiles; i++) {
+        const char *name = strarray_nth(&batch->names, i);
+        const char *slash = strrchr(name, '/');
+
+        if (fsync(batch->fds[i])) {
+            syslog(LOG_ERR, "IOERROR: writing %s: %m", name);
+            unlink(name);  /* remove any rubbish we created */
+            r = -1;
+        }
+        else if (slash && slash > name) {
+            char *dir = xstrndup(name, slash - name);
+            if (strarray_find(&dirs, dir, 0) < 0)
+                strarray_appendm(&dirs, dir);
+            else
+                free(dir);
+        }
+        close(batch->fds[i]);
+    }
+
+    /* and the directory entries for them */
+    for (i = 0; i < strarray_size(&dirs); i++) {
+        const char *dir = strarray_nth(&dirs, i);
+        int dirfd = open(dir, O_RDONLY|O_DIRECTORY, 0);
+
+        if (dirfd == -1 || fsync(dirfd)) {
+            syslog(LOG_ERR, "IOERROR: syncing directory %s: %m", dir);
+            r = -1;
+        }
+        if (dirfd != -1) close(dirfd);
+    }
+    strarray_fini(&dirs);
+
+    batch->nfiles = 0;
+    strarray_truncate(&batch->names, 0);
+
+    return r;
+}
+
+EXPORTED struct copyfile_batch *cyrus_copyfile_batch_new(void)
+{
+    return xzmalloc(sizeof(struct copyfile_batch));
+}
+
+/* As cyrus_copyfile(), except that the copy is only guaranteed to be on
+ * disk once cyrus_copyfile_batch_commit() has succeeded */
+EXPORTED int cyrus_copyfile_batch(struct copyfile_batch *batch,
+                                  const char *from, const char *to,
+                                  int flags)
+{
+    int fd = -1;
+    int r;
+
+    /* a renamed source has to be gone only once the copy is durable */
+    assert(!(flags & COPYFILE_RENAME));
+
+    if (batch->nfiles == COPYFILE_BATCH_MAX) {
+        r = copyfile_batch_sync(batch);
+        if (r) return r;
+    }
+
+    r = _copyfile(from, to, flags, &fd);
+
+    if (!r && fd == -1 && (flags & COPYFILE_SYNCLINK)) {
+        /* linked, but the source may not have been synced either */
+        fd = open(to, O_RDONLY, 0);
+        if (fd == -1) {
+            syslog(LOG_ERR, "IOERROR: opening %s: %m", to);
+            return -1;
+        }
+#ifdef SYNC_FILE_RANGE_WRITE
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+    }
+
+    if (!r && fd != -1) {
+        batch->fds[batch->nfiles++] = fd;
+        strarray_append(&batch->names, to);
+    }
+
+    return r;
+}
+
+/* Add a file the caller has written itself through 'fd', to be synced
+ * with the rest of the batch.  The batch takes over 'fd' */
+EXPORTED int cyrus_copyfile_batch_adopt(struct copyfile_batch *batch,
+                                        int fd, const char *name)
+{
+    if (batch->nfiles == COPYFILE_BATCH_MAX) {
+        int r = copyfile_batch_sync(batch);
+        if (r) {
+            close(fd);
+            unlink(name);
+            return r;
+        }
+    }
+
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+
+    batch->fds[batch->nfiles++] = fd;
+    strarray_append(&batch->names, name);
+
+    return 0;
+}
+
+/* Wait for all of the copies in the batch to reach the disk, and free
+ * it.  Returns -1 if any of them failed, in which case those copies
+ * have been removed. */
+EXPORTED int cyrus_copyfile_batch_commit(struct copyfile_batch **batchp)
+{
+    struct copyfile_batch *batch = *batchp;
+    int r;
+
+    if (!batch) return 0;
+
+    r = copyfile_batch_sync(batch);
+    strarray_fini(&batch->names);
+    free(batch);
+    *batchp = NULL;
+
+    return r;
+}
+
+/*
+ * Batched unlinks.  Files are collected and removed a directory at a
+ * time, relative to an open descriptor for the directory, and for a
+ * big enough group in inode order, which keeps filesystems like XFS
+ * walking their inode btrees forwards instead of hopping around them.
+ * Inode numbers the caller doesn't supply are read from the directory.
+ */
+
+#define UNLINK_BATCH_MAX 1024
+#define UNLINK_BATCH_SCAN 64  /* fewer than this per directory: name order */
+
+struct unlink_item {
+    char *path;
+    const char *base;       /* points into path */
+    size_t dirlen;
+    ino_t ino;
+    void *rock;
+};
+
+struct unlink_batch {
+    unlink_batch_cb_t *cb;
+    void *rock;
+    int maxrate;            /* files per second, 0 for no limit */
+    struct timeval start;
+    uint64_t attempted;
+    struct unlink_item *items;
+    int nitems;
+    unsigned long unlinked;
+    unsigned long failed;
+    double seconds;
+};
+
+EXPORTED struct unlink_batch *cyrus_unlink_batch_new(unlink_batch_cb_t *cb,
+                                                     void *rock, int maxrate)
+{
+    struct unlink_batch *batch = xzmalloc(sizeof(struct unlink_batch));
+
+    batch->cb = cb;
+    batch->rock = rock;
+    batch->maxrate = maxrate;
+    batch->items = xmalloc(UNLINK_BATCH_MAX * sizeof(struct unlink_item));
+
+    return batch;
+}
+
+/* queue 'path' for unlinking; 'ino' may be zero if not known */
+EXPORTED void cyrus_unlink_batch_add(struct unlink_batch *batch,
+                                     const char *path, ino_t ino,
+                                     void *itemrock)
+{
+    struct unlink_item *item;
+    const char *slash;
+
+    if (batch->nitems == UNLINK_BATCH_MAX)
+        cyrus_unlink_batch_flush(batch);
+
+    item = &batch->items[batch->nitems++];
+    item->path = xstrdup(path);
+    slash = strrchr(item->path, '/');
+    item->dirlen = slash ? (size_t) (slash - item->path) : 0;
+    item->base = slash ? slash + 1 : item->path;
+    item->ino = ino;
+    item->rock = itemrock;
+}
+
+static int unlink_item_cmp_dir(const void *a, const void *b)
+{
+    const struct unlink_item *x = a;
+    const struct unlink_item *y = b;
+    size_t n = x->dirlen < y->dirlen ? x->dirlen : y->dirlen;
+    int r = memcmp(x->path, y->path, n);
+
+    if (!r) r = (x->dirlen > y->dirlen) - (x->dirlen < y->dirlen);
+    if (!r) r = strcmp(x->base, y->base);
+
+    return r;
+}
+
+static int unlink_item_cmp_base(const void *a, const void *b)
+{
+    const struct unlink_item *x = a;
+    const struct unlink_item *y = b;
+
+    return strcmp(x->base, y->base);
+}
+
+static int unlink_item_cmp_ino(const void *a, const void *b)
+{
+    const struct unlink_item *x = a;
+    const struct unlink_item *y = b;
+
+    return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+/* fill in unknown inode numbers for 'items', which are sorted by name */
+static void unlink_batch_readinodes(int dirfd,
+                                    struct unlink_item *items, int n)
+{
+    struct unlink_item key;
+    struct dirent *d;
+    DIR *dirp;
+    int fd;
+
+    fd = dup(dirfd);
+    if (fd == -1) return;
+
+    dirp = fdopendir(fd);
+    if (!dirp) {
+        close(fd);
+        return;
+    }
+
+    while ((d = readdir(dirp))) {
+        struct unlink_item *hit;
+
+        key.base = d->d_name;
+        hit = bsearch(&key, items, n, sizeof(struct unlink_item),
+                      unlink_item_cmp_base);
+        if (hit && !hit->ino) hit->ino = d->d_ino;
+    }
+
+    closedir(dirp);
+}
+
+static void unlink_batch_throttle(struct unlink_batch *batch)
+{
+    struct timeval now;
+    double elapsed, wanted;
+
+    if (batch->maxrate <= 0) return;
+
+    gettimeofday(&now, NULL);
+    if (!batch->start.tv_sec) batch->start = now;
+
+    elapsed = timesub(&batch->start, &now);
+    wanted = (double) batch->attempted / batch->maxrate;
+
+    if (wanted > elapsed + 0.001)
+        usleep((useconds_t) ((wanted - elapsed) * 1000000));
+}
+
+EXPORTED void cyrus_unlink_batch_flush(struct unlink_batch *batch)
+{
+    struct timeval start, end;
+    int i, j, k;
+
+    if (!batch->nitems) return;
+
+    gettimeofday(&start, NULL);
+
+    qsort(batch->items, batch->nitems, sizeof(struct unlink_item),
+          unlink_item_cmp_dir);
+
+    for (i = 0; i < batch->nitems; i = j) {
+        struct unlink_item *group = &batch->items[i];
+        char *dir = xstrndup(group->path, group->dirlen);
+        int dirfd = -1;
+        int n;
+
+        for (j = i + 1; j < batch->nitems; j++) {
+            if (batch->items[j].dirlen != group->dirlen ||
+                memcmp(batch->items[j].path, group->path, group->dirlen))
+                break;
+        }
+        n = j - i;
+
+        if (group->dirlen)
+            dirfd = open(dir, O_RDONLY|O_DIRECTORY, 0);
+
+        if (dirfd != -1 && n >= UNLINK_BATCH_SCAN) {
+            for (k = 0; k < n; k++) {
+                if (!group[k].ino) {
+                    unlink_batch_readinodes(dirfd, group, n);
+                    break;
+                }
+            }
+            qsort(group, n, sizeof(struct unlink_item), unlink_item_cmp_ino);
+        }
+
+        for (k = 0; k < n; k++) {
+            struct unlink_item *item = &group[k];
+            int r, err = 0;
+
+            unlink_batch_throttle(batch);
+
+            if (dirfd != -1)
+                r = unlinkat(dirfd, item->base, 0);
+            else
+                r = unlink(item->path);
+            batch->attempted++;
+
+            if (r) {
+                err = errno;
+                if (err != ENOENT) batch->failed++;
+            }
+            else batch->unlinked++;
+
+            if (batch->cb) batch->cb(item->path, err, batch->rock, item->rock);
+            free(item->path);
+        }
+
+        if (dirfd != -1) close(dirfd);
+        free(dir);
+    }
+
+    batch->nitems = 0;
+
+    gettimeofday(&end, NULL);
+    batch->seconds += timesub(&start, &end);
+}
+
+/* how many files the batch has removed so far, how many it failed to
+ * remove (other than ones already gone), and the time it took */
+EXPORTED void cyrus_unlink_batch_stats(const struct unlink_batch *batch,
+                                       unsigned long *unlinked,
+                                       unsigned long *failed,
+                                       double *seconds)
+{
+    if (unlinked) *unlinked = batch->unlinked;
+    if (failed) *failed = batch->failed;
+    if (seconds) *seconds = batch->seconds;
+}
+
+/* unlink anything still queued and free the batch */
+EXPORTED void cyrus_unlink_batch_free(struct unlink_batch **batchp)
+{
+    struct unlink_batch *batch = *batchp;
+
+    if (!batch) return;
+
+    cyrus_unlink_batch_flush(batch);
+    free(batch->items);
+    free(batch);
+    *batchp = NULL;
+}
+
 #if defined(__linux__) && defined(HAVE_LIBCAP)
 EXPORTED int set_caps(int stage, int is_master)
 {
@@ -983,10 +1431,18 @@ EXPORTED void _buf_ensure(struct buf *buf, size_t n)
     if (buf->alloc >= newlen)
         return;
 
-    if (buf->alloc) {
+    if (buf->alloc && !(buf->flags & BUF_LOCAL)) {
         buf->alloc = roundup(newlen);
         buf->s = xrealloc(buf->s, buf->alloc);
     }
+    else if (buf->alloc) {
+        /* outgrew borrowed storage, move to the heap */
+        buf->alloc = roundup(newlen);
+        s = xmalloc(buf->alloc);
+        if (buf->len) memcpy(s, buf->s, buf->len);
+        buf->s = s;
+        buf->flags &= ~BUF_LOCAL;
+    }
     else {
         buf->alloc = roundup(newlen);
         s = xmalloc(buf->alloc);
@@ -1027,6 +1483,7 @@ EXPORTED char *buf_newcstring(struct buf *buf)
 EXPORTED char *buf_release(struct buf *buf)
 {
     char *ret = (char *)buf_cstring(buf);
+    if (buf->flags & BUF_LOCAL) ret = xstrndup(ret, buf->len);
     buf_init(buf);
     return ret;
 }
@@ -1046,6 +1503,7 @@ EXPORTED const char *buf_cstringnull_ifempty(const struct buf *buf)
 EXPORTED char *buf_releasenull(struct buf *buf)
 {
     char *ret = (char *)buf_cstringnull(buf);
+    if (ret && (buf->flags & BUF_LOCAL)) ret = xstrndup(ret, buf->len);
     buf_init(buf);
     return ret;
 }
@@ -1099,7 +1557,8 @@ EXPORTED void buf_reset(struct buf *buf)
     if (buf->flags & BUF_MMAP)
         map_free((const char **)&buf->s, &buf->len);
     buf->len = 0;
-    buf->flags = 0;
+    /* borrowed storage stays borrowed, we still can't free it */
+    buf->flags &= BUF_LOCAL;
 }
 
 EXPORTED void buf_truncate(struct buf *buf, ssize_t len)
@@ -1466,9 +1925,25 @@ EXPORTED void buf_init_mmap(struct buf *buf, int onceonly, int fd,
                 size, fname, mboxname);
 }
 
+EXPORTED void buf_init_local(struct buf *buf, char *storage, size_t size)
+{
+    assert(size);
+    buf->alloc = size;
+    buf->len = 0;
+    buf->flags = BUF_LOCAL;
+    buf->s = storage;
+}
+
+EXPORTED void buf_init_mpool(struct buf *buf, struct mpool *pool, size_t size)
+{
+    buf_init_local(buf, mpool_malloc(pool, size), size);
+}
+
 static void _buf_free_data(struct buf *buf)
 {
-    if (buf->alloc)
+    if (buf->flags & BUF_LOCAL)
+        return;
+    else if (buf->alloc)
         free(buf->s);
     else if (buf->flags & BUF_MMAP)
         map_free((const char **)&buf->s, &buf->len);
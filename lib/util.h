@@ -206,11 +206,38 @@ extern int cyrus_mkdir(const char *path, mode_t mode);
 enum {
     COPYFILE_NOLINK = (1<<0),
     COPYFILE_MKDIR  = (1<<1),
-    COPYFILE_RENAME = (1<<2)
+    COPYFILE_RENAME = (1<<2),
+    COPYFILE_SYNCLINK = (1<<3) /* batch only: sync even if hard linked */
 };
 
 extern int cyrus_copyfile(const char *from, const char *to, int flags);
 
+struct copyfile_batch;
+extern struct copyfile_batch *cyrus_copyfile_batch_new(void);
+extern int cyrus_copyfile_batch(struct copyfile_batch *batch,
+                                const char *from, const char *to, int flags);
+extern int cyrus_copyfile_batch_adopt(struct copyfile_batch *batch,
+                                      int fd, const char *name);
+extern int cyrus_copyfile_batch_commit(struct copyfile_batch **batchp);
+
+/* called for each file once the batch has tried to unlink it, with
+ * 'err' the errno if that failed */
+typedef void unlink_batch_cb_t(const char *path, int err,
+                               void *rock, void *itemrock);
+
+struct unlink_batch;
+extern struct unlink_batch *cyrus_unlink_batch_new(unlink_batch_cb_t *cb,
+                                                   void *rock, int maxrate);
+extern void cyrus_unlink_batch_add(struct unlink_batch *batch,
+                                   const char *path, ino_t ino,
+                                   void *itemrock);
+extern void cyrus_unlink_batch_flush(struct unlink_batch *batch);
+extern void cyrus_unlink_batch_stats(const struct unlink_batch *batch,
+                                     unsigned long *unlinked,
+                                     unsigned long *failed,
+                                     double *seconds);
+extern void cyrus_unlink_batch_free(struct unlink_batch **batchp);
+
 enum {
     BEFORE_SETUID,
     AFTER_SETUID,
@@ -250,6 +277,7 @@ extern int64_t now_ms(void);
 extern clock_t sclock(void);
 
 #define BUF_MMAP    (1<<1)
+#define BUF_LOCAL   (1<<2)      /* storage not ours: caller or arena owned */
 
 struct buf {
     char *s;
@@ -312,6 +340,16 @@ void buf_initm(struct buf *buf, char *base, int len);
 void buf_init_ro_cstr(struct buf *buf, const char *str);
 void buf_init_mmap(struct buf *buf, int onceonly, int fd,
                    const char *fname, size_t size, const char *mboxname);
+/* Writable buf over 'size' bytes of storage the caller owns, e.g. a
+ * local array.  Nothing is malloc()ed until the contents outgrow it,
+ * at which point they move to the heap as usual.  buf_free() must still
+ * be called, and the buf must not outlive the storage. */
+void buf_init_local(struct buf *buf, char *storage, size_t size);
+#define buf_init_array(b, arr) buf_init_local((b), (arr), sizeof(arr))
+/* Same, with 'size' bytes taken from 'pool'; valid until the pool
+ * is reset or freed */
+struct mpool;
+void buf_init_mpool(struct buf *buf, struct mpool *pool, size_t size);
 void buf_free(struct buf *buf);
 void buf_move(struct buf *dst, struct buf *src);
 const char *buf_lcase(struct buf *buf);
@@ -979,6 +979,77 @@ EXPORTED void vparse_tobuf(const struct vparse_card *card, struct buf *buf)
         _card_to_tgt(card, &tgt);
 }
 
+/* Copy the BEGIN and END lines of a single card, along with the raw
+ * (still folded) lines of those of its properties named in 'names',
+ * normalising line endings to CRLF.  This is the result of pruning the
+ * parsed card to 'names' and writing it out again, without building
+ * the tree.  Returns -1, leaving 'buf' in an unspecified state, for
+ * anything but one card without nested cards: parse those instead. */
+EXPORTED int vparse_filter_props(const char *base, size_t len,
+                                 const strarray_t *names, struct buf *buf)
+{
+    const char *p = base, *end = base + len;
+    int depth = 0, ncards = 0, keep = 0;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *next = eol ? eol + 1 : end;
+        size_t linelen = (eol ? eol : end) - p;
+
+        if (linelen && p[linelen-1] == '\r') linelen--;
+
+        if (!linelen) {
+            /* blank line */
+        }
+        else if (*p == ' ' || *p == '\t') {
+            /* continuation of the previous line */
+            if (!depth) return -1;
+            if (keep) {
+                buf_appendmap(buf, p, linelen);
+                buf_appendcstr(buf, "\r\n");
+            }
+        }
+        else if (linelen > 6 && !strncasecmp(p, "BEGIN:", 6)) {
+            if (depth++ || ncards++) return -1;
+            buf_appendmap(buf, p, linelen);
+            buf_appendcstr(buf, "\r\n");
+            keep = 0;
+        }
+        else if (linelen > 4 && !strncasecmp(p, "END:", 4)) {
+            if (depth-- != 1) return -1;
+            buf_appendmap(buf, p, linelen);
+            buf_appendcstr(buf, "\r\n");
+            keep = 0;
+        }
+        else {
+            /* property: [group.]name[;params]:value */
+            const char *name = p, *q;
+            char namebuf[256];
+
+            if (!depth) return -1;
+
+            for (q = p; q < p + linelen && *q != ';' && *q != ':'; q++) {
+                if (*q == '.') name = q + 1;
+            }
+            if (q == p + linelen || (size_t) (q - name) >= sizeof(namebuf))
+                return -1;
+
+            memcpy(namebuf, name, q - name);
+            namebuf[q - name] = '\0';
+
+            keep = (strarray_find_case(names, namebuf, 0) >= 0);
+            if (keep) {
+                buf_appendmap(buf, p, linelen);
+                buf_appendcstr(buf, "\r\n");
+            }
+        }
+
+        p = next;
+    }
+
+    return (depth || ncards != 1) ? -1 : 0;
+}
+
 EXPORTED struct vparse_card *vparse_new_card(const char *type)
 {
     struct vparse_card *card = xzmalloc(sizeof(struct vparse_card));
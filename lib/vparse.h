@@ -110,6 +110,10 @@ extern struct vparse_param *vparse_get_param(struct vparse_entry *entry, const c
 extern struct vparse_param *vparse_add_param(struct vparse_entry *entry, const char *name, const char *value);
 
 extern void vparse_tobuf(const struct vparse_card *card, struct buf *buf);
+
+/* copy only the named properties of a single card, without parsing it */
+extern int vparse_filter_props(const char *base, size_t len,
+                               const strarray_t *names, struct buf *buf);
 extern int vparse_restriction_check(struct vparse_card *card);
 
 #endif /* VCARDFAST_H */
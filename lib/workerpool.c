@@ -0,0 +1,157 @@
+/* workerpool.c -- Hand numbered jobs out to a pool of forked processes
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "exitcodes.h"
+#include "retry.h"
+#include "signals.h"
+#include "workerpool.h"
+#include "xmalloc.h"
+
+struct workerpool {
+    int nworkers;
+    pid_t *pids;
+    int failed;         /* couldn't hand out every job */
+};
+
+static void workerpool_worker(int fd, workerpool_job_t *job,
+                              workerpool_done_t *done, void *rock)
+{
+    uint32_t idx;
+    int failed = 0;
+
+    while (retry_read(fd, &idx, sizeof(idx)) == sizeof(idx)) {
+        signals_poll();
+        if (job(idx, rock)) failed = 1;
+    }
+
+    close(fd);
+    if (done) done(rock);
+    exit(failed ? EC_SOFTWARE : 0);
+}
+
+EXPORTED struct workerpool *workerpool_start(int nworkers, unsigned njobs,
+                                             workerpool_job_t *job,
+                                             workerpool_done_t *done,
+                                             void *rock)
+{
+    struct workerpool *pool = xzmalloc(sizeof(struct workerpool));
+    int fds[2];
+    uint32_t idx;
+    int i;
+
+    if (pipe(fds))
+        fatal("could not create worker pipe", EC_OSERR);
+
+    pool->nworkers = nworkers;
+    pool->pids = xzmalloc(nworkers * sizeof(pid_t));
+    for (i = 0; i < nworkers; i++) {
+        pool->pids[i] = fork();
+        if (pool->pids[i] == -1)
+            fatal("could not fork worker", EC_OSERR);
+        if (!pool->pids[i]) {
+            close(fds[1]);
+            workerpool_worker(fds[0], job, done, rock);
+            /* never returns */
+        }
+    }
+    close(fds[0]);
+
+    for (idx = 0; idx < njobs; idx++) {
+        if (retry_write(fds[1], &idx, sizeof(idx)) != sizeof(idx)) {
+            /* the workers are gone: workerpool_wait() will say why */
+            syslog(LOG_ERR, "could not write to workers: %m");
+            pool->failed = 1;
+            break;
+        }
+    }
+    close(fds[1]);
+
+    return pool;
+}
+
+EXPORTED int workerpool_wait(struct workerpool *pool)
+{
+    int r = 0;
+    int i;
+
+    for (i = 0; i < pool->nworkers; i++) {
+        int status = 0;
+
+        if (waitpid(pool->pids[i], &status, 0) == -1) {
+            syslog(LOG_ERR, "waitpid for worker %d: %m", (int) pool->pids[i]);
+            if (!r) r = EC_OSERR;
+        }
+        else if (WIFSIGNALED(status)) {
+            syslog(LOG_ERR, "worker %d killed by signal %d",
+                   (int) pool->pids[i], WTERMSIG(status));
+            if (!r) r = 128 + WTERMSIG(status);
+        }
+        else if (WIFEXITED(status) && WEXITSTATUS(status)) {
+            if (!r) r = WEXITSTATUS(status);
+        }
+    }
+
+    if (!r && pool->failed) r = EC_OSERR;
+
+    free(pool->pids);
+    free(pool);
+
+    return r;
+}
+
+EXPORTED int workerpool_run(int nworkers, unsigned njobs,
+                            workerpool_job_t *job, workerpool_done_t *done,
+                            void *rock)
+{
+    return workerpool_wait(workerpool_start(nworkers, njobs, job, done, rock));
+}
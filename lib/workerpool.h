@@ -0,0 +1,77 @@
+/* workerpool.h -- Hand numbered jobs out to a pool of forked processes
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef INCLUDED_WORKERPOOL_H
+#define INCLUDED_WORKERPOOL_H
+
+/* Run in a worker for each job, 0 <= idx < njobs.  Non-zero marks the
+ * worker as failed, although it carries on with the remaining jobs. */
+typedef int workerpool_job_t(unsigned idx, void *rock);
+
+/* Run in each worker once the jobs have run out, just before it exits:
+ * the place for cyrus_done() and friends. */
+typedef void workerpool_done_t(void *rock);
+
+struct workerpool;
+
+/* Fork 'nworkers' processes and feed them the job indexes through a
+ * pipe, so that a worker which lands a slow job doesn't hold up the
+ * others.  Returns once every index has been handed out, leaving the
+ * caller free to do its own share before workerpool_wait().  Anything
+ * the workers mustn't share with the parent (a database handle, say)
+ * has to be closed before calling this. */
+extern struct workerpool *workerpool_start(int nworkers, unsigned njobs,
+                                           workerpool_job_t *job,
+                                           workerpool_done_t *done,
+                                           void *rock);
+
+/* Reap the workers and free 'pool'.  Returns 0 if all of them exited
+ * successfully, else the exit status of the first one that didn't, or
+ * 128 plus the signal number if it was killed. */
+extern int workerpool_wait(struct workerpool *pool);
+
+/* workerpool_start() followed straight away by workerpool_wait() */
+extern int workerpool_run(int nworkers, unsigned njobs,
+                          workerpool_job_t *job, workerpool_done_t *done,
+                          void *rock);
+
+#endif /* INCLUDED_WORKERPOOL_H */
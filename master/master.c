@@ -70,6 +70,9 @@
 #include <errno.h>
 #include <limits.h>
 #include <math.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 #include <inttypes.h>
 
 #ifndef PATH_MAX
@@ -114,6 +117,14 @@
   int deny_severity = LOG_ERR;
 #endif
 
+/* The SNMP agent wants an fd_set to add its own descriptors to,
+ * so with SNMP support the main loop stays on pselect() */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_PWAIT) && defined(HAVE_PSELECT) \
+    && !defined(HAVE_UCDSNMP) && !defined(HAVE_NETSNMP)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
 #include "masterconf.h"
 
 #include "master.h"
@@ -224,6 +235,101 @@ static int myselect(int nfds, fd_set *rfds, fd_set *wfds,
 #endif
 }
 
+#ifdef USE_EPOLL
+/*
+ * The main loop waits on a persistent epoll set rather than rebuilding
+ * fd_sets over every service on each pass.  A service's status pipe
+ * stays registered for as long as it is open; its listener is armed
+ * edge-triggered and one-shot whenever we'd spawn a child for a new
+ * connection, and re-armed (which re-evaluates readiness) on the next
+ * pass that still wants it.  Either way a wakeup costs only the ready
+ * descriptors.
+ */
+#define EPOLL_MAXEVENTS 64
+#define EPOLL_TAG(si, lsn)  (((uint64_t) (si) << 1) | (lsn))
+#define EPOLL_TAG_SI(tag)   ((int) ((tag) >> 1))
+#define EPOLL_TAG_LSN(tag)  ((int) ((tag) & 1))
+
+static int epollfd = -1;
+
+static int mywait(struct epoll_event *events, int maxevents,
+                  struct timeval *tout)
+{
+    int timeout = -1;
+
+    if (tout) {
+        /* round up, so a short delay doesn't become a busy loop */
+        timeout = tout->tv_sec * 1000 + (tout->tv_usec + 999) / 1000;
+    }
+    return epoll_pwait(epollfd, events, maxevents, timeout, &pselect_sigmask);
+}
+
+/* bring the registration of Services[si] in line with what we want */
+static void service_watch(int si, int want_socket)
+{
+    struct service *s = &Services[si];
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+
+    if (s->watched_stat != s->stat[0]) {
+        if (s->watched_stat >= 0)
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, s->watched_stat, NULL);
+        s->watched_stat = -1;
+
+        if (s->stat[0] >= 0) {
+            ev.events = EPOLLIN;
+            ev.data.u64 = EPOLL_TAG(si, 0);
+            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, s->stat[0], &ev) < 0)
+                fatalf(1, "unable to watch %s/%s status pipe: %m",
+                       SERVICEPARAM(s->name), SERVICEPARAM(s->familyname));
+            s->watched_stat = s->stat[0];
+        }
+    }
+
+    if (s->watched_socket >= 0 && s->watched_socket != s->socket) {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, s->watched_socket, NULL);
+        s->watched_socket = -1;
+        s->socket_armed = 0;
+    }
+
+    if (want_socket && !s->socket_armed) {
+        int op = s->watched_socket >= 0 ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+        ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+        ev.data.u64 = EPOLL_TAG(si, 1);
+        if (epoll_ctl(epollfd, op, s->socket, &ev) < 0)
+            fatalf(1, "unable to watch %s/%s listener: %m",
+                   SERVICEPARAM(s->name), SERVICEPARAM(s->familyname));
+        s->watched_socket = s->socket;
+        s->socket_armed = 1;
+    }
+    else if (!want_socket && s->socket_armed) {
+        /* leave it registered, just quiet */
+        ev.events = 0;
+        ev.data.u64 = EPOLL_TAG(si, 1);
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, s->watched_socket, &ev);
+        s->socket_armed = 0;
+    }
+}
+
+/* must be called before the master closes a service's descriptors:
+ * children still hold the listener, so the kernel won't drop it for us */
+static void service_unwatch(struct service *s)
+{
+    if (s->watched_stat >= 0)
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, s->watched_stat, NULL);
+    if (s->watched_socket >= 0)
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, s->watched_socket, NULL);
+
+    s->watched_stat = -1;
+    s->watched_socket = -1;
+    s->socket_armed = 0;
+}
+#else
+#define service_unwatch(s)
+#endif /* USE_EPOLL */
+
 EXPORTED void fatal(const char *msg, int code)
 {
     syslog(LOG_CRIT, "%s", msg);
@@ -483,6 +589,11 @@ static struct service *service_add(const struct service *proto)
         s->stat[1] = -1;
     }
 
+    /* a new entry's descriptors are not yet in the event loop */
+    s->watched_stat = -1;
+    s->watched_socket = -1;
+    s->socket_armed = 0;
+
     return s;
 }
 
@@ -837,12 +948,74 @@ static int service_is_fork_limited(struct service *s)
     return 0;
 }
 
+/*
+ * Adaptive prefork: keep about PREFORK_HEADROOM seconds worth of
+ * connections (at the recent accept rate) ready, between the configured
+ * prefork and maxprefork.  Grow at once, by half again if we ran out of
+ * ready workers; shrink one worker per interval, so that a brief lull
+ * doesn't throw away the pool.  Surplus workers are not killed, they
+ * exit by themselves once their reuse timeout (-T) expires.
+ */
+#define PREFORK_INTERVAL    1.0 /* seconds */
+#define PREFORK_ALPHA       0.8 /* rate estimator decay, per second */
+#define PREFORK_HEADROOM    1.0 /* seconds */
+static void service_adapt_prefork(struct service *s, const struct timeval *now)
+{
+    double interval;
+    int target;
+
+    if (s->maxprefork <= s->min_workers)
+        return;
+
+    interval = timesub(&s->last_adapt, now);
+    if (interval < 0.0) {
+        /* clock went backwards, start over */
+        s->last_adapt = *now;
+        s->adapt_connections = s->nconnections;
+        return;
+    }
+    if (interval < PREFORK_INTERVAL)
+        return;
+
+    double f = pow(PREFORK_ALPHA, interval);
+    s->connrate = f * s->connrate +
+                  (1.0-f) * ((s->nconnections - s->adapt_connections) / interval);
+
+    target = (int) ceil(s->connrate * PREFORK_HEADROOM);
+    if (s->adapt_starved)
+        target = MAX(target, s->desired_workers + s->desired_workers / 2 + 1);
+    if (target > s->maxprefork) target = s->maxprefork;
+    if (target < s->min_workers) target = s->min_workers;
+
+    if (target > s->desired_workers) {
+        if (verbose)
+            syslog(LOG_DEBUG, "service %s/%s: prefork %d -> %d (%.1f conn/s%s)",
+                   SERVICEPARAM(s->name), SERVICEPARAM(s->familyname),
+                   s->desired_workers, target, s->connrate,
+                   s->adapt_starved ? ", starved" : "");
+        s->desired_workers = target;
+        s->prefork_grows++;
+    }
+    else if (target < s->desired_workers) {
+        if (verbose)
+            syslog(LOG_DEBUG, "service %s/%s: prefork %d -> %d (%.1f conn/s)",
+                   SERVICEPARAM(s->name), SERVICEPARAM(s->familyname),
+                   s->desired_workers, s->desired_workers - 1, s->connrate);
+        s->desired_workers--;
+        s->prefork_shrinks++;
+    }
+
+    s->last_adapt = *now;
+    s->adapt_connections = s->nconnections;
+    s->adapt_starved = 0;
+}
+
 static void spawn_service(int si)
 {
     pid_t p;
     int i;
     char path[PATH_MAX];
-    static char name_env[100], name_env2[100], name_env3[100];
+    static char name_env[100], name_env2[100], name_env3[100], name_env4[100];
     struct centry *c;
     struct service *s = &Services[si];
 
@@ -910,6 +1083,25 @@ static void spawn_service(int si)
         putenv(name_env);
         snprintf(name_env2, sizeof(name_env2), "CYRUS_ID=%d", s->associate);
         putenv(name_env2);
+        if (s->listen && !s->acceptlock) {
+            snprintf(name_env4, sizeof(name_env4), "CYRUS_NOACCEPTLOCK=1");
+            putenv(name_env4);
+        }
+
+#ifdef HAVE_SCHED_SETAFFINITY
+        if (s->cpuaffinity) {
+            /* spread the children of this service round-robin */
+            long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+            if (ncpus > 0) {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(s->nforks % ncpus, &cpus);
+                if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+                    syslog(LOG_WARNING, "can't set CPU affinity for %s: %m",
+                           s->name);
+            }
+        }
+#endif
 
         execv(path, s->exec->data);
         syslog(LOG_ERR, "couldn't exec %s: %m", path);
@@ -1115,6 +1307,7 @@ static void reap_child(void)
                                    SERVICEPARAM(s->name),
                                    SERVICEPARAM(s->familyname));
                             service_forget_exec(s);
+                            service_unwatch(s);
                             xclose(s->socket);
                         }
                     }
@@ -1534,6 +1727,7 @@ static void process_msg(int si, struct notify_message *msg)
                        SERVICEPARAM(s->name), SERVICEPARAM(s->familyname), c->pid);
             centry_set_state(c, SERVICE_STATE_BUSY);
             s->ready_workers--;
+            if (!s->ready_workers) s->adapt_starved = 1;
             break;
 
         case SERVICE_STATE_DEAD:
@@ -1742,7 +1936,10 @@ static void add_service(const char *name, struct entry *e, void *rock)
     char *cmd = xstrdup(masterconf_getstring(e, "cmd", ""));
     int prefork = masterconf_getint(e, "prefork", 0);
     int babysit = masterconf_getswitch(e, "babysit", 0);
+    int acceptlock = masterconf_getswitch(e, "acceptlock", 1);
+    int cpuaffinity = masterconf_getswitch(e, "cpuaffinity", 0);
     int maxforkrate = masterconf_getint(e, "maxforkrate", 0);
+    int maxprefork = masterconf_getint(e, "maxprefork", 0);
     char *listen = xstrdup(masterconf_getstring(e, "listen", ""));
     char *proto = xstrdup(masterconf_getstring(e, "proto", "tcp"));
     char *max = xstrdup(masterconf_getstring(e, "maxchild", "-1"));
@@ -1831,12 +2028,21 @@ static void add_service(const char *name, struct entry *e, void *rock)
         if (Services[i].max_workers < 0) {
             Services[i].max_workers = INT_MAX;
         }
+        if (maxprefork > Services[i].max_workers)
+            maxprefork = Services[i].max_workers;
     } else {
         /* udp */
         if (prefork > 1) prefork = 1;
         Services[i].desired_workers = prefork;
         Services[i].max_workers = 1;
+        maxprefork = 0;
     }
+    Services[i].min_workers = prefork;
+    Services[i].maxprefork = maxprefork;
+    Services[i].acceptlock = acceptlock;
+    Services[i].cpuaffinity = cpuaffinity;
+    gettimeofday(&Services[i].last_adapt, 0);
+    Services[i].adapt_connections = Services[i].nconnections;
 
     if (reconfig) {
         /* reconfiguring an existing service, update any other instances */
@@ -1846,6 +2052,12 @@ static void add_service(const char *name, struct entry *e, void *rock)
                 Services[j].maxforkrate = Services[i].maxforkrate;
                 Services[j].exec = Services[i].exec;
                 Services[j].desired_workers = Services[i].desired_workers;
+                Services[j].min_workers = Services[i].min_workers;
+                Services[j].maxprefork = Services[i].maxprefork;
+                Services[j].acceptlock = Services[i].acceptlock;
+                Services[j].cpuaffinity = Services[i].cpuaffinity;
+                Services[j].last_adapt = Services[i].last_adapt;
+                Services[j].adapt_connections = Services[j].nconnections;
                 Services[j].babysit = Services[i].babysit;
                 Services[j].max_workers = Services[i].max_workers;
             }
@@ -2104,6 +2316,48 @@ static void do_prom_report(struct timeval now)
 
     /* XXX what is nconnections? */
 
+    buf_printf(&report, "# HELP %s %s\n",
+                        "cyrus_master_desired_workers",
+                        "The number of ready workers we aim to have");
+    buf_appendcstr(&report, "# TYPE cyrus_master_desired_workers gauge\n");
+    for (i = 0; i < nservices; i++) {
+        const struct service *s = &Services[i];
+        buf_printf(&report, "cyrus_master_desired_workers{service=\"%s\",family=\"%s\"}",
+                            s->name, s->familyname);
+        buf_printf(&report, " %d %" PRId64 "\n",
+                            s->desired_workers, last_updated);
+    }
+
+    buf_printf(&report, "# HELP %s %s\n",
+                        "cyrus_master_connections_per_second",
+                        "The recent rate of connections (adaptive prefork only)");
+    buf_appendcstr(&report, "# TYPE cyrus_master_connections_per_second gauge\n");
+    for (i = 0; i < nservices; i++) {
+        const struct service *s = &Services[i];
+        if (s->maxprefork <= s->min_workers) continue;
+        buf_printf(&report, "cyrus_master_connections_per_second{service=\"%s\",family=\"%s\"}",
+                            s->name, s->familyname);
+        buf_printf(&report, " %g %" PRId64 "\n",
+                            s->connrate, last_updated);
+    }
+
+    buf_printf(&report, "# HELP %s %s\n",
+                        "cyrus_master_prefork_changes_total",
+                        "The number of adaptive prefork adjustments");
+    buf_appendcstr(&report, "# TYPE cyrus_master_prefork_changes_total counter\n");
+    for (i = 0; i < nservices; i++) {
+        const struct service *s = &Services[i];
+        if (s->maxprefork <= s->min_workers) continue;
+        buf_printf(&report, "cyrus_master_prefork_changes_total{service=\"%s\",family=\"%s\",direction=\"grow\"}",
+                            s->name, s->familyname);
+        buf_printf(&report, " %d %" PRId64 "\n",
+                            s->prefork_grows, last_updated);
+        buf_printf(&report, "cyrus_master_prefork_changes_total{service=\"%s\",family=\"%s\",direction=\"shrink\"}",
+                            s->name, s->familyname);
+        buf_printf(&report, " %d %" PRId64 "\n",
+                            s->prefork_shrinks, last_updated);
+    }
+
     buf_printf(&report, "# HELP %s %s\n",
                         "cyrus_master_forks_per_second",
                         "The rate at which we're spawning children");
@@ -2204,6 +2458,7 @@ static void reread_conf(struct timeval now)
             Services[i].desired_workers = 0;
 
             /* close all listeners */
+            service_unwatch(&Services[i]);
             shutdown(Services[i].socket, SHUT_RDWR);
             xclose(Services[i].socket);
         }
@@ -2259,7 +2514,11 @@ int main(int argc, char **argv)
     char *alt_config = NULL;
 
     int fd;
+#ifdef USE_EPOLL
+    struct epoll_event events[EPOLL_MAXEVENTS];
+#else
     fd_set rfds;
+#endif
     char *p = NULL;
     int r = 0;
 
@@ -2571,6 +2830,12 @@ int main(int argc, char **argv)
     /* set signal handlers */
     sighandler_setup();
 
+#ifdef USE_EPOLL
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0)
+        fatalf(1, "unable to create epoll instance: %m");
+#endif
+
     /* initialize services */
     for (i = 0; i < nservices; i++) {
         service_create(&Services[i]);
@@ -2622,9 +2887,13 @@ int main(int argc, char **argv)
         }
 
         /* do we have any services undermanned? */
+        gettimeofday(&now, 0);
         for (i = 0; i < nservices; i++) {
             total_children += Services[i].nactive;
             if (!in_shutdown) {
+                if (Services[i].exec)
+                    service_adapt_prefork(&Services[i], &now);
+
                 if (Services[i].exec /* enabled */ &&
                     (Services[i].nactive < Services[i].max_workers) &&
                     (Services[i].ready_workers < Services[i].desired_workers))
@@ -2666,6 +2935,7 @@ int main(int argc, char **argv)
                     Services[i].nconnections = 0;
                     Services[i].associate = 0;
 
+                    service_unwatch(&Services[i]);
                     xclose(Services[i].stat[0]);
                     xclose(Services[i].stat[1]);
                 }
@@ -2683,19 +2953,24 @@ int main(int argc, char **argv)
             reread_conf(now);
         }
 
+#ifndef USE_EPOLL
         FD_ZERO(&rfds);
+#endif
         maxfd = 0;
         for (i = 0; i < nservices; i++) {
             int x = Services[i].stat[0];
 
             int y = Services[i].socket;
+            int want_socket = 0;
 
             /* messages */
             if (x >= 0) {
                 if (verbose > 2)
                     syslog(LOG_DEBUG, "listening for messages from %s/%s",
                            Services[i].name, Services[i].familyname);
+#ifndef USE_EPOLL
                 FD_SET(x, &rfds);
+#endif
             }
             if (x > maxfd) maxfd = x;
 
@@ -2706,10 +2981,19 @@ int main(int argc, char **argv)
                 if (verbose > 2)
                     syslog(LOG_DEBUG, "listening for connections for %s/%s",
                            Services[i].name, Services[i].familyname);
+                want_socket = 1;
+#ifndef USE_EPOLL
                 FD_SET(y, &rfds);
+#endif
                 if (y > maxfd) maxfd = y;
             }
 
+#ifdef USE_EPOLL
+            service_watch(i, want_socket);
+#else
+            (void) want_socket;
+#endif
+
             /* paranoia */
             if (Services[i].ready_workers < 0) {
                 syslog(LOG_ERR, "%s/%s has %d workers?!?", Services[i].name,
@@ -2741,7 +3025,11 @@ int main(int argc, char **argv)
             snmp_select_info(&maxfd, &rfds, tvptr, &blockp);
 #endif
             errno = 0;
+#ifdef USE_EPOLL
+            ready_fds = mywait(events, EPOLL_MAXEVENTS, tvptr);
+#else
             ready_fds = myselect(maxfd, &rfds, NULL, NULL, tvptr);
+#endif
 
             if (ready_fds < 0) {
                 switch (errno) {
@@ -2755,7 +3043,9 @@ int main(int argc, char **argv)
                         syslog(LOG_WARNING, "Repeatedly interrupted, too many signals?");
                         /* Fake a timeout */
                         ready_fds = 0;
+#ifndef USE_EPOLL
                         FD_ZERO(&rfds);
+#endif
                     }
                     break;
                 default:
@@ -2773,6 +3063,47 @@ int main(int argc, char **argv)
             snmp_timeout();
 #endif
 
+#ifdef USE_EPOLL
+        if (ready_fds > 0) {
+            int n;
+
+            /* status messages first: they may tell us a worker is ready,
+             * and then there's no need to spawn one for a connection */
+            for (n = 0; n < ready_fds; n++) {
+                i = EPOLL_TAG_SI(events[n].data.u64);
+                if (EPOLL_TAG_LSN(events[n].data.u64)) continue;
+
+                while ((r = read_msg(Services[i].stat[0], &msg)) == 0)
+                    process_msg(i, &msg);
+
+                if (r == 2) {
+                    syslog(LOG_ERR,
+                        "got incorrectly sized response from child: %x", i);
+                }
+                else if (r < 0) {
+                    syslog(LOG_ERR,
+                        "error while receiving message from child %x: %m", i);
+                }
+            }
+
+            for (n = 0; n < ready_fds; n++) {
+                i = EPOLL_TAG_SI(events[n].data.u64);
+                if (!EPOLL_TAG_LSN(events[n].data.u64)) continue;
+
+                /* one-shot: it needs re-arming before it fires again */
+                Services[i].socket_armed = 0;
+
+                if (!in_shutdown && Services[i].exec &&
+                    Services[i].nactive < Services[i].max_workers &&
+                    Services[i].ready_workers == 0 &&
+                    Services[i].socket >= 0)
+                {
+                    /* huh, someone wants to talk to us */
+                    spawn_service(i);
+                }
+            }
+        }
+#else
         if (ready_fds > 0) {
             for (i = 0; i < nservices; i++) {
                 int x = Services[i].stat[0];
@@ -2804,6 +3135,7 @@ int main(int argc, char **argv)
                 }
             }
         }
+#endif /* USE_EPOLL */
 
         gettimeofday(&now, 0);
         child_janitor(now);
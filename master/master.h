@@ -29,6 +29,10 @@ struct service {
     int max_workers;            /* max num child processes to spawn */
     rlim_t maxfds;              /* max num file descriptors to use */
     unsigned int maxforkrate;   /* max rate to spawn children */
+    int min_workers;            /* configured prefork */
+    int maxprefork;             /* adaptive prefork upper bound, or 0 */
+    int acceptlock;             /* serialize accept() with a lock file? */
+    int cpuaffinity;            /* pin each child to one CPU? */
 
     /* stats */
     int ready_workers;          /* num child processes ready for service */
@@ -42,6 +46,19 @@ struct service {
     /* fork rate computation */
     struct timeval last_interval_start;
     unsigned int interval_forks;
+
+    /* adaptive prefork */
+    struct timeval last_adapt;  /* when desired_workers was last reviewed */
+    int adapt_connections;      /* nconnections at last_adapt */
+    int adapt_starved;          /* ran out of ready workers since then? */
+    double connrate;            /* connections per second (decaying) */
+    int prefork_grows;          /* num times desired_workers was raised */
+    int prefork_shrinks;        /* num times desired_workers was lowered */
+
+    /* event loop registration (epoll builds only) */
+    int watched_stat;           /* stat[0] as registered, or -1 */
+    int watched_socket;         /* socket as registered, or -1 */
+    int socket_armed;           /* listener armed for one wakeup? */
 };
 
 extern struct service *Services;
@@ -64,9 +64,13 @@
 #include <sysexits.h>
 #include <string.h>
 #include <limits.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "service.h"
 #include "libconfig.h"
+#include "prot.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
 #include "strarray.h"
@@ -84,14 +88,20 @@ extern char *optarg;
 static int use_count = 0;
 static int verbose = 0;
 static int lockfd = -1;
+static int accept_epollfd = -1;
 static int newfile = 0;
 
+/* service_preinit_fork: master only knows the template's pid */
+static pid_t template_pid = 0;
+static pid_t worker_pid = 0;
+static int recycle_fd = -1;
+
 void notify_master(int fd, int msg)
 {
     struct notify_message notifymsg;
     if (verbose) syslog(LOG_DEBUG, "telling master %x", msg);
     notifymsg.message = msg;
-    notifymsg.service_pid = getpid();
+    notifymsg.service_pid = template_pid ? template_pid : getpid();
     if (write(fd, &notifymsg, sizeof(notifymsg)) != sizeof(notifymsg)) {
         syslog(LOG_ERR, "unable to tell master %x: %m", msg);
     }
@@ -157,6 +167,9 @@ static int libwrap_ask(struct request_info *r __attribute__((unused)),
 #endif
 
 extern void cyrus_init(const char *, const char *, unsigned, int);
+extern void cyrus_prepare_fork(void);
+extern void cyrus_recycle_exit(void) __attribute__((noreturn));
+extern void cyrus_observe_startup(int forked, double seconds);
 
 static int getlockfd(char *service, int id)
 {
@@ -178,6 +191,49 @@ static int getlockfd(char *service, int id)
     return 0;
 }
 
+/*
+ * Accept without the lock file: every worker registers the listener
+ * with EPOLLEXCLUSIVE in an epoll set of its own, so the kernel wakes
+ * only one of them per incoming connection.  The listener is made
+ * non-blocking, because a wakeup can still occasionally be shared.
+ * Returns -1 if the platform can't do that, and we keep locking.
+ */
+static int init_exclusive_accept(void)
+{
+#if defined(HAVE_SYS_EPOLL_H) && defined(EPOLLEXCLUSIVE)
+    struct epoll_event ev;
+    int fdflags;
+
+    accept_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (accept_epollfd < 0) {
+        syslog(LOG_ERR, "epoll_create1: %m, using accept lock");
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    if (epoll_ctl(accept_epollfd, EPOLL_CTL_ADD, LISTEN_FD, &ev) < 0) {
+        syslog(LOG_ERR, "epoll_ctl(EPOLLEXCLUSIVE): %m, using accept lock");
+        close(accept_epollfd);
+        accept_epollfd = -1;
+        return -1;
+    }
+
+    fdflags = fcntl(LISTEN_FD, F_GETFL, 0);
+    if (fdflags != -1) fdflags = fcntl(LISTEN_FD, F_SETFL, fdflags | O_NONBLOCK);
+    if (fdflags == -1) {
+        syslog(LOG_ERR, "fcntl(O_NONBLOCK): %m, using accept lock");
+        close(accept_epollfd);
+        accept_epollfd = -1;
+        return -1;
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 static int lockaccept(void)
 {
     struct flock alockinfo;
@@ -243,6 +299,103 @@ static int unlockaccept(void)
     return 0;
 }
 
+static const int template_signals[] = {
+    SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2, 0
+};
+
+static void template_forward_signal(int sig)
+{
+    if (worker_pid > 0) kill(worker_pid, sig);
+}
+
+/*
+ * With service_preinit_fork, the process master started stays behind as
+ * a template once it's initialised, and forks the workers which accept
+ * connections.  A worker which has served max_use clients says so on a
+ * pipe and exits, and the template forks another from its initialised
+ * state.  If a worker exits for any other reason, so does the template,
+ * with the same status.
+ *
+ * Returns in each worker, with 'generation' set to the number of
+ * workers before it, and 'forked' to when it was forked.
+ */
+static void run_template(int *generation, struct timeval *forked)
+{
+    struct sigaction act, oldact[sizeof(template_signals) / sizeof(int)];
+    int i;
+
+    cyrus_prepare_fork();
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = template_forward_signal;
+    act.sa_flags = SA_RESTART;
+    sigemptyset(&act.sa_mask);
+    for (i = 0; template_signals[i]; i++) {
+        sigaction(template_signals[i], &act, &oldact[i]);
+    }
+
+    for (*generation = 0; ; (*generation)++) {
+        int fds[2], status, recycle;
+        pid_t pid;
+        char c;
+
+        if (pipe(fds) == -1) {
+            syslog(LOG_ERR, "service_preinit_fork: pipe: %m");
+            if (!*generation) break; /* serve from this process then */
+            _exit(0);
+        }
+
+        gettimeofday(forked, NULL);
+        pid = fork();
+        if (pid == -1) {
+            syslog(LOG_ERR, "service_preinit_fork: fork: %m");
+            close(fds[0]);
+            close(fds[1]);
+            if (!*generation) break;
+            _exit(0);
+        }
+
+        if (pid == 0) {
+            /* worker */
+            close(fds[0]);
+            recycle_fd = fds[1];
+            template_pid = getppid();
+            for (i = 0; template_signals[i]; i++) {
+                sigaction(template_signals[i], &oldact[i], NULL);
+            }
+            return;
+        }
+
+        close(fds[1]);
+        worker_pid = pid;
+        while (waitpid(pid, &status, 0) == -1) {
+            if (errno != EINTR) {
+                syslog(LOG_ERR, "service_preinit_fork: waitpid: %m");
+                _exit(EX_OSERR);
+            }
+        }
+        worker_pid = 0;
+        recycle = (read(fds[0], &c, 1) == 1);
+        close(fds[0]);
+
+        if (recycle && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            continue;
+
+        /* the worker has already done the cleanup and told master */
+        if (WIFSIGNALED(status)) {
+            signal(WTERMSIG(status), SIG_DFL);
+            raise(WTERMSIG(status));
+        }
+        _exit(WIFEXITED(status) ? WEXITSTATUS(status) : EX_SOFTWARE);
+    }
+
+    /* couldn't fork at all, carry on as a plain service process */
+    for (i = 0; template_signals[i]; i++) {
+        sigaction(template_signals[i], &oldact[i], NULL);
+    }
+    *generation = 0;
+}
+
 static int safe_wait_readable(int fd)
 {
     fd_set rfds;
@@ -273,6 +426,13 @@ static int safe_wait_readable(int fd)
      */
     signals_reset_sighup_handler(0);
 
+    if (accept_epollfd >= 0) {
+        /* the epoll set is readable once it has an event for us */
+        FD_ZERO(&rfds);
+        FD_SET(accept_epollfd, &rfds);
+        fd = accept_epollfd;
+    }
+
     r = signals_select(fd+1, &rfds, NULL, NULL, NULL);
 
     /* we don't want to be interrupted by SIGHUP anymore */
@@ -303,6 +463,11 @@ int main(int argc, char **argv, char **envp)
     ino_t start_ino;
     off_t start_size;
     time_t start_mtime;
+    struct timeval start, forked, ready;
+    int generation = 0;
+    int sig;
+
+    gettimeofday(&start, NULL);
 
     /*
      * service_init and service_main need argv and argc, so they can process
@@ -473,7 +638,10 @@ int main(int argc, char **argv, char **envp)
     start_size = sbuf.st_size;
     start_mtime = sbuf.st_mtime;
 
-    getlockfd(service, id);
+    if (!(getenv("CYRUS_NOACCEPTLOCK") && soctype == SOCK_STREAM &&
+          !init_exclusive_accept())) {
+        getlockfd(service, id);
+    }
 
     if (debug_stdio) {
         service_main(service_argv.count, service_argv.data, envp);
@@ -481,6 +649,23 @@ int main(int argc, char **argv, char **envp)
         return 0;
     }
 
+    if (config_getswitch(IMAPOPT_SERVICE_PREINIT_FORK)) {
+        run_template(&generation, &forked);
+
+        if (generation) {
+            /* master was told we were busy, and never saw the last
+             * worker go */
+            notify_master(STATUS_FD, MASTER_SERVICE_AVAILABLE);
+            start = forked;
+        }
+    }
+
+    /* the first worker's startup includes exec and initialisation */
+    gettimeofday(&ready, NULL);
+    cyrus_observe_startup(generation > 0,
+                          (ready.tv_sec - start.tv_sec) +
+                          (ready.tv_usec - start.tv_usec) / 1000000.0);
+
     for (;;) {
         /* ok, listen to this socket until someone talks to us */
 
@@ -492,6 +677,9 @@ int main(int argc, char **argv, char **envp)
             alarm(reuse_timeout);
         }
 
+        /* finish anything the last connection left for when we're idle */
+        prot_runidle();
+
         /* lock */
         lockaccept();
 
@@ -594,6 +782,13 @@ int main(int argc, char **argv, char **envp)
         /* cancel the alarm */
         alarm(0);
 
+        if (accept_epollfd >= 0 && soctype == SOCK_STREAM) {
+            /* don't let the listener's O_NONBLOCK leak into the session */
+            int flags = fcntl(fd, F_GETFL, 0);
+            if (flags != -1 && (flags & O_NONBLOCK))
+                fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+        }
+
         /* tcp only */
         if(soctype == SOCK_STREAM && socname.sa_family != AF_UNIX) {
             libwrap_init(&request, service);
@@ -634,8 +829,13 @@ int main(int argc, char **argv, char **envp)
         service_main(service_argv.count, service_argv.data, envp);
         /* if we returned, we can service another client with this process */
 
-        if (signals_poll() || use_count >= max_use) {
+        sig = signals_poll();
+        if (sig || use_count >= max_use) {
             /* caught SIGHUP or exceeded max use count */
+            if (!sig && recycle_fd != -1 && write(recycle_fd, "R", 1) == 1) {
+                /* the template forks a fresh worker in our place */
+                cyrus_recycle_exit();
+            }
             break;
         }
 
@@ -53,10 +53,110 @@
 #include <syslog.h>
 #include <errno.h>
 
+#include "exitcodes.h"
 #include "imap/global.h"
 #include "libconfig.h"
 #include "notify_external.h"
 
+/* the long-running helper, for notify_external_persistent */
+static pid_t helper_pid = 0;
+static FILE *helper_stream = NULL;
+
+static void stop_helper(void)
+{
+    if (helper_stream) fclose(helper_stream);
+    helper_stream = NULL;
+
+    if (helper_pid > 0) {
+        while (waitpid(helper_pid, NULL, 0) < 0 && errno == EINTR);
+    }
+    helper_pid = 0;
+}
+
+static int start_helper(const char *notify)
+{
+    int fds[2];
+
+    if (pipe(fds) < 0) {
+        syslog(LOG_ERR, "notify_external: pipe() returned %s", strerror(errno));
+        return -1;
+    }
+
+    helper_pid = fork();
+    if (helper_pid < 0) {
+        syslog(LOG_ERR, "notify_external: fork() returned %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        helper_pid = 0;
+        return -1;
+    }
+
+    if (!helper_pid) {
+        /* i'm the child! run the helper with the pipe as stdin */
+        close(fds[1]);
+        dup2(fds[0], 0);
+        execl(notify, notify, "-s", (char *) NULL);
+
+        syslog(LOG_ERR, "notify_external: exec returned %s", strerror(errno));
+        _exit(EC_OSERR);
+    }
+
+    close(fds[0]);
+    helper_stream = fdopen(fds[1], "w");
+    if (!helper_stream) {
+        close(fds[1]);
+        stop_helper();
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_helper(const char *class, const char *priority,
+                        const char *user, const char *mailbox,
+                        const char *message, const char *fname)
+{
+    fprintf(helper_stream,
+            "Class: %s\nPriority: %s\nUser: %s\nMailbox: %s\n"
+            "Filename: %s\nLength: %zu\n\n",
+            class ? class : "", priority ? priority : "",
+            user ? user : "", mailbox ? mailbox : "",
+            fname ? fname : "", strlen(message));
+    fputs(message, helper_stream);
+
+    return (fflush(helper_stream) || ferror(helper_stream)) ? -1 : 0;
+}
+
+static char *notify_persistent(const char *notify,
+                               const char *class, const char *priority,
+                               const char *user, const char *mailbox,
+                               const char *message, const char *fname)
+{
+    int tries;
+
+    for (tries = 0; tries < 2; tries++) {
+        /* restart the helper if it has gone away */
+        if (helper_pid && waitpid(helper_pid, NULL, WNOHANG) == helper_pid) {
+            syslog(LOG_WARNING, "notify_external: helper %s exited, restarting",
+                   notify);
+            helper_pid = 0;
+            stop_helper();
+        }
+
+        if (!helper_pid && start_helper(notify))
+            return strdup("NO notify_external could not start helper");
+
+        if (!write_helper(class, priority, user, mailbox, message, fname))
+            return strdup("OK notify_external notification successful");
+
+        syslog(LOG_ERR, "notify_external: writing to helper %s: %s",
+               notify, strerror(errno));
+        stop_helper();
+    }
+
+    return strdup("NO notify_external helper failed");
+}
+
 char* notify_external(const char *class, const char *priority,
                       const char *user, const char *mailbox,
                       int nopt __attribute__((unused)),
@@ -75,6 +175,11 @@ char* notify_external(const char *class, const char *priority,
         return strdup("NO Recipient unspecified");
     }
 
+    if (config_getswitch(IMAPOPT_NOTIFY_EXTERNAL_PERSISTENT)) {
+        return notify_persistent(notify, class, priority, user, mailbox,
+                                 message, fname);
+    }
+
     buf[0] = notify;
     buf[1] = "-c";
     buf[2] = class;
@@ -57,6 +57,8 @@
 #endif
 #include <signal.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/wait.h>
 
 #include "notifyd.h"
 
@@ -65,7 +67,9 @@
 #include "libconfig.h"
 #include "imap/notify.h"
 #include "xmalloc.h"
+#include "ptrarray.h"
 #include "strarray.h"
+#include "util.h"
 
 
 /* global state */
@@ -96,36 +100,110 @@ static char *fetch_arg(char *head, char* tail)
     return (cp == tail ? NULL : cp + 1);
 }
 
-static int do_notify(void)
+/*
+ * Parse a request of the form:
+ *
+ * method NUL class NUL priority NUL user NUL mailbox NUL
+ *   nopt NUL N(option NUL) message NUL
+ *
+ * and dispatch it to the notification method.
+ */
+static void handle_request(char *buf, int len)
 {
-    struct sockaddr_un sun_data;
-    socklen_t sunlen = sizeof(sun_data);
-    char buf[NOTIFY_MAXSIZE+1], *cp, *tail;
-    int r, i;
+    char *cp, *tail;
+    int i;
     char *method, *class, *priority, *user, *mailbox, *message;
     strarray_t options = STRARRAY_INITIALIZER;
-    long nopt;
-    char *reply;
-    char *fname;
+    long nopt = 0;
+    char *reply = NULL;
+    char *fname = NULL;
     notifymethod_t *nmethod;
-    unsigned bufsiz;
-    socklen_t optlen;
+
+    method = class = priority = user = mailbox = message = NULL;
+
+    buf[len] = '\0';
+    tail = buf + len - 1;
+
+    method = (cp = buf);
+
+    if (cp) class = (cp = fetch_arg(cp, tail));
+    if (cp) priority = (cp = fetch_arg(cp, tail));
+    if (cp) user = (cp = fetch_arg(cp, tail));
+    if (cp) mailbox = (cp = fetch_arg(cp, tail));
+
+    if (cp) cp = fetch_arg(cp, tail); /* skip to nopt */
+    if (cp) nopt = strtol(cp, NULL, 10);
+    if (nopt < 0 || errno == ERANGE) cp = NULL;
+
+    for (i = 0; cp && i < nopt; i++)
+        strarray_append(&options, cp = fetch_arg(cp, tail));
+
+    if (cp) message = (cp = fetch_arg(cp, tail));
+    if (cp) fname = (cp = fetch_arg(cp, tail));
+
+    if (!message) {
+        syslog(LOG_ERR, "malformed notify request");
+        strarray_fini(&options);
+        return;
+    }
+
+    if (!*method)
+        nmethod = default_method;
+    else {
+        nmethod = methods;
+        while (nmethod->name) {
+            if (!strcasecmp(nmethod->name, method)) break;
+            nmethod++;
+        }
+    }
+
+    syslog(LOG_DEBUG, "do_notify using method '%s'",
+           nmethod->name ? nmethod->name: "unknown");
+
+    if (nmethod->name) {
+        reply = nmethod->notify(class, priority, user, mailbox,
+                                nopt, options.data, message, fname);
+    }
+#if 0  /* we don't care about responses right now */
+    else {
+        reply = strdup("NO unknown notification method");
+        if (!reply) {
+            fatal("strdup failed", EC_OSERR);
+        }
+    }
+#endif
+
+    free(reply);
+    strarray_fini(&options);
+}
+
+static int get_bufsiz(unsigned *bufsiz)
+{
+    socklen_t optlen = sizeof(*bufsiz);
 
     /* Get receive buffer size */
-    optlen = sizeof(bufsiz);
-    r = getsockopt(soc, SOL_SOCKET, SO_RCVBUF, &bufsiz, &optlen);
-    if (r == -1) {
+    if (getsockopt(soc, SOL_SOCKET, SO_RCVBUF, bufsiz, &optlen) == -1) {
         syslog(LOG_ERR, "unable to getsockopt(SO_RCVBUF) on notify socket: %m");
-        return (errno);
+        return errno;
     }
 
     /* Use minimum of 1/10 of receive buffer size (-overhead) NOTIFY_MAXSIZE */
-    bufsiz = MIN(bufsiz / 10 - 32, NOTIFY_MAXSIZE);
+    *bufsiz = MIN(*bufsiz / 10 - 32, NOTIFY_MAXSIZE);
+    return 0;
+}
 
-    while (1) {
-        method = class = priority = user = mailbox = message = reply = NULL;
-        nopt = 0;
+static int do_notify(void)
+{
+    struct sockaddr_un sun_data;
+    socklen_t sunlen = sizeof(sun_data);
+    char buf[NOTIFY_MAXSIZE+1];
+    unsigned bufsiz;
+    int r;
 
+    r = get_bufsiz(&bufsiz);
+    if (r) return r;
+
+    while (1) {
         if (signals_poll() == SIGHUP) {
             /* caught a SIGHUP, return */
             return 0;
@@ -135,70 +213,185 @@ static int do_notify(void)
         if (r == -1) {
             return (errno);
         }
-        buf[r] = '\0';
-
-        tail = buf + r - 1;
 
-        /*
-         * parse request of the form:
-         *
-         * method NUL class NUL priority NUL user NUL mailbox NUL
-         *   nopt NUL N(option NUL) message NUL
-         */
-        method = (cp = buf);
+        handle_request(buf, r);
+    }
 
-        if (cp) class = (cp = fetch_arg(cp, tail));
-        if (cp) priority = (cp = fetch_arg(cp, tail));
-        if (cp) user = (cp = fetch_arg(cp, tail));
-        if (cp) mailbox = (cp = fetch_arg(cp, tail));
+    /* never reached */
+}
 
-        if (cp) cp = fetch_arg(cp, tail); /* skip to nopt */
-        if (cp) nopt = strtol(cp, NULL, 10);
-        if (nopt < 0 || errno == ERANGE) cp = NULL;
+/*
+ * Worker pool.  The main process reads requests off the notify socket
+ * as fast as they arrive into an in-memory queue, and hands them to
+ * worker processes over a SOCK_SEQPACKET socketpair, which the idle
+ * workers all read from.  Slow methods then only hold up a worker,
+ * not the socket.
+ */
+static pid_t *workers = NULL;
+static int nworkers = 0;
+static int work_soc[2] = { -1, -1 };
 
-        for (i = 0; cp && i < nopt; i++)
-            strarray_append(&options, cp = fetch_arg(cp, tail));
+static void worker_main(void)
+{
+    char buf[NOTIFY_MAXSIZE+1];
+    ssize_t r;
 
-        if (cp) message = (cp = fetch_arg(cp, tail));
-        if (cp) fname = (cp = fetch_arg(cp, tail));
+    close(soc);
+    close(work_soc[0]);
 
-        if (!message) {
-            syslog(LOG_ERR, "malformed notify request");
-            strarray_fini(&options);
-            return 0;
+    /* EOF once the main process has closed its end */
+    while ((r = recv(work_soc[1], buf, NOTIFY_MAXSIZE, 0)) != 0) {
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "notifyd worker: recv: %m");
+            break;
         }
+        handle_request(buf, r);
+    }
+
+    shut_down(0);
+}
+
+static void start_worker(int i)
+{
+    pid_t pid = fork();
 
-        if (!*method)
-            nmethod = default_method;
-        else {
-            nmethod = methods;
-            while (nmethod->name) {
-                if (!strcasecmp(nmethod->name, method)) break;
-                nmethod++;
+    if (pid < 0) {
+        syslog(LOG_ERR, "notifyd: unable to fork worker: %m");
+        pid = 0;
+    }
+    else if (!pid) {
+        worker_main();
+    }
+
+    workers[i] = pid;
+}
+
+/* restart any workers which have died */
+static void check_workers(void)
+{
+    pid_t pid;
+    int i, status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < nworkers; i++) {
+            if (workers[i] == pid) {
+                syslog(LOG_WARNING, "notifyd: worker %d exited, status %d",
+                       (int) pid, status);
+                workers[i] = 0;
             }
         }
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        if (!workers[i]) start_worker(i);
+    }
+}
+
+static int do_notify_pool(void)
+{
+    struct sockaddr_un sun_data;
+    socklen_t sunlen;
+    char buf[NOTIFY_MAXSIZE+1];
+    ptrarray_t queue = PTRARRAY_INITIALIZER;
+    int maxqueue = config_getint(IMAPOPT_NOTIFYD_QUEUE_SIZE);
+    int head = 0, dropped = 0;
+    unsigned bufsiz;
+    struct buf *b;
+    int i, r;
+
+    r = get_bufsiz(&bufsiz);
+    if (r) return r;
 
-        syslog(LOG_DEBUG, "do_notify using method '%s'",
-               nmethod->name ? nmethod->name: "unknown");
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, work_soc) < 0) {
+        syslog(LOG_ERR, "notifyd: socketpair: %m");
+        return errno;
+    }
+
+    workers = xzmalloc(nworkers * sizeof(pid_t));
+    check_workers();
 
-        if (nmethod->name) {
-            reply = nmethod->notify(class, priority, user, mailbox,
-                                    nopt, options.data, message, fname);
+    while (1) {
+        struct pollfd pfd[2];
+        int pending = ptrarray_size(&queue) - head;
+
+        if (signals_poll() == SIGHUP) break;
+
+        check_workers();
+
+        pfd[0].fd = soc;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = work_soc[0];
+        pfd[1].events = pending ? POLLOUT : 0;
+
+        r = poll(pfd, 2, 1000);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "notifyd: poll: %m");
+            r = errno;
+            break;
         }
-#if 0  /* we don't care about responses right now */
-        else {
-            reply = strdup("NO unknown notification method");
-            if (!reply) {
-                fatal("strdup failed", EC_OSERR);
+        r = 0;
+
+        /* read everything waiting on the socket */
+        while (pfd[0].revents & POLLIN) {
+            sunlen = sizeof(sun_data);
+            r = recvfrom(soc, buf, bufsiz, MSG_DONTWAIT,
+                         (struct sockaddr *) &sun_data, &sunlen);
+            if (r < 0) {
+                r = 0;
+                break;
             }
+
+            if (maxqueue > 0 && pending >= maxqueue) {
+                dropped++;
+                continue;
+            }
+
+            b = buf_new();
+            buf_setmap(b, buf, r);
+            ptrarray_append(&queue, b);
+            pending++;
         }
-#endif
 
-        free(reply);
-        strarray_fini(&options);
+        if (dropped) {
+            syslog(LOG_ERR, "notifyd: queue full, dropped %d notifications",
+                   dropped);
+            dropped = 0;
+        }
+
+        /* hand as many as the workers will take */
+        while (head < ptrarray_size(&queue)) {
+            b = ptrarray_nth(&queue, head);
+            if (send(work_soc[0], buf_base(b), buf_len(b),
+                     MSG_DONTWAIT|MSG_NOSIGNAL) < 0) break;
+            buf_destroy(b);
+            head++;
+        }
+
+        if (head == ptrarray_size(&queue)) {
+            ptrarray_truncate(&queue, 0);
+            head = 0;
+        }
     }
 
-    /* never reached */
+    /* pass on what's left, then let the workers finish */
+    for (i = head; i < ptrarray_size(&queue); i++) {
+        b = ptrarray_nth(&queue, i);
+        if (send(work_soc[0], buf_base(b), buf_len(b), MSG_NOSIGNAL) < 0)
+            syslog(LOG_ERR, "notifyd: lost notification: %m");
+        buf_destroy(b);
+    }
+    ptrarray_fini(&queue);
+
+    close(work_soc[0]);
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i]) waitpid(workers[i], NULL, 0);
+    }
+    free(workers);
+    workers = NULL;
+
+    return r;
 }
 
 
@@ -250,6 +443,9 @@ EXPORTED int service_init(int argc, char **argv, char **envp __attribute__((unus
 
     signals_set_shutdown(&shut_down);
 
+    /* a persistent external helper may go away under us */
+    signal(SIGPIPE, SIG_IGN);
+
     return 0;
 }
 
@@ -265,7 +461,12 @@ EXPORTED int service_main(int argc __attribute__((unused)),
 {
     int r = 0;
 
-    r = do_notify();
+    nworkers = config_getint(IMAPOPT_NOTIFYD_WORKERS);
+
+    if (nworkers > 0)
+        r = do_notify_pool();
+    else
+        r = do_notify();
 
     shut_down(r);
     return 0;
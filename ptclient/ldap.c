@@ -58,6 +58,7 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/uio.h>
@@ -190,7 +191,12 @@ typedef struct _ptsm {
 #define ISSET(x)  ((x != NULL) && (*(x) != '\0'))
 #define EMPTY(x)  ((x == NULL) || (*(x) == '\0'))
 
-static t_ptsm *ptsm = NULL;
+/* ptloader may call us from several threads; each gets its own
+   configuration and connection */
+static __thread t_ptsm *ptsm = NULL;
+
+/* ldap_set_option(NULL, ...) changes library-wide defaults */
+static pthread_mutex_t connect_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static int ptsmodule_interact(
     LDAP *ld __attribute__((unused)),
@@ -242,7 +248,7 @@ static int ptsmodule_interact(
  */
 static char *ptsmodule_canonifyid(const char *identifier, size_t len)
 {
-    static char retbuf[81];
+    static __thread char retbuf[81];
     char sawalpha;
     char *p;
     int username_tolower = 0;
@@ -286,7 +292,7 @@ static char *ptsmodule_canonifyid(const char *identifier, size_t len)
 }
 
 
-static int ptsmodule_connect(void)
+static int ptsmodule_do_connect(void)
 {
         int rc = 0;
 
@@ -443,6 +449,20 @@ static int ptsmodule_connect(void)
     return PTSM_OK;
 }
 
+static int ptsmodule_connect(void)
+{
+    int rc;
+
+    if (ptsm && ptsm->ld)
+        return PTSM_OK;
+
+    pthread_mutex_lock(&connect_mutex);
+    rc = ptsmodule_do_connect();
+    pthread_mutex_unlock(&connect_mutex);
+
+    return rc;
+}
+
 /* API */
 
 static void myinit(void)
@@ -1602,4 +1622,5 @@ struct pts_module pts_ldap =
 
     &myinit,
     &myauthstate,
+    1,             /* threaded */
 };
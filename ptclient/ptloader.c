@@ -42,12 +42,15 @@
 
 #include <config.h>
 
+#include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <syslog.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/param.h>
 #include <fcntl.h>
@@ -58,9 +61,12 @@
 #include "auth_pts.h"
 #include "cyrusdb.h"
 #include "exitcodes.h"
+#include "hash.h"
 #include "imap/global.h"
+#include "imap/prometheus.h"
 #include "libconfig.h"
 #include "retry.h"
+#include "util.h"
 #include "xmalloc.h"
 #include "ptloader.h"
 
@@ -124,11 +130,328 @@ const int config_need_data = 0;
 
 static char ptclient_debug = 0;
 struct db *ptsdb = NULL;
+static pthread_mutex_t ptsdb_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Connections are handed from the service loop to the workers here */
+static int conn_pipe[2];
+
+/*
+ * In-memory cache of recent answers from the pts module.
+ *
+ * When ptscache records expire during a login storm, many clients ask
+ * about the same identifier at once.  Only the first of them goes to
+ * the module; the rest wait for its answer.  Failures are remembered
+ * for ptloader_negative_timeout seconds, and an expired entry is still
+ * handed out for up to ptloader_stale_timeout seconds while one worker
+ * refreshes it, so a slow or unreachable directory doesn't stall every
+ * login.
+ */
+struct ptcache_entry {
+    time_t fetched;             /* when the module last answered */
+    time_t retry;               /* don't ask the module again before this */
+    struct auth_state *state;   /* NULL for a negative entry */
+    int dsize;
+    char *error;                /* reply for a negative entry */
+    int loading;                /* a worker is asking the module */
+};
+
+/* What we tell a client, copied out of the cache */
+struct ptanswer {
+    struct auth_state *state;
+    int dsize;
+    char *error;
+};
+
+static hash_table ptcache = HASH_TABLE_INITIALIZER;
+static pthread_mutex_t ptcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ptcache_cond = PTHREAD_COND_INITIALIZER;
+
+/* prometheus_apply_delta() locks against other processes only */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void ptloader_stat(enum prom_metric_id metric_id, double delta)
+{
+    pthread_mutex_lock(&stats_mutex);
+    prometheus_apply_delta(metric_id, delta);
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+static void ptcache_entry_free(void *data)
+{
+    struct ptcache_entry *entry = (struct ptcache_entry *) data;
+
+    free(entry->state);
+    free(entry->error);
+    free(entry);
+}
+
+/* Is 'entry' good enough to answer with? */
+static int ptcache_usable(struct ptcache_entry *entry, time_t now)
+{
+    return entry->state &&
+        entry->fetched + config_getint(IMAPOPT_PTSCACHE_TIMEOUT) +
+        config_getint(IMAPOPT_PTLOADER_STALE_TIMEOUT) >= now;
+}
+
+static void ptcache_expired(const char *key, void *data, void *rock)
+{
+    struct ptcache_entry *entry = (struct ptcache_entry *) data;
+    strarray_t *expired = (strarray_t *) rock;
+    time_t now = time(NULL);
+
+    if (entry->loading) return;
+    if (rock != &ptcache) {
+        if (ptcache_usable(entry, now)) return;
+        if (!entry->state && entry->retry > now) return;
+    }
+
+    strarray_append(expired, key);
+}
+
+/* Make room for one more entry; called with ptcache_mutex held */
+static void ptcache_prune(void)
+{
+    int max = config_getint(IMAPOPT_PTLOADER_CACHE_SIZE);
+    strarray_t expired = STRARRAY_INITIALIZER;
+    int i;
+
+    if (hash_numrecords(&ptcache) < max) return;
+
+    hash_enumerate(&ptcache, &ptcache_expired, &expired);
+    if (hash_numrecords(&ptcache) - strarray_size(&expired) >= max) {
+        /* everything is still live; drop all but the ones in flight */
+        strarray_truncate(&expired, 0);
+        hash_enumerate(&ptcache, &ptcache_expired, &ptcache);
+    }
+
+    for (i = 0; i < strarray_size(&expired); i++) {
+        ptcache_entry_free(hash_del(strarray_nth(&expired, i), &ptcache));
+    }
+    strarray_fini(&expired);
+}
+
+/* Copy the answer in 'entry'; called with ptcache_mutex held */
+static void ptcache_answer(struct ptcache_entry *entry, struct ptanswer *ans)
+{
+    if (ptcache_usable(entry, time(NULL))) {
+        ans->dsize = entry->dsize;
+        ans->state = xmemdup(entry->state, ans->dsize);
+    }
+    else {
+        ans->error = xstrdup(entry->error ? entry->error :
+                             "Error making authstate");
+    }
+}
+
+/*
+ * Ask the pts module about 'user', record the answer in 'entry' (which
+ * the caller has marked as loading) and copy it to 'ans'.
+ * Called without ptcache_mutex.
+ */
+static void ptcache_load(const char *user, size_t size,
+                         struct ptcache_entry *entry, struct ptanswer *ans)
+{
+    const char *reply = NULL;
+    struct auth_state *newstate;
+    struct timeval start, end;
+    double secs;
+    int dsize;
+
+    gettimeofday(&start, NULL);
+    newstate = ptsmodule_make_authstate(user, size, &reply, &dsize);
+    gettimeofday(&end, NULL);
+
+    secs = timesub(&start, &end);
+    ptloader_stat(CYRUS_PTLOADER_LOOKUP_SECONDS_TOTAL, secs);
+    ptloader_stat(secs < 0.01 ? CYRUS_PTLOADER_LOOKUP_LATENCY_TOTAL_BUCKET_LT_10MS :
+                  secs < 0.1 ? CYRUS_PTLOADER_LOOKUP_LATENCY_TOTAL_BUCKET_LT_100MS :
+                  secs < 1 ? CYRUS_PTLOADER_LOOKUP_LATENCY_TOTAL_BUCKET_LT_1S :
+                  secs < 10 ? CYRUS_PTLOADER_LOOKUP_LATENCY_TOTAL_BUCKET_LT_10S :
+                  CYRUS_PTLOADER_LOOKUP_LATENCY_TOTAL_BUCKET_GE_10S, 1);
+
+    if (ptclient_debug) {
+        syslog(LOG_DEBUG, "lookup of %s took %.3f seconds", user, secs);
+    }
+
+    pthread_mutex_lock(&ptcache_mutex);
+
+    if (newstate) {
+        free(entry->state);
+        free(entry->error);
+        entry->state = newstate;
+        entry->dsize = dsize;
+        entry->error = NULL;
+        entry->fetched = end.tv_sec;
+        entry->retry = 0;
+    }
+    else {
+        /* keep any previous answer around for the stale window */
+        free(entry->error);
+        entry->error = xstrdup(reply ? reply : "Error making authstate");
+        entry->retry = end.tv_sec +
+            config_getint(IMAPOPT_PTLOADER_NEGATIVE_TIMEOUT);
+    }
+    entry->loading = 0;
+    ptcache_answer(entry, ans);
+
+    pthread_cond_broadcast(&ptcache_cond);
+    pthread_mutex_unlock(&ptcache_mutex);
+}
+
+/* Write a successful answer through to the ptscache db */
+static void ptanswer_store(const char *user, size_t size,
+                           struct ptanswer *ans)
+{
+    if (ans->state) {
+        pthread_mutex_lock(&ptsdb_mutex);
+        cyrusdb_store(ptsdb, user, size, (void *)ans->state, ans->dsize, NULL);
+        pthread_mutex_unlock(&ptsdb_mutex);
+    }
+}
+
+static void ptanswer_fini(struct ptanswer *ans)
+{
+    free(ans->state);
+    free(ans->error);
+    memset(ans, 0, sizeof(struct ptanswer));
+}
+
+/* Answer one client on 'c' */
+static void ptloader_request(int c)
+{
+    const char *reply = NULL;
+    struct ptanswer ans = { NULL, 0, NULL };
+    char user[PTS_DB_KEYSIZE+1];
+    size_t size;
+    struct ptcache_entry *entry = NULL, *mine = NULL;
+    int load = 0, revalidate = 0;
+    time_t now;
+
+    (void)memset(&size, 0, sizeof(size));
+    if (read(c, &size, sizeof(size_t)) < 0) {
+        syslog(LOG_ERR, "socket (size): %m");
+        reply = "Error reading request (size)";
+        goto sendreply;
+    }
+
+    if (size > PTS_DB_KEYSIZE)  {
+        syslog(LOG_ERR, "size sent %d is greater than buffer size %d",
+               (int)size, PTS_DB_KEYSIZE);
+        reply = "Error: invalid request size";
+        goto sendreply;
+    }
+
+    if (size == 0) {
+        syslog(LOG_ERR, "size sent is 0");
+        reply = "Error: zero request size";
+        goto sendreply;
+    }
+
+    memset(&user, 0, sizeof(user));
+    if (read(c, &user, size) < 0) {
+        syslog(LOG_ERR, "socket(user; size = %d): %m", (int)size);
+        reply = "Error reading request (user)";
+        goto sendreply;
+    }
+
+    if (ptclient_debug) {
+        syslog(LOG_DEBUG, "user %s", user);
+    }
+
+    pthread_mutex_lock(&ptcache_mutex);
+
+    for (;;) {
+        now = time(NULL);
+        entry = ptcache.size ? hash_lookup(user, &ptcache) : NULL;
+
+        /* somebody is already asking: wait for their answer */
+        if (!entry || !entry->loading || ptcache_usable(entry, now)) break;
+        pthread_cond_wait(&ptcache_cond, &ptcache_mutex);
+    }
+
+    if (!entry) {
+        entry = xzmalloc(sizeof(struct ptcache_entry));
+        if (ptcache.size) {
+            ptcache_prune();
+            hash_insert(user, entry, &ptcache);
+        }
+        else mine = entry;
+        load = 1;
+        ptloader_stat(CYRUS_PTLOADER_REQUESTS_TOTAL_RESULT_MISS, 1);
+    }
+    else if (entry->state &&
+             entry->fetched + config_getint(IMAPOPT_PTSCACHE_TIMEOUT) > now) {
+        ptloader_stat(CYRUS_PTLOADER_REQUESTS_TOTAL_RESULT_HIT, 1);
+    }
+    else if (ptcache_usable(entry, now)) {
+        /* answer with what we have, and refresh it if nobody is */
+        if (!entry->loading && entry->retry <= now) {
+            revalidate = entry->loading = 1;
+        }
+        ptloader_stat(CYRUS_PTLOADER_REQUESTS_TOTAL_RESULT_STALE, 1);
+    }
+    else if (entry->retry > now) {
+        /* recent failure: don't go back to the module yet */
+        ptloader_stat(CYRUS_PTLOADER_REQUESTS_TOTAL_RESULT_NEGATIVE, 1);
+    }
+    else {
+        load = entry->loading = 1;
+        ptloader_stat(CYRUS_PTLOADER_REQUESTS_TOTAL_RESULT_MISS, 1);
+    }
+
+    if (!load) ptcache_answer(entry, &ans);
+
+    pthread_mutex_unlock(&ptcache_mutex);
+
+    if (load) ptcache_load(user, size, entry, &ans);
+
+    if (ans.state) {
+        /* Success! */
+        ptanswer_store(user, size, &ans);
+        reply = "OK";
+    }
+    else reply = ans.error;
+
+ sendreply:
+    if (retry_write(c, reply, strlen(reply) + 1) <0) {
+        syslog(LOG_WARNING, "retry_write: %m");
+    }
+    close(c);
+    ptanswer_fini(&ans);
+
+    if (revalidate) {
+        ptcache_load(user, size, entry, &ans);
+        ptanswer_store(user, size, &ans);
+        ptanswer_fini(&ans);
+    }
+
+    if (mine) ptcache_entry_free(mine);
+}
+
+static void *ptloader_worker(void *rock __attribute__((unused)))
+{
+    int c;
+
+    /* the module keeps its connection state per thread */
+    ptsmodule_init();
+
+    for (;;) {
+        if (read(conn_pipe[0], &c, sizeof(c)) != sizeof(c)) {
+            if (errno == EINTR) continue;
+            fatal("read from conn_pipe failed", EC_TEMPFAIL);
+        }
+
+        ptloader_request(c);
+    }
+
+    return NULL;
+}
 
 int service_init(int argc, char *argv[], char **envp __attribute__((unused)))
 {
     int r;
     int opt;
+    int i, nthreads;
     char fnamebuf[1024];
     extern char *optarg;
 
@@ -166,6 +489,30 @@ int service_init(int argc, char *argv[], char **envp __attribute__((unused)))
 
     ptsmodule_init();
 
+    if (config_getint(IMAPOPT_PTLOADER_CACHE_SIZE) > 0) {
+        construct_hash_table(&ptcache,
+                             config_getint(IMAPOPT_PTLOADER_CACHE_SIZE), 0);
+    }
+
+    if (pipe(conn_pipe) == -1) {
+        syslog(LOG_ERR, "could not setup connection signaling pipe: %m");
+        fatal("could not setup connection signaling pipe", EC_TEMPFAIL);
+    }
+
+    nthreads = config_getint(IMAPOPT_PTLOADER_THREADS);
+    if (nthreads < 1 || !pts_fromname()->threaded) nthreads = 1;
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_t t;
+
+        r = pthread_create(&t, NULL, &ptloader_worker, NULL);
+        if (r) {
+            syslog(LOG_ERR, "could not start worker thread: %s", strerror(r));
+            fatal("could not start worker thread", EC_TEMPFAIL);
+        }
+        pthread_detach(t);
+    }
+
     return 0;
 }
 
@@ -174,6 +521,7 @@ void service_abort(int error)
 {
     int r;
 
+    pthread_mutex_lock(&ptsdb_mutex);
     r = cyrusdb_close(ptsdb);
     if (r) {
         syslog(LOG_ERR, "DBERROR: error closing ptsdb: %s",
@@ -185,72 +533,19 @@ void service_abort(int error)
     exit(error);
 }
 
-/* we're a 'threaded' service, but since we never fork or create any
-   threads, we're just one-person-at-a-time based */
+/* Connections are answered by the worker threads started in
+   service_init(); all we do here is hand them over */
 int service_main_fd(int c, int argc __attribute__((unused)),
                     char **argv __attribute__((unused)),
                     char **envp __attribute__((unused)))
 {
-    const char *reply = NULL;
-    char user[PTS_DB_KEYSIZE];
-    int rc, dsize;
-    size_t size;
-    struct auth_state *newstate;
-
-    (void)memset(&size, 0, sizeof(size));
-    if (read(c, &size, sizeof(size_t)) < 0) {
-        syslog(LOG_ERR, "socket (size): %m");
-        reply = "Error reading request (size)";
-        goto sendreply;
-    }
-
-    if (size > PTS_DB_KEYSIZE)  {
-        syslog(LOG_ERR, "size sent %d is greater than buffer size %d",
-               (int)size, PTS_DB_KEYSIZE);
-        reply = "Error: invalid request size";
-        goto sendreply;
-    }
-
-    if (size == 0) {
-        syslog(LOG_ERR, "size sent is 0");
-        reply = "Error: zero request size";
-        goto sendreply;
-    }
-
-    memset(&user, 0, sizeof(user));
-    if (read(c, &user, size) < 0) {
-        syslog(LOG_ERR, "socket(user; size = %d): %m", (int)size);
-        reply = "Error reading request (user)";
-        goto sendreply;
-    }
-
-    if (ptclient_debug) {
-        syslog(LOG_DEBUG, "user %s", user);
+    if (write(conn_pipe[1], &c, sizeof(c)) == -1) {
+        syslog(LOG_CRIT,
+               "write to conn_pipe to signal new connection failed: %m");
+        close(c);
+        return EC_TEMPFAIL;
     }
 
-    newstate = ptsmodule_make_authstate(user, size, &reply, &dsize);
-
-    if(newstate) {
-        /* Success! */
-        rc = cyrusdb_store(ptsdb, user, size, (void *)newstate, dsize, NULL);
-        (void)rc;
-        free(newstate);
-
-        /* and we're done */
-        reply = "OK";
-    } else {
-        /* Failure */
-        if ( reply == NULL ) {
-            reply = "Error making authstate";
-        }
-    }
-
- sendreply:
-    if (retry_write(c, reply, strlen(reply) + 1) <0) {
-        syslog(LOG_WARNING, "retry_write: %m");
-    }
-    close(c);
-
     return 0;
 }
 
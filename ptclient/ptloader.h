@@ -52,6 +52,10 @@ struct pts_module {
     struct auth_state *(*make_authstate)(const char *identifier,
                 size_t size,
                 const char **reply, int *dsize);
+
+    /* make_authstate may be called from several threads at once,
+     * each of which has called init first */
+    int threaded;
 };
 
 extern struct pts_module *pts_modules[];
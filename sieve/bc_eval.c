@@ -62,6 +62,7 @@
 #include "xstrlcpy.h"
 #include "util.h"
 #include "times.h"
+#include "libconfig.h"
 
 #include <string.h>
 
@@ -90,6 +91,79 @@ static regex_t * bc_compile_regex(const char *s, int ctag,
     return reg;
 }
 
+/*
+ * Compiled regexes are kept in a small per-process LRU, so that the
+ * same script evaluated for message after message only compiles each
+ * of its patterns once.  Its size follows sieve_script_cache.
+ */
+#define REGEX_CACHE_PER_SCRIPT 8
+
+struct regex_cache_entry {
+    char *pattern;
+    int cflags;
+    regex_t *reg;
+    unsigned long lastuse;
+};
+
+static struct regex_cache_entry *regex_cache = NULL;
+static int regex_cache_count = 0;
+static int regex_cache_size = 0;
+static unsigned long regex_cache_clock = 0;
+
+/* Like bc_compile_regex, but the result may be owned by the cache,
+ * in which case *cached is set and the caller must not free it */
+static regex_t *bc_cached_regex(const char *s, int ctag,
+                                char *errmsg, size_t errsiz, int *cached)
+{
+    int max = REGEX_CACHE_PER_SCRIPT * config_getint(IMAPOPT_SIEVE_SCRIPT_CACHE);
+    struct regex_cache_entry *entry = NULL;
+    regex_t *reg;
+    int n;
+
+    *cached = 0;
+    if (max <= 0) return bc_compile_regex(s, ctag, errmsg, errsiz);
+
+    for (n = 0; n < regex_cache_count; n++) {
+        if (regex_cache[n].cflags == ctag && !strcmp(regex_cache[n].pattern, s)) {
+            regex_cache[n].lastuse = ++regex_cache_clock;
+            *cached = 1;
+            return regex_cache[n].reg;
+        }
+    }
+
+    reg = bc_compile_regex(s, ctag, errmsg, errsiz);
+    if (!reg) return NULL;
+
+    if (!regex_cache) {
+        regex_cache = xzmalloc(max * sizeof(struct regex_cache_entry));
+        regex_cache_size = max;
+    }
+    max = regex_cache_size;
+
+    if (regex_cache_count < max) {
+        entry = &regex_cache[regex_cache_count++];
+    }
+    else {
+        /* replace the least recently used */
+        entry = &regex_cache[0];
+        for (n = 1; n < max; n++) {
+            if (regex_cache[n].lastuse < entry->lastuse)
+                entry = &regex_cache[n];
+        }
+        free(entry->pattern);
+        regfree(entry->reg);
+        free(entry->reg);
+    }
+
+    entry->pattern = xstrdup(s);
+    entry->cflags = ctag;
+    entry->reg = reg;
+    entry->lastuse = ++regex_cache_clock;
+
+    *cached = 1;
+    return reg;
+}
+
 /* Determine if addr is a system address */
 static int sysaddr(const char *addr)
 {
@@ -344,7 +418,9 @@ static int do_comparison(const char *needle, const char *hay,
 
     if (ctag) {
         char errbuf[100]; /* Basically unused, as regex is tested at compile */
-        regex_t *reg = bc_compile_regex(needle, ctag, errbuf, sizeof(errbuf));
+        int cached;
+        regex_t *reg = bc_cached_regex(needle, ctag, errbuf, sizeof(errbuf),
+                                       &cached);
 
         if (!reg) {
             /* Oops */
@@ -353,8 +429,10 @@ static int do_comparison(const char *needle, const char *hay,
         else {
             res = comp(hay, strlen(hay),
                        (const char *) reg, match_vars, comprock);
-            regfree(reg);
-            free(reg);
+            if (!cached) {
+                regfree(reg);
+                free(reg);
+            }
         }
     } else {
 #if VERBOSE
@@ -366,12 +444,23 @@ static int do_comparison(const char *needle, const char *hay,
     return res;
 }
 
+/* below this many keys, building a multi-pattern matcher doesn't pay */
+#define MULTI_MIN_NEEDLES 4
+
+/* if multi is given, it caches a matcher for the same needles
+ * across calls, and the caller must free it afterwards */
 static int do_comparisons(strarray_t *needles, const char *hay,
                           comparator_t *comp, void *comprock, int ctag,
-                          variable_list_t *variables, strarray_t *match_vars)
+                          variable_list_t *variables, strarray_t *match_vars,
+                          comparator_multi_t **multi)
 {
     int n, res = 0, numneedles = strarray_size(needles);
 
+    if (multi && !variables && !ctag && numneedles >= MULTI_MIN_NEEDLES) {
+        if (!*multi) *multi = comparator_multi_new(comp, needles);
+        if (*multi) return comparator_multi_match(*multi, hay, strlen(hay));
+    }
+
     for (n = 0; n < numneedles && !res; n++) {
         const char *needle = strarray_nth(needles, n);
 
@@ -390,7 +479,7 @@ static int do_comparisons(strarray_t *needles, const char *hay,
 
 /* Evaluate a bytecode test */
 static int eval_bc_test(sieve_interp_t *interp, void* m, void *sc,
-                        bytecode_input_t * bc, int * ip,
+                        bytecode_input_t * bc, bc_program_t *prog, int * ip,
 			variable_list_t *variables,
                         duptrack_list_t *duptrack_list,
                         int version, int requires)
@@ -408,7 +497,7 @@ static int eval_bc_test(sieve_interp_t *interp, void* m, void *sc,
     #define SCOUNT_SIZE 20
     char scount[SCOUNT_SIZE];
 
-    i = bc_test_parse(bc, i, version, &test);
+    i = bc_program_test(prog, bc, i, version, &test);
     op = test.type;
 
     switch (op) {
@@ -421,7 +510,7 @@ static int eval_bc_test(sieve_interp_t *interp, void* m, void *sc,
         break;
 
     case BC_NOT:
-        res = eval_bc_test(interp, m, sc, bc, &i, variables,
+        res = eval_bc_test(interp, m, sc, bc, prog, &i, variables,
                            duptrack_list, version, requires);
         if (res >= 0) res = !res; /* Only invert in non-error case */
         break;
@@ -475,7 +564,7 @@ static int eval_bc_test(sieve_interp_t *interp, void* m, void *sc,
 
         /* return 0 unless you find one that is true, then return 1 */
         for (x = 0; x < list_len && !res; x++) {
-            int tmp = eval_bc_test(interp, m, sc, bc, &i, variables,
+            int tmp = eval_bc_test(interp, m, sc, bc, prog, &i, variables,
                                    duptrack_list, version, requires);
             if (tmp < 0) {
                 res = tmp;
@@ -495,7 +584,7 @@ static int eval_bc_test(sieve_interp_t *interp, void* m, void *sc,
 
         /* return 1 unless you find one that isn't true, then return 0 */
         for (x = 0; x < list_len && res; x++) {
-            int tmp =  eval_bc_test(interp, m, sc, bc, &i, variables,
+            int tmp =  eval_bc_test(interp, m, sc, bc, prog, &i, variables,
                                     duptrack_list, version, requires);
             if (tmp < 0) {
                 res = tmp;
@@ -516,6 +605,7 @@ static int eval_bc_test(sieve_interp_t *interp, void* m, void *sc,
         struct address_itr ai;
         const struct address *a;
         char *addr;
+        comparator_multi_t *multi = NULL;
 
         int numheaders = strarray_size(test.u.ae.sl);
 
@@ -642,7 +732,8 @@ static int eval_bc_test(sieve_interp_t *interp, void* m, void *sc,
                         res = do_comparisons(test.u.ae.pl, addr,
                                              comp, comprock, ctag,
                                              (requires & BFE_VARIABLES) ?
-                                             variables : NULL, match_vars);
+                                             variables : NULL, match_vars,
+                                             &multi);
                         if (res < 0) {
                             free(addr);
                             goto envelope_err;
@@ -665,10 +756,11 @@ static int eval_bc_test(sieve_interp_t *interp, void* m, void *sc,
             res = do_comparisons(test.u.ae.pl, scount,
                                  comp, comprock, 0 /* regex */,
                                  (requires & BFE_VARIABLES) ? variables : NULL,
-                                 match_vars);
+                                 match_vars, NULL);
         }
 
 envelope_err:
+        comparator_multi_free(&multi);
         free(strarray_takevf(test.u.ae.sl));
         free(strarray_takevf(test.u.ae.pl));
         break;
@@ -678,6 +770,7 @@ envelope_err:
     case BC_HEADER_PRE_INDEX:
     {
         const char **val;
+        comparator_multi_t *multi = NULL;
 
         int numheaders = strarray_size(test.u.hhs.sl);
 
@@ -689,6 +782,14 @@ envelope_err:
         int count = 0;
         int ctag = 0;
         char *decoded_header;
+        sieve_get_header *getheader = interp->getheader;
+        int predecoded = 0;
+
+        /* have the callback decode the values, if it can */
+        if (interp->getheader_decoded && match != B_COUNT) {
+            getheader = interp->getheader_decoded;
+            predecoded = 1;
+        }
 
         /* set up variables needed for compiling regex */
         if (match == B_REGEX) {
@@ -714,7 +815,7 @@ envelope_err:
                 this_header = parse_string(this_header, variables);
             }
 
-            if (interp->getheader(m, this_header, &val) != SIEVE_OK) {
+            if (getheader(m, this_header, &val) != SIEVE_OK) {
                 continue; /* this header does not exist, search the next */
             }
 #if VERBOSE
@@ -751,13 +852,15 @@ envelope_err:
                 if (match == B_COUNT) {
                     count++;
                 } else {
-                    decoded_header =
+                    decoded_header = predecoded ? NULL :
                         charset_parse_mimeheader(val[y], 0 /*flags*/);
 
-                    res = do_comparisons(test.u.hhs.pl, decoded_header,
+                    res = do_comparisons(test.u.hhs.pl,
+                                         predecoded ? val[y] : decoded_header,
                                          comp, comprock, ctag,
                                          (requires & BFE_VARIABLES) ?
-                                         variables : NULL, match_vars);
+                                         variables : NULL, match_vars,
+                                         &multi);
                     free(decoded_header);
 
                     if (res < 0) goto header_err;
@@ -771,10 +874,11 @@ envelope_err:
             res = do_comparisons(test.u.hhs.pl, scount,
                                  comp, comprock, 0 /* regex */,
                                  (requires & BFE_VARIABLES) ? variables : NULL,
-                                 match_vars);
+                                 match_vars, NULL);
         }
 
       header_err:
+        comparator_multi_free(&multi);
         free(strarray_takevf(test.u.hhs.sl));
         free(strarray_takevf(test.u.hhs.pl));
         break;
@@ -859,7 +963,7 @@ envelope_err:
                                      comp, comprock, 0 /* regex */,
                                      (requires & BFE_VARIABLES) ?
                                      variables : NULL,
-                                     match_vars);
+                                     match_vars, NULL);
                 break;
             }
 
@@ -932,6 +1036,7 @@ envelope_err:
     {
         sieve_bodypart_t **val;
         const char **content_types = NULL;
+        comparator_multi_t *multi = NULL;
 
         int match = test.u.b.comp.match;
         int relation = test.u.b.comp.relation;
@@ -999,7 +1104,8 @@ envelope_err:
                     res = do_comparisons(test.u.b.pl, content,
                                         comp, comprock, ctag,
                                         (requires & BFE_VARIABLES) ?
-                                        variables : NULL, match_vars);
+                                        variables : NULL, match_vars,
+                                        &multi);
                     if (res < 0) {
                         free(val[y]);
                         goto body_err;
@@ -1021,10 +1127,11 @@ envelope_err:
             res = do_comparisons(test.u.b.pl, scount,
                                  comp, comprock, 0 /* regex */,
                                  (requires & BFE_VARIABLES) ? variables : NULL,
-                                 match_vars);
+                                 match_vars, NULL);
         }
 
       body_err:
+        comparator_multi_free(&multi);
         free(strarray_takevf(test.u.b.pl));
         break;
     }
@@ -1369,7 +1476,7 @@ envelope_err:
             res = do_comparisons(test.u.mm.keylist, val,
                                  comp, comprock, ctag,
                                  (requires & BFE_VARIABLES) ? variables : NULL,
-                                 match_vars);
+                                 match_vars, NULL);
             free(val);
         }
 
@@ -1656,7 +1763,7 @@ int sieve_eval_bc(sieve_execute_t *exe, int is_incl, sieve_interp_t *i,
         strarray_t *actionflags = NULL;
         variable_list_t *variable = NULL;
 
-        ip = bc_action_parse(bc, ip, version, &cmd);
+        ip = bc_program_action(bc_cur->prog, bc, ip, version, &cmd);
         op = cmd.type;
 
         switch (op) {
@@ -1819,7 +1926,7 @@ int sieve_eval_bc(sieve_execute_t *exe, int is_incl, sieve_interp_t *i,
             int testend = cmd.u.i.testend;
             int result;
 
-            result = eval_bc_test(i, m, sc, bc, &ip, variables,
+            result = eval_bc_test(i, m, sc, bc, bc_cur->prog, &ip, variables,
                                 duptrack_list, version, requires);
 
             if (result < 0) {
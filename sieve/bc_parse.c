@@ -51,6 +51,34 @@
 #include "bc_parse.h"
 #include "strarray.h"
 #include "times.h"
+#include "xmalloc.h"
+
+/* the most stringlists any one action or test has */
+#define BC_MAX_LISTS 4
+
+/* one pre-decoded action or test, see bc_program_new() */
+struct bc_insn {
+    int next;                   /* bytecode index of the next item */
+    int nlists;                 /* stringlists in u */
+    unsigned short lists[BC_MAX_LISTS];  /* their offsets in u */
+    union {
+        commandlist_t cmd;
+        test_t test;
+    } u;
+};
+
+struct bc_program {
+    int version;
+    int npos;                   /* length of the bytecode in items */
+    int *slot;                  /* index -> 1 + insn, 0 if not decoded */
+    struct bc_insn *insns;
+    int ninsns;
+    int ainsns;
+};
+
+/* while pre-decoding, where to note each stringlist that gets created */
+static struct bc_insn *listrec = NULL;
+static int listrec_overflow = 0;
 
 
 /* Given a bytecode_input_t at the beginning of a file,
@@ -108,6 +136,14 @@ static int bc_stringlist_parse(bytecode_input_t *bc, int pos,
 
     *strlist = strarray_new();
 
+    if (listrec) {
+        if (listrec->nlists < BC_MAX_LISTS)
+            listrec->lists[listrec->nlists++] =
+                (char *) strlist - (char *) &listrec->u;
+        else
+            listrec_overflow = 1;
+    }
+
     while (len--) {
         char *str;
 
@@ -607,3 +643,200 @@ EXPORTED int bc_test_parse(bytecode_input_t *bc, int pos, int version,
 
     return pos;
 }
+
+/*
+ * Pre-decoding.
+ *
+ * Evaluating a script used to decode every action and test from the
+ * bytecode each time it was reached, for every message.  A bc_program
+ * holds all of them already decoded, indexed by bytecode position, so
+ * that evaluation only has to copy the decoded struct.
+ *
+ * Decoded items point into the bytecode for their strings, so a program
+ * must be freed before the bytecode is unmapped.  The stringlists are
+ * copied on every fetch, as evaluation frees the ones it is given.
+ */
+
+static int program_decode(bc_program_t *prog, bytecode_input_t *bc,
+                          int pos, int istest)
+{
+    struct bc_insn insn;
+    int next;
+
+    if (pos < 0 || pos >= prog->npos) return -1;
+    if (prog->slot[pos])
+        return prog->insns[prog->slot[pos] - 1].next;
+
+    memset(&insn, 0, sizeof(insn));
+    listrec = &insn;
+    listrec_overflow = 0;
+    if (istest)
+        next = bc_test_parse(bc, pos, prog->version, &insn.u.test);
+    else
+        next = bc_action_parse(bc, pos, prog->version, &insn.u.cmd);
+    listrec = NULL;
+
+    if (next < 0 || next > prog->npos || listrec_overflow) {
+        int i;
+
+        for (i = 0; i < insn.nlists; i++) {
+            strarray_t **sl = (strarray_t **) ((char *) &insn.u + insn.lists[i]);
+            free(strarray_takevf(*sl));
+        }
+        return -1;
+    }
+    insn.next = next;
+
+    if (prog->ninsns == prog->ainsns) {
+        prog->ainsns = prog->ainsns ? 2 * prog->ainsns : 32;
+        prog->insns = xrealloc(prog->insns,
+                               prog->ainsns * sizeof(struct bc_insn));
+    }
+    prog->insns[prog->ninsns++] = insn;
+    prog->slot[pos] = prog->ninsns;
+
+    return next;
+}
+
+/* decode the test at pos and any tests nested in it,
+ * return the index after all of them */
+static int program_decode_test(bc_program_t *prog, bytecode_input_t *bc,
+                               int pos)
+{
+    const test_t *test;
+    int next, n;
+
+    next = program_decode(prog, bc, pos, 1);
+    if (next < 0) return -1;
+
+    test = &prog->insns[prog->slot[pos] - 1].u.test;
+    switch (test->type) {
+    case BC_NOT:
+        return program_decode_test(prog, bc, next);
+
+    case BC_ANYOF:
+    case BC_ALLOF:
+    {
+        int ntests = test->u.aa.ntests;
+        int endtests = test->u.aa.endtests;
+
+        for (n = 0; n < ntests && next >= 0; n++)
+            next = program_decode_test(prog, bc, next);
+        return next < 0 ? -1 : endtests;
+    }
+
+    default:
+        return next;
+    }
+}
+
+/* Decode all the actions and tests in a bytecode file.
+ * Returns NULL if the bytecode isn't one we can decode up front,
+ * in which case it is simply parsed as it is evaluated. */
+EXPORTED bc_program_t *bc_program_new(bytecode_input_t *bc, size_t len)
+{
+    bc_program_t *prog;
+    int pos, version;
+
+    if (!bc || len < BYTECODE_MAGIC_LEN + 2 * sizeof(bytecode_input_t))
+        return NULL;
+
+    pos = bc_header_parse(bc, &version, NULL);
+    if (pos < 0 || version < BYTECODE_MIN_VERSION || version > BYTECODE_VERSION)
+        return NULL;
+
+    prog = xzmalloc(sizeof(bc_program_t));
+    prog->version = version;
+    prog->npos = len / sizeof(bytecode_input_t);
+    prog->slot = xzmalloc(prog->npos * sizeof(int));
+
+    while (pos < prog->npos) {
+        const commandlist_t *cmd;
+        int next = program_decode(prog, bc, pos, 0);
+
+        if (next < 0) break;
+
+        cmd = &prog->insns[prog->slot[pos] - 1].u.cmd;
+        if (cmd->type == B_IF) {
+            int testend = cmd->u.i.testend;
+
+            /* the test follows, then the jump over the "then" block */
+            if (program_decode_test(prog, bc, next) < 0) break;
+            next = testend;
+        }
+
+        if (next <= pos) break;
+        pos = next;
+    }
+
+    /* anything we stopped short of is parsed at evaluation time */
+    return prog;
+}
+
+EXPORTED void bc_program_free(bc_program_t **progp)
+{
+    bc_program_t *prog = *progp;
+    int n, i;
+
+    if (!prog) return;
+
+    for (n = 0; n < prog->ninsns; n++) {
+        struct bc_insn *insn = &prog->insns[n];
+
+        for (i = 0; i < insn->nlists; i++) {
+            strarray_t **sl = (strarray_t **) ((char *) &insn->u + insn->lists[i]);
+            free(strarray_takevf(*sl));
+        }
+    }
+
+    free(prog->insns);
+    free(prog->slot);
+    free(prog);
+    *progp = NULL;
+}
+
+/* look up the decoded item at pos, copying it and its stringlists
+ * to 'dest' (of 'size' bytes) */
+static int program_fetch(bc_program_t *prog, int pos, int version,
+                         void *dest, size_t size)
+{
+    const struct bc_insn *insn;
+    int i;
+
+    if (!prog || version != prog->version ||
+        pos < 0 || pos >= prog->npos || !prog->slot[pos])
+        return -1;
+
+    insn = &prog->insns[prog->slot[pos] - 1];
+    memcpy(dest, &insn->u, size);
+
+    for (i = 0; i < insn->nlists; i++) {
+        strarray_t **sl = (strarray_t **) ((char *) dest + insn->lists[i]);
+        strarray_t *copy = strarray_new();
+        int j;
+
+        for (j = 0; j < strarray_size(*sl); j++)
+            strarray_appendm(copy, (char *) strarray_nth(*sl, j));
+        *sl = copy;
+    }
+
+    return insn->next;
+}
+
+/* bc_action_parse(), using the pre-decoded copy if there is one */
+EXPORTED int bc_program_action(bc_program_t *prog, bytecode_input_t *bc,
+                               int pos, int version, commandlist_t *cmd)
+{
+    int next = program_fetch(prog, pos, version, cmd, sizeof(commandlist_t));
+
+    return next >= 0 ? next : bc_action_parse(bc, pos, version, cmd);
+}
+
+/* bc_test_parse(), using the pre-decoded copy if there is one */
+EXPORTED int bc_program_test(bc_program_t *prog, bytecode_input_t *bc,
+                             int pos, int version, test_t *test)
+{
+    int next = program_fetch(prog, pos, version, test, sizeof(test_t));
+
+    return next >= 0 ? next : bc_test_parse(bc, pos, version, test);
+}
@@ -55,4 +55,17 @@ extern int bc_action_parse(bytecode_input_t *bc, int pos, int version,
 extern int bc_test_parse(bytecode_input_t *bc, int pos, int version,
                          test_t *test);
 
+/* a bytecode file with its actions and tests decoded up front */
+typedef struct bc_program bc_program_t;
+
+extern bc_program_t *bc_program_new(bytecode_input_t *bc, size_t len);
+extern void bc_program_free(bc_program_t **progp);
+
+/* as bc_action_parse() and bc_test_parse(), but from 'prog' (if not NULL)
+ * where possible */
+extern int bc_program_action(bc_program_t *prog, bytecode_input_t *bc,
+                             int pos, int version, commandlist_t *cmd);
+extern int bc_program_test(bc_program_t *prog, bytecode_input_t *bc,
+                           int pos, int version, test_t *test);
+
 #endif
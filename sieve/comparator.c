@@ -479,6 +479,157 @@ static int ascii_numeric_cmp(const char *text, size_t tlen, const char *pat)
     }
 }
 
+/*
+ * Matching many :contains keys against the same text, as in
+ *   header :contains "subject" ["key1", "key2", ... ]
+ * is done with an Aho-Corasick automaton over all the keys, so each
+ * text is scanned once rather than once per key.  Children of a node
+ * are kept in a sibling list, as keys are short and fanout is low.
+ */
+struct ac_node {
+    int child;          /* first child, 0 if none */
+    int sibling;        /* next child of our parent, 0 if none */
+    int fail;           /* longest proper suffix which is also a prefix */
+    unsigned char c;
+    unsigned char final;/* some key ends here (or at a suffix of here) */
+};
+
+struct comparator_multi {
+    struct ac_node *nodes;
+    int nnodes;
+    int alloc;
+    int casemap;
+    int always;         /* an empty key matches everything */
+};
+
+static int ac_child(const struct comparator_multi *multi, int node,
+                    unsigned char c)
+{
+    int n;
+
+    for (n = multi->nodes[node].child; n; n = multi->nodes[n].sibling) {
+        if (multi->nodes[n].c == c) return n;
+    }
+
+    return 0;
+}
+
+static int ac_add_child(struct comparator_multi *multi, int node,
+                        unsigned char c)
+{
+    struct ac_node *new;
+
+    if (multi->nnodes == multi->alloc) {
+        multi->alloc *= 2;
+        multi->nodes = xrealloc(multi->nodes,
+                                multi->alloc * sizeof(struct ac_node));
+    }
+
+    new = &multi->nodes[multi->nnodes];
+    memset(new, 0, sizeof(struct ac_node));
+    new->c = c;
+    new->sibling = multi->nodes[node].child;
+    multi->nodes[node].child = multi->nnodes;
+
+    return multi->nnodes++;
+}
+
+EXPORTED comparator_multi_t *comparator_multi_new(comparator_t *comp,
+                                                  const strarray_t *needles)
+{
+    struct comparator_multi *multi;
+    int *queue, head = 0, tail = 0;
+    int n;
+
+    if (comp != &octet_contains && comp != &ascii_casemap_contains)
+        return NULL;
+
+    multi = xzmalloc(sizeof(struct comparator_multi));
+    multi->casemap = (comp == &ascii_casemap_contains);
+    multi->alloc = 64;
+    multi->nodes = xzmalloc(multi->alloc * sizeof(struct ac_node));
+    multi->nnodes = 1;  /* root */
+
+    /* build the trie of all keys */
+    for (n = 0; n < strarray_size(needles); n++) {
+        const unsigned char *p =
+            (const unsigned char *) strarray_nth(needles, n);
+        int node = 0;
+
+        if (!*p) multi->always = 1;
+
+        for (; *p; p++) {
+            unsigned char c = multi->casemap ? toupper(*p) : *p;
+            int next = ac_child(multi, node, c);
+
+            if (!next) next = ac_add_child(multi, node, c);
+            node = next;
+        }
+        multi->nodes[node].final = 1;
+    }
+
+    /* breadth first, link each node to its longest proper suffix
+     * in the trie; the parent's link is always done already */
+    queue = xmalloc(multi->nnodes * sizeof(int));
+    for (n = multi->nodes[0].child; n; n = multi->nodes[n].sibling) {
+        multi->nodes[n].fail = 0;
+        queue[tail++] = n;
+    }
+    while (head < tail) {
+        int node = queue[head++];
+
+        for (n = multi->nodes[node].child; n; n = multi->nodes[n].sibling) {
+            int f = multi->nodes[node].fail;
+            int next;
+
+            while (f && !ac_child(multi, f, multi->nodes[n].c))
+                f = multi->nodes[f].fail;
+            next = ac_child(multi, f, multi->nodes[n].c);
+
+            multi->nodes[n].fail = next;
+            if (multi->nodes[next].final) multi->nodes[n].final = 1;
+            queue[tail++] = n;
+        }
+    }
+    free(queue);
+
+    return multi;
+}
+
+/* returns 1 if any of the keys is contained in text, 0 otherwise */
+EXPORTED int comparator_multi_match(const comparator_multi_t *multi,
+                                    const char *text, size_t tlen)
+{
+    int node = 0;
+    size_t i;
+
+    if (multi->always) return 1;
+
+    for (i = 0; i < tlen; i++) {
+        unsigned char c = text[i];
+        int next;
+
+        if (multi->casemap) c = toupper(c);
+
+        while (!(next = ac_child(multi, node, c)) && node)
+            node = multi->nodes[node].fail;
+        node = next;
+
+        if (multi->nodes[node].final) return 1;
+    }
+
+    return 0;
+}
+
+EXPORTED void comparator_multi_free(comparator_multi_t **multip)
+{
+    if (!*multip) return;
+
+    free((*multip)->nodes);
+    free(*multip);
+    *multip = NULL;
+}
+
 static comparator_t *lookup_rel(int relation)
 {
     comparator_t *ret;
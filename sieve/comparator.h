@@ -70,4 +70,14 @@ typedef int comparator_t(const char *text, size_t tlen, const char *pat,
 comparator_t *lookup_comp(sieve_interp_t *i, int comp, int mode,
                           int relation, void **rock);
 
+/* single pass matcher for a set of :contains keys;
+ * NULL if comp is not a :contains comparator */
+typedef struct comparator_multi comparator_multi_t;
+
+comparator_multi_t *comparator_multi_new(comparator_t *comp,
+                                         const strarray_t *needles);
+int comparator_multi_match(const comparator_multi_t *multi,
+                           const char *text, size_t tlen);
+void comparator_multi_free(comparator_multi_t **multip);
+
 #endif /* COMPARATOR_H */
@@ -54,6 +54,7 @@ struct sieve_interp {
 
     sieve_get_size *getsize;
     sieve_get_header *getheader;
+    sieve_get_header *getheader_decoded;
     sieve_add_header *addheader;
     sieve_delete_header *deleteheader;
     sieve_get_envelope *getenvelope;
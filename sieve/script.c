@@ -66,6 +66,7 @@
 #include "sieve/sieve.h"
 #include "message.h"
 #include "bytecode.h"
+#include "bc_parse.h"
 #include "libconfig.h"
 #include "varlist.h"
 
@@ -160,17 +161,13 @@ static int stub_parse_error(int lineno, const char *msg,
     return SIEVE_OK;
 }
 
-/* Wrapper for sieve_script_parse using a disposable single-use interpreter.
- * Use when you only want to parse or compile, but not execute, a script. */
-EXPORTED int sieve_script_parse_only(FILE *stream, char **out_errors,
-                                     sieve_script_t **out_script)
+/* Build an interpreter with stub callbacks, suitable for parsing and
+ * compiling (but not executing) any number of scripts. */
+EXPORTED sieve_interp_t *sieve_compile_interp_new(void)
 {
     sieve_interp_t *interpreter = NULL;
-    sieve_script_t *script = NULL;
-    struct buf errors = BUF_INITIALIZER;
     int res;
 
-    /* build a single-use interpreter using stub callbacks*/
     interpreter = sieve_interp_alloc(NULL); /* uses xmalloc, never returns NULL */
 
     sieve_register_redirect(interpreter, (sieve_callback *) &stub_generic);
@@ -206,18 +203,32 @@ EXPORTED int sieve_script_parse_only(FILE *stream, char **out_errors,
     res = sieve_register_vacation(interpreter, &stub_vacation);
     if (res != SIEVE_OK) {
         syslog(LOG_ERR, "sieve_register_vacation() returns %d\n", res);
-        goto done;
+        sieve_interp_free(&interpreter);
+        return NULL;
     }
 
     res = sieve_register_duplicate(interpreter, &stub_duplicate);
     if (res != SIEVE_OK) {
         syslog(LOG_ERR, "sieve_register_duplicate() returns %d\n", res);
-        goto done;
+        sieve_interp_free(&interpreter);
+        return NULL;
     }
 
     sieve_register_notify(interpreter, &stub_notify, NULL);
     sieve_register_parse_error(interpreter, &stub_parse_error);
 
+    return interpreter;
+}
+
+/* Parse a script using an interpreter from sieve_compile_interp_new() */
+EXPORTED int sieve_script_parse_interp(sieve_interp_t *interpreter,
+                                       FILE *stream, char **out_errors,
+                                       sieve_script_t **out_script)
+{
+    sieve_script_t *script = NULL;
+    struct buf errors = BUF_INITIALIZER;
+    int res;
+
     buf_appendcstr(&errors, "script errors:\r\n");
     *out_errors = NULL;
 
@@ -236,12 +247,28 @@ EXPORTED int sieve_script_parse_only(FILE *stream, char **out_errors,
         *out_errors = buf_release(&errors);
     }
 
-done:
-    sieve_interp_free(&interpreter);
     buf_free(&errors);
     return res;
 }
 
+/* Wrapper for sieve_script_parse using a disposable single-use interpreter.
+ * Use when you only want to parse or compile, but not execute, a script. */
+EXPORTED int sieve_script_parse_only(FILE *stream, char **out_errors,
+                                     sieve_script_t **out_script)
+{
+    sieve_interp_t *interpreter = sieve_compile_interp_new();
+    int res;
+
+    *out_errors = NULL;
+    if (!interpreter) return SIEVE_FAIL;
+
+    res = sieve_script_parse_interp(interpreter, stream,
+                                    out_errors, out_script);
+
+    sieve_interp_free(&interpreter);
+    return res;
+}
+
 EXPORTED void sieve_script_free(sieve_script_t **s)
 {
     if (*s) {
@@ -432,6 +459,144 @@ static char *sieve_errstr(int code)
 /******************************bytecode functions*****************************
  *****************************************************************************/
 
+/*
+ * A per-process cache of mapped bytecode files, so that a busy lmtpd
+ * delivering to the same users over and over does not open and map
+ * their scripts for every message.  Entries are keyed by path, and
+ * only reused while the file's inode, mtime and size are unchanged.
+ * Entries in use by a loaded script are never evicted.
+ */
+struct bc_cache_entry {
+    char *fname;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+    const char *data;
+    size_t len;
+    bc_program_t *prog;
+    unsigned refcount;
+    unsigned long lastuse;
+    struct bc_cache_entry *next;
+};
+
+static struct bc_cache_entry *bc_cache = NULL;
+static unsigned long bc_cache_clock = 0;
+
+static void bc_cache_free(struct bc_cache_entry *entry)
+{
+    bc_program_free(&entry->prog);
+    map_free(&entry->data, &entry->len);
+    free(entry->fname);
+    free(entry);
+}
+
+/* drop unused entries beyond max, least recently used first */
+static void bc_cache_trim(int max)
+{
+    struct bc_cache_entry *entry, **prevp, **lrup;
+    int count;
+
+    for (;;) {
+        count = 0;
+        lrup = NULL;
+        for (prevp = &bc_cache; (entry = *prevp); prevp = &entry->next) {
+            count++;
+            if (entry->refcount) continue;
+            if (!lrup || entry->lastuse < (*lrup)->lastuse) lrup = prevp;
+        }
+
+        if (count <= max || !lrup) return;
+
+        entry = *lrup;
+        *lrup = entry->next;
+        bc_cache_free(entry);
+    }
+}
+
+static struct bc_cache_entry *bc_cache_get(const char *fname,
+                                           const struct stat *sbuf)
+{
+    struct bc_cache_entry *entry, **prevp;
+    int max = config_getint(IMAPOPT_SIEVE_SCRIPT_CACHE);
+    struct stat fbuf;
+    int fd;
+
+    if (max <= 0) return NULL;
+
+    for (prevp = &bc_cache; (entry = *prevp); prevp = &entry->next) {
+        if (strcmp(entry->fname, fname)) continue;
+
+        if (entry->dev == sbuf->st_dev && entry->ino == sbuf->st_ino &&
+            entry->mtime == sbuf->st_mtime && entry->size == sbuf->st_size) {
+            entry->lastuse = ++bc_cache_clock;
+            entry->refcount++;
+            return entry;
+        }
+
+        /* stale: forget it, but leave the mapping to its current users */
+        if (!entry->refcount) {
+            *prevp = entry->next;
+            bc_cache_free(entry);
+        }
+        else {
+            entry->fname[0] = '\0';
+        }
+        break;
+    }
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1) return NULL;
+    if (fstat(fd, &fbuf) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    entry = xzmalloc(sizeof(struct bc_cache_entry));
+    entry->fname = xstrdup(fname);
+    entry->dev = fbuf.st_dev;
+    entry->ino = fbuf.st_ino;
+    entry->mtime = fbuf.st_mtime;
+    entry->size = fbuf.st_size;
+    map_refresh(fd, 1, &entry->data, &entry->len, fbuf.st_size,
+                fname, "sievescript");
+    close(fd);
+
+    /* decoded once, used by every message the entry is reused for */
+    entry->prog = bc_program_new((bytecode_input_t *) entry->data, entry->len);
+
+    entry->lastuse = ++bc_cache_clock;
+    entry->refcount = 1;
+    entry->next = bc_cache;
+    bc_cache = entry;
+
+    bc_cache_trim(max);
+
+    return entry;
+}
+
+static void bc_cache_release(struct bc_cache_entry *entry)
+{
+    struct bc_cache_entry **prevp;
+
+    assert(entry->refcount);
+    if (--entry->refcount) return;
+
+    /* superseded entries go as soon as nobody uses them */
+    if (!entry->fname[0]) {
+        for (prevp = &bc_cache; *prevp; prevp = &(*prevp)->next) {
+            if (*prevp == entry) {
+                *prevp = entry->next;
+                break;
+            }
+        }
+        bc_cache_free(entry);
+        return;
+    }
+
+    bc_cache_trim(config_getint(IMAPOPT_SIEVE_SCRIPT_CACHE));
+}
+
 /* Load a compiled script */
 EXPORTED int sieve_script_load(const char *fname, sieve_execute_t **ret)
 {
@@ -468,8 +633,27 @@ EXPORTED int sieve_script_load(const char *fname, sieve_execute_t **ret)
     }
 
     if (!bc) {
+        struct bc_cache_entry *cached = bc_cache_get(fname, &sbuf);
         int fd;
 
+        if (cached) {
+            bc = (sieve_bytecode_t *) xzmalloc(sizeof(sieve_bytecode_t));
+
+            bc->fd = -1;
+            bc->inode = cached->ino;
+            bc->data = cached->data;
+            bc->len = cached->len;
+            bc->cached = cached;
+            bc->prog = cached->prog;
+
+            bc->next = ex->bc_list;
+            ex->bc_list = bc;
+
+            ex->bc_cur = bc;
+            *ret = ex;
+            return SIEVE_OK;
+        }
+
         /* new script -- load it */
         fd = open(fname, O_RDONLY);
         if (fd == -1) {
@@ -517,8 +701,13 @@ EXPORTED int sieve_script_unload(sieve_execute_t **s)
 
         /* free each bytecode buffer in the linked list */
         while (bc) {
-            map_free(&(bc->data), &(bc->len));
-            close(bc->fd);
+            if (bc->cached) {
+                bc_cache_release(bc->cached);
+            }
+            else {
+                map_free(&(bc->data), &(bc->len));
+                close(bc->fd);
+            }
             nextbc = bc->next;
             free(bc);
             bc = nextbc;
@@ -72,6 +72,8 @@ struct sieve_bytecode {
     const char *data;
     size_t len;
     int fd;
+    struct bc_cache_entry *cached; /* mapping owned by the script cache */
+    struct bc_program *prog;    /* pre-decoded actions and tests, or NULL */
 
     int is_executing;           /* used to prevent recursive INCLUDEs */
 
@@ -202,6 +202,11 @@ void sieve_register_specialuseexists(sieve_interp_t *interp,
                                      sieve_get_specialuseexists *f);
 void sieve_register_metadata(sieve_interp_t *interp, sieve_get_metadata *f);
 void sieve_register_header(sieve_interp_t *interp, sieve_get_header *f);
+/* optional: like the header callback, but returning the bodies already
+ * MIME-decoded to UTF-8, so that the caller can decode each header once
+ * per message rather than once per test */
+void sieve_register_header_decoded(sieve_interp_t *interp,
+                                   sieve_get_header *f);
 void sieve_register_addheader(sieve_interp_t *interp, sieve_add_header *f);
 void sieve_register_deleteheader(sieve_interp_t *interp, sieve_delete_header *f);
 void sieve_register_fname(sieve_interp_t *interp, sieve_get_fname *f);
@@ -234,6 +239,12 @@ int sieve_script_parse(sieve_interp_t *interp, FILE *script,
 int sieve_script_parse_only(FILE *stream, char **out_errors,
                             sieve_script_t **ret);
 
+/* The same, split so that one stub interpreter can be reused to
+ * compile many scripts */
+sieve_interp_t *sieve_compile_interp_new(void);
+int sieve_script_parse_interp(sieve_interp_t *interp, FILE *stream,
+                              char **out_errors, sieve_script_t **ret);
+
 /* given a path to a bytecode file, load it into the sieve_execute_t */
 int sieve_script_load(const char *fpath, sieve_execute_t **ret);
 
@@ -51,9 +51,17 @@
 #include "libconfig.h"
 #include "xmalloc.h"
 
+#include "bytecode.h"
 #include "script.h"
 #include "util.h"
 #include "assert.h"
+#include "cyr_lock.h"
+#include "hash.h"
+#include "map.h"
+#include "retry.h"
+#include "xsha1.h"
+#include <arpa/inet.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/file.h>
@@ -66,6 +74,221 @@
 #define TIMSIEVE_FAIL -1
 #define TIMSIEVE_OK 0
 
+struct bulk_state {
+    sieve_interp_t *interp;
+    hash_table bytecode;        /* sha1 of script text -> struct buf */
+    int force;
+    unsigned compiled, copied, current, failed;
+};
+
+/* is the bytecode at least as new as the script, and of this version? */
+static int bulk_is_current(const char *bcname, const struct stat *sbuf)
+{
+    struct stat bcbuf;
+    char hdr[BYTECODE_MAGIC_LEN + sizeof(uint32_t)];
+    uint32_t version;
+    int fd, r = 0;
+
+    if (stat(bcname, &bcbuf) || bcbuf.st_mtime < sbuf->st_mtime)
+        return 0;
+
+    fd = open(bcname, O_RDONLY);
+    if (fd < 0) return 0;
+
+    if (read(fd, hdr, sizeof(hdr)) == sizeof(hdr) &&
+        !memcmp(hdr, BYTECODE_MAGIC, BYTECODE_MAGIC_LEN)) {
+        memcpy(&version, hdr + BYTECODE_MAGIC_LEN, sizeof(version));
+        r = (ntohl(version) == BYTECODE_VERSION);
+    }
+
+    close(fd);
+    return r;
+}
+
+/* compile the script open on 'f' into 'fd', keeping a copy in 'out' */
+static int bulk_compile(struct bulk_state *bs, const char *fname,
+                        FILE *f, int fd, struct buf *out)
+{
+    sieve_script_t *s = NULL;
+    bytecode_info_t *bc = NULL;
+    const char *base = NULL;
+    size_t len = 0;
+    struct stat bcbuf;
+    char *err = NULL;
+    int r = 0;
+
+    if (sieve_script_parse_interp(bs->interp, f, &err, &s) != SIEVE_OK) {
+        fprintf(stderr, "%s: unable to parse script: %s\n",
+                fname, err ? err : "");
+        free(err);
+        return -1;
+    }
+
+    if (sieve_generate_bytecode(&bc, s) == -1) {
+        fprintf(stderr, "%s: bytecode generate failed\n", fname);
+        r = -1;
+    }
+    else if (sieve_emit_bytecode(fd, bc) == -1) {
+        fprintf(stderr, "%s: bytecode emit failed\n", fname);
+        r = -1;
+    }
+    else if (fstat(fd, &bcbuf) == -1) {
+        fprintf(stderr, "%s: fstat bytecode: %s\n", fname, strerror(errno));
+        r = -1;
+    }
+    else {
+        map_refresh(fd, 1, &base, &len, bcbuf.st_size, fname, NULL);
+        buf_setmap(out, base, len);
+        map_free(&base, &len);
+    }
+
+    sieve_free_bytecode(&bc);
+    sieve_script_free(&s);
+    return r;
+}
+
+static void bulk_one(struct bulk_state *bs, const char *fname)
+{
+    char *bcname = sieve_getbcfname(fname);
+    char *newname = NULL;
+    char hex[2 * SHA1_DIGEST_LENGTH + 1];
+    unsigned char sha1[SHA1_DIGEST_LENGTH];
+    struct buf text = BUF_INITIALIZER;
+    struct buf *code;
+    struct stat sbuf;
+    const char *base = NULL;
+    size_t len = 0;
+    FILE *f = NULL;
+    int sfd = -1, fd = -1;
+
+    if (!bcname) {
+        fprintf(stderr, "%s: not a .script file\n", fname);
+        bs->failed++;
+        return;
+    }
+
+    sfd = open(fname, O_RDWR);
+    if (sfd < 0 || lock_setlock(sfd, /*excl*/1, /*nb*/0, fname) ||
+        fstat(sfd, &sbuf)) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        bs->failed++;
+        goto done;
+    }
+
+    if (!bs->force && bulk_is_current(bcname, &sbuf)) {
+        bs->current++;
+        goto done;
+    }
+
+    /* identical scripts compile to identical bytecode */
+    map_refresh(sfd, 1, &base, &len, sbuf.st_size, fname, NULL);
+    xsha1((const unsigned char *) base, len, sha1);
+    bin_to_hex(sha1, SHA1_DIGEST_LENGTH, hex, BH_LOWER);
+    buf_setmap(&text, base, len);
+    map_free(&base, &len);
+
+    newname = strconcat(bcname, ".NEW", (char *) NULL);
+    fd = open(newname, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", newname, strerror(errno));
+        bs->failed++;
+        goto done;
+    }
+
+    code = hash_lookup(hex, &bs->bytecode);
+    if (code) {
+        if (retry_write(fd, buf_base(code), buf_len(code)) < 0) {
+            fprintf(stderr, "%s: %s\n", newname, strerror(errno));
+            goto fail;
+        }
+        bs->copied++;
+    }
+    else {
+        f = fmemopen((void *) buf_base(&text), buf_len(&text), "r");
+        if (!f) {
+            fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+            goto fail;
+        }
+
+        code = xzmalloc(sizeof(struct buf));
+        if (bulk_compile(bs, fname, f, fd, code)) {
+            buf_free(code);
+            free(code);
+            goto fail;
+        }
+        hash_insert(hex, code, &bs->bytecode);
+        bs->compiled++;
+    }
+
+    if (fsync(fd) || rename(newname, bcname)) {
+        fprintf(stderr, "%s: %s\n", bcname, strerror(errno));
+        goto fail;
+    }
+
+    goto done;
+
+fail:
+    unlink(newname);
+    bs->failed++;
+
+done:
+    if (f) fclose(f);
+    if (fd >= 0) close(fd);
+    if (sfd >= 0) close(sfd); /* releases the lock */
+    buf_free(&text);
+    free(newname);
+    free(bcname);
+}
+
+static void bulk_free_code(void *data)
+{
+    struct buf *code = data;
+
+    buf_free(code);
+    free(code);
+}
+
+/* compile each named script to its .bc file using one interpreter,
+ * skipping scripts whose bytecode is current and reusing the bytecode
+ * of identical scripts */
+static int bulk_main(int argc, char **argv, int force)
+{
+    struct bulk_state bs;
+    int i;
+
+    memset(&bs, 0, sizeof(bs));
+    bs.force = force;
+    bs.interp = sieve_compile_interp_new();
+    if (!bs.interp) {
+        fprintf(stderr, "unable to build interpreter\n");
+        return 1;
+    }
+    construct_hash_table(&bs.bytecode, 1024, 0);
+
+    if (argc) {
+        for (i = 0; i < argc; i++)
+            bulk_one(&bs, argv[i]);
+    }
+    else {
+        /* one script name per line on stdin */
+        struct buf line = BUF_INITIALIZER;
+
+        while (buf_getline(&line, stdin)) {
+            if (buf_len(&line))
+                bulk_one(&bs, buf_cstring(&line));
+        }
+        buf_free(&line);
+    }
+
+    printf("%u compiled, %u copied, %u current, %u failed\n",
+           bs.compiled, bs.copied, bs.current, bs.failed);
+
+    free_hash_table(&bs.bytecode, bulk_free_code);
+    sieve_interp_free(&bs.interp);
+
+    return bs.failed ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
     FILE *instream;
@@ -73,24 +296,39 @@ int main(int argc, char **argv)
     sieve_script_t *s = NULL;
     bytecode_info_t *bc = NULL;
     int c, fd, usage_error = 0;
+    int bulk = 0, force = 0;
     char *alt_config = NULL;
 
-    while ((c = getopt(argc, argv, "C:")) != EOF)
+    while ((c = getopt(argc, argv, "C:bf")) != EOF)
         switch (c) {
         case 'C': /* alt config file */
             alt_config = optarg;
             break;
+        case 'b': /* bulk mode */
+            bulk = 1;
+            break;
+        case 'f': /* bulk mode: recompile current bytecode too */
+            force = 1;
+            break;
         default:
             usage_error = 1;
             break;
         }
 
-    if (usage_error || (argc - optind) < 2) {
-        fprintf(stderr, "Syntax: %s [-C <altconfig>] <filename> <outputfile>\n",
-               argv[0]);
+    if (force && !bulk) usage_error = 1;
+
+    if (usage_error || (!bulk && (argc - optind) < 2)) {
+        fprintf(stderr, "Syntax: %s [-C <altconfig>] <filename> <outputfile>\n"
+                        "        %s [-C <altconfig>] -b [-f] [<filename>.script...]\n",
+               argv[0], argv[0]);
         exit(1);
     }
 
+    if (bulk) {
+        config_read(alt_config, 0);
+        return bulk_main(argc - optind, argv + optind, force);
+    }
+
     instream = fopen(argv[optind++],"r");
     if(instream == NULL) {
         fprintf(stderr, "Unable to open %s for reading\n", argv[1]);